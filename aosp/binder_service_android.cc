@@ -29,6 +29,7 @@
 using android::binder::Status;
 using android::os::IUpdateEngineCallback;
 using android::os::ParcelFileDescriptor;
+using android::os::UpdatePerformanceSnapshot;
 using std::string;
 using std::vector;
 using update_engine::UpdateEngineStatus;
@@ -265,4 +266,27 @@ Status BinderUpdateEngineAndroidService::triggerPostinstall(
   return Status::ok();
 }
 
+Status BinderUpdateEngineAndroidService::getPerformanceSnapshot(
+    UpdatePerformanceSnapshot* return_value) {
+  Error error;
+  PerformanceSnapshot snapshot;
+  if (!service_delegate_->GetPerformanceSnapshot(&snapshot, &error))
+    return ErrorPtrToStatus(error);
+  return_value->phase = snapshot.phase;
+  return_value->currentBytesPerSecond = snapshot.current_bytes_per_second;
+  return_value->averageBytesPerSecond = snapshot.average_bytes_per_second;
+  return_value->bytesBuffered = snapshot.bytes_buffered;
+  return_value->runningOperations = snapshot.running_operations;
+  return_value->queuedOperations = snapshot.queued_operations;
+  return_value->workerThreads = snapshot.worker_threads;
+  return_value->maxRunningWorkers = snapshot.max_running_workers;
+  return_value->workerUtilization = snapshot.worker_utilization;
+  return_value->estimatedSecondsRemaining =
+      snapshot.estimated_seconds_remaining;
+  return_value->throughputLevel = snapshot.throughput_level;
+  return_value->ioPhase = snapshot.io_phase;
+  return_value->ioBoosted = snapshot.io_boosted;
+  return Status::ok();
+}
+
 }  // namespace chromeos_update_engine
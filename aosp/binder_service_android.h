@@ -28,6 +28,7 @@
 
 #include "android/os/BnUpdateEngine.h"
 #include "android/os/IUpdateEngineCallback.h"
+#include "android/os/UpdatePerformanceSnapshot.h"
 #include "update_engine/aosp/service_delegate_android_interface.h"
 #include "update_engine/common/service_observer_interface.h"
 
@@ -82,6 +83,8 @@ class BinderUpdateEngineAndroidService final
       const android::sp<android::os::IUpdateEngineCallback>& callback) override;
   ::android::binder::Status triggerPostinstall(
       const ::android::String16& partition) override;
+  android::binder::Status getPerformanceSnapshot(
+      android::os::UpdatePerformanceSnapshot* return_value) override;
 
  private:
   // Remove the passed |callback| from the list of registered callbacks. Called
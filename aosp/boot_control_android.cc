@@ -17,6 +17,7 @@
 #include "update_engine/aosp/boot_control_android.h"
 
 #include <memory>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -62,6 +63,8 @@ bool BootControlAndroid::Init() {
   }
 
   LOG(INFO) << "Loaded boot control hal.";
+  num_slots_ = module_->GetNumSlots();
+  current_slot_ = module_->GetCurrentSlot();
 
   dynamic_control_ =
       std::make_unique<DynamicPartitionControlAndroid>(GetCurrentSlot());
@@ -70,11 +73,13 @@ bool BootControlAndroid::Init() {
 }
 
 unsigned int BootControlAndroid::GetNumSlots() const {
-  return module_->GetNumSlots();
+  hal_calls_saved_++;
+  return num_slots_;
 }
 
 BootControlInterface::Slot BootControlAndroid::GetCurrentSlot() const {
-  return module_->GetCurrentSlot();
+  hal_calls_saved_++;
+  return current_slot_;
 }
 
 bool BootControlAndroid::GetPartitionDevice(const std::string& partition_name,
@@ -82,12 +87,18 @@ bool BootControlAndroid::GetPartitionDevice(const std::string& partition_name,
                                             bool not_in_payload,
                                             std::string* device,
                                             bool* is_dynamic) const {
-  return dynamic_control_->GetPartitionDevice(partition_name,
-                                              slot,
-                                              GetCurrentSlot(),
-                                              not_in_payload,
-                                              device,
-                                              is_dynamic);
+  auto partition_dev = GetPartitionDevice(
+      partition_name, slot, GetCurrentSlot(), not_in_payload);
+  if (!partition_dev.has_value()) {
+    return false;
+  }
+  if (device) {
+    *device = std::move(partition_dev->rw_device_path);
+  }
+  if (is_dynamic) {
+    *is_dynamic = partition_dev->is_dynamic;
+  }
+  return true;
 }
 
 bool BootControlAndroid::GetPartitionDevice(const string& partition_name,
@@ -98,17 +109,28 @@ bool BootControlAndroid::GetPartitionDevice(const string& partition_name,
 }
 
 bool BootControlAndroid::IsSlotBootable(Slot slot) const {
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto it = slot_bootable_.find(slot);
+    if (it != slot_bootable_.end()) {
+      hal_calls_saved_++;
+      return it->second;
+    }
+  }
   const auto ret = module_->IsSlotBootable(slot);
   if (!ret.has_value()) {
     LOG(ERROR) << "Unable to determine if slot " << SlotName(slot)
                << " is bootable";
     return false;
   }
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  slot_bootable_[slot] = ret.value();
   return ret.value();
 }
 
 bool BootControlAndroid::MarkSlotUnbootable(Slot slot) {
   const auto ret = module_->MarkSlotUnbootable(slot);
+  InvalidateCache();
   if (!ret.IsOk()) {
     LOG(ERROR) << "Unable to call MarkSlotUnbootable for slot "
                << SlotName(slot) << ": " << ret.errMsg;
@@ -118,7 +140,9 @@ bool BootControlAndroid::MarkSlotUnbootable(Slot slot) {
 }
 
 bool BootControlAndroid::SetActiveBootSlot(Slot slot) {
+  LogCacheStats();
   const auto result = module_->SetActiveBootSlot(slot);
+  InvalidateCache();
   if (!result.IsOk()) {
     LOG(ERROR) << "Unable to call SetActiveBootSlot for slot " << SlotName(slot)
                << ": " << result.errMsg;
@@ -145,6 +169,13 @@ bool BootControlAndroid::MarkBootSuccessfulAsync(
 
 bool BootControlAndroid::IsSlotMarkedSuccessful(
     BootControlInterface::Slot slot) const {
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (slot_marked_successful_.count(slot)) {
+      hal_calls_saved_++;
+      return true;
+    }
+  }
   const auto ret = module_->IsSlotMarkedSuccessful(slot);
   CommandResult result;
   if (!ret.has_value()) {
@@ -152,12 +183,25 @@ bool BootControlAndroid::IsSlotMarkedSuccessful(
                << " is marked successful";
     return false;
   }
+  if (ret.value()) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    slot_marked_successful_.insert(slot);
+  }
   return ret.value();
 }
 
 Slot BootControlAndroid::GetActiveBootSlot() {
   if (module_->GetVersion() >= android::hal::BootControlVersion::BOOTCTL_V1_2) {
-    return module_->GetActiveBootSlot();
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (active_boot_slot_.has_value()) {
+      hal_calls_saved_++;
+      return *active_boot_slot_;
+    }
+    const Slot slot = module_->GetActiveBootSlot();
+    if (slot != kInvalidSlot) {
+      active_boot_slot_ = slot;
+    }
+    return slot;
   }
   LOG(WARNING) << "BootControl module version is lower than 1.2, "
                << __FUNCTION__ << " failed";
@@ -174,7 +218,47 @@ std::optional<PartitionDevice> BootControlAndroid::GetPartitionDevice(
     uint32_t slot,
     uint32_t current_slot,
     bool not_in_payload) const {
-  return dynamic_control_->GetPartitionDevice(
+  const auto key =
+      std::make_tuple(partition_name, slot, current_slot, not_in_payload);
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (devices_generation_ != dynamic_control_->mapping_generation()) {
+      devices_.clear();
+      devices_generation_ = dynamic_control_->mapping_generation();
+    }
+    auto it = devices_.find(key);
+    if (it != devices_.end()) {
+      device_lookups_saved_++;
+      return it->second;
+    }
+  }
+  auto partition_dev = dynamic_control_->GetPartitionDevice(
       partition_name, slot, current_slot, not_in_payload);
+  if (partition_dev.has_value()) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    // The lookup itself maps the target partitions that aren't mapped yet.
+    if (devices_generation_ != dynamic_control_->mapping_generation()) {
+      devices_.clear();
+      devices_generation_ = dynamic_control_->mapping_generation();
+    }
+    devices_[key] = *partition_dev;
+  }
+  return partition_dev;
+}
+
+void BootControlAndroid::InvalidateCache() {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  slot_bootable_.clear();
+  slot_marked_successful_.clear();
+  active_boot_slot_.reset();
+  devices_.clear();
 }
+
+void BootControlAndroid::LogCacheStats() {
+  LOG(INFO) << "Saved " << hal_calls_saved_.exchange(0)
+            << " boot control HAL calls and "
+            << device_lookups_saved_.exchange(0)
+            << " partition device lookups.";
+}
+
 }  // namespace chromeos_update_engine
@@ -17,9 +17,14 @@
 #ifndef UPDATE_ENGINE_AOSP_BOOT_CONTROL_ANDROID_H_
 #define UPDATE_ENGINE_AOSP_BOOT_CONTROL_ANDROID_H_
 
+#include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <tuple>
 
 #include <liblp/builder.h>
 #include <gtest/gtest_prod.h>
@@ -33,6 +38,12 @@ namespace chromeos_update_engine {
 
 // The Android implementation of the BootControlInterface. This implementation
 // uses the libhardware's boot_control HAL to access the bootloader.
+//
+// The answers of the HAL and the partition devices are cached, as they are
+// asked for many times during an update. The cache is invalidated when this
+// class changes the slot flags, and the devices are looked up again whenever
+// the dynamic partitions are mapped or unmapped. Whether a slot is marked
+// successful is only cached once it is, since another process marks it.
 class BootControlAndroid final : public BootControlInterface {
  public:
   BootControlAndroid() = default;
@@ -67,9 +78,32 @@ class BootControlAndroid final : public BootControlInterface {
   DynamicPartitionControlInterface* GetDynamicPartitionControl() override;
 
  private:
+  // Drops the cached slot flags and devices, e.g. after a slot switch.
+  void InvalidateCache();
+
+  // Logs and resets the number of HAL calls and device lookups saved.
+  void LogCacheStats();
+
   std::unique_ptr<android::hal::BootControlClient> module_;
   std::unique_ptr<DynamicPartitionControlAndroid> dynamic_control_;
 
+  // Constant for the boot, read in Init().
+  unsigned int num_slots_{0};
+  Slot current_slot_{kInvalidSlot};
+
+  mutable std::mutex cache_mutex_;
+  mutable std::map<Slot, bool> slot_bootable_;
+  mutable std::set<Slot> slot_marked_successful_;
+  std::optional<Slot> active_boot_slot_;
+  // The devices by partition name, slot, current slot and not_in_payload, for
+  // the |devices_generation_| of the dynamic partition mappings.
+  mutable std::map<std::tuple<std::string, uint32_t, uint32_t, bool>,
+                   PartitionDevice>
+      devices_;
+  mutable uint64_t devices_generation_{0};
+  mutable std::atomic<uint64_t> hal_calls_saved_{0};
+  mutable std::atomic<uint64_t> device_lookups_saved_{0};
+
   friend class BootControlAndroidTest;
   friend class UpdateAttempterAndroidIntegrationTest;
 
@@ -32,6 +32,7 @@
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/io_scheduler.h"
 
 using android::base::GetBoolProperty;
 using android::snapshot::ISnapshotManager;
@@ -47,8 +48,16 @@ constexpr auto kCheckBootCompletedInterval = base::TimeDelta::FromSeconds(2);
 // Interval to check IBootControl::isSlotMarkedSuccessful
 constexpr auto kCheckSlotMarkedSuccessfulInterval =
     base::TimeDelta::FromSeconds(2);
-// Interval to call SnapshotManager::ProcessUpdateState
+// Interval to call SnapshotManager::ProcessUpdateState until the merge rate is
+// known. It's also the longest interval while the merge progresses, so the
+// clients get the merge progress reported at least that often.
 constexpr auto kWaitForMergeInterval = base::TimeDelta::FromSeconds(2);
+constexpr auto kMinWaitForMergeInterval =
+    base::TimeDelta::FromMilliseconds(250);
+// Only a stalled merge, which has no progress to report, is checked less often.
+constexpr auto kMaxWaitForMergeInterval = base::TimeDelta::FromSeconds(30);
+// The block size of the merge throughput reported.
+constexpr uint64_t kMergeBlockSize = 4096;
 
 #ifdef __ANDROID_RECOVERY__
 static constexpr bool kIsRecovery = true;
@@ -77,6 +86,7 @@ CleanupPreviousUpdateAction::~CleanupPreviousUpdateAction() {
 }
 
 void CleanupPreviousUpdateAction::PerformAction() {
+  IoScheduler::GetInstance()->SetPhase(IoPhase::kMergePrep);
   StartActionInternal();
 }
 
@@ -96,6 +106,7 @@ void CleanupPreviousUpdateAction::ActionCompleted(ErrorCode error_code) {
   StopActionInternal();
   ReportMergeStats();
   metadata_device_ = nullptr;
+  IoScheduler::GetInstance()->SetPhase(IoPhase::kNone);
 }
 
 std::string CleanupPreviousUpdateAction::Type() const {
@@ -150,6 +161,9 @@ void CleanupPreviousUpdateAction::StartActionInternal() {
 
   LOG(INFO) << "Starting/resuming CleanupPreviousUpdateAction";
   running_ = true;
+  // The merge rate is measured again, without the time spent suspended.
+  merge_start_percentage_ = -1;
+  wait_for_merge_interval_ = base::TimeDelta();
   // Do nothing on non-VAB device.
   if (!boot_control_->GetDynamicPartitionControl()
            ->GetVirtualAbFeatureFlag()
@@ -293,13 +307,42 @@ void CleanupPreviousUpdateAction::StartMerge() {
   WaitForMergeOrSchedule();
 }
 
+base::TimeDelta CleanupPreviousUpdateAction::GetWaitForMergeInterval(
+    double merged,
+    double remaining,
+    base::TimeDelta elapsed,
+    base::TimeDelta last_interval) {
+  if (merged <= 0 || elapsed <= base::TimeDelta()) {
+    // No progress to go by, back off while the merge stalls.
+    if (last_interval.is_zero()) {
+      return kWaitForMergeInterval;
+    }
+    return std::min(last_interval * 2, kMaxWaitForMergeInterval);
+  }
+  // Check again halfway to the expected end, so the end is noticed soon, but
+  // keep reporting the progress regularly.
+  const auto remaining_time = elapsed * (remaining / merged);
+  return std::clamp(
+      remaining_time / 2, kMinWaitForMergeInterval, kWaitForMergeInterval);
+}
+
 void CleanupPreviousUpdateAction::ScheduleWaitForMerge() {
   TEST_AND_RETURN(running_);
+  const auto now = base::TimeTicks::Now();
+  if (merge_start_percentage_ < 0) {
+    merge_start_percentage_ = merge_percentage_;
+    merge_start_time_ = now;
+  }
+  wait_for_merge_interval_ =
+      GetWaitForMergeInterval(merge_percentage_ - merge_start_percentage_,
+                              100 - merge_percentage_,
+                              now - merge_start_time_,
+                              wait_for_merge_interval_);
   if (!scheduled_task_.PostTask(
           FROM_HERE,
           base::Bind(&CleanupPreviousUpdateAction::WaitForMergeOrSchedule,
                      base::Unretained(this)),
-          kWaitForMergeInterval)) {
+          wait_for_merge_interval_)) {
     CheckTaskScheduled("WaitForMerge");
   }
 }
@@ -392,6 +435,7 @@ void CleanupPreviousUpdateAction::WaitForMergeOrSchedule() {
 bool CleanupPreviousUpdateAction::OnMergePercentageUpdate() {
   double percentage = 0.0;
   snapshot_->GetUpdateState(&percentage);
+  merge_percentage_ = percentage;
   if (delegate_) {
     // libsnapshot uses [0, 100] percentage but update_engine uses [0, 1].
     delegate_->OnCleanupProgressUpdate(percentage / 100);
@@ -517,6 +561,10 @@ void CleanupPreviousUpdateAction::ReportMergeStats() {
 
   auto passed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
       result->merge_time());
+  const uint64_t blocks_per_second =
+      passed_ms.count() > 0 ? report.total_cow_size_bytes() / kMergeBlockSize *
+                                  1000 / passed_ms.count()
+                            : 0;
 
   bool vab_retrofit = boot_control_->GetDynamicPartitionControl()
                           ->GetVirtualAbFeatureFlag()
@@ -546,7 +594,8 @@ void CleanupPreviousUpdateAction::ReportMergeStats() {
             << android::snapshot::UpdateState_Name(report.state()) << " in "
             << passed_ms.count() << "ms (resumed " << report.resume_count()
             << " times), using " << report.cow_file_size()
-            << " bytes of COW image.";
+            << " bytes of COW image, merging " << blocks_per_second
+            << " blocks/s.";
   statsd::stats_write(statsd::SNAPSHOT_MERGE_REPORTED,
                       static_cast<int32_t>(report.state()),
                       static_cast<int64_t>(passed_ms.count()),
@@ -21,6 +21,7 @@
 #include <string>
 #include <string_view>
 
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 #include <libsnapshot/snapshot.h>
 #include <libsnapshot/snapshot_stats.h>
@@ -66,6 +67,15 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
   typedef ActionTraits<CleanupPreviousUpdateAction>::OutputObjectType
       OutputObjectType;
 
+  // Returns how long to wait before checking the merge again, when |merged|
+  // percent were merged in |elapsed| and |remaining| percent are left, and the
+  // last wait was |last_interval|.
+  static base::TimeDelta GetWaitForMergeInterval(
+      double merged,
+      double remaining,
+      base::TimeDelta elapsed,
+      base::TimeDelta last_interval);
+
  private:
   PrefsInterface* prefs_;
   BootControlInterface* boot_control_;
@@ -75,6 +85,12 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
   bool running_{false};
   bool cancel_failed_{false};
   unsigned int last_percentage_{0};
+  // The merge progress, and where and when it was first seen, to schedule
+  // the checks by the merge rate.
+  double merge_percentage_{0};
+  double merge_start_percentage_{-1};
+  base::TimeTicks merge_start_time_;
+  base::TimeDelta wait_for_merge_interval_;
   android::snapshot::ISnapshotMergeStats* merge_stats_;
   ScopedTaskId scheduled_task_;
 
@@ -171,4 +171,33 @@ TEST_F(CleanupPreviousUpdateActionTest, VabSlotNotReady) {
       << "Merge should not be started until slot is marked successful";
 }
 
+TEST(CleanupPreviousUpdateActionIntervalTest, WaitForMergeInterval) {
+  using base::TimeDelta;
+  // Without progress, start at 2s and back off.
+  EXPECT_EQ(TimeDelta::FromSeconds(2),
+            CleanupPreviousUpdateAction::GetWaitForMergeInterval(
+                0, 100, TimeDelta(), TimeDelta()));
+  EXPECT_EQ(TimeDelta::FromSeconds(4),
+            CleanupPreviousUpdateAction::GetWaitForMergeInterval(
+                0, 100, TimeDelta::FromSeconds(2), TimeDelta::FromSeconds(2)));
+  EXPECT_EQ(TimeDelta::FromSeconds(30),
+            CleanupPreviousUpdateAction::GetWaitForMergeInterval(
+                0, 100, TimeDelta::FromSeconds(2), TimeDelta::FromSeconds(20)));
+  // 40% per 10s with 10% left: check again in 1.25s.
+  EXPECT_EQ(TimeDelta::FromMilliseconds(1250),
+            CleanupPreviousUpdateAction::GetWaitForMergeInterval(
+                40, 10, TimeDelta::FromSeconds(10), TimeDelta()));
+  // The progress of long merges is still reported every 2s, even after a
+  // stall, and near the end checked every 250ms.
+  EXPECT_EQ(TimeDelta::FromSeconds(2),
+            CleanupPreviousUpdateAction::GetWaitForMergeInterval(
+                10, 10, TimeDelta::FromSeconds(10), TimeDelta()));
+  EXPECT_EQ(TimeDelta::FromSeconds(2),
+            CleanupPreviousUpdateAction::GetWaitForMergeInterval(
+                1, 99, TimeDelta::FromSeconds(10), TimeDelta::FromSeconds(30)));
+  EXPECT_EQ(TimeDelta::FromMilliseconds(250),
+            CleanupPreviousUpdateAction::GetWaitForMergeInterval(
+                99, 0.01, TimeDelta::FromSeconds(10), TimeDelta()));
+}
+
 }  // namespace chromeos_update_engine
@@ -18,9 +18,13 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -30,9 +34,17 @@
 #include <gflags/gflags.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/cow_write_batcher.h"
+#include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_consumer/snapshot_extent_writer.h"
+#include "update_engine/payload_consumer/vabc_partition_writer.h"
+#include "update_engine/payload_consumer/verity_writer_android.h"
 #include "update_engine/payload_generator/cow_size_estimator.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
 DEFINE_string(partitions,
@@ -47,26 +59,60 @@ DEFINE_string(vabc_compression_param,
               "",
               "Compression parameter for VABC. Default is use what's specified "
               "in OTA package");
+DEFINE_int32(threads,
+             0,
+             "Number of threads compressing the COW blocks, 0 for one per CPU");
+DEFINE_bool(stream,
+            false,
+            "Apply the operations of the payload straight to the COW files "
+            "instead of reading the extracted target images, which are not "
+            "needed then");
+DEFINE_string(source_dir,
+              "",
+              "Directory of the source images, only required with --stream "
+              "for incremental OTAs");
 
 namespace chromeos_update_engine {
 
-bool ProcessPartition(
-    const chromeos_update_engine::DeltaArchiveManifest& manifest,
-    const chromeos_update_engine::PartitionUpdate& partition,
-    const char* image_dir) {
-  base::FilePath img_dir{image_dir};
-  auto target_img = img_dir.Append(partition.partition_name() + ".img");
-  auto output_cow = img_dir.Append(partition.partition_name() + ".cow");
-  FileDescriptorPtr target_img_fd = std::make_shared<EintrSafeFileDescriptor>();
-  if (!target_img_fd->Open(target_img.value().c_str(), O_RDONLY)) {
-    PLOG(ERROR) << "Failed to open " << target_img.value();
-    return false;
+// Writes the same data through two extent writers.
+class TeeExtentWriter : public ExtentWriter {
+ public:
+  TeeExtentWriter(std::unique_ptr<ExtentWriter> first,
+                  std::unique_ptr<ExtentWriter> second)
+      : first_(std::move(first)), second_(std::move(second)) {}
+  ~TeeExtentWriter() override = default;
+
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override {
+    return first_->Init(extents, block_size) &&
+           second_->Init(extents, block_size);
+  }
+  bool Write(const void* bytes, size_t count) override {
+    return first_->Write(bytes, count) && second_->Write(bytes, count);
+  }
+
+ private:
+  std::unique_ptr<ExtentWriter> first_;
+  std::unique_ptr<ExtentWriter> second_;
+};
+
+// The COW version of the snapshots of |manifest|, unless overridden.
+uint32_t GetCowVersion(const DeltaArchiveManifest& manifest) {
+  if (FLAGS_cow_version > 0) {
+    return FLAGS_cow_version;
   }
+  return manifest.dynamic_partition_metadata().cow_version();
+}
+
+std::unique_ptr<android::snapshot::ICowWriter> CreatePartitionCowWriter(
+    const DeltaArchiveManifest& manifest,
+    const PartitionUpdate& partition,
+    const base::FilePath& output_cow) {
   android::base::unique_fd output_fd{
       open(output_cow.value().c_str(), O_RDWR | O_CREAT, 0744)};
   if (output_fd < 0) {
     PLOG(ERROR) << "Failed to open " << output_cow.value();
-    return false;
+    return nullptr;
   }
 
   const auto& dap = manifest.dynamic_partition_metadata();
@@ -80,14 +126,189 @@ bool ProcessPartition(
   if (!FLAGS_vabc_compression_param.empty()) {
     options.compression = FLAGS_vabc_compression_param;
   }
-  auto cow_version = dap.cow_version();
+  // The writer compresses the blocks of a batch on these threads and writes
+  // them out in order.
+  options.num_compress_threads =
+      FLAGS_threads > 0
+          ? FLAGS_threads
+          : std::max(1u, std::thread::hardware_concurrency());
+  const uint32_t cow_version = GetCowVersion(manifest);
   if (FLAGS_cow_version > 0) {
-    cow_version = FLAGS_cow_version;
     LOG(INFO) << "Using user specified COW version " << cow_version;
   }
-  auto cow_writer = android::snapshot::CreateCowWriter(
+  return android::snapshot::CreateCowWriter(
       cow_version, options, std::move(output_fd));
+}
+
+// Writes the verity data of |partition| to |target_fd|, computed from the
+// blocks before it.
+bool WriteVerity(const PartitionUpdate& partition,
+                 const FileDescriptorPtr& target_fd,
+                 const size_t block_size) {
+  if (partition.hash_tree_extent().num_blocks() == 0 &&
+      partition.fec_extent().num_blocks() == 0) {
+    return true;
+  }
+  InstallPlan::Partition install_part;
+  install_part.block_size = block_size;
+  TEST_AND_RETURN_FALSE(install_part.ParseVerityConfig(partition));
+  VerityWriterAndroid writer;
+  TEST_AND_RETURN_FALSE(writer.Init(install_part));
+  const uint64_t data_size =
+      install_part.hash_tree_data_offset + install_part.hash_tree_data_size;
+  brillo::Blob buffer(1024 * 512);
+  for (uint64_t offset = 0; offset < data_size;) {
+    const auto bytes_to_read = static_cast<ssize_t>(
+        std::min<uint64_t>(buffer.size(), data_size - offset));
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        target_fd, buffer.data(), bytes_to_read, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == bytes_to_read);
+    TEST_AND_RETURN_FALSE(writer.Update(offset, buffer.data(), bytes_read));
+    offset += bytes_read;
+  }
+  return writer.Finalize(target_fd.get(), target_fd.get());
+}
+
+// Applies the operations of |partition| with their data in |payload_data|
+// straight to |cow_writer|, the way VABCPartitionWriter does on the device.
+// The target blocks are also written to an unlinked scratch image in
+// |output_dir|, from which the verity data and the blocks no operation writes
+// are computed, as CowDryRun() reads them from the extracted image.
+bool StreamPartition(const DeltaArchiveManifest& manifest,
+                     const PartitionUpdate& partition,
+                     const unsigned char* payload_data,
+                     size_t payload_data_size,
+                     const base::FilePath& output_dir,
+                     android::snapshot::ICowWriter* cow_writer) {
+  const size_t block_size = manifest.block_size();
+  const size_t new_partition_size = partition.new_partition_info().size();
+
+  FileDescriptorPtr source_fd;
+  if (partition.has_old_partition_info()) {
+    if (FLAGS_source_dir.empty()) {
+      LOG(ERROR) << "--source_dir is required to stream the incremental "
+                    "partition "
+                 << partition.partition_name();
+      return false;
+    }
+    const auto source_img = base::FilePath(FLAGS_source_dir)
+                                .Append(partition.partition_name() + ".img");
+    source_fd = std::make_shared<EintrSafeFileDescriptor>();
+    if (!source_fd->Open(source_img.value().c_str(), O_RDONLY)) {
+      PLOG(ERROR) << "Failed to open " << source_img.value();
+      return false;
+    }
+  }
+
+  const auto scratch_img =
+      output_dir.Append(partition.partition_name() + ".stream.img");
+  FileDescriptorPtr target_fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (!target_fd->Open(
+          scratch_img.value().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) {
+    PLOG(ERROR) << "Failed to open " << scratch_img.value();
+    return false;
+  }
+  // The scratch image goes away with its file descriptor, it only takes space
+  // for the blocks written.
+  unlink(scratch_img.value().c_str());
+  TEST_AND_RETURN_FALSE_ERRNO(
+      ftruncate(target_fd->Fd(), new_partition_size) == 0);
+
+  VABCPartitionWriter::WriteMergeSequence(partition.merge_operations(),
+                                          cow_writer);
+  const ExtentRanges copy_blocks =
+      ComputeCopyBlocks(partition.merge_operations());
+  InstallOperationExecutor executor(block_size);
+  CowWriteBatcher batcher(
+      cow_writer, block_size, CowWriteBatcher::kDefaultBatchSize);
+  ExtentRanges visited;
+  for (const auto& op : partition.operations()) {
+    for (const auto& ext : op.dst_extents()) {
+      visited.AddExtent(ext);
+    }
+    const unsigned char* data = nullptr;
+    if (op.data_length() > 0) {
+      TEST_AND_RETURN_FALSE(op.data_offset() + op.data_length() <=
+                            payload_data_size);
+      data = payload_data + op.data_offset();
+    }
+    auto tee_writer = std::make_unique<TeeExtentWriter>(
+        std::make_unique<SnapshotExtentWriter>(&batcher),
+        std::make_unique<DirectExtentWriter>(target_fd));
+    switch (op.type()) {
+      case InstallOperation::ZERO:
+      case InstallOperation::DISCARD:
+        // The scratch image is already zeroed.
+        for (const auto& ext : op.dst_extents()) {
+          cow_writer->AddZeroBlocks(ext.start_block(), ext.num_blocks());
+        }
+        break;
+      case InstallOperation::REPLACE:
+      case InstallOperation::REPLACE_BZ:
+      case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
+        TEST_AND_RETURN_FALSE(
+            executor.ExecuteReplaceOperation(op, std::move(tee_writer), data));
+        break;
+      case InstallOperation::SOURCE_COPY:
+        TEST_AND_RETURN_FALSE(source_fd != nullptr);
+        TEST_AND_RETURN_FALSE(VABCPartitionWriter::ProcessSourceCopyOperation(
+            op,
+            block_size,
+            copy_blocks,
+            source_fd,
+            cow_writer,
+            true,
+            VABCPartitionWriter::UseRangedCopyOps(GetCowVersion(manifest))));
+        TEST_AND_RETURN_FALSE(executor.ExecuteSourceCopyOperation(
+            op, std::make_unique<DirectExtentWriter>(target_fd), source_fd));
+        break;
+      case InstallOperation::PARTITION_COPY:
+        LOG(ERROR) << "PARTITION_COPY operations are not supported.";
+        return false;
+      default:
+        TEST_AND_RETURN_FALSE(source_fd != nullptr);
+        TEST_AND_RETURN_FALSE(executor.ExecuteDiffOperation(
+            op, std::move(tee_writer), source_fd, data, op.data_length()));
+        break;
+    }
+    // Only the raw blocks of this operation may still be queued.
+    TEST_AND_RETURN_FALSE(batcher.Flush());
+    cow_writer->AddLabel(0);
+  }
+
+  TEST_AND_RETURN_FALSE(WriteVerity(partition, target_fd, block_size));
+  TEST_AND_RETURN_FALSE(WriteUnvisitedBlocks(
+      target_fd, visited, block_size, new_partition_size, cow_writer));
+  return true;
+}
+
+bool ProcessPartition(const DeltaArchiveManifest& manifest,
+                      const PartitionUpdate& partition,
+                      const unsigned char* payload_data,
+                      size_t payload_data_size,
+                      const char* image_dir) {
+  base::FilePath img_dir{image_dir};
+  auto target_img = img_dir.Append(partition.partition_name() + ".img");
+  auto output_cow = img_dir.Append(partition.partition_name() + ".cow");
+  auto cow_writer = CreatePartitionCowWriter(manifest, partition, output_cow);
   TEST_AND_RETURN_FALSE(cow_writer);
+  if (FLAGS_stream) {
+    TEST_AND_RETURN_FALSE(StreamPartition(manifest,
+                                          partition,
+                                          payload_data,
+                                          payload_data_size,
+                                          img_dir,
+                                          cow_writer.get()));
+    TEST_AND_RETURN_FALSE(cow_writer->Finalize());
+    return true;
+  }
+  FileDescriptorPtr target_img_fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (!target_img_fd->Open(target_img.value().c_str(), O_RDONLY)) {
+    PLOG(ERROR) << "Failed to open " << target_img.value();
+    return false;
+  }
   TEST_AND_RETURN_FALSE(CowDryRun(nullptr,
                                   target_img_fd,
                                   partition.operations(),
@@ -117,6 +338,7 @@ int main(int argc, char* argv[]) {
 
   if (argc != 3) {
     printf("Usage: %s <payload.bin> <extracted target_file>\n", argv[0]);
+    printf("       %s --stream <payload.bin> <output dir>\n", argv[0]);
     return -1;
   }
   const char* payload_path = argv[1];
@@ -156,11 +378,20 @@ int main(int argc, char* argv[]) {
     return 4;
   }
   chromeos_update_engine::DeltaArchiveManifest manifest;
-  if (!payload_metadata.GetManifest(payload, payload_size, &manifest)) {
+  if (!payload_metadata.GetManifest(payload, payload_size, &manifest) ||
+      !payload_metadata.LoadPartitionOperations(
+          payload, payload_size, &manifest)) {
     LOG(ERROR) << "Failed to parse manifest!";
     return 5;
   }
 
+  const size_t data_begin = payload_metadata.GetMetadataSize() +
+                            payload_metadata.GetMetadataSignatureSize();
+  if (data_begin > static_cast<size_t>(payload_size)) {
+    LOG(ERROR) << "Payload is truncated!";
+    return 5;
+  }
+
   size_t estimated_total_cow_size = 0;
   size_t actual_total_cow_size = 0;
 
@@ -173,7 +404,11 @@ int main(int argc, char* argv[]) {
       continue;
     }
     LOG(INFO) << partition.partition_name();
-    if (!ProcessPartition(manifest, partition, images_dir)) {
+    if (!ProcessPartition(manifest,
+                          partition,
+                          payload + data_begin,
+                          payload_size - data_begin,
+                          images_dir)) {
       return 6;
     }
     base::FilePath img_dir{images_dir};
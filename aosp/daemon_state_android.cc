@@ -24,18 +24,27 @@
 #include "update_engine/common/boot_control_stub.h"
 #include "update_engine/common/hardware.h"
 #include "update_engine/common/prefs.h"
+#include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
 
 bool DaemonStateAndroid::Initialize() {
-  boot_control_ = boot_control::CreateBootControl();
+  ScopedStepTimer total_timer("Initializing the daemon state");
+  {
+    // Waits for the boot control HAL, usually the slowest step.
+    ScopedStepTimer timer("Creating the boot control");
+    boot_control_ = boot_control::CreateBootControl();
+  }
   if (!boot_control_) {
     LOG(WARNING) << "Unable to create BootControl instance, using stub "
                  << "instead. All update attempts will fail.";
     boot_control_.reset(new BootControlStub());
   }
 
-  hardware_ = hardware::CreateHardware();
+  {
+    ScopedStepTimer timer("Creating the hardware");
+    hardware_ = hardware::CreateHardware();
+  }
   if (!hardware_) {
     LOG(ERROR) << "Error initializing the HardwareInterface.";
     return false;
@@ -45,17 +54,22 @@ bool DaemonStateAndroid::Initialize() {
   LOG_IF(INFO, !hardware_->IsOfficialBuild()) << "Booted non-official build.";
 
   // Initialize prefs.
-  base::FilePath non_volatile_path;
-  if (!hardware_->GetNonVolatileDirectory(&non_volatile_path)) {
-    prefs_.reset(new MemoryPrefs());
-    LOG(WARNING)
-        << "Could not get a non-volatile directory, fall back to memory prefs";
-  } else {
-    Prefs* prefs = new Prefs();
-    prefs_.reset(prefs);
-    if (!prefs->Init(non_volatile_path.Append(kPrefsSubDirectory))) {
-      LOG(ERROR) << "Failed to initialize preferences.";
-      return false;
+  {
+    ScopedStepTimer timer("Loading the prefs");
+    base::FilePath non_volatile_path;
+    if (!hardware_->GetNonVolatileDirectory(&non_volatile_path)) {
+      prefs_.reset(new MemoryPrefs());
+      LOG(WARNING) << "Could not get a non-volatile directory, fall back to "
+                   << "memory prefs";
+    } else {
+      Prefs* prefs = new Prefs();
+      prefs_.reset(prefs);
+      // The update and verification progress is written on every checkpoint.
+      if (!prefs->Init(non_volatile_path.Append(kPrefsSubDirectory),
+                       {"update-state-", "verify-"})) {
+        LOG(ERROR) << "Failed to initialize preferences.";
+        return false;
+      }
     }
   }
 
@@ -65,6 +79,7 @@ bool DaemonStateAndroid::Initialize() {
   certificate_checker_->Init();
 
   // Initialize the UpdateAttempter before the UpdateManager.
+  ScopedStepTimer timer("Creating the update attempter");
   update_attempter_.reset(
       new UpdateAttempterAndroid(this,
                                  prefs_.get(),
@@ -78,6 +93,7 @@ bool DaemonStateAndroid::Initialize() {
 bool DaemonStateAndroid::StartUpdater() {
   // The DaemonState in Android is a passive daemon. It will only start applying
   // an update when instructed to do so from the exposed binder API.
+  ScopedStepTimer timer("Starting the updater");
   update_attempter_->Init();
   return true;
 }
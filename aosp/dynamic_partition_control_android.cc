@@ -25,6 +25,7 @@
 #include <set>
 #include <string>
 #include <string_view>
+#include <thread>  // NOLINT(build/c++11) - for std::this_thread::sleep_for
 #include <utility>
 #include <vector>
 
@@ -99,6 +100,8 @@ constexpr std::chrono::milliseconds kMapTimeout{1000};
 // Map timeout for dynamic partitions with snapshots. Since several devices
 // needs to be mapped, this timeout is longer than |kMapTimeout|.
 constexpr std::chrono::milliseconds kMapSnapshotTimeout{10000};
+// How often the device nodes of mapped partitions are looked for.
+constexpr std::chrono::milliseconds kDeviceWaitInterval{5};
 
 DynamicPartitionControlAndroid::~DynamicPartitionControlAndroid() {
   std::set<std::string> mapped = mapped_devices_;
@@ -228,8 +231,15 @@ bool DynamicPartitionControlAndroid::MapPartitionInternal(
     params.timeout_ms = kMapSnapshotTimeout;
     success = snapshot_->MapUpdateSnapshot(params, path);
   } else {
-    params.timeout_ms = kMapTimeout;
+    // The device node is waited for along with the others in
+    // FinishMappingPartitions().
+    params.timeout_ms = defer_device_wait_ ? std::chrono::milliseconds::zero()
+                                           : kMapTimeout;
     success = CreateLogicalPartition(params, path);
+    if (success && defer_device_wait_) {
+      pending_devices_.emplace_back(
+          *path, std::chrono::steady_clock::now() + kMapTimeout);
+    }
   }
 
   if (!success) {
@@ -241,6 +251,7 @@ bool DynamicPartitionControlAndroid::MapPartitionInternal(
             << " to device mapper (force_writable = " << force_writable
             << "); device path at " << *path;
   mapped_devices_.insert(params.device_name);
+  mapping_generation_++;
   return true;
 }
 
@@ -324,11 +335,13 @@ bool DynamicPartitionControlAndroid::UnmapPartitionOnDeviceMapper(
               << " from device mapper.";
   }
   mapped_devices_.erase(device_name);
+  mapping_generation_++;
   return true;
 }
 
 bool DynamicPartitionControlAndroid::UnmapAllPartitions() {
   snapshot_->UnmapAllSnapshots();
+  mapping_generation_++;
   if (mapped_devices_.empty()) {
     return false;
   }
@@ -349,13 +362,39 @@ bool DynamicPartitionControlAndroid::UnmapAllPartitions() {
   return true;
 }
 
+void DynamicPartitionControlAndroid::StartMappingPartitions() {
+  defer_device_wait_ = true;
+}
+
+bool DynamicPartitionControlAndroid::FinishMappingPartitions() {
+  defer_device_wait_ = false;
+  bool success = true;
+  for (const auto& [path, deadline] : pending_devices_) {
+    while (!base::PathExists(base::FilePath(path))) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        LOG(ERROR) << "Timed out waiting for " << path;
+        success = false;
+        break;
+      }
+      std::this_thread::sleep_for(kDeviceWaitInterval);
+    }
+  }
+  LOG_IF(INFO, !pending_devices_.empty())
+      << "Waited for the devices of " << pending_devices_.size()
+      << " mapped partitions.";
+  pending_devices_.clear();
+  return success;
+}
+
 void DynamicPartitionControlAndroid::Cleanup() {
+  pending_devices_.clear();
   std::set<std::string> mapped = mapped_devices_;
   LOG(INFO) << "Destroying [" << Join(mapped, ", ") << "] from device mapper";
   for (const auto& device_name : mapped) {
     ignore_result(UnmapPartitionOnDeviceMapper(device_name));
   }
   LOG(INFO) << "UnmapAllPartitions done";
+  mapping_generation_++;
   metadata_device_.reset();
   if (GetVirtualAbFeatureFlag().IsEnabled()) {
     snapshot_ = SnapshotManager::New();
@@ -492,6 +531,7 @@ bool DynamicPartitionControlAndroid::PreparePartitionsForUpdate(
     bool update,
     uint64_t* required_size,
     ErrorCode* error) {
+  mapping_generation_++;
   source_slot_ = source_slot;
   target_slot_ = target_slot;
   if (required_size != nullptr) {
@@ -1123,6 +1163,7 @@ bool DynamicPartitionControlAndroid::UpdatePartitionMetadata(
 }
 
 bool DynamicPartitionControlAndroid::FinishUpdate(bool powerwash_required) {
+  mapping_generation_++;
   if (ExpectMetadataMounted()) {
     if (snapshot_->GetUpdateState() == UpdateState::Initiated) {
       LOG(INFO) << "Snapshot writes are done.";
@@ -1360,6 +1401,7 @@ bool DynamicPartitionControlAndroid::ResetUpdate(PrefsInterface* prefs) {
   for (auto& list : dynamic_partition_list_) {
     list.clear();
   }
+  mapping_generation_++;
 
   LOG(INFO) << __func__ << " resetting update state and deleting snapshots.";
   TEST_AND_RETURN_FALSE(prefs != nullptr);
@@ -1531,6 +1573,7 @@ std::optional<base::FilePath> DynamicPartitionControlAndroid::GetSuperDevice() {
 }
 
 bool DynamicPartitionControlAndroid::MapAllPartitions() {
+  mapping_generation_++;
   return snapshot_->MapAllSnapshots(kMapSnapshotTimeout);
 }
 
@@ -18,10 +18,13 @@
 #define UPDATE_ENGINE_AOSP_DYNAMIC_PARTITION_CONTROL_ANDROID_H_
 
 #include <array>
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11) - using libsnapshot / liblp API
 #include <memory>
 #include <set>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include <base/files/file_util.h>
@@ -114,6 +117,8 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
 
   bool MapAllPartitions() override;
   bool UnmapAllPartitions() override;
+  void StartMappingPartitions() override;
+  bool FinishMappingPartitions() override;
 
   bool IsDynamicPartition(const std::string& part_name, uint32_t slot) override;
 
@@ -121,6 +126,11 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
 
   std::optional<base::FilePath> GetSuperDevice();
 
+  // Changes whenever partitions are mapped or unmapped, or the update state
+  // that GetPartitionDevice() depends on changes, so that callers caching the
+  // devices know when to look them up again.
+  uint64_t mapping_generation() const { return mapping_generation_; }
+
  protected:
   // These functions are exposed for testing.
 
@@ -341,6 +351,12 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
   std::string GetDeviceName(std::string partition_name, uint32_t slot) const;
 
   std::set<std::string> mapped_devices_;
+  std::atomic<uint64_t> mapping_generation_{0};
+  // Whether logical partitions are mapped without waiting for their device
+  // nodes, and the nodes to wait for with their deadlines.
+  bool defer_device_wait_{false};
+  std::vector<std::pair<std::string, std::chrono::steady_clock::time_point>>
+      pending_devices_;
   const FeatureFlag dynamic_partitions_;
   const FeatureFlag virtual_ab_;
   const FeatureFlag virtual_ab_compression_;
@@ -747,6 +747,24 @@ TEST_F(DynamicPartitionControlAndroidTest, SimulatedSecondUpdate) {
                                           {"deleted", 64_MiB}}));
 }
 
+// Devices cached by the caller must be looked up again after preparing the
+// partitions of an update.
+TEST_F(DynamicPartitionControlAndroidTest, PrepareChangesMappingGeneration) {
+  SetSlots({0, 1});
+
+  SetMetadata(source(), update_sizes_0());
+  SetMetadata(target(), update_sizes_0());
+  ExpectStoreMetadata(update_sizes_1());
+  ExpectUnmap({"grown_b", "shrunk_b", "same_b", "added_b"});
+
+  const uint64_t generation = dynamicControl().mapping_generation();
+  ASSERT_TRUE(PreparePartitionsForUpdate({{"grown", 3_GiB},
+                                          {"shrunk", 150_MiB},
+                                          {"same", 100_MiB},
+                                          {"added", 150_MiB}}));
+  EXPECT_NE(generation, dynamicControl().mapping_generation());
+}
+
 TEST_F(DynamicPartitionControlAndroidTest, ApplyingToCurrentSlot) {
   SetSlots({1, 1});
   ASSERT_FALSE(PreparePartitionsForUpdate({}))
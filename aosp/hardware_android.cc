@@ -18,14 +18,19 @@
 
 #include <sys/types.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <string_view>
 
 #include <android/sysprop/GkiProperties.sysprop.h>
+#include <android-base/parsebool.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
+#include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
 #include <base/strings/string_number_conversions.h>
+#include <base/strings/string_util.h>
 #include <bootloader_message/bootloader_message.h>
 #include <fstab/fstab.h>
 #include <libavb/libavb.h>
@@ -40,9 +45,9 @@
 #include <android/sysprop/OtaProperties.sysprop.h>
 #endif
 
-using android::base::GetBoolProperty;
-using android::base::GetIntProperty;
 using android::base::GetProperty;
+using android::base::ParseBool;
+using android::base::ParseBoolResult;
 using std::string;
 
 namespace chromeos_update_engine {
@@ -57,9 +62,36 @@ const char kPropBootHardwareSKU[] = "ro.boot.hardware.sku";
 const char kPropBootRevision[] = "ro.boot.revision";
 const char kPropBuildDateUTC[] = "ro.build.date.utc";
 
-string GetPartitionBuildDate(const string& partition_name) {
-  return android::base::GetProperty("ro." + partition_name + ".build.date.utc",
-                                    "");
+// Where the power supplies, backlights and thermal zones are listed.
+const char kSysfsClassDir[] = "/sys/class";
+
+// Calls |callback| with the path of every entry of the sysfs class |name|.
+template <typename Callback>
+void ForEachSysfsClassEntry(const string& name, Callback callback) {
+  base::FileEnumerator entries(base::FilePath(kSysfsClassDir).Append(name),
+                               false /* recursive */,
+                               base::FileEnumerator::DIRECTORIES |
+                                   base::FileEnumerator::SHOW_SYM_LINKS);
+  for (base::FilePath entry = entries.Next(); !entry.empty();
+       entry = entries.Next()) {
+    callback(entry);
+  }
+}
+
+// Returns the trimmed content of the sysfs attribute |path|, or an empty string
+// if it can't be read.
+string ReadSysfsAttribute(const base::FilePath& path) {
+  string value;
+  if (!base::ReadFileToString(path, &value)) {
+    return "";
+  }
+  return string(base::TrimWhitespaceASCII(value, base::TRIM_ALL));
+}
+
+int ReadSysfsIntAttribute(const base::FilePath& path, int default_value) {
+  int value = 0;
+  return base::StringToInt(ReadSysfsAttribute(path), &value) ? value
+                                                             : default_value;
 }
 
 ErrorCode IsTimestampNewerLogged(const std::string& partition_name,
@@ -142,7 +174,7 @@ bool HardwareAndroid::IsOfficialBuild() const {
   //
   // In case of a non-bool value, we take the most restrictive option and
   // assume we are in an official-build.
-  return GetBoolProperty("ro.secure", true);
+  return GetReadOnlyBoolProperty("ro.secure", true);
 }
 
 bool HardwareAndroid::IsNormalBootMode() const {
@@ -150,7 +182,7 @@ bool HardwareAndroid::IsNormalBootMode() const {
   // update_engine will allow extra developers options, such as providing a
   // different update URL. In case of error, we assume the build is in
   // normal-mode.
-  return !GetBoolProperty("ro.debuggable", false);
+  return !GetReadOnlyBoolProperty("ro.debuggable", false);
 }
 
 bool HardwareAndroid::AreDevFeaturesEnabled() const {
@@ -170,9 +202,9 @@ bool HardwareAndroid::IsOOBEComplete(base::Time* out_time_of_oobe) const {
 }
 
 string HardwareAndroid::GetHardwareClass() const {
-  auto manufacturer = GetProperty(kPropProductManufacturer, "");
-  auto sku = GetProperty(kPropBootHardwareSKU, "");
-  auto revision = GetProperty(kPropBootRevision, "");
+  auto manufacturer = GetReadOnlyProperty(kPropProductManufacturer, "");
+  auto sku = GetReadOnlyProperty(kPropBootHardwareSKU, "");
+  auto revision = GetReadOnlyProperty(kPropBootRevision, "");
 
   return manufacturer + ":" + sku + ":" + revision;
 }
@@ -249,14 +281,18 @@ bool HardwareAndroid::GetPowerwashSafeDirectory(base::FilePath* path) const {
 }
 
 int64_t HardwareAndroid::GetBuildTimestamp() const {
-  return GetIntProperty<int64_t>(kPropBuildDateUTC, 0);
+  int64_t timestamp = 0;
+  return android::base::ParseInt(GetReadOnlyProperty(kPropBuildDateUTC, ""),
+                                 &timestamp)
+             ? timestamp
+             : 0;
 }
 
 // Returns true if the device runs an userdebug build, and explicitly allows OTA
 // downgrade.
 bool HardwareAndroid::AllowDowngrade() const {
-  return GetBoolProperty("ro.ota.allow_downgrade", false) &&
-         GetBoolProperty("ro.debuggable", false);
+  return GetReadOnlyBoolProperty("ro.ota.allow_downgrade", false) &&
+         GetReadOnlyBoolProperty("ro.debuggable", false);
 }
 
 bool HardwareAndroid::GetFirstActiveOmahaPingSent() const {
@@ -283,9 +319,12 @@ void HardwareAndroid::SetVbmetaDigestForInactiveSlot(bool reset) {
   if constexpr (constants::kIsRecovery) {
     return;
   }
+  // Called as the update switches the slots, or stops switching them.
+  LOG(INFO) << "Saved " << property_reads_saved_.exchange(0)
+            << " read-only property reads.";
 
-  if (android::base::GetProperty("ro.boot.avb_version", "").empty() &&
-      android::base::GetProperty("ro.boot.vbmeta.avb_version", "").empty()) {
+  if (GetReadOnlyProperty("ro.boot.avb_version", "").empty() &&
+      GetReadOnlyProperty("ro.boot.vbmeta.avb_version", "").empty()) {
     LOG(INFO) << "Device doesn't use avb, skipping setting vbmeta digest";
     return;
   }
@@ -303,6 +342,15 @@ void HardwareAndroid::SetVbmetaDigestForInactiveSlot(bool reset) {
   SetVbmetaDigestProp(digest);
 }
 
+string HardwareAndroid::GetVbmetaDigestForRunningSlot() const {
+  // A disabled or logging dm-verity lets the partitions change, e.g. after
+  // "adb remount".
+  if (GetReadOnlyProperty("ro.boot.veritymode", "") != "enforcing") {
+    return "";
+  }
+  return GetReadOnlyProperty("ro.boot.vbmeta.digest", "");
+}
+
 string HardwareAndroid::GetVersionForLogging(
     const string& partition_name) const {
   if (partition_name == "boot") {
@@ -370,4 +418,70 @@ const char* HardwareAndroid::GetPartitionMountOptions(
   }
 }
 
+DeviceConditions HardwareAndroid::GetDeviceConditions() const {
+  DeviceConditions conditions;
+  ForEachSysfsClassEntry("power_supply", [&](const base::FilePath& supply) {
+    const string status = ReadSysfsAttribute(supply.Append("status"));
+    conditions.charging =
+        conditions.charging || status == "Charging" || status == "Full";
+    if (ReadSysfsAttribute(supply.Append("type")) == "Battery") {
+      conditions.battery_percent =
+          ReadSysfsIntAttribute(supply.Append("capacity"), -1);
+    }
+  });
+  // Without a backlight the screen state is unknown, assume it is on.
+  bool has_backlight = false;
+  bool screen_on = false;
+  ForEachSysfsClassEntry("backlight", [&](const base::FilePath& backlight) {
+    has_backlight = true;
+    screen_on = screen_on ||
+                ReadSysfsIntAttribute(backlight.Append("brightness"), 0) > 0;
+  });
+  conditions.screen_on = !has_backlight || screen_on;
+  ForEachSysfsClassEntry("thermal", [&](const base::FilePath& zone) {
+    if (base::StartsWith(zone.BaseName().value(),
+                         "thermal_zone",
+                         base::CompareCase::SENSITIVE)) {
+      conditions.max_temp = std::max(
+          conditions.max_temp, ReadSysfsIntAttribute(zone.Append("temp"), 0));
+    }
+  });
+  return conditions;
+}
+
+string HardwareAndroid::GetReadOnlyProperty(const string& name,
+                                            const string& default_value) const {
+  std::lock_guard<std::mutex> lock(properties_mutex_);
+  auto it = properties_.find(name);
+  if (it != properties_.end()) {
+    property_reads_saved_++;
+    return it->second;
+  }
+  string value = GetProperty(name, "");
+  // Not cached, an unset property may still be set later during the boot.
+  if (value.empty()) {
+    return default_value;
+  }
+  properties_[name] = value;
+  return value;
+}
+
+bool HardwareAndroid::GetReadOnlyBoolProperty(const string& name,
+                                              bool default_value) const {
+  switch (ParseBool(GetReadOnlyProperty(name, ""))) {
+    case ParseBoolResult::kTrue:
+      return true;
+    case ParseBoolResult::kFalse:
+      return false;
+    case ParseBoolResult::kError:
+      break;
+  }
+  return default_value;
+}
+
+string HardwareAndroid::GetPartitionBuildDate(
+    const string& partition_name) const {
+  return GetReadOnlyProperty("ro." + partition_name + ".build.date.utc", "");
+}
+
 }  // namespace chromeos_update_engine
@@ -17,6 +17,9 @@
 #ifndef UPDATE_ENGINE_AOSP_HARDWARE_ANDROID_H_
 #define UPDATE_ENGINE_AOSP_HARDWARE_ANDROID_H_
 
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <string>
 
 #include <android-base/macros.h>
@@ -57,6 +60,7 @@ class HardwareAndroid : public HardwareInterface {
   bool SetFirstActiveOmahaPingSent() override;
   void SetWarmReset(bool warm_reset) override;
   void SetVbmetaDigestForInactiveSlot(bool reset) override;
+  std::string GetVbmetaDigestForRunningSlot() const override;
   [[nodiscard]] std::string GetVersionForLogging(
       const std::string& partition_name) const override;
   [[nodiscard]] ErrorCode IsPartitionUpdateValid(
@@ -64,8 +68,22 @@ class HardwareAndroid : public HardwareInterface {
       const std::string& new_version) const override;
   [[nodiscard]] const char* GetPartitionMountOptions(
       const std::string& partition_name) const override;
+  DeviceConditions GetDeviceConditions() const override;
 
  private:
+  // Returns the read-only property |name|, or |default_value| if it isn't set.
+  // The read-only properties are set once per boot, so they are only read from
+  // the property service the first time.
+  std::string GetReadOnlyProperty(const std::string& name,
+                                  const std::string& default_value) const;
+  bool GetReadOnlyBoolProperty(const std::string& name,
+                               bool default_value) const;
+  std::string GetPartitionBuildDate(const std::string& partition_name) const;
+
+  mutable std::mutex properties_mutex_;
+  mutable std::map<std::string, std::string> properties_;
+  mutable std::atomic<uint64_t> property_reads_saved_{0};
+
   DISALLOW_COPY_AND_ASSIGN(HardwareAndroid);
 };
 
@@ -148,13 +148,17 @@ void MetricsReporterAndroid::ReportUpdateAttemptMetrics(
 
 void MetricsReporterAndroid::ReportUpdateAttemptDownloadMetrics(
     int64_t payload_bytes_downloaded,
-    int64_t /* payload_download_speed_bps */,
+    int64_t payload_download_speed_bps,
     DownloadSource /* download_source */,
     metrics::DownloadErrorCode /* payload_download_error_code */,
     metrics::ConnectionType /* connection_type */) {
   // TODO(xunchang) add statsd reporting
   LOG(INFO) << "Current update attempt downloads "
             << payload_bytes_downloaded / kNumBytesInOneMiB << " bytes data";
+  if (payload_download_speed_bps > 0) {
+    LOG(INFO) << "Estimated download throughput: "
+              << payload_download_speed_bps / 1024 << " KiB/s";
+  }
 }
 
 void MetricsReporterAndroid::ReportSuccessfulUpdateMetrics(
@@ -186,6 +190,110 @@ void MetricsReporterAndroid::ReportSuccessfulUpdateMetrics(
                       IsFECEnabled(install_plan_));
 }
 
+void MetricsReporterAndroid::ReportCheckpointMetrics(
+    int num_checkpoints,
+    base::TimeDelta total_duration,
+    base::TimeDelta max_duration) {
+  LOG(INFO) << "Current update attempt wrote " << num_checkpoints
+            << " checkpoints in " << total_duration.InMilliseconds()
+            << " ms, the slowest took " << max_duration.InMilliseconds()
+            << " ms";
+}
+
+void MetricsReporterAndroid::ReportDownloadTimingMetrics(
+    int num_requests,
+    base::TimeDelta name_lookup,
+    base::TimeDelta connect,
+    base::TimeDelta tls_handshake,
+    base::TimeDelta first_byte,
+    int64_t p50_bytes_per_second,
+    int64_t p95_bytes_per_second,
+    int64_t slowest_bytes_per_second) {
+  LOG(INFO) << "Current update attempt made " << num_requests
+            << " download requests, on average name lookup took "
+            << name_lookup.InMilliseconds() << " ms, connecting "
+            << connect.InMilliseconds() << " ms, the TLS handshake "
+            << tls_handshake.InMilliseconds() << " ms and the first byte "
+            << first_byte.InMilliseconds() << " ms. The median request got "
+            << p50_bytes_per_second / 1024 << " KiB/s, 95% of them at least "
+            << p95_bytes_per_second / 1024 << " KiB/s and the slowest "
+            << slowest_bytes_per_second / 1024 << " KiB/s";
+}
+
+void MetricsReporterAndroid::ReportInstallOperationMetrics(
+    const std::string& partition_name,
+    const std::string& operation_type,
+    int num_operations,
+    base::TimeDelta total_duration,
+    base::TimeDelta read_duration,
+    base::TimeDelta write_duration,
+    int64_t bytes_per_second) {
+  LOG(INFO) << "Applied " << num_operations << " " << operation_type
+            << " operations to " << partition_name << " in "
+            << total_duration.InMilliseconds() << " ms, reading took "
+            << read_duration.InMilliseconds() << " ms, writing took "
+            << write_duration.InMilliseconds() << " ms, writing "
+            << bytes_per_second / 1024 << " KiB/s";
+}
+
+void MetricsReporterAndroid::ReportResourceUsageMetrics(
+    int64_t peak_rss_bytes,
+    base::TimeDelta download_cpu_time,
+    base::TimeDelta verify_cpu_time,
+    base::TimeDelta postinstall_cpu_time,
+    int num_fsyncs,
+    base::TimeDelta fsync_duration) {
+  LOG(INFO) << "Current update attempt peaked at "
+            << peak_rss_bytes / 1024 / 1024 << " MiB of resident memory, used "
+            << download_cpu_time.InMilliseconds()
+            << " ms of CPU downloading and applying the payload, "
+            << verify_cpu_time.InMilliseconds() << " ms verifying and "
+            << postinstall_cpu_time.InMilliseconds()
+            << " ms running postinstall, and synced " << num_fsyncs
+            << " times in " << fsync_duration.InMilliseconds() << " ms";
+}
+
+void MetricsReporterAndroid::ReportVerificationMetrics(
+    int64_t verify_bytes_per_second, int num_fec_fallbacks) {
+  LOG(INFO) << "Current update attempt verified "
+            << verify_bytes_per_second / 1024 << " KiB/s of partitions, "
+            << num_fec_fallbacks
+            << " operations read their source with error correction";
+}
+
+void MetricsReporterAndroid::ReportMemoryUsageMetrics(
+    int64_t peak_bytes,
+    int64_t manifest_peak_bytes,
+    int64_t download_buffer_peak_bytes,
+    int64_t operations_peak_bytes,
+    int64_t verifier_peak_bytes,
+    int64_t cow_writer_peak_bytes,
+    int num_soft_limit_hits) {
+  constexpr int64_t kMiB = 1024 * 1024;
+  LOG(INFO) << "Current update attempt buffers peaked at "
+            << peak_bytes / kMiB << " MiB: manifest "
+            << manifest_peak_bytes / kMiB << " MiB, download buffer "
+            << download_buffer_peak_bytes / kMiB << " MiB, operations "
+            << operations_peak_bytes / kMiB << " MiB, verifier "
+            << verifier_peak_bytes / kMiB << " MiB, COW writer "
+            << cow_writer_peak_bytes / kMiB << " MiB, over the soft limit "
+            << num_soft_limit_hits << " times";
+}
+
+void MetricsReporterAndroid::ReportThroughputGovernorMetrics(
+    int num_level_changes,
+    base::TimeDelta full_duration,
+    base::TimeDelta normal_duration,
+    base::TimeDelta reduced_duration,
+    base::TimeDelta minimal_duration) {
+  LOG(INFO) << "Current update attempt ran " << full_duration.InSeconds()
+            << " s at the full throughput level, " << normal_duration.InSeconds()
+            << " s at normal, " << reduced_duration.InSeconds()
+            << " s at reduced and " << minimal_duration.InSeconds()
+            << " s at minimal, changing level " << num_level_changes
+            << " times";
+}
+
 void MetricsReporterAndroid::ReportAbnormallyTerminatedUpdateAttemptMetrics() {
   int attempt_result =
       static_cast<int>(metrics::AttemptResult::kAbnormalTermination);
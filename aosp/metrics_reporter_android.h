@@ -63,6 +63,54 @@ class MetricsReporterAndroid : public MetricsReporterInterface {
       metrics::DownloadErrorCode payload_download_error_code,
       metrics::ConnectionType connection_type) override;
 
+  // The performance metrics from here to ReportThroughputGovernorMetrics()
+  // have no statsd atoms, they are only logged for the bugreports.
+  void ReportCheckpointMetrics(int num_checkpoints,
+                               base::TimeDelta total_duration,
+                               base::TimeDelta max_duration) override;
+
+  void ReportDownloadTimingMetrics(int num_requests,
+                                   base::TimeDelta name_lookup,
+                                   base::TimeDelta connect,
+                                   base::TimeDelta tls_handshake,
+                                   base::TimeDelta first_byte,
+                                   int64_t p50_bytes_per_second,
+                                   int64_t p95_bytes_per_second,
+                                   int64_t slowest_bytes_per_second) override;
+
+  void ReportInstallOperationMetrics(const std::string& partition_name,
+                                     const std::string& operation_type,
+                                     int num_operations,
+                                     base::TimeDelta total_duration,
+                                     base::TimeDelta read_duration,
+                                     base::TimeDelta write_duration,
+                                     int64_t bytes_per_second) override;
+
+  void ReportResourceUsageMetrics(int64_t peak_rss_bytes,
+                                  base::TimeDelta download_cpu_time,
+                                  base::TimeDelta verify_cpu_time,
+                                  base::TimeDelta postinstall_cpu_time,
+                                  int num_fsyncs,
+                                  base::TimeDelta fsync_duration) override;
+
+  void ReportVerificationMetrics(int64_t verify_bytes_per_second,
+                                 int num_fec_fallbacks) override;
+
+  void ReportMemoryUsageMetrics(int64_t peak_bytes,
+                                int64_t manifest_peak_bytes,
+                                int64_t download_buffer_peak_bytes,
+                                int64_t operations_peak_bytes,
+                                int64_t verifier_peak_bytes,
+                                int64_t cow_writer_peak_bytes,
+                                int num_soft_limit_hits) override;
+
+  void ReportThroughputGovernorMetrics(
+      int num_level_changes,
+      base::TimeDelta full_duration,
+      base::TimeDelta normal_duration,
+      base::TimeDelta reduced_duration,
+      base::TimeDelta minimal_duration) override;
+
   void ReportAbnormallyTerminatedUpdateAttemptMetrics() override;
 
   void ReportSuccessfulUpdateMetrics(
@@ -14,20 +14,30 @@
 // limitations under the License.
 //
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
-#include <future>
 #include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <base/files/file_path.h>
 #include <gflags/gflags.h>
+#include <sparse/sparse.h>
 #include <unistd.h>
 #include <xz.h>
 
@@ -35,7 +45,9 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/verity_writer_android.h"
 #include "update_engine/update_metadata.pb.h"
@@ -55,6 +67,13 @@ DEFINE_string(partitions,
               "Comma separated list of partitions to extract, leave empty for "
               "extracting all partitions");
 DEFINE_bool(single_thread, false, "Limit extraction to a single thread");
+DEFINE_bool(sparse,
+            false,
+            "Write Android sparse images, where the blocks of zeros take no "
+            "space");
+DEFINE_int32(jobs,
+             0,
+             "Number of threads extracting the partitions, 0 for one per CPU");
 
 using chromeos_update_engine::DeltaArchiveManifest;
 using chromeos_update_engine::PayloadMetadata;
@@ -95,97 +114,562 @@ void WriteVerity(const PartitionUpdate& partition,
   return;
 }
 
-bool ExtractImageFromPartition(const DeltaArchiveManifest& manifest,
-                               const PartitionUpdate& partition,
-                               const size_t data_begin,
-                               int payload_fd,
-                               std::string_view input_dir,
-                               std::string_view output_dir) {
-  InstallOperationExecutor executor(manifest.block_size());
+// Hashes an image and feeds its verity writer in order while the operations
+// write it, so that the extracted image is not read back. The writes past the
+// next offset to hash are kept until the writes before them arrive. Past
+// kMaxPendingBytes kept, or when writes overlap, the image is read back once
+// extracted instead.
+class ImageHasher {
+ public:
+  ImageHasher(const PartitionUpdate& partition,
+              size_t block_size,
+              FileDescriptorPtr fd);
+
+  // Records the |size| bytes of |data| written at |offset| of the image. May be
+  // called from any thread.
+  void Written(uint64_t offset, const uint8_t* data, size_t size);
+
+  // Records the |size| bytes at |offset| of the image written without going
+  // through memory, such as punched holes and ranges copied by the kernel,
+  // which are read back from the image to hash them. May be called from any
+  // thread.
+  void WrittenInPlace(uint64_t offset, uint64_t size);
+
+  // Whether all the writes so far could be followed.
+  bool streaming() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return streaming_;
+  }
+
+  // Once all the operations are applied, hashes the parts of the image that no
+  // operation wrote, writes the verity data and stores the hash of the whole
+  // image in |hash|.
+  bool Finish(brillo::Blob* hash);
+
+ private:
+  static constexpr size_t kMaxPendingBytes = 64 * 1024 * 1024;
+
+  // A write not hashed yet, |data| is empty when it is read back from the
+  // image.
+  struct Chunk {
+    brillo::Blob data;
+    uint64_t size;
+  };
+
+  void Add(uint64_t offset, Chunk chunk);
+
+  // Hashes |chunk| at |offset|, right after the data hashed so far.
+  bool ConsumeChunk(uint64_t offset, const Chunk& chunk);
+  bool Consume(uint64_t offset, const uint8_t* data, size_t size);
+  // Hashes the image from |offset| up to |end|.
+  bool ConsumeFile(uint64_t offset, uint64_t end);
+
+  void StopStreaming();
+
+  FileDescriptorPtr fd_;
+  InstallPlan::Partition install_part_;
+  std::unique_ptr<VerityWriterAndroid> verity_writer_;
+  uint64_t verity_data_size_{0};
+  // The verity writer writes the image from |hash_limit_| on, the writes past
+  // it are not followed.
+  uint64_t hash_limit_;
+  uint64_t image_size_;
+  HashCalculator hasher_;
+
+  mutable std::mutex mutex_;
+  // The offset of the next byte to hash.
+  uint64_t next_offset_{0};
+  std::map<uint64_t, Chunk> pending_;
+  // The bytes kept in memory by |pending_|.
+  size_t pending_bytes_{0};
+  // Whether a thread is hashing the writes in |pending_|.
+  bool draining_{false};
+  bool streaming_{true};
+};
+
+ImageHasher::ImageHasher(const PartitionUpdate& partition,
+                         size_t block_size,
+                         FileDescriptorPtr fd)
+    : fd_(std::move(fd)), image_size_(partition.new_partition_info().size()) {
+  hash_limit_ = image_size_;
+  if (partition.hash_tree_extent().num_blocks() == 0 &&
+      partition.fec_extent().num_blocks() == 0) {
+    return;
+  }
+  install_part_.block_size = block_size;
+  CHECK(install_part_.ParseVerityConfig(partition));
+  verity_writer_ = std::make_unique<VerityWriterAndroid>();
+  CHECK(verity_writer_->Init(install_part_));
+  verity_data_size_ =
+      install_part_.hash_tree_data_offset + install_part_.hash_tree_data_size;
+  for (const auto& extent :
+       {partition.hash_tree_extent(), partition.fec_extent()}) {
+    if (extent.num_blocks() != 0) {
+      hash_limit_ = std::min<uint64_t>(hash_limit_,
+                                       extent.start_block() * block_size);
+    }
+  }
+}
+
+void ImageHasher::StopStreaming() {
+  streaming_ = false;
+  pending_.clear();
+  pending_bytes_ = 0;
+}
+
+void ImageHasher::Written(uint64_t offset, const uint8_t* data, size_t size) {
+  if (offset >= hash_limit_ || size == 0) {
+    return;
+  }
+  size = std::min<uint64_t>(size, hash_limit_ - offset);
+  Add(offset, {brillo::Blob(data, data + size), size});
+}
+
+void ImageHasher::WrittenInPlace(uint64_t offset, uint64_t size) {
+  if (offset >= hash_limit_ || size == 0) {
+    return;
+  }
+  Add(offset, {{}, std::min(size, hash_limit_ - offset)});
+}
+
+void ImageHasher::Add(uint64_t offset, Chunk chunk) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!streaming_) {
+    return;
+  }
+  auto next = pending_.lower_bound(offset);
+  const bool overlaps =
+      offset < next_offset_ ||
+      (next != pending_.end() && next->first < offset + chunk.size) ||
+      (next != pending_.begin() &&
+       std::prev(next)->first + std::prev(next)->second.size > offset);
+  if (overlaps || pending_bytes_ + chunk.data.size() > kMaxPendingBytes) {
+    LOG(INFO) << "Can't follow the write at offset " << offset
+              << ", the image will be read back to hash it.";
+    StopStreaming();
+    return;
+  }
+  pending_bytes_ += chunk.data.size();
+  pending_.emplace_hint(next, offset, std::move(chunk));
+  if (draining_) {
+    return;
+  }
+  draining_ = true;
+  while (streaming_ && !pending_.empty() &&
+         pending_.begin()->first == next_offset_) {
+    Chunk first = std::move(pending_.begin()->second);
+    pending_.erase(pending_.begin());
+    pending_bytes_ -= first.data.size();
+    const uint64_t first_offset = next_offset_;
+    next_offset_ += first.size;
+    lock.unlock();
+    const bool success = ConsumeChunk(first_offset, first);
+    lock.lock();
+    if (!success) {
+      StopStreaming();
+    }
+  }
+  draining_ = false;
+}
+
+bool ImageHasher::ConsumeChunk(uint64_t offset, const Chunk& chunk) {
+  if (chunk.data.empty()) {
+    return ConsumeFile(offset, offset + chunk.size);
+  }
+  return Consume(offset, chunk.data.data(), chunk.data.size());
+}
+
+bool ImageHasher::Consume(uint64_t offset, const uint8_t* data, size_t size) {
+  TEST_AND_RETURN_FALSE(hasher_.Update(data, size));
+  if (verity_writer_ && offset < verity_data_size_) {
+    TEST_AND_RETURN_FALSE(verity_writer_->Update(
+        offset, data, std::min<uint64_t>(size, verity_data_size_ - offset)));
+  }
+  return true;
+}
+
+bool ImageHasher::ConsumeFile(uint64_t offset, uint64_t end) {
+  // 512KB buffer, as in WriteVerity().
+  static constexpr size_t BUFFER_SIZE = 1024 * 512;
+  brillo::Blob buffer(BUFFER_SIZE);
+  while (offset < end) {
+    const auto bytes_to_read =
+        static_cast<ssize_t>(std::min<uint64_t>(BUFFER_SIZE, end - offset));
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(
+        utils::ReadAll(fd_, buffer.data(), bytes_to_read, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == bytes_to_read);
+    TEST_AND_RETURN_FALSE(Consume(offset, buffer.data(), bytes_read));
+    offset += bytes_read;
+  }
+  return true;
+}
+
+bool ImageHasher::Finish(brillo::Blob* hash) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  TEST_AND_RETURN_FALSE(streaming_);
+  // The writes kept and the blocks no operation wrote, up to the verity data.
+  while (next_offset_ < hash_limit_) {
+    auto first = pending_.begin();
+    uint64_t end = first == pending_.end() ? hash_limit_ : first->first;
+    if (end == next_offset_) {
+      TEST_AND_RETURN_FALSE(ConsumeChunk(next_offset_, first->second));
+      end += first->second.size;
+      pending_.erase(first);
+    } else {
+      TEST_AND_RETURN_FALSE(ConsumeFile(next_offset_, end));
+    }
+    next_offset_ = end;
+  }
+  if (verity_writer_) {
+    CHECK(verity_writer_->Finalize(fd_.get(), fd_.get()));
+  }
+  // The verity data just written and the end of the image.
+  TEST_AND_RETURN_FALSE(ConsumeFile(hash_limit_, image_size_));
+  TEST_AND_RETURN_FALSE(hasher_.Finalize());
+  *hash = hasher_.raw_hash();
+  return true;
+}
+
+// Writes through |writer| and records the data written in |hasher|.
+class HashingExtentWriter : public ExtentWriter {
+ public:
+  HashingExtentWriter(std::unique_ptr<ExtentWriter> writer, ImageHasher* hasher)
+      : writer_(std::move(writer)), hasher_(hasher) {}
+  ~HashingExtentWriter() override = default;
+
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override {
+    block_size_ = block_size;
+    extents_ = extents;
+    cur_extent_ = 0;
+    extent_bytes_written_ = 0;
+    return writer_->Init(extents, block_size);
+  }
+
+  bool Write(const void* bytes, size_t count) override {
+    TEST_AND_RETURN_FALSE(writer_->Write(bytes, count));
+    const auto* data = static_cast<const uint8_t*>(bytes);
+    while (count > 0 && cur_extent_ < extents_.size()) {
+      const Extent& extent = extents_[cur_extent_];
+      const uint64_t extent_size = extent.num_blocks() * block_size_;
+      const size_t size =
+          std::min<uint64_t>(count, extent_size - extent_bytes_written_);
+      if (extent.start_block() != kSparseHole) {
+        hasher_->Written(
+            extent.start_block() * block_size_ + extent_bytes_written_,
+            data,
+            size);
+      }
+      data += size;
+      count -= size;
+      extent_bytes_written_ += size;
+      if (extent_bytes_written_ == extent_size) {
+        cur_extent_++;
+        extent_bytes_written_ = 0;
+      }
+    }
+    return true;
+  }
+
+ private:
+  std::unique_ptr<ExtentWriter> writer_;
+  ImageHasher* hasher_;
+
+  size_t block_size_{0};
+  google::protobuf::RepeatedPtrField<Extent> extents_;
+  int cur_extent_{0};
+  uint64_t extent_bytes_written_{0};
+};
+
+// Cleared once the file system of the output images can't punch holes or copy
+// ranges in the kernel, to stop trying.
+std::atomic<bool> can_punch_holes{true};
+std::atomic<bool> can_copy_in_kernel{true};
+
+// Zeroes the |extents| of |fd| by punching holes in them, so that they take no
+// disk space. Returns false when the file system can't punch holes, leaving
+// the extents to be written.
+bool PunchHoles(int fd,
+                const google::protobuf::RepeatedPtrField<Extent>& extents,
+                const size_t block_size) {
+  if (!can_punch_holes) {
+    return false;
+  }
+  for (const auto& extent : extents) {
+    if (extent.start_block() == kSparseHole) {
+      continue;
+    }
+    if (fallocate(fd,
+                  FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  extent.start_block() * block_size,
+                  extent.num_blocks() * block_size) != 0) {
+      PLOG(INFO) << "Can't punch holes in the output images, writing zeros";
+      can_punch_holes = false;
+      return false;
+    }
+  }
+  return true;
+}
+
+ssize_t CopyFileRange(int src_fd,
+                      loff_t* src_offset,
+                      int dst_fd,
+                      loff_t* dst_offset,
+                      size_t size) {
+#if defined(__NR_copy_file_range)
+  return syscall(
+      __NR_copy_file_range, src_fd, src_offset, dst_fd, dst_offset, size, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+// Copies the |src_extents| of |src_fd| to the |dst_extents| of |dst_fd| with
+// copy_file_range(), which shares the blocks instead of copying them on the
+// file systems with reflinks. Returns false when the kernel can't copy them,
+// leaving the extents to be written.
+bool CopyExtentsInKernel(
+    int src_fd,
+    const google::protobuf::RepeatedPtrField<Extent>& src_extents,
+    int dst_fd,
+    const google::protobuf::RepeatedPtrField<Extent>& dst_extents,
+    const size_t block_size) {
+  if (!can_copy_in_kernel) {
+    return false;
+  }
+  int src_index = 0, dst_index = 0;
+  uint64_t src_blocks_done = 0, dst_blocks_done = 0;
+  while (src_index < src_extents.size() && dst_index < dst_extents.size()) {
+    const Extent& src = src_extents[src_index];
+    const Extent& dst = dst_extents[dst_index];
+    if (src.start_block() == kSparseHole || dst.start_block() == kSparseHole) {
+      return false;
+    }
+    const uint64_t blocks = std::min(src.num_blocks() - src_blocks_done,
+                                     dst.num_blocks() - dst_blocks_done);
+    loff_t src_offset = (src.start_block() + src_blocks_done) * block_size;
+    loff_t dst_offset = (dst.start_block() + dst_blocks_done) * block_size;
+    uint64_t remaining = blocks * block_size;
+    while (remaining > 0) {
+      const ssize_t copied =
+          CopyFileRange(src_fd, &src_offset, dst_fd, &dst_offset, remaining);
+      if (copied < 0 && errno == EINTR) {
+        continue;
+      }
+      if (copied <= 0) {
+        if (copied < 0 && (errno == ENOSYS || errno == EXDEV ||
+                           errno == EOPNOTSUPP || errno == EINVAL)) {
+          PLOG(INFO) << "Can't copy ranges of the images in the kernel";
+          can_copy_in_kernel = false;
+        }
+        return false;
+      }
+      remaining -= copied;
+    }
+    src_blocks_done += blocks;
+    dst_blocks_done += blocks;
+    if (src_blocks_done == src.num_blocks()) {
+      src_index++;
+      src_blocks_done = 0;
+    }
+    if (dst_blocks_done == dst.num_blocks()) {
+      dst_index++;
+      dst_blocks_done = 0;
+    }
+  }
+  return true;
+}
+
+// Records in |hasher| the |extents| written in place.
+void ExtentsWrittenInPlace(
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    const size_t block_size,
+    ImageHasher* hasher) {
+  for (const auto& extent : extents) {
+    hasher->WrittenInPlace(extent.start_block() * block_size,
+                           extent.num_blocks() * block_size);
+  }
+}
+
+// Rewrites the raw image at |path| as an Android sparse image, where the
+// holes and the blocks of zeros take no space.
+bool WriteSparseImage(const std::string& path,
+                      const size_t block_size,
+                      const uint64_t size) {
+  android::base::unique_fd raw_fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  TEST_AND_RETURN_FALSE_ERRNO(raw_fd.ok());
+  std::unique_ptr<sparse_file, decltype(&sparse_file_destroy)> sparse(
+      sparse_file_new(block_size, size), sparse_file_destroy);
+  TEST_AND_RETURN_FALSE(sparse != nullptr);
+  TEST_AND_RETURN_FALSE(sparse_file_read(sparse.get(),
+                                         raw_fd.get(),
+                                         SPARSE_READ_MODE_HOLE,
+                                         false) == 0);
+  const auto sparse_path = path + ".sparse";
+  android::base::unique_fd sparse_fd(
+      open(sparse_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+           0644));
+  TEST_AND_RETURN_FALSE_ERRNO(sparse_fd.ok());
+  TEST_AND_RETURN_FALSE(
+      sparse_file_write(sparse.get(), sparse_fd.get(), false, true, false) ==
+      0);
+  TEST_AND_RETURN_FALSE_ERRNO(rename(sparse_path.c_str(), path.c_str()) == 0);
+  return true;
+}
+
+// The output and input images of a partition being extracted.
+struct PartitionExtraction {
+  const PartitionUpdate* partition{nullptr};
+  std::string output_path;
+  FileDescriptorPtr out_fd;
+  FileDescriptorPtr in_fd;
+  std::unique_ptr<ImageHasher> hasher;
+  // The operations not applied yet, whoever applies the last one finishes the
+  // image.
+  std::atomic<size_t> remaining_ops{0};
+};
+
+bool OpenPartitionImages(const PartitionUpdate& partition,
+                         std::string_view input_dir,
+                         std::string_view output_dir,
+                         const size_t block_size,
+                         PartitionExtraction* extraction) {
   const base::FilePath output_dir_path(
       base::StringPiece(output_dir.data(), output_dir.size()));
   const base::FilePath input_dir_path(
       base::StringPiece(input_dir.data(), input_dir.size()));
-  std::vector<unsigned char> blob;
 
   LOG(INFO) << "Extracting partition " << partition.partition_name()
             << " size: " << partition.new_partition_info().size();
-  const auto output_path =
+  extraction->partition = &partition;
+  extraction->output_path =
       output_dir_path.Append(partition.partition_name() + ".img").value();
-  auto out_fd =
-      std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+  extraction->out_fd = std::make_shared<EintrSafeFileDescriptor>();
+  TEST_AND_RETURN_FALSE_ERRNO(extraction->out_fd->Open(
+      extraction->output_path.c_str(), O_RDWR | O_CREAT, 0644));
+  // The image gets its final size up front, so that the ranges written in place
+  // read back whole while extracting.
   TEST_AND_RETURN_FALSE_ERRNO(
-      out_fd->Open(output_path.c_str(), O_RDWR | O_CREAT, 0644));
-  auto in_fd =
-      std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+      ftruncate64(extraction->out_fd->Fd(),
+                  partition.new_partition_info().size()) == 0);
+  extraction->in_fd = std::make_shared<EintrSafeFileDescriptor>();
   if (partition.has_old_partition_info()) {
     const auto input_path =
         input_dir_path.Append(partition.partition_name() + ".img").value();
     LOG(INFO) << "Incremental OTA detected for partition "
               << partition.partition_name() << " opening source image "
               << input_path;
-    CHECK(in_fd->Open(input_path.c_str(), O_RDONLY))
+    CHECK(extraction->in_fd->Open(input_path.c_str(), O_RDONLY))
         << " failed to open " << input_path;
   }
+  extraction->hasher = std::make_unique<ImageHasher>(
+      partition, block_size, extraction->out_fd);
+  extraction->remaining_ops = partition.operations_size();
+  return true;
+}
 
-  for (const auto& op : partition.operations()) {
-    if (op.has_src_sha256_hash()) {
-      brillo::Blob actual_hash;
-      TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
-          in_fd, op.src_extents(), manifest.block_size(), &actual_hash));
-      CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-               HexEncode(op.src_sha256_hash()))
-          << ", failed partition: " << partition.partition_name();
-    }
+// Applies |op| of the partition of |extraction|. The file descriptors are only
+// used with positional reads and writes, so several operations may run at
+// once.
+bool ExtractOperation(const InstallOperation& op,
+                      const PartitionExtraction& extraction,
+                      const size_t block_size,
+                      const size_t data_begin,
+                      int payload_fd,
+                      InstallOperationExecutor* executor,
+                      brillo::Blob* blob) {
+  const PartitionUpdate& partition = *extraction.partition;
+  if (op.has_src_sha256_hash()) {
+    brillo::Blob actual_hash;
+    TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
+        extraction.in_fd, op.src_extents(), block_size, &actual_hash));
+    CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+             HexEncode(op.src_sha256_hash()))
+        << ", failed partition: " << partition.partition_name();
+  }
 
-    blob.resize(op.data_length());
-    const auto op_data_offset = data_begin + op.data_offset();
-    ssize_t bytes_read = 0;
-    TEST_AND_RETURN_FALSE(utils::PReadAll(
-        payload_fd, blob.data(), blob.size(), op_data_offset, &bytes_read));
-    if (op.has_data_sha256_hash()) {
-      brillo::Blob actual_hash;
-      TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(blob, &actual_hash));
-      CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-               HexEncode(op.data_sha256_hash()))
-          << ", failed partition: " << partition.partition_name();
+  blob->resize(op.data_length());
+  const auto op_data_offset = data_begin + op.data_offset();
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(
+      payload_fd, blob->data(), blob->size(), op_data_offset, &bytes_read));
+  if (op.has_data_sha256_hash()) {
+    brillo::Blob actual_hash;
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(*blob, &actual_hash));
+    CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+             HexEncode(op.data_sha256_hash()))
+        << ", failed partition: " << partition.partition_name();
+  }
+  auto direct_writer = std::make_unique<HashingExtentWriter>(
+      std::make_unique<DirectExtentWriter>(extraction.out_fd),
+      extraction.hasher.get());
+  if (op.type() == InstallOperation::ZERO) {
+    if (PunchHoles(extraction.out_fd->Fd(), op.dst_extents(), block_size)) {
+      ExtentsWrittenInPlace(
+          op.dst_extents(), block_size, extraction.hasher.get());
+      return true;
     }
-    auto direct_writer = std::make_unique<DirectExtentWriter>(out_fd);
-    if (op.type() == InstallOperation::ZERO) {
-      TEST_AND_RETURN_FALSE(
-          executor.ExecuteZeroOrDiscardOperation(op, std::move(direct_writer)));
-    } else if (op.type() == InstallOperation::REPLACE ||
-               op.type() == InstallOperation::REPLACE_BZ ||
-               op.type() == InstallOperation::REPLACE_XZ) {
-      TEST_AND_RETURN_FALSE(executor.ExecuteReplaceOperation(
-          op, std::move(direct_writer), blob.data()));
-    } else if (op.type() == InstallOperation::SOURCE_COPY) {
-      CHECK(in_fd->IsOpen())
-          << ", failed partition: " << partition.partition_name();
-      TEST_AND_RETURN_FALSE(executor.ExecuteSourceCopyOperation(
-          op, std::move(direct_writer), in_fd));
-    } else {
-      CHECK(in_fd->IsOpen())
-          << ", failed partition: " << partition.partition_name();
-      TEST_AND_RETURN_FALSE(executor.ExecuteDiffOperation(
-          op, std::move(direct_writer), in_fd, blob.data(), blob.size()));
+    TEST_AND_RETURN_FALSE(
+        executor->ExecuteZeroOrDiscardOperation(op, std::move(direct_writer)));
+  } else if (op.type() == InstallOperation::REPLACE ||
+             op.type() == InstallOperation::REPLACE_BZ ||
+             op.type() == InstallOperation::REPLACE_XZ ||
+             op.type() == InstallOperation::REPLACE_ZSTD) {
+    TEST_AND_RETURN_FALSE(executor->ExecuteReplaceOperation(
+        op, std::move(direct_writer), blob->data()));
+  } else if (op.type() == InstallOperation::SOURCE_COPY) {
+    CHECK(extraction.in_fd->IsOpen())
+        << ", failed partition: " << partition.partition_name();
+    if (CopyExtentsInKernel(extraction.in_fd->Fd(),
+                            op.src_extents(),
+                            extraction.out_fd->Fd(),
+                            op.dst_extents(),
+                            block_size)) {
+      ExtentsWrittenInPlace(
+          op.dst_extents(), block_size, extraction.hasher.get());
+      return true;
     }
+    TEST_AND_RETURN_FALSE(executor->ExecuteSourceCopyOperation(
+        op, std::move(direct_writer), extraction.in_fd));
+  } else if (op.type() == InstallOperation::PARTITION_COPY) {
+    LOG(ERROR) << "PARTITION_COPY operations are not supported, failed "
+               << "partition: " << partition.partition_name();
+    return false;
+  } else {
+    CHECK(extraction.in_fd->IsOpen())
+        << ", failed partition: " << partition.partition_name();
+    TEST_AND_RETURN_FALSE(executor->ExecuteDiffOperation(
+        op, std::move(direct_writer), extraction.in_fd, blob->data(),
+        blob->size()));
   }
-  WriteVerity(partition, out_fd, manifest.block_size());
-  int err =
-      truncate64(output_path.c_str(), partition.new_partition_info().size());
-  if (err) {
-    PLOG(ERROR) << "Failed to truncate " << output_path << " to "
-                << partition.new_partition_info().size();
-  }
+  return true;
+}
+
+// Writes the verity data of the partition of |extraction| once all its
+// operations are applied, and checks the hash of the image.
+bool FinishPartitionImage(const PartitionExtraction& extraction,
+                          const size_t block_size) {
+  const PartitionUpdate& partition = *extraction.partition;
+  const auto& output_path = extraction.output_path;
   brillo::Blob actual_hash;
-  TEST_AND_RETURN_FALSE(
-      HashCalculator::RawHashOfFile(output_path, &actual_hash));
+  if (extraction.hasher->streaming()) {
+    TEST_AND_RETURN_FALSE(extraction.hasher->Finish(&actual_hash));
+  } else {
+    WriteVerity(partition, extraction.out_fd, block_size);
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfFile(output_path, &actual_hash));
+  }
   CHECK_EQ(HexEncode(ToStringView(actual_hash)),
            HexEncode(partition.new_partition_info().hash()))
       << " Partition " << partition.partition_name()
       << " hash mismatches. Either the source image or OTA package is "
          "corrupted.";
+  if (FLAGS_sparse) {
+    TEST_AND_RETURN_FALSE(WriteSparseImage(
+        output_path, block_size, partition.new_partition_info().size()));
+  }
 
   LOG(INFO) << "Extracted partition " << partition.partition_name();
 
@@ -198,55 +682,77 @@ bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
                           size_t payload_offset,
                           std::string_view input_dir,
                           std::string_view output_dir,
-                          const std::set<std::string>& partitions) {
+                          const std::set<std::string>& partitions,
+                          size_t num_jobs) {
   const size_t data_begin = metadata.GetMetadataSize() +
                             metadata.GetMetadataSignatureSize() +
                             payload_offset;
-  bool ret = true;
+  const size_t block_size = manifest.block_size();
 
-  if (FLAGS_single_thread) {
-    for (const auto& partition : manifest.partitions()) {
-      if (!partitions.empty() &&
-          partitions.count(partition.partition_name()) == 0) {
-        continue;
-      }
-      if (!ExtractImageFromPartition(manifest,
-                                     partition,
-                                     data_begin,
-                                     payload_fd,
-                                     input_dir,
-                                     output_dir)) {
-        ret = false;
-        LOG(ERROR) << "Extraction of partition " << partition.partition_name()
-                   << " failed";
-        break;
-      }
+  std::vector<const PartitionUpdate*> selected;
+  for (const auto& partition : manifest.partitions()) {
+    if (partitions.empty() || partitions.count(partition.partition_name())) {
+      selected.push_back(&partition);
     }
-  } else {
-    std::vector<std::pair<std::future<bool>, std::string>> futures;
-    for (const auto& partition : manifest.partitions()) {
-      if (!partitions.empty() &&
-          partitions.count(partition.partition_name()) == 0) {
-        continue;
-      }
-      futures.push_back(std::make_pair(std::async(std::launch::async,
-                                                  ExtractImageFromPartition,
-                                                  manifest,
-                                                  partition,
-                                                  data_begin,
-                                                  payload_fd,
-                                                  input_dir,
-                                                  output_dir),
-                                       partition.partition_name()));
+  }
+  std::vector<PartitionExtraction> extractions(selected.size());
+  // The operations of all the partitions, as (partition, operation) indices.
+  // The operations of a partition write disjoint blocks of its image and only
+  // read the source image, so they may run in any order, which keeps all the
+  // jobs busy until the end instead of one job per partition.
+  std::vector<std::pair<size_t, int>> tasks;
+  for (size_t i = 0; i < selected.size(); i++) {
+    if (!OpenPartitionImages(
+            *selected[i], input_dir, output_dir, block_size, &extractions[i])) {
+      LOG(ERROR) << "Extraction of partition "
+                 << selected[i]->partition_name() << " failed";
+      return false;
+    }
+    if (selected[i]->operations_size() == 0 &&
+        !FinishPartitionImage(extractions[i], block_size)) {
+      LOG(ERROR) << "Extraction of partition "
+                 << selected[i]->partition_name() << " failed";
+      return false;
     }
-    for (auto& future : futures) {
-      if (!future.first.get()) {
-        ret = false;
-        LOG(ERROR) << "Extraction of partition " << future.second << " failed";
+    for (int op = 0; op < selected[i]->operations_size(); op++) {
+      tasks.emplace_back(i, op);
+    }
+  }
+
+  std::atomic<size_t> next_task{0};
+  std::atomic<bool> failed{false};
+  auto run_tasks = [&]() {
+    InstallOperationExecutor executor(block_size);
+    brillo::Blob blob;
+    for (size_t task = next_task++; task < tasks.size() && !failed;
+         task = next_task++) {
+      auto& extraction = extractions[tasks[task].first];
+      const auto& op =
+          extraction.partition->operations(tasks[task].second);
+      bool success = ExtractOperation(
+          op, extraction, block_size, data_begin, payload_fd, &executor, &blob);
+      if (success && --extraction.remaining_ops == 0) {
+        success = FinishPartitionImage(extraction, block_size);
+      }
+      if (!success) {
+        LOG(ERROR) << "Extraction of partition "
+                   << extraction.partition->partition_name() << " failed";
+        failed = true;
       }
     }
+  };
+  num_jobs = std::max<size_t>(std::min(num_jobs, tasks.size()), 1);
+  LOG(INFO) << "Extracting " << tasks.size() << " operations with " << num_jobs
+            << " jobs";
+  std::vector<std::thread> jobs;
+  for (size_t i = 1; i < num_jobs; i++) {
+    jobs.emplace_back(run_tasks);
+  }
+  run_tasks();
+  for (auto& job : jobs) {
+    job.join();
   }
-  return ret;
+  return !failed;
 }
 
 }  // namespace chromeos_update_engine
@@ -317,7 +823,11 @@ int main(int argc, char* argv[]) {
   DeltaArchiveManifest manifest;
   if (!payload_metadata.GetManifest(payload + FLAGS_payload_offset,
                                     payload_size - FLAGS_payload_offset,
-                                    &manifest)) {
+                                    &manifest) ||
+      !payload_metadata.LoadPartitionOperations(
+          payload + FLAGS_payload_offset,
+          payload_size - FLAGS_payload_offset,
+          &manifest)) {
     LOG(ERROR) << "Failed to parse manifest!";
     return 1;
   }
@@ -326,11 +836,17 @@ int main(int argc, char* argv[]) {
                << " is an incremental OTA, --input_dir parameter is required.";
     return 1;
   }
+  size_t num_jobs = FLAGS_jobs > 0 ? FLAGS_jobs
+                                   : std::thread::hardware_concurrency();
+  if (FLAGS_single_thread) {
+    num_jobs = 1;
+  }
   return !ExtractImagesFromOTA(manifest,
                                payload_metadata,
                                payload_fd,
                                FLAGS_payload_offset,
                                FLAGS_input_dir,
                                FLAGS_output_dir,
-                               partitions);
+                               partitions,
+                               num_jobs);
 }
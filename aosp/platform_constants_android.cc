@@ -31,6 +31,7 @@ const char kCACertificatesPath[] = "/system/etc/security/cacerts";
 // No deadline file API support on Android.
 const char kOmahaResponseDeadlineFile[] = "";
 const char kNonVolatileDirectory[] = "/data/misc/update_engine";
+const char kUpdateEngineConfPath[] = "/system/etc/update_engine.conf";
 
 }  // namespace constants
 }  // namespace chromeos_update_engine
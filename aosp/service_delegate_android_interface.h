@@ -40,6 +40,36 @@ class CleanupSuccessfulUpdateCallbackInterface {
       const std::function<void()>& unbind) = 0;
 };
 
+// A snapshot of how fast the running update progresses and what limits it,
+// see ServiceDelegateAndroidInterface::GetPerformanceSnapshot().
+struct PerformanceSnapshot {
+  // The Type() of the running action, empty when no update is running.
+  std::string phase;
+  // The download throughput over the last few seconds and since the download
+  // started.
+  int64_t current_bytes_per_second{0};
+  int64_t average_bytes_per_second{0};
+  // Payload bytes received and not applied yet.
+  int64_t bytes_buffered{0};
+  // The operations running on worker threads and waiting for one, the number
+  // of workers and how many of them may run at once, and the fraction of the
+  // time the workers were busy. All zero when operations aren't applied on
+  // worker threads.
+  int32_t running_operations{0};
+  int32_t queued_operations{0};
+  int32_t worker_threads{0};
+  int32_t max_running_workers{0};
+  double worker_utilization{0};
+  // The time left for the running action from the rate it progressed at so
+  // far, -1 if unknown.
+  int64_t estimated_seconds_remaining{-1};
+  // The ThroughputGovernor level, which sets the CPU shares and the worker
+  // limit, the IoScheduler phase and whether its charging boost is active.
+  std::string throughput_level;
+  std::string io_phase;
+  bool io_boosted{false};
+};
+
 // This class defines the interface exposed by the Android version of the
 // daemon service. This interface only includes the method calls that such
 // daemon exposes. For asynchronous events initiated by a class implementing
@@ -133,6 +163,12 @@ class ServiceDelegateAndroidInterface {
       std::unique_ptr<CleanupSuccessfulUpdateCallbackInterface> callback,
       Error* error) = 0;
 
+  // Sets |snapshot| to the live performance of the running update, with an
+  // empty phase if no update is running. Returns true on success, otherwise
+  // returns false and sets |error| accordingly.
+  virtual bool GetPerformanceSnapshot(PerformanceSnapshot* snapshot,
+                                      Error* error) = 0;
+
  protected:
   ServiceDelegateAndroidInterface() = default;
 };
@@ -14,9 +14,12 @@
 // limitations under the License.
 //
 
+#include <unistd.h>
 #include <xz.h>
 
+#include <algorithm>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <base/command_line.h>
@@ -30,6 +33,7 @@
 
 #include "update_engine/aosp/update_attempter_android.h"
 #include "update_engine/common/boot_control.h"
+#include "update_engine/common/constants.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/hardware.h"
 #include "update_engine/common/logging.h"
@@ -119,6 +123,37 @@ class SideloadDaemonState : public DaemonStateInterface,
   double progress_{-1.};
 };
 
+// Adds to |headers| the ones of the recovery performance profile they don't
+// already set. Nothing else runs in recovery, so the update uses all the
+// CPUs, a quarter of the memory and direct I/O, and only syncs the partitions
+// on checkpoints.
+void AddRecoveryProfileHeaders(vector<string>* headers) {
+  const string cpus =
+      std::to_string(std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L));
+  const uint64_t memory_mb = static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) *
+                             sysconf(_SC_PAGESIZE) / (1024 * 1024);
+  const std::pair<string, string> profile[] = {
+      {kPayloadEnableThreading, "1"},
+      {kPayloadBatchedWrites, "1"},
+      {kPayloadApplyThreads, cpus},
+      {kPayloadApplyMemoryLimitMb, std::to_string(memory_mb / 4)},
+      {kPayloadSyncOnCheckpoint, "1"},
+      {kPayloadHugePageBuffers, "1"},
+      {kPayloadEarlyVerify, "1"},
+      {kPayloadVerifyThreads, cpus},
+      {kPayloadVerifyDirectIo, "1"},
+  };
+  for (const auto& [key, value] : profile) {
+    const string prefix = key + "=";
+    if (std::none_of(
+            headers->begin(), headers->end(), [&prefix](const string& header) {
+              return header.compare(0, prefix.size(), prefix) == 0;
+            })) {
+      headers->push_back(prefix + value);
+    }
+  }
+}
+
 // Apply an update payload directly from the given payload URI.
 bool ApplyUpdatePayload(const string& payload,
                         int64_t payload_offset,
@@ -185,6 +220,10 @@ int main(int argc, char** argv) {
                 "",
                 "A list of key-value pairs, one element of the list per line.");
   DEFINE_int64(status_fd, -1, "A file descriptor to notify the update status.");
+  DEFINE_bool(performance_profile,
+              true,
+              "Apply the update with all the resources of the device, the "
+              "headers passed in --headers take precedence.");
 
   chromeos_update_engine::Terminator::Init();
   chromeos_update_engine::SetupLogging(true /* stderr */, false /* file */);
@@ -197,6 +236,9 @@ int main(int argc, char** argv) {
 
   vector<string> headers = base::SplitString(
       FLAGS_headers, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  if (FLAGS_performance_profile) {
+    chromeos_update_engine::AddRecoveryProfileHeaders(&headers);
+  }
 
   if (!chromeos_update_engine::ApplyUpdatePayload(
           FLAGS_payload, FLAGS_offset, FLAGS_size, headers, FLAGS_status_fd))
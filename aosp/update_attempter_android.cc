@@ -16,10 +16,14 @@
 
 #include "update_engine/aosp/update_attempter_android.h"
 
+#include <sys/resource.h>
+
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <memory>
 #include <ostream>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -30,6 +34,7 @@
 #include <base/bind.h>
 #include <base/logging.h>
 #include <brillo/data_encoding.h>
+#include <brillo/key_value_store.h>
 #include <brillo/message_loops/message_loop.h>
 #include <brillo/strings/string_utils.h>
 #include <log/log_safetynet.h>
@@ -42,19 +47,30 @@
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/file_fetcher.h"
+#include "update_engine/common/memory_accounting.h"
 #include "update_engine/common/metrics_reporter_interface.h"
 #include "update_engine/common/network_selector.h"
+#include "update_engine/common/platform_constants.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/metrics_utils.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
 #include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/early_partition_hasher.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
+#include "update_engine/payload_consumer/io_scheduler.h"
+#include "update_engine/payload_consumer/operation_pipeline.h"
+#include "update_engine/payload_consumer/partition_fd_cache.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_consumer/payload_staging_action.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 #include "update_engine/payload_consumer/postinstall_runner_action.h"
+#include "update_engine/payload_consumer/throughput_governor.h"
+#include "update_engine/payload_consumer/verified_source_fd.h"
+#include "update_engine/payload_consumer/verified_source_hashes.h"
 #include "update_engine/update_boot_flags_action.h"
 #include "update_engine/update_status.h"
 #include "update_engine/update_status_utils.h"
@@ -62,6 +78,8 @@
 #ifndef _UE_SIDELOAD
 // Do not include support for external HTTP(s) urls when building
 // update_engine_sideload.
+#include "update_engine/common/parallel_http_fetcher.h"
+#include "update_engine/common/peer_cache_http_fetcher.h"
 #include "update_engine/libcurl_http_fetcher.h"
 #endif
 
@@ -81,6 +99,18 @@ namespace {
 // Minimum threshold to broadcast an status update in progress and time.
 const double kBroadcastThresholdProgress = 0.01;  // 1%
 const int kBroadcastThresholdSeconds = 10;
+// Number of the slowest download requests logged after each download.
+const size_t kSlowestTransfersLogged = 5;
+// Period over which the current download throughput is measured.
+constexpr TimeDelta kThroughputWindow = TimeDelta::FromSeconds(5);
+// Number of operations whose source hashes are checked together when
+// verifying that a payload applies to the current slot.
+const size_t kSourceHashBatchSize = 16;
+// Number of source partitions hashed at once by VerifyPayloadApplicable().
+const size_t kSourceVerifyThreads = 4;
+// File in the non-volatile directory where STAGE_PAYLOAD requests download
+// the payload.
+const char kStagedPayloadFileName[] = "staged_payload";
 
 // Log and set the error on the passed ErrorPtr.
 bool LogAndSetGenericError(Error* error,
@@ -111,6 +141,28 @@ bool LogAndSetError(Error* error,
   return false;
 }
 
+// The user and system CPU time of the process so far.
+TimeDelta GetProcessCpuTime() {
+  struct rusage usage {};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    PLOG(WARNING) << "getrusage() failed";
+    return TimeDelta();
+  }
+  return TimeDelta::FromTimeVal(usage.ru_utime) +
+         TimeDelta::FromTimeVal(usage.ru_stime);
+}
+
+// The peak resident memory of the process so far.
+int64_t GetPeakRssBytes() {
+  struct rusage usage {};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    PLOG(WARNING) << "getrusage() failed";
+    return 0;
+  }
+  // Linux reports it in KiB.
+  return static_cast<int64_t>(usage.ru_maxrss) * 1024;
+}
+
 bool GetHeaderAsBool(const string& header, bool default_value) {
   int value = 0;
   if (android::base::ParseInt(header, &value) && (value == 0 || value == 1))
@@ -155,6 +207,68 @@ std::string GetCurrentBuildVersion() {
   return android::base::GetProperty("ro.build.fingerprint", "");
 }
 
+// The result of checking the source hashes of a partition.
+struct SourceCheck {
+  enum Result { kMatch, kMismatch, kStopped, kIoError };
+  Result result{kMatch};
+  // Why the check failed with kIoError.
+  string message;
+};
+
+// Checks the source hashes of the operations of |partition|, read from
+// |partition_path|. Gives up with kStopped once |stop| is set.
+SourceCheck CheckSourceHashes(const PartitionUpdate& partition,
+                              const string& partition_path,
+                              size_t block_size,
+                              const std::atomic<bool>& stop) {
+  SourceCheck check;
+  FileDescriptorPtr fd(new EintrSafeFileDescriptor);
+  if (!fd->Open(partition_path.c_str(), O_RDONLY)) {
+    check.result = SourceCheck::kIoError;
+    check.message = "Failed to open " + partition_path;
+    return check;
+  }
+  // Small sources are hashed several at a time.
+  vector<const InstallOperation*> batch;
+  vector<const google::protobuf::RepeatedPtrField<Extent>*> batch_extents;
+  auto validate_batch = [&]() {
+    if (stop) {
+      check.result = SourceCheck::kStopped;
+      return false;
+    }
+    vector<brillo::Blob> source_hashes;
+    if (!fd_utils::ReadAndHashExtentsBatch(
+            fd, batch_extents, block_size, &source_hashes)) {
+      check.result = SourceCheck::kIoError;
+      check.message = "Failed to hash " + partition_path;
+      return false;
+    }
+    for (size_t i = 0; i < batch.size(); i++) {
+      if (!PartitionWriter::ValidateSourceHash(
+              source_hashes[i], *batch[i], fd, nullptr)) {
+        check.result = SourceCheck::kMismatch;
+        return false;
+      }
+    }
+    batch.clear();
+    batch_extents.clear();
+    return true;
+  };
+  for (const InstallOperation& operation : partition.operations()) {
+    if (!operation.has_src_sha256_hash())
+      continue;
+    batch.push_back(&operation);
+    batch_extents.push_back(&operation.src_extents());
+    if (batch.size() == kSourceHashBatchSize && !validate_batch()) {
+      return check;
+    }
+  }
+  if (!batch.empty()) {
+    validate_batch();
+  }
+  return check;
+}
+
 }  // namespace
 
 UpdateAttempterAndroid::UpdateAttempterAndroid(
@@ -224,6 +338,7 @@ void UpdateAttempterAndroid::Init() {
     LOG(INFO) << result;
     SetStatusAndNotify(UpdateStatus::IDLE);
     if (DidSystemReboot(prefs_)) {
+      ScopedStepTimer timer("Updating the state after reboot");
       UpdateStateAfterReboot(result);
     }
 
@@ -292,17 +407,51 @@ bool UpdateAttempterAndroid::ApplyPayload(
   payload.type = InstallPayloadType::kUnknown;
   install_plan_.payloads.push_back(payload);
 
+  install_plan_.stage_payload =
+      GetHeaderAsBool(headers[kPayloadStagePayload], false);
+  const string staged_payload_path = GetStagedPayloadPath();
+  if (install_plan_.stage_payload) {
+    if (!payload.size || payload.hash.empty() || staged_payload_path.empty()) {
+      return LogAndSetGenericError(
+          error,
+          __LINE__,
+          __FILE__,
+          "Staging a payload requires its FILE_SIZE and FILE_HASH.");
+    }
+  } else if (PayloadStagingAction::IsPayloadStaged(
+                 prefs_, staged_payload_path, payload)) {
+    // The local copy is mapped by FileFetcher, so applying it only waits for
+    // the storage.
+    LOG(INFO) << "Applying the payload staged at " << staged_payload_path;
+    install_plan_.download_url = "file://" + staged_payload_path;
+    base_offset_ = 0;
+  }
+
   // The |public_key_rsa| key would override the public key stored on disk.
   install_plan_.public_key_rsa = "";
 
   install_plan_.hash_checks_mandatory = hardware_->IsOfficialBuild();
-  install_plan_.is_resume = !payload_id.empty() &&
+  install_plan_.is_resume = !install_plan_.stage_payload &&
+                            !payload_id.empty() &&
                             DeltaPerformer::CanResumeUpdate(prefs_, payload_id);
-  if (!install_plan_.is_resume) {
+  // Staging the payload leaves the partitions and the update progress alone.
+  if (!install_plan_.is_resume && !install_plan_.stage_payload) {
     LOG(INFO) << "Starting a new update " << payload_url
               << " size: " << payload_size << " offset: " << payload_offset;
+    PartitionFdCache::GetInstance()->Clear();
     boot_control_->GetDynamicPartitionControl()->Cleanup();
-    boot_control_->GetDynamicPartitionControl()->ResetUpdate(prefs_);
+    // Partitions prepared for this payload by AllocateSpaceForPayload() are
+    // kept, instead of being prepared again from scratch.
+    if (DeltaPerformer::ArePartitionsPrepared(
+            prefs_, boot_control_, GetTargetSlot(), payload_id)) {
+      LOG(INFO) << "Reusing the partitions prepared for this payload.";
+      DeltaPerformer::ResetUpdateProgress(
+          prefs_,
+          false /* quick */,
+          true /* skip dynamic partitions metadata */);
+    } else {
+      boot_control_->GetDynamicPartitionControl()->ResetUpdate(prefs_);
+    }
 
     if (!prefs_->SetString(kPrefsUpdateCheckResponseHash, payload_id)) {
       LOG(WARNING) << "Unable to save the update check response hash.";
@@ -310,6 +459,8 @@ bool UpdateAttempterAndroid::ApplyPayload(
   }
   install_plan_.source_slot = GetCurrentSlot();
   install_plan_.target_slot = GetTargetSlot();
+  install_plan_.source_verity_digest =
+      hardware_->GetVbmetaDigestForRunningSlot();
 
   install_plan_.powerwash_required =
       GetHeaderAsBool(headers[kPayloadPropertyPowerwash], false);
@@ -362,7 +513,7 @@ bool UpdateAttempterAndroid::ApplyPayload(
   install_plan_.Dump();
 
   HttpFetcher* fetcher = nullptr;
-  if (FileFetcher::SupportedUrl(payload_url)) {
+  if (FileFetcher::SupportedUrl(install_plan_.download_url)) {
     DLOG(INFO) << "Using FileFetcher for file URL.";
     fetcher = new FileFetcher();
   } else {
@@ -371,13 +522,44 @@ bool UpdateAttempterAndroid::ApplyPayload(
     return false;  // NOLINT, unreached but analyzer might not know.
                    // Suppress warnings about null 'fetcher' after this.
 #else
-    LibcurlHttpFetcher* libcurl_fetcher = new LibcurlHttpFetcher(hardware_);
-    if (!headers[kPayloadDownloadRetry].empty()) {
-      libcurl_fetcher->set_max_retry_count(
-          atoi(headers[kPayloadDownloadRetry].c_str()));
+    auto new_libcurl_fetcher = [this, &headers]() {
+      auto libcurl_fetcher = std::make_unique<LibcurlHttpFetcher>(hardware_);
+      if (!headers[kPayloadDownloadRetry].empty()) {
+        libcurl_fetcher->set_max_retry_count(
+            atoi(headers[kPayloadDownloadRetry].c_str()));
+      }
+      libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
+      libcurl_fetcher->set_transfer_compression(
+          GetHeaderAsBool(headers[kPayloadCompressedTransfer], false));
+      return libcurl_fetcher;
+    };
+    size_t connections = 1;
+    if (!headers[kPayloadDownloadConnections].empty() &&
+        !android::base::ParseUint(headers[kPayloadDownloadConnections],
+                                  &connections,
+                                  ParallelHttpFetcher::kMaxConnections)) {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadDownloadConnections
+                   << ": " << headers[kPayloadDownloadConnections];
+      connections = 1;
+    }
+    if (connections > 1) {
+      LOG(INFO) << "Downloading payload over " << connections
+                << " connections.";
+      std::vector<std::unique_ptr<HttpFetcher>> fetchers;
+      for (size_t i = 0; i < connections; i++) {
+        fetchers.push_back(new_libcurl_fetcher());
+      }
+      fetcher = new ParallelHttpFetcher(std::move(fetchers));
+    } else {
+      fetcher = new_libcurl_fetcher().release();
+    }
+    if (!headers[kPayloadPeerCacheUrl].empty()) {
+      LOG(INFO) << "Asking cache peer " << headers[kPayloadPeerCacheUrl]
+                << " for the payload first.";
+      fetcher = new PeerCacheHttpFetcher(new_libcurl_fetcher(),
+                                         std::unique_ptr<HttpFetcher>(fetcher),
+                                         headers[kPayloadPeerCacheUrl]);
     }
-    libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
-    fetcher = libcurl_fetcher;
 #endif  // _UE_SIDELOAD
   }
   // Setup extra headers.
@@ -406,6 +588,13 @@ bool UpdateAttempterAndroid::ApplyPayload(
               << headers[kPayloadPropertyNetworkProxy];
     fetcher->SetProxies({headers[kPayloadPropertyNetworkProxy]});
   }
+  if (install_plan_.stage_payload) {
+    BuildStagingActions(fetcher);
+    SetStatusAndNotify(UpdateStatus::UPDATE_AVAILABLE);
+    ResetActionUsage();
+    ScheduleProcessingStart();
+    return true;
+  }
   if (!headers[kPayloadVABCNone].empty()) {
     install_plan_.vabc_none = true;
   }
@@ -419,12 +608,121 @@ bool UpdateAttempterAndroid::ApplyPayload(
   if (!headers[kPayloadBatchedWrites].empty()) {
     install_plan_.batched_writes = true;
   }
+  if (!headers[kPayloadApplyThreads].empty()) {
+    uint32_t apply_threads = 0;
+    if (android::base::ParseUint(headers[kPayloadApplyThreads],
+                                 &apply_threads)) {
+      install_plan_.apply_threads = apply_threads;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadApplyThreads << ": "
+                   << headers[kPayloadApplyThreads];
+    }
+  }
+  if (!headers[kPayloadApplyMemoryLimitMb].empty()) {
+    uint64_t limit_mb = 0;
+    if (android::base::ParseUint(headers[kPayloadApplyMemoryLimitMb],
+                                 &limit_mb)) {
+      install_plan_.apply_memory_limit = limit_mb * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadApplyMemoryLimitMb
+                   << ": " << headers[kPayloadApplyMemoryLimitMb];
+    }
+  }
+  uint64_t memory_soft_limit_mb = 0;
+  if (!headers[kPayloadMemorySoftLimitMb].empty() &&
+      !android::base::ParseUint(headers[kPayloadMemorySoftLimitMb],
+                                &memory_soft_limit_mb)) {
+    LOG(WARNING) << "Ignoring invalid " << kPayloadMemorySoftLimitMb << ": "
+                 << headers[kPayloadMemorySoftLimitMb];
+  }
+  MemoryAccounting::GetInstance()->set_soft_limit(
+      static_cast<size_t>(memory_soft_limit_mb * 1024 * 1024));
+  if (!headers[kPayloadCowBatchSizeMb].empty()) {
+    uint64_t size_mb = 0;
+    if (android::base::ParseUint(headers[kPayloadCowBatchSizeMb], &size_mb)) {
+      install_plan_.cow_batch_size = size_mb * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadCowBatchSizeMb << ": "
+                   << headers[kPayloadCowBatchSizeMb];
+    }
+  }
+  if (!headers[kPayloadSourcePrefetchOps].empty()) {
+    if (!android::base::ParseUint(headers[kPayloadSourcePrefetchOps],
+                                  &install_plan_.source_prefetch_ops)) {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadSourcePrefetchOps << ": "
+                   << headers[kPayloadSourcePrefetchOps];
+    }
+  }
+  install_plan_.reuse_applied_operations =
+      GetHeaderAsBool(headers[kPayloadReuseAppliedOperations], false);
+  install_plan_.sync_on_checkpoint =
+      GetHeaderAsBool(headers[kPayloadSyncOnCheckpoint], false);
+  AlignedBufferPool::GetInstance()->set_huge_pages(
+      GetHeaderAsBool(headers[kPayloadHugePageBuffers], false));
+  if (!headers[kPayloadDownloadAheadMb].empty()) {
+    uint64_t size_mb = 0;
+    if (android::base::ParseUint(headers[kPayloadDownloadAheadMb], &size_mb)) {
+      install_plan_.download_ahead_size = size_mb * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadDownloadAheadMb << ": "
+                   << headers[kPayloadDownloadAheadMb];
+    }
+  }
+  if (!headers[kPayloadDownloadAheadSpillMb].empty()) {
+    uint64_t size_mb = 0;
+    if (android::base::ParseUint(headers[kPayloadDownloadAheadSpillMb],
+                                 &size_mb)) {
+      install_plan_.download_ahead_spill_size = size_mb * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadDownloadAheadSpillMb
+                   << ": " << headers[kPayloadDownloadAheadSpillMb];
+    }
+  }
+  if (!headers[kPayloadProgressIntervalMs].empty() &&
+      !android::base::ParseUint(headers[kPayloadProgressIntervalMs],
+                                &install_plan_.progress_interval_ms)) {
+    LOG(WARNING) << "Ignoring invalid " << kPayloadProgressIntervalMs << ": "
+                 << headers[kPayloadProgressIntervalMs];
+  }
+  install_plan_.prepare_partitions_async =
+      GetHeaderAsBool(headers[kPayloadPreparePartitionsAsync], false);
+  if (!headers[kPayloadVerifyThreads].empty() &&
+      !android::base::ParseUint(headers[kPayloadVerifyThreads],
+                                &install_plan_.verify_threads)) {
+    LOG(WARNING) << "Ignoring invalid " << kPayloadVerifyThreads << ": "
+                 << headers[kPayloadVerifyThreads];
+  }
+  if (!headers[kPayloadVerifyReadMbPerSecond].empty()) {
+    uint64_t bandwidth_mb = 0;
+    if (android::base::ParseUint(headers[kPayloadVerifyReadMbPerSecond],
+                                 &bandwidth_mb)) {
+      install_plan_.verify_read_bandwidth = bandwidth_mb * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadVerifyReadMbPerSecond
+                   << ": " << headers[kPayloadVerifyReadMbPerSecond];
+    }
+  }
+  install_plan_.verify_direct_io =
+      GetHeaderAsBool(headers[kPayloadVerifyDirectIo], false);
+  install_plan_.verify_from_cow =
+      GetHeaderAsBool(headers[kPayloadVerifyFromCow], false);
+  install_plan_.verify_segments =
+      GetHeaderAsBool(headers[kPayloadVerifySegments], false);
+  install_plan_.early_verify =
+      GetHeaderAsBool(headers[kPayloadEarlyVerify], false);
+  IoScheduler::GetInstance()->LoadPrefs(prefs_);
+  // A missing update_engine.conf leaves the default thresholds.
+  brillo::KeyValueStore conf;
+  conf.Load(base::FilePath(constants::kUpdateEngineConfPath));
+  ThroughputGovernor::GetInstance()->Start(
+      hardware_, ThroughputGovernor::LoadConfig(conf));
 
   BuildUpdateActions(fetcher);
 
   SetStatusAndNotify(UpdateStatus::UPDATE_AVAILABLE);
 
   UpdatePrefsOnUpdateStart(install_plan_.is_resume);
+  ResetActionUsage();
   // TODO(xunchang) report the metrics for unresumable updates
 
   ScheduleProcessingStart();
@@ -511,6 +809,7 @@ bool UpdateAttempterAndroid::ResetStatus(Error* error) {
     LOG(INFO) << "Cleaning up reserved space for compressed APEX (if any)";
     std::vector<ApexInfo> apex_infos_blank;
     apex_handler_android_->AllocateSpace(apex_infos_blank);
+    allocated_cache_key_.clear();
   }
   // Remove the reboot marker so that if the machine is rebooted
   // after resetting to idle state, it doesn't go back to
@@ -546,10 +845,11 @@ bool operator!=(const std::vector<unsigned char>& a, std::string_view b) {
   return !(a == b);
 }
 
-bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
+bool UpdateAttempterAndroid::ReadPayloadMetadata(
     const std::string& metadata_filename,
     std::string_view expected_metadata_hash,
-    DeltaArchiveManifest* manifest,
+    PayloadMetadata* payload_metadata,
+    brillo::Blob* metadata,
     Error* error) {
   FileDescriptorPtr fd(new EintrSafeFileDescriptor);
   if (!fd->Open(metadata_filename.c_str(), O_RDONLY)) {
@@ -559,8 +859,8 @@ bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
                           "Failed to open " + metadata_filename,
                           ErrorCode::kDownloadManifestParseError);
   }
-  brillo::Blob metadata(kMaxPayloadHeaderSize);
-  if (!fd->Read(metadata.data(), metadata.size())) {
+  metadata->resize(kMaxPayloadHeaderSize);
+  if (!fd->Read(metadata->data(), metadata->size())) {
     return LogAndSetError(
         error,
         __LINE__,
@@ -569,8 +869,7 @@ bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
         ErrorCode::kDownloadManifestParseError);
   }
   ErrorCode errorcode{};
-  PayloadMetadata payload_metadata;
-  if (payload_metadata.ParsePayloadHeader(metadata, &errorcode) !=
+  if (payload_metadata->ParsePayloadHeader(*metadata, &errorcode) !=
       MetadataParseResult::kSuccess) {
     return LogAndSetError(error,
                           __LINE__,
@@ -579,8 +878,8 @@ bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
                               utils::ErrorCodeToString(errorcode),
                           errorcode);
   }
-  uint64_t metadata_size = payload_metadata.GetMetadataSize() +
-                           payload_metadata.GetMetadataSignatureSize();
+  uint64_t metadata_size = payload_metadata->GetMetadataSize() +
+                           payload_metadata->GetMetadataSignatureSize();
   if (metadata_size < kMaxPayloadHeaderSize ||
       metadata_size >
           static_cast<uint64_t>(utils::FileSize(metadata_filename))) {
@@ -591,9 +890,9 @@ bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
         "Invalid metadata size: " + std::to_string(metadata_size),
         ErrorCode::kDownloadManifestParseError);
   }
-  metadata.resize(metadata_size);
-  if (!fd->Read(metadata.data() + kMaxPayloadHeaderSize,
-                metadata.size() - kMaxPayloadHeaderSize)) {
+  metadata->resize(metadata_size);
+  if (!fd->Read(metadata->data() + kMaxPayloadHeaderSize,
+                metadata->size() - kMaxPayloadHeaderSize)) {
     return LogAndSetError(
         error,
         __LINE__,
@@ -605,7 +904,7 @@ bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
   if (!expected_metadata_hash.empty()) {
     brillo::Blob metadata_hash;
     TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
-        metadata.data(), payload_metadata.GetMetadataSize(), &metadata_hash));
+        metadata->data(), payload_metadata->GetMetadataSize(), &metadata_hash));
     if (metadata_hash != expected_metadata_hash) {
       return LogAndSetError(error,
                             __LINE__,
@@ -619,18 +918,26 @@ bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
                 << HexEncode(metadata_hash);
     }
   }
+  return true;
+}
 
-  auto payload_verifier = PayloadVerifier::CreateInstanceFromZipPath(
-      constants::kUpdateCertificatesPath);
+bool UpdateAttempterAndroid::ParseSignedManifest(
+    const PayloadMetadata& payload_metadata,
+    const brillo::Blob& metadata,
+    const std::string& certificates_path,
+    DeltaArchiveManifest* manifest,
+    Error* error) {
+  auto payload_verifier =
+      PayloadVerifier::CreateInstanceFromZipPath(certificates_path);
   if (!payload_verifier) {
     return LogAndSetError(error,
                           __LINE__,
                           __FILE__,
                           "Failed to create the payload verifier from " +
-                              std::string(constants::kUpdateCertificatesPath),
+                              certificates_path,
                           ErrorCode::kDownloadManifestParseError);
   }
-  errorcode = payload_metadata.ValidateMetadataSignature(
+  const ErrorCode errorcode = payload_metadata.ValidateMetadataSignature(
       metadata, "", *payload_verifier);
   if (errorcode != ErrorCode::kSuccess) {
     return LogAndSetError(error,
@@ -651,14 +958,31 @@ bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
   return true;
 }
 
+bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
+    const std::string& metadata_filename,
+    std::string_view expected_metadata_hash,
+    DeltaArchiveManifest* manifest,
+    Error* error) {
+  PayloadMetadata payload_metadata;
+  brillo::Blob metadata;
+  return ReadPayloadMetadata(metadata_filename,
+                             expected_metadata_hash,
+                             &payload_metadata,
+                             &metadata,
+                             error) &&
+         ParseSignedManifest(payload_metadata,
+                             metadata,
+                             constants::kUpdateCertificatesPath,
+                             manifest,
+                             error);
+}
+
 bool UpdateAttempterAndroid::VerifyPayloadApplicable(
     const std::string& metadata_filename, Error* error) {
-  DeltaArchiveManifest manifest;
-  TEST_AND_RETURN_FALSE(
-      VerifyPayloadParseManifest(metadata_filename, &manifest, error));
-
-  FileDescriptorPtr fd(new EintrSafeFileDescriptor);
-  ErrorCode errorcode{};
+  PayloadMetadata payload_metadata;
+  brillo::Blob metadata;
+  TEST_AND_RETURN_FALSE(ReadPayloadMetadata(
+      metadata_filename, "", &payload_metadata, &metadata, error));
 
   BootControlInterface::Slot current_slot = GetCurrentSlot();
   if (current_slot < 0) {
@@ -669,9 +993,52 @@ bool UpdateAttempterAndroid::VerifyPayloadApplicable(
         "Failed to get current slot " + std::to_string(current_slot),
         ErrorCode::kDownloadStateInitializationError);
   }
+  // The source partitions only change with the slot or the build, so the
+  // result of a full check holds for the same metadata until then.
+  brillo::Blob metadata_digest;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfData(metadata, &metadata_digest));
+  const string cache_key =
+      HexEncode(metadata_digest) + ":" + std::to_string(current_slot) + ":" +
+      android::base::GetProperty("ro.build.fingerprint", "");
+  if (cache_key == applicable_cache_key_) {
+    LOG(INFO) << "Payload was already checked against the current slot, it is "
+              << (applicable_cache_result_ ? "" : "not ") << "applicable.";
+    return applicable_cache_result_;
+  }
+
+  DeltaArchiveManifest manifest;
+  TEST_AND_RETURN_FALSE(ParseSignedManifest(payload_metadata,
+                                            metadata,
+                                            update_certificates_path_,
+                                            &manifest,
+                                            error));
+
+  // A source partition whose full hash was matched while dm-verity enforced
+  // the same digest isn't read again. The update still checks the source of
+  // every operation, see verified_source_hashes.h.
+  const string verity_digest = hardware_->GetVbmetaDigestForRunningSlot();
+  vector<const PartitionUpdate*> partitions;
+  vector<string> partition_paths;
+  vector<bool> hash_in_full;
   for (const PartitionUpdate& partition : manifest.partitions()) {
     if (!partition.has_old_partition_info())
       continue;
+    const PartitionInfo& info = partition.old_partition_info();
+    const brillo::Blob expected_hash(info.hash().begin(), info.hash().end());
+    brillo::Blob saved_hash;
+    const bool has_saved_hash =
+        GetVerifiedSourceHash(prefs_,
+                              verity_digest,
+                              partition.partition_name(),
+                              info.size(),
+                              &saved_hash);
+    if (has_saved_hash && !expected_hash.empty() &&
+        saved_hash == expected_hash) {
+      LOG(INFO) << "Source partition " << partition.partition_name()
+                << " was already verified for the same dm-verity digest.";
+      continue;
+    }
     string partition_path;
     if (!boot_control_->GetPartitionDevice(
             partition.partition_name(), current_slot, &partition_path)) {
@@ -681,29 +1048,69 @@ bool UpdateAttempterAndroid::VerifyPayloadApplicable(
           __FILE__,
           "Failed to get partition device for " + partition.partition_name());
     }
-    if (!fd->Open(partition_path.c_str(), O_RDONLY)) {
-      return LogAndSetGenericError(
-          error, __LINE__, __FILE__, "Failed to open " + partition_path);
-    }
-    for (const InstallOperation& operation : partition.operations()) {
-      if (!operation.has_src_sha256_hash())
-        continue;
-      brillo::Blob source_hash;
-      if (!fd_utils::ReadAndHashExtents(fd,
-                                        operation.src_extents(),
-                                        manifest.block_size(),
-                                        &source_hash)) {
-        return LogAndSetGenericError(
-            error, __LINE__, __FILE__, "Failed to hash " + partition_path);
+    partitions.push_back(&partition);
+    partition_paths.push_back(std::move(partition_path));
+    // Without a saved hash, the partition is hashed in full first so that the
+    // next checks can skip it if it matches.
+    hash_in_full.push_back(!verity_digest.empty() && !has_saved_hash &&
+                           !expected_hash.empty() && info.size() > 0);
+  }
+
+  // The partitions are hashed in parallel, the first failure stops the others.
+  vector<SourceCheck> checks(partitions.size());
+  vector<brillo::Blob> full_hashes(partitions.size());
+  std::atomic<size_t> next_partition{0};
+  std::atomic<bool> stop{false};
+  auto check_partitions = [&]() {
+    for (size_t i = next_partition++; i < partitions.size() && !stop;
+         i = next_partition++) {
+      const PartitionInfo& info = partitions[i]->old_partition_info();
+      if (hash_in_full[i]) {
+        if (HashCalculator::RawHashOfFile(
+                partition_paths[i], info.size(), &full_hashes[i]) !=
+            static_cast<off_t>(info.size())) {
+          full_hashes[i].clear();
+        } else if (full_hashes[i] == brillo::Blob(info.hash().begin(),
+                                                  info.hash().end())) {
+          continue;
+        }
       }
-      if (!PartitionWriter::ValidateSourceHash(
-              source_hash, operation, fd, &errorcode)) {
-        return false;
+      checks[i] = CheckSourceHashes(
+          *partitions[i], partition_paths[i], manifest.block_size(), stop);
+      if (checks[i].result != SourceCheck::kMatch) {
+        stop = true;
       }
     }
-    fd->Close();
+  };
+  vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(kSourceVerifyThreads, partitions.size());
+       i++) {
+    threads.emplace_back(check_partitions);
+  }
+  check_partitions();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < partitions.size(); i++) {
+    SetVerifiedSourceHash(prefs_,
+                          verity_digest,
+                          partitions[i]->partition_name(),
+                          partitions[i]->old_partition_info().size(),
+                          full_hashes[i]);
+  }
+
+  for (const SourceCheck& check : checks) {
+    if (check.result == SourceCheck::kIoError) {
+      return LogAndSetGenericError(error, __LINE__, __FILE__, check.message);
+    }
   }
-  return true;
+  const bool applicable =
+      std::none_of(checks.begin(), checks.end(), [](const SourceCheck& check) {
+        return check.result == SourceCheck::kMismatch;
+      });
+  applicable_cache_key_ = cache_key;
+  applicable_cache_result_ = applicable;
+  return applicable;
 }
 
 void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
@@ -715,6 +1122,10 @@ void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
     TerminateUpdateAndNotify(code);
     return;
   }
+  if (install_plan_.stage_payload) {
+    TerminateStagingAndNotify(code);
+    return;
+  }
 
   switch (code) {
     case ErrorCode::kSuccess:
@@ -723,15 +1134,26 @@ void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
         LOG(ERROR) << "Failed to write update completion marker";
       }
       prefs_->SetInt64(kPrefsDeltaUpdateFailures, 0);
+      // A staged payload isn't needed anymore once an update was applied.
+      PayloadStagingAction::ClearStagedPayload(prefs_, GetStagedPayloadPath());
 
       LOG(INFO) << "Update successfully applied, waiting to reboot.";
       break;
 
+    case ErrorCode::kDownloadStateInitializationError: {
+      // A source partition doesn't match the payload, so a hash saved for it
+      // may be stale.
+      vector<string> partition_names;
+      for (const auto& partition : install_plan_.partitions) {
+        partition_names.push_back(partition.name);
+      }
+      ClearVerifiedSourceHashes(prefs_, partition_names);
+      [[fallthrough]];
+    }
     case ErrorCode::kFilesystemCopierError:
     case ErrorCode::kNewRootfsVerificationError:
     case ErrorCode::kNewKernelVerificationError:
     case ErrorCode::kFilesystemVerifierError:
-    case ErrorCode::kDownloadStateInitializationError:
       // Reset the ongoing update for these errors so it starts from the
       // beginning next time.
       DeltaPerformer::ResetUpdateProgress(prefs_, false);
@@ -753,6 +1175,10 @@ void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
 
 void UpdateAttempterAndroid::ProcessingStopped(
     const ActionProcessor* processor) {
+  if (install_plan_.stage_payload) {
+    TerminateStagingAndNotify(ErrorCode::kUserCanceled);
+    return;
+  }
   TerminateUpdateAndNotify(ErrorCode::kUserCanceled);
 }
 
@@ -762,6 +1188,8 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
   // Reset download progress regardless of whether or not the download
   // action succeeded.
   const string type = action->Type();
+  RecordActionUsage(type);
+  action_progress_ = 0;
   if (type == CleanupPreviousUpdateAction::StaticType() ||
       (type == NoOpAction::StaticType() &&
        status_ == UpdateStatus::CLEANUP_PREVIOUS_UPDATE)) {
@@ -776,6 +1204,19 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
         code == ErrorCode::kSuccess || code == ErrorCode::kUpdatedButNotActive;
     prefs_->SetBoolean(kPrefsPostInstallSucceeded, succeeded);
   }
+  if (type == DownloadAction::StaticType()) {
+    // Keep the throughput estimate for the attempt metrics, also when the
+    // download failed.
+    HttpFetcher* fetcher =
+        static_cast<DownloadAction*>(action)->http_fetcher();
+    download_bytes_per_second_ =
+        fetcher ? fetcher->GetEstimatedBytesPerSecond() : 0;
+    download_timings_ =
+        fetcher ? fetcher->GetTransferTimings()
+                : std::vector<HttpTransferTiming>();
+    metrics_utils::LogSlowestTransfers(download_timings_,
+                                       kSlowestTransfersLogged);
+  }
   if (code != ErrorCode::kSuccess) {
     // If an action failed, the ActionProcessor will cancel the whole thing.
     return;
@@ -799,6 +1240,21 @@ void UpdateAttempterAndroid::BytesReceived(uint64_t bytes_progressed,
   double progress = 0;
   if (total)
     progress = static_cast<double>(bytes_received) / static_cast<double>(total);
+  action_progress_ = progress;
+
+  const Time now = clock_->GetMonotonicTime();
+  if (download_bytes_ == 0) {
+    download_start_time_ = now;
+    download_samples_.emplace_back(now, 0);
+  }
+  download_bytes_ += bytes_progressed;
+  download_bytes_received_ = bytes_received;
+  download_total_bytes_ = total;
+  download_samples_.emplace_back(now, download_bytes_);
+  while (download_samples_.size() > 2 &&
+         download_samples_[1].first <= now - kThroughputWindow) {
+    download_samples_.pop_front();
+  }
   if (status_ != UpdateStatus::DOWNLOADING || bytes_received == total) {
     download_progress_ = progress;
     SetStatusAndNotify(UpdateStatus::DOWNLOADING);
@@ -821,6 +1277,20 @@ void UpdateAttempterAndroid::DownloadComplete() {
   // Nothing needs to be done when the download completes.
 }
 
+void UpdateAttempterAndroid::PartitionOperationsTimed(
+    const string& partition_name, const OperationTimings& timings) {
+  for (const auto& [type, stats] : timings.stats()) {
+    metrics_reporter_->ReportInstallOperationMetrics(
+        partition_name,
+        InstallOperationTypeName(type),
+        static_cast<int>(stats.count),
+        stats.total,
+        stats.read,
+        stats.write,
+        stats.BytesPerSecond());
+  }
+}
+
 void UpdateAttempterAndroid::ProgressUpdate(double progress) {
   // Self throttle based on progress. Also send notifications if progress is
   // too slow.
@@ -835,6 +1305,7 @@ void UpdateAttempterAndroid::ProgressUpdate(double progress) {
 
 void UpdateAttempterAndroid::OnVerifyProgressUpdate(double progress) {
   assert(status_ == UpdateStatus::VERIFYING);
+  action_progress_ = progress;
   ProgressUpdate(progress);
 }
 
@@ -862,6 +1333,12 @@ void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
     return;
   }
 
+  // The partitions can't be unmapped while they are open.
+  EarlyPartitionHasher::GetInstance()->Reset();
+  PartitionFdCache::GetInstance()->Clear();
+  AlignedBufferPool::GetInstance()->Trim();
+  IoScheduler::GetInstance()->SetPhase(IoPhase::kNone);
+  ThroughputGovernor::GetInstance()->Stop();
   boot_control_->GetDynamicPartitionControl()->Cleanup();
 
   for (auto observer : daemon_state_->service_observers())
@@ -892,7 +1369,28 @@ void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
   }
 }
 
+void UpdateAttempterAndroid::TerminateStagingAndNotify(ErrorCode error_code) {
+  LOG(INFO) << "Staging the payload finished with "
+            << utils::ErrorCodeToString(error_code);
+  IoScheduler::GetInstance()->SetPhase(IoPhase::kNone);
+
+  for (auto observer : daemon_state_->service_observers())
+    observer->SendPayloadApplicationComplete(error_code);
+
+  // Nothing was applied, so the device is ready for the update itself.
+  download_progress_ = 0;
+  SetStatusAndNotify(UpdateStatus::IDLE);
+
+  if (!network_selector_->SetProcessNetwork(kDefaultNetworkId)) {
+    LOG(WARNING) << "Unable to unbind network.";
+  }
+}
+
 void UpdateAttempterAndroid::SetStatusAndNotify(UpdateStatus status) {
+  // An update started or ended since the space was allocated, which may have
+  // used or released it.
+  if (status != status_)
+    allocated_cache_key_.clear();
   status_ = status;
   size_t payload_size =
       install_plan_.payloads.empty() ? 0 : install_plan_.payloads[0].size;
@@ -930,6 +1428,7 @@ void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
   auto postinstall_runner_action =
       std::make_unique<PostinstallRunnerAction>(boot_control_, hardware_);
   filesystem_verifier_action->set_delegate(this);
+  filesystem_verifier_action->set_prefs(prefs_);
   postinstall_runner_action->set_delegate(this);
 
   // Bond them together. We have to use the leaf-types when calling
@@ -947,6 +1446,31 @@ void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
   processor_->EnqueueAction(std::move(postinstall_runner_action));
 }
 
+void UpdateAttempterAndroid::BuildStagingActions(HttpFetcher* fetcher) {
+  CHECK(!processor_->IsRunning());
+
+  auto install_plan_action = std::make_unique<InstallPlanAction>(install_plan_);
+  auto staging_action =
+      std::make_unique<PayloadStagingAction>(prefs_,
+                                             fetcher,  // passes ownership
+                                             GetStagedPayloadPath());
+  staging_action->set_delegate(this);
+  staging_action->set_base_offset(base_offset_);
+
+  BondActions(install_plan_action.get(), staging_action.get());
+
+  processor_->EnqueueAction(std::move(install_plan_action));
+  processor_->EnqueueAction(std::move(staging_action));
+}
+
+string UpdateAttempterAndroid::GetStagedPayloadPath() const {
+  base::FilePath dir;
+  if (!hardware_->GetNonVolatileDirectory(&dir)) {
+    return "";
+  }
+  return dir.Append(kStagedPayloadFileName).value();
+}
+
 bool UpdateAttempterAndroid::WriteUpdateCompletedMarker() {
   string boot_id;
   TEST_AND_RETURN_FALSE(utils::GetBootId(&boot_id));
@@ -1020,10 +1544,33 @@ void UpdateAttempterAndroid::CollectAndReportUpdateMetricsOnUpdateFinished(
   int64_t current_bytes_downloaded = metric_bytes_downloaded_.get();
   metrics_reporter_->ReportUpdateAttemptDownloadMetrics(
       current_bytes_downloaded,
-      0,
+      download_bytes_per_second_,
       DownloadSource::kNumDownloadSources,
       metrics::DownloadErrorCode::kUnset,
       metrics::ConnectionType::kUnset);
+  metrics_utils::ReportTransferTimings(metrics_reporter_.get(),
+                                       download_timings_);
+
+  int64_t num_checkpoints =
+      metrics_utils::GetPersistedValue(kPrefsCheckpointCount, prefs_);
+  if (num_checkpoints > 0) {
+    metrics_reporter_->ReportCheckpointMetrics(
+        static_cast<int>(num_checkpoints),
+        TimeDelta::FromMilliseconds(metrics_utils::GetPersistedValue(
+            kPrefsCheckpointDurationMs, prefs_)),
+        TimeDelta::FromMilliseconds(metrics_utils::GetPersistedValue(
+            kPrefsCheckpointMaxDurationMs, prefs_)));
+  }
+
+  const auto* governor = ThroughputGovernor::GetInstance();
+  const auto level_durations = governor->GetLevelDurations();
+  metrics_reporter_->ReportThroughputGovernorMetrics(
+      governor->num_level_changes(),
+      level_durations[static_cast<size_t>(ThroughputLevel::kFull)],
+      level_durations[static_cast<size_t>(ThroughputLevel::kNormal)],
+      level_durations[static_cast<size_t>(ThroughputLevel::kReduced)],
+      level_durations[static_cast<size_t>(ThroughputLevel::kMinimal)]);
+  ReportActionUsageMetrics();
 
   if (error_code == ErrorCode::kSuccess) {
     int64_t reboot_count =
@@ -1158,6 +1705,7 @@ void UpdateAttempterAndroid::UpdateStateAfterReboot(const OTAResult result) {
       LOG(INFO) << "Detected a rollback, releasing space allocated for apex "
                    "deompression.";
       apex_handler_android_->AllocateSpace({});
+      allocated_cache_key_.clear();
       DeltaPerformer::ResetUpdateProgress(prefs_, false);
     }
     return;
@@ -1200,9 +1748,77 @@ void UpdateAttempterAndroid::UpdatePrefsOnUpdateStart(bool is_resume) {
   ClearUpdateCompletedMarker();
 }
 
+void UpdateAttempterAndroid::ResetActionUsage() {
+  last_action_cpu_time_ = GetProcessCpuTime();
+  last_action_end_time_ = clock_->GetMonotonicTime();
+  action_cpu_times_.clear();
+  action_durations_.clear();
+  attempt_start_num_fsyncs_ = EintrSafeFileDescriptor::num_fsyncs();
+  attempt_start_fsync_duration_ = EintrSafeFileDescriptor::fsync_duration();
+  attempt_start_num_fec_fallbacks_ = VerifiedSourceFd::num_ecc_fallbacks();
+  download_bytes_ = 0;
+  download_bytes_received_ = 0;
+  download_total_bytes_ = 0;
+  download_samples_.clear();
+  action_progress_ = 0;
+  MemoryAccounting::GetInstance()->ResetPeaks();
+}
+
+void UpdateAttempterAndroid::RecordActionUsage(const string& type) {
+  const TimeDelta cpu_time = GetProcessCpuTime();
+  const Time end_time = clock_->GetMonotonicTime();
+  action_cpu_times_[type] += cpu_time - last_action_cpu_time_;
+  action_durations_[type] += end_time - last_action_end_time_;
+  last_action_cpu_time_ = cpu_time;
+  last_action_end_time_ = end_time;
+  MemoryAccounting::GetInstance()->LogUsage(type);
+}
+
+void UpdateAttempterAndroid::ReportActionUsageMetrics() {
+  metrics_reporter_->ReportResourceUsageMetrics(
+      GetPeakRssBytes(),
+      action_cpu_times_[DownloadAction::StaticType()],
+      action_cpu_times_[FilesystemVerifierAction::StaticType()],
+      action_cpu_times_[PostinstallRunnerAction::StaticType()],
+      static_cast<int>(EintrSafeFileDescriptor::num_fsyncs() -
+                       attempt_start_num_fsyncs_),
+      EintrSafeFileDescriptor::fsync_duration() -
+          attempt_start_fsync_duration_);
+
+  // The verifier reads every target partition back in full.
+  const TimeDelta verify_duration =
+      action_durations_[FilesystemVerifierAction::StaticType()];
+  int64_t verify_bytes_per_second = 0;
+  if (verify_duration.is_positive()) {
+    uint64_t verified_bytes = 0;
+    for (const auto& partition : install_plan_.partitions) {
+      verified_bytes += partition.target_size;
+    }
+    verify_bytes_per_second =
+        verified_bytes * 1000000 / verify_duration.InMicroseconds();
+  }
+  metrics_reporter_->ReportVerificationMetrics(
+      verify_bytes_per_second,
+      static_cast<int>(VerifiedSourceFd::num_ecc_fallbacks() -
+                       attempt_start_num_fec_fallbacks_));
+
+  const MemoryAccounting* memory = MemoryAccounting::GetInstance();
+  metrics_reporter_->ReportMemoryUsageMetrics(
+      memory->peak_total(),
+      memory->peak(MemoryConsumer::kManifest),
+      memory->peak(MemoryConsumer::kDownloadBuffer),
+      memory->peak(MemoryConsumer::kOperations),
+      memory->peak(MemoryConsumer::kVerifier),
+      memory->peak(MemoryConsumer::kCowWriter),
+      memory->num_soft_limit_hits());
+}
+
 void UpdateAttempterAndroid::ClearMetricsPrefs() {
   CHECK(prefs_);
   metric_bytes_downloaded_.Delete();
+  prefs_->Delete(kPrefsCheckpointCount);
+  prefs_->Delete(kPrefsCheckpointDurationMs);
+  prefs_->Delete(kPrefsCheckpointMaxDurationMs);
   prefs_->Delete(kPrefsNumReboots);
   prefs_->Delete(kPrefsSystemUpdatedMarker);
   prefs_->Delete(kPrefsUpdateTimestampStart);
@@ -1231,8 +1847,37 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
           headers[kPayloadPropertyMetadataHash], &metadata_hash)) {
     metadata_hash.clear();
   }
-  if (!VerifyPayloadParseManifest(
-          metadata_filename, ToStringView(metadata_hash), &manifest, error)) {
+  PayloadMetadata payload_metadata;
+  brillo::Blob metadata;
+  if (!ReadPayloadMetadata(metadata_filename,
+                           ToStringView(metadata_hash),
+                           &payload_metadata,
+                           &metadata,
+                           error)) {
+    return 0;
+  }
+  // Apps query the same payload repeatedly. The space stays allocated until
+  // the status changes, and apexd only answers differently on another build.
+  brillo::Blob metadata_digest;
+  if (!HashCalculator::RawHashOfData(metadata, &metadata_digest)) {
+    LogAndSetGenericError(
+        error, __LINE__, __FILE__, "Failed to hash the payload metadata.");
+    return 0;
+  }
+  const string apex_cache_key =
+      HexEncode(metadata_digest) + ":" +
+      android::base::GetProperty("ro.build.fingerprint", "");
+  const string allocated_cache_key =
+      apex_cache_key + ":" + std::to_string(GetTargetSlot());
+  if (allocated_cache_key == allocated_cache_key_) {
+    LOG(INFO) << "Space was already allocated for this payload.";
+    return 0;
+  }
+  if (!ParseSignedManifest(payload_metadata,
+                           metadata,
+                           update_certificates_path_,
+                           &manifest,
+                           error)) {
     return 0;
   }
 
@@ -1240,16 +1885,23 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
                                    manifest.apex_info().end());
   uint64_t apex_size_required = 0;
   if (apex_handler_android_ != nullptr) {
-    auto result = apex_handler_android_->CalculateSize(apex_infos);
-    if (!result.ok()) {
-      LogAndSetGenericError(
-          error,
-          __LINE__,
-          __FILE__,
-          "Failed to calculate size required for compressed APEX");
-      return 0;
+    if (apex_cache_key == apex_size_cache_key_) {
+      apex_size_required = apex_size_cache_result_;
+    } else {
+      // All the compressed APEXes are sized by apexd in a single request.
+      auto result = apex_handler_android_->CalculateSize(apex_infos);
+      if (!result.ok()) {
+        LogAndSetGenericError(
+            error,
+            __LINE__,
+            __FILE__,
+            "Failed to calculate size required for compressed APEX");
+        return 0;
+      }
+      apex_size_required = *result;
+      apex_size_cache_key_ = apex_cache_key;
+      apex_size_cache_result_ = apex_size_required;
     }
-    apex_size_required = *result;
   }
 
   string payload_id = GetPayloadId(headers);
@@ -1291,6 +1943,7 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
   }
 
   LOG(INFO) << "Successfully allocated space for payload.";
+  allocated_cache_key_ = allocated_cache_key;
   return 0;
 }
 
@@ -1390,6 +2043,7 @@ bool UpdateAttempterAndroid::setShouldSwitchSlotOnReboot(
         std::make_unique<FilesystemVerifierAction>(
             boot_control_->GetDynamicPartitionControl());
     filesystem_verifier_action->set_delegate(this);
+    filesystem_verifier_action->set_prefs(prefs_);
     BondActions(install_plan_action.get(), filesystem_verifier_action.get());
     BondActions(filesystem_verifier_action.get(),
                 postinstall_runner_action.get());
@@ -1449,9 +2103,11 @@ void UpdateAttempterAndroid::ScheduleCleanupPreviousUpdate() {
       boot_control_->GetDynamicPartitionControl()
           ->GetCleanupPreviousUpdateAction(boot_control_, prefs_, this);
   processor_->EnqueueAction(std::move(action));
-  processor_->set_delegate(this);
   SetStatusAndNotify(UpdateStatus::CLEANUP_PREVIOUS_UPDATE);
-  processor_->StartProcessing();
+  // Start it from the message loop, so at startup it doesn't hold back the
+  // daemon from serving binder calls. The action is queued already, so no
+  // other update can start meanwhile.
+  ScheduleProcessingStart();
 }
 
 bool UpdateAttempterAndroid::TriggerPostinstall(const std::string& partition,
@@ -1491,6 +2147,67 @@ void UpdateAttempterAndroid::RemoveCleanupPreviousUpdateCallback(
       end_it, cleanup_previous_update_callbacks_.end());
 }
 
+bool UpdateAttempterAndroid::GetPerformanceSnapshot(
+    PerformanceSnapshot* snapshot, Error* error) {
+  *snapshot = PerformanceSnapshot();
+  const auto* governor = ThroughputGovernor::GetInstance();
+  const auto* io_scheduler = IoScheduler::GetInstance();
+  snapshot->throughput_level = ThroughputLevelName(governor->level());
+  snapshot->io_phase = IoPhaseName(io_scheduler->phase());
+  snapshot->io_boosted = io_scheduler->boosted();
+
+  AbstractAction* action =
+      processor_->IsRunning() ? processor_->current_action() : nullptr;
+  if (action == nullptr) {
+    return true;
+  }
+  snapshot->phase = action->Type();
+
+  const Time now = clock_->GetMonotonicTime();
+  if (download_samples_.size() > 1) {
+    const auto& [since, bytes] = download_samples_.front();
+    const TimeDelta window = now - since;
+    if (window.is_positive()) {
+      snapshot->current_bytes_per_second =
+          (download_bytes_ - bytes) * 1000000 / window.InMicroseconds();
+    }
+    const TimeDelta elapsed = now - download_start_time_;
+    if (elapsed.is_positive()) {
+      snapshot->average_bytes_per_second =
+          download_bytes_ * 1000000 / elapsed.InMicroseconds();
+    }
+  }
+
+  if (snapshot->phase == DownloadAction::StaticType()) {
+    auto* download_action = static_cast<DownloadAction*>(action);
+    snapshot->bytes_buffered = download_action->GetBufferedBytes();
+    OperationPipeline::Stats stats;
+    if (download_action->GetPipelineStats(&stats)) {
+      snapshot->running_operations = static_cast<int32_t>(stats.running);
+      snapshot->queued_operations = static_cast<int32_t>(stats.queued);
+      snapshot->worker_threads = static_cast<int32_t>(stats.num_threads);
+      snapshot->max_running_workers = static_cast<int32_t>(stats.max_running);
+      snapshot->worker_utilization = stats.utilization();
+    }
+    // The download paces the update, so the time left follows from the
+    // recent throughput rather than from the share of operations applied.
+    const int64_t bytes_per_second = snapshot->current_bytes_per_second > 0
+                                         ? snapshot->current_bytes_per_second
+                                         : snapshot->average_bytes_per_second;
+    if (bytes_per_second > 0 &&
+        download_total_bytes_ >= download_bytes_received_) {
+      snapshot->estimated_seconds_remaining =
+          (download_total_bytes_ - download_bytes_received_) /
+          bytes_per_second;
+    }
+  } else if (action_progress_ > 0) {
+    const TimeDelta elapsed = now - last_action_end_time_;
+    snapshot->estimated_seconds_remaining = static_cast<int64_t>(
+        elapsed.InSecondsF() * (1 - action_progress_) / action_progress_);
+  }
+  return true;
+}
+
 bool UpdateAttempterAndroid::IsProductionBuild() {
   if (android::base::GetProperty("ro.build.type", "") != "userdebug" ||
       android::base::GetProperty("ro.build.tags", "") == "release-keys" ||
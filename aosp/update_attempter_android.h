@@ -19,8 +19,11 @@
 
 #include <stdint.h>
 
+#include <deque>
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <android-base/unique_fd.h>
@@ -41,6 +44,7 @@
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/postinstall_runner_action.h"
 
 namespace chromeos_update_engine {
@@ -100,6 +104,8 @@ class UpdateAttempterAndroid final
                                    Error* error) override;
   bool resetShouldSwitchSlotOnReboot(Error* error) override;
   bool TriggerPostinstall(const std::string& partition, Error* error) override;
+  bool GetPerformanceSnapshot(PerformanceSnapshot* snapshot,
+                              Error* error) override;
 
   // ActionProcessorDelegate methods:
   void ProcessingDone(const ActionProcessor* processor,
@@ -115,6 +121,8 @@ class UpdateAttempterAndroid final
                      uint64_t total) override;
   bool ShouldCancel(ErrorCode* cancel_reason) override;
   void DownloadComplete() override;
+  void PartitionOperationsTimed(const std::string& partition_name,
+                                const OperationTimings& timings) override;
 
   // FilesystemVerifyDelegate overrides
   void OnVerifyProgressUpdate(double progress) override;
@@ -156,6 +164,10 @@ class UpdateAttempterAndroid final
   // observers.
   void TerminateUpdateAndNotify(ErrorCode error_code);
 
+  // Same as TerminateUpdateAndNotify() for a request staging the payload,
+  // which leaves the update engine idle also on success.
+  void TerminateStagingAndNotify(ErrorCode error_code);
+
   // Sets the status to the given |status| and notifies a status update to
   // all observers.
   void SetStatusAndNotify(UpdateStatus status);
@@ -165,6 +177,14 @@ class UpdateAttempterAndroid final
   // passed to this function.
   void BuildUpdateActions(HttpFetcher* fetcher);
 
+  // Same as BuildUpdateActions() for only staging the payload, see
+  // PayloadStagingAction.
+  void BuildStagingActions(HttpFetcher* fetcher);
+
+  // Returns where STAGE_PAYLOAD requests stage the payload, or an empty
+  // string if there is no non-volatile directory.
+  std::string GetStagedPayloadPath() const;
+
   // Writes to the processing completed marker. Does nothing if
   // |update_completed_marker_| is empty.
   [[nodiscard]] bool WriteUpdateCompletedMarker();
@@ -215,10 +235,41 @@ class UpdateAttempterAndroid final
   //   |kPrefsUpdateBootTimestampStart|
   void ClearMetricsPrefs();
 
+  // Starts accounting the resources used by the actions of a new update
+  // attempt, and adds those used since the last call or completed action to
+  // the action of |type| which just completed.
+  void ResetActionUsage();
+  void RecordActionUsage(const std::string& type);
+
+  // Metrics report function to call:
+  //   |ReportResourceUsageMetrics|
+  //   |ReportVerificationMetrics|
+  //   |ReportMemoryUsageMetrics|
+  void ReportActionUsageMetrics();
+
   // Return source and target slots for update.
   BootControlInterface::Slot GetCurrentSlot() const;
   BootControlInterface::Slot GetTargetSlot() const;
 
+  // Reads the header, manifest and signature of the payload metadata in
+  // |metadata_filename| into |metadata|, checking the hash of the header and
+  // manifest against |metadata_hash| when not empty, and parses the header
+  // into |payload_metadata|.
+  static bool ReadPayloadMetadata(const std::string& metadata_filename,
+                                  std::string_view metadata_hash,
+                                  PayloadMetadata* payload_metadata,
+                                  brillo::Blob* metadata,
+                                  Error* error);
+
+  // Validates the signature of |metadata| read by ReadPayloadMetadata() with
+  // the certificates at |certificates_path| and parses its manifest into
+  // |manifest|.
+  static bool ParseSignedManifest(const PayloadMetadata& payload_metadata,
+                                  const brillo::Blob& metadata,
+                                  const std::string& certificates_path,
+                                  DeltaArchiveManifest* manifest,
+                                  Error* error);
+
   // Helper of public VerifyPayloadApplicable. Return the parsed manifest in
   // |manifest|.
   static bool VerifyPayloadParseManifest(const std::string& metadata_filename,
@@ -290,6 +341,52 @@ class UpdateAttempterAndroid final
 
   metrics_utils::PersistedValue<int64_t> metric_bytes_downloaded_;
   metrics_utils::PersistedValue<int64_t> metric_total_bytes_downloaded_;
+  // The download throughput estimated by the fetcher of the last download.
+  int64_t download_bytes_per_second_{0};
+  // The requests the fetcher of the last download made.
+  std::vector<HttpTransferTiming> download_timings_;
+
+  // The process CPU time and monotonic time when the last action of the
+  // current update attempt completed, or the attempt started, and the CPU and
+  // wall time each action took so far, by action type.
+  base::TimeDelta last_action_cpu_time_;
+  base::Time last_action_end_time_;
+  std::map<std::string, base::TimeDelta> action_cpu_times_;
+  std::map<std::string, base::TimeDelta> action_durations_;
+  // The fsync() calls and FEC fallbacks of the process when the current update
+  // attempt started.
+  uint64_t attempt_start_num_fsyncs_{0};
+  base::TimeDelta attempt_start_fsync_duration_;
+  uint64_t attempt_start_num_fec_fallbacks_{0};
+
+  // The payload bytes downloaded during the current update attempt, when the
+  // first of them arrived, and the total received and expected as last
+  // reported by the DownloadAction.
+  uint64_t download_bytes_{0};
+  base::Time download_start_time_;
+  uint64_t download_bytes_received_{0};
+  uint64_t download_total_bytes_{0};
+  // (time, |download_bytes_|) after each received chunk over the last
+  // kThroughputWindow, plus the one before, for the current throughput.
+  std::deque<std::pair<base::Time, uint64_t>> download_samples_;
+  // The progress last reported by the running action, not throttled like
+  // |download_progress_|.
+  double action_progress_{0};
+
+  // The last payload fully checked by VerifyPayloadApplicable(), keyed by the
+  // hash of its metadata, the current slot and the build fingerprint, and
+  // whether it applied to the current slot.
+  std::string applicable_cache_key_;
+  bool applicable_cache_result_{false};
+
+  // The decompressed size of the APEXes of the last payload sized by apexd,
+  // keyed by the hash of its metadata and the build fingerprint.
+  std::string apex_size_cache_key_;
+  uint64_t apex_size_cache_result_{0};
+  // The last payload AllocateSpaceForPayload() allocated space for, keyed as
+  // |apex_size_cache_key_| plus the target slot. Cleared when the status
+  // changes or the APEX space is released.
+  std::string allocated_cache_key_;
 
   DISALLOW_COPY_AND_ASSIGN(UpdateAttempterAndroid);
 };
@@ -16,9 +16,11 @@
 
 #include "update_engine/aosp/update_attempter_android.h"
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/sendfile.h>
@@ -39,15 +41,24 @@
 #include "update_engine/common/fake_clock.h"
 #include "update_engine/common/fake_hardware.h"
 #include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/mock_action_processor.h"
 #include "update_engine/common/mock_metrics_reporter.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/testing_constants.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/operation_timings.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/verified_source_hashes.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/update_metadata.pb.h"
 
 using base::Time;
 using base::TimeDelta;
+using std::string;
 using testing::_;
 using update_engine::UpdateStatus;
 
@@ -63,6 +74,7 @@ class UpdateAttempterAndroidTest : public ::testing::Test {
   UpdateAttempterAndroidTest() = default;
 
   void SetUp() override {
+    loop_.SetAsCurrent();
     clock_ = new FakeClock();
     metrics_reporter_ = new testing::NiceMock<MockMetricsReporter>();
     update_attempter_android_.metrics_reporter_.reset(metrics_reporter_);
@@ -80,6 +92,11 @@ class UpdateAttempterAndroidTest : public ::testing::Test {
         std::move(payload));
   }
 
+  void ClearApplicableCache() {
+    update_attempter_android_.applicable_cache_key_.clear();
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
   DaemonStateAndroid daemon_state_;
   FakePrefs prefs_;
   FakeBootControl boot_control_;
@@ -238,6 +255,238 @@ TEST_F(UpdateAttempterAndroidTest, ReportMetricsForBytesDownloaded) {
       0, metrics_utils::GetPersistedValue(kPrefsTotalBytesDownloaded, &prefs_));
 }
 
+TEST_F(UpdateAttempterAndroidTest, ReportCheckpointMetrics) {
+  prefs_.SetInt64(kPrefsCheckpointCount, 12);
+  prefs_.SetInt64(kPrefsCheckpointDurationMs, 300);
+  prefs_.SetInt64(kPrefsCheckpointMaxDurationMs, 80);
+  EXPECT_CALL(*metrics_reporter_,
+              ReportCheckpointMetrics(12,
+                                      TimeDelta::FromMilliseconds(300),
+                                      TimeDelta::FromMilliseconds(80)))
+      .Times(1);
+
+  InstallPlan::Payload payload;
+  payload.size = 50;
+  AddPayload(std::move(payload));
+  update_attempter_android_.ProcessingDone(nullptr, ErrorCode::kError);
+  EXPECT_FALSE(prefs_.Exists(kPrefsCheckpointCount));
+  EXPECT_FALSE(prefs_.Exists(kPrefsCheckpointDurationMs));
+  EXPECT_FALSE(prefs_.Exists(kPrefsCheckpointMaxDurationMs));
+}
+
+TEST_F(UpdateAttempterAndroidTest, SourceMismatchDropsVerifiedSourceHashes) {
+  SetVerifiedSourceHash(&prefs_, "digest", "system", 4096, {0x01});
+  SetVerifiedSourceHash(&prefs_, "digest", "vendor", 4096, {0x02});
+  InstallPlan::Partition partition;
+  partition.name = "system";
+  update_attempter_android_.install_plan_.partitions = {partition};
+
+  InstallPlan::Payload payload;
+  payload.size = 50;
+  AddPayload(std::move(payload));
+  update_attempter_android_.ProcessingDone(
+      nullptr, ErrorCode::kDownloadStateInitializationError);
+  brillo::Blob hash;
+  EXPECT_FALSE(
+      GetVerifiedSourceHash(&prefs_, "digest", "system", 4096, &hash));
+  // Only the partitions of the update are dropped.
+  EXPECT_TRUE(GetVerifiedSourceHash(&prefs_, "digest", "vendor", 4096, &hash));
+}
+
+TEST_F(UpdateAttempterAndroidTest, ReportInstallOperationMetrics) {
+  OperationTimings timings;
+  timings.Record(InstallOperation::SOURCE_COPY,
+                 TimeDelta::FromMilliseconds(30),
+                 TimeDelta::FromMilliseconds(10),
+                 TimeDelta::FromMilliseconds(20));
+  timings.Record(InstallOperation::SOURCE_COPY,
+                 TimeDelta::FromMilliseconds(50),
+                 TimeDelta::FromMilliseconds(20),
+                 TimeDelta::FromMilliseconds(25),
+                 81920);
+  EXPECT_CALL(*metrics_reporter_,
+              ReportInstallOperationMetrics("system",
+                                            "SOURCE_COPY",
+                                            2,
+                                            TimeDelta::FromMilliseconds(80),
+                                            TimeDelta::FromMilliseconds(30),
+                                            TimeDelta::FromMilliseconds(45),
+                                            1024000))
+      .Times(1);
+  update_attempter_android_.PartitionOperationsTimed("system", timings);
+}
+
+TEST_F(UpdateAttempterAndroidTest, ReportVerificationMetrics) {
+  InstallPlan::Partition partition;
+  partition.target_size = 4 * 1024 * 1024;
+  update_attempter_android_.install_plan_.partitions = {partition, partition};
+  clock_->SetMonotonicTime(Time::FromInternalValue(1000000));
+  update_attempter_android_.ResetActionUsage();
+  // The download doesn't count towards the verification.
+  clock_->SetMonotonicTime(Time::FromInternalValue(5000000));
+  update_attempter_android_.RecordActionUsage(DownloadAction::StaticType());
+  clock_->SetMonotonicTime(Time::FromInternalValue(7000000));
+  update_attempter_android_.RecordActionUsage(
+      FilesystemVerifierAction::StaticType());
+
+  EXPECT_CALL(*metrics_reporter_, ReportVerificationMetrics(4 * 1024 * 1024, 0))
+      .Times(1);
+  EXPECT_CALL(*metrics_reporter_, ReportResourceUsageMetrics(_, _, _, _, 0, _))
+      .Times(1);
+  update_attempter_android_.ReportActionUsageMetrics();
+}
+
+TEST_F(UpdateAttempterAndroidTest, PerformanceSnapshotWithoutUpdate) {
+  PerformanceSnapshot snapshot;
+  snapshot.phase = "stale";
+  Error error;
+  ASSERT_TRUE(
+      update_attempter_android_.GetPerformanceSnapshot(&snapshot, &error));
+  EXPECT_EQ("", snapshot.phase);
+  EXPECT_EQ(0, snapshot.current_bytes_per_second);
+  EXPECT_EQ(-1, snapshot.estimated_seconds_remaining);
+  EXPECT_FALSE(snapshot.throughput_level.empty());
+  EXPECT_FALSE(snapshot.io_phase.empty());
+}
+
+constexpr size_t kSourceBlockSize = 4096;
+// More blocks than the source hashes checked at once, so that the check of a
+// partition can stop half way.
+constexpr size_t kSourceBlocks = 40;
+// More partitions than the threads checking them.
+constexpr size_t kSourcePartitions = 6;
+
+// Writes to |payload_path| a delta payload signed with the unittest key which
+// copies every block of the source partitions at |source_paths|, each
+// operation checking the hash of its source block. Payloads with a different
+// |max_timestamp| have different metadata.
+void WriteSourceCopyPayload(const std::vector<string>& source_paths,
+                            int64_t max_timestamp,
+                            const string& payload_path) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(kSourceBlockSize);
+  manifest.set_minor_version(kSourceMinorPayloadVersion);
+  manifest.set_max_timestamp(max_timestamp);
+  for (size_t i = 0; i < source_paths.size(); i++) {
+    brillo::Blob data;
+    ASSERT_TRUE(utils::ReadFile(source_paths[i], &data));
+    PartitionUpdate* partition = manifest.add_partitions();
+    partition->set_partition_name("part" + std::to_string(i));
+    brillo::Blob hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(data, &hash));
+    partition->mutable_old_partition_info()->set_size(data.size());
+    partition->mutable_old_partition_info()->set_hash(hash.data(),
+                                                      hash.size());
+    for (size_t block = 0; block < data.size() / kSourceBlockSize; block++) {
+      InstallOperation* op = partition->add_operations();
+      op->set_type(InstallOperation::SOURCE_COPY);
+      *op->add_src_extents() = ExtentForRange(block, 1);
+      *op->add_dst_extents() = ExtentForRange(block, 1);
+      ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+          data.data() + block * kSourceBlockSize, kSourceBlockSize, &hash));
+      op->set_src_sha256_hash(hash.data(), hash.size());
+    }
+  }
+  ScopedTempFile blobs("Blobs-XXXXXX");
+  uint64_t metadata_size = 0;
+  ASSERT_TRUE(PayloadFile::WritePayload(
+      payload_path,
+      blobs.path(),
+      test_utils::GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      kBrilloMajorPayloadVersion,
+      manifest,
+      &metadata_size));
+}
+
+class VerifyPayloadApplicableTest : public UpdateAttempterAndroidTest {
+ protected:
+  void SetUp() override {
+    UpdateAttempterAndroidTest::SetUp();
+    update_attempter_android_.set_update_certificates_path(
+        test_utils::GetBuildArtifactsPath(kUnittestOTACertsPath));
+    boot_control_.SetCurrentSlot(0);
+    for (size_t i = 0; i < kSourcePartitions; i++) {
+      brillo::Blob data(kSourceBlocks * kSourceBlockSize);
+      for (size_t j = 0; j < data.size(); j++) {
+        data[j] = (j * 31 + j / kSourceBlockSize + i * 7) & 0xff;
+      }
+      ASSERT_TRUE(test_utils::WriteFileVector(sources_[i].path(), data));
+      source_data_[i] = std::move(data);
+      source_paths_.push_back(sources_[i].path());
+      for (BootControlInterface::Slot slot = 0; slot < 2; slot++) {
+        boot_control_.SetPartitionDevice(
+            "part" + std::to_string(i), slot, sources_[i].path());
+      }
+    }
+    ASSERT_NO_FATAL_FAILURE(
+        WriteSourceCopyPayload(source_paths_, 1, payload_.path()));
+  }
+
+  // Changes the last block of source partition |index|, or restores it.
+  void CorruptSource(size_t index, bool corrupt = true) {
+    brillo::Blob data = source_data_[index];
+    if (corrupt) {
+      std::fill(data.end() - kSourceBlockSize, data.end(), 0xee);
+    }
+    ASSERT_TRUE(test_utils::WriteFileVector(sources_[index].path(), data));
+  }
+
+  bool VerifyPayloadApplicable(const string& payload_path) {
+    Error error{};
+    const bool applicable =
+        update_attempter_android_.VerifyPayloadApplicable(payload_path, &error);
+    // A mismatch isn't an error, nor are the checks it stopped.
+    EXPECT_EQ(ErrorCode::kSuccess, error.error_code) << error.message;
+    return applicable;
+  }
+
+  ScopedTempFile sources_[kSourcePartitions];
+  brillo::Blob source_data_[kSourcePartitions];
+  std::vector<string> source_paths_;
+  ScopedTempFile payload_{"Payload-XXXXXX"};
+};
+
+TEST_F(VerifyPayloadApplicableTest, CacheHitTest) {
+  EXPECT_TRUE(VerifyPayloadApplicable(payload_.path()));
+  // The result of the same payload on the same slot is reused without reading
+  // the sources again.
+  ASSERT_NO_FATAL_FAILURE(CorruptSource(2));
+  EXPECT_TRUE(VerifyPayloadApplicable(payload_.path()));
+}
+
+TEST_F(VerifyPayloadApplicableTest, CacheInvalidationTest) {
+  EXPECT_TRUE(VerifyPayloadApplicable(payload_.path()));
+  ASSERT_NO_FATAL_FAILURE(CorruptSource(2));
+  EXPECT_TRUE(VerifyPayloadApplicable(payload_.path()));
+
+  // Another slot.
+  boot_control_.SetCurrentSlot(1);
+  EXPECT_FALSE(VerifyPayloadApplicable(payload_.path()));
+
+  // Another payload.
+  boot_control_.SetCurrentSlot(0);
+  ScopedTempFile other_payload("Payload-XXXXXX");
+  ASSERT_NO_FATAL_FAILURE(
+      WriteSourceCopyPayload(source_paths_, 2, other_payload.path()));
+  EXPECT_FALSE(VerifyPayloadApplicable(other_payload.path()));
+}
+
+TEST_F(VerifyPayloadApplicableTest, MismatchStopsOtherWorkersTest) {
+  // Whichever worker finds the mismatch, the others are stopped without
+  // their partitions counting as mismatches or errors, and the result is
+  // cached.
+  for (size_t i = 0; i < kSourcePartitions; i++) {
+    SCOPED_TRACE(i);
+    ClearApplicableCache();
+    ASSERT_NO_FATAL_FAILURE(CorruptSource(i));
+    EXPECT_FALSE(VerifyPayloadApplicable(payload_.path()));
+    ASSERT_NO_FATAL_FAILURE(CorruptSource(i, false));
+    EXPECT_FALSE(VerifyPayloadApplicable(payload_.path()));
+  }
+  ClearApplicableCache();
+  EXPECT_TRUE(VerifyPayloadApplicable(payload_.path()));
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
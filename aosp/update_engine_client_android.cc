@@ -38,6 +38,7 @@
 
 #include "android/os/BnUpdateEngineCallback.h"
 #include "android/os/IUpdateEngine.h"
+#include "android/os/UpdatePerformanceSnapshot.h"
 #include "update_engine/client_library/include/update_engine/update_status.h"
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/error_code_utils.h"
@@ -174,6 +175,9 @@ int UpdateEngineClientAndroid::OnInit() {
               false,
               "Wait for previous update to merge. "
               "Only available after rebooting to new slot.");
+  DEFINE_bool(performance,
+              false,
+              "Print the live performance of the running update and exit.");
   // Boilerplate init commands.
   base::CommandLine::Init(argc_, argv_);
   brillo::FlagHelper::Init(argc_, argv_, "Android Update Engine Client");
@@ -236,6 +240,32 @@ int UpdateEngineClientAndroid::OnInit() {
     return ExitWhenIdle(service_->resetStatus());
   }
 
+  if (FLAGS_performance) {
+    android::os::UpdatePerformanceSnapshot snapshot;
+    Status status = service_->getPerformanceSnapshot(&snapshot);
+    if (status.isOk()) {
+      if (snapshot.phase.empty()) {
+        LOG(INFO) << "No update running.";
+      } else {
+        LOG(INFO) << "Running " << snapshot.phase << ", downloading at "
+                  << snapshot.currentBytesPerSecond / 1024 << " KiB/s ("
+                  << snapshot.averageBytesPerSecond / 1024
+                  << " KiB/s on average), " << snapshot.bytesBuffered / 1024
+                  << " KiB buffered, " << snapshot.runningOperations
+                  << " operations running and " << snapshot.queuedOperations
+                  << " queued on " << snapshot.maxRunningWorkers << "/"
+                  << snapshot.workerThreads << " workers busy "
+                  << static_cast<int>(snapshot.workerUtilization * 100)
+                  << "% of the time, " << snapshot.estimatedSecondsRemaining
+                  << " s remaining.";
+      }
+      LOG(INFO) << "Throughput level " << snapshot.throughputLevel
+                << ", I/O phase " << snapshot.ioPhase
+                << (snapshot.ioBoosted ? " boosted." : ".");
+    }
+    return ExitWhenIdle(status);
+  }
+
   if (FLAGS_trigger_postinstall != UNSPECIFIED_FLAG) {
     return ExitWhenIdle(service_->triggerPostinstall(
         android::String16(FLAGS_trigger_postinstall.c_str())));
@@ -164,10 +164,21 @@ bool CertificateChecker::CheckCertificateChange(int preverify_ok,
                                   kPrefsUpdateServerCertificate,
                                   static_cast<int>(server_to_check),
                                   depth);
+  // Every connection checks the same certificates again, only read the prefs
+  // the first time.
+  const auto known_digest = known_digests_.find(storage_key);
+  if (known_digest != known_digests_.end() &&
+      known_digest->second == digest_string) {
+    NotifyCertificateChecked(server_to_check, CertificateCheckResult::kValid);
+    return true;
+  }
+
   string stored_digest;
   // If there's no stored certificate, we just store the current one and return.
   if (!prefs_->GetString(storage_key, &stored_digest)) {
-    if (!prefs_->SetString(storage_key, digest_string)) {
+    if (prefs_->SetString(storage_key, digest_string)) {
+      known_digests_[storage_key] = digest_string;
+    } else {
       LOG(WARNING) << "Failed to store server certificate on storage key "
                    << storage_key;
     }
@@ -178,7 +189,9 @@ bool CertificateChecker::CheckCertificateChange(int preverify_ok,
   // Certificate changed, we store a report to UMA and store the most recent
   // certificate.
   if (stored_digest != digest_string) {
-    if (!prefs_->SetString(storage_key, digest_string)) {
+    if (prefs_->SetString(storage_key, digest_string)) {
+      known_digests_[storage_key] = digest_string;
+    } else {
       LOG(WARNING) << "Failed to store server certificate on storage key "
                    << storage_key;
     }
@@ -189,6 +202,7 @@ bool CertificateChecker::CheckCertificateChange(int preverify_ok,
     return true;
   }
 
+  known_digests_[storage_key] = digest_string;
   NotifyCertificateChecked(server_to_check, CertificateCheckResult::kValid);
   // Since we don't perform actual SSL verification, we return success.
   return true;
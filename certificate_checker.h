@@ -20,6 +20,7 @@
 #include <curl/curl.h>
 #include <openssl/ssl.h>
 
+#include <map>
 #include <string>
 
 #include <android-base/macros.h>
@@ -125,6 +126,7 @@ class CertificateChecker {
   FRIEND_TEST(CertificateCheckerTest, SameCertificate);
   FRIEND_TEST(CertificateCheckerTest, ChangedCertificate);
   FRIEND_TEST(CertificateCheckerTest, FailedCertificate);
+  FRIEND_TEST(CertificateCheckerTest, KnownCertificate);
 
   // These callbacks are asynchronously called by openssl after initial SSL
   // verification. They are used to perform any additional security verification
@@ -167,6 +169,11 @@ class CertificateChecker {
   // The observer called whenever a certificate is checked, if not null.
   Observer* observer_{nullptr};
 
+  // The digest known to be stored in |prefs_| under each storage key, so the
+  // certificates of every new connection to a server aren't looked up in
+  // |prefs_| again.
+  std::map<std::string, std::string> known_digests_;
+
   DISALLOW_COPY_AND_ASSIGN(CertificateChecker);
 };
 
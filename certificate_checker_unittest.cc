@@ -121,6 +121,28 @@ TEST_F(CertificateCheckerTest, ChangedCertificate) {
       cert_checker.CheckCertificateChange(1, nullptr, server_to_check_));
 }
 
+// check certificate change, unchanged since the previous check
+TEST_F(CertificateCheckerTest, KnownCertificate) {
+  EXPECT_CALL(openssl_wrapper_, GetCertificateDigest(nullptr, _, _, _))
+      .Times(2)
+      .WillRepeatedly(DoAll(SetArgPointee<1>(depth_),
+                            SetArgPointee<2>(length_),
+                            SetArrayArgument<3>(digest_, digest_ + 4),
+                            Return(true)));
+  // Only the first check reads the prefs.
+  EXPECT_CALL(prefs_, GetString(cert_key_, _))
+      .WillOnce(DoAll(SetArgPointee<1>(digest_hex_), Return(true)));
+  EXPECT_CALL(prefs_, SetString(_, _)).Times(0);
+  EXPECT_CALL(
+      observer_,
+      CertificateChecked(server_to_check_, CertificateCheckResult::kValid))
+      .Times(2);
+  ASSERT_TRUE(
+      cert_checker.CheckCertificateChange(1, nullptr, server_to_check_));
+  ASSERT_TRUE(
+      cert_checker.CheckCertificateChange(1, nullptr, server_to_check_));
+}
+
 // check certificate change, failed
 TEST_F(CertificateCheckerTest, FailedCertificate) {
   EXPECT_CALL(
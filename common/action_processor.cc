@@ -49,6 +49,7 @@ void ActionProcessor::StartProcessing() {
     current_action_ = std::move(actions_.front());
     actions_.pop_front();
     LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
+    action_span_.Begin(current_action_->Type());
     current_action_->PerformAction();
   }
 }
@@ -62,6 +63,7 @@ void ActionProcessor::StopProcessing() {
             << (current_action_ ? current_action_->Type() : "")
             << (suspended_ ? " while suspended" : "");
   current_action_.reset();
+  action_span_.End();
   suspended_ = false;
   // Delete all the actions before calling the delegate.
   actions_.clear();
@@ -113,6 +115,7 @@ void ActionProcessor::ActionComplete(AbstractAction* actionptr,
   string old_type = current_action_->Type();
   current_action_->ActionCompleted(code);
   current_action_.reset();
+  action_span_.End();
   LOG(INFO) << "ActionProcessor: finished "
             << (actions_.empty() ? "last action " : "") << old_type
             << (suspended_ ? " while suspended" : "") << " with code "
@@ -141,6 +144,7 @@ void ActionProcessor::StartNextActionOrFinish(ErrorCode code) {
   current_action_ = std::move(actions_.front());
   actions_.pop_front();
   LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
+  action_span_.Begin(current_action_->Type());
   current_action_->PerformAction();
 }
 
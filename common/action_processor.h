@@ -24,6 +24,7 @@
 #include <android-base/macros.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/tracing.h"
 
 #include <gtest/gtest_prod.h>
 
@@ -105,6 +106,9 @@ class ActionProcessor {
   // A pointer to the currently processing Action, if any.
   std::unique_ptr<AbstractAction> current_action_;
 
+  // Traces |current_action_| from its start to its completion.
+  TraceSpan action_span_;
+
   // The ErrorCode reported by an action that was suspended but finished while
   // being suspended. This error code is stored here to be reported back to the
   // delegate once the processor is resumed.
@@ -0,0 +1,159 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/async_io_ring.h"
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <array>
+#include <utility>
+
+#include <base/bind.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+// Maximum number of completions handled per batch.
+constexpr size_t kCompletionBatchSize = 32;
+}  // namespace
+
+std::unique_ptr<AsyncIoRing> AsyncIoRing::Create(unsigned int queue_depth) {
+  auto ring =
+      io_uring_cpp::IoUringInterface::CreateLinuxIoUring(queue_depth, 0);
+  if (!ring) {
+    LOG(INFO) << "io_uring isn't available";
+    return nullptr;
+  }
+  base::ScopedFD event_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  if (!event_fd.is_valid()) {
+    PLOG(ERROR) << "Unable to create an eventfd";
+    return nullptr;
+  }
+  const auto ret = ring->RegisterEventfd(event_fd.get());
+  if (!ret.IsOk()) {
+    LOG(ERROR) << "Unable to register an eventfd with io_uring: " << ret;
+    return nullptr;
+  }
+  return std::unique_ptr<AsyncIoRing>(
+      new AsyncIoRing(std::move(ring), std::move(event_fd)));
+}
+
+AsyncIoRing::AsyncIoRing(std::unique_ptr<io_uring_cpp::IoUringInterface> ring,
+                         base::ScopedFD event_fd)
+    : ring_(std::move(ring)), eventfd_(std::move(event_fd)) {
+  controller_ = base::FileDescriptorWatcher::WatchReadable(
+      eventfd_.get(),
+      base::BindRepeating(&AsyncIoRing::OnEventfdReadable,
+                          base::Unretained(this)));
+}
+
+AsyncIoRing::~AsyncIoRing() {
+  controller_.reset();
+  // The kernel may still be using the buffers of the operations in flight,
+  // which the callers may release as soon as the ring is gone.
+  while (in_flight_ > 0) {
+    auto cqe = ring_->PopCQE();
+    if (cqe.IsErr() && cqe.GetError().ErrCode() == EINTR)
+      continue;
+    CHECK(cqe.IsOk()) << "Failed to wait for an io_uring operation: "
+                      << cqe.GetError();
+    in_flight_--;
+  }
+  if (!ring_->UnregisterEventfd().IsOk())
+    LOG(WARNING) << "Unable to unregister the eventfd of io_uring";
+}
+
+bool AsyncIoRing::Read(
+    int fd, void* buffer, size_t size, uint64_t offset, Callback callback) {
+  return AddOperation(ring_->PrepRead(fd, buffer, size, offset),
+                      std::move(callback));
+}
+
+bool AsyncIoRing::Write(int fd,
+                        const void* buffer,
+                        size_t size,
+                        uint64_t offset,
+                        Callback callback) {
+  return AddOperation(ring_->PrepWrite(fd, buffer, size, offset),
+                      std::move(callback));
+}
+
+bool AsyncIoRing::Fsync(int fd, Callback callback) {
+  return AddOperation(ring_->PrepFsync(fd), std::move(callback));
+}
+
+bool AsyncIoRing::Submit() {
+  if (queued_ == 0)
+    return true;
+  const auto result = ring_->Submit();
+  if (!result.IsOk()) {
+    LOG(ERROR) << "Unable to submit io_uring operations: " << result.ErrMsg();
+    return false;
+  }
+  queued_ -= result.EntriesSubmitted();
+  in_flight_ += result.EntriesSubmitted();
+  return true;
+}
+
+bool AsyncIoRing::AddOperation(io_uring_cpp::IoUringSQE sqe,
+                               Callback callback) {
+  if (!sqe.IsOk()) {
+    LOG(WARNING) << "The io_uring submission queue is full";
+    return false;
+  }
+  const uint64_t id = next_id_++;
+  sqe.SetData(id);
+  callbacks_.emplace(id, std::move(callback));
+  queued_++;
+  return true;
+}
+
+void AsyncIoRing::OnEventfdReadable() {
+  uint64_t count = 0;
+  if (HANDLE_EINTR(read(eventfd_.get(), &count, sizeof(count))) < 0 &&
+      errno != EAGAIN) {
+    PLOG(WARNING) << "Unable to read the eventfd of io_uring";
+  }
+  // A callback may destroy the ring, which stops the dispatch.
+  auto weak_this = weak_ptr_factory_.GetWeakPtr();
+  std::array<io_uring_cpp::IoUringCQE, kCompletionBatchSize> cqes;
+  while (weak_this) {
+    const auto popped = ring_->PopCQEs(0, {cqes.data(), cqes.size()});
+    if (popped.IsErr()) {
+      LOG(ERROR) << "Unable to get the io_uring completions: "
+                 << popped.GetError();
+      return;
+    }
+    const size_t num_cqes = popped.GetResult();
+    if (num_cqes == 0)
+      return;
+    in_flight_ -= num_cqes;
+    for (size_t i = 0; i < num_cqes && weak_this; i++) {
+      const auto it = callbacks_.find(cqes[i].GetData<uint64_t>());
+      if (it == callbacks_.end())
+        continue;
+      Callback callback = std::move(it->second);
+      callbacks_.erase(it);
+      std::move(callback).Run(cqes[i].res);
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,106 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_ASYNC_IO_RING_H_
+#define UPDATE_ENGINE_COMMON_ASYNC_IO_RING_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+
+#include <base/callback.h>
+#include <base/files/file_descriptor_watcher_posix.h>
+#include <base/files/scoped_file.h>
+#include <base/memory/weak_ptr.h>
+#include <android-base/macros.h>
+#include <liburing_cpp/IoUring.h>
+
+namespace chromeos_update_engine {
+
+// An io_uring whose completions are delivered on the current message loop,
+// so a single-threaded caller can keep several reads and writes in flight
+// without blocking the loop or polling. The ring signals an eventfd watched by
+// the loop whenever operations complete, and the callback of each completed
+// operation then runs from the loop.
+class AsyncIoRing {
+ public:
+  // Called with the number of bytes transferred, or a negative errno if the
+  // operation failed.
+  using Callback = base::OnceCallback<void(int result)>;
+
+  // Returns nullptr if io_uring isn't available. Requires a message loop
+  // watching file descriptors on the current thread.
+  static std::unique_ptr<AsyncIoRing> Create(unsigned int queue_depth);
+
+  // Blocks until the operations in flight complete, without running their
+  // callbacks.
+  ~AsyncIoRing();
+
+  // Queue a positioned read or write of |size| bytes of |fd|, or an fsync of
+  // |fd|, calling |callback| from the message loop once it completes. The
+  // operations are only started by Submit(). Return false if the queue is
+  // full. |buffer| must stay valid until |callback| runs or the ring is
+  // destroyed.
+  bool Read(int fd,
+            void* buffer,
+            size_t size,
+            uint64_t offset,
+            Callback callback);
+  bool Write(int fd,
+             const void* buffer,
+             size_t size,
+             uint64_t offset,
+             Callback callback);
+  bool Fsync(int fd, Callback callback);
+
+  // Starts the queued operations.
+  bool Submit();
+
+  // Number of operations queued or in flight whose callback didn't run yet.
+  size_t pending() const { return callbacks_.size(); }
+
+ private:
+  AsyncIoRing(std::unique_ptr<io_uring_cpp::IoUringInterface> ring,
+              base::ScopedFD event_fd);
+
+  // Records |callback| for the operation |sqe| was queued for.
+  bool AddOperation(io_uring_cpp::IoUringSQE sqe, Callback callback);
+
+  // Called from the message loop when |eventfd_| is signaled, runs the
+  // callbacks of all the completed operations.
+  void OnEventfdReadable();
+
+  std::unique_ptr<io_uring_cpp::IoUringInterface> ring_;
+  base::ScopedFD eventfd_;
+  std::unique_ptr<base::FileDescriptorWatcher::Controller> controller_;
+
+  // The callback of each operation not completed yet, by the id stored in its
+  // submission.
+  std::map<uint64_t, Callback> callbacks_;
+  uint64_t next_id_{0};
+  // Number of operations queued with Read(), Write() or Fsync() since the last
+  // Submit(), and number of submitted operations not completed yet.
+  size_t queued_{0};
+  size_t in_flight_{0};
+
+  base::WeakPtrFactory<AsyncIoRing> weak_ptr_factory_{this};
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncIoRing);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_ASYNC_IO_RING_H_
@@ -0,0 +1,158 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/async_io_ring.h"
+
+#include <errno.h>
+
+#include <memory>
+#include <string>
+
+#include <base/bind.h>
+#if BASE_VER < 780000  // Android
+#include <base/message_loop/message_loop.h>
+#else
+#include <base/task/single_thread_task_executor.h>
+#endif  // BASE_VER < 780000
+#include <base/time/time.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_engine {
+
+class AsyncIoRingTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    ring_ = AsyncIoRing::Create(8);
+    if (!ring_)
+      GTEST_SKIP() << "io_uring isn't available";
+  }
+
+  // Runs the message loop until all the callbacks of |ring_| ran.
+  void RunUntilDone() {
+    brillo::MessageLoopRunUntil(
+        &loop_,
+        TimeDelta::FromSeconds(10),
+        base::Bind([](AsyncIoRing* ring) { return ring->pending() == 0; },
+                   base::Unretained(ring_.get())));
+    EXPECT_EQ(0U, ring_->pending());
+  }
+
+#if BASE_VER < 780000  // Android
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+#else   // Chrome OS
+  base::SingleThreadTaskExecutor base_loop_{base::MessagePumpType::IO};
+  brillo::BaseMessageLoop loop_{base_loop_.task_runner()};
+#endif  // BASE_VER < 780000
+  std::unique_ptr<AsyncIoRing> ring_;
+  ScopedTempFile file_{"AsyncIoRingTest-file.XXXXXX", true};
+};
+
+TEST_F(AsyncIoRingTest, WriteAndReadTest) {
+  const string data(8192, 'w');
+  int write_result = 0;
+  int fsync_result = -1;
+  ASSERT_TRUE(ring_->Write(
+      file_.fd(),
+      data.data(),
+      data.size(),
+      0,
+      base::BindOnce([](int* out, int result) { *out = result; },
+                     &write_result)));
+  ASSERT_TRUE(ring_->Submit());
+  RunUntilDone();
+  EXPECT_EQ(static_cast<int>(data.size()), write_result);
+
+  ASSERT_TRUE(ring_->Fsync(
+      file_.fd(),
+      base::BindOnce([](int* out, int result) { *out = result; },
+                     &fsync_result)));
+  ASSERT_TRUE(ring_->Submit());
+  RunUntilDone();
+  EXPECT_EQ(0, fsync_result);
+
+  // Both halves are read at once.
+  string read_data(data.size(), '\0');
+  int read_results[2] = {0, 0};
+  for (size_t i = 0; i < 2; i++) {
+    ASSERT_TRUE(ring_->Read(
+        file_.fd(),
+        &read_data[i * 4096],
+        4096,
+        i * 4096,
+        base::BindOnce([](int* out, int result) { *out = result; },
+                       &read_results[i])));
+  }
+  EXPECT_EQ(2U, ring_->pending());
+  ASSERT_TRUE(ring_->Submit());
+  RunUntilDone();
+  EXPECT_EQ(4096, read_results[0]);
+  EXPECT_EQ(4096, read_results[1]);
+  EXPECT_EQ(data, read_data);
+}
+
+TEST_F(AsyncIoRingTest, ErrorTest) {
+  char buffer[16];
+  int read_result = 0;
+  ASSERT_TRUE(ring_->Read(
+      -1,
+      buffer,
+      sizeof(buffer),
+      0,
+      base::BindOnce([](int* out, int result) { *out = result; },
+                     &read_result)));
+  ASSERT_TRUE(ring_->Submit());
+  RunUntilDone();
+  EXPECT_EQ(-EBADF, read_result);
+}
+
+TEST_F(AsyncIoRingTest, DestroyInCallbackTest) {
+  // The ring may be destroyed by the callback of one of its operations.
+  string data(4096, 'd');
+  ASSERT_TRUE(test_utils::WriteFileString(file_.path(), data));
+  bool called = false;
+  ASSERT_TRUE(ring_->Read(file_.fd(),
+                          &data[0],
+                          data.size(),
+                          0,
+                          base::BindOnce(
+                              [](std::unique_ptr<AsyncIoRing>* ring,
+                                 bool* out,
+                                 int result) {
+                                *out = true;
+                                ring->reset();
+                              },
+                              &ring_,
+                              &called)));
+  ASSERT_TRUE(ring_->Submit());
+  brillo::MessageLoopRunUntil(
+      &loop_,
+      TimeDelta::FromSeconds(10),
+      base::Bind([](bool* out) { return *out; }, &called));
+  EXPECT_TRUE(called);
+  EXPECT_EQ(nullptr, ring_);
+}
+
+}  // namespace chromeos_update_engine
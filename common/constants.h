@@ -44,6 +44,11 @@ static constexpr const auto& kPostinstallDefaultScript = "postinst";
 static constexpr const auto& kPrefsAttemptInProgress = "attempt-in-progress";
 static constexpr const auto& kPrefsBackoffExpiryTime = "backoff-expiry-time";
 static constexpr const auto& kPrefsBootId = "boot-id";
+static constexpr const auto& kPrefsCheckpointCount = "checkpoint-count";
+static constexpr const auto& kPrefsCheckpointDurationMs =
+    "checkpoint-duration-ms";
+static constexpr const auto& kPrefsCheckpointMaxDurationMs =
+    "checkpoint-max-duration-ms";
 static constexpr const auto& kPrefsCurrentBytesDownloaded =
     "current-bytes-downloaded";
 static constexpr const auto& kPrefsCurrentResponseSignature =
@@ -55,11 +60,16 @@ static constexpr const auto& kPrefsDailyMetricsLastReportedAt =
     "daily-metrics-last-reported-at";
 static constexpr const auto& kPrefsDeltaUpdateFailures =
     "delta-update-failures";
+static constexpr const auto& kPrefsDynamicPartitionMetadataSlots =
+    "dynamic-partition-metadata-slots";
 static constexpr const auto& kPrefsDynamicPartitionMetadataUpdated =
     "dynamic-partition-metadata-updated";
 static constexpr const auto& kPrefsFullPayloadAttemptNumber =
     "full-payload-attempt-number";
 static constexpr const auto& kPrefsInstallDateDays = "install-date-days";
+static constexpr const auto& kPrefsIoBoostedWriteBandwidth =
+    "io-boosted-write-bandwidth";
+static constexpr const auto& kPrefsIoWriteBandwidth = "io-write-bandwidth";
 static constexpr const auto& kPrefsLastActivePingDay = "last-active-ping-day";
 static constexpr const auto& kPrefsLastRollCallPingDay =
     "last-roll-call-ping-day";
@@ -99,6 +109,10 @@ static constexpr const auto& kPrefsResumedUpdateFailures =
     "resumed-update-failures";
 static constexpr const auto& kPrefsRollbackHappened = "rollback-happened";
 static constexpr const auto& kPrefsRollbackVersion = "rollback-version";
+static constexpr const auto& kPrefsStagedPayloadHash = "staged-payload-hash";
+static constexpr const auto& kPrefsStagedPayloadSHA256Context =
+    "staged-payload-sha-256-context";
+static constexpr const auto& kPrefsStagedPayloadSize = "staged-payload-size";
 static constexpr const auto& kPrefsChannelOnSlotPrefix = "channel-on-slot-";
 static constexpr const auto& kPrefsSystemUpdatedMarker =
     "system-updated-marker";
@@ -134,6 +148,10 @@ static constexpr const auto& kPrefsUpdateStateNextDataOffset =
     "update-state-next-data-offset";
 static constexpr const auto& kPrefsUpdateStateNextOperation =
     "update-state-next-operation";
+static constexpr const auto& kPrefsUpdateStateOperationSHA256Context =
+    "update-state-operation-sha-256-context";
+static constexpr const auto& kPrefsUpdateStatePartitionOperations =
+    "update-state-partition-operations";
 static constexpr const auto& kPrefsUpdateStatePayloadIndex =
     "update-state-payload-index";
 static constexpr const auto& kPrefsUpdateStateSHA256Context =
@@ -148,6 +166,14 @@ static constexpr const auto& kPrefsUpdateTimestampStart =
     "update-timestamp-start";
 static constexpr const auto& kPrefsUrlSwitchCount = "url-switch-count";
 static constexpr const auto& kPrefsVerityWritten = "verity-written";
+static constexpr const auto& kPrefsVerifiedSourceHashes =
+    "verified-source-hashes";
+static constexpr const auto& kPrefsVerifyPartitionIndex =
+    "verify-partition-index";
+static constexpr const auto& kPrefsVerifyPartitionOffset =
+    "verify-partition-offset";
+static constexpr const auto& kPrefsVerifySHA256Context =
+    "verify-sha256-context";
 static constexpr const auto& kPrefsWallClockScatteringWaitPeriod =
     "wall-clock-wait-period";
 static constexpr const auto& kPrefsWallClockStagingWaitPeriod =
@@ -188,10 +214,85 @@ static constexpr const auto& kPayloadDisableVABC = "DISABLE_VABC";
 static constexpr const auto& kPayloadEnableThreading = "ENABLE_THREADING";
 // Enable batched writes for VABC
 static constexpr const auto& kPayloadBatchedWrites = "BATCHED_WRITES";
+// Number of worker threads used to apply install operations, values <= 1 keep
+// applying operations on the update thread.
+static constexpr const auto& kPayloadApplyThreads = "APPLY_THREADS";
+// Memory budget in MiB for operations applied on worker threads.
+static constexpr const auto& kPayloadApplyMemoryLimitMb =
+    "APPLY_MEMORY_LIMIT_MB";
+// Soft limit in MiB of the memory of all the buffers of the update, past which
+// fewer workers run, see MemoryAccounting.
+static constexpr const auto& kPayloadMemorySoftLimitMb = "MEMORY_SOFT_LIMIT_MB";
+// Size in MiB up to which consecutive VABC block writes are batched.
+static constexpr const auto& kPayloadCowBatchSizeMb = "COW_BATCH_SIZE_MB";
+// Number of upcoming operations whose source is read and verified in the
+// background while their data downloads, 0 disables it.
+static constexpr const auto& kPayloadSourcePrefetchOps = "SOURCE_PREFETCH_OPS";
+// Set "REUSE_APPLIED_OPERATIONS=1" to skip operations whose target a previous
+// attempt already wrote when the update has to start over.
+static constexpr const auto& kPayloadReuseAppliedOperations =
+    "REUSE_APPLIED_OPERATIONS";
+// Set "SYNC_ON_CHECKPOINT=1" to write the partitions without waiting for every
+// write to reach the storage, syncing them on checkpoints instead.
+static constexpr const auto& kPayloadSyncOnCheckpoint = "SYNC_ON_CHECKPOINT";
+// Set "HUGE_PAGE_BUFFERS=1" to back the large I/O buffers with huge pages.
+static constexpr const auto& kPayloadHugePageBuffers = "HUGE_PAGE_BUFFERS";
+// Size in MiB of the downloaded data buffered in memory ahead of the applied
+// data, and of the file it spills to once that is full.
+static constexpr const auto& kPayloadDownloadAheadMb = "DOWNLOAD_AHEAD_MB";
+static constexpr const auto& kPayloadDownloadAheadSpillMb =
+    "DOWNLOAD_AHEAD_SPILL_MB";
+// Minimum milliseconds between two reports of the download progress, e.g.
+// "PROGRESS_INTERVAL_MS=200". 0, the default, reports every received chunk.
+static constexpr const auto& kPayloadProgressIntervalMs =
+    "PROGRESS_INTERVAL_MS";
+// Set "PREPARE_PARTITIONS_ASYNC=1" to keep receiving the payload data until
+// the main loop gets to prepare the partitions for the update.
+static constexpr const auto& kPayloadPreparePartitionsAsync =
+    "PREPARE_PARTITIONS_ASYNC";
+// Number of partitions verified in parallel after the update, e.g.
+// "VERIFY_THREADS=4", and the read bandwidth in MiB/s they share.
+static constexpr const auto& kPayloadVerifyThreads = "VERIFY_THREADS";
+static constexpr const auto& kPayloadVerifyReadMbPerSecond =
+    "VERIFY_READ_MB_PER_SECOND";
+// Set "VERIFY_DIRECT_IO=1" to verify partitions with reads bypassing the page
+// cache.
+static constexpr const auto& kPayloadVerifyDirectIo = "VERIFY_DIRECT_IO";
+// Set "VERIFY_FROM_COW=1" to verify the Virtual A/B Compression snapshots by
+// reading their COW and source partitions in process instead of through
+// snapuserd.
+static constexpr const auto& kPayloadVerifyFromCow = "VERIFY_FROM_COW";
+// Set "VERIFY_SEGMENTS=1" to verify the target partitions against the per
+// segment hashes of the payload, skipping segments only written by source
+// copies.
+static constexpr const auto& kPayloadVerifySegments = "VERIFY_SEGMENTS";
+// Set "EARLY_VERIFY=1" to hash each target partition as soon as it is written,
+// while the following ones are applied.
+static constexpr const auto& kPayloadEarlyVerify = "EARLY_VERIFY";
+// Set "STAGE_PAYLOAD=1" to only download and verify the payload to /data at a
+// low I/O priority. A later request for the same payload applies the staged
+// copy instead of downloading it.
+static constexpr const auto& kPayloadStagePayload = "STAGE_PAYLOAD";
 
 // Max retry count for download
 static constexpr const auto& kPayloadDownloadRetry = "DOWNLOAD_RETRY";
 
+// Number of connections the payload is downloaded over in parallel, e.g.
+// "DOWNLOAD_CONNECTIONS=4". Defaults to a single connection.
+static constexpr const auto& kPayloadDownloadConnections =
+    "DOWNLOAD_CONNECTIONS";
+
+// Cache peer on the local network asked for the payload before the origin
+// server, e.g. "PEER_CACHE_URL=http://192.168.1.10:8080". The peer serves the
+// payload under the path of the payload URL.
+static constexpr const auto& kPayloadPeerCacheUrl = "PEER_CACHE_URL";
+
+// Set "COMPRESSED_TRANSFER=1" to ask the server to gzip the payload ranges on
+// the wire with a Transfer-Encoding. Payload offsets keep referring to the
+// uncompressed payload. Only honored over HTTP/1.1.
+static constexpr const auto& kPayloadCompressedTransfer =
+    "COMPRESSED_TRANSFER";
+
 // Set "SWITCH_SLOT_ON_REBOOT=0" to skip marking the updated partitions active.
 // The default is 1 (always switch slot if update succeeded).
 static constexpr const auto& kPayloadPropertySwitchSlotOnReboot =
@@ -16,6 +16,8 @@
 
 #include "update_engine/common/cow_operation_convert.h"
 
+#include <algorithm>
+
 #include <base/logging.h>
 
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -24,6 +26,71 @@
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// The blocks [start, end).
+struct BlockRange {
+  uint64_t start;
+  uint64_t end;
+};
+
+// Sorts |ranges| and merges the ones overlapping or touching each other.
+void SortAndMergeRanges(std::vector<BlockRange>* ranges) {
+  std::sort(ranges->begin(),
+            ranges->end(),
+            [](const BlockRange& a, const BlockRange& b) {
+              return a.start < b.start;
+            });
+  size_t merged = 0;
+  for (const BlockRange& range : *ranges) {
+    if (merged > 0 && (*ranges)[merged - 1].end >= range.start) {
+      (*ranges)[merged - 1].end =
+          std::max((*ranges)[merged - 1].end, range.end);
+    } else {
+      (*ranges)[merged++] = range;
+    }
+  }
+  ranges->resize(merged);
+}
+
+// Appends CowReplace operations copying the |count| blocks at |src_block| to
+// |dst_block|, except for the destination blocks in |copy_ranges|, which are
+// sorted and disjoint.
+void AddReplaceBlocks(const std::vector<BlockRange>& copy_ranges,
+                      uint64_t src_block,
+                      uint64_t dst_block,
+                      uint64_t count,
+                      std::vector<CowOperation>* converted) {
+  const uint64_t dst_end = dst_block + count;
+  uint64_t next = dst_block;
+  for (auto it = std::upper_bound(copy_ranges.begin(),
+                                  copy_ranges.end(),
+                                  dst_block,
+                                  [](uint64_t block, const BlockRange& range) {
+                                    return block < range.end;
+                                  });
+       it != copy_ranges.end() && it->start < dst_end;
+       ++it) {
+    if (it->start > next) {
+      push_back(converted,
+                {CowOperation::CowReplace,
+                 src_block + (next - dst_block),
+                 next,
+                 it->start - next});
+    }
+    next = it->end;
+  }
+  if (next < dst_end) {
+    push_back(converted,
+              {CowOperation::CowReplace,
+               src_block + (next - dst_block),
+               next,
+               dst_end - next});
+  }
+}
+
+}  // namespace
+
 void push_back(std::vector<CowOperation>* converted, const CowOperation& op) {
   if (!converted->empty() && IsConsecutive(converted->back(), op)) {
     converted->back().block_count += op.block_count;
@@ -37,9 +104,24 @@ std::vector<CowOperation> ConvertToCowOperations(
         ::chromeos_update_engine::InstallOperation>& operations,
     const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
         merge_operations) {
-  ExtentRanges merge_extents;
+  std::vector<BlockRange> copy_ranges;
   std::vector<CowOperation> converted;
 
+  size_t copy_blocks = 0;
+  for (const auto& merge_op : merge_operations) {
+    if (merge_op.type() == CowMergeOperation::COW_COPY) {
+      copy_blocks += merge_op.src_extent().num_blocks();
+    }
+  }
+  size_t replace_runs = 0;
+  for (const auto& operation : operations) {
+    if (operation.type() == InstallOperation::SOURCE_COPY) {
+      replace_runs += operation.dst_extents_size();
+    }
+  }
+  copy_ranges.reserve(merge_operations.size());
+  converted.reserve(copy_blocks + replace_runs);
+
   // We want all CowCopy ops to be done first, before any COW_REPLACE happen.
   // Therefore we add these ops in 2 separate loops. This is because during
   // merge, a CowReplace might modify a block needed by CowCopy, so we always
@@ -51,9 +133,13 @@ std::vector<CowOperation> ConvertToCowOperations(
     if (merge_op.type() != CowMergeOperation::COW_COPY) {
       continue;
     }
-    merge_extents.AddExtent(merge_op.dst_extent());
     const auto& src_extent = merge_op.src_extent();
     const auto& dst_extent = merge_op.dst_extent();
+    if (dst_extent.num_blocks() > 0) {
+      copy_ranges.push_back(
+          {dst_extent.start_block(),
+           dst_extent.start_block() + dst_extent.num_blocks()});
+    }
     // Add blocks in reverse order, because snapused specifically prefers this
     // ordering. Since we already eliminated all self-overlapping SOURCE_COPY
     // during delta generation, this should be safe to do.
@@ -63,25 +149,42 @@ std::vector<CowOperation> ConvertToCowOperations(
       converted.push_back({CowOperation::CowCopy, src_block, dst_block, 1});
     }
   }
+  SortAndMergeRanges(&copy_ranges);
+
   // COW_REPLACE are added after COW_COPY, because replace might modify blocks
   // needed by COW_COPY. Please don't merge this loop with the previous one.
   for (const auto& operation : operations) {
     if (operation.type() != InstallOperation::SOURCE_COPY) {
       continue;
     }
+    // Walks the source and destination extents in lockstep, one run of blocks
+    // contiguous in both at a time.
     const auto& src_extents = operation.src_extents();
     const auto& dst_extents = operation.dst_extents();
-    BlockIterator it1{src_extents};
-    BlockIterator it2{dst_extents};
-    while (!it1.is_end() && !it2.is_end()) {
-      const auto src_block = *it1;
-      const auto dst_block = *it2;
-      if (!merge_extents.ContainsBlock(dst_block)) {
-        push_back(&converted,
-                  {CowOperation::CowReplace, src_block, dst_block, 1});
+    int src_index = 0;
+    int dst_index = 0;
+    uint64_t src_offset = 0;
+    uint64_t dst_offset = 0;
+    while (src_index < src_extents.size() && dst_index < dst_extents.size()) {
+      const Extent& src_extent = src_extents[src_index];
+      const Extent& dst_extent = dst_extents[dst_index];
+      const uint64_t count = std::min(src_extent.num_blocks() - src_offset,
+                                      dst_extent.num_blocks() - dst_offset);
+      AddReplaceBlocks(copy_ranges,
+                       src_extent.start_block() + src_offset,
+                       dst_extent.start_block() + dst_offset,
+                       count,
+                       &converted);
+      src_offset += count;
+      dst_offset += count;
+      if (src_offset == src_extent.num_blocks()) {
+        src_index++;
+        src_offset = 0;
+      }
+      if (dst_offset == dst_extent.num_blocks()) {
+        dst_index++;
+        dst_offset = 0;
       }
-      ++it1;
-      ++it2;
     }
   }
   return converted;
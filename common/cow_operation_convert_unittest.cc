@@ -297,4 +297,31 @@ TEST_F(CowOperationConvertTest, CowReplaceDifferenceSrc) {
   VerifyCowMergeOp(cow_ops);
 }
 
+TEST_F(CowOperationConvertTest, CowReplaceAroundCowCopy) {
+  AddOperation(&operations_,
+               InstallOperation::SOURCE_COPY,
+               {{100, 4}, {200, 6}},
+               {{0, 6}, {10, 4}});
+  // Unsorted and touching COW_COPY destinations.
+  AddMergeOperation(
+      &merge_operations_, CowMergeOperation::COW_COPY, {203, 1}, {11, 1});
+  AddMergeOperation(
+      &merge_operations_, CowMergeOperation::COW_COPY, {102, 1}, {2, 1});
+  AddMergeOperation(
+      &merge_operations_, CowMergeOperation::COW_COPY, {101, 1}, {1, 1});
+
+  auto cow_ops = ConvertToCowOperations(operations_, merge_operations_);
+  const std::vector<std::array<uint64_t, 3>> expected_replace = {
+      {100, 0, 1}, {103, 3, 1}, {200, 4, 2}, {202, 10, 1}, {204, 12, 2}};
+  ASSERT_EQ(cow_ops.size(), 3 + expected_replace.size());
+  for (size_t i = 0; i < expected_replace.size(); i++) {
+    const auto& op = cow_ops[3 + i];
+    ASSERT_EQ(op.op, CowOperation::CowReplace) << op;
+    ASSERT_EQ(op.src_block, expected_replace[i][0]) << op;
+    ASSERT_EQ(op.dst_block, expected_replace[i][1]) << op;
+    ASSERT_EQ(op.block_count, expected_replace[i][2]) << op;
+  }
+  VerifyCowMergeOp(cow_ops);
+}
+
 }  // namespace chromeos_update_engine
@@ -25,7 +25,11 @@
 #include <string>
 #include <utility>
 
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+
 #include "update_engine/common/boot_control_interface.h"
+#include "update_engine/common/download_ahead_buffer.h"
 #include "update_engine/common/http_fetcher.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/payload_consumer/delta_performer.h"
@@ -59,6 +63,11 @@ class DownloadActionDelegate {
   // while applying or downloading the partial payload will result in this
   // method not being called.
   virtual void DownloadComplete() = 0;
+
+  // Called once all operations of |partition_name| were applied, with how
+  // long they took.
+  virtual void PartitionOperationsTimed(const std::string& partition_name,
+                                        const OperationTimings& timings) {}
 };
 
 class PrefsInterface;
@@ -110,6 +119,13 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
 
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
+  // Returns the number of payload bytes received but not applied yet.
+  size_t GetBufferedBytes() const;
+
+  // Sets |stats| to the state of the worker threads applying the payload,
+  // see DeltaPerformer::GetPipelineStats().
+  bool GetPipelineStats(OperationPipeline::Stats* stats) const;
+
  private:
   // Attempt to load cached manifest data from prefs
   // return true on success, false otherwise.
@@ -118,6 +134,31 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Start downloading the current payload using delta_performer.
   void StartDownloading();
 
+  // Reports the bytes received since the last report to |delegate_|, unless
+  // InstallPlan::progress_interval_ms didn't elapse since then and |force| is
+  // false.
+  void ReportProgress(bool force);
+
+  // Passes |length| bytes to |delta_performer_|, setting |code_| on failure.
+  bool WriteToDeltaPerformer(const void* bytes, size_t length);
+
+  // Applies a slice of the |download_ahead_| data, one slice per message
+  // loop iteration so that the fetcher keeps receiving data in between.
+  void ApplyBufferedData();
+  void ScheduleApplyBufferedData();
+
+  // Pauses the fetcher while the action is suspended or |download_ahead_| is
+  // full, unpauses it otherwise. Unpausing may complete the transfer, so this
+  // must be the last thing a caller does.
+  void UpdateFetcherPaused();
+
+  // Closes and verifies the payload once the transfer completed and all its
+  // data was applied.
+  void FinishTransfer(bool successful);
+
+  // Drops the buffered data and stops applying it.
+  void ClearBufferedData();
+
   // Pointer to the current payload in install_plan_.payloads.
   InstallPlan::Payload* payload_{nullptr};
 
@@ -146,6 +187,10 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   uint64_t bytes_received_previous_payloads_{0};
   uint64_t bytes_total_{0};
   bool download_active_{false};
+  // Bytes received but not reported to |delegate_| yet, and when the progress
+  // was last reported.
+  uint64_t bytes_progressed_pending_{0};
+  base::TimeTicks last_progress_time_;
 
   // Loaded from prefs before downloading any payload.
   size_t resume_payload_index_{0};
@@ -156,6 +201,16 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // The path to the zip file with X509 certificates.
   const std::string update_certificates_path_;
 
+  // Holds the received data until |delta_performer_| applies it when
+  // InstallPlan::download_ahead_size is set, so that downloading continues
+  // while operations are applied. Null otherwise.
+  std::unique_ptr<DownloadAheadBuffer> download_ahead_;
+  brillo::MessageLoop::TaskId apply_task_id_{brillo::MessageLoop::kTaskIdNull};
+  // Whether the transfer completed successfully with data still buffered.
+  bool transfer_complete_pending_{false};
+  bool suspended_{false};
+  bool fetcher_paused_{false};
+
   DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
@@ -0,0 +1,161 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/download_ahead_buffer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+DownloadAheadBuffer::DownloadAheadBuffer(size_t memory_limit,
+                                         const std::string& spill_path,
+                                         size_t spill_limit)
+    : memory_limit_(memory_limit),
+      spill_path_(spill_path),
+      spill_limit_(spill_path.empty() ? 0 : spill_limit) {}
+
+DownloadAheadBuffer::~DownloadAheadBuffer() {
+  if (spill_fd_.ok()) {
+    spill_fd_.reset();
+    unlink(spill_path_.c_str());
+  }
+}
+
+bool DownloadAheadBuffer::Init() {
+  if (spill_limit_ == 0)
+    return true;
+  spill_fd_.reset(HANDLE_EINTR(open(spill_path_.c_str(),
+                                    O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                    0600)));
+  if (!spill_fd_.ok()) {
+    PLOG(ERROR) << "Failed to create " << spill_path_;
+    return false;
+  }
+  return true;
+}
+
+bool DownloadAheadBuffer::Append(const void* data, size_t size) {
+  if (size == 0)
+    return true;
+  const auto bytes = static_cast<const uint8_t*>(data);
+  if (spill_size_ == 0 && tail_size_ == 0 &&
+      (head_size_ + size <= memory_limit_ || size > spill_limit_)) {
+    head_.emplace_back(bytes, bytes + size);
+    head_size_ += size;
+    memory_charge_.Set(head_size_ + tail_size_);
+    return true;
+  }
+  if (tail_size_ == 0 && spill_size_ + size <= spill_limit_) {
+    return WriteSpill(bytes, size);
+  }
+  tail_.emplace_back(bytes, bytes + size);
+  tail_size_ += size;
+  memory_charge_.Set(head_size_ + tail_size_);
+  return true;
+}
+
+bool DownloadAheadBuffer::Pop(size_t max_size, brillo::Blob* out) {
+  out->clear();
+  if (head_size_ == 0 && spill_size_ > 0) {
+    const size_t size = std::min(max_size, spill_size_);
+    out->resize(size);
+    if (!ReadSpill(out->data(), size))
+      return false;
+    PromoteTail();
+    return true;
+  }
+  while (out->size() < max_size && !head_.empty()) {
+    const brillo::Blob& front = head_.front();
+    const size_t size =
+        std::min(max_size - out->size(), front.size() - head_offset_);
+    out->insert(out->end(),
+                front.begin() + head_offset_,
+                front.begin() + head_offset_ + size);
+    head_offset_ += size;
+    head_size_ -= size;
+    if (head_offset_ == front.size()) {
+      head_.pop_front();
+      head_offset_ = 0;
+    }
+  }
+  PromoteTail();
+  memory_charge_.Set(head_size_ + tail_size_);
+  return true;
+}
+
+void DownloadAheadBuffer::Clear() {
+  head_.clear();
+  head_size_ = head_offset_ = 0;
+  spill_start_ = spill_size_ = 0;
+  tail_.clear();
+  tail_size_ = 0;
+  memory_charge_.Set(0);
+}
+
+void DownloadAheadBuffer::PromoteTail() {
+  if (head_size_ > 0 || spill_size_ > 0 || tail_size_ == 0)
+    return;
+  head_.swap(tail_);
+  head_size_ = tail_size_;
+  tail_size_ = 0;
+}
+
+bool DownloadAheadBuffer::WriteSpill(const uint8_t* data, size_t size) {
+  // The ring may wrap around the end of the file.
+  size_t offset = (spill_start_ + spill_size_) % spill_limit_;
+  while (size > 0) {
+    const size_t chunk = std::min(size, spill_limit_ - offset);
+    if (!utils::PWriteAll(spill_fd_.get(), data, chunk, offset)) {
+      PLOG(ERROR) << "Failed to write to " << spill_path_;
+      return false;
+    }
+    spill_size_ += chunk;
+    data += chunk;
+    size -= chunk;
+    offset = 0;
+  }
+  return true;
+}
+
+bool DownloadAheadBuffer::ReadSpill(uint8_t* data, size_t size) {
+  while (size > 0) {
+    const size_t chunk = std::min(size, spill_limit_ - spill_start_);
+    ssize_t bytes_read = 0;
+    if (!utils::PReadAll(
+            spill_fd_.get(), data, chunk, spill_start_, &bytes_read) ||
+        static_cast<size_t>(bytes_read) != chunk) {
+      PLOG(ERROR) << "Failed to read from " << spill_path_;
+      return false;
+    }
+    spill_start_ = (spill_start_ + chunk) % spill_limit_;
+    spill_size_ -= chunk;
+    data += chunk;
+    size -= chunk;
+  }
+  if (spill_size_ == 0)
+    spill_start_ = 0;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
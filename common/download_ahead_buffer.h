@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_DOWNLOAD_AHEAD_BUFFER_H_
+#define UPDATE_ENGINE_COMMON_DOWNLOAD_AHEAD_BUFFER_H_
+
+#include <cstddef>
+#include <deque>
+#include <string>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/memory_accounting.h"
+
+namespace chromeos_update_engine {
+
+// A FIFO of downloaded bytes waiting to be applied. Up to |memory_limit|
+// bytes are kept in memory, data arriving while that is full goes to a ring
+// file of |spill_limit| bytes at |spill_path|. Data that fits in neither is
+// still accepted and kept in memory, callers are expected to stop adding data
+// once size() reaches capacity().
+//
+// Nothing here is persisted: buffered bytes haven't been applied yet, so the
+// update progress checkpoint never covers them and an update resumed after a
+// crash downloads them again.
+class DownloadAheadBuffer {
+ public:
+  // A |spill_limit| of 0 or an empty |spill_path| keep everything in memory.
+  DownloadAheadBuffer(size_t memory_limit,
+                      const std::string& spill_path,
+                      size_t spill_limit);
+  ~DownloadAheadBuffer();
+
+  // Creates the spill file, if any. Must be called before anything else.
+  bool Init();
+
+  // Appends |size| bytes at |data|. Returns false on spill file errors.
+  bool Append(const void* data, size_t size);
+
+  // Replaces |out| with up to |max_size| of the oldest buffered bytes and
+  // removes them from the buffer. Returns false on spill file errors.
+  bool Pop(size_t max_size, brillo::Blob* out);
+
+  // Drops all buffered bytes.
+  void Clear();
+
+  size_t size() const { return head_size_ + spill_size_ + tail_size_; }
+  bool empty() const { return size() == 0; }
+  size_t capacity() const { return memory_limit_ + spill_limit_; }
+
+ private:
+  // Moves the data of |tail_| in front of the buffer once the spill file is
+  // empty.
+  void PromoteTail();
+
+  bool WriteSpill(const uint8_t* data, size_t size);
+  bool ReadSpill(uint8_t* data, size_t size);
+
+  const size_t memory_limit_;
+  const std::string spill_path_;
+  size_t spill_limit_;
+  android::base::unique_fd spill_fd_;
+
+  // The oldest data, in memory.
+  std::deque<brillo::Blob> head_;
+  size_t head_size_{0};
+  // Offset of the first byte of |head_.front()| not popped yet.
+  size_t head_offset_{0};
+  // Data newer than |head_|, in the ring file.
+  size_t spill_start_{0};
+  size_t spill_size_{0};
+  // Data newer than the ring file which didn't fit in it.
+  std::deque<brillo::Blob> tail_;
+  size_t tail_size_{0};
+  // Charges the data kept in memory.
+  ScopedMemoryCharge memory_charge_{MemoryConsumer::kDownloadBuffer};
+
+  DISALLOW_COPY_AND_ASSIGN(DownloadAheadBuffer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_DOWNLOAD_AHEAD_BUFFER_H_
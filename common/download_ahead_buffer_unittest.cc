@@ -0,0 +1,106 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/download_ahead_buffer.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class DownloadAheadBufferTest : public ::testing::Test {
+ protected:
+  // Appends |count| bytes counting up from |next_byte_|.
+  void Append(DownloadAheadBuffer* buffer, size_t count) {
+    brillo::Blob data(count);
+    for (auto& byte : data)
+      byte = next_byte_++;
+    ASSERT_TRUE(buffer->Append(data.data(), data.size()));
+  }
+
+  // Pops up to |count| bytes and checks that they continue the sequence.
+  void Pop(DownloadAheadBuffer* buffer, size_t count) {
+    brillo::Blob data;
+    ASSERT_TRUE(buffer->Pop(count, &data));
+    ASSERT_EQ(count, data.size());
+    for (const auto byte : data)
+      ASSERT_EQ(expected_byte_++, byte);
+  }
+
+  ScopedTempFile spill_file_{"download_ahead.XXXXXX"};
+  uint8_t next_byte_{0};
+  uint8_t expected_byte_{0};
+};
+
+TEST_F(DownloadAheadBufferTest, MemoryOnly) {
+  DownloadAheadBuffer buffer(100, "", 100);
+  ASSERT_TRUE(buffer.Init());
+  EXPECT_EQ(100u, buffer.capacity());
+  Append(&buffer, 60);
+  Append(&buffer, 60);
+  EXPECT_EQ(120u, buffer.size());
+  Pop(&buffer, 50);
+  Pop(&buffer, 70);
+  EXPECT_TRUE(buffer.empty());
+}
+
+TEST_F(DownloadAheadBufferTest, SpillsInOrder) {
+  DownloadAheadBuffer buffer(100, spill_file_.path(), 150);
+  ASSERT_TRUE(buffer.Init());
+  Append(&buffer, 80);
+  // Goes to the spill file, as does everything until it's drained.
+  Append(&buffer, 80);
+  Pop(&buffer, 80);
+  Append(&buffer, 60);
+  // Doesn't fit in the spill file anymore.
+  Append(&buffer, 30);
+  EXPECT_EQ(170u, buffer.size());
+  Pop(&buffer, 100);
+  Pop(&buffer, 40);
+  Pop(&buffer, 30);
+  EXPECT_TRUE(buffer.empty());
+}
+
+TEST_F(DownloadAheadBufferTest, SpillFileWrapsAround) {
+  DownloadAheadBuffer buffer(0, spill_file_.path(), 100);
+  ASSERT_TRUE(buffer.Init());
+  Append(&buffer, 60);
+  // The ring never drains, so its start keeps moving around the file.
+  for (int i = 0; i < 10; i++) {
+    Append(&buffer, 30);
+    Pop(&buffer, 30);
+  }
+  Pop(&buffer, 60);
+  EXPECT_TRUE(buffer.empty());
+}
+
+TEST_F(DownloadAheadBufferTest, Clear) {
+  DownloadAheadBuffer buffer(10, spill_file_.path(), 10);
+  ASSERT_TRUE(buffer.Init());
+  Append(&buffer, 10);
+  Append(&buffer, 10);
+  Append(&buffer, 10);
+  buffer.Clear();
+  EXPECT_TRUE(buffer.empty());
+  next_byte_ = expected_byte_ = 0;
+  Append(&buffer, 5);
+  Pop(&buffer, 5);
+}
+
+}  // namespace chromeos_update_engine
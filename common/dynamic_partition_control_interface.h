@@ -186,6 +186,12 @@ class DynamicPartitionControlInterface {
   // Unmap virtual block devices for all partitions.
   virtual bool UnmapAllPartitions() = 0;
 
+  // Until FinishMappingPartitions(), partitions are mapped without waiting
+  // for their device nodes, so the waits overlap. FinishMappingPartitions()
+  // then waits for all of them, returning whether they all showed up.
+  virtual void StartMappingPartitions() {}
+  virtual bool FinishMappingPartitions() { return true; }
+
   // Return if snapshot compression is enabled for this update.
   // This function should only be called after preparing for an update
   // (PreparePartitionsForUpdate), and before merging
@@ -120,7 +120,11 @@ class FakeHardware : public HardwareInterface {
   bool IsPowerwashScheduled() { return powerwash_scheduled_; }
 
   bool GetNonVolatileDirectory(base::FilePath* path) const override {
-    return false;
+    if (non_volatile_dir_.empty()) {
+      return false;
+    }
+    *path = non_volatile_dir_;
+    return true;
   }
 
   bool GetPowerwashSafeDirectory(base::FilePath* path) const override {
@@ -182,6 +186,10 @@ class FakeHardware : public HardwareInterface {
     min_firmware_key_version_ = min_firmware_key_version;
   }
 
+  void SetNonVolatileDirectory(const base::FilePath& path) {
+    non_volatile_dir_ = path;
+  }
+
   void SetPowerwashCount(int powerwash_count) {
     powerwash_count_ = powerwash_count;
   }
@@ -194,6 +202,14 @@ class FakeHardware : public HardwareInterface {
 
   void SetVbmetaDigestForInactiveSlot(bool reset) override {}
 
+  std::string GetVbmetaDigestForRunningSlot() const override {
+    return running_vbmeta_digest_;
+  }
+
+  void SetVbmetaDigestForRunningSlot(const std::string& digest) {
+    running_vbmeta_digest_ = digest;
+  }
+
   // Getters to verify state.
   int GetMaxKernelKeyRollforward() const { return kernel_max_rollforward_; }
 
@@ -225,6 +241,13 @@ class FakeHardware : public HardwareInterface {
 #endif
   }
 
+  DeviceConditions GetDeviceConditions() const override {
+    return device_conditions_;
+  }
+  void SetDeviceConditions(const DeviceConditions& conditions) {
+    device_conditions_ = conditions;
+  }
+
  private:
   bool is_official_build_{true};
   bool is_normal_boot_mode_{true};
@@ -239,13 +262,16 @@ class FakeHardware : public HardwareInterface {
   int min_firmware_key_version_{kMinFirmwareKeyVersion};
   int kernel_max_rollforward_{kKernelMaxRollforward};
   int firmware_max_rollforward_{kFirmwareMaxRollforward};
+  base::FilePath non_volatile_dir_;
   int powerwash_count_{kPowerwashCountNotSet};
   bool powerwash_scheduled_{false};
   bool save_rollback_data_{false};
   int64_t build_timestamp_{0};
   bool first_active_omaha_ping_sent_{false};
   bool warm_reset_{false};
+  std::string running_vbmeta_digest_;
   mutable std::map<std::string, std::string> partition_timestamps_;
+  DeviceConditions device_conditions_;
 
   DISALLOW_COPY_AND_ASSIGN(FakeHardware);
 };
@@ -16,6 +16,13 @@
 
 #include "update_engine/common/file_fetcher.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <string>
 
@@ -23,16 +30,30 @@
 #include <base/format_macros.h>
 #include <base/location.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <android-base/stringprintf.h>
 #include <brillo/streams/file_stream.h>
 
 #include "update_engine/common/utils.h"
 
+using brillo::MessageLoop;
 using std::string;
 
 namespace {
 
 size_t kReadBufferSize = 16 * 1024;
+// Limit the size of stream reads grows to.
+constexpr size_t kMaxReadBufferSize = 1024 * 1024;
+
+// Number and size of the reads kept in flight when a file can't be mapped but
+// supports positioned reads.
+constexpr size_t kReadAheadDepth = 4;
+constexpr size_t kReadAheadChunkSize = 1024 * 1024;
+
+// Size of the pieces a mapped file is handed to the delegate in. Large enough
+// that most operation blobs arrive in one piece and can be applied straight
+// from the mapping.
+constexpr size_t kMappedChunkSize = 4 * 1024 * 1024;
 
 }  // namespace
 
@@ -66,9 +87,10 @@ void FileFetcher::BeginTransfer(const string& url) {
   }
 
   string file_path;
+  int fd = -1;
 
   if (android::base::StartsWith(ToLower(url), "fd://")) {
-    int fd = std::stoi(url.substr(strlen("fd://")));
+    fd = std::stoi(url.substr(strlen("fd://")));
     file_path = url;
     stream_ = brillo::FileStream::FromFileDescriptor(fd, false, nullptr);
   } else {
@@ -90,9 +112,23 @@ void FileFetcher::BeginTransfer(const string& url) {
   }
   http_response_code_ = kHttpResponseOk;
 
-  if (offset_)
+  // |fd| belongs to the caller for fd:// URLs, only close our own one.
+  if (fd >= 0) {
+    if ((!map_files_ || !MapFile(fd)) && !StartReadAhead(fd))
+      GrowPipeBuffer(fd);
+  } else {
+    fd = HANDLE_EINTR(open(file_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd >= 0) {
+      if ((!map_files_ || !MapFile(fd)) && !StartReadAhead(fd))
+        GrowPipeBuffer(fd);
+      IGNORE_EINTR(close(fd));
+    }
+  }
+
+  if (offset_ && !mapped_data_ && !ring_)
     stream_->SetPosition(offset_, nullptr);
   bytes_copied_ = 0;
+  read_size_ = kReadBufferSize;
   transfer_in_progress_ = true;
   ScheduleRead();
 }
@@ -109,7 +145,24 @@ void FileFetcher::ScheduleRead() {
   if (transfer_paused_ || ongoing_read_ || !transfer_in_progress_)
     return;
 
-  buffer_.resize(kReadBufferSize);
+  if (mapped_data_) {
+    ongoing_read_ = true;
+    chunk_task_id_ = MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&FileFetcher::OnMappedChunkReady, base::Unretained(this)));
+    return;
+  }
+
+  if (ring_) {
+    ongoing_read_ = true;
+    chunk_task_id_ = MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&FileFetcher::OnReadAheadChunkReady,
+                   base::Unretained(this)));
+    return;
+  }
+
+  buffer_.resize(read_size_);
   size_t bytes_to_read = buffer_.size();
   if (data_length_ >= 0) {
     bytes_to_read = std::min(static_cast<uint64_t>(bytes_to_read),
@@ -144,6 +197,8 @@ void FileFetcher::OnReadDoneCallback(size_t bytes_read) {
       delegate_->TransferComplete(this, true);
   } else {
     bytes_copied_ += bytes_read;
+    if (bytes_read == buffer_.size())
+      read_size_ = std::min(read_size_ * 2, kMaxReadBufferSize);
     if (delegate_ &&
         !delegate_->ReceivedBytes(this, buffer_.data(), bytes_read))
       return;
@@ -151,6 +206,239 @@ void FileFetcher::OnReadDoneCallback(size_t bytes_read) {
   }
 }
 
+bool FileFetcher::MapFile(int fd) {
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      offset_ >= static_cast<uint64_t>(st.st_size)) {
+    return false;
+  }
+  uint64_t end = st.st_size;
+  if (data_length_ >= 0) {
+    end = std::min(end, offset_ + data_length_);
+  }
+  if (end <= offset_) {
+    return false;
+  }
+  // mmap() offsets must be page aligned, map from the page |offset_| is in.
+  const uint64_t map_offset = offset_ - offset_ % getpagesize();
+  const size_t map_size = end - map_offset;
+  void* mapping =
+      mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, map_offset);
+  if (mapping == MAP_FAILED) {
+    PLOG(WARNING) << "Unable to map the payload, reading it instead";
+    return false;
+  }
+  // The payload is consumed front to back exactly once: read ahead
+  // aggressively and let the kernel drop pages behind the read position.
+  madvise(mapping, map_size, MADV_SEQUENTIAL);
+  mapping_ = mapping;
+  mapping_size_ = map_size;
+  mapped_data_ = static_cast<const uint8_t*>(mapping) + (offset_ - map_offset);
+  mapped_data_size_ = end - offset_;
+  return true;
+}
+
+void FileFetcher::OnMappedChunkReady() {
+  chunk_task_id_ = MessageLoop::kTaskIdNull;
+  ongoing_read_ = false;
+  const size_t size =
+      std::min(kMappedChunkSize, mapped_data_size_ - bytes_copied_);
+  if (size == 0) {
+    CleanUp();
+    if (delegate_)
+      delegate_->TransferComplete(this, true);
+    return;
+  }
+  const uint8_t* data = mapped_data_ + bytes_copied_;
+  bytes_copied_ += size;
+  // Start reading the following chunk while the delegate processes this one.
+  const size_t next_size =
+      std::min(kMappedChunkSize, mapped_data_size_ - bytes_copied_);
+  if (next_size > 0) {
+    const uintptr_t next = reinterpret_cast<uintptr_t>(data + size);
+    const uintptr_t next_page = next - next % getpagesize();
+    madvise(reinterpret_cast<void*>(next_page),
+            next + next_size - next_page,
+            MADV_WILLNEED);
+  }
+  if (delegate_ && !delegate_->ReceivedBytes(this, data, size))
+    return;
+  ScheduleRead();
+}
+
+void FileFetcher::GrowPipeBuffer(int fd) {
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+    return;
+  }
+  // The size is rounded up by the kernel, and capped for unprivileged
+  // processes by /proc/sys/fs/pipe-max-size.
+  const int size = HANDLE_EINTR(
+      fcntl(fd, F_SETPIPE_SZ, static_cast<int>(kMaxReadBufferSize)));
+  if (size < 0) {
+    PLOG(WARNING) << "Unable to grow the buffer of the payload pipe";
+    return;
+  }
+  LOG(INFO) << "Reading the payload from a pipe of " << size << " bytes";
+}
+
+bool FileFetcher::StartReadAhead(int fd) {
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+    return false;
+  }
+  ring_ = io_uring_cpp::IoUringInterface::CreateLinuxIoUring(kReadAheadDepth,
+                                                             0);
+  if (!ring_) {
+    return false;
+  }
+  read_fd_ = HANDLE_EINTR(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+  if (read_fd_ < 0) {
+    PLOG(WARNING) << "Unable to duplicate the payload descriptor";
+    ring_.reset();
+    return false;
+  }
+  next_read_offset_ = offset_;
+  read_end_ = data_length_ >= 0 ? offset_ + data_length_ : UINT64_MAX;
+  reached_eof_ = false;
+  read_ahead_.resize(kReadAheadDepth);
+  for (size_t slot = 0; slot < read_ahead_.size(); slot++) {
+    if (!QueueNextReadAhead(slot)) {
+      StopReadAhead();
+      return false;
+    }
+  }
+  return true;
+}
+
+void FileFetcher::StopReadAhead() {
+  if (ring_) {
+    // Wait for the kernel to be done with |read_ahead_|. A failed read is of
+    // no interest anymore.
+    while (reads_in_flight_ > 0) {
+      WaitForReadAhead();
+    }
+    ring_.reset();
+    IGNORE_EINTR(close(read_fd_));
+    read_fd_ = -1;
+  }
+  read_ahead_.clear();
+  read_ahead_order_.clear();
+}
+
+bool FileFetcher::SubmitReadAhead(size_t slot) {
+  auto& read = read_ahead_[slot];
+  auto sqe = ring_->PrepRead(read_fd_,
+                             read.buffer.data() + read.filled,
+                             read.size - read.filled,
+                             read.offset + read.filled);
+  if (!sqe.IsOk()) {
+    LOG(ERROR) << "Unable to queue a read of the payload";
+    return false;
+  }
+  sqe.SetData(static_cast<uint64_t>(slot));
+  const auto result = ring_->Submit();
+  if (!result.IsOk()) {
+    LOG(ERROR) << "Unable to submit a read of the payload: "
+               << result.ErrMsg();
+    return false;
+  }
+  reads_in_flight_ += result.EntriesSubmitted();
+  return true;
+}
+
+bool FileFetcher::QueueNextReadAhead(size_t slot) {
+  if (reached_eof_ || next_read_offset_ >= read_end_) {
+    return true;
+  }
+  auto& read = read_ahead_[slot];
+  read.offset = next_read_offset_;
+  read.size = std::min<uint64_t>(kReadAheadChunkSize, read_end_ - read.offset);
+  read.filled = 0;
+  read.done = false;
+  read.buffer.resize(read.size);
+  next_read_offset_ += read.size;
+  read_ahead_order_.push_back(slot);
+  return SubmitReadAhead(slot);
+}
+
+bool FileFetcher::WaitForReadAhead() {
+  auto cqe = ring_->PopCQE();
+  while (cqe.IsErr() && cqe.GetError().ErrCode() == EINTR) {
+    cqe = ring_->PopCQE();
+  }
+  // The kernel may still be writing to the buffers of in-flight reads, they
+  // can't be released without waiting for the completion.
+  CHECK(cqe.IsOk()) << "Failed to wait for a read of the payload: "
+                    << cqe.GetError();
+  reads_in_flight_--;
+  const auto& completion = cqe.GetResult();
+  auto& read = read_ahead_[completion.GetData<uint64_t>()];
+  if (completion.res == -EINTR || completion.res == -EAGAIN) {
+    return SubmitReadAhead(completion.GetData<uint64_t>());
+  }
+  if (completion.res < 0) {
+    LOG(ERROR) << "Reading " << read.size - read.filled << " bytes of the "
+               << "payload at " << read.offset + read.filled
+               << " failed: " << strerror(-completion.res);
+    return false;
+  }
+  if (completion.res == 0) {
+    reached_eof_ = true;
+    read.done = true;
+    return true;
+  }
+  read.filled += completion.res;
+  if (read.filled < read.size) {
+    return SubmitReadAhead(completion.GetData<uint64_t>());
+  }
+  read.done = true;
+  return true;
+}
+
+void FileFetcher::OnReadAheadChunkReady() {
+  chunk_task_id_ = MessageLoop::kTaskIdNull;
+  ongoing_read_ = false;
+  if (read_ahead_order_.empty()) {
+    CleanUp();
+    if (delegate_)
+      delegate_->TransferComplete(this, true);
+    return;
+  }
+  const size_t slot = read_ahead_order_.front();
+  while (!read_ahead_[slot].done) {
+    if (!WaitForReadAhead()) {
+      CleanUp();
+      if (delegate_)
+        delegate_->TransferComplete(this, false);
+      return;
+    }
+  }
+  read_ahead_order_.pop_front();
+  const auto& read = read_ahead_[slot];
+  if (read.filled == 0) {
+    // The following reads start past the end of the file as well.
+    CleanUp();
+    if (delegate_)
+      delegate_->TransferComplete(this, true);
+    return;
+  }
+  bytes_copied_ += read.filled;
+  if (delegate_ &&
+      !delegate_->ReceivedBytes(this, read.buffer.data(), read.filled))
+    return;
+  // The delegate may have terminated the transfer.
+  if (!ring_)
+    return;
+  if (!QueueNextReadAhead(slot)) {
+    CleanUp();
+    if (delegate_)
+      delegate_->TransferComplete(this, false);
+    return;
+  }
+  ScheduleRead();
+}
+
 void FileFetcher::OnReadErrorCallback(const brillo::Error* error) {
   LOG(ERROR) << "Asynchronous read failed: " << error->GetMessage();
   CleanUp();
@@ -181,6 +469,18 @@ void FileFetcher::CleanUp() {
     stream_->CloseBlocking(nullptr);
     stream_.reset();
   }
+  if (chunk_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(chunk_task_id_);
+    chunk_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  if (mapping_) {
+    munmap(mapping_, mapping_size_);
+    mapping_ = nullptr;
+    mapping_size_ = 0;
+    mapped_data_ = nullptr;
+    mapped_data_size_ = 0;
+  }
+  StopReadAhead();
   // Destroying the |stream_| releases the callback, so we don't have any
   // ongoing read at this point.
   ongoing_read_ = false;
@@ -17,13 +17,18 @@
 #ifndef UPDATE_ENGINE_COMMON_FILE_FETCHER_H_
 #define UPDATE_ENGINE_COMMON_FILE_FETCHER_H_
 
+#include <deque>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <base/logging.h>
 #include <android-base/macros.h>
+#include <brillo/message_loops/message_loop.h>
 #include <brillo/streams/stream.h>
+#include <gtest/gtest_prod.h>  // for FRIEND_TEST
+#include <liburing_cpp/IoUring.h>
 
 #include "update_engine/common/http_fetcher.h"
 
@@ -80,6 +85,20 @@ class FileFetcher : public HttpFetcher {
   void set_max_retry_count(int max_retry_count) override {}
 
  private:
+  FRIEND_TEST(FileFetcherUnitTest, ReadsRangeWithReadAhead);
+
+  // A read of the io_uring read-ahead queue.
+  struct ReadAhead {
+    brillo::Blob buffer;
+    // Offset in the file of the first byte of |buffer|.
+    uint64_t offset{0};
+    // Number of bytes requested and number of bytes read so far.
+    size_t size{0};
+    size_t filled{0};
+    // Whether the read finished, either full or cut short by the end of file.
+    bool done{false};
+  };
+
   // Cleans up the fetcher, resetting its status to a newly constructed one.
   void CleanUp();
 
@@ -92,6 +111,45 @@ class FileFetcher : public HttpFetcher {
   void OnReadDoneCallback(size_t bytes_read);
   void OnReadErrorCallback(const brillo::Error* error);
 
+  // Maps the requested range of the regular file |fd| is open on. Returns
+  // false, leaving the fetcher to read through |stream_|, if |fd| isn't a
+  // regular file, the range is empty or mmap() fails.
+  bool MapFile(int fd);
+
+  // Called from the main loop to hand the next chunk of the mapped range to
+  // the delegate.
+  void OnMappedChunkReady();
+
+  // Sets up an io_uring queue of positioned reads of the requested range of
+  // |fd|, which is duplicated. Returns false, leaving the fetcher to read
+  // through |stream_|, if |fd| isn't a regular file or a block device or no
+  // ring can be created.
+  bool StartReadAhead(int fd);
+
+  // Enlarges the buffer of the pipe |fd| is open on, if it is one, to the
+  // largest stream read. With the default 64 KiB pipe buffer, a writer
+  // streaming the payload blocks every 64 KiB and each read returns at most
+  // that much, costing a message loop round trip per 64 KiB.
+  void GrowPipeBuffer(int fd);
+
+  // Waits for the in-flight reads and releases the read-ahead queue.
+  void StopReadAhead();
+
+  // Submits the read of the remainder of |read_ahead_[slot]|.
+  bool SubmitReadAhead(size_t slot);
+
+  // Reuses |read_ahead_[slot]| for the next chunk of the range, if any is
+  // left, and appends it to |read_ahead_order_|.
+  bool QueueNextReadAhead(size_t slot);
+
+  // Blocks until one in-flight read completes and records its result.
+  // Returns false if the read failed.
+  bool WaitForReadAhead();
+
+  // Called from the main loop to hand the oldest queued read to the delegate
+  // once it's done.
+  void OnReadAheadChunkReady();
+
   // Whether the transfer was started and didn't finish yet.
   bool transfer_in_progress_{false};
 
@@ -99,7 +157,8 @@ class FileFetcher : public HttpFetcher {
   bool transfer_paused_{false};
 
   // Whether there's an ongoing asynchronous read. When this value is true, the
-  // the |buffer_| is being used by the |stream_|.
+  // the |buffer_| is being used by the |stream_|, or for mapped files the
+  // delivery of the next chunk is scheduled.
   bool ongoing_read_{false};
 
   // Total number of bytes copied.
@@ -115,6 +174,43 @@ class FileFetcher : public HttpFetcher {
 
   // The buffer used for reading from the stream.
   brillo::Blob buffer_;
+  // Size of the next read from the stream. Doubles, up to a limit, every time
+  // a read fills the whole buffer, so fast streams need fewer round trips.
+  size_t read_size_{0};
+
+  // When the file could be mapped, the mapping of the requested range. Data is
+  // then handed to the delegate straight from the mapping, |buffer_| and
+  // |stream_| aren't used for reading.
+  void* mapping_{nullptr};
+  size_t mapping_size_{0};
+  // Start and size of the requested range inside |mapping_|.
+  const uint8_t* mapped_data_{nullptr};
+  size_t mapped_data_size_{0};
+  // The task delivering the next chunk of |mapped_data_| or |read_ahead_|, if
+  // scheduled.
+  brillo::MessageLoop::TaskId chunk_task_id_{brillo::MessageLoop::kTaskIdNull};
+
+  // Whether regular files may be mapped, only cleared by tests.
+  bool map_files_{true};
+
+  // When the file couldn't be mapped but supports positioned reads, the ring
+  // keeping several reads of the requested range in flight ahead of the
+  // delegate, which is then handed the data from |read_ahead_| instead of
+  // |buffer_|.
+  std::unique_ptr<io_uring_cpp::IoUringInterface> ring_;
+  // The duplicated descriptor the reads of |ring_| go to.
+  int read_fd_{-1};
+  std::vector<ReadAhead> read_ahead_;
+  // Indices of |read_ahead_| in file order, the front one is handed out next.
+  std::deque<size_t> read_ahead_order_;
+  // Number of reads submitted to |ring_| which didn't complete yet.
+  size_t reads_in_flight_{0};
+  // Offset in the file the next queued read starts at, and the end of the
+  // requested range.
+  uint64_t next_read_offset_{0};
+  uint64_t read_end_{0};
+  // Whether a read hit the end of the file.
+  bool reached_eof_{false};
 
   DISALLOW_COPY_AND_ASSIGN(FileFetcher);
 };
@@ -18,13 +18,49 @@
 
 #include <string>
 
+#include <brillo/message_loops/fake_message_loop.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
 
-class FileFetcherUnitTest : public ::testing::Test {};
+namespace {
+class RecordingDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    data.append(static_cast<const char*>(bytes), length);
+    chunks++;
+    return true;
+  }
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    complete = true;
+    success = successful;
+  }
+  void TransferTerminated(HttpFetcher* fetcher) override {}
+
+  std::string data;
+  size_t chunks{0};
+  bool complete{false};
+  bool success{false};
+};
+}  // namespace
+
+class FileFetcherUnitTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  void RunLoop() {
+    while (loop_.PendingTasks()) {
+      loop_.RunOnce(true);
+    }
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+};
 
 TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
   EXPECT_TRUE(FileFetcher::SupportedUrl("file:///path/to/somewhere.bin"));
@@ -34,4 +70,58 @@ TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
   EXPECT_FALSE(FileFetcher::SupportedUrl("http:///no_http_here"));
 }
 
+TEST_F(FileFetcherUnitTest, ReadsRangeOfLargeFile) {
+  // Larger than a single chunk of a mapped file.
+  std::string contents(9 * 1024 * 1024 + 123, '\0');
+  for (size_t i = 0; i < contents.size(); i++) {
+    contents[i] = static_cast<char>(i * 7 + i / 4096);
+  }
+  ScopedTempFile file("file_fetcher.XXXXXX");
+  ASSERT_TRUE(utils::WriteFile(
+      file.path().c_str(), contents.data(), contents.size()));
+
+  RecordingDelegate delegate;
+  FileFetcher fetcher;
+  fetcher.set_delegate(&delegate);
+  // An offset which isn't page aligned.
+  const size_t offset = 5000;
+  const size_t length = contents.size() - offset - 100;
+  fetcher.SetOffset(offset);
+  fetcher.SetLength(length);
+  fetcher.BeginTransfer("file://" + file.path());
+  RunLoop();
+
+  ASSERT_TRUE(delegate.complete);
+  ASSERT_TRUE(delegate.success);
+  ASSERT_EQ(contents.substr(offset, length), delegate.data);
+  ASSERT_EQ(length, fetcher.GetBytesDownloaded());
+  ASSERT_GT(delegate.chunks, 1u);
+}
+
+TEST_F(FileFetcherUnitTest, ReadsRangeWithReadAhead) {
+  // More chunks than reads kept in flight.
+  std::string contents(6 * 1024 * 1024 + 321, '\0');
+  for (size_t i = 0; i < contents.size(); i++) {
+    contents[i] = static_cast<char>(i * 11 + i / 4096);
+  }
+  ScopedTempFile file("file_fetcher.XXXXXX");
+  ASSERT_TRUE(utils::WriteFile(
+      file.path().c_str(), contents.data(), contents.size()));
+
+  RecordingDelegate delegate;
+  FileFetcher fetcher;
+  fetcher.map_files_ = false;
+  fetcher.set_delegate(&delegate);
+  const size_t offset = 777;
+  fetcher.SetOffset(offset);
+  // Without a length, reads continue up to the end of the file.
+  fetcher.BeginTransfer("file://" + file.path());
+  RunLoop();
+
+  ASSERT_TRUE(delegate.complete);
+  ASSERT_TRUE(delegate.success);
+  ASSERT_EQ(contents.substr(offset), delegate.data);
+  ASSERT_EQ(contents.size() - offset, fetcher.GetBytesDownloaded());
+}
+
 }  // namespace chromeos_update_engine
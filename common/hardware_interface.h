@@ -29,6 +29,18 @@
 
 namespace chromeos_update_engine {
 
+// The state of the device deciding how much of the CPU and of the storage an
+// update may use without the user noticing.
+struct DeviceConditions {
+  bool charging{false};
+  bool screen_on{true};
+  // The battery level in percent, or -1 when unknown.
+  int battery_percent{-1};
+  // The temperature of the hottest thermal zone in millidegrees Celsius, or 0
+  // when unknown.
+  int max_temp{0};
+};
+
 // The hardware interface allows access to the crossystem exposed properties,
 // such as the firmware version, hwid, verified boot mode.
 // These stateless functions are tied together in this interface to facilitate
@@ -140,6 +152,10 @@ class HardwareInterface {
   // Otherwise, clears the sysprop.
   virtual void SetVbmetaDigestForInactiveSlot(bool reset) = 0;
 
+  // Returns the vbmeta digest the running slot was verified against, or an
+  // empty string if dm-verity isn't enforced on it.
+  virtual std::string GetVbmetaDigestForRunningSlot() const = 0;
+
   // Return the version/timestamp for partition `partition_name`.
   // Don't make any assumption about the formatting of returned string.
   // Only used for logging/debugging purposes.
@@ -162,6 +178,9 @@ class HardwareInterface {
 
   virtual const char* GetPartitionMountOptions(
       const std::string& partition_name) const = 0;
+
+  // Returns the current power, screen and thermal state of the device.
+  virtual DeviceConditions GetDeviceConditions() const = 0;
 };
 
 }  // namespace chromeos_update_engine
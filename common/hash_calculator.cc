@@ -21,6 +21,7 @@
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
 
+#include "update_engine/common/sha256_multi_buffer.h"
 #include "update_engine/common/utils.h"
 
 using std::string;
@@ -95,6 +96,32 @@ bool HashCalculator::RawHashOfData(const brillo::Blob& data,
   return RawHashOfBytes(data.data(), data.size(), out_hash);
 }
 
+bool HashCalculator::RawHashOfDataBatch(const std::vector<brillo::Blob>& data,
+                                        std::vector<brillo::Blob>* out_hashes) {
+  static const bool has_sha256_instructions = HasSha256Instructions();
+  out_hashes->resize(data.size());
+  if (data.size() < 2 || has_sha256_instructions) {
+    for (size_t i = 0; i < data.size(); i++) {
+      TEST_AND_RETURN_FALSE(RawHashOfData(data[i], &(*out_hashes)[i]));
+    }
+    return true;
+  }
+  std::vector<const uint8_t*> pointers;
+  std::vector<size_t> lengths;
+  for (const auto& blob : data) {
+    pointers.push_back(blob.data());
+    lengths.push_back(blob.size());
+  }
+  brillo::Blob digests(data.size() * SHA256_DIGEST_LENGTH);
+  Sha256MultiBuffer(
+      pointers.data(), lengths.data(), data.size(), digests.data());
+  for (size_t i = 0; i < data.size(); i++) {
+    const auto digest = digests.begin() + i * SHA256_DIGEST_LENGTH;
+    (*out_hashes)[i].assign(digest, digest + SHA256_DIGEST_LENGTH);
+  }
+  return true;
+}
+
 bool HashCalculator::RawHashOfFile(const string& name, brillo::Blob* out_hash) {
   const auto file_size = utils::FileSize(name);
   return RawHashOfFile(name, file_size, out_hash) == file_size;
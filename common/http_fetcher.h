@@ -24,6 +24,7 @@
 
 #include <base/callback.h>
 #include <base/logging.h>
+#include <base/time/time.h>
 #include <android-base/macros.h>
 #include <brillo/message_loops/message_loop.h>
 #include <brillo/secure_blob.h>
@@ -42,6 +43,25 @@ namespace chromeos_update_engine {
 
 class HttpFetcherDelegate;
 
+// Timing of a single request made by a fetcher. The phase durations count
+// from the start of the request, so each one includes the previous ones.
+struct HttpTransferTiming {
+  // Offset of the first requested byte and number of bytes received.
+  uint64_t offset{0};
+  uint64_t bytes{0};
+  base::TimeDelta name_lookup;
+  base::TimeDelta connect;
+  // Zero for requests without TLS.
+  base::TimeDelta tls_handshake;
+  base::TimeDelta first_byte;
+  base::TimeDelta total;
+
+  int64_t BytesPerSecond() const {
+    return total.is_positive() ? bytes * 1000000 / total.InMicroseconds()
+                               : 0;
+  }
+};
+
 class HttpFetcher {
  public:
   // |proxy_resolver| is the resolver that will be consulted for proxy
@@ -140,6 +160,14 @@ class HttpFetcher {
   // Get the total number of bytes downloaded by fetcher.
   virtual size_t GetBytesDownloaded() = 0;
 
+  // Get the fetcher's estimate of its current download throughput, or 0 if
+  // it has none.
+  virtual int64_t GetEstimatedBytesPerSecond() { return 0; }
+
+  // Returns the timings of the requests the fetcher made so far, if it
+  // records them.
+  virtual std::vector<HttpTransferTiming> GetTransferTimings() { return {}; }
+
  protected:
   // The URL we're actively fetching from
   std::string url_;
@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_accounting.h"
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kMiB = 1024 * 1024;
+}  // namespace
+
+MemoryAccounting* MemoryAccounting::GetInstance() {
+  static MemoryAccounting instance;
+  return &instance;
+}
+
+// static
+const char* MemoryAccounting::ConsumerName(MemoryConsumer consumer) {
+  switch (consumer) {
+    case MemoryConsumer::kManifest:
+      return "manifest";
+    case MemoryConsumer::kDownloadBuffer:
+      return "download buffer";
+    case MemoryConsumer::kOperations:
+      return "operations";
+    case MemoryConsumer::kVerifier:
+      return "verifier";
+    case MemoryConsumer::kCowWriter:
+      return "COW writer";
+    case MemoryConsumer::kNumConsumers:
+      break;
+  }
+  return "unknown";
+}
+
+void MemoryAccounting::Charge(MemoryConsumer consumer, size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+  const size_t index = static_cast<size_t>(consumer);
+  UpdatePeak(&peak_[index], current_[index] += bytes);
+  const size_t total = total_ += bytes;
+  UpdatePeak(&peak_total_, total);
+  const size_t soft_limit = soft_limit_;
+  if (soft_limit > 0 && total > soft_limit && total - bytes <= soft_limit) {
+    num_soft_limit_hits_++;
+    LOG(WARNING) << "The update uses " << total / kMiB
+                 << " MiB, over the soft limit of " << soft_limit / kMiB
+                 << " MiB, after charging " << bytes / 1024 << " KiB to the "
+                 << ConsumerName(consumer);
+  }
+}
+
+void MemoryAccounting::Release(MemoryConsumer consumer, size_t bytes) {
+  const size_t index = static_cast<size_t>(consumer);
+  DCHECK_GE(current_[index].load(), bytes);
+  current_[index] -= bytes;
+  total_ -= bytes;
+}
+
+size_t MemoryAccounting::current(MemoryConsumer consumer) const {
+  return current_[static_cast<size_t>(consumer)];
+}
+
+size_t MemoryAccounting::peak(MemoryConsumer consumer) const {
+  return peak_[static_cast<size_t>(consumer)];
+}
+
+bool MemoryAccounting::OverSoftLimit() const {
+  const size_t soft_limit = soft_limit_;
+  return soft_limit > 0 && total_ > soft_limit;
+}
+
+void MemoryAccounting::ResetPeaks() {
+  for (size_t i = 0; i < kNumConsumers; i++) {
+    peak_[i] = current_[i].load();
+  }
+  peak_total_ = total_.load();
+  num_soft_limit_hits_ = 0;
+}
+
+void MemoryAccounting::LogUsage(const std::string& phase) const {
+  std::string usage;
+  for (size_t i = 0; i < kNumConsumers; i++) {
+    usage += std::string(", ") +
+             ConsumerName(static_cast<MemoryConsumer>(i)) + " " +
+             std::to_string(current_[i] / kMiB) + " (peak " +
+             std::to_string(peak_[i] / kMiB) + ")";
+  }
+  LOG(INFO) << "Memory in MiB after " << phase << ": total "
+            << total_ / kMiB << " (peak " << peak_total_ / kMiB << ")"
+            << usage;
+}
+
+// static
+void MemoryAccounting::UpdatePeak(std::atomic<size_t>* peak, size_t value) {
+  size_t current_peak = *peak;
+  while (current_peak < value &&
+         !peak->compare_exchange_weak(current_peak, value)) {
+  }
+}
+
+void ScopedMemoryCharge::Set(size_t bytes) {
+  MemoryAccounting* accounting = MemoryAccounting::GetInstance();
+  if (bytes > bytes_) {
+    accounting->Charge(consumer_, bytes - bytes_);
+  } else if (bytes < bytes_) {
+    accounting->Release(consumer_, bytes_ - bytes);
+  }
+  bytes_ = bytes;
+}
+
+}  // namespace chromeos_update_engine
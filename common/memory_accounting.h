@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_MEMORY_ACCOUNTING_H_
+#define UPDATE_ENGINE_COMMON_MEMORY_ACCOUNTING_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// The parts of the daemon holding large buffers while applying an update.
+enum class MemoryConsumer {
+  // The parsed manifest of the payload.
+  kManifest,
+  // The downloaded data waiting to be applied, see DownloadAheadBuffer.
+  kDownloadBuffer,
+  // The data and scratch space of the operations applied in parallel, see
+  // OperationPipeline.
+  kOperations,
+  // The read buffers of the partitions being hashed, see PartitionHasher.
+  kVerifier,
+  // The raw blocks queued for the COW writer, see CowWriteBatcher.
+  kCowWriter,
+
+  // This value must be the last entry.
+  kNumConsumers,
+};
+
+// Keeps count of the memory each MemoryConsumer holds, and of the peak of each
+// and of their total since the last ResetPeaks(). The counts are what the
+// consumers charge, not what the allocator actually maps.
+//
+// A soft limit on the total can be set. Nothing is refused past it, but the
+// consumers able to make do with less memory check OverSoftLimit() to back
+// off, e.g. ThroughputGovernor::LimitWorkers() runs fewer workers. Safe to use
+// from multiple threads.
+class MemoryAccounting {
+ public:
+  // The accounting of the daemon.
+  static MemoryAccounting* GetInstance();
+
+  MemoryAccounting() = default;
+
+  // Returns the name of |consumer| used in logs.
+  static const char* ConsumerName(MemoryConsumer consumer);
+
+  void Charge(MemoryConsumer consumer, size_t bytes);
+  void Release(MemoryConsumer consumer, size_t bytes);
+
+  size_t current(MemoryConsumer consumer) const;
+  size_t peak(MemoryConsumer consumer) const;
+  size_t total() const { return total_; }
+  size_t peak_total() const { return peak_total_; }
+
+  // Sets the soft limit on the total in bytes, 0 for none.
+  void set_soft_limit(size_t soft_limit) { soft_limit_ = soft_limit; }
+  bool OverSoftLimit() const;
+  // The number of times the total went over the soft limit since the last
+  // ResetPeaks().
+  int num_soft_limit_hits() const { return num_soft_limit_hits_; }
+
+  // Lowers the peaks to the current values, e.g. when an update attempt
+  // starts.
+  void ResetPeaks();
+
+  // Logs the current and peak memory of every consumer, once |phase| of the
+  // update is done.
+  void LogUsage(const std::string& phase) const;
+
+ private:
+  static constexpr size_t kNumConsumers =
+      static_cast<size_t>(MemoryConsumer::kNumConsumers);
+
+  // Raises |*peak| to |value| if it is lower.
+  static void UpdatePeak(std::atomic<size_t>* peak, size_t value);
+
+  std::array<std::atomic<size_t>, kNumConsumers> current_{};
+  std::array<std::atomic<size_t>, kNumConsumers> peak_{};
+  std::atomic<size_t> total_{0};
+  std::atomic<size_t> peak_total_{0};
+  std::atomic<size_t> soft_limit_{0};
+  std::atomic<int> num_soft_limit_hits_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryAccounting);
+};
+
+// Charges a changing number of bytes to a MemoryConsumer of the daemon's
+// MemoryAccounting, releasing them on destruction.
+class ScopedMemoryCharge {
+ public:
+  explicit ScopedMemoryCharge(MemoryConsumer consumer) : consumer_(consumer) {}
+  ~ScopedMemoryCharge() { Set(0); }
+
+  // Charges |bytes| instead of the bytes charged so far.
+  void Set(size_t bytes);
+
+  size_t bytes() const { return bytes_; }
+
+ private:
+  const MemoryConsumer consumer_;
+  size_t bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedMemoryCharge);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_MEMORY_ACCOUNTING_H_
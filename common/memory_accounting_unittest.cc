@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_accounting.h"
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(MemoryAccountingTest, PeaksTest) {
+  MemoryAccounting accounting;
+  accounting.Charge(MemoryConsumer::kOperations, 300);
+  accounting.Charge(MemoryConsumer::kVerifier, 200);
+  accounting.Release(MemoryConsumer::kOperations, 100);
+  EXPECT_EQ(200u, accounting.current(MemoryConsumer::kOperations));
+  EXPECT_EQ(300u, accounting.peak(MemoryConsumer::kOperations));
+  EXPECT_EQ(400u, accounting.total());
+  EXPECT_EQ(500u, accounting.peak_total());
+  EXPECT_EQ(0u, accounting.peak(MemoryConsumer::kManifest));
+
+  // The peaks start over from the current values.
+  accounting.ResetPeaks();
+  EXPECT_EQ(200u, accounting.peak(MemoryConsumer::kOperations));
+  EXPECT_EQ(400u, accounting.peak_total());
+}
+
+TEST(MemoryAccountingTest, SoftLimitTest) {
+  MemoryAccounting accounting;
+  accounting.Charge(MemoryConsumer::kDownloadBuffer, 1000);
+  EXPECT_FALSE(accounting.OverSoftLimit());
+
+  accounting.set_soft_limit(1500);
+  accounting.Charge(MemoryConsumer::kOperations, 400);
+  EXPECT_FALSE(accounting.OverSoftLimit());
+  accounting.Charge(MemoryConsumer::kOperations, 400);
+  EXPECT_TRUE(accounting.OverSoftLimit());
+  // Only going over the limit is counted, not staying over it.
+  accounting.Charge(MemoryConsumer::kOperations, 400);
+  EXPECT_EQ(1, accounting.num_soft_limit_hits());
+
+  accounting.Release(MemoryConsumer::kOperations, 1200);
+  EXPECT_FALSE(accounting.OverSoftLimit());
+  accounting.Charge(MemoryConsumer::kVerifier, 600);
+  EXPECT_EQ(2, accounting.num_soft_limit_hits());
+}
+
+TEST(MemoryAccountingTest, ScopedChargeTest) {
+  MemoryAccounting* accounting = MemoryAccounting::GetInstance();
+  const size_t current = accounting->current(MemoryConsumer::kCowWriter);
+  {
+    ScopedMemoryCharge charge(MemoryConsumer::kCowWriter);
+    charge.Set(4096);
+    EXPECT_EQ(current + 4096, accounting->current(MemoryConsumer::kCowWriter));
+    charge.Set(1024);
+    EXPECT_EQ(current + 1024, accounting->current(MemoryConsumer::kCowWriter));
+  }
+  EXPECT_EQ(current, accounting->current(MemoryConsumer::kCowWriter));
+}
+
+}  // namespace chromeos_update_engine
@@ -137,6 +137,81 @@ class MetricsReporterInterface {
       metrics::DownloadErrorCode payload_download_error_code,
       metrics::ConnectionType connection_type) = 0;
 
+  // Reports the cost of the update checkpoints written during an update
+  // attempt: their number, the time spent writing them and the duration of
+  // the slowest one.
+  virtual void ReportCheckpointMetrics(int num_checkpoints,
+                                       base::TimeDelta total_duration,
+                                       base::TimeDelta max_duration) = 0;
+
+  // Reports the mean time the |num_requests| requests of a download took to
+  // resolve the server name, to connect, to finish the TLS handshake and to
+  // receive the first byte, each counted from the start of the request, and
+  // the throughput of the requests that received data: the median, the one
+  // 95% of them reached and the slowest.
+  virtual void ReportDownloadTimingMetrics(
+      int num_requests,
+      base::TimeDelta name_lookup,
+      base::TimeDelta connect,
+      base::TimeDelta tls_handshake,
+      base::TimeDelta first_byte,
+      int64_t p50_bytes_per_second,
+      int64_t p95_bytes_per_second,
+      int64_t slowest_bytes_per_second) = 0;
+
+  // Reports how long the |num_operations| operations of type
+  // |operation_type| applied to |partition_name| took in total, how much
+  // of that was spent reading their source and writing their destination,
+  // and how many bytes of destination they wrote per second.
+  virtual void ReportInstallOperationMetrics(
+      const std::string& partition_name,
+      const std::string& operation_type,
+      int num_operations,
+      base::TimeDelta total_duration,
+      base::TimeDelta read_duration,
+      base::TimeDelta write_duration,
+      int64_t bytes_per_second) = 0;
+
+  // Reports the resources an update attempt used: the peak resident memory
+  // of the process, the CPU time spent downloading and applying the payload,
+  // verifying the target partitions and running postinstall, and the number
+  // of fsync() calls made writing the partitions and their total duration.
+  virtual void ReportResourceUsageMetrics(
+      int64_t peak_rss_bytes,
+      base::TimeDelta download_cpu_time,
+      base::TimeDelta verify_cpu_time,
+      base::TimeDelta postinstall_cpu_time,
+      int num_fsyncs,
+      base::TimeDelta fsync_duration) = 0;
+
+  // Reports how many bytes of target partitions were verified per second, and
+  // the number of install operations which read their source through forward
+  // error correction because the raw source partition was corrupted.
+  virtual void ReportVerificationMetrics(int64_t verify_bytes_per_second,
+                                         int num_fec_fallbacks) = 0;
+
+  // Reports the peak memory MemoryAccounting counted during an update attempt
+  // for all the buffers together and for those of the manifest, the download
+  // buffer, the operations applied in parallel, the verifier and the COW
+  // writer, and how many times the total went over the soft limit.
+  virtual void ReportMemoryUsageMetrics(int64_t peak_bytes,
+                                        int64_t manifest_peak_bytes,
+                                        int64_t download_buffer_peak_bytes,
+                                        int64_t operations_peak_bytes,
+                                        int64_t verifier_peak_bytes,
+                                        int64_t cow_writer_peak_bytes,
+                                        int num_soft_limit_hits) = 0;
+
+  // Reports how long an update attempt ran at each throughput level of
+  // ThroughputGovernor, from the one using the most of the device to the one
+  // using the least, and how many times the level changed.
+  virtual void ReportThroughputGovernorMetrics(
+      int num_level_changes,
+      base::TimeDelta full_duration,
+      base::TimeDelta normal_duration,
+      base::TimeDelta reduced_duration,
+      base::TimeDelta minimal_duration) = 0;
+
   // Reports the |kAbnormalTermination| for the |kMetricAttemptResult|
   // metric. No other metrics in the UpdateEngine.Attempt.* namespace
   // will be reported.
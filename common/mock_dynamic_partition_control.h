@@ -53,6 +53,8 @@ class MockDynamicPartitionControl : public DynamicPartitionControlInterface {
               (override));
   MOCK_METHOD(bool, MapAllPartitions, (), (override));
   MOCK_METHOD(bool, UnmapAllPartitions, (), (override));
+  MOCK_METHOD(void, StartMappingPartitions, (), (override));
+  MOCK_METHOD(bool, FinishMappingPartitions, (), (override));
 
   MOCK_METHOD(bool,
               OptimizeOperation,
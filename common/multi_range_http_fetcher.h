@@ -110,6 +110,14 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
     return base_fetcher_->GetBytesDownloaded();
   }
 
+  int64_t GetEstimatedBytesPerSecond() override {
+    return base_fetcher_->GetEstimatedBytesPerSecond();
+  }
+
+  std::vector<HttpTransferTiming> GetTransferTimings() override {
+    return base_fetcher_->GetTransferTimings();
+  }
+
   void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
     base_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
   }
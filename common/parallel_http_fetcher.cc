@@ -0,0 +1,327 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/parallel_http_fetcher.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/bind.h>
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+// Chunks each connection may be ahead of the one being delivered.
+constexpr size_t kChunksPerConnection = 2;
+}  // namespace
+
+ParallelHttpFetcher::ParallelHttpFetcher(
+    std::vector<std::unique_ptr<HttpFetcher>> fetchers, size_t chunk_size)
+    : chunk_size_(chunk_size),
+      max_window_(fetchers.size() * kChunksPerConnection) {
+  CHECK(!fetchers.empty());
+  CHECK_GT(chunk_size_, 0u);
+  for (auto& fetcher : fetchers) {
+    fetcher->set_delegate(this);
+    connections_.push_back({std::move(fetcher)});
+  }
+}
+
+ParallelHttpFetcher::~ParallelHttpFetcher() {
+  if (finish_task_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(finish_task_);
+  }
+}
+
+void ParallelHttpFetcher::BeginTransfer(const std::string& url) {
+  CHECK(!transfer_active_) << "BeginTransfer but already active.";
+  url_ = url;
+  http_response_code_ = 0;
+  terminating_ = failed_ = false;
+  window_.clear();
+  next_chunk_ = delivered_chunks_ = 0;
+  num_chunks_ = length_ > 0 ? (length_ + chunk_size_ - 1) / chunk_size_ : 1;
+  transfer_active_ = true;
+  Update();
+}
+
+void ParallelHttpFetcher::TerminateTransfer() {
+  if (!transfer_active_) {
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  terminating_ = true;
+  Update();
+}
+
+void ParallelHttpFetcher::Update() {
+  if (updating_) {
+    update_again_ = true;
+    return;
+  }
+  updating_ = true;
+  do {
+    update_again_ = false;
+    if (terminating_ || failed_) {
+      for (auto& connection : connections_) {
+        if (connection.active && !connection.terminate_requested) {
+          connection.terminate_requested = true;
+          connection.fetcher->TerminateTransfer();
+        }
+      }
+    } else {
+      DeliverData();
+      StartChunks();
+    }
+  } while (update_again_);
+  updating_ = false;
+
+  if (!transfer_active_ || finish_task_ != brillo::MessageLoop::kTaskIdNull ||
+      NumActiveConnections() > 0) {
+    return;
+  }
+  if (terminating_ || failed_ || delivered_chunks_ == num_chunks_) {
+    // Signal the delegate, which may destroy this object, once no fetcher
+    // callback is on the stack.
+    finish_task_ = brillo::MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&ParallelHttpFetcher::FinishTransfer,
+                   base::Unretained(this)));
+  }
+}
+
+void ParallelHttpFetcher::DeliverData() {
+  while (!paused_ && !terminating_ && !failed_ && !window_.empty()) {
+    Chunk& head = window_.front();
+    if (!head.data.empty()) {
+      brillo::Blob data;
+      data.swap(head.data);
+      if (delegate_ &&
+          !delegate_->ReceivedBytes(this, data.data(), data.size()))
+        return;
+      continue;
+    }
+    if (!head.complete)
+      return;
+    window_.pop_front();
+    delivered_chunks_++;
+  }
+}
+
+void ParallelHttpFetcher::StartChunks() {
+  for (auto& connection : connections_) {
+    if (terminating_ || failed_ || next_chunk_ >= num_chunks_ ||
+        window_.size() >= max_window_) {
+      return;
+    }
+    if (connection.active)
+      continue;
+    Chunk chunk;
+    chunk.offset = offset_ + static_cast<off_t>(next_chunk_ * chunk_size_);
+    if (length_ > 0)
+      chunk.length = std::min(chunk_size_, length_ - next_chunk_ * chunk_size_);
+    window_.push_back(std::move(chunk));
+    connection.chunk = next_chunk_++;
+    connection.active = true;
+    connection.terminate_requested = false;
+
+    HttpFetcher* fetcher = connection.fetcher.get();
+    fetcher->SetOffset(window_.back().offset);
+    if (window_.back().length > 0)
+      fetcher->SetLength(window_.back().length);
+    else
+      fetcher->UnsetLength();
+    // May call back into this object synchronously.
+    fetcher->BeginTransfer(url_);
+  }
+}
+
+bool ParallelHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                        const void* bytes,
+                                        size_t length) {
+  Connection* connection = FindConnection(fetcher);
+  CHECK(connection != nullptr);
+  if (!connection->active || connection->terminate_requested)
+    return false;
+  Chunk& chunk = ChunkOf(*connection);
+  // Fetchers may return more than the requested length.
+  if (chunk.length > 0)
+    length = std::min(length, chunk.length - chunk.received);
+  const auto data = static_cast<const uint8_t*>(bytes);
+  chunk.data.insert(chunk.data.end(), data, data + length);
+  chunk.received += length;
+  const bool chunk_received =
+      chunk.length > 0 && chunk.received == chunk.length;
+  if (chunk_received)
+    connection->terminate_requested = true;
+
+  Update();
+  if (chunk_received) {
+    // Like MultiRangeHttpFetcher, end the transfer once all requested bytes
+    // came in. The chunk is complete once the fetcher signals that.
+    fetcher->TerminateTransfer();
+    return false;
+  }
+  return true;
+}
+
+void ParallelHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                           bool successful) {
+  ConnectionEnded(fetcher, successful);
+}
+
+void ParallelHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
+  ConnectionEnded(fetcher, false);
+}
+
+void ParallelHttpFetcher::ConnectionEnded(HttpFetcher* fetcher,
+                                          bool successful) {
+  Connection* connection = FindConnection(fetcher);
+  CHECK(connection != nullptr);
+  CHECK(connection->active) << "Transfer ended unexpectedly.";
+  connection->active = false;
+  if (!terminating_ && !failed_) {
+    Chunk& chunk = ChunkOf(*connection);
+    if (chunk.length > 0 ? chunk.received == chunk.length : successful) {
+      chunk.complete = true;
+      if (fetcher->http_response_code() != 0)
+        http_response_code_ = fetcher->http_response_code();
+    } else {
+      LOG(ERROR) << "Failed to fetch chunk " << connection->chunk
+                 << " at offset " << chunk.offset << ", received "
+                 << chunk.received << " of " << chunk.length << " bytes.";
+      http_response_code_ = fetcher->http_response_code();
+      failed_ = true;
+    }
+  }
+  Update();
+}
+
+void ParallelHttpFetcher::FinishTransfer() {
+  finish_task_ = brillo::MessageLoop::kTaskIdNull;
+  transfer_active_ = false;
+  window_.clear();
+  if (!delegate_)
+    return;
+  // Note that after the callbacks return this object may be destroyed.
+  if (terminating_) {
+    delegate_->TransferTerminated(this);
+  } else {
+    delegate_->TransferComplete(this, !failed_);
+  }
+}
+
+ParallelHttpFetcher::Connection* ParallelHttpFetcher::FindConnection(
+    HttpFetcher* fetcher) {
+  for (auto& connection : connections_) {
+    if (connection.fetcher.get() == fetcher)
+      return &connection;
+  }
+  return nullptr;
+}
+
+ParallelHttpFetcher::Chunk& ParallelHttpFetcher::ChunkOf(
+    const Connection& connection) {
+  CHECK_GE(connection.chunk, delivered_chunks_);
+  return window_[connection.chunk - delivered_chunks_];
+}
+
+size_t ParallelHttpFetcher::NumActiveConnections() const {
+  return std::count_if(
+      connections_.begin(), connections_.end(), [](const Connection& c) {
+        return c.active;
+      });
+}
+
+void ParallelHttpFetcher::SetHeader(const std::string& header_name,
+                                    const std::string& header_value) {
+  for (auto& connection : connections_)
+    connection.fetcher->SetHeader(header_name, header_value);
+}
+
+void ParallelHttpFetcher::Pause() {
+  paused_ = true;
+  for (auto& connection : connections_)
+    connection.fetcher->Pause();
+}
+
+void ParallelHttpFetcher::Unpause() {
+  paused_ = false;
+  for (auto& connection : connections_)
+    connection.fetcher->Unpause();
+  Update();
+}
+
+void ParallelHttpFetcher::set_idle_seconds(int seconds) {
+  for (auto& connection : connections_)
+    connection.fetcher->set_idle_seconds(seconds);
+}
+
+void ParallelHttpFetcher::set_retry_seconds(int seconds) {
+  for (auto& connection : connections_)
+    connection.fetcher->set_retry_seconds(seconds);
+}
+
+void ParallelHttpFetcher::SetProxies(const std::deque<std::string>& proxies) {
+  HttpFetcher::SetProxies(proxies);
+  for (auto& connection : connections_)
+    connection.fetcher->SetProxies(proxies);
+}
+
+void ParallelHttpFetcher::set_low_speed_limit(int low_speed_bps,
+                                              int low_speed_sec) {
+  for (auto& connection : connections_)
+    connection.fetcher->set_low_speed_limit(low_speed_bps, low_speed_sec);
+}
+
+void ParallelHttpFetcher::set_connect_timeout(int connect_timeout_seconds) {
+  for (auto& connection : connections_)
+    connection.fetcher->set_connect_timeout(connect_timeout_seconds);
+}
+
+void ParallelHttpFetcher::set_max_retry_count(int max_retry_count) {
+  for (auto& connection : connections_)
+    connection.fetcher->set_max_retry_count(max_retry_count);
+}
+
+size_t ParallelHttpFetcher::GetBytesDownloaded() {
+  size_t bytes = 0;
+  for (auto& connection : connections_)
+    bytes += connection.fetcher->GetBytesDownloaded();
+  return bytes;
+}
+
+int64_t ParallelHttpFetcher::GetEstimatedBytesPerSecond() {
+  int64_t bytes_per_second = 0;
+  for (auto& connection : connections_)
+    bytes_per_second += connection.fetcher->GetEstimatedBytesPerSecond();
+  return bytes_per_second;
+}
+
+std::vector<HttpTransferTiming> ParallelHttpFetcher::GetTransferTimings() {
+  std::vector<HttpTransferTiming> timings;
+  for (auto& connection : connections_) {
+    auto connection_timings = connection.fetcher->GetTransferTimings();
+    timings.insert(
+        timings.end(), connection_timings.begin(), connection_timings.end());
+  }
+  return timings;
+}
+
+}  // namespace chromeos_update_engine
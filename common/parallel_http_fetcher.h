@@ -0,0 +1,158 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PARALLEL_HTTP_FETCHER_H_
+#define UPDATE_ENGINE_COMMON_PARALLEL_HTTP_FETCHER_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/http_fetcher.h"
+
+namespace chromeos_update_engine {
+
+// An HttpFetcher which downloads the requested range over several connections
+// at once, so that a single slow TCP stream doesn't cap the download. The
+// range is split into chunks which the child fetchers request one after the
+// other. Chunks arriving ahead of the one being delivered are buffered, at
+// most two chunks per connection, and the delegate always receives the bytes
+// in order, as from a single fetcher.
+//
+// Meant to be the base fetcher of a MultiRangeHttpFetcher, which issues one
+// transfer per range. Transfers without a length can't be split and use a
+// single connection. Completion is always signalled from the message loop.
+class ParallelHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
+ public:
+  static constexpr size_t kDefaultChunkSize = 4 * 1024 * 1024;  // 4 MiB
+  static constexpr size_t kMaxConnections = 8;
+
+  // Takes ownership of |fetchers|, which must not be empty and are
+  // configured through this object from now on.
+  explicit ParallelHttpFetcher(
+      std::vector<std::unique_ptr<HttpFetcher>> fetchers,
+      size_t chunk_size = kDefaultChunkSize);
+  ~ParallelHttpFetcher() override;
+
+  // HttpFetcher overrides.
+  void SetOffset(off_t offset) override { offset_ = offset; }
+  void SetLength(size_t length) override { length_ = length; }
+  void UnsetLength() override { length_ = 0; }
+
+  void BeginTransfer(const std::string& url) override;
+  void TerminateTransfer() override;
+
+  void SetHeader(const std::string& header_name,
+                 const std::string& header_value) override;
+  bool GetHeader(const std::string& header_name,
+                 std::string* header_value) const override {
+    return connections_.front().fetcher->GetHeader(header_name, header_value);
+  }
+
+  void Pause() override;
+  void Unpause() override;
+
+  void set_idle_seconds(int seconds) override;
+  void set_retry_seconds(int seconds) override;
+  void SetProxies(const std::deque<std::string>& proxies) override;
+  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override;
+  void set_connect_timeout(int connect_timeout_seconds) override;
+  void set_max_retry_count(int max_retry_count) override;
+
+  size_t GetBytesDownloaded() override;
+  // The sum of the estimates of all connections, which download at the same
+  // time.
+  int64_t GetEstimatedBytesPerSecond() override;
+  // The requests of all connections, grouped by connection.
+  std::vector<HttpTransferTiming> GetTransferTimings() override;
+
+ private:
+  struct Connection {
+    std::unique_ptr<HttpFetcher> fetcher;
+    // Index of the chunk being fetched while |active|.
+    size_t chunk{0};
+    bool active{false};
+    // Whether TerminateTransfer() was called on |fetcher|.
+    bool terminate_requested{false};
+  };
+
+  struct Chunk {
+    off_t offset{0};
+    // Zero if the transfer has no length.
+    size_t length{0};
+    size_t received{0};
+    // Bytes received but not passed on to the delegate yet.
+    brillo::Blob data;
+    // Whether all bytes of the chunk were received.
+    bool complete{false};
+  };
+
+  // HttpFetcherDelegate overrides, called by the child fetchers.
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override;
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+  void TransferTerminated(HttpFetcher* fetcher) override;
+
+  void ConnectionEnded(HttpFetcher* fetcher, bool successful);
+
+  // Delivers buffered bytes in order, hands out chunks to idle connections
+  // and schedules FinishTransfer() once all connections are done. Calls made
+  // while it runs, e.g. by fetchers completing synchronously, make it loop.
+  void Update();
+  void DeliverData();
+  void StartChunks();
+  void FinishTransfer();
+
+  Connection* FindConnection(HttpFetcher* fetcher);
+  Chunk& ChunkOf(const Connection& connection);
+  size_t NumActiveConnections() const;
+
+  std::vector<Connection> connections_;
+  const size_t chunk_size_;
+  // Chunks requested but not yet passed on to the delegate.
+  const size_t max_window_;
+
+  off_t offset_{0};
+  size_t length_{0};
+
+  bool transfer_active_{false};
+  bool terminating_{false};
+  bool failed_{false};
+  bool paused_{false};
+  bool updating_{false};
+  bool update_again_{false};
+
+  size_t num_chunks_{0};
+  // Index of the next chunk to request.
+  size_t next_chunk_{0};
+  // Number of chunks passed on to the delegate, the index of |window_|'s
+  // first chunk.
+  size_t delivered_chunks_{0};
+  std::deque<Chunk> window_;
+
+  brillo::MessageLoop::TaskId finish_task_{brillo::MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PARALLEL_HTTP_FETCHER_H_
@@ -0,0 +1,170 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/parallel_http_fetcher.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/mock_http_fetcher.h"
+#include "update_engine/common/multi_range_http_fetcher.h"
+
+using brillo::MessageLoop;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Not a multiple of kMockHttpFetcherChunkSize, so mock fetchers return more
+// than each chunk.
+constexpr size_t kChunkSize = 100 * 1000;
+
+class TestDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    data.append(static_cast<const char*>(bytes), length);
+    if (terminate_after > 0 && data.size() >= terminate_after) {
+      fetcher->TerminateTransfer();
+      return false;
+    }
+    return true;
+  }
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    completed = true;
+    success = successful;
+    MessageLoop::current()->BreakLoop();
+  }
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    terminated = true;
+    MessageLoop::current()->BreakLoop();
+  }
+
+  string data;
+  size_t terminate_after{0};
+  bool completed{false};
+  bool success{false};
+  bool terminated{false};
+};
+}  // namespace
+
+class ParallelHttpFetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    for (size_t i = 0; i < 1024 * 1024; i++) {
+      data_.push_back(static_cast<char>(i * 7 + i / 4096));
+    }
+  }
+
+  // Creates a fetcher with |num_connections| mock fetchers serving |data_|,
+  // collected in |mock_fetchers_|.
+  std::unique_ptr<ParallelHttpFetcher> CreateFetcher(size_t num_connections) {
+    std::vector<std::unique_ptr<HttpFetcher>> fetchers;
+    mock_fetchers_.clear();
+    for (size_t i = 0; i < num_connections; i++) {
+      auto fetcher = std::make_unique<MockHttpFetcher>(data_.data(),
+                                                       data_.size());
+      mock_fetchers_.push_back(fetcher.get());
+      fetchers.push_back(std::move(fetcher));
+    }
+    auto fetcher =
+        std::make_unique<ParallelHttpFetcher>(std::move(fetchers), kChunkSize);
+    fetcher->set_delegate(&delegate_);
+    return fetcher;
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  string data_;
+  std::vector<MockHttpFetcher*> mock_fetchers_;
+  TestDelegate delegate_;
+};
+
+TEST_F(ParallelHttpFetcherTest, DeliversRangeInOrder) {
+  auto fetcher = CreateFetcher(3);
+  fetcher->SetOffset(1000);
+  fetcher->SetLength(700 * 1000);
+  fetcher->BeginTransfer("http://fake/url");
+  loop_.Run();
+
+  ASSERT_TRUE(delegate_.completed);
+  ASSERT_TRUE(delegate_.success);
+  ASSERT_EQ(data_.substr(1000, 700 * 1000), delegate_.data);
+  // Every connection fetched some of the chunks.
+  for (auto* mock_fetcher : mock_fetchers_) {
+    ASSERT_GT(mock_fetcher->GetBytesDownloaded(), 0u);
+  }
+}
+
+TEST_F(ParallelHttpFetcherTest, TransferWithoutLengthUsesOneConnection) {
+  auto fetcher = CreateFetcher(2);
+  fetcher->SetOffset(data_.size() - 300 * 1000);
+  fetcher->BeginTransfer("http://fake/url");
+  loop_.Run();
+
+  ASSERT_TRUE(delegate_.success);
+  ASSERT_EQ(data_.substr(data_.size() - 300 * 1000), delegate_.data);
+  ASSERT_EQ(0u, mock_fetchers_[1]->GetBytesDownloaded());
+}
+
+TEST_F(ParallelHttpFetcherTest, FailedChunkFailsTransfer) {
+  auto fetcher = CreateFetcher(2);
+  mock_fetchers_[1]->FailTransfer(404);
+  fetcher->SetOffset(0);
+  fetcher->SetLength(5 * kChunkSize);
+  fetcher->BeginTransfer("http://fake/url");
+  loop_.Run();
+
+  ASSERT_TRUE(delegate_.completed);
+  ASSERT_FALSE(delegate_.success);
+  ASSERT_EQ(404, fetcher->http_response_code());
+  // Nothing past the failed chunk is delivered.
+  ASSERT_LE(delegate_.data.size(), kChunkSize);
+}
+
+TEST_F(ParallelHttpFetcherTest, TerminateTransfer) {
+  auto fetcher = CreateFetcher(2);
+  delegate_.terminate_after = kChunkSize + 1;
+  fetcher->SetOffset(0);
+  fetcher->SetLength(8 * kChunkSize);
+  fetcher->BeginTransfer("http://fake/url");
+  loop_.Run();
+
+  ASSERT_TRUE(delegate_.terminated);
+  ASSERT_FALSE(delegate_.completed);
+  ASSERT_EQ(data_.substr(0, delegate_.data.size()), delegate_.data);
+}
+
+TEST_F(ParallelHttpFetcherTest, MultiRangeBaseFetcher) {
+  MultiRangeHttpFetcher multi_fetcher(CreateFetcher(4).release());
+  multi_fetcher.set_delegate(&delegate_);
+  multi_fetcher.AddRange(10, 250 * 1000);
+  multi_fetcher.AddRange(500 * 1000, 400 * 1000);
+  multi_fetcher.BeginTransfer("http://fake/url");
+  loop_.Run();
+
+  ASSERT_TRUE(delegate_.success);
+  ASSERT_EQ(data_.substr(10, 250 * 1000) + data_.substr(500 * 1000, 400 * 1000),
+            delegate_.data);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,198 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/peer_cache_http_fetcher.h"
+
+#include <utility>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+PeerCacheHttpFetcher::PeerCacheHttpFetcher(
+    std::unique_ptr<HttpFetcher> peer_fetcher,
+    std::unique_ptr<HttpFetcher> origin_fetcher,
+    const std::string& peer_url)
+    : peer_fetcher_(std::move(peer_fetcher)),
+      origin_fetcher_(std::move(origin_fetcher)),
+      peer_url_(peer_url) {
+  peer_fetcher_->set_delegate(this);
+  origin_fetcher_->set_delegate(this);
+  // A failing peer is replaced by the origin instead of being retried.
+  peer_fetcher_->set_max_retry_count(0);
+  peer_fetcher_->set_connect_timeout(kPeerConnectTimeoutSeconds);
+}
+
+std::string PeerCacheHttpFetcher::PeerUrlFor(const std::string& peer_url,
+                                             const std::string& url) {
+  const size_t scheme_end = url.find("://");
+  if (scheme_end == std::string::npos ||
+      peer_url.find("://") == std::string::npos) {
+    return "";
+  }
+  const size_t path_start = url.find('/', scheme_end + 3);
+  std::string result = peer_url;
+  while (!result.empty() && result.back() == '/')
+    result.pop_back();
+  return result +
+         (path_start == std::string::npos ? "/" : url.substr(path_start));
+}
+
+void PeerCacheHttpFetcher::BeginTransfer(const std::string& url) {
+  CHECK(current_ == nullptr) << "BeginTransfer but already active.";
+  url_ = url;
+  http_response_code_ = 0;
+  received_ = 0;
+  terminating_ = false;
+  const std::string peer_url = PeerUrlFor(peer_url_, url);
+  if (peer_failures_ < kMaxPeerFailures && !peer_url.empty()) {
+    StartFetcher(peer_fetcher_.get(), peer_url);
+  } else {
+    StartFetcher(origin_fetcher_.get(), url);
+  }
+}
+
+void PeerCacheHttpFetcher::StartFetcher(HttpFetcher* fetcher,
+                                        const std::string& url) {
+  current_ = fetcher;
+  fetcher->SetOffset(offset_ + static_cast<off_t>(received_));
+  if (length_ > 0)
+    fetcher->SetLength(length_ - received_);
+  else
+    fetcher->UnsetLength();
+  // May call back into this object synchronously.
+  fetcher->BeginTransfer(url);
+  if (paused_ && current_ == fetcher)
+    fetcher->Pause();
+}
+
+void PeerCacheHttpFetcher::TerminateTransfer() {
+  if (current_ == nullptr) {
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  terminating_ = true;
+  current_->TerminateTransfer();
+}
+
+bool PeerCacheHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                         const void* bytes,
+                                         size_t length) {
+  if (fetcher != current_ || terminating_)
+    return false;
+  // Fetchers may return more than the requested length.
+  if (length_ > 0)
+    length = std::min(length, length_ - received_);
+  received_ += length;
+  if (fetcher == peer_fetcher_.get())
+    peer_bytes_ += length;
+  if (length > 0 && delegate_ &&
+      !delegate_->ReceivedBytes(this, bytes, length)) {
+    return false;
+  }
+  if (length_ > 0 && received_ == length_ && current_ == fetcher) {
+    // Like MultiRangeHttpFetcher, end the transfer once all requested bytes
+    // came in.
+    fetcher->TerminateTransfer();
+    return false;
+  }
+  return true;
+}
+
+void PeerCacheHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                            bool successful) {
+  if (fetcher != current_)
+    return;
+  const bool complete = length_ > 0 ? received_ == length_ : successful;
+  if (fetcher == peer_fetcher_.get() && !complete && !terminating_) {
+    peer_failures_++;
+    LOG(WARNING) << "Cache peer failed with HTTP response code "
+                 << fetcher->http_response_code() << " after " << received_
+                 << " bytes, fetching the rest from the origin server.";
+    StartFetcher(origin_fetcher_.get(), url_);
+    return;
+  }
+  current_ = nullptr;
+  http_response_code_ = fetcher->http_response_code();
+  // Note that after the callback returns this object may be destroyed.
+  if (delegate_)
+    delegate_->TransferComplete(this, complete);
+}
+
+void PeerCacheHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
+  if (fetcher != current_)
+    return;
+  current_ = nullptr;
+  if (!delegate_)
+    return;
+  // Terminated after receiving everything, see ReceivedBytes().
+  if (!terminating_ && length_ > 0 && received_ == length_) {
+    http_response_code_ = fetcher->http_response_code();
+    delegate_->TransferComplete(this, true);
+  } else {
+    delegate_->TransferTerminated(this);
+  }
+}
+
+void PeerCacheHttpFetcher::Pause() {
+  paused_ = true;
+  if (current_)
+    current_->Pause();
+}
+
+void PeerCacheHttpFetcher::Unpause() {
+  paused_ = false;
+  if (current_)
+    current_->Unpause();
+}
+
+void PeerCacheHttpFetcher::set_idle_seconds(int seconds) {
+  peer_fetcher_->set_idle_seconds(seconds);
+  origin_fetcher_->set_idle_seconds(seconds);
+}
+
+void PeerCacheHttpFetcher::set_retry_seconds(int seconds) {
+  peer_fetcher_->set_retry_seconds(seconds);
+  origin_fetcher_->set_retry_seconds(seconds);
+}
+
+void PeerCacheHttpFetcher::SetProxies(const std::deque<std::string>& proxies) {
+  HttpFetcher::SetProxies(proxies);
+  origin_fetcher_->SetProxies(proxies);
+}
+
+void PeerCacheHttpFetcher::set_low_speed_limit(int low_speed_bps,
+                                               int low_speed_sec) {
+  // A stalling peer is given up on like a failing one.
+  peer_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+  origin_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+}
+
+size_t PeerCacheHttpFetcher::GetBytesDownloaded() {
+  return peer_fetcher_->GetBytesDownloaded() +
+         origin_fetcher_->GetBytesDownloaded();
+}
+
+std::vector<HttpTransferTiming> PeerCacheHttpFetcher::GetTransferTimings() {
+  auto timings = peer_fetcher_->GetTransferTimings();
+  auto origin_timings = origin_fetcher_->GetTransferTimings();
+  timings.insert(timings.end(), origin_timings.begin(), origin_timings.end());
+  return timings;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PEER_CACHE_HTTP_FETCHER_H_
+#define UPDATE_ENGINE_COMMON_PEER_CACHE_HTTP_FETCHER_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "update_engine/common/http_fetcher.h"
+
+namespace chromeos_update_engine {
+
+// An HttpFetcher which first requests every transfer from a cache peer on the
+// local network, and falls back to the origin server for what the peer
+// doesn't deliver. A transfer the peer fails part way through is continued
+// from the origin at the first byte not received yet, so the delegate sees a
+// single stream either way. Once the peer failed kMaxPeerFailures transfers
+// it isn't asked anymore.
+//
+// The peer serves the payload under the path of the origin URL. It isn't
+// trusted: the data is verified by DeltaPerformer against the hashes in the
+// signed manifest like any other payload data. Headers and proxies are only
+// used for the origin server.
+class PeerCacheHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
+ public:
+  static constexpr int kMaxPeerFailures = 3;
+  // Peers are close by, don't wait long before falling back.
+  static constexpr int kPeerConnectTimeoutSeconds = 3;
+
+  // Takes ownership of both fetchers, which are configured through this
+  // object from now on. |peer_url| is the scheme and authority of the peer,
+  // e.g. "http://192.168.1.10:8080".
+  PeerCacheHttpFetcher(std::unique_ptr<HttpFetcher> peer_fetcher,
+                       std::unique_ptr<HttpFetcher> origin_fetcher,
+                       const std::string& peer_url);
+  ~PeerCacheHttpFetcher() override = default;
+
+  // Returns the URL of |url| on the peer at |peer_url|, empty if either isn't
+  // a valid URL.
+  static std::string PeerUrlFor(const std::string& peer_url,
+                                const std::string& url);
+
+  // HttpFetcher overrides.
+  void SetOffset(off_t offset) override { offset_ = offset; }
+  void SetLength(size_t length) override { length_ = length; }
+  void UnsetLength() override { length_ = 0; }
+
+  void BeginTransfer(const std::string& url) override;
+  void TerminateTransfer() override;
+
+  void SetHeader(const std::string& header_name,
+                 const std::string& header_value) override {
+    origin_fetcher_->SetHeader(header_name, header_value);
+  }
+  bool GetHeader(const std::string& header_name,
+                 std::string* header_value) const override {
+    return origin_fetcher_->GetHeader(header_name, header_value);
+  }
+
+  void Pause() override;
+  void Unpause() override;
+
+  void set_idle_seconds(int seconds) override;
+  void set_retry_seconds(int seconds) override;
+  void SetProxies(const std::deque<std::string>& proxies) override;
+  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override;
+  void set_connect_timeout(int connect_timeout_seconds) override {
+    origin_fetcher_->set_connect_timeout(connect_timeout_seconds);
+  }
+  void set_max_retry_count(int max_retry_count) override {
+    origin_fetcher_->set_max_retry_count(max_retry_count);
+  }
+
+  size_t GetBytesDownloaded() override;
+  int64_t GetEstimatedBytesPerSecond() override {
+    return current_ ? current_->GetEstimatedBytesPerSecond() : 0;
+  }
+  // The requests made to the peer followed by those made to the origin.
+  std::vector<HttpTransferTiming> GetTransferTimings() override;
+
+  // Bytes of the transfers so far delivered by the peer.
+  size_t peer_bytes() const { return peer_bytes_; }
+
+ private:
+  // HttpFetcherDelegate overrides, called by the peer and origin fetchers.
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override;
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+  void TransferTerminated(HttpFetcher* fetcher) override;
+
+  // Starts fetching the rest of the transfer from |fetcher|.
+  void StartFetcher(HttpFetcher* fetcher, const std::string& url);
+
+  std::unique_ptr<HttpFetcher> peer_fetcher_;
+  std::unique_ptr<HttpFetcher> origin_fetcher_;
+  const std::string peer_url_;
+
+  // The fetcher of the transfer in progress, if any.
+  HttpFetcher* current_{nullptr};
+  off_t offset_{0};
+  size_t length_{0};
+  // Bytes of the current transfer passed on to the delegate.
+  size_t received_{0};
+
+  int peer_failures_{0};
+  size_t peer_bytes_{0};
+  bool paused_{false};
+  bool terminating_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(PeerCacheHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PEER_CACHE_HTTP_FETCHER_H_
@@ -0,0 +1,156 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/peer_cache_http_fetcher.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/mock_http_fetcher.h"
+
+using brillo::MessageLoop;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+class TestDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    data.append(static_cast<const char*>(bytes), length);
+    if (on_received)
+      on_received();
+    return true;
+  }
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    completed = true;
+    success = successful;
+    MessageLoop::current()->BreakLoop();
+  }
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    terminated = true;
+    MessageLoop::current()->BreakLoop();
+  }
+
+  string data;
+  std::function<void()> on_received;
+  bool completed{false};
+  bool success{false};
+  bool terminated{false};
+};
+}  // namespace
+
+class PeerCacheHttpFetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    for (size_t i = 0; i < 300 * 1000; i++) {
+      data_.push_back(static_cast<char>(i * 7 + i / 4096));
+    }
+    auto peer = std::make_unique<MockHttpFetcher>(data_.data(), data_.size());
+    auto origin =
+        std::make_unique<MockHttpFetcher>(data_.data(), data_.size());
+    peer_ = peer.get();
+    origin_ = origin.get();
+    fetcher_ = std::make_unique<PeerCacheHttpFetcher>(
+        std::move(peer), std::move(origin), "http://peer:8080/");
+    fetcher_->set_delegate(&delegate_);
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  string data_;
+  MockHttpFetcher* peer_;
+  MockHttpFetcher* origin_;
+  std::unique_ptr<PeerCacheHttpFetcher> fetcher_;
+  TestDelegate delegate_;
+};
+
+TEST_F(PeerCacheHttpFetcherTest, PeerUrl) {
+  ASSERT_EQ("http://peer:8080/ota/payload.bin?x=1",
+            PeerCacheHttpFetcher::PeerUrlFor(
+                "http://peer:8080/", "https://cdn.com/ota/payload.bin?x=1"));
+  ASSERT_EQ("http://peer/",
+            PeerCacheHttpFetcher::PeerUrlFor("http://peer", "http://cdn"));
+  ASSERT_EQ("", PeerCacheHttpFetcher::PeerUrlFor("peer", "http://cdn/a"));
+  ASSERT_EQ("", PeerCacheHttpFetcher::PeerUrlFor("http://peer", "file"));
+}
+
+TEST_F(PeerCacheHttpFetcherTest, FetchesFromPeer) {
+  origin_->set_never_use(true);
+  fetcher_->SetOffset(1000);
+  fetcher_->SetLength(200 * 1000);
+  fetcher_->BeginTransfer("http://cdn/payload.bin");
+  loop_.Run();
+
+  ASSERT_TRUE(delegate_.completed);
+  ASSERT_TRUE(delegate_.success);
+  ASSERT_EQ(data_.substr(1000, 200 * 1000), delegate_.data);
+  ASSERT_EQ(200u * 1000, fetcher_->peer_bytes());
+}
+
+TEST_F(PeerCacheHttpFetcherTest, FallsBackToOrigin) {
+  peer_->FailTransfer(404);
+  fetcher_->SetOffset(1000);
+  fetcher_->SetLength(200 * 1000);
+  fetcher_->BeginTransfer("http://cdn/payload.bin");
+  loop_.Run();
+
+  ASSERT_TRUE(delegate_.success);
+  ASSERT_EQ(data_.substr(1000, 200 * 1000), delegate_.data);
+  ASSERT_EQ(0u, fetcher_->peer_bytes());
+}
+
+TEST_F(PeerCacheHttpFetcherTest, ContinuesFromOriginAfterPeerFailure) {
+  // The peer fails after delivering its first chunk.
+  delegate_.on_received = [this]() {
+    if (delegate_.data.size() == kMockHttpFetcherChunkSize)
+      peer_->FailTransfer(500);
+  };
+  fetcher_->SetOffset(0);
+  fetcher_->BeginTransfer("http://cdn/payload.bin");
+  loop_.Run();
+
+  ASSERT_TRUE(delegate_.success);
+  ASSERT_EQ(data_, delegate_.data);
+  ASSERT_EQ(kMockHttpFetcherChunkSize, fetcher_->peer_bytes());
+}
+
+TEST_F(PeerCacheHttpFetcherTest, StopsAskingFailingPeer) {
+  peer_->FailTransfer(404);
+  for (int i = 0; i <= PeerCacheHttpFetcher::kMaxPeerFailures; i++) {
+    delegate_ = TestDelegate();
+    fetcher_->SetOffset(0);
+    fetcher_->SetLength(1000);
+    fetcher_->BeginTransfer("http://cdn/payload.bin");
+    loop_.Run();
+    ASSERT_TRUE(delegate_.success);
+  }
+  // The last transfer went to the origin only.
+  peer_->set_never_use(true);
+  delegate_ = TestDelegate();
+  fetcher_->BeginTransfer("http://cdn/payload.bin");
+  loop_.Run();
+  ASSERT_TRUE(delegate_.success);
+}
+
+}  // namespace chromeos_update_engine
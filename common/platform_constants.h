@@ -54,6 +54,9 @@ extern const char kOmahaResponseDeadlineFile[];
 // The stateful directory used by update_engine.
 extern const char kNonVolatileDirectory[];
 
+// Path to the update_engine.conf of the running image.
+extern const char kUpdateEngineConfPath[];
+
 #ifdef __ANDROID_RECOVERY__
 constexpr bool kIsRecovery = true;
 #else
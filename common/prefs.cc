@@ -17,7 +17,10 @@
 #include "update_engine/common/prefs.h"
 
 #include <algorithm>
+#include <cstring>
 #include <filesystem>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <android-base/file.h>
@@ -25,9 +28,12 @@
 #include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_split.h>
+#include <brillo/secure_blob.h>
 
 #include "android-base/strings.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 
 using std::string;
@@ -52,14 +58,130 @@ void DeleteEmptyDirectories(const base::FilePath& path) {
   }
 }
 
+constexpr uint32_t kLogRecordMagic = 0x31504555;  // "UEP1"
+constexpr size_t kLogHeaderSize = 2 * sizeof(uint32_t);
+constexpr size_t kLogChecksumSize = 32;  // SHA-256
+
+template <typename T>
+void Put(brillo::Blob* out, const T& value) {
+  const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+  out->insert(out->end(), bytes, bytes + sizeof(value));
+}
+
+void PutString(brillo::Blob* out, std::string_view value) {
+  Put(out, static_cast<uint32_t>(value.size()));
+  out->insert(out->end(), value.begin(), value.end());
+}
+
+// Consumes values from the body of a log record. Every Get*() fails once the
+// body is exhausted.
+class RecordReader {
+ public:
+  RecordReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  template <typename T>
+  bool Get(T* value) {
+    if (size_ - offset_ < sizeof(*value)) {
+      return false;
+    }
+    memcpy(value, data_ + offset_, sizeof(*value));
+    offset_ += sizeof(*value);
+    return true;
+  }
+
+  bool GetString(string* value) {
+    uint32_t length = 0;
+    if (!Get(&length) || size_ - offset_ < length) {
+      return false;
+    }
+    value->assign(reinterpret_cast<const char*>(data_ + offset_), length);
+    offset_ += length;
+    return true;
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t offset_{0};
+};
+
+// Returns the log record holding |changes|, where a key without value is
+// deleted.
+template <typename Changes>
+bool MakeLogRecord(const Changes& changes, brillo::Blob* record) {
+  brillo::Blob body;
+  Put(&body, static_cast<uint32_t>(changes.size()));
+  for (const auto& [key, value] : changes) {
+    Put(&body, static_cast<uint8_t>(value.has_value()));
+    PutString(&body, key);
+    if (value) {
+      PutString(&body, *value);
+    }
+  }
+  brillo::Blob checksum;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfBytes(body.data(), body.size(), &checksum));
+  record->clear();
+  record->reserve(kLogHeaderSize + body.size() + checksum.size());
+  Put(record, kLogRecordMagic);
+  Put(record, static_cast<uint32_t>(body.size()));
+  record->insert(record->end(), body.begin(), body.end());
+  record->insert(record->end(), checksum.begin(), checksum.end());
+  return true;
+}
+
 }  // namespace
 
+void PrefsBase::ClearCache() {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  cache_.clear();
+  transaction_keys_.clear();
+  in_transaction_ = false;
+}
+
+void PrefsBase::CacheValue(std::string_view key,
+                           std::optional<std::string> value) {
+  auto it = cache_.find(key);
+  if (it == cache_.end()) {
+    cache_.emplace(key, std::move(value));
+  } else {
+    it->second = std::move(value);
+  }
+  if (in_transaction_) {
+    transaction_keys_.emplace(key);
+  }
+}
+
 bool PrefsBase::GetString(const std::string_view key, string* value) const {
-  return storage_->GetKey(key, value);
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  auto it = cache_.find(key);
+  if (it != cache_.end()) {
+    if (!it->second) {
+      return false;
+    }
+    *value = *it->second;
+    return true;
+  }
+  if (storage_->GetKey(key, value)) {
+    cache_.emplace(key, *value);
+    return true;
+  }
+  // Don't remember read errors as missing keys.
+  if (!storage_->KeyExists(key)) {
+    cache_.emplace(key, std::nullopt);
+  }
+  return false;
 }
 
 bool PrefsBase::SetString(std::string_view key, std::string_view value) {
-  TEST_AND_RETURN_FALSE(storage_->SetKey(key, value));
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto it = cache_.find(key);
+    if (it == cache_.end() || it->second != value) {
+      TEST_AND_RETURN_FALSE(storage_->SetKey(key, value));
+      CacheValue(key, std::string{value});
+    }
+  }
   const auto observers_for_key = observers_.find(key);
   if (observers_for_key != observers_.end()) {
     std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
@@ -112,11 +234,27 @@ bool PrefsBase::SetBoolean(std::string_view key, const bool value) {
 }
 
 bool PrefsBase::Exists(std::string_view key) const {
-  return storage_->KeyExists(key);
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  auto it = cache_.find(key);
+  if (it != cache_.end()) {
+    return it->second.has_value();
+  }
+  if (!storage_->KeyExists(key)) {
+    cache_.emplace(key, std::nullopt);
+    return false;
+  }
+  return true;
 }
 
 bool PrefsBase::Delete(std::string_view key) {
-  TEST_AND_RETURN_FALSE(storage_->DeleteKey(key));
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto it = cache_.find(key);
+    if (it == cache_.end() || it->second) {
+      TEST_AND_RETURN_FALSE(storage_->DeleteKey(key));
+      CacheValue(key, std::nullopt);
+    }
+  }
   const auto observers_for_key = observers_.find(key);
   if (observers_for_key != observers_.end()) {
     std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
@@ -169,19 +307,70 @@ string PrefsInterface::CreateSubKey(const vector<string>& ns_and_key) {
 // Prefs
 
 bool Prefs::Init(const base::FilePath& prefs_dir) {
+  ClearCache();
   return file_storage_.Init(prefs_dir);
 }
 
+bool Prefs::Init(const base::FilePath& prefs_dir,
+                 const vector<string>& log_prefixes) {
+  ClearCache();
+  TEST_AND_RETURN_FALSE(file_storage_.Init(prefs_dir));
+  if (log_prefixes.empty()) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(log_storage_.Init(prefs_dir.value() + ".log"));
+  storage_.set_log_prefixes(log_prefixes);
+  // Move the keys stored in files by builds without the log. Until the file is
+  // deleted, the move can just be done again.
+  for (const auto& prefix : log_prefixes) {
+    vector<string> keys;
+    TEST_AND_RETURN_FALSE(file_storage_.GetSubKeys(prefix, &keys));
+    for (const auto& key : keys) {
+      string value;
+      TEST_AND_RETURN_FALSE(file_storage_.GetKey(key, &value));
+      TEST_AND_RETURN_FALSE(log_storage_.SetKey(key, value));
+      TEST_AND_RETURN_FALSE(file_storage_.DeleteKey(key));
+    }
+    LOG_IF(INFO, !keys.empty())
+        << "Moved " << keys.size() << " prefs starting with " << prefix
+        << " to the log.";
+  }
+  return true;
+}
+
 bool PrefsBase::StartTransaction() {
-  return storage_->CreateTemporaryPrefs();
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  // Like the storage, drop the changes of an unfinished transaction.
+  for (const auto& key : transaction_keys_) {
+    cache_.erase(key);
+  }
+  transaction_keys_.clear();
+  in_transaction_ = storage_->CreateTemporaryPrefs();
+  return in_transaction_;
 }
 
 bool PrefsBase::CancelTransaction() {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  for (const auto& key : transaction_keys_) {
+    cache_.erase(key);
+  }
+  transaction_keys_.clear();
+  in_transaction_ = false;
   return storage_->DeleteTemporaryPrefs();
 }
 
 bool PrefsBase::SubmitTransaction() {
-  return storage_->SwapPrefs();
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  const bool success = storage_->SwapPrefs();
+  if (!success) {
+    // Whatever the storage holds now, read it again.
+    for (const auto& key : transaction_keys_) {
+      cache_.erase(key);
+    }
+  }
+  transaction_keys_.clear();
+  in_transaction_ = false;
+  return success;
 }
 
 std::string Prefs::FileStorage::GetTemporaryDir() const {
@@ -339,6 +528,311 @@ bool Prefs::FileStorage::GetFileNameForKey(std::string_view key,
   return true;
 }
 
+// Prefs::SplitStorage
+
+bool Prefs::SplitStorage::IsLogKey(std::string_view key) const {
+  return std::any_of(
+      log_prefixes_.begin(), log_prefixes_.end(), [key](const string& prefix) {
+        return android::base::StartsWith(key, prefix);
+      });
+}
+
+bool Prefs::SplitStorage::StartFileTransaction() {
+  if (in_transaction_ && !files_in_transaction_) {
+    TEST_AND_RETURN_FALSE(files_->CreateTemporaryPrefs());
+    files_in_transaction_ = true;
+  }
+  return true;
+}
+
+bool Prefs::SplitStorage::GetKey(std::string_view key, string* value) const {
+  return IsLogKey(key) ? log_->GetKey(key, value) : files_->GetKey(key, value);
+}
+
+bool Prefs::SplitStorage::GetSubKeys(std::string_view ns,
+                                     vector<string>* keys) const {
+  TEST_AND_RETURN_FALSE(files_->GetSubKeys(ns, keys));
+  return log_prefixes_.empty() || log_->GetSubKeys(ns, keys);
+}
+
+bool Prefs::SplitStorage::SetKey(std::string_view key, std::string_view value) {
+  if (IsLogKey(key)) {
+    return log_->SetKey(key, value);
+  }
+  TEST_AND_RETURN_FALSE(StartFileTransaction());
+  return files_->SetKey(key, value);
+}
+
+bool Prefs::SplitStorage::KeyExists(std::string_view key) const {
+  return IsLogKey(key) ? log_->KeyExists(key) : files_->KeyExists(key);
+}
+
+bool Prefs::SplitStorage::DeleteKey(std::string_view key) {
+  if (IsLogKey(key)) {
+    return log_->DeleteKey(key);
+  }
+  TEST_AND_RETURN_FALSE(StartFileTransaction());
+  return files_->DeleteKey(key);
+}
+
+bool Prefs::SplitStorage::CreateTemporaryPrefs() {
+  if (log_prefixes_.empty()) {
+    return files_->CreateTemporaryPrefs();
+  }
+  // Don't carry over the file transaction of a previous, unfinished one.
+  DeleteTemporaryPrefs();
+  TEST_AND_RETURN_FALSE(log_->CreateTemporaryPrefs());
+  in_transaction_ = true;
+  return true;
+}
+
+bool Prefs::SplitStorage::DeleteTemporaryPrefs() {
+  if (log_prefixes_.empty()) {
+    return files_->DeleteTemporaryPrefs();
+  }
+  in_transaction_ = false;
+  bool success = log_->DeleteTemporaryPrefs();
+  if (files_in_transaction_) {
+    files_in_transaction_ = false;
+    success = files_->DeleteTemporaryPrefs() && success;
+  }
+  return success;
+}
+
+bool Prefs::SplitStorage::SwapPrefs() {
+  if (log_prefixes_.empty()) {
+    return files_->SwapPrefs();
+  }
+  TEST_AND_RETURN_FALSE(in_transaction_);
+  in_transaction_ = false;
+  if (!log_->SwapPrefs()) {
+    DeleteTemporaryPrefs();
+    return false;
+  }
+  if (files_in_transaction_) {
+    files_in_transaction_ = false;
+    TEST_AND_RETURN_FALSE(files_->SwapPrefs());
+  }
+  return true;
+}
+
+// LogPrefsStorage
+
+LogPrefsStorage::~LogPrefsStorage() {
+  if (fd_ >= 0) {
+    IGNORE_EINTR(close(fd_));
+  }
+}
+
+bool LogPrefsStorage::Init(const string& path) {
+  TEST_AND_RETURN_FALSE(fd_ < 0);
+  path_ = path;
+  fd_ = HANDLE_EINTR(open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+  TEST_AND_RETURN_FALSE_ERRNO(fd_ >= 0);
+
+  struct stat st {};
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(fd_, &st) == 0);
+  brillo::Blob data(st.st_size);
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd_, data.data(), data.size(), 0, &bytes_read));
+  data.resize(bytes_read);
+
+  values_.clear();
+  values_size_ = 0;
+  uint64_t offset = 0;
+  while (data.size() - offset >= kLogHeaderSize) {
+    uint32_t magic = 0;
+    uint32_t body_size = 0;
+    memcpy(&magic, data.data() + offset, sizeof(magic));
+    memcpy(&body_size, data.data() + offset + sizeof(magic), sizeof(body_size));
+    if (magic != kLogRecordMagic ||
+        data.size() - offset - kLogHeaderSize < body_size + kLogChecksumSize) {
+      break;
+    }
+    const uint8_t* body = data.data() + offset + kLogHeaderSize;
+    brillo::Blob checksum;
+    if (!HashCalculator::RawHashOfBytes(body, body_size, &checksum) ||
+        memcmp(checksum.data(), body + body_size, kLogChecksumSize) != 0) {
+      break;
+    }
+    RecordReader reader(body, body_size);
+    uint32_t count = 0;
+    Changes changes;
+    bool valid = reader.Get(&count);
+    for (uint32_t i = 0; valid && i < count; i++) {
+      uint8_t has_value = 0;
+      string key;
+      string value;
+      valid = reader.Get(&has_value) && reader.GetString(&key) &&
+              (!has_value || reader.GetString(&value));
+      if (valid) {
+        changes[key] =
+            has_value ? std::optional<string>(std::move(value)) : std::nullopt;
+      }
+    }
+    if (!valid) {
+      break;
+    }
+    for (auto& [key, value] : changes) {
+      auto it = values_.find(key);
+      if (it != values_.end()) {
+        values_size_ -= it->first.size() + it->second.size();
+        values_.erase(it);
+      }
+      if (value) {
+        values_size_ += key.size() + value->size();
+        values_.emplace(key, std::move(*value));
+      }
+    }
+    offset += kLogHeaderSize + body_size + kLogChecksumSize;
+  }
+  write_offset_ = offset;
+  if (offset < data.size()) {
+    LOG(WARNING) << "Dropping " << data.size() - offset
+                 << " bytes of incomplete records from " << path_;
+    TEST_AND_RETURN_FALSE_ERRNO(ftruncate(fd_, offset) == 0);
+  }
+  return true;
+}
+
+const string* LogPrefsStorage::Find(std::string_view key) const {
+  if (transaction_) {
+    auto it = transaction_->find(key);
+    if (it != transaction_->end()) {
+      return it->second ? &*it->second : nullptr;
+    }
+  }
+  auto it = values_.find(key);
+  return it == values_.end() ? nullptr : &it->second;
+}
+
+bool LogPrefsStorage::GetKey(std::string_view key, string* value) const {
+  const string* current = Find(key);
+  if (current == nullptr) {
+    return false;
+  }
+  *value = *current;
+  return true;
+}
+
+bool LogPrefsStorage::GetSubKeys(std::string_view ns,
+                                 vector<string>* keys) const {
+  for (auto it = values_.lower_bound(ns);
+       it != values_.end() && android::base::StartsWith(it->first, ns);
+       ++it) {
+    if (Find(it->first) != nullptr) {
+      keys->push_back(it->first);
+    }
+  }
+  if (transaction_) {
+    for (const auto& [key, value] : *transaction_) {
+      if (value && android::base::StartsWith(key, ns) &&
+          values_.find(key) == values_.end()) {
+        keys->push_back(key);
+      }
+    }
+  }
+  return true;
+}
+
+bool LogPrefsStorage::SetKey(std::string_view key, std::string_view value) {
+  TEST_AND_RETURN_FALSE(!key.empty());
+  if (transaction_) {
+    (*transaction_)[string{key}] = string{value};
+    return true;
+  }
+  return Commit({{string{key}, string{value}}});
+}
+
+bool LogPrefsStorage::KeyExists(std::string_view key) const {
+  return Find(key) != nullptr;
+}
+
+bool LogPrefsStorage::DeleteKey(std::string_view key) {
+  if (transaction_) {
+    (*transaction_)[string{key}] = std::nullopt;
+    return true;
+  }
+  if (values_.find(key) == values_.end()) {
+    return true;
+  }
+  return Commit({{string{key}, std::nullopt}});
+}
+
+bool LogPrefsStorage::CreateTemporaryPrefs() {
+  transaction_.emplace();
+  return true;
+}
+
+bool LogPrefsStorage::DeleteTemporaryPrefs() {
+  transaction_.reset();
+  return true;
+}
+
+bool LogPrefsStorage::SwapPrefs() {
+  TEST_AND_RETURN_FALSE(transaction_);
+  Changes changes = std::move(*transaction_);
+  transaction_.reset();
+  return changes.empty() || Commit(changes);
+}
+
+bool LogPrefsStorage::Commit(const Changes& changes) {
+  TEST_AND_RETURN_FALSE(fd_ >= 0);
+  brillo::Blob record;
+  TEST_AND_RETURN_FALSE(MakeLogRecord(changes, &record));
+  TEST_AND_RETURN_FALSE_ERRNO(
+      utils::PWriteAll(fd_, record.data(), record.size(), write_offset_));
+  TEST_AND_RETURN_FALSE_ERRNO(fdatasync(fd_) == 0);
+  write_offset_ += record.size();
+
+  for (const auto& [key, value] : changes) {
+    auto it = values_.find(key);
+    if (it != values_.end()) {
+      values_size_ -= it->first.size() + it->second.size();
+      values_.erase(it);
+    }
+    if (value) {
+      values_size_ += key.size() + value->size();
+      values_.emplace(key, *value);
+    }
+  }
+  if (write_offset_ > kMinCompactionSize &&
+      write_offset_ > kCompactionFactor * values_size_) {
+    // The new record is durable already, a failed compaction loses nothing.
+    LOG_IF(WARNING, !Compact()) << "Failed to compact " << path_;
+  }
+  return true;
+}
+
+bool LogPrefsStorage::Compact() {
+  Changes changes;
+  for (const auto& [key, value] : values_) {
+    changes.emplace(key, value);
+  }
+  brillo::Blob record;
+  TEST_AND_RETURN_FALSE(MakeLogRecord(changes, &record));
+
+  const string new_path = path_ + ".new";
+  int fd = HANDLE_EINTR(
+      open(new_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  if (!utils::PWriteAll(fd, record.data(), record.size(), 0) ||
+      fdatasync(fd) != 0 || rename(new_path.c_str(), path_.c_str()) != 0) {
+    PLOG(ERROR) << "Failed to write the compacted log " << new_path;
+    IGNORE_EINTR(close(fd));
+    unlink(new_path.c_str());
+    return false;
+  }
+  IGNORE_EINTR(close(fd_));
+  fd_ = fd;
+  write_offset_ = record.size();
+  if (!utils::FsyncDirectory(android::base::Dirname(path_).c_str())) {
+    PLOG(WARNING) << "Failed to fsync the directory of " << path_;
+  }
+  return true;
+}
+
 // MemoryPrefs
 
 bool MemoryPrefs::MemoryStorage::GetKey(std::string_view key,
@@ -17,10 +17,16 @@
 #ifndef UPDATE_ENGINE_COMMON_PREFS_H_
 #define UPDATE_ENGINE_COMMON_PREFS_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include <base/files/file_path.h>
@@ -75,6 +81,9 @@ class PrefsBase : public PrefsInterface {
     DISALLOW_COPY_AND_ASSIGN(StorageInterface);
   };
 
+  // The values read or written are cached in memory, so the |storage| is
+  // only read once per key and written when a value changes. It must not be
+  // changed by anything else meanwhile.
   explicit PrefsBase(StorageInterface* storage) : storage_(storage) {}
 
   // PrefsInterface methods.
@@ -100,30 +109,123 @@ class PrefsBase : public PrefsInterface {
   void RemoveObserver(std::string_view key,
                       ObserverInterface* observer) override;
 
+ protected:
+  // Forgets the cached values, e.g. when the storage is initialized again.
+  void ClearCache();
+
  private:
   // The registered observers watching for changes.
   std::map<std::string, std::vector<ObserverInterface*>, std::less<>>
       observers_;
 
+  // Updates the cached value of |key|, std::nullopt if it doesn't exist.
+  // |cache_mutex_| must be held.
+  void CacheValue(std::string_view key, std::optional<std::string> value);
+
   // The concrete implementation of the storage used for the keys.
   StorageInterface* storage_;
 
+  mutable std::mutex cache_mutex_;
+  // The known values of the keys, std::nullopt for the ones known not to
+  // exist.
+  mutable std::map<std::string, std::optional<std::string>, std::less<>>
+      cache_;
+  // Whether a transaction is in progress and the keys it changed, which are
+  // dropped from |cache_| if it doesn't go through.
+  bool in_transaction_{false};
+  std::set<std::string, std::less<>> transaction_keys_;
+
   DISALLOW_COPY_AND_ASSIGN(PrefsBase);
 };
 
+// Keeps all its keys in a single append-only file. Every change, or every
+// transaction, is appended as one record followed by its checksum and made
+// durable with a single fdatasync(), instead of the atomic file write per key
+// and the copy of the prefs directory per transaction of Prefs::FileStorage.
+// A record cut short by a crash is detected by its checksum and dropped along
+// with anything after it. The log is rewritten with only the current values
+// once it grows past kCompactionFactor times their size.
+//
+// Changes made between CreateTemporaryPrefs() and SwapPrefs() are only kept
+// in memory, and are visible to the getters, until SwapPrefs() appends them.
+class LogPrefsStorage : public PrefsBase::StorageInterface {
+ public:
+  static constexpr size_t kMinCompactionSize = 64 * 1024;  // 64 KiB
+  static constexpr size_t kCompactionFactor = 4;
+
+  LogPrefsStorage() = default;
+  ~LogPrefsStorage() override;
+
+  // Opens or creates the log at |path| and loads the values it holds.
+  bool Init(const std::string& path);
+
+  // PrefsBase::StorageInterface overrides.
+  bool GetKey(std::string_view key, std::string* value) const override;
+  bool GetSubKeys(std::string_view ns,
+                  std::vector<std::string>* keys) const override;
+  bool SetKey(std::string_view key, std::string_view value) override;
+  bool KeyExists(std::string_view key) const override;
+  bool DeleteKey(std::string_view key) override;
+  bool CreateTemporaryPrefs() override;
+  bool DeleteTemporaryPrefs() override;
+  bool SwapPrefs() override;
+
+  // Size of the log, for tests.
+  uint64_t log_size() const { return write_offset_; }
+
+ private:
+  // New values of the changed keys, or std::nullopt for the deleted ones.
+  using Changes =
+      std::map<std::string, std::optional<std::string>, std::less<>>;
+
+  // Durably appends |changes| to the log as one record and applies them.
+  bool Commit(const Changes& changes);
+
+  // Rewrites the log with the current values only.
+  bool Compact();
+
+  // Returns the current value of |key| within the transaction.
+  const std::string* Find(std::string_view key) const;
+
+  std::string path_;
+  int fd_{-1};
+  // Offset the next record is written at.
+  uint64_t write_offset_{0};
+
+  std::map<std::string, std::string, std::less<>> values_;
+  // Total size of the keys and values in |values_|.
+  uint64_t values_size_{0};
+  // The changes of the transaction in progress, if any.
+  std::optional<Changes> transaction_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogPrefsStorage);
+};
+
 // Implements a preference store by storing the value associated with
 // a key in a separate file named after the key under a preference
 // store directory.
 
+//
+// The keys starting with one of the log prefixes passed to Init(), typically
+// the ones written on every checkpoint, are kept in a LogPrefsStorage instead.
+// A transaction is then only atomic for the keys of each kind on their own:
+// the log keys are committed first, and the prefs directory is only copied
+// once a key stored in a file is changed.
 class Prefs : public PrefsBase {
  public:
-  Prefs() : PrefsBase(&file_storage_) {}
+  Prefs() : PrefsBase(&storage_) {}
 
   // Initializes the store by associating this object with |prefs_dir|
   // as the preference store directory. Returns true on success, false
   // otherwise.
   bool Init(const base::FilePath& prefs_dir);
 
+  // Like Init(), but also keeps the keys starting with any of |log_prefixes|
+  // in a log next to |prefs_dir|, with the ".log" extension. Such keys found
+  // in files are moved to the log.
+  bool Init(const base::FilePath& prefs_dir,
+            const std::vector<std::string>& log_prefixes);
+
  private:
   FRIEND_TEST(PrefsTest, GetFileNameForKey);
   FRIEND_TEST(PrefsTest, GetFileNameForKeyBadCharacter);
@@ -163,8 +265,45 @@ class Prefs : public PrefsBase {
     base::FilePath prefs_dir_;
   };
 
-  // The concrete file storage implementation.
+  // Passes the log keys to a LogPrefsStorage and the others to a FileStorage.
+  class SplitStorage : public PrefsBase::StorageInterface {
+   public:
+    SplitStorage(FileStorage* files, LogPrefsStorage* log)
+        : files_(files), log_(log) {}
+
+    void set_log_prefixes(std::vector<std::string> log_prefixes) {
+      log_prefixes_ = std::move(log_prefixes);
+    }
+
+    // PrefsBase::StorageInterface overrides.
+    bool GetKey(std::string_view key, std::string* value) const override;
+    bool GetSubKeys(std::string_view ns,
+                    std::vector<std::string>* keys) const override;
+    bool SetKey(std::string_view key, std::string_view value) override;
+    bool KeyExists(std::string_view key) const override;
+    bool DeleteKey(std::string_view key) override;
+    bool CreateTemporaryPrefs() override;
+    bool DeleteTemporaryPrefs() override;
+    bool SwapPrefs() override;
+
+   private:
+    bool IsLogKey(std::string_view key) const;
+
+    // Starts the transaction of |files_| on the first change of a file key
+    // within a transaction.
+    bool StartFileTransaction();
+
+    FileStorage* files_;
+    LogPrefsStorage* log_;
+    std::vector<std::string> log_prefixes_;
+    bool in_transaction_{false};
+    bool files_in_transaction_{false};
+  };
+
+  // The concrete storage implementations.
   FileStorage file_storage_;
+  LogPrefsStorage log_storage_;
+  SplitStorage storage_{&file_storage_, &log_storage_};
 
   DISALLOW_COPY_AND_ASSIGN(Prefs);
 };
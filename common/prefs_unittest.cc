@@ -17,8 +17,10 @@
 #include "update_engine/common/prefs.h"
 
 #include <inttypes.h>
+#include <unistd.h>
 
 #include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -33,7 +35,10 @@ using std::string;
 using std::vector;
 using testing::_;
 using testing::ElementsAre;
+using testing::DoAll;
 using testing::Eq;
+using testing::Return;
+using testing::SetArgPointee;
 using testing::UnorderedElementsAre;
 
 namespace {
@@ -585,6 +590,94 @@ TEST_F(PrefsTest, MultiNamespaceKeyTest) {
   MultiNamespaceKeyTest();
 }
 
+class MockStorage : public PrefsBase::StorageInterface {
+ public:
+  MOCK_METHOD(bool,
+              GetKey,
+              (std::string_view key, string* value),
+              (const, override));
+  MOCK_METHOD(bool,
+              GetSubKeys,
+              (std::string_view ns, vector<string>* keys),
+              (const, override));
+  MOCK_METHOD(bool,
+              SetKey,
+              (std::string_view key, std::string_view value),
+              (override));
+  MOCK_METHOD(bool, KeyExists, (std::string_view key), (const, override));
+  MOCK_METHOD(bool, DeleteKey, (std::string_view key), (override));
+  MOCK_METHOD(bool, CreateTemporaryPrefs, (), (override));
+  MOCK_METHOD(bool, DeleteTemporaryPrefs, (), (override));
+};
+
+TEST(PrefsCacheTest, ReadsEachKeyOnce) {
+  testing::StrictMock<MockStorage> storage;
+  PrefsBase prefs(&storage);
+  EXPECT_CALL(storage, GetKey(Eq(kKey), _))
+      .WillOnce(DoAll(SetArgPointee<1>("value"), Return(true)));
+  EXPECT_CALL(storage, GetKey(Eq("missing"), _)).WillOnce(Return(false));
+  EXPECT_CALL(storage, KeyExists(Eq("missing"))).WillOnce(Return(false));
+
+  string value;
+  for (int i = 0; i < 2; i++) {
+    EXPECT_TRUE(prefs.GetString(kKey, &value));
+    EXPECT_EQ("value", value);
+    EXPECT_TRUE(prefs.Exists(kKey));
+    EXPECT_FALSE(prefs.GetString("missing", &value));
+    EXPECT_FALSE(prefs.Exists("missing"));
+  }
+}
+
+TEST(PrefsCacheTest, WritesOnlyChanges) {
+  testing::StrictMock<MockStorage> storage;
+  PrefsBase prefs(&storage);
+  MockPrefsObserver observer;
+  prefs.AddObserver(kKey, &observer);
+  EXPECT_CALL(storage, SetKey(Eq(kKey), Eq("1"))).WillOnce(Return(true));
+  EXPECT_CALL(storage, DeleteKey(Eq(kKey))).WillOnce(Return(true));
+  // Observers still see every call.
+  EXPECT_CALL(observer, OnPrefSet(Eq(kKey))).Times(2);
+  EXPECT_CALL(observer, OnPrefDeleted(Eq(kKey))).Times(2);
+
+  EXPECT_TRUE(prefs.SetInt64(kKey, 1));
+  EXPECT_TRUE(prefs.SetInt64(kKey, 1));
+  EXPECT_TRUE(prefs.Delete(kKey));
+  EXPECT_TRUE(prefs.Delete(kKey));
+  EXPECT_FALSE(prefs.Exists(kKey));
+  prefs.RemoveObserver(kKey, &observer);
+}
+
+TEST(PrefsCacheTest, FailedWritesNotCached) {
+  testing::StrictMock<MockStorage> storage;
+  PrefsBase prefs(&storage);
+  EXPECT_CALL(storage, SetKey(Eq(kKey), Eq("value"))).WillOnce(Return(false));
+  EXPECT_CALL(storage, GetKey(Eq(kKey), _)).WillOnce(Return(false));
+  EXPECT_CALL(storage, KeyExists(Eq(kKey))).WillOnce(Return(true));
+
+  string value;
+  EXPECT_FALSE(prefs.SetString(kKey, "value"));
+  EXPECT_FALSE(prefs.GetString(kKey, &value));
+  // The read error isn't taken for a missing key.
+  EXPECT_TRUE(prefs.Exists(kKey));
+}
+
+TEST(PrefsCacheTest, CancelledTransactionNotCached) {
+  testing::StrictMock<MockStorage> storage;
+  PrefsBase prefs(&storage);
+  EXPECT_CALL(storage, CreateTemporaryPrefs()).WillOnce(Return(true));
+  EXPECT_CALL(storage, SetKey(Eq(kKey), Eq("new"))).WillOnce(Return(true));
+  EXPECT_CALL(storage, DeleteTemporaryPrefs()).WillOnce(Return(true));
+  EXPECT_CALL(storage, GetKey(Eq(kKey), _))
+      .WillOnce(DoAll(SetArgPointee<1>("old"), Return(true)));
+
+  ASSERT_TRUE(prefs.StartTransaction());
+  ASSERT_TRUE(prefs.SetString(kKey, "new"));
+  ASSERT_TRUE(prefs.CancelTransaction());
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("old", value);
+}
+
 class MemoryPrefsTest : public BasePrefsTest {
  protected:
   void SetUp() override { common_prefs_ = &prefs_; }
@@ -616,4 +709,140 @@ TEST_F(MemoryPrefsTest, MultiNamespaceKeyTest) {
   MultiNamespaceKeyTest();
 }
 
+class LogPrefsTest : public BasePrefsTest {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    prefs_dir_ = temp_dir_.GetPath().Append("prefs");
+    log_path_ = base::FilePath(prefs_dir_.value() + ".log");
+    ASSERT_TRUE(base::CreateDirectory(prefs_dir_));
+    Reload();
+  }
+
+  void Reload() {
+    prefs_ = std::make_unique<Prefs>();
+    ASSERT_TRUE(prefs_->Init(prefs_dir_, {"hot-", "ns1"}));
+    common_prefs_ = prefs_.get();
+  }
+
+  base::ScopedTempDir temp_dir_;
+  base::FilePath prefs_dir_;
+  base::FilePath log_path_;
+  std::unique_ptr<Prefs> prefs_;
+};
+
+TEST_F(LogPrefsTest, KeysPersistInLog) {
+  ASSERT_TRUE(prefs_->SetInt64("hot-key", 1234));
+  ASSERT_TRUE(prefs_->SetString(kKey, "cold"));
+  ASSERT_TRUE(prefs_->SetString("hot-deleted", "value"));
+  ASSERT_TRUE(prefs_->Delete("hot-deleted"));
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append("hot-key")));
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append(kKey)));
+
+  Reload();
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_->GetInt64("hot-key", &value));
+  EXPECT_EQ(1234, value);
+  string cold;
+  EXPECT_TRUE(prefs_->GetString(kKey, &cold));
+  EXPECT_EQ("cold", cold);
+  EXPECT_FALSE(prefs_->Exists("hot-deleted"));
+}
+
+TEST_F(LogPrefsTest, Transaction) {
+  ASSERT_TRUE(prefs_->SetInt64("hot-key", 1));
+  ASSERT_TRUE(prefs_->StartTransaction());
+  ASSERT_TRUE(prefs_->SetInt64("hot-key", 2));
+  ASSERT_TRUE(prefs_->SetInt64("hot-other", 3));
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_->GetInt64("hot-key", &value));
+  EXPECT_EQ(2, value);
+  int64_t log_size = 0;
+  ASSERT_TRUE(base::GetFileSize(log_path_, &log_size));
+  ASSERT_TRUE(prefs_->CancelTransaction());
+  // Nothing was written for the cancelled transaction.
+  int64_t new_log_size = 0;
+  ASSERT_TRUE(base::GetFileSize(log_path_, &new_log_size));
+  EXPECT_EQ(log_size, new_log_size);
+  EXPECT_TRUE(prefs_->GetInt64("hot-key", &value));
+  EXPECT_EQ(1, value);
+  EXPECT_FALSE(prefs_->Exists("hot-other"));
+
+  ASSERT_TRUE(prefs_->StartTransaction());
+  ASSERT_TRUE(prefs_->SetInt64("hot-key", 2));
+  ASSERT_TRUE(prefs_->SetInt64("hot-other", 3));
+  // Only the log keys were changed, so the directory isn't copied.
+  EXPECT_FALSE(base::PathExists(base::FilePath(prefs_dir_.value() + "_tmp")));
+  ASSERT_TRUE(prefs_->SubmitTransaction());
+  ASSERT_TRUE(base::GetFileSize(log_path_, &new_log_size));
+  EXPECT_GT(new_log_size, log_size);
+
+  Reload();
+  EXPECT_TRUE(prefs_->GetInt64("hot-key", &value));
+  EXPECT_EQ(2, value);
+  EXPECT_TRUE(prefs_->GetInt64("hot-other", &value));
+  EXPECT_EQ(3, value);
+}
+
+TEST_F(LogPrefsTest, TransactionWithFileKeys) {
+  ASSERT_TRUE(prefs_->StartTransaction());
+  ASSERT_TRUE(prefs_->SetInt64("hot-key", 1));
+  ASSERT_TRUE(prefs_->SetString(kKey, "cold"));
+  ASSERT_TRUE(prefs_->SubmitTransaction());
+  ASSERT_TRUE(prefs_->CancelTransaction());
+
+  Reload();
+  EXPECT_TRUE(prefs_->Exists("hot-key"));
+  EXPECT_TRUE(prefs_->Exists(kKey));
+}
+
+TEST_F(LogPrefsTest, DropsIncompleteRecords) {
+  ASSERT_TRUE(prefs_->SetInt64("hot-key", 1));
+  int64_t log_size = 0;
+  ASSERT_TRUE(base::GetFileSize(log_path_, &log_size));
+  ASSERT_TRUE(prefs_->SetInt64("hot-key", 2));
+  // Cut the last record short, as a crash while appending it would.
+  ASSERT_EQ(0, truncate(log_path_.value().c_str(), log_size + 10));
+
+  Reload();
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_->GetInt64("hot-key", &value));
+  EXPECT_EQ(1, value);
+  // New records go where the incomplete one was.
+  ASSERT_TRUE(prefs_->SetInt64("hot-key", 3));
+  Reload();
+  EXPECT_TRUE(prefs_->GetInt64("hot-key", &value));
+  EXPECT_EQ(3, value);
+}
+
+TEST_F(LogPrefsTest, CompactsLog) {
+  for (int i = 0; i < 2000; i++) {
+    ASSERT_TRUE(prefs_->SetInt64("hot-key", i));
+  }
+  int64_t log_size = 0;
+  ASSERT_TRUE(base::GetFileSize(log_path_, &log_size));
+  EXPECT_LE(log_size, static_cast<int64_t>(LogPrefsStorage::kMinCompactionSize));
+
+  Reload();
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_->GetInt64("hot-key", &value));
+  EXPECT_EQ(1999, value);
+}
+
+TEST_F(LogPrefsTest, MovesFileKeysToLog) {
+  const string value = "1234";
+  ASSERT_EQ(static_cast<int>(value.size()),
+            base::WriteFile(
+                prefs_dir_.Append("hot-key"), value.data(), value.size()));
+  Reload();
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append("hot-key")));
+  string read_value;
+  EXPECT_TRUE(prefs_->GetString("hot-key", &read_value));
+  EXPECT_EQ(value, read_value);
+}
+
+TEST_F(LogPrefsTest, MultiNamespaceKeyTest) {
+  MultiNamespaceKeyTest();
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,210 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/sha256_multi_buffer.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+namespace chromeos_update_engine {
+
+namespace {
+// Compiles to SSE2 or NEON registers, every operation applies to all lanes.
+using Vec = uint32_t __attribute__((vector_size(4 * kSha256Lanes)));
+
+constexpr size_t kBlockSize = 64;
+
+constexpr uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+constexpr uint32_t kInitialState[8] = {0x6a09e667,
+                                       0xbb67ae85,
+                                       0x3c6ef372,
+                                       0xa54ff53a,
+                                       0x510e527f,
+                                       0x9b05688c,
+                                       0x1f83d9ab,
+                                       0x5be0cd19};
+
+inline Vec Rotr(Vec x, int bits) {
+  return (x >> bits) | (x << (32 - bits));
+}
+
+inline uint32_t LoadBigEndian(const uint8_t* p) {
+  return (uint32_t{p[0]} << 24) | (uint32_t{p[1]} << 16) |
+         (uint32_t{p[2]} << 8) | uint32_t{p[3]};
+}
+
+// The message of a lane: its whole blocks are read in place, the remaining
+// bytes and the padding are copied to |tail|.
+struct Lane {
+  bool active{false};
+  size_t index{0};
+  const uint8_t* data{nullptr};
+  size_t whole_blocks{0};
+  size_t num_blocks{0};
+  size_t next_block{0};
+  uint8_t tail[2 * kBlockSize];
+
+  void Start(size_t message_index, const uint8_t* message, size_t length) {
+    active = true;
+    index = message_index;
+    data = message;
+    whole_blocks = length / kBlockSize;
+    next_block = 0;
+    const size_t tail_size = length % kBlockSize;
+    // The 0x80 byte and the 64-bit length need to fit after the data.
+    num_blocks = whole_blocks + (tail_size + 9 > kBlockSize ? 2 : 1);
+    memset(tail, 0, sizeof(tail));
+    if (tail_size > 0) {
+      memcpy(tail, message + whole_blocks * kBlockSize, tail_size);
+    }
+    tail[tail_size] = 0x80;
+    const uint64_t bits = static_cast<uint64_t>(length) * 8;
+    uint8_t* end = tail + (num_blocks - whole_blocks) * kBlockSize;
+    for (int i = 1; i <= 8; i++) {
+      end[-i] = static_cast<uint8_t>(bits >> (8 * (i - 1)));
+    }
+  }
+
+  const uint8_t* Block() const {
+    if (next_block < whole_blocks) {
+      return data + next_block * kBlockSize;
+    }
+    return tail + (next_block - whole_blocks) * kBlockSize;
+  }
+};
+
+void Compress(Vec state[8], const uint8_t* const blocks[kSha256Lanes]) {
+  Vec w[64];
+  for (size_t t = 0; t < 16; t++) {
+    for (size_t lane = 0; lane < kSha256Lanes; lane++) {
+      w[t][lane] = LoadBigEndian(blocks[lane] + 4 * t);
+    }
+  }
+  for (size_t t = 16; t < 64; t++) {
+    const Vec s0 = Rotr(w[t - 15], 7) ^ Rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+    const Vec s1 = Rotr(w[t - 2], 17) ^ Rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+    w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+  }
+  Vec a = state[0], b = state[1], c = state[2], d = state[3];
+  Vec e = state[4], f = state[5], g = state[6], h = state[7];
+  for (size_t t = 0; t < 64; t++) {
+    const Vec s1 = Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25);
+    const Vec ch = (e & f) ^ (~e & g);
+    const Vec temp1 = h + s1 + ch + kRoundConstants[t] + w[t];
+    const Vec s0 = Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22);
+    const Vec maj = (a & b) ^ (a & c) ^ (b & c);
+    h = g;
+    g = f;
+    f = e;
+    e = d + temp1;
+    d = c;
+    c = b;
+    b = a;
+    a = temp1 + s0 + maj;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+}  // namespace
+
+bool HasSha256Instructions() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  // CPUID leaf 7, EBX bit 29.
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29));
+#elif defined(__aarch64__)
+  return getauxval(AT_HWCAP) & HWCAP_SHA2;
+#else
+  return false;
+#endif
+}
+
+void Sha256MultiBuffer(const uint8_t* const* data,
+                       const size_t* lengths,
+                       size_t count,
+                       uint8_t* digests) {
+  Lane lanes[kSha256Lanes];
+  Vec state[8];
+  size_t next_message = 0;
+  size_t active_lanes = 0;
+  auto start_next = [&](size_t lane) {
+    if (next_message >= count) {
+      lanes[lane].active = false;
+      return;
+    }
+    lanes[lane].Start(next_message, data[next_message], lengths[next_message]);
+    next_message++;
+    active_lanes++;
+    for (size_t i = 0; i < 8; i++) {
+      state[i][lane] = kInitialState[i];
+    }
+  };
+  for (size_t lane = 0; lane < kSha256Lanes; lane++) {
+    start_next(lane);
+  }
+
+  // Idle lanes hash this block, their result is thrown away.
+  static const uint8_t kIdleBlock[kBlockSize] = {};
+  while (active_lanes > 0) {
+    const uint8_t* blocks[kSha256Lanes];
+    for (size_t lane = 0; lane < kSha256Lanes; lane++) {
+      blocks[lane] = lanes[lane].active ? lanes[lane].Block() : kIdleBlock;
+    }
+    Compress(state, blocks);
+    for (size_t lane = 0; lane < kSha256Lanes; lane++) {
+      Lane& current = lanes[lane];
+      if (!current.active || ++current.next_block < current.num_blocks) {
+        continue;
+      }
+      for (size_t i = 0; i < 8; i++) {
+        const uint32_t word = state[i][lane];
+        uint8_t* out = digests + 32 * current.index + 4 * i;
+        out[0] = word >> 24;
+        out[1] = word >> 16;
+        out[2] = word >> 8;
+        out[3] = word;
+      }
+      active_lanes--;
+      start_next(lane);
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
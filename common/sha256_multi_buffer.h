@@ -0,0 +1,46 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_SHA256_MULTI_BUFFER_H_
+#define UPDATE_ENGINE_COMMON_SHA256_MULTI_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace chromeos_update_engine {
+
+// Number of messages Sha256MultiBuffer() hashes at the same time, one per
+// 32-bit lane of a 128-bit vector.
+constexpr size_t kSha256Lanes = 4;
+
+// Whether the CPU has SHA-256 instructions (x86 SHA extensions or the ARMv8
+// SHA2 ones). libcrypto uses them for a single message, which beats hashing
+// several messages in vector lanes.
+bool HasSha256Instructions();
+
+// Computes the SHA-256 of each of the |count| messages of |lengths[i]| bytes
+// at |data[i]|, storing the 32 byte digests at |digests| + 32 * i. The
+// messages are hashed |kSha256Lanes| at a time, a lane taking the next message
+// as soon as its message is done, so this suits many short messages of any
+// lengths.
+void Sha256MultiBuffer(const uint8_t* const* data,
+                       const size_t* lengths,
+                       size_t count,
+                       uint8_t* digests);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_SHA256_MULTI_BUFFER_H_
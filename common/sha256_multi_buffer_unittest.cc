@@ -0,0 +1,71 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/sha256_multi_buffer.h"
+
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+
+namespace chromeos_update_engine {
+
+TEST(Sha256MultiBufferTest, MatchesSingleBufferHashes) {
+  // Lengths around the padding boundaries, more messages than lanes so lanes
+  // pick up new messages while others are still hashing.
+  const std::vector<size_t> lengths = {
+      0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 4096, 12345, 3, 70000};
+  std::vector<brillo::Blob> messages;
+  std::vector<const uint8_t*> data;
+  for (size_t length : lengths) {
+    brillo::Blob message(length);
+    for (size_t i = 0; i < length; i++) {
+      message[i] = (i * 31 + length) & 0xff;
+    }
+    messages.push_back(std::move(message));
+  }
+  for (const auto& message : messages) {
+    data.push_back(message.data());
+  }
+  brillo::Blob digests(32 * messages.size());
+  Sha256MultiBuffer(
+      data.data(), lengths.data(), lengths.size(), digests.data());
+
+  for (size_t i = 0; i < messages.size(); i++) {
+    brillo::Blob expected;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(messages[i], &expected));
+    EXPECT_EQ(expected,
+              brillo::Blob(digests.begin() + 32 * i,
+                           digests.begin() + 32 * (i + 1)))
+        << "length " << lengths[i];
+  }
+}
+
+TEST(Sha256MultiBufferTest, RawHashOfDataBatch) {
+  std::vector<brillo::Blob> messages = {{}, {1, 2, 3}, brillo::Blob(5000, 7)};
+  std::vector<brillo::Blob> hashes;
+  ASSERT_TRUE(HashCalculator::RawHashOfDataBatch(messages, &hashes));
+  ASSERT_EQ(messages.size(), hashes.size());
+  for (size_t i = 0; i < messages.size(); i++) {
+    brillo::Blob expected;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(messages[i], &expected));
+    EXPECT_EQ(expected, hashes[i]);
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -16,12 +16,18 @@
 
 #include "update_engine/common/subprocess.h"
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
@@ -30,6 +36,7 @@
 #include <base/bind.h>
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
 #include <android-base/stringprintf.h>
 #include <brillo/secure_blob.h>
 
@@ -44,62 +51,170 @@ namespace chromeos_update_engine {
 
 namespace {
 
-bool SetupChild(const std::map<string, string>& env, uint32_t flags) {
-  // Setup the environment variables.
-  clearenv();
-  if (setpgid(0, 0) != 0) {
-    PLOG(ERROR) << "Failed to setpgid on subprocess " << getpid();
-    return false;
+// Owns the posix_spawn() attributes and file actions used to start a child.
+class SpawnOptions {
+ public:
+  SpawnOptions() {
+    posix_spawnattr_init(&attr_);
+    posix_spawn_file_actions_init(&actions_);
   }
-  for (const auto& key_value : env) {
-    setenv(key_value.first.c_str(), key_value.second.c_str(), 0);
+  ~SpawnOptions() {
+    posix_spawn_file_actions_destroy(&actions_);
+    posix_spawnattr_destroy(&attr_);
   }
 
-  if ((flags & Subprocess::kRedirectStderrToStdout) != 0) {
-    if (HANDLE_EINTR(dup2(STDOUT_FILENO, STDERR_FILENO)) != STDERR_FILENO)
-      return false;
+  posix_spawnattr_t* attr() { return &attr_; }
+  posix_spawn_file_actions_t* actions() { return &actions_; }
+
+ private:
+  posix_spawnattr_t attr_;
+  posix_spawn_file_actions_t actions_;
+
+  DISALLOW_COPY_AND_ASSIGN(SpawnOptions);
+};
+
+#ifndef POSIX_SPAWN_CLOEXEC_DEFAULT
+// Returns the file descriptors above stderr which a child would inherit, i.e.
+// the ones not marked close-on-exec.
+vector<int> GetInheritableFds() {
+  vector<int> fds;
+  DIR* dir = opendir("/proc/self/fd");
+  if (dir == nullptr) {
+    PLOG(WARNING) << "Failed to list the open file descriptors";
+    return fds;
   }
-
-  int fd = HANDLE_EINTR(open("/dev/null", O_RDONLY));
-  if (fd < 0)
-    return false;
-  if (HANDLE_EINTR(dup2(fd, STDIN_FILENO)) != STDIN_FILENO)
-    return false;
-  IGNORE_EINTR(close(fd));
-
-  return true;
+  while (const struct dirent* entry = readdir(dir)) {
+    int fd;
+    if (!base::StringToInt(entry->d_name, &fd) || fd <= STDERR_FILENO ||
+        fd == dirfd(dir)) {
+      continue;
+    }
+    int fd_flags = fcntl(fd, F_GETFD);
+    if (fd_flags >= 0 && (fd_flags & FD_CLOEXEC) == 0)
+      fds.push_back(fd);
+  }
+  closedir(dir);
+  return fds;
 }
+#endif  // POSIX_SPAWN_CLOEXEC_DEFAULT
 
 // Helper function to launch a process with the given Subprocess::Flags.
 // This function only sets up and starts the process according to the |flags|.
 // The caller is responsible for watching the termination of the subprocess.
-// Return whether the process was successfully launched and fills in the |proc|
-// Process.
+// Return whether the process was successfully launched and fills in its |pid|
+// and our end of the |pipes| mapped onto the child stdout and |output_pipes|.
+// The child is started with posix_spawn(), which doesn't copy the address space
+// of the parent like fork() does, so the cost of launching doesn't grow with
+// the memory used by the update_engine.
 bool LaunchProcess(const vector<string>& cmd,
                    uint32_t flags,
                    const vector<int>& output_pipes,
-                   brillo::Process* proc) {
+                   pid_t* pid,
+                   std::map<int, base::ScopedFD>* pipes) {
+  TEST_AND_RETURN_FALSE(!cmd.empty());
+  vector<char*> argv;
   for (const string& arg : cmd)
-    proc->AddArg(arg);
-  proc->SetSearchPath((flags & Subprocess::kSearchPath) != 0);
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
 
   // Create an environment for the child process with just the required PATHs.
-  std::map<string, string> env;
+  vector<string> env;
   for (const char* key : {"LD_LIBRARY_PATH", "PATH"}) {
     const char* value = getenv(key);
     if (value)
-      env.emplace(key, value);
+      env.push_back(string(key) + "=" + value);
   }
-
-  for (const int fd : output_pipes) {
-    proc->RedirectUsingPipe(fd, false);
+  vector<char*> envp;
+  for (const string& key_value : env)
+    envp.push_back(const_cast<char*>(key_value.c_str()));
+  envp.push_back(nullptr);
+
+  SpawnOptions options;
+  short spawn_flags =  // NOLINT(runtime/int)
+      POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+  spawn_flags |= POSIX_SPAWN_USEVFORK;
+#endif  // POSIX_SPAWN_USEVFORK
+  // Only stdin, stdout, stderr and the |output_pipes| are open in the child.
+#ifdef POSIX_SPAWN_CLOEXEC_DEFAULT
+  spawn_flags |= POSIX_SPAWN_CLOEXEC_DEFAULT;
+#else
+  for (const int fd : GetInheritableFds()) {
+    TEST_AND_RETURN_FALSE(
+        posix_spawn_file_actions_addclose(options.actions(), fd) == 0);
   }
-  proc->SetCloseUnusedFileDescriptors(true);
-  proc->RedirectUsingPipe(STDOUT_FILENO, false);
-  proc->SetPreExecCallback(base::Bind(&SetupChild, env, flags));
+#endif  // POSIX_SPAWN_CLOEXEC_DEFAULT
+  sigset_t signals;
+  sigemptyset(&signals);
+  TEST_AND_RETURN_FALSE(posix_spawnattr_setsigmask(options.attr(), &signals) ==
+                        0);
+  sigfillset(&signals);
+  sigdelset(&signals, SIGKILL);
+  sigdelset(&signals, SIGSTOP);
+  TEST_AND_RETURN_FALSE(
+      posix_spawnattr_setsigdefault(options.attr(), &signals) == 0);
+  TEST_AND_RETURN_FALSE(posix_spawnattr_setpgroup(options.attr(), 0) == 0);
+  TEST_AND_RETURN_FALSE(posix_spawnattr_setflags(options.attr(), spawn_flags) ==
+                        0);
+
+  vector<int> child_fds = output_pipes;
+  child_fds.push_back(STDOUT_FILENO);
+  const int max_child_fd =
+      *std::max_element(child_fds.begin(), child_fds.end());
+  // The child ends of the pipes are closed in the parent once the child runs.
+  vector<base::ScopedFD> child_ends;
+  for (const int child_fd : child_fds) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+      PLOG(ERROR) << "Failed to create a pipe for fd " << child_fd;
+      return false;
+    }
+    base::ScopedFD reader(fds[0]);
+    base::ScopedFD writer(fds[1]);
+    // Move the child end above all the |child_fds| so mapping one of them in
+    // the child doesn't overwrite the end of another pipe.
+    base::ScopedFD child_end(
+        HANDLE_EINTR(fcntl(writer.get(), F_DUPFD_CLOEXEC, max_child_fd + 1)));
+    if (!child_end.is_valid()) {
+      PLOG(ERROR) << "Failed to duplicate the pipe for fd " << child_fd;
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(posix_spawn_file_actions_adddup2(
+                              options.actions(), child_end.get(), child_fd) ==
+                          0);
+    (*pipes)[child_fd] = std::move(reader);
+    child_ends.push_back(std::move(child_end));
+  }
+  if ((flags & Subprocess::kRedirectStderrToStdout) != 0) {
+    TEST_AND_RETURN_FALSE(
+        posix_spawn_file_actions_adddup2(
+            options.actions(), STDOUT_FILENO, STDERR_FILENO) == 0);
+  }
+  TEST_AND_RETURN_FALSE(
+      posix_spawn_file_actions_addopen(
+          options.actions(), STDIN_FILENO, "/dev/null", O_RDONLY, 0) == 0);
 
   LOG(INFO) << "Running \"" << android::base::Join(cmd, " ") << "\"";
-  return proc->Start();
+  int err = (flags & Subprocess::kSearchPath) != 0
+                ? posix_spawnp(pid,
+                               argv[0],
+                               options.actions(),
+                               options.attr(),
+                               argv.data(),
+                               envp.data())
+                : posix_spawn(pid,
+                              argv[0],
+                              options.actions(),
+                              options.attr(),
+                              argv.data(),
+                              envp.data());
+  if (err != 0) {
+    errno = err;
+    PLOG(ERROR) << "Failed to spawn " << cmd[0];
+    pipes->clear();
+    return false;
+  }
+  return true;
 }
 
 }  // namespace
@@ -117,6 +232,11 @@ void Subprocess::Init(
 Subprocess::~Subprocess() {
   if (subprocess_singleton_ == this)
     subprocess_singleton_ = nullptr;
+  // Nobody will reap the children still running, don't leave them behind.
+  for (const auto& pid_record : subprocess_records_) {
+    if (pid_record.second->pid != 0)
+      kill(pid_record.second->pid, SIGKILL);
+  }
 }
 
 void Subprocess::OnStdoutReady(SubprocessRecord* record) {
@@ -163,13 +283,8 @@ void Subprocess::ChildExitedCallback(const siginfo_t& info) {
   if (!record->callback.is_null()) {
     record->callback.Run(info.si_status, record->stdout_str);
   }
-  // Release and close all the pipes after calling the callback so our
-  // redirected pipes are still alive. Releasing the process first makes
-  // Reset(0) not attempt to kill the process, which is already a zombie at this
-  // point.
-  record->proc.Release();
-  record->proc.Reset(0);
-
+  // Close all the pipes after calling the callback so our redirected pipes are
+  // still alive.
   subprocess_records_.erase(pid_record);
 }
 
@@ -184,18 +299,19 @@ pid_t Subprocess::ExecFlags(const vector<string>& cmd,
                             const ExecCallback& callback) {
   unique_ptr<SubprocessRecord> record(new SubprocessRecord(callback));
 
-  if (!LaunchProcess(cmd, flags, output_pipes, &record->proc)) {
+  if (!LaunchProcess(
+          cmd, flags, output_pipes, &record->pid, &record->pipes)) {
     LOG(ERROR) << "Failed to launch subprocess";
     return 0;
   }
 
-  pid_t pid = record->proc.pid();
+  pid_t pid = record->pid;
   CHECK(process_reaper_.WatchForChild(
       FROM_HERE,
       pid,
       base::Bind(&Subprocess::ChildExitedCallback, base::Unretained(this))));
 
-  record->stdout_fd = record->proc.GetPipe(STDOUT_FILENO);
+  record->stdout_fd = record->pipes[STDOUT_FILENO].get();
   // Capture the subprocess output. Make our end of the pipe non-blocking.
   int fd_flags = fcntl(record->stdout_fd, F_GETFL, 0) | O_NONBLOCK;
   if (HANDLE_EINTR(fcntl(record->stdout_fd, F_SETFL, fd_flags)) < 0) {
@@ -242,14 +358,14 @@ void Subprocess::KillExec(pid_t pid) {
   pid_record->second->callback.Reset();
   // We don't care about output/return code, so we use SIGKILL here to ensure it
   // will be killed, SIGTERM might lead to leaked subprocess.
-  CHECK_EQ(pid_record->second->proc.pid(), pid);
+  CHECK_EQ(pid_record->second->pid, pid);
   if (kill(-pid, SIGKILL) != 0) {
     PLOG(WARNING) << "Failed to kill subprocess group " << pid;
   }
   WaitForProcessGroup(pid, 5000ms);
   // Release the pid now so we don't try to kill it if Subprocess is destroyed
   // before the corresponding ChildExitedCallback() is called.
-  pid_record->second->proc.Release();
+  pid_record->second->pid = 0;
   if (subprocess_records_.count(pid)) {
     siginfo_t info;
     info.si_code = CLD_KILLED;
@@ -263,7 +379,9 @@ int Subprocess::GetPipeFd(pid_t pid, int fd) const {
   auto pid_record = subprocess_records_.find(pid);
   if (pid_record == subprocess_records_.end())
     return -1;
-  return pid_record->second->proc.GetPipe(fd);
+  const auto& pipes = pid_record->second->pipes;
+  auto pipe = pipes.find(fd);
+  return pipe == pipes.end() ? -1 : pipe->second.get();
 }
 
 bool Subprocess::SynchronousExec(const vector<string>& cmd,
@@ -281,8 +399,9 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
                                       int* return_code,
                                       string* stdout_str,
                                       string* stderr_str) {
-  brillo::ProcessImpl proc;
-  if (!LaunchProcess(cmd, flags, {STDERR_FILENO}, &proc)) {
+  pid_t pid;
+  std::map<int, base::ScopedFD> pipes;
+  if (!LaunchProcess(cmd, flags, {STDERR_FILENO}, &pid, &pipes)) {
     LOG(ERROR) << "Failed to launch subprocess";
     return false;
   }
@@ -295,8 +414,8 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
   }
 
   // Read from both stdout and stderr individually.
-  int stdout_fd = proc.GetPipe(STDOUT_FILENO);
-  int stderr_fd = proc.GetPipe(STDERR_FILENO);
+  int stdout_fd = pipes[STDOUT_FILENO].get();
+  int stderr_fd = pipes[STDERR_FILENO].get();
   vector<char> buffer(32 * 1024);
   bool stdout_closed = false, stderr_closed = false;
   while (!stdout_closed || !stderr_closed) {
@@ -325,7 +444,12 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
 
   // At this point, the subprocess already closed the output, so we only need to
   // wait for it to finish.
-  int proc_return_code = proc.Wait();
+  int status = 0;
+  if (HANDLE_EINTR(waitpid(pid, &status, 0)) < 0) {
+    PLOG(ERROR) << "Failed to wait for subprocess " << pid;
+    return false;
+  }
+  int proc_return_code = WEXITSTATUS(status);
   if (return_code)
     *return_code = proc_return_code;
   return proc_return_code != brillo::Process::kErrorExitStatus;
@@ -26,6 +26,7 @@
 
 #include <base/callback.h>
 #include <base/files/file_descriptor_watcher_posix.h>
+#include <base/files/scoped_file.h>
 #include <base/logging.h>
 #include <android-base/macros.h>
 #include <brillo/asynchronous_signal_handler_interface.h>
@@ -122,9 +123,14 @@ class Subprocess {
     // The callback supplied by the caller.
     ExecCallback callback;
 
-    // The ProcessImpl instance managing the child process. Destroying this
-    // will close our end of the pipes we have open.
-    brillo::ProcessImpl proc;
+    // The child process id, reset to 0 once the child must not be killed
+    // anymore when the record is destroyed.
+    pid_t pid{0};
+
+    // Our end of the pipes mapped onto the child stdout and |output_pipes|,
+    // indexed by the file descriptor in the child. Destroying the record
+    // closes them.
+    std::map<int, base::ScopedFD> pipes;
 
     // These are used to monitor the stdout of the running process, including
     // the stderr if it was redirected.
@@ -0,0 +1,67 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/throughput_estimator.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace chromeos_update_engine {
+
+ThroughputEstimator::ThroughputEstimator(double weight) : weight_(weight) {}
+
+void ThroughputEstimator::Start(base::TimeTicks now) {
+  if (running_)
+    return;
+  running_ = true;
+  interval_start_ = now - interval_elapsed_;
+}
+
+void ThroughputEstimator::Stop(base::TimeTicks now) {
+  if (!running_)
+    return;
+  Advance(now);
+  running_ = false;
+  interval_elapsed_ = now - interval_start_;
+}
+
+void ThroughputEstimator::AddBytes(size_t bytes, base::TimeTicks now) {
+  if (!running_)
+    return;
+  Advance(now);
+  interval_bytes_ += bytes;
+}
+
+void ThroughputEstimator::Advance(base::TimeTicks now) {
+  const int64_t intervals =
+      (now - interval_start_).InMilliseconds() / kSampleIntervalMs;
+  if (intervals <= 0)
+    return;
+  const int64_t rate =
+      static_cast<int64_t>(interval_bytes_) * 1000 / kSampleIntervalMs;
+  peak_bytes_per_second_ = std::max(peak_bytes_per_second_, rate);
+  bytes_per_second_ = num_samples_ == 0
+                          ? rate
+                          : weight_ * rate + (1 - weight_) * bytes_per_second_;
+  // The remaining intervals had no data at all.
+  bytes_per_second_ *= std::pow(1 - weight_, intervals - 1);
+  num_samples_ += intervals;
+  interval_bytes_ = 0;
+  interval_start_ +=
+      base::TimeDelta::FromMilliseconds(intervals * kSampleIntervalMs);
+}
+
+}  // namespace chromeos_update_engine
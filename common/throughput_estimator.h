@@ -0,0 +1,77 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_THROUGHPUT_ESTIMATOR_H_
+#define UPDATE_ENGINE_COMMON_THROUGHPUT_ESTIMATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// Estimates the throughput of a connection as an exponentially weighted
+// moving average of the rate measured over consecutive sampling intervals.
+// Only the time between Start() and Stop() is measured, so that the time
+// spent between transfers or while paused doesn't lower the estimate.
+// Intervals without any data while running, e.g. during a stall, count as
+// zero throughput.
+class ThroughputEstimator {
+ public:
+  static constexpr int64_t kSampleIntervalMs = 1000;
+  // Weight of the latest sample in the average.
+  static constexpr double kDefaultWeight = 0.25;
+
+  explicit ThroughputEstimator(double weight = kDefaultWeight);
+
+  // Starts or stops measuring at |now|. A sampling interval left partially
+  // filled by Stop() is continued by the next Start(), so that transfers
+  // shorter than an interval still contribute to the estimate.
+  void Start(base::TimeTicks now);
+  void Stop(base::TimeTicks now);
+
+  // Records |bytes| received at |now|. Ignored unless running.
+  void AddBytes(size_t bytes, base::TimeTicks now);
+
+  // Whether at least one sampling interval completed.
+  bool has_estimate() const { return num_samples_ > 0; }
+  // The estimated throughput, zero until the first interval completed.
+  int64_t bytes_per_second() const {
+    return static_cast<int64_t>(bytes_per_second_);
+  }
+  // The highest rate measured over a single sampling interval.
+  int64_t peak_bytes_per_second() const { return peak_bytes_per_second_; }
+
+ private:
+  // Completes the sampling intervals that ended before |now|.
+  void Advance(base::TimeTicks now);
+
+  const double weight_;
+  bool running_{false};
+  base::TimeTicks interval_start_;
+  // Time already spent in the current interval while stopped.
+  base::TimeDelta interval_elapsed_;
+  size_t interval_bytes_{0};
+
+  size_t num_samples_{0};
+  double bytes_per_second_{0};
+  int64_t peak_bytes_per_second_{0};
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_THROUGHPUT_ESTIMATOR_H_
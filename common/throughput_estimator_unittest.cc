@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/throughput_estimator.h"
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+class ThroughputEstimatorTest : public ::testing::Test {
+ protected:
+  base::TimeTicks At(int64_t ms) {
+    return start_ + base::TimeDelta::FromMilliseconds(ms);
+  }
+
+  base::TimeTicks start_ = base::TimeTicks::Now();
+  ThroughputEstimator estimator_{0.5};
+};
+
+TEST_F(ThroughputEstimatorTest, NoEstimateBeforeFirstInterval) {
+  estimator_.Start(At(0));
+  estimator_.AddBytes(1000, At(500));
+  EXPECT_FALSE(estimator_.has_estimate());
+  EXPECT_EQ(0, estimator_.bytes_per_second());
+}
+
+TEST_F(ThroughputEstimatorTest, AveragesIntervals) {
+  estimator_.Start(At(0));
+  estimator_.AddBytes(1000, At(500));
+  // Completes the first interval.
+  estimator_.AddBytes(3000, At(1500));
+  EXPECT_TRUE(estimator_.has_estimate());
+  EXPECT_EQ(1000, estimator_.bytes_per_second());
+  estimator_.AddBytes(0, At(2000));
+  EXPECT_EQ(2000, estimator_.bytes_per_second());
+  EXPECT_EQ(3000, estimator_.peak_bytes_per_second());
+}
+
+TEST_F(ThroughputEstimatorTest, StallLowersEstimate) {
+  estimator_.Start(At(0));
+  estimator_.AddBytes(4000, At(500));
+  // Three intervals without data after the first one.
+  estimator_.AddBytes(0, At(4000));
+  EXPECT_EQ(500, estimator_.bytes_per_second());
+}
+
+TEST_F(ThroughputEstimatorTest, IgnoresTimeWhileStopped) {
+  estimator_.Start(At(0));
+  estimator_.AddBytes(1000, At(500));
+  estimator_.Stop(At(600));
+  estimator_.AddBytes(4000, At(800));
+  // The interval started before Stop() ends 400 ms after the restart.
+  estimator_.Start(At(10000));
+  estimator_.AddBytes(1000, At(10300));
+  EXPECT_FALSE(estimator_.has_estimate());
+  estimator_.AddBytes(0, At(10400));
+  EXPECT_EQ(2000, estimator_.bytes_per_second());
+}
+
+}  // namespace chromeos_update_engine
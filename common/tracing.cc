@@ -0,0 +1,234 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/tracing.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <base/logging.h>
+
+#ifdef __ANDROID__
+#include <cutils/trace.h>
+#endif  // __ANDROID__
+
+#include "update_engine/common/utils.h"
+
+using android::base::StringAppendF;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace tracing {
+
+namespace {
+
+#ifdef __ANDROID__
+// The category the spans are traced under, shared with the other daemons
+// installing packages like apexd.
+constexpr uint64_t kAtraceTag = ATRACE_TAG_PACKAGE_MANAGER;
+#endif  // __ANDROID__
+
+// A span recorded to the ring buffer.
+struct Event {
+  char name[64];
+  uint64_t start_us;
+  uint64_t duration_us;
+  uint32_t tid;
+  // Whether the span began and ended in different scopes.
+  bool async;
+};
+
+std::mutex g_mutex;
+std::vector<Event> g_events;
+// The total number of events recorded since StartRecording(), the last
+// |g_events.size()| of them are kept.
+uint64_t g_num_events = 0;
+std::atomic<int32_t> g_next_cookie{1};
+
+uint32_t CurrentThreadId() {
+  static thread_local const uint32_t tid =
+      static_cast<uint32_t>(syscall(SYS_gettid));
+  return tid;
+}
+
+void Record(const char* name,
+            uint64_t start_us,
+            uint64_t duration_us,
+            bool async) {
+  std::lock_guard<std::mutex> lock(g_mutex);
+  if (g_events.empty()) {
+    return;
+  }
+  Event& event = g_events[g_num_events++ % g_events.size()];
+  strncpy(event.name, name, sizeof(event.name) - 1);
+  event.name[sizeof(event.name) - 1] = '\0';
+  event.start_us = start_us;
+  event.duration_us = duration_us;
+  event.tid = CurrentThreadId();
+  event.async = async;
+}
+
+void AppendJsonString(const char* value, string* json) {
+  json->push_back('"');
+  for (const char* c = value; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      json->push_back('\\');
+      json->push_back(*c);
+    } else if (static_cast<unsigned char>(*c) < 0x20) {
+      StringAppendF(json, "\\u%04x", *c);
+    } else {
+      json->push_back(*c);
+    }
+  }
+  json->push_back('"');
+}
+
+}  // namespace
+
+namespace internal {
+
+std::atomic<bool> g_recording{false};
+
+bool IsAtraceEnabled() {
+#ifdef __ANDROID__
+  return atrace_is_tag_enabled(kAtraceTag);
+#else
+  return false;
+#endif  // __ANDROID__
+}
+
+uint64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Begin(const char* name, uint64_t* start_us) {
+#ifdef __ANDROID__
+  atrace_begin(kAtraceTag, name);
+#endif  // __ANDROID__
+  *start_us = NowUs();
+}
+
+void End(const char* name, uint64_t start_us) {
+#ifdef __ANDROID__
+  atrace_end(kAtraceTag);
+#endif  // __ANDROID__
+  if (g_recording.load(std::memory_order_relaxed)) {
+    Record(name, start_us, NowUs() - start_us, false);
+  }
+}
+
+void AsyncBegin(const char* name, int32_t cookie) {
+#ifdef __ANDROID__
+  atrace_async_begin(kAtraceTag, name, cookie);
+#endif  // __ANDROID__
+}
+
+void AsyncEnd(const char* name, int32_t cookie, uint64_t start_us) {
+#ifdef __ANDROID__
+  atrace_async_end(kAtraceTag, name, cookie);
+#endif  // __ANDROID__
+  if (g_recording.load(std::memory_order_relaxed)) {
+    Record(name, start_us, NowUs() - start_us, true);
+  }
+}
+
+}  // namespace internal
+
+void StartRecording(size_t max_events) {
+  CHECK_GT(max_events, 0u);
+  std::lock_guard<std::mutex> lock(g_mutex);
+  g_events.assign(max_events, Event{});
+  g_num_events = 0;
+  internal::g_recording = true;
+}
+
+bool StopRecording(const string& path) {
+  internal::g_recording = false;
+  std::vector<Event> events;
+  uint64_t num_events = 0;
+  {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    events.swap(g_events);
+    num_events = g_num_events;
+  }
+  if (events.empty()) {
+    return false;
+  }
+  const uint64_t kept = std::min<uint64_t>(num_events, events.size());
+  LOG_IF(WARNING, kept < num_events)
+      << "Dropped the first " << num_events - kept << " of " << num_events
+      << " trace events.";
+
+  const pid_t pid = getpid();
+  string json = "{\"traceEvents\":[";
+  for (uint64_t i = num_events - kept; i < num_events; i++) {
+    const Event& event = events[i % events.size()];
+    json.append(i > num_events - kept ? ",{" : "{");
+    json.append("\"name\":");
+    AppendJsonString(event.name, &json);
+    // The spans beginning and ending in different scopes may overlap those of
+    // the same thread, so they go to a track of their own.
+    StringAppendF(&json,
+                  ",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64
+                  ",\"pid\":%d,\"tid\":%" PRIu32 "}",
+                  event.start_us,
+                  event.duration_us,
+                  pid,
+                  event.async ? 0 : event.tid);
+  }
+  json.append("]}");
+  if (!utils::WriteFile(path.c_str(), json.data(), json.size())) {
+    LOG(ERROR) << "Unable to write the trace to " << path;
+    return false;
+  }
+  LOG(INFO) << "Wrote " << kept << " trace events to " << path;
+  return true;
+}
+
+}  // namespace tracing
+
+void TraceSpan::Begin(const string& name) {
+  End();
+  if (!tracing::IsEnabled()) {
+    return;
+  }
+  name_ = name;
+  cookie_ = tracing::g_next_cookie++;
+  start_us_ = tracing::internal::NowUs();
+  tracing::internal::AsyncBegin(name_.c_str(), cookie_);
+  active_ = true;
+}
+
+void TraceSpan::End() {
+  if (!active_) {
+    return;
+  }
+  active_ = false;
+  tracing::internal::AsyncEnd(name_.c_str(), cookie_, start_us_);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_TRACING_H_
+#define UPDATE_ENGINE_COMMON_TRACING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// Spans showing where the time goes during an update. On Android they are
+// written to atrace under the "pm" category, which Perfetto and systrace
+// capture. Anywhere, they can also be recorded to an in-memory ring buffer and
+// dumped in the Chrome JSON trace format, which Perfetto UI opens. While
+// neither atrace nor the ring buffer are recording, a span costs a couple of
+// atomic loads.
+namespace tracing {
+
+namespace internal {
+extern std::atomic<bool> g_recording;
+bool IsAtraceEnabled();
+void Begin(const char* name, uint64_t* start_us);
+void End(const char* name, uint64_t start_us);
+void AsyncBegin(const char* name, int32_t cookie);
+void AsyncEnd(const char* name, int32_t cookie, uint64_t start_us);
+uint64_t NowUs();
+}  // namespace internal
+
+// Whether spans are recorded anywhere.
+inline bool IsEnabled() {
+  return internal::g_recording.load(std::memory_order_relaxed) ||
+         internal::IsAtraceEnabled();
+}
+
+// Starts recording the spans to a ring buffer of the last |max_events|.
+void StartRecording(size_t max_events);
+
+// Stops recording to the ring buffer and writes its spans to |path| as a
+// Chrome JSON trace. Returns false if the file can't be written.
+bool StopRecording(const std::string& path);
+
+}  // namespace tracing
+
+// Traces the scope it lives in as |name|, which must outlive it.
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(const char* name) {
+    if (tracing::IsEnabled()) {
+      name_ = name;
+      tracing::internal::Begin(name_, &start_us_);
+    }
+  }
+  ~ScopedTrace() {
+    if (name_) {
+      tracing::internal::End(name_, start_us_);
+    }
+  }
+
+ private:
+  const char* name_{nullptr};
+  uint64_t start_us_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTrace);
+};
+
+// A span which begins and ends in different scopes, e.g. while an Action runs
+// across several iterations of the message loop. Begin() and End() must be
+// called on the same thread.
+class TraceSpan {
+ public:
+  TraceSpan() = default;
+  ~TraceSpan() { End(); }
+
+  // Ends the current span, if any, and begins one named |name|.
+  void Begin(const std::string& name);
+  void End();
+
+ private:
+  std::string name_;
+  int32_t cookie_{0};
+  uint64_t start_us_{0};
+  bool active_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(TraceSpan);
+};
+
+#define UE_TRACE_CONCAT_INNER(a, b) a##b
+#define UE_TRACE_CONCAT(a, b) UE_TRACE_CONCAT_INNER(a, b)
+// Traces the rest of the enclosing scope as |name|, a string literal or any
+// string outliving the scope.
+#define TRACE_SCOPE(name) \
+  ::chromeos_update_engine::ScopedTrace UE_TRACE_CONCAT(trace_scope_, \
+                                                        __LINE__)(name)
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_TRACING_H_
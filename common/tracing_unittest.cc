@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/tracing.h"
+
+#include <string>
+
+#include <base/files/file_util.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using testing::HasSubstr;
+using testing::Not;
+
+namespace chromeos_update_engine {
+
+class TracingTest : public ::testing::Test {
+ protected:
+  string StopAndRead() {
+    string json;
+    EXPECT_TRUE(tracing::StopRecording(trace_file_.path()));
+    EXPECT_TRUE(utils::ReadFile(trace_file_.path(), &json));
+    return json;
+  }
+
+  ScopedTempFile trace_file_{"tracing_unittest.XXXXXX"};
+};
+
+TEST_F(TracingTest, DisabledTest) {
+  { TRACE_SCOPE("not recorded"); }
+  EXPECT_FALSE(tracing::StopRecording(trace_file_.path()));
+}
+
+TEST_F(TracingTest, RecordsSpansTest) {
+  tracing::StartRecording(16);
+  EXPECT_TRUE(tracing::IsEnabled());
+  {
+    TRACE_SCOPE("outer");
+    TRACE_SCOPE("in\"ner");
+  }
+  TraceSpan span;
+  span.Begin("FilesystemVerifierAction");
+  span.Begin("PostinstallRunnerAction");
+  span.End();
+  const string json = StopAndRead();
+  EXPECT_FALSE(tracing::IsEnabled());
+
+  EXPECT_THAT(json, HasSubstr("{\"traceEvents\":[{\"name\":\"in\\\"ner\""));
+  EXPECT_THAT(json, HasSubstr("{\"name\":\"outer\",\"ph\":\"X\""));
+  EXPECT_THAT(json, HasSubstr("{\"name\":\"FilesystemVerifierAction\""));
+  EXPECT_THAT(json, HasSubstr("{\"name\":\"PostinstallRunnerAction\""));
+}
+
+TEST_F(TracingTest, KeepsLastEventsTest) {
+  tracing::StartRecording(2);
+  { TRACE_SCOPE("first"); }
+  { TRACE_SCOPE("second"); }
+  { TRACE_SCOPE("third"); }
+  const string json = StopAndRead();
+  EXPECT_THAT(json, Not(HasSubstr("first")));
+  EXPECT_THAT(json, HasSubstr("{\"traceEvents\":[{\"name\":\"second\""));
+  EXPECT_THAT(json, HasSubstr("},{\"name\":\"third\""));
+}
+
+}  // namespace chromeos_update_engine
@@ -1114,7 +1114,7 @@ bool ReadExtents(FileDescriptorPtr fd,
     bytes_read += bytes_read_this_iteration;
   }
   TEST_AND_RETURN_FALSE(out_data_size == bytes_read);
-  *out_data = data;
+  *out_data = std::move(data);
   return true;
 }
 
@@ -458,6 +458,22 @@ class ScopedPathUnlinker {
   DISALLOW_COPY_AND_ASSIGN(ScopedPathUnlinker);
 };
 
+// Logs how long the scope took, e.g. to trace the steps of the startup.
+class ScopedStepTimer {
+ public:
+  explicit ScopedStepTimer(const std::string& step)
+      : step_(step), start_(base::TimeTicks::Now()) {}
+  ~ScopedStepTimer() {
+    LOG(INFO) << step_ << " took "
+              << (base::TimeTicks::Now() - start_).InMilliseconds() << "ms.";
+  }
+
+ private:
+  const std::string step_;
+  const base::TimeTicks start_;
+  DISALLOW_COPY_AND_ASSIGN(ScopedStepTimer);
+};
+
 class ScopedTempFile {
  public:
   ScopedTempFile() : ScopedTempFile("update_engine_temp.XXXXXX") {}
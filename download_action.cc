@@ -17,8 +17,13 @@
 #include "update_engine/common/download_action.h"
 
 #include <string>
+#include <utility>
+#include <vector>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/files/memory_mapped_file.h>
 #include <base/metrics/statistics_recorder.h>
 #include <android-base/stringprintf.h>
 
@@ -26,13 +31,24 @@
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/tracing.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/io_scheduler.h"
 
 using base::FilePath;
+using brillo::MessageLoop;
 using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+// Bytes of buffered data passed to DeltaPerformer per message loop iteration.
+constexpr size_t kApplySliceSize = 1024 * 1024;  // 1 MiB
+// Smaller runs of data not needed by the resumed update are downloaded
+// anyway, a separate request costs more than that.
+constexpr uint64_t kMinSkippedDataSize = 1024 * 1024;  // 1 MiB
+}  // namespace
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                BootControlInterface* boot_control,
                                HardwareInterface* hardware,
@@ -48,7 +64,9 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
       delegate_(nullptr),
       update_certificates_path_(std::move(update_certificates_path)) {}
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  ClearBufferedData();
+}
 
 void DownloadAction::PerformAction() {
   http_fetcher_->set_delegate(this);
@@ -57,6 +75,7 @@ void DownloadAction::PerformAction() {
   CHECK(HasInputObject());
   install_plan_ = GetInputObject();
   install_plan_.Dump();
+  IoScheduler::GetInstance()->SetPhase(IoPhase::kApply);
 
   bytes_received_ = 0;
   bytes_received_previous_payloads_ = 0;
@@ -90,22 +109,23 @@ void DownloadAction::PerformAction() {
 }
 
 bool DownloadAction::LoadCachedManifest(int64_t manifest_size) {
-  std::string cached_manifest_bytes;
-  if (!prefs_->GetString(kPrefsManifestBytes, &cached_manifest_bytes) ||
-      cached_manifest_bytes.size() <= 0) {
+  const FilePath path = DeltaPerformer::CachedManifestPath(hardware_);
+  base::MemoryMappedFile cached_manifest;
+  if (path.empty() || !base::PathExists(path) ||
+      !cached_manifest.Initialize(path) || cached_manifest.length() == 0) {
     LOG(INFO) << "Cached Manifest data not found";
     return false;
   }
-  if (static_cast<int64_t>(cached_manifest_bytes.size()) != manifest_size) {
+  if (static_cast<int64_t>(cached_manifest.length()) != manifest_size) {
     LOG(WARNING) << "Cached metadata has unexpected size: "
-                 << cached_manifest_bytes.size() << " vs. " << manifest_size;
+                 << cached_manifest.length() << " vs. " << manifest_size;
     return false;
   }
 
   ErrorCode error{};
   const bool success =
       delta_performer_->Write(
-          cached_manifest_bytes.data(), cached_manifest_bytes.size(), &error) &&
+          cached_manifest.data(), cached_manifest.length(), &error) &&
       delta_performer_->IsManifestValid();
   if (success) {
     LOG(INFO) << "Successfully parsed cached manifest";
@@ -119,6 +139,7 @@ bool DownloadAction::LoadCachedManifest(int64_t manifest_size) {
 
 void DownloadAction::StartDownloading() {
   download_active_ = true;
+  bytes_progressed_pending_ = 0;
   http_fetcher_->ClearRanges();
 
   if (delta_performer_ != nullptr) {
@@ -134,16 +155,42 @@ void DownloadAction::StartDownloading() {
                                               update_certificates_path_));
   }
 
+  ClearBufferedData();
+  download_ahead_.reset();
+  if (install_plan_.download_ahead_size > 0) {
+    string spill_path;
+    FilePath dir;
+    if (install_plan_.download_ahead_spill_size > 0 &&
+        hardware_->GetNonVolatileDirectory(&dir)) {
+      spill_path = dir.Append("download_ahead").value();
+    }
+    download_ahead_ = std::make_unique<DownloadAheadBuffer>(
+        install_plan_.download_ahead_size,
+        spill_path,
+        install_plan_.download_ahead_spill_size);
+    if (download_ahead_->Init()) {
+      LOG(INFO) << "Downloading up to " << download_ahead_->capacity()
+                << " bytes ahead of the applied data.";
+    } else {
+      LOG(WARNING) << "Applying received data directly.";
+      download_ahead_.reset();
+    }
+  }
+
   if (install_plan_.is_resume &&
       payload_ == &install_plan_.payloads[resume_payload_index_]) {
-    // Resuming an update so parse the cached manifest first
+    // Resuming an update so parse the cached manifest first. Progress may have
+    // been journalled after the last checkpoint in prefs.
+    delta_performer_->RecoverJournalledCheckpoint();
     int64_t manifest_metadata_size = 0;
     int64_t manifest_signature_size = 0;
     prefs_->GetInt64(kPrefsManifestMetadataSize, &manifest_metadata_size);
     prefs_->GetInt64(kPrefsManifestSignatureSize, &manifest_signature_size);
 
     // TODO(zhangkelvin) Add unittest for success and fallback route
-    if (!LoadCachedManifest(manifest_metadata_size + manifest_signature_size)) {
+    const bool manifest_loaded =
+        LoadCachedManifest(manifest_metadata_size + manifest_signature_size);
+    if (!manifest_loaded) {
       if (delta_performer_) {
         // Create a new DeltaPerformer to reset all its state
         delta_performer_ =
@@ -160,18 +207,28 @@ void DownloadAction::StartDownloading() {
                               manifest_metadata_size + manifest_signature_size);
     }
 
-    // If there're remaining unprocessed data blobs, fetch them. Be careful
-    // not to request data beyond the end of the payload to avoid 416 HTTP
-    // response error codes.
-    int64_t next_data_offset = 0;
-    prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
-    uint64_t resume_offset =
-        manifest_metadata_size + manifest_signature_size + next_data_offset;
-    if (!payload_->size) {
-      http_fetcher_->AddRange(base_offset_ + resume_offset);
-    } else if (resume_offset < payload_->size) {
-      http_fetcher_->AddRange(base_offset_ + resume_offset,
-                              payload_->size - resume_offset);
+    // Only fetch the data of the operations a previous attempt didn't apply
+    // already, if known.
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    if (manifest_loaded &&
+        delta_performer_->PlanDataFetch(kMinSkippedDataSize, &ranges)) {
+      for (const auto& [offset, length] : ranges) {
+        http_fetcher_->AddRange(base_offset_ + offset, length);
+      }
+    } else {
+      // If there're remaining unprocessed data blobs, fetch them. Be careful
+      // not to request data beyond the end of the payload to avoid 416 HTTP
+      // response error codes.
+      int64_t next_data_offset = 0;
+      prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
+      uint64_t resume_offset =
+          manifest_metadata_size + manifest_signature_size + next_data_offset;
+      if (!payload_->size) {
+        http_fetcher_->AddRange(base_offset_ + resume_offset);
+      } else if (resume_offset < payload_->size) {
+        http_fetcher_->AddRange(base_offset_ + resume_offset,
+                                payload_->size - resume_offset);
+      }
     }
   } else {
     if (payload_->size) {
@@ -187,14 +244,79 @@ void DownloadAction::StartDownloading() {
 }
 
 void DownloadAction::SuspendAction() {
-  http_fetcher_->Pause();
+  suspended_ = true;
+  UpdateFetcherPaused();
 }
 
 void DownloadAction::ResumeAction() {
-  http_fetcher_->Unpause();
+  suspended_ = false;
+  if (download_ahead_ && !download_ahead_->empty())
+    ScheduleApplyBufferedData();
+  UpdateFetcherPaused();
+}
+
+void DownloadAction::UpdateFetcherPaused() {
+  bool pause = suspended_;
+  if (download_ahead_ && !pause) {
+    // Resume fetching once half of the buffer was applied.
+    pause = fetcher_paused_
+                ? download_ahead_->size() > download_ahead_->capacity() / 2
+                : download_ahead_->size() >= download_ahead_->capacity();
+  }
+  if (pause == fetcher_paused_)
+    return;
+  fetcher_paused_ = pause;
+  if (pause) {
+    http_fetcher_->Pause();
+  } else {
+    http_fetcher_->Unpause();
+  }
+}
+
+void DownloadAction::ScheduleApplyBufferedData() {
+  if (apply_task_id_ != MessageLoop::kTaskIdNull)
+    return;
+  apply_task_id_ = MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&DownloadAction::ApplyBufferedData, base::Unretained(this)));
+}
+
+void DownloadAction::ApplyBufferedData() {
+  apply_task_id_ = MessageLoop::kTaskIdNull;
+  if (suspended_ || !delta_performer_)
+    return;
+  brillo::Blob data;
+  if (!download_ahead_->Pop(kApplySliceSize, &data)) {
+    code_ = ErrorCode::kDownloadWriteError;
+    TerminateProcessing();
+    return;
+  }
+  if (!data.empty() && !WriteToDeltaPerformer(data.data(), data.size())) {
+    TerminateProcessing();
+    return;
+  }
+  if (!download_ahead_->empty()) {
+    ScheduleApplyBufferedData();
+  } else if (transfer_complete_pending_) {
+    transfer_complete_pending_ = false;
+    FinishTransfer(true);
+    return;
+  }
+  UpdateFetcherPaused();
+}
+
+void DownloadAction::ClearBufferedData() {
+  if (apply_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(apply_task_id_);
+    apply_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  if (download_ahead_)
+    download_ahead_->Clear();
+  transfer_complete_pending_ = false;
 }
 
 void DownloadAction::TerminateProcessing() {
+  ClearBufferedData();
   if (delta_performer_) {
     delta_performer_->Close();
     delta_performer_.reset();
@@ -205,6 +327,18 @@ void DownloadAction::TerminateProcessing() {
   http_fetcher_->TerminateTransfer();
 }
 
+size_t DownloadAction::GetBufferedBytes() const {
+  size_t bytes = download_ahead_ ? download_ahead_->size() : 0;
+  if (delta_performer_) {
+    bytes += delta_performer_->GetBufferedBytes();
+  }
+  return bytes;
+}
+
+bool DownloadAction::GetPipelineStats(OperationPipeline::Stats* stats) const {
+  return delta_performer_ && delta_performer_->GetPipelineStats(stats);
+}
+
 void DownloadAction::SeekToOffset(off_t offset) {
   bytes_received_ = offset;
 }
@@ -212,23 +346,21 @@ void DownloadAction::SeekToOffset(off_t offset) {
 bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
                                    const void* bytes,
                                    size_t length) {
+  TRACE_SCOPE("DownloadAction::ReceivedBytes");
   bytes_received_ += length;
-  uint64_t bytes_downloaded_total =
-      bytes_received_previous_payloads_ + bytes_received_;
-  if (delegate_ && download_active_) {
-    delegate_->BytesReceived(
-        length, bytes_downloaded_total - base_offset_, bytes_total_);
-  }
-  if (delta_performer_ && !delta_performer_->Write(bytes, length, &code_)) {
-    if (code_ != ErrorCode::kSuccess) {
-      LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
-                 << ") in DeltaPerformer's Write method when "
-                 << "processing the received payload -- Terminating processing";
-    } else {
-      LOG(ERROR) << "Unknown error in DeltaPerformer's Write method when "
-                 << "processing the received payload -- Terminating processing";
+  bytes_progressed_pending_ += length;
+  ReportProgress(false);
+  if (download_ahead_ && delta_performer_) {
+    if (!download_ahead_->Append(bytes, length)) {
       code_ = ErrorCode::kDownloadWriteError;
+      TerminateProcessing();
+      return false;
     }
+    ScheduleApplyBufferedData();
+    UpdateFetcherPaused();
+    return true;
+  }
+  if (delta_performer_ && !WriteToDeltaPerformer(bytes, length)) {
     // Don't tell the action processor that the action is complete until we get
     // the TransferTerminated callback. Otherwise, this and the HTTP fetcher
     // objects may get destroyed before all callbacks are complete.
@@ -239,11 +371,62 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
   return true;
 }
 
+void DownloadAction::ReportProgress(bool force) {
+  if (!delegate_ || !download_active_) {
+    bytes_progressed_pending_ = 0;
+    return;
+  }
+  if (bytes_progressed_pending_ == 0)
+    return;
+  const uint64_t bytes_received =
+      bytes_received_previous_payloads_ + bytes_received_ - base_offset_;
+  // The last bytes are always reported right away.
+  if (!force && install_plan_.progress_interval_ms > 0 &&
+      bytes_received < bytes_total_) {
+    const base::TimeTicks now = base::TimeTicks::Now();
+    if (now - last_progress_time_ <
+        base::TimeDelta::FromMilliseconds(install_plan_.progress_interval_ms)) {
+      return;
+    }
+    last_progress_time_ = now;
+  }
+  delegate_->BytesReceived(std::exchange(bytes_progressed_pending_, 0),
+                           bytes_received,
+                           bytes_total_);
+}
+
+bool DownloadAction::WriteToDeltaPerformer(const void* bytes, size_t length) {
+  if (delta_performer_->Write(bytes, length, &code_))
+    return true;
+  if (code_ != ErrorCode::kSuccess) {
+    LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
+               << ") in DeltaPerformer's Write method when "
+               << "processing the received payload -- Terminating processing";
+  } else {
+    LOG(ERROR) << "Unknown error in DeltaPerformer's Write method when "
+               << "processing the received payload -- Terminating processing";
+    code_ = ErrorCode::kDownloadWriteError;
+  }
+  return false;
+}
+
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  TRACE_SCOPE("DownloadAction::TransferComplete");
+  if (successful && download_ahead_ && !download_ahead_->empty()) {
+    // Finish once ApplyBufferedData() caught up.
+    transfer_complete_pending_ = true;
+    return;
+  }
+  FinishTransfer(successful);
+}
+
+void DownloadAction::FinishTransfer(bool successful) {
+  ClearBufferedData();
   if (delta_performer_) {
     LOG_IF(WARNING, delta_performer_->Close() != 0)
         << "Error closing the writer.";
   }
+  ReportProgress(true);
   download_active_ = false;
   ErrorCode code =
       successful ? ErrorCode::kSuccess : ErrorCode::kDownloadTransferError;
@@ -275,6 +458,7 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
 }
 
 void DownloadAction::TransferTerminated(HttpFetcher* fetcher) {
+  ClearBufferedData();
   if (code_ != ErrorCode::kSuccess) {
     processor_->ActionComplete(this, code_);
   } else if (payload_->already_applied) {
@@ -18,6 +18,7 @@
 #include <cstdint>
 #include <memory>
 
+#include <base/files/scoped_temp_dir.h>
 #include <gmock/gmock.h>
 #include <gmock/gmock-actions.h>
 #include <gmock/gmock-function-mocker.h>
@@ -50,8 +51,24 @@ class DownloadActionTest : public ::testing::Test {
  public:
   static constexpr int64_t METADATA_SIZE = 1024;
   static constexpr int64_t SIGNATURE_SIZE = 256;
+
+  void SetUp() override {
+    ASSERT_TRUE(non_volatile_dir_.CreateUniqueTempDir());
+    hardware_.SetNonVolatileDirectory(non_volatile_dir_.GetPath());
+  }
+
+  // Saves |data| as the manifest cached by a previous attempt.
+  void CacheManifest(const std::string& data) {
+    ASSERT_TRUE(utils::WriteFile(
+        DeltaPerformer::CachedManifestPath(&hardware_).value().c_str(),
+        data.data(),
+        data.size()));
+  }
+
   std::shared_ptr<ActionPipe<InstallPlan>> action_pipe{
       new ActionPipe<InstallPlan>()};
+  base::ScopedTempDir non_volatile_dir_;
+  FakeHardware hardware_;
 };
 
 TEST_F(DownloadActionTest, CacheManifestInvalid) {
@@ -65,8 +82,7 @@ TEST_F(DownloadActionTest, CacheManifestInvalid) {
       .WillRepeatedly(DoAll(SetArgPointee<1>(SIGNATURE_SIZE), Return(true)));
   EXPECT_CALL(prefs, GetInt64(kPrefsUpdateStateNextDataOffset, _))
       .WillRepeatedly(DoAll(SetArgPointee<1>(0L), Return(true)));
-  EXPECT_CALL(prefs, GetString(kPrefsManifestBytes, _))
-      .WillRepeatedly(DoAll(SetArgPointee<1>(data), Return(true)));
+  CacheManifest(data);
 
   BootControlStub boot_control;
   MockHttpFetcher* http_fetcher = new MockHttpFetcher(data.data(), data.size());
@@ -81,7 +97,7 @@ TEST_F(DownloadActionTest, CacheManifestInvalid) {
 
   // takes ownership of passed in HttpFetcher
   auto download_action = std::make_unique<DownloadAction>(
-      &prefs, &boot_control, nullptr, http_fetcher, false /* interactive */);
+      &prefs, &boot_control, &hardware_, http_fetcher, false /* interactive */);
   download_action->set_in_pipe(action_pipe);
   MockActionProcessor mock_processor;
   download_action->SetProcessor(&mock_processor);
@@ -129,8 +145,7 @@ TEST_F(DownloadActionTest, CacheManifestValid) {
           DoAll(SetArgPointee<1>(signature_blob_length), Return(true)));
   EXPECT_CALL(prefs, GetInt64(kPrefsUpdateStateNextDataOffset, _))
       .WillRepeatedly(DoAll(SetArgPointee<1>(0L), Return(true)));
-  EXPECT_CALL(prefs, GetString(kPrefsManifestBytes, _))
-      .WillRepeatedly(DoAll(SetArgPointee<1>(data), Return(true)));
+  CacheManifest(data);
   EXPECT_CALL(prefs, GetInt64(kPrefsUpdateStateNextOperation, _))
       .WillRepeatedly(DoAll(SetArgPointee<1>(0), Return(true)));
   EXPECT_CALL(prefs, GetInt64(kPrefsUpdateStatePayloadIndex, _))
@@ -150,14 +165,13 @@ TEST_F(DownloadActionTest, CacheManifestValid) {
   install_part.target_path = partition_file.path();
   action_pipe->set_contents(install_plan);
 
-  FakeHardware hardware;
   // takes ownership of passed in HttpFetcher
   auto download_action = std::make_unique<DownloadAction>(
-      &prefs, &boot_control, &hardware, http_fetcher, false /* interactive */);
+      &prefs, &boot_control, &hardware_, http_fetcher, false /* interactive */);
 
   auto delta_performer = std::make_unique<DeltaPerformer>(&prefs,
                                                           &boot_control,
-                                                          &hardware,
+                                                          &hardware_,
                                                           nullptr,
                                                           &install_plan,
                                                           &payload,
@@ -56,6 +56,15 @@ namespace {
 
 const int kNoNetworkRetrySeconds = 10;
 
+// A transfer running at less than this fraction of the estimated throughput
+// for |low_speed_time_seconds_| is considered stalled.
+constexpr int64_t kStallThroughputDivisor = 20;
+// The receive buffer holds this much data at the estimated throughput, within
+// libcurl's default and maximum buffer sizes.
+constexpr int64_t kBufferMs = 100;
+constexpr int64_t kMinBufferSize = CURL_MAX_WRITE_SIZE;
+constexpr int64_t kMaxBufferSize = 512 * 1024;
+
 // libcurl's CURLOPT_SOCKOPTFUNCTION callback function. Called after the socket
 // is created but before it is connected. This callback tags the created socket
 // so the network usage can be tracked in Android.
@@ -106,6 +115,12 @@ LibcurlHttpFetcher::~LibcurlHttpFetcher() {
   LOG_IF(ERROR, transfer_in_progress_)
       << "Destroying the fetcher while a transfer is in progress.";
   CleanUp();
+  if (curl_share_handle_) {
+    // Closes the cached connections, which calls back into this object.
+    LOG_IF(ERROR, curl_share_cleanup(curl_share_handle_) != CURLSHE_OK)
+        << "Failed to clean up the shared connection cache.";
+    curl_share_handle_ = nullptr;
+  }
 }
 
 bool LibcurlHttpFetcher::GetProxyType(const string& proxy_str,
@@ -142,6 +157,7 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
 
   curl_handle_ = curl_easy_init();
   CHECK(curl_handle_);
+  SetUpShareHandle();
   ignore_failure_ = false;
 
   // Tag and untag the socket for network usage stats.
@@ -203,6 +219,14 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
       curl_easy_setopt(curl_handle_, CURLOPT_HTTPHEADER, curl_http_headers_),
       CURLE_OK);
 
+  // Never negotiate a Content-Encoding: ranges would then refer to the
+  // encoded representation instead of the payload.
+  if (transfer_compression_ &&
+      curl_easy_setopt(curl_handle_, CURLOPT_TRANSFER_ENCODING, 1L) !=
+          CURLE_OK) {
+    LOG(INFO) << "Compressed transfers aren't supported by libcurl.";
+  }
+
   if (bytes_downloaded_ > 0 || download_length_) {
     // Resume from where we left off.
     resume_offset_ = bytes_downloaded_;
@@ -233,9 +257,28 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
 
   // If the connection drops under |low_speed_limit_bps_| (10
   // bytes/sec by default) for |low_speed_time_seconds_| (90 seconds,
-  // 180 on non-official builds), reconnect.
+  // 180 on non-official builds), reconnect. Once the throughput of the
+  // previous transfers is known, a connection dropping to a small fraction of
+  // it is considered stalled too.
+  long low_speed_limit_bps = low_speed_limit_bps_;  // NOLINT(runtime/int)
+  if (throughput_.has_estimate()) {
+    const int64_t bytes_per_second = throughput_.bytes_per_second();
+    low_speed_limit_bps =
+        std::max<int64_t>(low_speed_limit_bps,
+                          bytes_per_second / kStallThroughputDivisor);
+    // Let libcurl hand over more data per write callback on fast links.
+    long buffer_size =  // NOLINT(runtime/int) - curl needs long.
+        std::clamp(bytes_per_second * kBufferMs / 1000,
+                   kMinBufferSize,
+                   kMaxBufferSize);
+    CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_BUFFERSIZE, buffer_size),
+             CURLE_OK);
+    LOG(INFO) << "Estimated throughput " << bytes_per_second
+              << " bytes/s, using a low speed limit of " << low_speed_limit_bps
+              << " bytes/s and a " << buffer_size << " bytes receive buffer.";
+  }
   CHECK_EQ(curl_easy_setopt(
-               curl_handle_, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit_bps_),
+               curl_handle_, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit_bps),
            CURLE_OK);
   CHECK_EQ(curl_easy_setopt(
                curl_handle_, CURLOPT_LOW_SPEED_TIME, low_speed_time_seconds_),
@@ -274,6 +317,7 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
 
   CHECK_EQ(curl_multi_add_handle(curl_multi_handle_, curl_handle_), CURLM_OK);
   transfer_in_progress_ = true;
+  throughput_.Start(base::TimeTicks::Now());
 }
 
 // Lock down only the protocol in case of HTTP.
@@ -304,6 +348,14 @@ void LibcurlHttpFetcher::SetCurlOptionsForHttps() {
       CURLE_OK);
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SSL_CIPHER_LIST, "HIGH:!ADH"),
            CURLE_OK);
+  // Negotiate HTTP/2 through ALPN when the server supports it, falling back
+  // to HTTP/1.1 otherwise. libcurl built without HTTP/2 support rejects the
+  // option, in which case HTTP/1.1 is used as before.
+  if (curl_easy_setopt(curl_handle_,
+                       CURLOPT_HTTP_VERSION,
+                       CURL_HTTP_VERSION_2TLS) != CURLE_OK) {
+    LOG(INFO) << "HTTP/2 isn't supported by libcurl, using HTTP/1.1.";
+  }
   if (server_to_check_ != ServerToCheck::kNone) {
     CHECK_EQ(
         curl_easy_setopt(curl_handle_, CURLOPT_SSL_CTX_DATA, &server_to_check_),
@@ -463,6 +515,7 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
   // closed or download finished).
 
   GetHttpResponseCode();
+  RecordTransferTiming();
   if (http_response_code_) {
     LOG(INFO) << "HTTP response code: " << http_response_code_;
     no_network_retry_count_ = 0;
@@ -600,6 +653,7 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void* ptr, size_t size, size_t nmemb) {
     }
   }
   bytes_downloaded_ += payload_size;
+  throughput_.AddBytes(payload_size, base::TimeTicks::Now());
   if (delegate_) {
     in_write_callback_ = true;
     auto should_terminate = !delegate_->ReceivedBytes(this, ptr, payload_size);
@@ -628,6 +682,7 @@ void LibcurlHttpFetcher::Pause() {
   }
   CHECK(curl_handle_);
   CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_ALL), CURLE_OK);
+  throughput_.Stop(base::TimeTicks::Now());
 }
 
 void LibcurlHttpFetcher::Unpause() {
@@ -649,6 +704,7 @@ void LibcurlHttpFetcher::Unpause() {
   }
   CHECK(curl_handle_);
   CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
+  throughput_.Start(base::TimeTicks::Now());
   // Since the transfer is in progress, we need to dispatch a CurlPerformOnce()
   // now to let the connection continue, otherwise it would be called by the
   // TimeoutCallback but with a delay.
@@ -767,6 +823,23 @@ void LibcurlHttpFetcher::TimeoutCallback() {
     CurlPerformOnce();
 }
 
+void LibcurlHttpFetcher::SetUpShareHandle() {
+  if (!curl_share_handle_) {
+    curl_share_handle_ = curl_share_init();
+    CHECK(curl_share_handle_);
+    // All transfers run on the message loop thread, so no lock functions are
+    // needed.
+    for (const curl_lock_data data : {CURL_LOCK_DATA_DNS,
+                                      CURL_LOCK_DATA_SSL_SESSION,
+                                      CURL_LOCK_DATA_CONNECT}) {
+      CHECK_EQ(curl_share_setopt(curl_share_handle_, CURLSHOPT_SHARE, data),
+               CURLSHE_OK);
+    }
+  }
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SHARE, curl_share_handle_),
+           CURLE_OK);
+}
+
 void LibcurlHttpFetcher::CleanUp() {
   MessageLoop::current()->CancelTask(retry_task_id_);
   retry_task_id_ = MessageLoop::kTaskIdNull;
@@ -797,6 +870,52 @@ void LibcurlHttpFetcher::CleanUp() {
   transfer_in_progress_ = false;
   transfer_paused_ = false;
   restart_transfer_on_unpause_ = false;
+  throughput_.Stop(base::TimeTicks::Now());
+}
+
+void LibcurlHttpFetcher::RecordTransferTiming() {
+  curl_off_t name_lookup_us = 0;
+  curl_off_t connect_us = 0;
+  curl_off_t tls_handshake_us = 0;
+  curl_off_t first_byte_us = 0;
+  curl_off_t total_us = 0;
+  curl_off_t bytes = 0;
+  if (curl_easy_getinfo(
+          curl_handle_, CURLINFO_NAMELOOKUP_TIME_T, &name_lookup_us) !=
+          CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_CONNECT_TIME_T, &connect_us) !=
+          CURLE_OK ||
+      curl_easy_getinfo(
+          curl_handle_, CURLINFO_APPCONNECT_TIME_T, &tls_handshake_us) !=
+          CURLE_OK ||
+      curl_easy_getinfo(
+          curl_handle_, CURLINFO_STARTTRANSFER_TIME_T, &first_byte_us) !=
+          CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_TOTAL_TIME_T, &total_us) !=
+          CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_SIZE_DOWNLOAD_T, &bytes) !=
+          CURLE_OK) {
+    LOG(WARNING) << "Unable to get the timing of the request.";
+    return;
+  }
+  HttpTransferTiming timing;
+  timing.offset = resume_offset_;
+  timing.bytes = bytes;
+  timing.name_lookup = TimeDelta::FromMicroseconds(name_lookup_us);
+  timing.connect = TimeDelta::FromMicroseconds(connect_us);
+  timing.tls_handshake = TimeDelta::FromMicroseconds(tls_handshake_us);
+  timing.first_byte = TimeDelta::FromMicroseconds(first_byte_us);
+  timing.total = TimeDelta::FromMicroseconds(total_us);
+  // One line of key=value pairs per request, easy to extract from the logs.
+  LOG(INFO) << "Request timing: offset=" << timing.offset
+            << " bytes=" << timing.bytes
+            << " dns_ms=" << timing.name_lookup.InMilliseconds()
+            << " connect_ms=" << timing.connect.InMilliseconds()
+            << " tls_ms=" << timing.tls_handshake.InMilliseconds()
+            << " ttfb_ms=" << timing.first_byte.InMilliseconds()
+            << " total_ms=" << timing.total.InMilliseconds()
+            << " kibps=" << timing.BytesPerSecond() / 1024;
+  transfer_timings_.push_back(timing);
 }
 
 void LibcurlHttpFetcher::GetHttpResponseCode() {
@@ -21,6 +21,7 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <curl/curl.h>
 
@@ -32,6 +33,7 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/throughput_estimator.h"
 
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
 // http work.
@@ -136,10 +138,27 @@ class LibcurlHttpFetcher : public HttpFetcher {
     server_to_check_ = server_to_check;
   }
 
+  // Asks the server to compress the response on the wire with a
+  // Transfer-Encoding, which libcurl decodes before the delegate sees the
+  // data. Unlike a Content-Encoding, it leaves the requested ranges referring
+  // to the uncompressed resource. Servers are free to ignore it, and it is
+  // only available over HTTP/1.1.
+  void set_transfer_compression(bool transfer_compression) {
+    transfer_compression_ = transfer_compression;
+  }
+
   size_t GetBytesDownloaded() override {
     return static_cast<size_t>(bytes_downloaded_);
   }
 
+  int64_t GetEstimatedBytesPerSecond() override {
+    return throughput_.bytes_per_second();
+  }
+
+  std::vector<HttpTransferTiming> GetTransferTimings() override {
+    return transfer_timings_;
+  }
+
   void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
     low_speed_limit_bps_ = low_speed_bps;
     low_speed_time_seconds_ = low_speed_sec;
@@ -159,6 +178,7 @@ class LibcurlHttpFetcher : public HttpFetcher {
 
  private:
   FRIEND_TEST(LibcurlHttpFetcherTest, HostResolvedTest);
+  FRIEND_TEST(LibcurlHttpFetcherTest, ShareHandleOutlivesTransfers);
 
   // libcurl's CURLOPT_CLOSESOCKETFUNCTION callback function. Called when
   // closing a socket created with the CURLOPT_OPENSOCKETFUNCTION callback.
@@ -167,6 +187,10 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Asks libcurl for the http response code and stores it in the object.
   virtual void GetHttpResponseCode();
 
+  // Asks libcurl for the timing of the request that just finished, logs it
+  // and appends it to |transfer_timings_|.
+  void RecordTransferTiming();
+
   // Returns the last |CURLcode|.
   CURLcode GetCurlCode();
 
@@ -216,6 +240,9 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // curl(m) handles, fd_controller_maps_(fd_task_maps_), timeout_id_.
   void CleanUp();
 
+  // Creates |curl_share_handle_| if needed and attaches it to |curl_handle_|.
+  void SetUpShareHandle();
+
   // Force terminate the transfer. This will invoke the delegate's (if any)
   // TransferTerminated callback so, after returning, this fetcher instance may
   // be destroyed.
@@ -242,6 +269,11 @@ class LibcurlHttpFetcher : public HttpFetcher {
   CURLM* curl_multi_handle_{nullptr};
   CURL* curl_handle_{nullptr};
   struct curl_slist* curl_http_headers_{nullptr};
+  // Shares the DNS cache, TLS sessions and open connections between the
+  // transfers of this fetcher, so that retries and consecutive ranges don't
+  // pay for a new handshake. Unlike the handles above it's only released in
+  // the destructor.
+  CURLSH* curl_share_handle_{nullptr};
 
   // The extra headers that will be sent on each request.
   std::map<std::string, std::string> extra_headers_;
@@ -318,12 +350,22 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // ServerToCheck::kNone.
   ServerToCheck server_to_check_{ServerToCheck::kNone};
 
+  // Whether to ask for a compressed Transfer-Encoding.
+  bool transfer_compression_{false};
+
   // True if this object is for update check.
   bool is_update_check_{false};
 
   // Internal state machine.
   UnresolvedHostStateMachine unresolved_host_state_machine_;
 
+  // Throughput of the transfers of this fetcher, used to adapt the low speed
+  // limit and the receive buffer size of the following ones.
+  ThroughputEstimator throughput_;
+
+  // Timings of all requests made by this fetcher, in the order they finished.
+  std::vector<HttpTransferTiming> transfer_timings_;
+
   int low_speed_limit_bps_{kDownloadLowSpeedLimitBps};
   int low_speed_time_seconds_{kDownloadLowSpeedTimeSeconds};
   int connect_timeout_seconds_{kDownloadConnectTimeoutSeconds};
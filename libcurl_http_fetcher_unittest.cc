@@ -95,6 +95,18 @@ TEST_F(LibcurlHttpFetcherTest, InvalidURLTest) {
             no_network_max_retries);
 }
 
+TEST_F(LibcurlHttpFetcherTest, ShareHandleOutlivesTransfers) {
+  libcurl_fetcher_.set_no_network_max_retries(0);
+  libcurl_fetcher_.BeginTransfer("not-a-URL");
+  CURLSH* share_handle = libcurl_fetcher_.curl_share_handle_;
+  EXPECT_NE(nullptr, share_handle);
+  while (loop_.PendingTasks()) {
+    loop_.RunOnce(true);
+  }
+  EXPECT_EQ(nullptr, libcurl_fetcher_.curl_handle_);
+  EXPECT_EQ(share_handle, libcurl_fetcher_.curl_share_handle_);
+}
+
 TEST_F(LibcurlHttpFetcherTest, CouldNotResolveHostTest) {
   int no_network_max_retries = 1;
   libcurl_fetcher_.set_no_network_max_retries(no_network_max_retries);
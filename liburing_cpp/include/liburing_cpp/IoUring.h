@@ -27,6 +27,7 @@
 #include <optional>
 #include <variant>
 
+#include "BufferView.h"
 #include "IoUringCQE.h"
 #include "IoUringSQE.h"
 
@@ -53,6 +54,11 @@ class IoUringInterface {
   // Register a set of file descriptors to kernel.
   virtual Errno RegisterFiles(const int* files, size_t files_size) = 0;
   virtual Errno UnregisterFiles() = 0;
+
+  // Register an eventfd the kernel signals whenever a completion is posted,
+  // so completions can be waited for with poll() or an event loop.
+  virtual Errno RegisterEventfd(int fd) = 0;
+  virtual Errno UnregisterEventfd() = 0;
   // Append a submission entry into this io_uring. This does not submit the
   // operation to the kernel. For that, call |IoUringInterface::Submit()|
   virtual IoUringSQE PrepRead(int fd, void *buf, unsigned nbytes,
@@ -61,6 +67,21 @@ class IoUringInterface {
   // this write operation completes.
   virtual IoUringSQE PrepWrite(int fd, const void *buf, unsigned nbytes,
                                uint64_t offset) = 0;
+  // Same as PrepRead() and PrepWrite(), with |buf| within the buffer
+  // |buf_index| registered with |RegisterBuffers()|. The kernel then doesn't
+  // map the memory for every operation.
+  virtual IoUringSQE PrepReadFixed(int fd, void *buf, unsigned nbytes,
+                                   uint64_t offset, int buf_index) = 0;
+  virtual IoUringSQE PrepWriteFixed(int fd, const void *buf, unsigned nbytes,
+                                    uint64_t offset, int buf_index) = 0;
+  // Flush the data and metadata of |fd| to storage. The fdatasync variant
+  // only flushes the metadata needed to read the data back. Link the writes
+  // to it with |IoUringSQE::Link()| for a barrier after them.
+  virtual IoUringSQE PrepFsync(int fd) = 0;
+  virtual IoUringSQE PrepFdatasync(int fd) = 0;
+  // Same as fallocate(fd, mode, offset, len).
+  virtual IoUringSQE PrepFallocate(int fd, int mode, uint64_t offset,
+                                   uint64_t len) = 0;
 
   // Return number of SQEs available in the queue. If this is 0, subsequent
   // calls to Prep*() functions will fail.
@@ -76,9 +97,21 @@ class IoUringInterface {
   virtual Result<Errno, IoUringCQE> PopCQE() = 0;
   virtual Result<Errno, std::vector<IoUringCQE>> PopCQE(unsigned int count) = 0;
   virtual Result<Errno, IoUringCQE> PeekCQE() = 0;
+  // Block until |wait_count| CQEs are available, then pop as many of the
+  // available ones as fit in |cqes|, without allocating. |wait_count| must
+  // not exceed cqes.size(). Returns the number of CQEs popped.
+  virtual Result<Errno, size_t> PopCQEs(unsigned int wait_count,
+                                        BufferView<IoUringCQE> cqes) = 0;
 
   static std::unique_ptr<IoUringInterface> CreateLinuxIoUring(int queue_depth,
                                                               int flags);
+  // Same as above, with a kernel thread polling the submission queue so
+  // |Submit()| doesn't need a system call while the thread is awake. The
+  // thread sleeps after |idle_ms| milliseconds without submissions. Kernels
+  // before 5.11 only allow it to privileged processes using registered
+  // files.
+  static std::unique_ptr<IoUringInterface> CreateLinuxIoUringSqPoll(
+      int queue_depth, unsigned int idle_ms);
 };
 
 }  // namespace io_uring_cpp
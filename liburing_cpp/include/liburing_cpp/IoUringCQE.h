@@ -37,6 +37,7 @@ struct IoUringCQE {
     return *reinterpret_cast<const T*>(&userdata);
   }
 
+  constexpr IoUringCQE() : IoUringCQE(0, 0, 0) {}
   constexpr IoUringCQE(int32_t res, uint32_t flags, uint64_t userdata)
       : res(res), flags(flags), userdata(userdata) {}
 
@@ -67,6 +67,13 @@ struct [[nodiscard]] IoUringSQE {
     return SetData(*reinterpret_cast<const uint64_t*>(&data));
   }
   IoUringSQE& SetData(uint64_t data);
+  // Only start the next SQE of this ring once this one completed
+  // successfully. Otherwise the next one completes with -ECANCELED, and so on
+  // for the rest of the chain.
+  IoUringSQE &Link();
+  // The fd of this SQE is an index in the files registered with
+  // |IoUringInterface::RegisterFiles()|.
+  IoUringSQE &UseFixedFile();
 
   constexpr bool IsOk() const { return sqe != nullptr; }
 
@@ -82,6 +82,14 @@ class IoUring final : public IoUringInterface {
     return ret;
   }
 
+  Errno RegisterEventfd(int fd) override {
+    return Errno(io_uring_register_eventfd(&ring, fd));
+  }
+
+  Errno UnregisterEventfd() override {
+    return Errno(io_uring_unregister_eventfd(&ring));
+  }
+
   IoUringSQE PrepRead(int fd, void* buf, unsigned nbytes,
                       uint64_t offset) override {
     auto sqe = io_uring_get_sqe(&ring);
@@ -100,6 +108,49 @@ class IoUring final : public IoUringInterface {
     io_uring_prep_write(sqe, fd, buf, nbytes, offset);
     return IoUringSQE{static_cast<void*>(sqe)};
   }
+  IoUringSQE PrepReadFixed(int fd, void* buf, unsigned nbytes,
+                           uint64_t offset, int buf_index) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_read_fixed(sqe, fd, buf, nbytes, offset, buf_index);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepWriteFixed(int fd, const void* buf, unsigned nbytes,
+                            uint64_t offset, int buf_index) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_write_fixed(sqe, fd, buf, nbytes, offset, buf_index);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepFsync(int fd) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_fsync(sqe, fd, 0);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepFdatasync(int fd) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepFallocate(int fd, int mode, uint64_t offset,
+                           uint64_t len) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_fallocate(sqe, fd, mode, offset, len);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
 
   size_t SQELeft() const override { return io_uring_sq_space_left(&ring); }
   size_t SQEReady() const override { return io_uring_sq_ready(&ring); }
@@ -156,6 +207,33 @@ class IoUring final : public IoUringInterface {
     return {IoUringCQE(ptr->res, ptr->flags, ptr->user_data)};
   }
 
+  Result<Errno, size_t> PopCQEs(const unsigned int wait_count,
+                                BufferView<IoUringCQE> cqes) override {
+    if (wait_count > cqes.size()) {
+      return {Errno(EINVAL)};
+    }
+    if (wait_count > 0) {
+      struct io_uring_cqe* ptr{};
+      const auto ret = io_uring_wait_cqe_nr(&ring, &ptr, wait_count);
+      if (ret != 0) {
+        return {Errno(ret)};
+      }
+    }
+    // The CQEs are copied straight from the completion queue, which is only
+    // advanced once for all of them.
+    size_t count = 0;
+    unsigned head;
+    struct io_uring_cqe* ptr;
+    io_uring_for_each_cqe(&ring, head, ptr) {
+      if (count == cqes.size()) {
+        break;
+      }
+      cqes[count++] = IoUringCQE(ptr->res, ptr->flags, ptr->user_data);
+    }
+    io_uring_cq_advance(&ring, count);
+    return {count};
+  }
+
   IoUring(struct io_uring r) : ring(r) {}
 
  private:
@@ -188,4 +266,18 @@ std::unique_ptr<IoUringInterface> IoUringInterface::CreateLinuxIoUring(
   return std::unique_ptr<IoUringInterface>(new IoUring(ring));
 }
 
+std::unique_ptr<IoUringInterface> IoUringInterface::CreateLinuxIoUringSqPoll(
+    int queue_depth, unsigned int idle_ms) {
+  struct io_uring ring {};
+  struct io_uring_params params {};
+  params.flags = IORING_SETUP_SQPOLL;
+  params.sq_thread_idle = idle_ms;
+  const auto err = io_uring_queue_init_params(queue_depth, &ring, &params);
+  if (err) {
+    errno = -err;
+    return {};
+  }
+  return std::unique_ptr<IoUringInterface>(new IoUring(ring));
+}
+
 }  // namespace io_uring_cpp
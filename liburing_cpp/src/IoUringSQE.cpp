@@ -37,4 +37,18 @@ IoUringSQE &IoUringSQE::SetData(uint64_t data) {
   return *this;
 }
 
+IoUringSQE &IoUringSQE::Link() {
+  if (IsOk()) {
+    static_cast<struct io_uring_sqe *>(sqe)->flags |= IOSQE_IO_LINK;
+  }
+  return *this;
+}
+
+IoUringSQE &IoUringSQE::UseFixedFile() {
+  if (IsOk()) {
+    static_cast<struct io_uring_sqe *>(sqe)->flags |= IOSQE_FIXED_FILE;
+  }
+  return *this;
+}
+
 }  // namespace io_uring_cpp
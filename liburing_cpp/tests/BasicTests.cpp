@@ -21,7 +21,9 @@
 #include <stdio.h>
 
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 
@@ -191,4 +193,127 @@ TEST_F(IoUringTest, ExtentRead) {
   for (int i = 0; i < data.size(); ++i) {
     ASSERT_EQ(data[i], i % 256);
   }
-}
\ No newline at end of file
+}
+TEST_F(IoUringTest, FixedBuffers) {
+  const int fd = fileno(fp);
+  std::vector<unsigned char> write_buf(kBlockSize * 2, 'B');
+  std::vector<unsigned char> read_buf(kBlockSize * 2);
+  const struct iovec iovecs[] = {{write_buf.data(), write_buf.size()},
+                                 {read_buf.data(), read_buf.size()}};
+  const auto err = ring->RegisterBuffers(iovecs, 2);
+  ASSERT_TRUE(err.IsOk()) << err;
+
+  ASSERT_TRUE(
+      ring->PrepWriteFixed(fd, write_buf.data(), write_buf.size(), 0, 0)
+          .Link()
+          .IsOk());
+  ASSERT_TRUE(
+      ring->PrepReadFixed(fd, read_buf.data(), read_buf.size(), 0, 1).IsOk());
+  const auto ret = ring->Submit();
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  std::array<IoUringCQE, 2> cqes;
+  const auto popped = ring->PopCQEs(2, {cqes.data(), cqes.size()});
+  ASSERT_TRUE(popped.IsOk()) << popped.GetError();
+  ASSERT_EQ(popped.GetResult(), 2);
+  for (const auto& cqe : cqes) {
+    ASSERT_EQ(cqe.res, kBlockSize * 2);
+  }
+  ASSERT_EQ(read_buf, write_buf);
+}
+
+TEST_F(IoUringTest, LinkedWriteAndFsync) {
+  const int fd = fileno(fp);
+  std::string buffer(kBlockSize, 'C');
+  ASSERT_TRUE(ring->PrepWrite(fd, buffer.data(), buffer.size(), 0)
+                  .Link()
+                  .SetData(uint64_t{1})
+                  .IsOk());
+  ASSERT_TRUE(ring->PrepFdatasync(fd).Link().SetData(uint64_t{2}).IsOk());
+  ASSERT_TRUE(ring->PrepFsync(fd).SetData(uint64_t{3}).IsOk());
+  const auto ret = ring->Submit();
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+
+  // The chain completes in order.
+  std::array<IoUringCQE, 4> cqes;
+  const auto popped = ring->PopCQEs(3, {cqes.data(), cqes.size()});
+  ASSERT_TRUE(popped.IsOk()) << popped.GetError();
+  ASSERT_EQ(popped.GetResult(), 3);
+  for (size_t i = 0; i < 3; i++) {
+    ASSERT_EQ(cqes[i].GetData<uint64_t>(), i + 1);
+    ASSERT_GE(cqes[i].res, 0);
+  }
+  ASSERT_EQ(cqes[0].res, kBlockSize);
+}
+
+TEST_F(IoUringTest, LinkedChainCanceled) {
+  std::string buffer(kBlockSize, 'D');
+  // The write fails, so the fsync linked to it never runs.
+  ASSERT_TRUE(ring->PrepWrite(-1, buffer.data(), buffer.size(), 0)
+                  .Link()
+                  .IsOk());
+  ASSERT_TRUE(ring->PrepFsync(fileno(fp)).IsOk());
+  const auto ret = ring->SubmitAndWait(2);
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  std::array<IoUringCQE, 2> cqes;
+  const auto popped = ring->PopCQEs(0, {cqes.data(), cqes.size()});
+  ASSERT_TRUE(popped.IsOk()) << popped.GetError();
+  ASSERT_EQ(popped.GetResult(), 2);
+  ASSERT_EQ(cqes[0].res, -EBADF);
+  ASSERT_EQ(cqes[1].res, -ECANCELED);
+}
+
+TEST_F(IoUringTest, Eventfd) {
+  const int efd = eventfd(0, EFD_CLOEXEC);
+  ASSERT_GE(efd, 0) << strerror(errno);
+  const auto registered = ring->RegisterEventfd(efd);
+  ASSERT_TRUE(registered.IsOk()) << registered.ErrMsg();
+
+  std::string buffer(kBlockSize, 'E');
+  ASSERT_TRUE(
+      ring->PrepWrite(fileno(fp), buffer.data(), buffer.size(), 0).IsOk());
+  const auto ret = ring->Submit();
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+
+  // The completion signals the eventfd.
+  uint64_t count = 0;
+  ASSERT_EQ(read(efd, &count, sizeof(count)), sizeof(count));
+  ASSERT_GE(count, 1);
+  const auto cqe = ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk()) << cqe.GetError();
+  ASSERT_EQ(cqe.GetResult().res, kBlockSize);
+
+  ASSERT_TRUE(ring->UnregisterEventfd().IsOk());
+  close(efd);
+}
+
+TEST_F(IoUringTest, Fallocate) {
+  const int fd = fileno(fp);
+  ASSERT_TRUE(ring->PrepFallocate(fd, 0, 0, kBlockSize * 16).IsOk());
+  const auto ret = ring->Submit();
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  const auto cqe = ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk()) << cqe.GetError();
+  if (cqe.GetResult().res == -EOPNOTSUPP || cqe.GetResult().res == -EINVAL) {
+    GTEST_SKIP() << "Kernel or filesystem does not support fallocate";
+  }
+  ASSERT_EQ(cqe.GetResult().res, 0);
+  struct stat st {};
+  ASSERT_EQ(fstat(fd, &st), 0);
+  ASSERT_EQ(st.st_size, kBlockSize * 16);
+}
+
+TEST_F(IoUringTest, SqPoll) {
+  auto sq_poll_ring = IoUringInterface::CreateLinuxIoUringSqPoll(64, 100);
+  if (sq_poll_ring == nullptr) {
+    GTEST_SKIP() << "SQPOLL io_uring not allowed: " << strerror(errno);
+  }
+  int fd = open("/proc/self/maps", O_RDONLY);
+  std::array<char, 1024> buf{};
+  ASSERT_TRUE(sq_poll_ring->PrepRead(fd, buf.data(), buf.size(), 0).IsOk());
+  const auto ret = sq_poll_ring->Submit();
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  const auto cqe = sq_poll_ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk()) << cqe.GetError();
+  ASSERT_GT(cqe.GetResult().res, 0);
+  close(fd);
+}
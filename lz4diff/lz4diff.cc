@@ -30,6 +30,7 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/memory_patch_writer.h"
 #include "lz4diff/lz4diff.pb.h"
 #include "lz4diff_format.h"
 
@@ -55,20 +56,18 @@ bool StoreDstCompressedFileInfo(std::string_view recompressed_blob,
     auto s1 = recompressed_blob.substr(offset, block.compressed_length);
     auto s2 = target_blob.substr(offset, block.compressed_length);
     if (s1 != s2) {
-      ScopedTempFile patch;
+      Blob patch;
+      MemoryPatchWriter patch_writer(&patch);
       int err =
           bsdiff::bsdiff(reinterpret_cast<const unsigned char*>(s1.data()),
                          s1.size(),
                          reinterpret_cast<const unsigned char*>(s2.data()),
                          s2.size(),
-                         patch.path().c_str(),
+                         &patch_writer,
                          nullptr);
       CHECK_EQ(err, 0);
-      LOG(WARNING) << "Recompress Postfix patch size: "
-                   << utils::FileSize(patch.path());
-      std::string patch_content;
-      TEST_AND_RETURN_FALSE(utils::ReadFile(patch.path(), &patch_content));
-      pb_block.set_postfix_bspatch(std::move(patch_content));
+      LOG(WARNING) << "Recompress Postfix patch size: " << patch.size();
+      pb_block.set_postfix_bspatch(patch.data(), patch.size());
     }
     // Include recompressed blob hash, so we can determine if the device
     // produces same compressed output
@@ -83,30 +82,27 @@ bool StoreDstCompressedFileInfo(std::string_view recompressed_blob,
   return true;
 }
 
-template <typename Blob>
-static bool TryBsdiff(Blob src, Blob dst, Blob* output) noexcept {
+static bool TryBsdiff(const Blob& src,
+                      const Blob& dst,
+                      Blob* output) noexcept {
   static constexpr auto kLz4diffDefaultBrotliQuality = 9;
   CHECK_NE(output, nullptr);
-  ScopedTempFile patch;
-
   Blob bsdiff_delta;
-  bsdiff::BsdiffPatchWriter patch_writer(patch.path(),
-                                         {bsdiff::CompressorType::kBrotli},
-                                         kLz4diffDefaultBrotliQuality);
+  MemoryPatchWriter patch_writer(&bsdiff_delta,
+                                 {bsdiff::CompressorType::kBrotli},
+                                 kLz4diffDefaultBrotliQuality);
   TEST_AND_RETURN_FALSE(0 == bsdiff::bsdiff(src.data(),
                                             src.size(),
                                             dst.data(),
                                             dst.size(),
                                             &patch_writer,
                                             nullptr));
-
-  TEST_AND_RETURN_FALSE(utils::ReadFile(patch.path(), &bsdiff_delta));
   TEST_AND_RETURN_FALSE(!bsdiff_delta.empty());
   *output = std::move(bsdiff_delta);
   return true;
 }
 
-bool TryFindDeflates(puffin::Buffer data,
+bool TryFindDeflates(const puffin::Buffer& data,
                      std::vector<puffin::BitExtent>* deflates) {
   if (puffin::LocateDeflatesInZipArchive(data, deflates)) {
     return true;
@@ -138,8 +134,8 @@ static bool ConstructLz4diffPatch(Blob inner_patch,
   return true;
 }
 
-static bool TryPuffdiff(puffin::Buffer src,
-                        puffin::Buffer dst,
+static bool TryPuffdiff(const puffin::Buffer& src,
+                        const puffin::Buffer& dst,
                         Blob* output) noexcept {
   CHECK_NE(output, nullptr);
   std::vector<puffin::BitExtent> src_deflates;
@@ -183,14 +179,32 @@ bool Lz4Diff(std::string_view src,
              const CompressedFile& dst_file_info,
              Blob* output,
              InstallOperation::Type* op_type) noexcept {
+  Lz4Context context;
+  return Lz4Diff(
+      src, dst, src_file_info, dst_file_info, &context, output, op_type);
+}
+
+bool Lz4Diff(std::string_view src,
+             std::string_view dst,
+             const CompressedFile& src_file_info,
+             const CompressedFile& dst_file_info,
+             Lz4Context* context,
+             Blob* output,
+             InstallOperation::Type* op_type) noexcept {
   const auto& src_block_info = src_file_info.blocks;
   const auto& dst_block_info = dst_file_info.blocks;
 
-  auto decompressed_src = TryDecompressBlob(
-      src, src_block_info, src_file_info.zero_padding_enabled);
-  auto decompressed_dst = TryDecompressBlob(
-      dst, dst_block_info, dst_file_info.zero_padding_enabled);
-  if (decompressed_src.empty() || decompressed_dst.empty()) {
+  Blob& decompressed_src = *context->decompressed_src();
+  Blob& decompressed_dst = *context->decompressed_dst();
+  if (!TryDecompressBlob(src,
+                         src_block_info,
+                         src_file_info.zero_padding_enabled,
+                         &decompressed_src) ||
+      !TryDecompressBlob(dst,
+                         dst_block_info,
+                         dst_file_info.zero_padding_enabled,
+                         &decompressed_dst) ||
+      decompressed_src.empty() || decompressed_dst.empty()) {
     LOG(ERROR) << "Failed to decompress input data";
     return false;
   }
@@ -215,13 +229,13 @@ bool Lz4Diff(std::string_view src,
       *op_type = InstallOperation::LZ4DIFF_PUFFDIFF;
     }
   }
-  // Free up memory used by |decompressed_src| , as we don't need it anymore.
-  decompressed_src = {};
-
-  auto recompressed_blob = TryCompressBlob(ToStringView(decompressed_dst),
-                                           dst_block_info,
-                                           dst_file_info.zero_padding_enabled,
-                                           dst_file_info.algo);
+  Blob& recompressed_blob = *context->compressed();
+  TEST_AND_RETURN_FALSE(TryCompressBlob(ToStringView(decompressed_dst),
+                                        dst_block_info,
+                                        dst_file_info.zero_padding_enabled,
+                                        dst_file_info.algo,
+                                        context,
+                                        &recompressed_blob));
   TEST_AND_RETURN_FALSE(recompressed_blob.size() > 0);
 
   StoreSrcCompressedFileInfo(src_file_info, &header);
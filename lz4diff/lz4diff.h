@@ -26,10 +26,22 @@
 
 namespace chromeos_update_engine {
 
+class Lz4Context;
+
+bool Lz4Diff(std::string_view src,
+             std::string_view dst,
+             const CompressedFile& src_file_info,
+             const CompressedFile& dst_file_info,
+             Blob* output,
+             InstallOperation::Type* op_type = nullptr) noexcept;
+
+// Like the above, decompressing and recompressing with the scratch buffers
+// and LZ4HC states of |context|.
 bool Lz4Diff(std::string_view src,
              std::string_view dst,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
+             Lz4Context* context,
              Blob* output,
              InstallOperation::Type* op_type = nullptr) noexcept;
 
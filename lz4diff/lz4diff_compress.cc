@@ -21,95 +21,248 @@
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <vector>
+
 #include <base/logging.h>
 #include <lz4.h>
 #include <lz4hc.h>
 
 namespace chromeos_update_engine {
 
-bool TryCompressBlob(std::string_view blob,
-                     const std::vector<CompressedBlock>& block_info,
-                     const bool zero_padding_enabled,
-                     const CompressionAlgorithm compression_algo,
-                     const SinkFunc& sink) {
+namespace {
+// The most threads blocks are compressed or decompressed on.
+constexpr size_t kMaxThreads = 4;
+// The least number of blocks compressed or decompressed by each thread.
+constexpr size_t kMinBlocksPerThread = 64;
+// The number of blocks compressed before they are passed to a sink. Enough for
+// every thread to get a share, while keeping the compressed data held at once
+// to a few megabytes.
+constexpr size_t kBlocksPerBatch = kMaxThreads * kMinBlocksPerThread * 4;
+
+// The number of threads to compress or decompress |count| blocks on.
+size_t NumThreadsForBlocks(size_t count) {
+  return std::clamp<size_t>(
+      std::min<size_t>(std::thread::hardware_concurrency(),
+                       count / kMinBlocksPerThread),
+      1,
+      kMaxThreads);
+}
+
+// Runs |work| with the index of the thread on |num_threads| consecutive
+// ranges of the |count| blocks. Returns whether all ranges succeeded.
+bool RunOnBlockRanges(
+    size_t count,
+    size_t num_threads,
+    const std::function<bool(size_t, size_t, size_t)>& work) {
+  if (num_threads == 1) {
+    return work(0, 0, count);
+  }
+  std::vector<std::thread> threads;
+  std::vector<char> results(num_threads, false);
+  size_t begin = 0;
+  for (size_t t = 0; t < num_threads; t++) {
+    const size_t end = count * (t + 1) / num_threads;
+    auto run = [&work, &results, begin, end, t] {
+      results[t] = work(t, begin, end);
+    };
+    if (t + 1 < num_threads) {
+      threads.emplace_back(run);
+    } else {
+      run();
+    }
+    begin = end;
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return std::all_of(
+      results.begin(), results.end(), [](char result) { return result; });
+}
+
+// Compresses |block| of |blob|, whose first |uncompressed_size| bytes are
+// covered by blocks, into the |block.compressed_length| bytes at |output|.
+// |hc| is only used for LZ4HC and may be reused for the next block.
+bool CompressBlock(std::string_view blob,
+                   size_t uncompressed_size,
+                   const CompressedBlock& block,
+                   const bool zero_padding_enabled,
+                   const CompressionAlgorithm& compression_algo,
+                   LZ4_streamHC_t* hc,
+                   uint8_t* output) {
+  const auto uncompressed_block =
+      blob.substr(block.uncompressed_offset, block.uncompressed_length);
+  int ret = 0;
+  // LZ4 spec enforces that last op of a compressed block must be an insert op
+  // of at least 5 bytes. Compressors will try to conform to that requirement
+  // if the input size is just right. We don't want that. So always give a
+  // little bit more data.
+  switch (int src_size = uncompressed_size - block.uncompressed_offset;
+          compression_algo.type()) {
+    case CompressionAlgorithm::LZ4HC:
+      ret = LZ4_compress_HC_destSize(hc,
+                                     uncompressed_block.data(),
+                                     reinterpret_cast<char*>(output),
+                                     &src_size,
+                                     block.compressed_length,
+                                     compression_algo.level());
+      break;
+    case CompressionAlgorithm::LZ4:
+      ret = LZ4_compress_destSize(uncompressed_block.data(),
+                                  reinterpret_cast<char*>(output),
+                                  &src_size,
+                                  block.compressed_length);
+      break;
+    default:
+      LOG(ERROR) << "Unrecognized compression algorithm: "
+                 << compression_algo.type();
+      return false;
+  }
+  TEST_GT(ret, 0);
+  const uint64_t bytes_written = ret;
+  // Last block may have trailing zeros
+  TEST_LE(bytes_written, block.compressed_length);
+  if (bytes_written < block.compressed_length) {
+    if (zero_padding_enabled) {
+      const auto padding = block.compressed_length - bytes_written;
+      std::memmove(output + padding, output, bytes_written);
+      std::fill(output, output + padding, 0);
+    } else {
+      std::fill(output + bytes_written, output + block.compressed_length, 0);
+    }
+  }
+  return true;
+}
+
+// The size of |block| in the compressed blob.
+uint64_t CompressedBlockSize(const CompressedBlock& block) {
+  return block.IsCompressed() ? block.compressed_length
+                              : block.uncompressed_length;
+}
+
+// Compresses the blocks [|begin|, |end|) of |block_info| into |output|, with
+// the LZ4HC states of |context|. |uncompressed_size| is the size of the data
+// all of |block_info| covers. Every block is compressed independently, so large
+// ranges are compressed on several threads.
+bool CompressBlocks(std::string_view blob,
+                    const std::vector<CompressedBlock>& block_info,
+                    size_t begin,
+                    size_t end,
+                    size_t uncompressed_size,
+                    const bool zero_padding_enabled,
+                    const CompressionAlgorithm& compression_algo,
+                    Lz4Context* context,
+                    Blob* output) {
+  size_t compressed_size = 0;
+  std::vector<size_t> compressed_offsets;
+  compressed_offsets.reserve(end - begin);
+  for (size_t i = begin; i < end; i++) {
+    compressed_offsets.push_back(compressed_size);
+    compressed_size += CompressedBlockSize(block_info[i]);
+  }
+  output->resize(compressed_size);
+  const size_t num_threads = NumThreadsForBlocks(end - begin);
+  TEST_AND_RETURN_FALSE(context->ReserveHcStates(num_threads));
+  return RunOnBlockRanges(
+      end - begin,
+      num_threads,
+      [&](size_t thread, size_t range_begin, size_t range_end) {
+        for (size_t i = range_begin; i < range_end; i++) {
+          const auto& block = block_info[begin + i];
+          uint8_t* block_output = output->data() + compressed_offsets[i];
+          if (!block.IsCompressed()) {
+            std::memcpy(block_output,
+                        blob.data() + block.uncompressed_offset,
+                        block.uncompressed_length);
+            continue;
+          }
+          TEST_AND_RETURN_FALSE(CompressBlock(blob,
+                                              uncompressed_size,
+                                              block,
+                                              zero_padding_enabled,
+                                              compression_algo,
+                                              context->hc_state(thread),
+                                              block_output));
+        }
+        return true;
+      });
+}
+
+// Returns the size of the data covered by |block_info|, checking the blocks
+// are sorted and contiguous.
+size_t UncompressedSizeOfBlocks(
+    const std::vector<CompressedBlock>& block_info) {
   size_t uncompressed_size = 0;
   for (const auto& block : block_info) {
     CHECK_EQ(uncompressed_size, block.uncompressed_offset)
         << "Compressed block info is expected to be sorted.";
     uncompressed_size += block.uncompressed_length;
   }
-  auto hc = LZ4_createStreamHC();
-  DEFER {
-    if (hc) {
-      LZ4_freeStreamHC(hc);
-      hc = nullptr;
-    }
-  };
-  size_t compressed_offset = 0;
-  Blob block_buffer;
-  for (const auto& block : block_info) {
-    const auto uncompressed_block =
-        blob.substr(block.uncompressed_offset, block.uncompressed_length);
-    if (!block.IsCompressed()) {
-      TEST_EQ(sink(reinterpret_cast<const uint8_t*>(uncompressed_block.data()),
-                   uncompressed_block.size()),
-              uncompressed_block.size());
-      continue;
-    }
-    block_buffer.resize(block.compressed_length);
-    // Execute the increment at end of each loop
-    DEFER {
-      compressed_offset += block.compressed_length;
-      block_buffer.clear();
-    };
+  return uncompressed_size;
+}
+}  // namespace
 
-    int ret = 0;
-    // LZ4 spec enforces that last op of a compressed block must be an insert op
-    // of at least 5 bytes. Compressors will try to conform to that requirement
-    // if the input size is just right. We don't want that. So always give a
-    // little bit more data.
-    switch (int src_size = uncompressed_size - block.uncompressed_offset;
-            compression_algo.type()) {
-      case CompressionAlgorithm::LZ4HC:
-        ret = LZ4_compress_HC_destSize(
-            hc,
-            uncompressed_block.data(),
-            reinterpret_cast<char*>(block_buffer.data()),
-            &src_size,
-            block.compressed_length,
-            compression_algo.level());
-        break;
-      case CompressionAlgorithm::LZ4:
-        ret =
-            LZ4_compress_destSize(uncompressed_block.data(),
-                                  reinterpret_cast<char*>(block_buffer.data()),
-                                  &src_size,
-                                  block.compressed_length);
-        break;
-      default:
-        LOG(ERROR) << "Unrecognized compression algorithm: "
-                   << compression_algo.type();
-        return {};
-    }
-    TEST_GT(ret, 0);
-    const uint64_t bytes_written = ret;
-    // Last block may have trailing zeros
-    TEST_LE(bytes_written, block.compressed_length);
-    if (bytes_written < block.compressed_length) {
-      if (zero_padding_enabled) {
-        const auto padding = block.compressed_length - bytes_written;
-        std::memmove(
-            block_buffer.data() + padding, block_buffer.data(), bytes_written);
-        std::fill(block_buffer.data(), block_buffer.data() + padding, 0);
+Lz4Context::~Lz4Context() {
+  for (auto hc : hc_states_) {
+    LZ4_freeStreamHC(hc);
+  }
+}
+
+Lz4Context* Lz4Context::ForCurrentThread() {
+  static thread_local Lz4Context context;
+  return &context;
+}
+
+bool Lz4Context::ReserveHcStates(size_t count) {
+  while (hc_states_.size() < count) {
+    auto hc = LZ4_createStreamHC();
+    TEST_AND_RETURN_FALSE(hc != nullptr);
+    hc_states_.push_back(hc);
+  }
+  return true;
+}
 
-      } else {
-        std::fill(block_buffer.data() + bytes_written,
-                  block_buffer.data() + block.compressed_length,
-                  0);
-      }
+bool TryCompressBlob(std::string_view blob,
+                     const std::vector<CompressedBlock>& block_info,
+                     const bool zero_padding_enabled,
+                     const CompressionAlgorithm compression_algo,
+                     const SinkFunc& sink) {
+  Lz4Context context;
+  return TryCompressBlob(
+      blob, block_info, zero_padding_enabled, compression_algo, sink, &context);
+}
+
+bool TryCompressBlob(std::string_view blob,
+                     const std::vector<CompressedBlock>& block_info,
+                     const bool zero_padding_enabled,
+                     const CompressionAlgorithm compression_algo,
+                     const SinkFunc& sink,
+                     Lz4Context* context) {
+  // The blocks are compressed a batch at a time, each batch passed to |sink|
+  // before the next one is compressed, so the compressed blob is never held
+  // in memory as a whole.
+  const size_t uncompressed_size = UncompressedSizeOfBlocks(block_info);
+  TEST_AND_RETURN_FALSE(uncompressed_size <= blob.size());
+  Blob* compressed = context->compressed();
+  for (size_t begin = 0; begin < block_info.size(); begin += kBlocksPerBatch) {
+    const size_t end = std::min(begin + kBlocksPerBatch, block_info.size());
+    TEST_AND_RETURN_FALSE(CompressBlocks(blob,
+                                         block_info,
+                                         begin,
+                                         end,
+                                         uncompressed_size,
+                                         zero_padding_enabled,
+                                         compression_algo,
+                                         context,
+                                         compressed));
+    size_t offset = 0;
+    for (size_t i = begin; i < end; i++) {
+      const auto size = CompressedBlockSize(block_info[i]);
+      TEST_EQ(sink(compressed->data() + offset, size), size);
+      offset += size;
     }
-    TEST_EQ(sink(block_buffer.data(), block_buffer.size()),
-            block_buffer.size());
   }
   // Any trailing data will be copied to the output buffer.
   TEST_EQ(
@@ -119,40 +272,49 @@ bool TryCompressBlob(std::string_view blob,
   return true;
 }
 
+bool TryCompressBlob(std::string_view blob,
+                     const std::vector<CompressedBlock>& block_info,
+                     const bool zero_padding_enabled,
+                     const CompressionAlgorithm compression_algo,
+                     Lz4Context* context,
+                     Blob* output) {
+  const size_t uncompressed_size = UncompressedSizeOfBlocks(block_info);
+  TEST_EQ(uncompressed_size, blob.size());
+  return CompressBlocks(blob,
+                        block_info,
+                        0,
+                        block_info.size(),
+                        uncompressed_size,
+                        zero_padding_enabled,
+                        compression_algo,
+                        context,
+                        output);
+}
+
 Blob TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
                      const CompressionAlgorithm compression_algo) {
-  size_t uncompressed_size = 0;
-  size_t compressed_size = 0;
-  for (const auto& block : block_info) {
-    CHECK_EQ(uncompressed_size, block.uncompressed_offset)
-        << "Compressed block info is expected to be sorted.";
-    uncompressed_size += block.uncompressed_length;
-    compressed_size += block.compressed_length;
-  }
-  TEST_EQ(uncompressed_size, blob.size());
+  Lz4Context context;
   Blob output;
-  output.reserve(utils::RoundUp(compressed_size, kBlockSize));
   if (!TryCompressBlob(blob,
                        block_info,
                        zero_padding_enabled,
                        compression_algo,
-                       [&output](const uint8_t* data, size_t size) {
-                         output.insert(output.end(), data, data + size);
-                         return size;
-                       })) {
+                       &context,
+                       &output)) {
     return {};
   }
-
   return output;
 }
 
-Blob TryDecompressBlob(std::string_view blob,
+bool TryDecompressBlob(std::string_view blob,
                        const std::vector<CompressedBlock>& block_info,
-                       const bool zero_padding_enabled) {
+                       const bool zero_padding_enabled,
+                       Blob* output) {
+  output->clear();
   if (block_info.empty()) {
-    return {};
+    return false;
   }
   size_t uncompressed_size = 0;
   size_t compressed_size = 0;
@@ -166,63 +328,84 @@ Blob TryDecompressBlob(std::string_view blob,
   if (blob.size() < compressed_size) {
     LOG(INFO) << "File is chunked. Skip lz4 decompress. Expected size: "
               << compressed_size << ", actual size: " << blob.size();
-    return {};
+    return false;
   }
-  Blob output;
-  output.reserve(uncompressed_size);
+  std::vector<size_t> compressed_offsets;
+  compressed_offsets.reserve(block_info.size());
   size_t compressed_offset = 0;
   for (const auto& block : block_info) {
-    std::string_view cluster =
-        blob.substr(compressed_offset, block.compressed_length);
-    if (!block.IsCompressed()) {
-      CHECK_NE(cluster.size(), 0UL);
-      output.insert(output.end(), cluster.begin(), cluster.end());
-      compressed_offset += cluster.size();
-      continue;
-    }
-    size_t inputmargin = 0;
-    if (zero_padding_enabled) {
-      while (inputmargin < std::min(kBlockSize, cluster.size()) &&
-             cluster[inputmargin] == 0) {
-        inputmargin++;
-      }
-    }
-    output.resize(output.size() + block.uncompressed_length);
-
-    const auto bytes_decompressed = LZ4_decompress_safe_partial(
-        cluster.data() + inputmargin,
-        reinterpret_cast<char*>(output.data()) + output.size() -
-            block.uncompressed_length,
-        cluster.size() - inputmargin,
-        block.uncompressed_length,
-        block.uncompressed_length);
-    if (bytes_decompressed < 0) {
-      LOG(FATAL) << "Failed to decompress, " << bytes_decompressed
-                 << ", output_cursor = "
-                 << output.size() - block.uncompressed_length
-                 << ", input_cursor = " << compressed_offset
-                 << ", blob.size() = " << blob.size()
-                 << ", cluster_size = " << block.compressed_length
-                 << ", dest capacity = " << block.uncompressed_length
-                 << ", input margin = " << inputmargin << " "
-                 << HashCalculator::SHA256Digest(cluster) << " "
-                 << HashCalculator::SHA256Digest(blob);
-      return {};
-    }
+    compressed_offsets.push_back(compressed_offset);
     compressed_offset += block.compressed_length;
-    CHECK_EQ(static_cast<uint64_t>(bytes_decompressed),
-             block.uncompressed_length);
   }
-  CHECK_EQ(output.size(), uncompressed_size);
+  // Every block decompresses to its own range of |output|, so large blobs are
+  // decompressed on several threads.
+  output->resize(uncompressed_size);
+  const bool success = RunOnBlockRanges(
+      block_info.size(),
+      NumThreadsForBlocks(block_info.size()),
+      [&](size_t /* thread */, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          const auto& block = block_info[i];
+          std::string_view cluster =
+              blob.substr(compressed_offsets[i], block.compressed_length);
+          uint8_t* block_output = output->data() + block.uncompressed_offset;
+          if (!block.IsCompressed()) {
+            CHECK_EQ(cluster.size(), block.uncompressed_length);
+            std::memcpy(block_output, cluster.data(), cluster.size());
+            continue;
+          }
+          size_t inputmargin = 0;
+          if (zero_padding_enabled) {
+            while (inputmargin < std::min(kBlockSize, cluster.size()) &&
+                   cluster[inputmargin] == 0) {
+              inputmargin++;
+            }
+          }
+          const auto bytes_decompressed = LZ4_decompress_safe_partial(
+              cluster.data() + inputmargin,
+              reinterpret_cast<char*>(block_output),
+              cluster.size() - inputmargin,
+              block.uncompressed_length,
+              block.uncompressed_length);
+          if (bytes_decompressed < 0) {
+            LOG(FATAL) << "Failed to decompress, " << bytes_decompressed
+                       << ", output_cursor = " << block.uncompressed_offset
+                       << ", input_cursor = " << compressed_offsets[i]
+                       << ", blob.size() = " << blob.size()
+                       << ", cluster_size = " << block.compressed_length
+                       << ", dest capacity = " << block.uncompressed_length
+                       << ", input margin = " << inputmargin << " "
+                       << HashCalculator::SHA256Digest(cluster) << " "
+                       << HashCalculator::SHA256Digest(blob);
+            return false;
+          }
+          CHECK_EQ(static_cast<uint64_t>(bytes_decompressed),
+                   block.uncompressed_length);
+        }
+        return true;
+      });
+  if (!success) {
+    return false;
+  }
+  CHECK_EQ(output->size(), uncompressed_size);
 
   // Trailing data not recorded by compressed block info will be treated as
   // uncompressed, most of the time these are xattrs or trailing zeros.
   CHECK_EQ(blob.size(), compressed_offset)
       << " Unexpected data the end of compressed data ";
   if (compressed_offset < blob.size()) {
-    output.insert(output.end(), blob.begin() + compressed_offset, blob.end());
+    output->insert(output->end(), blob.begin() + compressed_offset, blob.end());
   }
+  return true;
+}
 
+Blob TryDecompressBlob(std::string_view blob,
+                       const std::vector<CompressedBlock>& block_info,
+                       const bool zero_padding_enabled) {
+  Blob output;
+  if (!TryDecompressBlob(blob, block_info, zero_padding_enabled, &output)) {
+    return {};
+  }
   return output;
 }
 
@@ -19,11 +19,44 @@
 
 #include "lz4diff_format.h"
 #include <string_view>
+#include <vector>
+
+#include <base/macros.h>
+#include <lz4hc.h>
 
 namespace chromeos_update_engine {
 
 using SinkFunc = std::function<size_t(const uint8_t*, size_t)>;
 
+// State reused across the blobs compressed and decompressed by a thread: the
+// LZ4HC states of the threads compressing a blob, and scratch buffers which
+// keep their capacity, so consecutive files don't allocate them again. Not
+// thread safe, every thread needs its own, see ForCurrentThread().
+class Lz4Context {
+ public:
+  Lz4Context() = default;
+  ~Lz4Context();
+
+  // The context of the calling thread, kept until the thread exits.
+  static Lz4Context* ForCurrentThread();
+
+  // Makes sure there are LZ4HC states for |count| threads.
+  bool ReserveHcStates(size_t count);
+  LZ4_streamHC_t* hc_state(size_t index) const { return hc_states_[index]; }
+
+  Blob* compressed() { return &compressed_; }
+  Blob* decompressed_src() { return &decompressed_src_; }
+  Blob* decompressed_dst() { return &decompressed_dst_; }
+
+ private:
+  std::vector<LZ4_streamHC_t*> hc_states_;
+  Blob compressed_;
+  Blob decompressed_src_;
+  Blob decompressed_dst_;
+
+  DISALLOW_COPY_AND_ASSIGN(Lz4Context);
+};
+
 // |TryCompressBlob| and |TryDecompressBlob| are inverse function of each other.
 // One compresses data into fixed size output chunks, one decompresses fixed
 // size blocks.
@@ -37,11 +70,29 @@ Blob TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
                      const CompressionAlgorithm compression_algo);
+// Like the above, but passes the compressed blocks to |sink| in order as soon
+// as each batch of them is compressed, so only a batch is held in memory.
 bool TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
                      const CompressionAlgorithm compression_algo,
                      const SinkFunc& sink);
+// Like the above, with the LZ4HC states and the buffer of the compressed
+// batch of |context|.
+bool TryCompressBlob(std::string_view blob,
+                     const std::vector<CompressedBlock>& block_info,
+                     const bool zero_padding_enabled,
+                     const CompressionAlgorithm compression_algo,
+                     const SinkFunc& sink,
+                     Lz4Context* context);
+// Compresses |blob|, which must be covered by |block_info|, into |output|,
+// with the LZ4HC states of |context|. |output| keeps its capacity.
+bool TryCompressBlob(std::string_view blob,
+                     const std::vector<CompressedBlock>& block_info,
+                     const bool zero_padding_enabled,
+                     const CompressionAlgorithm compression_algo,
+                     Lz4Context* context,
+                     Blob* output);
 
 Blob TryDecompressBlob(std::string_view blob,
                        const std::vector<CompressedBlock>& block_info,
@@ -49,6 +100,12 @@ Blob TryDecompressBlob(std::string_view blob,
 Blob TryDecompressBlob(const Blob& blob,
                        const std::vector<CompressedBlock>& block_info,
                        const bool zero_padding_enabled);
+// Decompresses |blob| into |output|, which keeps its capacity. Returns false
+// if |blob| isn't made of |block_info|.
+bool TryDecompressBlob(std::string_view blob,
+                       const std::vector<CompressedBlock>& block_info,
+                       const bool zero_padding_enabled,
+                       Blob* output);
 
 std::ostream& operator<<(std::ostream& out, const CompressedBlockInfo& info);
 
@@ -108,6 +108,92 @@ TEST_F(Lz4diffCompressTest, ExtractElfBinary) {
   ASSERT_EQ(decompressed_blob, expected_blob);
 }
 
+TEST_F(Lz4diffCompressTest, CompressAndDecompressManyBlocks) {
+  // Enough blocks to be split across threads, every one of them compressed
+  // on its own into 3000 bytes, except one stored uncompressed.
+  constexpr size_t kNumBlocks = 300;
+  string data;
+  for (size_t i = 0; data.size() < kNumBlocks * kBlockSize; i++) {
+    data += android::base::StringPrintf("line %zu\n", i);
+  }
+  data.resize(kNumBlocks * kBlockSize);
+  vector<CompressedBlock> blocks;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    blocks.emplace_back(
+        i * kBlockSize, i == 100 ? kBlockSize : 3000, kBlockSize);
+  }
+
+  for (const auto type :
+       {CompressionAlgorithm::LZ4, CompressionAlgorithm::LZ4HC}) {
+    CompressionAlgorithm algo;
+    algo.set_type(type);
+    algo.set_level(9);
+    const Blob compressed = TryCompressBlob(data, blocks, false, algo);
+    ASSERT_EQ(299 * 3000 + kBlockSize, compressed.size());
+    const Blob decompressed = TryDecompressBlob(compressed, blocks, false);
+    ASSERT_EQ(data, ToStringView(decompressed));
+  }
+}
+
+TEST_F(Lz4diffCompressTest, CompressToSinkInBatches) {
+  // More blocks than are compressed at once before being passed to the sink.
+  constexpr size_t kNumBlocks = 2500;
+  string data;
+  for (size_t i = 0; data.size() < kNumBlocks * kBlockSize; i++) {
+    data += android::base::StringPrintf("line %zu\n", i);
+  }
+  data.resize(kNumBlocks * kBlockSize);
+  vector<CompressedBlock> blocks;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    blocks.emplace_back(i * kBlockSize, 3000, kBlockSize);
+  }
+  CompressionAlgorithm algo;
+  algo.set_type(CompressionAlgorithm::LZ4);
+  const Blob expected = TryCompressBlob(data, blocks, false, algo);
+  ASSERT_EQ(kNumBlocks * 3000, expected.size());
+
+  // Trailing data not covered by any block is passed to the sink last.
+  data += "trailing";
+  Blob compressed;
+  ASSERT_TRUE(TryCompressBlob(
+      data, blocks, false, algo, [&compressed](const uint8_t* b, size_t size) {
+        compressed.insert(compressed.end(), b, b + size);
+        return size;
+      }));
+  ASSERT_EQ(expected.size() + 8, compressed.size());
+  ASSERT_TRUE(std::equal(expected.begin(), expected.end(), compressed.begin()));
+  ASSERT_EQ("trailing", ToStringView(compressed).substr(expected.size()));
+}
+
+TEST_F(Lz4diffCompressTest, ReuseContextAndBuffers) {
+  string data;
+  for (size_t i = 0; data.size() < 8 * kBlockSize; i++) {
+    data += android::base::StringPrintf("line %zu\n", i);
+  }
+  data.resize(8 * kBlockSize);
+  vector<CompressedBlock> blocks;
+  for (size_t i = 0; i < 8; i++) {
+    blocks.emplace_back(i * kBlockSize, 3000, kBlockSize);
+  }
+  CompressionAlgorithm algo;
+  algo.set_type(CompressionAlgorithm::LZ4HC);
+  algo.set_level(9);
+  const Blob expected = TryCompressBlob(data, blocks, false, algo);
+  ASSERT_FALSE(expected.empty());
+
+  Lz4Context context;
+  Blob compressed;
+  Blob decompressed;
+  for (size_t i = 0; i < 2; i++) {
+    ASSERT_TRUE(
+        TryCompressBlob(data, blocks, false, algo, &context, &compressed));
+    ASSERT_EQ(expected, compressed);
+    ASSERT_TRUE(TryDecompressBlob(
+        ToStringView(compressed), blocks, false, &decompressed));
+    ASSERT_EQ(data, ToStringView(decompressed));
+  }
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
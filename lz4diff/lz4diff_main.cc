@@ -14,11 +14,27 @@
 // limitations under the License.
 //
 
+#include <stdio.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <base/strings/string_split.h>
+
 #include "lz4diff.h"
 #include "lz4diff/lz4patch.h"
 #include "lz4diff_compress.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
 #include "update_engine/payload_generator/erofs_filesystem.h"
+#include "update_engine/payload_generator/mapped_file.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/common/utils.h"
 
 using namespace chromeos_update_engine;
@@ -133,10 +149,234 @@ int ExecuteLz4diffOp(const char* src_image_path,
       src_image_path, dst_image_path, *src_file, *dst_file, patch_file, op);
 }
 
+// A pair of files of the same name in two EROFS images of a batch manifest
+// line, and the results of diffing them.
+struct BatchJob {
+  std::shared_ptr<const MappedFile> src_image;
+  std::shared_ptr<const MappedFile> dst_image;
+  std::string src_image_path;
+  std::string dst_image_path;
+  FilesystemInterface::File src_file;
+  FilesystemInterface::File dst_file;
+
+  size_t src_size{0};
+  size_t dst_size{0};
+  size_t patch_size{0};
+  InstallOperation::Type op_type{InstallOperation::REPLACE};
+  double diff_ms{0};
+  double patch_ms{0};
+  bool ok{false};
+};
+
+// Parses the optional compression params of a manifest line, "lz4" or
+// "lz4hc[:level]", overriding the algorithm recorded in the images.
+bool ParseCompressionParams(const std::string& params,
+                            CompressionAlgorithm* algo) {
+  const auto parts = base::SplitString(
+      params, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  if (parts.empty() || parts.size() > 2) {
+    return false;
+  }
+  if (parts[0] == "lz4") {
+    algo->set_type(CompressionAlgorithm::LZ4);
+  } else if (parts[0] == "lz4hc") {
+    algo->set_type(CompressionAlgorithm::LZ4HC);
+  } else {
+    return false;
+  }
+  int32_t level = 0;
+  if (parts.size() == 2 && !android::base::ParseInt(parts[1], &level)) {
+    return false;
+  }
+  algo->set_level(level);
+  return true;
+}
+
+// Adds a job for every compressed file of |dst_image_path| also present in
+// |src_image_path| to |jobs|.
+bool AddBatchJobs(const std::string& src_image_path,
+                  const std::string& dst_image_path,
+                  const CompressionAlgorithm* algo,
+                  std::vector<BatchJob>* jobs) {
+  auto src_fs = ErofsFilesystem::CreateFromFile(src_image_path);
+  auto dst_fs = ErofsFilesystem::CreateFromFile(dst_image_path);
+  auto src_image = MappedFile::OpenShared(src_image_path);
+  auto dst_image = MappedFile::OpenShared(dst_image_path);
+  if (!src_fs || !dst_fs || !src_image || !dst_image) {
+    LOG(ERROR) << "Unable to open EROFS images " << src_image_path << " and "
+               << dst_image_path;
+    return false;
+  }
+  std::vector<FilesystemInterface::File> src_files;
+  std::vector<FilesystemInterface::File> dst_files;
+  TEST_AND_RETURN_FALSE(src_fs->GetFiles(&src_files));
+  TEST_AND_RETURN_FALSE(dst_fs->GetFiles(&dst_files));
+  std::map<std::string, const FilesystemInterface::File*> src_by_name;
+  for (const auto& src_file : src_files) {
+    src_by_name.emplace(src_file.name, &src_file);
+  }
+  for (const auto& dst_file : dst_files) {
+    const auto it = src_by_name.find(dst_file.name);
+    if (it == src_by_name.end() || !dst_file.is_compressed) {
+      continue;
+    }
+    BatchJob job;
+    job.src_image = src_image;
+    job.dst_image = dst_image;
+    job.src_image_path = src_image_path;
+    job.dst_image_path = dst_image_path;
+    job.src_file = *it->second;
+    job.dst_file = dst_file;
+    if (algo) {
+      job.src_file.compressed_file_info.algo = *algo;
+      job.dst_file.compressed_file_info.algo = *algo;
+    }
+    jobs->push_back(std::move(job));
+  }
+  return true;
+}
+
+// Diffs and patches the files of |job|, on the scratch buffers and LZ4HC
+// states of the calling thread.
+void RunBatchJob(BatchJob* job) {
+  using Clock = std::chrono::steady_clock;
+  auto elapsed_ms = [](Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start)
+        .count();
+  };
+  Lz4Context* context = Lz4Context::ForCurrentThread();
+  Blob src_blob;
+  Blob dst_blob;
+  if (!job->src_image->ReadExtents(
+          job->src_file.extents, kBlockSize, &src_blob) ||
+      !job->dst_image->ReadExtents(
+          job->dst_file.extents, kBlockSize, &dst_blob)) {
+    LOG(ERROR) << "Unable to read " << job->dst_file.name;
+    return;
+  }
+  job->src_size = src_blob.size();
+  job->dst_size = dst_blob.size();
+
+  Blob patch;
+  const auto diff_start = Clock::now();
+  if (!Lz4Diff(ToStringView(src_blob),
+               ToStringView(dst_blob),
+               job->src_file.compressed_file_info,
+               job->dst_file.compressed_file_info,
+               context,
+               &patch,
+               &job->op_type)) {
+    LOG(ERROR) << "LZ4DIFF failed for " << job->dst_file.name;
+    return;
+  }
+  job->diff_ms = elapsed_ms(diff_start);
+  job->patch_size = patch.size();
+
+  Blob actual_target;
+  const auto patch_start = Clock::now();
+  const bool patched = Lz4Patch(
+      ToStringView(src_blob),
+      ToStringView(patch),
+      [&actual_target](const uint8_t* data, size_t size) {
+        actual_target.insert(actual_target.end(), data, data + size);
+        return size;
+      },
+      context);
+  job->patch_ms = elapsed_ms(patch_start);
+  job->ok = patched && actual_target == dst_blob;
+  if (!job->ok) {
+    LOG(ERROR) << "LZ4PATCH output mismatch for " << job->dst_file.name;
+  }
+}
+
+// Diffs all the files listed by |manifest_path| on a thread pool and writes
+// their patch sizes and timings to the CSV file |csv_path|. Each line of the
+// manifest holds a source and a target EROFS image, optionally followed by
+// the compression params to use instead of those of the images, e.g.
+// "lz4hc:9". Empty lines and lines starting with '#' are ignored.
+int ExecuteLz4diffBatch(const char* manifest_path, const char* csv_path) {
+  std::string manifest;
+  if (!utils::ReadFile(manifest_path, &manifest)) {
+    LOG(ERROR) << "Unable to read " << manifest_path;
+    return 1;
+  }
+  std::vector<BatchJob> jobs;
+  for (const auto& line : base::SplitString(
+           manifest, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    if (line[0] == '#') {
+      continue;
+    }
+    const auto fields = base::SplitString(
+        line, " \t", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    CompressionAlgorithm algo;
+    if ((fields.size() != 2 && fields.size() != 3) ||
+        (fields.size() == 3 && !ParseCompressionParams(fields[2], &algo))) {
+      LOG(ERROR) << "Invalid manifest line: " << line;
+      return 1;
+    }
+    if (!AddBatchJobs(fields[0],
+                      fields[1],
+                      fields.size() == 3 ? &algo : nullptr,
+                      &jobs)) {
+      return 1;
+    }
+  }
+  LOG(INFO) << "Diffing " << jobs.size() << " files";
+
+  // Every thread of the scheduler reuses its own LZ4 context for its jobs.
+  TaskScheduler scheduler(diff_utils::GetMaxThreads());
+  {
+    TaskScheduler::TaskGroup group(&scheduler, false);
+    for (auto& job : jobs) {
+      BatchJob* task_job = &job;
+      group.Submit(utils::BlocksInExtents(job.dst_file.extents),
+                   [task_job]() { RunBatchJob(task_job); });
+    }
+    group.Wait();
+  }
+
+  std::string csv =
+      "src_image,dst_image,file,src_size,dst_size,algo,level,patch_size,"
+      "op_type,diff_ms,patch_ms,ok\n";
+  size_t failures = 0;
+  for (const auto& job : jobs) {
+    const auto& algo = job.dst_file.compressed_file_info.algo;
+    csv += android::base::StringPrintf(
+        "%s,%s,%s,%zu,%zu,%s,%d,%zu,%s,%.3f,%.3f,%d\n",
+        job.src_image_path.c_str(),
+        job.dst_image_path.c_str(),
+        job.dst_file.name.c_str(),
+        job.src_size,
+        job.dst_size,
+        CompressionAlgorithm::Type_Name(algo.type()).c_str(),
+        algo.level(),
+        job.patch_size,
+        job.ok ? InstallOperationTypeName(job.op_type) : "",
+        job.diff_ms,
+        job.patch_ms,
+        job.ok);
+    failures += job.ok ? 0 : 1;
+  }
+  if (!utils::WriteFile(csv_path, csv.data(), csv.size())) {
+    LOG(ERROR) << "Unable to write " << csv_path;
+    return 1;
+  }
+  LOG(INFO) << "Diffed " << jobs.size() << " files, " << failures
+            << " failed";
+  return failures == 0 ? 0 : 5;
+}
+
 int main(int argc, const char** argv) {
+  if (argc >= 2 && std::string_view(argv[1]) == "batch") {
+    if (argc != 4) {
+      printf("Usage: %s batch <manifest> <output csv>\n", argv[0]);
+      return 1;
+    }
+    return ExecuteLz4diffBatch(argv[2], argv[3]);
+  }
   if (argc < 4) {
     printf(
-        "Usage: %s <diff/patch/test> <src EROFS image> <dst EROFS image> "
+        "Usage: %s <diff/patch/test/batch> <src EROFS image> <dst EROFS image> "
         "...args\n",
         argv[0]);
     return 2;
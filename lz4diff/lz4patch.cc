@@ -222,7 +222,7 @@ size_t GetDecompressedSize(
   return decompressed_size;
 }
 
-bool ApplyInnerPatch(Blob decompressed_src,
+bool ApplyInnerPatch(const Blob& decompressed_src,
                      const Lz4diffPatch& patch,
                      Blob* decompressed_dst) {
   switch (patch.pb_header.inner_type()) {
@@ -245,18 +245,22 @@ bool ApplyInnerPatch(Blob decompressed_src,
 // Hand coding CPS is not fun.
 bool Lz4Patch(std::string_view src_data,
               const Lz4diffPatch& patch,
-              const SinkFunc& sink) {
-  auto decompressed_src = TryDecompressBlob(
+              const SinkFunc& sink,
+              Lz4Context* context) {
+  Blob& decompressed_src = *context->decompressed_src();
+  TEST_AND_RETURN_FALSE(TryDecompressBlob(
       src_data,
       ToCompressedBlockVec(patch.pb_header.src_info().block_info()),
-      patch.pb_header.src_info().zero_padding_enabled());
+      patch.pb_header.src_info().zero_padding_enabled(),
+      &decompressed_src));
   TEST_AND_RETURN_FALSE(!decompressed_src.empty());
-  Blob decompressed_dst;
+  Blob& decompressed_dst = *context->decompressed_dst();
+  decompressed_dst.clear();
   const auto decompressed_dst_size =
       GetDecompressedSize(patch.pb_header.dst_info().block_info());
   decompressed_dst.reserve(decompressed_dst_size);
 
-  ApplyInnerPatch(std::move(decompressed_src), patch, &decompressed_dst);
+  ApplyInnerPatch(decompressed_src, patch, &decompressed_dst);
 
   if (!HasPosfixPatches(patch)) {
     return TryCompressBlob(
@@ -264,7 +268,8 @@ bool Lz4Patch(std::string_view src_data,
         ToCompressedBlockVec(patch.pb_header.dst_info().block_info()),
         patch.pb_header.dst_info().zero_padding_enabled(),
         patch.pb_header.dst_info().algo(),
-        sink);
+        sink,
+        context);
   }
   auto postfix_patcher =
       [&sink,
@@ -308,7 +313,8 @@ bool Lz4Patch(std::string_view src_data,
       ToCompressedBlockVec(patch.pb_header.dst_info().block_info()),
       patch.pb_header.dst_info().zero_padding_enabled(),
       patch.pb_header.dst_info().algo(),
-      postfix_patcher);
+      postfix_patcher,
+      context);
 }
 
 bool Lz4Patch(std::string_view src_data,
@@ -318,11 +324,15 @@ bool Lz4Patch(std::string_view src_data,
   const auto output_size =
       GetCompressedSize(patch.pb_header.dst_info().block_info());
   blob.reserve(output_size);
+  Lz4Context context;
   TEST_AND_RETURN_FALSE(Lz4Patch(
-      src_data, patch, [&blob](const uint8_t* data, size_t size) -> size_t {
+      src_data,
+      patch,
+      [&blob](const uint8_t* data, size_t size) -> size_t {
         blob.insert(blob.end(), data, data + size);
         return size;
-      }));
+      },
+      &context));
   *output = std::move(blob);
   return true;
 }
@@ -340,9 +350,17 @@ bool Lz4Patch(std::string_view src_data,
 bool Lz4Patch(std::string_view src_data,
               std::string_view patch_data,
               const SinkFunc& sink) {
+  Lz4Context context;
+  return Lz4Patch(src_data, patch_data, sink, &context);
+}
+
+bool Lz4Patch(std::string_view src_data,
+              std::string_view patch_data,
+              const SinkFunc& sink,
+              Lz4Context* context) {
   Lz4diffPatch patch;
   TEST_AND_RETURN_FALSE(ParseLz4DifffPatch(patch_data, &patch));
-  return Lz4Patch(src_data, patch, sink);
+  return Lz4Patch(src_data, patch, sink, context);
 }
 
 bool Lz4Patch(const Blob& src_data, const Blob& patch_data, Blob* output) {
@@ -25,6 +25,11 @@ namespace chromeos_update_engine {
 bool Lz4Patch(std::string_view src_data,
               std::string_view patch_data,
               const SinkFunc& sink);
+// Like the above, with the scratch buffers and LZ4HC states of |context|.
+bool Lz4Patch(std::string_view src_data,
+              std::string_view patch_data,
+              const SinkFunc& sink,
+              Lz4Context* context);
 
 bool Lz4Patch(std::string_view src_data,
               std::string_view patch_data,
@@ -16,7 +16,10 @@
 
 #include "update_engine/metrics_utils.h"
 
+#include <algorithm>
+#include <functional>
 #include <string>
+#include <vector>
 
 #include <base/time/time.h>
 
@@ -381,5 +384,62 @@ bool LoadAndReportTimeToReboot(MetricsReporterInterface* metrics_reporter,
   return true;
 }
 
+void LogSlowestTransfers(const std::vector<HttpTransferTiming>& timings,
+                         size_t count) {
+  std::vector<const HttpTransferTiming*> slowest;
+  for (const auto& timing : timings) {
+    if (timing.bytes > 0)
+      slowest.push_back(&timing);
+  }
+  count = std::min(count, slowest.size());
+  std::partial_sort(
+      slowest.begin(),
+      slowest.begin() + count,
+      slowest.end(),
+      [](const HttpTransferTiming* a, const HttpTransferTiming* b) {
+        return a->BytesPerSecond() < b->BytesPerSecond();
+      });
+  for (size_t i = 0; i < count; i++) {
+    LOG(INFO) << "Slow request " << i + 1 << ": " << slowest[i]->bytes
+              << " bytes at offset " << slowest[i]->offset << " in "
+              << slowest[i]->total.InMilliseconds() << " ms, first byte after "
+              << slowest[i]->first_byte.InMilliseconds() << " ms";
+  }
+}
+
+void ReportTransferTimings(MetricsReporterInterface* metrics_reporter,
+                           const std::vector<HttpTransferTiming>& timings) {
+  if (timings.empty())
+    return;
+  TimeDelta name_lookup, connect, tls_handshake, first_byte;
+  // Throughput of the requests that received data, fastest first.
+  std::vector<int64_t> bytes_per_second;
+  for (const auto& timing : timings) {
+    name_lookup += timing.name_lookup;
+    connect += timing.connect;
+    tls_handshake += timing.tls_handshake;
+    first_byte += timing.first_byte;
+    if (timing.bytes > 0)
+      bytes_per_second.push_back(timing.BytesPerSecond());
+  }
+  std::sort(
+      bytes_per_second.begin(), bytes_per_second.end(), std::greater<>());
+  // The throughput which |percent| of the requests reached.
+  auto percentile = [&bytes_per_second](size_t percent) -> int64_t {
+    if (bytes_per_second.empty())
+      return 0;
+    return bytes_per_second[(bytes_per_second.size() * percent - 1) / 100];
+  };
+  const int num_requests = static_cast<int>(timings.size());
+  metrics_reporter->ReportDownloadTimingMetrics(num_requests,
+                                                name_lookup / num_requests,
+                                                connect / num_requests,
+                                                tls_handshake / num_requests,
+                                                first_byte / num_requests,
+                                                percentile(50),
+                                                percentile(95),
+                                                percentile(100));
+}
+
 }  // namespace metrics_utils
 }  // namespace chromeos_update_engine
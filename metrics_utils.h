@@ -22,12 +22,14 @@
 #include <string_view>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include <base/time/time.h>
 
 #include "update_engine/common/clock_interface.h"
 #include "update_engine/common/connection_utils.h"
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/http_fetcher.h"
 #include "update_engine/common/metrics_constants.h"
 #include "update_engine/common/metrics_reporter_interface.h"
 #include "update_engine/common/prefs_interface.h"
@@ -85,6 +87,17 @@ bool LoadAndReportTimeToReboot(MetricsReporterInterface* metrics_reporter,
                                PrefsInterface* prefs,
                                ClockInterface* clock);
 
+// Logs the |count| requests of |timings| which received data at the lowest
+// throughput, slowest first.
+void LogSlowestTransfers(const std::vector<HttpTransferTiming>& timings,
+                         size_t count);
+
+// Reports the mean phase durations of |timings| and the median, 95th
+// percentile and slowest throughput of the requests that received data to
+// |metrics_reporter|. Nothing is reported without timings.
+void ReportTransferTimings(MetricsReporterInterface* metrics_reporter,
+                           const std::vector<HttpTransferTiming>& timings);
+
 template <typename T>
 class PersistedValue {
  public:
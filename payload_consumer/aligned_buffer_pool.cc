@@ -0,0 +1,229 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+size_t RoundUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// Maps |size| bytes of zeroed memory, with huge pages if |huge_pages| and the
+// size allows. Returns an empty region on failure.
+iovec MapRegion(size_t size, bool huge_pages) {
+  huge_pages = huge_pages && size >= AlignedBufferPool::kHugePageSize;
+  if (huge_pages) {
+    const size_t huge_size = RoundUp(size, AlignedBufferPool::kHugePageSize);
+    void* data = mmap(nullptr,
+                      huge_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                      -1,
+                      0);
+    if (data != MAP_FAILED) {
+      return {data, huge_size};
+    }
+    // Without reserved huge pages, let the kernel use transparent ones.
+    size = huge_size;
+  }
+  size = RoundUp(size, AlignedBufferPool::kAlignment);
+  void* data = mmap(nullptr,
+                    size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+  if (data == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map a buffer of " << size << " bytes";
+    return {};
+  }
+  if (huge_pages && madvise(data, size, MADV_HUGEPAGE) != 0) {
+    PLOG(WARNING) << "Transparent huge pages aren't available";
+  }
+  return {data, size};
+}
+
+bool SizeLess(const iovec& a, const iovec& b) {
+  return a.iov_len < b.iov_len;
+}
+
+}  // namespace
+
+AlignedBufferPool::Buffer::Buffer(AlignedBufferPool* pool,
+                                  iovec region,
+                                  size_t size)
+    : pool_(pool),
+      region_(region),
+      data_(static_cast<uint8_t*>(region.iov_base)),
+      size_(size) {}
+
+AlignedBufferPool::Buffer::Buffer(Buffer&& other) {
+  *this = std::move(other);
+}
+
+AlignedBufferPool::Buffer& AlignedBufferPool::Buffer::operator=(
+    Buffer&& other) {
+  if (this != &other) {
+    Reset();
+    pool_ = other.pool_;
+    region_ = other.region_;
+    data_ = other.data_;
+    size_ = other.size_;
+    other.pool_ = nullptr;
+    other.region_ = {};
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+AlignedBufferPool::Buffer::~Buffer() {
+  Reset();
+}
+
+void AlignedBufferPool::Buffer::Reset() {
+  if (pool_ != nullptr) {
+    pool_->Release(region_);
+  }
+  pool_ = nullptr;
+  region_ = {};
+  data_ = nullptr;
+  size_ = 0;
+}
+
+AlignedBufferPool* AlignedBufferPool::GetInstance() {
+  static AlignedBufferPool instance;
+  return &instance;
+}
+
+AlignedBufferPool::~AlignedBufferPool() {
+  // Borrowed buffers must not outlive the pool.
+  CHECK_EQ(regions_.size(), free_regions_.size());
+  for (const auto& region : free_regions_) {
+    munmap(region.iov_base, region.iov_len);
+  }
+}
+
+void AlignedBufferPool::set_huge_pages(bool huge_pages) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  huge_pages_ = huge_pages;
+}
+
+AlignedBufferPool::Buffer AlignedBufferPool::Acquire(size_t size) {
+  if (size == 0) {
+    return {};
+  }
+  bool huge_pages;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Take the smallest buffer that fits.
+    auto it = std::find_if(
+        free_regions_.begin(),
+        free_regions_.end(),
+        [size](const iovec& region) { return region.iov_len >= size; });
+    if (it != free_regions_.end()) {
+      const iovec region = *it;
+      pooled_bytes_ -= region.iov_len;
+      free_regions_.erase(it);
+      return Buffer(this, region, size);
+    }
+    huge_pages = huge_pages_;
+  }
+  const iovec region = MapRegion(size, huge_pages);
+  if (region.iov_base == nullptr) {
+    return {};
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  regions_.push_back(region);
+  generation_++;
+  return Buffer(this, region, size);
+}
+
+std::vector<iovec> AlignedBufferPool::Regions(uint64_t* generation) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (generation != nullptr) {
+    *generation = generation_;
+  }
+  return regions_;
+}
+
+uint64_t AlignedBufferPool::generation() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return generation_;
+}
+
+size_t AlignedBufferPool::pooled_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pooled_bytes_;
+}
+
+void AlignedBufferPool::Trim() {
+  std::vector<iovec> unmapped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    unmapped = DropRegions(0);
+  }
+  for (const auto& region : unmapped) {
+    munmap(region.iov_base, region.iov_len);
+  }
+}
+
+void AlignedBufferPool::Release(iovec region) {
+  std::vector<iovec> unmapped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_regions_.insert(std::upper_bound(free_regions_.begin(),
+                                          free_regions_.end(),
+                                          region,
+                                          SizeLess),
+                         region);
+    pooled_bytes_ += region.iov_len;
+    unmapped = DropRegions(max_pooled_bytes_);
+  }
+  for (const auto& dropped : unmapped) {
+    munmap(dropped.iov_base, dropped.iov_len);
+  }
+}
+
+std::vector<iovec> AlignedBufferPool::DropRegions(size_t max_bytes) {
+  // Drop the smallest buffers first, so the pool converges to the sizes the
+  // largest users need.
+  std::vector<iovec> dropped;
+  while (pooled_bytes_ > max_bytes && !free_regions_.empty()) {
+    const iovec region = free_regions_.front();
+    free_regions_.erase(free_regions_.begin());
+    pooled_bytes_ -= region.iov_len;
+    regions_.erase(std::find_if(
+        regions_.begin(), regions_.end(), [&region](const iovec& r) {
+          return r.iov_base == region.iov_base;
+        }));
+    dropped.push_back(region);
+    generation_++;
+  }
+  return dropped;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ALIGNED_BUFFER_POOL_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ALIGNED_BUFFER_POOL_H_
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// Hands out I/O buffers mapped directly from the kernel, so they are aligned
+// for O_DIRECT and stay at the same addresses, which io_uring needs to
+// register them. Buffers of at least kHugePageSize can be backed by huge
+// pages, from the hugetlb pool if there is one and otherwise transparently,
+// to cut the TLB misses of the large sequential reads and copies.
+//
+// Released buffers are kept for reuse as long as all kept buffers add up to
+// |max_pooled_bytes|; the smallest ones are dropped first. Safe to use from
+// multiple threads.
+class AlignedBufferPool {
+ public:
+  static constexpr size_t kAlignment = 4096;
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;           // 2 MiB
+  static constexpr size_t kDefaultMaxPooledBytes = 64 * 1024 * 1024;  // 64 MiB
+
+  // A buffer borrowed from a pool, handed back to it on destruction.
+  class Buffer {
+   public:
+    Buffer() = default;
+    Buffer(Buffer&& other);
+    Buffer& operator=(Buffer&& other);
+    ~Buffer();
+
+    uint8_t* data() { return data_; }
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    uint8_t* begin() { return data_; }
+    uint8_t* end() { return data_ + size_; }
+    uint8_t& operator[](size_t i) { return data_[i]; }
+
+   private:
+    friend class AlignedBufferPool;
+    Buffer(AlignedBufferPool* pool, iovec region, size_t size);
+    void Reset();
+
+    AlignedBufferPool* pool_{nullptr};
+    // The whole mapping, which may be larger than |size_|.
+    iovec region_{};
+    uint8_t* data_{nullptr};
+    size_t size_{0};
+
+    DISALLOW_COPY_AND_ASSIGN(Buffer);
+  };
+
+  // The pool shared by the payload consumer.
+  static AlignedBufferPool* GetInstance();
+
+  explicit AlignedBufferPool(size_t max_pooled_bytes = kDefaultMaxPooledBytes)
+      : max_pooled_bytes_(max_pooled_bytes) {}
+  ~AlignedBufferPool();
+
+  // Whether to back the buffers of at least kHugePageSize with huge pages.
+  void set_huge_pages(bool huge_pages);
+
+  // Returns a buffer of |size| bytes, or an empty buffer if the memory can't
+  // be mapped. The contents of reused buffers are unspecified.
+  Buffer Acquire(size_t size);
+
+  // The mappings of all buffers alive right now, either borrowed or kept for
+  // reuse, e.g. to register them with IoUringInterface::RegisterBuffers(). If
+  // |generation| isn't null, it is set to the generation() they belong to.
+  std::vector<iovec> Regions(uint64_t* generation = nullptr) const;
+
+  // Changes whenever a mapping is added or removed, so that the users of
+  // Regions() know when to get them again.
+  uint64_t generation() const;
+
+  // Total size of the buffers currently kept for reuse.
+  size_t pooled_bytes() const;
+
+  // Unmaps the buffers kept for reuse, e.g. once the update is over.
+  void Trim();
+
+ private:
+  void Release(iovec region);
+
+  // Drops the smallest kept buffers until they add up to |max_bytes|, and
+  // returns them to be unmapped once |mutex_| is released.
+  std::vector<iovec> DropRegions(size_t max_bytes);
+
+  const size_t max_pooled_bytes_;
+
+  mutable std::mutex mutex_;
+  bool huge_pages_{false};
+  // Mappings not borrowed by anyone, in ascending order of size.
+  std::vector<iovec> free_regions_;
+  size_t pooled_bytes_{0};
+  // All the mappings of the pool.
+  std::vector<iovec> regions_;
+  uint64_t generation_{1};
+
+  DISALLOW_COPY_AND_ASSIGN(AlignedBufferPool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ALIGNED_BUFFER_POOL_H_
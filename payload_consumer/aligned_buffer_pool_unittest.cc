@@ -0,0 +1,114 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+
+#include <utility>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(AlignedBufferPoolTest, BuffersAreAligned) {
+  AlignedBufferPool pool;
+  auto buffer = pool.Acquire(100);
+  ASSERT_EQ(100u, buffer.size());
+  ASSERT_EQ(0u,
+            reinterpret_cast<uintptr_t>(buffer.data()) %
+                AlignedBufferPool::kAlignment);
+}
+
+TEST(AlignedBufferPoolTest, ReusesReleasedBuffers) {
+  AlignedBufferPool pool;
+  const uint8_t* data = nullptr;
+  {
+    auto buffer = pool.Acquire(8192);
+    data = buffer.data();
+  }
+  ASSERT_EQ(8192u, pool.pooled_bytes());
+  auto buffer = pool.Acquire(4096);
+  ASSERT_EQ(4096u, buffer.size());
+  ASSERT_EQ(data, buffer.data());
+  ASSERT_EQ(0u, pool.pooled_bytes());
+}
+
+TEST(AlignedBufferPoolTest, DropsBuffersOverLimit) {
+  AlignedBufferPool pool(8192);
+  {
+    auto first = pool.Acquire(4096);
+    auto second = pool.Acquire(8192);
+  }
+  ASSERT_EQ(8192u, pool.pooled_bytes());
+  ASSERT_EQ(1u, pool.Regions().size());
+}
+
+TEST(AlignedBufferPoolTest, TrimUnmapsKeptBuffers) {
+  AlignedBufferPool pool;
+  auto borrowed = pool.Acquire(4096);
+  { auto released = pool.Acquire(4096); }
+  ASSERT_EQ(2u, pool.Regions().size());
+  pool.Trim();
+  ASSERT_EQ(0u, pool.pooled_bytes());
+  auto regions = pool.Regions();
+  ASSERT_EQ(1u, regions.size());
+  ASSERT_EQ(borrowed.data(), regions[0].iov_base);
+}
+
+TEST(AlignedBufferPoolTest, GenerationChangesWithRegions) {
+  AlignedBufferPool pool;
+  auto buffer = pool.Acquire(4096);
+  uint64_t generation = 0;
+  ASSERT_EQ(1u, pool.Regions(&generation).size());
+  ASSERT_EQ(pool.generation(), generation);
+  // Reusing a kept buffer doesn't change the mappings.
+  buffer = AlignedBufferPool::Buffer();
+  buffer = pool.Acquire(4096);
+  ASSERT_EQ(generation, pool.generation());
+  // Neither does trimming when no buffer is kept.
+  pool.Trim();
+  ASSERT_EQ(generation, pool.generation());
+
+  auto other = pool.Acquire(4096);
+  ASSERT_NE(generation, pool.generation());
+  generation = pool.generation();
+  other = AlignedBufferPool::Buffer();
+  pool.Trim();
+  ASSERT_NE(generation, pool.generation());
+}
+
+TEST(AlignedBufferPoolTest, HugePageBuffers) {
+  AlignedBufferPool pool;
+  pool.set_huge_pages(true);
+  auto buffer = pool.Acquire(AlignedBufferPool::kHugePageSize + 1);
+  ASSERT_NE(nullptr, buffer.data());
+  auto regions = pool.Regions();
+  ASSERT_EQ(1u, regions.size());
+  ASSERT_EQ(2 * AlignedBufferPool::kHugePageSize, regions[0].iov_len);
+  buffer[buffer.size() - 1] = 1;
+}
+
+TEST(AlignedBufferPoolTest, MovedBufferIsReleasedOnce) {
+  AlignedBufferPool pool;
+  {
+    auto buffer = pool.Acquire(100);
+    AlignedBufferPool::Buffer moved(std::move(buffer));
+    ASSERT_EQ(100u, moved.size());
+    ASSERT_EQ(nullptr, buffer.data());
+  }
+  ASSERT_EQ(AlignedBufferPool::kAlignment, pool.pooled_bytes());
+}
+
+}  // namespace chromeos_update_engine
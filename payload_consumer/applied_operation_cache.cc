@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/applied_operation_cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kHashSize = 32;  // SHA-256
+// A record is the key followed by the destination hash.
+constexpr size_t kRecordSize = 2 * kHashSize;
+}  // namespace
+
+AppliedOperationCache::~AppliedOperationCache() {
+  if (fd_ >= 0) {
+    IGNORE_EINTR(close(fd_));
+  }
+}
+
+std::string AppliedOperationCache::Key(const std::string& partition_name,
+                                       const InstallOperation& operation) {
+  std::string data = partition_name;
+  data.push_back('\0');
+  data += operation.SerializeAsString();
+  brillo::Blob key;
+  if (!HashCalculator::RawHashOfBytes(data.data(), data.size(), &key)) {
+    return {};
+  }
+  return std::string(key.begin(), key.end());
+}
+
+bool AppliedOperationCache::Open(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  TEST_AND_RETURN_FALSE(fd_ < 0);
+  fd_ = HANDLE_EINTR(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+  TEST_AND_RETURN_FALSE_ERRNO(fd_ >= 0);
+
+  struct stat st {};
+  if (fstat(fd_, &st) != 0 || st.st_size <= 0) {
+    return true;
+  }
+  // A record cut short by an interruption is dropped, the next one is written
+  // in its place.
+  brillo::Blob data(std::min<uint64_t>(st.st_size, kMaxSize));
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(fd_, data.data(), data.size(), 0, &bytes_read)) {
+    PLOG(WARNING) << "Unable to read the applied operation cache";
+    return ClearLocked();
+  }
+  write_offset_ = bytes_read - bytes_read % kRecordSize;
+  for (uint64_t offset = 0; offset < write_offset_; offset += kRecordSize) {
+    const char* record = reinterpret_cast<const char*>(data.data() + offset);
+    entries_[std::string(record, kHashSize)] =
+        std::string(record + kHashSize, kHashSize);
+  }
+  LOG(INFO) << "Loaded " << entries_.size() << " applied operations.";
+  return true;
+}
+
+bool AppliedOperationCache::Lookup(const std::string& partition_name,
+                                   const InstallOperation& operation,
+                                   brillo::Blob* dst_hash) const {
+  const std::string key = Key(partition_name, operation);
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(key);
+  if (key.empty() || it == entries_.end()) {
+    return false;
+  }
+  dst_hash->assign(it->second.begin(), it->second.end());
+  return true;
+}
+
+bool AppliedOperationCache::Record(const std::string& partition_name,
+                                   const InstallOperation& operation,
+                                   const brillo::Blob& dst_hash) {
+  TEST_AND_RETURN_FALSE(dst_hash.size() == kHashSize);
+  const std::string key = Key(partition_name, operation);
+  TEST_AND_RETURN_FALSE(!key.empty());
+  std::string record = key;
+  record.append(dst_hash.begin(), dst_hash.end());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  TEST_AND_RETURN_FALSE(fd_ >= 0);
+  if (write_offset_ + kRecordSize > kMaxSize) {
+    TEST_AND_RETURN_FALSE(ClearLocked());
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(
+      utils::PWriteAll(fd_, record.data(), record.size(), write_offset_));
+  write_offset_ += kRecordSize;
+  entries_[key] = record.substr(kHashSize);
+  return true;
+}
+
+bool AppliedOperationCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return ClearLocked();
+}
+
+bool AppliedOperationCache::ClearLocked() {
+  entries_.clear();
+  write_offset_ = 0;
+  TEST_AND_RETURN_FALSE(fd_ >= 0);
+  TEST_AND_RETURN_FALSE_ERRNO(HANDLE_EINTR(ftruncate(fd_, 0)) == 0);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,88 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_APPLIED_OPERATION_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_APPLIED_OPERATION_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Remembers the SHA-256 of what install operations wrote to their destination
+// extents, so that when an update is restarted from scratch the operations
+// whose destination still holds that data can be skipped. An operation is
+// identified by its partition and its serialized InstallOperation, which
+// covers its position in the payload and its data hash.
+//
+// Entries are only hints: callers hash the destination before trusting one,
+// so records which are stale, lost or torn by an interruption merely cost
+// applying the operation again. Records are therefore appended without
+// syncing, and the file starts over once it would grow past kMaxSize.
+class AppliedOperationCache {
+ public:
+  static constexpr size_t kMaxSize = 16 * 1024 * 1024;  // 16 MiB
+
+  AppliedOperationCache() = default;
+  ~AppliedOperationCache();
+
+  // Opens or creates the cache at |path| and loads its records.
+  bool Open(const std::string& path);
+  bool IsOpen() const { return fd_ >= 0; }
+
+  // Returns whether a record of |operation| of |partition_name| exists, and
+  // the hash of the destination it wrote in |dst_hash|.
+  bool Lookup(const std::string& partition_name,
+              const InstallOperation& operation,
+              brillo::Blob* dst_hash) const;
+
+  // Records that |operation| of |partition_name| wrote data hashing to
+  // |dst_hash|. May be called from several threads at once.
+  bool Record(const std::string& partition_name,
+              const InstallOperation& operation,
+              const brillo::Blob& dst_hash);
+
+  // Drops all records.
+  bool Clear();
+
+ private:
+  static std::string Key(const std::string& partition_name,
+                         const InstallOperation& operation);
+
+  // Truncates the file. Must be called with |mutex_| held.
+  bool ClearLocked();
+
+  mutable std::mutex mutex_;
+  int fd_{-1};
+  // Offset the next record is written at.
+  uint64_t write_offset_{0};
+  // Destination hashes by key.
+  std::unordered_map<std::string, std::string> entries_;
+
+  DISALLOW_COPY_AND_ASSIGN(AppliedOperationCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_APPLIED_OPERATION_CACHE_H_
@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/applied_operation_cache.h"
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+InstallOperation MakeOperation(uint64_t start_block) {
+  InstallOperation op;
+  op.set_type(InstallOperation::REPLACE);
+  op.set_data_offset(start_block * 100);
+  op.set_data_length(100);
+  *op.add_dst_extents() = ExtentForRange(start_block, 1);
+  return op;
+}
+
+brillo::Blob MakeHash(uint8_t value) {
+  return brillo::Blob(32, value);
+}
+}  // namespace
+
+class AppliedOperationCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ASSERT_TRUE(cache_.Open(file_.path())); }
+
+  ScopedTempFile file_{"applied_operations.XXXXXX"};
+  AppliedOperationCache cache_;
+};
+
+TEST_F(AppliedOperationCacheTest, LooksUpRecordedOperations) {
+  brillo::Blob hash;
+  ASSERT_FALSE(cache_.Lookup("system", MakeOperation(1), &hash));
+  ASSERT_TRUE(cache_.Record("system", MakeOperation(1), MakeHash(1)));
+  ASSERT_TRUE(cache_.Lookup("system", MakeOperation(1), &hash));
+  ASSERT_EQ(MakeHash(1), hash);
+  // The same operation of another partition is a different operation.
+  ASSERT_FALSE(cache_.Lookup("vendor", MakeOperation(1), &hash));
+  ASSERT_FALSE(cache_.Lookup("system", MakeOperation(2), &hash));
+  // Hashes other than SHA-256 are rejected.
+  ASSERT_FALSE(cache_.Record("system", MakeOperation(2), brillo::Blob(4)));
+}
+
+TEST_F(AppliedOperationCacheTest, SurvivesReopen) {
+  ASSERT_TRUE(cache_.Record("system", MakeOperation(1), MakeHash(1)));
+  ASSERT_TRUE(cache_.Record("system", MakeOperation(1), MakeHash(2)));
+  AppliedOperationCache reopened;
+  ASSERT_TRUE(reopened.Open(file_.path()));
+  brillo::Blob hash;
+  ASSERT_TRUE(reopened.Lookup("system", MakeOperation(1), &hash));
+  // The latest record wins.
+  ASSERT_EQ(MakeHash(2), hash);
+}
+
+TEST_F(AppliedOperationCacheTest, IgnoresTornRecord) {
+  ASSERT_TRUE(cache_.Record("system", MakeOperation(1), MakeHash(1)));
+  ASSERT_TRUE(cache_.Record("system", MakeOperation(2), MakeHash(2)));
+  const off_t size = utils::FileSize(file_.path());
+  ASSERT_EQ(0, truncate(file_.path().c_str(), size - 5));
+
+  AppliedOperationCache reopened;
+  ASSERT_TRUE(reopened.Open(file_.path()));
+  brillo::Blob hash;
+  ASSERT_TRUE(reopened.Lookup("system", MakeOperation(1), &hash));
+  ASSERT_FALSE(reopened.Lookup("system", MakeOperation(2), &hash));
+  // The next record replaces the torn one.
+  ASSERT_TRUE(reopened.Record("system", MakeOperation(3), MakeHash(3)));
+  ASSERT_EQ(size, utils::FileSize(file_.path()));
+}
+
+TEST_F(AppliedOperationCacheTest, Clear) {
+  ASSERT_TRUE(cache_.Record("system", MakeOperation(1), MakeHash(1)));
+  ASSERT_TRUE(cache_.Clear());
+  brillo::Blob hash;
+  ASSERT_FALSE(cache_.Lookup("system", MakeOperation(1), &hash));
+  ASSERT_EQ(0, utils::FileSize(file_.path()));
+}
+
+}  // namespace chromeos_update_engine
@@ -20,7 +20,9 @@
 
 #include <algorithm>
 
+#include "update_engine/common/tracing.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/operation_timings.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
@@ -110,6 +112,8 @@ bool BlockExtentWriter::Write(const void* bytes, size_t count) {
     return true;
   }
 
+  OperationTimings::ScopedPhase phase(OperationTimings::Phase::kWrite);
+  TRACE_SCOPE("BlockExtentWriter write");
   auto data = static_cast<const uint8_t*>(bytes);
   while (count > 0) {
     const auto bytes_written = ConsumeWithBuffer(data, count);
@@ -31,10 +31,16 @@
 
 namespace chromeos_update_engine {
 
-class BzipExtentWriter : public ExtentWriter {
+class BzipExtentWriter final : public ExtentWriter {
  public:
-  explicit BzipExtentWriter(std::unique_ptr<ExtentWriter> next)
-      : next_(std::move(next)) {
+  static constexpr size_t kDefaultOutputBufferSize = 16 * 1024;
+
+  // Decompressed data is passed to |next| in chunks of up to
+  // |output_buffer_size| bytes.
+  explicit BzipExtentWriter(
+      std::unique_ptr<ExtentWriter> next,
+      size_t output_buffer_size = kDefaultOutputBufferSize)
+      : next_(std::move(next)), output_buffer_size_(output_buffer_size) {
     memset(&stream_, 0, sizeof(stream_));
   }
   ~BzipExtentWriter() override;
@@ -47,6 +53,9 @@ class BzipExtentWriter : public ExtentWriter {
   std::unique_ptr<ExtentWriter> next_;  // The underlying ExtentWriter.
   bz_stream stream_{};                  // the libbz2 stream
   brillo::Blob input_buffer_;
+  // Allocated once in Init() and reused by every Write().
+  const size_t output_buffer_size_;
+  brillo::Blob output_buffer_;
 };
 
 }  // namespace chromeos_update_engine
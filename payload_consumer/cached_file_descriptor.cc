@@ -16,9 +16,12 @@
 
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
 
+#include <string.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <iterator>
+#include <utility>
 
 #include <base/logging.h>
 
@@ -99,4 +102,109 @@ bool CachedFileDescriptorBase::FlushCache() {
 void UnownedCachedFileDescriptor::SetFD(FileDescriptor* fd) {
   fd_ = fd;
 }
+
+ssize_t WriteBackFileDescriptor::Read(void* buf, size_t count) {
+  if (!FlushCache() || fd_->Seek(offset_, SEEK_SET) != offset_) {
+    return -1;
+  }
+  const ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0) {
+    offset_ += bytes_read;
+  }
+  return bytes_read;
+}
+
+ssize_t WriteBackFileDescriptor::Write(const void* buf, size_t count) {
+  if (count == 0) {
+    return 0;
+  }
+  const auto bytes = static_cast<const uint8_t*>(buf);
+  uint64_t begin = offset_;
+  uint64_t end = offset_ + count;
+  // The first range ending at or after |begin|, then all the ones starting
+  // before |end| are merged with the new data.
+  auto first = ranges_.upper_bound(begin);
+  if (first != ranges_.begin()) {
+    auto previous = std::prev(first);
+    if (previous->first + previous->second.size() >= begin) {
+      first = previous;
+    }
+  }
+  auto last = first;
+  while (last != ranges_.end() && last->first <= end) {
+    end = std::max<uint64_t>(end, last->first + last->second.size());
+    ++last;
+  }
+  brillo::Blob data;
+  if (first != last && first->first <= begin) {
+    // Extend the first range in place, which is the common case of sequential
+    // writes.
+    begin = first->first;
+    data = std::move(first->second);
+    cached_size_ -= data.size();
+    ++first;
+  }
+  data.resize(end - begin);
+  for (auto it = first; it != last; ++it) {
+    memcpy(data.data() + (it->first - begin),
+           it->second.data(),
+           it->second.size());
+    cached_size_ -= it->second.size();
+  }
+  memcpy(data.data() + (offset_ - begin), bytes, count);
+  cached_size_ += data.size();
+  // Erase the ranges merged, including the one moved from.
+  auto erase_begin = ranges_.lower_bound(begin);
+  ranges_.erase(erase_begin, last);
+  ranges_.emplace(begin, std::move(data));
+  offset_ += count;
+
+  if (cached_size_ >= budget_ && !FlushCache()) {
+    return -1;
+  }
+  return count;
+}
+
+off64_t WriteBackFileDescriptor::Seek(off64_t offset, int whence) {
+  // Like CachedFileDescriptorBase::Seek(), SEEK_END isn't supported.
+  CHECK(whence == SEEK_SET || whence == SEEK_CUR);
+  offset_ = whence == SEEK_SET ? offset : offset_ + offset;
+  return offset_;
+}
+
+bool WriteBackFileDescriptor::BlkIoctl(int request,
+                                       uint64_t start,
+                                       uint64_t length,
+                                       int* result) {
+  // The cached data would overwrite the result later.
+  return FlushCache() && fd_->BlkIoctl(request, start, length, result);
+}
+
+bool WriteBackFileDescriptor::Flush() {
+  return FlushCache() && fd_->Flush();
+}
+
+bool WriteBackFileDescriptor::Close() {
+  offset_ = 0;
+  return FlushCache() && fd_->Close();
+}
+
+bool WriteBackFileDescriptor::FlushCache() {
+  if (ranges_.empty()) {
+    return true;
+  }
+  std::vector<IoRequest> requests;
+  requests.reserve(ranges_.size());
+  for (auto& [offset, data] : ranges_) {
+    requests.push_back({data.data(), data.size(), offset});
+  }
+  if (!fd_->WriteAt(requests)) {
+    PLOG(ERROR) << "Failed to flush " << ranges_.size() << " cached ranges!";
+    return false;
+  }
+  ranges_.clear();
+  cached_size_ = 0;
+  return true;
+}
+
 }  // namespace chromeos_update_engine
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <sys/types.h>
 
+#include <map>
 #include <memory>
 #include <vector>
 
@@ -93,6 +94,56 @@ class UnownedCachedFileDescriptor final : public CachedFileDescriptorBase {
   FileDescriptor* fd_;
 };
 
+// Caches the writes to |fd| wherever they go, unlike CachedFileDescriptor
+// which only caches sequential writes and flushes whenever it seeks elsewhere.
+// The written ranges are kept merged with the adjacent and overlapping ones,
+// and written out in increasing offset order with a single WriteAt() once they
+// add up to |budget| bytes, or on Flush() and Close(). Reads and ioctls, which
+// may depend on the cached data, write it out first.
+class WriteBackFileDescriptor final : public FileDescriptor {
+ public:
+  WriteBackFileDescriptor(FileDescriptorPtr fd, size_t budget)
+      : fd_(fd), budget_(budget) {}
+  ~WriteBackFileDescriptor() override = default;
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    offset_ = 0;
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    offset_ = 0;
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override;
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+  // The number of bytes cached.
+  size_t cached_size() const { return cached_size_; }
+
+ private:
+  // Writes out the cached ranges without calling |fd_->Flush()|.
+  bool FlushCache();
+
+  FileDescriptorPtr fd_;
+  const size_t budget_;
+  // The data to write at every offset. The ranges never overlap nor touch.
+  std::map<uint64_t, brillo::Blob> ranges_;
+  size_t cached_size_{0};
+  off64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(WriteBackFileDescriptor);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_CACHED_FILE_DESCRIPTOR_H_
@@ -201,4 +201,108 @@ TEST_F(CachedFileDescriptorTest, SeekAfterWriteTest) {
   EXPECT_EQ(blob_in, blob_out);
 }
 
+class WriteBackFileDescriptorTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    brillo::Blob zero_blob(kFileSize, 0);
+    EXPECT_TRUE(utils::WriteFile(
+        temp_file_.path().c_str(), zero_blob.data(), zero_blob.size()));
+    EXPECT_TRUE(wbfd_.Open(temp_file_.path().c_str(), O_RDWR, 0600));
+  }
+
+  void TearDown() override {
+    EXPECT_TRUE(wbfd_.Close());
+    EXPECT_FALSE(wbfd_.IsOpen());
+  }
+
+  void WriteAt(off64_t offset, const brillo::Blob& blob) {
+    EXPECT_EQ(wbfd_.Seek(offset, SEEK_SET), offset);
+    EXPECT_EQ(wbfd_.Write(blob.data(), blob.size()),
+              static_cast<ssize_t>(blob.size()));
+  }
+
+  brillo::Blob ReadFile() {
+    brillo::Blob blob_out;
+    EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+    return blob_out;
+  }
+
+ protected:
+  ScopedTempFile temp_file_{"WriteBackFileDescriptor-file.XXXXXX"};
+  WriteBackFileDescriptor wbfd_{FileDescriptorPtr(new EintrSafeFileDescriptor),
+                                kCacheSize};
+};
+
+TEST_F(WriteBackFileDescriptorTest, SeekDoesNotFlushTest) {
+  WriteAt(500, brillo::Blob(10, 1));
+  WriteAt(100, brillo::Blob(10, 2));
+  WriteAt(300, brillo::Blob(10, 3));
+  EXPECT_EQ(wbfd_.cached_size(), 30u);
+  EXPECT_EQ(ReadFile(), brillo::Blob(kFileSize, 0));
+
+  EXPECT_TRUE(wbfd_.Flush());
+  EXPECT_EQ(wbfd_.cached_size(), 0u);
+  brillo::Blob expected(kFileSize, 0);
+  std::fill_n(&expected[500], 10, 1);
+  std::fill_n(&expected[100], 10, 2);
+  std::fill_n(&expected[300], 10, 3);
+  EXPECT_EQ(ReadFile(), expected);
+}
+
+TEST_F(WriteBackFileDescriptorTest, MergeRangesTest) {
+  brillo::Blob expected(kFileSize, 0);
+  // Adjacent, overlapping and covering writes, with the last one winning.
+  WriteAt(20, brillo::Blob(10, 1));
+  WriteAt(30, brillo::Blob(10, 2));
+  WriteAt(10, brillo::Blob(15, 3));
+  WriteAt(50, brillo::Blob(5, 4));
+  WriteAt(35, brillo::Blob(20, 5));
+  std::fill_n(&expected[10], 15, 3);
+  std::fill_n(&expected[25], 5, 1);
+  std::fill_n(&expected[30], 5, 2);
+  std::fill_n(&expected[35], 20, 5);
+  EXPECT_EQ(wbfd_.cached_size(), 45u);
+
+  EXPECT_TRUE(wbfd_.Flush());
+  EXPECT_EQ(ReadFile(), expected);
+}
+
+TEST_F(WriteBackFileDescriptorTest, BudgetFlushTest) {
+  WriteAt(600, brillo::Blob(kCacheSize / 2, 1));
+  EXPECT_EQ(ReadFile(), brillo::Blob(kFileSize, 0));
+  WriteAt(0, brillo::Blob(kCacheSize / 2, 2));
+  // The budget is reached, so both ranges got written.
+  EXPECT_EQ(wbfd_.cached_size(), 0u);
+  brillo::Blob expected(kFileSize, 0);
+  std::fill_n(&expected[600], kCacheSize / 2, 1);
+  std::fill_n(&expected[0], kCacheSize / 2, 2);
+  EXPECT_EQ(ReadFile(), expected);
+}
+
+TEST_F(WriteBackFileDescriptorTest, ReadCachedDataTest) {
+  WriteAt(200, brillo::Blob(10, 1));
+  WriteAt(0, brillo::Blob(10, 2));
+  brillo::Blob blob_out(20);
+  EXPECT_EQ(wbfd_.Seek(195, SEEK_SET), 195);
+  EXPECT_EQ(wbfd_.Read(blob_out.data(), blob_out.size()), 20);
+  brillo::Blob expected(20, 0);
+  std::fill_n(&expected[5], 10, 1);
+  EXPECT_EQ(blob_out, expected);
+  EXPECT_EQ(wbfd_.Seek(0, SEEK_CUR), 215);
+}
+
+TEST_F(WriteBackFileDescriptorTest, RandomWriteTest) {
+  brillo::Blob expected(kFileSize, 0);
+  std::srand(0);
+  for (size_t i = 0; i < kRandomIterations; i++) {
+    size_t start = std::rand() % kFileSize;
+    size_t size = std::rand() % (kFileSize - start) % (kCacheSize / 2);
+    brillo::Blob blob(size, i % 256);
+    WriteAt(start, blob);
+    std::copy(blob.begin(), blob.end(), &expected[start]);
+  }
+  EXPECT_TRUE(wbfd_.Flush());
+  EXPECT_EQ(ReadFile(), expected);
+}
+
 }  // namespace chromeos_update_engine
@@ -58,4 +58,22 @@ TEST(CertificateParserAndroidTest, VerifySignature) {
   ASSERT_TRUE(verifier->VerifyRawSignature(sig_blob, hash_blob, nullptr));
 }
 
+TEST(CertificateParserAndroidTest, CachesKeysUntilFileChanges) {
+  brillo::Blob certs;
+  ASSERT_TRUE(utils::ReadFile(
+      test_utils::GetBuildArtifactsPath(kUnittestOtacertsPath), &certs));
+  ScopedTempFile zip_file("otacerts.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(zip_file.path(), certs));
+  // The second verifier comes from the cache.
+  for (int i = 0; i < 2; i++) {
+    ASSERT_NE(nullptr,
+              PayloadVerifier::CreateInstanceFromZipPath(zip_file.path()));
+  }
+
+  // A different file is parsed again.
+  ASSERT_TRUE(test_utils::WriteFileString(zip_file.path(), "not a zip"));
+  ASSERT_EQ(nullptr,
+            PayloadVerifier::CreateInstanceFromZipPath(zip_file.path()));
+}
+
 }  // namespace chromeos_update_engine
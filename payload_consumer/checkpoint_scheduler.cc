@@ -0,0 +1,53 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "update_engine/payload_consumer/checkpoint_scheduler.h"
+
+#include <algorithm>
+
+namespace chromeos_update_engine {
+
+namespace {
+// Weight of the latest checkpoint in the moving average, in 1/kWeightScale.
+constexpr int64_t kLatestWeight = 1;
+constexpr int64_t kWeightScale = 4;
+}  // namespace
+
+bool CheckpointScheduler::ShouldCheckpoint(base::TimeTicks now) {
+  if (now > next_checkpoint_time_) {
+    next_checkpoint_time_ = now + interval_;
+    return true;
+  }
+  return false;
+}
+
+void CheckpointScheduler::RecordCheckpoint(base::TimeDelta duration) {
+  if (num_checkpoints_ == 0) {
+    average_duration_ = duration;
+  } else {
+    average_duration_ = (average_duration_ * (kWeightScale - kLatestWeight) +
+                         duration * kLatestWeight) /
+                        kWeightScale;
+  }
+  num_checkpoints_++;
+  total_duration_ += duration;
+  max_duration_ = std::max(max_duration_, duration);
+
+  interval_ = std::clamp(average_duration_ * 100 / kMaxOverheadPercent,
+                         base::TimeDelta::FromMilliseconds(kMinIntervalMs),
+                         base::TimeDelta::FromMilliseconds(kMaxIntervalMs));
+}
+
+}  // namespace chromeos_update_engine
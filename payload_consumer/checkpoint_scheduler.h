@@ -0,0 +1,67 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_SCHEDULER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// Decides when DeltaPerformer writes its next checkpoint. The interval between
+// checkpoints follows the measured cost of writing one, so that checkpointing
+// takes about kMaxOverheadPercent of the time spent applying: cheap
+// checkpoints on fast storage are written more often, which shortens the work
+// redone after an interruption, expensive ones less often.
+class CheckpointScheduler {
+ public:
+  static constexpr int64_t kMinIntervalMs = 250;
+  static constexpr int64_t kMaxIntervalMs = 10 * 1000;
+  static constexpr int64_t kMaxOverheadPercent = 2;
+
+  // |initial_interval| is used until the first checkpoint was measured.
+  explicit CheckpointScheduler(base::TimeDelta initial_interval)
+      : interval_(initial_interval) {}
+
+  // Returns whether a checkpoint is due at |now|, in which case the next one
+  // is due one interval later. The first call always returns true.
+  bool ShouldCheckpoint(base::TimeTicks now);
+
+  // Records that writing a checkpoint took |duration| and adapts the interval
+  // to the average cost of recent checkpoints.
+  void RecordCheckpoint(base::TimeDelta duration);
+
+  base::TimeDelta interval() const { return interval_; }
+  size_t num_checkpoints() const { return num_checkpoints_; }
+  base::TimeDelta total_duration() const { return total_duration_; }
+  base::TimeDelta max_duration() const { return max_duration_; }
+
+ private:
+  base::TimeDelta interval_;
+  base::TimeTicks next_checkpoint_time_;
+
+  // Exponentially weighted moving average of the checkpoint durations.
+  base::TimeDelta average_duration_;
+  size_t num_checkpoints_{0};
+  base::TimeDelta total_duration_;
+  base::TimeDelta max_duration_;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_SCHEDULER_H_
@@ -0,0 +1,70 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "update_engine/payload_consumer/checkpoint_scheduler.h"
+
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+
+namespace chromeos_update_engine {
+
+class CheckpointSchedulerTest : public ::testing::Test {
+ protected:
+  CheckpointScheduler scheduler_{TimeDelta::FromSeconds(1)};
+};
+
+TEST_F(CheckpointSchedulerTest, FollowsInitialIntervalTest) {
+  base::TimeTicks now = base::TimeTicks::Now();
+  ASSERT_TRUE(scheduler_.ShouldCheckpoint(now));
+  ASSERT_FALSE(scheduler_.ShouldCheckpoint(now + TimeDelta::FromSeconds(1)));
+  ASSERT_TRUE(scheduler_.ShouldCheckpoint(
+      now + TimeDelta::FromMilliseconds(1001)));
+}
+
+TEST_F(CheckpointSchedulerTest, CheapCheckpointsAreFrequentTest) {
+  scheduler_.RecordCheckpoint(TimeDelta::FromMicroseconds(100));
+  ASSERT_EQ(
+      TimeDelta::FromMilliseconds(CheckpointScheduler::kMinIntervalMs),
+      scheduler_.interval());
+}
+
+TEST_F(CheckpointSchedulerTest, ExpensiveCheckpointsAreRareTest) {
+  // 80 ms checkpoints on slow eMMC are written every 4 seconds.
+  scheduler_.RecordCheckpoint(TimeDelta::FromMilliseconds(80));
+  ASSERT_EQ(TimeDelta::FromSeconds(4), scheduler_.interval());
+  scheduler_.RecordCheckpoint(TimeDelta::FromSeconds(1));
+  ASSERT_EQ(
+      TimeDelta::FromMilliseconds(CheckpointScheduler::kMaxIntervalMs),
+      scheduler_.interval());
+}
+
+TEST_F(CheckpointSchedulerTest, AveragesRecentCheckpointsTest) {
+  scheduler_.RecordCheckpoint(TimeDelta::FromMilliseconds(40));
+  // A single outlier moves the interval by a quarter of the difference.
+  scheduler_.RecordCheckpoint(TimeDelta::FromMilliseconds(120));
+  ASSERT_EQ(TimeDelta::FromSeconds(3), scheduler_.interval());
+}
+
+TEST_F(CheckpointSchedulerTest, TracksCostTest) {
+  scheduler_.RecordCheckpoint(TimeDelta::FromMilliseconds(10));
+  scheduler_.RecordCheckpoint(TimeDelta::FromMilliseconds(30));
+  scheduler_.RecordCheckpoint(TimeDelta::FromMilliseconds(20));
+  ASSERT_EQ(3u, scheduler_.num_checkpoints());
+  ASSERT_EQ(TimeDelta::FromMilliseconds(60), scheduler_.total_duration());
+  ASSERT_EQ(TimeDelta::FromMilliseconds(30), scheduler_.max_duration());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,85 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/cow_write_batcher.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+CowWriteBatcher::CowWriteBatcher(android::snapshot::ICowWriter* cow_writer,
+                                 size_t block_size,
+                                 size_t batch_size)
+    : cow_writer_(cow_writer),
+      block_size_(block_size),
+      batch_size_(std::max(batch_size, block_size)) {}
+
+bool CowWriteBatcher::AddRawBlocks(uint64_t new_block,
+                                   const void* data,
+                                   size_t size) {
+  TEST_AND_RETURN_FALSE(!failed_);
+  TEST_AND_RETURN_FALSE(size % block_size_ == 0);
+  if (size == 0) {
+    return true;
+  }
+  const bool contiguous =
+      new_block == buffer_start_block_ + buffer_.size() / block_size_;
+  if (!buffer_.empty() &&
+      (!contiguous || buffer_.size() + size > batch_size_)) {
+    TEST_AND_RETURN_FALSE(Flush());
+  }
+  // Writes which fill a whole batch on their own don't need to be copied.
+  if (buffer_.empty() && size >= batch_size_) {
+    if (!cow_writer_->AddRawBlocks(new_block, data, size)) {
+      LOG(ERROR) << "Failed to write " << size / block_size_
+                 << " raw blocks at " << new_block;
+      failed_ = true;
+      return false;
+    }
+    return true;
+  }
+  if (buffer_.empty()) {
+    buffer_.reserve(batch_size_);
+    memory_charge_.Set(buffer_.capacity());
+    buffer_start_block_ = new_block;
+  }
+  const auto bytes = static_cast<const uint8_t*>(data);
+  buffer_.insert(buffer_.end(), bytes, bytes + size);
+  return true;
+}
+
+bool CowWriteBatcher::Flush() {
+  TEST_AND_RETURN_FALSE(!failed_);
+  if (buffer_.empty()) {
+    return true;
+  }
+  if (!cow_writer_->AddRawBlocks(
+          buffer_start_block_, buffer_.data(), buffer_.size())) {
+    LOG(ERROR) << "Failed to write " << buffer_.size() / block_size_
+               << " raw blocks at " << buffer_start_block_;
+    failed_ = true;
+    return false;
+  }
+  // Keep the capacity around for the next batch.
+  buffer_.clear();
+  return true;
+}
+
+}  // namespace chromeos_update_engine
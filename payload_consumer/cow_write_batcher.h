@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_COW_WRITE_BATCHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_COW_WRITE_BATCHER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <base/macros.h>
+#include <libsnapshot/cow_writer.h>
+
+#include "update_engine/common/memory_accounting.h"
+
+namespace chromeos_update_engine {
+
+// Coalesces raw block writes to consecutive blocks, which operations usually
+// produce one extent (or one 1 MiB piece of it) at a time, into a single
+// ICowWriter::AddRawBlocks() call of up to |batch_size| bytes. The COW writer
+// compresses the blocks of a single call on all of its compression threads
+// and emits them in one sequential write, so large calls keep every thread
+// busy.
+//
+// Queued blocks are not part of the COW image until Flush() is called. Callers
+// must flush before adding any other kind of COW operation or a label, so the
+// order of operations in the image is preserved.
+class CowWriteBatcher {
+ public:
+  static constexpr size_t kDefaultBatchSize = 4 * 1024 * 1024;  // 4 MiB
+
+  CowWriteBatcher(android::snapshot::ICowWriter* cow_writer,
+                  size_t block_size,
+                  size_t batch_size);
+
+  // Queues |size| bytes of |data|, a whole number of blocks, to be written to
+  // the blocks starting at |new_block|. Returns false if this or an earlier
+  // write to the COW writer failed.
+  [[nodiscard]] bool AddRawBlocks(uint64_t new_block,
+                                  const void* data,
+                                  size_t size);
+
+  // Hands all queued blocks to the COW writer. Failures are sticky: once a
+  // write failed, every later call fails too.
+  [[nodiscard]] bool Flush();
+
+  size_t pending_bytes() const { return buffer_.size(); }
+
+ private:
+  android::snapshot::ICowWriter* const cow_writer_;
+  const size_t block_size_;
+  const size_t batch_size_;
+
+  // Data of the queued blocks, which start at |buffer_start_block_|.
+  std::vector<uint8_t> buffer_;
+  ScopedMemoryCharge memory_charge_{MemoryConsumer::kCowWriter};
+  uint64_t buffer_start_block_{0};
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(CowWriteBatcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_COW_WRITE_BATCHER_H_
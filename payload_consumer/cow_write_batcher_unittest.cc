@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/cow_write_batcher.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <libsnapshot/mock_cow_writer.h>
+
+namespace chromeos_update_engine {
+
+using testing::_;
+using testing::Return;
+using testing::Sequence;
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+}  // namespace
+
+class CowWriteBatcherTest : public ::testing::Test {
+ protected:
+  android::snapshot::MockCowWriter cow_writer_;
+  CowWriteBatcher batcher_{&cow_writer_, kBlockSize, 4 * kBlockSize};
+  std::vector<uint8_t> block_{std::vector<uint8_t>(kBlockSize, 'x')};
+};
+
+TEST_F(CowWriteBatcherTest, CoalescesContiguousBlocks) {
+  EXPECT_CALL(cow_writer_, AddRawBlocks(10, _, 3 * kBlockSize))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(batcher_.AddRawBlocks(10, block_.data(), kBlockSize));
+  ASSERT_TRUE(batcher_.AddRawBlocks(11, block_.data(), kBlockSize));
+  ASSERT_TRUE(batcher_.AddRawBlocks(12, block_.data(), kBlockSize));
+  ASSERT_EQ(3 * kBlockSize, batcher_.pending_bytes());
+  ASSERT_TRUE(batcher_.Flush());
+  ASSERT_EQ(0u, batcher_.pending_bytes());
+}
+
+TEST_F(CowWriteBatcherTest, FlushesOnGapAndFullBatch) {
+  Sequence s;
+  EXPECT_CALL(cow_writer_, AddRawBlocks(10, _, kBlockSize))
+      .InSequence(s)
+      .WillOnce(Return(true));
+  EXPECT_CALL(cow_writer_, AddRawBlocks(20, _, 4 * kBlockSize))
+      .InSequence(s)
+      .WillOnce(Return(true));
+  EXPECT_CALL(cow_writer_, AddRawBlocks(24, _, kBlockSize))
+      .InSequence(s)
+      .WillOnce(Return(true));
+  ASSERT_TRUE(batcher_.AddRawBlocks(10, block_.data(), kBlockSize));
+  for (uint64_t block = 20; block < 25; block++) {
+    ASSERT_TRUE(batcher_.AddRawBlocks(block, block_.data(), kBlockSize));
+  }
+  ASSERT_TRUE(batcher_.Flush());
+}
+
+TEST_F(CowWriteBatcherTest, LargeWritesGoStraightThrough) {
+  std::vector<uint8_t> data(8 * kBlockSize, 'y');
+  EXPECT_CALL(cow_writer_, AddRawBlocks(0, data.data(), data.size()))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(batcher_.AddRawBlocks(0, data.data(), data.size()));
+  ASSERT_EQ(0u, batcher_.pending_bytes());
+}
+
+TEST_F(CowWriteBatcherTest, FailureIsSticky) {
+  EXPECT_CALL(cow_writer_, AddRawBlocks(_, _, _)).WillOnce(Return(false));
+  ASSERT_TRUE(batcher_.AddRawBlocks(0, block_.data(), kBlockSize));
+  ASSERT_FALSE(batcher_.Flush());
+  ASSERT_FALSE(batcher_.AddRawBlocks(1, block_.data(), kBlockSize));
+  ASSERT_FALSE(batcher_.Flush());
+}
+
+TEST_F(CowWriteBatcherTest, RejectsPartialBlocks) {
+  ASSERT_FALSE(batcher_.AddRawBlocks(0, block_.data(), kBlockSize - 1));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,6 +16,9 @@
 
 #include "update_engine/payload_consumer/cow_writer_file_descriptor.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <utility>
@@ -47,40 +50,169 @@ bool CowWriterFileDescriptor::Open(const char* path, int flags) {
   return false;
 }
 
-ssize_t CowWriterFileDescriptor::Read(void* buf, size_t count) {
-  if (dirty_) {
+bool CowWriterFileDescriptor::RefreshReader(uint64_t offset, uint64_t count) {
+  const auto block_size = cow_writer_->GetBlockSize();
+  const uint64_t start_block = offset / block_size;
+  const uint64_t end_block = (offset + count + block_size - 1) / block_size;
+  if (end_block > start_block &&
+      written_blocks_.OverlapsWithExtent(
+          ExtentForRange(start_block, end_block - start_block))) {
     // OK, CowReader provides a snapshot view of what the cow contains. Which
     // means any writes happened after opening a CowReader isn't visible to
-    // that CowReader. Therefore, we re-open CowReader whenever we attempt a
-    // read after write. This does incur an overhead everytime you read after
-    // write.
-    // The usage of |dirty_| flag to coordinate re-open is a very coarse grained
-    // checked. This implementation has suboptimal performance. For better
-    // performance, keep track of blocks which are overwritten, and only re-open
-    // if reading a dirty block.
-    // TODO(b/173432386) Implement finer grained dirty checks
-    const auto offset = cow_reader_->Seek(0, SEEK_CUR);
+    // that CowReader. Therefore, we re-open CowReader whenever we attempt to
+    // read a block written since it was opened. This does incur an overhead
+    // everytime you do.
+    const auto position = cow_reader_->Seek(0, SEEK_CUR);
     cow_reader_.reset();
     if (!cow_writer_->Finalize()) {
       LOG(ERROR) << "Failed to Finalize() cow writer";
-      return -1;
+      return false;
     }
     cow_reader_ = cow_writer_->OpenFileDescriptor(source_device_);
     if (cow_reader_ == nullptr) {
       LOG(ERROR)
           << "Failed to re-open cow file descriptor after writing to COW";
-      return -1;
+      return false;
     }
-    const auto pos = cow_reader_->Seek(offset, SEEK_SET);
-    if (pos != offset) {
+    const auto pos = cow_reader_->Seek(position, SEEK_SET);
+    if (pos != position) {
       LOG(ERROR) << "Failed to seek to previous position after re-opening cow "
                     "reader, expected "
-                 << offset << " actual: " << pos;
-      return -1;
+                 << position << " actual: " << pos;
+      return false;
     }
     dirty_ = false;
+    written_blocks_ = ExtentRanges();
+  }
+  return true;
+}
+
+void CowWriterFileDescriptor::MarkWritten(uint64_t offset, uint64_t count) {
+  if (count == 0) {
+    return;
+  }
+  const auto block_size = cow_writer_->GetBlockSize();
+  const uint64_t start_block = offset / block_size;
+  const uint64_t end_block = (offset + count + block_size - 1) / block_size;
+  written_blocks_.AddExtent(
+      ExtentForRange(start_block, end_block - start_block));
+  dirty_ = true;
+  // Drop the cached chunks which are now stale.
+  const uint64_t end = offset + count;
+  for (uint64_t index = offset / kChunkSize; index * kChunkSize < end;
+       index++) {
+    auto it = chunk_index_.find(index);
+    if (it != chunk_index_.end()) {
+      cached_bytes_ -= it->second->second.size();
+      chunks_.erase(it->second);
+      chunk_index_.erase(it);
+    }
+  }
+}
+
+ssize_t CowWriterFileDescriptor::ReadCached(void* buf,
+                                            size_t count,
+                                            uint64_t offset) {
+  ssize_t bytes_read = 0;
+  if (count >= kChunkSize) {
+    if (!RefreshReader(offset, count) ||
+        !utils::PReadAll(cow_reader_.get(), buf, count, offset, &bytes_read)) {
+      return -1;
+    }
+    return bytes_read;
+  }
+  auto bytes = static_cast<uint8_t*>(buf);
+  while (static_cast<size_t>(bytes_read) < count) {
+    const uint64_t index = offset / kChunkSize;
+    const brillo::Blob* chunk = GetChunk(index);
+    if (chunk == nullptr) {
+      return -1;
+    }
+    const size_t chunk_offset = offset - index * kChunkSize;
+    if (chunk_offset >= chunk->size()) {
+      break;
+    }
+    const size_t size =
+        std::min(count - bytes_read, chunk->size() - chunk_offset);
+    memcpy(bytes + bytes_read, chunk->data() + chunk_offset, size);
+    bytes_read += size;
+    offset += size;
+    if (chunk->size() < kChunkSize) {
+      break;
+    }
   }
-  return cow_reader_->Read(buf, count);
+  return bytes_read;
+}
+
+const brillo::Blob* CowWriterFileDescriptor::GetChunk(uint64_t index) {
+  auto it = chunk_index_.find(index);
+  if (it != chunk_index_.end()) {
+    chunks_.splice(chunks_.begin(), chunks_, it->second);
+    return &it->second->second;
+  }
+  const uint64_t start = index * kChunkSize;
+  if (!RefreshReader(start, kChunkSize)) {
+    return nullptr;
+  }
+  brillo::Blob data(kChunkSize);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(
+          cow_reader_.get(), data.data(), data.size(), start, &bytes_read)) {
+    LOG(ERROR) << "Failed to read " << data.size() << " bytes at " << start;
+    return nullptr;
+  }
+  data.resize(bytes_read);
+  chunks_.emplace_front(index, std::move(data));
+  chunk_index_[index] = chunks_.begin();
+  cached_bytes_ += chunks_.front().second.size();
+  // Always keep the most recent chunk, which the caller is using.
+  while (cached_bytes_ > kReadCacheSize && chunks_.size() > 1) {
+    cached_bytes_ -= chunks_.back().second.size();
+    chunk_index_.erase(chunks_.back().first);
+    chunks_.pop_back();
+  }
+  return &chunks_.front().second;
+}
+
+ssize_t CowWriterFileDescriptor::Read(void* buf, size_t count) {
+  const off64_t offset = cow_reader_->Seek(0, SEEK_CUR);
+  if (offset < 0) {
+    return -1;
+  }
+  const ssize_t bytes_read = ReadCached(buf, count, offset);
+  if (bytes_read > 0 && cow_reader_->Seek(offset + bytes_read, SEEK_SET) < 0) {
+    return -1;
+  }
+  return bytes_read;
+}
+
+bool CowWriterFileDescriptor::ReadAt(const std::vector<IoRequest>& requests) {
+  for (const auto& request : requests) {
+    TEST_AND_RETURN_FALSE(
+        ReadCached(request.data, request.size, request.offset) ==
+        static_cast<ssize_t>(request.size));
+  }
+  return true;
+}
+
+bool CowWriterFileDescriptor::WriteAt(const std::vector<IoRequest>& requests) {
+  const auto block_size = cow_writer_->GetBlockSize();
+  for (size_t i = 0; i < requests.size();) {
+    // Requests contiguous both in the file and in memory are added at once.
+    const uint64_t offset = requests[i].offset;
+    const auto data = static_cast<const uint8_t*>(requests[i].data);
+    size_t size = 0;
+    for (; i < requests.size() && requests[i].offset == offset + size &&
+           requests[i].data == data + size;
+         i++) {
+      size += requests[i].size;
+    }
+    CHECK_EQ(offset % block_size, 0u);
+    TEST_AND_RETURN_FALSE(
+        cow_writer_->AddRawBlocks(offset / block_size, data, size));
+    MarkWritten(offset, size);
+  }
+  return true;
 }
 
 ssize_t CowWriterFileDescriptor::Write(const void* buf, size_t count) {
@@ -92,7 +224,7 @@ ssize_t CowWriterFileDescriptor::Write(const void* buf, size_t count) {
     if (cow_reader_->Seek(count, SEEK_CUR) < 0) {
       return -1;
     }
-    dirty_ = true;
+    MarkWritten(offset, count);
     return count;
   }
   return -1;
@@ -135,6 +267,9 @@ bool CowWriterFileDescriptor::Close() {
     }
     cow_writer_ = nullptr;
   }
+  chunks_.clear();
+  chunk_index_.clear();
+  cached_bytes_ = 0;
   if (cow_reader_) {
     TEST_AND_RETURN_FALSE(cow_reader_->Close());
     cow_reader_ = nullptr;
@@ -15,20 +15,33 @@
 //
 
 #include <cstdint>
+#include <list>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include <brillo/secure_blob.h>
 #include <libsnapshot/cow_writer.h>
 
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
 
 // A Readable/Writable FileDescriptor class. This is a simple wrapper around
 // CowWriter. Only intended to be used by FileSystemVerifierAction for writing
 // FEC. Writes must be block aligned(4096) or write will fail.
+//
+// Reads smaller than kChunkSize, like the block sized ones of the FEC
+// encoder, are served from an LRU cache of kChunkSize chunks up to
+// kReadCacheSize bytes, since every read of the COW goes through its ops.
 class CowWriterFileDescriptor final : public FileDescriptor {
  public:
+  static constexpr size_t kChunkSize = 64 * 1024;                // 64 KiB
+  static constexpr size_t kReadCacheSize = 16 * 1024 * 1024;  // 16 MiB
+
   // |cow_reader| should be obtained by calling
   // |cow_writer->OpenReader()->OpenFileDescriptor()|
   CowWriterFileDescriptor(
@@ -46,6 +59,11 @@ class CowWriterFileDescriptor final : public FileDescriptor {
   // aligned.
   ssize_t Write(const void* buf, size_t count) override;
 
+  // Positional versions of Read() and Write(), which leave the offset
+  // untouched. The writes have the same alignment requirements.
+  bool ReadAt(const std::vector<IoRequest>& requests) override;
+  bool WriteAt(const std::vector<IoRequest>& requests) override;
+
   off64_t Seek(off64_t offset, int whence) override;
 
   uint64_t BlockDevSize() override;
@@ -64,9 +82,33 @@ class CowWriterFileDescriptor final : public FileDescriptor {
   bool IsOpen() override;
 
  private:
+  // Re-opens |cow_reader_| at the same offset if any of the |count| bytes at
+  // |offset| was written since it was opened, so it sees the writes.
+  bool RefreshReader(uint64_t offset, uint64_t count);
+
+  // Records that the |count| bytes at |offset| were written.
+  void MarkWritten(uint64_t offset, uint64_t count);
+
+  // Reads up to |count| bytes at |offset| into |buf|, through the cache for
+  // small reads. Returns the number of bytes read, short at the end of the
+  // device, or -1 on errors.
+  ssize_t ReadCached(void* buf, size_t count, uint64_t offset);
+
+  // Returns the chunk |index|, reading it first if it isn't cached, or
+  // nullptr on errors.
+  const brillo::Blob* GetChunk(uint64_t index);
+
   std::unique_ptr<android::snapshot::ICowWriter> cow_writer_;
   FileDescriptorPtr cow_reader_;
   std::optional<std::string> source_device_;
+  // Whether anything was written since the last Finalize().
   bool dirty_ = false;
+  // The blocks written since |cow_reader_| was opened.
+  ExtentRanges written_blocks_;
+
+  // The cached chunks and their index, most recently used first.
+  std::list<std::pair<uint64_t, brillo::Blob>> chunks_;
+  std::unordered_map<uint64_t, decltype(chunks_)::iterator> chunk_index_;
+  size_t cached_bytes_ = 0;
 };
 }  // namespace chromeos_update_engine
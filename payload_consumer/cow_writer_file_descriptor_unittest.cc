@@ -113,4 +113,44 @@ TEST_F(CowWriterFileDescriptorUnittest, ReadAfterWrite) {
          "is open, Finalize() should not be called.";
 }
 
+TEST_F(CowWriterFileDescriptorUnittest, PositionalReadAfterWrite) {
+  std::vector<unsigned char> first(BLOCK_SIZE, 0x11);
+  std::vector<unsigned char> second(BLOCK_SIZE * 2, 0x22);
+  auto cow_fd = GetCowFd();
+  ASSERT_EQ(0, cow_fd->Seek(0, SEEK_SET));
+  ASSERT_TRUE(cow_fd->WriteAt({{second.data(), second.size(), BLOCK_SIZE * 5},
+                               {first.data(), first.size(), BLOCK_SIZE}}));
+  // Positional writes don't move the offset.
+  ASSERT_EQ(0, cow_fd->Seek(0, SEEK_CUR));
+
+  std::vector<unsigned char> read_first(first.size());
+  std::vector<unsigned char> read_second(second.size());
+  ASSERT_TRUE(cow_fd->ReadAt(
+      {{read_first.data(), read_first.size(), BLOCK_SIZE},
+       {read_second.data(), read_second.size(), BLOCK_SIZE * 5}}));
+  ASSERT_EQ(first, read_first);
+  ASSERT_EQ(second, read_second);
+}
+
+TEST_F(CowWriterFileDescriptorUnittest, CachedReadSeesLaterWrites) {
+  std::vector<unsigned char> first(BLOCK_SIZE, 0x11);
+  std::vector<unsigned char> second(BLOCK_SIZE, 0x22);
+  auto cow_fd = GetCowFd();
+  ASSERT_TRUE(cow_fd->WriteAt({{first.data(), first.size(), 0}}));
+
+  // The block sized read caches the whole chunk, including block 1.
+  std::vector<unsigned char> read_back(BLOCK_SIZE);
+  ASSERT_TRUE(cow_fd->ReadAt({{read_back.data(), read_back.size(), 0}}));
+  ASSERT_EQ(first, read_back);
+
+  ASSERT_TRUE(cow_fd->WriteAt({{second.data(), second.size(), BLOCK_SIZE}}));
+  ASSERT_EQ((ssize_t)BLOCK_SIZE, cow_fd->Seek(BLOCK_SIZE, SEEK_SET));
+  ASSERT_EQ((ssize_t)read_back.size(),
+            cow_fd->Read(read_back.data(), read_back.size()));
+  ASSERT_EQ(second, read_back);
+  ASSERT_EQ((ssize_t)BLOCK_SIZE * 2, cow_fd->Seek(0, SEEK_CUR));
+  ASSERT_TRUE(cow_fd->ReadAt({{read_back.data(), read_back.size(), 0}}));
+  ASSERT_EQ(first, read_back);
+}
+
 }  // namespace chromeos_update_engine
@@ -16,11 +16,13 @@
 
 #include "update_engine/payload_consumer/delta_performer.h"
 
+#include <fcntl.h>
 #include <linux/fs.h>
 
 #include <algorithm>
 #include <chrono>
 #include <cstring>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
@@ -48,15 +50,22 @@
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/terminator.h"
+#include "update_engine/common/tracing.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/early_partition_hasher.h"
+#include "update_engine/payload_consumer/partition_fd_cache.h"
 #include "update_engine/payload_consumer/partition_update_generator_interface.h"
 #include "update_engine/payload_consumer/partition_writer.h"
+#include "update_engine/payload_consumer/throughput_governor.h"
 #include "update_engine/update_metadata.pb.h"
 #if USE_FEC
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor_utils.h"
 #endif  // USE_FEC
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
 
 using google::protobuf::RepeatedPtrField;
 using std::min;
@@ -69,10 +78,59 @@ const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
 const unsigned DeltaPerformer::kProgressDownloadWeight = 50;
 const unsigned DeltaPerformer::kProgressOperationsWeight = 50;
 const uint64_t DeltaPerformer::kCheckpointFrequencySeconds = 1;
+const uint64_t DeltaPerformer::kPrefsCheckpointFrequencySeconds = 30;
 
 namespace {
 const int kUpdateStateOperationInvalid = -1;
+// Upper bound of the blocks zeroed or discarded at once, so that cancellation
+// and progress are still handled every now and then.
+constexpr uint64_t kMaxCoalescedZeroBytes = 1024 * 1024 * 1024;  // 1 GiB
 const int kMaxResumedUpdateFailures = 10;
+constexpr char kUpdateStateJournalFileName[] = "update_state_journal";
+constexpr char kAppliedOperationCacheFileName[] = "applied_operations";
+constexpr char kPayloadHashCheckpointsFileName[] = "payload_hash_checkpoints";
+constexpr char kReusedBlobsFileName[] = "reused_blobs";
+constexpr char kCachedManifestFileName[] = "manifest";
+// Payload data between two records of the payload hashes. Only runs of
+// reused operations ending at a record can be left out of the download.
+constexpr uint64_t kPayloadHashCheckpointInterval = 8 * 1024 * 1024;  // 8 MiB
+// REPLACE operations with at least this much data are written as their blob
+// is downloaded, in chunks of the given size, and can be resumed after any of
+// the chunks.
+constexpr uint64_t kMinStreamedOperationSize = 16 * 1024 * 1024;  // 16 MiB
+constexpr size_t kStreamedOperationChunkSize = 2 * 1024 * 1024;   // 2 MiB
+// Payload data kept in memory while the partitions are prepared in the
+// background, the download waits for the preparation beyond that.
+constexpr size_t kMaxBufferedWhilePreparing = 32 * 1024 * 1024;  // 32 MiB
+
+// Whether the update state in |prefs| is past the start of the payload, with
+// |next_operation| applied next, possibly in part already.
+bool HasProgress(PrefsInterface* prefs, int64_t next_operation) {
+  return next_operation > 0 ||
+         (next_operation == 0 &&
+          prefs->Exists(kPrefsUpdateStateOperationSHA256Context));
+}
+
+// Returns the number of operations of |partition|, which may be stored apart
+// from the manifest.
+size_t NumOperations(const PartitionUpdate& partition) {
+  return partition.has_operations_blob_offset() ? partition.num_operations()
+                                                : partition.operations_size();
+}
+
+// Returns whether the operations of |partition| are stored apart from the
+// manifest and weren't loaded yet.
+bool HasPendingOperations(const PartitionUpdate& partition) {
+  return partition.has_operations_blob_offset() &&
+         partition.operations_size() == 0;
+}
+
+// The value of kPrefsDynamicPartitionMetadataSlots for partitions prepared
+// while booted from |source_slot|.
+string SlotsPrefValue(BootControlInterface::Slot source_slot,
+                      BootControlInterface::Slot target_slot) {
+  return std::to_string(source_slot) + ":" + std::to_string(target_slot);
+}
 
 }  // namespace
 
@@ -169,6 +227,117 @@ void DeltaPerformer::UpdateOverallProgress(bool force_log,
   last_progress_chunk_ = curr_progress_chunk;
 }
 
+bool DeltaPerformer::BorrowOperationData(const InstallOperation& op,
+                                         const char** bytes_p,
+                                         size_t* count_p) {
+  // Pipelined operations outlive the Write() call, so they always need their
+  // own copy of the blob.
+  if (!buffer_.empty() || op.data_length() == 0 ||
+      *count_p < op.data_length() || op.data_offset() != buffer_offset_ ||
+      ShouldPipelineOperation(op)) {
+    return false;
+  }
+  borrowed_data_ = reinterpret_cast<const uint8_t*>(*bytes_p);
+  borrowed_data_size_ = op.data_length();
+  *bytes_p += borrowed_data_size_;
+  *count_p -= borrowed_data_size_;
+  return true;
+}
+
+bool DeltaPerformer::ShouldStreamOperation(const InstallOperation& op) const {
+  // Only raw data can be written as it arrives without first checking its
+  // hash, nothing parses it. A blob used by several operations is kept whole.
+  return op.type() == InstallOperation::REPLACE &&
+         op.data_length() >= kMinStreamedOperationSize &&
+         !op.data_sha256_hash().empty() && partition_writer_ &&
+         partition_writer_->SupportsPartialOperations() &&
+         op.data_length() ==
+             utils::BlocksInExtents(op.dst_extents()) * block_size_ &&
+         reused_blobs_.count(op.data_offset()) == 0;
+}
+
+bool DeltaPerformer::StreamOperation(const InstallOperation& op,
+                                     const char** bytes_p,
+                                     size_t* count_p,
+                                     bool* applied,
+                                     ErrorCode* error) {
+  *applied = false;
+  // |buffer_offset_| is past the part of the blob already written.
+  if (buffer_offset_ < op.data_offset() ||
+      buffer_offset_ - op.data_offset() > op.data_length()) {
+    LOG(ERROR) << "Unexpected data offset " << buffer_offset_
+               << " for the operation at " << op.data_offset();
+    *error = ErrorCode::kDownloadStateInitializationError;
+    return false;
+  }
+  uint64_t written = buffer_offset_ - op.data_offset();
+  if (written == 0 && buffer_.empty()) {
+    streamed_op_hasher_ = std::make_unique<HashCalculator>();
+  } else if (!streamed_op_hasher_) {
+    LOG(ERROR) << "Missing the hash of the " << written
+               << " bytes of operation " << next_operation_num_
+               << " already written";
+    *error = ErrorCode::kDownloadStateInitializationError;
+    return false;
+  }
+
+  while (written < op.data_length()) {
+    const size_t chunk_size =
+        min<uint64_t>(op.data_length() - written, kStreamedOperationChunkSize);
+    CopyDataToBuffer(bytes_p, count_p, chunk_size);
+    if (buffer_.size() < chunk_size) {
+      return true;
+    }
+    if (partition_ops_in_flight_ && !WaitForInFlightOperations(error)) {
+      return false;
+    }
+    ScopedTerminatorExitUnblocker exit_unblocker =
+        ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+    InstallOperation chunk_op;
+    chunk_op.set_type(InstallOperation::REPLACE);
+    chunk_op.set_data_offset(buffer_offset_);
+    chunk_op.set_data_length(chunk_size);
+    vector<Extent> dst_extents;
+    ExtentsToVector(op.dst_extents(), &dst_extents);
+    StoreExtents(ExtentsSublist(dst_extents,
+                                written / block_size_,
+                                chunk_size / block_size_),
+                 chunk_op.mutable_dst_extents());
+    if (!streamed_op_hasher_->Update(buffer_.data(), buffer_.size()) ||
+        !HandleOpResult(partition_writer_->PerformReplaceOperation(
+                            chunk_op, buffer_.data(), buffer_.size()),
+                        "REPLACE",
+                        error)) {
+      return false;
+    }
+    DiscardBuffer(true, buffer_.size());
+    written += chunk_size;
+    if (written < op.data_length() && ShouldCheckpoint()) {
+      CheckpointUpdateProgress(true);
+    }
+  }
+
+  // The whole blob was written before its hash could be checked. Only the
+  // verification of the partition makes the target usable, a mismatch fails
+  // the update before that.
+  const brillo::Blob expected_hash(op.data_sha256_hash().begin(),
+                                   op.data_sha256_hash().end());
+  TEST_AND_RETURN_FALSE(streamed_op_hasher_->Finalize());
+  if (streamed_op_hasher_->raw_hash() != expected_hash) {
+    LOG(ERROR) << "Hash verification failed for streamed operation "
+               << next_operation_num_
+               << ". Expected hash = " << HexEncode(expected_hash);
+    if (install_plan_->hash_checks_mandatory) {
+      *error = ErrorCode::kDownloadOperationHashMismatch;
+      return false;
+    }
+    LOG(WARNING) << "Ignoring operation validation errors";
+  }
+  streamed_op_hasher_.reset();
+  *applied = true;
+  return true;
+}
+
 size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p,
                                         size_t* count_p,
                                         size_t max) {
@@ -201,13 +370,14 @@ bool DeltaPerformer::HandleOpResult(bool op_result,
 }
 
 int DeltaPerformer::Close() {
+  prepare_partitions_task_.Cancel();
   // Checkpoint update progress before canceling, so that subsequent attempts
   // can resume from exactly where update_engine left last time.
   CheckpointUpdateProgress(true);
+  PersistCheckpointMetrics();
   int err = -CloseCurrentPartition();
   LOG_IF(ERROR,
-         !payload_hash_calculator_.Finalize() ||
-             !signed_hash_calculator_.Finalize())
+         !payload_hasher_.Finalize())
       << "Unable to finalize the hash.";
   if (!buffer_.empty()) {
     LOG(INFO) << "Discarding " << buffer_.size() << " unused downloaded bytes";
@@ -218,14 +388,304 @@ int DeltaPerformer::Close() {
 }
 
 int DeltaPerformer::CloseCurrentPartition() {
+  // Errors of in-flight operations are reported by WaitForInFlightOperations()
+  // in the regular flow, here we only need them to stop using the writers.
+  if (op_pipeline_) {
+    op_pipeline_->Drain();
+  }
+  partition_ops_in_flight_ = false;
+  for (auto& partition : finishing_partitions_) {
+    LOG_IF(ERROR, partition.writer->Close() < 0)
+        << "Failed to close partition " << partition.name;
+  }
+  finishing_partitions_.clear();
   if (!partition_writer_) {
     return 0;
   }
   int err = partition_writer_->Close();
   partition_writer_ = nullptr;
+  if (op_pipeline_) {
+    op_pipeline_->set_dependency_graph(nullptr);
+  }
+  operation_graph_.reset();
+  operation_timings_.reset();
   return err;
 }
 
+void DeltaPerformer::ReleaseFinishedPartitionOperations() {
+  // In-flight operations of finishing partitions still refer to theirs.
+  if (!finishing_partitions_.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < current_partition_ && i < partitions_.size(); i++) {
+    if (partitions_[i].operations_size() == 0 &&
+        partitions_[i].merge_operations_size() == 0) {
+      continue;
+    }
+    // Clear() keeps the elements around for reuse, swap them out instead so
+    // they are actually freed.
+    google::protobuf::RepeatedPtrField<InstallOperation>().Swap(
+        partitions_[i].mutable_operations());
+    google::protobuf::RepeatedPtrField<CowMergeOperation>().Swap(
+        partitions_[i].mutable_merge_operations());
+  }
+}
+
+bool DeltaPerformer::LoadPartitionOperations(const char** bytes_p,
+                                             size_t* count_p,
+                                             bool* loaded,
+                                             ErrorCode* error) {
+  PartitionUpdate& partition = partitions_[current_partition_];
+  *loaded = !HasPendingOperations(partition);
+  if (*loaded) {
+    return true;
+  }
+  if (buffer_offset_ != partition.operations_blob_offset()) {
+    LOG(ERROR) << "The operations of partition " << partition.partition_name()
+               << " are at blob offset " << partition.operations_blob_offset()
+               << " but expected at offset " << buffer_offset_;
+    *error = ErrorCode::kDownloadManifestParseError;
+    return false;
+  }
+  CopyDataToBuffer(bytes_p, count_p, partition.operations_blob_size());
+  if (buffer_.size() < partition.operations_blob_size()) {
+    return true;
+  }
+  if (!PayloadMetadata::ParsePartitionOperations(manifest_.minor_version(),
+                                                 buffer_.data(),
+                                                 buffer_.size(),
+                                                 &partition)) {
+    *error = ErrorCode::kDownloadManifestParseError;
+    return false;
+  }
+  // A resumed update needs them again, but not their bytes of the payload.
+  LOG_IF(WARNING,
+         !prefs_->SetString(
+             kPrefsUpdateStatePartitionOperations,
+             {reinterpret_cast<const char*>(buffer_.data()), buffer_.size()}))
+      << "Unable to save the operations of partition "
+      << partition.partition_name();
+  LOG(INFO) << "Loaded the " << partition.num_operations()
+            << " operations of partition " << partition.partition_name();
+  DiscardBuffer(true, buffer_.size());
+  *loaded = true;
+  return true;
+}
+
+bool DeltaPerformer::ResumePartitionOperations() {
+  if (next_operation_num_ >= num_total_operations_) {
+    return true;
+  }
+  size_t partition_num = current_partition_;
+  while (next_operation_num_ >= acc_num_operations_[partition_num]) {
+    partition_num++;
+  }
+  PartitionUpdate& partition = partitions_[partition_num];
+  // Before the operations were downloaded, they're downloaded again.
+  if (!HasPendingOperations(partition) ||
+      buffer_offset_ <= partition.operations_blob_offset()) {
+    return true;
+  }
+  string operations_data;
+  TEST_AND_RETURN_FALSE(prefs_->GetString(kPrefsUpdateStatePartitionOperations,
+                                          &operations_data));
+  return PayloadMetadata::ParsePartitionOperations(
+      manifest_.minor_version(),
+      reinterpret_cast<const uint8_t*>(operations_data.data()),
+      operations_data.size(),
+      &partition);
+}
+
+bool DeltaPerformer::PlanReusedBlobs() {
+  reused_blobs_.clear();
+  // The first operation using every blob, by data offset.
+  std::map<uint64_t, std::pair<size_t, const InstallOperation*>> first_uses;
+  uint64_t next_data_offset = 0;
+  size_t op_num = 0;
+  for (const PartitionUpdate& partition : partitions_) {
+    // The blobs of the operations after those aren't known yet.
+    if (HasPendingOperations(partition)) {
+      break;
+    }
+    for (const InstallOperation& op : partition.operations()) {
+      const size_t current_op = op_num++;
+      if (op.data_length() == 0) {
+        continue;
+      }
+      if (op.data_offset() == next_data_offset) {
+        first_uses.emplace(op.data_offset(), std::make_pair(current_op, &op));
+        next_data_offset += op.data_length();
+        continue;
+      }
+      // Other offsets are rejected once the operation is reached.
+      auto it = first_uses.find(op.data_offset());
+      if (it == first_uses.end()) {
+        continue;
+      }
+      const InstallOperation& first_op = *it->second.second;
+      if (op.data_length() != first_op.data_length() ||
+          op.data_sha256_hash() != first_op.data_sha256_hash()) {
+        LOG(ERROR) << "Operation " << current_op << " uses the blob of "
+                   << "operation " << it->second.first << " differently.";
+        return false;
+      }
+      ReusedBlob& blob = reused_blobs_[op.data_offset()];
+      blob.length = op.data_length();
+      blob.sha256_hash = op.data_sha256_hash();
+      blob.first_operation = it->second.first;
+      blob.last_operation = current_op;
+    }
+  }
+
+  uint64_t reused_size = 0;
+  for (const auto& [offset, blob] : reused_blobs_) {
+    reused_size += blob.length;
+  }
+  if (reused_size > kMaxReusedBlobsSize) {
+    LOG(ERROR) << "The blobs used several times add up to " << reused_size
+               << " bytes, more than the " << kMaxReusedBlobsSize
+               << " bytes supported.";
+    return false;
+  }
+
+  const base::FilePath path = ReusedBlobsPath();
+  if (next_operation_num_ == 0) {
+    // The blobs saved for a previous update are of no use.
+    if (!path.empty() && base::PathExists(path)) {
+      LOG_IF(WARNING, !base::DeleteFile(path))
+          << "Unable to delete the reused blobs of a previous update.";
+    }
+    return true;
+  }
+  if (reused_blobs_.empty()) {
+    return true;
+  }
+
+  // The blobs downloaded before the resumed operation aren't downloaded again.
+  brillo::Blob saved;
+  if (!path.empty() && base::PathExists(path)) {
+    TEST_AND_RETURN_FALSE(utils::ReadFile(path.value(), &saved));
+  }
+  uint64_t header[2];
+  for (size_t pos = 0; saved.size() - pos >= sizeof(header);) {
+    memcpy(header, saved.data() + pos, sizeof(header));
+    pos += sizeof(header);
+    const uint64_t offset = header[0];
+    const uint64_t length = header[1];
+    // A blob cut short is saved again after it.
+    if (length > saved.size() - pos) {
+      break;
+    }
+    const auto data_begin = saved.begin() + pos;
+    pos += length;
+    auto it = reused_blobs_.find(offset);
+    brillo::Blob hash;
+    if (it == reused_blobs_.end() || it->second.length != length ||
+        it->second.data ||
+        !HashCalculator::RawHashOfBytes(&*data_begin, length, &hash) ||
+        it->second.sha256_hash != string(hash.begin(), hash.end())) {
+      continue;
+    }
+    it->second.data =
+        std::make_shared<const brillo::Blob>(data_begin, data_begin + length);
+  }
+  for (auto it = reused_blobs_.begin(); it != reused_blobs_.end();) {
+    const ReusedBlob& blob = it->second;
+    if (blob.last_operation < next_operation_num_) {
+      it = reused_blobs_.erase(it);
+      continue;
+    }
+    if (blob.first_operation < next_operation_num_ && !blob.data) {
+      LOG(ERROR) << "The blob at offset " << it->first
+                 << " of operation " << blob.first_operation
+                 << " wasn't saved.";
+      return false;
+    }
+    ++it;
+  }
+  return true;
+}
+
+void DeltaPerformer::CacheReusedBlob(const InstallOperation& op) {
+  if (reused_data_ || op.data_length() == 0) {
+    return;
+  }
+  auto it = reused_blobs_.find(op.data_offset());
+  if (it == reused_blobs_.end() || it->second.data) {
+    return;
+  }
+  auto data = std::make_shared<const brillo::Blob>(
+      OperationData(), OperationData() + op.data_length());
+  it->second.data = data;
+
+  // A resumed update needs it again, but not its bytes of the payload. The
+  // checkpoints after this operation are only written once it's saved.
+  const base::FilePath path = ReusedBlobsPath();
+  int fd = path.empty() ? -1
+                        : HANDLE_EINTR(open(path.value().c_str(),
+                                            O_WRONLY | O_CREAT | O_APPEND,
+                                            0600));
+  ScopedFdCloser fd_closer(&fd);
+  const uint64_t header[] = {op.data_offset(), data->size()};
+  LOG_IF(WARNING,
+         fd < 0 || !utils::WriteAll(fd, header, sizeof(header)) ||
+             !utils::WriteAll(fd, data->data(), data->size()) ||
+             fsync(fd) != 0)
+      << "Unable to save the blob at offset " << op.data_offset();
+}
+
+bool DeltaPerformer::UseReusedBlob(const InstallOperation& op) {
+  if (op.data_length() == 0 || op.data_offset() >= buffer_offset_) {
+    return false;
+  }
+  auto it = reused_blobs_.find(op.data_offset());
+  if (it == reused_blobs_.end() || !it->second.data) {
+    return false;
+  }
+  reused_data_ = it->second.data;
+  // Nothing needs the blob after its last use.
+  if (next_operation_num_ >= it->second.last_operation) {
+    reused_blobs_.erase(it);
+  }
+  return true;
+}
+
+base::FilePath DeltaPerformer::CachedManifestPath(
+    HardwareInterface* hardware) {
+  base::FilePath dir;
+  if (hardware == nullptr || !hardware->GetNonVolatileDirectory(&dir)) {
+    return {};
+  }
+  return dir.Append(kCachedManifestFileName);
+}
+
+void DeltaPerformer::SaveManifest() {
+  const base::FilePath path = CachedManifestPath(hardware_);
+  if (path.empty()) {
+    return;
+  }
+  // The file is written and synced while the partitions are prepared and the
+  // first operations applied.
+  saved_manifest_ = std::async(
+      std::launch::async,
+      [path, manifest = string(buffer_.begin(), buffer_.end())]() {
+        if (utils::WriteStringToFileAtomic(path.value(), manifest)) {
+          return;
+        }
+        LOG(WARNING) << "Unable to save the manifest to " << path;
+        // The manifest of a previous payload must not be taken for this one.
+        base::DeleteFile(path);
+      });
+}
+
+base::FilePath DeltaPerformer::ReusedBlobsPath() const {
+  base::FilePath dir;
+  if (hardware_ == nullptr || !hardware_->GetNonVolatileDirectory(&dir)) {
+    return {};
+  }
+  return dir.Append(kReusedBlobsFileName);
+}
+
 bool DeltaPerformer::OpenCurrentPartition() {
   if (current_partition_ >= partitions_.size())
     return false;
@@ -251,7 +711,20 @@ bool DeltaPerformer::OpenCurrentPartition() {
 
   TEST_AND_RETURN_FALSE(partition_writer_->Init(
       install_plan_, source_may_exist, partition_operation_num));
-  CheckpointUpdateProgress(true);
+  operation_timings_ = std::make_unique<OperationTimings>();
+  if (OpenAppliedOperationCache()) {
+    partition_writer_->SetAppliedOperationCache(&applied_operations_);
+  }
+  if (op_pipeline_) {
+    // When updating in place, an operation must not read blocks an earlier
+    // one is still writing, nor overwrite blocks an earlier one still reads.
+    operation_graph_ = std::make_unique<OperationDependencyGraph>(
+        partition.operations(), partition_writer_->SourceIsTarget());
+    op_pipeline_->set_dependency_graph(operation_graph_.get());
+  }
+  // Forcing the checkpoint would wait for the operations of the previous
+  // partition, the next regular checkpoint covers them instead.
+  CheckpointUpdateProgress(finishing_partitions_.empty());
   return true;
 }
 
@@ -384,6 +857,8 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
   }
 
   manifest_parsed_ = true;
+  // The parsed manifest takes at least as much memory as its encoding.
+  manifest_memory_.Set(manifest_.ByteSizeLong());
   return MetadataParseResult::kSuccess;
 }
 
@@ -461,6 +936,23 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     }
   }
 
+  // Data received while preparing the partitions, applied once that's done.
+  brillo::Blob prepare_data;
+  if (preparing_partitions_) {
+    bool ready = false;
+    BufferWhilePreparingPartitions(c_bytes, count, &ready);
+    if (!ready) {
+      return true;
+    }
+    if (!FinishParsingManifest(error)) {
+      LOG(ERROR) << "Failed to set up the update";
+      return false;
+    }
+    prepare_data.swap(prepare_buffer_);
+    c_bytes = reinterpret_cast<const char*>(prepare_data.data());
+    count = prepare_data.size();
+  }
+
   while (next_operation_num_ < num_total_operations_) {
     // Check if we should cancel the current attempt for any reason.
     // In this case, *error will have already been populated with the reason
@@ -471,53 +963,140 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     // We know there are more operations to perform because we didn't reach the
     // |num_total_operations_| limit yet.
     if (next_operation_num_ >= acc_num_operations_[current_partition_]) {
-      if (partition_writer_) {
-        if (!partition_writer_->FinishedInstallOps()) {
-          *error = ErrorCode::kDownloadWriteError;
-          return false;
-        }
-      }
-      const auto err = CloseCurrentPartition();
-      if (err < 0) {
-        LOG(ERROR) << "Failed to close partition "
-                   << partitions_[current_partition_].partition_name() << " "
-                   << strerror(-err);
+      if (!FinishCurrentPartition(error)) {
         return false;
       }
       // Skip until there are operations for current_partition_.
       while (next_operation_num_ >= acc_num_operations_[current_partition_]) {
         current_partition_++;
       }
+      ReleaseFinishedPartitionOperations();
+    }
+    if (!partition_writer_) {
+      bool loaded = false;
+      if (!LoadPartitionOperations(&c_bytes, &count, &loaded, error)) {
+        return false;
+      }
+      if (!loaded) {
+        return true;
+      }
       if (!OpenCurrentPartition()) {
         *error = ErrorCode::kInstallDeviceOpenError;
         return false;
       }
     }
 
+    if (!skipped_operations_.empty() &&
+        skipped_operations_.front().first_operation == next_operation_num_) {
+      if (!SkipPlannedOperations()) {
+        *error = ErrorCode::kDownloadStateInitializationError;
+        return false;
+      }
+      continue;
+    }
+
     const InstallOperation& op =
         partitions_[current_partition_].operations(GetPartitionOperationNum());
-
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
-
-    // Check whether we received all of the next operation's data payload.
-    if (!CanPerformInstallOperation(op))
-      return true;
-    if (!ProcessOperation(&op, error)) {
-      LOG(ERROR) << "unable to process operation: "
-                 << InstallOperationTypeName(op.type())
-                 << " Error: " << utils::ErrorCodeToString(*error);
-      return false;
+    // Let the writer verify the source of the next few operations while their
+    // blobs are still being downloaded.
+    partition_writer_->PrefetchSource(GetPartitionOperationNum());
+
+    // The borrowed blob is only valid during this call, make sure it's never
+    // used past the current operation.
+    DEFER {
+      borrowed_data_ = nullptr;
+      borrowed_data_size_ = 0;
+      reused_data_.reset();
+    };
+    if (ShouldStreamOperation(op)) {
+      bool applied = false;
+      if (!StreamOperation(op, &c_bytes, &count, &applied, error)) {
+        LOG(ERROR) << "unable to stream operation: "
+                   << InstallOperationTypeName(op.type())
+                   << " Error: " << utils::ErrorCodeToString(*error);
+        return false;
+      }
+      if (!applied)
+        return true;
+    } else {
+      if (!UseReusedBlob(op) && !BorrowOperationData(op, &c_bytes, &count))
+        CopyDataToBuffer(&c_bytes, &count, op.data_length());
+
+      // Check whether we received all of the next operation's data payload.
+      if (!CanPerformInstallOperation(op))
+        return true;
+      CacheReusedBlob(op);
+      if (IsOperationApplied(op)) {
+        // The blob still counts towards the payload hash.
+        DiscardBuffer(true, OperationDataSize());
+        num_reused_operations_++;
+      } else if (ShouldPipelineOperation(op)) {
+        if (!ProcessOperationAsync(&op, error)) {
+          LOG(ERROR) << "unable to queue operation: "
+                     << InstallOperationTypeName(op.type())
+                     << " Error: " << utils::ErrorCodeToString(*error);
+          return false;
+        }
+      } else {
+        // Operations which can't be pipelined are applied once everything
+        // queued before them finished. Operations of previous partitions
+        // write other devices and may keep running.
+        if (partition_ops_in_flight_ && !WaitForInFlightOperations(error)) {
+          return false;
+        }
+        InstallOperation merged_op;
+        const size_t num_merged_ops =
+            CoalesceZeroOrDiscardOperations(&merged_op);
+        if (!ProcessOperation(num_merged_ops > 1 ? &merged_op : &op, error)) {
+          LOG(ERROR) << "unable to process operation: "
+                     << InstallOperationTypeName(op.type())
+                     << " Error: " << utils::ErrorCodeToString(*error);
+          return false;
+        }
+        if (num_merged_ops > 1) {
+          next_operation_num_ += num_merged_ops - 1;
+        }
+      }
     }
 
     next_operation_num_++;
     UpdateOverallProgress(false, "Completed ");
     CheckpointUpdateProgress(false);
+    RecordPayloadHashCheckpoint();
   }
 
+  if (!WaitForInFlightOperations(error)) {
+    return false;
+  }
   if (partition_writer_) {
     TEST_AND_RETURN_FALSE(partition_writer_->FinishedInstallOps());
+    ReportOperationTimings(partitions_[current_partition_].partition_name(),
+                           operation_timings_.get());
   }
   CloseCurrentPartition();
+  if (num_reused_operations_ > 0) {
+    LOG(INFO) << "Skipped " << num_reused_operations_
+              << " operations whose target was written by a previous attempt.";
+  }
+  // The payload is fully applied, a retry needs to start over anyway.
+  if (applied_operations_.IsOpen()) {
+    LOG_IF(WARNING, !applied_operations_.Clear())
+        << "Unable to clear the applied operation cache.";
+  }
+  if (payload_hash_checkpoints_.IsOpen()) {
+    LOG_IF(WARNING, !payload_hash_checkpoints_.Reset())
+        << "Unable to reset the payload hash checkpoints.";
+  }
+
+  // The payload index is only for other consumers of the payload, it's only
+  // hashed along with the blobs before it.
+  if (manifest_.index_size() > 0 &&
+      buffer_offset_ == manifest_.index_offset()) {
+    CopyDataToBuffer(&c_bytes, &count, manifest_.index_size());
+    if (buffer_.size() < manifest_.index_size())
+      return true;
+    DiscardBuffer(true, buffer_.size());
+  }
 
   // In major version 2, we don't add unused operation to the payload.
   // If we already extracted the signature we should skip this step.
@@ -580,8 +1159,7 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
     return false;
   manifest_valid_ = true;
   if (!install_plan_->is_resume) {
-    auto begin = reinterpret_cast<const char*>(buffer_.data());
-    prefs_->SetString(kPrefsManifestBytes, {begin, buffer_.size()});
+    SaveManifest();
   }
 
   // Clear the download buffer.
@@ -634,7 +1212,7 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
       // whichever one is longer. In the worst case, we add 1 label per
       // InstallOp. So take size of label ops into account.
       const auto label_ops_size =
-          partition.operations_size() * sizeof(android::snapshot::CowOperation);
+          NumOperations(partition) * sizeof(android::snapshot::CowOperation);
       // Adding extra 2MB headroom just for any unexpected space usage.
       // If we overrun reserved COW size, entire OTA will fail
       // and no way for user to retry OTA
@@ -650,6 +1228,15 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
   if (install_plan_->disable_vabc) {
     manifest_.mutable_dynamic_partition_metadata()->set_vabc_enabled(false);
   }
+  install_plan_->cow_version =
+      manifest_.dynamic_partition_metadata().cow_version();
+  if (install_plan_->enable_threading.value_or(false) &&
+      !ThroughputGovernor::GetInstance()->AllowsThreadedCompression()) {
+    LOG(INFO) << "Not enabling multi-threaded compression for VABC at the "
+              << ThroughputLevelName(ThroughputGovernor::GetInstance()->level())
+              << " throughput level";
+    install_plan_->enable_threading = false;
+  }
   if (install_plan_->enable_threading) {
     manifest_.mutable_dynamic_partition_metadata()
         ->mutable_vabc_feature_set()
@@ -666,6 +1253,52 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
     LOG(INFO) << "Attempting to enable batched writes for VABC";
   }
 
+  if (install_plan_->prepare_partitions_async &&
+      install_plan_->target_slot != BootControlInterface::kInvalidSlot &&
+      !payload_->already_applied) {
+    // Creating the snapshots may take seconds, let the data following the
+    // manifest arrive in |prepare_buffer_| until the task ran. The update
+    // doesn't touch |manifest_| meanwhile.
+    LOG(INFO) << "Preparing partitions once the main loop is idle.";
+    preparing_partitions_ = true;
+    CHECK(prepare_partitions_task_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&DeltaPerformer::RunPreparePartitions,
+                       base::Unretained(this))));
+    return true;
+  }
+  return FinishParsingManifest(error);
+}
+
+void DeltaPerformer::BufferWhilePreparingPartitions(const char* c_bytes,
+                                                    size_t count,
+                                                    bool* ready) {
+  prepare_buffer_.insert(prepare_buffer_.end(), c_bytes, c_bytes + count);
+  // Nothing else arrives once the whole payload was received, so that data
+  // has to be applied before returning.
+  const bool payload_received = metadata_size_ + metadata_signature_size_ +
+                                    buffer_offset_ + buffer_.size() +
+                                    prepare_buffer_.size() >=
+                                payload_->size;
+  if (!prepared_partitions_ &&
+      (payload_received ||
+       prepare_buffer_.size() >= kMaxBufferedWhilePreparing)) {
+    LOG(INFO) << "Preparing partitions now with " << prepare_buffer_.size()
+              << " bytes buffered.";
+    prepare_partitions_task_.Cancel();
+    RunPreparePartitions();
+  }
+  *ready = prepared_partitions_.has_value();
+}
+
+void DeltaPerformer::RunPreparePartitions() {
+  PreparePartitionsResult result;
+  result.success =
+      PreparePartitionsForUpdate(&result.required_size, &result.error);
+  prepared_partitions_ = result;
+}
+
+bool DeltaPerformer::FinishParsingManifest(ErrorCode* error) {
   // This populates |partitions_| and the |install_plan.partitions| with the
   // list of partitions from the manifest.
   if (!ParseManifestPartitions(error))
@@ -679,7 +1312,7 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
 
   num_total_operations_ = 0;
   for (const auto& partition : partitions_) {
-    num_total_operations_ += partition.operations_size();
+    num_total_operations_ += NumOperations(partition);
     acc_num_operations_.push_back(num_total_operations_);
   }
 
@@ -696,7 +1329,43 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
     return false;
   }
 
-  if (next_operation_num_ < acc_num_operations_[current_partition_]) {
+  if (install_plan_->apply_threads > 1 && !op_pipeline_) {
+    // Twice as many operations as threads keeps the workers busy while the
+    // next operation's data is being downloaded.
+    const size_t memory_limit = install_plan_->apply_memory_limit
+                                    ? install_plan_->apply_memory_limit
+                                    : OperationPipeline::kDefaultMemoryLimit;
+    op_pipeline_ =
+        std::make_unique<OperationPipeline>(install_plan_->apply_threads,
+                                            2 * install_plan_->apply_threads,
+                                            memory_limit);
+    LOG(INFO) << "Applying operations on " << op_pipeline_->num_threads()
+              << " threads where supported, using up to "
+              << memory_limit / 1024 / 1024 << " MiB";
+  }
+
+  if (!PlanReusedBlobs()) {
+    *error = ErrorCode::kDownloadStateInitializationError;
+    LOG(ERROR) << "Unable to set up the data blobs used several times.";
+    return false;
+  }
+
+  // When resuming, the partitions before the one being resumed are done. The
+  // blobs they share with later partitions were planned above.
+  while (current_partition_ + 1 < partitions_.size() &&
+         next_operation_num_ >= acc_num_operations_[current_partition_]) {
+    current_partition_++;
+  }
+  ReleaseFinishedPartitionOperations();
+  if (!ResumePartitionOperations()) {
+    *error = ErrorCode::kDownloadStateInitializationError;
+    LOG(ERROR) << "Unable to load the operations of the resumed partition.";
+    return false;
+  }
+  // Partitions whose operations are still to be downloaded are opened once
+  // they arrive.
+  if (next_operation_num_ < acc_num_operations_[current_partition_] &&
+      !HasPendingOperations(partitions_[current_partition_])) {
     if (!OpenCurrentPartition()) {
       *error = ErrorCode::kInstallDeviceOpenError;
       return false;
@@ -718,23 +1387,19 @@ bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
   // Note: Validate must be called only if CanPerformInstallOperation is
   // called. Otherwise, we might be failing operations before even if there
   // isn't sufficient data to compute the proper hash.
-  *error = ValidateOperationHash(*op);
-  if (*error != ErrorCode::kSuccess) {
-    if (install_plan_->hash_checks_mandatory) {
-      LOG(ERROR) << "Mandatory operation hash check failed";
-      return false;
-    }
-
-    // For non-mandatory cases, just send a UMA stat.
-    LOG(WARNING) << "Ignoring operation validation errors";
-    *error = ErrorCode::kSuccess;
-  }
+  if (!VerifyOperationData(*op, error))
+    return false;
 
   // Makes sure we unblock exit when this operation completes.
   ScopedTerminatorExitUnblocker exit_unblocker =
       ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
 
   base::TimeTicks op_start_time = base::TimeTicks::Now();
+  OperationTimings::ScopedOperation op_timer(
+      operation_timings_.get(),
+      op->type(),
+      utils::BlocksInExtents(op->dst_extents()) * block_size_);
+  TRACE_SCOPE(InstallOperationTypeName(op->type()));
 
   bool op_result{};
   const string op_name = InstallOperationTypeName(op->type());
@@ -742,18 +1407,26 @@ bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
     case InstallOperation::REPLACE:
     case InstallOperation::REPLACE_BZ:
     case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
       op_result = PerformReplaceOperation(*op);
       OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
       break;
     case InstallOperation::ZERO:
-    case InstallOperation::DISCARD:
+    case InstallOperation::DISCARD: {
+      // The block device zeroes or discards the blocks, all of it is I/O.
+      OperationTimings::ScopedPhase phase(OperationTimings::Phase::kWrite);
       op_result = PerformZeroOrDiscardOperation(*op);
       OP_DURATION_HISTOGRAM("ZERO_OR_DISCARD", op_start_time);
       break;
+    }
     case InstallOperation::SOURCE_COPY:
       op_result = PerformSourceCopyOperation(*op, error);
       OP_DURATION_HISTOGRAM("SOURCE_COPY", op_start_time);
       break;
+    case InstallOperation::PARTITION_COPY:
+      op_result = PerformPartitionCopyOperation(*op, error);
+      OP_DURATION_HISTOGRAM("PARTITION_COPY", op_start_time);
+      break;
     case InstallOperation::SOURCE_BSDIFF:
     case InstallOperation::BROTLI_BSDIFF:
     case InstallOperation::PUFFDIFF:
@@ -772,20 +1445,265 @@ bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
   return true;
 }
 
+bool DeltaPerformer::VerifyOperationData(const InstallOperation& op,
+                                         ErrorCode* error) {
+  *error = ValidateOperationHash(op);
+  if (*error != ErrorCode::kSuccess) {
+    if (install_plan_->hash_checks_mandatory) {
+      LOG(ERROR) << "Mandatory operation hash check failed";
+      return false;
+    }
+
+    // For non-mandatory cases, just send a UMA stat.
+    LOG(WARNING) << "Ignoring operation validation errors";
+    *error = ErrorCode::kSuccess;
+  }
+  return true;
+}
+
+bool DeltaPerformer::ShouldPipelineOperation(const InstallOperation& op) const {
+  return op_pipeline_ && partition_writer_ &&
+         partition_writer_->SupportsConcurrentOperations() &&
+         OperationPipeline::IsSupportedOperation(op);
+}
+
+size_t DeltaPerformer::GetBufferedBytes() const {
+  size_t bytes = buffer_.size() + prepare_buffer_.size();
+  if (op_pipeline_) {
+    bytes += op_pipeline_->GetStats().in_flight_memory;
+  }
+  return bytes;
+}
+
+bool DeltaPerformer::GetPipelineStats(OperationPipeline::Stats* stats) const {
+  if (!op_pipeline_) {
+    return false;
+  }
+  *stats = op_pipeline_->GetStats();
+  return true;
+}
+
+bool DeltaPerformer::ProcessOperationAsync(const InstallOperation* op,
+                                           ErrorCode* error) {
+  // Same checks as ProcessOperation() and the Perform*Operation() methods,
+  // they must all pass before the data blob is released. The data hash is
+  // checked by the task instead, so the workers hash the blobs rather than
+  // this thread, before using them all the same.
+  const bool check_hash_in_task = !op->data_sha256_hash().empty();
+  if (!check_hash_in_task && !VerifyOperationData(*op, error))
+    return false;
+  const bool valid_data =
+      !op->has_data_length() ||
+      ((reused_data_ || buffer_offset_ == op->data_offset()) &&
+       OperationDataSize() >= op->data_length());
+  const bool valid_lengths =
+      (!op->has_src_length() || op->src_length() % block_size_ == 0) &&
+      (!op->has_dst_length() || op->dst_length() % block_size_ == 0);
+  if (!valid_data || !valid_lengths) {
+    LOG(ERROR) << "Invalid data offset or length of "
+               << InstallOperationTypeName(op->type()) << " operation "
+               << next_operation_num_;
+    *error = ErrorCode::kDownloadOperationExecutionError;
+    return false;
+  }
+
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+
+  const size_t op_index = next_operation_num_;
+  const size_t partition_op_index = GetPartitionOperationNum();
+  const string& partition_name =
+      partitions_[current_partition_].partition_name();
+  PartitionWriterInterface* writer = partition_writer_.get();
+  OperationTimings* timings = operation_timings_.get();
+  const bool hash_checks_mandatory = install_plan_->hash_checks_mandatory;
+  const uint64_t dst_bytes =
+      utils::BlocksInExtents(op->dst_extents()) * block_size_;
+  const size_t memory_usage = OperationPipeline::EstimateMemoryUsage(
+      *op, OperationDataSize(), block_size_);
+  OperationPipeline::Task task = [op,
+                                  writer,
+                                  timings,
+                                  check_hash_in_task,
+                                  hash_checks_mandatory,
+                                  dst_bytes,
+                                  op_index,
+                                  partition_op_index,
+                                  partition_name,
+                                  data = ReleaseBuffer()]() {
+    if (check_hash_in_task) {
+      const ErrorCode hash_error =
+          CheckOperationHash(*op, op_index, data->data());
+      if (hash_error != ErrorCode::kSuccess) {
+        if (hash_checks_mandatory) {
+          LOG(ERROR) << "Mandatory operation hash check failed";
+          return hash_error;
+        }
+        LOG(WARNING) << "Ignoring operation validation errors";
+      }
+    }
+    OperationTimings::ScopedOperation op_timer(timings, op->type(), dst_bytes);
+    TRACE_SCOPE(InstallOperationTypeName(op->type()));
+    ErrorCode op_error = ErrorCode::kSuccess;
+    bool op_result{};
+    switch (op->type()) {
+      case InstallOperation::REPLACE:
+      case InstallOperation::REPLACE_BZ:
+      case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
+        op_result =
+            writer->PerformReplaceOperation(*op, data->data(), data->size());
+        break;
+      case InstallOperation::SOURCE_COPY:
+        op_result = writer->PerformSourceCopyOperation(*op, &op_error);
+        break;
+      default:
+        op_result = writer->PerformDiffOperation(
+            *op, &op_error, data->data(), data->size());
+        break;
+    }
+    if (op_result)
+      return ErrorCode::kSuccess;
+    LOG(ERROR) << "Failed to perform " << InstallOperationTypeName(op->type())
+               << " operation " << op_index << ", which is the operation "
+               << partition_op_index << " in partition \"" << partition_name
+               << "\"";
+    return op_error == ErrorCode::kSuccess
+               ? ErrorCode::kDownloadOperationExecutionError
+               : op_error;
+  };
+  // Backs off while the device is warm or low on battery.
+  op_pipeline_->set_max_running(ThroughputGovernor::GetInstance()->LimitWorkers(
+      op_pipeline_->num_threads()));
+  if (!op_pipeline_->Submit(
+          partition_op_index, *op, memory_usage, std::move(task))) {
+    return WaitForInFlightOperations(error);
+  }
+  partition_ops_in_flight_ = true;
+  return true;
+}
+
+bool DeltaPerformer::WaitForInFlightOperations(ErrorCode* error) {
+  if (!op_pipeline_)
+    return true;
+  const ErrorCode pipeline_error = op_pipeline_->Drain();
+  if (pipeline_error != ErrorCode::kSuccess) {
+    *error = pipeline_error;
+    return false;
+  }
+  partition_ops_in_flight_ = false;
+  if (finishing_partitions_.empty())
+    return true;
+  // Finish the partitions in manifest order.
+  while (!finishing_partitions_.empty()) {
+    FinishingPartition partition = std::move(finishing_partitions_.front());
+    finishing_partitions_.erase(finishing_partitions_.begin());
+    if (!partition.writer->FinishedInstallOps()) {
+      LOG(ERROR) << "Failed to finish partition " << partition.name;
+      partition.writer->Close();
+      *error = ErrorCode::kDownloadWriteError;
+      return false;
+    }
+    const int err = partition.writer->Close();
+    if (err < 0) {
+      LOG(ERROR) << "Failed to close partition " << partition.name << " "
+                 << strerror(-err);
+      *error = ErrorCode::kDownloadWriteError;
+      return false;
+    }
+    ReportOperationTimings(partition.name, partition.timings.get());
+    HashPartitionEarly(partition.name);
+  }
+  ReleaseFinishedPartitionOperations();
+  return true;
+}
+
+bool DeltaPerformer::FinishCurrentPartition(ErrorCode* error) {
+  if (partition_ops_in_flight_ && partition_writer_) {
+    if (operation_graph_) {
+      op_pipeline_->set_dependency_graph(nullptr);
+    }
+    finishing_partitions_.push_back(
+        {partitions_[current_partition_].partition_name(),
+         std::move(partition_writer_),
+         std::move(operation_graph_),
+         std::move(operation_timings_)});
+    partition_ops_in_flight_ = false;
+    return true;
+  }
+  if (!WaitForInFlightOperations(error)) {
+    return false;
+  }
+  const bool written = partition_writer_ != nullptr;
+  if (partition_writer_) {
+    if (!partition_writer_->FinishedInstallOps()) {
+      *error = ErrorCode::kDownloadWriteError;
+      return false;
+    }
+    ReportOperationTimings(partitions_[current_partition_].partition_name(),
+                           operation_timings_.get());
+  }
+  const auto err = CloseCurrentPartition();
+  if (err < 0) {
+    LOG(ERROR) << "Failed to close partition "
+               << partitions_[current_partition_].partition_name() << " "
+               << strerror(-err);
+    return false;
+  }
+  if (written) {
+    HashPartitionEarly(partitions_[current_partition_].partition_name());
+  }
+  return true;
+}
+
+void DeltaPerformer::HashPartitionEarly(const std::string& partition_name) {
+  if (!install_plan_->early_verify) {
+    return;
+  }
+  for (const auto& partition : install_plan_->partitions) {
+    if (partition.name == partition_name) {
+      if (EarlyPartitionHasher::CanHashEarly(*install_plan_, partition)) {
+        EarlyPartitionHasher::GetInstance()->PartitionWritten(partition);
+      }
+      return;
+    }
+  }
+}
+
+void DeltaPerformer::ReportOperationTimings(const string& partition_name,
+                                            const OperationTimings* timings) {
+  if (timings == nullptr || timings->stats().empty()) {
+    return;
+  }
+  LOG(INFO) << "Operation timings of partition " << partition_name << ":\n"
+            << timings->ToString();
+  if (download_delegate_) {
+    download_delegate_->PartitionOperationsTimed(partition_name, *timings);
+  }
+}
+
 bool DeltaPerformer::IsManifestValid() {
   return manifest_valid_;
 }
 
 bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
-  partitions_.assign(manifest_.partitions().begin(),
-                     manifest_.partitions().end());
-
   // For VAB and partial updates, the partition preparation will copy the
   // dynamic partitions metadata to the target metadata slot, and rename the
   // slot suffix of the partitions in the metadata.
   if (install_plan_->target_slot != BootControlInterface::kInvalidSlot) {
     uint64_t required_size = 0;
-    if (!PreparePartitionsForUpdate(&required_size, error)) {
+    bool prepared = false;
+    if (preparing_partitions_) {
+      const PreparePartitionsResult result = *prepared_partitions_;
+      preparing_partitions_ = false;
+      prepared_partitions_.reset();
+      prepared = result.success;
+      required_size = result.required_size;
+      *error = result.error;
+    } else {
+      prepared = PreparePartitionsForUpdate(&required_size, error);
+    }
+    if (!prepared) {
       if (*error == ErrorCode::kOverlayfsenabledError) {
         return false;
       } else if (required_size > 0) {
@@ -797,7 +1715,13 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
     }
   }
 
-  // Partitions in manifest are no longer needed after preparing partitions.
+  // Partitions in manifest are no longer needed after preparing partitions,
+  // move them over instead of copying every operation.
+  partitions_.clear();
+  partitions_.reserve(manifest_.partitions_size());
+  for (auto& partition : *manifest_.mutable_partitions()) {
+    partitions_.push_back(std::move(partition));
+  }
   manifest_.clear_partitions();
   // TODO(xunchang) TBD: allow partial update only on devices with dynamic
   // partition.
@@ -895,8 +1819,8 @@ bool DeltaPerformer::PreparePartitionsForUpdate(
   ignore_result(
       prefs->GetString(kPrefsDynamicPartitionMetadataUpdated, &last_hash));
 
-  bool is_resume = !update_check_response_hash.empty() &&
-                   last_hash == update_check_response_hash;
+  const bool is_resume = ArePartitionsPrepared(
+      prefs, boot_control, target_slot, update_check_response_hash);
 
   if (is_resume) {
     LOG(INFO) << "Using previously prepared partitions for update. hash = "
@@ -922,6 +1846,9 @@ bool DeltaPerformer::PreparePartitionsForUpdate(
   }
   const auto duration = std::chrono::system_clock::now() - start;
 
+  TEST_AND_RETURN_FALSE(prefs->SetString(
+      kPrefsDynamicPartitionMetadataSlots,
+      SlotsPrefValue(boot_control->GetCurrentSlot(), target_slot)));
   TEST_AND_RETURN_FALSE(prefs->SetString(kPrefsDynamicPartitionMetadataUpdated,
                                          update_check_response_hash));
   LOG(INFO)
@@ -932,12 +1859,34 @@ bool DeltaPerformer::PreparePartitionsForUpdate(
   return true;
 }
 
+bool DeltaPerformer::ArePartitionsPrepared(
+    PrefsInterface* prefs,
+    BootControlInterface* boot_control,
+    BootControlInterface::Slot target_slot,
+    const string& update_check_response_hash) {
+  if (update_check_response_hash.empty())
+    return false;
+  string last_hash;
+  if (!prefs->GetString(kPrefsDynamicPartitionMetadataUpdated, &last_hash) ||
+      last_hash != update_check_response_hash) {
+    return false;
+  }
+  // Partitions prepared before the slot switched are stale. Prefs written
+  // before the slots were recorded are trusted as they were.
+  string slots;
+  return !prefs->GetString(kPrefsDynamicPartitionMetadataSlots, &slots) ||
+         slots == SlotsPrefValue(boot_control->GetCurrentSlot(), target_slot);
+}
+
 bool DeltaPerformer::CanPerformInstallOperation(
     const chromeos_update_engine::InstallOperation& operation) {
   // If we don't have a data blob we can apply it right away.
   if (!operation.has_data_offset() && !operation.has_data_length())
     return true;
 
+  if (reused_data_)
+    return true;
+
   // See if we have the entire data blob in the buffer
   if (operation.data_offset() < buffer_offset_) {
     LOG(ERROR) << "we threw away data it seems?";
@@ -945,26 +1894,67 @@ bool DeltaPerformer::CanPerformInstallOperation(
   }
 
   return (operation.data_offset() + operation.data_length() <=
-          buffer_offset_ + buffer_.size());
+          buffer_offset_ + OperationDataSize());
 }
 
 bool DeltaPerformer::PerformReplaceOperation(
     const InstallOperation& operation) {
   CHECK(operation.type() == InstallOperation::REPLACE ||
         operation.type() == InstallOperation::REPLACE_BZ ||
-        operation.type() == InstallOperation::REPLACE_XZ);
+        operation.type() == InstallOperation::REPLACE_XZ ||
+        operation.type() == InstallOperation::REPLACE_ZSTD);
 
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(OperationDataSize() >= operation.data_length());
 
   TEST_AND_RETURN_FALSE(partition_writer_->PerformReplaceOperation(
-      operation, buffer_.data(), buffer_.size()));
+      operation, OperationData(), OperationDataSize()));
   // Update buffer
-  DiscardBuffer(true, buffer_.size());
+  DiscardBuffer(true, OperationDataSize());
   return true;
 }
 
+size_t DeltaPerformer::CoalesceZeroOrDiscardOperations(
+    InstallOperation* merged_op) {
+  const auto& operations = partitions_[current_partition_].operations();
+  const size_t first = GetPartitionOperationNum();
+  const InstallOperation::Type type = operations[first].type();
+  if (type != InstallOperation::ZERO && type != InstallOperation::DISCARD) {
+    return 0;
+  }
+  // Planned runs of skipped operations start at their first operation.
+  size_t max_end = operations.size();
+  if (!skipped_operations_.empty()) {
+    max_end = std::min(max_end,
+                       first + skipped_operations_.front().first_operation -
+                           next_operation_num_);
+  }
+  ExtentRanges ranges;
+  size_t end = first;
+  for (; end < max_end; end++) {
+    const InstallOperation& op = operations[end];
+    // Operations with a blob are invalid, they are rejected on their own.
+    if (op.type() != type || op.has_data_offset() || op.has_data_length()) {
+      break;
+    }
+    const uint64_t num_blocks = utils::BlocksInExtents(op.dst_extents());
+    if (end > first &&
+        (ranges.blocks() + num_blocks) * block_size_ > kMaxCoalescedZeroBytes) {
+      break;
+    }
+    ranges.AddRepeatedExtents(op.dst_extents());
+  }
+  if (end - first < 2) {
+    return end - first;
+  }
+  merged_op->set_type(type);
+  for (const auto& extent : ranges.extent_set()) {
+    *merged_op->add_dst_extents() = extent;
+  }
+  return end - first;
+}
+
 bool DeltaPerformer::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
   CHECK(operation.type() == InstallOperation::DISCARD ||
@@ -986,6 +1976,55 @@ bool DeltaPerformer::PerformSourceCopyOperation(
   return partition_writer_->PerformSourceCopyOperation(operation, error);
 }
 
+bool DeltaPerformer::PerformPartitionCopyOperation(
+    const InstallOperation& operation, ErrorCode* error) {
+  // These operations have no blob.
+  TEST_AND_RETURN_FALSE(!operation.has_data_offset());
+  TEST_AND_RETURN_FALSE(!operation.has_data_length());
+  TEST_AND_RETURN_FALSE(operation.has_src_sha256_hash());
+  const uint64_t size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size_;
+  TEST_AND_RETURN_FALSE(size > 0 && size <= kMaxPartitionCopySize);
+  TEST_AND_RETURN_FALSE(
+      size == utils::BlocksInExtents(operation.dst_extents()) * block_size_);
+
+  const auto& partitions = install_plan_->partitions;
+  const auto source = std::find_if(
+      partitions.begin(),
+      partitions.end(),
+      [&operation](const InstallPlan::Partition& partition) {
+        return partition.name == operation.src_partition_name();
+      });
+  if (source == partitions.end() || source->source_path.empty()) {
+    LOG(ERROR) << "No source partition " << operation.src_partition_name()
+               << " to copy from.";
+    return false;
+  }
+  FileDescriptorPtr source_fd =
+      PartitionFdCache::GetInstance()->Open(source->source_path, O_RDONLY);
+  if (!source_fd) {
+    PLOG(ERROR) << "Unable to open source partition " << source->source_path;
+    return false;
+  }
+
+  brillo::Blob data;
+  TEST_AND_RETURN_FALSE(utils::ReadExtents(
+      source_fd, operation.src_extents(), &data, block_size_));
+  brillo::Blob source_hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(data, &source_hash));
+  TEST_AND_RETURN_FALSE(PartitionWriter::ValidateSourceHash(
+      source_hash, operation, source_fd, error));
+
+  // The data read is written as the blob of a REPLACE, which every partition
+  // writer supports the same way.
+  InstallOperation replace;
+  replace.set_type(InstallOperation::REPLACE);
+  *replace.mutable_dst_extents() = operation.dst_extents();
+  replace.set_data_length(data.size());
+  return partition_writer_->PerformReplaceOperation(
+      replace, data.data(), data.size());
+}
+
 bool DeltaPerformer::ExtentsToBsdiffPositionsString(
     const RepeatedPtrField<Extent>& extents,
     uint64_t block_size,
@@ -1013,16 +2052,17 @@ bool DeltaPerformer::PerformDiffOperation(const InstallOperation& operation,
                                           ErrorCode* error) {
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(reused_data_ ||
+                        buffer_offset_ == operation.data_offset());
+  TEST_AND_RETURN_FALSE(OperationDataSize() >= operation.data_length());
   if (operation.has_src_length())
     TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
   if (operation.has_dst_length())
     TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
 
   TEST_AND_RETURN_FALSE(partition_writer_->PerformDiffOperation(
-      operation, error, buffer_.data(), buffer_.size()));
-  DiscardBuffer(true, buffer_.size());
+      operation, error, OperationData(), OperationDataSize()));
+  DiscardBuffer(true, OperationDataSize());
   return true;
 }
 
@@ -1148,6 +2188,26 @@ ErrorCode DeltaPerformer::ValidateManifest() {
     }
   }
 
+  for (const PartitionUpdate& partition : manifest_.partitions()) {
+    if (partition.has_operations_blob_offset() &&
+        partition.operations_size() > 0) {
+      LOG(ERROR) << "Partition " << partition.partition_name()
+                 << " has operations both in the manifest and apart from it.";
+      return ErrorCode::kDownloadManifestParseError;
+    }
+  }
+
+  // The payload index, if any, is right before the signatures.
+  if (manifest_.index_size() > 0 && manifest_.has_signatures_offset() &&
+      manifest_.index_offset() + manifest_.index_size() !=
+          manifest_.signatures_offset()) {
+    LOG(ERROR) << "Payload index at blob offset " << manifest_.index_offset()
+               << " of size " << manifest_.index_size()
+               << " isn't followed by the signatures at "
+               << manifest_.signatures_offset();
+    return ErrorCode::kDownloadManifestParseError;
+  }
+
   // TODO(crbug.com/37661) we should be adding more and more manifest checks,
   // such as partition boundaries, etc.
 
@@ -1282,6 +2342,12 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
     return ErrorCode::kSuccess;
   }
 
+  return CheckOperationHash(operation, next_operation_num_, OperationData());
+}
+
+ErrorCode DeltaPerformer::CheckOperationHash(const InstallOperation& operation,
+                                             size_t op_index,
+                                             const uint8_t* data) {
   brillo::Blob expected_op_hash;
   expected_op_hash.assign(operation.data_sha256_hash().data(),
                           (operation.data_sha256_hash().data() +
@@ -1289,15 +2355,13 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
 
   brillo::Blob calculated_op_hash;
   if (!HashCalculator::RawHashOfBytes(
-          buffer_.data(), operation.data_length(), &calculated_op_hash)) {
-    LOG(ERROR) << "Unable to compute actual hash of operation "
-               << next_operation_num_;
+          data, operation.data_length(), &calculated_op_hash)) {
+    LOG(ERROR) << "Unable to compute actual hash of operation " << op_index;
     return ErrorCode::kDownloadOperationHashVerificationError;
   }
 
   if (calculated_op_hash != expected_op_hash) {
-    LOG(ERROR) << "Hash verification failed for operation "
-               << next_operation_num_
+    LOG(ERROR) << "Hash verification failed for operation " << op_index
                << ". Expected hash = " << HexEncode(expected_op_hash);
     LOG(ERROR) << "Calculated hash over " << operation.data_length()
                << " bytes at offset: " << operation.data_offset() << " = "
@@ -1331,10 +2395,9 @@ ErrorCode DeltaPerformer::VerifyPayload(
 
   // Verifies the payload hash.
   TEST_AND_RETURN_VAL(ErrorCode::kDownloadPayloadVerificationError,
-                      !payload_hash_calculator_.raw_hash().empty());
-  if (payload_hash_calculator_.raw_hash() != update_check_response_hash) {
-    LOG(ERROR) << "Actual hash: "
-               << HexEncode(payload_hash_calculator_.raw_hash())
+                      !payload_hasher_.payload_hash().empty());
+  if (payload_hasher_.payload_hash() != update_check_response_hash) {
+    LOG(ERROR) << "Actual hash: " << HexEncode(payload_hasher_.payload_hash())
                << ", expected hash: " << HexEncode(update_check_response_hash);
     return ErrorCode::kPayloadHashMismatchError;
   }
@@ -1352,7 +2415,7 @@ ErrorCode DeltaPerformer::VerifyPayload(
 
   TEST_AND_RETURN_VAL(ErrorCode::kSignedDeltaPayloadExpectedError,
                       !signatures_message_data_.empty());
-  brillo::Blob hash_data = signed_hash_calculator_.raw_hash();
+  brillo::Blob hash_data = payload_hasher_.signed_hash();
   TEST_AND_RETURN_VAL(ErrorCode::kDownloadPayloadPubKeyVerificationError,
                       hash_data.size() == kSHA256Size);
 
@@ -1369,23 +2432,52 @@ ErrorCode DeltaPerformer::VerifyPayload(
 
 void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
                                    size_t signed_hash_buffer_size) {
+  // A reused blob was counted and hashed when it was downloaded.
+  if (reused_data_) {
+    reused_data_.reset();
+    return;
+  }
+
   // Update the buffer offset.
   if (do_advance_offset)
-    buffer_offset_ += buffer_.size();
+    buffer_offset_ += OperationDataSize();
 
-  // Hash the content.
-  payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
-  signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  // Hash the content. The borrowed data is only valid during this Write()
+  // call, so it's copied, |buffer_| is handed over to the hasher instead.
+  if (borrowed_data_) {
+    payload_hasher_.Update(
+        borrowed_data_, borrowed_data_size_, signed_hash_buffer_size);
+  } else {
+    payload_hasher_.Update(std::make_shared<const brillo::Blob>(
+                               std::move(buffer_)),
+                           signed_hash_buffer_size);
+  }
+
+  borrowed_data_ = nullptr;
+  borrowed_data_size_ = 0;
 
   // Swap content with an empty vector to ensure that all memory is released.
   brillo::Blob().swap(buffer_);
 }
 
+std::shared_ptr<const brillo::Blob> DeltaPerformer::ReleaseBuffer() {
+  CHECK(borrowed_data_ == nullptr);
+  if (reused_data_) {
+    return std::move(reused_data_);
+  }
+  buffer_offset_ += buffer_.size();
+  auto data = std::make_shared<const brillo::Blob>(std::move(buffer_));
+  brillo::Blob().swap(buffer_);
+  payload_hasher_.Update(data, data->size());
+  return data;
+}
+
 bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
                                      const string& update_check_response_hash) {
   int64_t next_operation = kUpdateStateOperationInvalid;
   if (!(prefs->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) &&
-        next_operation != kUpdateStateOperationInvalid && next_operation > 0)) {
+        next_operation != kUpdateStateOperationInvalid &&
+        HasProgress(prefs, next_operation))) {
     LOG(WARNING) << "Failed to resume update " << kPrefsUpdateStateNextOperation
                  << " invalid: " << next_operation;
     return false;
@@ -1462,39 +2554,69 @@ bool DeltaPerformer::ResetUpdateProgress(
     prefs->SetString(kPrefsUpdateStateSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignedSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignatureBlob, "");
+    prefs->Delete(kPrefsUpdateStateOperationSHA256Context);
+    // The manifest used to be saved in prefs, it's in its own file now.
+    prefs->Delete(kPrefsManifestBytes);
+    prefs->Delete(kPrefsUpdateStatePartitionOperations);
     prefs->SetInt64(kPrefsManifestMetadataSize, -1);
     prefs->SetInt64(kPrefsManifestSignatureSize, -1);
     prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
     prefs->Delete(kPrefsPostInstallSucceeded);
     prefs->Delete(kPrefsVerityWritten);
+    prefs->Delete(kPrefsVerifyPartitionIndex);
+    prefs->Delete(kPrefsVerifyPartitionOffset);
+    prefs->Delete(kPrefsVerifySHA256Context);
     if (!skip_dynamic_partititon_metadata_updated) {
       LOG(INFO) << "Resetting recorded hash for prepared partitions.";
       prefs->Delete(kPrefsDynamicPartitionMetadataUpdated);
+      prefs->Delete(kPrefsDynamicPartitionMetadataSlots);
     }
   }
   return true;
 }
 
 bool DeltaPerformer::ShouldCheckpoint() {
-  base::TimeTicks curr_time = base::TimeTicks::Now();
-  if (curr_time > update_checkpoint_time_) {
-    update_checkpoint_time_ = curr_time + update_checkpoint_wait_;
-    return true;
-  }
-  return false;
+  return checkpoint_scheduler_.ShouldCheckpoint(base::TimeTicks::Now());
 }
 
 bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
   if (!force && !ShouldCheckpoint()) {
     return false;
   }
+  TRACE_SCOPE("DeltaPerformer::CheckpointUpdateProgress");
+  if (saved_manifest_.valid()) {
+    saved_manifest_.get();
+  }
+  // Pipelined operations may finish out of order, only operations before
+  // |next_operation_num_| being all applied makes the checkpoint valid. If one
+  // of them failed, keep the previous checkpoint.
+  ErrorCode pipeline_error = ErrorCode::kSuccess;
+  if (!WaitForInFlightOperations(&pipeline_error)) {
+    LOG(ERROR) << "Not checkpointing after failed operation: "
+               << utils::ErrorCodeToString(pipeline_error);
+    return false;
+  }
+  // Only the time spent persisting the state counts as the checkpoint's cost,
+  // waiting for the operations is part of applying them.
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  DEFER {
+    checkpoint_scheduler_.RecordCheckpoint(base::TimeTicks::Now() -
+                                           start_time);
+  };
   Terminator::set_exit_blocked(true);
+  if (!force && CheckpointToJournal()) {
+    return true;
+  }
   LOG_IF(WARNING, !prefs_->StartTransaction())
       << "unable to start transaction in checkpointing";
   DEFER {
     prefs_->CancelTransaction();
   };
-  if (last_updated_operation_num_ != next_operation_num_ || force) {
+  // Progress since the last prefs checkpoint may only be in the journal.
+  if (last_updated_operation_num_ != next_operation_num_ ||
+      prefs_checkpoint_operation_ !=
+          static_cast<int64_t>(next_operation_num_) ||
+      force) {
     if (!signatures_message_data_.empty()) {
       // Save the signature blob because if the update is interrupted after the
       // download phase we don't go through this path anymore. Some alternatives
@@ -1511,32 +2633,29 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
           << "Unable to store the signature blob.";
     }
     TEST_AND_RETURN_FALSE(prefs_->SetString(
-        kPrefsUpdateStateSHA256Context, payload_hash_calculator_.GetContext()));
+        kPrefsUpdateStateSHA256Context, payload_hasher_.GetPayloadContext()));
     TEST_AND_RETURN_FALSE(
         prefs_->SetString(kPrefsUpdateStateSignedSHA256Context,
-                          signed_hash_calculator_.GetContext()));
+                          payload_hasher_.GetSignedContext()));
     TEST_AND_RETURN_FALSE(
         prefs_->SetInt64(kPrefsUpdateStateNextDataOffset, buffer_offset_));
-    last_updated_operation_num_ = next_operation_num_;
-
-    if (next_operation_num_ < num_total_operations_) {
-      size_t partition_index = current_partition_;
-      while (next_operation_num_ >= acc_num_operations_[partition_index]) {
-        partition_index++;
-      }
-      const size_t partition_operation_num =
-          next_operation_num_ -
-          (partition_index ? acc_num_operations_[partition_index - 1] : 0);
-      const InstallOperation& op =
-          partitions_[partition_index].operations(partition_operation_num);
+    // A streamed operation is resumed from the part of its blob written so
+    // far, which is before |buffer_offset_|.
+    if (streamed_op_hasher_) {
       TEST_AND_RETURN_FALSE(
-          prefs_->SetInt64(kPrefsUpdateStateNextDataLength, op.data_length()));
-    } else {
+          prefs_->SetString(kPrefsUpdateStateOperationSHA256Context,
+                            streamed_op_hasher_->GetContext()));
+    } else if (prefs_->Exists(kPrefsUpdateStateOperationSHA256Context)) {
       TEST_AND_RETURN_FALSE(
-          prefs_->SetInt64(kPrefsUpdateStateNextDataLength, 0));
+          prefs_->Delete(kPrefsUpdateStateOperationSHA256Context));
     }
+    last_updated_operation_num_ = next_operation_num_;
+
+    TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataLength,
+                                           GetNextOperationDataLength()));
     if (partition_writer_) {
-      partition_writer_->CheckpointUpdateProgress(GetPartitionOperationNum());
+      TEST_AND_RETURN_FALSE(partition_writer_->CheckpointUpdateProgress(
+          GetPartitionOperationNum()));
     } else {
       CHECK_EQ(next_operation_num_, num_total_operations_)
           << "Partition writer is null, we are expected to finish all "
@@ -1548,16 +2667,384 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
       prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num_));
   if (!prefs_->SubmitTransaction()) {
     LOG(ERROR) << "Failed to submit transaction in checkpointing";
+    return true;
+  }
+  prefs_checkpoint_operation_ = next_operation_num_;
+  prefs_checkpoint_time_ = base::TimeTicks::Now() + prefs_checkpoint_wait_;
+  // The records extend the previous prefs checkpoint and are obsolete now.
+  if (journal_.IsOpen()) {
+    LOG_IF(WARNING, !journal_.Reset()) << "Unable to reset the journal.";
   }
   return true;
 }
 
+void DeltaPerformer::PersistCheckpointMetrics() {
+  const size_t num_checkpoints = checkpoint_scheduler_.num_checkpoints();
+  if (num_checkpoints == 0) {
+    return;
+  }
+  const int64_t duration_ms =
+      checkpoint_scheduler_.total_duration().InMilliseconds();
+  const int64_t max_duration_ms =
+      checkpoint_scheduler_.max_duration().InMilliseconds();
+  LOG(INFO) << "Wrote " << num_checkpoints << " checkpoints in "
+            << duration_ms << " ms, the slowest took " << max_duration_ms
+            << " ms. Checkpointing every "
+            << checkpoint_scheduler_.interval().InMilliseconds() << " ms.";
+  // Add to the values of previous payloads of this attempt, which are
+  // reported and cleared once the attempt finished.
+  int64_t previous_count = 0;
+  int64_t previous_duration_ms = 0;
+  int64_t previous_max_duration_ms = 0;
+  if (!prefs_->GetInt64(kPrefsCheckpointCount, &previous_count) ||
+      !prefs_->GetInt64(kPrefsCheckpointDurationMs, &previous_duration_ms) ||
+      !prefs_->GetInt64(kPrefsCheckpointMaxDurationMs,
+                        &previous_max_duration_ms)) {
+    previous_count = previous_duration_ms = previous_max_duration_ms = 0;
+  }
+  LOG_IF(WARNING,
+         !prefs_->SetInt64(kPrefsCheckpointCount,
+                           previous_count + num_checkpoints) ||
+             !prefs_->SetInt64(kPrefsCheckpointDurationMs,
+                               previous_duration_ms + duration_ms) ||
+             !prefs_->SetInt64(
+                 kPrefsCheckpointMaxDurationMs,
+                 std::max(previous_max_duration_ms, max_duration_ms)))
+      << "Unable to store the checkpoint metrics.";
+}
+
+bool DeltaPerformer::CheckpointToJournal() {
+  // The signature blob is only stored in prefs. An update is only resumed if
+  // prefs show progress past the first operation, so the first checkpoint
+  // after that always goes to prefs too.
+  if (!signatures_message_data_.empty() || prefs_checkpoint_operation_ <= 0 ||
+      partition_writer_ == nullptr ||
+      base::TimeTicks::Now() > prefs_checkpoint_time_ || !OpenJournal()) {
+    return false;
+  }
+  if (last_updated_operation_num_ == next_operation_num_) {
+    return true;
+  }
+  // Make the operations durable before recording them as done. If they can't
+  // be, the previous checkpoint stays, there's nothing to write to prefs.
+  if (!partition_writer_->CheckpointUpdateProgress(
+          GetPartitionOperationNum())) {
+    return true;
+  }
+  UpdateStateJournal::Checkpoint checkpoint;
+  checkpoint.next_operation = next_operation_num_;
+  checkpoint.next_data_offset = buffer_offset_;
+  checkpoint.next_data_length = GetNextOperationDataLength();
+  checkpoint.sha256_context = payload_hasher_.GetPayloadContext();
+  checkpoint.signed_sha256_context = payload_hasher_.GetSignedContext();
+  if (!journal_.Append(prefs_checkpoint_operation_, checkpoint)) {
+    LOG(WARNING) << "Unable to journal the checkpoint, writing prefs instead.";
+    return false;
+  }
+  last_updated_operation_num_ = next_operation_num_;
+  return true;
+}
+
+bool DeltaPerformer::OpenAppliedOperationCache() {
+  if (applied_operations_.IsOpen()) {
+    return true;
+  }
+  base::FilePath dir;
+  if (!install_plan_->reuse_applied_operations || hardware_ == nullptr ||
+      !hardware_->GetNonVolatileDirectory(&dir)) {
+    return false;
+  }
+  return applied_operations_.Open(
+      dir.Append(kAppliedOperationCacheFileName).value());
+}
+
+bool DeltaPerformer::IsOperationApplied(const InstallOperation& op) {
+  brillo::Blob dst_hash;
+  if (!applied_operations_.IsOpen() ||
+      !applied_operations_.Lookup(
+          partitions_[current_partition_].partition_name(), op, &dst_hash)) {
+    return false;
+  }
+  // Earlier operations may still be writing the destination. Failures are
+  // reported when the operation is applied instead.
+  ErrorCode error = ErrorCode::kSuccess;
+  if (partition_ops_in_flight_ && !WaitForInFlightOperations(&error)) {
+    return false;
+  }
+  return partition_writer_->IsOperationApplied(op, dst_hash);
+}
+
+bool DeltaPerformer::OpenPayloadHashCheckpoints() {
+  if (payload_hash_checkpoints_.IsOpen()) {
+    return true;
+  }
+  base::FilePath dir;
+  if (payload_->hash.size() < sizeof(int64_t) || hardware_ == nullptr ||
+      !hardware_->GetNonVolatileDirectory(&dir)) {
+    return false;
+  }
+  return payload_hash_checkpoints_.Open(
+      dir.Append(kPayloadHashCheckpointsFileName).value());
+}
+
+int64_t DeltaPerformer::PayloadHashCheckpointBase() const {
+  int64_t base = 0;
+  memcpy(&base, payload_->hash.data(), sizeof(base));
+  return base;
+}
+
+void DeltaPerformer::RecordPayloadHashCheckpoint() {
+  // Only useful along with the records of the applied operations.
+  if (!applied_operations_.IsOpen() ||
+      buffer_offset_ <
+          last_hash_checkpoint_offset_ + kPayloadHashCheckpointInterval ||
+      !OpenPayloadHashCheckpoints()) {
+    return;
+  }
+  UpdateStateJournal::Checkpoint checkpoint;
+  checkpoint.next_operation = next_operation_num_;
+  checkpoint.next_data_offset = buffer_offset_;
+  checkpoint.sha256_context = payload_hasher_.GetPayloadContext();
+  checkpoint.signed_sha256_context = payload_hasher_.GetSignedContext();
+  LOG_IF(WARNING,
+         !payload_hash_checkpoints_.Append(PayloadHashCheckpointBase(),
+                                           checkpoint))
+      << "Unable to record the payload hashes.";
+  last_hash_checkpoint_offset_ = buffer_offset_;
+}
+
+bool DeltaPerformer::IsOperationAppliedTo(const FileDescriptorPtr& target,
+                                          const string& partition_name,
+                                          const InstallOperation& op) {
+  brillo::Blob dst_hash;
+  brillo::Blob hash;
+  return applied_operations_.Lookup(partition_name, op, &dst_hash) &&
+         fd_utils::ReadAndHashExtents(
+             target, op.dst_extents(), block_size_, &hash) &&
+         hash == dst_hash;
+}
+
+bool DeltaPerformer::PlanDataFetch(
+    uint64_t min_skip_size, vector<std::pair<uint64_t, uint64_t>>* ranges) {
+  CHECK(manifest_valid_);
+  skipped_operations_.clear();
+  if (!payload_->size || !OpenAppliedOperationCache() ||
+      !OpenPayloadHashCheckpoints()) {
+    return false;
+  }
+  // The operations stored apart from the manifest aren't known before their
+  // partition is downloaded. Skipped blobs couldn't be used again later.
+  if (std::any_of(
+          partitions_.begin(), partitions_.end(), HasPendingOperations) ||
+      !reused_blobs_.empty()) {
+    return false;
+  }
+  // Runs of reused operations can only end where the hashes were recorded.
+  std::map<size_t, UpdateStateJournal::Checkpoint> checkpoints;
+  for (auto& checkpoint :
+       payload_hash_checkpoints_.ReadAll(PayloadHashCheckpointBase())) {
+    if (checkpoint.next_operation > 0 && checkpoint.next_data_offset >= 0) {
+      checkpoints[checkpoint.next_operation] = std::move(checkpoint);
+    }
+  }
+  if (checkpoints.empty()) {
+    return false;
+  }
+
+  auto dynamic_control = boot_control_->GetDynamicPartitionControl();
+  const size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  uint64_t data_offset = buffer_offset_;
+  for (size_t i = current_partition_; i < partitions_.size(); i++) {
+    const size_t first_op = i > 0 ? acc_num_operations_[i - 1] : 0;
+    const size_t end_op = acc_num_operations_[i];
+    if (next_operation_num_ >= end_op) {
+      continue;
+    }
+    const InstallPlan::Partition& install_part =
+        install_plan_->partitions[num_previous_partitions + i];
+    // Snapshot writers never record applied operations.
+    FileDescriptorPtr target;
+    if (!(dynamic_control && dynamic_control->UpdateUsesSnapshotCompression() &&
+          IsDynamicPartition(install_part.name, install_plan_->target_slot))) {
+      target = std::make_shared<EintrSafeFileDescriptor>();
+      if (!target->Open(install_part.target_path.c_str(), O_RDONLY)) {
+        target.reset();
+      }
+    }
+
+    // The run of reused operations starting at |run_start|, the data offsets
+    // its operations start at.
+    size_t run_start = std::max(first_op, next_operation_num_);
+    vector<uint64_t> run_offsets;
+    for (size_t op_num = run_start; op_num <= end_op; op_num++) {
+      run_offsets.push_back(data_offset);
+      bool applied = false;
+      if (op_num < end_op) {
+        const InstallOperation& op =
+            partitions_[i].operations(op_num - first_op);
+        if (op.data_length() > 0) {
+          // Payload data is laid out in operation order, the offsets of
+          // skipped data are derived from that.
+          if (op.data_offset() != data_offset) {
+            LOG(WARNING) << "Unexpected data offset of operation " << op_num
+                         << ", downloading all data.";
+            skipped_operations_.clear();
+            return false;
+          }
+          data_offset += op.data_length();
+        }
+        applied = target && IsOperationAppliedTo(
+                                target, partitions_[i].partition_name(), op);
+      }
+      if (applied) {
+        continue;
+      }
+      // The run ends before |op_num|, cut it back to the last recorded
+      // hashes within it.
+      auto checkpoint = checkpoints.upper_bound(op_num);
+      if (checkpoint != checkpoints.begin() &&
+          (--checkpoint)->first > run_start) {
+        const auto& hashes = checkpoint->second;
+        const uint64_t end_data_offset =
+            run_offsets[checkpoint->first - run_start];
+        if (static_cast<uint64_t>(hashes.next_data_offset) ==
+                end_data_offset &&
+            end_data_offset >= run_offsets.front() + min_skip_size) {
+          skipped_operations_.push_back({run_start,
+                                         checkpoint->first,
+                                         run_offsets.front(),
+                                         end_data_offset,
+                                         hashes.sha256_context,
+                                         hashes.signed_sha256_context});
+        }
+      }
+      run_start = op_num + 1;
+      run_offsets.clear();
+    }
+  }
+  if (skipped_operations_.empty()) {
+    return false;
+  }
+
+  // Everything around the skipped data is fetched, up to the end of the
+  // payload.
+  const uint64_t data_start = metadata_size_ + metadata_signature_size_;
+  uint64_t fetch_offset = data_start + buffer_offset_;
+  uint64_t skipped_size = 0;
+  ranges->clear();
+  for (const auto& skipped : skipped_operations_) {
+    const uint64_t skipped_offset = data_start + skipped.first_data_offset;
+    if (skipped_offset > fetch_offset) {
+      ranges->emplace_back(fetch_offset, skipped_offset - fetch_offset);
+    }
+    fetch_offset = data_start + skipped.end_data_offset;
+    skipped_size += skipped.end_data_offset - skipped.first_data_offset;
+  }
+  if (fetch_offset < payload_->size) {
+    ranges->emplace_back(fetch_offset, payload_->size - fetch_offset);
+  }
+  LOG(INFO) << "Skipping the download of " << skipped_size << " bytes of "
+            << skipped_operations_.size()
+            << " runs of operations applied by a previous attempt.";
+  return true;
+}
+
+bool DeltaPerformer::SkipPlannedOperations() {
+  const SkippedOperations skipped = std::move(skipped_operations_.front());
+  skipped_operations_.pop_front();
+  TEST_AND_RETURN_FALSE(buffer_offset_ == skipped.first_data_offset &&
+                        buffer_.empty());
+  // The data was hashed by the attempt which recorded these hashes.
+  TEST_AND_RETURN_FALSE(
+      payload_hasher_.SetPayloadContext(skipped.sha256_context));
+  TEST_AND_RETURN_FALSE(
+      payload_hasher_.SetSignedContext(skipped.signed_sha256_context));
+  const uint64_t skipped_size =
+      skipped.end_data_offset - skipped.first_data_offset;
+  buffer_offset_ = skipped.end_data_offset;
+  total_bytes_received_ += skipped_size;
+  num_reused_operations_ += skipped.end_operation - next_operation_num_;
+  next_operation_num_ = skipped.end_operation;
+  UpdateOverallProgress(false, "Completed ");
+  CheckpointUpdateProgress(false);
+  return true;
+}
+
+bool DeltaPerformer::OpenJournal() {
+  if (journal_.IsOpen()) {
+    return true;
+  }
+  base::FilePath dir;
+  if (hardware_ == nullptr || !hardware_->GetNonVolatileDirectory(&dir)) {
+    return false;
+  }
+  return journal_.Open(dir.Append(kUpdateStateJournalFileName).value());
+}
+
+uint64_t DeltaPerformer::GetNextOperationDataLength() {
+  if (next_operation_num_ >= num_total_operations_) {
+    return 0;
+  }
+  size_t partition_index = current_partition_;
+  while (next_operation_num_ >= acc_num_operations_[partition_index]) {
+    partition_index++;
+  }
+  // The next partition's operations may not be downloaded yet.
+  if (HasPendingOperations(partitions_[partition_index])) {
+    return 0;
+  }
+  const size_t partition_operation_num =
+      next_operation_num_ -
+      (partition_index ? acc_num_operations_[partition_index - 1] : 0);
+  return partitions_[partition_index]
+      .operations(partition_operation_num)
+      .data_length();
+}
+
+bool DeltaPerformer::RecoverJournalledCheckpoint() {
+  int64_t next_operation = kUpdateStateOperationInvalid;
+  if (!prefs_->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) ||
+      next_operation <= 0 || !OpenJournal()) {
+    return false;
+  }
+  const auto checkpoint = journal_.ReadLatest(next_operation);
+  if (!checkpoint || checkpoint->next_operation <= next_operation) {
+    return false;
+  }
+  LOG(INFO) << "Resuming from journalled operation "
+            << checkpoint->next_operation << " instead of " << next_operation;
+  TEST_AND_RETURN_FALSE(prefs_->StartTransaction());
+  DEFER {
+    prefs_->CancelTransaction();
+  };
+  TEST_AND_RETURN_FALSE(prefs_->SetString(kPrefsUpdateStateSHA256Context,
+                                          checkpoint->sha256_context));
+  TEST_AND_RETURN_FALSE(prefs_->SetString(
+      kPrefsUpdateStateSignedSHA256Context, checkpoint->signed_sha256_context));
+  TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataOffset,
+                                         checkpoint->next_data_offset));
+  TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataLength,
+                                         checkpoint->next_data_length));
+  TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextOperation,
+                                         checkpoint->next_operation));
+  // Journalled checkpoints are never in the middle of an operation.
+  if (prefs_->Exists(kPrefsUpdateStateOperationSHA256Context)) {
+    TEST_AND_RETURN_FALSE(
+        prefs_->Delete(kPrefsUpdateStateOperationSHA256Context));
+  }
+  TEST_AND_RETURN_FALSE(prefs_->SubmitTransaction());
+  LOG_IF(WARNING, !journal_.Reset()) << "Unable to reset the journal.";
+  return true;
+}
+
 bool DeltaPerformer::PrimeUpdateState() {
   CHECK(manifest_valid_);
 
   int64_t next_operation = kUpdateStateOperationInvalid;
   if (!prefs_->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) ||
-      next_operation == kUpdateStateOperationInvalid || next_operation <= 0) {
+      next_operation == kUpdateStateOperationInvalid ||
+      !HasProgress(prefs_, next_operation)) {
     // Initiating a new update, no more state needs to be initialized.
     return true;
   }
@@ -1576,7 +3063,7 @@ bool DeltaPerformer::PrimeUpdateState() {
   if (prefs_->GetString(kPrefsUpdateStateSignedSHA256Context,
                         &signed_hash_context)) {
     TEST_AND_RETURN_FALSE(
-        signed_hash_calculator_.SetContext(signed_hash_context));
+        payload_hasher_.SetSignedContext(signed_hash_context));
   }
 
   prefs_->GetString(kPrefsUpdateStateSignatureBlob, &signatures_message_data_);
@@ -1584,7 +3071,16 @@ bool DeltaPerformer::PrimeUpdateState() {
   string hash_context;
   TEST_AND_RETURN_FALSE(
       prefs_->GetString(kPrefsUpdateStateSHA256Context, &hash_context) &&
-      payload_hash_calculator_.SetContext(hash_context));
+      payload_hasher_.SetPayloadContext(hash_context));
+
+  // The next operation may be partially written already.
+  string operation_hash_context;
+  if (prefs_->GetString(kPrefsUpdateStateOperationSHA256Context,
+                        &operation_hash_context)) {
+    streamed_op_hasher_ = std::make_unique<HashCalculator>();
+    TEST_AND_RETURN_FALSE(
+        streamed_op_hasher_->SetContext(operation_hash_context));
+  }
 
   int64_t manifest_metadata_size = 0;
   TEST_AND_RETURN_FALSE(
@@ -19,24 +19,39 @@
 
 #include <inttypes.h>
 
+#include <deque>
+#include <future>
 #include <limits>
+#include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <base/files/file_path.h>
 #include <base/time/time.h>
 #include <brillo/secure_blob.h>
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_accounting.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/common/scoped_task_id.h"
+#include "update_engine/payload_consumer/applied_operation_cache.h"
+#include "update_engine/payload_consumer/checkpoint_scheduler.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/operation_dependency_graph.h"
+#include "update_engine/payload_consumer/operation_pipeline.h"
+#include "update_engine/payload_consumer/operation_timings.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
+#include "update_engine/payload_consumer/payload_hasher.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_consumer/update_state_journal.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -63,6 +78,7 @@ class DeltaPerformer : public FileWriter {
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
   static const uint64_t kCheckpointFrequencySeconds;
+  static const uint64_t kPrefsCheckpointFrequencySeconds;
 
   DeltaPerformer(
       PrefsInterface* prefs,
@@ -108,6 +124,37 @@ class DeltaPerformer : public FileWriter {
   // or -errno on error.
   int CloseCurrentPartition();
 
+  // Frees the operations of |partitions_| before |current_partition_|, which
+  // are never looked at again once the partitions are done.
+  void ReleaseFinishedPartitionOperations();
+
+  // Reads from |bytes_p| the operations of |current_partition_| if they are
+  // stored apart from the manifest, before its data blobs. Sets |loaded| once
+  // the partition has its operations, false if more data is needed.
+  bool LoadPartitionOperations(const char** bytes_p,
+                               size_t* count_p,
+                               bool* loaded,
+                               ErrorCode* error);
+
+  // When resuming inside a partition whose operations are stored apart from
+  // the manifest, loads them from where LoadPartitionOperations() kept them.
+  bool ResumePartitionOperations();
+
+  // Finds in |partitions_| the data blobs used by several operations, which
+  // are kept from their first use to their last. When resuming, loads the
+  // ones downloaded before from where CacheReusedBlob() saved them.
+  bool PlanReusedBlobs();
+
+  // Keeps the blob of the current operation if a later one uses it too.
+  void CacheReusedBlob(const InstallOperation& op);
+
+  // Points |reused_data_| at the blob of |op| if it's a blob downloaded
+  // earlier for another operation. Returns false if it has to be downloaded.
+  bool UseReusedBlob(const InstallOperation& op);
+
+  // Returns the file the reused blobs are saved in, empty if there's none.
+  base::FilePath ReusedBlobsPath() const;
+
   // Returns |true| only if the manifest has been processed and it's valid.
   bool IsManifestValid();
 
@@ -169,10 +216,34 @@ class DeltaPerformer : public FileWriter {
 
   // Checkpoints the update progress into persistent storage to allow this
   // update attempt to be resumed after reboot.
-  // If |force| is false, checkpoint may be throttled.
+  // If |force| is false, checkpoint may be throttled, and may be appended to
+  // the update state journal instead of being written to prefs.
   // Exposed for testing purposes.
   bool CheckpointUpdateProgress(bool force);
 
+  // Writes the progress journalled since the last checkpoint in prefs, if
+  // any, to prefs. Must be called before prefs are read to resume an update.
+  // Returns whether the prefs checkpoint was advanced.
+  bool RecoverJournalledCheckpoint();
+
+  // Returns the number of payload bytes received but not applied yet,
+  // including the data of the operations queued on worker threads.
+  size_t GetBufferedBytes() const;
+
+  // Sets |stats| to the state of the worker threads applying operations.
+  // Returns false if operations are applied on the calling thread.
+  bool GetPipelineStats(OperationPipeline::Stats* stats) const;
+
+  // Returns in |ranges| the (offset, length) pairs of the payload bytes a
+  // resumed update still needs, in order. Runs of operations whose target a
+  // previous attempt already wrote are left out if they span at least
+  // |min_skip_size| bytes and the payload hashes past them were recorded, the
+  // data of these operations is then never expected by Write(). Must be
+  // called once the manifest was parsed, before any data is written. Returns
+  // false if nothing can be left out.
+  bool PlanDataFetch(uint64_t min_skip_size,
+                     std::vector<std::pair<uint64_t, uint64_t>>* ranges);
+
   // Initialize partitions and allocate required space for an update with the
   // given |manifest|. |update_check_response_hash| is used to check if the
   // previous call to this function corresponds to the same payload.
@@ -192,6 +263,19 @@ class DeltaPerformer : public FileWriter {
       uint64_t* required_size,
       ErrorCode* error = nullptr);
 
+  // Returns the file the manifest of the payload being applied is saved in
+  // for a resumed update to load, empty if there's none.
+  static base::FilePath CachedManifestPath(HardwareInterface* hardware);
+
+  // Returns whether PreparePartitionsForUpdate() already prepared the
+  // partitions of |target_slot| for the payload |update_check_response_hash|
+  // from the current slot, in which case they're used as they are.
+  static bool ArePartitionsPrepared(
+      PrefsInterface* prefs,
+      BootControlInterface* boot_control,
+      BootControlInterface::Slot target_slot,
+      const std::string& update_check_response_hash);
+
  protected:
   // Exposed as virtual for testing purposes.
   virtual std::unique_ptr<PartitionWriterInterface> CreatePartitionWriter(
@@ -212,6 +296,9 @@ class DeltaPerformer : public FileWriter {
   FRIEND_TEST(DeltaPerformerTest, BrilloMetadataSignatureSizeTest);
   FRIEND_TEST(DeltaPerformerTest, BrilloParsePayloadMetadataTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
+  FRIEND_TEST(DeltaPerformerTest, ProcessOperationAsyncBadDataOffsetTest);
+  FRIEND_TEST(DeltaPerformerTest, ResumeAfterReleasingPartitionsTest);
+  FRIEND_TEST(DeltaPerformerTest, PlanDataFetchAfterReleasingPartitionsTest);
 
   // Obtain the operation index for current partition. If all operations for
   // current partition is are finished, return # of operations. This is mostly
@@ -251,8 +338,64 @@ class DeltaPerformer : public FileWriter {
                      ErrorCode* error,
                      bool* should_return);
 
+  // Sets up the update once the manifest is valid: prepares the partitions
+  // unless |prepare_partitions_task_| already did, finds the operations and
+  // primes the update state.
+  bool FinishParsingManifest(ErrorCode* error);
+
+  // Keeps the |count| bytes at |c_bytes| in |prepare_buffer_| until
+  // |prepare_partitions_task_| ran. Sets |*ready| once it did, running it
+  // right away once too much data piled up or the whole payload arrived.
+  void BufferWhilePreparingPartitions(const char* c_bytes,
+                                      size_t count,
+                                      bool* ready);
+
+  // Runs PreparePartitionsForUpdate() and keeps its result in
+  // |prepared_partitions_|.
+  void RunPreparePartitions();
+
   // Process one InstallOperation
   bool ProcessOperation(const InstallOperation* op, ErrorCode* error);
+
+  // Whether |op| can be handed to |op_pipeline_| instead of being applied by
+  // ProcessOperation().
+  bool ShouldPipelineOperation(const InstallOperation& op) const;
+
+  // Merges the destination of the run of ZERO or DISCARD operations starting
+  // at the next operation into |merged_op|, so that they are applied as a few
+  // large ranges instead of one operation after the other. Returns the number
+  // of operations |merged_op| covers, 0 if the next operation can't be merged.
+  size_t CoalesceZeroOrDiscardOperations(InstallOperation* merged_op);
+
+  // Verifies the data blob of |op| and queues it on |op_pipeline_|. The blob is
+  // moved out of |buffer_| and the payload hashes are updated right away, the
+  // operation itself may still be running after this returns. Returns false if
+  // |op| is invalid or an earlier pipelined operation failed.
+  bool ProcessOperationAsync(const InstallOperation* op, ErrorCode* error);
+
+  // Waits for all operations queued on |op_pipeline_|, then finishes and
+  // closes the partitions in |finishing_partitions_|. Returns false and sets
+  // |error| if any of that failed.
+  bool WaitForInFlightOperations(ErrorCode* error);
+
+  // Finishes and closes the current partition once all of its operations were
+  // handed out. Partitions with operations on |op_pipeline_| are moved to
+  // |finishing_partitions_| instead, so their last operations keep running
+  // while the next partition starts.
+  bool FinishCurrentPartition(ErrorCode* error);
+
+  // Starts hashing the partition |partition_name|, whose operations were all
+  // applied and which was closed, if the install plan asks for it.
+  void HashPartitionEarly(const std::string& partition_name);
+
+  // Logs the operation timings of the finished partition |partition_name|
+  // and passes them on to the download delegate.
+  void ReportOperationTimings(const std::string& partition_name,
+                              const OperationTimings* timings);
+
+  // Checks the result of ValidateOperationHash() for |op|, returns false if the
+  // operation must not be applied.
+  bool VerifyOperationData(const InstallOperation& op, ErrorCode* error);
   // Checks the integrity of the payload manifest. Returns true upon success,
   // false otherwise.
   ErrorCode ValidateManifest();
@@ -261,6 +404,11 @@ class DeltaPerformer : public FileWriter {
   // matches what's specified in the manifest in the payload.
   // Returns ErrorCode::kSuccess on match or a suitable error code otherwise.
   ErrorCode ValidateOperationHash(const InstallOperation& operation);
+  // Compares the hash of the data blob |data| of |operation|, the operation
+  // |op_index|, against the one in the manifest. Safe to call from any thread.
+  static ErrorCode CheckOperationHash(const InstallOperation& operation,
+                                      size_t op_index,
+                                      const uint8_t* data);
 
   // Returns true on success.
   bool PerformInstallOperation(const InstallOperation& operation);
@@ -272,6 +420,8 @@ class DeltaPerformer : public FileWriter {
   bool PerformZeroOrDiscardOperation(const InstallOperation& operation);
   bool PerformSourceCopyOperation(const InstallOperation& operation,
                                   ErrorCode* error = nullptr);
+  bool PerformPartitionCopyOperation(const InstallOperation& operation,
+                                     ErrorCode* error = nullptr);
   bool PerformDiffOperation(const InstallOperation& operation,
                             ErrorCode* error = nullptr);
 
@@ -287,6 +437,92 @@ class DeltaPerformer : public FileWriter {
   // accordingly.
   void DiscardBuffer(bool do_advance_offset, size_t signed_hash_buffer_size);
 
+  // Same as DiscardBuffer(true, buffer_.size()), but hands the content of
+  // |buffer_| over to the caller instead of deallocating it. The hasher keeps
+  // a reference to it until it's hashed.
+  std::shared_ptr<const brillo::Blob> ReleaseBuffer();
+
+  // If the whole data blob of |op| is at the start of the |*count_p| bytes at
+  // |*bytes_p|, points |borrowed_data_| at it and advances both past the blob.
+  // Returns false when the blob has to be copied into |buffer_| instead.
+  bool BorrowOperationData(const InstallOperation& op,
+                           const char** bytes_p,
+                           size_t* count_p);
+
+  // Whether |op| is a REPLACE operation with a blob large enough to be
+  // written as it's downloaded rather than once all of it arrived.
+  bool ShouldStreamOperation(const InstallOperation& op) const;
+
+  // Writes the blob of |op| from |*bytes_p| in chunks as they're complete,
+  // picking up after the part a previous call or attempt wrote already. The
+  // data hash of the operation is checked once the last chunk is written.
+  // Sets |applied| once the whole operation is.
+  bool StreamOperation(const InstallOperation& op,
+                       const char** bytes_p,
+                       size_t* count_p,
+                       bool* applied,
+                       ErrorCode* error);
+
+  // The data blob of the current operation, either reused from a previous
+  // operation, borrowed from the data passed to Write() or accumulated in
+  // |buffer_|.
+  const uint8_t* OperationData() const {
+    if (reused_data_)
+      return reused_data_->data();
+    return borrowed_data_ ? borrowed_data_ : buffer_.data();
+  }
+  size_t OperationDataSize() const {
+    if (reused_data_)
+      return reused_data_->size();
+    return borrowed_data_ ? borrowed_data_size_ : buffer_.size();
+  }
+
+  // Adds the number and cost of the checkpoints written so far to the ones
+  // stored in prefs, for the update attempter to report.
+  void PersistCheckpointMetrics();
+
+  // Appends a checkpoint to |journal_| if the prefs checkpoint is recent
+  // enough. Returns false if the checkpoint has to be written to prefs.
+  bool CheckpointToJournal();
+
+  // Opens |journal_| in the non-volatile directory, if not open yet.
+  bool OpenJournal();
+
+  // Opens |applied_operations_| in the non-volatile directory if enabled by
+  // InstallPlan::reuse_applied_operations and not open yet.
+  bool OpenAppliedOperationCache();
+
+  // Whether |op| was applied by a previous attempt and its destination still
+  // holds what it wrote, in which case it is skipped.
+  bool IsOperationApplied(const InstallOperation& op);
+
+  // Opens |payload_hash_checkpoints_| in the non-volatile directory if the
+  // payload hash is known and not open yet.
+  bool OpenPayloadHashCheckpoints();
+
+  // The records of |payload_hash_checkpoints_| belonging to this payload
+  // extend this value, derived from the payload hash.
+  int64_t PayloadHashCheckpointBase() const;
+
+  // Records the payload hashes after the data of the operations applied so
+  // far in |payload_hash_checkpoints_|, if enough data was received since the
+  // last record.
+  void RecordPayloadHashCheckpoint();
+
+  // Whether the destination of |op| of |partition_name|, read from |target|,
+  // holds what a previous attempt recorded in |applied_operations_|.
+  bool IsOperationAppliedTo(const FileDescriptorPtr& target,
+                            const std::string& partition_name,
+                            const InstallOperation& op);
+
+  // Skips the run of operations at the front of |skipped_operations_|, whose
+  // data was left out by PlanDataFetch().
+  bool SkipPlannedOperations();
+
+  // Returns the data length of operation |next_operation_num_|, 0 if all
+  // operations are done.
+  uint64_t GetNextOperationDataLength();
+
   // Primes the required update state. Returns true if the update state was
   // successfully initialized to a saved resume state or if the update is a new
   // update. Returns false otherwise.
@@ -347,6 +583,7 @@ class DeltaPerformer : public FileWriter {
   // Parsed manifest. Set after enough bytes to parse the manifest were
   // downloaded.
   DeltaArchiveManifest manifest_;
+  ScopedMemoryCharge manifest_memory_{MemoryConsumer::kManifest};
   bool manifest_parsed_{false};
   bool manifest_valid_{false};
   uint64_t metadata_size_{0};
@@ -381,6 +618,29 @@ class DeltaPerformer : public FileWriter {
   brillo::Blob buffer_;
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_{0};
+  // Data blob of the current operation when it arrived in a single Write()
+  // call and is used in place, |buffer_| is empty then. Only valid until that
+  // Write() returns.
+  const uint8_t* borrowed_data_{nullptr};
+  size_t borrowed_data_size_{0};
+  // Data blob of the current operation when it's a blob downloaded before for
+  // another operation. It doesn't count towards |buffer_offset_| again.
+  std::shared_ptr<const brillo::Blob> reused_data_;
+  // Hash of the part of the blob of the current operation written so far, if
+  // it's streamed. |buffer_offset_| is past that part.
+  std::unique_ptr<HashCalculator> streamed_op_hasher_;
+
+  // A data blob used by several operations, by its data offset.
+  struct ReusedBlob {
+    uint64_t length{0};
+    std::string sha256_hash;
+    // The first and last operations using it.
+    size_t first_operation{0};
+    size_t last_operation{0};
+    // The blob, once downloaded.
+    std::shared_ptr<const brillo::Blob> data;
+  };
+  std::map<uint64_t, ReusedBlob> reused_blobs_;
 
   // Last |next_operation_num_| value updated as part of the progress update.
   uint64_t last_updated_operation_num_{std::numeric_limits<uint64_t>::max()};
@@ -388,13 +648,11 @@ class DeltaPerformer : public FileWriter {
   // The block size (parsed from the manifest).
   uint32_t block_size_{0};
 
-  // Calculates the whole payload file hash, including headers and signatures.
-  HashCalculator payload_hash_calculator_;
-
-  // Calculates the hash of the portion of the payload signed by the payload
-  // signature. This hash skips the metadata signature portion, located after
+  // Calculates the whole payload file hash, including headers and signatures,
+  // and the hash of the portion of the payload signed by the payload
+  // signature. The latter skips the metadata signature portion, located after
   // the metadata and doesn't include the payload signature itself.
-  HashCalculator signed_hash_calculator_;
+  PayloadHasher payload_hasher_;
 
   // Signatures message blob extracted directly from the payload.
   std::string signatures_message_data_;
@@ -426,14 +684,98 @@ class DeltaPerformer : public FileWriter {
       base::TimeDelta::FromSeconds(kProgressLogTimeoutSeconds)};
   base::TimeTicks forced_progress_log_time_;
 
-  // The frequency that we should write an update checkpoint (constant), and
-  // the point in time at which the next checkpoint should be written.
-  const base::TimeDelta update_checkpoint_wait_{
+  // Decides when to write the next update checkpoint, starting with one every
+  // kCheckpointFrequencySeconds until their cost was measured.
+  CheckpointScheduler checkpoint_scheduler_{
       base::TimeDelta::FromSeconds(kCheckpointFrequencySeconds)};
-  base::TimeTicks update_checkpoint_time_;
+
+  // Checkpoints in between are appended to |journal_|, which takes a single
+  // write instead of a prefs transaction.
+  const base::TimeDelta prefs_checkpoint_wait_{
+      base::TimeDelta::FromSeconds(kPrefsCheckpointFrequencySeconds)};
+  base::TimeTicks prefs_checkpoint_time_;
+  // Next operation of the last checkpoint written to prefs, -1 if none.
+  int64_t prefs_checkpoint_operation_{-1};
+  UpdateStateJournal journal_;
+
+  // What the operations applied by this and previous attempts wrote, see
+  // InstallPlan::reuse_applied_operations.
+  AppliedOperationCache applied_operations_;
+  size_t num_reused_operations_{0};
+
+  // The payload hashes every now and then while applying operations, so
+  // that a later attempt can skip downloading the data of operations it
+  // reuses. Records are keyed by PayloadHashCheckpointBase().
+  UpdateStateJournal payload_hash_checkpoints_;
+  // Data offset of the last record in |payload_hash_checkpoints_|.
+  uint64_t last_hash_checkpoint_offset_{0};
+
+  // A run of operations PlanDataFetch() left the data out for, along with
+  // the payload hashes past it.
+  struct SkippedOperations {
+    size_t first_operation;
+    size_t end_operation;
+    uint64_t first_data_offset;
+    uint64_t end_data_offset;
+    std::string sha256_context;
+    std::string signed_sha256_context;
+  };
+  std::deque<SkippedOperations> skipped_operations_;
 
   std::unique_ptr<PartitionWriterInterface> partition_writer_;
 
+  // Dependencies between the operations of the current partition, only built
+  // when |op_pipeline_| is used.
+  std::unique_ptr<OperationDependencyGraph> operation_graph_;
+
+  // Whether operations of the current partition were queued on |op_pipeline_|
+  // since it was last drained.
+  bool partition_ops_in_flight_{false};
+
+  // Partitions whose operations were all handed out but may still be running
+  // on |op_pipeline_|. They are finished by WaitForInFlightOperations(), at
+  // the latest at the next checkpoint.
+  struct FinishingPartition {
+    std::string name;
+    std::unique_ptr<PartitionWriterInterface> writer;
+    std::unique_ptr<OperationDependencyGraph> graph;
+    std::unique_ptr<OperationTimings> timings;
+  };
+  std::vector<FinishingPartition> finishing_partitions_;
+
+  // How long the operations of the current partition took, reported once the
+  // partition is finished.
+  std::unique_ptr<OperationTimings> operation_timings_;
+
+  // Applies operations on worker threads when InstallPlan::apply_threads is
+  // greater than one. Declared after the writers so that in-flight operations
+  // finish before the writers are destroyed.
+  std::unique_ptr<OperationPipeline> op_pipeline_;
+
+  // Payload data received while the partitions are being prepared.
+  brillo::Blob prepare_buffer_;
+
+  // When InstallPlan::prepare_partitions_async is set, the partitions are
+  // prepared by a task posted on the main loop once the manifest is valid,
+  // so that the payload data following it keeps being received meanwhile.
+  // The preparation stays on the main loop, like every other user of the
+  // DynamicPartitionControlInterface. |preparing_partitions_| is set from
+  // then until the result in |prepared_partitions_| is collected.
+  struct PreparePartitionsResult {
+    bool success{false};
+    uint64_t required_size{0};
+    ErrorCode error{ErrorCode::kSuccess};
+  };
+  bool preparing_partitions_{false};
+  ScopedTaskId prepare_partitions_task_;
+  std::optional<PreparePartitionsResult> prepared_partitions_;
+
+  // Saves the metadata in |buffer_| to CachedManifestPath() in the background.
+  void SaveManifest();
+  // Set while SaveManifest() writes the file. The progress of the update is
+  // only recorded once it's done, as a resumed update may load it.
+  std::future<void> saved_manifest_;
+
   DISALLOW_COPY_AND_ASSIGN(DeltaPerformer);
 };
 
@@ -30,6 +30,7 @@
 #include <base/files/file_util.h>
 #include <base/files/scoped_temp_dir.h>
 #include <android-base/stringprintf.h>
+#include <brillo/message_loops/fake_message_loop.h>
 #include <brillo/secure_blob.h>
 #include <gmock/gmock.h>
 #include <google/protobuf/repeated_field.h>
@@ -49,6 +50,7 @@
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/payload_generator/payload_signer.h"
@@ -206,6 +208,8 @@ class DeltaPerformerTest : public ::testing::Test {
     PayloadGenerationConfig config;
     config.version.major = major_version;
     config.version.minor = minor_version;
+    config.split_partition_operations = split_partition_operations_;
+    config.dedup_blobs = dedup_blobs_;
 
     PayloadFile payload;
     EXPECT_TRUE(payload.Init(config));
@@ -248,6 +252,61 @@ class DeltaPerformerTest : public ::testing::Test {
     return payload_data;
   }
 
+  // Generates an unsigned full payload of |partitions|, each given with its
+  // name and operations. |blob_data| holds the blobs of all the operations.
+  brillo::Blob GenerateMultiPartitionPayload(
+      const brillo::Blob& blob_data,
+      const vector<std::pair<string, vector<AnnotatedOperation>>>&
+          partitions) {
+    ScopedTempFile blob_file("Blob-XXXXXX");
+    EXPECT_TRUE(test_utils::WriteFileVector(blob_file.path(), blob_data));
+
+    PayloadGenerationConfig config;
+    config.version.major = kBrilloMajorPayloadVersion;
+    config.version.minor = kFullPayloadMinorVersion;
+    config.dedup_blobs = dedup_blobs_;
+
+    PayloadFile payload;
+    EXPECT_TRUE(payload.Init(config));
+    for (const auto& [name, aops] : partitions) {
+      uint64_t num_blocks = 0;
+      for (const AnnotatedOperation& aop : aops) {
+        for (const Extent& extent : aop.op.dst_extents()) {
+          num_blocks = std::max(num_blocks,
+                                extent.start_block() + extent.num_blocks());
+        }
+      }
+      PartitionConfig new_part(name);
+      new_part.path = "/dev/zero";
+      new_part.size = num_blocks * 4096;
+      EXPECT_TRUE(
+          payload.AddPartition(PartitionConfig(name), new_part, aops, {}, {}));
+    }
+
+    ScopedTempFile payload_file("Payload-XXXXXX");
+    EXPECT_TRUE(payload.WritePayload(
+        payload_file.path(), blob_file.path(), "", &payload_.metadata_size));
+
+    brillo::Blob payload_data;
+    EXPECT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+    return payload_data;
+  }
+
+  // Points the target devices of the partitions in |names| to new empty files,
+  // returned in the same order, and their source devices to /dev/null.
+  vector<std::unique_ptr<ScopedTempFile>> CreateTargetPartitions(
+      const vector<string>& names) {
+    vector<std::unique_ptr<ScopedTempFile>> targets;
+    for (const string& name : names) {
+      targets.push_back(std::make_unique<ScopedTempFile>("Partition-XXXXXX"));
+      fake_boot_control_.SetPartitionDevice(
+          name, install_plan_.target_slot, targets.back()->path());
+      fake_boot_control_.SetPartitionDevice(
+          name, install_plan_.source_slot, "/dev/null");
+    }
+    return targets;
+  }
+
   brillo::Blob GenerateSourceCopyPayload(const brillo::Blob& copied_data,
                                          bool add_hash,
                                          PartitionConfig* old_part = nullptr) {
@@ -287,13 +346,15 @@ class DeltaPerformerTest : public ::testing::Test {
   // Apply the payload provided in |payload_data| reading from the |source_path|
   // file and writing the contents to a new partition. The existing data in the
   // new target file are set to |target_data| before applying the payload.
-  // Expect result of performer_.Write() to be |expect_success|.
+  // Expect result of performer_.Write() to be |expect_success|. The payload is
+  // passed in chunks of |chunk_size| bytes if set, all at once otherwise.
   // Returns the result of the payload application.
   brillo::Blob ApplyPayloadToData(DeltaPerformer* delta_performer,
                                   const brillo::Blob& payload_data,
                                   const string& source_path,
                                   const brillo::Blob& target_data,
-                                  bool expect_success) {
+                                  bool expect_success,
+                                  size_t chunk_size = 0) {
     ScopedTempFile new_part("Partition-XXXXXX");
     EXPECT_TRUE(test_utils::WriteFileVector(new_part.path(), target_data));
 
@@ -309,8 +370,17 @@ class DeltaPerformerTest : public ::testing::Test {
     fake_boot_control_.SetPartitionDevice(
         kPartitionNameKernel, install_plan_.source_slot, "/dev/null");
 
-    EXPECT_EQ(expect_success,
-              delta_performer->Write(payload_data.data(), payload_data.size()));
+    if (chunk_size == 0) {
+      chunk_size = payload_data.size();
+    }
+    bool success = true;
+    for (size_t offset = 0; success && offset < payload_data.size();
+         offset += chunk_size) {
+      success = delta_performer->Write(
+          payload_data.data() + offset,
+          std::min(chunk_size, payload_data.size() - offset));
+    }
+    EXPECT_EQ(expect_success, success);
     EXPECT_EQ(0, performer_.Close());
 
     brillo::Blob partition_data;
@@ -426,6 +496,10 @@ class DeltaPerformerTest : public ::testing::Test {
   }
 
   FakePrefs prefs_;
+  // Whether GeneratePayload() stores the operations apart from the manifest.
+  bool split_partition_operations_{false};
+  // Whether GeneratePayload() stores identical blobs once.
+  bool dedup_blobs_{false};
   InstallPlan install_plan_;
   InstallPlan::Payload payload_;
   FakeBootControl fake_boot_control_;
@@ -464,6 +538,71 @@ TEST_F(DeltaPerformerTest, FullPayloadWriteTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, SplitOperationsPayloadWriteTest) {
+  split_partition_operations_ = true;
+  payload_.type = InstallPayloadType::kFull;
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096);  // block size
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+
+  brillo::Blob payload_data =
+      GeneratePayload(expected_data,
+                      aops,
+                      false,
+                      kBrilloMajorPayloadVersion,
+                      kSplitManifestMinorPayloadVersion);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, DedupBlobsPayloadWriteTest) {
+  payload_.type = InstallPayloadType::kFull;
+  brillo::Blob block(std::begin(kRandomString), std::end(kRandomString));
+  block.resize(4096);  // block size
+  // Three blocks, the first and last ones identical.
+  brillo::Blob expected_data = block;
+  expected_data.resize(2 * 4096, 'x');
+  expected_data.insert(expected_data.end(), block.begin(), block.end());
+  vector<AnnotatedOperation> aops;
+  for (uint64_t i = 0; i < 3; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  const brillo::Blob full_payload = GeneratePayload(expected_data,
+                                                    aops,
+                                                    false,
+                                                    kBrilloMajorPayloadVersion,
+                                                    kFullPayloadMinorVersion);
+  dedup_blobs_ = true;
+  const brillo::Blob payload_data = GeneratePayload(expected_data,
+                                                    aops,
+                                                    false,
+                                                    kBrilloMajorPayloadVersion,
+                                                    kFullPayloadMinorVersion);
+  EXPECT_EQ(full_payload.size() - 4096, payload_data.size());
+
+  // The blobs come in pieces, so the shared one is copied once downloaded.
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(&performer_,
+                               payload_data,
+                               "/dev/null",
+                               brillo::Blob(),
+                               true,
+                               1000));
+}
+
 TEST_F(DeltaPerformerTest, ShouldCancelTest) {
   payload_.type = InstallPayloadType::kFull;
   brillo::Blob expected_data =
@@ -508,6 +647,434 @@ TEST_F(DeltaPerformerTest, ReplaceOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+// Operations applied concurrently on an in-place partition wait for the earlier
+// ones writing the blocks they read, and reading the blocks they write.
+TEST_F(DeltaPerformerTest, InPlaceConcurrentOperationsTest) {
+  install_plan_.apply_threads = 4;
+  constexpr size_t kNumBlocks = 4;
+  brillo::Blob data;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    data.insert(data.end(), kBlockSize, 'a' + i);
+  }
+  ScopedTempFile partition("Partition-XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(partition.path(), data));
+
+  const brillo::Blob blob_data = brillo::CombineBlobs(
+      {brillo::Blob(kBlockSize, 'x'), brillo::Blob(kBlockSize, 'y')});
+  vector<AnnotatedOperation> aops(4);
+  // Block 1 is copied from block 0 after it was replaced.
+  aops[0].op.set_type(InstallOperation::REPLACE);
+  *aops[0].op.add_dst_extents() = ExtentForRange(0, 1);
+  aops[0].op.set_data_offset(0);
+  aops[0].op.set_data_length(kBlockSize);
+  aops[1].op.set_type(InstallOperation::SOURCE_COPY);
+  *aops[1].op.add_src_extents() = ExtentForRange(0, 1);
+  *aops[1].op.add_dst_extents() = ExtentForRange(1, 1);
+  // Block 2 is copied from block 3 before it is replaced.
+  aops[2].op.set_type(InstallOperation::SOURCE_COPY);
+  *aops[2].op.add_src_extents() = ExtentForRange(3, 1);
+  *aops[2].op.add_dst_extents() = ExtentForRange(2, 1);
+  aops[3].op.set_type(InstallOperation::REPLACE);
+  *aops[3].op.add_dst_extents() = ExtentForRange(3, 1);
+  aops[3].op.set_data_offset(kBlockSize);
+  aops[3].op.set_data_length(kBlockSize);
+
+  PartitionConfig old_part(kPartitionNameRoot);
+  old_part.path = partition.path();
+  old_part.size = data.size();
+  const brillo::Blob payload_data =
+      GeneratePayload(blob_data, aops, false, &old_part);
+
+  payload_.size = payload_data.size();
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, partition.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.source_slot, partition.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+  EXPECT_TRUE(performer_.Write(payload_data.data(), payload_data.size()));
+  EXPECT_EQ(0, performer_.Close());
+
+  const brillo::Blob expected_data =
+      brillo::CombineBlobs({brillo::Blob(2 * kBlockSize, 'x'),
+                            brillo::Blob(kBlockSize, 'd'),
+                            brillo::Blob(kBlockSize, 'y')});
+  brillo::Blob partition_data;
+  ASSERT_TRUE(utils::ReadFile(partition.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
+// An operation whose blob isn't the one received is rejected before it's
+// queued, with the error ProcessOperation() reports.
+TEST_F(DeltaPerformerTest, ProcessOperationAsyncBadDataOffsetTest) {
+  performer_.buffer_ = brillo::Blob(kBlockSize, 'x');
+  InstallOperation op;
+  op.set_type(InstallOperation::REPLACE);
+  *op.add_dst_extents() = ExtentForRange(0, 1);
+  // The received blob is at offset 0.
+  op.set_data_offset(kBlockSize);
+  op.set_data_length(kBlockSize);
+  // The hash is checked by the task, which never runs.
+  brillo::Blob hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(performer_.buffer_, &hash));
+  op.set_data_sha256_hash(hash.data(), hash.size());
+
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_FALSE(performer_.ProcessOperationAsync(&op, &error));
+  EXPECT_EQ(ErrorCode::kDownloadOperationExecutionError, error);
+  // The blob wasn't released.
+  EXPECT_EQ(kBlockSize, performer_.buffer_.size());
+}
+
+TEST_F(DeltaPerformerTest, ReplaceOperationChunkedWriteTest) {
+  // Blobs split across Write() calls are buffered, blobs received in one piece
+  // are applied in place. Both must yield the same result.
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096 * 3);
+  for (size_t i = 0; i < expected_data.size(); i++) {
+    expected_data[i] ^= static_cast<uint8_t>(i / 7);
+  }
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 3; block++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+    aop.op.set_data_offset(block * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(&performer_,
+                               payload_data,
+                               "/dev/null",
+                               brillo::Blob(),
+                               true,
+                               5000));
+}
+
+TEST_F(DeltaPerformerTest, StreamedReplaceOperationResumeTest) {
+  // A large REPLACE operation is written as its blob arrives. Once
+  // interrupted, it's resumed from the last part written with the rest of its
+  // blob only.
+  brillo::Blob expected_data(16 * 1024 * 1024 + 4096);
+  for (size_t i = 0; i < expected_data.size(); i++) {
+    expected_data[i] = static_cast<uint8_t>(i + i / 4096);
+  }
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, expected_data.size() / 4096);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, false);
+  const size_t data_start = payload_.metadata_size;
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  payload_.size = payload_data.size();
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.source_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+
+  // The first two chunks of 2 MiB are written, the rest is discarded.
+  const size_t received = 5 * 1024 * 1024;
+  ASSERT_TRUE(performer_.Write(payload_data.data(), data_start + received));
+  EXPECT_NE(0, performer_.Close());
+  int64_t next_data_offset = -1;
+  ASSERT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset));
+  EXPECT_EQ(4 * 1024 * 1024, next_data_offset);
+  EXPECT_TRUE(prefs_.Exists(kPrefsUpdateStateOperationSHA256Context));
+  const std::string payload_id = "12345";
+  prefs_.SetString(kPrefsUpdateCheckResponseHash, payload_id);
+  ASSERT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs_, payload_id));
+
+  DeltaPerformer resumed_performer{&prefs_,
+                                   &fake_boot_control_,
+                                   &fake_hardware_,
+                                   &mock_delegate_,
+                                   &install_plan_,
+                                   &payload_,
+                                   false /* interactive */,
+                                   "" /* Update certs path */};
+  ASSERT_TRUE(resumed_performer.Write(payload_data.data(), data_start));
+  ASSERT_TRUE(
+      resumed_performer.Write(payload_data.data() + data_start +
+                                  next_data_offset,
+                              payload_data.size() - data_start -
+                                  next_data_offset));
+  EXPECT_EQ(0, resumed_performer.Close());
+  EXPECT_FALSE(prefs_.Exists(kPrefsUpdateStateOperationSHA256Context));
+
+  brillo::Blob partition_data;
+  ASSERT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
+TEST_F(DeltaPerformerTest, ResumeAfterReleasingPartitionsTest) {
+  // The operations of the partitions before the resumed one are released once
+  // the manifest is parsed, the blob the first partition shares with the last
+  // one is still used.
+  base::ScopedTempDir non_volatile_dir;
+  ASSERT_TRUE(non_volatile_dir.CreateUniqueTempDir());
+  fake_hardware_.SetNonVolatileDirectory(non_volatile_dir.GetPath());
+  payload_.type = InstallPayloadType::kFull;
+  dedup_blobs_ = true;
+  const vector<string> names = {"system", "vendor", "product"};
+  brillo::Blob blob_data;
+  vector<brillo::Blob> expected_data(names.size());
+  vector<std::pair<string, vector<AnnotatedOperation>>> partitions;
+  for (size_t i = 0; i < names.size(); i++) {
+    vector<AnnotatedOperation> aops;
+    for (uint64_t block = 0; block < 4; block++) {
+      brillo::Blob data(4096, static_cast<uint8_t>('a' + 4 * i + block));
+      if (i + 1 == names.size() && block == 3) {
+        data = brillo::Blob(expected_data[0].begin(),
+                            expected_data[0].begin() + 4096);
+      }
+      AnnotatedOperation aop;
+      *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+      aop.op.set_data_offset(blob_data.size());
+      aop.op.set_data_length(data.size());
+      aop.op.set_type(InstallOperation::REPLACE);
+      aops.push_back(aop);
+      blob_data.insert(blob_data.end(), data.begin(), data.end());
+      expected_data[i].insert(expected_data[i].end(), data.begin(), data.end());
+    }
+    partitions.emplace_back(names[i], aops);
+  }
+  const brillo::Blob payload_data =
+      GenerateMultiPartitionPayload(blob_data, partitions);
+  const size_t data_start = payload_.metadata_size;
+  ASSERT_EQ(data_start + 11 * 4096, payload_data.size());
+  payload_.size = payload_data.size();
+  const auto targets = CreateTargetPartitions(names);
+
+  // Interrupted after the second operation of the second partition.
+  const size_t received = 6 * 4096;
+  ASSERT_TRUE(performer_.Write(payload_data.data(), data_start + received));
+  EXPECT_EQ(1u, performer_.current_partition_);
+  EXPECT_EQ(0, performer_.partitions_[0].operations_size());
+  ASSERT_EQ(1u, performer_.reused_blobs_.count(0));
+  EXPECT_TRUE(performer_.reused_blobs_.at(0).data);
+  EXPECT_EQ(0, performer_.Close());
+  int64_t next_data_offset = -1;
+  ASSERT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset));
+  EXPECT_EQ(static_cast<int64_t>(received), next_data_offset);
+  const string payload_id = "12345";
+  prefs_.SetString(kPrefsUpdateCheckResponseHash, payload_id);
+  ASSERT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs_, payload_id));
+
+  install_plan_.partitions.clear();
+  DeltaPerformer resumed_performer{&prefs_,
+                                   &fake_boot_control_,
+                                   &fake_hardware_,
+                                   &mock_delegate_,
+                                   &install_plan_,
+                                   &payload_,
+                                   false /* interactive */,
+                                   "" /* Update certs path */};
+  ASSERT_TRUE(resumed_performer.Write(payload_data.data(), data_start));
+  EXPECT_EQ(1u, resumed_performer.current_partition_);
+  EXPECT_EQ(0, resumed_performer.partitions_[0].operations_size());
+  EXPECT_EQ(4, resumed_performer.partitions_[1].operations_size());
+  // Loaded from where the interrupted attempt saved it.
+  ASSERT_EQ(1u, resumed_performer.reused_blobs_.count(0));
+  EXPECT_TRUE(resumed_performer.reused_blobs_.at(0).data);
+  ASSERT_TRUE(resumed_performer.Write(
+      payload_data.data() + data_start + next_data_offset,
+      payload_data.size() - data_start - next_data_offset));
+  EXPECT_EQ(0, resumed_performer.Close());
+
+  for (size_t i = 0; i < names.size(); i++) {
+    brillo::Blob partition_data;
+    ASSERT_TRUE(utils::ReadFile(targets[i]->path(), &partition_data));
+    EXPECT_EQ(expected_data[i], partition_data) << names[i];
+  }
+}
+
+TEST_F(DeltaPerformerTest, PlanDataFetchAfterReleasingPartitionsTest) {
+  // The data a resumed update still needs is planned from the resumed
+  // partition on, without the released operations of the ones before it.
+  base::ScopedTempDir non_volatile_dir;
+  ASSERT_TRUE(non_volatile_dir.CreateUniqueTempDir());
+  fake_hardware_.SetNonVolatileDirectory(non_volatile_dir.GetPath());
+  payload_.type = InstallPayloadType::kFull;
+  install_plan_.reuse_applied_operations = true;
+  constexpr size_t kOpSize = 1024 * 1024;
+  const vector<string> names = {"system", "vendor", "product"};
+  const vector<size_t> num_ops = {4, 12, 4};
+  brillo::Blob blob_data;
+  vector<brillo::Blob> expected_data(names.size());
+  vector<std::pair<string, vector<AnnotatedOperation>>> partitions;
+  for (size_t i = 0; i < names.size(); i++) {
+    vector<AnnotatedOperation> aops;
+    for (size_t op = 0; op < num_ops[i]; op++) {
+      const size_t begin = blob_data.size();
+      AnnotatedOperation aop;
+      *(aop.op.add_dst_extents()) =
+          ExtentForRange(op * kOpSize / 4096, kOpSize / 4096);
+      aop.op.set_data_offset(begin);
+      aop.op.set_data_length(kOpSize);
+      aop.op.set_type(InstallOperation::REPLACE);
+      aops.push_back(aop);
+      for (size_t j = begin; j < begin + kOpSize; j++) {
+        blob_data.push_back(static_cast<uint8_t>(j + j / 4096));
+      }
+      expected_data[i].insert(
+          expected_data[i].end(), blob_data.begin() + begin, blob_data.end());
+    }
+    partitions.emplace_back(names[i], aops);
+  }
+  const brillo::Blob payload_data =
+      GenerateMultiPartitionPayload(blob_data, partitions);
+  const size_t data_start = payload_.metadata_size;
+  payload_.size = payload_data.size();
+  ASSERT_TRUE(HashCalculator::RawHashOfData(payload_data, &payload_.hash));
+  const auto targets = CreateTargetPartitions(names);
+
+  // Interrupted in the second partition, before any payload hashes were
+  // recorded.
+  ASSERT_TRUE(performer_.Write(payload_data.data(), data_start + 5 * kOpSize));
+  EXPECT_EQ(0, performer_.Close());
+  const string payload_id = "12345";
+  prefs_.SetString(kPrefsUpdateCheckResponseHash, payload_id);
+  ASSERT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs_, payload_id));
+
+  // An attempt which started over applied all but the last operation,
+  // recording the payload hashes after 8 and 16 MiB of data. Its progress
+  // isn't resumed from.
+  {
+    FakePrefs other_prefs;
+    install_plan_.partitions.clear();
+    DeltaPerformer other_performer{&other_prefs,
+                                   &fake_boot_control_,
+                                   &fake_hardware_,
+                                   &mock_delegate_,
+                                   &install_plan_,
+                                   &payload_,
+                                   false /* interactive */,
+                                   "" /* Update certs path */};
+    ASSERT_TRUE(other_performer.Write(payload_data.data(),
+                                      data_start + 19 * kOpSize));
+    EXPECT_EQ(0, other_performer.Close());
+  }
+
+  install_plan_.partitions.clear();
+  DeltaPerformer resumed_performer{&prefs_,
+                                   &fake_boot_control_,
+                                   &fake_hardware_,
+                                   &mock_delegate_,
+                                   &install_plan_,
+                                   &payload_,
+                                   false /* interactive */,
+                                   "" /* Update certs path */};
+  ASSERT_TRUE(resumed_performer.Write(payload_data.data(), data_start));
+  EXPECT_EQ(1u, resumed_performer.current_partition_);
+  EXPECT_EQ(0, resumed_performer.partitions_[0].operations_size());
+  // The rest of the second partition is applied already, the third one only
+  // up to where no hashes were recorded.
+  vector<std::pair<uint64_t, uint64_t>> ranges;
+  ASSERT_TRUE(resumed_performer.PlanDataFetch(kOpSize, &ranges));
+  const uint64_t fetch_offset = data_start + 16 * kOpSize;
+  EXPECT_EQ((vector<std::pair<uint64_t, uint64_t>>{
+                {fetch_offset, payload_data.size() - fetch_offset}}),
+            ranges);
+  ASSERT_TRUE(resumed_performer.Write(payload_data.data() + fetch_offset,
+                                      payload_data.size() - fetch_offset));
+  EXPECT_EQ(0, resumed_performer.Close());
+
+  for (size_t i = 0; i < names.size(); i++) {
+    brillo::Blob partition_data;
+    ASSERT_TRUE(utils::ReadFile(targets[i]->path(), &partition_data));
+    EXPECT_EQ(expected_data[i], partition_data) << names[i];
+  }
+}
+
+TEST_F(DeltaPerformerTest, PreparePartitionsAsyncTest) {
+  // Data received before the main loop prepared the partitions is applied once
+  // that's done, right away when the payload is complete.
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  install_plan_.prepare_partitions_async = true;
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096 * 3);
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 3; block++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+    aop.op.set_data_offset(block * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(&performer_,
+                               payload_data,
+                               "/dev/null",
+                               brillo::Blob(),
+                               true,
+                               3000));
+}
+
+TEST_F(DeltaPerformerTest, PreparePartitionsOnMainLoopTest) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  install_plan_.prepare_partitions_async = true;
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096 * 2);
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 2; block++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+    aop.op.set_data_offset(block * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  payload_.size = payload_data.size();
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.source_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+
+  // The data following the manifest waits for the posted preparation.
+  const size_t first = payload_data.size() - 4096;
+  ASSERT_TRUE(performer_.Write(payload_data.data(), first));
+  EXPECT_GT(performer_.GetBufferedBytes(), 0u);
+  EXPECT_TRUE(loop.PendingTasks());
+  loop.RunOnce(false);
+  EXPECT_TRUE(performer_.Write(payload_data.data() + first,
+                               payload_data.size() - first));
+  EXPECT_EQ(0, performer_.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
 TEST_F(DeltaPerformerTest, ReplaceBzOperationTest) {
   brillo::Blob expected_data =
       brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
@@ -570,6 +1137,37 @@ TEST_F(DeltaPerformerTest, ZeroOperationTest) {
             ApplyPayloadToData(payload_data, "/dev/null", existing_data, true));
 }
 
+TEST_F(DeltaPerformerTest, ZeroOperationsAreCoalescedTest) {
+  brillo::Blob existing_data = brillo::Blob(4096 * 10, 'a');
+  brillo::Blob replace_data = brillo::Blob(4096, 'b');
+  // Blocks 4, 6 and 8 are zeroed, block 5 is zeroed and then replaced.
+  brillo::Blob expected_data = existing_data;
+  std::fill(
+      expected_data.data() + 4096 * 4, expected_data.data() + 4096 * 7, 0);
+  std::fill(
+      expected_data.data() + 4096 * 8, expected_data.data() + 4096 * 9, 0);
+  std::copy(replace_data.begin(),
+            replace_data.end(),
+            expected_data.data() + 4096 * 5);
+
+  vector<AnnotatedOperation> aops(4);
+  aops[0].op.set_type(InstallOperation::ZERO);
+  *(aops[0].op.add_dst_extents()) = ExtentForRange(5, 2);
+  aops[1].op.set_type(InstallOperation::ZERO);
+  *(aops[1].op.add_dst_extents()) = ExtentForRange(4, 1);
+  aops[2].op.set_type(InstallOperation::REPLACE);
+  *(aops[2].op.add_dst_extents()) = ExtentForRange(5, 1);
+  aops[2].op.set_data_offset(0);
+  aops[2].op.set_data_length(replace_data.size());
+  aops[3].op.set_type(InstallOperation::ZERO);
+  *(aops[3].op.add_dst_extents()) = ExtentForRange(8, 1);
+
+  brillo::Blob payload_data = GeneratePayload(replace_data, aops, false);
+
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(payload_data, "/dev/null", existing_data, true));
+}
+
 TEST_F(DeltaPerformerTest, SourceCopyOperationTest) {
   brillo::Blob expected_data(std::begin(kRandomString),
                              std::end(kRandomString));
@@ -1108,6 +1706,58 @@ TEST_F(DeltaPerformerTest, FullPayloadCanResumeTest) {
   ASSERT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs_, payload_id));
 }
 
+TEST_F(DeltaPerformerTest, CachedManifestTest) {
+  // The manifest is saved for a resumed update to load.
+  base::ScopedTempDir non_volatile_dir;
+  ASSERT_TRUE(non_volatile_dir.CreateUniqueTempDir());
+  fake_hardware_.SetNonVolatileDirectory(non_volatile_dir.GetPath());
+  brillo::Blob expected_data(std::begin(kRandomString),
+                             std::end(kRandomString));
+  expected_data.resize(4096);  // block size
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, false);
+
+  ASSERT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  const base::FilePath path =
+      DeltaPerformer::CachedManifestPath(&fake_hardware_);
+  string cached_manifest;
+  ASSERT_TRUE(utils::ReadFile(path.value(), &cached_manifest));
+  EXPECT_EQ(string(payload_data.begin(),
+                   payload_data.begin() + payload_.metadata_size),
+            cached_manifest);
+}
+
+TEST_F(DeltaPerformerTest, ArePartitionsPreparedTest) {
+  const std::string payload_id = "12345";
+  DeltaArchiveManifest manifest;
+  fake_boot_control_.SetCurrentSlot(0);
+  EXPECT_FALSE(DeltaPerformer::ArePartitionsPrepared(
+      &prefs_, &fake_boot_control_, 1, payload_id));
+  ASSERT_TRUE(DeltaPerformer::PreparePartitionsForUpdate(
+      &prefs_, &fake_boot_control_, 1, manifest, payload_id, nullptr));
+  EXPECT_TRUE(DeltaPerformer::ArePartitionsPrepared(
+      &prefs_, &fake_boot_control_, 1, payload_id));
+
+  // Not for another payload, nor once booted from the other slot.
+  EXPECT_FALSE(DeltaPerformer::ArePartitionsPrepared(
+      &prefs_, &fake_boot_control_, 1, "67890"));
+  EXPECT_FALSE(DeltaPerformer::ArePartitionsPrepared(
+      &prefs_, &fake_boot_control_, 1, ""));
+  fake_boot_control_.SetCurrentSlot(1);
+  EXPECT_FALSE(DeltaPerformer::ArePartitionsPrepared(
+      &prefs_, &fake_boot_control_, 0, payload_id));
+
+  // Nor once the progress was reset.
+  fake_boot_control_.SetCurrentSlot(0);
+  ASSERT_TRUE(DeltaPerformer::ResetUpdateProgress(&prefs_, false));
+  EXPECT_FALSE(DeltaPerformer::ArePartitionsPrepared(
+      &prefs_, &fake_boot_control_, 1, payload_id));
+}
+
 class TestDeltaPerformer : public DeltaPerformer {
  public:
   using DeltaPerformer::DeltaPerformer;
@@ -1174,7 +1824,10 @@ TEST_F(DeltaPerformerTest, SetNextOpIndex) {
   std::vector<size_t> indices;
   EXPECT_CALL(writer1, CheckpointUpdateProgress(_))
       .WillRepeatedly(
-          [&indices](size_t index) mutable { indices.emplace_back(index); });
+          [&indices](size_t index) mutable {
+            indices.emplace_back(index);
+            return true;
+          });
   EXPECT_CALL(writer1, Init(_, true, _)).Times(1).WillOnce(Return(true));
   EXPECT_CALL(writer1, PerformSourceCopyOperation(_, _))
       .Times(2)
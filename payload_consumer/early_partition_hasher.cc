@@ -0,0 +1,130 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/early_partition_hasher.h"
+
+#include <fcntl.h>
+
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/partition_fd_cache.h"
+
+namespace chromeos_update_engine {
+
+EarlyPartitionHasher* EarlyPartitionHasher::GetInstance() {
+  static EarlyPartitionHasher instance;
+  return &instance;
+}
+
+EarlyPartitionHasher::~EarlyPartitionHasher() {
+  // The hashers call back into this object until they're stopped.
+  Reset();
+}
+
+bool EarlyPartitionHasher::CanHashEarly(
+    const InstallPlan& install_plan, const InstallPlan::Partition& partition) {
+  // Virtual A/B compressed partitions have no writable target path, they
+  // can only be read once the snapshots are mapped for verification.
+  if (partition.target_size == 0 || partition.target_path.empty()) {
+    return false;
+  }
+  // The verity data is written during the verification.
+  if (install_plan.write_verity &&
+      (partition.hash_tree_size > 0 || partition.fec_size > 0)) {
+    return false;
+  }
+  // Those are verified segment by segment instead.
+  return !install_plan.verify_segments ||
+         partition.target_segment_hashes.empty();
+}
+
+void EarlyPartitionHasher::PartitionWritten(
+    const InstallPlan::Partition& partition) {
+  auto fd = PartitionFdCache::GetInstance()->Open(partition.target_path,
+                                                  O_RDONLY);
+  if (!fd) {
+    PLOG(WARNING) << "Unable to open " << partition.target_path
+                  << ", not hashing it early";
+    return;
+  }
+  LOG(INFO) << "Hashing partition " << partition.name << " on device "
+            << partition.target_path << " while applying the update";
+  auto hasher = std::make_unique<PartitionHasher>(std::move(fd),
+                                                  partition.target_size,
+                                                  kMinReadSize,
+                                                  kMaxReadSize,
+                                                  0,
+                                                  nullptr);
+  hasher->set_done_callback([this]() { HasherDone(); });
+  std::unique_ptr<PartitionHasher> replaced;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = hashers_[partition.target_path];
+    replaced = std::move(entry.hasher);
+    entry = {partition.target_size, std::move(hasher)};
+    StartWaiting();
+  }
+  // Stopping a hasher waits for its threads, don't hold the lock for it.
+  replaced.reset();
+}
+
+std::unique_ptr<PartitionHasher> EarlyPartitionHasher::Take(
+    const std::string& path, uint64_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = hashers_.find(path);
+  if (it == hashers_.end() || it->second.size != size) {
+    return nullptr;
+  }
+  auto hasher = std::move(it->second.hasher);
+  hashers_.erase(it);
+  StartWaiting();
+  return hasher;
+}
+
+void EarlyPartitionHasher::Reset() {
+  std::map<std::string, Entry> hashers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    hashers.swap(hashers_);
+  }
+}
+
+void EarlyPartitionHasher::HasherDone() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  StartWaiting();
+}
+
+void EarlyPartitionHasher::StartWaiting() {
+  size_t running = 0;
+  for (const auto& [path, entry] : hashers_) {
+    if (entry.hasher->started() && !entry.hasher->done()) {
+      running++;
+    }
+  }
+  for (auto& [path, entry] : hashers_) {
+    if (running >= kMaxRunning) {
+      break;
+    }
+    if (!entry.hasher->started()) {
+      entry.hasher->Start();
+      running++;
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
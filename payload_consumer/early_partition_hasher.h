@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_EARLY_PARTITION_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_EARLY_PARTITION_HASHER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <base/macros.h>
+
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/partition_hasher.h"
+
+namespace chromeos_update_engine {
+
+// Hashes the target partitions DeltaPerformer finished writing while the rest
+// of the payload is still applied, so FilesystemVerifierAction only has to
+// pick up the hashes. At most kMaxRunning partitions are hashed at once, the
+// others wait for their turn. Safe to use from multiple threads.
+class EarlyPartitionHasher {
+ public:
+  static constexpr size_t kMaxRunning = 2;
+  static constexpr size_t kMinReadSize = 1024 * 1024;      // 1 MiB
+  static constexpr size_t kMaxReadSize = 8 * 1024 * 1024;  // 8 MiB
+
+  // The hasher of the update in progress.
+  static EarlyPartitionHasher* GetInstance();
+
+  EarlyPartitionHasher() = default;
+  ~EarlyPartitionHasher();
+
+  // Whether FilesystemVerifierAction can use the hash of |partition| of
+  // |install_plan| once it's written: the whole partition is hashed and
+  // nothing writes to it after the operations.
+  static bool CanHashEarly(const InstallPlan& install_plan,
+                           const InstallPlan::Partition& partition);
+
+  // Starts hashing |partition|, whose operations were all applied. Replaces
+  // the hash of an earlier attempt at it.
+  void PartitionWritten(const InstallPlan::Partition& partition);
+
+  // Returns the hasher of the partition on |path| of |size| bytes, started or
+  // not, and forgets it. Returns nullptr if there's none.
+  std::unique_ptr<PartitionHasher> Take(const std::string& path,
+                                        uint64_t size);
+
+  // Stops and drops all hashers.
+  void Reset();
+
+ private:
+  friend class EarlyPartitionHasherTest;
+
+  // Starts the waiting hashers within kMaxRunning. |mutex_| must be held.
+  void StartWaiting();
+  // Called on the thread of a hasher once it's done, starts the next ones.
+  void HasherDone();
+
+  struct Entry {
+    uint64_t size;
+    std::unique_ptr<PartitionHasher> hasher;
+  };
+
+  mutable std::mutex mutex_;
+  // The hashers by the path of their partition.
+  std::map<std::string, Entry> hashers_;
+
+  DISALLOW_COPY_AND_ASSIGN(EarlyPartitionHasher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EARLY_PARTITION_HASHER_H_
@@ -0,0 +1,173 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/early_partition_hasher.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_storage_file_descriptor.h"
+#include "update_engine/payload_consumer/partition_fd_cache.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Holds the reads back until |released| is set.
+class GatedFileDescriptor : public FakeStorageFileDescriptor {
+ public:
+  GatedFileDescriptor(FileDescriptorPtr fd,
+                      FakeStorage* storage,
+                      const std::atomic<bool>* released)
+      : FakeStorageFileDescriptor(std::move(fd), storage),
+        released_(released) {}
+
+  bool ReadAt(const std::vector<IoRequest>& requests) override {
+    while (!*released_) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return FakeStorageFileDescriptor::ReadAt(requests);
+  }
+
+ private:
+  const std::atomic<bool>* released_;
+};
+}  // namespace
+
+class EarlyPartitionHasherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(3 * 1024 * 1024 + 4096);
+    test_utils::FillWithData(&data_);
+    ASSERT_TRUE(test_utils::WriteFileVector(file_.path(), data_));
+    partition_.name = "system";
+    partition_.target_path = file_.path();
+    partition_.target_size = data_.size();
+  }
+
+  void TearDown() override {
+    hasher_.Reset();
+    PartitionFdCache::GetInstance()->Clear();
+    PartitionFdCache::GetInstance()->SetWrapper(nullptr);
+  }
+
+  // Whether the hasher of the partition on |path| was started.
+  bool IsStarted(const std::string& path) {
+    std::lock_guard<std::mutex> lock(hasher_.mutex_);
+    return hasher_.hashers_.at(path).hasher->started();
+  }
+
+  ScopedTempFile file_{"early_partition_hasher.XXXXXX"};
+  brillo::Blob data_;
+  InstallPlan install_plan_;
+  InstallPlan::Partition partition_;
+  EarlyPartitionHasher hasher_;
+};
+
+TEST_F(EarlyPartitionHasherTest, CanHashEarly) {
+  EXPECT_TRUE(EarlyPartitionHasher::CanHashEarly(install_plan_, partition_));
+
+  // Verity data is only written during the verification.
+  partition_.hash_tree_size = 4096;
+  EXPECT_TRUE(EarlyPartitionHasher::CanHashEarly(install_plan_, partition_));
+  install_plan_.write_verity = true;
+  EXPECT_FALSE(EarlyPartitionHasher::CanHashEarly(install_plan_, partition_));
+  partition_.hash_tree_size = 0;
+
+  install_plan_.verify_segments = true;
+  partition_.target_segment_hashes.push_back({});
+  EXPECT_FALSE(EarlyPartitionHasher::CanHashEarly(install_plan_, partition_));
+  partition_.target_segment_hashes.clear();
+
+  // Like the snapshots of Virtual A/B compression.
+  partition_.target_path.clear();
+  EXPECT_FALSE(EarlyPartitionHasher::CanHashEarly(install_plan_, partition_));
+}
+
+TEST_F(EarlyPartitionHasherTest, HashesWrittenPartition) {
+  hasher_.PartitionWritten(partition_);
+  // Only the hasher of the same partition is handed out.
+  EXPECT_EQ(nullptr, hasher_.Take(file_.path(), data_.size() - 4096));
+  auto hasher = hasher_.Take(file_.path(), data_.size());
+  ASSERT_NE(nullptr, hasher);
+  EXPECT_EQ(nullptr, hasher_.Take(file_.path(), data_.size()));
+
+  ASSERT_TRUE(hasher->started());
+  while (!hasher->done()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  brillo::Blob expected;
+  ASSERT_TRUE(
+      HashCalculator::RawHashOfBytes(data_.data(), data_.size(), &expected));
+  ASSERT_TRUE(hasher->succeeded());
+  EXPECT_EQ(expected, hasher->hash());
+}
+
+TEST_F(EarlyPartitionHasherTest, StartsWaitingPartitionOnceOneIsDone) {
+  FakeStorage storage{StorageModel()};
+  std::atomic<bool> released{false};
+  PartitionFdCache::GetInstance()->SetWrapper(
+      [&storage, &released](FileDescriptorPtr fd) -> FileDescriptorPtr {
+        return std::make_shared<GatedFileDescriptor>(
+            std::move(fd), &storage, &released);
+      });
+  // The hashers read through |released| and |storage| until they stop.
+  DEFER {
+    released = true;
+    hasher_.Reset();
+  };
+
+  std::vector<std::unique_ptr<ScopedTempFile>> files;
+  std::vector<InstallPlan::Partition> partitions;
+  for (size_t i = 0; i <= EarlyPartitionHasher::kMaxRunning; i++) {
+    files.push_back(
+        std::make_unique<ScopedTempFile>("early_partition_hasher.XXXXXX"));
+    ASSERT_TRUE(test_utils::WriteFileVector(files.back()->path(), data_));
+    InstallPlan::Partition partition = partition_;
+    partition.name = "system" + std::to_string(i);
+    partition.target_path = files.back()->path();
+    partitions.push_back(partition);
+    hasher_.PartitionWritten(partition);
+  }
+  const std::string& last_path = partitions.back().target_path;
+  EXPECT_FALSE(IsStarted(last_path));
+
+  // Nothing else is written nor taken, the hashers that are done start it.
+  released = true;
+  while (!IsStarted(last_path)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  auto hasher = hasher_.Take(last_path, data_.size());
+  ASSERT_NE(nullptr, hasher);
+  while (!hasher->done()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  brillo::Blob expected;
+  ASSERT_TRUE(
+      HashCalculator::RawHashOfBytes(data_.data(), data_.size(), &expected));
+  ASSERT_TRUE(hasher->succeeded());
+  EXPECT_EQ(expected, hasher->hash());
+}
+
+}  // namespace chromeos_update_engine
@@ -17,7 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_MAP_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_MAP_H_
 
-#include <map>
+#include <algorithm>
+#include <optional>
 #include <utility>
 #include <vector>
 
@@ -32,48 +33,78 @@ namespace chromeos_update_engine {
 // Currently the only usecase is for VABCPartitionWriter to keep track of which
 // block belongs to which merge operation. Therefore this class only contains
 // the minimal set of functions needed.
-template <typename T, typename Comparator = ExtentLess>
+//
+// The entries are kept in a vector sorted by start block, so lookups are a
+// binary search over contiguous memory. Adding extents in increasing order or
+// through the bulk constructor is cheap, adding them out of order moves the
+// entries after them.
+template <typename T>
 class ExtentMap {
  public:
+  ExtentMap() = default;
+
+  // Builds the map from |entries| in one go. Entries overlapping one that
+  // starts before them are dropped.
+  explicit ExtentMap(std::vector<std::pair<Extent, T>> entries) {
+    std::stable_sort(entries.begin(),
+                     entries.end(),
+                     [](const auto& a, const auto& b) {
+                       return a.first.start_block() < b.first.start_block();
+                     });
+    entries_.reserve(entries.size());
+    for (auto& [extent, value] : entries) {
+      if (extent.num_blocks() == 0) {
+        continue;
+      }
+      if (!entries_.empty() && entries_.back().end > extent.start_block()) {
+        LOG(WARNING) << "Dropping " << extent
+                     << " overlapping another extent of the map";
+        continue;
+      }
+      entries_.push_back({extent.start_block(),
+                          extent.start_block() + extent.num_blocks(),
+                          std::move(value)});
+    }
+  }
+
   bool AddExtent(const Extent& extent, T&& value) {
-    if (set_.OverlapsWithExtent(extent)) {
+    if (extent.num_blocks() == 0) {
       return false;
     }
-    const auto& [it, inserted] = map_.insert({extent, std::forward<T>(value)});
-    if (inserted) {
-      set_.AddExtent(extent);
+    const uint64_t end = extent.start_block() + extent.num_blocks();
+    // First entry ending after |extent| starts, the only one it can overlap
+    // with since the entries are disjoint.
+    const auto it = FirstEndingAfter(extent.start_block());
+    if (it != entries_.end() && it->start < end) {
+      return false;
     }
-    return inserted;
+    entries_.insert(it, {extent.start_block(), end, std::forward<T>(value)});
+    return true;
   }
 
-  size_t size() const { return map_.size(); }
+  size_t size() const { return entries_.size(); }
 
   // Return a pointer to entry which is intersecting |extent|. If T is already
   // a pointer type, return T on success. This function always return
   // |nullptr| on failure. Therefore you cannot store nullptr as an entry.
   std::optional<T> Get(const Extent& extent) const {
-    const auto it = map_.find(extent);
-    if (it == map_.end()) {
-      for (const auto& ext : set_.GetCandidateRange(extent)) {
-        // Sometimes there are operations like
-        // map.AddExtent({0, 5}, 42);
-        // map.Get({2, 1})
-        // If the querying extent is completely covered within the key, we still
-        // consdier this to be a valid query.
-
-        if (ExtentContains(ext, extent)) {
-          return map_.at(ext);
-        }
-        if (ExtentRanges::ExtentsOverlap(ext, extent)) {
-          LOG(WARNING) << "Looking up a partially intersecting extent isn't "
-                          "supported by "
-                          "this data structure. Querying extent: "
-                       << extent << ", partial match in map: " << ext;
-        }
-      }
+    const auto it = FirstEndingAfter(extent.start_block());
+    if (it == entries_.end() || it->start > extent.start_block()) {
       return {};
     }
-    return {it->second};
+    const Extent ext = ExtentForRange(it->start, it->end - it->start);
+    // Sometimes there are operations like
+    // map.AddExtent({0, 5}, 42);
+    // map.Get({2, 1})
+    // If the querying extent is completely covered within the key, we still
+    // consdier this to be a valid query.
+    if (ExtentContains(ext, extent)) {
+      return {it->value};
+    }
+    LOG(WARNING) << "Looking up a partially intersecting extent isn't "
+                    "supported by this data structure. Querying extent: "
+                 << extent << ", partial match in map: " << ext;
+    return {};
   }
 
   // Return a set of extents that are contained in this extent map.
@@ -86,19 +117,56 @@ class ExtentMap {
   // E.g. extent map contains [0,5] and [10,15], GetIntersectingExtents([3, 12])
   // would return [3,5] and [10,12]
   std::vector<Extent> GetIntersectingExtents(const Extent& extent) const {
-    return set_.GetIntersectingExtents(extent);
+    std::vector<Extent> result;
+    const uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    for (auto it = FirstEndingAfter(start);
+         it != entries_.end() && it->start < end;
+         ++it) {
+      const uint64_t begin = std::max(it->start, start);
+      result.push_back(ExtentForRange(begin, std::min(it->end, end) - begin));
+    }
+    return result;
   }
 
   // Complement of |GetIntersectingExtents|, return vector of extents which are
   // part of |extent| but not covered by this map.
   std::vector<Extent> GetNonIntersectingExtents(const Extent& extent) const {
-    return FilterExtentRanges({extent}, set_);
+    std::vector<Extent> result;
+    uint64_t next = extent.start_block();
+    const uint64_t end = next + extent.num_blocks();
+    for (auto it = FirstEndingAfter(next);
+         it != entries_.end() && it->start < end;
+         ++it) {
+      if (it->start > next) {
+        result.push_back(ExtentForRange(next, it->start - next));
+      }
+      next = it->end;
+    }
+    if (next < end) {
+      result.push_back(ExtentForRange(next, end - next));
+    }
+    return result;
   }
 
  private:
-  // Get a range of exents that potentially intersect with parameter |extent|
-  std::map<Extent, T, Comparator> map_;
-  ExtentRanges set_{false};
+  struct Entry {
+    uint64_t start;
+    uint64_t end;
+    T value;
+  };
+  using Iterator = typename std::vector<Entry>::const_iterator;
+
+  Iterator FirstEndingAfter(uint64_t block) const {
+    return std::upper_bound(
+        entries_.begin(),
+        entries_.end(),
+        block,
+        [](uint64_t b, const Entry& entry) { return b < entry.end; });
+  }
+
+  // Disjoint, sorted by |start|.
+  std::vector<Entry> entries_;
 };
 }  // namespace chromeos_update_engine
 
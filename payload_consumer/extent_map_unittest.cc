@@ -158,4 +158,31 @@ TEST_F(ExtentMapTest, GetTouchingExtents) {
   ASSERT_EQ(extents[1], ExtentForRange(10, 5));
 }
 
+TEST_F(ExtentMapTest, AddOutOfOrder) {
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(20, 5), 3));
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(0, 5), 1));
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(10, 5), 2));
+  ASSERT_FALSE(map_.AddExtent(ExtentForRange(4, 2), 4));
+  ASSERT_FALSE(map_.AddExtent(ExtentForRange(12, 10), 4));
+  ASSERT_EQ(map_.size(), 3U);
+  ASSERT_EQ(map_.Get(ExtentForRange(0, 5)), 1);
+  ASSERT_EQ(map_.Get(ExtentForRange(11, 2)), 2);
+  ASSERT_EQ(map_.Get(ExtentForRange(24, 1)), 3);
+}
+
+TEST_F(ExtentMapTest, BulkConstruction) {
+  ExtentMap<int> map({{ExtentForRange(10, 5), 2},
+                      {ExtentForRange(0, 5), 1},
+                      {ExtentForRange(12, 2), 4},
+                      {ExtentForRange(20, 5), 3}});
+  ASSERT_EQ(map.size(), 3U);
+  ASSERT_EQ(map.Get(ExtentForRange(2, 2)), 1);
+  ASSERT_EQ(map.Get(ExtentForRange(12, 2)), 2);
+  ASSERT_EQ(map.Get(ExtentForRange(20, 5)), 3);
+  ASSERT_EQ(map.GetNonIntersectingExtents(ExtentForRange(0, 30)),
+            (std::vector<Extent>{ExtentForRange(5, 5),
+                                 ExtentForRange(15, 5),
+                                 ExtentForRange(25, 5)}));
+}
+
 }  // namespace chromeos_update_engine
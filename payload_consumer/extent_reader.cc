@@ -18,10 +18,13 @@
 
 #include <algorithm>
 
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "update_engine/common/tracing.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/operation_timings.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 
 using google::protobuf::RepeatedPtrField;
@@ -67,24 +70,20 @@ bool DirectExtentReader::Seek(uint64_t offset) {
 bool DirectExtentReader::Read(void* buffer, size_t count) {
   auto bytes = reinterpret_cast<uint8_t*>(buffer);
   uint64_t bytes_read = 0;
+  // Collect the pieces of all extents covered by this read, so descriptors
+  // that can keep several reads in flight get all of them at once.
+  std::vector<FileDescriptor::IoRequest> requests;
   while (bytes_read < count) {
-    if (cur_extent_ == extents_.end()) {
-      TEST_AND_RETURN_FALSE(bytes_read == count);
-    }
+    TEST_AND_RETURN_FALSE(cur_extent_ != extents_.end());
     uint64_t cur_extent_bytes_left =
         cur_extent_->num_blocks() * block_size_ - cur_extent_bytes_read_;
     uint64_t bytes_to_read =
         std::min(count - bytes_read, cur_extent_bytes_left);
 
-    ssize_t out_bytes_read;
-    TEST_AND_RETURN_FALSE(utils::ReadAll(
-        fd_,
-        bytes + bytes_read,
-        bytes_to_read,
-        cur_extent_->start_block() * block_size_ + cur_extent_bytes_read_,
-        &out_bytes_read));
-    TEST_AND_RETURN_FALSE(out_bytes_read ==
-                          static_cast<ssize_t>(bytes_to_read));
+    requests.push_back(
+        {bytes + bytes_read,
+         bytes_to_read,
+         cur_extent_->start_block() * block_size_ + cur_extent_bytes_read_});
 
     bytes_read += bytes_to_read;
     cur_extent_bytes_read_ += bytes_to_read;
@@ -95,6 +94,56 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
       cur_extent_bytes_read_ = 0;
     }
   }
+  // Prefer positional reads so readers sharing |fd_| across threads don't
+  // race on the file offset, see FileDescriptor::ReadAt().
+  OperationTimings::ScopedPhase phase(OperationTimings::Phase::kRead);
+  TRACE_SCOPE("ExtentReader read");
+  return fd_->ReadAt(requests);
+}
+
+bool BufferedExtentReader::Init(FileDescriptorPtr fd,
+                                const RepeatedPtrField<Extent>& extents,
+                                uint32_t block_size) {
+  buffer_.blob()->resize(utils::BlocksInExtents(extents) * block_size);
+  offset_ = 0;
+  DirectExtentReader reader;
+  TEST_AND_RETURN_FALSE(reader.Init(fd, extents, block_size));
+  return reader.Read(buffer_.data(), buffer_.size());
+}
+
+bool BufferedExtentReader::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= buffer_.size());
+  offset_ = offset;
+  return true;
+}
+
+bool BufferedExtentReader::Read(void* buffer, size_t count) {
+  TEST_AND_RETURN_FALSE(count <= buffer_.size() - offset_);
+  memcpy(buffer, buffer_.data() + offset_, count);
+  offset_ += count;
+  return true;
+}
+
+bool SharedExtentReader::Init(FileDescriptorPtr fd,
+                              const RepeatedPtrField<Extent>& extents,
+                              uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(data_ != nullptr);
+  TEST_AND_RETURN_FALSE(data_->size() ==
+                        utils::BlocksInExtents(extents) * block_size);
+  offset_ = 0;
+  return true;
+}
+
+bool SharedExtentReader::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= data_->size());
+  offset_ = offset;
+  return true;
+}
+
+bool SharedExtentReader::Read(void* buffer, size_t count) {
+  TEST_AND_RETURN_FALSE(count <= data_->size() - offset_);
+  memcpy(buffer, data_->data() + offset_, count);
+  offset_ += count;
   return true;
 }
 
@@ -17,9 +17,14 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_READER_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_READER_H_
 
+#include <memory>
+#include <utility>
 #include <vector>
 
+#include <brillo/secure_blob.h>
+
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/scratch_buffer_pool.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -77,6 +82,51 @@ class DirectExtentReader : public ExtentReader {
   DISALLOW_COPY_AND_ASSIGN(DirectExtentReader);
 };
 
+// BufferedExtentReader reads all the extents into |buffer| at once in Init(),
+// with a single batch of requests to the file descriptor, then serves Seek()
+// and Read() from memory. This suits readers doing many small reads, like
+// bspatch, on sources fragmented in many extents.
+class BufferedExtentReader : public ExtentReader {
+ public:
+  explicit BufferedExtentReader(ScratchBufferPool::Buffer buffer)
+      : buffer_(std::move(buffer)) {}
+  ~BufferedExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* bytes, size_t count) override;
+
+ private:
+  ScratchBufferPool::Buffer buffer_;
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BufferedExtentReader);
+};
+
+// SharedExtentReader serves Seek() and Read() from the content of the extents
+// read beforehand, e.g. for another operation with the same source. Init() only
+// checks that |data| is as large as the extents.
+class SharedExtentReader : public ExtentReader {
+ public:
+  explicit SharedExtentReader(std::shared_ptr<const brillo::Blob> data)
+      : data_(std::move(data)) {}
+  ~SharedExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* bytes, size_t count) override;
+
+ private:
+  std::shared_ptr<const brillo::Blob> data_;
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SharedExtentReader);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_READER_H_
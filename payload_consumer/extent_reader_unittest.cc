@@ -167,4 +167,43 @@ TEST_F(ExtentReaderTest, RandomReadTest) {
   }
 }
 
+TEST_F(ExtentReaderTest, BufferedRandomReadTest) {
+  vector<Extent> extents = {ExtentForRange(0, 0),
+                            ExtentForRange(9, 3),
+                            ExtentForRange(1, 1),
+                            ExtentForRange(4, 2),
+                            ExtentForRange(7, 1)};
+  ScratchBufferPool pool;
+  BufferedExtentReader reader(pool.Acquire(0));
+  EXPECT_TRUE(reader.Init(fd_, {extents.begin(), extents.end()}, kBlockSize));
+
+  brillo::Blob result;
+  ReadExtents(extents, &result);
+
+  brillo::Blob blob(utils::BlocksInExtents(extents) * kBlockSize);
+  uint32_t rand_seed = 0;
+  for (size_t idx = 0; idx < kRandomIterations; idx++) {
+    size_t start = rand_r(&rand_seed) % blob.size();
+    size_t size = rand_r(&rand_seed) % (blob.size() - start);
+    EXPECT_TRUE(reader.Seek(start));
+    EXPECT_TRUE(reader.Read(blob.data(), size));
+    for (size_t i = 0; i < size; i++) {
+      ASSERT_EQ(blob[i], result[start + i]);
+    }
+  }
+}
+
+TEST_F(ExtentReaderTest, BufferedOverflowTest) {
+  vector<Extent> extents = {ExtentForRange(1, 1)};
+  ScratchBufferPool pool;
+  BufferedExtentReader reader(pool.Acquire(0));
+  EXPECT_TRUE(reader.Init(fd_, {extents.begin(), extents.end()}, kBlockSize));
+  EXPECT_TRUE(reader.Seek(kBlockSize));
+  EXPECT_FALSE(reader.Seek(kBlockSize + 1));
+  brillo::Blob blob(kBlockSize + 1);
+  EXPECT_TRUE(reader.Seek(0));
+  EXPECT_FALSE(reader.Read(blob.data(), blob.size()));
+  EXPECT_TRUE(reader.Read(blob.data(), kBlockSize));
+}
+
 }  // namespace chromeos_update_engine
@@ -21,8 +21,11 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <vector>
 
+#include "update_engine/common/tracing.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/operation_timings.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 
 using std::min;
@@ -34,6 +37,7 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
     return true;
   const char* c_bytes = reinterpret_cast<const char*>(bytes);
   size_t bytes_written = 0;
+  requests_.clear();
   while (bytes_written < count) {
     TEST_AND_RETURN_FALSE(cur_extent_ != extents_.end());
     uint64_t bytes_remaining_cur_extent =
@@ -45,12 +49,10 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
     TEST_AND_RETURN_FALSE(bytes_to_write > 0);
 
     if (cur_extent_->start_block() != kSparseHole) {
-      const off64_t offset =
-          cur_extent_->start_block() * block_size_ + extent_bytes_written_;
-      TEST_AND_RETURN_FALSE_ERRNO(fd_->Seek(offset, SEEK_SET) !=
-                                  static_cast<off64_t>(-1));
-      TEST_AND_RETURN_FALSE(
-          utils::WriteAll(fd_, c_bytes + bytes_written, bytes_to_write));
+      requests_.push_back(
+          {const_cast<char*>(c_bytes + bytes_written),
+           bytes_to_write,
+           cur_extent_->start_block() * block_size_ + extent_bytes_written_});
     }
     bytes_written += bytes_to_write;
     extent_bytes_written_ += bytes_to_write;
@@ -62,7 +64,11 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
       cur_extent_++;
     }
   }
-  return true;
+  // Positional writes leave the file offset untouched, so several writers can
+  // share |fd_| from different threads, see FileDescriptor::WriteAt().
+  OperationTimings::ScopedPhase phase(OperationTimings::Phase::kWrite);
+  TRACE_SCOPE("ExtentWriter write");
+  return fd_->WriteAt(requests_);
 }
 
 }  // namespace chromeos_update_engine
@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <base/logging.h>
 #include <brillo/secure_blob.h>
@@ -47,7 +48,7 @@ class ExtentWriter {
 // DirectExtentWriter is probably the simplest ExtentWriter implementation.
 // It writes the data directly into the extents.
 
-class DirectExtentWriter : public ExtentWriter {
+class DirectExtentWriter final : public ExtentWriter {
  public:
   explicit DirectExtentWriter(FileDescriptorPtr fd) : fd_(fd) {}
   ~DirectExtentWriter() override = default;
@@ -70,6 +71,9 @@ class DirectExtentWriter : public ExtentWriter {
   google::protobuf::RepeatedPtrField<Extent> extents_;
   // The next call to write should correspond to |cur_extents_|.
   google::protobuf::RepeatedPtrField<Extent>::iterator cur_extent_;
+  // The writes of the current Write() call. Kept across calls, so the many
+  // small writes of decompressors and patchers don't allocate it each time.
+  std::vector<FileDescriptor::IoRequest> requests_;
 };
 
 }  // namespace chromeos_update_engine
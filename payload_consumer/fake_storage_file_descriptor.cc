@@ -0,0 +1,142 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/fake_storage_file_descriptor.h"
+
+#include <algorithm>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+void FakeStorage::Transfer(const vector<FileDescriptor::IoRequest>& requests,
+                           bool write) {
+  uint64_t num_requests = 0;
+  uint64_t bytes = 0;
+  uint64_t unaligned = 0;
+  // The requests merged with the previous ones, from |begin| to |end|.
+  uint64_t begin = 0;
+  uint64_t end = 0;
+  auto finish_request = [&]() {
+    if (model_.alignment > 0 &&
+        (begin % model_.alignment != 0 || end % model_.alignment != 0)) {
+      unaligned++;
+    }
+  };
+  for (const auto& request : requests) {
+    if (request.size == 0) {
+      continue;
+    }
+    if (num_requests == 0 || request.offset != end) {
+      if (num_requests > 0) {
+        finish_request();
+      }
+      num_requests++;
+      begin = request.offset;
+    }
+    end = request.offset + request.size;
+    bytes += request.size;
+  }
+  if (num_requests == 0) {
+    return;
+  }
+  finish_request();
+
+  const uint64_t queue_depth = std::max<uint64_t>(model_.queue_depth, 1);
+  base::TimeDelta duration =
+      model_.latency * static_cast<int64_t>((num_requests + queue_depth - 1) /
+                                            queue_depth) +
+      model_.unaligned_penalty * static_cast<int64_t>(unaligned);
+  if (model_.bandwidth > 0) {
+    duration += base::TimeDelta::FromMicroseconds(static_cast<int64_t>(
+        bytes * base::Time::kMicrosecondsPerSecond / model_.bandwidth));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  (write ? stats_.writes : stats_.reads) += num_requests;
+  (write ? stats_.bytes_written : stats_.bytes_read) += bytes;
+  stats_.unaligned_requests += unaligned;
+  stats_.elapsed += duration;
+}
+
+void FakeStorage::Flush() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.flushes++;
+  stats_.elapsed += model_.flush_latency;
+}
+
+FakeStorage::Stats FakeStorage::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void FakeStorage::ResetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_ = Stats();
+}
+
+bool FakeStorageFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  offset_ = 0;
+  return fd_->Open(path, flags, mode);
+}
+
+bool FakeStorageFileDescriptor::Open(const char* path, int flags) {
+  offset_ = 0;
+  return fd_->Open(path, flags);
+}
+
+ssize_t FakeStorageFileDescriptor::Read(void* buf, size_t count) {
+  storage_->Transfer({{buf, count, offset_}}, false);
+  const ssize_t result = fd_->Read(buf, count);
+  if (result > 0) {
+    offset_ += result;
+  }
+  return result;
+}
+
+ssize_t FakeStorageFileDescriptor::Write(const void* buf, size_t count) {
+  storage_->Transfer({{const_cast<void*>(buf), count, offset_}}, true);
+  const ssize_t result = fd_->Write(buf, count);
+  if (result > 0) {
+    offset_ += result;
+  }
+  return result;
+}
+
+bool FakeStorageFileDescriptor::ReadAt(const vector<IoRequest>& requests) {
+  storage_->Transfer(requests, false);
+  return fd_->ReadAt(requests);
+}
+
+bool FakeStorageFileDescriptor::WriteAt(const vector<IoRequest>& requests) {
+  storage_->Transfer(requests, true);
+  return fd_->WriteAt(requests);
+}
+
+off64_t FakeStorageFileDescriptor::Seek(off64_t offset, int whence) {
+  const off64_t result = fd_->Seek(offset, whence);
+  if (result >= 0) {
+    offset_ = result;
+  }
+  return result;
+}
+
+bool FakeStorageFileDescriptor::Flush() {
+  storage_->Flush();
+  return fd_->Flush();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_FAKE_STORAGE_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_FAKE_STORAGE_FILE_DESCRIPTOR_H_
+
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// How fast an emulated storage device serves the requests.
+struct StorageModel {
+  // Time to serve a request, whatever its size.
+  base::TimeDelta latency;
+  // Bytes per second, 0 for no limit.
+  uint64_t bandwidth{0};
+  // Requests of a ReadAt() or WriteAt() batch served at the same time, each
+  // |queue_depth| of them costing one |latency|.
+  size_t queue_depth{1};
+  // Time to serve a Flush().
+  base::TimeDelta flush_latency;
+  // Requests whose offset or size isn't a multiple of |alignment| take
+  // |unaligned_penalty| longer, like the read-modify-write of a partial flash
+  // page. Not checked when 0.
+  uint64_t alignment{0};
+  base::TimeDelta unaligned_penalty;
+};
+
+// Accounts the time that the requests of its FakeStorageFileDescriptors would
+// take on a device following a StorageModel. The time is kept on a simulated
+// clock instead of being waited for, so that the I/O patterns of the apply path
+// compare the same on any host and in any run. The device serves one batch of
+// requests after the other, all the descriptors sharing its bandwidth. Safe to
+// use from multiple threads.
+class FakeStorage {
+ public:
+  struct Stats {
+    uint64_t reads{0};
+    uint64_t writes{0};
+    uint64_t bytes_read{0};
+    uint64_t bytes_written{0};
+    uint64_t flushes{0};
+    uint64_t unaligned_requests{0};
+    // The time the device spent serving all the requests.
+    base::TimeDelta elapsed;
+  };
+
+  explicit FakeStorage(const StorageModel& model) : model_(model) {}
+
+  // Accounts a batch of |requests|. Requests contiguous in the file count as
+  // one, like EintrSafeFileDescriptor issues them.
+  void Transfer(const std::vector<FileDescriptor::IoRequest>& requests,
+                bool write);
+  // Accounts a flush of the written data.
+  void Flush();
+
+  Stats stats() const;
+  void ResetStats();
+
+ private:
+  const StorageModel model_;
+
+  mutable std::mutex mutex_;
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(FakeStorage);
+};
+
+// A FileDescriptor accounting its requests on |storage| before passing them to
+// |fd|, to wrap the partitions opened by the PartitionFdCache or the images of
+// the benchmarks. The callers using Fd() directly bypass the emulation.
+class FakeStorageFileDescriptor : public FileDescriptor {
+ public:
+  FakeStorageFileDescriptor(FileDescriptorPtr fd, FakeStorage* storage)
+      : fd_(std::move(fd)), storage_(storage) {}
+  ~FakeStorageFileDescriptor() override = default;
+
+  // FileDescriptor override methods.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  bool ReadAt(const std::vector<IoRequest>& requests) override;
+  bool WriteAt(const std::vector<IoRequest>& requests) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool Flush() override;
+  bool Close() override { return fd_->Close(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  int Fd() override { return fd_->Fd(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  FakeStorage* storage_;
+
+  // The offset of the next Read() or Write(), to check its alignment.
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(FakeStorageFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_FAKE_STORAGE_FILE_DESCRIPTOR_H_
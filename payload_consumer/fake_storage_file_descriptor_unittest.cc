@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/fake_storage_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <memory>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using base::TimeDelta;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+
+// 4 KiB take 1 ms at this bandwidth.
+StorageModel TestModel() {
+  StorageModel model;
+  model.latency = TimeDelta::FromMicroseconds(100);
+  model.bandwidth = kBlockSize * 1000;
+  model.queue_depth = 4;
+  model.flush_latency = TimeDelta::FromMilliseconds(5);
+  model.alignment = kBlockSize;
+  model.unaligned_penalty = TimeDelta::FromMicroseconds(50);
+  return model;
+}
+}  // namespace
+
+class FakeStorageFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    brillo::Blob data(16 * kBlockSize, 'a');
+    ASSERT_TRUE(
+        utils::WriteFile(file_.path().c_str(), data.data(), data.size()));
+    fd_ = std::make_unique<FakeStorageFileDescriptor>(
+        std::make_shared<EintrSafeFileDescriptor>(), &storage_);
+    ASSERT_TRUE(fd_->Open(file_.path().c_str(), O_RDWR));
+  }
+
+  ScopedTempFile file_{"FakeStorageFileDescriptorTest.XXXXXX"};
+  FakeStorage storage_{TestModel()};
+  std::unique_ptr<FakeStorageFileDescriptor> fd_;
+};
+
+TEST_F(FakeStorageFileDescriptorTest, QueueDepthTest) {
+  brillo::Blob data(8 * kBlockSize, 'b');
+  // Eight requests with gaps between them, served in two rounds.
+  std::vector<FileDescriptor::IoRequest> requests;
+  for (size_t i = 0; i < 8; i++) {
+    requests.push_back(
+        {data.data() + i * kBlockSize, kBlockSize, 2 * i * kBlockSize});
+  }
+  ASSERT_TRUE(fd_->WriteAt(requests));
+
+  const auto stats = storage_.stats();
+  EXPECT_EQ(8u, stats.writes);
+  EXPECT_EQ(data.size(), stats.bytes_written);
+  EXPECT_EQ(0u, stats.unaligned_requests);
+  EXPECT_EQ(TimeDelta::FromMicroseconds(2 * 100 + 8 * 1000), stats.elapsed);
+
+  // The data still reaches the file.
+  brillo::Blob read_data(kBlockSize);
+  ASSERT_TRUE(fd_->ReadAt({{read_data.data(), read_data.size(), 0}}));
+  EXPECT_EQ(brillo::Blob(kBlockSize, 'b'), read_data);
+}
+
+TEST_F(FakeStorageFileDescriptorTest, ContiguousRequestsTest) {
+  brillo::Blob data(2 * kBlockSize);
+  ASSERT_TRUE(fd_->ReadAt({{data.data(), kBlockSize, kBlockSize},
+                           {data.data() + kBlockSize, kBlockSize, 0},
+                           {data.data(), kBlockSize, kBlockSize}}));
+  // The third request follows the second one.
+  EXPECT_EQ(2u, storage_.stats().reads);
+}
+
+TEST_F(FakeStorageFileDescriptorTest, UnalignedTest) {
+  brillo::Blob data(kBlockSize / 2);
+  ASSERT_EQ(static_cast<off64_t>(kBlockSize), fd_->Seek(kBlockSize, SEEK_SET));
+  ASSERT_EQ(static_cast<ssize_t>(data.size()),
+            fd_->Read(data.data(), data.size()));
+  // Starts where the previous read ended.
+  ASSERT_EQ(static_cast<ssize_t>(data.size()),
+            fd_->Read(data.data(), data.size()));
+
+  const auto stats = storage_.stats();
+  EXPECT_EQ(2u, stats.reads);
+  EXPECT_EQ(2u, stats.unaligned_requests);
+  EXPECT_EQ(TimeDelta::FromMicroseconds(2 * (100 + 500 + 50)), stats.elapsed);
+}
+
+TEST_F(FakeStorageFileDescriptorTest, FlushTest) {
+  ASSERT_TRUE(fd_->Flush());
+  ASSERT_TRUE(fd_->Flush());
+  EXPECT_EQ(2u, storage_.stats().flushes);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(10), storage_.stats().elapsed);
+
+  storage_.ResetStats();
+  EXPECT_EQ(0u, storage_.stats().flushes);
+  EXPECT_EQ(TimeDelta(), storage_.stats().elapsed);
+}
+
+}  // namespace chromeos_update_engine
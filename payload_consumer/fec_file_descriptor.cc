@@ -16,8 +16,14 @@
 
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 
+#include <string.h>
+
+#include <algorithm>
+
 #include <base/logging.h>
 
+#include "update_engine/common/utils.h"
+
 namespace chromeos_update_engine {
 
 bool FecFileDescriptor::Open(const char* path, int flags) {
@@ -42,11 +48,32 @@ bool FecFileDescriptor::Open(const char* path, int flags, mode_t mode) {
   }
 
   dev_size_ = status.data_size;
+  offset_ = 0;
   return true;
 }
 
 ssize_t FecFileDescriptor::Read(void* buf, size_t count) {
-  return fh_.read(buf, count);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (offset_ >= dev_size_) {
+    return 0;
+  }
+  count = std::min<uint64_t>(count, dev_size_ - offset_);
+  if (!ReadCached(buf, count, offset_)) {
+    return -1;
+  }
+  offset_ += count;
+  return count;
+}
+
+bool FecFileDescriptor::ReadAt(const std::vector<IoRequest>& requests) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& request : requests) {
+    TEST_AND_RETURN_FALSE(request.offset <= dev_size_ &&
+                          request.size <= dev_size_ - request.offset);
+    TEST_AND_RETURN_FALSE(
+        ReadCached(request.data, request.size, request.offset));
+  }
+  return true;
 }
 
 ssize_t FecFileDescriptor::Write(const void* buf, size_t count) {
@@ -55,10 +82,27 @@ ssize_t FecFileDescriptor::Write(const void* buf, size_t count) {
 }
 
 off64_t FecFileDescriptor::Seek(off64_t offset, int whence) {
-  if (fh_.seek(offset, whence)) {
-    return offset;
+  std::lock_guard<std::mutex> lock(mutex_);
+  off64_t base = 0;
+  switch (whence) {
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      base = offset_;
+      break;
+    case SEEK_END:
+      base = dev_size_;
+      break;
+    default:
+      errno = EINVAL;
+      return -1;
   }
-  return -1;
+  if (base + offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = base + offset;
+  return offset_;
 }
 
 uint64_t FecFileDescriptor::BlockDevSize() {
@@ -74,7 +118,89 @@ bool FecFileDescriptor::BlkIoctl(int request,
 }
 
 bool FecFileDescriptor::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stripes_.clear();
+  stripe_index_.clear();
+  cached_bytes_ = 0;
   return fh_.close();
 }
 
+bool FecFileDescriptor::ReadCached(void* buf, size_t count, uint64_t offset) {
+  auto bytes = static_cast<uint8_t*>(buf);
+  if (cache_size_ < kStripeSize) {
+    ssize_t bytes_read = Decode(bytes, count, offset);
+    if (bytes_read != static_cast<ssize_t>(count)) {
+      PLOG(ERROR) << "Failed to read " << count << " bytes at " << offset;
+      return false;
+    }
+    return true;
+  }
+  while (count > 0) {
+    const uint64_t index = offset / kStripeSize;
+    const brillo::Blob* stripe = GetStripe(index);
+    TEST_AND_RETURN_FALSE(stripe != nullptr);
+    const size_t stripe_offset = offset - index * kStripeSize;
+    TEST_AND_RETURN_FALSE(stripe_offset < stripe->size());
+    const size_t size = std::min(count, stripe->size() - stripe_offset);
+    memcpy(bytes, stripe->data() + stripe_offset, size);
+    bytes += size;
+    offset += size;
+    count -= size;
+  }
+  return true;
+}
+
+const brillo::Blob* FecFileDescriptor::GetStripe(uint64_t index) {
+  const bool sequential = index == last_stripe_ + 1;
+  last_stripe_ = index;
+  auto it = stripe_index_.find(index);
+  if (it != stripe_index_.end()) {
+    stripes_.splice(stripes_.begin(), stripes_, it->second);
+    return &it->second->second;
+  }
+
+  // Decode the following stripes too when reading sequentially, as long as
+  // they aren't cached already and fit in the cache.
+  const uint64_t num_stripes = (dev_size_ + kStripeSize - 1) / kStripeSize;
+  const size_t max_stripes =
+      sequential ? std::min(kPrefetchStripes, cache_size_ / kStripeSize) : 1;
+  size_t count = 1;
+  while (count < max_stripes && index + count < num_stripes &&
+         stripe_index_.count(index + count) == 0) {
+    count++;
+  }
+  const uint64_t start = index * kStripeSize;
+  if (start >= dev_size_) {
+    LOG(ERROR) << "Reading past the end of the device at " << start;
+    return nullptr;
+  }
+  brillo::Blob data(std::min<uint64_t>(count * kStripeSize, dev_size_ - start));
+  ssize_t bytes_read = Decode(data.data(), data.size(), start);
+  if (bytes_read != static_cast<ssize_t>(data.size())) {
+    PLOG(ERROR) << "Failed to read " << data.size() << " bytes at " << start;
+    return nullptr;
+  }
+
+  // Insert the stripes in reverse, so the requested one ends up first.
+  for (size_t i = count; i-- > 0;) {
+    const auto begin = data.begin() + i * kStripeSize;
+    const auto end =
+        data.begin() + std::min(data.size(), (i + 1) * kStripeSize);
+    stripes_.emplace_front(index + i, brillo::Blob(begin, end));
+    stripe_index_[index + i] = stripes_.begin();
+    cached_bytes_ += stripes_.front().second.size();
+  }
+  EvictStripes();
+  return &stripes_.front().second;
+}
+
+void FecFileDescriptor::EvictStripes() {
+  // Always keep the most recent stripe, which the caller is using.
+  while (cached_bytes_ > cache_size_ && stripes_.size() > 1) {
+    cached_bytes_ -= stripes_.back().second.size();
+    stripe_index_.erase(stripes_.back().first);
+    stripes_.pop_back();
+  }
+}
+
 }  // namespace chromeos_update_engine
@@ -17,6 +17,13 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_FILE_DESCRIPTOR_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_FILE_DESCRIPTOR_H_
 
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <brillo/secure_blob.h>
 #include <fec/io.h>
 
 #include "update_engine/payload_consumer/file_descriptor.h"
@@ -29,10 +36,20 @@
 
 namespace chromeos_update_engine {
 
-// An error corrected file based on FEC.
+// An error corrected file based on FEC. Since libfec decodes whole RS
+// codewords for every read, the decoded data is kept in an LRU cache of
+// |kStripeSize| stripes up to |cache_size| bytes, and the stripes following a
+// sequential read are decoded along with it. Reads are serialized, so the
+// descriptor can be shared by threads.
 class FecFileDescriptor : public FileDescriptor {
  public:
-  FecFileDescriptor() = default;
+  static constexpr size_t kStripeSize = 64 * 1024;              // 64 KiB
+  static constexpr size_t kDefaultCacheSize = 4 * 1024 * 1024;  // 4 MiB
+  // Number of stripes decoded at once when reading sequentially.
+  static constexpr size_t kPrefetchStripes = 4;
+
+  explicit FecFileDescriptor(size_t cache_size = kDefaultCacheSize)
+      : cache_size_(cache_size) {}
   ~FecFileDescriptor() = default;
 
   // Interface methods.
@@ -40,6 +57,8 @@ class FecFileDescriptor : public FileDescriptor {
   bool Open(const char* path, int flags) override;
   ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
+  // Reads positionally, leaving the offset used by Read() untouched.
+  bool ReadAt(const std::vector<IoRequest>& requests) override;
   off64_t Seek(off64_t offset, int whence) override;
   uint64_t BlockDevSize() override;
   bool BlkIoctl(int request,
@@ -56,8 +75,36 @@ class FecFileDescriptor : public FileDescriptor {
   }
 
  protected:
+  // Copies |count| bytes at |offset| within the device into |buf| from the
+  // cached stripes, decoding the missing ones. |mutex_| must be held.
+  bool ReadCached(void* buf, size_t count, uint64_t offset);
+
+  // Returns the stripe |index|, decoding it first if it isn't cached, or
+  // nullptr on errors. |mutex_| must be held.
+  const brillo::Blob* GetStripe(uint64_t index);
+
+  // Drops the least recently used stripes until the cache fits its budget.
+  void EvictStripes();
+
+  // Reads |count| error corrected bytes at |offset| within the device into
+  // |buf|. Returns the number of bytes read or -1 on errors.
+  virtual ssize_t Decode(void* buf, size_t count, uint64_t offset) {
+    return fh_.pread(buf, count, offset);
+  }
+
   fec::io fh_;
   uint64_t dev_size_{0};
+
+  const size_t cache_size_;
+  std::mutex mutex_;
+  // The offset of Read().
+  uint64_t offset_{0};
+  // The cached stripes and their index, most recently used first.
+  std::list<std::pair<uint64_t, brillo::Blob>> stripes_;
+  std::unordered_map<uint64_t, decltype(stripes_)::iterator> stripe_index_;
+  size_t cached_bytes_{0};
+  // The last stripe read, to detect sequential reads.
+  uint64_t last_stripe_{0};
 };
 
 }  // namespace chromeos_update_engine
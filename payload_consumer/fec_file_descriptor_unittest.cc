@@ -0,0 +1,176 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/fec_file_descriptor.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kStripeSize = FecFileDescriptor::kStripeSize;
+
+// A FecFileDescriptor decoding from |data| instead of libfec, counting the
+// decoded ranges.
+class FakeFecFileDescriptor : public FecFileDescriptor {
+ public:
+  FakeFecFileDescriptor(const brillo::Blob& data, size_t cache_size)
+      : FecFileDescriptor(cache_size), data_(data) {
+    dev_size_ = data_.size();
+  }
+
+  size_t decodes() const { return decodes_; }
+  uint64_t decoded_bytes() const { return decoded_bytes_; }
+
+ protected:
+  ssize_t Decode(void* buf, size_t count, uint64_t offset) override {
+    if (offset > data_.size() || count > data_.size() - offset) {
+      errno = EIO;
+      return -1;
+    }
+    memcpy(buf, data_.data() + offset, count);
+    decodes_++;
+    decoded_bytes_ += count;
+    return count;
+  }
+
+ private:
+  const brillo::Blob& data_;
+  size_t decodes_{0};
+  uint64_t decoded_bytes_{0};
+};
+}  // namespace
+
+class FecFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // 16 stripes and a partial one.
+    data_.resize(16 * kStripeSize + 1000);
+    std::mt19937 random(5);
+    for (auto& byte : data_) {
+      byte = random() & 0xff;
+    }
+  }
+
+  // Reads |size| bytes at |offset| from |fd| and checks them.
+  void ExpectRead(FileDescriptor* fd, uint64_t offset, size_t size) {
+    brillo::Blob buf(size);
+    ASSERT_TRUE(fd->ReadAt({{buf.data(), size, offset}}));
+    EXPECT_EQ(brillo::Blob(data_.begin() + offset,
+                           data_.begin() + offset + size),
+              buf);
+  }
+
+  brillo::Blob data_;
+};
+
+TEST_F(FecFileDescriptorTest, CacheHitTest) {
+  FakeFecFileDescriptor fd(data_, 4 * kStripeSize);
+  ExpectRead(&fd, 3 * kStripeSize + 100, 200);
+  EXPECT_EQ(1u, fd.decodes());
+  EXPECT_EQ(kStripeSize, fd.decoded_bytes());
+  // Anywhere in the same stripe.
+  ExpectRead(&fd, 3 * kStripeSize, kStripeSize);
+  ExpectRead(&fd, 3 * kStripeSize + 7, 1);
+  EXPECT_EQ(1u, fd.decodes());
+}
+
+TEST_F(FecFileDescriptorTest, EvictionTest) {
+  FakeFecFileDescriptor fd(data_, 2 * kStripeSize);
+  // Reads of stripes which don't follow each other decode a stripe each.
+  ExpectRead(&fd, 4 * kStripeSize, 10);
+  ExpectRead(&fd, 8 * kStripeSize, 10);
+  EXPECT_EQ(2u, fd.decodes());
+  // Stripe 4 is used again, which leaves stripe 8 the least recently used.
+  ExpectRead(&fd, 4 * kStripeSize + 20, 10);
+  ExpectRead(&fd, 12 * kStripeSize, 10);
+  EXPECT_EQ(3u, fd.decodes());
+  ExpectRead(&fd, 4 * kStripeSize, 10);
+  EXPECT_EQ(3u, fd.decodes());
+  ExpectRead(&fd, 8 * kStripeSize, 10);
+  EXPECT_EQ(4u, fd.decodes());
+}
+
+TEST_F(FecFileDescriptorTest, StraddlingReadTest) {
+  FakeFecFileDescriptor fd(data_, 4 * kStripeSize);
+  // Ends in stripe 6, two stripes after it starts. Stripe 4 is decoded
+  // alone, stripe 5 follows it and is decoded along with stripes 6 to 8.
+  ExpectRead(&fd, 5 * kStripeSize - 10, kStripeSize + 20);
+  EXPECT_EQ(2u, fd.decodes());
+  ExpectRead(&fd, 6 * kStripeSize - 1, 2);
+  ExpectRead(&fd, 8 * kStripeSize, kStripeSize);
+  EXPECT_EQ(2u, fd.decodes());
+}
+
+TEST_F(FecFileDescriptorTest, SequentialReadTest) {
+  FakeFecFileDescriptor fd(data_, 8 * kStripeSize);
+  brillo::Blob buf(data_.size());
+  ASSERT_EQ(static_cast<ssize_t>(kStripeSize),
+            fd.Read(buf.data(), kStripeSize));
+  ASSERT_EQ(static_cast<ssize_t>(data_.size() - kStripeSize),
+            fd.Read(buf.data() + kStripeSize, data_.size()));
+  EXPECT_EQ(data_, buf);
+  EXPECT_EQ(0, fd.Read(buf.data(), 1));
+  // Each stripe is decoded once, most of them with the following ones.
+  EXPECT_EQ(data_.size(), fd.decoded_bytes());
+  EXPECT_LT(fd.decodes(), data_.size() / kStripeSize);
+}
+
+TEST_F(FecFileDescriptorTest, ReadPastEndTest) {
+  FakeFecFileDescriptor fd(data_, 4 * kStripeSize);
+  brillo::Blob buf(2000);
+  EXPECT_FALSE(fd.ReadAt({{buf.data(), buf.size(), data_.size() - 1000}}));
+  // The partial last stripe.
+  ExpectRead(&fd, data_.size() - 1000, 1000);
+}
+
+TEST_F(FecFileDescriptorTest, ConcurrentReadersTest) {
+  // Too small a cache for the data, so the readers keep evicting each other's
+  // stripes.
+  FakeFecFileDescriptor fd(data_, 3 * kStripeSize);
+  vector<std::thread> threads;
+  vector<int> failures(8, 0);
+  for (size_t t = 0; t < failures.size(); t++) {
+    threads.emplace_back([this, &fd, &failures, t]() {
+      std::mt19937 random(t);
+      brillo::Blob buf(3 * kStripeSize);
+      for (int i = 0; i < 200; i++) {
+        const size_t size = 1 + random() % buf.size();
+        const uint64_t offset = random() % (data_.size() - size + 1);
+        if (!fd.ReadAt({{buf.data(), size, offset}}) ||
+            memcmp(buf.data(), data_.data() + offset, size) != 0) {
+          failures[t]++;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(vector<int>(failures.size(), 0), failures);
+}
+
+}  // namespace chromeos_update_engine
@@ -16,19 +16,127 @@
 
 #include "update_engine/payload_consumer/file_descriptor.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+
 #include <base/posix/eintr_wrapper.h>
 
 #include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+
+std::atomic<uint64_t> g_num_fsyncs{0};
+std::atomic<int64_t> g_fsync_us{0};
+
+// fsync() counted in the process wide totals.
+int TimedFsync(int fd) {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  const int rc = fsync(fd);
+  g_num_fsyncs++;
+  g_fsync_us += (base::TimeTicks::Now() - start).InMicroseconds();
+  return rc;
+}
+
+// Reads or writes all of |iovs| from |offset| of |fd| with preadv()/pwritev(),
+// retrying after short transfers. Returns false on errors and end of file.
+bool VectoredIo(int fd, bool write, std::vector<iovec> iovs, uint64_t offset) {
+  size_t first = 0;
+  while (true) {
+    while (first < iovs.size() && iovs[first].iov_len == 0) {
+      first++;
+    }
+    if (first == iovs.size()) {
+      return true;
+    }
+    const int count = std::min<size_t>(iovs.size() - first, IOV_MAX);
+    const ssize_t rc =
+        write ? HANDLE_EINTR(pwritev(fd, &iovs[first], count, offset))
+              : HANDLE_EINTR(preadv(fd, &iovs[first], count, offset));
+    if (rc < 0) {
+      PLOG(ERROR) << (write ? "pwritev" : "preadv") << " of " << count
+                  << " buffers at " << offset << " failed";
+      return false;
+    }
+    if (rc == 0) {
+      LOG(ERROR) << "Unexpected end of file at " << offset;
+      return false;
+    }
+    offset += rc;
+    for (size_t done = rc; done > 0;) {
+      auto& iov = iovs[first];
+      const size_t step = std::min(done, iov.iov_len);
+      iov.iov_base = static_cast<uint8_t*>(iov.iov_base) + step;
+      iov.iov_len -= step;
+      done -= step;
+      if (iov.iov_len == 0) {
+        first++;
+      }
+    }
+  }
+}
+
+// Runs the |requests| on |fd| in order, merging the consecutive ones which
+// are contiguous in the file into one VectoredIo().
+bool RunContiguousRequests(
+    int fd,
+    bool write,
+    const std::vector<FileDescriptor::IoRequest>& requests) {
+  for (size_t i = 0; i < requests.size();) {
+    const uint64_t offset = requests[i].offset;
+    uint64_t end = offset;
+    std::vector<iovec> iovs;
+    for (; i < requests.size() && requests[i].offset == end; i++) {
+      iovs.push_back({requests[i].data, requests[i].size});
+      end += requests[i].size;
+    }
+    TEST_AND_RETURN_FALSE(VectoredIo(fd, write, std::move(iovs), offset));
+  }
+  return true;
+}
+
+}  // namespace
+
+bool FileDescriptor::ReadAt(const std::vector<IoRequest>& requests) {
+  for (const auto& request : requests) {
+    ssize_t bytes_read = 0;
+    if (Fd() >= 0) {
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          Fd(), request.data, request.size, request.offset, &bytes_read));
+    } else {
+      TEST_AND_RETURN_FALSE(utils::ReadAll(
+          this, request.data, request.size, request.offset, &bytes_read));
+    }
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(request.size));
+  }
+  return true;
+}
+
+bool FileDescriptor::WriteAt(const std::vector<IoRequest>& requests) {
+  for (const auto& request : requests) {
+    if (Fd() >= 0) {
+      TEST_AND_RETURN_FALSE(utils::PWriteAll(
+          Fd(), request.data, request.size, request.offset));
+    } else {
+      TEST_AND_RETURN_FALSE_ERRNO(Seek(request.offset, SEEK_SET) ==
+                                  static_cast<off64_t>(request.offset));
+      TEST_AND_RETURN_FALSE(utils::WriteAll(this, request.data, request.size));
+    }
+  }
+  return true;
+}
+
 EintrSafeFileDescriptor::~EintrSafeFileDescriptor() {
   if (IsOpen()) {
     Close();
@@ -50,6 +158,16 @@ ssize_t EintrSafeFileDescriptor::Read(void* buf, size_t count) {
   return HANDLE_EINTR(read(fd_, buf, count));
 }
 
+bool EintrSafeFileDescriptor::ReadAt(const std::vector<IoRequest>& requests) {
+  CHECK_GE(fd_, 0);
+  return RunContiguousRequests(fd_, false, requests);
+}
+
+bool EintrSafeFileDescriptor::WriteAt(const std::vector<IoRequest>& requests) {
+  CHECK_GE(fd_, 0);
+  return RunContiguousRequests(fd_, true, requests);
+}
+
 ssize_t EintrSafeFileDescriptor::Write(const void* buf, size_t count) {
   CHECK_GE(fd_, 0);
 
@@ -132,9 +250,12 @@ bool EintrSafeFileDescriptor::BlkIoctl(int request,
 
 bool EintrSafeFileDescriptor::Flush() {
   CHECK_GE(fd_, 0);
-  // Implemented as a No-Op, as delta_performer typically uses |O_DSYNC|, except
-  // in interactive settings.
-  fsync(fd_);
+  // Without |O_DSYNC|, the writes are only durable once this succeeds. Some
+  // special files don't support syncing, which doesn't make it fail.
+  if (TimedFsync(fd_) != 0 && errno != EINVAL) {
+    PLOG(ERROR) << "Failed to sync file descriptor " << fd_;
+    return false;
+  }
   return true;
 }
 
@@ -144,11 +265,19 @@ bool EintrSafeFileDescriptor::Close() {
   }
   // https://stackoverflow.com/questions/705454/does-linux-guarantee-the-contents-of-a-file-is-flushed-to-disc-after-close
   // |close()| doesn't imply |fsync()|, we need to do it manually.
-  fsync(fd_);
+  TimedFsync(fd_);
   if (IGNORE_EINTR(close(fd_)))
     return false;
   fd_ = -1;
   return true;
 }
 
+uint64_t EintrSafeFileDescriptor::num_fsyncs() {
+  return g_num_fsyncs;
+}
+
+base::TimeDelta EintrSafeFileDescriptor::fsync_duration() {
+  return base::TimeDelta::FromMicroseconds(g_fsync_us);
+}
+
 }  // namespace chromeos_update_engine
@@ -19,9 +19,12 @@
 
 #include <errno.h>
 #include <sys/types.h>
+#include <cstdint>
 #include <memory>
+#include <vector>
 
 #include <android-base/macros.h>
+#include <base/time/time.h>
 
 // Abstraction for managing opening, reading, writing and closing of file
 // descriptors. This includes an abstract class and one standard implementation
@@ -48,6 +51,13 @@ using FileDescriptorPtr = std::shared_ptr<FileDescriptor>;
 // An abstract class defining the file descriptor API.
 class FileDescriptor {
  public:
+  // A positional read or write of |size| bytes at |offset|, see ReadAt().
+  struct IoRequest {
+    void* data;
+    size_t size;
+    uint64_t offset;
+  };
+
   FileDescriptor() {}
   virtual ~FileDescriptor() {}
 
@@ -67,6 +77,15 @@ class FileDescriptor {
   // no bytes were written. Specific implementations may set errno accordingly.
   virtual ssize_t Write(const void* buf, size_t count) = 0;
 
+  // Reads |size| bytes at |offset| into |data| for every entry of |requests|,
+  // or writes them from |data| to the file. Implementations may issue the
+  // requests concurrently and in any order, so they must not overlap. The
+  // default implementation runs them one after another, with pread()/pwrite()
+  // when Fd() is available and Seek() + Read()/Write() otherwise. Returns
+  // false if any request failed or hit the end of the file.
+  virtual bool ReadAt(const std::vector<IoRequest>& requests);
+  virtual bool WriteAt(const std::vector<IoRequest>& requests);
+
   // Seeks to an offset. Returns the resulting offset location as measured in
   // bytes from the beginning. On error, return -1. Specific implementations
   // may set errno accordingly.
@@ -115,16 +134,20 @@ class FileDescriptor {
 };
 
 // A simple EINTR-immune wrapper implementation around standard system calls.
-class EintrSafeFileDescriptor final : public FileDescriptor {
+class EintrSafeFileDescriptor : public FileDescriptor {
  public:
   EintrSafeFileDescriptor() : fd_(-1) {}
-  ~EintrSafeFileDescriptor();
+  ~EintrSafeFileDescriptor() override;
 
   // Interface methods.
   bool Open(const char* path, int flags, mode_t mode) override;
   bool Open(const char* path, int flags) override;
   ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
+  // Requests contiguous in the file, like the pieces of one extent, are run
+  // with a single preadv()/pwritev().
+  bool ReadAt(const std::vector<IoRequest>& requests) override;
+  bool WriteAt(const std::vector<IoRequest>& requests) override;
   off64_t Seek(off64_t offset, int whence) override;
   uint64_t BlockDevSize() override;
   bool BlkIoctl(int request,
@@ -137,6 +160,11 @@ class EintrSafeFileDescriptor final : public FileDescriptor {
   bool IsOpen() override { return (fd_ >= 0); }
   int Fd() override { return fd_; }
 
+  // The number of fsync() calls made by Flush() and Close() of all instances
+  // since the process started, and the total time they took.
+  static uint64_t num_fsyncs();
+  static base::TimeDelta fsync_duration();
+
  protected:
   int fd_;
 };
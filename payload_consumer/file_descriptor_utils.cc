@@ -16,14 +16,18 @@
 
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 
+#include <fcntl.h>
+
 #include <algorithm>
 
 #include <base/logging.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
 #include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 
 using google::protobuf::RepeatedPtrField;
 using std::min;
@@ -35,6 +39,62 @@ namespace {
 // Size of the buffer used to copy blocks.
 const uint64_t kMaxCopyBufferSize = 1024 * 1024;
 
+// How far ahead of the current read position the kernel is asked to prefetch
+// the extents being read.
+const uint64_t kPrefetchWindowSize = 8 * 1024 * 1024;
+
+// Issues POSIX_FADV_WILLNEED hints for the blocks of |extents| that will be
+// read next, so that fragmented extents are fetched by the kernel with a deep
+// queue instead of one synchronous read at a time. Does nothing for file
+// descriptors without a kernel fd.
+class ExtentPrefetcher {
+ public:
+  ExtentPrefetcher(const FileDescriptorPtr& fd,
+                   const RepeatedPtrField<Extent>& extents,
+                   uint64_t block_size)
+      : fd_(fd->Fd()),
+        block_size_(block_size),
+        window_blocks_(std::max<uint64_t>(kPrefetchWindowSize / block_size, 1)),
+        extents_(extents),
+        next_extent_(extents.begin()) {}
+
+  // Called once |consumed_blocks| blocks of |extents_| were read.
+  void Update(uint64_t consumed_blocks) {
+    if (fd_ < 0) {
+      return;
+    }
+    const uint64_t target_blocks = consumed_blocks + window_blocks_;
+    while (advised_blocks_ < target_blocks && next_extent_ != extents_.end()) {
+      const uint64_t num_blocks =
+          std::min(next_extent_->num_blocks() - next_extent_offset_,
+                   target_blocks - advised_blocks_);
+      if (next_extent_->start_block() != kSparseHole) {
+        // Failures only lose the hint, the actual read reports real errors.
+        posix_fadvise(
+            fd_,
+            (next_extent_->start_block() + next_extent_offset_) * block_size_,
+            num_blocks * block_size_,
+            POSIX_FADV_WILLNEED);
+      }
+      advised_blocks_ += num_blocks;
+      next_extent_offset_ += num_blocks;
+      if (next_extent_offset_ == next_extent_->num_blocks()) {
+        next_extent_++;
+        next_extent_offset_ = 0;
+      }
+    }
+  }
+
+ private:
+  const int fd_;
+  const uint64_t block_size_;
+  const uint64_t window_blocks_;
+  const RepeatedPtrField<Extent>& extents_;
+  RepeatedPtrField<Extent>::const_iterator next_extent_;
+  uint64_t next_extent_offset_{0};
+  uint64_t advised_blocks_{0};
+};
+
 }  // namespace
 namespace fd_utils {
 
@@ -48,13 +108,18 @@ bool CommonHashExtents(FileDescriptorPtr source,
   // Ensure we copy at least one block at a time.
   if (buffer_blocks < 1)
     buffer_blocks = 1;
-  brillo::Blob buf(buffer_blocks * block_size);
+  const size_t buffer_size = buffer_blocks * block_size;
+  auto buf = AlignedBufferPool::GetInstance()->Acquire(buffer_size);
+  TEST_AND_RETURN_FALSE(buf.size() == buffer_size);
 
   DirectExtentReader reader;
   TEST_AND_RETURN_FALSE(reader.Init(source, src_extents, block_size));
+  ExtentPrefetcher prefetcher(source, src_extents, block_size);
 
   HashCalculator source_hasher;
+  uint64_t consumed_blocks = 0;
   while (total_blocks > 0) {
+    prefetcher.Update(consumed_blocks);
     auto read_blocks = std::min(total_blocks, buffer_blocks);
     TEST_AND_RETURN_FALSE(reader.Read(buf.data(), read_blocks * block_size));
     if (hash_out != nullptr) {
@@ -66,6 +131,7 @@ bool CommonHashExtents(FileDescriptorPtr source,
           writer->Write(buf.data(), read_blocks * block_size));
     }
     total_blocks -= read_blocks;
+    consumed_blocks += read_blocks;
   }
 
   if (hash_out != nullptr) {
@@ -97,6 +163,37 @@ bool ReadAndHashExtents(FileDescriptorPtr source,
   return CommonHashExtents(source, extents, nullptr, block_size, hash_out);
 }
 
+bool ReadAndHashExtentsBatch(
+    FileDescriptorPtr source,
+    const std::vector<const RepeatedPtrField<Extent>*>& extents,
+    uint64_t block_size,
+    std::vector<brillo::Blob>* hashes) {
+  hashes->resize(extents.size());
+  // Indices into |extents| of the data read in full.
+  std::vector<size_t> batched;
+  std::vector<brillo::Blob> data;
+  for (size_t i = 0; i < extents.size(); i++) {
+    if (utils::BlocksInExtents(*extents[i]) * block_size >
+        kMaxBatchedHashSize) {
+      TEST_AND_RETURN_FALSE(ReadAndHashExtents(
+          source, *extents[i], block_size, &(*hashes)[i]));
+      continue;
+    }
+    brillo::Blob blob;
+    TEST_AND_RETURN_FALSE(
+        utils::ReadExtents(source, *extents[i], &blob, block_size));
+    batched.push_back(i);
+    data.push_back(std::move(blob));
+  }
+  std::vector<brillo::Blob> batched_hashes;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfDataBatch(data, &batched_hashes));
+  for (size_t i = 0; i < batched.size(); i++) {
+    (*hashes)[batched[i]] = std::move(batched_hashes[i]);
+  }
+  return true;
+}
+
 }  // namespace fd_utils
 
 }  // namespace chromeos_update_engine
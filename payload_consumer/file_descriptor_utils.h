@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_FILE_DESCRIPTOR_UTILS_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_FILE_DESCRIPTOR_UTILS_H_
 
+#include <vector>
+
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/extent_writer.h"
@@ -60,6 +62,17 @@ bool ReadAndHashExtents(
     uint64_t block_size,
     brillo::Blob* hash_out);
 
+// Same as ReadAndHashExtents() for each of |extents|, storing the hashes to
+// |hashes|. Extents of at most |kMaxBatchedHashSize| bytes are read in full
+// and then hashed together, see HashCalculator::RawHashOfDataBatch().
+constexpr size_t kMaxBatchedHashSize = 1024 * 1024;  // 1 MiB
+bool ReadAndHashExtentsBatch(
+    FileDescriptorPtr source,
+    const std::vector<const google::protobuf::RepeatedPtrField<Extent>*>&
+        extents,
+    uint64_t block_size,
+    std::vector<brillo::Blob>* hashes);
+
 }  // namespace fd_utils
 }  // namespace chromeos_update_engine
 
@@ -193,4 +193,26 @@ TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsTest) {
   EXPECT_EQ(expected_hash, hash_out);
 }
 
+TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsBatchTest) {
+  const std::vector<RepeatedPtrField<Extent>> extents = {
+      CreateExtentList({{1, 1}, {4, 1}}),
+      CreateExtentList({{0, 5}}),
+      CreateExtentList({{2, 2}}),
+      CreateExtentList({{3, 1}, {0, 1}, {1, 1}}),
+      CreateExtentList({{4, 1}})};
+  std::vector<const RepeatedPtrField<Extent>*> batch;
+  for (const auto& item : extents) {
+    batch.push_back(&item);
+  }
+  std::vector<brillo::Blob> hashes;
+  EXPECT_TRUE(fd_utils::ReadAndHashExtentsBatch(source_, batch, 4, &hashes));
+  ASSERT_EQ(extents.size(), hashes.size());
+  for (size_t i = 0; i < extents.size(); i++) {
+    brillo::Blob expected_hash;
+    EXPECT_TRUE(
+        fd_utils::ReadAndHashExtents(source_, extents[i], 4, &expected_hash));
+    EXPECT_EQ(expected_hash, hashes[i]);
+  }
+}
+
 }  // namespace chromeos_update_engine
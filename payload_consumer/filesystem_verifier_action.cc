@@ -31,15 +31,24 @@
 #include <utility>
 
 #include <base/bind.h>
+#include <base/time/time.h>
 #include <brillo/data_encoding.h>
 #include <brillo/message_loops/message_loop.h>
 #include <brillo/secure_blob.h>
 #include <brillo/streams/file_stream.h>
 
+#include "update_engine/common/constants.h"
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/tracing.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/early_partition_hasher.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/io_scheduler.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+#include "update_engine/payload_consumer/partition_fd_cache.h"
+#include "update_engine/payload_consumer/throughput_governor.h"
+#include "update_engine/payload_consumer/verified_source_hashes.h"
 
 using brillo::data_encoding::Base64Encode;
 using std::string;
@@ -79,8 +88,19 @@ namespace chromeos_update_engine {
 
 namespace {
 const off_t kReadFileBufferSize = 128 * 1024;
+const off_t kAsyncReadBufferSize = 1024 * 1024;
+// Upper bound of the read size probed by ReadSizeProbe.
+const off_t kMaxReadBufferSize = 8 * 1024 * 1024;
+// Alignment of the offset, the size and the buffer of O_DIRECT reads.
+constexpr size_t kDirectIoAlignment = 4096;
 constexpr float kVerityProgressPercent = 0.3;
 constexpr float kEncodeFECPercent = 0.3;
+// How often the progress of partitions hashed in parallel is checked.
+constexpr base::TimeDelta kParallelHashingPollInterval =
+    base::TimeDelta::FromMilliseconds(100);
+// How often the progress of a partition is checkpointed.
+constexpr base::TimeDelta kCheckpointInterval =
+    base::TimeDelta::FromSeconds(5);
 
 }  // namespace
 
@@ -93,6 +113,7 @@ void FilesystemVerifierAction::PerformAction() {
     return;
   }
   install_plan_ = GetInputObject();
+  IoScheduler::GetInstance()->SetPhase(IoPhase::kVerify);
 
   if (install_plan_.partitions.empty()) {
     LOG(ERROR) << "No partitions to verify.";
@@ -117,11 +138,20 @@ void FilesystemVerifierAction::PerformAction() {
   // If we are not writing verity, just map all partitions once at the
   // beginning.
   // No need to re-map for each partition, because we are not writing any new
-  // COW data.
+  // COW data. Snapshots read from their COW aren't mapped at all.
   if (dynamic_control_->UpdateUsesSnapshotCompression() &&
-      !install_plan_.write_verity) {
+      !install_plan_.write_verity && !install_plan_.verify_from_cow) {
     dynamic_control_->MapAllPartitions();
   }
+  read_limiter_ = std::make_unique<ReadBandwidthLimiter>(
+      install_plan_.verify_read_bandwidth);
+  // With io_uring, each read is split into several requests which are kept
+  // in flight together, larger reads mean a deeper queue.
+  min_read_size_ = IoUringFileDescriptor::IsSupported() ? kAsyncReadBufferSize
+                                                        : kReadFileBufferSize;
+  read_size_probe_ =
+      std::make_unique<ReadSizeProbe>(min_read_size_, kMaxReadBufferSize);
+  LoadCheckpoint();
   StartPartitionHashing();
   abort_action_completer.set_should_complete(false);
 }
@@ -132,12 +162,22 @@ void FilesystemVerifierAction::TerminateProcessing() {
 }
 
 void FilesystemVerifierAction::Cleanup(ErrorCode code) {
+  // Stops the threads of the hashers before the partitions are unmapped.
+  parallel_hashers_.clear();
+  segment_hashers_.clear();
+  EarlyPartitionHasher::GetInstance()->Reset();
+  pending_task_id_.Cancel();
+  if (prefs_ && !cancelled_ && code == ErrorCode::kSuccess) {
+    prefs_->Delete(kPrefsVerifyPartitionOffset);
+    prefs_->Delete(kPrefsVerifySHA256Context);
+    prefs_->Delete(kPrefsVerifyPartitionIndex);
+  }
   partition_fd_.reset();
   // This memory is not used anymore.
-  buffer_.clear();
+  buffer_ = AlignedBufferPool::Buffer();
 
   // If we didn't write verity, partitions were maped. Releaase resource now.
-  if (!install_plan_.write_verity &&
+  if (!install_plan_.write_verity && !install_plan_.verify_from_cow &&
       dynamic_control_->UpdateUsesSnapshotCompression()) {
     LOG(INFO) << "Not writing verity and VABC is enabled, unmapping all "
                  "partitions";
@@ -168,7 +208,7 @@ bool FilesystemVerifierAction::InitializeFdVABC(bool should_write_verity) {
   const InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
 
-  if (!should_write_verity) {
+  if (!should_write_verity && !install_plan_.verify_from_cow) {
     // In VABC, we cannot map/unmap partitions w/o first closing ALL fds first.
     // Since this function might be called inside a ScheduledTask, the closure
     // might have a copy of partition_fd_ when executing this function. Which
@@ -194,6 +234,8 @@ bool FilesystemVerifierAction::InitializeFdVABC(bool should_write_verity) {
     }
     return InitializeFd(partition.readonly_target_path);
   }
+  // The COW reader resolves the blocks of the snapshot from the COW and the
+  // source partition in process, without going through snapuserd.
   partition_fd_ =
       dynamic_control_->OpenCowFd(partition.name, partition.source_path, true);
   if (!partition_fd_) {
@@ -206,14 +248,23 @@ bool FilesystemVerifierAction::InitializeFdVABC(bool should_write_verity) {
 }
 
 bool FilesystemVerifierAction::InitializeFd(const std::string& part_path) {
-  partition_fd_ = std::make_unique<EintrSafeFileDescriptor>();
   const bool write_verity = ShouldWriteVerity();
   int flags = write_verity ? O_RDWR : O_RDONLY;
   if (!utils::SetBlockDeviceReadOnly(part_path, !write_verity)) {
     LOG(WARNING) << "Failed to set block device " << part_path << " as "
                  << (write_verity ? "writable" : "readonly");
   }
-  if (!partition_fd_->Open(part_path.c_str(), flags)) {
+  // Reuse the descriptor a plain partition was written with, if any. Snapshot
+  // devices get remapped while verifying, so they can't be kept open.
+  if (IsVABC(install_plan_.partitions[partition_index_])) {
+    partition_fd_ = CreateAsyncFileDescriptor();
+    if (!partition_fd_->Open(part_path.c_str(), flags)) {
+      partition_fd_.reset();
+    }
+  } else {
+    partition_fd_ = PartitionFdCache::GetInstance()->Open(part_path, flags);
+  }
+  if (!partition_fd_) {
     LOG(ERROR) << "Unable to open " << part_path << " for reading.";
     return false;
   }
@@ -225,7 +276,10 @@ void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd,
                                                const size_t buffer_size) {
   if (verity_writer_->FECFinished()) {
     LOG(INFO) << "EncodeFEC is completed. Resuming other tasks";
-    if (dynamic_control_->UpdateUsesSnapshotCompression()) {
+    // The COW descriptor the verity data was written with already reads it
+    // back when the snapshots are read from their COW.
+    if (dynamic_control_->UpdateUsesSnapshotCompression() &&
+        !install_plan_.verify_from_cow) {
       // Spin up snapuserd to read fs.
       if (!InitializeFdVABC(false)) {
         LOG(ERROR) << "Failed to map all partitions";
@@ -265,34 +319,38 @@ void FilesystemVerifierAction::WriteVerityAndHashPartition(
     WriteVerityData(fd, buffer, buffer_size);
     return;
   }
-  const auto cur_offset = fd->Seek(start_offset, SEEK_SET);
-  if (cur_offset != start_offset) {
-    PLOG(ERROR) << "Failed to seek to offset: " << start_offset;
-    Cleanup(ErrorCode::kVerityCalculationError);
-    return;
-  }
-  const auto read_size =
-      std::min<uint64_t>(buffer_size, end_offset - start_offset);
-  const auto bytes_read = fd->Read(buffer, read_size);
-  if (bytes_read < 0 || static_cast<size_t>(bytes_read) != read_size) {
-    PLOG(ERROR) << "Failed to read offset " << start_offset << " expected "
-                << read_size << " bytes, actual: " << bytes_read;
-    Cleanup(ErrorCode::kVerityCalculationError);
-    return;
+  const auto read_size = std::min<uint64_t>(
+      std::min(buffer_size, read_size_probe_->read_size()),
+      end_offset - start_offset);
+  const auto read_start = base::TimeTicks::Now();
+  {
+    TRACE_SCOPE("FilesystemVerifierAction read");
+    if (!fd->ReadAt({{buffer,
+                      static_cast<size_t>(read_size),
+                      static_cast<uint64_t>(start_offset)}})) {
+      PLOG(ERROR) << "Failed to read " << read_size << " bytes at offset "
+                  << start_offset;
+      Cleanup(ErrorCode::kVerityCalculationError);
+      return;
+    }
   }
-  if (!verity_writer_->Update(
-          start_offset, static_cast<const uint8_t*>(buffer), read_size)) {
-    LOG(ERROR) << "VerityWriter::Update() failed";
-    Cleanup(ErrorCode::kVerityCalculationError);
-    return;
+  read_size_probe_->AddRead(read_size, base::TimeTicks::Now() - read_start);
+  {
+    TRACE_SCOPE("FilesystemVerifierAction verity");
+    if (!verity_writer_->Update(
+            start_offset, static_cast<const uint8_t*>(buffer), read_size)) {
+      LOG(ERROR) << "VerityWriter::Update() failed";
+      Cleanup(ErrorCode::kVerityCalculationError);
+      return;
+    }
   }
-  UpdatePartitionProgress((start_offset + bytes_read) * 1.0f / partition_size_ *
+  UpdatePartitionProgress((start_offset + read_size) * 1.0f / partition_size_ *
                           kVerityProgressPercent);
   CHECK(pending_task_id_.PostTask(
       FROM_HERE,
       base::BindOnce(&FilesystemVerifierAction::WriteVerityAndHashPartition,
                      base::Unretained(this),
-                     start_offset + bytes_read,
+                     start_offset + read_size,
                      end_offset,
                      buffer,
                      buffer_size)));
@@ -311,27 +369,36 @@ void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
     FinishPartitionHashing();
     return;
   }
-  const auto cur_offset = fd->Seek(start_offset, SEEK_SET);
-  if (cur_offset != start_offset) {
-    PLOG(ERROR) << "Failed to seek to offset: " << start_offset;
-    Cleanup(ErrorCode::kFilesystemVerifierError);
-    return;
+  const auto read_size = std::min<uint64_t>(
+      std::min(buffer_size, read_size_probe_->read_size()),
+      end_offset - start_offset);
+  const auto read_start = base::TimeTicks::Now();
+  {
+    TRACE_SCOPE("FilesystemVerifierAction read");
+    if (!fd->ReadAt({{buffer,
+                      static_cast<size_t>(read_size),
+                      static_cast<uint64_t>(start_offset)}})) {
+      PLOG(ERROR) << "Failed to read " << read_size << " bytes at offset "
+                  << start_offset;
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
   }
-  const auto read_size =
-      std::min<uint64_t>(buffer_size, end_offset - start_offset);
-  const auto bytes_read = fd->Read(buffer, read_size);
-  if (bytes_read < 0 || static_cast<size_t>(bytes_read) != read_size) {
-    PLOG(ERROR) << "Failed to read offset " << start_offset << " expected "
-                << read_size << " bytes, actual: " << bytes_read;
-    Cleanup(ErrorCode::kFilesystemVerifierError);
-    return;
+  read_size_probe_->AddRead(read_size, base::TimeTicks::Now() - read_start);
+  {
+    TRACE_SCOPE("FilesystemVerifierAction hash");
+    if (!hasher_->Update(buffer, read_size)) {
+      LOG(ERROR) << "Hasher updated failed on offset" << start_offset;
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
   }
-  if (!hasher_->Update(buffer, read_size)) {
-    LOG(ERROR) << "Hasher updated failed on offset" << start_offset;
-    Cleanup(ErrorCode::kFilesystemVerifierError);
-    return;
+  // Partitions with verity are only resumed from their start, the verity
+  // data is written again.
+  if (!ShouldWriteVerity()) {
+    SaveCheckpoint(start_offset + read_size, hasher_->GetContext());
   }
-  const auto progress = (start_offset + bytes_read) * 1.0f / partition_size_;
+  const auto progress = (start_offset + read_size) * 1.0f / partition_size_;
   // If we are writing verity, then the progress bar will be split between
   // verity writes and partition hashing. Otherwise, the entire progress bar is
   // dedicated to partition hashing for smooth progress.
@@ -346,7 +413,7 @@ void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
       FROM_HERE,
       base::BindOnce(&FilesystemVerifierAction::HashPartition,
                      base::Unretained(this),
-                     start_offset + bytes_read,
+                     start_offset + read_size,
                      end_offset,
                      buffer,
                      buffer_size)));
@@ -371,6 +438,32 @@ void FilesystemVerifierAction::StartPartitionHashing() {
     Cleanup(ErrorCode::kSuccess);
     return;
   }
+  if (!parallel_hashers_.empty()) {
+    // The partition is already being hashed.
+    CheckParallelHashing();
+    return;
+  }
+  // The checkpoint only applies to the partition hashed first.
+  const uint64_t resume_offset = resume_offset_;
+  const std::string resume_context = std::move(resume_context_);
+  resume_offset_ = 0;
+  resume_context_.clear();
+  if (CanHashInParallel(partition_index_)) {
+    if (!StartParallelHashing(resume_offset, resume_context)) {
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    CheckParallelHashing();
+    return;
+  }
+  if (ShouldVerifySegments(partition_index_)) {
+    if (!StartSegmentHashing()) {
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    CheckSegmentHashing();
+    return;
+  }
   const InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
   const auto& part_path = GetPartitionPath();
@@ -402,7 +495,12 @@ void FilesystemVerifierAction::StartPartitionHashing() {
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
-  buffer_.resize(kReadFileBufferSize);
+  // Reads use the part of the buffer |read_size_probe_| picks.
+  buffer_ = AlignedBufferPool::GetInstance()->Acquire(kMaxReadBufferSize);
+  if (buffer_.size() != static_cast<size_t>(kMaxReadBufferSize)) {
+    Cleanup(ErrorCode::kFilesystemVerifierError);
+    return;
+  }
   hasher_ = std::make_unique<HashCalculator>();
 
   filesystem_data_end_ = partition_size_;
@@ -427,8 +525,353 @@ void FilesystemVerifierAction::StartPartitionHashing() {
         0, filesystem_data_end_, buffer_.data(), buffer_.size());
   } else {
     LOG(INFO) << "Verity writes disabled on partition " << partition.name;
-    HashPartition(0, partition_size_, buffer_.data(), buffer_.size());
+    uint64_t start_offset = 0;
+    if (!resume_context.empty()) {
+      if (hasher_->SetContext(resume_context)) {
+        LOG(INFO) << "Resuming hashing at offset " << resume_offset;
+        start_offset = resume_offset;
+      } else {
+        LOG(WARNING) << "Invalid hash context, hashing from the start";
+        hasher_ = std::make_unique<HashCalculator>();
+      }
+    }
+    HashPartition(
+        start_offset, partition_size_, buffer_.data(), buffer_.size());
+  }
+}
+
+bool FilesystemVerifierAction::CanHashInParallel(size_t index) const {
+  if (verifier_step_ != VerifierStep::kVerifyTargetHash) {
+    return false;
+  }
+  const InstallPlan::Partition& partition = install_plan_.partitions[index];
+  if (partition.target_size == 0 || ShouldVerifySegments(index)) {
+    return false;
+  }
+  if (install_plan_.write_verity) {
+    // Partitions with verity are written to, and VABC partitions are all
+    // remapped before they're read, unless they're read from their COW.
+    if (partition.hash_tree_size > 0 || partition.fec_size > 0 ||
+        (IsVABC(partition) && !install_plan_.verify_from_cow)) {
+      return false;
+    }
   }
+  if (IsVABC(partition) && install_plan_.verify_from_cow) {
+    return true;
+  }
+  const auto& path = IsVABC(partition) ? partition.readonly_target_path
+                                       : partition.target_path;
+  return !path.empty();
+}
+
+bool FilesystemVerifierAction::StartParallelHashing(
+    uint64_t resume_offset, const std::string& resume_context) {
+  for (size_t index = partition_index_;
+       index < install_plan_.partitions.size() && CanHashInParallel(index);
+       index++) {
+    const InstallPlan::Partition& partition = install_plan_.partitions[index];
+    const auto& path = IsVABC(partition) ? partition.readonly_target_path
+                                         : partition.target_path;
+    if (!(IsVABC(partition) && install_plan_.verify_from_cow) &&
+        !utils::SetBlockDeviceReadOnly(path, true)) {
+      LOG(WARNING) << "Failed to set block device " << path << " as readonly";
+    }
+    // The checkpoint of a resumed verification means the partition wasn't
+    // written by this attempt.
+    if (index != partition_index_ || resume_context.empty()) {
+      auto early_hasher = EarlyPartitionHasher::GetInstance()->Take(
+          path, partition.target_size);
+      if (early_hasher) {
+        LOG(INFO) << "Partition " << index << " (" << partition.name
+                  << ") was hashed while applying the update";
+        parallel_hashers_.push_back(std::move(early_hasher));
+        continue;
+      }
+    }
+    bool direct_io = false;
+    auto fd = OpenForHashing(partition, path, &direct_io);
+    if (!fd) {
+      return false;
+    }
+    LOG(INFO) << "Hashing partition " << index << " (" << partition.name
+              << ") on device " << path << " in the background"
+              << (direct_io ? " with direct reads" : "");
+    const uint64_t offset =
+        index == partition_index_ && !resume_context.empty() ? resume_offset
+                                                             : 0;
+    auto hasher =
+        std::make_unique<PartitionHasher>(std::move(fd),
+                                          partition.target_size - offset,
+                                          min_read_size_,
+                                          kMaxReadBufferSize,
+                                          direct_io ? kDirectIoAlignment : 0,
+                                          read_limiter_.get());
+    if (offset > 0) {
+      LOG(INFO) << "Resuming hashing at offset " << offset;
+      hasher->set_offset(offset);
+      hasher->set_hash_context(resume_context);
+    }
+    parallel_hashers_.push_back(std::move(hasher));
+  }
+  return true;
+}
+
+void FilesystemVerifierAction::CheckParallelHashing() {
+  if (parallel_hashers_.empty()) {
+    return;
+  }
+  const size_t max_running = ThroughputGovernor::GetInstance()->LimitWorkers(
+      install_plan_.verify_threads);
+  size_t running = 0;
+  for (auto& hasher : parallel_hashers_) {
+    if (!hasher->started()) {
+      if (running >= max_running) {
+        break;
+      }
+      hasher->Start();
+    }
+    if (!hasher->done()) {
+      running++;
+    }
+  }
+  const auto& hasher = parallel_hashers_.front();
+  if (!hasher->done()) {
+    UpdatePartitionProgress(hasher->bytes_hashed() * 1.0 / hasher->size());
+    uint64_t offset = 0;
+    std::string context;
+    if (hasher->GetCheckpoint(&offset, &context)) {
+      SaveCheckpoint(offset, context);
+    }
+    CHECK(pending_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&FilesystemVerifierAction::CheckParallelHashing,
+                       base::Unretained(this)),
+        kParallelHashingPollInterval));
+    return;
+  }
+  if (!hasher->succeeded()) {
+    Cleanup(ErrorCode::kFilesystemVerifierError);
+    return;
+  }
+  const brillo::Blob hash = hasher->hash();
+  parallel_hashers_.pop_front();
+  VerifyPartitionHash(hash);
+}
+
+bool FilesystemVerifierAction::ShouldVerifySegments(size_t index) const {
+  const InstallPlan::Partition& partition = install_plan_.partitions[index];
+  if (verifier_step_ != VerifierStep::kVerifyTargetHash ||
+      !install_plan_.verify_segments ||
+      partition.target_segment_hashes.empty() ||
+      partition.target_path.empty() || IsVABC(partition)) {
+    return false;
+  }
+  // The verity data is only written at the end of the hashing.
+  return !install_plan_.write_verity ||
+         (partition.hash_tree_size == 0 && partition.fec_size == 0);
+}
+
+bool FilesystemVerifierAction::StartSegmentHashing() {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  const auto& copied = partition.target_copied_segments;
+  const size_t num_segments = copied.size();
+  const size_t num_hashed =
+      num_segments - std::count(copied.begin(), copied.end(), true);
+  LOG(INFO) << "Verifying " << num_hashed << " of " << num_segments
+            << " segments of partition " << partition_index_ << " ("
+            << partition.name << "), the others are only written by source "
+            << "copies";
+  if (!utils::SetBlockDeviceReadOnly(partition.target_path, true)) {
+    LOG(WARNING) << "Failed to set block device " << partition.target_path
+                 << " as readonly";
+  }
+  // Splits the runs of hashed segments so every thread gets some.
+  const size_t max_run = std::max<size_t>(
+      utils::DivRoundUp(num_hashed,
+                        std::max<size_t>(install_plan_.verify_threads, 1)),
+      1);
+  for (size_t first = 0; first < num_segments;) {
+    if (copied[first]) {
+      first++;
+      continue;
+    }
+    size_t end = first + 1;
+    while (end < num_segments && !copied[end] && end - first < max_run) {
+      end++;
+    }
+    bool direct_io = false;
+    auto fd = OpenForHashing(partition, partition.target_path, &direct_io);
+    if (!fd) {
+      return false;
+    }
+    const uint64_t offset = first * partition.target_segment_size;
+    const uint64_t size =
+        std::min(end * partition.target_segment_size, partition.target_size) -
+        offset;
+    auto hasher =
+        std::make_unique<PartitionHasher>(std::move(fd),
+                                          size,
+                                          min_read_size_,
+                                          kMaxReadBufferSize,
+                                          direct_io ? kDirectIoAlignment : 0,
+                                          read_limiter_.get());
+    hasher->set_offset(offset);
+    hasher->set_segment_size(partition.target_segment_size);
+    segment_hashers_.push_back({first, std::move(hasher)});
+    first = end;
+  }
+  return true;
+}
+
+void FilesystemVerifierAction::CheckSegmentHashing() {
+  const size_t max_running = ThroughputGovernor::GetInstance()->LimitWorkers(
+      install_plan_.verify_threads);
+  size_t running = 0;
+  uint64_t bytes_hashed = 0;
+  uint64_t total_bytes = 0;
+  for (auto& segment_hasher : segment_hashers_) {
+    auto& hasher = segment_hasher.hasher;
+    if (!hasher->started() && running < max_running) {
+      hasher->Start();
+    }
+    if (!hasher->done()) {
+      running++;
+    }
+    bytes_hashed += hasher->bytes_hashed();
+    total_bytes += hasher->size();
+  }
+  if (running > 0) {
+    UpdatePartitionProgress(bytes_hashed * 1.0 / total_bytes);
+    CHECK(pending_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&FilesystemVerifierAction::CheckSegmentHashing,
+                       base::Unretained(this)),
+        kParallelHashingPollInterval));
+    return;
+  }
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  size_t mismatches = 0;
+  for (const auto& segment_hasher : segment_hashers_) {
+    if (!segment_hasher.hasher->succeeded()) {
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    const auto& hashes = segment_hasher.hasher->segment_hashes();
+    for (size_t i = 0; i < hashes.size(); i++) {
+      const size_t segment = segment_hasher.first_segment + i;
+      if (hashes[i] == partition.target_segment_hashes[segment]) {
+        continue;
+      }
+      const uint64_t offset = segment * partition.target_segment_size;
+      LOG(ERROR) << "Segment " << segment << " of " << partition.name
+                 << ", bytes [" << offset << ", "
+                 << std::min(offset + partition.target_segment_size,
+                             partition.target_size)
+                 << "), has hash " << HexEncode(hashes[i]);
+      mismatches++;
+    }
+  }
+  segment_hashers_.clear();
+  FinishTargetVerification(mismatches == 0);
+}
+
+std::unique_ptr<FileDescriptor> FilesystemVerifierAction::OpenForHashing(
+    const InstallPlan::Partition& partition,
+    const std::string& path,
+    bool* direct_io) {
+  // Snapshots are read through snapuserd, only bypass the page cache of
+  // partitions read straight from their block device.
+  *direct_io = install_plan_.verify_direct_io && !IsVABC(partition) &&
+               partition.target_size % kDirectIoAlignment == 0;
+  if (IsVABC(partition) && install_plan_.verify_from_cow) {
+    auto fd = dynamic_control_->OpenCowFd(
+        partition.name, partition.source_path, true);
+    if (!fd) {
+      LOG(ERROR) << "Unable to open the COW of partition " << partition.name;
+    }
+    return fd;
+  }
+  if (*direct_io) {
+    auto fd = CreateAsyncFileDescriptor();
+    if (fd->Open(path.c_str(), O_RDONLY | O_DIRECT)) {
+      return fd;
+    }
+    PLOG(WARNING) << "Unable to open " << path << " for direct reads";
+    *direct_io = false;
+  }
+  // Like in InitializeFd(), only reuse the descriptors of plain partitions.
+  std::unique_ptr<FileDescriptor> fd;
+  if (IsVABC(partition)) {
+    fd = CreateAsyncFileDescriptor();
+    if (!fd->Open(path.c_str(), O_RDONLY)) {
+      fd.reset();
+    }
+  } else {
+    fd = PartitionFdCache::GetInstance()->Open(path, O_RDONLY);
+  }
+  if (!fd) {
+    LOG(ERROR) << "Unable to open " << path << " for reading.";
+    return nullptr;
+  }
+  return fd;
+}
+
+void FilesystemVerifierAction::LoadCheckpoint() {
+  int64_t index = 0;
+  if (!prefs_ || !install_plan_.is_resume ||
+      !prefs_->GetInt64(kPrefsVerifyPartitionIndex, &index)) {
+    return;
+  }
+  if (index < 0 ||
+      static_cast<uint64_t>(index) > install_plan_.partitions.size()) {
+    LOG(WARNING) << "Ignoring invalid verification checkpoint at partition "
+                 << index;
+    return;
+  }
+  partition_index_ = index;
+  int64_t offset = 0;
+  std::string context;
+  // The offset is only set once the context matches it.
+  if (partition_index_ < install_plan_.partitions.size() &&
+      prefs_->GetInt64(kPrefsVerifyPartitionOffset, &offset) && offset > 0 &&
+      static_cast<uint64_t>(offset) <
+          install_plan_.partitions[partition_index_].target_size &&
+      offset % kDirectIoAlignment == 0 &&
+      prefs_->GetString(kPrefsVerifySHA256Context, &context) &&
+      !context.empty()) {
+    resume_offset_ = offset;
+    resume_context_ = std::move(context);
+  }
+  LOG(INFO) << "Resuming verification at partition " << partition_index_
+            << " offset " << resume_offset_;
+}
+
+void FilesystemVerifierAction::SaveCheckpoint(uint64_t offset,
+                                              const std::string& context) {
+  if (!prefs_ || verifier_step_ != VerifierStep::kVerifyTargetHash) {
+    return;
+  }
+  const auto now = base::TimeTicks::Now();
+  if (now - last_checkpoint_time_ < kCheckpointInterval) {
+    return;
+  }
+  last_checkpoint_time_ = now;
+  // Each pref is written atomically, but not all of them together. Without
+  // an offset, the context is ignored.
+  prefs_->Delete(kPrefsVerifyPartitionOffset);
+  prefs_->SetInt64(kPrefsVerifyPartitionIndex, partition_index_);
+  prefs_->SetString(kPrefsVerifySHA256Context, context);
+  prefs_->SetInt64(kPrefsVerifyPartitionOffset, offset);
+}
+
+void FilesystemVerifierAction::SavePartitionsVerified() {
+  if (!prefs_) {
+    return;
+  }
+  prefs_->Delete(kPrefsVerifyPartitionOffset);
+  prefs_->SetInt64(kPrefsVerifyPartitionIndex, partition_index_);
 }
 
 bool FilesystemVerifierAction::IsVABC(
@@ -479,32 +922,27 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
     Cleanup(ErrorCode::kError);
     return;
   }
+  VerifyPartitionHash(hasher_->raw_hash());
+}
+
+void FilesystemVerifierAction::VerifyPartitionHash(const brillo::Blob& hash) {
   const InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
-  LOG(INFO) << "Hash of " << partition.name << ": "
-            << HexEncode(hasher_->raw_hash());
+  LOG(INFO) << "Hash of " << partition.name << ": " << HexEncode(hash);
 
   switch (verifier_step_) {
     case VerifierStep::kVerifyTargetHash:
-      if (partition.target_hash != hasher_->raw_hash()) {
-        LOG(ERROR) << "New '" << partition.name
-                   << "' partition verification failed.";
-        if (partition.source_hash.empty()) {
-          // No need to verify source if it is a full payload.
-          Cleanup(ErrorCode::kNewRootfsVerificationError);
-          return;
-        }
-        // If we have not verified source partition yet, now that the target
-        // partition does not match, and it's not a full payload, we need to
-        // switch to kVerifySourceHash step to check if it's because the
-        // source partition does not match either.
-        verifier_step_ = VerifierStep::kVerifySourceHash;
-      } else {
-        partition_index_++;
-      }
-      break;
+      FinishTargetVerification(partition.target_hash == hash);
+      return;
     case VerifierStep::kVerifySourceHash:
-      if (partition.source_hash != hasher_->raw_hash()) {
+      // This step finds out whether the source changed, so it always reads
+      // the partition, but the hash saves VerifyPayloadApplicable() a read.
+      SetVerifiedSourceHash(prefs_,
+                            install_plan_.source_verity_digest,
+                            partition.name,
+                            partition.source_size,
+                            hash);
+      if (partition.source_hash != hash) {
         LOG(ERROR) << "Old '" << partition.name
                    << "' partition verification failed.";
         LOG(ERROR) << "This is a server-side error due to mismatched delta"
@@ -517,7 +955,7 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
                       " means that the delta I've been given doesn't match my"
                       " existing system. The "
                    << partition.name << " partition I have has hash: "
-                   << Base64Encode(hasher_->raw_hash())
+                   << Base64Encode(hash)
                    << " but the update expected me to have "
                    << Base64Encode(partition.source_hash) << " .";
         LOG(INFO) << "To get the checksum of the " << partition.name
@@ -540,8 +978,32 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
       Cleanup(ErrorCode::kNewRootfsVerificationError);
       return;
   }
+}
+
+void FilesystemVerifierAction::FinishTargetVerification(bool verified) {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  if (!verified) {
+    LOG(ERROR) << "New '" << partition.name
+               << "' partition verification failed.";
+    if (partition.source_hash.empty()) {
+      // No need to verify source if it is a full payload.
+      Cleanup(ErrorCode::kNewRootfsVerificationError);
+      return;
+    }
+    // If we have not verified source partition yet, now that the target
+    // partition does not match, and it's not a full payload, we need to
+    // switch to kVerifySourceHash step to check if it's because the
+    // source partition does not match either.
+    verifier_step_ = VerifierStep::kVerifySourceHash;
+    // The following partitions don't matter anymore.
+    parallel_hashers_.clear();
+  } else {
+    partition_index_++;
+    SavePartitionsVerified();
+  }
   // Start hashing the next partition, if any.
-  buffer_.clear();
+  buffer_ = AlignedBufferPool::Buffer();
   if (partition_fd_) {
     partition_fd_->Close();
     partition_fd_.reset();
@@ -20,18 +20,23 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <deque>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/scoped_task_id.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/partition_hasher.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
 
 // This action will hash all the partitions of the target slot involved in the
@@ -80,6 +85,10 @@ class FilesystemVerifierAction : public InstallPlanAction {
     return this->delegate_;
   }
 
+  // Used to checkpoint the progress of the verification so that a resumed
+  // update continues from there, may be null.
+  void set_prefs(PrefsInterface* prefs) { prefs_ = prefs; }
+
   // Debugging/logging
   static std::string StaticType() { return "FilesystemVerifierAction"; }
   std::string Type() const override { return StaticType(); }
@@ -115,6 +124,64 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // and continue checking the next one.
   void FinishPartitionHashing();
 
+  // Checks |hash| of the current partition and continues checking the next
+  // one.
+  void VerifyPartitionHash(const brillo::Blob& hash);
+
+  // Falls back to checking the source partition if the target partition
+  // couldn't be |verified|, continues with the next partition otherwise.
+  void FinishTargetVerification(bool verified);
+
+  // Whether partition |index| is checked against its segment hashes instead
+  // of its hash, see InstallPlan::verify_segments.
+  bool ShouldVerifySegments(size_t index) const;
+
+  // Sets up |segment_hashers_| for the segments of the current partition not
+  // only written by source copies.
+  bool StartSegmentHashing();
+
+  // Keeps up to |install_plan_.verify_threads|, at least one, of
+  // |segment_hashers_| running and checks the segment hashes of the current
+  // partition once they are all done.
+  void CheckSegmentHashing();
+
+  // Opens |path|, the target device of |partition|, for a PartitionHasher,
+  // with O_DIRECT if enabled and possible. Sets |direct_io| to whether it
+  // did. Returns nullptr on failure.
+  std::unique_ptr<FileDescriptor> OpenForHashing(
+      const InstallPlan::Partition& partition,
+      const std::string& path,
+      bool* direct_io);
+
+  // Whether partition |index| can be hashed by a PartitionHasher, which reads
+  // ahead on a thread of its own and may run while other partitions are
+  // hashed, i.e. when the partition is only read.
+  bool CanHashInParallel(size_t index) const;
+
+  // Sets up |parallel_hashers_| for the current partition and the following
+  // ones which can be hashed in parallel. The current partition is hashed
+  // from |resume_offset| on, continuing the hash |resume_context|, if set.
+  bool StartParallelHashing(uint64_t resume_offset,
+                            const std::string& resume_context);
+
+  // Keeps up to |install_plan_.verify_threads|, at least one, of
+  // |parallel_hashers_| running and verifies the hash of the current
+  // partition once its hasher is done.
+  void CheckParallelHashing();
+
+  // Picks up where the checkpoint of a previous attempt verifying the same
+  // payload left off: skips the partitions already verified and sets
+  // |resume_offset_| and |resume_context_| for the next one.
+  void LoadCheckpoint();
+
+  // Records that the current partition is hashed up to |offset|, with hash
+  // context |context|. Does nothing if the last checkpoint is more recent than
+  // kCheckpointInterval.
+  void SaveCheckpoint(uint64_t offset, const std::string& context);
+
+  // Records that all the partitions before |partition_index_| are verified.
+  void SavePartitionsVerified();
+
   // Cleans up all the variables we use for async operations and tells the
   // ActionProcessor we're done w/ |code| as passed in. |cancelled_| should be
   // true if TerminateProcessing() was called.
@@ -143,7 +210,7 @@ class FilesystemVerifierAction : public InstallPlanAction {
   std::unique_ptr<FileDescriptor> partition_fd_;
 
   // Buffer for storing data we read.
-  brillo::Blob buffer_;
+  AlignedBufferPool::Buffer buffer_;
 
   bool cancelled_{false};  // true if the action has been cancelled.
 
@@ -173,6 +240,33 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // points to pending read callbacks from async stream.
   ScopedTaskId pending_task_id_;
 
+  // Hashers of the current partition and the following ones when they are
+  // hashed in parallel, in partition order.
+  std::deque<std::unique_ptr<PartitionHasher>> parallel_hashers_;
+  // Hashers of runs of segments of the current partition, see
+  // ShouldVerifySegments().
+  struct SegmentHasher {
+    // Index of the first segment |hasher| hashes.
+    size_t first_segment;
+    std::unique_ptr<PartitionHasher> hasher;
+  };
+  std::vector<SegmentHasher> segment_hashers_;
+  // Shared by the |parallel_hashers_| and |segment_hashers_|.
+  std::unique_ptr<ReadBandwidthLimiter> read_limiter_;
+
+  // The read size probing starts at.
+  size_t min_read_size_{0};
+  // Picks the read size of the partitions hashed on the main loop.
+  std::unique_ptr<ReadSizeProbe> read_size_probe_;
+
+  // Where the verification is checkpointed, may be null.
+  PrefsInterface* prefs_{nullptr};
+  base::TimeTicks last_checkpoint_time_;
+  // Loaded from the checkpoint, the offset the hashing of the current
+  // partition resumes at and the hash context of the bytes before it.
+  uint64_t resume_offset_{0};
+  std::string resume_context_;
+
   // Cumulative sum of partition sizes. Used for progress report.
   // This vector will always start with 0, and end with total size of all
   // partitions.
@@ -32,12 +32,15 @@
 #include <libsnapshot/cow_writer.h>
 #include <sys/stat.h>
 
+#include "update_engine/common/constants.h"
 #include "update_engine/common/dynamic_partition_control_stub.h"
+#include "update_engine/common/fake_prefs.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/mock_dynamic_partition_control.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/verified_source_hashes.h"
 #include "update_engine/payload_consumer/verity_writer_android.h"
 
 using brillo::MessageLoop;
@@ -126,6 +129,23 @@ class FilesystemVerifierActionTest : public ::testing::Test {
         HashCalculator::RawHashOfFile(target_part_.path(), &part.target_hash));
     return &part;
   }
+  // Splits |partition| into |num_segments| segments, hashed from the target
+  // partition file, none of them copied.
+  void SetSegmentHashes(InstallPlan::Partition* partition,
+                        size_t num_segments) {
+    brillo::Blob data;
+    ASSERT_TRUE(utils::ReadFile(target_part_.path(), &data));
+    partition->target_segment_size = PARTITION_SIZE / num_segments;
+    for (size_t i = 0; i < num_segments; i++) {
+      brillo::Blob hash;
+      ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+          data.data() + i * partition->target_segment_size,
+          partition->target_segment_size,
+          &hash));
+      partition->target_segment_hashes.push_back(hash);
+    }
+    partition->target_copied_segments.assign(num_segments, false);
+  }
   static void ZeroRange(FileDescriptorPtr fd,
                         size_t start_block,
                         size_t num_blocks) {
@@ -192,6 +212,7 @@ class FilesystemVerifierActionTest : public ::testing::Test {
   brillo::FakeMessageLoop loop_{nullptr};
   ActionProcessor processor_;
   DynamicPartitionControlStub dynamic_control_stub_;
+  FakePrefs prefs_;
   std::vector<unsigned char> fec_data_;
   std::vector<unsigned char> hash_tree_data_;
   static ScopedTempFile source_part_;
@@ -348,6 +369,7 @@ void FilesystemVerifierActionTest::BuildActions(
   auto feeder_action = std::make_unique<ObjectFeederAction<InstallPlan>>();
   auto verifier_action =
       std::make_unique<FilesystemVerifierAction>(dynamic_control);
+  verifier_action->set_prefs(&prefs_);
   auto collector_action =
       std::make_unique<ObjectCollectorAction<InstallPlan>>();
 
@@ -638,6 +660,206 @@ void FilesystemVerifierActionTest::DoTestVABC(bool clear_target_hash,
   }
 }
 
+TEST_F(FilesystemVerifierActionTest, ParallelHashing) {
+  install_plan_.verify_threads = 2;
+  AddFakePartition(&install_plan_, "part_a");
+  AddFakePartition(&install_plan_, "part_b");
+  AddFakePartition(&install_plan_, "part_c");
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, ParallelHashingTargetMismatch) {
+  install_plan_.verify_threads = 2;
+  AddFakePartition(&install_plan_, "part_a");
+  auto part = AddFakePartition(&install_plan_, "part_b");
+  AddFakePartition(&install_plan_, "part_c");
+  // The source of the mismatching partition is hashed next, its hash matches.
+  part->target_hash[0] ^= 1;
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, SourceHashSavedForVerityDigest) {
+  install_plan_.source_verity_digest = "digest";
+  auto part = AddFakePartition(&install_plan_);
+  part->target_hash[0] ^= 1;
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+  brillo::Blob saved_hash;
+  ASSERT_TRUE(GetVerifiedSourceHash(
+      &prefs_, "digest", part->name, part->source_size, &saved_hash));
+  ASSERT_EQ(part->source_hash, saved_hash);
+}
+
+TEST_F(FilesystemVerifierActionTest, SourceHashIgnoresSavedHash) {
+  install_plan_.source_verity_digest = "digest";
+  auto part = AddFakePartition(&install_plan_);
+  part->target_hash[0] ^= 1;
+  // The saved hash claims the source changed, the source is read again and
+  // matches.
+  brillo::Blob saved_hash = part->source_hash;
+  saved_hash[0] ^= 1;
+  SetVerifiedSourceHash(
+      &prefs_, "digest", part->name, part->source_size, saved_hash);
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+  ASSERT_TRUE(GetVerifiedSourceHash(
+      &prefs_, "digest", part->name, part->source_size, &saved_hash));
+  ASSERT_EQ(part->source_hash, saved_hash);
+}
+
+TEST_F(FilesystemVerifierActionTest, VerifySegmentsSkipsCopiedSegments) {
+  install_plan_.verify_segments = true;
+  install_plan_.verify_threads = 2;
+  auto part = AddFakePartition(&install_plan_);
+  SetSegmentHashes(part, 4);
+  // Neither the partition hash nor the hash of the copied segment are used.
+  part->target_hash[0] ^= 1;
+  part->target_segment_hashes[1][0] ^= 1;
+  part->target_copied_segments[1] = true;
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, ResumeSkipsVerifiedPartitions) {
+  install_plan_.is_resume = true;
+  AddFakePartition(&install_plan_, "part_a");
+  AddFakePartition(&install_plan_, "part_b");
+  // The first partition was verified before the update got suspended.
+  install_plan_.partitions[0].target_hash[0] ^= 1;
+  ASSERT_TRUE(prefs_.SetInt64(kPrefsVerifyPartitionIndex, 1));
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+  // The checkpoint is gone once verification succeeded.
+  ASSERT_FALSE(prefs_.Exists(kPrefsVerifyPartitionIndex));
+}
+
+TEST_F(FilesystemVerifierActionTest, ResumeContinuesPartitionHash) {
+  install_plan_.is_resume = true;
+  auto part = AddFakePartition(&install_plan_);
+  brillo::Blob source_data;
+  brillo::Blob target_data;
+  ASSERT_TRUE(utils::ReadFile(source_part_.path(), &source_data));
+  ASSERT_TRUE(utils::ReadFile(target_part_.path(), &target_data));
+  // The checkpoint claims the first half hashed to the first half of the
+  // source partition, which only matches if hashing continues from there.
+  const size_t offset = PARTITION_SIZE / 2;
+  HashCalculator hasher;
+  ASSERT_TRUE(hasher.Update(source_data.data(), offset));
+  ASSERT_TRUE(prefs_.SetInt64(kPrefsVerifyPartitionIndex, 0));
+  ASSERT_TRUE(prefs_.SetString(kPrefsVerifySHA256Context, hasher.GetContext()));
+  ASSERT_TRUE(prefs_.SetInt64(kPrefsVerifyPartitionOffset, offset));
+  ASSERT_TRUE(hasher.Update(target_data.data() + offset, offset));
+  ASSERT_TRUE(hasher.Finalize());
+  part->target_hash = hasher.raw_hash();
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, VerifySegmentsMismatch) {
+  install_plan_.verify_segments = true;
+  auto part = AddFakePartition(&install_plan_);
+  SetSegmentHashes(part, 4);
+  part->target_segment_hashes[2][0] ^= 1;
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
 TEST_F(FilesystemVerifierActionTest, VABC_NoVerity_Success) {
   DoTestVABC(false, false);
 }
@@ -685,4 +907,42 @@ TEST_F(FilesystemVerifierActionTest, VABC_Verity_Target_Mismatch) {
   DoTestVABC(true, true);
 }
 
+TEST_F(FilesystemVerifierActionTest, VABC_FromCow_Success) {
+  auto part_ptr = AddFakePartition(&install_plan_);
+  ASSERT_NE(part_ptr, nullptr);
+  InstallPlan::Partition& part = *part_ptr;
+  install_plan_.verify_from_cow = true;
+  // Neither the snapshot device nor the target partition are read.
+  part.target_path = "Shouldn't attempt to open this path";
+  part.readonly_target_path = "Shouldn't attempt to open this path either";
+  NiceMock<MockDynamicPartitionControl> dynamic_control;
+  EnableVABC(&dynamic_control, part.name);
+  const std::string cow_path = target_part_.path();
+  ON_CALL(dynamic_control, OpenCowFd(part.name, {part.source_path}, _))
+      .WillByDefault([cow_path]() {
+        auto cow_fd = std::make_unique<EintrSafeFileDescriptor>();
+        EXPECT_TRUE(cow_fd->Open(cow_path.c_str(), O_RDONLY));
+        return cow_fd;
+      });
+  EXPECT_CALL(dynamic_control, OpenCowFd(part.name, {part.source_path}, _))
+      .Times(AtLeast(1));
+  EXPECT_CALL(dynamic_control, MapAllPartitions()).Times(0);
+  EXPECT_CALL(dynamic_control, ListDynamicPartitionsForSlot(_, _, _))
+      .WillRepeatedly(
+          DoAll(SetArgPointee<2, std::vector<std::string>>({part.name}),
+                Return(true)));
+
+  BuildActions(install_plan_, &dynamic_control);
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
 }  // namespace chromeos_update_engine
@@ -19,8 +19,12 @@
 #include <fcntl.h>
 #include <glob.h>
 #include <linux/fs.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <memory>
+#include <optional>
 #include <utility>
 #include <vector>
 
@@ -29,6 +33,7 @@
 #include <bsdiff/bspatch.h>
 #include <puffin/brotli_util.h>
 #include <puffin/puffpatch.h>
+#include <zucchini/buffer_view.h>
 #include <zucchini/patch_reader.h>
 #include <zucchini/zucchini.h>
 
@@ -41,7 +46,10 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_bspatch.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -175,18 +183,83 @@ class PuffinExtentStream : public puffin::StreamInterface {
   DISALLOW_COPY_AND_ASSIGN(PuffinExtentStream);
 };
 
+// A read-only view of some extents of a file, mapped next to each other into
+// one contiguous range of memory. The pages are backed by the page cache, so
+// the kernel can reclaim them under memory pressure instead of the whole
+// range staying resident like a heap buffer would.
+class MappedExtents {
+ public:
+  MappedExtents() = default;
+  ~MappedExtents() {
+    if (addr_ != MAP_FAILED) {
+      munmap(addr_, size_);
+    }
+  }
+
+  // Maps |extents| of |fd|. Fails if |block_size| isn't a multiple of the page
+  // size or the file doesn't support mmap(), e.g. because it isn't a regular
+  // file or block device.
+  bool Map(int fd,
+           const google::protobuf::RepeatedPtrField<Extent>& extents,
+           size_t block_size) {
+    TEST_AND_RETURN_FALSE(fd >= 0 && addr_ == MAP_FAILED);
+    TEST_AND_RETURN_FALSE(block_size % getpagesize() == 0);
+    size_ = utils::BlocksInExtents(extents) * block_size;
+    TEST_AND_RETURN_FALSE(size_ > 0);
+    // Touching a mapped page past the end of the file raises SIGBUS, so bail
+    // out on extents which can't be read in the first place.
+    const off_t file_size = utils::FileSize(fd);
+    TEST_AND_RETURN_FALSE(file_size >= 0);
+    // Reserve the address range first, then map every extent over its part.
+    addr_ = mmap(nullptr, size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    TEST_AND_RETURN_FALSE_ERRNO(addr_ != MAP_FAILED);
+    uint8_t* dst = static_cast<uint8_t*>(addr_);
+    for (const auto& extent : extents) {
+      TEST_AND_RETURN_FALSE(extent.start_block() != kSparseHole);
+      const size_t length = extent.num_blocks() * block_size;
+      TEST_AND_RETURN_FALSE(extent.start_block() * block_size + length <=
+                            static_cast<uint64_t>(file_size));
+      TEST_AND_RETURN_FALSE_ERRNO(
+          mmap(dst,
+               length,
+               PROT_READ,
+               MAP_SHARED | MAP_FIXED,
+               fd,
+               static_cast<off_t>(extent.start_block() * block_size)) !=
+          MAP_FAILED);
+      dst += length;
+    }
+    return true;
+  }
+
+  const uint8_t* data() const { return static_cast<const uint8_t*>(addr_); }
+  size_t size() const { return size_; }
+
+ private:
+  void* addr_{MAP_FAILED};
+  size_t size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MappedExtents);
+};
+
 bool InstallOperationExecutor::ExecuteReplaceOperation(
     const InstallOperation& operation,
     std::unique_ptr<ExtentWriter> writer,
     const void* data) {
   TEST_AND_RETURN_FALSE(operation.type() == InstallOperation::REPLACE ||
                         operation.type() == InstallOperation::REPLACE_BZ ||
-                        operation.type() == InstallOperation::REPLACE_XZ);
+                        operation.type() == InstallOperation::REPLACE_XZ ||
+                        operation.type() == InstallOperation::REPLACE_ZSTD);
   // Setup the ExtentWriter stack based on the operation type.
   if (operation.type() == InstallOperation::REPLACE_BZ) {
-    writer.reset(new BzipExtentWriter(std::move(writer)));
+    writer.reset(
+        new BzipExtentWriter(std::move(writer), decompress_buffer_size_));
   } else if (operation.type() == InstallOperation::REPLACE_XZ) {
-    writer.reset(new XzExtentWriter(std::move(writer)));
+    writer.reset(
+        new XzExtentWriter(std::move(writer), decompress_buffer_size_));
+  } else if (operation.type() == InstallOperation::REPLACE_ZSTD) {
+    writer.reset(
+        new ZstdExtentWriter(std::move(writer), decompress_buffer_size_));
   }
   TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
   TEST_AND_RETURN_FALSE(writer->Write(data, operation.data_length()));
@@ -201,20 +274,30 @@ bool InstallOperationExecutor::ExecuteZeroOrDiscardOperation(
   using base::MemoryMappedFile;
   using Access = base::MemoryMappedFile::Access;
   using Region = base::MemoryMappedFile::Region;
-  writer->Init(operation.dst_extents(), block_size_);
+  constexpr uint64_t kMaxZeroBufferSize = 16 * 1024 * 1024;  // 16 MiB
+  TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
+  uint64_t remaining =
+      utils::BlocksInExtents(operation.dst_extents()) * block_size_;
+  if (remaining == 0) {
+    return true;
+  }
   // Mmap a region of /dev/zero, as we don't need any actual memory to store
-  // these 0s, so mmap a region of "free memory".
+  // these 0s, so mmap a region of "free memory". Coalesced operations can
+  // cover most of a partition, so the region is written repeatedly.
   base::File dev_zero(base::FilePath("/dev/zero"),
                       base::File::FLAG_OPEN | base::File::FLAG_READ);
   MemoryMappedFile buffer;
   TEST_AND_RETURN_FALSE_ERRNO(buffer.Initialize(
       std::move(dev_zero),
-      Region{
-          0,
-          static_cast<size_t>(utils::BlocksInExtents(operation.dst_extents()) *
-                              block_size_)},
+      Region{0,
+             static_cast<size_t>(
+                 std::min<uint64_t>(remaining, kMaxZeroBufferSize))},
       Access::READ_ONLY));
-  writer->Write(buffer.data(), buffer.length());
+  while (remaining > 0) {
+    const size_t size = std::min<uint64_t>(remaining, buffer.length());
+    TEST_AND_RETURN_FALSE(writer->Write(buffer.data(), size));
+    remaining -= size;
+  }
   return true;
 }
 
@@ -266,31 +349,52 @@ bool InstallOperationExecutor::ExecuteLz4diffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  brillo::Blob src_data;
+  ScratchBufferPool::Buffer src_data = scratch_buffers_.Acquire(
+      utils::BlocksInExtents(operation.src_extents()) * block_size_);
+  DirectExtentReader reader;
+  TEST_AND_RETURN_FALSE(
+      reader.Init(source_fd, operation.src_extents(), block_size_));
+  TEST_AND_RETURN_FALSE(reader.Read(src_data.data(), src_data.size()));
 
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(
-      source_fd, operation.src_extents(), &src_data, block_size_));
+  // Operations may run concurrently, so every thread reuses its own buffers
+  // and LZ4HC states.
   TEST_AND_RETURN_FALSE(Lz4Patch(
-      ToStringView(src_data),
+      ToStringView(src_data.data(), src_data.size()),
       ToStringView(data, count),
       [writer(writer.get())](const uint8_t* data, size_t size) -> size_t {
         if (!writer->Write(data, size)) {
           return 0;
         }
         return size;
-      }));
+      },
+      Lz4Context::ForCurrentThread()));
   return true;
 }
 
+std::unique_ptr<ExtentReader> InstallOperationExecutor::CreateSourceReader(
+    const InstallOperation& operation, FileDescriptorPtr source_fd) {
+  std::unique_ptr<ExtentReader> reader;
+  if (utils::BlocksInExtents(operation.src_extents()) * block_size_ <=
+      kMaxBufferedSourceSize) {
+    reader =
+        std::make_unique<BufferedExtentReader>(scratch_buffers_.Acquire(0));
+  } else {
+    reader = std::make_unique<DirectExtentReader>();
+  }
+  if (!reader->Init(source_fd, operation.src_extents(), block_size_)) {
+    return nullptr;
+  }
+  return reader;
+}
+
 bool InstallOperationExecutor::ExecuteSourceBsdiffOperation(
     const InstallOperation& operation,
     std::unique_ptr<ExtentWriter> writer,
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd, operation.src_extents(), block_size_));
+  auto reader = CreateSourceReader(operation, source_fd);
+  TEST_AND_RETURN_FALSE(reader != nullptr);
   auto src_file = std::make_unique<BsdiffExtentFile>(
       std::move(reader),
       utils::BlocksInExtents(operation.src_extents()) * block_size_);
@@ -299,22 +403,55 @@ bool InstallOperationExecutor::ExecuteSourceBsdiffOperation(
       std::move(writer),
       utils::BlocksInExtents(operation.dst_extents()) * block_size_);
 
+  const uint8_t* patch = reinterpret_cast<const uint8_t*>(data);
+  if (IsZstdBsdiffPatch(patch, count)) {
+    TEST_AND_RETURN_FALSE(
+        ZstdBspatch(src_file.get(), dst_file.get(), patch, count));
+    return true;
+  }
   TEST_AND_RETURN_FALSE(bsdiff::bspatch(std::move(src_file),
                                         std::move(dst_file),
-                                        reinterpret_cast<const uint8_t*>(data),
+                                        patch,
                                         count) == 0);
   return true;
 }
 
+std::unique_ptr<ExtentReader>
+InstallOperationExecutor::CreatePuffDiffSourceReader(
+    const InstallOperation& operation, FileDescriptorPtr source_fd) {
+  const uint64_t src_size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size_;
+  // The source was verified against its hash before being used, so data with
+  // the same hash is the same.
+  if (!operation.has_src_sha256_hash() || src_size > kMaxBufferedSourceSize) {
+    return CreateSourceReader(operation, source_fd);
+  }
+  auto data = puffdiff_sources_.Get(operation.src_sha256_hash());
+  if (data == nullptr) {
+    auto blob = std::make_shared<brillo::Blob>(src_size);
+    DirectExtentReader reader;
+    if (!reader.Init(source_fd, operation.src_extents(), block_size_) ||
+        !reader.Read(blob->data(), blob->size())) {
+      return nullptr;
+    }
+    data = std::move(blob);
+    puffdiff_sources_.Put(operation.src_sha256_hash(), data);
+  }
+  auto reader = std::make_unique<SharedExtentReader>(std::move(data));
+  if (!reader->Init(source_fd, operation.src_extents(), block_size_)) {
+    return nullptr;
+  }
+  return reader;
+}
+
 bool InstallOperationExecutor::ExecutePuffDiffOperation(
     const InstallOperation& operation,
     std::unique_ptr<ExtentWriter> writer,
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd, operation.src_extents(), block_size_));
+  auto reader = CreatePuffDiffSourceReader(operation, source_fd);
+  TEST_AND_RETURN_FALSE(reader != nullptr);
   puffin::UniqueStreamPtr src_stream(new PuffinExtentStream(
       std::move(reader),
       utils::BlocksInExtents(operation.src_extents()) * block_size_));
@@ -341,19 +478,29 @@ bool InstallOperationExecutor::ExecuteZucchiniOperation(
     size_t count) {
   uint64_t src_size =
       utils::BlocksInExtents(operation.src_extents()) * block_size_;
-  brillo::Blob source_bytes(src_size);
-
-  // TODO(197361113) either make zucchini stream the read, or use memory mapped
-  // files.
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd, operation.src_extents(), block_size_));
-  TEST_AND_RETURN_FALSE(reader->Seek(0));
-  TEST_AND_RETURN_FALSE(reader->Read(source_bytes.data(), src_size));
+  // Zucchini needs random access to the whole source image. Map it from the
+  // source partition when possible, so it doesn't add to the anonymous memory
+  // already taken by the target image. Fall back to reading it into a buffer
+  // for sources without a plain fd, e.g. when reading through ECC.
+  MappedExtents mapped_source;
+  std::optional<ScratchBufferPool::Buffer> source_buffer;
+  zucchini::ConstBufferView source_bytes;
+  const int source_raw_fd = source_fd->Fd();
+  if (source_raw_fd >= 0 &&
+      mapped_source.Map(source_raw_fd, operation.src_extents(), block_size_)) {
+    source_bytes = {mapped_source.data(), mapped_source.size()};
+  } else {
+    source_buffer.emplace(scratch_buffers_.Acquire(src_size));
+    DirectExtentReader reader;
+    TEST_AND_RETURN_FALSE(
+        reader.Init(source_fd, operation.src_extents(), block_size_));
+    TEST_AND_RETURN_FALSE(reader.Read(source_buffer->data(), src_size));
+    source_bytes = {source_buffer->data(), source_buffer->size()};
+  }
 
-  brillo::Blob zucchini_patch;
+  ScratchBufferPool::Buffer zucchini_patch = scratch_buffers_.Acquire(0);
   TEST_AND_RETURN_FALSE(puffin::BrotliDecode(
-      static_cast<const uint8_t*>(data), count, &zucchini_patch));
+      static_cast<const uint8_t*>(data), count, zucchini_patch.blob()));
   auto patch_reader = zucchini::EnsemblePatchReader::Create(
       {zucchini_patch.data(), zucchini_patch.size()});
   if (!patch_reader.has_value()) {
@@ -366,9 +513,9 @@ bool InstallOperationExecutor::ExecuteZucchiniOperation(
                         utils::BlocksInExtents(operation.dst_extents()) *
                             block_size_);
 
-  brillo::Blob patched_data(dst_size);
+  ScratchBufferPool::Buffer patched_data = scratch_buffers_.Acquire(dst_size);
   auto status =
-      zucchini::ApplyBuffer({source_bytes.data(), source_bytes.size()},
+      zucchini::ApplyBuffer(source_bytes,
                             *patch_reader,
                             {patched_data.data(), patched_data.size()});
   if (status != zucchini::status::kStatusSuccess) {
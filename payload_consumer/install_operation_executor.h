@@ -19,17 +19,31 @@
 
 #include <memory>
 
+#include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/scratch_buffer_pool.h"
+#include "update_engine/payload_consumer/source_data_cache.h"
+#include "update_engine/payload_consumer/xz_extent_writer.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
 class InstallOperationExecutor {
  public:
+  // The largest source of a SOURCE_BSDIFF, BROTLI_BSDIFF or PUFFDIFF operation
+  // read in a single batch before patching.
+  static constexpr size_t kMaxBufferedSourceSize = 16 * 1024 * 1024;  // 16 MiB
+
   explicit InstallOperationExecutor(size_t block_size)
       : block_size_(block_size) {}
 
+  // Size of the buffer REPLACE_BZ, REPLACE_XZ and REPLACE_ZSTD blobs are
+  // decompressed into before being handed to the ExtentWriter.
+  void set_decompress_buffer_size(size_t size) {
+    decompress_buffer_size_ = size;
+  }
+
   // data should point to the memory of operation.data_length() bytes
   bool ExecuteReplaceOperation(const InstallOperation& operation,
                                std::unique_ptr<ExtentWriter> writer,
@@ -68,7 +82,25 @@ class InstallOperationExecutor {
                                const void* data,
                                size_t count);
 
+  // Returns a reader of the source extents of |operation| for patchers doing
+  // many small reads. Sources up to kMaxBufferedSourceSize are read at once
+  // into a scratch buffer, the larger ones are read as the patcher goes.
+  std::unique_ptr<ExtentReader> CreateSourceReader(
+      const InstallOperation& operation, FileDescriptorPtr source_fd);
+
+  // Returns a reader of the source extents of the PUFFDIFF |operation|. The
+  // sources are cached by their hash, as several PUFFDIFF operations may patch
+  // the same one.
+  std::unique_ptr<ExtentReader> CreatePuffDiffSourceReader(
+      const InstallOperation& operation, FileDescriptorPtr source_fd);
+
   size_t block_size_;
+  size_t decompress_buffer_size_{XzExtentWriter::kDefaultOutputBufferSize};
+  // Source and target images of diff operations, reused across the operations
+  // of the partition.
+  ScratchBufferPool scratch_buffers_;
+  // The verified sources of the last PUFFDIFF operations of the partition.
+  SourceDataCache puffdiff_sources_;
 };
 
 }  // namespace chromeos_update_engine
@@ -37,6 +37,7 @@
 #include <puffin/brotli_util.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/cached_file_descriptor.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/fake_extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
@@ -122,6 +123,51 @@ class InstallOperationExecutorTest : public ::testing::Test {
           << " is modified but it shouldn't.";
     }
   }
+
+  // Applies a zucchini patch from |source_data_| to |target_data_| with the
+  // source and destination extents of |op| and checks the result.
+  void RunZucchiniOp(const InstallOperation& op) {
+    // Make a zucchini patch
+    std::vector<Extent> src_extents{ExtentForRange(0, NUM_BLOCKS)};
+    std::vector<Extent> dst_extents{ExtentForRange(0, NUM_BLOCKS)};
+    PayloadGenerationConfig config{
+        .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                  kZucchiniMinorPayloadVersion)};
+    const FilesystemInterface::File empty;
+    diff_utils::BestDiffGenerator best_diff_generator(source_data_,
+                                                      target_data_,
+                                                      src_extents,
+                                                      dst_extents,
+                                                      empty,
+                                                      empty,
+                                                      config);
+    std::vector<uint8_t> patch_data = target_data_;  // Fake the full operation
+    AnnotatedOperation aop;
+    // Zucchini is enabled only on files with certain extensions
+    aop.name = "test.so";
+    ASSERT_TRUE(best_diff_generator.GenerateBestDiffOperation(
+        {{InstallOperation::ZUCCHINI, 1024 * BLOCK_SIZE}}, &aop, &patch_data));
+    ASSERT_EQ(InstallOperation::ZUCCHINI, aop.op.type());
+
+    // Call the executor
+    ScopedTempFile patched{"patched.XXXXXXXX", true};
+    FileDescriptorPtr patched_fd = std::make_shared<EintrSafeFileDescriptor>();
+    patched_fd->Open(patched.path().c_str(), O_RDWR);
+    std::unique_ptr<ExtentWriter> writer(new DirectExtentWriter(patched_fd));
+    writer->Init(op.dst_extents(), BLOCK_SIZE);
+    ASSERT_TRUE(executor_.ExecuteDiffOperation(op,
+                                               std::move(writer),
+                                               source_fd_,
+                                               patch_data.data(),
+                                               patch_data.size()));
+
+    // Compare the result
+    std::vector<uint8_t> patched_data;
+    ASSERT_TRUE(utils::ReadFile(patched.path(), &patched_data));
+    ASSERT_EQ(NUM_BLOCKS * BLOCK_SIZE, patched_data.size());
+    ASSERT_EQ(target_data_, patched_data);
+  }
+
   ScopedTempFile source_{"source_partition.XXXXXXXX", true};
   ScopedTempFile target_{"target_partition.XXXXXXXX", true};
   FileDescriptorPtr source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
@@ -229,43 +275,47 @@ TEST_F(InstallOperationExecutorTest, ZucchiniOpTest) {
   op.set_type(InstallOperation::ZUCCHINI);
   *op.mutable_src_extents()->Add() = ExtentForRange(0, NUM_BLOCKS);
   *op.mutable_dst_extents()->Add() = ExtentForRange(0, NUM_BLOCKS);
+  RunZucchiniOp(op);
+}
 
-  // Make a zucchini patch
-  std::vector<Extent> src_extents{ExtentForRange(0, NUM_BLOCKS)};
-  std::vector<Extent> dst_extents{ExtentForRange(0, NUM_BLOCKS)};
-  PayloadGenerationConfig config{
-      .version = PayloadVersion(kBrilloMajorPayloadVersion,
-                                kZucchiniMinorPayloadVersion)};
-  const FilesystemInterface::File empty;
-  diff_utils::BestDiffGenerator best_diff_generator(source_data_,
-                                                    target_data_,
-                                                    src_extents,
-                                                    dst_extents,
-                                                    empty,
-                                                    empty,
-                                                    config);
-  std::vector<uint8_t> patch_data = target_data_;  // Fake the full operation
-  AnnotatedOperation aop;
-  // Zucchini is enabled only on files with certain extensions
-  aop.name = "test.so";
-  ASSERT_TRUE(best_diff_generator.GenerateBestDiffOperation(
-      {{InstallOperation::ZUCCHINI, 1024 * BLOCK_SIZE}}, &aop, &patch_data));
-  ASSERT_EQ(InstallOperation::ZUCCHINI, aop.op.type());
-
-  // Call the executor
-  ScopedTempFile patched{"patched.XXXXXXXX", true};
-  FileDescriptorPtr patched_fd = std::make_shared<EintrSafeFileDescriptor>();
-  patched_fd->Open(patched.path().c_str(), O_RDWR);
-  std::unique_ptr<ExtentWriter> writer(new DirectExtentWriter(patched_fd));
-  writer->Init(op.dst_extents(), BLOCK_SIZE);
-  ASSERT_TRUE(executor_.ExecuteDiffOperation(
-      op, std::move(writer), source_fd_, patch_data.data(), patch_data.size()));
-
-  // Compare the result
-  std::vector<uint8_t> patched_data;
-  ASSERT_TRUE(utils::ReadFile(patched.path(), &patched_data));
-  ASSERT_EQ(NUM_BLOCKS * BLOCK_SIZE, patched_data.size());
-  ASSERT_EQ(target_data_, patched_data);
+TEST_F(InstallOperationExecutorTest, ZucchiniOpFragmentedSourceTest) {
+  // The source image is mapped extent by extent, it must still look like the
+  // contiguous image the patch was generated from. Scatter it over a larger
+  // partition, in extents which are neither adjacent nor in order.
+  InstallOperation op;
+  op.set_type(InstallOperation::ZUCCHINI);
+  *op.mutable_src_extents()->Add() = ExtentForRange(12, 3);
+  *op.mutable_src_extents()->Add() = ExtentForRange(2, 4);
+  *op.mutable_src_extents()->Add() = ExtentForRange(20, NUM_BLOCKS - 7);
+  *op.mutable_dst_extents()->Add() = ExtentForRange(0, NUM_BLOCKS);
+
+  // Blocks outside of the extents don't belong to the image.
+  brillo::Blob partition_data(23 * BLOCK_SIZE, 0xEE);
+  size_t block = 0;
+  for (const auto& extent : op.src_extents()) {
+    std::copy(source_data_.begin() + block * BLOCK_SIZE,
+              source_data_.begin() +
+                  (block + extent.num_blocks()) * BLOCK_SIZE,
+              partition_data.begin() + extent.start_block() * BLOCK_SIZE);
+    block += extent.num_blocks();
+  }
+  ASSERT_EQ(NUM_BLOCKS, block);
+  ScopedTempFile partition{"source_partition.XXXXXXXX"};
+  ASSERT_TRUE(utils::WriteFile(
+      partition.path().c_str(), partition_data.data(), partition_data.size()));
+  source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  ASSERT_TRUE(source_fd_->Open(partition.path().c_str(), O_RDONLY));
+  RunZucchiniOp(op);
+}
+
+TEST_F(InstallOperationExecutorTest, ZucchiniOpUnmappableSourceTest) {
+  InstallOperation op;
+  op.set_type(InstallOperation::ZUCCHINI);
+  *op.mutable_src_extents()->Add() = ExtentForRange(0, NUM_BLOCKS);
+  *op.mutable_dst_extents()->Add() = ExtentForRange(0, NUM_BLOCKS);
+  // Sources without a plain fd are read into memory instead.
+  source_fd_ = std::make_shared<CachedFileDescriptor>(source_fd_, BLOCK_SIZE);
+  RunZucchiniOp(op);
 }
 
 TEST_F(InstallOperationExecutorTest, GetNthBlockTest) {
@@ -22,9 +22,12 @@
 #include <base/format_macros.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
+#include <android-base/scopeguard.h>
 #include <android-base/stringprintf.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
@@ -89,7 +92,8 @@ string InstallPlan::ToString() const {
   vector<string> result_str;
   result_str.emplace_back(VectorToString(
       {
-          {"type", (is_resume ? "resume" : "new_update")},
+          {"type",
+           (stage_payload ? "stage" : is_resume ? "resume" : "new_update")},
           {"version", version},
           {"source_slot", BootControlInterface::SlotName(source_slot)},
           {"target_slot", BootControlInterface::SlotName(target_slot)},
@@ -146,6 +150,16 @@ string InstallPlan::ToString() const {
 }
 
 bool InstallPlan::LoadPartitionsFromSlots(BootControlInterface* boot_control) {
+  // Map all the partitions before waiting for any of their devices.
+  auto dynamic_control = boot_control->GetDynamicPartitionControl();
+  if (dynamic_control != nullptr) {
+    dynamic_control->StartMappingPartitions();
+  }
+  auto finish_mapping = android::base::make_scope_guard([dynamic_control] {
+    if (dynamic_control != nullptr) {
+      dynamic_control->FinishMappingPartitions();
+    }
+  });
   bool result = true;
   for (Partition& partition : partitions) {
     if (source_slot != BootControlInterface::kInvalidSlot &&
@@ -167,6 +181,10 @@ bool InstallPlan::LoadPartitionsFromSlots(BootControlInterface* boot_control) {
       partition.target_path.clear();
     }
   }
+  finish_mapping.Disable();
+  if (dynamic_control != nullptr) {
+    TEST_AND_RETURN_FALSE(dynamic_control->FinishMappingPartitions());
+  }
   return result;
 }
 
@@ -179,7 +197,8 @@ bool InstallPlan::Partition::operator==(
           run_postinstall == that.run_postinstall &&
           postinstall_path == that.postinstall_path &&
           filesystem_type == that.filesystem_type &&
-          postinstall_optional == that.postinstall_optional);
+          postinstall_optional == that.postinstall_optional &&
+          postinstall_parallel == that.postinstall_parallel);
 }
 
 bool InstallPlan::Partition::ParseVerityConfig(
@@ -220,6 +239,75 @@ bool InstallPlan::Partition::ParseVerityConfig(
   return true;
 }
 
+bool InstallPlan::Partition::ParseSegmentHashes(
+    const PartitionUpdate& partition) {
+  target_segment_size = 0;
+  target_segment_hashes.clear();
+  target_copied_segments.clear();
+  const PartitionInfo& info = partition.new_partition_info();
+  if (info.segment_hashes_size() == 0) {
+    return true;
+  }
+  const uint64_t segment_size = info.segment_size();
+  if (block_size == 0 || segment_size == 0 || segment_size % block_size != 0) {
+    LOG(ERROR) << "Invalid segment size " << segment_size;
+    return false;
+  }
+  const uint64_t num_segments =
+      (target_size + segment_size - 1) / segment_size;
+  if (static_cast<uint64_t>(info.segment_hashes_size()) != num_segments) {
+    LOG(ERROR) << "Expected " << num_segments << " segment hashes, got "
+               << info.segment_hashes_size();
+    return false;
+  }
+  if (info.has_segment_hashes_digest()) {
+    HashCalculator digest;
+    for (const auto& hash : info.segment_hashes()) {
+      TEST_AND_RETURN_FALSE(digest.Update(hash.data(), hash.size()));
+    }
+    TEST_AND_RETURN_FALSE(digest.Finalize());
+    if (brillo::Blob(info.segment_hashes_digest().begin(),
+                     info.segment_hashes_digest().end()) !=
+        digest.raw_hash()) {
+      LOG(ERROR) << "Segment hashes don't match their digest";
+      return false;
+    }
+  }
+
+  // Blocks the source copies write, minus any block also written by another
+  // operation, in whatever order.
+  ExtentRanges copied;
+  ExtentRanges written;
+  for (const auto& op : partition.operations()) {
+    if (op.type() == InstallOperation::SOURCE_COPY &&
+        op.has_src_sha256_hash()) {
+      copied.AddRepeatedExtents(op.dst_extents());
+    } else {
+      written.AddRepeatedExtents(op.dst_extents());
+    }
+  }
+  copied.SubtractRanges(written);
+
+  target_segment_size = segment_size;
+  target_segment_hashes.reserve(num_segments);
+  target_copied_segments.reserve(num_segments);
+  for (uint64_t i = 0; i < num_segments; i++) {
+    const auto& hash = info.segment_hashes(i);
+    target_segment_hashes.emplace_back(hash.begin(), hash.end());
+    const uint64_t offset = i * segment_size;
+    const uint64_t size = std::min(segment_size, target_size - offset);
+    // A trailing partial block is never covered by an operation.
+    bool is_copied = size % block_size == 0;
+    if (is_copied) {
+      const auto extents = copied.GetIntersectingExtents(
+          ExtentForRange(offset / block_size, size / block_size));
+      is_copied = utils::BlocksInExtents(extents) == size / block_size;
+    }
+    target_copied_segments.push_back(is_copied);
+  }
+  return true;
+}
+
 template <typename PartitinoUpdateArray>
 bool InstallPlan::ParseManifestToInstallPlan(
     const PartitinoUpdateArray& partitions,
@@ -240,6 +328,7 @@ bool InstallPlan::ParseManifestToInstallPlan(
                                             : kPostinstallDefaultScript);
       install_part.filesystem_type = partition.filesystem_type();
       install_part.postinstall_optional = partition.postinstall_optional();
+      install_part.postinstall_parallel = partition.postinstall_parallel();
     }
 
     if (partition.has_old_partition_info()) {
@@ -265,6 +354,12 @@ bool InstallPlan::ParseManifestToInstallPlan(
                 << "` verity configs";
       return false;
     }
+    if (!install_part.ParseSegmentHashes(partition)) {
+      *error = ErrorCode::kDownloadNewPartitionInfoError;
+      LOG(INFO) << "Failed to parse partition `" << partition.partition_name()
+                << "` segment hashes";
+      return false;
+    }
 
     install_plan->partitions.push_back(install_part);
   }
@@ -143,6 +143,9 @@ struct InstallPlan {
     std::string postinstall_path;
     std::string filesystem_type;
     bool postinstall_optional{false};
+    // Whether the postinstall program can run concurrently with the ones of
+    // other partitions.
+    bool postinstall_parallel{false};
 
     // Verity hash tree and FEC config. See update_metadata.proto for details.
     // All offsets and sizes are in bytes.
@@ -159,7 +162,16 @@ struct InstallPlan {
     uint64_t fec_size{0};
     uint32_t fec_roots{0};
 
+    // Per segment hashes of the target partition, see PartitionInfo.
+    // |target_copied_segments| tells, for every segment, whether all its
+    // blocks are only written by SOURCE_COPY operations with a source hash,
+    // which DeltaPerformer already verified.
+    uint64_t target_segment_size{0};
+    std::vector<brillo::Blob> target_segment_hashes;
+    std::vector<bool> target_copied_segments;
+
     bool ParseVerityConfig(const PartitionUpdate&);
+    bool ParseSegmentHashes(const PartitionUpdate&);
   };
   std::vector<Partition> partitions;
 
@@ -199,6 +211,90 @@ struct InstallPlan {
 
   // Whether to enable multi-threaded compression on COW writes
   std::optional<bool> enable_threading;
+
+  // Number of threads used to apply install operations of non-VABC
+  // partitions. 0 or 1 applies operations sequentially.
+  uint32_t apply_threads{0};
+
+  // Memory budget in bytes of the operations applied concurrently when
+  // |apply_threads| is greater than one. 0 uses a built-in default.
+  uint64_t apply_memory_limit{0};
+
+  // Maximum size in bytes of the raw block writes VABC partitions coalesce
+  // before handing them to the COW writer. 0 uses a built-in default.
+  uint64_t cow_batch_size{0};
+
+  // COW format version of the snapshots, from the dynamic partition metadata
+  // of the payload.
+  uint32_t cow_version{0};
+
+  // Number of upcoming operations whose source extents are read and hashed in
+  // the background while their data is still being downloaded. 0 disables it.
+  uint32_t source_prefetch_ops{0};
+
+  // Whether to record what every applied operation wrote, so that an update
+  // started over after a failure skips the operations whose target still
+  // holds that data. Only effective for partitions written in place, not for
+  // Virtual A/B snapshots which are recreated by every attempt.
+  bool reuse_applied_operations{false};
+
+  // Whether the partitions written in place are opened without O_DSYNC, their
+  // writes only made durable right before every checkpoint records progress.
+  // Resuming is just as safe, as nothing past the last checkpoint is trusted.
+  bool sync_on_checkpoint{false};
+
+  // Bytes of downloaded payload data buffered in memory while waiting to be
+  // applied, so that the download doesn't stall while operations are
+  // applied. 0 applies the data as it's received.
+  uint64_t download_ahead_size{0};
+  // Additional bytes buffered in a file once the memory buffer is full.
+  uint64_t download_ahead_spill_size{0};
+
+  // Minimum time in milliseconds between two reports of the download progress
+  // to the DownloadActionDelegate, the bytes received in between being
+  // reported at once. 0 reports every chunk received.
+  uint32_t progress_interval_ms{0};
+
+  // Whether to prepare the target partitions, i.e. create the snapshots, in a
+  // task of the main loop posted once the manifest is valid, buffering the
+  // payload data received until then.
+  bool prepare_partitions_async{false};
+
+  // Number of partitions FilesystemVerifierAction hashes at the same time,
+  // each one on a reader and a hashing thread of its own. Partitions it
+  // writes verity data to are hashed on the main loop instead. 0 or 1 hashes
+  // all partitions one at a time.
+  uint32_t verify_threads{0};
+  // Limit in bytes per second of the reads of all partitions hashed in
+  // parallel together. 0 doesn't limit them.
+  uint64_t verify_read_bandwidth{0};
+  // Whether FilesystemVerifierAction reads the partitions it only reads, and
+  // that aren't Virtual A/B snapshots, with O_DIRECT instead of going through
+  // the page cache.
+  bool verify_direct_io{false};
+  // Whether FilesystemVerifierAction reads the Virtual A/B Compression
+  // snapshots by resolving their blocks from the COW and source partitions
+  // itself, instead of mapping them and reading them through snapuserd.
+  bool verify_from_cow{false};
+
+  // The vbmeta digest the source slot was verified against by dm-verity, or
+  // empty if it isn't enforced. FilesystemVerifierAction saves the hashes of
+  // the source partitions it reads for this digest, see
+  // verified_source_hashes.h.
+  std::string source_verity_digest;
+
+  // Whether FilesystemVerifierAction checks the per segment hashes of the
+  // target partitions, skipping the segments only written by SOURCE_COPY
+  // operations, instead of hashing the whole partitions.
+  bool verify_segments{false};
+
+  // Whether DeltaPerformer starts hashing the target partitions it finished
+  // writing while applying the rest of the payload, see EarlyPartitionHasher.
+  bool early_verify{false};
+
+  // Whether the payload is only downloaded to /data by PayloadStagingAction,
+  // to be applied from there by a later update.
+  bool stage_payload{false};
 };
 
 class InstallPlanAction;
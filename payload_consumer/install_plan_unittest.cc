@@ -14,9 +14,18 @@
 // limitations under the License.
 //
 
+#include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/mock_boot_control.h"
+#include "update_engine/common/mock_dynamic_partition_control.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using testing::_;
+using testing::InSequence;
+using testing::Return;
 
 namespace chromeos_update_engine {
 
@@ -78,4 +87,101 @@ Payload: 0
   already_applied: false)");
 }
 
+TEST(InstallPlanTest, ParseSegmentHashes) {
+  PartitionUpdate update;
+  PartitionInfo* info = update.mutable_new_partition_info();
+  info->set_size(10 * 4096);
+  info->set_segment_size(4 * 4096);
+  for (int i = 0; i < 3; i++) {
+    info->add_segment_hashes(std::string(32, 'a' + i));
+  }
+  // Segment 0 is copied, segment 1 is copied but partially overwritten and
+  // the copy of segment 2 has no source hash.
+  InstallOperation* op = update.add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  op->set_src_sha256_hash(std::string(32, 'x'));
+  *op->add_dst_extents() = ExtentForRange(0, 8);
+  op = update.add_operations();
+  op->set_type(InstallOperation::REPLACE);
+  *op->add_dst_extents() = ExtentForRange(6, 1);
+  op = update.add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  *op->add_dst_extents() = ExtentForRange(8, 2);
+
+  InstallPlan::Partition partition;
+  partition.block_size = 4096;
+  partition.target_size = info->size();
+  ASSERT_TRUE(partition.ParseSegmentHashes(update));
+  EXPECT_EQ(4u * 4096, partition.target_segment_size);
+  ASSERT_EQ(3u, partition.target_segment_hashes.size());
+  EXPECT_EQ(brillo::Blob(32, 'c'), partition.target_segment_hashes[2]);
+  EXPECT_EQ(std::vector<bool>({true, false, false}),
+            partition.target_copied_segments);
+
+  // A digest of the segment hashes has to match them.
+  HashCalculator digest;
+  for (const auto& hash : info->segment_hashes()) {
+    ASSERT_TRUE(digest.Update(hash.data(), hash.size()));
+  }
+  ASSERT_TRUE(digest.Finalize());
+  info->set_segment_hashes_digest(digest.raw_hash().data(),
+                                  digest.raw_hash().size());
+  ASSERT_TRUE(partition.ParseSegmentHashes(update));
+  info->mutable_segment_hashes(0)->at(0) ^= 1;
+  ASSERT_FALSE(partition.ParseSegmentHashes(update));
+  info->clear_segment_hashes_digest();
+
+  // One hash is missing.
+  info->mutable_segment_hashes()->RemoveLast();
+  ASSERT_FALSE(partition.ParseSegmentHashes(update));
+}
+
+TEST(InstallPlanTest, LoadPartitionsFromSlotsMapsBeforeWaiting) {
+  MockBootControl boot_control;
+  MockDynamicPartitionControl dynamic_control;
+  ON_CALL(boot_control, GetDynamicPartitionControl())
+      .WillByDefault(Return(&dynamic_control));
+  InstallPlan install_plan;
+  install_plan.source_slot = 0;
+  install_plan.target_slot = 1;
+  install_plan.partitions = {{.name = "system", .target_size = 4096},
+                             {.name = "vendor", .target_size = 4096}};
+
+  // The devices of all partitions are looked up between starting and
+  // finishing the mapping.
+  PartitionDevice device{.rw_device_path = "/dev/block/dm-1"};
+  {
+    InSequence seq;
+    EXPECT_CALL(dynamic_control, StartMappingPartitions());
+    EXPECT_CALL(boot_control, GetPartitionDevice("system", 1, 0, _))
+        .WillOnce(Return(device));
+    EXPECT_CALL(boot_control, GetPartitionDevice("vendor", 1, 0, _))
+        .WillOnce(Return(device));
+    EXPECT_CALL(dynamic_control, FinishMappingPartitions())
+        .WillOnce(Return(true));
+  }
+  ASSERT_TRUE(install_plan.LoadPartitionsFromSlots(&boot_control));
+  EXPECT_EQ("/dev/block/dm-1", install_plan.partitions[1].target_path);
+  testing::Mock::VerifyAndClearExpectations(&boot_control);
+  testing::Mock::VerifyAndClearExpectations(&dynamic_control);
+
+  // A device that doesn't show up fails the load.
+  EXPECT_CALL(dynamic_control, StartMappingPartitions());
+  EXPECT_CALL(boot_control, GetPartitionDevice(_, 1, 0, _))
+      .WillRepeatedly(Return(device));
+  EXPECT_CALL(dynamic_control, FinishMappingPartitions())
+      .WillOnce(Return(false));
+  ASSERT_FALSE(install_plan.LoadPartitionsFromSlots(&boot_control));
+  testing::Mock::VerifyAndClearExpectations(&boot_control);
+  testing::Mock::VerifyAndClearExpectations(&dynamic_control);
+
+  // The mapping is finished even when looking up a device fails.
+  EXPECT_CALL(dynamic_control, StartMappingPartitions());
+  EXPECT_CALL(boot_control, GetPartitionDevice("system", 1, 0, _))
+      .WillOnce(Return(std::nullopt));
+  EXPECT_CALL(dynamic_control, FinishMappingPartitions())
+      .WillOnce(Return(true));
+  ASSERT_FALSE(install_plan.LoadPartitionsFromSlots(&boot_control));
+}
+
 }  // namespace chromeos_update_engine
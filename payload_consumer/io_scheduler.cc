@@ -0,0 +1,268 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_scheduler.h"
+
+#include <errno.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <base/files/file_enumerator.h>
+#include <base/files/file_path.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_util.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// From linux/ioprio.h, which isn't available everywhere.
+constexpr int kIoprioWhoProcess = 1;
+constexpr int kIoprioClassShift = 13;
+enum IoprioClass {
+  kIoprioClassNone = 0,
+  kIoprioClassBestEffort = 2,
+  kIoprioClassIdle = 3,
+};
+
+constexpr int IoprioValue(IoprioClass io_class, int level) {
+  return (io_class << kIoprioClassShift) | level;
+}
+
+// Returns the I/O priority of |phase|, raised when |boosted|.
+int PhasePriority(IoPhase phase, bool boosted) {
+  switch (phase) {
+    case IoPhase::kNone:
+      // The priority derived from the nice value of each thread.
+      return IoprioValue(kIoprioClassNone, 0);
+    case IoPhase::kApply:
+    case IoPhase::kVerify:
+      return IoprioValue(kIoprioClassBestEffort, boosted ? 4 : 7);
+    case IoPhase::kMergePrep:
+    case IoPhase::kStage:
+      return boosted ? IoprioValue(kIoprioClassBestEffort, 7)
+                     : IoprioValue(kIoprioClassIdle, 0);
+  }
+  return IoprioValue(kIoprioClassNone, 0);
+}
+
+uint64_t GetBandwidthPref(PrefsInterface* prefs, std::string_view key) {
+  int64_t bandwidth = 0;
+  if (!prefs->Exists(key)) {
+    return 0;
+  }
+  if (!prefs->GetInt64(key, &bandwidth) || bandwidth < 0) {
+    LOG(WARNING) << "Ignoring invalid pref " << key;
+    return 0;
+  }
+  return bandwidth;
+}
+
+}  // namespace
+
+const char* IoPhaseName(IoPhase phase) {
+  switch (phase) {
+    case IoPhase::kNone:
+      return "none";
+    case IoPhase::kApply:
+      return "apply";
+    case IoPhase::kVerify:
+      return "verify";
+    case IoPhase::kMergePrep:
+      return "merge_prep";
+    case IoPhase::kStage:
+      return "stage";
+  }
+  return "unknown";
+}
+
+int BestEffortIoPriority(int level) {
+  return IoprioValue(kIoprioClassBestEffort, std::clamp(level, 0, 7));
+}
+
+bool SetProcessIoPriority(pid_t pid, int ioprio) {
+  const std::string task_dir =
+      pid ? "/proc/" + std::to_string(pid) + "/task" : "/proc/self/task";
+  bool success = true;
+  base::FileEnumerator tasks(base::FilePath(task_dir),
+                             false /* recursive */,
+                             base::FileEnumerator::DIRECTORIES);
+  for (base::FilePath task = tasks.Next(); !task.empty(); task = tasks.Next()) {
+    int tid = 0;
+    if (!base::StringToInt(task.BaseName().value(), &tid)) {
+      continue;
+    }
+    // Threads may exit meanwhile.
+    if (syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, ioprio) != 0 &&
+        errno != ESRCH) {
+      PLOG(WARNING) << "Failed to set the I/O priority of thread " << tid;
+      success = false;
+    }
+  }
+  return success;
+}
+
+bool IsPowerSupplyCharging(const std::string& power_supply_dir) {
+  base::FileEnumerator supplies(base::FilePath(power_supply_dir),
+                                false /* recursive */,
+                                base::FileEnumerator::DIRECTORIES |
+                                    base::FileEnumerator::SHOW_SYM_LINKS);
+  for (base::FilePath supply = supplies.Next(); !supply.empty();
+       supply = supplies.Next()) {
+    std::string status;
+    if (!utils::ReadFile(supply.Append("status").value(), &status)) {
+      continue;
+    }
+    status = std::string(base::TrimWhitespaceASCII(status, base::TRIM_ALL));
+    if (status == "Charging" || status == "Full") {
+      return true;
+    }
+  }
+  return false;
+}
+
+IoScheduler* IoScheduler::GetInstance() {
+  static IoScheduler instance;
+  return &instance;
+}
+
+void IoScheduler::LoadPrefs(PrefsInterface* prefs) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  write_bandwidth_ = GetBandwidthPref(prefs, kPrefsIoWriteBandwidth);
+  boosted_write_bandwidth_ =
+      GetBandwidthPref(prefs, kPrefsIoBoostedWriteBandwidth);
+  tokens_ = 0;
+  last_refill_ = std::chrono::steady_clock::now();
+  // Check the charging state on the next write.
+  next_power_check_ = {};
+  LOG(INFO) << "Limiting writes to " << write_bandwidth_ << " bytes/s, "
+            << boosted_write_bandwidth_ << " bytes/s while charging (0 means "
+            << "unlimited).";
+}
+
+void IoScheduler::SetPhase(IoPhase phase) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (phase_ == phase) {
+    return;
+  }
+  phase_ = phase;
+  const auto now = std::chrono::steady_clock::now();
+  boosted_ = phase_ != IoPhase::kNone && IsCharging();
+  next_power_check_ = now + kPowerCheckInterval;
+  ApplyPriority();
+}
+
+IoPhase IoScheduler::phase() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return phase_;
+}
+
+bool IoScheduler::boosted() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return boosted_;
+}
+
+void IoScheduler::SetWriteBandwidthCap(uint64_t bandwidth) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  write_bandwidth_cap_ = bandwidth;
+}
+
+void IoScheduler::AcquireWrite(size_t bytes) {
+  std::chrono::duration<double> wait{0};
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto now = std::chrono::steady_clock::now();
+    UpdateBoost(now);
+    uint64_t bandwidth = boosted_ ? boosted_write_bandwidth_ : write_bandwidth_;
+    if (write_bandwidth_cap_ &&
+        (bandwidth == 0 || bandwidth > write_bandwidth_cap_)) {
+      bandwidth = write_bandwidth_cap_;
+    }
+    if (bandwidth == 0) {
+      last_refill_ = now;
+      return;
+    }
+    const std::chrono::duration<double> elapsed = now - last_refill_;
+    const double burst =
+        bandwidth * std::chrono::duration<double>(kBurstDuration).count();
+    tokens_ = std::min(burst, tokens_ + elapsed.count() * bandwidth);
+    last_refill_ = now;
+    tokens_ -= bytes;
+    if (tokens_ < 0) {
+      // Writes arriving meanwhile wait for the deficit of this one too.
+      wait = std::chrono::duration<double>(-tokens_ / bandwidth);
+    }
+  }
+  if (wait.count() > 0) {
+    std::this_thread::sleep_for(wait);
+  }
+}
+
+bool IoScheduler::SetIoPriority(int ioprio) {
+  return SetProcessIoPriority(0, ioprio);
+}
+
+bool IoScheduler::IsCharging() const {
+  return IsPowerSupplyCharging(power_supply_dir_);
+}
+
+void IoScheduler::UpdateBoost(std::chrono::steady_clock::time_point now) {
+  if (now < next_power_check_) {
+    return;
+  }
+  next_power_check_ = now + kPowerCheckInterval;
+  const bool boosted = IsCharging();
+  if (boosted == boosted_) {
+    return;
+  }
+  LOG(INFO) << (boosted ? "Boosting" : "Throttling") << " the update I/O.";
+  boosted_ = boosted;
+  tokens_ = 0;
+  ApplyPriority();
+}
+
+void IoScheduler::ApplyPriority() {
+  const int ioprio = PhasePriority(phase_, boosted_);
+  if (SetIoPriority(ioprio)) {
+    LOG(INFO) << "Set the I/O priority to " << (ioprio >> kIoprioClassShift)
+              << "/" << (ioprio & ((1 << kIoprioClassShift) - 1)) << ".";
+  }
+}
+
+ssize_t ThrottledFileDescriptor::Write(const void* buf, size_t count) {
+  scheduler_->AcquireWrite(count);
+  return fd_->Write(buf, count);
+}
+
+bool ThrottledFileDescriptor::WriteAt(const std::vector<IoRequest>& requests) {
+  size_t bytes = 0;
+  for (const auto& request : requests) {
+    bytes += request.size;
+  }
+  scheduler_->AcquireWrite(bytes);
+  return fd_->WriteAt(requests);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,183 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_SCHEDULER_H_
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/common/prefs_interface.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// The phases of an update, which get different I/O priorities.
+enum class IoPhase {
+  kNone,       // No update running, the default priority.
+  kApply,      // Writing the payload to the target partitions.
+  kVerify,     // Hashing the target partitions.
+  kMergePrep,  // Waiting for and preparing the merge of the snapshots.
+  kStage,      // Downloading the payload to /data ahead of the update.
+};
+
+const char* IoPhaseName(IoPhase phase);
+
+// Returns the I/O priority of the best-effort class at |level|, from 0 (the
+// highest) to 7.
+int BestEffortIoPriority(int level);
+
+// Sets the I/O priority of all the threads of the process |pid|, or of the
+// daemon when |pid| is 0.
+bool SetProcessIoPriority(pid_t pid, int ioprio);
+
+// Returns whether any power supply in |power_supply_dir| is charging or full.
+bool IsPowerSupplyCharging(const std::string& power_supply_dir);
+
+// Keeps the disk I/O of the daemon from competing with foreground apps: sets
+// the I/O priority class of all the threads of the daemon according to the
+// phase of the update, and paces the writes to the partitions with a token
+// bucket. While the device is charging, the writes are limited by a higher
+// bandwidth and the I/O priorities are raised, so updates applied overnight
+// finish sooner.
+//
+// The bandwidths are read from the prefs kPrefsIoWriteBandwidth and
+// kPrefsIoBoostedWriteBandwidth, in bytes per second, where 0 or a missing
+// pref doesn't limit the writes. Safe to use from multiple threads.
+class IoScheduler {
+ public:
+  // How often the charging state is checked while writing.
+  static constexpr std::chrono::seconds kPowerCheckInterval{30};
+  // How far the writes may run ahead of the bandwidth after a pause.
+  static constexpr std::chrono::milliseconds kBurstDuration{250};
+
+  // The scheduler of the daemon.
+  static IoScheduler* GetInstance();
+
+  // |power_supply_dir| is where the power supplies report whether they are
+  // charging.
+  explicit IoScheduler(std::string power_supply_dir = "/sys/class/power_supply")
+      : power_supply_dir_(std::move(power_supply_dir)) {}
+  virtual ~IoScheduler() = default;
+
+  // Reloads the write bandwidths from |prefs|.
+  void LoadPrefs(PrefsInterface* prefs);
+
+  // Sets the I/O priority of the daemon for |phase|.
+  void SetPhase(IoPhase phase);
+  IoPhase phase() const;
+
+  // Whether the higher bandwidth and priorities are in effect.
+  bool boosted() const;
+
+  // Limits the writes to at most |bandwidth| bytes per second whatever the
+  // prefs allow, 0 removes the limit.
+  void SetWriteBandwidthCap(uint64_t bandwidth);
+
+  // Blocks until |bytes| more bytes may be written.
+  void AcquireWrite(size_t bytes);
+
+ protected:
+  // Sets the I/O priority of all the threads of the daemon to |ioprio|, which
+  // tests override.
+  virtual bool SetIoPriority(int ioprio);
+
+ private:
+  // Returns whether any power supply is charging or full.
+  bool IsCharging() const;
+
+  // Rechecks the charging state every kPowerCheckInterval and applies the
+  // boost when it changes. |mutex_| must be held.
+  void UpdateBoost(std::chrono::steady_clock::time_point now);
+
+  // Applies the priority of |phase_|. |mutex_| must be held.
+  void ApplyPriority();
+
+  const std::string power_supply_dir_;
+
+  mutable std::mutex mutex_;
+  IoPhase phase_{IoPhase::kNone};
+  bool boosted_{false};
+  std::chrono::steady_clock::time_point next_power_check_;
+
+  uint64_t write_bandwidth_{0};
+  uint64_t boosted_write_bandwidth_{0};
+  uint64_t write_bandwidth_cap_{0};
+  // The bytes which may be written right away, negative when the writes are
+  // ahead of the bandwidth.
+  double tokens_{0};
+  std::chrono::steady_clock::time_point last_refill_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoScheduler);
+};
+
+// A FileDescriptor passing the writes through IoScheduler::AcquireWrite()
+// before writing them to |fd|.
+class ThrottledFileDescriptor : public FileDescriptor {
+ public:
+  ThrottledFileDescriptor(FileDescriptorPtr fd, IoScheduler* scheduler)
+      : fd_(std::move(fd)), scheduler_(scheduler) {}
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override {
+    return fd_->Read(buf, count);
+  }
+  ssize_t Write(const void* buf, size_t count) override;
+  bool ReadAt(const std::vector<IoRequest>& requests) override {
+    return fd_->ReadAt(requests);
+  }
+  bool WriteAt(const std::vector<IoRequest>& requests) override;
+  off64_t Seek(off64_t offset, int whence) override {
+    return fd_->Seek(offset, whence);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override { return fd_->Close(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  int Fd() override { return fd_->Fd(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  IoScheduler* scheduler_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThrottledFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_SCHEDULER_H_
@@ -0,0 +1,130 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_scheduler.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Records the priorities instead of setting them.
+class TestIoScheduler : public IoScheduler {
+ public:
+  using IoScheduler::IoScheduler;
+
+  std::vector<int> priorities;
+
+ protected:
+  bool SetIoPriority(int ioprio) override {
+    priorities.push_back(ioprio);
+    return true;
+  }
+};
+
+}  // namespace
+
+class IoSchedulerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(power_supply_dir_.CreateUniqueTempDir());
+    ASSERT_TRUE(base::CreateDirectory(battery_dir()));
+    SetBatteryStatus("Discharging");
+  }
+
+  base::FilePath battery_dir() const {
+    return power_supply_dir_.GetPath().Append("battery");
+  }
+
+  void SetBatteryStatus(const std::string& status) {
+    const std::string line = status + "\n";
+    ASSERT_TRUE(utils::WriteFile(battery_dir().Append("status").value().c_str(),
+                                 line.data(),
+                                 line.size()));
+  }
+
+  base::ScopedTempDir power_supply_dir_;
+  FakePrefs prefs_;
+};
+
+TEST_F(IoSchedulerTest, UnlimitedWritesDontWait) {
+  TestIoScheduler scheduler(power_supply_dir_.GetPath().value());
+  scheduler.LoadPrefs(&prefs_);
+  const auto start = std::chrono::steady_clock::now();
+  scheduler.AcquireWrite(1024 * 1024 * 1024);
+  scheduler.AcquireWrite(1024 * 1024 * 1024);
+  ASSERT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(100));
+}
+
+TEST_F(IoSchedulerTest, PacesWrites) {
+  ASSERT_TRUE(prefs_.SetInt64(kPrefsIoWriteBandwidth, 1000 * 1000));
+  TestIoScheduler scheduler(power_supply_dir_.GetPath().value());
+  scheduler.LoadPrefs(&prefs_);
+  const auto start = std::chrono::steady_clock::now();
+  // The bucket starts empty, so each write waits for its share.
+  for (int i = 0; i < 5; i++) {
+    scheduler.AcquireWrite(10 * 1000);
+  }
+  ASSERT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(45));
+}
+
+TEST_F(IoSchedulerTest, ChargingBoostsBandwidth) {
+  ASSERT_TRUE(prefs_.SetInt64(kPrefsIoWriteBandwidth, 1000));
+  SetBatteryStatus("Charging");
+  TestIoScheduler scheduler(power_supply_dir_.GetPath().value());
+  scheduler.LoadPrefs(&prefs_);
+  const auto start = std::chrono::steady_clock::now();
+  // Without a boosted bandwidth, the writes aren't limited while charging.
+  scheduler.AcquireWrite(1000 * 1000);
+  ASSERT_TRUE(scheduler.boosted());
+  ASSERT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(100));
+}
+
+TEST_F(IoSchedulerTest, PhasesSetPriorities) {
+  TestIoScheduler scheduler(power_supply_dir_.GetPath().value());
+  scheduler.SetPhase(IoPhase::kApply);
+  scheduler.SetPhase(IoPhase::kApply);
+  scheduler.SetPhase(IoPhase::kMergePrep);
+  scheduler.SetPhase(IoPhase::kNone);
+  ASSERT_EQ(IoPhase::kNone, scheduler.phase());
+  // Best effort at the lowest level, idle, then back to the default.
+  ASSERT_EQ((std::vector<int>{(2 << 13) | 7, 3 << 13, 0}),
+            scheduler.priorities);
+}
+
+TEST_F(IoSchedulerTest, ChargingRaisesPriority) {
+  SetBatteryStatus("Full");
+  TestIoScheduler scheduler(power_supply_dir_.GetPath().value());
+  scheduler.SetPhase(IoPhase::kVerify);
+  ASSERT_TRUE(scheduler.boosted());
+  ASSERT_EQ((std::vector<int>{(2 << 13) | 4}), scheduler.priorities);
+}
+
+}  // namespace chromeos_update_engine
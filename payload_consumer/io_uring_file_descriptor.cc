@@ -0,0 +1,277 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Most buffers older kernels accept in IoUringInterface::RegisterBuffers().
+constexpr size_t kMaxFixedBuffers = 1024;
+
+bool IsRetryableError(int error) {
+  return error == EINTR || error == EAGAIN;
+}
+}  // namespace
+
+IoUringFileDescriptor::~IoUringFileDescriptor() {
+  if (IsOpen()) {
+    Close();
+  }
+}
+
+bool IoUringFileDescriptor::IsSupported() {
+  static const bool supported =
+      io_uring_cpp::IoUringInterface::CreateLinuxIoUring(1, 0) != nullptr;
+  return supported;
+}
+
+bool IoUringFileDescriptor::Close() {
+  {
+    // Rings hold a reference to the registered descriptor, drop them before
+    // closing it.
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    idle_rings_.clear();
+  }
+  return EintrSafeFileDescriptor::Close();
+}
+
+std::unique_ptr<IoUringFileDescriptor::Ring>
+IoUringFileDescriptor::AcquireRing() {
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    if (!idle_rings_.empty()) {
+      auto ring = std::move(idle_rings_.back());
+      idle_rings_.pop_back();
+      return ring;
+    }
+  }
+  auto ring = std::make_unique<Ring>();
+  ring->ring =
+      io_uring_cpp::IoUringInterface::CreateLinuxIoUring(kQueueDepth, 0);
+  if (ring->ring == nullptr) {
+    PLOG(WARNING) << "Failed to create io_uring";
+    return nullptr;
+  }
+  ring->fixed_file = ring->ring->RegisterFiles(&fd_, 1).IsOk();
+  return ring;
+}
+
+void IoUringFileDescriptor::RegisterPoolBuffers(Ring* ring) {
+  const AlignedBufferPool* pool = AlignedBufferPool::GetInstance();
+  if (ring->buffers_generation == pool->generation()) {
+    return;
+  }
+  // The registered buffers keep the pages they had when registered, so the
+  // ones of regions unmapped since then must not be used anymore.
+  if (!ring->buffers.empty()) {
+    const auto result = ring->ring->UnregisterBuffers();
+    LOG_IF(WARNING, !result.IsOk())
+        << "Failed to unregister io_uring buffers: " << result;
+    ring->buffers.clear();
+  }
+  std::vector<iovec> regions = pool->Regions(&ring->buffers_generation);
+  if (regions.empty() || regions.size() > kMaxFixedBuffers) {
+    return;
+  }
+  const auto result =
+      ring->ring->RegisterBuffers(regions.data(), regions.size());
+  if (!result.IsOk()) {
+    LOG(WARNING) << "Failed to register " << regions.size()
+                 << " buffers with io_uring: " << result;
+    return;
+  }
+  ring->buffers = std::move(regions);
+}
+
+int IoUringFileDescriptor::FixedBufferIndex(const Ring& ring,
+                                            const IoRequest& request) {
+  const auto* data = static_cast<const uint8_t*>(request.data);
+  for (size_t i = 0; i < ring.buffers.size(); i++) {
+    const auto* begin = static_cast<const uint8_t*>(ring.buffers[i].iov_base);
+    const auto* end = begin + ring.buffers[i].iov_len;
+    if (data >= begin && data + request.size <= end) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void IoUringFileDescriptor::ReleaseRing(std::unique_ptr<Ring> ring) {
+  std::lock_guard<std::mutex> lock(rings_mutex_);
+  idle_rings_.push_back(std::move(ring));
+}
+
+bool IoUringFileDescriptor::ReadAt(const std::vector<IoRequest>& requests) {
+  return SubmitRequests(false, requests);
+}
+
+bool IoUringFileDescriptor::WriteAt(const std::vector<IoRequest>& requests) {
+  return SubmitRequests(true, requests);
+}
+
+bool IoUringFileDescriptor::SubmitRequests(
+    bool write, const std::vector<IoRequest>& requests) {
+  CHECK_GE(fd_, 0);
+  std::vector<IoRequest> pieces;
+  for (const auto& request : requests) {
+    for (size_t done = 0; done < request.size; done += kMaxRequestSize) {
+      pieces.push_back({static_cast<uint8_t*>(request.data) + done,
+                        std::min(request.size - done, kMaxRequestSize),
+                        request.offset + done});
+    }
+  }
+  // A single request gains nothing from the ring.
+  if (pieces.size() <= 1) {
+    return write ? EintrSafeFileDescriptor::WriteAt(pieces)
+                 : EintrSafeFileDescriptor::ReadAt(pieces);
+  }
+  auto ring = AcquireRing();
+  if (ring == nullptr) {
+    return write ? EintrSafeFileDescriptor::WriteAt(pieces)
+                 : EintrSafeFileDescriptor::ReadAt(pieces);
+  }
+  RegisterPoolBuffers(ring.get());
+  auto& uring = *ring->ring;
+  const int fd = ring->fixed_file ? 0 : fd_;
+
+  // Indices of |pieces| (or their remainders after a short read or write)
+  // which still have to be submitted.
+  std::deque<size_t> pending;
+  for (size_t i = 0; i < pieces.size(); i++) {
+    pending.push_back(i);
+  }
+  size_t prepared = 0;
+  size_t in_flight = 0;
+  int error = 0;
+  bool ring_usable = true;
+  while (true) {
+    while (error == 0 && !pending.empty() &&
+           prepared + in_flight < kQueueDepth) {
+      const auto& piece = pieces[pending.front()];
+      const int buf_index = FixedBufferIndex(*ring, piece);
+      auto sqe = [&]() {
+        if (buf_index >= 0) {
+          return write ? uring.PrepWriteFixed(fd,
+                                              piece.data,
+                                              piece.size,
+                                              piece.offset,
+                                              buf_index)
+                       : uring.PrepReadFixed(fd,
+                                             piece.data,
+                                             piece.size,
+                                             piece.offset,
+                                             buf_index);
+        }
+        return write ? uring.PrepWrite(fd, piece.data, piece.size,
+                                       piece.offset)
+                     : uring.PrepRead(fd, piece.data, piece.size,
+                                      piece.offset);
+      }();
+      if (!sqe.IsOk()) {
+        break;
+      }
+      if (ring->fixed_file) {
+        sqe.SetFlags(IOSQE_FIXED_FILE);
+      }
+      sqe.SetData(static_cast<uint64_t>(pending.front()));
+      pending.pop_front();
+      prepared++;
+    }
+    if (prepared > 0 && ring_usable) {
+      const auto result = uring.Submit();
+      if (result.IsOk()) {
+        prepared -= result.EntriesSubmitted();
+        in_flight += result.EntriesSubmitted();
+      } else if (!IsRetryableError(-result.ErrCode()) || in_flight == 0) {
+        // Entries which weren't submitted stay in the submission queue, so
+        // this ring can't be reused.
+        LOG(ERROR) << "Failed to submit io_uring requests: "
+                   << result.ErrMsg();
+        if (error == 0) {
+          error = result.ErrCode() < 0 ? -result.ErrCode() : EIO;
+        }
+        ring_usable = false;
+      }
+    }
+    if (in_flight == 0) {
+      if (!ring_usable || error != 0 || pending.empty()) {
+        break;
+      }
+      continue;
+    }
+
+    auto cqe = uring.PopCQE();
+    while (cqe.IsErr() && IsRetryableError(cqe.GetError().ErrCode())) {
+      cqe = uring.PopCQE();
+    }
+    // The buffers of in-flight requests belong to the caller, there is no
+    // way to return before the kernel is done with them.
+    CHECK(cqe.IsOk()) << "Failed to wait for io_uring completion: "
+                      << cqe.GetError();
+    in_flight--;
+    const auto& completion = cqe.GetResult();
+    const size_t index = completion.GetData<uint64_t>();
+    auto& piece = pieces[index];
+    if (completion.res < 0) {
+      if (IsRetryableError(-completion.res)) {
+        pending.push_back(index);
+      } else if (error == 0) {
+        error = -completion.res;
+        LOG(ERROR) << "io_uring " << (write ? "write" : "read") << " of "
+                   << piece.size << " bytes at " << piece.offset
+                   << " failed: " << strerror(error);
+      }
+    } else if (completion.res == 0) {
+      // Reached the end of the file.
+      error = error ? error : EIO;
+    } else if (static_cast<size_t>(completion.res) < piece.size) {
+      piece.data = static_cast<uint8_t*>(piece.data) + completion.res;
+      piece.size -= completion.res;
+      piece.offset += completion.res;
+      pending.push_back(index);
+    }
+  }
+  if (ring_usable) {
+    ReleaseRing(std::move(ring));
+  }
+  if (error != 0) {
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<FileDescriptor> CreateAsyncFileDescriptor() {
+  if (IoUringFileDescriptor::IsSupported()) {
+    return std::make_unique<IoUringFileDescriptor>();
+  }
+  return std::make_unique<EintrSafeFileDescriptor>();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+
+#include <sys/uio.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <liburing_cpp/IoUring.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// An EintrSafeFileDescriptor which runs ReadAt()/WriteAt() batches through
+// io_uring, keeping up to kQueueDepth requests in flight instead of issuing
+// one pread()/pwrite() at a time. Requests are split into pieces of at most
+// kMaxRequestSize bytes, so even a single large request keeps the storage
+// queue busy. The descriptor is registered as a fixed file with every ring,
+// and the buffers of the AlignedBufferPool as fixed buffers, so that the
+// kernel doesn't map the pool's memory for every request.
+//
+// Batches may be submitted from several threads at once, each one borrows a
+// ring of its own for the duration of the call.
+class IoUringFileDescriptor final : public EintrSafeFileDescriptor {
+ public:
+  static constexpr size_t kQueueDepth = 32;
+  static constexpr size_t kMaxRequestSize = 128 * 1024;  // 128 KiB
+
+  IoUringFileDescriptor() = default;
+  ~IoUringFileDescriptor() override;
+
+  // Whether the running kernel supports io_uring.
+  static bool IsSupported();
+
+  bool ReadAt(const std::vector<IoRequest>& requests) override;
+  bool WriteAt(const std::vector<IoRequest>& requests) override;
+  bool Close() override;
+
+ private:
+  struct Ring {
+    std::unique_ptr<io_uring_cpp::IoUringInterface> ring;
+    // Whether |fd_| is registered as fixed file 0 of |ring|.
+    bool fixed_file{false};
+    // The AlignedBufferPool regions registered as fixed buffers of |ring|, as
+    // of the pool's generation |buffers_generation|.
+    std::vector<iovec> buffers;
+    uint64_t buffers_generation{0};
+  };
+
+  // Registers the current regions of the AlignedBufferPool with |ring| if
+  // they changed since the last time.
+  static void RegisterPoolBuffers(Ring* ring);
+  // Returns the index of the fixed buffer of |ring| holding all of |request|,
+  // or -1 if there is none.
+  static int FixedBufferIndex(const Ring& ring, const IoRequest& request);
+
+  // Runs all |requests| through a ring, see ReadAt(). Sets errno on failure.
+  bool SubmitRequests(bool write, const std::vector<IoRequest>& requests);
+
+  // Returns an idle ring, creating a new one if needed, or nullptr if no ring
+  // can be created.
+  std::unique_ptr<Ring> AcquireRing();
+  void ReleaseRing(std::unique_ptr<Ring> ring);
+
+  std::mutex rings_mutex_;
+  // Rings not used by any batch right now.
+  std::vector<std::unique_ptr<Ring>> idle_rings_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringFileDescriptor);
+};
+
+// Returns a new, closed IoUringFileDescriptor if the kernel supports io_uring
+// and an EintrSafeFileDescriptor otherwise.
+std::unique_ptr<FileDescriptor> CreateAsyncFileDescriptor();
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
@@ -0,0 +1,124 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <fcntl.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+
+namespace chromeos_update_engine {
+
+class IoUringFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    if (!IoUringFileDescriptor::IsSupported()) {
+      GTEST_SKIP() << "io_uring is not supported by this kernel.";
+    }
+    ASSERT_TRUE(fd_.Open(file_.path().c_str(), O_RDWR));
+  }
+
+  ScopedTempFile file_{"io_uring_fd.XXXXXX"};
+  IoUringFileDescriptor fd_;
+};
+
+TEST_F(IoUringFileDescriptorTest, WriteAndReadBackTest) {
+  // Large enough to be split into more requests than the queue can hold.
+  constexpr size_t kSize =
+      IoUringFileDescriptor::kMaxRequestSize *
+          (IoUringFileDescriptor::kQueueDepth + 3) +
+      123;
+  brillo::Blob data(kSize);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = i * 7 % 251;
+  }
+  // Write the two halves out of order.
+  ASSERT_TRUE(fd_.WriteAt({{data.data() + kSize / 2, kSize - kSize / 2,
+                            kSize / 2},
+                           {data.data(), kSize / 2, 0}}));
+
+  brillo::Blob file_data;
+  ASSERT_TRUE(utils::ReadFile(file_.path(), &file_data));
+  ASSERT_EQ(data, file_data);
+
+  brillo::Blob read_data(kSize);
+  ASSERT_TRUE(fd_.ReadAt({{read_data.data(), kSize, 0}}));
+  ASSERT_EQ(data, read_data);
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadPastEndFailsTest) {
+  brillo::Blob data(IoUringFileDescriptor::kMaxRequestSize * 2);
+  ASSERT_TRUE(fd_.WriteAt({{data.data(), data.size(), 0}}));
+
+  brillo::Blob read_data(data.size());
+  ASSERT_FALSE(fd_.ReadAt({{read_data.data(), read_data.size(), 4096}}));
+}
+
+TEST_F(IoUringFileDescriptorTest, ReopenTest) {
+  brillo::Blob data(IoUringFileDescriptor::kMaxRequestSize * 2, 'a');
+  ASSERT_TRUE(fd_.WriteAt({{data.data(), data.size(), 0}}));
+  ASSERT_TRUE(fd_.Close());
+
+  ScopedTempFile other_file{"io_uring_fd.XXXXXX"};
+  ASSERT_TRUE(fd_.Open(other_file.path().c_str(), O_RDWR));
+  ASSERT_TRUE(fd_.WriteAt({{data.data(), data.size(), 0}}));
+  brillo::Blob file_data;
+  ASSERT_TRUE(utils::ReadFile(other_file.path(), &file_data));
+  ASSERT_EQ(data, file_data);
+}
+
+// The buffers of the AlignedBufferPool are registered with the rings, which
+// must follow the pool as it maps and unmaps them.
+TEST_F(IoUringFileDescriptorTest, PoolBuffersTest) {
+  constexpr size_t kSize = IoUringFileDescriptor::kMaxRequestSize * 3;
+  AlignedBufferPool* pool = AlignedBufferPool::GetInstance();
+  auto data = pool->Acquire(kSize);
+  ASSERT_EQ(kSize, data.size());
+  for (size_t i = 0; i < kSize; i++) {
+    data[i] = i * 7 % 251;
+  }
+  ASSERT_TRUE(fd_.WriteAt({{data.data(), kSize, 0}}));
+
+  for (int i = 0; i < 3; i++) {
+    // A new mapping, possibly at the address of one unmapped since the
+    // last batch.
+    pool->Trim();
+    const size_t size = kSize + i * AlignedBufferPool::kAlignment;
+    auto read_data = pool->Acquire(size);
+    ASSERT_EQ(size, read_data.size());
+    memset(read_data.data(), 0, read_data.size());
+    // Into the pool buffer, which is registered, and into memory which isn't.
+    brillo::Blob tail(IoUringFileDescriptor::kMaxRequestSize);
+    ASSERT_TRUE(fd_.ReadAt({{read_data.data(), kSize - tail.size(), 0},
+                            {tail.data(), tail.size(), kSize - tail.size()}}));
+    ASSERT_EQ(0, memcmp(data.data(), read_data.data(), kSize - tail.size()));
+    ASSERT_EQ(0,
+              memcmp(data.data() + kSize - tail.size(),
+                     tail.data(),
+                     tail.size()));
+  }
+}
+
+}  // namespace chromeos_update_engine
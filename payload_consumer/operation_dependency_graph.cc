@@ -0,0 +1,183 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_dependency_graph.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <utility>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Tracks, for every block, the last operation writing it and the operations
+// which read it since. Blocks are grouped in disjoint segments keyed by their
+// first block. ExtentMap can't be used here: it only stores extents which
+// never overlap, while every write replaces the owners of its blocks.
+class BlockOwners {
+ public:
+  // Appends the last writer of every block of |extent| to |deps|, and the
+  // readers since the last write too if |include_readers| is set.
+  void Collect(const Extent& extent,
+               bool include_readers,
+               std::vector<size_t>* deps) const {
+    const uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    auto it = segments_.upper_bound(start);
+    if (it != segments_.begin()) {
+      it = std::prev(it);
+    }
+    for (; it != segments_.end() && it->first < end; ++it) {
+      if (it->second.end <= start) {
+        continue;
+      }
+      if (it->second.writer) {
+        deps->push_back(*it->second.writer);
+      }
+      if (include_readers) {
+        deps->insert(
+            deps->end(), it->second.readers.begin(), it->second.readers.end());
+      }
+    }
+  }
+
+  // Records |op_index| as the last writer of all blocks of |extent|.
+  void Write(const Extent& extent, size_t op_index) {
+    const uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    SplitAt(start);
+    SplitAt(end);
+    segments_.erase(segments_.lower_bound(start), segments_.lower_bound(end));
+    segments_.emplace(start, Segment{end, op_index, {}});
+  }
+
+  // Records |op_index| as a reader of all blocks of |extent|.
+  void Read(const Extent& extent, size_t op_index) {
+    const uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    SplitAt(start);
+    SplitAt(end);
+    uint64_t next = start;
+    auto it = segments_.lower_bound(start);
+    while (next < end) {
+      if (it == segments_.end() || it->first > next) {
+        // Fill the gap up to the next segment.
+        const uint64_t gap_end =
+            it == segments_.end() ? end : std::min(end, it->first);
+        it = segments_.emplace_hint(
+            it, next, Segment{gap_end, std::nullopt, {op_index}});
+      } else {
+        it->second.readers.push_back(op_index);
+      }
+      next = it->second.end;
+      ++it;
+    }
+  }
+
+ private:
+  struct Segment {
+    uint64_t end;
+    std::optional<size_t> writer;
+    std::vector<size_t> readers;
+  };
+
+  // Makes sure no segment crosses |block|.
+  void SplitAt(uint64_t block) {
+    auto it = segments_.upper_bound(block);
+    if (it == segments_.begin()) {
+      return;
+    }
+    it = std::prev(it);
+    if (it->first < block && block < it->second.end) {
+      Segment tail = it->second;
+      it->second.end = block;
+      segments_.emplace_hint(std::next(it), block, std::move(tail));
+    }
+  }
+
+  std::map<uint64_t, Segment> segments_;
+};
+
+template <typename Extents, typename Function>
+void ForEachExtent(const Extents& extents, Function function) {
+  for (const auto& extent : extents) {
+    if (extent.start_block() != kSparseHole && extent.num_blocks() > 0) {
+      function(extent);
+    }
+  }
+}
+
+}  // namespace
+
+OperationDependencyGraph::OperationDependencyGraph(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    bool track_source_extents)
+    : dependencies_(operations.size()), dependents_(operations.size()) {
+  BlockOwners owners;
+  for (int i = 0; i < operations.size(); i++) {
+    const size_t index = i;
+    const auto& op = operations[i];
+    auto& deps = dependencies_[index];
+    ForEachExtent(op.dst_extents(), [&](const Extent& extent) {
+      owners.Collect(extent, track_source_extents, &deps);
+    });
+    if (track_source_extents) {
+      ForEachExtent(op.src_extents(), [&](const Extent& extent) {
+        owners.Collect(extent, false, &deps);
+      });
+    }
+    std::sort(deps.begin(), deps.end());
+    deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+    // An operation reading its own destination conflicts with itself only.
+    deps.erase(std::remove(deps.begin(), deps.end(), index), deps.end());
+    for (const size_t dep : deps) {
+      dependents_[dep].push_back(index);
+    }
+
+    if (track_source_extents) {
+      ForEachExtent(op.src_extents(), [&](const Extent& extent) {
+        owners.Read(extent, index);
+      });
+    }
+    ForEachExtent(op.dst_extents(), [&](const Extent& extent) {
+      owners.Write(extent, index);
+    });
+  }
+}
+
+std::vector<size_t> OperationDependencyGraph::GetReadyOperations(
+    const std::vector<bool>& completed) const {
+  std::vector<size_t> ready;
+  for (size_t i = 0; i < size() && i < completed.size(); i++) {
+    if (completed[i]) {
+      continue;
+    }
+    const auto& deps = dependencies_[i];
+    if (std::all_of(deps.begin(), deps.end(), [&completed](size_t dep) {
+          return completed[dep];
+        })) {
+      ready.push_back(i);
+    }
+  }
+  return ready;
+}
+
+}  // namespace chromeos_update_engine
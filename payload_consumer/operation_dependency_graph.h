@@ -0,0 +1,69 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_DEPENDENCY_GRAPH_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_DEPENDENCY_GRAPH_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// The order in which the install operations of one partition have to be
+// applied. Operation j depends on an earlier operation i if j writes a block
+// i writes. When |track_source_extents| is set, which is needed when source
+// and target are the same device, j also depends on i if j reads a block i
+// writes or j writes a block i reads. Only the direct predecessors of every
+// block are recorded, so the graph stays linear in the number of extents:
+// waiting for them implies waiting for everything before them.
+//
+// Building the graph takes O(n log n) time for n extents.
+class OperationDependencyGraph {
+ public:
+  OperationDependencyGraph() = default;
+  OperationDependencyGraph(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+      bool track_source_extents);
+
+  // Number of operations in the graph.
+  size_t size() const { return dependencies_.size(); }
+
+  // Operations which must be completed before operation |index| may start, in
+  // ascending order.
+  const std::vector<size_t>& dependencies(size_t index) const {
+    return dependencies_[index];
+  }
+  // Operations which depend on operation |index|, in ascending order.
+  const std::vector<size_t>& dependents(size_t index) const {
+    return dependents_[index];
+  }
+
+  // Returns, in ascending order, all operations that are not |completed| but
+  // have all their dependencies |completed|. |completed| has one entry per
+  // operation.
+  std::vector<size_t> GetReadyOperations(
+      const std::vector<bool>& completed) const;
+
+ private:
+  std::vector<std::vector<size_t>> dependencies_;
+  std::vector<std::vector<size_t>> dependents_;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_DEPENDENCY_GRAPH_H_
@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_dependency_graph.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class OperationDependencyGraphTest : public ::testing::Test {
+ protected:
+  InstallOperation* AddOperation(vector<Extent> src, vector<Extent> dst) {
+    auto op = operations_.Add();
+    op->set_type(src.empty() ? InstallOperation::REPLACE
+                             : InstallOperation::SOURCE_BSDIFF);
+    for (const auto& extent : src) {
+      *op->add_src_extents() = extent;
+    }
+    for (const auto& extent : dst) {
+      *op->add_dst_extents() = extent;
+    }
+    return op;
+  }
+
+  RepeatedPtrField<InstallOperation> operations_;
+};
+
+TEST_F(OperationDependencyGraphTest, DisjointOperationsAreIndependent) {
+  AddOperation({}, {ExtentForRange(0, 10)});
+  AddOperation({}, {ExtentForRange(10, 10)});
+  AddOperation({ExtentForRange(0, 20)}, {ExtentForRange(20, 5)});
+  OperationDependencyGraph graph(operations_, false);
+  ASSERT_EQ(3u, graph.size());
+  for (size_t i = 0; i < graph.size(); i++) {
+    EXPECT_TRUE(graph.dependencies(i).empty());
+  }
+  EXPECT_EQ(vector<size_t>({0, 1, 2}),
+            graph.GetReadyOperations({false, false, false}));
+}
+
+TEST_F(OperationDependencyGraphTest, OnlyLastWriterIsRecorded) {
+  AddOperation({}, {ExtentForRange(0, 10)});
+  AddOperation({}, {ExtentForRange(5, 10)});
+  AddOperation({}, {ExtentForRange(0, 2), ExtentForRange(8, 1)});
+  OperationDependencyGraph graph(operations_, false);
+  EXPECT_EQ(vector<size_t>({0}), graph.dependencies(1));
+  // Blocks 0-1 were last written by op 0, block 8 by op 1.
+  EXPECT_EQ(vector<size_t>({0, 1}), graph.dependencies(2));
+  EXPECT_EQ(vector<size_t>({1, 2}), graph.dependents(0));
+
+  EXPECT_EQ(vector<size_t>({0}),
+            graph.GetReadyOperations({false, false, false}));
+  EXPECT_EQ(vector<size_t>({1}),
+            graph.GetReadyOperations({true, false, false}));
+  EXPECT_EQ(vector<size_t>({2}), graph.GetReadyOperations({true, true, false}));
+  EXPECT_TRUE(graph.GetReadyOperations({true, true, true}).empty());
+}
+
+TEST_F(OperationDependencyGraphTest, SourceExtentsTrackedInPlace) {
+  // Op 1 reads what op 0 writes, op 2 overwrites what op 1 reads.
+  AddOperation({}, {ExtentForRange(0, 4)});
+  AddOperation({ExtentForRange(2, 4)}, {ExtentForRange(10, 2)});
+  AddOperation({}, {ExtentForRange(5, 1)});
+  AddOperation({ExtentForRange(10, 1)}, {ExtentForRange(10, 1)});
+
+  OperationDependencyGraph ab_graph(operations_, false);
+  EXPECT_TRUE(ab_graph.dependencies(1).empty());
+  EXPECT_TRUE(ab_graph.dependencies(2).empty());
+  EXPECT_EQ(vector<size_t>({1}), ab_graph.dependencies(3));
+
+  OperationDependencyGraph in_place_graph(operations_, true);
+  EXPECT_EQ(vector<size_t>({0}), in_place_graph.dependencies(1));
+  EXPECT_EQ(vector<size_t>({1}), in_place_graph.dependencies(2));
+  EXPECT_EQ(vector<size_t>({1}), in_place_graph.dependencies(3));
+}
+
+TEST_F(OperationDependencyGraphTest, SparseHolesAreIgnored) {
+  AddOperation({}, {ExtentForRange(kSparseHole, 4)});
+  AddOperation({}, {ExtentForRange(kSparseHole, 4)});
+  OperationDependencyGraph graph(operations_, false);
+  EXPECT_TRUE(graph.dependencies(1).empty());
+}
+
+}  // namespace chromeos_update_engine
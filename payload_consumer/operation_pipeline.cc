@@ -0,0 +1,262 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_pipeline.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/memory_accounting.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Upper bound of the dictionary the xz decoder allocates, see XzExtentWriter.
+constexpr size_t kXzMaxDictSize = 64 * 1024 * 1024;
+// libbz2 needs about 3.5 MiB to decompress streams with 900k blocks.
+constexpr size_t kBzipDecompressMemory = 4 * 1024 * 1024;
+// Upper bound of the window the zstd decoder allocates and of its other
+// buffers, see ZstdExtentWriter.
+constexpr size_t kZstdMaxWindowSize =
+    size_t{1} << ZstdExtentWriter::kMaxWindowLog;
+constexpr size_t kZstdDecompressMemory = 256 * 1024;
+// Size of the cache puffpatch uses for deflate streams.
+constexpr size_t kPuffpatchCacheSize = 5 * 1024 * 1024;
+
+void AddBlocks(const google::protobuf::RepeatedPtrField<Extent>& extents,
+               ExtentRanges* ranges) {
+  for (const auto& extent : extents) {
+    if (extent.start_block() != kSparseHole && extent.num_blocks() > 0) {
+      ranges->AddExtent(extent);
+    }
+  }
+}
+
+bool OverlapsWith(const ExtentRanges& ranges,
+                  const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  if (ranges.blocks() == 0) {
+    return false;
+  }
+  for (const auto& extent : extents) {
+    if (extent.start_block() != kSparseHole &&
+        ranges.OverlapsWithExtent(extent)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+OperationPipeline::OperationPipeline(size_t num_threads,
+                                     size_t max_in_flight,
+                                     size_t memory_limit)
+    : max_in_flight_(std::max<size_t>(max_in_flight, 1)),
+      memory_limit_(memory_limit),
+      start_time_(base::TimeTicks::Now()) {
+  num_threads = std::max<size_t>(num_threads, 1);
+  max_running_ = num_threads;
+  workers_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; i++) {
+    workers_.emplace_back(&OperationPipeline::WorkerLoop, this);
+  }
+}
+
+OperationPipeline::~OperationPipeline() {
+  Drain();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+bool OperationPipeline::IsSupportedOperation(
+    const InstallOperation& operation) {
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+    case InstallOperation::SOURCE_COPY:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::ZUCCHINI:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+      return true;
+    // ZERO and DISCARD use block device ioctls which temporarily change the
+    // flags of the shared target fd.
+    default:
+      return false;
+  }
+}
+
+size_t OperationPipeline::EstimateMemoryUsage(
+    const InstallOperation& operation, size_t data_size, size_t block_size) {
+  const size_t dst_size =
+      utils::BlocksInExtents(operation.dst_extents()) * block_size;
+  switch (operation.type()) {
+    case InstallOperation::REPLACE_XZ:
+      // The generator shrinks the dictionary to the input size when possible.
+      return data_size + kDecompressBufferSize +
+             std::min(dst_size, kXzMaxDictSize);
+    case InstallOperation::REPLACE_BZ:
+      return data_size + kDecompressBufferSize + kBzipDecompressMemory;
+    case InstallOperation::REPLACE_ZSTD:
+      // The window is never larger than the frame content.
+      return data_size + kDecompressBufferSize + kZstdDecompressMemory +
+             std::min(dst_size, kZstdMaxWindowSize);
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+      return data_size + kPuffpatchCacheSize;
+    case InstallOperation::ZUCCHINI:
+      // Zucchini patches the whole source image into the whole target image.
+      return data_size + dst_size +
+             utils::BlocksInExtents(operation.src_extents()) * block_size;
+    default:
+      return data_size;
+  }
+}
+
+bool OperationPipeline::ConflictsWithInFlight(
+    size_t op_index, const InstallOperation& operation) const {
+  if (graph_ != nullptr && op_index < graph_->size()) {
+    for (const size_t dep : graph_->dependencies(op_index)) {
+      for (const auto& entry : in_flight_) {
+        if (entry.graph == graph_ && entry.op_index == dep) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+  for (const auto& entry : in_flight_) {
+    if (entry.graph == nullptr &&
+        OverlapsWith(entry.dst_blocks, operation.dst_extents())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool OperationPipeline::Submit(size_t op_index,
+                               const InstallOperation& operation,
+                               size_t memory_usage,
+                               Task task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this, op_index, &operation, memory_usage] {
+    return error_ != ErrorCode::kSuccess || in_flight_.empty() ||
+           (in_flight_.size() < max_in_flight_ &&
+            in_flight_memory_ + memory_usage <= memory_limit_ &&
+            !ConflictsWithInFlight(op_index, operation));
+  });
+  if (error_ != ErrorCode::kSuccess) {
+    return false;
+  }
+  in_flight_memory_ += memory_usage;
+  MemoryAccounting::GetInstance()->Charge(MemoryConsumer::kOperations,
+                                          memory_usage);
+  Entry entry{
+      op_index, next_sequence_++, graph_, memory_usage, {}, std::move(task)};
+  AddBlocks(operation.dst_extents(), &entry.dst_blocks);
+  in_flight_.push_back(std::move(entry));
+  queue_.push_back(std::prev(in_flight_.end()));
+  lock.unlock();
+  work_cv_.notify_one();
+  return true;
+}
+
+ErrorCode OperationPipeline::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return in_flight_.empty(); });
+  return error_;
+}
+
+OperationPipeline::Stats OperationPipeline::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats;
+  stats.num_threads = workers_.size();
+  stats.max_running = max_running_;
+  stats.running = running_;
+  stats.queued = queue_.size();
+  stats.in_flight_memory = in_flight_memory_;
+  stats.busy = busy_;
+  stats.age = base::TimeTicks::Now() - start_time_;
+  return stats;
+}
+
+void OperationPipeline::set_max_running(size_t max_running) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_running_ = std::max<size_t>(max_running, 1);
+  }
+  work_cv_.notify_all();
+}
+
+void OperationPipeline::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this] {
+      return stopping_ || (!queue_.empty() && running_ < max_running_);
+    });
+    if (queue_.empty()) {
+      return;
+    }
+    auto entry = queue_.front();
+    queue_.pop_front();
+    running_++;
+    // Once an operation failed, the remaining ones are skipped. Their results
+    // would be discarded anyway since progress is never checkpointed past the
+    // failed operation.
+    const bool skip = error_ != ErrorCode::kSuccess;
+    Task task = std::move(entry->task);
+    lock.unlock();
+
+    const base::TimeTicks start = base::TimeTicks::Now();
+    const ErrorCode error = skip ? ErrorCode::kSuccess : task();
+    // Release the operation's data before taking the lock again.
+    task = nullptr;
+    const base::TimeDelta duration = base::TimeTicks::Now() - start;
+
+    lock.lock();
+    busy_ += duration;
+    if (error != ErrorCode::kSuccess &&
+        (error_ == ErrorCode::kSuccess || entry->sequence < failed_sequence_)) {
+      error_ = error;
+      failed_sequence_ = entry->sequence;
+    }
+    in_flight_memory_ -= entry->memory_usage;
+    MemoryAccounting::GetInstance()->Release(MemoryConsumer::kOperations,
+                                             entry->memory_usage);
+    in_flight_.erase(entry);
+    running_--;
+    done_cv_.notify_all();
+    // A worker held back by |max_running_| may take the next entry.
+    work_cv_.notify_one();
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,195 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_PIPELINE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_PIPELINE_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/common/error_code.h"
+#include "update_engine/payload_consumer/operation_dependency_graph.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Runs install operations on a pool of worker threads. The operations of a
+// partition are submitted in manifest order and an operation is only handed
+// to a worker once none of the in-flight operations it depends on is left.
+// With a dependency graph set, see set_dependency_graph(), these are the ones
+// writing its destination blocks and, when the partition's source is its
+// target as in in-place updates, the ones writing the blocks it reads or
+// reading the blocks it writes. Without a graph, only operations writing the
+// same destination blocks are ordered. Operations may complete in any order,
+// callers must Drain() the pipeline before persisting progress.
+//
+// Each operation is charged an estimate of the memory it needs while running,
+// see EstimateMemoryUsage(). Operations are held back while the charge of all
+// in-flight operations would exceed the memory limit, an operation is always
+// admitted when nothing else is in flight.
+class OperationPipeline {
+ public:
+  using Task = std::function<ErrorCode()>;
+
+  // A snapshot of the state of the pipeline.
+  struct Stats {
+    size_t num_threads{0};
+    // The limit set by set_max_running().
+    size_t max_running{0};
+    // Operations being run by a worker and waiting for one.
+    size_t running{0};
+    size_t queued{0};
+    // The memory charged for the in-flight operations.
+    size_t in_flight_memory{0};
+    // The time the workers spent running operations, added up, and since
+    // the pipeline was created.
+    base::TimeDelta busy;
+    base::TimeDelta age;
+
+    // The fraction of the time the workers spent running operations.
+    double utilization() const {
+      return age.is_positive() && num_threads > 0
+                 ? busy.InSecondsF() / (age.InSecondsF() * num_threads)
+                 : 0;
+    }
+  };
+
+  // Buffer size workers use to decompress REPLACE_BZ/XZ/ZSTD blobs, large
+  // enough for the target to see big writes even without write caching.
+  static constexpr size_t kDecompressBufferSize = 1024 * 1024;  // 1 MiB
+  // Memory limit used when the install plan doesn't specify one.
+  static constexpr size_t kDefaultMemoryLimit = 64 * 1024 * 1024;  // 64 MiB
+
+  // Starts |num_threads| workers. At most |max_in_flight| operations using at
+  // most |memory_limit| bytes together are queued or running at any point in
+  // time.
+  OperationPipeline(size_t num_threads,
+                    size_t max_in_flight,
+                    size_t memory_limit);
+  ~OperationPipeline();
+
+  // Whether operations of this type can be applied by the pipeline.
+  static bool IsSupportedOperation(const InstallOperation& operation);
+
+  // Returns the number of bytes |operation| with a data blob of |data_size|
+  // bytes is expected to use while running: the blob itself plus the
+  // decompression and patching state of its type.
+  static size_t EstimateMemoryUsage(const InstallOperation& operation,
+                                    size_t data_size,
+                                    size_t block_size);
+
+  // Queues |task|, which applies |operation|, the |op_index|th operation of
+  // the partition, and charges |memory_usage| bytes for it until it finishes.
+  // Blocks while the pipeline is full or while |operation| conflicts with an
+  // in-flight operation. Returns false without queueing |task| if a previously
+  // submitted task failed, failures are never cleared.
+  [[nodiscard]] bool Submit(size_t op_index,
+                            const InstallOperation& operation,
+                            size_t memory_usage,
+                            Task task);
+
+  // Waits for all in-flight operations to finish. Returns kSuccess or the
+  // error of the failed operation submitted first, of any partition.
+  ErrorCode Drain();
+
+  size_t num_threads() const { return workers_.size(); }
+
+  Stats GetStats() const;
+
+  // Lets at most |max_running| of the workers, at least one, run operations
+  // at once. The other workers stay idle until the limit is raised again.
+  void set_max_running(size_t max_running);
+
+  // Uses |graph|, which must outlive the operations submitted with it,
+  // instead of comparing destination extents to decide whether an operation
+  // conflicts with in-flight ones. The op indices passed to Submit() are then
+  // indices into |graph|. Pass nullptr to go back to comparing extents.
+  //
+  // Operations submitted with a different graph belong to another partition,
+  // so they never conflict with the ones submitted with |graph| and may still
+  // be in flight when switching graphs. Must not be called concurrently with
+  // Submit().
+  void set_dependency_graph(const OperationDependencyGraph* graph) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    graph_ = graph;
+  }
+
+ private:
+  struct Entry {
+    size_t op_index;
+    // The order of submission, which unlike |op_index| spans partitions.
+    uint64_t sequence;
+    // The dependency graph set when the operation was submitted.
+    const OperationDependencyGraph* graph;
+    size_t memory_usage;
+    ExtentRanges dst_blocks;
+    Task task;
+  };
+
+  void WorkerLoop();
+
+  // Whether operation |op_index| depends on, or |operation| writes blocks
+  // written by, any entry of |in_flight_|. Must be called with |mutex_| held.
+  bool ConflictsWithInFlight(size_t op_index,
+                             const InstallOperation& operation) const;
+
+  const size_t max_in_flight_;
+  const size_t memory_limit_;
+  const OperationDependencyGraph* graph_{nullptr};
+  std::vector<std::thread> workers_;
+  const base::TimeTicks start_time_;
+
+  mutable std::mutex mutex_;
+  // Signalled when an operation finishes.
+  std::condition_variable done_cv_;
+  // Signalled when |queue_| gets a new entry or |stopping_| is set.
+  std::condition_variable work_cv_;
+
+  // All submitted operations that haven't finished yet, in submission order.
+  std::list<Entry> in_flight_;
+  // Entries of |in_flight_| that no worker picked up yet.
+  std::deque<std::list<Entry>::iterator> queue_;
+  // Sum of |memory_usage| of all |in_flight_| entries.
+  size_t in_flight_memory_{0};
+  // The number of operations being run by the workers and the limit of it.
+  size_t running_{0};
+  size_t max_running_;
+  // The time the workers spent running operations, added up.
+  base::TimeDelta busy_;
+
+  // The |sequence| of the next submitted operation.
+  uint64_t next_sequence_{0};
+  // Error of the failed operation submitted first, if any.
+  ErrorCode error_{ErrorCode::kSuccess};
+  uint64_t failed_sequence_{0};
+  bool stopping_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(OperationPipeline);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_PIPELINE_H_
@@ -0,0 +1,272 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_pipeline.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+InstallOperation MakeOperation(uint64_t start_block, uint64_t num_blocks) {
+  InstallOperation op;
+  op.set_type(InstallOperation::REPLACE);
+  *op.add_dst_extents() = ExtentForRange(start_block, num_blocks);
+  return op;
+}
+}  // namespace
+
+class OperationPipelineTest : public ::testing::Test {
+ protected:
+  OperationPipeline pipeline_{4, 8, 100};
+};
+
+TEST_F(OperationPipelineTest, RunsAllOperations) {
+  std::atomic<size_t> count{0};
+  std::vector<InstallOperation> ops;
+  for (size_t i = 0; i < 32; i++) {
+    ops.push_back(MakeOperation(i * 4, 4));
+  }
+  for (size_t i = 0; i < ops.size(); i++) {
+    ASSERT_TRUE(pipeline_.Submit(i, ops[i], 1, [&count]() {
+      count++;
+      return ErrorCode::kSuccess;
+    }));
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline_.Drain());
+  ASSERT_EQ(ops.size(), count);
+}
+
+TEST_F(OperationPipelineTest, OverlappingOperationsRunInOrder) {
+  std::mutex mutex;
+  std::vector<size_t> order;
+  // Every operation writes block 10, so none of them may run concurrently and
+  // they have to complete in submission order.
+  std::vector<InstallOperation> ops;
+  for (size_t i = 0; i < 8; i++) {
+    ops.push_back(MakeOperation(i % 2 ? 10 : 5, 6));
+  }
+  for (size_t i = 0; i < ops.size(); i++) {
+    ASSERT_TRUE(pipeline_.Submit(i, ops[i], 1, [&mutex, &order, i]() {
+      // Give later operations a chance to overtake this one.
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(i);
+      return ErrorCode::kSuccess;
+    }));
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline_.Drain());
+  ASSERT_EQ(order, std::vector<size_t>({0, 1, 2, 3, 4, 5, 6, 7}));
+}
+
+TEST_F(OperationPipelineTest, FailureIsSticky) {
+  auto op = MakeOperation(0, 1);
+  ASSERT_TRUE(pipeline_.Submit(
+      0, op, 1, []() { return ErrorCode::kDownloadOperationExecutionError; }));
+  ASSERT_EQ(ErrorCode::kDownloadOperationExecutionError, pipeline_.Drain());
+
+  bool ran = false;
+  auto next_op = MakeOperation(1, 1);
+  ASSERT_FALSE(pipeline_.Submit(1, next_op, 1, [&ran]() {
+    ran = true;
+    return ErrorCode::kSuccess;
+  }));
+  ASSERT_EQ(ErrorCode::kDownloadOperationExecutionError, pipeline_.Drain());
+  ASSERT_FALSE(ran);
+}
+
+TEST_F(OperationPipelineTest, ReportsLowestFailedOperation) {
+  std::vector<InstallOperation> ops = {MakeOperation(0, 1),
+                                       MakeOperation(1, 1)};
+  std::atomic<bool> first_may_finish{false};
+  ASSERT_TRUE(pipeline_.Submit(0, ops[0], 1, [&first_may_finish]() {
+    while (!first_may_finish) {
+      std::this_thread::yield();
+    }
+    return ErrorCode::kDownloadOperationHashMismatch;
+  }));
+  ASSERT_TRUE(pipeline_.Submit(1, ops[1], 1, [&first_may_finish]() {
+    first_may_finish = true;
+    return ErrorCode::kDownloadOperationExecutionError;
+  }));
+  ASSERT_EQ(ErrorCode::kDownloadOperationHashMismatch, pipeline_.Drain());
+}
+
+TEST_F(OperationPipelineTest, ReportsFirstFailedOperationAcrossPartitions) {
+  // The failed operation of the first partition has a higher index than the
+  // one of the second partition, but comes first.
+  google::protobuf::RepeatedPtrField<InstallOperation> first_ops;
+  for (size_t i = 0; i < 6; i++) {
+    *first_ops.Add() = MakeOperation(i, 1);
+  }
+  google::protobuf::RepeatedPtrField<InstallOperation> second_ops;
+  *second_ops.Add() = MakeOperation(0, 1);
+  OperationDependencyGraph first_graph(first_ops, false);
+  OperationDependencyGraph second_graph(second_ops, false);
+
+  std::atomic<bool> second_failed{false};
+  pipeline_.set_dependency_graph(&first_graph);
+  ASSERT_TRUE(pipeline_.Submit(5, first_ops[5], 1, [&second_failed]() {
+    while (!second_failed) {
+      std::this_thread::yield();
+    }
+    return ErrorCode::kDownloadOperationHashMismatch;
+  }));
+  pipeline_.set_dependency_graph(&second_graph);
+  ASSERT_TRUE(pipeline_.Submit(0, second_ops[0], 1, [&second_failed]() {
+    second_failed = true;
+    return ErrorCode::kDownloadOperationExecutionError;
+  }));
+  ASSERT_EQ(ErrorCode::kDownloadOperationHashMismatch, pipeline_.Drain());
+}
+
+TEST_F(OperationPipelineTest, MemoryLimitSerializesOperations) {
+  std::vector<InstallOperation> ops = {MakeOperation(0, 1),
+                                       MakeOperation(1, 1)};
+  std::atomic<bool> first_done{false};
+  std::atomic<bool> overlapped{false};
+  ASSERT_TRUE(pipeline_.Submit(0, ops[0], 60, [&first_done]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    first_done = true;
+    return ErrorCode::kSuccess;
+  }));
+  // Both operations together exceed the limit of 100 bytes.
+  ASSERT_TRUE(pipeline_.Submit(1, ops[1], 60, [&first_done, &overlapped]() {
+    overlapped = !first_done;
+    return ErrorCode::kSuccess;
+  }));
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline_.Drain());
+  ASSERT_FALSE(overlapped);
+}
+
+TEST_F(OperationPipelineTest, Stats) {
+  auto op = MakeOperation(0, 1);
+  std::atomic<bool> release{false};
+  ASSERT_TRUE(pipeline_.Submit(0, op, 30, [&release]() {
+    while (!release) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return ErrorCode::kSuccess;
+  }));
+  pipeline_.set_max_running(2);
+  auto stats = pipeline_.GetStats();
+  ASSERT_EQ(4u, stats.num_threads);
+  ASSERT_EQ(2u, stats.max_running);
+  ASSERT_EQ(1u, stats.running + stats.queued);
+  ASSERT_EQ(30u, stats.in_flight_memory);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  release = true;
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline_.Drain());
+  stats = pipeline_.GetStats();
+  ASSERT_EQ(0u, stats.running + stats.queued);
+  ASSERT_EQ(0u, stats.in_flight_memory);
+  ASSERT_GE(stats.busy, base::TimeDelta::FromMilliseconds(5));
+  ASSERT_LE(stats.busy, stats.age);
+  ASSERT_GT(stats.utilization(), 0);
+  ASSERT_LE(stats.utilization(), 0.25);
+}
+
+TEST_F(OperationPipelineTest, OversizedOperationIsAdmitted) {
+  auto op = MakeOperation(0, 1);
+  bool ran = false;
+  ASSERT_TRUE(pipeline_.Submit(0, op, 1000, [&ran]() {
+    ran = true;
+    return ErrorCode::kSuccess;
+  }));
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline_.Drain());
+  ASSERT_TRUE(ran);
+}
+
+TEST_F(OperationPipelineTest, DependencyGraphSerializesOperations) {
+  // The second operation reads what the first one writes, so with a graph
+  // tracking source extents they can't overlap although their destinations
+  // don't.
+  google::protobuf::RepeatedPtrField<InstallOperation> ops;
+  *ops.Add() = MakeOperation(0, 1);
+  *ops.Add() = MakeOperation(1, 1);
+  *ops[1].add_src_extents() = ExtentForRange(0, 1);
+  OperationDependencyGraph graph(ops, true);
+  pipeline_.set_dependency_graph(&graph);
+
+  std::atomic<bool> first_done{false};
+  std::atomic<bool> overlapped{false};
+  ASSERT_TRUE(pipeline_.Submit(0, ops[0], 1, [&first_done]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    first_done = true;
+    return ErrorCode::kSuccess;
+  }));
+  ASSERT_TRUE(pipeline_.Submit(1, ops[1], 1, [&first_done, &overlapped]() {
+    overlapped = !first_done;
+    return ErrorCode::kSuccess;
+  }));
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline_.Drain());
+  ASSERT_FALSE(overlapped);
+}
+
+TEST_F(OperationPipelineTest, PartitionsDontConflict) {
+  // Both partitions write block 0 of their own device, operations submitted
+  // with different graphs must be able to overlap.
+  google::protobuf::RepeatedPtrField<InstallOperation> ops;
+  *ops.Add() = MakeOperation(0, 1);
+  OperationDependencyGraph first_graph(ops, false);
+  OperationDependencyGraph second_graph(ops, false);
+
+  std::atomic<bool> second_ran{false};
+  pipeline_.set_dependency_graph(&first_graph);
+  ASSERT_TRUE(pipeline_.Submit(0, ops[0], 1, [&second_ran]() {
+    while (!second_ran) {
+      std::this_thread::yield();
+    }
+    return ErrorCode::kSuccess;
+  }));
+  pipeline_.set_dependency_graph(&second_graph);
+  ASSERT_TRUE(pipeline_.Submit(0, ops[0], 1, [&second_ran]() {
+    second_ran = true;
+    return ErrorCode::kSuccess;
+  }));
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline_.Drain());
+}
+
+TEST_F(OperationPipelineTest, EstimateMemoryUsage) {
+  InstallOperation op = MakeOperation(0, 16);
+  ASSERT_EQ(100u, OperationPipeline::EstimateMemoryUsage(op, 100, 4096));
+  op.set_type(InstallOperation::REPLACE_XZ);
+  ASSERT_EQ(100u + OperationPipeline::kDecompressBufferSize + 16 * 4096,
+            OperationPipeline::EstimateMemoryUsage(op, 100, 4096));
+}
+
+TEST_F(OperationPipelineTest, SupportedOperations) {
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_COPY);
+  ASSERT_TRUE(OperationPipeline::IsSupportedOperation(op));
+  op.set_type(InstallOperation::PUFFDIFF);
+  ASSERT_TRUE(OperationPipeline::IsSupportedOperation(op));
+  op.set_type(InstallOperation::ZERO);
+  ASSERT_FALSE(OperationPipeline::IsSupportedOperation(op));
+  op.set_type(InstallOperation::DISCARD);
+  ASSERT_FALSE(OperationPipeline::IsSupportedOperation(op));
+}
+
+}  // namespace chromeos_update_engine
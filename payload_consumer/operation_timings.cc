@@ -0,0 +1,139 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_timings.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+#include <android-base/stringprintf.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// The operation timed on the calling thread and whether one of its phases is
+// being timed.
+thread_local OperationTimings::ScopedOperation* current_operation = nullptr;
+thread_local bool in_phase = false;
+
+size_t BucketForDuration(base::TimeDelta duration) {
+  size_t bucket = 0;
+  for (int64_t ms = duration.InMilliseconds(); ms > 0; ms >>= 1) {
+    bucket++;
+  }
+  return std::min(bucket, OperationTimings::kNumBuckets - 1);
+}
+}  // namespace
+
+OperationTimings::ScopedOperation::ScopedOperation(OperationTimings* timings,
+                                                   InstallOperation::Type type,
+                                                   uint64_t bytes)
+    : timings_(timings),
+      type_(type),
+      bytes_(bytes),
+      previous_(current_operation) {
+  if (timings_ != nullptr) {
+    start_ = base::TimeTicks::Now();
+    current_operation = this;
+  }
+}
+
+OperationTimings::ScopedOperation::~ScopedOperation() {
+  if (timings_ != nullptr) {
+    timings_->Record(
+        type_, base::TimeTicks::Now() - start_, read_, write_, bytes_);
+    current_operation = previous_;
+  }
+}
+
+OperationTimings::ScopedPhase::ScopedPhase(Phase phase) {
+  if (current_operation == nullptr || in_phase) {
+    return;
+  }
+  duration_ = phase == Phase::kRead ? &current_operation->read_
+                                    : &current_operation->write_;
+  in_phase = true;
+  start_ = base::TimeTicks::Now();
+}
+
+OperationTimings::ScopedPhase::~ScopedPhase() {
+  if (duration_ != nullptr) {
+    *duration_ += base::TimeTicks::Now() - start_;
+    in_phase = false;
+  }
+}
+
+void OperationTimings::Record(InstallOperation::Type type,
+                              base::TimeDelta total,
+                              base::TimeDelta read,
+                              base::TimeDelta write,
+                              uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats& stats = stats_[type];
+  stats.count++;
+  stats.bytes += bytes;
+  stats.total += total;
+  stats.read += read;
+  stats.write += write;
+  stats.max = std::max(stats.max, total);
+  stats.histogram[BucketForDuration(total)]++;
+}
+
+std::map<InstallOperation::Type, OperationTimings::Stats>
+OperationTimings::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+std::string OperationTimings::ToString() const {
+  std::string result;
+  for (const auto& [type, type_stats] : stats()) {
+    result += android::base::StringPrintf(
+        "%s: %zu ops, %" PRId64 " ms (read %" PRId64 " ms, write %" PRId64
+        " ms, cpu %" PRId64 " ms), max %" PRId64 " ms, histogram [",
+        InstallOperationTypeName(type),
+        type_stats.count,
+        type_stats.total.InMilliseconds(),
+        type_stats.read.InMilliseconds(),
+        type_stats.write.InMilliseconds(),
+        type_stats.cpu().InMilliseconds(),
+        type_stats.max.InMilliseconds());
+    const char* separator = "";
+    for (size_t i = 0; i < kNumBuckets; i++) {
+      if (type_stats.histogram[i] == 0) {
+        continue;
+      }
+      if (i + 1 < kNumBuckets) {
+        result += android::base::StringPrintf("%s<%zu ms: %zu",
+                                              separator,
+                                              size_t{1} << i,
+                                              type_stats.histogram[i]);
+      } else {
+        result += android::base::StringPrintf("%s>=%zu ms: %zu",
+                                              separator,
+                                              size_t{1} << (i - 1),
+                                              type_stats.histogram[i]);
+      }
+      separator = ", ";
+    }
+    result += "]\n";
+  }
+  return result;
+}
+
+}  // namespace chromeos_update_engine
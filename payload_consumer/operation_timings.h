@@ -0,0 +1,131 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_TIMINGS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_TIMINGS_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Collects how long install operations take and how much they write, by
+// operation type. The time of an operation is split into the time spent
+// reading its source, writing its destination and the remainder, mostly
+// decompressing and patching. Phases
+// are attributed by thread, so operations may be timed on several threads at
+// once.
+class OperationTimings {
+ public:
+  // Bucket i of a histogram counts the operations which took less than 2^i
+  // ms and at least 2^(i-1) ms, the last bucket all the slower ones.
+  static constexpr size_t kNumBuckets = 16;
+
+  struct Stats {
+    size_t count{0};
+    // Size of the destinations written.
+    uint64_t bytes{0};
+    base::TimeDelta total;
+    base::TimeDelta read;
+    base::TimeDelta write;
+    base::TimeDelta max;
+    std::array<size_t, kNumBuckets> histogram{};
+
+    // Time spent neither reading nor writing.
+    base::TimeDelta cpu() const { return total - read - write; }
+    // Bytes written per second spent in the operations.
+    int64_t BytesPerSecond() const {
+      return total.is_positive() ? bytes * 1000000 / total.InMicroseconds()
+                                 : 0;
+    }
+  };
+
+  enum class Phase { kRead, kWrite };
+
+  // Times an operation on the calling thread until destroyed, including the
+  // ScopedPhase instances created on this thread meanwhile. |bytes| is the
+  // size of its destination. Does nothing if |timings| is nullptr.
+  class ScopedOperation {
+   public:
+    ScopedOperation(OperationTimings* timings,
+                    InstallOperation::Type type,
+                    uint64_t bytes = 0);
+    ~ScopedOperation();
+
+   private:
+    friend class ScopedPhase;
+
+    OperationTimings* timings_;
+    InstallOperation::Type type_;
+    uint64_t bytes_;
+    base::TimeTicks start_;
+    base::TimeDelta read_;
+    base::TimeDelta write_;
+    // The operation timed on this thread before this one, if any.
+    ScopedOperation* previous_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedOperation);
+  };
+
+  // Adds the time until destroyed to |phase| of the operation timed on the
+  // calling thread, if any. Phases nested in another count towards the outer
+  // one, e.g. the source reads of XOR blocks written by the COW writer.
+  class ScopedPhase {
+   public:
+    explicit ScopedPhase(Phase phase);
+    ~ScopedPhase();
+
+   private:
+    base::TimeDelta* duration_{nullptr};
+    base::TimeTicks start_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedPhase);
+  };
+
+  OperationTimings() = default;
+
+  void Record(InstallOperation::Type type,
+              base::TimeDelta total,
+              base::TimeDelta read,
+              base::TimeDelta write,
+              uint64_t bytes = 0);
+
+  std::map<InstallOperation::Type, Stats> stats() const;
+
+  // Returns one line per operation type, e.g.
+  //   REPLACE_XZ: 12 ops, 840 ms (read 0 ms, write 212 ms, cpu 628 ms),
+  //   max 97 ms, histogram [<16 ms: 4, <32 ms: 3, <64 ms: 4, <128 ms: 1]
+  std::string ToString() const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::map<InstallOperation::Type, Stats> stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(OperationTimings);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_TIMINGS_H_
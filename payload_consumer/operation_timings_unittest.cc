@@ -0,0 +1,101 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_timings.h"
+
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(OperationTimingsTest, RecordsOperationsByType) {
+  OperationTimings timings;
+  timings.Record(InstallOperation::REPLACE_XZ,
+                 base::TimeDelta::FromMilliseconds(10),
+                 base::TimeDelta::FromMilliseconds(1),
+                 base::TimeDelta::FromMilliseconds(4),
+                 4096);
+  timings.Record(InstallOperation::REPLACE_XZ,
+                 base::TimeDelta::FromMilliseconds(30),
+                 base::TimeDelta(),
+                 base::TimeDelta::FromMilliseconds(6),
+                 36864);
+  timings.Record(InstallOperation::SOURCE_COPY,
+                 base::TimeDelta::FromMicroseconds(500),
+                 base::TimeDelta::FromMicroseconds(200),
+                 base::TimeDelta::FromMicroseconds(300));
+
+  const auto stats = timings.stats();
+  ASSERT_EQ(2u, stats.size());
+  const auto& xz = stats.at(InstallOperation::REPLACE_XZ);
+  ASSERT_EQ(2u, xz.count);
+  ASSERT_EQ(40960u, xz.bytes);
+  // 40 KiB in 40 ms.
+  ASSERT_EQ(1024000, xz.BytesPerSecond());
+  ASSERT_EQ(base::TimeDelta::FromMilliseconds(40), xz.total);
+  ASSERT_EQ(base::TimeDelta::FromMilliseconds(1), xz.read);
+  ASSERT_EQ(base::TimeDelta::FromMilliseconds(10), xz.write);
+  ASSERT_EQ(base::TimeDelta::FromMilliseconds(29), xz.cpu());
+  ASSERT_EQ(base::TimeDelta::FromMilliseconds(30), xz.max);
+  // 10 ms is in [8, 16), 30 ms in [16, 32).
+  ASSERT_EQ(1u, xz.histogram[4]);
+  ASSERT_EQ(1u, xz.histogram[5]);
+  ASSERT_EQ(1u, stats.at(InstallOperation::SOURCE_COPY).histogram[0]);
+  ASSERT_EQ(0, stats.at(InstallOperation::SOURCE_COPY).BytesPerSecond());
+
+  ASSERT_EQ(
+      "REPLACE_XZ: 2 ops, 40 ms (read 1 ms, write 10 ms, cpu 29 ms), max 30 "
+      "ms, histogram [<16 ms: 1, <32 ms: 1]\n"
+      "SOURCE_COPY: 1 ops, 0 ms (read 0 ms, write 0 ms, cpu 0 ms), max 0 ms, "
+      "histogram [<1 ms: 1]\n",
+      timings.ToString());
+}
+
+TEST(OperationTimingsTest, ScopedPhasesAddUp) {
+  OperationTimings timings;
+  {
+    OperationTimings::ScopedOperation op(
+        &timings, InstallOperation::PUFFDIFF, 8192);
+    {
+      OperationTimings::ScopedPhase read(OperationTimings::Phase::kRead);
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    {
+      OperationTimings::ScopedPhase write(OperationTimings::Phase::kWrite);
+      // Nested phases count towards the outer one.
+      OperationTimings::ScopedPhase read(OperationTimings::Phase::kRead);
+      std::this_thread::sleep_for(std::chrono::milliseconds(3));
+    }
+  }
+  // Phases outside of an operation are ignored.
+  OperationTimings::ScopedPhase read(OperationTimings::Phase::kRead);
+
+  const auto stats = timings.stats().at(InstallOperation::PUFFDIFF);
+  ASSERT_EQ(1u, stats.count);
+  ASSERT_EQ(8192u, stats.bytes);
+  ASSERT_GE(stats.read, base::TimeDelta::FromMilliseconds(2));
+  ASSERT_GE(stats.write, base::TimeDelta::FromMilliseconds(3));
+  ASSERT_GE(stats.total, stats.read + stats.write);
+}
+
+TEST(OperationTimingsTest, NullTimingsDoNothing) {
+  OperationTimings::ScopedOperation op(nullptr, InstallOperation::ZERO);
+  OperationTimings::ScopedPhase write(OperationTimings::Phase::kWrite);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/packed_extents.h"
+
+#include <cstdint>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Start blocks are stored relative to the end of the previous extent, modulo
+// 2^64 so that kSparseHole and extents going backwards stay small too.
+template <typename Packed>
+void PackExtents(RepeatedPtrField<Extent>* extents, Packed* packed) {
+  packed->Clear();
+  packed->Reserve(extents->size() * 2);
+  uint64_t end = 0;
+  for (const Extent& extent : *extents) {
+    packed->Add(static_cast<int64_t>(extent.start_block() - end));
+    packed->Add(static_cast<int64_t>(extent.num_blocks()));
+    end = extent.start_block() + extent.num_blocks();
+  }
+  extents->Clear();
+}
+
+template <typename Packed>
+bool UnpackExtents(Packed* packed, RepeatedPtrField<Extent>* extents) {
+  if (packed->empty()) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(extents->empty());
+  TEST_AND_RETURN_FALSE(packed->size() % 2 == 0);
+  extents->Reserve(packed->size() / 2);
+  uint64_t end = 0;
+  for (int i = 0; i < packed->size(); i += 2) {
+    Extent* extent = extents->Add();
+    extent->set_start_block(end + static_cast<uint64_t>(packed->Get(i)));
+    extent->set_num_blocks(static_cast<uint64_t>(packed->Get(i + 1)));
+    end = extent->start_block() + extent->num_blocks();
+  }
+  packed->Clear();
+  return true;
+}
+
+bool HasPackedExtents(const InstallOperation& op) {
+  return op.packed_src_extents_size() > 0 || op.packed_dst_extents_size() > 0;
+}
+
+}  // namespace
+
+void PackOperationsExtents(uint32_t minor_version,
+                           RepeatedPtrField<InstallOperation>* operations) {
+  if (minor_version < kPackedExtentsMinorPayloadVersion) {
+    return;
+  }
+  for (InstallOperation& op : *operations) {
+    PackExtents(op.mutable_src_extents(), op.mutable_packed_src_extents());
+    PackExtents(op.mutable_dst_extents(), op.mutable_packed_dst_extents());
+  }
+}
+
+bool UnpackOperationsExtents(uint32_t minor_version,
+                             RepeatedPtrField<InstallOperation>* operations) {
+  const bool allowed = minor_version >= kPackedExtentsMinorPayloadVersion;
+  for (InstallOperation& op : *operations) {
+    if (!HasPackedExtents(op)) {
+      continue;
+    }
+    if (!allowed) {
+      LOG(ERROR) << "Packed extents found in a payload of minor version "
+                 << minor_version;
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(UnpackExtents(op.mutable_packed_src_extents(),
+                                        op.mutable_src_extents()));
+    TEST_AND_RETURN_FALSE(UnpackExtents(op.mutable_packed_dst_extents(),
+                                        op.mutable_dst_extents()));
+  }
+  return true;
+}
+
+void PackManifestExtents(DeltaArchiveManifest* manifest) {
+  for (PartitionUpdate& partition : *manifest->mutable_partitions()) {
+    PackOperationsExtents(manifest->minor_version(),
+                          partition.mutable_operations());
+  }
+}
+
+bool UnpackManifestExtents(DeltaArchiveManifest* manifest) {
+  for (PartitionUpdate& partition : *manifest->mutable_partitions()) {
+    if (!UnpackOperationsExtents(manifest->minor_version(),
+                                 partition.mutable_operations())) {
+      LOG(ERROR) << "Invalid packed extents in partition "
+                 << partition.partition_name();
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,49 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Converts between the |src_extents| and |dst_extents| of install operations
+// and their packed encoding in |packed_src_extents| and |packed_dst_extents|,
+// see update_metadata.proto. Only the generator deals with the packed fields,
+// the rest of the code sees the manifest with its extents unpacked.
+
+// Moves the extents of every operation in |manifest| to the packed fields.
+// Does nothing if the minor version of |manifest| doesn't allow them.
+void PackManifestExtents(DeltaArchiveManifest* manifest);
+
+// Moves the packed extents of every operation in |manifest| back to the
+// regular extent fields. Returns false if the packed fields are malformed,
+// set alongside the regular ones or not allowed by the minor version.
+bool UnpackManifestExtents(DeltaArchiveManifest* manifest);
+
+// Same as the above on |operations| of a payload of |minor_version|, for the
+// operations stored apart from the manifest.
+void PackOperationsExtents(
+    uint32_t minor_version,
+    google::protobuf::RepeatedPtrField<InstallOperation>* operations);
+bool UnpackOperationsExtents(
+    uint32_t minor_version,
+    google::protobuf::RepeatedPtrField<InstallOperation>* operations);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/packed_extents.h"
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+class PackedExtentsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    manifest_.set_minor_version(kPackedExtentsMinorPayloadVersion);
+    op_ = manifest_.add_partitions()->add_operations();
+    op_->set_type(InstallOperation::SOURCE_COPY);
+    *op_->add_src_extents() = ExtentForRange(100, 10);
+    *op_->add_src_extents() = ExtentForRange(kSparseHole, 2);
+    *op_->add_src_extents() = ExtentForRange(20, 5);
+    *op_->add_dst_extents() = ExtentForRange(0, 1);
+  }
+
+  DeltaArchiveManifest manifest_;
+  InstallOperation* op_;
+};
+
+TEST_F(PackedExtentsTest, RoundTripTest) {
+  const InstallOperation original = *op_;
+  PackManifestExtents(&manifest_);
+  EXPECT_EQ(0, op_->src_extents_size());
+  EXPECT_EQ(0, op_->dst_extents_size());
+  ASSERT_EQ(6, op_->packed_src_extents_size());
+  // Starts are relative to the previous end, the hole wraps around to 1.
+  EXPECT_EQ(100, op_->packed_src_extents(0));
+  EXPECT_EQ(19, op_->packed_src_extents(4));
+
+  ASSERT_TRUE(UnpackManifestExtents(&manifest_));
+  EXPECT_EQ(original.SerializeAsString(), op_->SerializeAsString());
+}
+
+TEST_F(PackedExtentsTest, OldMinorVersionTest) {
+  const InstallOperation original = *op_;
+  manifest_.set_minor_version(kLZ4DIFFMinorPayloadVersion);
+  PackManifestExtents(&manifest_);
+  EXPECT_EQ(original.SerializeAsString(), op_->SerializeAsString());
+
+  op_->add_packed_dst_extents(1);
+  op_->add_packed_dst_extents(1);
+  op_->clear_dst_extents();
+  EXPECT_FALSE(UnpackManifestExtents(&manifest_));
+}
+
+TEST_F(PackedExtentsTest, MalformedTest) {
+  PackManifestExtents(&manifest_);
+  op_->add_packed_src_extents(1);
+  EXPECT_FALSE(UnpackManifestExtents(&manifest_));
+
+  op_->clear_packed_src_extents();
+  *op_->add_dst_extents() = ExtentForRange(5, 1);
+  EXPECT_FALSE(UnpackManifestExtents(&manifest_));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,199 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// The least number of blocks hashed by each of the threads.
+constexpr size_t kMinBlocksPerThread = 64;
+
+using ScopedMdCtx = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
+}  // namespace
+
+ParallelHashTreeBuilder::ParallelHashTreeBuilder(size_t block_size,
+                                                 const EVP_MD* md)
+    : block_size_(block_size), md_(md) {
+  CHECK(md_ != nullptr);
+  hash_size_ = 1;
+  while (hash_size_ < static_cast<size_t>(EVP_MD_size(md_))) {
+    hash_size_ <<= 1;
+  }
+  CHECK_LT(hash_size_ * 2, block_size_);
+  num_threads_ =
+      std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxThreads);
+}
+
+bool ParallelHashTreeBuilder::Initialize(uint64_t data_size,
+                                         const brillo::Blob& salt) {
+  if (data_size == 0 || data_size % block_size_ != 0) {
+    LOG(ERROR) << "Hash tree data size " << data_size
+               << " is not a multiple of the block size " << block_size_;
+    return false;
+  }
+  data_size_ = data_size;
+  salt_ = salt;
+  leftover_.clear();
+  levels_.clear();
+  // Padding after the hashes of the data blocks stays zero.
+  levels_.emplace_back(NextLevelSize(data_size_), 0);
+  base_level_used_ = 0;
+  root_hash_.clear();
+  return true;
+}
+
+uint64_t ParallelHashTreeBuilder::NextLevelSize(uint64_t level_size) const {
+  const uint64_t hashes_size = level_size / block_size_ * hash_size_;
+  return utils::DivRoundUp(hashes_size, block_size_) * block_size_;
+}
+
+uint64_t ParallelHashTreeBuilder::CalculateSize(uint64_t data_size) const {
+  uint64_t tree_size = 0;
+  uint64_t level_size = data_size;
+  do {
+    level_size = NextLevelSize(level_size);
+    tree_size += level_size;
+  } while (level_size > block_size_);
+  return tree_size;
+}
+
+bool ParallelHashTreeBuilder::Update(const uint8_t* data, size_t size) {
+  TEST_AND_RETURN_FALSE(!levels_.empty());
+  auto& base_level = levels_[0];
+  const uint64_t hashed_size =
+      base_level_used_ / hash_size_ * block_size_ + leftover_.size();
+  if (hashed_size + size > data_size_) {
+    LOG(ERROR) << "Hashing " << hashed_size + size
+               << " bytes, more than the expected " << data_size_;
+    return false;
+  }
+  if (!leftover_.empty()) {
+    const size_t count = std::min(size, block_size_ - leftover_.size());
+    leftover_.insert(leftover_.end(), data, data + count);
+    data += count;
+    size -= count;
+    if (leftover_.size() < block_size_) {
+      return true;
+    }
+    TEST_AND_RETURN_FALSE(HashBlocksOnThread(
+        leftover_.data(), block_size_, base_level.data() + base_level_used_));
+    base_level_used_ += hash_size_;
+    leftover_.clear();
+  }
+  const size_t whole_size = size / block_size_ * block_size_;
+  TEST_AND_RETURN_FALSE(
+      HashBlocks(data, whole_size, base_level.data() + base_level_used_));
+  base_level_used_ += whole_size / block_size_ * hash_size_;
+  leftover_.assign(data + whole_size, data + size);
+  return true;
+}
+
+bool ParallelHashTreeBuilder::BuildHashTree() {
+  TEST_AND_RETURN_FALSE(levels_.size() == 1);
+  if (base_level_used_ / hash_size_ * block_size_ != data_size_) {
+    LOG(ERROR) << "Only " << base_level_used_ / hash_size_ * block_size_
+               << " of " << data_size_ << " bytes were hashed";
+    return false;
+  }
+  while (levels_.back().size() > block_size_) {
+    brillo::Blob next_level(NextLevelSize(levels_.back().size()), 0);
+    const auto& level = levels_.back();
+    TEST_AND_RETURN_FALSE(
+        HashBlocks(level.data(), level.size(), next_level.data()));
+    levels_.push_back(std::move(next_level));
+  }
+  root_hash_.resize(hash_size_);
+  TEST_AND_RETURN_FALSE(HashBlocksOnThread(
+      levels_.back().data(), block_size_, root_hash_.data()));
+  return true;
+}
+
+bool ParallelHashTreeBuilder::WriteHashTree(
+    const std::function<bool(const uint8_t*, size_t)>& callback) const {
+  TEST_AND_RETURN_FALSE(!root_hash_.empty());
+  for (auto level = levels_.rbegin(); level != levels_.rend(); level++) {
+    TEST_AND_RETURN_FALSE(callback(level->data(), level->size()));
+  }
+  return true;
+}
+
+bool ParallelHashTreeBuilder::HashBlocks(const uint8_t* data,
+                                         size_t size,
+                                         uint8_t* out) const {
+  const size_t num_blocks = size / block_size_;
+  const size_t num_threads = std::clamp<size_t>(
+      num_blocks / kMinBlocksPerThread, 1, num_threads_);
+  if (num_threads == 1) {
+    return HashBlocksOnThread(data, size, out);
+  }
+  std::vector<std::thread> threads;
+  std::vector<char> results(num_threads, false);
+  size_t begin = 0;
+  for (size_t t = 0; t < num_threads; t++) {
+    const size_t end = num_blocks * (t + 1) / num_threads;
+    auto hash = [this, data, out, begin, end, &results, t] {
+      results[t] = HashBlocksOnThread(data + begin * block_size_,
+                                      (end - begin) * block_size_,
+                                      out + begin * hash_size_);
+    };
+    if (t + 1 < num_threads) {
+      threads.emplace_back(hash);
+    } else {
+      hash();
+    }
+    begin = end;
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return std::all_of(
+      results.begin(), results.end(), [](char result) { return result; });
+}
+
+bool ParallelHashTreeBuilder::HashBlocksOnThread(const uint8_t* data,
+                                                 size_t size,
+                                                 uint8_t* out) const {
+  // Every block is hashed from a copy of the context which has the salt
+  // already.
+  ScopedMdCtx salted(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+  ScopedMdCtx ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+  TEST_AND_RETURN_FALSE(salted && ctx);
+  TEST_AND_RETURN_FALSE(EVP_DigestInit_ex(salted.get(), md_, nullptr) == 1);
+  TEST_AND_RETURN_FALSE(
+      EVP_DigestUpdate(salted.get(), salt_.data(), salt_.size()) == 1);
+  for (size_t offset = 0; offset < size; offset += block_size_) {
+    unsigned int digest_size = 0;
+    TEST_AND_RETURN_FALSE(EVP_MD_CTX_copy_ex(ctx.get(), salted.get()) == 1);
+    TEST_AND_RETURN_FALSE(
+        EVP_DigestUpdate(ctx.get(), data + offset, block_size_) == 1);
+    TEST_AND_RETURN_FALSE(
+        EVP_DigestFinal_ex(ctx.get(), out, &digest_size) == 1);
+    std::fill(out + digest_size, out + hash_size_, 0);
+    out += hash_size_;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_HASH_TREE_BUILDER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_HASH_TREE_BUILDER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <openssl/evp.h>
+
+namespace chromeos_update_engine {
+
+// Builds the same dm-verity hash tree as libverity's HashTreeBuilder, hashing
+// the blocks of every level on up to |kMaxThreads| threads. The tree is kept
+// in memory until it's written with WriteHashTree(), top level first.
+//
+// Digests come from libcrypto, which already picks the SHA-NI or ARMv8
+// SHA2 instructions when the CPU has them.
+class ParallelHashTreeBuilder {
+ public:
+  static constexpr size_t kMaxThreads = 4;
+
+  // |md| is a digest returned by HashTreeBuilder::HashFunction().
+  ParallelHashTreeBuilder(size_t block_size, const EVP_MD* md);
+
+  // Prepares to hash |data_size| bytes, a multiple of the block size, with
+  // every block prefixed with |salt|.
+  bool Initialize(uint64_t data_size, const brillo::Blob& salt);
+
+  // Hashes the next |size| bytes of data. Data not making up a whole block
+  // yet is kept until the next call.
+  bool Update(const uint8_t* data, size_t size);
+
+  // Hashes the levels above the data blocks once all of them were passed to
+  // Update().
+  bool BuildHashTree();
+
+  // Passes every level of the tree to |callback|, from the top level down.
+  bool WriteHashTree(
+      const std::function<bool(const uint8_t*, size_t)>& callback) const;
+
+  // Size of the hash tree of |data_size| bytes.
+  uint64_t CalculateSize(uint64_t data_size) const;
+
+  const brillo::Blob& root_hash() const { return root_hash_; }
+
+ private:
+  // Size of the level hashing a level of |level_size| bytes.
+  uint64_t NextLevelSize(uint64_t level_size) const;
+
+  // Hashes the |size| bytes of whole blocks at |data| to |out|, one
+  // |hash_size_| digest per block, splitting the blocks across threads.
+  bool HashBlocks(const uint8_t* data, size_t size, uint8_t* out) const;
+
+  // Same as HashBlocks() on the calling thread.
+  bool HashBlocksOnThread(const uint8_t* data, size_t size, uint8_t* out) const;
+
+  const size_t block_size_;
+  const EVP_MD* const md_;
+  // Digest size rounded up to a power of two, the digests are padded with
+  // zeros.
+  size_t hash_size_{0};
+  size_t num_threads_{1};
+
+  uint64_t data_size_{0};
+  brillo::Blob salt_;
+  // Data of the block only partially passed to Update() so far.
+  brillo::Blob leftover_;
+  // Levels of the tree, the hashes of the data blocks first.
+  std::vector<brillo::Blob> levels_;
+  // Bytes of |levels_[0]| hashed so far.
+  size_t base_level_used_{0};
+  brillo::Blob root_hash_;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelHashTreeBuilder);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_HASH_TREE_BUILDER_H_
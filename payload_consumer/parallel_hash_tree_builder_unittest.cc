@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <verity/hash_tree_builder.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+
+brillo::Blob MakeData(size_t num_blocks) {
+  brillo::Blob data(num_blocks * kBlockSize);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = (i * 7 + i / kBlockSize) & 0xff;
+  }
+  return data;
+}
+
+// Builds the tree of |data| passing |chunk_size| bytes at a time to both
+// builders and expects identical trees.
+void ExpectSameTree(const std::string& algorithm,
+                    const brillo::Blob& salt,
+                    const brillo::Blob& data,
+                    size_t chunk_size) {
+  const EVP_MD* md = HashTreeBuilder::HashFunction(algorithm);
+  ASSERT_NE(nullptr, md);
+  HashTreeBuilder expected_builder(kBlockSize, md);
+  ParallelHashTreeBuilder builder(kBlockSize, md);
+  ASSERT_TRUE(expected_builder.Initialize(data.size(), salt));
+  ASSERT_TRUE(builder.Initialize(data.size(), salt));
+  ASSERT_EQ(expected_builder.CalculateSize(data.size()),
+            builder.CalculateSize(data.size()));
+  for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+    const size_t size = std::min(chunk_size, data.size() - offset);
+    ASSERT_TRUE(expected_builder.Update(data.data() + offset, size));
+    ASSERT_TRUE(builder.Update(data.data() + offset, size));
+  }
+  ASSERT_TRUE(expected_builder.BuildHashTree());
+  ASSERT_TRUE(builder.BuildHashTree());
+
+  brillo::Blob expected_tree;
+  ASSERT_TRUE(expected_builder.WriteHashTree(
+      [&expected_tree](auto data, auto size) {
+        expected_tree.insert(expected_tree.end(), data, data + size);
+        return true;
+      }));
+  brillo::Blob tree;
+  ASSERT_TRUE(builder.WriteHashTree([&tree](auto data, auto size) {
+    tree.insert(tree.end(), data, data + size);
+    return true;
+  }));
+  ASSERT_EQ(builder.CalculateSize(data.size()), tree.size());
+  ASSERT_EQ(expected_tree, tree);
+}
+}  // namespace
+
+TEST(ParallelHashTreeBuilderTest, SingleBlock) {
+  ExpectSameTree("sha256", {}, MakeData(1), kBlockSize);
+}
+
+TEST(ParallelHashTreeBuilderTest, MultipleLevels) {
+  // 20000 blocks take 157 blocks of sha256 hashes, enough for several threads
+  // on the first two levels.
+  ExpectSameTree("sha256", {1, 2, 3}, MakeData(20000), 1024 * kBlockSize);
+}
+
+TEST(ParallelHashTreeBuilderTest, Sha1HashesArePadded) {
+  ExpectSameTree("sha1", {0xaa, 0xbb}, MakeData(300), 64 * kBlockSize);
+}
+
+TEST(ParallelHashTreeBuilderTest, UnalignedUpdates) {
+  ExpectSameTree("sha256", {4, 5, 6, 7}, MakeData(300), 10000);
+}
+
+TEST(ParallelHashTreeBuilderTest, RejectsMoreData) {
+  ParallelHashTreeBuilder builder(kBlockSize,
+                                  HashTreeBuilder::HashFunction("sha256"));
+  const brillo::Blob data = MakeData(2);
+  ASSERT_TRUE(builder.Initialize(kBlockSize, {}));
+  ASSERT_FALSE(builder.Update(data.data(), data.size()));
+}
+
+TEST(ParallelHashTreeBuilderTest, RejectsMissingData) {
+  ParallelHashTreeBuilder builder(kBlockSize,
+                                  HashTreeBuilder::HashFunction("sha256"));
+  const brillo::Blob data = MakeData(2);
+  ASSERT_TRUE(builder.Initialize(data.size(), {}));
+  ASSERT_TRUE(builder.Update(data.data(), kBlockSize + 1));
+  ASSERT_FALSE(builder.BuildHashTree());
+}
+
+}  // namespace chromeos_update_engine
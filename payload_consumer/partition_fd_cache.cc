@@ -0,0 +1,196 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/partition_fd_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+#if USE_FEC
+#include "update_engine/payload_consumer/fec_file_descriptor.h"
+#endif
+
+namespace chromeos_update_engine {
+
+namespace {
+
+bool IsWritable(int flags) {
+  return (flags & O_ACCMODE) != O_RDONLY;
+}
+
+// Whether a descriptor opened with |cached| can serve a request for
+// |requested|.
+bool IsCompatible(int cached, int requested) {
+  const int cached_access = cached & O_ACCMODE;
+  const int requested_access = requested & O_ACCMODE;
+  if (cached_access != requested_access && cached_access != O_RDWR) {
+    return false;
+  }
+  if ((cached & O_DIRECT) != (requested & O_DIRECT)) {
+    return false;
+  }
+  return !IsWritable(requested) ||
+         (cached & ~O_ACCMODE) == (requested & ~O_ACCMODE);
+}
+
+// Whether |fd| is still open on the file at |path|, which may have been
+// replaced since.
+bool RefersTo(FileDescriptor* fd, const std::string& path) {
+  struct stat fd_stat {};
+  struct stat path_stat {};
+  return fd->Fd() >= 0 && fstat(fd->Fd(), &fd_stat) == 0 &&
+         stat(path.c_str(), &path_stat) == 0 &&
+         fd_stat.st_dev == path_stat.st_dev &&
+         fd_stat.st_ino == path_stat.st_ino;
+}
+
+// A descriptor forwarding to a cached one, which it leaves open.
+class SharedFileDescriptor : public FileDescriptor {
+ public:
+  SharedFileDescriptor(FileDescriptorPtr fd, bool writable)
+      : fd_(std::move(fd)), writable_(writable) {}
+  ~SharedFileDescriptor() override = default;
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    LOG(ERROR) << "Shared partition descriptors can't be reopened.";
+    return false;
+  }
+  bool Open(const char* path, int flags) override { return Open(path, 0, 0); }
+  ssize_t Read(void* buf, size_t count) override {
+    return fd_->Read(buf, count);
+  }
+  ssize_t Write(const void* buf, size_t count) override {
+    return fd_->Write(buf, count);
+  }
+  bool ReadAt(const std::vector<IoRequest>& requests) override {
+    return fd_->ReadAt(requests);
+  }
+  bool WriteAt(const std::vector<IoRequest>& requests) override {
+    return fd_->WriteAt(requests);
+  }
+  off64_t Seek(off64_t offset, int whence) override {
+    return fd_->Seek(offset, whence);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override {
+    if (!open_) {
+      return false;
+    }
+    open_ = false;
+    return !writable_ || fd_->Flush();
+  }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return open_ && fd_->IsOpen(); }
+  int Fd() override { return open_ ? fd_->Fd() : -1; }
+
+ private:
+  FileDescriptorPtr fd_;
+  const bool writable_;
+  bool open_{true};
+
+  DISALLOW_COPY_AND_ASSIGN(SharedFileDescriptor);
+};
+
+}  // namespace
+
+PartitionFdCache* PartitionFdCache::GetInstance() {
+  static PartitionFdCache instance;
+  return &instance;
+}
+
+std::unique_ptr<FileDescriptor> PartitionFdCache::Open(const std::string& path,
+                                                       int flags) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(path);
+  if (it == entries_.end() || !IsCompatible(it->second.flags, flags) ||
+      !RefersTo(it->second.fd.get(), path)) {
+    FileDescriptorPtr fd = CreateAsyncFileDescriptor();
+    if (!fd->Open(path.c_str(), flags)) {
+      return nullptr;
+    }
+    if (wrapper_) {
+      fd = wrapper_(std::move(fd));
+    }
+    // Descriptors already handed out keep the replaced one open.
+    it = entries_.insert_or_assign(path, Entry{std::move(fd), flags, 0}).first;
+  }
+  it->second.last_use = ++uses_;
+  auto shared =
+      std::make_unique<SharedFileDescriptor>(it->second.fd, IsWritable(flags));
+  EvictEntries();
+  return shared;
+}
+
+void PartitionFdCache::SetWrapper(Wrapper wrapper) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  wrapper_ = std::move(wrapper);
+}
+
+void PartitionFdCache::EvictEntries() {
+  while (entries_.size() > kMaxCachedDescriptors) {
+    entries_.erase(std::min_element(
+        entries_.begin(), entries_.end(), [](const auto& a, const auto& b) {
+          return a.second.last_use < b.second.last_use;
+        }));
+  }
+}
+
+#if USE_FEC
+std::unique_ptr<FileDescriptor> PartitionFdCache::OpenEcc(
+    const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = ecc_entries_.find(path);
+  if (it == ecc_entries_.end()) {
+    auto fd = std::make_shared<FecFileDescriptor>();
+    if (!fd->Open(path.c_str(), O_RDONLY, 0)) {
+      return nullptr;
+    }
+    it = ecc_entries_.emplace(path, std::move(fd)).first;
+  }
+  return std::make_unique<SharedFileDescriptor>(it->second, false);
+}
+#endif  // USE_FEC
+
+void PartitionFdCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  LOG_IF(INFO, !entries_.empty() || !ecc_entries_.empty())
+      << "Releasing " << entries_.size() + ecc_entries_.size()
+      << " cached partition descriptors.";
+  entries_.clear();
+  ecc_entries_.clear();
+}
+
+size_t PartitionFdCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size() + ecc_entries_.size();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PARTITION_FD_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PARTITION_FD_CACHE_H_
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <base/macros.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// Keeps the partitions opened during an update open until it ends, so the
+// partition writers and the FilesystemVerifierAction of a partial update with
+// many small partitions don't open the same devices over and over.
+//
+// The descriptors handed out share the cached one: closing them only flushes
+// the writes, and Open() fails. The cached descriptors are closed by Clear()
+// once the last of them is released, which must happen before unmapping the
+// partitions. Safe to use from multiple threads.
+class PartitionFdCache {
+ public:
+  // The least recently used descriptors beyond this many are dropped.
+  static constexpr size_t kMaxCachedDescriptors = 128;
+
+  // The cache of the update in progress.
+  static PartitionFdCache* GetInstance();
+
+  // Wraps the descriptors opened by the cache, see SetWrapper().
+  using Wrapper = std::function<FileDescriptorPtr(FileDescriptorPtr)>;
+
+  PartitionFdCache() = default;
+
+  // Passes every descriptor opened from now on through |wrapper|, which the
+  // benchmarks and tests use to emulate slower storage, see
+  // FakeStorageFileDescriptor. Cleared with an empty |wrapper|.
+  void SetWrapper(Wrapper wrapper);
+
+  // Returns a descriptor of |path| opened with |flags|, which reuses the one
+  // opened earlier if it is still open on the same file and allows the same
+  // access with the same O_DIRECT and, for writes, the same other flags.
+  // Returns nullptr with errno set on failure.
+  std::unique_ptr<FileDescriptor> Open(const std::string& path, int flags);
+
+#if USE_FEC
+  // Returns an error corrected, read-only descriptor of |path|, see
+  // FecFileDescriptor, or nullptr on failure.
+  std::unique_ptr<FileDescriptor> OpenEcc(const std::string& path);
+#endif  // USE_FEC
+
+  // Drops all cached descriptors.
+  void Clear();
+
+  // The number of cached descriptors.
+  size_t size() const;
+
+ private:
+  struct Entry {
+    FileDescriptorPtr fd;
+    int flags;
+    // The value of |uses_| when last handed out.
+    uint64_t last_use;
+  };
+
+  // Drops the least recently used entry of |entries_| beyond
+  // kMaxCachedDescriptors.
+  void EvictEntries();
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+  uint64_t uses_{0};
+  std::map<std::string, FileDescriptorPtr> ecc_entries_;
+  Wrapper wrapper_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionFdCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PARTITION_FD_CACHE_H_
@@ -0,0 +1,102 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/partition_fd_cache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class PartitionFdCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    brillo::Blob data(4096, 'a');
+    ASSERT_TRUE(
+        utils::WriteFile(file_.path().c_str(), data.data(), data.size()));
+  }
+
+  ScopedTempFile file_{"PartitionFdCacheTest.XXXXXX"};
+  PartitionFdCache cache_;
+};
+
+TEST_F(PartitionFdCacheTest, ReuseWritableForReadsTest) {
+  auto writer = cache_.Open(file_.path(), O_RDWR);
+  ASSERT_NE(writer, nullptr);
+  brillo::Blob data(4096, 'b');
+  ASSERT_TRUE(writer->WriteAt({{data.data(), data.size(), 0}}));
+  const int fd = writer->Fd();
+  // Closing only flushes the shared descriptor.
+  ASSERT_TRUE(writer->Close());
+  EXPECT_FALSE(writer->IsOpen());
+
+  auto reader = cache_.Open(file_.path(), O_RDONLY);
+  ASSERT_NE(reader, nullptr);
+  EXPECT_EQ(fd, reader->Fd());
+  brillo::Blob read_data(data.size());
+  ASSERT_TRUE(reader->ReadAt({{read_data.data(), read_data.size(), 0}}));
+  EXPECT_EQ(data, read_data);
+  EXPECT_FALSE(reader->Open(file_.path().c_str(), O_RDONLY));
+  EXPECT_EQ(1u, cache_.size());
+}
+
+TEST_F(PartitionFdCacheTest, ReopenForOtherAccessTest) {
+  auto reader = cache_.Open(file_.path(), O_RDONLY);
+  ASSERT_NE(reader, nullptr);
+  auto writer = cache_.Open(file_.path(), O_RDWR);
+  ASSERT_NE(writer, nullptr);
+  EXPECT_NE(reader->Fd(), writer->Fd());
+  // Writes need the same flags.
+  auto dsync_writer = cache_.Open(file_.path(), O_RDWR | O_DSYNC);
+  ASSERT_NE(dsync_writer, nullptr);
+  EXPECT_NE(writer->Fd(), dsync_writer->Fd());
+  // The descriptors handed out stay usable.
+  brillo::Blob read_data(16);
+  EXPECT_TRUE(reader->ReadAt({{read_data.data(), read_data.size(), 0}}));
+  EXPECT_EQ(1u, cache_.size());
+}
+
+TEST_F(PartitionFdCacheTest, ReplacedFileTest) {
+  ASSERT_NE(cache_.Open(file_.path(), O_RDONLY), nullptr);
+
+  // A new file at the same path must not be read through the old descriptor.
+  ASSERT_EQ(0, unlink(file_.path().c_str()));
+  brillo::Blob data(4096, 'c');
+  ASSERT_TRUE(
+      utils::WriteFile(file_.path().c_str(), data.data(), data.size()));
+  auto reader = cache_.Open(file_.path(), O_RDONLY);
+  ASSERT_NE(reader, nullptr);
+  brillo::Blob read_data(data.size());
+  ASSERT_TRUE(reader->ReadAt({{read_data.data(), read_data.size(), 0}}));
+  EXPECT_EQ(data, read_data);
+}
+
+TEST_F(PartitionFdCacheTest, ClearTest) {
+  ASSERT_NE(cache_.Open(file_.path(), O_RDONLY), nullptr);
+  EXPECT_EQ(1u, cache_.size());
+  cache_.Clear();
+  EXPECT_EQ(0u, cache_.size());
+  EXPECT_EQ(nullptr, cache_.Open(file_.path() + ".missing", O_RDONLY));
+  EXPECT_EQ(0u, cache_.size());
+}
+
+}  // namespace chromeos_update_engine
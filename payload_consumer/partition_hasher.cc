@@ -0,0 +1,267 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/partition_hasher.h"
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/tracing.h"
+
+namespace chromeos_update_engine {
+
+void ReadBandwidthLimiter::Acquire(size_t bytes) {
+  if (bytes_per_second_ == 0) {
+    return;
+  }
+  const auto duration = std::chrono::microseconds(
+      static_cast<int64_t>(bytes * 1000000 / bytes_per_second_));
+  std::chrono::steady_clock::time_point start;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    start = std::max(std::chrono::steady_clock::now(), next_read_);
+    next_read_ = start + duration;
+  }
+  std::this_thread::sleep_until(start);
+}
+
+void ReadSizeProbe::AddRead(size_t bytes, base::TimeDelta duration) {
+  if (settled_) {
+    return;
+  }
+  probe_bytes_ += bytes;
+  probe_duration_ += duration;
+  if (probe_bytes_ < kProbeBytes) {
+    return;
+  }
+  const double throughput =
+      probe_bytes_ / std::max(probe_duration_.InSecondsF(), 1e-6);
+  probe_bytes_ = 0;
+  probe_duration_ = base::TimeDelta();
+  if (previous_throughput_ > 0 && throughput < previous_throughput_ * 1.1) {
+    if (throughput < previous_throughput_) {
+      read_size_ /= 2;
+    }
+    settled_ = true;
+  } else if (read_size_ * 2 > max_size_) {
+    settled_ = true;
+  } else {
+    previous_throughput_ = throughput;
+    read_size_ *= 2;
+  }
+  LOG_IF(INFO, settled_) << "Reading " << read_size_ / 1024
+                         << " KiB at a time";
+}
+
+PartitionHasher::PartitionHasher(std::unique_ptr<FileDescriptor> fd,
+                                 uint64_t size,
+                                 size_t min_read_size,
+                                 size_t max_read_size,
+                                 size_t buffer_alignment,
+                                 ReadBandwidthLimiter* limiter)
+    : fd_(std::move(fd)),
+      size_(size),
+      buffer_alignment_(buffer_alignment),
+      limiter_(limiter),
+      read_size_probe_(min_read_size, max_read_size),
+      buffers_(kNumBuffers) {
+  CHECK(buffer_alignment == 0 ||
+        AlignedBufferPool::kAlignment % buffer_alignment == 0);
+  for (size_t i = 0; i < buffers_.size(); i++) {
+    free_buffers_.push_back(i);
+  }
+}
+
+PartitionHasher::~PartitionHasher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void PartitionHasher::Start() {
+  CHECK(threads_.empty());
+  threads_.emplace_back(&PartitionHasher::ReadLoop, this);
+  threads_.emplace_back(&PartitionHasher::HashLoop, this);
+}
+
+uint8_t* PartitionHasher::BufferData(size_t buffer, size_t size) {
+  if (buffers_[buffer].size() < size) {
+    // Buffers only grow with the read size, which changes a few times.
+    buffers_[buffer] = AlignedBufferPool::GetInstance()->Acquire(size);
+    size_t buffers_size = 0;
+    for (const auto& acquired : buffers_) {
+      buffers_size += acquired.size();
+    }
+    memory_charge_.Set(buffers_size);
+  }
+  return buffers_[buffer].data();
+}
+
+void PartitionHasher::ReadLoop() {
+  uint64_t offset = 0;
+  while (offset < size_) {
+    size_t buffer;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] {
+        return cancelled_ || failed_ || !free_buffers_.empty();
+      });
+      if (cancelled_ || failed_) {
+        return;
+      }
+      buffer = free_buffers_.front();
+      free_buffers_.pop_front();
+    }
+    const size_t read_size =
+        std::min<uint64_t>(read_size_probe_.read_size(), size_ - offset);
+    uint8_t* data = BufferData(buffer, read_size);
+    if (data == nullptr) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      failed_ = true;
+      cv_.notify_all();
+      return;
+    }
+    if (limiter_) {
+      limiter_->Acquire(read_size);
+    }
+    TRACE_SCOPE("PartitionHasher read");
+    const auto read_start = base::TimeTicks::Now();
+    if (!fd_->ReadAt({{data, read_size, offset_ + offset}})) {
+      PLOG(ERROR) << "Failed to read " << read_size << " bytes at offset "
+                  << offset_ + offset;
+      std::lock_guard<std::mutex> lock(mutex_);
+      failed_ = true;
+      cv_.notify_all();
+      return;
+    }
+    read_size_probe_.AddRead(read_size, base::TimeTicks::Now() - read_start);
+    offset += read_size;
+    std::lock_guard<std::mutex> lock(mutex_);
+    filled_buffers_.emplace_back(buffer, read_size);
+    cv_.notify_all();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  read_finished_ = true;
+  cv_.notify_all();
+}
+
+bool PartitionHasher::GetCheckpoint(uint64_t* offset, std::string* context) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (checkpoint_context_.empty()) {
+    return false;
+  }
+  *offset = offset_ + checkpoint_bytes_;
+  *context = checkpoint_context_;
+  return true;
+}
+
+void PartitionHasher::HashLoop() {
+  auto hasher = std::make_unique<HashCalculator>();
+  // Bytes of the current segment hashed so far.
+  uint64_t segment_bytes = 0;
+  bool success = false;
+  if (!hash_context_.empty() && !hasher->SetContext(hash_context_)) {
+    LOG(ERROR) << "Failed to restore the hash context";
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = true;
+    cv_.notify_all();
+  }
+  while (true) {
+    std::pair<size_t, size_t> filled;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] {
+        return cancelled_ || failed_ || read_finished_ ||
+               !filled_buffers_.empty();
+      });
+      if (cancelled_ || failed_) {
+        break;
+      }
+      if (filled_buffers_.empty()) {
+        // Nothing is left of the last segment if it is a full one.
+        success = (segment_size_ > 0 && segment_bytes == 0) ||
+                  hasher->Finalize();
+        if (success && segment_size_ > 0 && segment_bytes > 0) {
+          segment_hashes_.push_back(hasher->raw_hash());
+        }
+        break;
+      }
+      filled = filled_buffers_.front();
+      filled_buffers_.pop_front();
+    }
+    TRACE_SCOPE("PartitionHasher hash");
+    const uint8_t* data = buffers_[filled.first].data();
+    size_t remaining = filled.second;
+    bool hashed = true;
+    while (hashed && remaining > 0) {
+      // Buffers may span several segments.
+      const size_t size =
+          segment_size_ > 0
+              ? std::min<uint64_t>(remaining, segment_size_ - segment_bytes)
+              : remaining;
+      hashed = hasher->Update(data, size);
+      data += size;
+      remaining -= size;
+      segment_bytes += size;
+      if (hashed && segment_bytes == segment_size_) {
+        if (!hasher->Finalize()) {
+          hashed = false;
+          break;
+        }
+        segment_hashes_.push_back(hasher->raw_hash());
+        hasher = std::make_unique<HashCalculator>();
+        segment_bytes = 0;
+      }
+    }
+    if (!hashed) {
+      LOG(ERROR) << "Failed to hash " << filled.second << " bytes";
+      std::lock_guard<std::mutex> lock(mutex_);
+      failed_ = true;
+      cv_.notify_all();
+      break;
+    }
+    bytes_hashed_ += filled.second;
+    // A context is a couple hundred bytes, cheap next to hashing a buffer.
+    std::string context =
+        segment_size_ == 0 ? hasher->GetContext() : std::string();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!context.empty()) {
+      checkpoint_context_ = std::move(context);
+      checkpoint_bytes_ = bytes_hashed_;
+    }
+    free_buffers_.push_back(filled.first);
+    cv_.notify_all();
+  }
+  if (success && segment_size_ == 0) {
+    hash_ = hasher->raw_hash();
+  }
+  succeeded_ = success;
+  done_ = true;
+  if (done_callback_) {
+    done_callback_();
+  }
+}
+
+}  // namespace chromeos_update_engine
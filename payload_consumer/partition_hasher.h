@@ -0,0 +1,207 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PARTITION_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PARTITION_HASHER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/memory_accounting.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// Paces the reads of several threads to at most |bytes_per_second| bytes per
+// second in total, so that hashing partitions in the background leaves
+// bandwidth to the rest of the system.
+class ReadBandwidthLimiter {
+ public:
+  // A limit of 0 doesn't limit reads at all.
+  explicit ReadBandwidthLimiter(uint64_t bytes_per_second)
+      : bytes_per_second_(bytes_per_second) {}
+
+  // Blocks until |bytes| more bytes may be read.
+  void Acquire(size_t bytes);
+
+ private:
+  const uint64_t bytes_per_second_;
+
+  std::mutex mutex_;
+  // The time the read following the last granted one may start at.
+  std::chrono::steady_clock::time_point next_read_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReadBandwidthLimiter);
+};
+
+// Picks the size of sequential reads: starts at |min_size| and doubles it, up
+// to |max_size|, as long as every kProbeBytes read at the new size show a
+// throughput at least 10% higher than at the previous size.
+class ReadSizeProbe {
+ public:
+  static constexpr uint64_t kProbeBytes = 16 * 1024 * 1024;
+
+  ReadSizeProbe(size_t min_size, size_t max_size)
+      : max_size_(max_size), read_size_(min_size) {}
+
+  size_t read_size() const { return read_size_; }
+
+  // Records a read of |bytes| bytes which took |duration|.
+  void AddRead(size_t bytes, base::TimeDelta duration);
+
+ private:
+  const size_t max_size_;
+  size_t read_size_;
+  // Whether |read_size_| is final.
+  bool settled_{false};
+
+  // Bytes read at |read_size_| so far and how long that took.
+  uint64_t probe_bytes_{0};
+  base::TimeDelta probe_duration_;
+  // Bytes per second measured at half |read_size_|, 0 if not measured.
+  double previous_throughput_{0};
+};
+
+// Computes the SHA-256 hash of the first |size| bytes of a file descriptor on
+// two threads of its own: one reads ahead into up to kNumBuffers buffers while
+// the other hashes the filled ones, so reading and hashing overlap.
+class PartitionHasher {
+ public:
+  static constexpr size_t kNumBuffers = 4;
+
+  // The size of reads is picked by a ReadSizeProbe between |min_read_size|
+  // and |max_read_size|. With a non-zero |buffer_alignment|, which O_DIRECT
+  // reads require, reads go into buffers aligned to it. Reads are paced by
+  // |limiter|, which may be null and must outlive this object.
+  PartitionHasher(std::unique_ptr<FileDescriptor> fd,
+                  uint64_t size,
+                  size_t min_read_size,
+                  size_t max_read_size,
+                  size_t buffer_alignment,
+                  ReadBandwidthLimiter* limiter);
+  // Stops reading and hashing and waits for both threads.
+  ~PartitionHasher();
+
+  // Hashes the |size| bytes starting at |offset| instead of the first ones.
+  // Must be called before Start().
+  void set_offset(uint64_t offset) { offset_ = offset; }
+  // Hashes every |segment_size| bytes on its own, the last segment may be
+  // shorter, instead of hashing the whole range. Must be called before
+  // Start().
+  void set_segment_size(uint64_t segment_size) {
+    segment_size_ = segment_size;
+  }
+  // Continues the hash from |context|, the HashCalculator::GetContext() of
+  // the bytes before the range. Must be called before Start().
+  void set_hash_context(std::string context) {
+    hash_context_ = std::move(context);
+  }
+
+  // Calls |callback| on the hashing thread once done(), whether the hash
+  // succeeded, failed or was cancelled. Must be called before Start().
+  void set_done_callback(std::function<void()> callback) {
+    done_callback_ = std::move(callback);
+  }
+
+  // Starts the threads.
+  void Start();
+
+  bool started() const { return !threads_.empty(); }
+  bool done() const { return done_; }
+  uint64_t size() const { return size_; }
+  uint64_t bytes_hashed() const { return bytes_hashed_; }
+
+  // Once done(), whether the whole range was read and hashed, and its hash
+  // or, with a segment size, the hashes of its segments.
+  bool succeeded() const { return succeeded_; }
+  const brillo::Blob& hash() const { return hash_; }
+  const std::vector<brillo::Blob>& segment_hashes() const {
+    return segment_hashes_;
+  }
+
+  // Sets |offset| to the end of the bytes hashed so far and |context| to the
+  // hash context at that point, for a later hasher to continue from. Returns
+  // false if nothing was hashed yet or with a segment size.
+  bool GetCheckpoint(uint64_t* offset, std::string* context);
+
+ private:
+  void ReadLoop();
+  void HashLoop();
+
+  // Returns the start of |buffer|, which holds at least |size| bytes, or
+  // nullptr if it can't be allocated.
+  uint8_t* BufferData(size_t buffer, size_t size);
+
+  std::unique_ptr<FileDescriptor> fd_;
+  uint64_t offset_{0};
+  const uint64_t size_;
+  uint64_t segment_size_{0};
+  std::string hash_context_;
+  std::function<void()> done_callback_;
+  const size_t buffer_alignment_;
+  ReadBandwidthLimiter* limiter_;
+  // Only used by the reading thread.
+  ReadSizeProbe read_size_probe_;
+
+  // Page aligned, which covers |buffer_alignment_|.
+  std::vector<AlignedBufferPool::Buffer> buffers_;
+  // Charges |buffers_|, only used by the reading thread.
+  ScopedMemoryCharge memory_charge_{MemoryConsumer::kVerifier};
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  // Signalled when a buffer is freed or filled, or the state below changes.
+  std::condition_variable cv_;
+  // Indices of |buffers_| free to be read into.
+  std::deque<size_t> free_buffers_;
+  // Indices and sizes of the filled |buffers_|, in file order.
+  std::deque<std::pair<size_t, size_t>> filled_buffers_;
+  // The hash context after the first |checkpoint_bytes_| bytes of the range.
+  std::string checkpoint_context_;
+  uint64_t checkpoint_bytes_{0};
+  bool read_finished_{false};
+  bool failed_{false};
+  bool cancelled_{false};
+
+  std::atomic<uint64_t> bytes_hashed_{0};
+  std::atomic<bool> done_{false};
+  // Set before |done_|.
+  bool succeeded_{false};
+  brillo::Blob hash_;
+  std::vector<brillo::Blob> segment_hashes_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionHasher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PARTITION_HASHER_H_
@@ -0,0 +1,195 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/partition_hasher.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+void WaitUntilDone(const PartitionHasher& hasher) {
+  while (!hasher.done()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+}  // namespace
+
+class PartitionHasherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(1024 * 1024 + 123);
+    test_utils::FillWithData(&data_);
+    ASSERT_TRUE(test_utils::WriteFileVector(file_.path(), data_));
+  }
+
+  std::unique_ptr<FileDescriptor> OpenFile() {
+    auto fd = std::make_unique<EintrSafeFileDescriptor>();
+    EXPECT_TRUE(fd->Open(file_.path().c_str(), O_RDONLY));
+    return fd;
+  }
+
+  ScopedTempFile file_{"partition_hasher.XXXXXX"};
+  brillo::Blob data_;
+};
+
+TEST_F(PartitionHasherTest, HashesRange) {
+  // Smaller buffers than the range, which doesn't end on a buffer boundary.
+  const size_t size = data_.size() - 17;
+  PartitionHasher hasher(OpenFile(), size, 64 * 1024, 256 * 1024, 0, nullptr);
+  hasher.Start();
+  WaitUntilDone(hasher);
+
+  brillo::Blob expected;
+  ASSERT_TRUE(HashCalculator::RawHashOfBytes(data_.data(), size, &expected));
+  ASSERT_TRUE(hasher.succeeded());
+  ASSERT_EQ(expected, hasher.hash());
+  ASSERT_EQ(size, hasher.bytes_hashed());
+}
+
+TEST_F(PartitionHasherTest, HashesSegments) {
+  // Segments don't line up with the reads and the last one is shorter.
+  const size_t offset = 4096;
+  const size_t segment_size = 100 * 1024;
+  const size_t size = data_.size() - offset;
+  PartitionHasher hasher(OpenFile(), size, 64 * 1024, 64 * 1024, 0, nullptr);
+  hasher.set_offset(offset);
+  hasher.set_segment_size(segment_size);
+  hasher.Start();
+  WaitUntilDone(hasher);
+
+  ASSERT_TRUE(hasher.succeeded());
+  ASSERT_EQ(utils::DivRoundUp(size, segment_size),
+            hasher.segment_hashes().size());
+  for (size_t i = 0; i < hasher.segment_hashes().size(); i++) {
+    brillo::Blob expected;
+    ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+        data_.data() + offset + i * segment_size,
+        std::min(segment_size, size - i * segment_size),
+        &expected));
+    ASSERT_EQ(expected, hasher.segment_hashes()[i]) << "segment " << i;
+  }
+}
+
+TEST_F(PartitionHasherTest, ContinuesFromCheckpoint) {
+  const size_t size = data_.size();
+  PartitionHasher first(OpenFile(), size / 2, 64 * 1024, 64 * 1024, 0, nullptr);
+  first.Start();
+  WaitUntilDone(first);
+  uint64_t offset = 0;
+  std::string context;
+  ASSERT_TRUE(first.GetCheckpoint(&offset, &context));
+  ASSERT_EQ(size / 2, offset);
+
+  PartitionHasher second(
+      OpenFile(), size - offset, 64 * 1024, 64 * 1024, 0, nullptr);
+  second.set_offset(offset);
+  second.set_hash_context(context);
+  second.Start();
+  WaitUntilDone(second);
+
+  brillo::Blob expected;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(data_, &expected));
+  ASSERT_TRUE(second.succeeded());
+  ASSERT_EQ(expected, second.hash());
+}
+
+TEST_F(PartitionHasherTest, FailsPastEndOfFile) {
+  PartitionHasher hasher(
+      OpenFile(), data_.size() + 4096, 64 * 1024, 64 * 1024, 0, nullptr);
+  hasher.Start();
+  WaitUntilDone(hasher);
+  ASSERT_FALSE(hasher.succeeded());
+}
+
+TEST_F(PartitionHasherTest, DestroyWhileHashing) {
+  ReadBandwidthLimiter limiter(1024 * 1024);
+  auto hasher = std::make_unique<PartitionHasher>(
+      OpenFile(), data_.size(), 64 * 1024, 64 * 1024, 0, &limiter);
+  hasher->Start();
+  hasher.reset();
+}
+
+TEST_F(PartitionHasherTest, HashesWithAlignedBuffers) {
+  PartitionHasher hasher(
+      OpenFile(), data_.size(), 64 * 1024, 64 * 1024, 4096, nullptr);
+  hasher.Start();
+  WaitUntilDone(hasher);
+
+  brillo::Blob expected;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(data_, &expected));
+  ASSERT_TRUE(hasher.succeeded());
+  ASSERT_EQ(expected, hasher.hash());
+}
+
+TEST(ReadSizeProbeTest, GrowsWhileThroughputImproves) {
+  ReadSizeProbe probe(1024 * 1024, 8 * 1024 * 1024);
+  // 100 MB/s at 1 MiB, 200 MB/s at 2 MiB, 210 MB/s at 4 MiB.
+  probe.AddRead(ReadSizeProbe::kProbeBytes,
+                base::TimeDelta::FromMicroseconds(ReadSizeProbe::kProbeBytes /
+                                                  100));
+  ASSERT_EQ(2u * 1024 * 1024, probe.read_size());
+  probe.AddRead(ReadSizeProbe::kProbeBytes,
+                base::TimeDelta::FromMicroseconds(ReadSizeProbe::kProbeBytes /
+                                                  200));
+  ASSERT_EQ(4u * 1024 * 1024, probe.read_size());
+  probe.AddRead(ReadSizeProbe::kProbeBytes,
+                base::TimeDelta::FromMicroseconds(ReadSizeProbe::kProbeBytes /
+                                                  210));
+  // Not worth the larger size, and settled.
+  ASSERT_EQ(4u * 1024 * 1024, probe.read_size());
+  probe.AddRead(ReadSizeProbe::kProbeBytes,
+                base::TimeDelta::FromMicroseconds(1));
+  ASSERT_EQ(4u * 1024 * 1024, probe.read_size());
+}
+
+TEST(ReadSizeProbeTest, ShrinksWhenSlower) {
+  ReadSizeProbe probe(1024 * 1024, 8 * 1024 * 1024);
+  probe.AddRead(ReadSizeProbe::kProbeBytes,
+                base::TimeDelta::FromMicroseconds(ReadSizeProbe::kProbeBytes /
+                                                  100));
+  probe.AddRead(ReadSizeProbe::kProbeBytes,
+                base::TimeDelta::FromMicroseconds(ReadSizeProbe::kProbeBytes /
+                                                  50));
+  ASSERT_EQ(1024u * 1024, probe.read_size());
+}
+
+TEST(ReadBandwidthLimiterTest, PacesReads) {
+  ReadBandwidthLimiter limiter(1000 * 1000);
+  const auto start = std::chrono::steady_clock::now();
+  // The first read is granted right away, each one after waits for the
+  // previous one's share of the bandwidth.
+  for (int i = 0; i < 5; i++) {
+    limiter.Acquire(10 * 1000);
+  }
+  ASSERT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(40));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,8 +16,15 @@
 
 #include "update_engine/payload_consumer/partition_update_generator_android.h"
 
+#include <fcntl.h>
+
+#include <chrono>
+#include <deque>
 #include <filesystem>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <utility>
 
 #include <android-base/properties.h>
@@ -26,11 +33,59 @@
 #include <base/strings/string_split.h>
 
 #include "update_engine/common/boot_control_interface.h"
-#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/partition_hasher.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Source partitions hashed at the same time, each by a PartitionHasher
+// reading on a thread and hashing on another.
+constexpr size_t kMaxConcurrentHashes = 4;
+constexpr size_t kMinReadSize = 1024 * 1024;      // 1 MiB
+constexpr size_t kMaxReadSize = 8 * 1024 * 1024;  // 8 MiB
+// Alignment of the size and the buffers of O_DIRECT reads.
+constexpr size_t kDirectIoAlignment = 4096;
+// How often the hashers are checked for completion.
+constexpr auto kHashPollInterval = std::chrono::milliseconds(10);
+
+// The hashes of the source partitions computed so far, by device and size.
+// The source slot is the running one, whose static partitions don't change
+// while update_engine runs, so an update retried without restarting it
+// doesn't read them again.
+struct HashCache {
+  std::mutex mutex;
+  std::map<std::pair<std::string, int64_t>, brillo::Blob> hashes;
+};
+
+HashCache* GetHashCache() {
+  static auto* cache = new HashCache();
+  return cache;
+}
+
+// Starts hashing the first |size| bytes of |device|, with direct reads if
+// possible. Returns nullptr if it can't be opened.
+std::unique_ptr<PartitionHasher> StartHashing(const std::string& device,
+                                              int64_t size) {
+  auto fd = std::make_unique<EintrSafeFileDescriptor>();
+  size_t alignment = 0;
+  if (size % kDirectIoAlignment == 0 &&
+      fd->Open(device.c_str(), O_RDONLY | O_DIRECT)) {
+    alignment = kDirectIoAlignment;
+  } else if (!fd->Open(device.c_str(), O_RDONLY)) {
+    PLOG(ERROR) << "Unable to open " << device;
+    return nullptr;
+  }
+  auto hasher = std::make_unique<PartitionHasher>(
+      std::move(fd), size, kMinReadSize, kMaxReadSize, alignment, nullptr);
+  hasher->Start();
+  return hasher;
+}
+
+}  // namespace
+
 PartitionUpdateGeneratorAndroid::PartitionUpdateGeneratorAndroid(
     BootControlInterface* boot_control, size_t block_size)
     : boot_control_(boot_control), block_size_(block_size) {}
@@ -52,7 +107,9 @@ bool PartitionUpdateGeneratorAndroid::
     return false;
   }
 
-  std::vector<PartitionUpdate> partition_updates;
+  // The partitions to copy, with their source device and size.
+  std::vector<std::string> partition_names;
+  std::vector<std::pair<std::string, int64_t>> source_devices;
   for (const auto& partition_name : ab_partitions) {
     if (partitions_in_payload.find(partition_name) !=
         partitions_in_payload.end()) {
@@ -95,13 +152,20 @@ bool PartitionUpdateGeneratorAndroid::
       return false;
     }
 
-    auto partition_update = CreatePartitionUpdate(
-        partition_name, source_device, target_device, source_size);
-    if (!partition_update.has_value()) {
-      LOG(ERROR) << "Failed to create partition update for " << partition_name;
+    partition_names.push_back(partition_name);
+    source_devices.emplace_back(source_device, source_size);
+  }
+
+  const auto hashes = CalculateHashesForPartitions(source_devices);
+  std::vector<PartitionUpdate> partition_updates;
+  for (size_t i = 0; i < partition_names.size(); i++) {
+    if (!hashes[i].has_value()) {
+      LOG(ERROR) << "Failed to create partition update for "
+                 << partition_names[i];
       return false;
     }
-    partition_updates.push_back(partition_update.value());
+    partition_updates.push_back(BuildPartitionUpdate(
+        partition_names[i], source_devices[i].second, hashes[i].value()));
   }
   *update_list = std::move(partition_updates);
   return true;
@@ -127,21 +191,26 @@ PartitionUpdateGeneratorAndroid::CreatePartitionUpdate(
     const std::string& source_device,
     const std::string& target_device,
     int64_t partition_size) {
+  auto raw_hash =
+      CalculateHashesForPartitions({{source_device, partition_size}})[0];
+  if (!raw_hash.has_value()) {
+    return {};
+  }
+  return BuildPartitionUpdate(partition_name, partition_size, *raw_hash);
+}
+
+PartitionUpdate PartitionUpdateGeneratorAndroid::BuildPartitionUpdate(
+    const std::string& partition_name,
+    int64_t partition_size,
+    const brillo::Blob& raw_hash) {
   PartitionUpdate partition_update;
   partition_update.set_partition_name(partition_name);
   auto old_partition_info = partition_update.mutable_old_partition_info();
   old_partition_info->set_size(partition_size);
-
-  auto raw_hash = CalculateHashForPartition(source_device, partition_size);
-  if (!raw_hash.has_value()) {
-    LOG(ERROR) << "Failed to calculate hash for partition " << source_device
-               << " size: " << partition_size;
-    return {};
-  }
-  old_partition_info->set_hash(raw_hash->data(), raw_hash->size());
+  old_partition_info->set_hash(raw_hash.data(), raw_hash.size());
   auto new_partition_info = partition_update.mutable_new_partition_info();
   new_partition_info->set_size(partition_size);
-  new_partition_info->set_hash(raw_hash->data(), raw_hash->size());
+  new_partition_info->set_hash(raw_hash.data(), raw_hash.size());
 
   auto copy_operation = partition_update.add_operations();
   copy_operation->set_type(InstallOperation::SOURCE_COPY);
@@ -155,23 +224,63 @@ PartitionUpdateGeneratorAndroid::CreatePartitionUpdate(
   return partition_update;
 }
 
-std::optional<brillo::Blob>
-PartitionUpdateGeneratorAndroid::CalculateHashForPartition(
-    const std::string& block_device, int64_t partition_size) {
+std::vector<std::optional<brillo::Blob>>
+PartitionUpdateGeneratorAndroid::CalculateHashesForPartitions(
+    const std::vector<std::pair<std::string, int64_t>>& devices) {
   // TODO(xunchang) compute the hash with ecc partitions first, the hashing
   // behavior should match the one in SOURCE_COPY. Also, we don't have the
   // correct hash for source partition.
   // An alternative way is to verify the written bytes match the read bytes
   // during filesystem verification. This could probably save us a read of
   // partitions here.
-  brillo::Blob raw_hash;
-  if (HashCalculator::RawHashOfFile(block_device, partition_size, &raw_hash) !=
-      partition_size) {
-    LOG(ERROR) << "Failed to calculate hash for " << block_device;
-    return std::nullopt;
+  std::vector<std::optional<brillo::Blob>> hashes(devices.size());
+  std::deque<size_t> waiting;
+  HashCache* cache = GetHashCache();
+  {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    for (size_t i = 0; i < devices.size(); i++) {
+      const auto it = cache->hashes.find(devices[i]);
+      if (it != cache->hashes.end()) {
+        LOG(INFO) << "Reusing the hash of " << devices[i].first;
+        hashes[i] = it->second;
+      } else {
+        waiting.push_back(i);
+      }
+    }
   }
 
-  return raw_hash;
+  std::vector<std::pair<size_t, std::unique_ptr<PartitionHasher>>> running;
+  while (!waiting.empty() || !running.empty()) {
+    while (!waiting.empty() && running.size() < kMaxConcurrentHashes) {
+      const size_t i = waiting.front();
+      waiting.pop_front();
+      auto hasher = StartHashing(devices[i].first, devices[i].second);
+      if (hasher) {
+        running.emplace_back(i, std::move(hasher));
+      }
+    }
+    if (running.empty()) {
+      break;
+    }
+    std::this_thread::sleep_for(kHashPollInterval);
+    for (auto it = running.begin(); it != running.end();) {
+      const auto& [i, hasher] = *it;
+      if (!hasher->done()) {
+        ++it;
+        continue;
+      }
+      if (hasher->succeeded()) {
+        hashes[i] = hasher->hash();
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        cache->hashes.emplace(devices[i], hasher->hash());
+      } else {
+        LOG(ERROR) << "Failed to calculate hash for " << devices[i].first
+                   << " size: " << devices[i].second;
+      }
+      it = running.erase(it);
+    }
+  }
+  return hashes;
 }
 
 namespace partition_update_generator {
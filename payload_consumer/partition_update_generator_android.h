@@ -20,6 +20,7 @@
 #include <optional>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <brillo/secure_blob.h>
@@ -47,6 +48,7 @@ class PartitionUpdateGeneratorAndroid
   friend class PartitionUpdateGeneratorAndroidTest;
   FRIEND_TEST(PartitionUpdateGeneratorAndroidTest, GetStaticPartitions);
   FRIEND_TEST(PartitionUpdateGeneratorAndroidTest, CreatePartitionUpdate);
+  FRIEND_TEST(PartitionUpdateGeneratorAndroidTest, ReusesSourceHashes);
 
   // Creates a PartitionUpdate object for a given partition to update from
   // source to target. Returns std::nullopt on failure.
@@ -56,8 +58,15 @@ class PartitionUpdateGeneratorAndroid
       const std::string& target_device,
       int64_t partition_size);
 
-  std::optional<brillo::Blob> CalculateHashForPartition(
-      const std::string& block_device, int64_t partition_size);
+  PartitionUpdate BuildPartitionUpdate(const std::string& partition_name,
+                                       int64_t partition_size,
+                                       const brillo::Blob& raw_hash);
+
+  // Returns the SHA-256 hashes of the first |size| bytes of each (device,
+  // size) pair of |devices|, std::nullopt for the ones which couldn't be
+  // read. Several devices are hashed in parallel.
+  std::vector<std::optional<brillo::Blob>> CalculateHashesForPartitions(
+      const std::vector<std::pair<std::string, int64_t>>& devices);
 
   BootControlInterface* boot_control_;
   size_t block_size_;
@@ -156,4 +156,23 @@ TEST_F(PartitionUpdateGeneratorAndroidTest, GenerateOperations) {
   CheckPartitionUpdate("system", system_contents, update_list[1]);
 }
 
+TEST_F(PartitionUpdateGeneratorAndroidTest, ReusesSourceHashes) {
+  auto system_contents = std::string(4096 * 2, '1');
+  SetUpBlockDevice({{"system_a", system_contents},
+                    {"system_b", std::string(4096 * 2, 0)}});
+  auto partition_update = generator_->CreatePartitionUpdate(
+      "system", device_map_["system_a"], device_map_["system_b"], 4096 * 2);
+  ASSERT_TRUE(partition_update.has_value());
+
+  // The source slot isn't expected to change, it's not read again.
+  auto modified_contents = std::string(4096 * 2, '2');
+  ASSERT_TRUE(utils::WriteFile(device_map_["system_a"].c_str(),
+                               modified_contents.data(),
+                               modified_contents.size()));
+  partition_update = generator_->CreatePartitionUpdate(
+      "system", device_map_["system_a"], device_map_["system_b"], 4096 * 2);
+  ASSERT_TRUE(partition_update.has_value());
+  CheckPartitionUpdate("system", system_contents, partition_update.value());
+}
+
 }  // namespace chromeos_update_engine
@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <linux/fs.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <inttypes.h>
 
@@ -32,19 +33,142 @@
 #include <android-base/stringprintf.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/io_scheduler.h"
 #include "update_engine/payload_consumer/mount_history.h"
+#include "update_engine/payload_consumer/operation_pipeline.h"
+#include "update_engine/payload_consumer/partition_fd_cache.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
 namespace chromeos_update_engine {
 
 namespace {
-constexpr uint64_t kCacheSize = 1024 * 1024;  // 1MB
+constexpr uint64_t kCacheSize = 1024 * 1024;         // 1MB
+constexpr uint64_t kWriteBackSize = 4 * 1024 * 1024;  // 4MB
+
+// Passes the data written to the destination of an operation on to |writer|
+// while hashing it into |hasher|, adding up its size in |size|.
+class HashingExtentWriter : public ExtentWriter {
+ public:
+  HashingExtentWriter(std::unique_ptr<ExtentWriter> writer,
+                      HashCalculator* hasher,
+                      uint64_t* size)
+      : writer_(std::move(writer)), hasher_(hasher), size_(size) {}
+  ~HashingExtentWriter() override = default;
+
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override {
+    return writer_->Init(extents, block_size);
+  }
+  bool Write(const void* bytes, size_t count) override {
+    TEST_AND_RETURN_FALSE(writer_->Write(bytes, count));
+    *size_ += count;
+    return hasher_->Update(bytes, count);
+  }
+
+ private:
+  std::unique_ptr<ExtentWriter> writer_;
+  HashCalculator* hasher_;
+  uint64_t* size_;
+};
+
+// Whether |a| and |b| refer to the same file or block device.
+bool IsSameFile(const std::string& a, const std::string& b) {
+  struct stat a_stat {};
+  struct stat b_stat {};
+  if (stat(a.c_str(), &a_stat) != 0 || stat(b.c_str(), &b_stat) != 0) {
+    return false;
+  }
+  if (S_ISBLK(a_stat.st_mode) && S_ISBLK(b_stat.st_mode)) {
+    return a_stat.st_rdev == b_stat.st_rdev;
+  }
+  return a_stat.st_dev == b_stat.st_dev && a_stat.st_ino == b_stat.st_ino;
+}
+
+void AppendRange(google::protobuf::RepeatedPtrField<Extent>* extents,
+                 uint64_t start_block,
+                 uint64_t num_blocks) {
+  if (!extents->empty()) {
+    Extent* last = extents->Mutable(extents->size() - 1);
+    if (last->start_block() + last->num_blocks() == start_block) {
+      last->set_num_blocks(last->num_blocks() + num_blocks);
+      return;
+    }
+  }
+  *extents->Add() = ExtentForRange(start_block, num_blocks);
+}
+
+// Copies the SOURCE_COPY |operation| to |trimmed| without the blocks it
+// copies onto themselves, which is only valid when source and target are the
+// same device. Skipping these never changes what the other blocks read, since
+// their content stays the same either way. Returns false if there are no such
+// blocks.
+bool TrimIdentityCopies(const InstallOperation& operation,
+                        InstallOperation* trimmed) {
+  google::protobuf::RepeatedPtrField<Extent> src_extents;
+  google::protobuf::RepeatedPtrField<Extent> dst_extents;
+  bool found_identity = false;
+  int src_index = 0;
+  int dst_index = 0;
+  uint64_t src_offset = 0;
+  uint64_t dst_offset = 0;
+  while (src_index < operation.src_extents_size() &&
+         dst_index < operation.dst_extents_size()) {
+    const Extent& src = operation.src_extents(src_index);
+    const Extent& dst = operation.dst_extents(dst_index);
+    const uint64_t num_blocks = std::min(src.num_blocks() - src_offset,
+                                         dst.num_blocks() - dst_offset);
+    const uint64_t src_block = src.start_block() + src_offset;
+    const uint64_t dst_block = dst.start_block() + dst_offset;
+    if (src_block == dst_block) {
+      found_identity = true;
+    } else {
+      AppendRange(&src_extents, src_block, num_blocks);
+      AppendRange(&dst_extents, dst_block, num_blocks);
+    }
+    src_offset += num_blocks;
+    dst_offset += num_blocks;
+    if (src_offset == src.num_blocks()) {
+      src_index++;
+      src_offset = 0;
+    }
+    if (dst_offset == dst.num_blocks()) {
+      dst_index++;
+      dst_offset = 0;
+    }
+  }
+  // Leave malformed operations to the regular checks.
+  if (!found_identity || src_index != operation.src_extents_size() ||
+      dst_index != operation.dst_extents_size()) {
+    return false;
+  }
+  *trimmed = operation;
+  *trimmed->mutable_src_extents() = std::move(src_extents);
+  *trimmed->mutable_dst_extents() = std::move(dst_extents);
+  return true;
+}
+
+// Whether all of |extents| are in |ranges|.
+bool ContainsExtents(const ExtentRanges& ranges,
+                     const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  for (const Extent& extent : extents) {
+    uint64_t blocks = 0;
+    for (const Extent& overlap : ranges.GetIntersectingExtents(extent)) {
+      blocks += overlap.num_blocks();
+    }
+    if (blocks != extent.num_blocks()) {
+      return false;
+    }
+  }
+  return true;
+}
 
 // Discard the tail of the block device referenced by |fd|, from the offset
 // |data_size| until the end of the block device. Returns whether the data was
@@ -83,25 +207,40 @@ bool DiscardPartitionTail(const FileDescriptorPtr& fd, uint64_t data_size) {
 
 // Opens path for read/write. On success returns an open FileDescriptor
 // and sets *err to 0. On failure, sets *err to errno and returns nullptr.
+// With |write_back|, the writes are cached wherever they go instead of only
+// while they are sequential.
 FileDescriptorPtr OpenFile(const char* path,
                            int mode,
                            bool cache_writes,
+                           bool write_back,
                            int* err) {
   // Try to mark the block device read-only based on the mode. Ignore any
   // failure since this won't work when passing regular files.
   bool read_only = (mode & O_ACCMODE) == O_RDONLY;
   utils::SetBlockDeviceReadOnly(path, read_only);
 
-  FileDescriptorPtr fd(new EintrSafeFileDescriptor());
-  if (cache_writes && !read_only) {
-    fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
-    LOG(INFO) << "Caching writes.";
-  }
-  if (!fd->Open(path, mode, 000)) {
+  // The descriptor stays open for the rest of the update, see
+  // PartitionFdCache.
+  FileDescriptorPtr fd = PartitionFdCache::GetInstance()->Open(path, mode);
+  if (fd == nullptr) {
     *err = errno;
     PLOG(ERROR) << "Unable to open file " << path;
     return nullptr;
   }
+  if (!read_only) {
+    // Throttle below the caches, so the pacing sees the batched writes.
+    fd = std::make_shared<ThrottledFileDescriptor>(fd,
+                                                   IoScheduler::GetInstance());
+  }
+  if (cache_writes && !read_only) {
+    if (write_back) {
+      fd = FileDescriptorPtr(new WriteBackFileDescriptor(fd, kWriteBackSize));
+    } else {
+      fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
+    }
+    LOG(INFO) << "Caching " << (write_back ? "all" : "sequential")
+              << " writes.";
+  }
   *err = 0;
   return fd;
 }
@@ -149,6 +288,9 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   uint32_t source_slot = install_plan->source_slot;
   uint32_t target_slot = install_plan->target_slot;
   TEST_AND_RETURN_FALSE(OpenSourcePartition(source_slot, source_may_exist));
+  if (!source_path_.empty()) {
+    verified_source_fd_.EnablePrefetch(install_plan->source_prefetch_ops);
+  }
 
   // We shouldn't open the source partition in certain cases, e.g. some dynamic
   // partitions in delta payload, partitions included in the full payload for
@@ -157,14 +299,32 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   target_path_ = install_part_.target_path;
   int err{};
 
+  // Interactive updates, and the ones syncing on checkpoints, only make the
+  // writes durable when checkpointing the progress.
+  const bool dsync = !interactive_ && !install_plan->sync_on_checkpoint;
   int flags = O_RDWR;
-  if (!interactive_)
+  if (dsync)
     flags |= O_DSYNC;
 
   LOG(INFO) << "Opening " << target_path_ << " partition with"
-            << (interactive_ ? "out" : "") << " O_DSYNC";
-
-  target_fd_ = OpenFile(target_path_.c_str(), flags, true, &err);
+            << (dsync ? "" : "out") << " O_DSYNC";
+
+  // CachedFileDescriptor keeps a single write-back buffer, so operations can
+  // only run concurrently on the raw fd. Decompress into larger chunks instead
+  // to keep the writes big.
+  concurrent_ops_ = install_plan->apply_threads > 1;
+  if (concurrent_ops_) {
+    install_op_executor_.set_decompress_buffer_size(
+        OperationPipeline::kDecompressBufferSize);
+  }
+  // The source of an in place update is read through another fd, which must
+  // not miss the writes of the previous operations. CachedFileDescriptor writes
+  // them out once the next operation seeks, but WriteBackFileDescriptor could
+  // keep them until the next checkpoint.
+  same_device_ =
+      !source_path_.empty() && IsSameFile(source_path_, target_path_);
+  target_fd_ = OpenFile(
+      target_path_.c_str(), flags, !concurrent_ops_, !same_device_, &err);
   if (!target_fd_) {
     LOG(ERROR) << "Unable to open target partition "
                << partition.partition_name() << " on slot "
@@ -177,23 +337,100 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
             << " operations to partition \"" << partition.partition_name()
             << "\"";
 
+  LOG_IF(INFO, same_device_)
+      << "Source and target are the same, skipping copies in place.";
+
   // Discard the end of the partition, but ignore failures.
   DiscardPartitionTail(target_fd_, install_part_.target_size);
 
+  // Operations applied in place may read the blocks of the ZERO operations
+  // before those run.
+  if (!same_device_) {
+    PrepareZeroRanges(next_op_index);
+  }
+
   return true;
 }
 
+void PartitionWriter::PrepareZeroRanges(size_t next_op_index) {
+  prepared_zero_ranges_ = ExtentRanges();
+#ifdef BLKZEROOUT
+  const auto& operations = partition_update_.operations();
+  ExtentRanges zero_ranges;
+  ExtentRanges discard_ranges;
+  ExtentRanges written;
+  for (int i = 0; i < operations.size(); i++) {
+    const InstallOperation& operation = operations[i];
+    if (operation.type() == InstallOperation::ZERO) {
+      if (static_cast<size_t>(i) >= next_op_index) {
+        zero_ranges.AddRepeatedExtents(operation.dst_extents());
+      }
+    } else if (operation.type() == InstallOperation::DISCARD) {
+      if (static_cast<size_t>(i) >= next_op_index) {
+        discard_ranges.AddRepeatedExtents(operation.dst_extents());
+      }
+    } else {
+      // Whether these blocks end up zero depends on the order of operations.
+      written.AddRepeatedExtents(operation.dst_extents());
+    }
+  }
+  zero_ranges.SubtractRanges(written);
+  // Zeroed blocks are as good as discarded ones.
+  discard_ranges.SubtractRanges(written);
+  discard_ranges.SubtractRanges(zero_ranges);
+
+  uint64_t prepared_blocks = 0;
+  for (const auto& [request, ranges] :
+       {std::make_pair(BLKZEROOUT, &zero_ranges),
+        std::make_pair(BLKDISCARD, &discard_ranges)}) {
+    for (const Extent& extent : ranges->extent_set()) {
+      int result = 0;
+      if (!target_fd_->BlkIoctl(request,
+                                extent.start_block() * block_size_,
+                                extent.num_blocks() * block_size_,
+                                &result) ||
+          result != 0) {
+        // Most likely not a block device, don't bother with the rest.
+        LOG(INFO) << "Can't prepare the zero blocks of "
+                  << partition_update_.partition_name() << " up front.";
+        return;
+      }
+      prepared_zero_ranges_.AddExtent(extent);
+      prepared_blocks += extent.num_blocks();
+    }
+  }
+  if (prepared_blocks > 0) {
+    LOG(INFO) << "Zeroed or discarded " << prepared_blocks << " blocks in "
+              << prepared_zero_ranges_.extent_set().size() << " ranges of "
+              << partition_update_.partition_name() << " up front.";
+  }
+#endif  // defined(BLKZEROOUT)
+}
+
 bool PartitionWriter::PerformReplaceOperation(const InstallOperation& operation,
                                               const void* data,
                                               size_t count) {
   // Setup the ExtentWriter stack based on the operation type.
   std::unique_ptr<ExtentWriter> writer = CreateBaseExtentWriter();
-  return install_op_executor_.ExecuteReplaceOperation(
-      operation, std::move(writer), data);
+  if (applied_operations_ == nullptr) {
+    return install_op_executor_.ExecuteReplaceOperation(
+        operation, std::move(writer), data);
+  }
+  HashCalculator hasher;
+  uint64_t size = 0;
+  TEST_AND_RETURN_FALSE(install_op_executor_.ExecuteReplaceOperation(
+      operation,
+      std::make_unique<HashingExtentWriter>(std::move(writer), &hasher, &size),
+      data));
+  RecordAppliedOperation(operation, &hasher, size);
+  return true;
 }
 
 bool PartitionWriter::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
+  if (ContainsExtents(prepared_zero_ranges_, operation.dst_extents())) {
+    return true;
+  }
 #ifdef BLKZEROOUT
   int request =
       (operation.type() == InstallOperation::ZERO ? BLKZEROOUT : BLKDISCARD);
@@ -203,19 +440,25 @@ bool PartitionWriter::PerformZeroOrDiscardOperation(
                                                             writer.get());
 #endif  // !defined(BLKZEROOUT)
 
-  for (const Extent& extent : operation.dst_extents()) {
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    const Extent& extent = operation.dst_extents(i);
     const uint64_t start = extent.start_block() * block_size_;
     const uint64_t length = extent.num_blocks() * block_size_;
     int result = 0;
     if (target_fd_->BlkIoctl(request, start, length, &result) && result == 0) {
       continue;
     }
-    // In case of failure, we fall back to writing 0 for the entire operation.
+    // In case of failure, we fall back to writing 0s for the extents which
+    // weren't handled yet.
     PLOG(WARNING) << "BlkIoctl failed. Falling back to write 0s for remainder "
                      "of this operation.";
+    InstallOperation remainder;
+    remainder.set_type(operation.type());
+    remainder.mutable_dst_extents()->CopyFrom(operation.dst_extents());
+    remainder.mutable_dst_extents()->DeleteSubrange(0, i);
     auto writer = CreateBaseExtentWriter();
     return install_op_executor_.ExecuteZeroOrDiscardOperation(
-        operation, std::move(writer));
+        remainder, std::move(writer));
   }
   return true;
 }
@@ -227,6 +470,28 @@ bool PartitionWriter::PerformSourceCopyOperation(
   // decide it the operation should be skipped.
   const PartitionUpdate& partition = partition_update_;
 
+  InstallOperation buf;
+  bool should_optimize = dynamic_control_->OptimizeOperation(
+      partition.partition_name(), operation, &buf);
+  // Blocks copied onto themselves when updating in place are already there.
+  if (!should_optimize && same_device_ &&
+      TrimIdentityCopies(operation, &buf)) {
+    if (buf.dst_extents_size() == 0) {
+      return true;
+    }
+    should_optimize = true;
+  }
+  const InstallOperation& optimized = should_optimize ? buf : operation;
+
+  // Copy and hash the source in a single pass in the common case, so every
+  // source block is only read once. On a mismatch the copy is redone from the
+  // fd picked by ChooseSourceFD(), which falls back to error correction.
+  if (!should_optimize && operation.has_src_sha256_hash() &&
+      CopyAndVerifySource(operation)) {
+    RecordAppliedSourceCopy(operation);
+    return true;
+  }
+
   // Invoke ChooseSourceFD with original operation, so that it can properly
   // verify source hashes. Optimized operation might contain a smaller set of
   // extents, or completely empty.
@@ -239,14 +504,14 @@ bool PartitionWriter::PerformSourceCopyOperation(
     return false;
   }
 
-  InstallOperation buf;
-  const bool should_optimize = dynamic_control_->OptimizeOperation(
-      partition.partition_name(), operation, &buf);
-  const InstallOperation& optimized = should_optimize ? buf : operation;
-
+  auto source_lock = verified_source_fd_.LockIfShared(source_fd);
   auto writer = CreateBaseExtentWriter();
-  return install_op_executor_.ExecuteSourceCopyOperation(
-      optimized, std::move(writer), source_fd);
+  TEST_AND_RETURN_FALSE(install_op_executor_.ExecuteSourceCopyOperation(
+      optimized, std::move(writer), source_fd));
+  if (!should_optimize) {
+    RecordAppliedSourceCopy(operation);
+  }
+  return true;
 }
 
 bool PartitionWriter::PerformDiffOperation(const InstallOperation& operation,
@@ -256,9 +521,87 @@ bool PartitionWriter::PerformDiffOperation(const InstallOperation& operation,
   FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
+  auto source_lock = verified_source_fd_.LockIfShared(source_fd);
   auto writer = CreateBaseExtentWriter();
-  return install_op_executor_.ExecuteDiffOperation(
-      operation, std::move(writer), source_fd, data, count);
+  if (applied_operations_ == nullptr) {
+    return install_op_executor_.ExecuteDiffOperation(
+        operation, std::move(writer), source_fd, data, count);
+  }
+  HashCalculator hasher;
+  uint64_t size = 0;
+  TEST_AND_RETURN_FALSE(install_op_executor_.ExecuteDiffOperation(
+      operation,
+      std::make_unique<HashingExtentWriter>(std::move(writer), &hasher, &size),
+      source_fd,
+      data,
+      count));
+  RecordAppliedOperation(operation, &hasher, size);
+  return true;
+}
+
+bool PartitionWriter::IsOperationApplied(const InstallOperation& operation,
+                                         const brillo::Blob& dst_hash) {
+  if (applied_operations_ == nullptr || !target_fd_) {
+    return false;
+  }
+  // Write out what is still cached before reading the destination back.
+  TEST_AND_RETURN_FALSE(target_fd_->Flush());
+  brillo::Blob hash;
+  return fd_utils::ReadAndHashExtents(
+             target_fd_, operation.dst_extents(), block_size_, &hash) &&
+         hash == dst_hash;
+}
+
+void PartitionWriter::RecordAppliedOperation(const InstallOperation& operation,
+                                             HashCalculator* hasher,
+                                             uint64_t size) {
+  // Operations which only wrote part of their destination, e.g. because it
+  // was optimized, can't be verified against their whole destination.
+  if (size != utils::BlocksInExtents(operation.dst_extents()) * block_size_ ||
+      !hasher->Finalize()) {
+    return;
+  }
+  LOG_IF(WARNING,
+         !applied_operations_->Record(
+             partition_update_.partition_name(), operation, hasher->raw_hash()))
+      << "Unable to record applied operation.";
+}
+
+void PartitionWriter::RecordAppliedSourceCopy(
+    const InstallOperation& operation) {
+  // The destination now holds the verified source.
+  if (applied_operations_ == nullptr || !operation.has_src_sha256_hash()) {
+    return;
+  }
+  const brillo::Blob src_hash(operation.src_sha256_hash().begin(),
+                              operation.src_sha256_hash().end());
+  LOG_IF(WARNING,
+         !applied_operations_->Record(
+             partition_update_.partition_name(), operation, src_hash))
+      << "Unable to record applied operation.";
+}
+
+bool PartitionWriter::CopyAndVerifySource(const InstallOperation& operation) {
+  const FileDescriptorPtr& source_fd = verified_source_fd_.source_fd();
+  if (source_fd == nullptr || !source_fd->IsOpen()) {
+    return false;
+  }
+  auto writer = CreateBaseExtentWriter();
+  TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
+  brillo::Blob source_hash;
+  TEST_AND_RETURN_FALSE(fd_utils::CommonHashExtents(source_fd,
+                                                    operation.src_extents(),
+                                                    writer.get(),
+                                                    block_size_,
+                                                    &source_hash));
+  const brillo::Blob expected_source_hash(operation.src_sha256_hash().begin(),
+                                          operation.src_sha256_hash().end());
+  if (source_hash != expected_source_hash) {
+    LOG(WARNING) << "Source hash mismatch while copying extents "
+                 << operation.src_extents() << ", retrying.";
+    return false;
+  }
+  return true;
 }
 
 FileDescriptorPtr PartitionWriter::ChooseSourceFD(
@@ -279,14 +622,21 @@ int PartitionWriter::Close() {
   }
   target_fd_.reset();
   target_path_.clear();
+  same_device_ = false;
+  applied_operations_ = nullptr;
 
   return -err;
 }
 
-void PartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
-  if (target_fd_) {
-    target_fd_->Flush();
+bool PartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
+  // Without O_DSYNC, this is what makes the operations applied so far
+  // durable before they are recorded as done.
+  if (target_fd_ && !target_fd_->Flush()) {
+    LOG(ERROR) << "Failed to flush " << target_path_ << ", not checkpointing "
+               << next_op_index;
+    return false;
   }
+  return true;
 }
 
 std::unique_ptr<ExtentWriter> PartitionWriter::CreateBaseExtentWriter() {
@@ -25,12 +25,15 @@
 #include <gtest/gtest_prod.h>
 
 #include "update_engine/common/dynamic_partition_control_interface.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_consumer/applied_operation_cache.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
 #include "update_engine/payload_consumer/verified_source_fd.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -62,7 +65,7 @@ class PartitionWriter : public PartitionWriterInterface {
   // applied.
   //   |next_op_index| is index of next operation that should be applied.
   // |next_op_index-1| is the last operation that is already applied.
-  void CheckpointUpdateProgress(size_t next_op_index) override;
+  bool CheckpointUpdateProgress(size_t next_op_index) override;
 
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
@@ -90,6 +93,21 @@ class PartitionWriter : public PartitionWriterInterface {
   // the partition writer is expected to be closed soon.
   [[nodiscard]] bool FinishedInstallOps() override { return true; }
 
+  bool SupportsConcurrentOperations() const override { return concurrent_ops_; }
+  bool SourceIsTarget() const override { return same_device_; }
+  bool SupportsPartialOperations() const override { return true; }
+
+  void PrefetchSource(size_t next_op_index) override {
+    verified_source_fd_.PrefetchSourceHashes(partition_update_.operations(),
+                                             next_op_index);
+  }
+
+  void SetAppliedOperationCache(AppliedOperationCache* cache) override {
+    applied_operations_ = cache;
+  }
+  bool IsOperationApplied(const InstallOperation& operation,
+                          const brillo::Blob& dst_hash) override;
+
  private:
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
@@ -99,8 +117,29 @@ class PartitionWriter : public PartitionWriterInterface {
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& op,
                                    ErrorCode* error);
 
+  // Copies the source extents of the SOURCE_COPY |operation| from the raw
+  // source partition while hashing them. Returns false if the source couldn't
+  // be read or its hash doesn't match, the target may be partially written
+  // then.
+  [[nodiscard]] bool CopyAndVerifySource(const InstallOperation& operation);
+
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
 
+  // Zeroes or discards up front the blocks of the ZERO and DISCARD operations
+  // from |next_op_index| on which no other operation writes, one ioctl per
+  // merged range, and records them in |prepared_zero_ranges_|. Failures are
+  // ignored, the operations then handle their blocks themselves.
+  void PrepareZeroRanges(size_t next_op_index);
+
+  // Records in |applied_operations_| that |operation| wrote |size| bytes
+  // hashed by |hasher| to its destination, if that's all of it.
+  void RecordAppliedOperation(const InstallOperation& operation,
+                              HashCalculator* hasher,
+                              uint64_t size);
+  // Records the SOURCE_COPY |operation|, which copied all of its verified
+  // source, in |applied_operations_|.
+  void RecordAppliedSourceCopy(const InstallOperation& operation);
+
   const PartitionUpdate& partition_update_;
   const InstallPlan::Partition& install_part_;
   DynamicPartitionControlInterface* dynamic_control_;
@@ -112,6 +151,16 @@ class PartitionWriter : public PartitionWriterInterface {
   FileDescriptorPtr target_fd_;
   const bool interactive_;
   const size_t block_size_;
+  // Whether the target was opened for operations running on several threads
+  // at once, see InstallPlan::apply_threads.
+  bool concurrent_ops_{false};
+  // Whether source and target are the same file or device, e.g. when a
+  // partition is updated in place.
+  bool same_device_{false};
+  // The blocks PrepareZeroRanges() handled already.
+  ExtentRanges prepared_zero_ranges_;
+  // Where applied operations are recorded, if enabled.
+  AppliedOperationCache* applied_operations_{nullptr};
 
   // This instance handles decompression/bsdfif/puffdiff. It's responsible for
   // constructing data which should be written to target partition, actual
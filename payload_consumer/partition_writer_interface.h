@@ -27,6 +27,8 @@
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
+class AppliedOperationCache;
+
 class PartitionWriterInterface {
  public:
   virtual ~PartitionWriterInterface() = default;
@@ -42,7 +44,9 @@ class PartitionWriterInterface {
   // applied.
   //   |next_op_index| is index of next operation that should be applied.
   // |next_op_index-1| is the last operation that is already applied.
-  virtual void CheckpointUpdateProgress(size_t next_op_index) = 0;
+  // Returns false if the applied operations couldn't be made durable, in which
+  // case the progress must not be recorded.
+  virtual bool CheckpointUpdateProgress(size_t next_op_index) = 0;
 
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
@@ -69,6 +73,42 @@ class PartitionWriterInterface {
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
   [[nodiscard]] virtual bool FinishedInstallOps() = 0;
+
+  // Whether PerformReplaceOperation(), PerformSourceCopyOperation() and
+  // PerformDiffOperation() may be called from several threads at once for
+  // operations with disjoint destination extents. Zero/discard operations and
+  // CheckpointUpdateProgress() are never called with other operations in
+  // flight.
+  virtual bool SupportsConcurrentOperations() const { return false; }
+
+  // Whether the source of the operations is read from the target device, as
+  // in in-place updates. Concurrent operations then also conflict when one
+  // reads the blocks another one writes.
+  virtual bool SourceIsTarget() const { return false; }
+
+  // Whether a REPLACE operation may be applied as several REPLACE operations
+  // of consecutive parts of its destination, with CheckpointUpdateProgress()
+  // called in between for the operation being applied. Writers whose
+  // checkpoints only mark the boundaries of operations can't resume from a
+  // part of one.
+  virtual bool SupportsPartialOperations() const { return false; }
+
+  // Hints that the operations of the partition from |next_op_index| on are
+  // applied soon, so their source data can be read and verified ahead of time.
+  virtual void PrefetchSource(size_t next_op_index) {}
+
+  // Records the operations applied from now on in |cache|, so that a later
+  // attempt can skip them if the target still holds their data. Writers
+  // whose target doesn't outlive the attempt ignore it.
+  virtual void SetAppliedOperationCache(AppliedOperationCache* cache) {}
+
+  // Whether the destination of |operation| already holds data hashing to
+  // |dst_hash|, as recorded in the cache by a previous attempt. Never called
+  // with other operations in flight.
+  virtual bool IsOperationApplied(const InstallOperation& operation,
+                                  const brillo::Blob& dst_hash) {
+    return false;
+  }
 };
 }  // namespace chromeos_update_engine
 
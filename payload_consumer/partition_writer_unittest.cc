@@ -14,7 +14,11 @@
 // limitations under the License.
 //
 
+#include <linux/fs.h>
+
+#include <algorithm>
 #include <memory>
+#include <tuple>
 #include <vector>
 
 #include <brillo/secure_blob.h>
@@ -28,8 +32,10 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/fake_file_descriptor.h"
+#include "update_engine/payload_consumer/fake_storage_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/partition_fd_cache.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/annotated_operation.h"
@@ -40,6 +46,33 @@
 
 namespace chromeos_update_engine {
 
+namespace {
+using BlkIoctlRequest = std::tuple<int, uint64_t, uint64_t>;
+
+// Records the BlkIoctl() requests and pretends they succeed without touching
+// the blocks, so any zeroes in them were written.
+class FakeBlkIoctlFileDescriptor : public FakeStorageFileDescriptor {
+ public:
+  FakeBlkIoctlFileDescriptor(FileDescriptorPtr fd,
+                             FakeStorage* storage,
+                             std::vector<BlkIoctlRequest>* requests)
+      : FakeStorageFileDescriptor(std::move(fd), storage),
+        requests_(requests) {}
+
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    requests_->emplace_back(request, start, length);
+    *result = 0;
+    return true;
+  }
+
+ private:
+  std::vector<BlkIoctlRequest>* requests_;
+};
+}  // namespace
+
 class PartitionWriterTest : public testing::Test {
  public:
   // Helper function to pretend that the ECC file descriptor was already opened.
@@ -107,7 +140,7 @@ class PartitionWriterTest : public testing::Test {
       return {};
     }
     EXPECT_TRUE(writer_.PerformSourceCopyOperation(op, &error));
-    writer_.CheckpointUpdateProgress(1);
+    EXPECT_TRUE(writer_.CheckpointUpdateProgress(1));
 
     brillo::Blob output_data;
     EXPECT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
@@ -181,6 +214,172 @@ TEST_F(PartitionWriterTest, ErrorCorrectionSourceCopyFallbackTest) {
   EXPECT_EQ(1U, GetSourceEccRecoveredFailures());
 }
 
+// Test that a source matching the operation hash is copied without reading
+// the error-corrected device.
+TEST_F(PartitionWriterTest, SourceCopySinglePassTest) {
+  constexpr size_t kCopyOperationSize = 4 * 4096;
+  FakeFileDescriptor* fake_fec = SetFakeECCFile(kCopyOperationSize);
+  brillo::Blob expected_data = FakeFileDescriptorData(kCopyOperationSize);
+
+  auto source_copy_op = GenerateSourceCopyOp(expected_data, true);
+  ASSERT_NO_FATAL_FAILURE();
+  auto output_data = PerformSourceCopyOp(source_copy_op.op, expected_data);
+  ASSERT_NO_FATAL_FAILURE();
+  ASSERT_EQ(output_data, expected_data);
+
+  EXPECT_EQ(0U, fake_fec->GetReadOps().size());
+  EXPECT_EQ(0U, GetSourceEccRecoveredFailures());
+}
+
+// Without O_DSYNC, the copy reaches the target once checkpointed.
+TEST_F(PartitionWriterTest, SyncOnCheckpointSourceCopyTest) {
+  install_plan_.sync_on_checkpoint = true;
+  constexpr size_t kCopyOperationSize = 4 * 4096;
+  brillo::Blob expected_data = FakeFileDescriptorData(kCopyOperationSize);
+
+  auto source_copy_op = GenerateSourceCopyOp(expected_data, true);
+  ASSERT_NO_FATAL_FAILURE();
+  auto output_data = PerformSourceCopyOp(source_copy_op.op, expected_data);
+  ASSERT_NO_FATAL_FAILURE();
+  ASSERT_EQ(output_data, expected_data);
+}
+
+TEST_F(PartitionWriterTest, InPlaceSourceCopySkipsIdentityBlocksTest) {
+  constexpr size_t kNumBlocks = 8;
+  const brillo::Blob data = FakeFileDescriptorData(kNumBlocks * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(target_partition.path(), data));
+  InstallPlan::Partition install_part;
+  install_part.source_path = target_partition.path();
+  install_part.source_size = data.size();
+  install_part.target_path = target_partition.path();
+  install_part.target_size = data.size();
+  PartitionWriter writer{
+      partition_update_, install_part, &dynamic_control_, kBlockSize, false};
+  ASSERT_TRUE(writer.Init(&install_plan_, true, 0));
+
+  // Blocks 0 and 1 stay where they are, blocks 5 and 6 move to 3 and 4.
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_COPY);
+  *op.add_src_extents() = ExtentForRange(0, 2);
+  *op.add_src_extents() = ExtentForRange(5, 2);
+  *op.add_dst_extents() = ExtentForRange(0, 2);
+  *op.add_dst_extents() = ExtentForRange(3, 2);
+  ErrorCode error = ErrorCode::kSuccess;
+  ASSERT_TRUE(writer.PerformSourceCopyOperation(op, &error));
+
+  // Copies entirely in place aren't even read, so their hash isn't checked.
+  InstallOperation identity_op;
+  identity_op.set_type(InstallOperation::SOURCE_COPY);
+  *identity_op.add_src_extents() = ExtentForRange(6, 2);
+  *identity_op.add_dst_extents() = ExtentForRange(6, 2);
+  identity_op.set_src_sha256_hash("invalid");
+  ASSERT_TRUE(writer.PerformSourceCopyOperation(identity_op, &error));
+  ASSERT_TRUE(writer.CheckpointUpdateProgress(2));
+
+  brillo::Blob expected_data = data;
+  std::copy(data.begin() + 5 * kBlockSize,
+            data.begin() + 7 * kBlockSize,
+            expected_data.begin() + 3 * kBlockSize);
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  ASSERT_EQ(expected_data, output_data);
+}
+
+// Concurrent operations only conflict on their source blocks when the source is
+// read from the target.
+TEST_F(PartitionWriterTest, SourceIsTargetTest) {
+  install_plan_.apply_threads = 2;
+  install_part_.source_size = kBlockSize;
+  install_part_.target_size = kBlockSize;
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+  EXPECT_FALSE(writer_.SourceIsTarget());
+
+  InstallPlan::Partition install_part;
+  install_part.source_path = target_partition.path();
+  install_part.source_size = kBlockSize;
+  install_part.target_path = target_partition.path();
+  install_part.target_size = kBlockSize;
+  PartitionWriter writer{
+      partition_update_, install_part, &dynamic_control_, kBlockSize, false};
+  ASSERT_TRUE(writer.Init(&install_plan_, true, 0));
+  EXPECT_TRUE(writer.SourceIsTarget());
+}
+
+// The blocks of ZERO and DISCARD operations no other operation writes are
+// handled up front, one request per range, and the operations then skip them.
+TEST_F(PartitionWriterTest, PreparedZeroRangesSkipWriteTest) {
+  const brillo::Blob data = FakeFileDescriptorData(4 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(target_partition.path(), data));
+  install_part_.target_size = data.size();
+  InstallOperation* op = partition_update_.add_operations();
+  op->set_type(InstallOperation::REPLACE);
+  *op->add_dst_extents() = ExtentForRange(3, 1);
+  op = partition_update_.add_operations();
+  op->set_type(InstallOperation::ZERO);
+  *op->add_dst_extents() = ExtentForRange(0, 2);
+  op = partition_update_.add_operations();
+  op->set_type(InstallOperation::DISCARD);
+  *op->add_dst_extents() = ExtentForRange(2, 2);
+
+  FakeStorage storage{StorageModel()};
+  std::vector<BlkIoctlRequest> requests;
+  PartitionFdCache::GetInstance()->SetWrapper(
+      [&storage, &requests](FileDescriptorPtr fd) -> FileDescriptorPtr {
+        return std::make_shared<FakeBlkIoctlFileDescriptor>(
+            std::move(fd), &storage, &requests);
+      });
+  DEFER {
+    PartitionFdCache::GetInstance()->Clear();
+    PartitionFdCache::GetInstance()->SetWrapper(nullptr);
+  };
+  ASSERT_TRUE(writer_.Init(&install_plan_, false, 0));
+  // Block 3 is written by the REPLACE operation.
+  EXPECT_EQ((std::vector<BlkIoctlRequest>{
+                {BLKZEROOUT, 0, 2 * kBlockSize},
+                {BLKDISCARD, 2 * kBlockSize, kBlockSize}}),
+            requests);
+  requests.clear();
+
+  ASSERT_TRUE(
+      writer_.PerformZeroOrDiscardOperation(partition_update_.operations(1)));
+  EXPECT_TRUE(requests.empty());
+  // The DISCARD operation isn't entirely prepared, so it handles all of its
+  // blocks itself.
+  ASSERT_TRUE(
+      writer_.PerformZeroOrDiscardOperation(partition_update_.operations(2)));
+  EXPECT_EQ((std::vector<BlkIoctlRequest>{
+                {BLKDISCARD, 2 * kBlockSize, 2 * kBlockSize}}),
+            requests);
+  ASSERT_TRUE(writer_.CheckpointUpdateProgress(3));
+
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  ASSERT_EQ(data, output_data);
+}
+
+// Without a block device to prepare the zero ranges on, the operations fall
+// back to writing zeroes.
+TEST_F(PartitionWriterTest, UnpreparedZeroRangesWriteZerosTest) {
+  const brillo::Blob data = FakeFileDescriptorData(4 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(target_partition.path(), data));
+  install_part_.target_size = data.size();
+  InstallOperation* op = partition_update_.add_operations();
+  op->set_type(InstallOperation::ZERO);
+  *op->add_dst_extents() = ExtentForRange(1, 2);
+  ASSERT_TRUE(writer_.Init(&install_plan_, false, 0));
+
+  ASSERT_TRUE(writer_.PerformZeroOrDiscardOperation(*op));
+  ASSERT_TRUE(writer_.CheckpointUpdateProgress(1));
+
+  brillo::Blob expected_data = data;
+  std::fill(expected_data.begin() + kBlockSize,
+            expected_data.begin() + 3 * kBlockSize,
+            0);
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  ASSERT_EQ(expected_data, output_data);
+}
+
 TEST_F(PartitionWriterTest, ChooseSourceFDTest) {
   constexpr size_t kSourceSize = 4 * 4096;
   ScopedTempFile source("Source-XXXXXX");
@@ -65,6 +65,34 @@ extern const uint32_t kZucchiniMinorPayloadVersion;
 // THe minor version that allows LZ4DIFF operation
 constexpr uint32_t kLZ4DIFFMinorPayloadVersion = 9;
 
+// The minor version that allows packed extents in the operations.
+constexpr uint32_t kPackedExtentsMinorPayloadVersion = 10;
+
+// The minor version that allows REPLACE_ZSTD operation.
+constexpr uint32_t kZstdMinorPayloadVersion = 11;
+
+// The minor version that allows a PayloadIndex after the data blobs.
+constexpr uint32_t kPayloadIndexMinorPayloadVersion = 12;
+
+// The minor version that allows the operations of a partition apart from the
+// manifest, before its data blobs.
+constexpr uint32_t kSplitManifestMinorPayloadVersion = 13;
+
+// The minor version that allows operations to share a data blob, i.e. data
+// offsets before the end of the blobs of the previous operations.
+constexpr uint32_t kDedupBlobsMinorPayloadVersion = 14;
+
+// The minor version that allows PARTITION_COPY operation.
+constexpr uint32_t kPartitionCopyMinorPayloadVersion = 15;
+
+// The most the data blobs used by several operations may add up to, as the
+// client keeps them around until their last use.
+constexpr uint64_t kMaxReusedBlobsSize = 16 * 1024 * 1024;  // 16 MiB
+
+// The most a PARTITION_COPY operation may copy, as the client reads its source
+// data in memory.
+constexpr uint64_t kMaxPartitionCopySize = 4 * 1024 * 1024;  // 4 MiB
+
 // The minimum and maximum supported minor version.
 extern const uint32_t kMinSupportedMinorPayloadVersion;
 extern const uint32_t kMaxSupportedMinorPayloadVersion;
@@ -0,0 +1,512 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Benchmarks of the hot paths of applying a payload. Run with
+// --benchmark_filter=<regex> to pick some of them.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+#include <fec/io.h>
+#include <libsnapshot/cow_writer.h>
+#include <verity/hash_tree_builder.h>
+#include <zstd.h>
+
+#include "update_engine/common/cow_operation_convert.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/lz4diff/lz4diff.h"
+#include "update_engine/lz4diff/lz4diff_compress.h"
+#include "update_engine/lz4diff/lz4patch.h"
+#include "update_engine/payload_consumer/cached_file_descriptor.h"
+#include "update_engine/payload_consumer/extent_map.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/fake_storage_file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/verity_writer_android.h"
+#include "update_engine/payload_consumer/xor_extent_writer.h"
+#include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/payload_generator/xz.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kMiB = 1024 * 1024;
+
+// Returns |size| bytes of partition-like data: runs of blocks of text, which
+// compress well, between runs of random blocks, which don't.
+brillo::Blob MakeImageData(size_t size, uint32_t seed) {
+  std::mt19937 random(seed);
+  brillo::Blob data;
+  data.reserve(size);
+  size_t line = 0;
+  while (data.size() < size) {
+    const bool text = random() % 3 != 0;
+    const size_t run_end =
+        std::min(size, data.size() + (1 + random() % 16) * kBlockSize);
+    while (data.size() < run_end) {
+      if (text) {
+        const auto str = android::base::StringPrintf(
+            "line %zu of block %zu\n", line++, data.size() / kBlockSize);
+        data.insert(data.end(), str.begin(), str.end());
+      } else {
+        data.push_back(random() & 0xFF);
+      }
+    }
+    data.resize(run_end);
+  }
+  return data;
+}
+
+// Returns |source| with about one block out of |one_in| changed.
+brillo::Blob MakeTargetData(const brillo::Blob& source,
+                            size_t one_in,
+                            uint32_t seed) {
+  std::mt19937 random(seed);
+  brillo::Blob target = source;
+  for (size_t block = 0; block < target.size() / kBlockSize; block++) {
+    if (random() % one_in != 0) {
+      continue;
+    }
+    for (size_t i = 0; i < 64; i++) {
+      target[block * kBlockSize + random() % kBlockSize] = random() & 0xFF;
+    }
+  }
+  return target;
+}
+
+// A temporary partition image of |size| bytes, opened read-write.
+class TempImage {
+ public:
+  explicit TempImage(size_t size) : file_("bench_image.XXXXXX", true, size) {
+    fd_ = std::make_shared<EintrSafeFileDescriptor>();
+    CHECK(fd_->Open(file_.path().c_str(), O_RDWR));
+  }
+  explicit TempImage(const brillo::Blob& data) : TempImage(data.size()) {
+    CHECK(utils::WriteAll(fd_, data.data(), data.size()));
+  }
+
+  const FileDescriptorPtr& fd() const { return fd_; }
+
+ private:
+  ScopedTempFile file_;
+  FileDescriptorPtr fd_;
+};
+
+// Sets the dst extents of |op| to |num_blocks| blocks split in extents of
+// |extent_blocks| blocks, in a random order when |shuffle|.
+void SetDstExtents(InstallOperation* op,
+                   size_t num_blocks,
+                   size_t extent_blocks,
+                   bool shuffle) {
+  std::vector<Extent> extents;
+  for (size_t block = 0; block < num_blocks; block += extent_blocks) {
+    extents.push_back(
+        ExtentForRange(block, std::min(extent_blocks, num_blocks - block)));
+  }
+  if (shuffle) {
+    std::shuffle(extents.begin(), extents.end(), std::mt19937(42));
+  }
+  op->clear_dst_extents();
+  for (const auto& extent : extents) {
+    *op->add_dst_extents() = extent;
+  }
+}
+
+}  // namespace
+
+// REPLACE, REPLACE_BZ, REPLACE_XZ and REPLACE_ZSTD operations of 8 MiB.
+static void BM_ExecuteReplaceOperation(benchmark::State& state) {
+  const auto type = static_cast<InstallOperation::Type>(state.range(0));
+  const brillo::Blob data = MakeImageData(8 * kMiB, 1);
+  brillo::Blob blob;
+  switch (type) {
+    case InstallOperation::REPLACE_BZ:
+      CHECK(BzipCompress(data, &blob));
+      break;
+    case InstallOperation::REPLACE_XZ:
+      XzCompressInit();
+      CHECK(XzCompress(data, &blob));
+      break;
+    case InstallOperation::REPLACE_ZSTD:
+      blob.resize(ZSTD_compressBound(data.size()));
+      blob.resize(ZSTD_compress(
+          blob.data(), blob.size(), data.data(), data.size(), 19));
+      break;
+    default:
+      blob = data;
+      break;
+  }
+  InstallOperation op;
+  op.set_type(type);
+  op.set_data_length(blob.size());
+  SetDstExtents(&op, data.size() / kBlockSize, 256, false);
+  TempImage target(data.size());
+  InstallOperationExecutor executor(kBlockSize);
+  for (auto _ : state) {
+    CHECK(executor.ExecuteReplaceOperation(
+        op, std::make_unique<DirectExtentWriter>(target.fd()), blob.data()));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+  state.SetLabel(InstallOperationTypeName(type));
+}
+BENCHMARK(BM_ExecuteReplaceOperation)
+    ->Arg(InstallOperation::REPLACE)
+    ->Arg(InstallOperation::REPLACE_BZ)
+    ->Arg(InstallOperation::REPLACE_XZ)
+    ->Arg(InstallOperation::REPLACE_ZSTD)
+    ->Unit(benchmark::kMillisecond);
+
+// A ZERO operation of 64 MiB.
+static void BM_ExecuteZeroOperation(benchmark::State& state) {
+  constexpr size_t kSize = 64 * kMiB;
+  InstallOperation op;
+  op.set_type(InstallOperation::ZERO);
+  SetDstExtents(&op, kSize / kBlockSize, kSize / kBlockSize, false);
+  TempImage target(kSize);
+  InstallOperationExecutor executor(kBlockSize);
+  for (auto _ : state) {
+    CHECK(executor.ExecuteZeroOrDiscardOperation(
+        op, std::make_unique<DirectExtentWriter>(target.fd())));
+  }
+  state.SetBytesProcessed(state.iterations() * kSize);
+}
+BENCHMARK(BM_ExecuteZeroOperation)->Unit(benchmark::kMillisecond);
+
+// A SOURCE_COPY operation of 8 MiB moving extents of 16 blocks around.
+static void BM_ExecuteSourceCopyOperation(benchmark::State& state) {
+  const brillo::Blob data = MakeImageData(8 * kMiB, 2);
+  const size_t num_blocks = data.size() / kBlockSize;
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_COPY);
+  *op.add_src_extents() = ExtentForRange(0, num_blocks);
+  SetDstExtents(&op, num_blocks, 16, true);
+  TempImage source(data);
+  TempImage target(data.size());
+  InstallOperationExecutor executor(kBlockSize);
+  for (auto _ : state) {
+    CHECK(executor.ExecuteSourceCopyOperation(
+        op, std::make_unique<DirectExtentWriter>(target.fd()), source.fd()));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ExecuteSourceCopyOperation)->Unit(benchmark::kMillisecond);
+
+// SOURCE_BSDIFF and BROTLI_BSDIFF operations of 4 MiB with one block out of
+// eight changed.
+static void BM_ExecuteDiffOperation(benchmark::State& state) {
+  const auto type = static_cast<InstallOperation::Type>(state.range(0));
+  const brillo::Blob source_data = MakeImageData(4 * kMiB, 3);
+  const brillo::Blob target_data = MakeTargetData(source_data, 8, 4);
+  const size_t num_blocks = source_data.size() / kBlockSize;
+  const std::vector<Extent> extents{ExtentForRange(0, num_blocks)};
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kMaxSupportedMinorPayloadVersion)};
+  const FilesystemInterface::File empty;
+  diff_utils::BestDiffGenerator generator(
+      source_data, target_data, extents, extents, empty, empty, config);
+  AnnotatedOperation aop;
+  brillo::Blob patch;
+  CHECK(generator.GenerateBestDiffOperation(
+      {{type, std::numeric_limits<size_t>::max()}}, &aop, &patch));
+  CHECK_EQ(type, aop.op.type());
+
+  InstallOperation op;
+  op.set_type(type);
+  *op.add_src_extents() = extents[0];
+  *op.add_dst_extents() = extents[0];
+  op.set_data_length(patch.size());
+  TempImage source(source_data);
+  TempImage target(target_data.size());
+  InstallOperationExecutor executor(kBlockSize);
+  for (auto _ : state) {
+    CHECK(executor.ExecuteDiffOperation(
+        op,
+        std::make_unique<DirectExtentWriter>(target.fd()),
+        source.fd(),
+        patch.data(),
+        patch.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * target_data.size());
+  state.SetLabel(InstallOperationTypeName(type));
+}
+BENCHMARK(BM_ExecuteDiffOperation)
+    ->Arg(InstallOperation::SOURCE_BSDIFF)
+    ->Arg(InstallOperation::BROTLI_BSDIFF)
+    ->Unit(benchmark::kMillisecond);
+
+// Writes 16 MiB through a DirectExtentWriter into extents of range(0) blocks
+// in a random order, straight to the file or through a CachedFileDescriptor
+// when range(1) is set.
+static void BM_ExtentWriter(benchmark::State& state) {
+  const size_t extent_blocks = state.range(0);
+  const bool cached = state.range(1);
+  const brillo::Blob data = MakeImageData(16 * kMiB, 5);
+  InstallOperation op;
+  SetDstExtents(&op, data.size() / kBlockSize, extent_blocks, true);
+  TempImage target(data.size());
+  FileDescriptorPtr fd = target.fd();
+  if (cached) {
+    fd = std::make_shared<CachedFileDescriptor>(fd, kMiB);
+  }
+  for (auto _ : state) {
+    DirectExtentWriter writer(fd);
+    CHECK(writer.Init(op.dst_extents(), kBlockSize));
+    // Written in chunks of 256 KiB, as payload data is received.
+    for (size_t offset = 0; offset < data.size(); offset += 256 * 1024) {
+      CHECK(writer.Write(data.data() + offset,
+                         std::min<size_t>(256 * 1024, data.size() - offset)));
+    }
+    CHECK(fd->Flush());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ExtentWriter)
+    ->ArgsProduct({{1, 16, 256, 4096}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+// Same as BM_ExtentWriter on emulated flash storage, reporting the time the
+// device would take per iteration as "device_ms" and the requests it got as
+// "requests". The device time is simulated, so it only depends on the
+// requests issued and is the same on any host.
+static void BM_ExtentWriterFakeStorage(benchmark::State& state) {
+  const size_t extent_blocks = state.range(0);
+  const bool cached = state.range(1);
+  const brillo::Blob data = MakeImageData(16 * kMiB, 5);
+  InstallOperation op;
+  SetDstExtents(&op, data.size() / kBlockSize, extent_blocks, true);
+  TempImage target(data.size());
+  // Roughly an eMMC device.
+  StorageModel model;
+  model.latency = base::TimeDelta::FromMicroseconds(150);
+  model.bandwidth = 200 * kMiB;
+  model.queue_depth = 4;
+  model.flush_latency = base::TimeDelta::FromMilliseconds(5);
+  model.alignment = kBlockSize;
+  model.unaligned_penalty = base::TimeDelta::FromMicroseconds(300);
+  FakeStorage storage(model);
+  FileDescriptorPtr fd =
+      std::make_shared<FakeStorageFileDescriptor>(target.fd(), &storage);
+  if (cached) {
+    fd = std::make_shared<CachedFileDescriptor>(fd, kMiB);
+  }
+  for (auto _ : state) {
+    DirectExtentWriter writer(fd);
+    CHECK(writer.Init(op.dst_extents(), kBlockSize));
+    for (size_t offset = 0; offset < data.size(); offset += 256 * 1024) {
+      CHECK(writer.Write(data.data() + offset,
+                         std::min<size_t>(256 * 1024, data.size() - offset)));
+    }
+    CHECK(fd->Flush());
+  }
+  const FakeStorage::Stats stats = storage.stats();
+  state.counters["device_ms"] = benchmark::Counter(
+      stats.elapsed.InMillisecondsF(), benchmark::Counter::kAvgIterations);
+  state.counters["requests"] = benchmark::Counter(
+      stats.reads + stats.writes, benchmark::Counter::kAvgIterations);
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ExtentWriterFakeStorage)
+    ->ArgsProduct({{1, 16, 256, 4096}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+// SHA-256 of 64 MiB passed in buffers of range(0) bytes.
+static void BM_HashCalculator(benchmark::State& state) {
+  const size_t buffer_size = state.range(0);
+  constexpr size_t kSize = 64 * kMiB;
+  const brillo::Blob data = MakeImageData(buffer_size, 6);
+  for (auto _ : state) {
+    HashCalculator hasher;
+    for (size_t offset = 0; offset < kSize; offset += buffer_size) {
+      CHECK(hasher.Update(data.data(), data.size()));
+    }
+    CHECK(hasher.Finalize());
+    benchmark::DoNotOptimize(hasher.raw_hash());
+  }
+  state.SetBytesProcessed(state.iterations() * kSize);
+}
+BENCHMARK(BM_HashCalculator)
+    ->Arg(kBlockSize)
+    ->Arg(64 * 1024)
+    ->Arg(kMiB)
+    ->Unit(benchmark::kMillisecond);
+
+// Writes 8 MiB of XOR blocks through an XORExtentWriter into a COW estimator,
+// with the source blocks shifted by half a block.
+static void BM_XorExtentWriter(benchmark::State& state) {
+  const brillo::Blob source_data = MakeImageData(8 * kMiB + kBlockSize, 7);
+  const brillo::Blob target_data = MakeTargetData(
+      brillo::Blob(source_data.begin(), source_data.end() - kBlockSize), 4, 8);
+  const size_t num_blocks = target_data.size() / kBlockSize;
+  TempImage source(source_data);
+
+  CowMergeOperation merge_op;
+  merge_op.set_type(CowMergeOperation::COW_XOR);
+  *merge_op.mutable_src_extent() = ExtentForRange(0, num_blocks);
+  *merge_op.mutable_dst_extent() = ExtentForRange(0, num_blocks);
+  merge_op.set_src_offset(kBlockSize / 2);
+  ExtentMap<const CowMergeOperation*> xor_map;
+  CHECK(xor_map.AddExtent(merge_op.dst_extent(), &merge_op));
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_BSDIFF);
+  *op.add_src_extents() = ExtentForRange(0, num_blocks + 1);
+  *op.add_dst_extents() = ExtentForRange(0, num_blocks);
+
+  android::snapshot::CowOptions options{
+      .block_size = static_cast<uint32_t>(kBlockSize),
+      .compression = "lz4",
+      .max_blocks = num_blocks};
+  for (auto _ : state) {
+    auto cow_writer = android::snapshot::CreateCowEstimator(2, options);
+    CHECK(cow_writer != nullptr);
+    XORExtentWriter writer(
+        op, source.fd(), cow_writer.get(), xor_map, source_data.size());
+    CHECK(writer.Init(op.dst_extents(), kBlockSize));
+    CHECK(writer.Write(target_data.data(), target_data.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * target_data.size());
+}
+BENCHMARK(BM_XorExtentWriter)->Unit(benchmark::kMillisecond);
+
+// Converts range(0) SOURCE_COPY operations of 64 blocks each, moved by half
+// an operation, to COW operations. Every other operation has a quarter of its
+// blocks in a COW_COPY merge operation.
+static void BM_ConvertToCowOperations(benchmark::State& state) {
+  const int num_ops = state.range(0);
+  google::protobuf::RepeatedPtrField<InstallOperation> operations;
+  google::protobuf::RepeatedPtrField<CowMergeOperation> merge_operations;
+  for (int i = 0; i < num_ops; i++) {
+    InstallOperation* op = operations.Add();
+    op->set_type(InstallOperation::SOURCE_COPY);
+    *op->add_src_extents() = ExtentForRange(i * 64, 64);
+    *op->add_dst_extents() = ExtentForRange(i * 64 + 32, 64);
+    if (i % 2 == 1) {
+      CowMergeOperation* merge_op = merge_operations.Add();
+      merge_op->set_type(CowMergeOperation::COW_COPY);
+      *merge_op->mutable_src_extent() = ExtentForRange(i * 64, 16);
+      *merge_op->mutable_dst_extent() = ExtentForRange(i * 64 + 32, 16);
+    }
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        ConvertToCowOperations(operations, merge_operations));
+  }
+  state.SetItemsProcessed(state.iterations() * num_ops);
+}
+BENCHMARK(BM_ConvertToCowOperations)
+    ->Arg(1000)
+    ->Arg(100000)
+    ->Unit(benchmark::kMillisecond);
+
+// Applies an LZ4DIFF patch between two 4 MiB LZ4 compressed files with one
+// block out of eight changed.
+static void BM_Lz4Patch(benchmark::State& state) {
+  constexpr size_t kNumBlocks = 1024;
+  std::string source_data;
+  for (size_t i = 0; source_data.size() < kNumBlocks * kBlockSize; i++) {
+    source_data += android::base::StringPrintf("line %zu\n", i);
+  }
+  source_data.resize(kNumBlocks * kBlockSize);
+  std::string target_data = source_data;
+  for (size_t block = 0; block < kNumBlocks; block += 8) {
+    target_data.replace(block * kBlockSize, 12, "changed line");
+  }
+  CompressedFile file_info;
+  file_info.algo.set_type(CompressionAlgorithm::LZ4);
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    file_info.blocks.emplace_back(i * kBlockSize, 3000, kBlockSize);
+  }
+  const Blob source =
+      TryCompressBlob(source_data, file_info.blocks, false, file_info.algo);
+  const Blob target =
+      TryCompressBlob(target_data, file_info.blocks, false, file_info.algo);
+  Blob patch;
+  CHECK(Lz4Diff(source, target, file_info, file_info, &patch));
+  Blob output;
+  for (auto _ : state) {
+    output.clear();
+    CHECK(Lz4Patch(source, patch, &output));
+  }
+  CHECK(output == target);
+  state.SetBytesProcessed(state.iterations() * target_data.size());
+}
+BENCHMARK(BM_Lz4Patch)->Unit(benchmark::kMillisecond);
+
+// Builds the SHA-256 hash tree of 32 MiB of data, and its FEC with 2 roots
+// when range(0) is set.
+static void BM_VerityWriterAndroid(benchmark::State& state) {
+  const bool fec = state.range(0);
+  const brillo::Blob data = MakeImageData(32 * kMiB, 9);
+  InstallPlan::Partition partition;
+  partition.block_size = kBlockSize;
+  partition.hash_tree_algorithm = "sha256";
+  partition.hash_tree_data_offset = 0;
+  partition.hash_tree_data_size = data.size();
+  partition.hash_tree_offset = data.size();
+  partition.hash_tree_size =
+      HashTreeBuilder(kBlockSize, HashTreeBuilder::HashFunction("sha256"))
+          .CalculateSize(data.size());
+  uint64_t image_size = partition.hash_tree_offset + partition.hash_tree_size;
+  if (fec) {
+    partition.fec_roots = 2;
+    partition.fec_data_offset = 0;
+    partition.fec_data_size = image_size;
+    partition.fec_offset = image_size;
+    partition.fec_size = fec_ecc_get_size(image_size, partition.fec_roots);
+    image_size += partition.fec_size;
+  }
+  TempImage image(image_size);
+  CHECK(utils::WriteAll(image.fd(), data.data(), data.size()));
+  for (auto _ : state) {
+    VerityWriterAndroid writer;
+    CHECK(writer.Init(partition));
+    for (size_t offset = 0; offset < data.size(); offset += kMiB) {
+      CHECK(writer.Update(offset, data.data() + offset, kMiB));
+    }
+    CHECK(writer.Finalize(image.fd().get(), image.fd().get()));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_VerityWriterAndroid)
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
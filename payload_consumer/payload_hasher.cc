@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_hasher.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+PayloadHasher::PayloadHasher()
+    : worker_(&PayloadHasher::WorkerLoop, this) {}
+
+PayloadHasher::~PayloadHasher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_one();
+  worker_.join();
+}
+
+void PayloadHasher::Update(const void* data, size_t size, size_t signed_size) {
+  if (size == 0) {
+    return;
+  }
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  Enqueue({std::make_shared<const brillo::Blob>(bytes, bytes + size),
+           signed_size});
+}
+
+void PayloadHasher::Update(std::shared_ptr<const brillo::Blob> data,
+                           size_t signed_size) {
+  if (!data || data->empty()) {
+    return;
+  }
+  Enqueue({std::move(data), signed_size});
+}
+
+void PayloadHasher::Enqueue(Job job) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Keeps the memory held by the queue bounded if hashing can't keep up.
+  done_cv_.wait(lock, [this] {
+    return queue_.empty() || queued_bytes_ < kMaxQueuedBytes;
+  });
+  queued_bytes_ += job.data->size();
+  queue_.push_back(std::move(job));
+  work_cv_.notify_one();
+}
+
+void PayloadHasher::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return queue_.empty() && !busy_; });
+}
+
+void PayloadHasher::Diverge() {
+  if (!shared_) {
+    return;
+  }
+  shared_ = false;
+  if (!signed_.SetContext(payload_.GetContext())) {
+    failed_ = true;
+  }
+}
+
+std::string PayloadHasher::GetPayloadContext() {
+  Wait();
+  return payload_.GetContext();
+}
+
+std::string PayloadHasher::GetSignedContext() {
+  Wait();
+  return shared_ ? payload_.GetContext() : signed_.GetContext();
+}
+
+bool PayloadHasher::SetPayloadContext(const std::string& context) {
+  Wait();
+  Diverge();
+  TEST_AND_RETURN_FALSE(payload_.SetContext(context));
+  // Resuming an update whose hashes didn't diverge yet.
+  shared_ = context == signed_.GetContext();
+  return true;
+}
+
+bool PayloadHasher::SetSignedContext(const std::string& context) {
+  Wait();
+  Diverge();
+  TEST_AND_RETURN_FALSE(signed_.SetContext(context));
+  shared_ = context == payload_.GetContext();
+  return true;
+}
+
+bool PayloadHasher::Finalize() {
+  Wait();
+  Diverge();
+  const bool payload_finalized = payload_.Finalize();
+  const bool signed_finalized = signed_.Finalize();
+  return !failed_ && payload_finalized && signed_finalized;
+}
+
+void PayloadHasher::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    Job job = std::move(queue_.front());
+    queue_.pop_front();
+    busy_ = true;
+    lock.unlock();
+
+    // The hashers are only used by this thread while it's busy.
+    const brillo::Blob& data = *job.data;
+    const size_t signed_size = std::min(job.signed_size, data.size());
+    if (signed_size < data.size()) {
+      Diverge();
+    }
+    bool hashed = payload_.Update(data.data(), data.size());
+    if (!shared_ && signed_size > 0) {
+      hashed = signed_.Update(data.data(), signed_size) && hashed;
+    }
+
+    lock.lock();
+    failed_ = failed_ || !hashed;
+    queued_bytes_ -= data.size();
+    busy_ = false;
+    done_cv_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
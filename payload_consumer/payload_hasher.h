@@ -0,0 +1,106 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_HASHER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+
+namespace chromeos_update_engine {
+
+// Computes the two running hashes of a payload on a thread of its own: the
+// hash of the whole payload and the hash of the portion covered by the payload
+// signature. The data is hashed in the order it's passed. As long as both
+// hashes were fed the same bytes, e.g. up to the metadata signature, they're
+// computed in a single pass. Must be used from a single thread.
+class PayloadHasher {
+ public:
+  // Update() waits for the worker once this much data is queued.
+  static constexpr size_t kMaxQueuedBytes = 16 * 1024 * 1024;  // 16 MiB
+
+  PayloadHasher();
+  ~PayloadHasher();
+
+  // Hashes the |size| bytes of |data| into the payload hash and the first
+  // |signed_size| of them into the signed hash. |data| is copied.
+  void Update(const void* data, size_t size, size_t signed_size);
+  // Same as above for all of |data|, which is kept until it's hashed instead
+  // of being copied.
+  void Update(std::shared_ptr<const brillo::Blob> data, size_t signed_size);
+
+  // These wait for the queued data to be hashed first.
+  std::string GetPayloadContext();
+  std::string GetSignedContext();
+  bool SetPayloadContext(const std::string& context);
+  bool SetSignedContext(const std::string& context);
+
+  // Waits for the queued data and finalizes both hashes. Returns false if any
+  // of the data couldn't be hashed.
+  bool Finalize();
+  // Only valid after Finalize().
+  const brillo::Blob& payload_hash() const { return payload_.raw_hash(); }
+  const brillo::Blob& signed_hash() const { return signed_.raw_hash(); }
+
+ private:
+  struct Job {
+    std::shared_ptr<const brillo::Blob> data;
+    size_t signed_size;
+  };
+
+  void Enqueue(Job job);
+
+  // Waits until the worker hashed everything queued.
+  void Wait();
+
+  // Brings |signed_| up to date with |payload_| while both hashes are the
+  // same. Only called while the worker is idle or by the worker.
+  void Diverge();
+
+  void WorkerLoop();
+
+  HashCalculator payload_;
+  // Stale while |shared_| is set, the hash is the same as |payload_|'s then.
+  HashCalculator signed_;
+  bool shared_{true};
+  bool failed_{false};
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::deque<Job> queue_;
+  size_t queued_bytes_{0};
+  bool busy_{false};
+  bool stopping_{false};
+  std::thread worker_;
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadHasher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_HASHER_H_
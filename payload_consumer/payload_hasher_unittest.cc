@@ -0,0 +1,75 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_hasher.h"
+
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PayloadHasherTest : public ::testing::Test {
+ protected:
+  brillo::Blob Hash(const string& data) {
+    brillo::Blob hash;
+    EXPECT_TRUE(
+        HashCalculator::RawHashOfBytes(data.data(), data.size(), &hash));
+    return hash;
+  }
+};
+
+TEST_F(PayloadHasherTest, SharedHashTest) {
+  PayloadHasher hasher;
+  hasher.Update("metadata", 8, 8);
+  hasher.Update(std::make_shared<const brillo::Blob>(4, 'a'), 4);
+  ASSERT_TRUE(hasher.Finalize());
+  EXPECT_EQ(Hash("metadataaaaa"), hasher.payload_hash());
+  EXPECT_EQ(Hash("metadataaaaa"), hasher.signed_hash());
+}
+
+TEST_F(PayloadHasherTest, DivergedHashTest) {
+  PayloadHasher hasher;
+  hasher.Update("metadata", 8, 8);
+  hasher.Update("signature", 9, 0);
+  hasher.Update("datasig", 7, 4);
+  ASSERT_TRUE(hasher.Finalize());
+  EXPECT_EQ(Hash("metadatasignaturedatasig"), hasher.payload_hash());
+  EXPECT_EQ(Hash("metadatadata"), hasher.signed_hash());
+}
+
+TEST_F(PayloadHasherTest, ContextTest) {
+  PayloadHasher hasher;
+  hasher.Update("metadata", 8, 8);
+  hasher.Update("signature", 9, 0);
+  const string payload_context = hasher.GetPayloadContext();
+  const string signed_context = hasher.GetSignedContext();
+
+  PayloadHasher resumed;
+  ASSERT_TRUE(resumed.SetSignedContext(signed_context));
+  ASSERT_TRUE(resumed.SetPayloadContext(payload_context));
+  resumed.Update("data", 4, 4);
+  ASSERT_TRUE(resumed.Finalize());
+  EXPECT_EQ(Hash("metadatasignaturedata"), resumed.payload_hash());
+  EXPECT_EQ(Hash("metadatadata"), resumed.signed_hash());
+}
+
+}  // namespace chromeos_update_engine
@@ -24,6 +24,7 @@
 #include "update_engine/common/constants.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 
@@ -149,8 +150,9 @@ bool PayloadMetadata::GetManifest(const unsigned char* payload,
                                   DeltaArchiveManifest* out_manifest) const {
   uint64_t manifest_offset = GetManifestOffset();
   CHECK_GE(size, manifest_offset + manifest_size_);
-  return out_manifest->ParseFromArray(&payload[manifest_offset],
-                                      manifest_size_);
+  TEST_AND_RETURN_FALSE(
+      out_manifest->ParseFromArray(&payload[manifest_offset], manifest_size_));
+  return UnpackManifestExtents(out_manifest);
 }
 
 ErrorCode PayloadMetadata::ValidateMetadataSignature(
@@ -222,6 +224,106 @@ ErrorCode PayloadMetadata::ValidateMetadataSignature(
   return ErrorCode::kSuccess;
 }
 
+bool PayloadMetadata::ParsePartitionOperations(uint32_t minor_version,
+                                               const uint8_t* data,
+                                               size_t size,
+                                               PartitionUpdate* partition) {
+  TEST_AND_RETURN_FALSE(partition->has_operations_blob_offset());
+  TEST_AND_RETURN_FALSE(size == partition->operations_blob_size());
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(data, size, &hash));
+  if (partition->operations_blob_sha256_hash() !=
+      string(hash.begin(), hash.end())) {
+    LOG(ERROR) << "Hash mismatch of the operations of partition "
+               << partition->partition_name();
+    return false;
+  }
+  PartitionOperations operations;
+  TEST_AND_RETURN_FALSE(operations.ParseFromArray(data, size));
+  TEST_AND_RETURN_FALSE(static_cast<uint32_t>(operations.operations_size()) ==
+                        partition->num_operations());
+  TEST_AND_RETURN_FALSE(
+      UnpackOperationsExtents(minor_version, operations.mutable_operations()));
+  partition->mutable_operations()->Swap(operations.mutable_operations());
+  return true;
+}
+
+bool PayloadMetadata::LoadPartitionOperations(
+    const unsigned char* payload,
+    size_t size,
+    DeltaArchiveManifest* manifest) const {
+  const uint64_t data_offset = metadata_size_ + metadata_signature_size_;
+  for (PartitionUpdate& partition : *manifest->mutable_partitions()) {
+    if (!partition.has_operations_blob_offset()) {
+      continue;
+    }
+    const uint64_t offset = data_offset + partition.operations_blob_offset();
+    TEST_AND_RETURN_FALSE(offset <= size &&
+                          partition.operations_blob_size() <= size - offset);
+    TEST_AND_RETURN_FALSE(
+        ParsePartitionOperations(manifest->minor_version(),
+                                 payload + offset,
+                                 partition.operations_blob_size(),
+                                 &partition));
+  }
+  return true;
+}
+
+uint64_t PayloadMetadata::GetPayloadIndexOffset(
+    const DeltaArchiveManifest& manifest) const {
+  return metadata_size_ + metadata_signature_size_ + manifest.index_offset();
+}
+
+bool PayloadMetadata::ParsePayloadIndex(const DeltaArchiveManifest& manifest,
+                                        const brillo::Blob& index_data,
+                                        PayloadIndex* out_index) {
+  TEST_AND_RETURN_FALSE(manifest.index_size() > 0);
+  TEST_AND_RETURN_FALSE(index_data.size() == manifest.index_size());
+  brillo::Blob index_hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(index_data, &index_hash));
+  if (manifest.index_sha256_hash() !=
+      string(index_hash.begin(), index_hash.end())) {
+    LOG(ERROR) << "Payload index hash mismatch.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(
+      out_index->ParseFromArray(index_data.data(), index_data.size()));
+
+  // The hash matched, these only catch indexes not generated as expected.
+  const uint64_t num_operations = out_index->data_offsets_size();
+  TEST_AND_RETURN_FALSE(out_index->data_lengths_size() ==
+                        static_cast<int>(num_operations));
+  for (const auto& range : out_index->partitions()) {
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(range.first_operation()) +
+                              range.num_operations() <=
+                          num_operations);
+  }
+  if (out_index->chunk_size() > 0) {
+    const uint64_t num_chunks =
+        (manifest.index_offset() + out_index->chunk_size() - 1) /
+        out_index->chunk_size();
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(
+                              out_index->chunk_hashes_size()) == num_chunks);
+  }
+  return true;
+}
+
+bool PayloadMetadata::VerifyPayloadIndexChunk(const PayloadIndex& index,
+                                              uint64_t chunk_number,
+                                              const uint8_t* data,
+                                              size_t size) {
+  TEST_AND_RETURN_FALSE(chunk_number <
+                        static_cast<uint64_t>(index.chunk_hashes_size()));
+  // Only the last chunk may be shorter, its size isn't known here.
+  TEST_AND_RETURN_FALSE(size == index.chunk_size() ||
+                        (size < index.chunk_size() &&
+                         chunk_number + 1 ==
+                             static_cast<uint64_t>(index.chunk_hashes_size())));
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(data, size, &hash));
+  return index.chunk_hashes(chunk_number) == string(hash.begin(), hash.end());
+}
+
 bool PayloadMetadata::ParsePayloadFile(const string& payload_path,
                                        DeltaArchiveManifest* manifest,
                                        Signatures* metadata_signatures) {
@@ -250,4 +352,16 @@ bool PayloadMetadata::ParsePayloadFile(const string& payload_path,
   return true;
 }
 
+bool PayloadMetadata::ReadPayloadIndex(const string& payload_path,
+                                       const DeltaArchiveManifest& manifest,
+                                       PayloadIndex* out_index) const {
+  TEST_AND_RETURN_FALSE(manifest.index_size() > 0);
+  brillo::Blob index_data;
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(payload_path,
+                                             GetPayloadIndexOffset(manifest),
+                                             manifest.index_size(),
+                                             &index_data));
+  return ParsePayloadIndex(manifest, index_data, out_index);
+}
+
 }  // namespace chromeos_update_engine
@@ -85,8 +85,8 @@ class PayloadMetadata {
   // yet parsed, returns zero.
   uint32_t GetMetadataSignatureSize() const { return metadata_signature_size_; }
 
-  // Set |*out_manifest| to the manifest in |payload|.
-  // Returns true on success.
+  // Set |*out_manifest| to the manifest in |payload|, with any packed extents
+  // of its operations unpacked. Returns true on success.
   bool GetManifest(const brillo::Blob& payload,
                    DeltaArchiveManifest* out_manifest) const;
 
@@ -94,6 +94,41 @@ class PayloadMetadata {
                    size_t size,
                    DeltaArchiveManifest* out_manifest) const;
 
+  // Parses into |partition| its operations stored apart from the manifest of a
+  // payload of |minor_version|, from the |size| bytes at |data| read at its
+  // operations_blob_offset(). They are checked against the hash in
+  // |partition|, so they can be trusted as much as the manifest.
+  static bool ParsePartitionOperations(uint32_t minor_version,
+                                       const uint8_t* data,
+                                       size_t size,
+                                       PartitionUpdate* partition);
+
+  // Parses into |manifest| the operations of its partitions stored apart
+  // from it, from the whole |payload| of |size| bytes. Does nothing for the
+  // other partitions.
+  bool LoadPartitionOperations(const unsigned char* payload,
+                               size_t size,
+                               DeltaArchiveManifest* manifest) const;
+
+  // Returns the offset in the payload of the PayloadIndex of |manifest|, which
+  // must have one. The header must have been parsed.
+  uint64_t GetPayloadIndexOffset(const DeltaArchiveManifest& manifest) const;
+
+  // Parses into |out_index| the PayloadIndex of |manifest| from |index_data|,
+  // its index_size() bytes at GetPayloadIndexOffset(). They are checked
+  // against the hash in |manifest|, so the index can be trusted as much as the
+  // manifest. Returns false if it has no index or it doesn't match.
+  static bool ParsePayloadIndex(const DeltaArchiveManifest& manifest,
+                                const brillo::Blob& index_data,
+                                PayloadIndex* out_index);
+
+  // Returns whether the |size| bytes at |data| are the chunk |chunk_number| of
+  // the data blobs hashed in |index|.
+  static bool VerifyPayloadIndexChunk(const PayloadIndex& index,
+                                      uint64_t chunk_number,
+                                      const uint8_t* data,
+                                      size_t size);
+
   // Parses a payload file |payload_path| and prepares the metadata properties,
   // manifest and metadata signatures. Can be used as an easy to use utility to
   // get the payload information without manually the process.
@@ -101,6 +136,12 @@ class PayloadMetadata {
                         DeltaArchiveManifest* manifest,
                         Signatures* metadata_signatures);
 
+  // Reads the PayloadIndex of |manifest| from the payload file |payload_path|,
+  // after ParsePayloadFile(). Returns false if it has no index.
+  bool ReadPayloadIndex(const std::string& payload_path,
+                        const DeltaArchiveManifest& manifest,
+                        PayloadIndex* out_index) const;
+
  private:
   // Returns the byte offset at which the manifest protobuf begins in a payload.
   uint64_t GetManifestOffset() const;
@@ -0,0 +1,285 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_staging_action.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <brillo/data_encoding.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/io_scheduler.h"
+
+using brillo::data_encoding::Base64Encode;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Whether the staging progress in |prefs| is the one of |payload|.
+bool IsStagingPayload(PrefsInterface* prefs,
+                      const InstallPlan::Payload& payload) {
+  string hash;
+  return !payload.hash.empty() &&
+         prefs->GetString(kPrefsStagedPayloadHash, &hash) &&
+         hash == Base64Encode(payload.hash);
+}
+}  // namespace
+
+PayloadStagingAction::PayloadStagingAction(PrefsInterface* prefs,
+                                           HttpFetcher* http_fetcher,
+                                           string staging_path)
+    : prefs_(prefs),
+      http_fetcher_(new MultiRangeHttpFetcher(http_fetcher)),
+      staging_path_(std::move(staging_path)) {}
+
+bool PayloadStagingAction::IsPayloadStaged(
+    PrefsInterface* prefs,
+    const string& staging_path,
+    const InstallPlan::Payload& payload) {
+  // The hash context is dropped once the whole payload was verified.
+  int64_t staged_size = 0;
+  return !staging_path.empty() && payload.size > 0 &&
+         IsStagingPayload(prefs, payload) &&
+         prefs->GetInt64(kPrefsStagedPayloadSize, &staged_size) &&
+         static_cast<uint64_t>(staged_size) == payload.size &&
+         !prefs->Exists(kPrefsStagedPayloadSHA256Context) &&
+         utils::FileSize(staging_path) >= static_cast<off_t>(payload.size);
+}
+
+void PayloadStagingAction::ClearStagedPayload(PrefsInterface* prefs,
+                                              const string& staging_path) {
+  prefs->Delete(kPrefsStagedPayloadHash);
+  prefs->Delete(kPrefsStagedPayloadSize);
+  prefs->Delete(kPrefsStagedPayloadSHA256Context);
+  if (!staging_path.empty() && unlink(staging_path.c_str()) != 0 &&
+      errno != ENOENT) {
+    PLOG(WARNING) << "Unable to delete " << staging_path;
+  }
+}
+
+void PayloadStagingAction::PerformAction() {
+  http_fetcher_->set_delegate(this);
+
+  CHECK(HasInputObject());
+  install_plan_ = GetInputObject();
+  CHECK_EQ(install_plan_.payloads.size(), 1UL);
+  payload_ = &install_plan_.payloads[0];
+  if (payload_->size == 0 || payload_->hash.empty()) {
+    LOG(ERROR) << "Staging a payload requires its size and hash.";
+    processor_->ActionComplete(this,
+                               ErrorCode::kDownloadStateInitializationError);
+    return;
+  }
+  if (IsPayloadStaged(prefs_, staging_path_, *payload_)) {
+    LOG(INFO) << "The payload is already staged at " << staging_path_;
+    if (HasOutputPipe())
+      SetOutputObject(install_plan_);
+    processor_->ActionComplete(this, ErrorCode::kSuccess);
+    return;
+  }
+  if (!OpenStagingFile()) {
+    processor_->ActionComplete(this, code_);
+    return;
+  }
+  IoScheduler::GetInstance()->SetPhase(IoPhase::kStage);
+  if (staged_bytes_ == payload_->size) {
+    FinishStaging();
+    return;
+  }
+
+  LOG(INFO) << "Staging the payload at " << staging_path_ << " from byte "
+            << staged_bytes_ << " of " << payload_->size;
+  http_fetcher_->ClearRanges();
+  http_fetcher_->AddRange(base_offset_ + staged_bytes_,
+                          payload_->size - staged_bytes_);
+  transfer_active_ = true;
+  http_fetcher_->BeginTransfer(install_plan_.download_url);
+}
+
+bool PayloadStagingAction::OpenStagingFile() {
+  int64_t staged_size = 0;
+  string context;
+  const bool resume =
+      IsStagingPayload(prefs_, *payload_) &&
+      prefs_->GetInt64(kPrefsStagedPayloadSize, &staged_size) &&
+      staged_size >= 0 &&
+      static_cast<uint64_t>(staged_size) <= payload_->size &&
+      prefs_->GetString(kPrefsStagedPayloadSHA256Context, &context) &&
+      hasher_.SetContext(context);
+  if (!resume) {
+    // Data staged for another payload, or whose progress was lost, is of no
+    // use anymore.
+    ClearStagedPayload(prefs_, staging_path_);
+    staged_size = 0;
+  }
+
+  code_ = ErrorCode::kDownloadWriteError;
+  fd_.reset(HANDLE_EINTR(
+      open(staging_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600)));
+  if (fd_ < 0) {
+    PLOG(ERROR) << "Unable to open " << staging_path_;
+    return false;
+  }
+  // A no-op when resuming, the space was allocated by the first attempt.
+  if (fallocate(fd_, 0, 0, payload_->size) != 0) {
+    if (errno == ENOSPC) {
+      PLOG(ERROR) << "Unable to allocate " << payload_->size << " bytes for "
+                  << staging_path_;
+      code_ = ErrorCode::kNotEnoughSpace;
+      return false;
+    }
+    PLOG(WARNING) << "Unable to preallocate " << staging_path_;
+  }
+  staged_bytes_ = staged_size;
+  checkpointed_bytes_ = staged_size;
+  if (!resume) {
+    TEST_AND_RETURN_FALSE(prefs_->SetString(kPrefsStagedPayloadHash,
+                                            Base64Encode(payload_->hash)));
+    TEST_AND_RETURN_FALSE(Checkpoint());
+  }
+  code_ = ErrorCode::kSuccess;
+  return true;
+}
+
+bool PayloadStagingAction::Checkpoint() {
+  if (fdatasync(fd_) != 0) {
+    PLOG(ERROR) << "Unable to sync " << staging_path_;
+    return false;
+  }
+  // Without a size the progress isn't resumed, so a crash in between doesn't
+  // pair the new hash context with the old size.
+  prefs_->Delete(kPrefsStagedPayloadSize);
+  TEST_AND_RETURN_FALSE(prefs_->SetString(kPrefsStagedPayloadSHA256Context,
+                                          hasher_.GetContext()));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetInt64(kPrefsStagedPayloadSize, staged_bytes_));
+  checkpointed_bytes_ = staged_bytes_;
+  return true;
+}
+
+void PayloadStagingAction::SuspendAction() {
+  if (transfer_active_)
+    http_fetcher_->Pause();
+}
+
+void PayloadStagingAction::ResumeAction() {
+  if (transfer_active_)
+    http_fetcher_->Unpause();
+}
+
+void PayloadStagingAction::TerminateProcessing() {
+  // Keep what was staged so far for the next attempt.
+  if (fd_ >= 0 && staged_bytes_ > checkpointed_bytes_ && !Checkpoint())
+    LOG(WARNING) << "Unable to save the staging progress.";
+  transfer_active_ = false;
+  http_fetcher_->TerminateTransfer();
+}
+
+void PayloadStagingAction::Fail(ErrorCode code) {
+  code_ = code;
+  transfer_active_ = false;
+  // The action is completed by the TransferTerminated callback.
+  http_fetcher_->TerminateTransfer();
+}
+
+bool PayloadStagingAction::ReceivedBytes(HttpFetcher* fetcher,
+                                         const void* bytes,
+                                         size_t length) {
+  if (length > payload_->size - staged_bytes_) {
+    LOG(ERROR) << "Received more than the " << payload_->size
+               << " bytes of the payload.";
+    Fail(ErrorCode::kPayloadSizeMismatchError);
+    return false;
+  }
+  if (!utils::PWriteAll(fd_, bytes, length, staged_bytes_)) {
+    PLOG(ERROR) << "Unable to write to " << staging_path_;
+    Fail(ErrorCode::kDownloadWriteError);
+    return false;
+  }
+  if (!hasher_.Update(bytes, length)) {
+    Fail(ErrorCode::kDownloadWriteError);
+    return false;
+  }
+  staged_bytes_ += length;
+  // The last checkpoint is written once the payload is verified.
+  if (staged_bytes_ - checkpointed_bytes_ >= kCheckpointSize &&
+      staged_bytes_ < payload_->size && !Checkpoint()) {
+    Fail(ErrorCode::kDownloadWriteError);
+    return false;
+  }
+  if (delegate_)
+    delegate_->BytesReceived(length, staged_bytes_, payload_->size);
+  return true;
+}
+
+void PayloadStagingAction::TransferComplete(HttpFetcher* fetcher,
+                                            bool successful) {
+  transfer_active_ = false;
+  if (!successful) {
+    LOG(ERROR) << "Staging the payload failed after " << staged_bytes_
+               << " bytes.";
+    if (staged_bytes_ > checkpointed_bytes_ && !Checkpoint())
+      LOG(WARNING) << "Unable to save the staging progress.";
+    processor_->ActionComplete(this, ErrorCode::kDownloadTransferError);
+    return;
+  }
+  FinishStaging();
+}
+
+void PayloadStagingAction::TransferTerminated(HttpFetcher* fetcher) {
+  transfer_active_ = false;
+  if (code_ != ErrorCode::kSuccess)
+    processor_->ActionComplete(this, code_);
+}
+
+void PayloadStagingAction::FinishStaging() {
+  ErrorCode code = ErrorCode::kSuccess;
+  if (staged_bytes_ != payload_->size) {
+    LOG(ERROR) << "Staged " << staged_bytes_ << " bytes of a payload of "
+               << payload_->size << " bytes.";
+    code = ErrorCode::kPayloadSizeMismatchError;
+  } else if (!hasher_.Finalize() || hasher_.raw_hash() != payload_->hash) {
+    LOG(ERROR) << "The staged payload doesn't match its hash, discarding it.";
+    ClearStagedPayload(prefs_, staging_path_);
+    code = ErrorCode::kPayloadHashMismatchError;
+  } else if (fdatasync(fd_) != 0) {
+    PLOG(ERROR) << "Unable to sync " << staging_path_;
+    code = ErrorCode::kDownloadWriteError;
+  } else {
+    prefs_->Delete(kPrefsStagedPayloadSHA256Context);
+    if (prefs_->SetInt64(kPrefsStagedPayloadSize, staged_bytes_)) {
+      LOG(INFO) << "Staged and verified the payload at " << staging_path_;
+    } else {
+      LOG(ERROR) << "Unable to save the staged payload size.";
+      code = ErrorCode::kDownloadWriteError;
+    }
+  }
+  fd_.reset();
+
+  if (code == ErrorCode::kSuccess && HasOutputPipe())
+    SetOutputObject(install_plan_);
+  processor_->ActionComplete(this, code);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_STAGING_ACTION_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_STAGING_ACTION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+
+#include "update_engine/common/download_action.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/common/prefs_interface.h"
+#include "update_engine/payload_consumer/install_plan.h"
+
+namespace chromeos_update_engine {
+
+// Downloads the payload of the install plan to a local file ahead of the
+// update, so that applying it later only reads local storage. Nothing is
+// written to the partitions.
+//
+// The file is allocated at its full size first, so that staging fails early
+// rather than halfway when /data is short of space. The received data is
+// hashed as it's written; every kCheckpointSize bytes the file is synced and
+// the hash context and staged size are saved in the prefs, and a later
+// attempt for the same payload resumes from the last checkpoint. The payload
+// only counts as staged once its whole hash matches the install plan.
+class PayloadStagingAction : public InstallPlanAction,
+                             public HttpFetcherDelegate {
+ public:
+  // Staged bytes between two checkpoints of the progress.
+  static constexpr uint64_t kCheckpointSize = 16 * 1024 * 1024;  // 16 MiB
+
+  static std::string StaticType() { return "PayloadStagingAction"; }
+
+  // Takes ownership of |http_fetcher|. The payload is staged at
+  // |staging_path|.
+  PayloadStagingAction(PrefsInterface* prefs,
+                       HttpFetcher* http_fetcher,
+                       std::string staging_path);
+  ~PayloadStagingAction() override = default;
+
+  // Returns whether |payload| was completely staged and verified at
+  // |staging_path|.
+  static bool IsPayloadStaged(PrefsInterface* prefs,
+                              const std::string& staging_path,
+                              const InstallPlan::Payload& payload);
+  // Deletes the payload staged at |staging_path| and its progress.
+  static void ClearStagedPayload(PrefsInterface* prefs,
+                                 const std::string& staging_path);
+
+  // InstallPlanAction overrides.
+  void PerformAction() override;
+  void SuspendAction() override;
+  void ResumeAction() override;
+  void TerminateProcessing() override;
+  std::string Type() const override { return StaticType(); }
+
+  // HttpFetcherDelegate methods (see http_fetcher.h)
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override;
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+  void TransferTerminated(HttpFetcher* fetcher) override;
+
+  // Only BytesReceived() is called on |delegate|.
+  void set_delegate(DownloadActionDelegate* delegate) { delegate_ = delegate; }
+  void set_base_offset(int64_t base_offset) { base_offset_ = base_offset; }
+
+  HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
+
+ private:
+  // Opens and allocates the staging file and loads the progress of a previous
+  // attempt at staging the same payload. Sets |code_| on failure.
+  bool OpenStagingFile();
+
+  // Syncs the staged data and saves the progress in the prefs.
+  bool Checkpoint();
+
+  // Verifies the staged payload and completes the action.
+  void FinishStaging();
+
+  // Fails the action with |code|, stopping the transfer first if running.
+  void Fail(ErrorCode code);
+
+  PrefsInterface* prefs_;
+  std::unique_ptr<MultiRangeHttpFetcher> http_fetcher_;
+  const std::string staging_path_;
+  DownloadActionDelegate* delegate_{nullptr};
+  int64_t base_offset_{0};
+
+  // The payload being staged, in |install_plan_|.
+  const InstallPlan::Payload* payload_{nullptr};
+  android::base::unique_fd fd_;
+  HashCalculator hasher_;
+  uint64_t staged_bytes_{0};
+  uint64_t checkpointed_bytes_{0};
+  bool transfer_active_{false};
+
+  // Used by TransferTerminated to figure whether this action stopped the
+  // transfer itself or was terminated by the action processor.
+  ErrorCode code_{ErrorCode::kSuccess};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadStagingAction);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_STAGING_ACTION_H_
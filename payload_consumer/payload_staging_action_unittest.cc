@@ -0,0 +1,169 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_staging_action.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <base/bind.h>
+#include <base/files/scoped_temp_dir.h>
+#include <brillo/data_encoding.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/action_processor.h"
+#include "update_engine/common/constants.h"
+#include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/mock_http_fetcher.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using brillo::MessageLoop;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+class StagingTestDelegate : public ActionProcessorDelegate {
+ public:
+  void ProcessingDone(const ActionProcessor* processor,
+                      ErrorCode code) override {
+    MessageLoop::current()->BreakLoop();
+  }
+  void ProcessingStopped(const ActionProcessor* processor) override {
+    MessageLoop::current()->BreakLoop();
+  }
+  void ActionCompleted(ActionProcessor* processor,
+                       AbstractAction* action,
+                       ErrorCode code) override {
+    if (action->Type() == PayloadStagingAction::StaticType()) {
+      code_ = code;
+      bytes_downloaded_ = static_cast<PayloadStagingAction*>(action)
+                              ->http_fetcher()
+                              ->GetBytesDownloaded();
+    }
+  }
+
+  ErrorCode code_{ErrorCode::kError};
+  size_t bytes_downloaded_{0};
+};
+}  // namespace
+
+class PayloadStagingActionTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    staging_path_ = temp_dir_.GetPath().Append("staged_payload").value();
+    // Several chunks of the mock fetcher.
+    data_.resize(300 * 1024);
+    test_utils::FillWithData(&data_);
+    payload_.size = data_.size();
+    ASSERT_TRUE(HashCalculator::RawHashOfData(data_, &payload_.hash));
+  }
+
+  // Stages |payload_| downloading |data_|, and returns how the action
+  // completed.
+  ErrorCode Stage() {
+    InstallPlan install_plan;
+    install_plan.download_url = "http://fake_url.invalid";
+    install_plan.stage_payload = true;
+    install_plan.payloads.push_back(payload_);
+
+    auto install_plan_action =
+        std::make_unique<InstallPlanAction>(install_plan);
+    auto staging_action = std::make_unique<PayloadStagingAction>(
+        &prefs_,
+        new MockHttpFetcher(data_.data(), data_.size()),
+        staging_path_);
+    BondActions(install_plan_action.get(), staging_action.get());
+    ActionProcessor processor;
+    processor.set_delegate(&delegate_);
+    processor.EnqueueAction(std::move(install_plan_action));
+    processor.EnqueueAction(std::move(staging_action));
+
+    loop_.PostTask(
+        FROM_HERE,
+        base::Bind(
+            [](ActionProcessor* processor) { processor->StartProcessing(); },
+            base::Unretained(&processor)));
+    loop_.Run();
+    EXPECT_FALSE(processor.IsRunning());
+    return delegate_.code_;
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  base::ScopedTempDir temp_dir_;
+  string staging_path_;
+  FakePrefs prefs_;
+  StagingTestDelegate delegate_;
+  brillo::Blob data_;
+  InstallPlan::Payload payload_;
+};
+
+TEST_F(PayloadStagingActionTest, StagesPayload) {
+  ASSERT_EQ(ErrorCode::kSuccess, Stage());
+  EXPECT_EQ(data_.size(), delegate_.bytes_downloaded_);
+  EXPECT_TRUE(
+      PayloadStagingAction::IsPayloadStaged(&prefs_, staging_path_, payload_));
+  brillo::Blob staged;
+  ASSERT_TRUE(utils::ReadFile(staging_path_, &staged));
+  EXPECT_EQ(data_, staged);
+
+  // Staging it again downloads nothing.
+  ASSERT_EQ(ErrorCode::kSuccess, Stage());
+  EXPECT_EQ(0U, delegate_.bytes_downloaded_);
+
+  PayloadStagingAction::ClearStagedPayload(&prefs_, staging_path_);
+  EXPECT_FALSE(
+      PayloadStagingAction::IsPayloadStaged(&prefs_, staging_path_, payload_));
+  EXPECT_FALSE(utils::FileExists(staging_path_.c_str()));
+}
+
+TEST_F(PayloadStagingActionTest, ResumesFromCheckpoint) {
+  // A previous attempt staged the beginning of the payload.
+  constexpr size_t kStagedSize = 100 * 1024;
+  ASSERT_TRUE(
+      utils::WriteFile(staging_path_.c_str(), data_.data(), kStagedSize));
+  HashCalculator hasher;
+  ASSERT_TRUE(hasher.Update(data_.data(), kStagedSize));
+  ASSERT_TRUE(prefs_.SetString(
+      kPrefsStagedPayloadHash,
+      brillo::data_encoding::Base64Encode(payload_.hash)));
+  ASSERT_TRUE(
+      prefs_.SetString(kPrefsStagedPayloadSHA256Context, hasher.GetContext()));
+  ASSERT_TRUE(prefs_.SetInt64(kPrefsStagedPayloadSize, kStagedSize));
+
+  ASSERT_EQ(ErrorCode::kSuccess, Stage());
+  EXPECT_EQ(data_.size() - kStagedSize, delegate_.bytes_downloaded_);
+  brillo::Blob staged;
+  ASSERT_TRUE(utils::ReadFile(staging_path_, &staged));
+  EXPECT_EQ(data_, staged);
+}
+
+TEST_F(PayloadStagingActionTest, HashMismatchDiscardsPayload) {
+  payload_.hash[0] ^= 1;
+  ASSERT_EQ(ErrorCode::kPayloadHashMismatchError, Stage());
+  EXPECT_FALSE(
+      PayloadStagingAction::IsPayloadStaged(&prefs_, staging_path_, payload_));
+  EXPECT_FALSE(prefs_.Exists(kPrefsStagedPayloadHash));
+  EXPECT_FALSE(utils::FileExists(staging_path_.c_str()));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,10 +16,15 @@
 
 #include "update_engine/payload_consumer/payload_verifier.h"
 
+#include <sys/stat.h>
+
+#include <map>
+#include <mutex>
 #include <utility>
 #include <vector>
 
 #include <base/logging.h>
+#include <openssl/ecdsa.h>
 #include <openssl/pem.h>
 
 #include "update_engine/common/constants.h"
@@ -49,6 +54,44 @@ const uint8_t kSHA256DigestInfoPrefix[] = {
     0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20,
 };
 
+using PublicKeys =
+    std::vector<std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>>;
+
+// The public keys parsed from a certificate zip file, valid as long as the
+// file isn't replaced or modified.
+struct CachedPublicKeys {
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec mtime;
+  PublicKeys keys;
+};
+
+// Certificate zip files don't change while the daemon runs, but are read for
+// every payload applied or checked.
+std::mutex public_key_cache_mutex;
+std::map<string, CachedPublicKeys>& PublicKeyCache() {
+  static auto* cache = new std::map<string, CachedPublicKeys>();
+  return *cache;
+}
+
+bool MatchesFile(const CachedPublicKeys& cached, const struct stat& st) {
+  return cached.device == st.st_dev && cached.inode == st.st_ino &&
+         cached.size == st.st_size &&
+         cached.mtime.tv_sec == st.st_mtim.tv_sec &&
+         cached.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+// Returns new references to |keys|.
+PublicKeys CopyPublicKeys(const PublicKeys& keys) {
+  PublicKeys copy;
+  for (const auto& key : keys) {
+    EVP_PKEY_up_ref(key.get());
+    copy.emplace_back(key.get(), EVP_PKEY_free);
+  }
+  return copy;
+}
+
 }  // namespace
 
 std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstance(
@@ -74,6 +117,19 @@ std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstance(
 
 std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstanceFromZipPath(
     const std::string& certificate_zip_path) {
+  struct stat st {};
+  const bool has_stat = stat(certificate_zip_path.c_str(), &st) == 0;
+  std::lock_guard<std::mutex> lock(public_key_cache_mutex);
+  auto& cache = PublicKeyCache();
+  auto it = cache.find(certificate_zip_path);
+  if (has_stat && it != cache.end() && MatchesFile(it->second, st)) {
+    return std::unique_ptr<PayloadVerifier>(
+        new PayloadVerifier(CopyPublicKeys(it->second.keys)));
+  }
+  if (it != cache.end()) {
+    cache.erase(it);
+  }
+
   auto parser = CreateCertificateParser();
   if (!parser) {
     LOG(ERROR) << "Failed to create certificate parser from "
@@ -89,6 +145,14 @@ std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstanceFromZipPath(
     return nullptr;
   }
 
+  if (has_stat) {
+    cache.emplace(certificate_zip_path,
+                  CachedPublicKeys{st.st_dev,
+                                   st.st_ino,
+                                   st.st_size,
+                                   st.st_mtim,
+                                   CopyPublicKeys(public_keys)});
+  }
   return std::unique_ptr<PayloadVerifier>(
       new PayloadVerifier(std::move(public_keys)));
 }
@@ -149,8 +213,23 @@ bool PayloadVerifier::VerifyRawSignature(
     brillo::Blob* decrypted_sig_data) const {
   TEST_AND_RETURN_FALSE(!public_keys_.empty());
 
+  size_t keys_tried = 0;
   for (const auto& public_key : public_keys_) {
     int key_type = EVP_PKEY_id(public_key.get());
+    // Skips the keys that can't have made a signature of this size without
+    // running the RSA or EC operation.
+    if (key_type == EVP_PKEY_RSA) {
+      const RSA* rsa = EVP_PKEY_get0_RSA(public_key.get());
+      if (rsa != nullptr && RSA_size(rsa) != sig_data.size()) {
+        continue;
+      }
+    } else if (key_type == EVP_PKEY_EC) {
+      const EC_KEY* ec_key = EVP_PKEY_get0_EC_KEY(public_key.get());
+      if (ec_key != nullptr && sig_data.size() > ECDSA_size(ec_key)) {
+        continue;
+      }
+    }
+    keys_tried++;
     if (key_type == EVP_PKEY_RSA) {
       brillo::Blob sig_hash_data;
       if (!GetRawHashFromSignature(
@@ -187,8 +266,8 @@ bool PayloadVerifier::VerifyRawSignature(
       return false;
     }
   }
-  LOG(INFO) << "Failed to verify the signature with " << public_keys_.size()
-            << " keys.";
+  LOG(INFO) << "Failed to verify the signature with " << keys_tried << " of "
+            << public_keys_.size() << " keys.";
   return false;
 }
 
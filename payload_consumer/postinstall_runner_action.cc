@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <string>
@@ -31,6 +32,7 @@
 #include <base/files/file_util.h>
 #include <base/logging.h>
 #include <base/strings/string_split.h>
+#include <brillo/key_value_store.h>
 
 #include "update_engine/common/action_processor.h"
 #include "update_engine/common/boot_control_interface.h"
@@ -72,6 +74,21 @@ static void LogBuildInfoForPartition(std::string_view mount_point) {
   }
 }
 
+static void SetNonBlocking(int fd) {
+  int fd_flags = fcntl(fd, F_GETFL, 0) | O_NONBLOCK;
+  if (HANDLE_EINTR(fcntl(fd, F_SETFL, fd_flags)) < 0) {
+    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd " << fd;
+  }
+}
+
+static bool DeleteMountDir(const std::string& dir) {
+#if BASE_VER < 800000
+  return base::DeleteFile(base::FilePath(dir), true);
+#else
+  return base::DeleteFile(base::FilePath(dir));
+#endif
+}
+
 }  // namespace
 
 namespace chromeos_update_engine {
@@ -79,9 +96,27 @@ namespace chromeos_update_engine {
 using std::string;
 using std::vector;
 
+namespace {
+
+ErrorCode GetPostinstallErrorCode(int return_code) {
+  // This special return code means that we tried to update firmware,
+  // but couldn't because we booted from FW B, and we need to reboot
+  // to get back to FW A.
+  if (return_code == 3)
+    return ErrorCode::kPostinstallBootedFromFirmwareB;
+  // This special return code means that we tried to update firmware,
+  // but couldn't because we booted from FW B, and we need to reboot
+  // to get back to FW A.
+  if (return_code == 4)
+    return ErrorCode::kPostinstallFirmwareRONotUpdatable;
+  return ErrorCode::kPostinstallRunnerError;
+}
+
+}  // namespace
+
 PostinstallRunnerAction::PostinstallRunnerAction(
     BootControlInterface* boot_control, HardwareInterface* hardware)
-    : boot_control_(boot_control), hardware_(hardware) {
+    : boot_control_(boot_control), hardware_(hardware), scheduler_(hardware) {
 #ifdef __ANDROID__
   fs_mount_dir_ = "/postinstall";
 #else   // __ANDROID__
@@ -154,11 +189,19 @@ void PostinstallRunnerAction::PerformAction() {
   accumulated_weight_ = 0;
   ReportProgress(0);
 
+  if (!install_plan_.download_url.empty()) {
+    // A missing update_engine.conf leaves the default priorities.
+    brillo::KeyValueStore store;
+    store.Load(base::FilePath(constants::kUpdateEngineConfPath));
+    scheduler_.Start(PostinstallScheduler::LoadConfig(store));
+    StartParallelPostinstall();
+  }
   PerformPartitionPostinstall();
 }
 
 bool PostinstallRunnerAction::MountPartition(
-    const InstallPlan::Partition& partition) noexcept {
+    const InstallPlan::Partition& partition,
+    const string& mount_dir) noexcept {
   // Perform post-install for the current_partition_ partition. At this point we
   // need to call CompletePartitionPostinstall to complete the operation and
   // cleanup.
@@ -169,14 +212,17 @@ bool PostinstallRunnerAction::MountPartition(
     return false;
   }
 
-  if (!utils::FileExists(fs_mount_dir_.c_str())) {
-    LOG(ERROR) << "Mount point " << fs_mount_dir_
+  if (!utils::FileExists(mount_dir.c_str())) {
+    LOG(ERROR) << "Mount point " << mount_dir
                << " does not exist, mount call will fail";
     return false;
   }
-  // Double check that the fs_mount_dir is not busy with a previous mounted
+  // Double check that the mount_dir is not busy with a previous mounted
   // filesystem from a previous crashed postinstall step.
-  EnsureUnmounted();
+  if (utils::IsMountpoint(mount_dir)) {
+    LOG(INFO) << "Found previously mounted filesystem at " << mount_dir;
+    utils::UnmountFilesystem(mount_dir);
+  }
 
 #ifdef __ANDROID__
   // In Chromium OS, the postinstall step is allowed to write to the block
@@ -191,7 +237,7 @@ bool PostinstallRunnerAction::MountPartition(
 
   if (!utils::MountFilesystem(
           mountable_device,
-          fs_mount_dir_,
+          mount_dir,
           MS_RDONLY,
           partition.filesystem_type,
           hardware_->GetPartitionMountOptions(partition.name))) {
@@ -206,9 +252,15 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
     return CompletePostinstall(ErrorCode::kSuccess);
   }
 
-  // Skip all the partitions that don't have a post-install step.
+  // Skip all the partitions that don't have a post-install step, or whose
+  // post-install step is already running in parallel.
   while (current_partition_ < install_plan_.partitions.size() &&
-         !install_plan_.partitions[current_partition_].run_postinstall) {
+         (!install_plan_.partitions[current_partition_].run_postinstall ||
+          IsParallelPostinstall(current_partition_))) {
+    if (IsParallelPostinstall(current_partition_)) {
+      current_partition_++;
+      continue;
+    }
     VLOG(1) << "Skipping post-install on partition "
             << install_plan_.partitions[current_partition_].name;
     // Attempt to mount a device if it has postinstall script configured, even
@@ -223,7 +275,7 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
     const auto& partition = install_plan_.partitions[current_partition_];
     if (!partition.postinstall_path.empty()) {
       const auto mountable_device = partition.readonly_target_path;
-      if (!MountPartition(partition)) {
+      if (!MountPartition(partition, fs_mount_dir_)) {
         return CompletePostinstall(ErrorCode::kPostInstallMountError);
       }
       LogBuildInfoForPartition(fs_mount_dir_);
@@ -234,42 +286,81 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
     }
     current_partition_++;
   }
-  if (current_partition_ == install_plan_.partitions.size())
+  if (current_partition_ == install_plan_.partitions.size()) {
+    if (HasRunningParallelPostinstall()) {
+      LOG(INFO) << "Waiting for the parallel postinstall programs to finish.";
+      return;
+    }
     return CompletePostinstall(ErrorCode::kSuccess);
+  }
 
   const InstallPlan::Partition& partition =
       install_plan_.partitions[current_partition_];
 
-  const string mountable_device = partition.readonly_target_path;
   // Perform post-install for the current_partition_ partition. At this point we
   // need to call CompletePartitionPostinstall to complete the operation and
   // cleanup.
 
-  if (!MountPartition(partition)) {
+  if (!MountPartition(partition, fs_mount_dir_)) {
     CompletePostinstall(ErrorCode::kPostInstallMountError);
     return;
   }
   LogBuildInfoForPartition(fs_mount_dir_);
+  // Runs the postinstall script asynchronously to free up the main loop while
+  // it's running.
+  vector<string> command;
+  if (!GetPostinstallCommand(partition, fs_mount_dir_, &command)) {
+    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+  }
+
+  current_command_ = Subprocess::Get().ExecFlags(
+      command,
+      Subprocess::kRedirectStderrToStdout,
+      {kPostinstallStatusFd},
+      base::Bind(&PostinstallRunnerAction::CompletePartitionPostinstall,
+                 base::Unretained(this)));
+  // Subprocess::Exec should never return a negative process id.
+  CHECK_GE(current_command_, 0);
+
+  if (!current_command_) {
+    CompletePartitionPostinstall(1, "Postinstall didn't launch");
+    return;
+  }
+  scheduler_.AddProcess(current_command_);
+
+  // Monitor the status file descriptor.
+  progress_fd_ =
+      Subprocess::Get().GetPipeFd(current_command_, kPostinstallStatusFd);
+  SetNonBlocking(progress_fd_);
+
+  progress_controller_ = base::FileDescriptorWatcher::WatchReadable(
+      progress_fd_,
+      base::BindRepeating(&PostinstallRunnerAction::OnProgressFdReady,
+                          base::Unretained(this)));
+}
+
+bool PostinstallRunnerAction::GetPostinstallCommand(
+    const InstallPlan::Partition& partition,
+    const string& mount_dir,
+    vector<string>* command) {
   base::FilePath postinstall_path(partition.postinstall_path);
   if (postinstall_path.IsAbsolute()) {
     LOG(ERROR) << "Invalid absolute path passed to postinstall, use a relative"
                   "path instead: "
                << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    return false;
   }
 
-  string abs_path =
-      base::FilePath(fs_mount_dir_).Append(postinstall_path).value();
-  if (!base::StartsWith(
-          abs_path, fs_mount_dir_, base::CompareCase::SENSITIVE)) {
+  string abs_path = base::FilePath(mount_dir).Append(postinstall_path).value();
+  if (!base::StartsWith(abs_path, mount_dir, base::CompareCase::SENSITIVE)) {
     LOG(ERROR) << "Invalid relative postinstall path: "
                << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    return false;
   }
 
   LOG(INFO) << "Performing postinst (" << partition.postinstall_path << " at "
             << abs_path << ") installed on mountable device "
-            << mountable_device;
+            << partition.readonly_target_path;
 
   // Logs the file format of the postinstall script we are about to run. This
   // will help debug when the postinstall script doesn't match the architecture
@@ -277,78 +368,213 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
   LOG(INFO) << "Format file for new " << partition.postinstall_path
             << " is: " << utils::GetFileFormat(abs_path);
 
-  // Runs the postinstall script asynchronously to free up the main loop while
-  // it's running.
-  vector<string> command = {abs_path};
+  *command = {abs_path};
 #ifdef __ANDROID__
   // In Brillo and Android, we pass the slot number and status fd.
-  command.push_back(std::to_string(install_plan_.target_slot));
-  command.push_back(std::to_string(kPostinstallStatusFd));
+  command->push_back(std::to_string(install_plan_.target_slot));
+  command->push_back(std::to_string(kPostinstallStatusFd));
 #else
   // Chrome OS postinstall expects the target rootfs as the first parameter.
-  command.push_back(partition.target_path);
+  command->push_back(partition.target_path);
 #endif  // __ANDROID__
+  return true;
+}
 
-  current_command_ = Subprocess::Get().ExecFlags(
-      command,
-      Subprocess::kRedirectStderrToStdout,
-      {kPostinstallStatusFd},
-      base::Bind(&PostinstallRunnerAction::CompletePartitionPostinstall,
-                 base::Unretained(this)));
-  // Subprocess::Exec should never return a negative process id.
-  CHECK_GE(current_command_, 0);
+void PostinstallRunnerAction::StartParallelPostinstall() {
+  for (size_t i = 0; i < install_plan_.partitions.size(); ++i) {
+    const auto& partition = install_plan_.partitions[i];
+    if (!partition.run_postinstall || !partition.postinstall_parallel)
+      continue;
+
+    auto job = std::make_unique<ParallelPostinstall>();
+    job->partition = i;
+    job->mount_dir = fs_mount_dir_ + "_" + partition.name;
+    if (!base::DirectoryExists(base::FilePath(job->mount_dir))) {
+      if (!base::CreateDirectory(base::FilePath(job->mount_dir))) {
+        PLOG(WARNING) << "Unable to create mount point " << job->mount_dir
+                      << ", running postinstall of " << partition.name
+                      << " serially.";
+        continue;
+      }
+      job->created_mount_dir = true;
+    }
 
-  if (!current_command_) {
-    CompletePartitionPostinstall(1, "Postinstall didn't launch");
-    return;
+    vector<string> command;
+    if (MountPartition(partition, job->mount_dir)) {
+      LogBuildInfoForPartition(job->mount_dir);
+      if (GetPostinstallCommand(partition, job->mount_dir, &command)) {
+        job->command = Subprocess::Get().ExecFlags(
+            command,
+            Subprocess::kRedirectStderrToStdout,
+            {kPostinstallStatusFd},
+            base::Bind(&PostinstallRunnerAction::CompleteParallelPostinstall,
+                       base::Unretained(this),
+                       parallel_jobs_.size()));
+      }
+    }
+    if (job->command <= 0) {
+      // Any error is reported by the serial pass, which runs it again.
+      LOG(WARNING) << "Unable to start postinstall of " << partition.name
+                   << " in parallel, running it serially.";
+      job->command = 0;
+      CleanupParallelPostinstall(job.get());
+      continue;
+    }
+    scheduler_.AddProcess(job->command);
+
+    job->progress_fd =
+        Subprocess::Get().GetPipeFd(job->command, kPostinstallStatusFd);
+    SetNonBlocking(job->progress_fd);
+    job->progress_controller = base::FileDescriptorWatcher::WatchReadable(
+        job->progress_fd,
+        base::BindRepeating(&PostinstallRunnerAction::OnParallelProgressFdReady,
+                            base::Unretained(this),
+                            parallel_jobs_.size()));
+    LOG(INFO) << "Started postinstall of " << partition.name << " at "
+              << job->mount_dir << " in parallel.";
+    parallel_jobs_.push_back(std::move(job));
   }
+}
 
-  // Monitor the status file descriptor.
-  progress_fd_ =
-      Subprocess::Get().GetPipeFd(current_command_, kPostinstallStatusFd);
-  int fd_flags = fcntl(progress_fd_, F_GETFL, 0) | O_NONBLOCK;
-  if (HANDLE_EINTR(fcntl(progress_fd_, F_SETFL, fd_flags)) < 0) {
-    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd " << progress_fd_;
+void PostinstallRunnerAction::CompleteParallelPostinstall(
+    size_t index, int return_code, const string& output) {
+  auto& job = *parallel_jobs_[index];
+  scheduler_.RemoveProcess(job.command);
+  job.command = 0;
+  CleanupParallelPostinstall(&job);
+
+  const auto& partition = install_plan_.partitions[job.partition];
+  if (return_code != 0) {
+    LOG(ERROR) << "Postinst command for " << partition.name
+               << " failed with code: " << return_code;
+    if (partition.postinstall_optional) {
+      LOG(INFO) << "Ignoring postinstall failure since it is optional";
+    } else {
+      // Stops the serial postinstall program and the other parallel ones.
+      TerminateProcessing();
+      return CompletePostinstall(GetPostinstallErrorCode(return_code));
+    }
   }
+  job.progress = 1;
+  ReportProgress(current_progress_);
 
-  progress_controller_ = base::FileDescriptorWatcher::WatchReadable(
-      progress_fd_,
-      base::BindRepeating(&PostinstallRunnerAction::OnProgressFdReady,
-                          base::Unretained(this)));
+  if (current_partition_ == install_plan_.partitions.size() &&
+      !HasRunningParallelPostinstall()) {
+    CompletePostinstall(ErrorCode::kSuccess);
+  }
 }
 
-void PostinstallRunnerAction::OnProgressFdReady() {
+void PostinstallRunnerAction::TerminateParallelPostinstall() {
+  for (auto& job : parallel_jobs_) {
+    if (job->command) {
+      // Calling KillExec() will discard the callback we registered.
+      Subprocess::Get().KillExec(job->command);
+      if (job->suspended && kill(job->command, SIGCONT) != 0) {
+        PLOG(ERROR) << "Couldn't resume child process " << job->command;
+      }
+      scheduler_.RemoveProcess(job->command);
+      job->command = 0;
+    }
+    CleanupParallelPostinstall(job.get());
+  }
+}
+
+void PostinstallRunnerAction::CleanupParallelPostinstall(
+    ParallelPostinstall* job) {
+  job->progress_controller.reset();
+  job->progress_fd = -1;
+  job->progress_buffer.clear();
+  job->suspended = false;
+  if (utils::IsMountpoint(job->mount_dir)) {
+    utils::UnmountFilesystem(job->mount_dir);
+  }
+  if (job->created_mount_dir) {
+    if (!DeleteMountDir(job->mount_dir)) {
+      PLOG(WARNING) << "Not removing mountpoint " << job->mount_dir;
+    }
+    job->created_mount_dir = false;
+  }
+}
+
+bool PostinstallRunnerAction::IsParallelPostinstall(size_t partition) const {
+  return std::any_of(parallel_jobs_.begin(),
+                     parallel_jobs_.end(),
+                     [partition](const auto& job) {
+                       return job->partition == partition;
+                     });
+}
+
+bool PostinstallRunnerAction::HasRunningParallelPostinstall() const {
+  return std::any_of(parallel_jobs_.begin(),
+                     parallel_jobs_.end(),
+                     [](const auto& job) { return job->command != 0; });
+}
+
+bool PostinstallRunnerAction::ReadProgressLines(int fd,
+                                                string* buffer,
+                                                vector<string>* lines) {
   char buf[1024];
   size_t bytes_read;
   do {
     bytes_read = 0;
     bool eof;
-    bool ok =
-        utils::ReadAll(progress_fd_, buf, std::size(buf), &bytes_read, &eof);
-    progress_buffer_.append(buf, bytes_read);
-    // Process every line.
-    vector<string> lines = base::SplitString(
-        progress_buffer_, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
-    if (!lines.empty()) {
-      progress_buffer_ = lines.back();
-      lines.pop_back();
-      for (const auto& line : lines) {
-        ProcessProgressLine(line);
-      }
+    bool ok = utils::ReadAll(fd, buf, std::size(buf), &bytes_read, &eof);
+    buffer->append(buf, bytes_read);
+    // Collect every complete line.
+    vector<string> new_lines = base::SplitString(
+        *buffer, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+    if (!new_lines.empty()) {
+      *buffer = new_lines.back();
+      new_lines.pop_back();
+      lines->insert(lines->end(), new_lines.begin(), new_lines.end());
     }
     if (!ok || eof) {
       // There was either an error or an EOF condition, so we are done watching
       // the file descriptor.
-      progress_controller_.reset();
-      return;
+      return false;
     }
   } while (bytes_read);
+  return true;
+}
+
+void PostinstallRunnerAction::OnProgressFdReady() {
+  vector<string> lines;
+  bool keep_watching =
+      ReadProgressLines(progress_fd_, &progress_buffer_, &lines);
+  for (const auto& line : lines) {
+    ProcessProgressLine(line);
+  }
+  if (!keep_watching) {
+    progress_controller_.reset();
+  }
+}
+
+void PostinstallRunnerAction::OnParallelProgressFdReady(size_t index) {
+  auto& job = *parallel_jobs_[index];
+  vector<string> lines;
+  bool keep_watching =
+      ReadProgressLines(job.progress_fd, &job.progress_buffer, &lines);
+  for (const auto& line : lines) {
+    double frac = 0;
+    if (ParseProgressLine(line, &frac)) {
+      job.progress = std::clamp(frac, 0., 1.);
+      ReportProgress(current_progress_);
+    }
+  }
+  if (!keep_watching) {
+    job.progress_controller.reset();
+  }
+}
+
+bool PostinstallRunnerAction::ParseProgressLine(const string& line,
+                                                double* frac) {
+  return sscanf(line.c_str(), "global_progress %lf", frac) == 1 &&
+         !std::isnan(*frac);
 }
 
 bool PostinstallRunnerAction::ProcessProgressLine(const string& line) {
   double frac = 0;
-  if (sscanf(line.c_str(), "global_progress %lf", &frac) == 1 &&
-      !std::isnan(frac)) {
+  if (ParseProgressLine(line, &frac)) {
     ReportProgress(frac);
     return true;
   }
@@ -357,30 +583,30 @@ bool PostinstallRunnerAction::ProcessProgressLine(const string& line) {
 }
 
 void PostinstallRunnerAction::ReportProgress(double frac) {
+  if (!std::isfinite(frac) || frac < 0)
+    frac = 0;
+  if (frac > 1)
+    frac = 1;
+  current_progress_ = frac;
   if (!delegate_)
     return;
-  if (current_partition_ >= partition_weight_.size() || total_weight_ == 0) {
+  if (total_weight_ == 0) {
     delegate_->ProgressUpdate(1.);
     return;
   }
-  if (!std::isfinite(frac) || frac < 0)
-    frac = 0;
-  if (frac > 1)
-    frac = 1;
-  double postinst_action_progress =
-      (accumulated_weight_ + partition_weight_[current_partition_] * frac) /
-      total_weight_;
-  delegate_->ProgressUpdate(postinst_action_progress);
+  double weight = accumulated_weight_;
+  if (current_partition_ < partition_weight_.size())
+    weight += partition_weight_[current_partition_] * frac;
+  for (const auto& job : parallel_jobs_) {
+    weight += partition_weight_[job->partition] * job->progress;
+  }
+  delegate_->ProgressUpdate(weight / total_weight_);
 }
 
 void PostinstallRunnerAction::Cleanup() {
   utils::UnmountFilesystem(fs_mount_dir_);
 #ifndef __ANDROID__
-#if BASE_VER < 800000
-  if (!base::DeleteFile(base::FilePath(fs_mount_dir_), true)) {
-#else
-  if (!base::DeleteFile(base::FilePath(fs_mount_dir_))) {
-#endif
+  if (!DeleteMountDir(fs_mount_dir_)) {
     PLOG(WARNING) << "Not removing temporary mountpoint " << fs_mount_dir_;
   }
 #endif
@@ -393,26 +619,13 @@ void PostinstallRunnerAction::Cleanup() {
 
 void PostinstallRunnerAction::CompletePartitionPostinstall(
     int return_code, const string& output) {
+  scheduler_.RemoveProcess(current_command_);
   current_command_ = 0;
   Cleanup();
 
   if (return_code != 0) {
     LOG(ERROR) << "Postinst command failed with code: " << return_code;
-    ErrorCode error_code = ErrorCode::kPostinstallRunnerError;
-
-    if (return_code == 3) {
-      // This special return code means that we tried to update firmware,
-      // but couldn't because we booted from FW B, and we need to reboot
-      // to get back to FW A.
-      error_code = ErrorCode::kPostinstallBootedFromFirmwareB;
-    }
-
-    if (return_code == 4) {
-      // This special return code means that we tried to update firmware,
-      // but couldn't because we booted from FW B, and we need to reboot
-      // to get back to FW A.
-      error_code = ErrorCode::kPostinstallFirmwareRONotUpdatable;
-    }
+    ErrorCode error_code = GetPostinstallErrorCode(return_code);
 
     // If postinstall script for this partition is optional we can ignore the
     // result.
@@ -439,6 +652,8 @@ PostinstallRunnerAction::~PostinstallRunnerAction() {
 }
 
 void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
+  TerminateParallelPostinstall();
+  scheduler_.Stop();
   // We only attempt to mark the new slot as active if all the postinstall
   // steps succeeded.
   DEFER {
@@ -477,6 +692,15 @@ void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
 }
 
 void PostinstallRunnerAction::SuspendAction() {
+  for (auto& job : parallel_jobs_) {
+    if (!job->command)
+      continue;
+    if (kill(job->command, SIGSTOP) != 0) {
+      PLOG(ERROR) << "Couldn't pause child process " << job->command;
+    } else {
+      job->suspended = true;
+    }
+  }
   if (!current_command_)
     return;
   if (kill(current_command_, SIGSTOP) != 0) {
@@ -487,6 +711,15 @@ void PostinstallRunnerAction::SuspendAction() {
 }
 
 void PostinstallRunnerAction::ResumeAction() {
+  for (auto& job : parallel_jobs_) {
+    if (!job->command)
+      continue;
+    if (kill(job->command, SIGCONT) != 0) {
+      PLOG(ERROR) << "Couldn't resume child process " << job->command;
+    } else {
+      job->suspended = false;
+    }
+  }
   if (!current_command_)
     return;
   if (kill(current_command_, SIGCONT) != 0) {
@@ -497,6 +730,8 @@ void PostinstallRunnerAction::ResumeAction() {
 }
 
 void PostinstallRunnerAction::TerminateProcessing() {
+  TerminateParallelPostinstall();
+  scheduler_.Stop();
   if (!current_command_)
     return;
   // Calling KillExec() will discard the callback we registered and therefore
@@ -29,6 +29,7 @@
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/postinstall_scheduler.h"
 
 // The Postinstall Runner Action is responsible for running the postinstall
 // script of a successfully downloaded update.
@@ -67,17 +68,77 @@ class PostinstallRunnerAction : public InstallPlanAction {
  private:
   friend class PostinstallRunnerActionTest;
   FRIEND_TEST(PostinstallRunnerActionTest, ProcessProgressLineTest);
+  FRIEND_TEST(PostinstallRunnerActionTest, ParallelProgressTest);
+
+  // The state of a postinstall program running concurrently with the others.
+  struct ParallelPostinstall {
+    // The index of the partition in the InstallPlan.
+    size_t partition{0};
+    // The mount point used only by this program.
+    std::string mount_dir;
+    // Whether |mount_dir| was created by us and should be removed.
+    bool created_mount_dir{false};
+    // The program pid, or 0 once it exited.
+    pid_t command{0};
+    // True if |command| has been suspended by SuspendAction().
+    bool suspended{false};
+    int progress_fd{-1};
+    std::unique_ptr<base::FileDescriptorWatcher::Controller>
+        progress_controller;
+    std::string progress_buffer;
+    // The last progress reported by the program, between 0 and 1.
+    double progress{0};
+  };
 
   // exposed for testing purposes only
   void SetMountDir(std::string dir) { fs_mount_dir_ = std::move(dir); }
   void EnsureUnmounted();
 
   void PerformPartitionPostinstall();
-  [[nodiscard]] bool MountPartition(
-      const InstallPlan::Partition& partition) noexcept;
+  [[nodiscard]] bool MountPartition(const InstallPlan::Partition& partition,
+                                    const std::string& mount_dir) noexcept;
+
+  // Builds in |command| the postinstall command line of |partition| mounted at
+  // |mount_dir|. Returns false if the postinstall path is not valid.
+  bool GetPostinstallCommand(const InstallPlan::Partition& partition,
+                             const std::string& mount_dir,
+                             std::vector<std::string>* command);
+
+  // Launches the postinstall programs of all the partitions flagged with
+  // |postinstall_parallel|, each on its own mount point, so they run while the
+  // rest of the partitions are processed one at a time. A partition that
+  // can't be launched this way is left to the serial pass.
+  void StartParallelPostinstall();
+
+  // Subprocess::Exec callback for the program in |parallel_jobs_[index]|.
+  void CompleteParallelPostinstall(size_t index,
+                                   int return_code,
+                                   const std::string& output);
+
+  // Kills the parallel postinstall programs still running and unmounts their
+  // partitions.
+  void TerminateParallelPostinstall();
+
+  // Stops watching the progress of |job|, unmounts its partition and removes
+  // its mount point if we created it.
+  static void CleanupParallelPostinstall(ParallelPostinstall* job);
+
+  // Whether |partition| was launched by StartParallelPostinstall().
+  bool IsParallelPostinstall(size_t partition) const;
+  bool HasRunningParallelPostinstall() const;
 
   // Called whenever the |progress_fd_| has data available to read.
   void OnProgressFdReady();
+  void OnParallelProgressFdReady(size_t index);
+
+  // Reads the available data in |fd| into |buffer| and returns in |lines| the
+  // complete lines read. Returns false once |fd| shouldn't be watched anymore.
+  static bool ReadProgressLines(int fd,
+                                std::string* buffer,
+                                std::vector<std::string>* lines);
+
+  // Parses a "global_progress <frac>" line into |frac|.
+  static bool ParseProgressLine(const std::string& line, double* frac);
 
   // Updates the action progress according to the |line| passed from the
   // postinstall program. Valid lines are:
@@ -88,7 +149,8 @@ class PostinstallRunnerAction : public InstallPlanAction {
 
   // Report the progress to the delegate given that the postinstall operation
   // for |current_partition_| has a current progress of |frac|, a value between
-  // 0 and 1 for that step.
+  // 0 and 1 for that step. The progress of the parallel postinstall programs is
+  // added to it.
   void ReportProgress(double frac);
 
   // Cleanup the setup made when running postinstall for a given partition.
@@ -123,6 +185,12 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // the |current_partition_|.
   double accumulated_weight_{0};
 
+  // The last progress reported for |current_partition_|.
+  double current_progress_{0};
+
+  // The postinstall programs started by StartParallelPostinstall().
+  std::vector<std::unique_ptr<ParallelPostinstall>> parallel_jobs_;
+
   // The delegate used to notify of progress updates, if any.
   DelegateInterface* delegate_{nullptr};
 
@@ -151,6 +219,9 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // A buffer of a partial read line from the progress file descriptor.
   std::string progress_buffer_;
 
+  // Sets the priorities of the postinstall programs from the device state.
+  PostinstallScheduler scheduler_;
+
   DISALLOW_COPY_AND_ASSIGN(PostinstallRunnerAction);
 };
 
@@ -269,6 +269,41 @@ TEST_F(PostinstallRunnerActionTest, ProcessProgressLineTest) {
   action.ProcessProgressLine("global_progress Exception in ... :)");
 }
 
+TEST_F(PostinstallRunnerActionTest, ParallelProgressTest) {
+  PostinstallRunnerAction action(&fake_boot_control_, &fake_hardware_);
+  testing::StrictMock<MockPostinstallRunnerActionDelegate> mock_delegate_;
+  action.set_delegate(&mock_delegate_);
+
+  // The first partition runs in parallel with the second one.
+  action.current_partition_ = 1;
+  action.partition_weight_ = {1, 2, 5};
+  action.accumulated_weight_ = 0;
+  action.total_weight_ = 8;
+  auto job = std::make_unique<PostinstallRunnerAction::ParallelPostinstall>();
+  job->partition = 0;
+  job->progress = 0.5;
+  action.parallel_jobs_.push_back(std::move(job));
+
+  // 50% of the first and the second actions is 1.5/8 of the total.
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(0.1875));
+  action.ProcessProgressLine("global_progress 0.5");
+  testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
+
+  // Progress read from the parallel program keeps the one of the second.
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  string lines = "global_progress 1\nglobal_progress";
+  ASSERT_TRUE(utils::WriteAll(fds[1], lines.data(), lines.size()));
+  close(fds[1]);
+  action.parallel_jobs_[0]->progress_fd = fds[0];
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(0.25));
+  action.OnParallelProgressFdReady(0);
+  testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
+  EXPECT_EQ(1., action.parallel_jobs_[0]->progress);
+  EXPECT_EQ("global_progress", action.parallel_jobs_[0]->progress_buffer);
+  close(fds[0]);
+}
+
 // Test that postinstall succeeds in the simple case of running the default
 // /postinst command which only exits 0.
 TEST_F(PostinstallRunnerActionTest, RunAsRootSimpleTest) {
@@ -0,0 +1,148 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/postinstall_scheduler.h"
+
+#include <errno.h>
+#include <sys/resource.h>
+
+#include <string>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+
+#include "update_engine/payload_consumer/io_scheduler.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr auto kStateCheckInterval = base::TimeDelta::FromSeconds(30);
+
+void GetIntConfig(const brillo::KeyValueStore& store,
+                  const std::string& key,
+                  int* value) {
+  std::string str;
+  if (store.GetString(key, &str) && !base::StringToInt(str, value)) {
+    LOG(WARNING) << "Ignoring invalid " << key << "=" << str;
+  }
+}
+
+}  // namespace
+
+PostinstallScheduler::Config PostinstallScheduler::LoadConfig(
+    const brillo::KeyValueStore& store) {
+  Config config;
+  GetIntConfig(store, "POSTINSTALL_IDLE_NICE", &config.idle_nice);
+  GetIntConfig(store, "POSTINSTALL_BUSY_NICE", &config.busy_nice);
+  GetIntConfig(store, "POSTINSTALL_IDLE_IOPRIO", &config.idle_ioprio);
+  GetIntConfig(store, "POSTINSTALL_BUSY_IOPRIO", &config.busy_ioprio);
+  GetIntConfig(store, "POSTINSTALL_MAX_TEMP", &config.max_temp);
+  store.GetBoolean("POSTINSTALL_CPU_SHARES", &config.cpu_shares);
+  return config;
+}
+
+void PostinstallScheduler::Start(const Config& config) {
+  config_ = config;
+  started_ = true;
+  idle_ = IsDeviceIdle();
+  LOG(INFO) << "The device is " << (idle_ ? "idle" : "busy")
+            << ", running postinstall at nice "
+            << (idle_ ? config_.idle_nice : config_.busy_nice) << ".";
+  if (config_.cpu_shares) {
+    SetCpuShares(idle_ ? CpuShares::kHigh : CpuShares::kNormal);
+  }
+  check_task_.Cancel();
+  ScheduleStateCheck();
+}
+
+void PostinstallScheduler::Stop() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  check_task_.Cancel();
+  processes_.clear();
+  if (config_.cpu_shares) {
+    SetCpuShares(CpuShares::kNormal);
+  }
+}
+
+void PostinstallScheduler::AddProcess(pid_t pid) {
+  if (!started_ || pid <= 0) {
+    return;
+  }
+  processes_.insert(pid);
+  ApplyPriority(pid);
+}
+
+void PostinstallScheduler::RemoveProcess(pid_t pid) {
+  processes_.erase(pid);
+}
+
+bool PostinstallScheduler::SetProcessPriority(pid_t pid, int nice, int ioprio) {
+  bool success = true;
+  if (setpriority(PRIO_PROCESS, pid, nice) != 0) {
+    PLOG(WARNING) << "Failed to set the nice value of process " << pid;
+    success = false;
+  }
+  return SetProcessIoPriority(pid, ioprio) && success;
+}
+
+bool PostinstallScheduler::SetCpuShares(CpuShares shares) {
+  return cpu_limiter_.SetCpuShares(shares);
+}
+
+bool PostinstallScheduler::IsDeviceIdle() const {
+  const DeviceConditions conditions = hardware_->GetDeviceConditions();
+  return conditions.charging && !conditions.screen_on &&
+         (config_.max_temp <= 0 || conditions.max_temp <= config_.max_temp);
+}
+
+void PostinstallScheduler::CheckDeviceState() {
+  const bool idle = IsDeviceIdle();
+  if (idle != idle_) {
+    LOG(INFO) << "The device became " << (idle ? "idle" : "busy")
+              << ", updating the postinstall priorities.";
+    idle_ = idle;
+    if (config_.cpu_shares) {
+      SetCpuShares(idle_ ? CpuShares::kHigh : CpuShares::kNormal);
+    }
+    for (pid_t pid : processes_) {
+      ApplyPriority(pid);
+    }
+  }
+  ScheduleStateCheck();
+}
+
+void PostinstallScheduler::ScheduleStateCheck() {
+  if (!check_task_.PostTask(
+          FROM_HERE,
+          [this]() { CheckDeviceState(); },
+          kStateCheckInterval)) {
+    LOG(WARNING) << "Unable to schedule the device state check.";
+  }
+}
+
+void PostinstallScheduler::ApplyPriority(pid_t pid) {
+  const int nice = idle_ ? config_.idle_nice : config_.busy_nice;
+  const int level = idle_ ? config_.idle_ioprio : config_.busy_ioprio;
+  if (!SetProcessPriority(pid, nice, BestEffortIoPriority(level))) {
+    LOG(WARNING) << "Unable to set the priority of postinstall process " << pid;
+  }
+}
+
+}  // namespace chromeos_update_engine
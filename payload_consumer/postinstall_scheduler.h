@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_POSTINSTALL_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_POSTINSTALL_SCHEDULER_H_
+
+#include <sys/types.h>
+
+#include <set>
+#include <string>
+
+#include <base/macros.h>
+#include <brillo/key_value_store.h>
+#include <brillo/message_loops/message_loop.h>
+
+#include "update_engine/common/cpu_limiter.h"
+#include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/scoped_task_id.h"
+
+namespace chromeos_update_engine {
+
+// Sets the CPU and I/O priorities of the postinstall programs according to
+// whether the device is idle, that is charging, with the screen off and not
+// hot. On an idle device postinstall runs at a higher priority so it finishes
+// sooner, otherwise at a lower one so it doesn't slow down the foreground. The
+// device state is checked again every 30 seconds.
+//
+// The priorities are read from update_engine.conf:
+//   POSTINSTALL_IDLE_NICE, POSTINSTALL_BUSY_NICE: the nice values.
+//   POSTINSTALL_IDLE_IOPRIO, POSTINSTALL_BUSY_IOPRIO: the best-effort I/O
+//       priority levels, from 0 (the highest) to 7.
+//   POSTINSTALL_MAX_TEMP: the temperature in millidegrees Celsius above which
+//       the device isn't idle, 0 to ignore the temperature.
+//   POSTINSTALL_CPU_SHARES: whether to also raise the cgroup cpu shares of the
+//       daemon, which the postinstall programs inherit, while idle.
+class PostinstallScheduler {
+ public:
+  struct Config {
+    int idle_nice{0};
+    int busy_nice{10};
+    int idle_ioprio{0};
+    int busy_ioprio{7};
+    int max_temp{45000};
+    bool cpu_shares{false};
+  };
+
+  // Returns the config in |store|, with the defaults for the missing keys.
+  static Config LoadConfig(const brillo::KeyValueStore& store);
+
+  // The device state is read from |hardware|.
+  explicit PostinstallScheduler(HardwareInterface* hardware)
+      : hardware_(hardware) {}
+  virtual ~PostinstallScheduler() = default;
+
+  // Starts checking the device state with |config|.
+  void Start(const Config& config);
+
+  // Stops checking the device state, forgets the processes and restores the
+  // cpu shares.
+  void Stop();
+
+  // Applies the current priorities to |pid| and to every change of the device
+  // state until RemoveProcess().
+  void AddProcess(pid_t pid);
+  void RemoveProcess(pid_t pid);
+
+  bool idle() const { return idle_; }
+
+ protected:
+  // Sets the nice value and the I/O priority of |pid|, which tests override.
+  virtual bool SetProcessPriority(pid_t pid, int nice, int ioprio);
+  virtual bool SetCpuShares(CpuShares shares);
+
+ private:
+  // Returns whether the device is charging, with the screen off and not hotter
+  // than |config_.max_temp|.
+  bool IsDeviceIdle() const;
+
+  // Rechecks the device state and applies the priorities when it changed.
+  void CheckDeviceState();
+  void ScheduleStateCheck();
+
+  void ApplyPriority(pid_t pid);
+
+  HardwareInterface* hardware_;
+  Config config_;
+  bool started_{false};
+  bool idle_{false};
+  std::set<pid_t> processes_;
+
+  CPULimiter cpu_limiter_;
+  ScopedTaskId check_task_;
+
+  DISALLOW_COPY_AND_ASSIGN(PostinstallScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_POSTINSTALL_SCHEDULER_H_
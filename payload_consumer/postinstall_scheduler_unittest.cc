@@ -0,0 +1,147 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/postinstall_scheduler.h"
+
+#include <tuple>
+#include <vector>
+
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/payload_consumer/io_scheduler.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Records the priorities instead of setting them.
+class TestPostinstallScheduler : public PostinstallScheduler {
+ public:
+  using PostinstallScheduler::PostinstallScheduler;
+
+  std::vector<std::tuple<pid_t, int, int>> priorities;
+  std::vector<CpuShares> shares;
+
+ protected:
+  bool SetProcessPriority(pid_t pid, int nice, int ioprio) override {
+    priorities.emplace_back(pid, nice, ioprio);
+    return true;
+  }
+  bool SetCpuShares(CpuShares cpu_shares) override {
+    shares.push_back(cpu_shares);
+    return true;
+  }
+};
+
+}  // namespace
+
+class PostinstallSchedulerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    SetIdleState();
+  }
+
+  void SetIdleState() {
+    conditions_ = {};
+    conditions_.charging = true;
+    conditions_.screen_on = false;
+    conditions_.max_temp = 30000;
+    fake_hardware_.SetDeviceConditions(conditions_);
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  FakeHardware fake_hardware_;
+  DeviceConditions conditions_;
+};
+
+TEST_F(PostinstallSchedulerTest, LoadConfigTest) {
+  brillo::KeyValueStore store;
+  store.SetString("POSTINSTALL_IDLE_NICE", "-5");
+  store.SetString("POSTINSTALL_BUSY_IOPRIO", "6");
+  store.SetString("POSTINSTALL_MAX_TEMP", "not a number");
+  store.SetBoolean("POSTINSTALL_CPU_SHARES", true);
+  const auto config = PostinstallScheduler::LoadConfig(store);
+  EXPECT_EQ(-5, config.idle_nice);
+  EXPECT_EQ(10, config.busy_nice);
+  EXPECT_EQ(0, config.idle_ioprio);
+  EXPECT_EQ(6, config.busy_ioprio);
+  EXPECT_EQ(45000, config.max_temp);
+  EXPECT_TRUE(config.cpu_shares);
+}
+
+TEST_F(PostinstallSchedulerTest, IdleDeviceTest) {
+  TestPostinstallScheduler scheduler(&fake_hardware_);
+  scheduler.Start({});
+  EXPECT_TRUE(scheduler.idle());
+  scheduler.AddProcess(42);
+  ASSERT_EQ(1u, scheduler.priorities.size());
+  EXPECT_EQ(std::make_tuple(42, 0, BestEffortIoPriority(0)),
+            scheduler.priorities[0]);
+  EXPECT_TRUE(scheduler.shares.empty());
+  scheduler.Stop();
+}
+
+TEST_F(PostinstallSchedulerTest, BusyDeviceTest) {
+  const std::vector<void (*)(DeviceConditions*)> busy_states = {
+      [](DeviceConditions* conditions) { conditions->charging = false; },
+      [](DeviceConditions* conditions) { conditions->screen_on = true; },
+      [](DeviceConditions* conditions) { conditions->max_temp = 50000; }};
+  for (const auto& set_busy : busy_states) {
+    SetIdleState();
+    set_busy(&conditions_);
+    fake_hardware_.SetDeviceConditions(conditions_);
+    TestPostinstallScheduler scheduler(&fake_hardware_);
+    scheduler.Start({});
+    EXPECT_FALSE(scheduler.idle());
+    scheduler.AddProcess(42);
+    ASSERT_EQ(1u, scheduler.priorities.size());
+    EXPECT_EQ(std::make_tuple(42, 10, BestEffortIoPriority(7)),
+              scheduler.priorities[0]);
+    scheduler.Stop();
+  }
+}
+
+TEST_F(PostinstallSchedulerTest, DeviceStateChangeTest) {
+  conditions_.screen_on = true;
+  fake_hardware_.SetDeviceConditions(conditions_);
+  TestPostinstallScheduler scheduler(&fake_hardware_);
+  PostinstallScheduler::Config config;
+  config.cpu_shares = true;
+  scheduler.Start(config);
+  scheduler.AddProcess(42);
+  scheduler.AddProcess(43);
+  scheduler.RemoveProcess(43);
+  EXPECT_FALSE(scheduler.idle());
+
+  conditions_.screen_on = false;
+  fake_hardware_.SetDeviceConditions(conditions_);
+  ASSERT_TRUE(loop_.RunOnce(true));
+  EXPECT_TRUE(scheduler.idle());
+  ASSERT_EQ(3u, scheduler.priorities.size());
+  EXPECT_EQ(std::make_tuple(42, 0, BestEffortIoPriority(0)),
+            scheduler.priorities[2]);
+
+  scheduler.Stop();
+  EXPECT_FALSE(loop_.PendingTasks());
+  EXPECT_EQ((std::vector<CpuShares>{
+                CpuShares::kNormal, CpuShares::kHigh, CpuShares::kNormal}),
+            scheduler.shares);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/scratch_buffer_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace chromeos_update_engine {
+
+namespace {
+bool CapacityLess(const brillo::Blob& a, const brillo::Blob& b) {
+  return a.capacity() < b.capacity();
+}
+}  // namespace
+
+ScratchBufferPool::Buffer::Buffer(ScratchBufferPool* pool, brillo::Blob blob)
+    : pool_(pool), blob_(std::move(blob)) {}
+
+ScratchBufferPool::Buffer::Buffer(Buffer&& other)
+    : pool_(other.pool_), blob_(std::move(other.blob_)) {
+  other.pool_ = nullptr;
+}
+
+ScratchBufferPool::Buffer::~Buffer() {
+  if (pool_ != nullptr) {
+    pool_->Release(std::move(blob_));
+  }
+}
+
+ScratchBufferPool::Buffer ScratchBufferPool::Acquire(size_t size) {
+  brillo::Blob blob;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_buffers_.empty()) {
+      // Take the smallest buffer that fits. If none does, grow the largest
+      // one, which frees the old allocation instead of keeping it around.
+      auto it = std::find_if(
+          free_buffers_.begin(),
+          free_buffers_.end(),
+          [size](const brillo::Blob& b) { return b.capacity() >= size; });
+      if (it == free_buffers_.end()) {
+        it = std::prev(free_buffers_.end());
+      }
+      pooled_bytes_ -= it->capacity();
+      blob = std::move(*it);
+      free_buffers_.erase(it);
+    }
+  }
+  blob.resize(size);
+  return Buffer(this, std::move(blob));
+}
+
+size_t ScratchBufferPool::pooled_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pooled_bytes_;
+}
+
+void ScratchBufferPool::Release(brillo::Blob blob) {
+  if (blob.capacity() == 0 || blob.capacity() > max_pooled_bytes_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  pooled_bytes_ += blob.capacity();
+  free_buffers_.insert(std::upper_bound(free_buffers_.begin(),
+                                        free_buffers_.end(),
+                                        blob,
+                                        CapacityLess),
+                       std::move(blob));
+  while (pooled_bytes_ > max_pooled_bytes_) {
+    pooled_bytes_ -= free_buffers_.front().capacity();
+    free_buffers_.erase(free_buffers_.begin());
+  }
+}
+
+}  // namespace chromeos_update_engine
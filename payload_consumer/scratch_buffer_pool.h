@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SCRATCH_BUFFER_POOL_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SCRATCH_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// Recycles the scratch buffers diff operations read their source into or
+// patch their target into, so consecutive operations of a partition reuse the
+// same memory instead of allocating and faulting in fresh pages every time.
+//
+// Released buffers are kept as long as the capacity of all kept buffers stays
+// within |max_pooled_bytes|; the smallest ones are dropped first, so the pool
+// converges to buffers of the size the largest operations need. Buffers
+// larger than the limit are freed on release. Safe to use from multiple
+// threads.
+class ScratchBufferPool {
+ public:
+  static constexpr size_t kDefaultMaxPooledBytes = 32 * 1024 * 1024;  // 32 MiB
+
+  // A buffer borrowed from a pool, handed back to it on destruction.
+  class Buffer {
+   public:
+    Buffer(Buffer&& other);
+    ~Buffer();
+
+    uint8_t* data() { return blob_.data(); }
+    size_t size() const { return blob_.size(); }
+    // The underlying blob, for APIs which fill a blob themselves. It may be
+    // resized freely.
+    brillo::Blob* blob() { return &blob_; }
+
+   private:
+    friend class ScratchBufferPool;
+    Buffer(ScratchBufferPool* pool, brillo::Blob blob);
+
+    ScratchBufferPool* pool_;
+    brillo::Blob blob_;
+
+    DISALLOW_COPY_AND_ASSIGN(Buffer);
+  };
+
+  explicit ScratchBufferPool(size_t max_pooled_bytes = kDefaultMaxPooledBytes)
+      : max_pooled_bytes_(max_pooled_bytes) {}
+
+  // Returns a buffer of |size| bytes. The contents are unspecified.
+  Buffer Acquire(size_t size);
+
+  // Total capacity of the buffers currently kept for reuse.
+  size_t pooled_bytes() const;
+
+ private:
+  void Release(brillo::Blob blob);
+
+  const size_t max_pooled_bytes_;
+
+  mutable std::mutex mutex_;
+  // Buffers not borrowed by anyone, in ascending order of capacity.
+  std::vector<brillo::Blob> free_buffers_;
+  size_t pooled_bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ScratchBufferPool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SCRATCH_BUFFER_POOL_H_
@@ -0,0 +1,84 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/scratch_buffer_pool.h"
+
+#include <utility>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(ScratchBufferPoolTest, ReusesReleasedBuffers) {
+  ScratchBufferPool pool(1024);
+  const uint8_t* data = nullptr;
+  {
+    auto buffer = pool.Acquire(512);
+    ASSERT_EQ(512u, buffer.size());
+    data = buffer.data();
+  }
+  ASSERT_LE(512u, pool.pooled_bytes());
+  auto buffer = pool.Acquire(256);
+  ASSERT_EQ(256u, buffer.size());
+  ASSERT_EQ(data, buffer.data());
+  ASSERT_EQ(0u, pool.pooled_bytes());
+}
+
+TEST(ScratchBufferPoolTest, PicksSmallestFittingBuffer) {
+  ScratchBufferPool pool(4096);
+  const uint8_t* small_data = nullptr;
+  {
+    auto small = pool.Acquire(128);
+    auto large = pool.Acquire(1024);
+    small_data = small.data();
+  }
+  auto buffer = pool.Acquire(100);
+  ASSERT_EQ(small_data, buffer.data());
+}
+
+TEST(ScratchBufferPoolTest, OversizedBuffersAreNotKept) {
+  ScratchBufferPool pool(1024);
+  { auto buffer = pool.Acquire(2048); }
+  ASSERT_EQ(0u, pool.pooled_bytes());
+}
+
+TEST(ScratchBufferPoolTest, DropsSmallestBuffersOverLimit) {
+  ScratchBufferPool pool(1024);
+  const uint8_t* largest_data = nullptr;
+  {
+    auto first = pool.Acquire(512);
+    auto second = pool.Acquire(400);
+    auto third = pool.Acquire(600);
+    largest_data = third.data();
+  }
+  ASSERT_LE(pool.pooled_bytes(), 1024u);
+  // The largest buffer is the one worth keeping.
+  auto buffer = pool.Acquire(600);
+  ASSERT_EQ(largest_data, buffer.data());
+}
+
+TEST(ScratchBufferPoolTest, MovedBufferIsReleasedOnce) {
+  ScratchBufferPool pool(1024);
+  {
+    auto buffer = pool.Acquire(100);
+    ScratchBufferPool::Buffer moved(std::move(buffer));
+    ASSERT_EQ(100u, moved.size());
+  }
+  ASSERT_LE(100u, pool.pooled_bytes());
+  ASSERT_GE(1024u, pool.pooled_bytes());
+}
+
+}  // namespace chromeos_update_engine
@@ -21,6 +21,7 @@
 
 #include <libsnapshot/cow_writer.h>
 
+#include "update_engine/payload_consumer/io_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -28,6 +29,11 @@ namespace chromeos_update_engine {
 bool SnapshotExtentWriter::WriteExtent(const void* bytes,
                                        const Extent& extent,
                                        size_t block_size) {
+  IoScheduler::GetInstance()->AcquireWrite(extent.num_blocks() * block_size);
+  if (batcher_ != nullptr) {
+    return batcher_->AddRawBlocks(
+        extent.start_block(), bytes, extent.num_blocks() * block_size);
+  }
   return cow_writer_->AddRawBlocks(
       extent.start_block(), bytes, extent.num_blocks() * block_size);
 }
@@ -23,6 +23,7 @@
 #include <libsnapshot/cow_writer.h>
 
 #include "update_engine/payload_consumer/block_extent_writer.h"
+#include "update_engine/payload_consumer/cow_write_batcher.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -31,12 +32,16 @@ class SnapshotExtentWriter final : public BlockExtentWriter {
  public:
   explicit SnapshotExtentWriter(android::snapshot::ICowWriter* cow_writer)
       : cow_writer_(cow_writer) {}
+  // Queues the blocks in |batcher| instead of writing them right away.
+  explicit SnapshotExtentWriter(CowWriteBatcher* batcher)
+      : cow_writer_(nullptr), batcher_(batcher) {}
   bool WriteExtent(const void* bytes,
                    const Extent& extent,
                    size_t block_size) override;
 
  private:
   android::snapshot::ICowWriter* cow_writer_;
+  CowWriteBatcher* batcher_{nullptr};
 };
 
 }  // namespace chromeos_update_engine
@@ -209,4 +209,34 @@ TEST_F(SnapshotExtentWriterTest, WriteAcrossBlockBoundary) {
                      cow_writer_.operations_[125].data.end());
   ASSERT_EQ(buf, actual_data);
 }
+
+TEST_F(SnapshotExtentWriterTest, BatchedWritesCoalesce) {
+  CowWriteBatcher batcher(
+      &cow_writer_, kBlockSize, CowWriteBatcher::kDefaultBatchSize);
+  std::vector<uint8_t> buf(kBlockSize * 4);
+  std::iota(buf.begin(), buf.end(), 0);
+
+  // Contiguous blocks of consecutive extents and writers end up in a single
+  // COW operation once flushed.
+  {
+    SnapshotExtentWriter writer(&batcher);
+    google::protobuf::RepeatedPtrField<Extent> extents;
+    AddExtent(&extents, 10, 1);
+    AddExtent(&extents, 11, 2);
+    writer.Init(extents, kBlockSize);
+    ASSERT_TRUE(writer.Write(buf.data(), kBlockSize * 3));
+  }
+  {
+    SnapshotExtentWriter writer(&batcher);
+    google::protobuf::RepeatedPtrField<Extent> extents;
+    AddExtent(&extents, 13, 1);
+    writer.Init(extents, kBlockSize);
+    ASSERT_TRUE(writer.Write(buf.data() + kBlockSize * 3, kBlockSize));
+  }
+  ASSERT_TRUE(cow_writer_.operations_.empty());
+  ASSERT_TRUE(batcher.Flush());
+  ASSERT_EQ(1U, cow_writer_.operations_.size());
+  ASSERT_EQ(buf, cow_writer_.operations_[10].data);
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,57 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_data_cache.h"
+
+namespace chromeos_update_engine {
+
+std::shared_ptr<const brillo::Blob> SourceDataCache::Get(
+    const std::string& src_hash) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(src_hash);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->second;
+}
+
+void SourceDataCache::Put(const std::string& src_hash,
+                          std::shared_ptr<const brillo::Blob> data) {
+  if (!data || data->size() > max_bytes_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (index_.count(src_hash)) {
+    // Concurrent operations with the same source may both have read it.
+    return;
+  }
+  cached_bytes_ += data->size();
+  entries_.emplace_front(src_hash, std::move(data));
+  index_[src_hash] = entries_.begin();
+  while (cached_bytes_ > max_bytes_) {
+    cached_bytes_ -= entries_.back().second->size();
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+}
+
+size_t SourceDataCache::cached_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cached_bytes_;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,70 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_DATA_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_DATA_CACHE_H_
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// Keeps the source data of the last diff operations of a partition by the
+// hash of their source extents, so operations patching the same source, e.g.
+// an APK split in several operations, don't read it again. The least recently
+// used data is dropped once the cached data exceeds |max_bytes|. Safe to use
+// from multiple threads.
+class SourceDataCache {
+ public:
+  static constexpr size_t kDefaultMaxBytes = 32 * 1024 * 1024;  // 32 MiB
+
+  explicit SourceDataCache(size_t max_bytes = kDefaultMaxBytes)
+      : max_bytes_(max_bytes) {}
+
+  // Returns the data cached for |src_hash|, or nullptr.
+  std::shared_ptr<const brillo::Blob> Get(const std::string& src_hash);
+
+  // Caches |data| hashing to |src_hash|, unless it's larger than the cache.
+  void Put(const std::string& src_hash,
+           std::shared_ptr<const brillo::Blob> data);
+
+  size_t cached_bytes() const;
+
+ private:
+  using Entry = std::pair<std::string, std::shared_ptr<const brillo::Blob>>;
+
+  const size_t max_bytes_;
+
+  mutable std::mutex mutex_;
+  // From the most to the least recently used.
+  std::list<Entry> entries_;
+  std::map<std::string, std::list<Entry>::iterator> index_;
+  size_t cached_bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SourceDataCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_DATA_CACHE_H_
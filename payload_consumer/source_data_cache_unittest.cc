@@ -0,0 +1,53 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_data_cache.h"
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(SourceDataCacheTest, ReturnsCachedData) {
+  SourceDataCache cache(1024);
+  EXPECT_EQ(nullptr, cache.Get("a"));
+  auto data = std::make_shared<const brillo::Blob>(512, 'a');
+  cache.Put("a", data);
+  EXPECT_EQ(data, cache.Get("a"));
+  EXPECT_EQ(512u, cache.cached_bytes());
+}
+
+TEST(SourceDataCacheTest, DropsLeastRecentlyUsed) {
+  SourceDataCache cache(1024);
+  cache.Put("a", std::make_shared<const brillo::Blob>(512, 'a'));
+  cache.Put("b", std::make_shared<const brillo::Blob>(512, 'b'));
+  ASSERT_NE(nullptr, cache.Get("a"));
+  cache.Put("c", std::make_shared<const brillo::Blob>(512, 'c'));
+  EXPECT_NE(nullptr, cache.Get("a"));
+  EXPECT_EQ(nullptr, cache.Get("b"));
+  EXPECT_NE(nullptr, cache.Get("c"));
+  EXPECT_EQ(1024u, cache.cached_bytes());
+}
+
+TEST(SourceDataCacheTest, OversizedDataIsNotCached) {
+  SourceDataCache cache(1024);
+  cache.Put("a", std::make_shared<const brillo::Blob>(2048, 'a'));
+  EXPECT_EQ(nullptr, cache.Get("a"));
+  EXPECT_EQ(0u, cache.cached_bytes());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,152 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_prefetcher.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/file_descriptor_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+bool ShouldPrefetch(const InstallOperation& operation) {
+  return operation.type() != InstallOperation::SOURCE_COPY &&
+         operation.type() != InstallOperation::PARTITION_COPY &&
+         operation.has_src_sha256_hash() && operation.src_extents_size() > 0;
+}
+}  // namespace
+
+SourceHashPrefetcher::SourceHashPrefetcher(FileDescriptorPtr source_fd,
+                                           size_t block_size,
+                                           size_t depth)
+    : source_fd_(std::move(source_fd)),
+      block_size_(block_size),
+      depth_(std::max<size_t>(depth, 1)),
+      worker_(&SourceHashPrefetcher::WorkerLoop, this) {}
+
+SourceHashPrefetcher::~SourceHashPrefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+std::deque<SourceHashPrefetcher::Entry>::iterator
+SourceHashPrefetcher::FindEntry(size_t op_index) {
+  return std::find_if(
+      entries_.begin(), entries_.end(), [op_index](const Entry& entry) {
+        return entry.op_index == op_index;
+      });
+}
+
+void SourceHashPrefetcher::Prefetch(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    size_t op_index) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The entry being hashed is kept, the worker still refers to it.
+    entries_.erase(std::remove_if(entries_.begin(),
+                                  entries_.end(),
+                                  [op_index](const Entry& entry) {
+                                    return entry.op_index < op_index &&
+                                           entry.state != State::kHashing;
+                                  }),
+                   entries_.end());
+    next_op_index_ = std::max(next_op_index_, op_index);
+    const size_t end =
+        std::min<size_t>(operations.size(), op_index + depth_);
+    for (; next_op_index_ < end; next_op_index_++) {
+      const auto& operation = operations[next_op_index_];
+      if (ShouldPrefetch(operation)) {
+        entries_.push_back(
+            {next_op_index_, &operation, State::kQueued, brillo::Blob()});
+      }
+    }
+  }
+  cv_.notify_all();
+}
+
+std::optional<brillo::Blob> SourceHashPrefetcher::TakeSourceHash(
+    const InstallOperation& operation) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = std::find_if(
+      entries_.begin(), entries_.end(), [&operation](const Entry& entry) {
+        return entry.operation == &operation;
+      });
+  if (it == entries_.end()) {
+    return std::nullopt;
+  }
+  const size_t op_index = it->op_index;
+  cv_.wait(lock, [this, op_index] {
+    auto entry = FindEntry(op_index);
+    return entry == entries_.end() || entry->state != State::kHashing;
+  });
+  it = FindEntry(op_index);
+  if (it == entries_.end()) {
+    return std::nullopt;
+  }
+  std::optional<brillo::Blob> hash;
+  if (it->state == State::kDone) {
+    hash = std::move(it->hash);
+  }
+  entries_.erase(it);
+  return hash;
+}
+
+void SourceHashPrefetcher::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    auto queued = [this] {
+      return std::find_if(
+          entries_.begin(), entries_.end(), [](const Entry& entry) {
+            return entry.state == State::kQueued;
+          });
+    };
+    cv_.wait(lock, [this, &queued] {
+      return stopping_ || queued() != entries_.end();
+    });
+    if (stopping_) {
+      return;
+    }
+    auto it = queued();
+    it->state = State::kHashing;
+    const size_t op_index = it->op_index;
+    const InstallOperation* operation = it->operation;
+    lock.unlock();
+
+    brillo::Blob hash;
+    const bool success = fd_utils::ReadAndHashExtents(
+        source_fd_, operation->src_extents(), block_size_, &hash);
+    LOG_IF(WARNING, !success) << "Failed to prefetch source of operation "
+                              << op_index;
+
+    lock.lock();
+    it = FindEntry(op_index);
+    if (it != entries_.end()) {
+      it->state = success ? State::kDone : State::kFailed;
+      it->hash = std::move(hash);
+    }
+    cv_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_PREFETCHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_PREFETCHER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Reads and hashes the source extents of upcoming install operations on a
+// background thread, so the source partition is read while the current
+// operation is still being downloaded or patched. At most |depth| operations
+// are prefetched at a time and only their hashes are kept; the data itself is
+// read again by the operation, usually from the page cache.
+//
+// Only operations which verify a source hash before being applied are
+// prefetched. SOURCE_COPY is skipped, it hashes its source while copying, and
+// so is PARTITION_COPY, which reads another partition.
+class SourceHashPrefetcher {
+ public:
+  // |source_fd| must support positional reads, i.e. Fd() must not be -1.
+  SourceHashPrefetcher(FileDescriptorPtr source_fd,
+                       size_t block_size,
+                       size_t depth);
+  ~SourceHashPrefetcher();
+
+  // Queues the operations of |operations| in [|op_index|, |op_index| +
+  // depth) which aren't queued yet. Results of operations before |op_index|
+  // which were never taken are dropped.
+  void Prefetch(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+      size_t op_index);
+
+  // Returns the hash of the source extents of |operation|, which must be one
+  // of the operations passed to Prefetch(), and forgets about it. Waits if the
+  // hash is being computed right now. Returns nullopt if |operation| wasn't
+  // hashed yet, in which case it is no longer prefetched, or reading its
+  // source failed.
+  std::optional<brillo::Blob> TakeSourceHash(const InstallOperation& operation);
+
+ private:
+  enum class State { kQueued, kHashing, kDone, kFailed };
+  struct Entry {
+    size_t op_index;
+    const InstallOperation* operation;
+    State state;
+    brillo::Blob hash;
+  };
+
+  void WorkerLoop();
+
+  // Returns the entry of operation |op_index|, or entries_.end().
+  std::deque<Entry>::iterator FindEntry(size_t op_index);
+
+  const FileDescriptorPtr source_fd_;
+  const size_t block_size_;
+  const size_t depth_;
+
+  std::mutex mutex_;
+  // Signalled when an entry is queued or finished, or |stopping_| is set.
+  std::condition_variable cv_;
+  // Prefetched operations in ascending |op_index| order.
+  std::deque<Entry> entries_;
+  // Index of the first operation Prefetch() didn't look at yet.
+  size_t next_op_index_{0};
+  bool stopping_{false};
+  std::thread worker_;
+
+  DISALLOW_COPY_AND_ASSIGN(SourceHashPrefetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_PREFETCHER_H_
@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_prefetcher.h"
+
+#include <fcntl.h>
+
+#include <memory>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 8;
+}  // namespace
+
+class SourceHashPrefetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    source_data_.resize(kNumBlocks * kBlockSize);
+    test_utils::FillWithData(&source_data_);
+    ASSERT_TRUE(utils::WriteFile(
+        source_file_.path().c_str(), source_data_.data(), source_data_.size()));
+    ASSERT_TRUE(source_fd_->Open(source_file_.path().c_str(), O_RDONLY));
+  }
+
+  // Adds a SOURCE_BSDIFF operation reading |num_blocks| blocks at
+  // |start_block| to |operations_| and returns the expected source hash.
+  brillo::Blob AddOperation(uint64_t start_block, uint64_t num_blocks) {
+    InstallOperation* op = operations_.Add();
+    op->set_type(InstallOperation::SOURCE_BSDIFF);
+    *op->add_src_extents() = ExtentForRange(start_block, num_blocks);
+    brillo::Blob hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        source_data_.data() + start_block * kBlockSize,
+        num_blocks * kBlockSize,
+        &hash));
+    // The prefetcher only looks at operations which carry a source hash.
+    op->set_src_sha256_hash(hash.data(), hash.size());
+    return hash;
+  }
+
+  ScopedTempFile source_file_{"source_hash_prefetcher.XXXXXX"};
+  brillo::Blob source_data_;
+  FileDescriptorPtr source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  google::protobuf::RepeatedPtrField<InstallOperation> operations_;
+};
+
+TEST_F(SourceHashPrefetcherTest, HashesUpcomingOperations) {
+  const brillo::Blob first_hash = AddOperation(0, 2);
+  const brillo::Blob second_hash = AddOperation(4, 3);
+  SourceHashPrefetcher prefetcher(source_fd_, kBlockSize, 4);
+  prefetcher.Prefetch(operations_, 0);
+
+  auto hash = prefetcher.TakeSourceHash(operations_[0]);
+  // The worker may not have reached the operation yet.
+  if (hash.has_value()) {
+    ASSERT_EQ(first_hash, *hash);
+  }
+  hash = prefetcher.TakeSourceHash(operations_[1]);
+  if (hash.has_value()) {
+    ASSERT_EQ(second_hash, *hash);
+  }
+  // Taken hashes are forgotten.
+  ASSERT_FALSE(prefetcher.TakeSourceHash(operations_[0]).has_value());
+}
+
+TEST_F(SourceHashPrefetcherTest, SkipsSourceCopy) {
+  AddOperation(0, 1);
+  operations_[0].set_type(InstallOperation::SOURCE_COPY);
+  SourceHashPrefetcher prefetcher(source_fd_, kBlockSize, 4);
+  prefetcher.Prefetch(operations_, 0);
+  ASSERT_FALSE(prefetcher.TakeSourceHash(operations_[0]).has_value());
+}
+
+TEST_F(SourceHashPrefetcherTest, OnlyPrefetchesUpToDepth) {
+  AddOperation(0, 1);
+  AddOperation(1, 1);
+  AddOperation(2, 1);
+  SourceHashPrefetcher prefetcher(source_fd_, kBlockSize, 1);
+  prefetcher.Prefetch(operations_, 1);
+  ASSERT_FALSE(prefetcher.TakeSourceHash(operations_[0]).has_value());
+  ASSERT_FALSE(prefetcher.TakeSourceHash(operations_[2]).has_value());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,225 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/throughput_governor.h"
+
+#include <algorithm>
+#include <string>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+
+#include "update_engine/common/memory_accounting.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr auto kStateCheckInterval = base::TimeDelta::FromSeconds(30);
+
+void GetIntConfig(const brillo::KeyValueStore& store,
+                  const std::string& key,
+                  int* value) {
+  std::string str;
+  if (store.GetString(key, &str) && !base::StringToInt(str, value)) {
+    LOG(WARNING) << "Ignoring invalid " << key << "=" << str;
+  }
+}
+
+void GetBandwidthConfig(const brillo::KeyValueStore& store,
+                        const std::string& key,
+                        uint64_t* bandwidth) {
+  std::string str;
+  uint64_t bandwidth_mb = 0;
+  if (!store.GetString(key, &str)) {
+    return;
+  }
+  if (base::StringToUint64(str, &bandwidth_mb)) {
+    *bandwidth = bandwidth_mb * 1024 * 1024;
+  } else {
+    LOG(WARNING) << "Ignoring invalid " << key << "=" << str;
+  }
+}
+
+}  // namespace
+
+const char* ThroughputLevelName(ThroughputLevel level) {
+  switch (level) {
+    case ThroughputLevel::kFull:
+      return "full";
+    case ThroughputLevel::kNormal:
+      return "normal";
+    case ThroughputLevel::kReduced:
+      return "reduced";
+    case ThroughputLevel::kMinimal:
+      return "minimal";
+  }
+  return "unknown";
+}
+
+ThroughputGovernor* ThroughputGovernor::GetInstance() {
+  static ThroughputGovernor instance(IoScheduler::GetInstance());
+  return &instance;
+}
+
+ThroughputGovernor::Config ThroughputGovernor::LoadConfig(
+    const brillo::KeyValueStore& store) {
+  Config config;
+  GetIntConfig(store, "GOVERNOR_WARM_TEMP", &config.warm_temp);
+  GetIntConfig(store, "GOVERNOR_HOT_TEMP", &config.hot_temp);
+  GetIntConfig(store, "GOVERNOR_LOW_BATTERY", &config.low_battery);
+  GetBandwidthConfig(store,
+                     "GOVERNOR_REDUCED_WRITE_MB_PER_SECOND",
+                     &config.reduced_write_bandwidth);
+  GetBandwidthConfig(store,
+                     "GOVERNOR_MINIMAL_WRITE_MB_PER_SECOND",
+                     &config.minimal_write_bandwidth);
+  return config;
+}
+
+ThroughputLevel ThroughputGovernor::LevelFor(const DeviceConditions& conditions,
+                                             const Config& config) {
+  const bool low_battery = !conditions.charging &&
+                           conditions.battery_percent >= 0 &&
+                           conditions.battery_percent < config.low_battery;
+  if (low_battery ||
+      (config.hot_temp > 0 && conditions.max_temp >= config.hot_temp)) {
+    return ThroughputLevel::kMinimal;
+  }
+  if ((config.warm_temp > 0 && conditions.max_temp >= config.warm_temp) ||
+      (!conditions.charging && conditions.screen_on)) {
+    return ThroughputLevel::kReduced;
+  }
+  if (conditions.charging && !conditions.screen_on) {
+    return ThroughputLevel::kFull;
+  }
+  return ThroughputLevel::kNormal;
+}
+
+void ThroughputGovernor::Start(HardwareInterface* hardware,
+                               const Config& config) {
+  hardware_ = hardware;
+  config_ = config;
+  durations_ = {};
+  num_level_changes_ = 0;
+  level_start_ = base::TimeTicks::Now();
+  SetLevel(LevelFor(hardware_->GetDeviceConditions(), config_));
+  check_task_.Cancel();
+  ScheduleStateCheck();
+}
+
+void ThroughputGovernor::Stop() {
+  if (!hardware_) {
+    return;
+  }
+  check_task_.Cancel();
+  // Keep the time spent at the last level.
+  durations_[static_cast<size_t>(level_.load())] +=
+      base::TimeTicks::Now() - level_start_;
+  level_start_ = base::TimeTicks::Now();
+  hardware_ = nullptr;
+  level_ = ThroughputLevel::kNormal;
+  io_scheduler_->SetWriteBandwidthCap(0);
+  SetCpuShares(CpuShares::kNormal);
+}
+
+size_t ThroughputGovernor::LimitWorkers(size_t requested) const {
+  size_t workers = 1;
+  switch (level_) {
+    case ThroughputLevel::kFull:
+    case ThroughputLevel::kNormal:
+      workers = requested;
+      break;
+    case ThroughputLevel::kReduced:
+      workers = requested / 2;
+      break;
+    case ThroughputLevel::kMinimal:
+      workers = 1;
+      break;
+  }
+  // Every worker holds the buffers of what it is working on.
+  if (MemoryAccounting::GetInstance()->OverSoftLimit())
+    workers /= 2;
+  return std::max<size_t>(workers, 1);
+}
+
+bool ThroughputGovernor::AllowsThreadedCompression() const {
+  return level_ == ThroughputLevel::kFull || level_ == ThroughputLevel::kNormal;
+}
+
+ThroughputGovernor::LevelDurations ThroughputGovernor::GetLevelDurations()
+    const {
+  LevelDurations durations = durations_;
+  if (hardware_) {
+    durations[static_cast<size_t>(level_.load())] +=
+        base::TimeTicks::Now() - level_start_;
+  }
+  return durations;
+}
+
+bool ThroughputGovernor::SetCpuShares(CpuShares shares) {
+  return cpu_limiter_.SetCpuShares(shares);
+}
+
+void ThroughputGovernor::CheckDeviceState() {
+  const ThroughputLevel level =
+      LevelFor(hardware_->GetDeviceConditions(), config_);
+  if (level != level_) {
+    const auto now = base::TimeTicks::Now();
+    durations_[static_cast<size_t>(level_.load())] += now - level_start_;
+    level_start_ = now;
+    num_level_changes_++;
+    SetLevel(level);
+  }
+  ScheduleStateCheck();
+}
+
+void ThroughputGovernor::ScheduleStateCheck() {
+  if (!check_task_.PostTask(
+          FROM_HERE,
+          [this]() { CheckDeviceState(); },
+          kStateCheckInterval)) {
+    LOG(WARNING) << "Unable to schedule the device state check.";
+  }
+}
+
+void ThroughputGovernor::SetLevel(ThroughputLevel level) {
+  level_ = level;
+  uint64_t write_cap = 0;
+  CpuShares shares = CpuShares::kNormal;
+  switch (level) {
+    case ThroughputLevel::kFull:
+      shares = CpuShares::kHigh;
+      break;
+    case ThroughputLevel::kNormal:
+      break;
+    case ThroughputLevel::kReduced:
+      write_cap = config_.reduced_write_bandwidth;
+      shares = CpuShares::kLow;
+      break;
+    case ThroughputLevel::kMinimal:
+      write_cap = config_.minimal_write_bandwidth;
+      shares = CpuShares::kLow;
+      break;
+  }
+  LOG(INFO) << "Running the update at the " << ThroughputLevelName(level)
+            << " throughput level, writes capped at " << write_cap
+            << " bytes/s (0 means unlimited).";
+  io_scheduler_->SetWriteBandwidthCap(write_cap);
+  SetCpuShares(shares);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,146 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_THROUGHPUT_GOVERNOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_THROUGHPUT_GOVERNOR_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+#include <brillo/key_value_store.h>
+
+#include "update_engine/common/cpu_limiter.h"
+#include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/scoped_task_id.h"
+#include "update_engine/payload_consumer/io_scheduler.h"
+
+namespace chromeos_update_engine {
+
+// How much of the device an update may use, from the most to the least.
+enum class ThroughputLevel {
+  kFull,     // Charging with the screen off.
+  kNormal,   // The device is in use but neither warm nor low on battery.
+  kReduced,  // Warm, or running on battery with the screen on.
+  kMinimal,  // Hot, or low on battery.
+};
+
+const char* ThroughputLevelName(ThroughputLevel level);
+
+// Scales the resources of an update with the state of the device read through
+// HardwareInterface, so the parallel apply, verify and compression modes back
+// off on their own when the device gets warm or runs low on battery:
+//   - the worker threads applying and verifying the update are halved at
+//     kReduced and down to one at kMinimal,
+//   - multi-threaded VABC compression is only allowed up to kNormal,
+//   - the writes to the partitions are capped at kReduced and kMinimal,
+//   - the cgroup cpu shares of the daemon are raised at kFull and lowered from
+//     kReduced.
+// The device state is checked again every 30 seconds while started. The
+// limits may be read from any thread, the rest is used on the main loop.
+//
+// The thresholds and the bandwidths are read from update_engine.conf:
+//   GOVERNOR_WARM_TEMP, GOVERNOR_HOT_TEMP: the temperatures in millidegrees
+//       Celsius from which the device is warm and hot, 0 to ignore them.
+//   GOVERNOR_LOW_BATTERY: the battery percentage under which the device is
+//       low on battery while not charging.
+//   GOVERNOR_REDUCED_WRITE_MB_PER_SECOND, GOVERNOR_MINIMAL_WRITE_MB_PER_SECOND:
+//       the write bandwidths at kReduced and kMinimal, 0 for no cap.
+class ThroughputGovernor {
+ public:
+  struct Config {
+    int warm_temp{40000};
+    int hot_temp{45000};
+    int low_battery{15};
+    uint64_t reduced_write_bandwidth{0};
+    uint64_t minimal_write_bandwidth{8 * 1024 * 1024};
+  };
+
+  // How long the update spent at each level since Start().
+  using LevelDurations = std::array<base::TimeDelta, 4>;
+
+  // The governor of the daemon.
+  static ThroughputGovernor* GetInstance();
+
+  // Returns the config in |store|, with the defaults for the missing keys.
+  static Config LoadConfig(const brillo::KeyValueStore& store);
+
+  // Returns the level for |conditions| under |config|.
+  static ThroughputLevel LevelFor(const DeviceConditions& conditions,
+                                  const Config& config);
+
+  // The write caps are applied to |io_scheduler|.
+  explicit ThroughputGovernor(IoScheduler* io_scheduler)
+      : io_scheduler_(io_scheduler) {}
+  virtual ~ThroughputGovernor() = default;
+
+  // Starts following the state of the device read from |hardware| with
+  // |config|, and resets the time spent at each level.
+  void Start(HardwareInterface* hardware, const Config& config);
+
+  // Stops following the state of the device and lifts all the limits.
+  void Stop();
+
+  ThroughputLevel level() const { return level_; }
+
+  // Returns how many of |requested| workers may run at the current level, at
+  // least one. Half as many run while the memory of the update is over the
+  // soft limit of MemoryAccounting.
+  size_t LimitWorkers(size_t requested) const;
+
+  // Whether multi-threaded compression may be used at the current level.
+  bool AllowsThreadedCompression() const;
+
+  // Returns how long the update spent at each level, indexed by
+  // ThroughputLevel, and how many times the level changed since Start().
+  LevelDurations GetLevelDurations() const;
+  int num_level_changes() const { return num_level_changes_; }
+
+ protected:
+  // Sets the cgroup cpu shares of the daemon, which tests override.
+  virtual bool SetCpuShares(CpuShares shares);
+
+ private:
+  // Rechecks the device state and applies the level when it changed.
+  void CheckDeviceState();
+  void ScheduleStateCheck();
+
+  // Switches to |level| and applies its write cap and cpu shares.
+  void SetLevel(ThroughputLevel level);
+
+  IoScheduler* io_scheduler_;
+  HardwareInterface* hardware_{nullptr};
+  Config config_;
+
+  // Read by the worker threads.
+  std::atomic<ThroughputLevel> level_{ThroughputLevel::kNormal};
+
+  LevelDurations durations_;
+  base::TimeTicks level_start_;
+  int num_level_changes_{0};
+
+  CPULimiter cpu_limiter_;
+  ScopedTaskId check_task_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThroughputGovernor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_THROUGHPUT_GOVERNOR_H_
@@ -0,0 +1,155 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/throughput_governor.h"
+
+#include <vector>
+
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_hardware.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Records the cpu shares instead of setting them.
+class TestThroughputGovernor : public ThroughputGovernor {
+ public:
+  using ThroughputGovernor::ThroughputGovernor;
+
+  std::vector<CpuShares> shares;
+
+ protected:
+  bool SetCpuShares(CpuShares cpu_shares) override {
+    shares.push_back(cpu_shares);
+    return true;
+  }
+};
+
+}  // namespace
+
+class ThroughputGovernorTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  DeviceConditions Conditions(bool charging,
+                              bool screen_on,
+                              int battery_percent = 80,
+                              int max_temp = 30000) {
+    DeviceConditions conditions;
+    conditions.charging = charging;
+    conditions.screen_on = screen_on;
+    conditions.battery_percent = battery_percent;
+    conditions.max_temp = max_temp;
+    return conditions;
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  FakeHardware fake_hardware_;
+  IoScheduler io_scheduler_;
+  ThroughputGovernor::Config config_;
+};
+
+TEST_F(ThroughputGovernorTest, LoadConfigTest) {
+  brillo::KeyValueStore store;
+  store.SetString("GOVERNOR_HOT_TEMP", "50000");
+  store.SetString("GOVERNOR_LOW_BATTERY", "not a number");
+  store.SetString("GOVERNOR_REDUCED_WRITE_MB_PER_SECOND", "32");
+  const auto config = ThroughputGovernor::LoadConfig(store);
+  EXPECT_EQ(40000, config.warm_temp);
+  EXPECT_EQ(50000, config.hot_temp);
+  EXPECT_EQ(15, config.low_battery);
+  EXPECT_EQ(32u * 1024 * 1024, config.reduced_write_bandwidth);
+  EXPECT_EQ(8u * 1024 * 1024, config.minimal_write_bandwidth);
+}
+
+TEST_F(ThroughputGovernorTest, LevelForTest) {
+  EXPECT_EQ(ThroughputLevel::kFull,
+            ThroughputGovernor::LevelFor(Conditions(true, false), config_));
+  EXPECT_EQ(ThroughputLevel::kNormal,
+            ThroughputGovernor::LevelFor(Conditions(true, true), config_));
+  EXPECT_EQ(ThroughputLevel::kNormal,
+            ThroughputGovernor::LevelFor(Conditions(false, false), config_));
+  EXPECT_EQ(ThroughputLevel::kReduced,
+            ThroughputGovernor::LevelFor(Conditions(false, true), config_));
+  EXPECT_EQ(
+      ThroughputLevel::kReduced,
+      ThroughputGovernor::LevelFor(Conditions(true, false, 80, 42000), config_));
+  EXPECT_EQ(
+      ThroughputLevel::kMinimal,
+      ThroughputGovernor::LevelFor(Conditions(true, false, 80, 46000), config_));
+  EXPECT_EQ(ThroughputLevel::kMinimal,
+            ThroughputGovernor::LevelFor(Conditions(false, false, 10), config_));
+  // A low battery doesn't matter while charging, nor an unknown one.
+  EXPECT_EQ(ThroughputLevel::kFull,
+            ThroughputGovernor::LevelFor(Conditions(true, false, 10), config_));
+  EXPECT_EQ(ThroughputLevel::kNormal,
+            ThroughputGovernor::LevelFor(Conditions(false, false, -1), config_));
+}
+
+TEST_F(ThroughputGovernorTest, LimitWorkersTest) {
+  TestThroughputGovernor governor(&io_scheduler_);
+  // Without Start() nothing is limited.
+  EXPECT_EQ(4u, governor.LimitWorkers(4));
+  EXPECT_EQ(1u, governor.LimitWorkers(0));
+  EXPECT_TRUE(governor.AllowsThreadedCompression());
+
+  fake_hardware_.SetDeviceConditions(Conditions(false, true));
+  governor.Start(&fake_hardware_, config_);
+  EXPECT_EQ(ThroughputLevel::kReduced, governor.level());
+  EXPECT_EQ(2u, governor.LimitWorkers(4));
+  EXPECT_EQ(1u, governor.LimitWorkers(1));
+  EXPECT_FALSE(governor.AllowsThreadedCompression());
+
+  fake_hardware_.SetDeviceConditions(Conditions(false, false, 5));
+  ASSERT_TRUE(loop_.RunOnce(true));
+  EXPECT_EQ(ThroughputLevel::kMinimal, governor.level());
+  EXPECT_EQ(1u, governor.LimitWorkers(4));
+
+  governor.Stop();
+  EXPECT_FALSE(loop_.PendingTasks());
+  EXPECT_EQ(4u, governor.LimitWorkers(4));
+}
+
+TEST_F(ThroughputGovernorTest, LevelChangesTest) {
+  TestThroughputGovernor governor(&io_scheduler_);
+  fake_hardware_.SetDeviceConditions(Conditions(true, false));
+  governor.Start(&fake_hardware_, config_);
+  EXPECT_EQ(ThroughputLevel::kFull, governor.level());
+
+  // An unchanged state keeps the level.
+  ASSERT_TRUE(loop_.RunOnce(true));
+  EXPECT_EQ(0, governor.num_level_changes());
+
+  fake_hardware_.SetDeviceConditions(Conditions(true, false, 80, 50000));
+  ASSERT_TRUE(loop_.RunOnce(true));
+  EXPECT_EQ(ThroughputLevel::kMinimal, governor.level());
+  EXPECT_EQ(1, governor.num_level_changes());
+
+  governor.Stop();
+  EXPECT_EQ((std::vector<CpuShares>{
+                CpuShares::kHigh, CpuShares::kLow, CpuShares::kNormal}),
+            governor.shares);
+  const auto durations = governor.GetLevelDurations();
+  EXPECT_EQ(base::TimeDelta(),
+            durations[static_cast<size_t>(ThroughputLevel::kNormal)]);
+  EXPECT_EQ(base::TimeDelta(),
+            durations[static_cast<size_t>(ThroughputLevel::kReduced)]);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,218 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/update_state_journal.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr uint32_t kRecordMagic = 0x314a4555;  // "UEJ1"
+constexpr size_t kHeaderSize = 2 * sizeof(uint32_t);
+constexpr size_t kChecksumSize = 32;  // SHA-256
+
+template <typename T>
+void Put(brillo::Blob* out, const T& value) {
+  const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+  out->insert(out->end(), bytes, bytes + sizeof(value));
+}
+
+void PutString(brillo::Blob* out, const std::string& value) {
+  Put(out, static_cast<uint32_t>(value.size()));
+  out->insert(out->end(), value.begin(), value.end());
+}
+
+// Consumes values from the body of a record. Every Get*() fails once the body
+// is exhausted.
+class RecordReader {
+ public:
+  RecordReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  template <typename T>
+  bool Get(T* value) {
+    if (size_ - offset_ < sizeof(*value)) {
+      return false;
+    }
+    memcpy(value, data_ + offset_, sizeof(*value));
+    offset_ += sizeof(*value);
+    return true;
+  }
+
+  bool GetString(std::string* value) {
+    uint32_t length = 0;
+    if (!Get(&length) || size_ - offset_ < length) {
+      return false;
+    }
+    value->assign(reinterpret_cast<const char*>(data_ + offset_), length);
+    offset_ += length;
+    return true;
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t offset_{0};
+};
+}  // namespace
+
+UpdateStateJournal::~UpdateStateJournal() {
+  if (fd_ >= 0) {
+    IGNORE_EINTR(close(fd_));
+  }
+}
+
+template <typename Callback>
+uint64_t UpdateStateJournal::ReadRecords(Callback callback) const {
+  struct stat st {};
+  if (fstat(fd_, &st) != 0 || st.st_size <= 0) {
+    return 0;
+  }
+  brillo::Blob data(std::min<uint64_t>(st.st_size, kMaxSize));
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(fd_, data.data(), data.size(), 0, &bytes_read)) {
+    PLOG(WARNING) << "Unable to read the update state journal";
+    return 0;
+  }
+  data.resize(bytes_read);
+
+  uint64_t offset = 0;
+  while (data.size() - offset >= kHeaderSize) {
+    uint32_t magic = 0;
+    uint32_t body_size = 0;
+    memcpy(&magic, data.data() + offset, sizeof(magic));
+    memcpy(&body_size, data.data() + offset + sizeof(magic), sizeof(body_size));
+    if (magic != kRecordMagic ||
+        data.size() - offset - kHeaderSize < body_size + kChecksumSize) {
+      break;
+    }
+    const uint8_t* body = data.data() + offset + kHeaderSize;
+    brillo::Blob checksum;
+    if (!HashCalculator::RawHashOfBytes(body, body_size, &checksum) ||
+        memcmp(checksum.data(), body + body_size, kChecksumSize) != 0) {
+      break;
+    }
+    RecordReader reader(body, body_size);
+    int64_t base = 0;
+    Checkpoint checkpoint;
+    if (!reader.Get(&base) || !reader.Get(&checkpoint.next_operation) ||
+        !reader.Get(&checkpoint.next_data_offset) ||
+        !reader.Get(&checkpoint.next_data_length) ||
+        !reader.GetString(&checkpoint.sha256_context) ||
+        !reader.GetString(&checkpoint.signed_sha256_context)) {
+      break;
+    }
+    callback(base, checkpoint);
+    offset += kHeaderSize + body_size + kChecksumSize;
+  }
+  return offset;
+}
+
+bool UpdateStateJournal::Open(const std::string& path) {
+  TEST_AND_RETURN_FALSE(fd_ < 0);
+  fd_ = HANDLE_EINTR(
+      open(path.c_str(), O_RDWR | O_CREAT | O_DSYNC | O_CLOEXEC, 0600));
+  TEST_AND_RETURN_FALSE_ERRNO(fd_ >= 0);
+  write_offset_ = ReadRecords([](int64_t, const Checkpoint&) {});
+  return true;
+}
+
+bool UpdateStateJournal::Append(int64_t base_operation,
+                                const Checkpoint& checkpoint) {
+  TEST_AND_RETURN_FALSE(fd_ >= 0);
+  brillo::Blob body;
+  Put(&body, base_operation);
+  Put(&body, checkpoint.next_operation);
+  Put(&body, checkpoint.next_data_offset);
+  Put(&body, checkpoint.next_data_length);
+  PutString(&body, checkpoint.sha256_context);
+  PutString(&body, checkpoint.signed_sha256_context);
+
+  brillo::Blob checksum;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfBytes(body.data(), body.size(), &checksum));
+  brillo::Blob record;
+  record.reserve(kHeaderSize + body.size() + checksum.size());
+  Put(&record, kRecordMagic);
+  Put(&record, static_cast<uint32_t>(body.size()));
+  record.insert(record.end(), body.begin(), body.end());
+  record.insert(record.end(), checksum.begin(), checksum.end());
+
+  if (write_offset_ + record.size() > kMaxSize) {
+    TEST_AND_RETURN_FALSE(Reset());
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(
+      utils::PWriteAll(fd_, record.data(), record.size(), write_offset_));
+  write_offset_ += record.size();
+  return true;
+}
+
+std::optional<UpdateStateJournal::Checkpoint> UpdateStateJournal::ReadLatest(
+    int64_t base_operation) const {
+  std::optional<Checkpoint> latest;
+  if (fd_ < 0) {
+    return latest;
+  }
+  ReadRecords([base_operation, &latest](int64_t base,
+                                        const Checkpoint& checkpoint) {
+    // After a crash a reset may not have stuck, so don't rely on the order
+    // of the records; progress only ever moves forward.
+    if (base == base_operation &&
+        (!latest || checkpoint.next_operation >= latest->next_operation)) {
+      latest = checkpoint;
+    }
+  });
+  return latest;
+}
+
+std::vector<UpdateStateJournal::Checkpoint> UpdateStateJournal::ReadAll(
+    int64_t base_operation) const {
+  std::vector<Checkpoint> checkpoints;
+  if (fd_ < 0) {
+    return checkpoints;
+  }
+  ReadRecords([base_operation, &checkpoints](int64_t base,
+                                             const Checkpoint& checkpoint) {
+    if (base == base_operation) {
+      checkpoints.push_back(checkpoint);
+    }
+  });
+  return checkpoints;
+}
+
+bool UpdateStateJournal::Reset() {
+  TEST_AND_RETURN_FALSE(fd_ >= 0);
+  TEST_AND_RETURN_FALSE_ERRNO(HANDLE_EINTR(ftruncate(fd_, 0)) == 0);
+  // ftruncate() isn't covered by O_DSYNC. Stale records surviving a crash
+  // either extend an older prefs checkpoint or are behind newer records, and
+  // are never picked by ReadLatest().
+  write_offset_ = 0;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
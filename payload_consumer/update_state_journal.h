@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_UPDATE_STATE_JOURNAL_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_UPDATE_STATE_JOURNAL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// An append-only file of update progress checkpoints. Appending a checkpoint
+// takes a single O_DSYNC write, compared to the transaction over a handful of
+// pref files a full checkpoint takes, so progress can be recorded often.
+//
+// Every record extends a checkpoint persisted in prefs, identified by the
+// next operation stored there. Only records extending the current prefs
+// checkpoint are meaningful; the journal is reset whenever prefs are written.
+// A record cut short by a crash is detected by its checksum and ignored, along
+// with anything after it.
+class UpdateStateJournal {
+ public:
+  // Journalled copy of the kPrefsUpdateState* prefs.
+  struct Checkpoint {
+    int64_t next_operation{0};
+    int64_t next_data_offset{0};
+    int64_t next_data_length{0};
+    std::string sha256_context;
+    std::string signed_sha256_context;
+  };
+
+  // The journal starts over once it would grow past this size.
+  static constexpr size_t kMaxSize = 1024 * 1024;  // 1 MiB
+
+  UpdateStateJournal() = default;
+  ~UpdateStateJournal();
+
+  // Opens or creates the journal at |path|. New records are appended after the
+  // last valid one.
+  bool Open(const std::string& path);
+  bool IsOpen() const { return fd_ >= 0; }
+
+  // Durably appends |checkpoint|, which extends the prefs checkpoint whose
+  // next operation is |base_operation|.
+  bool Append(int64_t base_operation, const Checkpoint& checkpoint);
+
+  // Returns the most recent record extending the prefs checkpoint whose next
+  // operation is |base_operation|, if any.
+  std::optional<Checkpoint> ReadLatest(int64_t base_operation) const;
+
+  // Returns all records extending |base_operation|, oldest first.
+  std::vector<Checkpoint> ReadAll(int64_t base_operation) const;
+
+  // Drops all records.
+  bool Reset();
+
+ private:
+  // Reads the records from the start of the file, calling |callback| with the
+  // base operation and contents of every valid one. Returns the offset past
+  // the last valid record.
+  template <typename Callback>
+  uint64_t ReadRecords(Callback callback) const;
+
+  int fd_{-1};
+  // Offset the next record is written at.
+  uint64_t write_offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(UpdateStateJournal);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_UPDATE_STATE_JOURNAL_H_
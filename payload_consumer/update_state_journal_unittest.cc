@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/update_state_journal.h"
+
+#include <unistd.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+UpdateStateJournal::Checkpoint MakeCheckpoint(int64_t next_operation) {
+  UpdateStateJournal::Checkpoint checkpoint;
+  checkpoint.next_operation = next_operation;
+  checkpoint.next_data_offset = next_operation * 1000;
+  checkpoint.next_data_length = 42;
+  checkpoint.sha256_context = "context" + std::to_string(next_operation);
+  checkpoint.signed_sha256_context = "signed";
+  return checkpoint;
+}
+}  // namespace
+
+class UpdateStateJournalTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ASSERT_TRUE(journal_.Open(file_.path())); }
+
+  ScopedTempFile file_{"update_state_journal.XXXXXX"};
+  UpdateStateJournal journal_;
+};
+
+TEST_F(UpdateStateJournalTest, ReadsLatestCheckpoint) {
+  ASSERT_FALSE(journal_.ReadLatest(10).has_value());
+  ASSERT_TRUE(journal_.Append(10, MakeCheckpoint(11)));
+  ASSERT_TRUE(journal_.Append(10, MakeCheckpoint(15)));
+
+  auto checkpoint = journal_.ReadLatest(10);
+  ASSERT_TRUE(checkpoint.has_value());
+  ASSERT_EQ(15, checkpoint->next_operation);
+  ASSERT_EQ(15000, checkpoint->next_data_offset);
+  ASSERT_EQ(42, checkpoint->next_data_length);
+  ASSERT_EQ("context15", checkpoint->sha256_context);
+  ASSERT_EQ("signed", checkpoint->signed_sha256_context);
+  // Records extending another prefs checkpoint are ignored.
+  ASSERT_FALSE(journal_.ReadLatest(11).has_value());
+}
+
+TEST_F(UpdateStateJournalTest, ReadsAllCheckpoints) {
+  ASSERT_TRUE(journal_.ReadAll(10).empty());
+  ASSERT_TRUE(journal_.Append(10, MakeCheckpoint(11)));
+  ASSERT_TRUE(journal_.Append(12, MakeCheckpoint(13)));
+  ASSERT_TRUE(journal_.Append(10, MakeCheckpoint(15)));
+
+  auto checkpoints = journal_.ReadAll(10);
+  ASSERT_EQ(2u, checkpoints.size());
+  ASSERT_EQ(11, checkpoints[0].next_operation);
+  ASSERT_EQ(15, checkpoints[1].next_operation);
+  ASSERT_EQ("context15", checkpoints[1].sha256_context);
+}
+
+TEST_F(UpdateStateJournalTest, SurvivesReopen) {
+  ASSERT_TRUE(journal_.Append(3, MakeCheckpoint(4)));
+  UpdateStateJournal reopened;
+  ASSERT_TRUE(reopened.Open(file_.path()));
+  ASSERT_TRUE(reopened.Append(3, MakeCheckpoint(5)));
+  auto checkpoint = reopened.ReadLatest(3);
+  ASSERT_TRUE(checkpoint.has_value());
+  ASSERT_EQ(5, checkpoint->next_operation);
+}
+
+TEST_F(UpdateStateJournalTest, IgnoresTornRecord) {
+  ASSERT_TRUE(journal_.Append(1, MakeCheckpoint(2)));
+  ASSERT_TRUE(journal_.Append(1, MakeCheckpoint(3)));
+  // Cut the last record short as a crash in the middle of the write would.
+  const off_t size = utils::FileSize(file_.path());
+  ASSERT_EQ(0, truncate(file_.path().c_str(), size - 5));
+
+  UpdateStateJournal reopened;
+  ASSERT_TRUE(reopened.Open(file_.path()));
+  auto checkpoint = reopened.ReadLatest(1);
+  ASSERT_TRUE(checkpoint.has_value());
+  ASSERT_EQ(2, checkpoint->next_operation);
+}
+
+TEST_F(UpdateStateJournalTest, Reset) {
+  ASSERT_TRUE(journal_.Append(1, MakeCheckpoint(2)));
+  ASSERT_TRUE(journal_.Reset());
+  ASSERT_FALSE(journal_.ReadLatest(1).has_value());
+  ASSERT_TRUE(journal_.Append(2, MakeCheckpoint(3)));
+  ASSERT_TRUE(journal_.ReadLatest(2).has_value());
+}
+
+TEST_F(UpdateStateJournalTest, StartsOverWhenFull) {
+  // Large records keep the number of synchronous writes down.
+  auto checkpoint = MakeCheckpoint(1);
+  checkpoint.sha256_context.assign(16 * 1024, 'x');
+  const size_t num_records = UpdateStateJournal::kMaxSize / (16 * 1024) + 8;
+  for (size_t i = 0; i < num_records; i++) {
+    checkpoint.next_operation = i + 1;
+    ASSERT_TRUE(journal_.Append(0, checkpoint));
+  }
+  ASSERT_LE(utils::FileSize(file_.path()),
+            static_cast<off_t>(UpdateStateJournal::kMaxSize));
+  auto latest = journal_.ReadLatest(0);
+  ASSERT_TRUE(latest.has_value());
+  ASSERT_EQ(static_cast<int64_t>(num_records), latest->next_operation);
+}
+
+}  // namespace chromeos_update_engine
@@ -64,16 +64,19 @@ namespace chromeos_update_engine {
 using android::snapshot::ICowWriter;
 using ::google::protobuf::RepeatedPtrField;
 
+// The first COW format version only used with userspace snapshots.
+constexpr uint32_t kRangedCopyOpsCowVersion = 3;
+
 // Compute XOR map, a map from dst extent to corresponding merge operation
-static ExtentMap<const CowMergeOperation*, ExtentLess> ComputeXorMap(
+static ExtentMap<const CowMergeOperation*> ComputeXorMap(
     const RepeatedPtrField<CowMergeOperation>& merge_ops) {
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map;
+  std::vector<std::pair<Extent, const CowMergeOperation*>> entries;
   for (const auto& merge_op : merge_ops) {
     if (merge_op.type() == CowMergeOperation::COW_XOR) {
-      xor_map.AddExtent(merge_op.dst_extent(), &merge_op);
+      entries.emplace_back(merge_op.dst_extent(), &merge_op);
     }
   }
-  return xor_map;
+  return ExtentMap<const CowMergeOperation*>(std::move(entries));
 }
 
 VABCPartitionWriter::VABCPartitionWriter(
@@ -97,13 +100,22 @@ VABCPartitionWriter::VABCPartitionWriter(
             << copy_blocks_.blocks() << " copy blocks";
 }
 
+bool VABCPartitionWriter::UseRangedCopyOps(uint32_t cow_version) {
+  // COW version 3 implies userspace snapshots, older ones only use ranged
+  // copies when the device says it has them.
+  return cow_version >= kRangedCopyOpsCowVersion ||
+         android::base::GetBoolProperty(
+             "ro.virtual_ab.userspace.snapshots.enabled", false);
+}
+
 bool VABCPartitionWriter::ProcessSourceCopyOperation(
     const InstallOperation& operation,
     const size_t block_size,
     const ExtentRanges& copy_blocks,
     const FileDescriptorPtr& source_fd,
     android::snapshot::ICowWriter* cow_writer,
-    bool sequence_op_supported) {
+    bool sequence_op_supported,
+    bool ranged_copy_ops) {
   // COPY ops are already handled during Init(), no need to do actual work, but
   // we still want to verify that all blocks contain expected data.
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
@@ -113,8 +125,6 @@ bool VABCPartitionWriter::ProcessSourceCopyOperation(
   const auto& dst_extents = operation.dst_extents();
   BlockIterator it1{src_extents};
   BlockIterator it2{dst_extents};
-  const bool userSnapshots = android::base::GetBoolProperty(
-      "ro.virtual_ab.userspace.snapshots.enabled", false);
   // For devices not supporting XOR, sequence op is not supported, so all COPY
   // operations are written up front in strict merge order.
   while (!it1.is_end() && !it2.is_end()) {
@@ -137,9 +147,9 @@ bool VABCPartitionWriter::ProcessSourceCopyOperation(
   std::vector<uint8_t> buffer;
   for (const auto& cow_op : converted) {
     if (cow_op.op == CowOperation::CowCopy) {
-      if (userSnapshots) {
-        cow_writer->AddCopy(
-            cow_op.dst_block, cow_op.src_block, cow_op.block_count);
+      if (ranged_copy_ops) {
+        TEST_AND_RETURN_FALSE(cow_writer->AddCopy(
+            cow_op.dst_block, cow_op.src_block, cow_op.block_count));
       } else {
         // Add blocks in reverse order, because snapused specifically prefers
         // this ordering. Since we already eliminated all self-overlapping
@@ -174,8 +184,6 @@ bool VABCPartitionWriter::DoesDeviceSupportsXor() {
 }
 
 bool VABCPartitionWriter::WriteAllCopyOps() {
-  const bool userSnapshots = android::base::GetBoolProperty(
-      "ro.virtual_ab.userspace.snapshots.enabled", false);
   for (const auto& cow_op : partition_update_.merge_operations()) {
     if (cow_op.type() != CowMergeOperation::COW_COPY) {
       continue;
@@ -183,7 +191,7 @@ bool VABCPartitionWriter::WriteAllCopyOps() {
     if (cow_op.dst_extent() == cow_op.src_extent()) {
       continue;
     }
-    if (userSnapshots) {
+    if (ranged_copy_ops_) {
       TEST_AND_RETURN_FALSE(cow_op.src_extent().num_blocks() != 0);
       TEST_AND_RETURN_FALSE(
           cow_writer_->AddCopy(cow_op.dst_extent().start_block(),
@@ -218,9 +226,11 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
     LOG(INFO) << "Virtual AB Compression with XOR is disabled.";
   }
   TEST_AND_RETURN_FALSE(install_plan != nullptr);
+  ranged_copy_ops_ = UseRangedCopyOps(install_plan->cow_version);
   if (source_may_exist && install_part_.source_size > 0) {
     TEST_AND_RETURN_FALSE(!install_part_.source_path.empty());
     TEST_AND_RETURN_FALSE(verified_source_fd_.Open());
+    verified_source_fd_.EnablePrefetch(install_plan->source_prefetch_ops);
   }
   std::optional<std::string> source_path;
   if (!install_part_.source_path.empty()) {
@@ -243,6 +253,11 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   cow_writer_ =
       dynamic_control_->OpenCowWriter(install_part_.name, source_path, label);
   TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  write_batcher_ = std::make_unique<CowWriteBatcher>(
+      cow_writer_.get(),
+      block_size_,
+      install_plan->cow_batch_size > 0 ? install_plan->cow_batch_size
+                                       : CowWriteBatcher::kDefaultBatchSize);
 
   if (label) {
     return true;
@@ -330,11 +345,12 @@ bool VABCPartitionWriter::WriteMergeSequence(
 }
 
 std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
-  return std::make_unique<SnapshotExtentWriter>(cow_writer_.get());
+  return std::make_unique<SnapshotExtentWriter>(write_batcher_.get());
 }
 
 [[nodiscard]] bool VABCPartitionWriter::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
+  TEST_AND_RETURN_FALSE(write_batcher_->Flush());
   for (const auto& extent : operation.dst_extents()) {
     TEST_AND_RETURN_FALSE(
         cow_writer_->AddZeroBlocks(extent.start_block(), extent.num_blocks()));
@@ -345,13 +361,15 @@ std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
 [[nodiscard]] bool VABCPartitionWriter::PerformSourceCopyOperation(
     const InstallOperation& operation, ErrorCode* error) {
   auto source_fd = verified_source_fd_.ChooseSourceFD(operation, error);
+  TEST_AND_RETURN_FALSE(write_batcher_->Flush());
 
   return ProcessSourceCopyOperation(operation,
                                     block_size_,
                                     copy_blocks_,
                                     source_fd,
                                     cow_writer_.get(),
-                                    DoesDeviceSupportsXor());
+                                    DoesDeviceSupportsXor(),
+                                    ranged_copy_ops_);
 }
 
 bool VABCPartitionWriter::PerformReplaceOperation(const InstallOperation& op,
@@ -372,6 +390,10 @@ bool VABCPartitionWriter::PerformDiffOperation(
       verified_source_fd_.ChooseSourceFD(operation, error);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
   TEST_AND_RETURN_FALSE(source_fd->IsOpen());
+  // XORExtentWriter adds its operations to |cow_writer_| directly.
+  if (IsXorEnabled()) {
+    TEST_AND_RETURN_FALSE(write_batcher_->Flush());
+  }
 
   std::unique_ptr<ExtentWriter> writer =
       IsXorEnabled() ? std::make_unique<XORExtentWriter>(
@@ -385,19 +407,28 @@ bool VABCPartitionWriter::PerformDiffOperation(
       operation, std::move(writer), source_fd, data, count);
 }
 
-void VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
+bool VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
   // No need to call fsync/sync, as CowWriter flushes after a label is added
   // added.
   // if cow_writer_ failed, that means Init() failed. This function shouldn't be
   // called if Init() fails.
-  TEST_AND_RETURN(cow_writer_ != nullptr);
-  cow_writer_->AddLabel(next_op_index);
+  TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  // Without the queued blocks, the label would claim operations which aren't
+  // in the image yet.
+  if (!write_batcher_->Flush()) {
+    LOG(ERROR) << "Failed to flush COW writes, not adding label "
+               << next_op_index;
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(cow_writer_->AddLabel(next_op_index));
+  return true;
 }
 
 [[nodiscard]] bool VABCPartitionWriter::FinishedInstallOps() {
   // Add a hardcoded magic label to indicate end of all install ops. This label
   // is needed by filesystem verification, don't remove.
   TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  TEST_AND_RETURN_FALSE(write_batcher_->Flush());
   TEST_AND_RETURN_FALSE(cow_writer_->AddLabel(kEndOfInstallLabel));
   TEST_AND_RETURN_FALSE(cow_writer_->Finalize());
 
@@ -415,9 +446,15 @@ int VABCPartitionWriter::Close() {
   if (cow_writer_) {
     LOG(INFO) << "Finalizing " << partition_update_.partition_name()
               << " COW image";
+    // Blocks still queued belong to operations after the last label, which
+    // are applied again on resume, so a failed flush only loses those.
+    if (!write_batcher_->Flush()) {
+      LOG(WARNING) << "Failed to flush pending COW writes";
+    }
     if (!cow_writer_->Finalize()) {
       return -errno;
     }
+    write_batcher_ = nullptr;
     cow_writer_ = nullptr;
   }
   return 0;
@@ -24,6 +24,7 @@
 
 #include <libsnapshot/cow_writer.h>
 
+#include "update_engine/payload_consumer/cow_write_batcher.h"
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
@@ -34,13 +35,19 @@
 namespace chromeos_update_engine {
 class VABCPartitionWriter final : public PartitionWriterInterface {
  public:
+  // Whether COW copy operations spanning several blocks can be written for
+  // snapshots in the COW format |cow_version|, rather than one operation per
+  // block in the reverse order snapuserd expects otherwise.
+  static bool UseRangedCopyOps(uint32_t cow_version);
+
   static bool ProcessSourceCopyOperation(
       const InstallOperation& operation,
       const size_t block_size,
       const ExtentRanges& copy_blocks,
       const FileDescriptorPtr& source_fd,
       android::snapshot::ICowWriter* cow_writer,
-      bool sequence_op_supported);
+      bool sequence_op_supported,
+      bool ranged_copy_ops);
 
   VABCPartitionWriter(const PartitionUpdate& partition_update,
                       const InstallPlan::Partition& install_part,
@@ -68,10 +75,15 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
                                           const void* data,
                                           size_t count) override;
 
-  void CheckpointUpdateProgress(size_t next_op_index) override;
+  bool CheckpointUpdateProgress(size_t next_op_index) override;
 
   [[nodiscard]] bool FinishedInstallOps() override;
   int Close() override;
+
+  void PrefetchSource(size_t next_op_index) override {
+    verified_source_fd_.PrefetchSourceHashes(partition_update_.operations(),
+                                             next_op_index);
+  }
   // Send merge sequence data to cow writer
   static bool WriteMergeSequence(
       const ::google::protobuf::RepeatedPtrField<CowMergeOperation>& merge_ops,
@@ -82,6 +94,9 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   bool IsXorEnabled() const noexcept { return xor_map_.size() > 0; }
   [[nodiscard]] bool WriteAllCopyOps();
   std::unique_ptr<android::snapshot::ICowWriter> cow_writer_;
+  // Batches COW_REPLACE writes to |cow_writer_|. Must be flushed before any
+  // other operation or label is added to |cow_writer_|.
+  std::unique_ptr<CowWriteBatcher> write_batcher_;
 
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
 
@@ -94,8 +109,10 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   const size_t block_size_;
   InstallOperationExecutor executor_;
   VerifiedSourceFd verified_source_fd_;
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map_;
+  ExtentMap<const CowMergeOperation*> xor_map_;
   ExtentRanges copy_blocks_;
+  // Set by Init() from UseRangedCopyOps().
+  bool ranged_copy_ops_{false};
 };
 
 }  // namespace chromeos_update_engine
@@ -207,6 +207,26 @@ void VABCPartitionWriterTest::AddBlockTest(bool xor_enabled) {
   ASSERT_TRUE(writer_.PerformSourceCopyOperation(install_op, &error));
 }
 
+TEST_F(VABCPartitionWriterTest, RangedCopyOpsTest) {
+  ON_CALL(dynamic_control_, GetVirtualAbCompressionXorFeatureFlag())
+      .WillByDefault(Return(FeatureFlag(FeatureFlag::Value::NONE)));
+  install_plan_.cow_version = 3;
+  AddMergeOp(&partition_update_, {5, 4}, {20, 4}, CowMergeOperation::COW_COPY);
+  VABCPartitionWriter writer_{
+      partition_update_, install_part_, &dynamic_control_, kBlockSize};
+  EXPECT_CALL(dynamic_control_, OpenCowWriter(fake_part_name, _, _))
+      .WillOnce(Invoke([](const std::string&,
+                          const std::optional<std::string>&,
+                          std::optional<uint64_t>) {
+        auto cow_writer = std::make_unique<android::snapshot::MockCowWriter>();
+        ON_CALL(*cow_writer, AddLabel(_)).WillByDefault(Return(true));
+        // A single copy of the whole extent rather than one per block.
+        EXPECT_CALL(*cow_writer, AddCopy(20, 5, 4)).WillOnce(Return(true));
+        return cow_writer;
+      }));
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+}
+
 std::string GetNoopBSDIFF(size_t data_size) {
   auto zeros = GetReadonlyZeroBlock(data_size);
   TemporaryFile patch_file;
@@ -18,7 +18,10 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <atomic>
 #include <memory>
+#include <optional>
+#include <utility>
 #include <vector>
 
 #include <base/strings/string_number_conversions.h>
@@ -30,15 +33,21 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/partition_fd_cache.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 #include "update_engine/update_metadata.pb.h"
-#if USE_FEC
-#include "update_engine/payload_consumer/fec_file_descriptor.h"
-#endif
 
 namespace chromeos_update_engine {
 using std::string;
 
+namespace {
+std::atomic<uint64_t> g_num_ecc_fallbacks{0};
+}  // namespace
+
+uint64_t VerifiedSourceFd::num_ecc_fallbacks() {
+  return g_num_ecc_fallbacks;
+}
+
 bool VerifiedSourceFd::OpenCurrentECCPartition() {
   // No support for ECC for full payloads.
   // Full payload should not have any opeartion that requires ECC partitions.
@@ -49,13 +58,12 @@ bool VerifiedSourceFd::OpenCurrentECCPartition() {
     return false;
 
 #if USE_FEC
-  auto fd = std::make_shared<FecFileDescriptor>();
-  if (!fd->Open(source_path_.c_str(), O_RDONLY, 0)) {
+  source_ecc_fd_ = PartitionFdCache::GetInstance()->OpenEcc(source_path_);
+  if (source_ecc_fd_ == nullptr) {
     PLOG(ERROR) << "Unable to open ECC source partition " << source_path_;
     source_ecc_open_failure_ = true;
     return false;
   }
-  source_ecc_fd_ = fd;
 #else
   // No support for ECC compiled.
   source_ecc_open_failure_ = true;
@@ -103,12 +111,14 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
     // corrected device first since we can't verify the block in the raw device
     // at this point, but we first need to make sure all extents are readable
     // since the error corrected device can be shorter or not available.
+    std::lock_guard<std::mutex> lock(ecc_mutex_);
     if (OpenCurrentECCPartition() &&
         fd_utils::ReadAndHashExtents(
             source_ecc_fd_, operation.src_extents(), block_size_, nullptr)) {
       if (error) {
         *error = ErrorCode::kDownloadOperationHashMissingError;
       }
+      g_num_ecc_fallbacks++;
       return source_ecc_fd_;
     }
     return source_fd_;
@@ -117,8 +127,15 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
   brillo::Blob source_hash;
   brillo::Blob expected_source_hash(operation.src_sha256_hash().begin(),
                                     operation.src_sha256_hash().end());
-  if (!fd_utils::ReadAndHashExtents(
-          source_fd_, operation.src_extents(), block_size_, &source_hash)) {
+  std::optional<brillo::Blob> prefetched_hash;
+  if (prefetcher_) {
+    prefetched_hash = prefetcher_->TakeSourceHash(operation);
+  }
+  if (prefetched_hash) {
+    source_hash = std::move(*prefetched_hash);
+  } else if (!fd_utils::ReadAndHashExtents(
+                 source_fd_, operation.src_extents(), block_size_,
+                 &source_hash)) {
     LOG(ERROR) << "Failed to compute hash for operation " << operation.type()
                << " data offset: " << operation.data_offset();
     if (error) {
@@ -134,6 +151,7 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
   }
   // We fall back to use the error corrected device if the hash of the raw
   // device doesn't match or there was an error reading the source partition.
+  std::lock_guard<std::mutex> lock(ecc_mutex_);
   if (!OpenCurrentECCPartition()) {
     // The following function call will return false since the source hash
     // mismatches, but we still want to call it so it prints the appropriate
@@ -147,6 +165,7 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
                << ", expected "
                << base::HexEncode(expected_source_hash.data(),
                                   expected_source_hash.size());
+  g_num_ecc_fallbacks++;
 
   std::vector<unsigned char> source_data;
   if (!utils::ReadExtents(
@@ -170,11 +189,34 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
   return nullptr;
 }
 
+std::unique_lock<std::mutex> VerifiedSourceFd::LockIfShared(
+    const FileDescriptorPtr& fd) {
+  if (fd == nullptr || fd->Fd() >= 0) {
+    return {};
+  }
+  return std::unique_lock<std::mutex>(ecc_mutex_);
+}
+
+void VerifiedSourceFd::EnablePrefetch(size_t depth) {
+  if (depth == 0 || source_fd_ == nullptr || !source_fd_->IsOpen() ||
+      source_fd_->Fd() < 0) {
+    return;
+  }
+  prefetcher_ =
+      std::make_unique<SourceHashPrefetcher>(source_fd_, block_size_, depth);
+}
+
+void VerifiedSourceFd::PrefetchSourceHashes(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    size_t op_index) {
+  if (prefetcher_) {
+    prefetcher_->Prefetch(operations, op_index);
+  }
+}
+
 bool VerifiedSourceFd::Open() {
-  source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
-  if (source_fd_ == nullptr)
-    return false;
-  if (!source_fd_->Open(source_path_.c_str(), O_RDONLY)) {
+  source_fd_ = PartitionFdCache::GetInstance()->Open(source_path_, O_RDONLY);
+  if (source_fd_ == nullptr) {
     PLOG(ERROR) << "Failed to open " << source_path_;
   }
   return true;
@@ -17,7 +17,10 @@
 #define UPDATE_ENGINE_VERIFIED_SOURCE_FD_H__
 
 #include <cstddef>
+#include <cstdint>
 
+#include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 
@@ -26,6 +29,7 @@
 
 #include "update_engine/common/error_code.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/source_hash_prefetcher.h"
 
 namespace chromeos_update_engine {
 
@@ -33,11 +37,39 @@ class VerifiedSourceFd {
  public:
   explicit VerifiedSourceFd(size_t block_size, std::string source_path)
       : block_size_(block_size), source_path_(std::move(source_path)) {}
+  // Safe to call from multiple threads at once, the error-corrected device is
+  // only accessed with |ecc_mutex_| held.
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& operation,
                                    ErrorCode* error);
 
+  // Returns a lock which must be held while reading from |fd| if |fd| was
+  // returned by ChooseSourceFD() and can't be read positionally, i.e. it's the
+  // error-corrected device. The returned lock is empty for any other |fd|.
+  [[nodiscard]] std::unique_lock<std::mutex> LockIfShared(
+      const FileDescriptorPtr& fd);
+
   [[nodiscard]] bool Open();
 
+  // Hashes the source of up to |depth| upcoming operations in the background
+  // once PrefetchSourceHashes() is called, ChooseSourceFD() then uses those
+  // hashes instead of reading the source again. Must be called after Open().
+  // Prefetching is silently unavailable if the source can't be read
+  // positionally.
+  void EnablePrefetch(size_t depth);
+
+  // Starts prefetching the sources of |operations| from |op_index| on, see
+  // SourceHashPrefetcher::Prefetch(). No-op unless EnablePrefetch() was called.
+  void PrefetchSourceHashes(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+      size_t op_index);
+
+  // The raw source partition, without any verification or error correction.
+  const FileDescriptorPtr& source_fd() const { return source_fd_; }
+
+  // The number of operations of all instances which read their source
+  // through the error-corrected device since the process started.
+  static uint64_t num_ecc_fallbacks();
+
  private:
   bool WriteBackCorrectedSourceBlocks(
       const std::vector<unsigned char>& source_data,
@@ -47,6 +79,10 @@ class VerifiedSourceFd {
   const std::string source_path_;
   FileDescriptorPtr source_ecc_fd_;
   FileDescriptorPtr source_fd_;
+  // Guards |source_ecc_fd_| and the fields describing its state below.
+  std::mutex ecc_mutex_;
+  // Declared after |source_fd_|, so its worker is stopped first.
+  std::unique_ptr<SourceHashPrefetcher> prefetcher_;
 
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/verified_source_hashes.h"
+
+#include <vector>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The value of the pref of a partition is "<digest> <size> <hex hash>".
+string GetPrefKey(const string& partition_name) {
+  return PrefsInterface::CreateSubKey(
+      {kPrefsVerifiedSourceHashes, partition_name});
+}
+}  // namespace
+
+bool GetVerifiedSourceHash(PrefsInterface* prefs,
+                           const string& verity_digest,
+                           const string& partition_name,
+                           uint64_t size,
+                           brillo::Blob* hash) {
+  string value;
+  if (!prefs || verity_digest.empty() ||
+      !prefs->GetString(GetPrefKey(partition_name), &value)) {
+    return false;
+  }
+  const vector<string> fields = base::SplitString(
+      value, " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  uint64_t saved_size = 0;
+  vector<uint8_t> saved_hash;
+  if (fields.size() != 3 || fields[0] != verity_digest ||
+      !base::StringToUint64(fields[1], &saved_size) || saved_size != size ||
+      !base::HexStringToBytes(fields[2], &saved_hash)) {
+    return false;
+  }
+  hash->assign(saved_hash.begin(), saved_hash.end());
+  return true;
+}
+
+void SetVerifiedSourceHash(PrefsInterface* prefs,
+                           const string& verity_digest,
+                           const string& partition_name,
+                           uint64_t size,
+                           const brillo::Blob& hash) {
+  if (!prefs || verity_digest.empty() || hash.empty()) {
+    return;
+  }
+  if (!prefs->SetString(GetPrefKey(partition_name),
+                        verity_digest + " " + std::to_string(size) + " " +
+                            HexEncode(hash))) {
+    LOG(WARNING) << "Unable to save the source hash of " << partition_name;
+  }
+}
+
+void ClearVerifiedSourceHashes(PrefsInterface* prefs,
+                               const vector<string>& partition_names) {
+  if (!prefs) {
+    return;
+  }
+  for (const string& partition_name : partition_names) {
+    const string key = GetPrefKey(partition_name);
+    if (prefs->Exists(key) && !prefs->Delete(key)) {
+      LOG(WARNING) << "Unable to drop the source hash of " << partition_name;
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,70 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_VERIFIED_SOURCE_HASHES_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_VERIFIED_SOURCE_HASHES_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/prefs_interface.h"
+
+namespace chromeos_update_engine {
+
+// The SHA-256 of the first |size| bytes of the source partitions, as read
+// while the source slot was verified by dm-verity against |verity_digest|.
+// They are kept in |prefs| across update attempts so that
+// VerifyPayloadApplicable() doesn't read the partitions in full every time.
+//
+// dm-verity only checks the blocks read through it, and doesn't cover the
+// whole partition, so a saved hash is not trusted in place of the partition
+// contents: it may only skip a check which the update repeats anyway. The
+// source hashes of the operations and the hashes of the target partitions are
+// always computed from what is read, so a stale hash can't get a wrong update
+// installed, it only makes the update fail later. Such a failure drops the
+// saved hashes, see ClearVerifiedSourceHashes(). For the same reason the
+// hashes never stand in for the partitions when the result is the identity
+// of a partition, e.g. in a partition_info hash.
+//
+// Only the last hash of each partition is kept, and nothing is kept or found
+// when |verity_digest| is empty.
+
+// Returns whether a hash of |partition_name| was saved for the same
+// |verity_digest| and |size|, and sets |hash| to it.
+bool GetVerifiedSourceHash(PrefsInterface* prefs,
+                           const std::string& verity_digest,
+                           const std::string& partition_name,
+                           uint64_t size,
+                           brillo::Blob* hash);
+
+// Saves the |hash| of the first |size| bytes of |partition_name|.
+void SetVerifiedSourceHash(PrefsInterface* prefs,
+                           const std::string& verity_digest,
+                           const std::string& partition_name,
+                           uint64_t size,
+                           const brillo::Blob& hash);
+
+// Drops the hashes saved for |partition_names|, once the update found one of
+// them doesn't match the content of its partition anymore.
+void ClearVerifiedSourceHashes(PrefsInterface* prefs,
+                               const std::vector<std::string>& partition_names);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_VERIFIED_SOURCE_HASHES_H_
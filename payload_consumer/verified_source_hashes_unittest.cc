@@ -0,0 +1,75 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/verified_source_hashes.h"
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/fake_prefs.h"
+
+namespace chromeos_update_engine {
+
+TEST(VerifiedSourceHashesTest, SaveAndGetTest) {
+  FakePrefs prefs;
+  const brillo::Blob hash = {0x01, 0x23, 0xab, 0xcd};
+  brillo::Blob saved_hash;
+  EXPECT_FALSE(
+      GetVerifiedSourceHash(&prefs, "digest", "system", 4096, &saved_hash));
+
+  SetVerifiedSourceHash(&prefs, "digest", "system", 4096, hash);
+  EXPECT_TRUE(
+      GetVerifiedSourceHash(&prefs, "digest", "system", 4096, &saved_hash));
+  EXPECT_EQ(hash, saved_hash);
+  // The hash only holds for the same digest and size of the same partition.
+  EXPECT_FALSE(
+      GetVerifiedSourceHash(&prefs, "other", "system", 4096, &saved_hash));
+  EXPECT_FALSE(
+      GetVerifiedSourceHash(&prefs, "digest", "system", 8192, &saved_hash));
+  EXPECT_FALSE(
+      GetVerifiedSourceHash(&prefs, "digest", "vendor", 4096, &saved_hash));
+
+  // A new digest replaces the hash.
+  SetVerifiedSourceHash(&prefs, "other", "system", 4096, hash);
+  EXPECT_FALSE(
+      GetVerifiedSourceHash(&prefs, "digest", "system", 4096, &saved_hash));
+  EXPECT_TRUE(
+      GetVerifiedSourceHash(&prefs, "other", "system", 4096, &saved_hash));
+}
+
+TEST(VerifiedSourceHashesTest, ClearTest) {
+  FakePrefs prefs;
+  brillo::Blob saved_hash;
+  SetVerifiedSourceHash(&prefs, "digest", "system", 4096, {0x01});
+  SetVerifiedSourceHash(&prefs, "digest", "vendor", 4096, {0x02});
+  ClearVerifiedSourceHashes(&prefs, {"system", "product"});
+  EXPECT_FALSE(
+      GetVerifiedSourceHash(&prefs, "digest", "system", 4096, &saved_hash));
+  EXPECT_TRUE(
+      GetVerifiedSourceHash(&prefs, "digest", "vendor", 4096, &saved_hash));
+}
+
+TEST(VerifiedSourceHashesTest, NoDigestTest) {
+  // Nothing is saved without dm-verity.
+  FakePrefs prefs;
+  brillo::Blob saved_hash;
+  SetVerifiedSourceHash(&prefs, "", "system", 4096, {0x01});
+  EXPECT_FALSE(GetVerifiedSourceHash(&prefs, "", "system", 4096, &saved_hash));
+  EXPECT_FALSE(prefs.Exists(PrefsInterface::CreateSubKey(
+      {kPrefsVerifiedSourceHashes, "system"})));
+}
+
+}  // namespace chromeos_update_engine
@@ -20,7 +20,15 @@
 
 #include <algorithm>
 #include <memory>
+#include <thread>
 #include <utility>
+#include <vector>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
@@ -35,6 +43,61 @@ extern "C" {
 
 namespace chromeos_update_engine {
 
+namespace {
+// Size of the reads of FEC data which wasn't passed to Update().
+constexpr size_t kFusedReadSize = 1024 * 1024;  // 1 MiB
+// Threads encoding the data passed to a single Update() call, and the least
+// data each of them encodes.
+constexpr size_t kMaxEncodeThreads = 4;
+constexpr size_t kMinBytesPerThread = 256 * 1024;  // 256 KiB
+
+// Adds |mul|[|src|[i]] to |dst|[i] for the |size| bytes of |src|. |nibbles|
+// holds |mul| of the values 0 to 15 followed by |mul| of 0x00 to 0xf0, which
+// is enough to multiply 16 bytes at a time since multiplying by a constant in
+// GF(2^8) is linear. Uses only |mul| unless |use_simd|.
+void MultiplyAdd(const uint8_t* src,
+                 size_t size,
+                 const uint8_t* mul,
+                 const uint8_t* nibbles,
+                 uint8_t* dst,
+                 bool use_simd) {
+  size_t i = 0;
+  // The bytes multiplied 16 at a time, the rest is left to the scalar loop.
+  [[maybe_unused]] const size_t simd_size = use_simd ? size / 16 * 16 : 0;
+#if defined(__SSSE3__)
+  const __m128i low_table =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(nibbles));
+  const __m128i high_table =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(nibbles + 16));
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  for (; i < simd_size; i += 16) {
+    const __m128i value =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    const __m128i low = _mm_and_si128(value, mask);
+    const __m128i high = _mm_and_si128(_mm_srli_epi64(value, 4), mask);
+    const __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low_table, low),
+                                          _mm_shuffle_epi8(high_table, high));
+    __m128i* out = reinterpret_cast<__m128i*>(dst + i);
+    _mm_storeu_si128(out, _mm_xor_si128(_mm_loadu_si128(out), product));
+  }
+#elif defined(__aarch64__)
+  const uint8x16_t low_table = vld1q_u8(nibbles);
+  const uint8x16_t high_table = vld1q_u8(nibbles + 16);
+  const uint8x16_t mask = vdupq_n_u8(0x0f);
+  for (; i < simd_size; i += 16) {
+    const uint8x16_t value = vld1q_u8(src + i);
+    const uint8x16_t product =
+        veorq_u8(vqtbl1q_u8(low_table, vandq_u8(value, mask)),
+                 vqtbl1q_u8(high_table, vshrq_n_u8(value, 4)));
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), product));
+  }
+#endif
+  for (; i < size; i++) {
+    dst[i] ^= mul[src[i]];
+  }
+}
+}  // namespace
+
 bool IncrementalEncodeFEC::Init(const uint64_t _data_offset,
                                 const uint64_t _data_size,
                                 const uint64_t _fec_offset,
@@ -54,16 +117,182 @@ bool IncrementalEncodeFEC::Init(const uint64_t _data_offset,
   // This is the N in RS(M, N), which is the number of bytes for each rs block.
   rs_n_ = FEC_RSM - fec_roots_;
   rs_char_.reset(init_rs_char(FEC_PARAMS(fec_roots_)));
-  rs_blocks_.resize(block_size_ * rs_n_);
-  buffer_.resize(block_size_, 0);
-  fec_.resize(block_size_ * fec_roots_);
-  fec_read_.resize(fec_.size());
   TEST_AND_RETURN_FALSE(data_size_ % block_size_ == 0);
   TEST_AND_RETURN_FALSE(fec_roots_ >= 0 && fec_roots_ < FEC_RSM);
 
   num_rounds_ = utils::DivRoundUp(data_size_ / block_size_, rs_n_);
   TEST_AND_RETURN_FALSE(num_rounds_ * fec_roots_ * block_size_ == fec_size_);
   TEST_AND_RETURN_FALSE(rs_char_ != nullptr);
+
+  encoded_end_ = data_offset_;
+  fused_ = fec_size_ != 0 && fec_size_ <= kMaxFusedFecSize;
+  if (!fused_) {
+    LOG_IF(INFO, fec_size_ != 0)
+        << "FEC data of " << fec_size_
+        << " bytes is encoded by re-reading the partition";
+    rs_blocks_.resize(block_size_ * rs_n_);
+    buffer_ = AlignedBufferPool::GetInstance()->Acquire(block_size_);
+    TEST_AND_RETURN_FALSE(buffer_.size() == block_size_);
+    fec_.resize(block_size_ * fec_roots_);
+    parity_.clear();
+    mul_tables_.clear();
+    nibble_tables_.clear();
+    return true;
+  }
+  parity_.assign(fec_size_, 0);
+  buffer_ = AlignedBufferPool::GetInstance()->Acquire(kFusedReadSize);
+  TEST_AND_RETURN_FALSE(buffer_.size() == kFusedReadSize);
+  fec_.resize(block_size_ * fec_roots_);
+  num_threads_ = std::clamp<size_t>(
+      std::thread::hardware_concurrency(), 1, kMaxEncodeThreads);
+  min_bytes_per_thread_ = kMinBytesPerThread;
+  use_simd_ = true;
+  // The parity of a byte value |v| at position |j| of an rs block is |v|
+  // times the parity of 1 at that position, the products of each root are
+  // looked up in |mul_tables_|, or in |nibble_tables_| 16 bytes at a time.
+  mul_tables_.resize(rs_n_ * fec_roots_ * 256);
+  nibble_tables_.resize(rs_n_ * fec_roots_ * 32);
+  brillo::Blob message(rs_n_, 0);
+  brillo::Blob parity(8 * fec_roots_);
+  for (uint64_t j = 0; j < rs_n_; j++) {
+    // Parity of the 8 rs blocks with a single bit set at position |j|, the
+    // parity of any other byte value is the xor of those of its bits.
+    for (int bit = 0; bit < 8; bit++) {
+      message[j] = 1 << bit;
+      encode_rs_char(
+          rs_char_.get(), message.data(), parity.data() + bit * fec_roots_);
+    }
+    message[j] = 0;
+    for (uint64_t r = 0; r < fec_roots_; r++) {
+      uint8_t* mul = mul_tables_.data() + (j * fec_roots_ + r) * 256;
+      mul[0] = 0;
+      for (unsigned v = 1; v < 256; v++) {
+        const unsigned low_bit = v & -v;
+        mul[v] = mul[v ^ low_bit] ^
+                 parity[__builtin_ctz(low_bit) * fec_roots_ + r];
+      }
+      uint8_t* nibbles = nibble_tables_.data() + (j * fec_roots_ + r) * 32;
+      for (unsigned v = 0; v < 16; v++) {
+        nibbles[v] = mul[v];
+        nibbles[16 + v] = mul[v << 4];
+      }
+    }
+  }
+  return true;
+}
+
+void IncrementalEncodeFEC::SetEncodeOptionsForTesting(
+    size_t num_threads, size_t min_bytes_per_thread, bool use_simd) {
+  num_threads_ = std::max<size_t>(num_threads, 1);
+  min_bytes_per_thread_ = std::max<size_t>(min_bytes_per_thread, 1);
+  use_simd_ = use_simd;
+}
+
+void IncrementalEncodeFEC::Update(uint64_t offset,
+                                  const uint8_t* data,
+                                  size_t size) {
+  if (!fused_ || offset > encoded_end_) {
+    return;
+  }
+  const uint64_t end = std::min(offset + size, data_offset_ + data_size_);
+  if (end <= encoded_end_) {
+    return;
+  }
+  EncodeData(encoded_end_ - data_offset_,
+             data + (encoded_end_ - offset),
+             end - encoded_end_);
+  encoded_end_ = end;
+}
+
+void IncrementalEncodeFEC::EncodeData(uint64_t offset,
+                                      const uint8_t* data,
+                                      size_t size) {
+  // Data blocks |num_rounds_| apart belong to the same round, any shorter run
+  // of bytes adds to distinct parity bytes and can be split across threads.
+  const uint64_t window = num_rounds_ * block_size_;
+  while (size > 0) {
+    const size_t window_size = std::min<uint64_t>(size, window);
+    const size_t num_threads = std::clamp<size_t>(
+        window_size / min_bytes_per_thread_, 1, num_threads_);
+    std::vector<std::thread> threads;
+    size_t begin = 0;
+    for (size_t t = 1; t <= num_threads; t++) {
+      size_t end = window_size;
+      if (t < num_threads) {
+        // Split at block boundaries, which leaves nothing to this thread if
+        // its share ends in the block where the previous one ended.
+        const uint64_t split = (offset + window_size * t / num_threads) /
+                               block_size_ * block_size_;
+        end = split > offset + begin ? split - offset : begin;
+      }
+      if (t < num_threads) {
+        threads.emplace_back(&IncrementalEncodeFEC::EncodeBlocks,
+                             this,
+                             offset + begin,
+                             data + begin,
+                             end - begin);
+      } else {
+        EncodeBlocks(offset + begin, data + begin, end - begin);
+      }
+      begin = end;
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    data += window_size;
+    offset += window_size;
+    size -= window_size;
+  }
+}
+
+void IncrementalEncodeFEC::EncodeBlocks(uint64_t offset,
+                                        const uint8_t* data,
+                                        size_t size) {
+  // Byte |k| of data block |b| is at position |b / num_rounds_| of rs block
+  // |k| of round |b % num_rounds_|, see fec_ecc_interleave().
+  const uint64_t plane_size = num_rounds_ * block_size_;
+  while (size > 0) {
+    const uint64_t block = offset / block_size_;
+    const uint64_t byte = offset % block_size_;
+    const size_t count = std::min<uint64_t>(size, block_size_ - byte);
+    const uint64_t table = (block / num_rounds_) * fec_roots_;
+    uint8_t* parity =
+        parity_.data() + (block % num_rounds_) * block_size_ + byte;
+    for (uint64_t r = 0; r < fec_roots_; r++) {
+      MultiplyAdd(data,
+                  count,
+                  mul_tables_.data() + (table + r) * 256,
+                  nibble_tables_.data() + (table + r) * 32,
+                  parity + r * plane_size,
+                  use_simd_);
+    }
+    data += count;
+    offset += count;
+    size -= count;
+  }
+}
+
+bool IncrementalEncodeFEC::WriteFEC(const brillo::Blob& fec) {
+  if (verify_mode_) {
+    fec_read_.resize(fec.size());
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(read_fd_,
+                                          fec_read_.data(),
+                                          fec_read_.size(),
+                                          fec_offset_,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read >= 0);
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == fec_read_.size());
+    TEST_AND_RETURN_FALSE(fec == fec_read_);
+  } else {
+    CHECK(write_fd_);
+    write_fd_->Seek(fec_offset_, SEEK_SET);
+    if (!utils::WriteAll(write_fd_, fec.data(), fec.size())) {
+      PLOG(ERROR) << "EncodeFEC write() failed";
+      return false;
+    }
+  }
+  fec_offset_ += fec.size();
   return true;
 }
 
@@ -74,6 +303,22 @@ bool IncrementalEncodeFEC::Compute(FileDescriptor* _read_fd,
     write_fd_ = _write_fd;
     cache_fd_.SetFD(write_fd_);
     write_fd_ = &cache_fd_;
+  } else if (current_step_ == EncodeFECStep::kEncodeRoundStep && fused_) {
+    // Only the data which wasn't passed to Update() is left to be read.
+    const uint64_t data_end = data_offset_ + data_size_;
+    if (encoded_end_ < data_end) {
+      const size_t read_size =
+          std::min<uint64_t>(buffer_.size(), data_end - encoded_end_);
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          read_fd_, buffer_.data(), read_size, encoded_end_, &bytes_read));
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == read_size);
+      EncodeData(encoded_end_ - data_offset_, buffer_.data(), read_size);
+      encoded_end_ += read_size;
+    }
+    if (encoded_end_ == data_end) {
+      current_round_ = num_rounds_;
+    }
   } else if (current_step_ == EncodeFECStep::kEncodeRoundStep) {
     // Encodes |block_size| number of rs blocks each round so that we can read
     // one block each time instead of 1 byte to increase random read
@@ -107,28 +352,23 @@ bool IncrementalEncodeFEC::Compute(FileDescriptor* _read_fd,
                      fec_.data() + j * fec_roots_);
     }
 
-    if (verify_mode_) {
-      ssize_t bytes_read = 0;
-      TEST_AND_RETURN_FALSE(utils::PReadAll(read_fd_,
-                                            fec_read_.data(),
-                                            fec_read_.size(),
-                                            fec_offset_,
-                                            &bytes_read));
-      TEST_AND_RETURN_FALSE(bytes_read >= 0);
-      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) ==
-                            fec_read_.size());
-      TEST_AND_RETURN_FALSE(fec_ == fec_read_);
-    } else {
-      CHECK(write_fd_);
-      write_fd_->Seek(fec_offset_, SEEK_SET);
-      if (!utils::WriteAll(write_fd_, fec_.data(), fec_.size())) {
-        PLOG(ERROR) << "EncodeFEC write() failed";
-        return false;
-      }
-    }
-    fec_offset_ += fec_.size();
+    TEST_AND_RETURN_FALSE(WriteFEC(fec_));
     current_round_++;
   } else if (current_step_ == EncodeFECStep::kWriteStep) {
+    if (fused_) {
+      // Interleave the parity planes into the parity of each rs block, one
+      // round at a time.
+      const uint64_t plane_size = num_rounds_ * block_size_;
+      for (uint64_t i = 0; i < num_rounds_; i++) {
+        for (uint64_t k = 0; k < block_size_; k++) {
+          for (uint64_t r = 0; r < fec_roots_; r++) {
+            fec_[k * fec_roots_ + r] =
+                parity_[r * plane_size + i * block_size_ + k];
+          }
+        }
+        TEST_AND_RETURN_FALSE(WriteFEC(fec_));
+      }
+    }
     write_fd_->Flush();
   }
   UpdateState();
@@ -151,6 +391,9 @@ bool IncrementalEncodeFEC::Finished() const {
 }
 
 double IncrementalEncodeFEC::ReportProgress() const {
+  if (fused_ && data_size_ != 0) {
+    return static_cast<double>(encoded_end_ - data_offset_) / data_size_;
+  }
   if (num_rounds_ == 0) {
     return 1.0;
   }
@@ -182,7 +425,7 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
                  << partition_->hash_tree_algorithm;
       return false;
     }
-    hash_tree_builder_ = std::make_unique<HashTreeBuilder>(
+    hash_tree_builder_ = std::make_unique<ParallelHashTreeBuilder>(
         partition_->block_size, hash_function);
     TEST_AND_RETURN_FALSE(hash_tree_builder_->Initialize(
         partition_->hash_tree_data_size, partition_->hash_tree_salt));
@@ -230,51 +473,20 @@ bool VerityWriterAndroid::Update(const uint64_t offset,
       }
     }
   }
-  total_offset_ += size;
-
-  return true;
-}
-bool VerityWriterAndroid::Finalize(FileDescriptor* read_fd,
-                                   FileDescriptor* write_fd) {
-  const auto hash_tree_data_end =
-      partition_->hash_tree_data_offset + partition_->hash_tree_data_size;
-  if (total_offset_ < hash_tree_data_end) {
-    LOG(ERROR) << "Read up to " << total_offset_
-               << " when we are expecting to read everything "
-                  "before "
-               << hash_tree_data_end;
-    return false;
-  }
-  // All hash tree data blocks has been hashed, write hash tree to disk.
-  LOG(INFO) << "Writing verity hash tree to "
-            << partition_->readonly_target_path;
-  if (hash_tree_builder_) {
-    TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
-    TEST_AND_RETURN_FALSE_ERRNO(
-        write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
-    auto success =
-        hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
-          return utils::WriteAll(write_fd, data, size);
-        });
-    // hashtree builder already prints error messages.
-    TEST_AND_RETURN_FALSE(success);
-    hash_tree_builder_.reset();
-  }
   if (partition_->fec_size != 0) {
-    LOG(INFO) << "Writing verity FEC to " << partition_->readonly_target_path;
-    TEST_AND_RETURN_FALSE(EncodeFEC(read_fd,
-                                    write_fd,
-                                    partition_->fec_data_offset,
-                                    partition_->fec_data_size,
-                                    partition_->fec_offset,
-                                    partition_->fec_size,
-                                    partition_->fec_roots,
-                                    partition_->block_size,
-                                    false /* verify_mode */));
+    // The hash tree on disk is stale until IncrementalFinalize() writes it.
+    uint64_t fec_end_offset = offset + size;
+    if (partition_->hash_tree_size != 0) {
+      fec_end_offset = std::min(fec_end_offset, partition_->hash_tree_offset);
+    }
+    if (offset < fec_end_offset) {
+      encodeFEC_.Update(offset, buffer, fec_end_offset - offset);
+    }
   }
+  total_offset_ += size;
+
   return true;
 }
-
 bool VerityWriterAndroid::IncrementalFinalize(FileDescriptor* read_fd,
                                               FileDescriptor* write_fd) {
   if (!hash_tree_written_) {
@@ -295,8 +507,12 @@ bool VerityWriterAndroid::IncrementalFinalize(FileDescriptor* read_fd,
       TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
       TEST_AND_RETURN_FALSE_ERRNO(
           write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
-      auto success =
-          hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
+      // The hash tree is usually covered by FEC as well.
+      uint64_t hash_tree_offset = partition_->hash_tree_offset;
+      auto success = hash_tree_builder_->WriteHashTree(
+          [this, write_fd, &hash_tree_offset](auto data, auto size) {
+            encodeFEC_.Update(hash_tree_offset, data, size);
+            hash_tree_offset += size;
             return utils::WriteAll(write_fd, data, size);
           });
       // hashtree builder already prints error messages.
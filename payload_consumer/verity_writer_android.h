@@ -29,7 +29,9 @@ extern "C" {
 }
 
 #include "payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
 
 namespace chromeos_update_engine {
@@ -39,8 +41,19 @@ enum class EncodeFECStep {
   kWriteStep,
   kComplete
 };
+// Encodes FEC data either in rounds, re-reading the data blocks of every rs
+// block from disk, or, when the FEC data is small enough to be kept in memory,
+// from the data passed to Update() while the partition is read for the hash
+// tree. Reed-Solomon parity is linear, so each data byte adds its value times
+// a constant of its position to each parity byte of its rs block no matter in
+// which order the bytes come. Those products are computed 16 bytes at a time
+// with SSSE3 or NEON when available, on up to 4 threads.
 class IncrementalEncodeFEC {
  public:
+  // Largest FEC data encoded from Update(), enough for the FEC of a 7 GiB
+  // partition with 2 roots.
+  static constexpr uint64_t kMaxFusedFecSize = 64 * 1024 * 1024;  // 64 MiB
+
   IncrementalEncodeFEC()
       : rs_char_(nullptr, &free_rs_char), cache_fd_(nullptr, 1 * (1 << 20)) {}
   // Initialize all member variables needed to performe FEC Computation
@@ -51,15 +64,37 @@ class IncrementalEncodeFEC {
             const uint64_t _fec_roots,
             const uint64_t _block_size,
             const bool _verify_mode);
+  // Encodes partition data at [offset : offset + size) if it directly follows
+  // the data encoded so far, data read later than that is ignored and read
+  // from disk by Compute() instead.
+  void Update(uint64_t offset, const uint8_t* data, size_t size);
   bool Compute(FileDescriptor* _read_fd, FileDescriptor* _write_fd);
   void UpdateState();
   bool Finished() const;
   void Reset();
   double ReportProgress() const;
 
+  // Overrides, after Init(), the threads encoding the data passed to
+  // Update(), the least data each of them encodes and whether SIMD
+  // instructions compute the products, so that tests can compare every path
+  // with libfec.
+  void SetEncodeOptionsForTesting(size_t num_threads,
+                                  size_t min_bytes_per_thread,
+                                  bool use_simd);
+
  private:
+  // Adds the parity contribution of the |size| bytes of |data| at |offset| of
+  // the FEC data range to |parity_|.
+  void EncodeData(uint64_t offset, const uint8_t* data, size_t size);
+  // Same as EncodeData() on the calling thread, the range must not contain
+  // two blocks of the same round.
+  void EncodeBlocks(uint64_t offset, const uint8_t* data, size_t size);
+  // Writes |fec| to |fec_offset_|, or compares it with what's there in verify
+  // mode, and advances |fec_offset_|.
+  bool WriteFEC(const brillo::Blob& fec);
+
   brillo::Blob rs_blocks_;
-  brillo::Blob buffer_;
+  AlignedBufferPool::Buffer buffer_;
   brillo::Blob fec_;
   brillo::Blob fec_read_;
   EncodeFECStep current_step_;
@@ -75,6 +110,21 @@ class IncrementalEncodeFEC {
   uint64_t block_size_;
   uint64_t rs_n_;
   bool verify_mode_;
+  // Whether the FEC is encoded from the data passed to Update().
+  bool fused_{false};
+  // End of the data encoded so far, as an offset in the partition.
+  uint64_t encoded_end_{0};
+  // Parity byte |r| of every rs block, in |fec_roots_| planes of
+  // |num_rounds_| * |block_size_| bytes.
+  brillo::Blob parity_;
+  // Parity byte |r| contributed by byte value |v| at position |j| of an rs
+  // block, at (j * |fec_roots_| + r) * 256 + v.
+  brillo::Blob mul_tables_;
+  // The same for the values 0 to 15 and 0x00 to 0xf0, 32 bytes per table.
+  brillo::Blob nibble_tables_;
+  size_t num_threads_{1};
+  size_t min_bytes_per_thread_{1};
+  bool use_simd_{true};
   std::unique_ptr<void, decltype(&free_rs_char)> rs_char_;
   UnownedCachedFileDescriptor cache_fd_;
 };
@@ -86,17 +136,16 @@ class VerityWriterAndroid : public VerityWriterInterface {
 
   bool Init(const InstallPlan::Partition& partition);
   bool Update(uint64_t offset, const uint8_t* buffer, size_t size) override;
-  bool Finalize(FileDescriptor* read_fd, FileDescriptor* write_fd) override;
   bool IncrementalFinalize(FileDescriptor* read_fd,
                            FileDescriptor* write_fd) override;
   double GetProgress() override;
   bool FECFinished() const override;
   // Read [data_offset : data_offset + data_size) from |path| and encode FEC
   // data, if |verify_mode|, then compare the encoded FEC with the one in
-  // |path|, otherwise write the encoded FEC to |path|. We can't encode as we go
-  // in each Update() like hash tree, because for every rs block, its data are
-  // spreaded across entire |data_size|, unless we can cache all data in
-  // memory, we have to re-read them from disk.
+  // |path|, otherwise write the encoded FEC to |path|. For every rs block, its
+  // data are spreaded across entire |data_size|, so this re-reads them from
+  // disk round by round. Update() encodes as it goes instead when the FEC
+  // data fits in memory, see IncrementalEncodeFEC.
   static bool EncodeFEC(FileDescriptor* read_fd,
                         FileDescriptor* write_fd,
                         uint64_t data_offset,
@@ -121,7 +170,7 @@ class VerityWriterAndroid : public VerityWriterInterface {
   bool hash_tree_written_ = false;
   const InstallPlan::Partition* partition_ = nullptr;
 
-  std::unique_ptr<HashTreeBuilder> hash_tree_builder_;
+  std::unique_ptr<ParallelHashTreeBuilder> hash_tree_builder_;
   uint64_t total_offset_ = 0;
   DISALLOW_COPY_AND_ASSIGN(VerityWriterAndroid);
 };
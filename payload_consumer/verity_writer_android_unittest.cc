@@ -18,6 +18,8 @@
 
 #include <fcntl.h>
 
+#include <algorithm>
+
 #include <brillo/secure_blob.h>
 #include <gtest/gtest.h>
 
@@ -165,6 +167,126 @@ TEST_F(VerityWriterAndroidTest, FECTest) {
   ASSERT_EQ(part_data, actual_part);
 }
 
+TEST_F(VerityWriterAndroidTest, FECCoversHashTreeAndMetadata) {
+  // 300 data blocks take two rounds, FEC covers the data, the hash tree and
+  // one more block which is never passed to Update().
+  const uint64_t block_size = partition_.block_size;
+  partition_.hash_tree_algorithm = "sha256";
+  partition_.hash_tree_data_size = 300 * block_size;
+  partition_.hash_tree_offset = partition_.hash_tree_data_size;
+  HashTreeBuilder builder(block_size,
+                          HashTreeBuilder::HashFunction("sha256"));
+  partition_.hash_tree_size =
+      builder.CalculateSize(partition_.hash_tree_data_size);
+  partition_.fec_data_offset = 0;
+  partition_.fec_data_size =
+      partition_.hash_tree_offset + partition_.hash_tree_size + block_size;
+  partition_.fec_offset = partition_.fec_data_size;
+  partition_.fec_size = 2 * partition_.fec_roots * block_size;
+  brillo::Blob part_data(partition_.fec_offset + partition_.fec_size);
+  for (size_t i = 0; i < partition_.fec_data_size; i++) {
+    part_data[i] = (i * 7 + i / block_size) & 0xff;
+  }
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+
+  ASSERT_TRUE(verity_writer_.Init(partition_));
+  for (uint64_t offset = 0; offset < partition_.hash_tree_offset;
+       offset += 8 * block_size) {
+    const size_t size =
+        std::min(8 * block_size, partition_.hash_tree_offset - offset);
+    ASSERT_TRUE(verity_writer_.Update(offset, part_data.data() + offset, size));
+  }
+  ASSERT_TRUE(
+      verity_writer_.Finalize(partition_fd_.get(), partition_fd_.get()));
+  // Encoding by re-reading the rs blocks of every round from disk must agree
+  // with the FEC encoded from the data passed to Update().
+  ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                             partition_.fec_data_offset,
+                                             partition_.fec_data_size,
+                                             partition_.fec_offset,
+                                             partition_.fec_size,
+                                             partition_.fec_roots,
+                                             block_size,
+                                             true /* verify_mode */));
+}
+
+// The FEC encoded from the data passed to Update() must be the same bytes as
+// libfec's, whether computed with or without SIMD instructions, on any number
+// of threads and however the data is split between them. A block size which
+// isn't a multiple of 16 and unaligned Update() sizes leave the SIMD code a
+// tail for the scalar loop.
+TEST_F(VerityWriterAndroidTest, FusedFECMatchesLibfecTest) {
+  constexpr uint64_t kDataBlocks = 1000;
+  for (uint64_t block_size : {4096u, 1000u}) {
+    for (uint64_t fec_roots : {2u, 8u}) {
+      const uint64_t data_size = kDataBlocks * block_size;
+      const uint64_t num_rounds =
+          utils::DivRoundUp(kDataBlocks, FEC_RSM - fec_roots);
+      const uint64_t fec_size = num_rounds * fec_roots * block_size;
+      brillo::Blob part_data(data_size + fec_size);
+      for (size_t i = 0; i < data_size; i++) {
+        part_data[i] = (i * 7 + i / block_size * 13 + (i >> 9)) & 0xff;
+      }
+      ASSERT_TRUE(
+          test_utils::WriteFileVector(partition_.target_path, part_data));
+      ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                                 0,
+                                                 data_size,
+                                                 data_size,
+                                                 fec_size,
+                                                 fec_roots,
+                                                 block_size,
+                                                 false /* verify_mode */));
+      brillo::Blob expected_fec;
+      ASSERT_TRUE(utils::ReadFileChunk(
+          partition_.target_path, data_size, fec_size, &expected_fec));
+
+      // The least data of a thread, splits happen at block boundaries.
+      const uint64_t min_bytes_per_thread[] = {1, block_size, 3 * block_size};
+      for (size_t num_threads : {1u, 2u, 4u}) {
+        for (uint64_t min_bytes : min_bytes_per_thread) {
+          for (bool use_simd : {false, true}) {
+            SCOPED_TRACE(testing::Message()
+                         << "block_size=" << block_size
+                         << " fec_roots=" << fec_roots
+                         << " num_threads=" << num_threads
+                         << " min_bytes=" << min_bytes
+                         << " use_simd=" << use_simd);
+            ASSERT_TRUE(
+                test_utils::WriteFileVector(partition_.target_path, part_data));
+            IncrementalEncodeFEC encode_fec;
+            ASSERT_TRUE(encode_fec.Init(0,
+                                        data_size,
+                                        data_size,
+                                        fec_size,
+                                        fec_roots,
+                                        block_size,
+                                        false /* verify_mode */));
+            encode_fec.SetEncodeOptionsForTesting(
+                num_threads, min_bytes, use_simd);
+            // The last quarter isn't passed to Update() but read from disk.
+            const uint64_t update_size = 7 * block_size + 13;
+            for (uint64_t offset = 0; offset < data_size * 3 / 4;
+                 offset += update_size) {
+              encode_fec.Update(offset,
+                                part_data.data() + offset,
+                                std::min(update_size, data_size - offset));
+            }
+            while (!encode_fec.Finished()) {
+              ASSERT_TRUE(
+                  encode_fec.Compute(partition_fd_.get(), partition_fd_.get()));
+            }
+            brillo::Blob actual_fec;
+            ASSERT_TRUE(utils::ReadFileChunk(
+                partition_.target_path, data_size, fec_size, &actual_fec));
+            ASSERT_EQ(expected_fec, actual_fec);
+          }
+        }
+      }
+    }
+  }
+}
+
 TEST_F(VerityWriterAndroidTest, HashTreeDisabled) {
   partition_.hash_tree_size = 0;
   partition_.hash_tree_data_size = 0;
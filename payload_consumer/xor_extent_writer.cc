@@ -14,12 +14,12 @@
 // limitations under the License.
 //
 
-#include <algorithm>
 #include <optional>
 #include <vector>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/xor_extent_writer.h"
+#include "update_engine/payload_consumer/xor_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
@@ -44,11 +44,7 @@ bool XORExtentWriter::WriteXorCowOp(const uint8_t* bytes,
     return false;
   }
 
-  std::transform(xor_block_data.cbegin(),
-                 xor_block_data.cbegin() + xor_block_data.size(),
-                 bytes,
-                 xor_block_data.begin(),
-                 std::bit_xor<unsigned char>{});
+  XorBytes(xor_block_data.data(), bytes, xor_block_data.size());
   TEST_AND_RETURN_FALSE(cow_writer_->AddXorBlocks(xor_ext.start_block(),
                                                   xor_block_data.data(),
                                                   xor_block_data.size(),
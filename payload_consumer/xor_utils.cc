@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/xor_utils.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace chromeos_update_engine {
+
+namespace {
+
+using XorFunction = void (*)(uint8_t*, const uint8_t*, size_t);
+
+// XORs the bytes which don't fill a whole vector. memcpy() keeps the word
+// accesses safe for unaligned buffers.
+void XorTail(uint8_t* dst, const uint8_t* src, size_t size) {
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < size; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__SSE2__)
+void XorBytesSse2(uint8_t* dst, const uint8_t* src, size_t size) {
+  size_t i = 0;
+  for (; i + 2 * sizeof(__m128i) <= size; i += 2 * sizeof(__m128i)) {
+    auto d = reinterpret_cast<__m128i*>(dst + i);
+    auto s = reinterpret_cast<const __m128i*>(src + i);
+    const __m128i x0 =
+        _mm_xor_si128(_mm_loadu_si128(d), _mm_loadu_si128(s));
+    const __m128i x1 =
+        _mm_xor_si128(_mm_loadu_si128(d + 1), _mm_loadu_si128(s + 1));
+    _mm_storeu_si128(d, x0);
+    _mm_storeu_si128(d + 1, x1);
+  }
+  XorTail(dst + i, src + i, size - i);
+}
+#endif  // __SSE2__
+
+__attribute__((target("avx2"))) void XorBytesAvx2(uint8_t* dst,
+                                                  const uint8_t* src,
+                                                  size_t size) {
+  size_t i = 0;
+  for (; i + 2 * sizeof(__m256i) <= size; i += 2 * sizeof(__m256i)) {
+    auto d = reinterpret_cast<__m256i*>(dst + i);
+    auto s = reinterpret_cast<const __m256i*>(src + i);
+    const __m256i x0 =
+        _mm256_xor_si256(_mm256_loadu_si256(d), _mm256_loadu_si256(s));
+    const __m256i x1 =
+        _mm256_xor_si256(_mm256_loadu_si256(d + 1), _mm256_loadu_si256(s + 1));
+    _mm256_storeu_si256(d, x0);
+    _mm256_storeu_si256(d + 1, x1);
+  }
+  XorTail(dst + i, src + i, size - i);
+}
+#elif defined(__ARM_NEON)
+void XorBytesNeon(uint8_t* dst, const uint8_t* src, size_t size) {
+  size_t i = 0;
+  for (; i + 2 * sizeof(uint8x16_t) <= size; i += 2 * sizeof(uint8x16_t)) {
+    const uint8x16_t x0 = veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i));
+    const uint8x16_t x1 = veorq_u8(vld1q_u8(dst + i + sizeof(uint8x16_t)),
+                                   vld1q_u8(src + i + sizeof(uint8x16_t)));
+    vst1q_u8(dst + i, x0);
+    vst1q_u8(dst + i + sizeof(uint8x16_t), x1);
+  }
+  XorTail(dst + i, src + i, size - i);
+}
+#endif
+
+XorFunction SelectXorFunction() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return XorBytesAvx2;
+  }
+#endif
+#if defined(__SSE2__)
+  return XorBytesSse2;
+#elif defined(__ARM_NEON)
+  // NEON is part of every ARMv8 CPU and of the ARMv7 ABI Android uses.
+  return XorBytesNeon;
+#else
+  return XorBytesGeneric;
+#endif
+}
+
+}  // namespace
+
+void XorBytesGeneric(uint8_t* dst, const uint8_t* src, size_t size) {
+  XorTail(dst, src, size);
+}
+
+void XorBytes(uint8_t* dst, const uint8_t* src, size_t size) {
+  static const XorFunction xor_function = SelectXorFunction();
+  xor_function(dst, src, size);
+}
+
+}  // namespace chromeos_update_engine
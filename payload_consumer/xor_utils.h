@@ -0,0 +1,35 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_XOR_UTILS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_XOR_UTILS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace chromeos_update_engine {
+
+// Sets |dst| to |dst| XOR |src|, |size| bytes each. The buffers may have any
+// alignment but must not partially overlap. Uses the widest vector unit the
+// CPU supports, picked once at runtime: AVX2 or SSE2 on x86, NEON on ARM.
+void XorBytes(uint8_t* dst, const uint8_t* src, size_t size);
+
+// Same as XorBytes() using plain 64-bit words, exposed for tests.
+void XorBytesGeneric(uint8_t* dst, const uint8_t* src, size_t size);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_XOR_UTILS_H_
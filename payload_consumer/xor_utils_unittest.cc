@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/xor_utils.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+std::vector<uint8_t> MakeData(size_t size, uint8_t seed) {
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = static_cast<uint8_t>(i * 31 + seed);
+  }
+  return data;
+}
+}  // namespace
+
+TEST(XorUtilsTest, MatchesBytewiseXor) {
+  // Cover sizes around the vector widths, at every offset within a vector.
+  for (size_t size : {0, 1, 7, 8, 31, 32, 63, 64, 65, 4096, 4096 + 17}) {
+    for (size_t offset = 0; offset < 32; offset++) {
+      auto dst = MakeData(size + offset, 3);
+      const auto src = MakeData(size + offset, 101);
+      auto expected = dst;
+      for (size_t i = offset; i < expected.size(); i++) {
+        expected[i] ^= src[i];
+      }
+      XorBytes(dst.data() + offset, src.data() + offset, size);
+      ASSERT_EQ(expected, dst) << "size " << size << " offset " << offset;
+    }
+  }
+}
+
+TEST(XorUtilsTest, GenericMatchesDispatched) {
+  auto dst = MakeData(4096 * 3 + 5, 1);
+  auto generic_dst = dst;
+  const auto src = MakeData(dst.size(), 2);
+  XorBytes(dst.data(), src.data(), dst.size());
+  XorBytesGeneric(generic_dst.data(), src.data(), generic_dst.size());
+  ASSERT_EQ(generic_dst, dst);
+  // XORing the same data twice restores the original.
+  XorBytes(dst.data(), src.data(), dst.size());
+  ASSERT_EQ(MakeData(dst.size(), 1), dst);
+}
+
+}  // namespace chromeos_update_engine
@@ -17,13 +17,18 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <vector>
+
 using google::protobuf::RepeatedPtrField;
 
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
-
 // xz uses a variable dictionary size which impacts on the compression ratio
 // and is required to be reconstructed in RAM during decompression. While we
 // control the required memory from the compressor side, the decompressor allows
@@ -51,6 +56,113 @@ const char* XzErrorString(enum xz_ret error) {
   }
 #undef __XZ_ERROR_STRING_CASE
 }
+
+constexpr size_t kXzStreamHeaderSize = 12;
+constexpr size_t kXzStreamFooterSize = 12;
+constexpr uint8_t kXzHeaderMagic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+constexpr uint8_t kXzFooterMagic[] = {'Y', 'Z'};
+
+// An xz stream among concatenated ones.
+struct XzStream {
+  size_t offset;
+  size_t size;
+  uint64_t decoded_size;
+};
+
+// Reads the xz variable length integer at |*pos| of the |size| bytes at
+// |data| and advances |*pos| past it.
+bool ReadXzInteger(const uint8_t* data,
+                   size_t size,
+                   size_t* pos,
+                   uint64_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < 9 && *pos < size; i++) {
+    const uint8_t byte = data[(*pos)++];
+    *value |= static_cast<uint64_t>(byte & 0x7f) << (i * 7);
+    if ((byte & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Splits the |size| bytes at |data| in the xz streams they're made of, walking
+// back from the footer and the index of the last one. The streams are only
+// checked as far as needed to find them, decoding them checks the rest.
+// Returns false if |data| isn't made of complete streams.
+bool SplitXzStreams(const uint8_t* data,
+                    size_t size,
+                    std::vector<XzStream>* streams) {
+  streams->clear();
+  size_t end = size;
+  while (end > 0) {
+    if (end < kXzStreamHeaderSize + kXzStreamFooterSize)
+      return false;
+    const uint8_t* footer = data + end - kXzStreamFooterSize;
+    if (memcmp(footer + 10, kXzFooterMagic, sizeof(kXzFooterMagic)) != 0)
+      return false;
+    // The backward size is the size of the index in 4 bytes units, minus one.
+    const uint64_t index_size =
+        (static_cast<uint64_t>(footer[4]) | footer[5] << 8 | footer[6] << 16 |
+         static_cast<uint64_t>(footer[7]) << 24) *
+            4 +
+        4;
+    if (index_size > end - kXzStreamHeaderSize - kXzStreamFooterSize)
+      return false;
+    const size_t index_end = end - kXzStreamFooterSize;
+    const size_t index_start = index_end - index_size;
+    size_t pos = index_start;
+    uint64_t num_records = 0;
+    if (data[pos++] != 0x00 ||
+        !ReadXzInteger(data, index_end, &pos, &num_records))
+      return false;
+    uint64_t blocks_size = 0;
+    uint64_t decoded_size = 0;
+    for (uint64_t i = 0; i < num_records; i++) {
+      uint64_t unpadded_size = 0;
+      uint64_t uncompressed_size = 0;
+      if (!ReadXzInteger(data, index_end, &pos, &unpadded_size) ||
+          !ReadXzInteger(data, index_end, &pos, &uncompressed_size))
+        return false;
+      // Every block is padded to a multiple of 4 bytes.
+      blocks_size += (unpadded_size + 3) & ~static_cast<uint64_t>(3);
+      decoded_size += uncompressed_size;
+      if (blocks_size > index_start)
+        return false;
+    }
+    if (kXzStreamHeaderSize + blocks_size > index_start)
+      return false;
+    const size_t start = index_start - kXzStreamHeaderSize - blocks_size;
+    if (memcmp(data + start, kXzHeaderMagic, sizeof(kXzHeaderMagic)) != 0)
+      return false;
+    streams->push_back({start, end - start, decoded_size});
+    end = start;
+  }
+  std::reverse(streams->begin(), streams->end());
+  return true;
+}
+
+// Decodes |stream| of |input| into |output| in a single call.
+bool DecodeXzStream(const uint8_t* input,
+                    const XzStream& stream,
+                    brillo::Blob* output) {
+  std::unique_ptr<xz_dec, decltype(&xz_dec_end)> decoder(
+      xz_dec_init(XZ_SINGLE, 0), &xz_dec_end);
+  TEST_AND_RETURN_FALSE(decoder != nullptr);
+  output->resize(stream.decoded_size);
+  xz_buf request{};
+  request.in = input + stream.offset;
+  request.in_size = stream.size;
+  request.out = output->data();
+  request.out_size = output->size();
+  const xz_ret ret = xz_dec_run(decoder.get(), &request);
+  if (ret != XZ_STREAM_END || request.out_pos != output->size()) {
+    LOG(ERROR) << "xz_dec_run returned " << XzErrorString(ret)
+               << " for the stream at offset " << stream.offset;
+    return false;
+  }
+  return true;
+}
+
 }  // namespace
 
 XzExtentWriter::~XzExtentWriter() {
@@ -62,14 +174,69 @@ bool XzExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
                           uint32_t block_size) {
   stream_.reset(xz_dec_init(XZ_DYNALLOC, kXzMaxDictSize));
   TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  output_buffer_.resize(output_buffer_size_);
   return underlying_writer_->Init(extents, block_size);
 }
 
+bool XzExtentWriter::WriteStreamsInParallel(const uint8_t* input,
+                                            size_t count,
+                                            bool* decoded) {
+  *decoded = false;
+  std::vector<XzStream> streams;
+  if (!SplitXzStreams(input, count, &streams) || streams.size() < 2)
+    return true;
+  uint64_t max_decoded_size = 0;
+  for (const XzStream& stream : streams)
+    max_decoded_size = std::max(max_decoded_size, stream.decoded_size);
+  if (max_decoded_size > kMaxParallelMemory)
+    return true;
+  const size_t memory_limited = static_cast<size_t>(
+      kMaxParallelMemory / std::max<uint64_t>(max_decoded_size, 1));
+  const size_t max_parallel = std::max<size_t>(
+      std::min<size_t>({kMaxParallelStreams,
+                        std::thread::hardware_concurrency(),
+                        memory_limited}),
+      1);
+
+  *decoded = true;
+  std::vector<brillo::Blob> outputs(max_parallel);
+  for (size_t first = 0; first < streams.size(); first += max_parallel) {
+    const size_t num_streams = std::min(max_parallel, streams.size() - first);
+    std::vector<std::future<bool>> results;
+    for (size_t i = 1; i < num_streams; i++) {
+      results.push_back(std::async(std::launch::async,
+                                   DecodeXzStream,
+                                   input,
+                                   streams[first + i],
+                                   &outputs[i]));
+    }
+    bool success = DecodeXzStream(input, streams[first], &outputs[0]);
+    for (auto& result : results)
+      success = result.get() && success;
+    TEST_AND_RETURN_FALSE(success);
+    for (size_t i = 0; i < num_streams; i++) {
+      TEST_AND_RETURN_FALSE(
+          underlying_writer_->Write(outputs[i].data(), outputs[i].size()));
+    }
+  }
+  return true;
+}
+
 bool XzExtentWriter::Write(const void* bytes, size_t count) {
+  const uint8_t* input = reinterpret_cast<const uint8_t*>(bytes);
+  // The whole data of an operation is usually passed at once, then its
+  // streams can all be found.
+  if (!written_) {
+    written_ = true;
+    bool decoded = false;
+    TEST_AND_RETURN_FALSE(WriteStreamsInParallel(input, count, &decoded));
+    if (decoded)
+      return true;
+  }
+
   // Copy the input data into |input_buffer_| only if |input_buffer_| already
   // contains unconsumed data. Otherwise, process the data directly from the
   // source.
-  const uint8_t* input = reinterpret_cast<const uint8_t*>(bytes);
   if (!input_buffer_.empty()) {
     input_buffer_.insert(input_buffer_.end(), input, input + count);
     input = input_buffer_.data();
@@ -81,30 +248,32 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
   request.in_pos = 0;
   request.in_size = count;
 
-  brillo::Blob output_buffer(kOutputBufferLength);
-  request.out = output_buffer.data();
-  request.out_size = output_buffer.size();
+  request.out = output_buffer_.data();
+  request.out_size = output_buffer_.size();
   for (;;) {
     request.out_pos = 0;
 
+    // Another stream follows the one which ended, see XzCompressStreams().
+    if (stream_ended_) {
+      xz_dec_reset(stream_.get());
+      stream_ended_ = false;
+    }
     xz_ret ret = xz_dec_run(stream_.get(), &request);
     if (ret != XZ_OK && ret != XZ_STREAM_END) {
       LOG(ERROR) << "xz_dec_run returned " << XzErrorString(ret);
       return false;
     }
+    stream_ended_ = ret == XZ_STREAM_END;
 
-    if (request.out_pos == 0)
-      break;
-
-    TEST_AND_RETURN_FALSE(
-        underlying_writer_->Write(output_buffer.data(), request.out_pos));
-    if (ret == XZ_STREAM_END)
-      CHECK_EQ(request.in_size, request.in_pos);
-    if (request.in_size == request.in_pos)
+    if (request.out_pos > 0) {
+      TEST_AND_RETURN_FALSE(
+          underlying_writer_->Write(output_buffer_.data(), request.out_pos));
+    }
+    if (stream_ended_ && request.in_size != request.in_pos)
+      continue;
+    if (request.out_pos == 0 || request.in_size == request.in_pos)
       break;  // No more input to process.
   }
-  output_buffer.clear();
-
   // Store unconsumed data (if any) in |input_buffer_|. Since |input| can point
   // to the existing |input_buffer_| we create a new one before assigning it.
   brillo::Blob new_input_buffer(request.in + request.in_pos,
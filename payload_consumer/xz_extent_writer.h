@@ -29,18 +29,30 @@
 // XzExtentWriter is a concrete ExtentWriter subclass that xz-decompresses
 // what it's given in Write using xz-embedded. Note that xz-embedded only
 // supports files with either no CRC or CRC-32. It passes the decompressed data
-// to an underlying ExtentWriter.
+// to an underlying ExtentWriter. The data may be made of several concatenated
+// xz streams, which are decoded in parallel when they're all passed at once.
 
 namespace chromeos_update_engine {
 
-class XzExtentWriter : public ExtentWriter {
+class XzExtentWriter final : public ExtentWriter {
   struct xz_deleter {
     constexpr void operator()(xz_dec* p) { xz_dec_end(p); }
   };
 
  public:
-  explicit XzExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer)
-      : underlying_writer_(std::move(underlying_writer)) {}
+  static constexpr size_t kDefaultOutputBufferSize = 16 * 1024;
+  // Maximum number of xz streams decoded at once, one per thread.
+  static constexpr size_t kMaxParallelStreams = 4;
+  // Maximum decoded data of the streams decoded at once.
+  static constexpr size_t kMaxParallelMemory = 32 * 1024 * 1024;  // 32 MiB
+
+  // Decompressed data is passed to |underlying_writer| in chunks of up to
+  // |output_buffer_size| bytes.
+  explicit XzExtentWriter(
+      std::unique_ptr<ExtentWriter> underlying_writer,
+      size_t output_buffer_size = kDefaultOutputBufferSize)
+      : underlying_writer_(std::move(underlying_writer)),
+        output_buffer_size_(output_buffer_size) {}
   ~XzExtentWriter() override;
 
   bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
@@ -48,11 +60,25 @@ class XzExtentWriter : public ExtentWriter {
   bool Write(const void* bytes, size_t count) override;
 
  private:
+  // Decodes the |count| bytes at |input| if they're several complete xz
+  // streams, several of them at once, and writes them in order. Sets
+  // |*decoded| to whether they were. Returns false on error.
+  bool WriteStreamsInParallel(const uint8_t* input,
+                              size_t count,
+                              bool* decoded);
+
   // The underlying ExtentWriter.
   std::unique_ptr<ExtentWriter> underlying_writer_;
   // The opaque xz decompressor struct.
   std::unique_ptr<xz_dec, xz_deleter> stream_{nullptr};
   brillo::Blob input_buffer_;
+  // Whether Write() was called already.
+  bool written_{false};
+  // Whether the last xz stream passed to |stream_| ended.
+  bool stream_ended_{false};
+  // Allocated once in Init() and reused by every Write().
+  const size_t output_buffer_size_;
+  brillo::Blob output_buffer_;
 
   DISALLOW_COPY_AND_ASSIGN(XzExtentWriter);
 };
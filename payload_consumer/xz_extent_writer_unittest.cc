@@ -129,6 +129,18 @@ TEST_F(XzExtentWriterTest, CompressedDataBiggerThanTheBuffer) {
   EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
 }
 
+TEST_F(XzExtentWriterTest, SmallOutputBuffer) {
+  // All the data is written when the output buffer is smaller than both the
+  // input and the output.
+  fake_extent_writer_ = new FakeExtentWriter();
+  xz_writer_.reset(
+      new XzExtentWriter(base::WrapUnique(fake_extent_writer_), 1000));
+  WriteAll(brillo::Blob(std::begin(kCompressed30KiBofA),
+                        std::end(kCompressed30KiBofA)));
+  brillo::Blob expected_data(30 * 1024, 'a');
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+}
+
 TEST_F(XzExtentWriterTest, GarbageDataRejected) {
   EXPECT_TRUE(xz_writer_->Init({}, 1024));
   // The sample_data_ is an uncompressed string.
@@ -148,4 +160,43 @@ TEST_F(XzExtentWriterTest, PartialDataIsKept) {
   EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
 }
 
+TEST_F(XzExtentWriterTest, ConcatenatedStreams) {
+  // Decoded in parallel when all of them are passed at once.
+  brillo::Blob compressed(std::begin(kCompressedDataNoCheck),
+                          std::end(kCompressedDataNoCheck));
+  compressed.insert(compressed.end(),
+                    std::begin(kCompressed30KiBofA),
+                    std::end(kCompressed30KiBofA));
+  compressed.insert(compressed.end(),
+                    std::begin(kCompressedDataCRC32),
+                    std::end(kCompressedDataCRC32));
+  WriteAll(compressed);
+  brillo::Blob expected_data = sample_data_;
+  expected_data.insert(expected_data.end(), 30 * 1024, 'a');
+  expected_data.insert(
+      expected_data.end(), sample_data_.begin(), sample_data_.end());
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+
+  // And one after the other otherwise.
+  fake_extent_writer_ = new FakeExtentWriter();
+  xz_writer_.reset(new XzExtentWriter(base::WrapUnique(fake_extent_writer_)));
+  EXPECT_TRUE(xz_writer_->Init({}, 1024));
+  for (uint8_t byte : compressed) {
+    EXPECT_TRUE(xz_writer_->Write(&byte, 1));
+  }
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(XzExtentWriterTest, CorruptStreamRejected) {
+  brillo::Blob compressed(std::begin(kCompressed30KiBofA),
+                          std::end(kCompressed30KiBofA));
+  compressed.insert(compressed.end(),
+                    std::begin(kCompressedDataNoCheck),
+                    std::end(kCompressedDataNoCheck));
+  // A byte of the LZMA2 data of the first stream.
+  compressed[40] ^= 0xff;
+  EXPECT_TRUE(xz_writer_->Init({}, 1024));
+  EXPECT_FALSE(xz_writer_->Write(compressed.data(), compressed.size()));
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,231 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_bspatch.h"
+
+#include <string.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr char kBsdf2Magic[] = "BSDF2";
+// The magic, the compressor types and the sizes of the control and diff
+// streams and new file.
+constexpr size_t kHeaderSize = 32;
+// Size of a control entry: its diff and extra sizes and offset increment.
+constexpr size_t kControlEntrySize = 24;
+// Size of the chunks the new data is produced in.
+constexpr size_t kBufferSize = 64 * 1024;
+
+// Reads the sign-magnitude little endian integer of bsdiff patches at
+// |buffer|.
+int64_t DecodeInt64(const uint8_t* buffer) {
+  uint64_t magnitude = 0;
+  for (size_t i = 0; i < 8; i++) {
+    magnitude |= static_cast<uint64_t>(buffer[i]) << (8 * i);
+  }
+  const int64_t value = magnitude & ~(1ULL << 63);
+  return (magnitude >> 63) ? -value : value;
+}
+
+// Decompresses a zstd stream of the patch as it's read.
+class ZstdStreamReader {
+ public:
+  ZstdStreamReader(const uint8_t* data, size_t size) : input_{data, size, 0} {}
+
+  bool Init() {
+    stream_.reset(ZSTD_createDStream());
+    TEST_AND_RETURN_FALSE(stream_ != nullptr);
+    TEST_AND_RETURN_FALSE(!ZSTD_isError(ZSTD_DCtx_setParameter(
+        stream_.get(), ZSTD_d_windowLogMax, ZstdExtentWriter::kMaxWindowLog)));
+    return true;
+  }
+
+  // Reads exactly |count| bytes of the decompressed stream into |buffer|.
+  bool Read(void* buffer, size_t count) {
+    ZSTD_outBuffer output = {buffer, count, 0};
+    while (output.pos < output.size) {
+      TEST_AND_RETURN_FALSE(Decompress(&output));
+    }
+    return true;
+  }
+
+  // Returns whether the stream ended, after all of it was read.
+  bool Finish() {
+    while (!frame_ended_ || input_.pos < input_.size) {
+      uint8_t extra;
+      ZSTD_outBuffer output = {&extra, sizeof(extra), 0};
+      TEST_AND_RETURN_FALSE(Decompress(&output));
+      // The stream is longer than what the control entries use.
+      TEST_AND_RETURN_FALSE(output.pos == 0);
+    }
+    return true;
+  }
+
+ private:
+  // Decompresses into |output|, failing if no progress can be made.
+  bool Decompress(ZSTD_outBuffer* output) {
+    const size_t input_pos = input_.pos;
+    const size_t output_pos = output->pos;
+    const size_t ret = ZSTD_decompressStream(stream_.get(), output, &input_);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "ZSTD_decompressStream failed: " << ZSTD_getErrorName(ret);
+      return false;
+    }
+    frame_ended_ = ret == 0;
+    // The stream is truncated.
+    TEST_AND_RETURN_FALSE(input_.pos != input_pos || output->pos != output_pos);
+    return true;
+  }
+
+  struct ZstdDeleter {
+    void operator()(ZSTD_DStream* p) { ZSTD_freeDStream(p); }
+  };
+  std::unique_ptr<ZSTD_DStream, ZstdDeleter> stream_;
+  ZSTD_inBuffer input_;
+  bool frame_ended_{false};
+};
+
+bool ReadAll(bsdiff::FileInterface* file, uint8_t* buffer, size_t count) {
+  while (count > 0) {
+    size_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(file->Read(buffer, count, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read > 0);
+    buffer += bytes_read;
+    count -= bytes_read;
+  }
+  return true;
+}
+
+bool WriteAll(bsdiff::FileInterface* file,
+              const uint8_t* buffer,
+              size_t count) {
+  while (count > 0) {
+    size_t bytes_written = 0;
+    TEST_AND_RETURN_FALSE(file->Write(buffer, count, &bytes_written));
+    TEST_AND_RETURN_FALSE(bytes_written > 0);
+    buffer += bytes_written;
+    count -= bytes_written;
+  }
+  return true;
+}
+}  // namespace
+
+bool IsZstdBsdiffPatch(const uint8_t* patch, size_t size) {
+  if (size < kHeaderSize || memcmp(patch, kBsdf2Magic, 5) != 0) {
+    return false;
+  }
+  return patch[5] == kBsdiffZstdCompressorType &&
+         patch[6] == kBsdiffZstdCompressorType &&
+         patch[7] == kBsdiffZstdCompressorType;
+}
+
+bool ZstdBspatch(bsdiff::FileInterface* old_file,
+                 bsdiff::FileInterface* new_file,
+                 const uint8_t* patch,
+                 size_t size) {
+  TEST_AND_RETURN_FALSE(IsZstdBsdiffPatch(patch, size));
+  const int64_t ctrl_size = DecodeInt64(patch + 8);
+  const int64_t diff_size = DecodeInt64(patch + 16);
+  const int64_t new_size = DecodeInt64(patch + 24);
+  TEST_AND_RETURN_FALSE(ctrl_size >= 0 && diff_size >= 0 && new_size >= 0);
+  const uint64_t streams_size = size - kHeaderSize;
+  TEST_AND_RETURN_FALSE(static_cast<uint64_t>(ctrl_size) <= streams_size);
+  TEST_AND_RETURN_FALSE(static_cast<uint64_t>(diff_size) <=
+                        streams_size - ctrl_size);
+
+  const uint8_t* ctrl_data = patch + kHeaderSize;
+  const uint8_t* diff_data = ctrl_data + ctrl_size;
+  const uint8_t* extra_data = diff_data + diff_size;
+  ZstdStreamReader ctrl_stream(ctrl_data, ctrl_size);
+  ZstdStreamReader diff_stream(diff_data, diff_size);
+  ZstdStreamReader extra_stream(extra_data, patch + size - extra_data);
+  TEST_AND_RETURN_FALSE(ctrl_stream.Init() && diff_stream.Init() &&
+                        extra_stream.Init());
+
+  uint64_t old_size = 0;
+  TEST_AND_RETURN_FALSE(old_file->GetSize(&old_size));
+  brillo::Blob new_buffer(kBufferSize);
+  brillo::Blob old_buffer(kBufferSize);
+  // Where |old_file| is, to only seek it when the patch skips old data.
+  int64_t old_file_pos = -1;
+  int64_t old_pos = 0;
+  uint64_t new_pos = 0;
+  while (new_pos < static_cast<uint64_t>(new_size)) {
+    uint8_t entry[kControlEntrySize];
+    TEST_AND_RETURN_FALSE(ctrl_stream.Read(entry, sizeof(entry)));
+    const int64_t entry_diff_size = DecodeInt64(entry);
+    const int64_t entry_extra_size = DecodeInt64(entry + 8);
+    const int64_t offset_increment = DecodeInt64(entry + 16);
+    TEST_AND_RETURN_FALSE(entry_diff_size >= 0 && entry_extra_size >= 0);
+    const uint64_t remaining = new_size - new_pos;
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(entry_diff_size) <= remaining);
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(entry_extra_size) <=
+                          remaining - entry_diff_size);
+
+    // The diff data is added to the old data, which is taken as zeros outside
+    // of the old file.
+    for (int64_t done = 0; done < entry_diff_size;) {
+      const size_t chunk =
+          std::min<uint64_t>(entry_diff_size - done, kBufferSize);
+      TEST_AND_RETURN_FALSE(diff_stream.Read(new_buffer.data(), chunk));
+      const int64_t old_start = std::max<int64_t>(old_pos, 0);
+      if (old_start < static_cast<int64_t>(old_size) &&
+          old_start < old_pos + static_cast<int64_t>(chunk)) {
+        const int64_t old_end =
+            std::min<int64_t>(old_pos + chunk, static_cast<int64_t>(old_size));
+        if (old_file_pos != old_start) {
+          TEST_AND_RETURN_FALSE(old_file->Seek(old_start));
+        }
+        const size_t old_count = old_end - old_start;
+        TEST_AND_RETURN_FALSE(ReadAll(old_file, old_buffer.data(), old_count));
+        old_file_pos = old_end;
+        uint8_t* new_data = new_buffer.data() + (old_start - old_pos);
+        for (size_t i = 0; i < old_count; i++) {
+          new_data[i] += old_buffer[i];
+        }
+      }
+      TEST_AND_RETURN_FALSE(WriteAll(new_file, new_buffer.data(), chunk));
+      TEST_AND_RETURN_FALSE(!__builtin_add_overflow(old_pos, chunk, &old_pos));
+      done += chunk;
+    }
+    for (int64_t done = 0; done < entry_extra_size;) {
+      const size_t chunk =
+          std::min<uint64_t>(entry_extra_size - done, kBufferSize);
+      TEST_AND_RETURN_FALSE(extra_stream.Read(new_buffer.data(), chunk));
+      TEST_AND_RETURN_FALSE(WriteAll(new_file, new_buffer.data(), chunk));
+      done += chunk;
+    }
+    new_pos += entry_diff_size + entry_extra_size;
+    TEST_AND_RETURN_FALSE(
+        !__builtin_add_overflow(old_pos, offset_increment, &old_pos));
+  }
+  TEST_AND_RETURN_FALSE(ctrl_stream.Finish() && diff_stream.Finish() &&
+                        extra_stream.Finish());
+  return true;
+}
+
+}  // namespace chromeos_update_engine
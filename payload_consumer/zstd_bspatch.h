@@ -0,0 +1,46 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_BSPATCH_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_BSPATCH_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <bsdiff/file_interface.h>
+
+namespace chromeos_update_engine {
+
+// The compressor type of zstd compressed streams in BSDF2 bsdiff patches.
+// The bsdiff library only knows bzip2 and brotli, so the patches with such
+// streams, which minor version 11 allows, are applied by ZstdBspatch().
+constexpr uint8_t kBsdiffZstdCompressorType = 3;
+
+// Returns whether the |size| bytes at |patch| are a BSDF2 patch with its
+// control, diff and extra streams all compressed with zstd.
+bool IsZstdBsdiffPatch(const uint8_t* patch, size_t size);
+
+// Applies such a patch, reading the old data from |old_file| and writing the
+// new data to |new_file| sequentially. The streams are decompressed as the
+// patch is applied, so the memory used doesn't depend on its size.
+bool ZstdBspatch(bsdiff::FileInterface* old_file,
+                 bsdiff::FileInterface* new_file,
+                 const uint8_t* patch,
+                 size_t size);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_BSPATCH_H_
@@ -0,0 +1,135 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_bspatch.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <brillo/secure_blob.h>
+#include <bsdiff/bsdiff.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_generator/memory_patch_writer.h"
+
+using bsdiff::CompressorType;
+
+namespace chromeos_update_engine {
+
+namespace {
+// A bsdiff::FileInterface over a Blob, reading or appending at most 1000
+// bytes at a time.
+class BlobFile : public bsdiff::FileInterface {
+ public:
+  explicit BlobFile(brillo::Blob* data) : data_(data) {}
+
+  bool Read(void* buf, size_t count, size_t* bytes_read) override {
+    *bytes_read = std::min({count, data_->size() - pos_, size_t{1000}});
+    memcpy(buf, data_->data() + pos_, *bytes_read);
+    pos_ += *bytes_read;
+    return *bytes_read > 0;
+  }
+  bool Write(const void* buf, size_t count, size_t* bytes_written) override {
+    *bytes_written = std::min(count, size_t{1000});
+    const uint8_t* bytes = static_cast<const uint8_t*>(buf);
+    data_->insert(data_->end(), bytes, bytes + *bytes_written);
+    return true;
+  }
+  bool Seek(off_t pos) override {
+    if (pos < 0 || static_cast<size_t>(pos) > data_->size())
+      return false;
+    pos_ = pos;
+    return true;
+  }
+  bool Close() override { return true; }
+  bool GetSize(uint64_t* size) override {
+    *size = data_->size();
+    return true;
+  }
+
+ private:
+  brillo::Blob* data_;
+  size_t pos_{0};
+};
+}  // namespace
+
+class ZstdBspatchTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_data_.resize(200000);
+    test_utils::FillWithData(&old_data_);
+    new_data_ = old_data_;
+    new_data_.erase(new_data_.begin() + 100, new_data_.begin() + 300);
+    for (size_t i = 5000; i < 6000; i += 7) {
+      new_data_[i]++;
+    }
+    new_data_.insert(new_data_.end(), 3000, 'x');
+
+    // Zstd compresses these streams better than bzip2, so it's used.
+    MemoryPatchWriter writer(&patch_, {CompressorType::kBZ2}, 9, true);
+    ASSERT_EQ(0,
+              bsdiff::bsdiff(old_data_.data(),
+                             old_data_.size(),
+                             new_data_.data(),
+                             new_data_.size(),
+                             &writer,
+                             nullptr));
+  }
+
+  bool Patch(const brillo::Blob& patch, brillo::Blob* output) {
+    BlobFile old_file(&old_data_);
+    BlobFile new_file(output);
+    return ZstdBspatch(&old_file, &new_file, patch.data(), patch.size());
+  }
+
+  brillo::Blob old_data_;
+  brillo::Blob new_data_;
+  brillo::Blob patch_;
+};
+
+TEST_F(ZstdBspatchTest, PatchTest) {
+  ASSERT_TRUE(IsZstdBsdiffPatch(patch_.data(), patch_.size()));
+  brillo::Blob output;
+  ASSERT_TRUE(Patch(patch_, &output));
+  EXPECT_EQ(new_data_, output);
+}
+
+TEST_F(ZstdBspatchTest, TruncatedPatchTest) {
+  for (size_t size : {patch_.size() - 1, patch_.size() / 2}) {
+    brillo::Blob output;
+    EXPECT_FALSE(
+        Patch(brillo::Blob(patch_.begin(), patch_.begin() + size), &output));
+  }
+}
+
+TEST_F(ZstdBspatchTest, OtherPatchesTest) {
+  brillo::Blob patch;
+  MemoryPatchWriter writer(&patch, {CompressorType::kBrotli}, 9);
+  ASSERT_EQ(0,
+            bsdiff::bsdiff(old_data_.data(),
+                           old_data_.size(),
+                           new_data_.data(),
+                           new_data_.size(),
+                           &writer,
+                           nullptr));
+  EXPECT_FALSE(IsZstdBsdiffPatch(patch.data(), patch.size()));
+  brillo::Blob output;
+  EXPECT_FALSE(Patch(patch, &output));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,62 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+#include "update_engine/common/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+ZstdExtentWriter::~ZstdExtentWriter() {
+  TEST_AND_RETURN(frame_ended_);
+}
+
+bool ZstdExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
+                            uint32_t block_size) {
+  stream_.reset(ZSTD_createDStream());
+  TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  TEST_AND_RETURN_FALSE(!ZSTD_isError(ZSTD_DCtx_setParameter(
+      stream_.get(), ZSTD_d_windowLogMax, kMaxWindowLog)));
+  output_buffer_.resize(output_buffer_size_);
+  return next_->Init(extents, block_size);
+}
+
+bool ZstdExtentWriter::Write(const void* bytes, size_t count) {
+  // The decompressor keeps the input it can't decode yet in its own buffers,
+  // so all of |bytes| is always consumed.
+  ZSTD_inBuffer input = {bytes, count, 0};
+  ZSTD_outBuffer output;
+  do {
+    output = {output_buffer_.data(), output_buffer_.size(), 0};
+    const size_t ret = ZSTD_decompressStream(stream_.get(), &output, &input);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "ZSTD_decompressStream failed: " << ZSTD_getErrorName(ret);
+      return false;
+    }
+    // A zero return means the frame was decoded and flushed entirely.
+    frame_ended_ = ret == 0;
+    if (output.pos > 0) {
+      TEST_AND_RETURN_FALSE(next_->Write(output_buffer_.data(), output.pos));
+    }
+    // A full output buffer may leave decoded data in the decompressor.
+  } while (input.pos < input.size ||
+           (output.pos == output.size && !frame_ended_));
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,71 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+
+#include <zstd.h>
+
+#include <memory>
+#include <utility>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/extent_writer.h"
+
+// ZstdExtentWriter is a concrete ExtentWriter subclass that zstd-decompresses
+// what it's given in Write. It passes the decompressed data to an underlying
+// ExtentWriter. The data may be made of several concatenated zstd frames.
+
+namespace chromeos_update_engine {
+
+class ZstdExtentWriter final : public ExtentWriter {
+  struct zstd_deleter {
+    void operator()(ZSTD_DStream* p) { ZSTD_freeDStream(p); }
+  };
+
+ public:
+  static constexpr size_t kDefaultOutputBufferSize = 16 * 1024;
+  // The largest window the decompressor accepts, which "zstd -19" stays
+  // within for the operation sizes the generator produces.
+  static constexpr int kMaxWindowLog = 23;  // 8 MiB
+
+  // Decompressed data is passed to |next| in chunks of up to
+  // |output_buffer_size| bytes.
+  explicit ZstdExtentWriter(
+      std::unique_ptr<ExtentWriter> next,
+      size_t output_buffer_size = kDefaultOutputBufferSize)
+      : next_(std::move(next)), output_buffer_size_(output_buffer_size) {}
+  ~ZstdExtentWriter() override;
+
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Write(const void* bytes, size_t count) override;
+
+ private:
+  std::unique_ptr<ExtentWriter> next_;  // The underlying ExtentWriter.
+  // The zstd decompression stream.
+  std::unique_ptr<ZSTD_DStream, zstd_deleter> stream_;
+  // Whether the last frame passed to |stream_| ended.
+  bool frame_ended_{true};
+  // Allocated once in Init() and reused by every Write().
+  const size_t output_buffer_size_;
+  brillo::Blob output_buffer_;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class ZstdExtentWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    fd_.reset(new EintrSafeFileDescriptor);
+    ASSERT_TRUE(fd_->Open(temp_file_.path().c_str(), O_RDWR, 0600));
+    decompressed_data_.resize(800 * 1024);
+    for (size_t i = 0; i < decompressed_data_.size(); ++i)
+      decompressed_data_[i] = static_cast<uint8_t>("ABC\n"[i % 4] + i / 4096);
+  }
+  void TearDown() override { fd_->Close(); }
+
+  brillo::Blob Compress(const brillo::Blob& data) {
+    brillo::Blob compressed(ZSTD_compressBound(data.size()));
+    size_t size = ZSTD_compress(
+        compressed.data(), compressed.size(), data.data(), data.size(), 19);
+    EXPECT_FALSE(ZSTD_isError(size));
+    compressed.resize(size);
+    return compressed;
+  }
+
+  // Writes |compressed_data| in chunks of |chunk_size| bytes and checks the
+  // result is |decompressed_data_|.
+  void WriteAndCheck(const brillo::Blob& compressed_data, size_t chunk_size) {
+    vector<Extent> extents = {
+        ExtentForBytes(kBlockSize, 0, decompressed_data_.size())};
+    ZstdExtentWriter zstd_writer(std::make_unique<DirectExtentWriter>(fd_));
+    EXPECT_TRUE(zstd_writer.Init({extents.begin(), extents.end()}, kBlockSize));
+    for (size_t i = 0; i < compressed_data.size(); i += chunk_size) {
+      size_t this_chunk_size = min(chunk_size, compressed_data.size() - i);
+      EXPECT_TRUE(zstd_writer.Write(&compressed_data[i], this_chunk_size));
+    }
+
+    brillo::Blob output;
+    EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &output));
+    test_utils::ExpectVectorsEq(decompressed_data_, output);
+  }
+
+  FileDescriptorPtr fd_;
+  ScopedTempFile temp_file_{"ZstdExtentWriterTest-file.XXXXXX"};
+  brillo::Blob decompressed_data_;
+};
+
+TEST_F(ZstdExtentWriterTest, SimpleTest) {
+  WriteAndCheck(Compress(decompressed_data_), decompressed_data_.size());
+}
+
+TEST_F(ZstdExtentWriterTest, ChunkedTest) {
+  WriteAndCheck(Compress(decompressed_data_), 3);
+}
+
+TEST_F(ZstdExtentWriterTest, ConcatenatedFramesTest) {
+  const brillo::Blob& data = decompressed_data_;
+  const auto middle = data.begin() + data.size() / 2;
+  brillo::Blob compressed_data = Compress(brillo::Blob(data.begin(), middle));
+  brillo::Blob second = Compress(brillo::Blob(middle, data.end()));
+  compressed_data.insert(compressed_data.end(), second.begin(), second.end());
+  WriteAndCheck(compressed_data, 1000);
+}
+
+TEST_F(ZstdExtentWriterTest, CorruptedDataTest) {
+  brillo::Blob compressed_data = Compress(decompressed_data_);
+  compressed_data[0] ^= 0xff;
+  vector<Extent> extents = {
+      ExtentForBytes(kBlockSize, 0, decompressed_data_.size())};
+  ZstdExtentWriter zstd_writer(std::make_unique<DirectExtentWriter>(fd_));
+  EXPECT_TRUE(zstd_writer.Init({extents.begin(), extents.end()}, kBlockSize));
+  EXPECT_FALSE(
+      zstd_writer.Write(compressed_data.data(), compressed_data.size()));
+}
+
+}  // namespace chromeos_update_engine
@@ -17,6 +17,12 @@
 #include "update_engine/payload_generator/ab_generator.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <memory>
 #include <utility>
 
 #include <android-base/stringprintf.h>
@@ -27,6 +33,8 @@
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/mapped_file.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 using chromeos_update_engine::diff_utils::IsAReplaceOperation;
 using std::string;
@@ -34,6 +42,83 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+// Sets the source hash of |op|, hashing its source data in |image| when it is
+// mapped, or read from |source_part_path| otherwise.
+bool AddOperationSourceHash(const MappedFile* image,
+                            const string& source_part_path,
+                            InstallOperation* op) {
+  // PARTITION_COPY reads another partition, its hash is set already.
+  if (op->src_extents_size() == 0 ||
+      op->type() == InstallOperation::PARTITION_COPY)
+    return true;
+
+  vector<Extent> src_extents;
+  ExtentsToVector(op->src_extents(), &src_extents);
+  uint64_t src_length = op->has_src_length()
+                            ? op->src_length()
+                            : utils::BlocksInExtents(src_extents) * kBlockSize;
+  brillo::Blob src_hash;
+  if (image == nullptr) {
+    brillo::Blob src_data;
+    TEST_AND_RETURN_FALSE(utils::ReadExtents(
+        source_part_path, src_extents, &src_data, src_length, kBlockSize));
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(src_data, &src_hash));
+  } else {
+    HashCalculator hasher;
+    for (const Extent& extent : src_extents) {
+      if (src_length == 0)
+        break;
+      TEST_AND_RETURN_FALSE(image->Contains(extent, kBlockSize));
+      const uint64_t length =
+          std::min(src_length, extent.num_blocks() * kBlockSize);
+      TEST_AND_RETURN_FALSE(hasher.Update(
+          image->data() + extent.start_block() * kBlockSize, length));
+      src_length -= length;
+    }
+    TEST_AND_RETURN_FALSE(src_length == 0);
+    TEST_AND_RETURN_FALSE(hasher.Finalize());
+    src_hash = hasher.raw_hash();
+  }
+  op->set_src_sha256_hash(src_hash.data(), src_hash.size());
+  return true;
+}
+
+// Reads the target data of the A-replace operation |aop| and sets |blob| and
+// |op_type| to the best full operation for it.
+bool GenerateFullData(const AnnotatedOperation& aop,
+                      const PayloadVersion& version,
+                      const string& target_part_path,
+                      bool max_compression_effort,
+                      brillo::Blob* blob,
+                      InstallOperation::Type* op_type) {
+  TEST_AND_RETURN_FALSE(IsAReplaceOperation(aop.op.type()));
+
+  vector<Extent> dst_extents;
+  ExtentsToVector(aop.op.dst_extents(), &dst_extents);
+  brillo::Blob data(utils::BlocksInExtents(dst_extents) * kBlockSize);
+  TEST_AND_RETURN_FALSE(utils::ReadExtents(
+      target_part_path, dst_extents, &data, data.size(), kBlockSize));
+
+  return diff_utils::GenerateBestFullOperation(
+      data, version, blob, op_type, max_compression_effort);
+}
+
+// Sets the |blob| of type |op_type| generated by GenerateFullData() on |aop|.
+bool SetFullData(AnnotatedOperation* aop,
+                 const brillo::Blob& blob,
+                 InstallOperation::Type op_type,
+                 BlobFileWriter* blob_file) {
+  // If the operation doesn't point to a data blob or points to a data blob of
+  // a different type then we add it.
+  if (aop->op.type() != op_type || aop->op.data_length() != blob.size()) {
+    aop->op.set_type(op_type);
+    TEST_AND_RETURN_FALSE(aop->SetOperationBlob(blob, blob_file));
+  }
+  return true;
+}
+}  // namespace
+
 bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                      const PartitionConfig& old_part,
                                      const PartitionConfig& new_part,
@@ -54,24 +139,56 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                                        hard_chunk_blocks,
                                                        soft_chunk_blocks,
                                                        config,
-                                                       blob_file));
+                                                       blob_file,
+                                                       source_block_index_));
   LOG(INFO) << "done reading " << new_part.name;
 
   SortOperationsByDestination(aops);
 
+  const ApplyCostModel* cost_model =
+      config.apply_cost_model ? &*config.apply_cost_model : nullptr;
+  if (cost_model) {
+    TEST_AND_RETURN_FALSE(SplitCostlyOperations(aops,
+                                                config.version,
+                                                *cost_model,
+                                                new_part.path,
+                                                blob_file,
+                                                config.max_compression_effort));
+  }
+
   // Use the soft_chunk_size when merging operations to prevent merging all
-  // the operations into a huge one if there's no hard limit.
+  // the operations into a huge one if there's no hard limit. A cost model
+  // limits the merged operations by their cost instead.
   size_t merge_chunk_blocks = soft_chunk_blocks;
+  if (cost_model) {
+    merge_chunk_blocks = std::numeric_limits<size_t>::max();
+  }
   if (hard_chunk_blocks != -1 &&
-      static_cast<size_t>(hard_chunk_blocks) < soft_chunk_blocks) {
+      static_cast<size_t>(hard_chunk_blocks) < merge_chunk_blocks) {
     merge_chunk_blocks = hard_chunk_blocks;
   }
 
   LOG(INFO) << "Merging " << aops->size() << " operations.";
-  TEST_AND_RETURN_FALSE(MergeOperations(
-      aops, config.version, merge_chunk_blocks, new_part.path, blob_file));
+  TEST_AND_RETURN_FALSE(MergeOperations(aops,
+                                        config.version,
+                                        merge_chunk_blocks,
+                                        new_part.path,
+                                        blob_file,
+                                        config.max_compression_effort,
+                                        cost_model));
   LOG(INFO) << aops->size() << " operations after merge.";
 
+  // The blobs are stored in the order of the operations, so ordering them for
+  // streaming lays out the data blobs too.
+  if (cost_model && config.streaming_download_mib_per_second > 0) {
+    OrderOperationsForStreaming(aops,
+                                *cost_model,
+                                config.streaming_download_mib_per_second,
+                                config.streaming_lookahead_size);
+  } else if (cost_model) {
+    InterleaveOperationsByCost(aops, *cost_model);
+  }
+
   if (config.version.minor >= kOpSrcHashMinorPayloadVersion)
     TEST_AND_RETURN_FALSE(AddSourceHash(aops, old_part.path));
 
@@ -86,7 +203,8 @@ void ABGenerator::SortOperationsByDestination(
 bool ABGenerator::FragmentOperations(const PayloadVersion& version,
                                      vector<AnnotatedOperation>* aops,
                                      const string& target_part_path,
-                                     BlobFileWriter* blob_file) {
+                                     BlobFileWriter* blob_file,
+                                     bool max_compression_effort) {
   vector<AnnotatedOperation> fragmented_aops;
   for (const AnnotatedOperation& aop : *aops) {
     // Only do split if the operation has more than one dst extents.
@@ -96,8 +214,12 @@ bool ABGenerator::FragmentOperations(const PayloadVersion& version,
         continue;
       }
       if (IsAReplaceOperation(aop.op.type())) {
-        TEST_AND_RETURN_FALSE(SplitAReplaceOp(
-            version, aop, target_part_path, &fragmented_aops, blob_file));
+        TEST_AND_RETURN_FALSE(SplitAReplaceOp(version,
+                                              aop,
+                                              target_part_path,
+                                              &fragmented_aops,
+                                              blob_file,
+                                              max_compression_effort));
         continue;
       }
     }
@@ -162,11 +284,13 @@ bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
                                   const AnnotatedOperation& original_aop,
                                   const string& target_part_path,
                                   vector<AnnotatedOperation>* result_aops,
-                                  BlobFileWriter* blob_file) {
+                                  BlobFileWriter* blob_file,
+                                  bool max_compression_effort) {
   InstallOperation original_op = original_aop.op;
   TEST_AND_RETURN_FALSE(IsAReplaceOperation(original_op.type()));
   const bool is_replace = original_op.type() == InstallOperation::REPLACE;
 
+  const size_t first_aop = result_aops->size();
   uint64_t data_offset = original_op.data_offset();
   for (int i = 0; i < original_op.dst_extents_size(); i++) {
     const Extent& dst_ext = original_op.dst_extents(i);
@@ -186,11 +310,51 @@ bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
     new_aop.op = new_op;
     new_aop.name =
         android::base::StringPrintf("%s:%d", original_aop.name.c_str(), i);
-    TEST_AND_RETURN_FALSE(
-        AddDataAndSetType(&new_aop, version, target_part_path, blob_file));
-
     result_aops->push_back(new_aop);
   }
+
+  // The fragments are compressed at once on the shared threads, then their
+  // blobs are stored in order, so the blob file is the same as when they are
+  // compressed one after another.
+  const size_t num_fragments = result_aops->size() - first_aop;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler != nullptr && num_fragments > 1) {
+    vector<brillo::Blob> blobs(num_fragments);
+    vector<InstallOperation::Type> op_types(num_fragments);
+    std::atomic<bool> failed{false};
+    {
+      TaskScheduler::TaskGroup group(scheduler, false);
+      for (size_t i = 0; i < num_fragments; i++) {
+        const AnnotatedOperation* aop = &(*result_aops)[first_aop + i];
+        group.Submit(utils::BlocksInExtents(aop->op.dst_extents()),
+                     [&, i, aop]() {
+                       if (!failed && !GenerateFullData(*aop,
+                                                        version,
+                                                        target_part_path,
+                                                        max_compression_effort,
+                                                        &blobs[i],
+                                                        &op_types[i])) {
+                         failed = true;
+                       }
+                     });
+      }
+      group.Wait();
+    }
+    TEST_AND_RETURN_FALSE(!failed);
+    for (size_t i = 0; i < num_fragments; i++) {
+      TEST_AND_RETURN_FALSE(SetFullData(
+          &(*result_aops)[first_aop + i], blobs[i], op_types[i], blob_file));
+      blobs[i] = brillo::Blob();
+    }
+    return true;
+  }
+  for (size_t i = first_aop; i < result_aops->size(); i++) {
+    TEST_AND_RETURN_FALSE(AddDataAndSetType(&(*result_aops)[i],
+                                            version,
+                                            target_part_path,
+                                            blob_file,
+                                            max_compression_effort));
+  }
   return true;
 }
 
@@ -198,7 +362,9 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
                                   const PayloadVersion& version,
                                   size_t chunk_blocks,
                                   const string& target_part_path,
-                                  BlobFileWriter* blob_file) {
+                                  BlobFileWriter* blob_file,
+                                  bool max_compression_effort,
+                                  const ApplyCostModel* cost_model) {
   vector<AnnotatedOperation> new_aops;
   for (const AnnotatedOperation& curr_aop : *aops) {
     if (new_aops.empty()) {
@@ -223,11 +389,19 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
         curr_aop.op.dst_extents(0).num_blocks();
     bool is_a_replace = IsAReplaceOperation(curr_aop.op.type());
 
+    // The merged operation pays the cost of a single operation once.
+    bool within_cost =
+        !cost_model ||
+        cost_model->OperationCost(last_aop.op, kBlockSize) +
+                cost_model->OperationCost(curr_aop.op, kBlockSize) -
+                cost_model->operation_cost <=
+            cost_model->target_operation_cost;
+
     bool is_delta_op = curr_aop.op.type() == InstallOperation::SOURCE_COPY;
     if (((is_delta_op && (last_aop.op.type() == curr_aop.op.type())) ||
          (is_a_replace && last_is_a_replace)) &&
         last_end_block == curr_start_block &&
-        combined_block_count <= chunk_blocks) {
+        combined_block_count <= chunk_blocks && within_cost) {
       // If the operations have the same type (which is a type that we can
       // merge), are contiguous, are fragmented to have one destination extent,
       // and their combined block count would be less than chunk size, merge
@@ -255,8 +429,11 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
   for (AnnotatedOperation& curr_aop : new_aops) {
     if (curr_aop.op.data_length() == 0 &&
         IsAReplaceOperation(curr_aop.op.type())) {
-      TEST_AND_RETURN_FALSE(
-          AddDataAndSetType(&curr_aop, version, target_part_path, blob_file));
+      TEST_AND_RETURN_FALSE(AddDataAndSetType(&curr_aop,
+                                              version,
+                                              target_part_path,
+                                              blob_file,
+                                              max_compression_effort));
     }
   }
 
@@ -264,52 +441,197 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
   return true;
 }
 
-bool ABGenerator::AddDataAndSetType(AnnotatedOperation* aop,
-                                    const PayloadVersion& version,
-                                    const string& target_part_path,
-                                    BlobFileWriter* blob_file) {
-  TEST_AND_RETURN_FALSE(IsAReplaceOperation(aop->op.type()));
+bool ABGenerator::SplitCostlyOperations(vector<AnnotatedOperation>* aops,
+                                        const PayloadVersion& version,
+                                        const ApplyCostModel& cost_model,
+                                        const string& target_part_path,
+                                        BlobFileWriter* blob_file,
+                                        bool max_compression_effort) {
+  vector<AnnotatedOperation> new_aops;
+  for (const AnnotatedOperation& aop : *aops) {
+    const InstallOperation::Type type = aop.op.type();
+    const uint64_t num_blocks = utils::BlocksInExtents(aop.op.dst_extents());
+    const double cost = cost_model.OperationCost(aop.op, kBlockSize);
+    const auto parts = std::ceil(cost / cost_model.target_operation_cost);
+    const uint64_t num_parts =
+        std::min(static_cast<uint64_t>(parts), num_blocks);
+    if ((type != InstallOperation::SOURCE_COPY && !IsAReplaceOperation(type)) ||
+        num_parts <= 1) {
+      new_aops.push_back(aop);
+      continue;
+    }
+    vector<Extent> src_extents;
+    vector<Extent> dst_extents;
+    ExtentsToVector(aop.op.src_extents(), &src_extents);
+    ExtentsToVector(aop.op.dst_extents(), &dst_extents);
+    const uint64_t part_blocks = (num_blocks + num_parts - 1) / num_parts;
+    for (uint64_t offset = 0, i = 0; offset < num_blocks;
+         offset += part_blocks, i++) {
+      AnnotatedOperation new_aop;
+      new_aop.name = android::base::StringPrintf(
+          "%s:%" PRIu64, aop.name.c_str(), i);
+      new_aop.op.set_type(type);
+      StoreExtents(ExtentsSublist(dst_extents, offset, part_blocks),
+                   new_aop.op.mutable_dst_extents());
+      if (type == InstallOperation::SOURCE_COPY) {
+        StoreExtents(ExtentsSublist(src_extents, offset, part_blocks),
+                     new_aop.op.mutable_src_extents());
+      } else {
+        // The data of the part is read from the target and compressed again.
+        TEST_AND_RETURN_FALSE(AddDataAndSetType(&new_aop,
+                                                version,
+                                                target_part_path,
+                                                blob_file,
+                                                max_compression_effort));
+      }
+      new_aops.push_back(std::move(new_aop));
+    }
+  }
+  LOG(INFO) << "Split costly operations: " << aops->size() << " to "
+            << new_aops.size() << " operations.";
+  *aops = std::move(new_aops);
+  return true;
+}
 
-  vector<Extent> dst_extents;
-  ExtentsToVector(aop->op.dst_extents(), &dst_extents);
-  brillo::Blob data(utils::BlocksInExtents(dst_extents) * kBlockSize);
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(
-      target_part_path, dst_extents, &data, data.size(), kBlockSize));
+void ABGenerator::InterleaveOperationsByCost(vector<AnnotatedOperation>* aops,
+                                             const ApplyCostModel& cost_model) {
+  vector<AnnotatedOperation> cpu_aops;
+  vector<AnnotatedOperation> io_aops;
+  for (AnnotatedOperation& aop : *aops) {
+    if (ApplyCostModel::IsCpuBound(aop.op)) {
+      cpu_aops.push_back(std::move(aop));
+    } else {
+      io_aops.push_back(std::move(aop));
+    }
+  }
+  aops->clear();
+  double cpu_cost = 0;
+  double io_cost = 0;
+  size_t cpu_index = 0;
+  size_t io_index = 0;
+  while (cpu_index < cpu_aops.size() || io_index < io_aops.size()) {
+    if (io_index == io_aops.size() ||
+        (cpu_index < cpu_aops.size() && cpu_cost <= io_cost)) {
+      cpu_cost += cost_model.OperationCost(cpu_aops[cpu_index].op, kBlockSize);
+      aops->push_back(std::move(cpu_aops[cpu_index++]));
+    } else {
+      io_cost += cost_model.OperationCost(io_aops[io_index].op, kBlockSize);
+      aops->push_back(std::move(io_aops[io_index++]));
+    }
+  }
+}
 
-  brillo::Blob blob;
-  InstallOperation::Type op_type;
-  TEST_AND_RETURN_FALSE(
-      diff_utils::GenerateBestFullOperation(data, version, &blob, &op_type));
+void ABGenerator::OrderOperationsForStreaming(
+    vector<AnnotatedOperation>* aops,
+    const ApplyCostModel& cost_model,
+    double download_mib_per_second,
+    uint64_t lookahead_size) {
+  // In milliseconds, like the costs of |cost_model|.
+  const auto download_time =
+      [download_mib_per_second](const AnnotatedOperation& aop) {
+        return aop.op.data_length() * 1000.0 /
+               (download_mib_per_second * 1024 * 1024);
+      };
+  vector<AnnotatedOperation> cpu_aops;
+  vector<AnnotatedOperation> network_aops;
+  for (AnnotatedOperation& aop : *aops) {
+    if (cost_model.OperationCost(aop.op, kBlockSize) > download_time(aop)) {
+      cpu_aops.push_back(std::move(aop));
+    } else {
+      network_aops.push_back(std::move(aop));
+    }
+  }
+  aops->clear();
 
-  // If the operation doesn't point to a data blob or points to a data blob of
-  // a different type then we add it.
-  if (aop->op.type() != op_type || aop->op.data_length() != blob.size()) {
-    aop->op.set_type(op_type);
-    aop->SetOperationBlob(blob, blob_file);
+  // When the device is done downloading and applying the operations ordered so
+  // far, and when each of the blobs downloaded ahead is released with its size.
+  double download_end = 0;
+  double apply_end = 0;
+  std::deque<std::pair<double, uint64_t>> lookahead;
+  uint64_t lookahead_used = 0;
+  size_t cpu_index = 0;
+  size_t network_index = 0;
+  while (cpu_index < cpu_aops.size() || network_index < network_aops.size()) {
+    // Take an operation applying for longer than it downloads when the device
+    // would otherwise wait for the next blob.
+    const bool take_cpu =
+        cpu_index < cpu_aops.size() &&
+        (network_index == network_aops.size() ||
+         apply_end - download_end < download_time(network_aops[network_index]));
+    AnnotatedOperation& aop = take_cpu ? cpu_aops[cpu_index++]
+                                       : network_aops[network_index++];
+    const uint64_t size = aop.op.data_length();
+    double download_start = download_end;
+    while (!lookahead.empty() && lookahead_used + size > lookahead_size) {
+      download_start = std::max(download_start, lookahead.front().first);
+      lookahead_used -= lookahead.front().second;
+      lookahead.pop_front();
+    }
+    download_end = download_start + download_time(aop);
+    apply_end = std::max(apply_end, download_end) +
+                cost_model.OperationCost(aop.op, kBlockSize);
+    lookahead.emplace_back(apply_end, size);
+    lookahead_used += size;
+    aops->push_back(std::move(aop));
   }
+  LOG(INFO) << "Ordered " << cpu_aops.size() << " CPU bound and "
+            << network_aops.size() << " network bound operations, estimated "
+            << "to stream in " << apply_end / 1000 << " seconds.";
+}
 
-  return true;
+bool ABGenerator::AddDataAndSetType(AnnotatedOperation* aop,
+                                    const PayloadVersion& version,
+                                    const string& target_part_path,
+                                    BlobFileWriter* blob_file,
+                                    bool max_compression_effort) {
+  brillo::Blob blob;
+  InstallOperation::Type op_type;
+  TEST_AND_RETURN_FALSE(GenerateFullData(*aop,
+                                         version,
+                                         target_part_path,
+                                         max_compression_effort,
+                                         &blob,
+                                         &op_type));
+  return SetFullData(aop, blob, op_type, blob_file);
 }
 
 bool ABGenerator::AddSourceHash(vector<AnnotatedOperation>* aops,
                                 const string& source_part_path) {
-  for (AnnotatedOperation& aop : *aops) {
-    if (aop.op.src_extents_size() == 0)
-      continue;
+  // The source image is mapped once for all threads, sharing the pages the
+  // diffs read.
+  const auto image = MappedFile::OpenShared(source_part_path);
+
+  // When called from GenerateUpdatePayloadFile(), the operations are hashed on
+  // the threads shared by all partitions.
+  std::unique_ptr<TaskScheduler> own_scheduler;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler == nullptr) {
+    own_scheduler =
+        std::make_unique<TaskScheduler>(diff_utils::GetMaxThreads());
+    scheduler = own_scheduler.get();
+  }
 
-    vector<Extent> src_extents;
-    ExtentsToVector(aop.op.src_extents(), &src_extents);
-    brillo::Blob src_data, src_hash;
-    uint64_t src_length =
-        aop.op.has_src_length()
-            ? aop.op.src_length()
-            : utils::BlocksInExtents(aop.op.src_extents()) * kBlockSize;
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(
-        source_part_path, src_extents, &src_data, src_length, kBlockSize));
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(src_data, &src_hash));
-    aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  // Every task sets the hashes of a range of operations, so the result
+  // doesn't depend on the order they run in.
+  std::atomic<bool> success{true};
+  {
+    TaskScheduler::TaskGroup group(scheduler, false);
+    const size_t range_ops =
+        std::max<size_t>(1, aops->size() / (scheduler->num_threads() * 4) + 1);
+    for (size_t start = 0; start < aops->size(); start += range_ops) {
+      const size_t end = std::min(aops->size(), start + range_ops);
+      group.Submit(end - start, [&, start, end]() {
+        for (size_t i = start; i < end && success; i++) {
+          if (!AddOperationSourceHash(
+                  image.get(), source_part_path, &(*aops)[i].op)) {
+            success = false;
+          }
+        }
+      });
+    }
+    group.Wait();
   }
-  return true;
+  return success;
 }
 
 }  // namespace chromeos_update_engine
@@ -24,11 +24,13 @@
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/apply_cost_model.h"
 #include "update_engine/payload_generator/blob_file_writer.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
 #include "update_engine/payload_generator/operations_generator.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/payload_generator/source_block_index.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -39,6 +41,10 @@ namespace chromeos_update_engine {
 class ABGenerator : public OperationsGenerator {
  public:
   ABGenerator() = default;
+  // Also copies the blocks found in the other partitions of
+  // |source_block_index|, which must outlive the generator.
+  explicit ABGenerator(const SourceBlockIndex* source_block_index)
+      : source_block_index_(source_block_index) {}
 
   // Generate the update payload operations for the given partition using
   // SOURCE_* operations, used for generating deltas for the minor version
@@ -60,11 +66,13 @@ class ABGenerator : public OperationsGenerator {
   // BSDIFF and SOURCE_BSDIFF, PUFFDIFF and BROTLI_BSDIFF operations.  The
   // |target_part_path| is the filename of the new image, where the destination
   // extents refer to. The blobs of the operations in |aops| should reference
-  // |blob_file|. |blob_file| are updated if needed.
+  // |blob_file|. |blob_file| are updated if needed. See
+  // diff_utils::GenerateBestFullOperation() for |max_compression_effort|.
   static bool FragmentOperations(const PayloadVersion& version,
                                  std::vector<AnnotatedOperation>* aops,
                                  const std::string& target_part_path,
-                                 BlobFileWriter* blob_file);
+                                 BlobFileWriter* blob_file,
+                                 bool max_compression_effort = false);
 
   // Takes a vector of AnnotatedOperations |aops| and sorts them by the first
   // start block in their destination extents. Sets |aops| to a vector of the
@@ -87,12 +95,15 @@ class ABGenerator : public OperationsGenerator {
   // Takes a REPLACE, REPLACE_BZ or REPLACE_XZ operation |aop|, and adds one
   // operation for each dst extent in |aop| to |ops|. The new operations added
   // to |ops| will have only one dst extent each, and may be of a different
-  // type depending on whether compression is advantageous.
+  // type depending on whether compression is advantageous. When called from a
+  // TaskScheduler task, the new operations are compressed concurrently on its
+  // threads, their blobs are still stored in order.
   static bool SplitAReplaceOp(const PayloadVersion& version,
                               const AnnotatedOperation& original_aop,
                               const std::string& target_part,
                               std::vector<AnnotatedOperation>* result_aops,
-                              BlobFileWriter* blob_file);
+                              BlobFileWriter* blob_file,
+                              bool max_compression_effort = false);
 
   // Takes a sorted (by first destination extent) vector of operations |aops|
   // and merges SOURCE_COPY, REPLACE, REPLACE_BZ and REPLACE_XZ, operations in
@@ -101,16 +112,51 @@ class ABGenerator : public OperationsGenerator {
   //   - They are both REPLACE_*, or they are both SOURCE_COPY,
   //   - Their destination blocks are contiguous.
   //   - Their combined blocks do not exceed |chunk_blocks| blocks.
+  //   - With a |cost_model|, their combined cost doesn't exceed its target.
   // Note that unlike other methods, you can't pass a negative number in
   // |chunk_blocks|.
   static bool MergeOperations(std::vector<AnnotatedOperation>* aops,
                               const PayloadVersion& version,
                               size_t chunk_blocks,
                               const std::string& target_part,
-                              BlobFileWriter* blob_file);
+                              BlobFileWriter* blob_file,
+                              bool max_compression_effort = false,
+                              const ApplyCostModel* cost_model = nullptr);
+
+  // Splits the SOURCE_COPY, REPLACE, REPLACE_BZ and REPLACE_XZ operations of
+  // |aops| costing more than the target of |cost_model| into operations of
+  // about that cost, writing consecutive parts of their destination. The other
+  // operations are left as they are.
+  static bool SplitCostlyOperations(std::vector<AnnotatedOperation>* aops,
+                                    const PayloadVersion& version,
+                                    const ApplyCostModel& cost_model,
+                                    const std::string& target_part_path,
+                                    BlobFileWriter* blob_file,
+                                    bool max_compression_effort = false);
+
+  // Reorders |aops| so the operations mostly spent on the CPU alternate with
+  // the ones mostly spent on I/O, for a device applying several at once to
+  // keep both busy. Each kind keeps its order, and the next operation is taken
+  // from the kind with the least cost so far according to |cost_model|.
+  static void InterleaveOperationsByCost(std::vector<AnnotatedOperation>* aops,
+                                         const ApplyCostModel& cost_model);
+
+  // Reorders |aops| for a device downloading their blobs at
+  // |download_mib_per_second| up to |lookahead_size| bytes ahead of the
+  // operation it applies. The operations applying for longer than their blob
+  // downloads according to |cost_model| are placed so their blobs arrive while
+  // the device is busy applying, and the ones with large blobs are downloaded
+  // while the device applies the others. Each kind keeps its order.
+  static void OrderOperationsForStreaming(
+      std::vector<AnnotatedOperation>* aops,
+      const ApplyCostModel& cost_model,
+      double download_mib_per_second,
+      uint64_t lookahead_size);
 
   // Takes a vector of AnnotatedOperations |aops|, adds source hash to all
-  // operations that have src_extents.
+  // operations that have src_extents. The operations are hashed in parallel
+  // on the current TaskScheduler, or on threads of their own when not called
+  // from a task.
   static bool AddSourceHash(std::vector<AnnotatedOperation>* aops,
                             const std::string& source_part_path);
 
@@ -125,7 +171,10 @@ class ABGenerator : public OperationsGenerator {
   static bool AddDataAndSetType(AnnotatedOperation* aop,
                                 const PayloadVersion& version,
                                 const std::string& target_part_path,
-                                BlobFileWriter* blob_file);
+                                BlobFileWriter* blob_file,
+                                bool max_compression_effort);
+
+  const SourceBlockIndex* source_block_index_{nullptr};
 
   DISALLOW_COPY_AND_ASSIGN(ABGenerator);
 };
@@ -33,6 +33,7 @@
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/payload_generator/xz.h"
 
 using std::string;
@@ -48,9 +49,11 @@ bool ExtentEquals(const Extent& ext,
   return ext.start_block() == start_block && ext.num_blocks() == num_blocks;
 }
 
-// Tests splitting of a REPLACE/REPLACE_XZ operation.
+// Tests splitting of a REPLACE/REPLACE_XZ operation, from a TaskScheduler task
+// if |on_scheduler|.
 void TestSplitReplaceOrReplaceXzOperation(InstallOperation::Type orig_type,
-                                          bool compressible) {
+                                          bool compressible,
+                                          bool on_scheduler = false) {
   const size_t op_ex1_start_block = 2;
   const size_t op_ex1_num_blocks = 2;
   const size_t op_ex2_start_block = 6;
@@ -118,8 +121,20 @@ void TestSplitReplaceOrReplaceXzOperation(InstallOperation::Type orig_type,
   vector<AnnotatedOperation> result_ops;
   PayloadVersion version(kBrilloMajorPayloadVersion,
                          kSourceMinorPayloadVersion);
-  ASSERT_TRUE(ABGenerator::SplitAReplaceOp(
-      version, aop, part_file.path(), &result_ops, &blob_file));
+  if (on_scheduler) {
+    TaskScheduler scheduler(2);
+    TaskScheduler::TaskGroup group(&scheduler, true);
+    bool success = false;
+    group.Submit(1, [&]() {
+      success = ABGenerator::SplitAReplaceOp(
+          version, aop, part_file.path(), &result_ops, &blob_file);
+    });
+    group.Wait();
+    ASSERT_TRUE(success);
+  } else {
+    ASSERT_TRUE(ABGenerator::SplitAReplaceOp(
+        version, aop, part_file.path(), &result_ops, &blob_file));
+  }
 
   // Check the result.
   InstallOperation::Type expected_type =
@@ -395,6 +410,13 @@ TEST_F(ABGeneratorTest, SplitReplaceXzIntoReplaceTest) {
   TestSplitReplaceOrReplaceXzOperation(InstallOperation::REPLACE_XZ, false);
 }
 
+TEST_F(ABGeneratorTest, SplitReplaceOnSchedulerTest) {
+  // The blobs are stored in order of the fragments all the same.
+  TestSplitReplaceOrReplaceXzOperation(InstallOperation::REPLACE, true, true);
+  TestSplitReplaceOrReplaceXzOperation(
+      InstallOperation::REPLACE_XZ, false, true);
+}
+
 TEST_F(ABGeneratorTest, SortOperationsByDestinationTest) {
   vector<AnnotatedOperation> aops;
   // One operation with multiple destination extents.
@@ -541,6 +563,132 @@ TEST_F(ABGeneratorTest, NoMergeOperationsTest) {
   EXPECT_EQ(4U, aops.size());
 }
 
+TEST_F(ABGeneratorTest, SplitCostlyOperationsTest) {
+  // Costs 1 + 4 * 4 = 17 ms, split in two operations of at most 10 ms.
+  const ApplyCostModel cost_model = {1, 4, 20, 80, 10};
+  vector<AnnotatedOperation> aops(2);
+  aops[0].name = "copy";
+  aops[0].op.set_type(InstallOperation::SOURCE_COPY);
+  *aops[0].op.add_src_extents() = ExtentForRange(2000, 600);
+  *aops[0].op.add_src_extents() = ExtentForRange(3000, 424);
+  *aops[0].op.add_dst_extents() = ExtentForRange(0, 1024);
+  // Diff operations are never split.
+  aops[1].op.set_type(InstallOperation::SOURCE_BSDIFF);
+  *aops[1].op.add_src_extents() = ExtentForRange(5000, 1024);
+  *aops[1].op.add_dst_extents() = ExtentForRange(1024, 1024);
+
+  BlobFileWriter blob_file(0, nullptr);
+  PayloadVersion version(kBrilloMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  EXPECT_TRUE(ABGenerator::SplitCostlyOperations(
+      &aops, version, cost_model, "", &blob_file));
+
+  ASSERT_EQ(3U, aops.size());
+  EXPECT_EQ("copy:0", aops[0].name);
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, aops[0].op.type());
+  ASSERT_EQ(1, aops[0].op.src_extents_size());
+  EXPECT_TRUE(ExtentEquals(aops[0].op.src_extents(0), 2000, 512));
+  ASSERT_EQ(1, aops[0].op.dst_extents_size());
+  EXPECT_TRUE(ExtentEquals(aops[0].op.dst_extents(0), 0, 512));
+  EXPECT_EQ("copy:1", aops[1].name);
+  ASSERT_EQ(2, aops[1].op.src_extents_size());
+  EXPECT_TRUE(ExtentEquals(aops[1].op.src_extents(0), 2512, 88));
+  EXPECT_TRUE(ExtentEquals(aops[1].op.src_extents(1), 3000, 424));
+  ASSERT_EQ(1, aops[1].op.dst_extents_size());
+  EXPECT_TRUE(ExtentEquals(aops[1].op.dst_extents(0), 512, 512));
+  EXPECT_EQ(InstallOperation::SOURCE_BSDIFF, aops[2].op.type());
+}
+
+TEST_F(ABGeneratorTest, MergeOperationsWithinCostTest) {
+  // Merging the first two operations costs 1 + 4 * 2 = 9 ms, merging the
+  // third one too would cost 13 ms.
+  const ApplyCostModel cost_model = {1, 4, 20, 80, 10};
+  vector<AnnotatedOperation> aops(3);
+  for (size_t i = 0; i < aops.size(); i++) {
+    aops[i].name = std::to_string(i);
+    aops[i].op.set_type(InstallOperation::SOURCE_COPY);
+    *aops[i].op.add_src_extents() = ExtentForRange(1000 + i * 256, 256);
+    *aops[i].op.add_dst_extents() = ExtentForRange(i * 256, 256);
+  }
+
+  BlobFileWriter blob_file(0, nullptr);
+  PayloadVersion version(kBrilloMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  EXPECT_TRUE(ABGenerator::MergeOperations(
+      &aops, version, 10000, "", &blob_file, false, &cost_model));
+
+  ASSERT_EQ(2U, aops.size());
+  EXPECT_EQ("0,1", aops[0].name);
+  EXPECT_TRUE(ExtentEquals(aops[0].op.dst_extents(0), 0, 512));
+  EXPECT_EQ("2", aops[1].name);
+}
+
+TEST_F(ABGeneratorTest, InterleaveOperationsByCostTest) {
+  const ApplyCostModel cost_model = {1, 4, 20, 80, 100};
+  vector<AnnotatedOperation> aops;
+  // A diff operation costing 1 + 80 = 81 ms and three copies costing 1 + 4 *
+  // 4 = 17 ms, then another diff.
+  const auto add_op = [&aops](const string& name,
+                              InstallOperation::Type type,
+                              uint64_t num_blocks) {
+    AnnotatedOperation aop;
+    aop.name = name;
+    aop.op.set_type(type);
+    *aop.op.add_dst_extents() = ExtentForRange(aops.size() * 1024, num_blocks);
+    aops.push_back(aop);
+  };
+  add_op("diff1", InstallOperation::SOURCE_BSDIFF, 256);
+  add_op("diff2", InstallOperation::PUFFDIFF, 256);
+  add_op("copy1", InstallOperation::SOURCE_COPY, 1024);
+  add_op("copy2", InstallOperation::SOURCE_COPY, 1024);
+  add_op("copy3", InstallOperation::SOURCE_COPY, 1024);
+
+  ABGenerator::InterleaveOperationsByCost(&aops, cost_model);
+
+  vector<string> names;
+  for (const auto& aop : aops) {
+    names.push_back(aop.name);
+  }
+  // The copies are applied while the first diff is, before the second diff.
+  EXPECT_EQ((vector<string>{"diff1", "copy1", "copy2", "copy3", "diff2"}),
+            names);
+}
+
+TEST_F(ABGeneratorTest, OrderOperationsForStreamingTest) {
+  const ApplyCostModel cost_model = {1, 4, 20, 80, 100};
+  vector<AnnotatedOperation> aops;
+  const auto add_op = [&aops](const string& name,
+                              InstallOperation::Type type,
+                              uint64_t num_blocks,
+                              uint64_t data_length) {
+    AnnotatedOperation aop;
+    aop.name = name;
+    aop.op.set_type(type);
+    *aop.op.add_dst_extents() = ExtentForRange(aops.size() * 1024, num_blocks);
+    aop.op.set_data_length(data_length);
+    aops.push_back(aop);
+  };
+  // At 1 MiB/s, the replaces download in 250 ms and apply in 1 + 4 = 5 ms, the
+  // diffs download in 4 ms and apply in 1 + 4 * 80 = 321 ms.
+  add_op("replace1", InstallOperation::REPLACE, 256, 256 * 1024);
+  add_op("replace2", InstallOperation::REPLACE, 256, 256 * 1024);
+  add_op("replace3", InstallOperation::REPLACE, 256, 256 * 1024);
+  add_op("diff1", InstallOperation::SOURCE_BSDIFF, 1024, 4096);
+  add_op("diff2", InstallOperation::SOURCE_BSDIFF, 1024, 4096);
+
+  ABGenerator::OrderOperationsForStreaming(
+      &aops, cost_model, 1, 16 * 1024 * 1024);
+
+  vector<string> names;
+  for (const auto& aop : aops) {
+    names.push_back(aop.name);
+  }
+  // A replace downloads while each diff applies.
+  EXPECT_EQ(
+      (vector<string>{"diff1", "replace1", "diff2", "replace2", "replace3"}),
+      names);
+}
+
 TEST_F(ABGeneratorTest, AddSourceHashTest) {
   vector<AnnotatedOperation> aops;
   InstallOperation first_op;
@@ -573,4 +721,46 @@ TEST_F(ABGeneratorTest, AddSourceHashTest) {
   EXPECT_EQ(expected_hash, result_hash);
 }
 
+TEST_F(ABGeneratorTest, AddSourceHashManyOperationsTest) {
+  // Hashed in parallel, every operation gets the hash of its own source.
+  const size_t kNumBlocks = 64;
+  ScopedTempFile src_part_file("AddSourceHashTest_src_part.XXXXXX");
+  brillo::Blob src_data(kNumBlocks * kBlockSize);
+  test_utils::FillWithData(&src_data);
+  ASSERT_TRUE(test_utils::WriteFileVector(src_part_file.path(), src_data));
+
+  vector<AnnotatedOperation> aops(1000);
+  for (size_t i = 0; i < aops.size(); i++) {
+    aops[i].op.set_type(InstallOperation::SOURCE_BSDIFF);
+    *aops[i].op.add_src_extents() = ExtentForRange(i % kNumBlocks, 1);
+    *aops[i].op.add_src_extents() = ExtentForRange((i * 7) % kNumBlocks, 1);
+    if (i % 2) {
+      aops[i].op.set_src_length(kBlockSize + i);
+    }
+  }
+  EXPECT_TRUE(ABGenerator::AddSourceHash(&aops, src_part_file.path()));
+
+  for (const AnnotatedOperation& aop : aops) {
+    const vector<Extent> src_extents(aop.op.src_extents().begin(),
+                                     aop.op.src_extents().end());
+    brillo::Blob data;
+    ASSERT_TRUE(utils::ReadExtents(
+        src_part_file.path(),
+        src_extents,
+        &data,
+        aop.op.has_src_length() ? aop.op.src_length() : 2 * kBlockSize,
+        kBlockSize));
+    brillo::Blob expected_hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(data, &expected_hash));
+    EXPECT_EQ(expected_hash,
+              brillo::Blob(aop.op.src_sha256_hash().begin(),
+                           aop.op.src_sha256_hash().end()));
+  }
+
+  // Sources past the end of the partition fail.
+  *aops[500].op.add_src_extents() = ExtentForRange(kNumBlocks, 1);
+  aops[500].op.clear_src_length();
+  EXPECT_FALSE(ABGenerator::AddSourceHash(&aops, src_part_file.path()));
+}
+
 }  // namespace chromeos_update_engine
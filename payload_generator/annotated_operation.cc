@@ -20,6 +20,7 @@
 #include <base/strings/string_number_conversions.h>
 #include <android-base/stringprintf.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 
@@ -41,12 +42,18 @@ bool AnnotatedOperation::SetOperationBlob(const brillo::Blob& blob,
   if (blob.empty()) {
     op.clear_data_offset();
     op.clear_data_length();
+    op.clear_data_sha256_hash();
     return true;
   }
+  // Hash the blob while it is in memory so the payload writer doesn't need to
+  // read it back.
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(blob, &hash));
   off_t data_offset = blob_file->StoreBlob(blob);
   TEST_AND_RETURN_FALSE(data_offset != -1);
   op.set_data_offset(data_offset);
   op.set_data_length(blob.size());
+  op.set_data_sha256_hash(hash.data(), hash.size());
   return true;
 }
 
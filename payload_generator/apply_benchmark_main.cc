@@ -0,0 +1,447 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Applies a recorded payload to source images, or loop devices, the way the
+// device does and reports how long each phase took and what it cost as JSON.
+// The storage may be slowed down with a latency per request, a bandwidth shared
+// by all the partitions and a cost per fsync, to compare the changes to the
+// apply path on something closer to the flash of a device than the host disk.
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/strings.h>
+#include <base/bind.h>
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/json/json_writer.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <base/values.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <gflags/gflags.h>
+#include <xz.h>
+
+#include "update_engine/common/download_action.h"
+#include "update_engine/common/error_code_utils.h"
+#include "update_engine/common/fake_boot_control.h"
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/file_fetcher.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/prefs.h"
+#include "update_engine/common/terminator.h"
+#include "update_engine/common/tracing.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/filesystem_verifier_action.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/partition_fd_cache.h"
+
+DEFINE_string(payload, "", "Path to the payload to apply.");
+DEFINE_string(partition_names,
+              "",
+              "Names of the partitions in the payload, separated by colons.");
+DEFINE_string(old_partitions,
+              "",
+              "Paths to the source images or devices of a delta payload, in "
+              "the order of --partition_names and separated by colons.");
+DEFINE_string(new_partitions,
+              "",
+              "Paths to the target images or devices, in the order of "
+              "--partition_names and separated by colons.");
+DEFINE_int64(latency_us,
+             0,
+             "Latency added to every read and write of the partitions, in "
+             "microseconds.");
+DEFINE_uint64(bandwidth,
+              0,
+              "Bytes per second shared by all the reads and writes of the "
+              "partitions, 0 for no limit.");
+DEFINE_int64(fsync_ms, 0, "Time added to every flush of a partition, in ms.");
+DEFINE_string(out_file, "", "Where to write the JSON report, stdout if empty.");
+DEFINE_string(trace_file,
+              "",
+              "Where to write a Chrome JSON trace of the spans of the update, "
+              "which Perfetto UI opens. Not traced if empty.");
+DEFINE_uint64(trace_events,
+              1 << 20,
+              "With --trace_file, how many of the last spans are kept.");
+
+namespace chromeos_update_engine {
+
+namespace {
+
+using std::string;
+using std::vector;
+using Clock = std::chrono::steady_clock;
+
+// Slows the requests down to the latency, bandwidth and fsync cost of the
+// emulated storage, and counts them. Safe to use from multiple threads.
+class EmulatedStorage {
+ public:
+  EmulatedStorage(std::chrono::microseconds latency,
+                  uint64_t bandwidth,
+                  std::chrono::milliseconds sync_cost)
+      : latency_(latency), bandwidth_(bandwidth), sync_cost_(sync_cost) {}
+
+  // Waits until |bytes| went through the storage.
+  void Transfer(size_t bytes, bool write) {
+    (write ? writes_ : reads_)++;
+    (write ? bytes_written_ : bytes_read_) += bytes;
+    Clock::time_point done = Clock::now();
+    if (bandwidth_ > 0) {
+      const auto duration = std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(static_cast<double>(bytes) /
+                                        bandwidth_));
+      std::lock_guard<std::mutex> lock(mutex_);
+      busy_until_ = std::max(busy_until_, done) + duration;
+      done = busy_until_;
+    }
+    std::this_thread::sleep_until(done + latency_);
+  }
+
+  void Sync() {
+    syncs_++;
+    std::this_thread::sleep_for(sync_cost_);
+  }
+
+  void AddToReport(base::DictionaryValue* report) const {
+    report->SetDouble("storage.reads", reads_);
+    report->SetDouble("storage.writes", writes_);
+    report->SetDouble("storage.bytes_read", bytes_read_);
+    report->SetDouble("storage.bytes_written", bytes_written_);
+    report->SetDouble("storage.syncs", syncs_);
+  }
+
+ private:
+  const std::chrono::microseconds latency_;
+  const uint64_t bandwidth_;
+  const std::chrono::milliseconds sync_cost_;
+
+  std::mutex mutex_;
+  // When the requests issued so far are through at |bandwidth_|.
+  Clock::time_point busy_until_;
+
+  std::atomic<uint64_t> reads_{0};
+  std::atomic<uint64_t> writes_{0};
+  std::atomic<uint64_t> bytes_read_{0};
+  std::atomic<uint64_t> bytes_written_{0};
+  std::atomic<uint64_t> syncs_{0};
+};
+
+// A FileDescriptor going through EmulatedStorage before |fd|. The callers
+// using Fd() directly bypass the emulation.
+class EmulatedFileDescriptor : public FileDescriptor {
+ public:
+  EmulatedFileDescriptor(FileDescriptorPtr fd, EmulatedStorage* storage)
+      : fd_(std::move(fd)), storage_(storage) {}
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override {
+    storage_->Transfer(count, false);
+    return fd_->Read(buf, count);
+  }
+  ssize_t Write(const void* buf, size_t count) override {
+    storage_->Transfer(count, true);
+    return fd_->Write(buf, count);
+  }
+  bool ReadAt(const vector<IoRequest>& requests) override {
+    storage_->Transfer(TotalSize(requests), false);
+    return fd_->ReadAt(requests);
+  }
+  bool WriteAt(const vector<IoRequest>& requests) override {
+    storage_->Transfer(TotalSize(requests), true);
+    return fd_->WriteAt(requests);
+  }
+  off64_t Seek(off64_t offset, int whence) override {
+    return fd_->Seek(offset, whence);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool Flush() override {
+    storage_->Sync();
+    return fd_->Flush();
+  }
+  bool Close() override { return fd_->Close(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  int Fd() override { return fd_->Fd(); }
+
+ private:
+  static size_t TotalSize(const vector<IoRequest>& requests) {
+    size_t size = 0;
+    for (const auto& request : requests) {
+      size += request.size;
+    }
+    return size;
+  }
+
+  FileDescriptorPtr fd_;
+  EmulatedStorage* storage_;
+
+  DISALLOW_COPY_AND_ASSIGN(EmulatedFileDescriptor);
+};
+
+// The resources used by the process up to some point.
+struct Usage {
+  Clock::time_point time;
+  double user_seconds{0};
+  double system_seconds{0};
+  // In KiB, only ever grows.
+  uint64_t max_rss_kb{0};
+  // From /proc/self/io.
+  std::map<string, uint64_t> io;
+
+  static Usage Now() {
+    Usage usage;
+    usage.time = Clock::now();
+    struct rusage rusage {};
+    PCHECK(getrusage(RUSAGE_SELF, &rusage) == 0);
+    usage.user_seconds =
+        rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec / 1000000.0;
+    usage.system_seconds =
+        rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec / 1000000.0;
+    usage.max_rss_kb = rusage.ru_maxrss;
+    string io;
+    if (base::ReadFileToString(base::FilePath("/proc/self/io"), &io)) {
+      base::StringPairs pairs;
+      base::SplitStringIntoKeyValuePairs(io, ':', '\n', &pairs);
+      for (const auto& [key, value] : pairs) {
+        uint64_t number = 0;
+        if (base::StringToUint64(
+                base::TrimWhitespaceASCII(value, base::TRIM_ALL), &number)) {
+          usage.io[key] = number;
+        }
+      }
+    }
+    return usage;
+  }
+};
+
+// Adds what was used from |start| to |end| to |report| under |phase|, with the
+// throughput of |bytes| over that time.
+void AddPhase(const string& phase,
+              const Usage& start,
+              const Usage& end,
+              uint64_t bytes,
+              base::DictionaryValue* report) {
+  const double seconds =
+      std::chrono::duration<double>(end.time - start.time).count();
+  const string prefix = "phases." + phase + ".";
+  report->SetDouble(prefix + "seconds", seconds);
+  report->SetDouble(prefix + "bytes", bytes);
+  report->SetDouble(prefix + "mib_per_second",
+                    seconds > 0 ? bytes / seconds / (1024 * 1024) : 0);
+  report->SetDouble(prefix + "user_seconds",
+                    end.user_seconds - start.user_seconds);
+  report->SetDouble(prefix + "system_seconds",
+                    end.system_seconds - start.system_seconds);
+  report->SetDouble(prefix + "max_rss_kb", end.max_rss_kb);
+  // The read and write syscalls, and the bytes which reached the storage.
+  for (const char* key : {"syscr", "syscw", "read_bytes", "write_bytes"}) {
+    const auto it = end.io.find(key);
+    if (it != end.io.end()) {
+      const auto start_it = start.io.find(key);
+      report->SetDouble(
+          prefix + key,
+          it->second - (start_it != start.io.end() ? start_it->second : 0));
+    }
+  }
+}
+
+// Records the usage at the end of every action.
+class BenchmarkProcessorDelegate : public ActionProcessorDelegate {
+ public:
+  void ProcessingDone(const ActionProcessor* processor,
+                      ErrorCode code) override {
+    brillo::MessageLoop::current()->BreakLoop();
+    code_ = code;
+  }
+  void ProcessingStopped(const ActionProcessor* processor) override {
+    brillo::MessageLoop::current()->BreakLoop();
+  }
+  void ActionCompleted(ActionProcessor* processor,
+                       AbstractAction* action,
+                       ErrorCode code) override {
+    usages_[action->Type()] = Usage::Now();
+  }
+
+  ErrorCode code_{ErrorCode::kError};
+  std::map<string, Usage> usages_;
+};
+
+vector<string> SplitPaths(const string& paths) {
+  if (paths.empty()) {
+    return {};
+  }
+  return base::SplitString(
+      paths, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+}
+
+int Main(int argc, char** argv) {
+  gflags::SetUsageMessage(
+      "Applies a payload to the given partitions with an emulated storage and "
+      "reports the time, CPU, memory and I/O of every phase as JSON.");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  CHECK_EQ(argc, 1) << " Unused args: "
+                    << android::base::Join(
+                           vector<char*>(argv + 1, argv + argc), " ");
+  Terminator::Init();
+
+  const vector<string> partition_names = SplitPaths(FLAGS_partition_names);
+  const vector<string> old_partitions = SplitPaths(FLAGS_old_partitions);
+  const vector<string> new_partitions = SplitPaths(FLAGS_new_partitions);
+  LOG_IF(FATAL, FLAGS_payload.empty()) << "Must pass --payload.";
+  LOG_IF(FATAL, partition_names.empty()) << "Must pass --partition_names.";
+  CHECK_EQ(partition_names.size(), new_partitions.size());
+  const bool is_delta = !old_partitions.empty();
+  if (is_delta) {
+    CHECK_EQ(partition_names.size(), old_partitions.size());
+  }
+
+  FakeBootControl fake_boot_control;
+  FakeHardware fake_hardware;
+  MemoryPrefs prefs;
+  InstallPlan install_plan;
+  InstallPlan::Payload payload;
+  install_plan.source_slot = is_delta ? 0 : BootControlInterface::kInvalidSlot;
+  install_plan.target_slot = 1;
+  payload.type =
+      is_delta ? InstallPayloadType::kDelta : InstallPayloadType::kFull;
+  payload.size = utils::FileSize(FLAGS_payload);
+  CHECK(HashCalculator::RawHashOfFile(
+      FLAGS_payload, payload.size, &payload.hash));
+  install_plan.payloads = {payload};
+  install_plan.download_url =
+      "file://" +
+      base::MakeAbsoluteFilePath(base::FilePath(FLAGS_payload)).value();
+
+  uint64_t partitions_size = 0;
+  for (size_t i = 0; i < partition_names.size(); i++) {
+    fake_boot_control.SetPartitionDevice(
+        partition_names[i], install_plan.target_slot, new_partitions[i]);
+    if (is_delta) {
+      fake_boot_control.SetPartitionDevice(
+          partition_names[i], install_plan.source_slot, old_partitions[i]);
+    }
+    const off_t size = utils::FileSize(new_partitions[i]);
+    CHECK_GE(size, 0) << new_partitions[i];
+    partitions_size += size;
+  }
+
+  EmulatedStorage storage(std::chrono::microseconds(FLAGS_latency_us),
+                          FLAGS_bandwidth,
+                          std::chrono::milliseconds(FLAGS_fsync_ms));
+  PartitionFdCache::GetInstance()->SetWrapper([&storage](FileDescriptorPtr fd) {
+    return std::make_shared<EmulatedFileDescriptor>(std::move(fd), &storage);
+  });
+
+  xz_crc32_init();
+  brillo::BaseMessageLoop loop;
+  loop.SetAsCurrent();
+  auto install_plan_action = std::make_unique<InstallPlanAction>(install_plan);
+  auto download_action =
+      std::make_unique<DownloadAction>(&prefs,
+                                       &fake_boot_control,
+                                       &fake_hardware,
+                                       new FileFetcher(),
+                                       true /* interactive */);
+  auto filesystem_verifier_action = std::make_unique<FilesystemVerifierAction>(
+      fake_boot_control.GetDynamicPartitionControl());
+  BondActions(install_plan_action.get(), download_action.get());
+  BondActions(download_action.get(), filesystem_verifier_action.get());
+  ActionProcessor processor;
+  BenchmarkProcessorDelegate delegate;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(std::move(install_plan_action));
+  processor.EnqueueAction(std::move(download_action));
+  processor.EnqueueAction(std::move(filesystem_verifier_action));
+
+  if (!FLAGS_trace_file.empty()) {
+    tracing::StartRecording(FLAGS_trace_events);
+  }
+  const Usage start = Usage::Now();
+  loop.PostTask(FROM_HERE,
+                base::Bind(&ActionProcessor::StartProcessing,
+                           base::Unretained(&processor)));
+  loop.Run();
+  const Usage end = Usage::Now();
+  if (!FLAGS_trace_file.empty()) {
+    tracing::StopRecording(FLAGS_trace_file);
+  }
+  PartitionFdCache::GetInstance()->Clear();
+  PartitionFdCache::GetInstance()->SetWrapper(nullptr);
+  if (delegate.code_ != ErrorCode::kSuccess) {
+    LOG(ERROR) << "Failed to apply the payload: "
+               << utils::ErrorCodeToString(delegate.code_);
+    return 1;
+  }
+
+  base::DictionaryValue report;
+  report.SetString("payload", FLAGS_payload);
+  report.SetBoolean("is_delta", is_delta);
+  report.SetDouble("payload_size", payload.size);
+  report.SetDouble("partitions_size", partitions_size);
+  report.SetDouble("emulation.latency_us", FLAGS_latency_us);
+  report.SetDouble("emulation.bandwidth", FLAGS_bandwidth);
+  report.SetDouble("emulation.fsync_ms", FLAGS_fsync_ms);
+  const Usage& planned = delegate.usages_[InstallPlanAction::StaticType()];
+  const Usage& applied = delegate.usages_[DownloadAction::StaticType()];
+  AddPhase("apply", planned, applied, payload.size, &report);
+  AddPhase("verify", applied, end, partitions_size, &report);
+  AddPhase("total", start, end, payload.size, &report);
+  storage.AddToReport(&report);
+
+  string json;
+  CHECK(base::JSONWriter::WriteWithOptions(
+      report, base::JSONWriter::OPTIONS_PRETTY_PRINT, &json));
+  if (FLAGS_out_file.empty()) {
+    printf("%s", json.c_str());
+  } else {
+    CHECK(utils::WriteFile(FLAGS_out_file.c_str(), json.data(), json.size()));
+  }
+  return 0;
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
@@ -0,0 +1,106 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/apply_cost_model.h"
+
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Rough figures for devices of each class writing to eMMC or UFS storage, in
+// the order of the members. Pass the costs explicitly to tune them.
+constexpr ApplyCostModel kLowEndDevice = {2.0, 8.0, 40.0, 160.0, 400.0};
+constexpr ApplyCostModel kMidRangeDevice = {1.0, 4.0, 20.0, 80.0, 200.0};
+constexpr ApplyCostModel kHighEndDevice = {0.5, 2.0, 10.0, 40.0, 100.0};
+}  // namespace
+
+bool ApplyCostModel::Parse(const string& name, ApplyCostModel* model) {
+  if (name == "low") {
+    *model = kLowEndDevice;
+    return true;
+  }
+  if (name == "mid") {
+    *model = kMidRangeDevice;
+    return true;
+  }
+  if (name == "high") {
+    *model = kHighEndDevice;
+    return true;
+  }
+  const vector<string> costs = base::SplitString(
+      name, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  double values[5];
+  if (costs.size() != 5) {
+    LOG(ERROR) << "Invalid apply cost model: " << name;
+    return false;
+  }
+  for (size_t i = 0; i < costs.size(); i++) {
+    if (!base::StringToDouble(costs[i], &values[i]) || values[i] < 0) {
+      LOG(ERROR) << "Invalid cost in apply cost model: " << costs[i];
+      return false;
+    }
+  }
+  TEST_AND_RETURN_FALSE(values[4] > 0);
+  *model = {values[0], values[1], values[2], values[3], values[4]};
+  return true;
+}
+
+double ApplyCostModel::OperationCost(const InstallOperation& op,
+                                     size_t block_size) const {
+  const double mib =
+      static_cast<double>(utils::BlocksInExtents(op.dst_extents())) *
+      block_size / (1024 * 1024);
+  switch (op.type()) {
+    case InstallOperation::SOURCE_COPY:
+    case InstallOperation::PARTITION_COPY:
+    case InstallOperation::REPLACE:
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+    case InstallOperation::REPLACE_ZSTD:
+      return operation_cost + mib * copy_cost_per_mib;
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+      return operation_cost + mib * decompress_cost_per_mib;
+    default:
+      return operation_cost + mib * patch_cost_per_mib;
+  }
+}
+
+bool ApplyCostModel::IsCpuBound(const InstallOperation& op) {
+  switch (op.type()) {
+    case InstallOperation::SOURCE_COPY:
+    case InstallOperation::PARTITION_COPY:
+    case InstallOperation::REPLACE:
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      return false;
+    default:
+      return true;
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,57 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_APPLY_COST_MODEL_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_APPLY_COST_MODEL_H_
+
+#include <string>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A rough model of how long a device takes to apply an operation, so the
+// operations of a payload can be sized and ordered for applying it fast rather
+// than only for its size. All costs are in milliseconds.
+struct ApplyCostModel {
+  // Paid by every operation whatever its size: verifying its data, saving a
+  // checkpoint and setting up its writer.
+  double operation_cost;
+  // Per MiB written by operations which only copy data: SOURCE_COPY,
+  // PARTITION_COPY, REPLACE, ZERO and DISCARD, and by REPLACE_ZSTD, which
+  // decompresses about as fast.
+  double copy_cost_per_mib;
+  // Per MiB written by REPLACE_BZ and REPLACE_XZ.
+  double decompress_cost_per_mib;
+  // Per MiB written by the diff operations.
+  double patch_cost_per_mib;
+  // The cost operations are merged up to and split down to, when possible.
+  double target_operation_cost;
+
+  // Sets |model| to the one of |name|: one of the device classes "low", "mid"
+  // and "high", or the five costs above separated by commas.
+  static bool Parse(const std::string& name, ApplyCostModel* model);
+
+  // Returns the cost of |op|, which writes blocks of |block_size| bytes.
+  double OperationCost(const InstallOperation& op, size_t block_size) const;
+
+  // Whether applying |op| is mostly spent on the CPU rather than on I/O.
+  static bool IsCpuBound(const InstallOperation& op);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_APPLY_COST_MODEL_H_
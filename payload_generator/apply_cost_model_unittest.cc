@@ -0,0 +1,76 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/apply_cost_model.h"
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+class ApplyCostModelTest : public ::testing::Test {};
+
+TEST_F(ApplyCostModelTest, ParseDeviceClassTest) {
+  ApplyCostModel low, mid, high;
+  EXPECT_TRUE(ApplyCostModel::Parse("low", &low));
+  EXPECT_TRUE(ApplyCostModel::Parse("mid", &mid));
+  EXPECT_TRUE(ApplyCostModel::Parse("high", &high));
+  EXPECT_GT(low.operation_cost, mid.operation_cost);
+  EXPECT_GT(mid.operation_cost, high.operation_cost);
+}
+
+TEST_F(ApplyCostModelTest, ParseCostsTest) {
+  ApplyCostModel model;
+  EXPECT_TRUE(ApplyCostModel::Parse("1, 2,3,4.5,100", &model));
+  EXPECT_DOUBLE_EQ(1, model.operation_cost);
+  EXPECT_DOUBLE_EQ(2, model.copy_cost_per_mib);
+  EXPECT_DOUBLE_EQ(3, model.decompress_cost_per_mib);
+  EXPECT_DOUBLE_EQ(4.5, model.patch_cost_per_mib);
+  EXPECT_DOUBLE_EQ(100, model.target_operation_cost);
+}
+
+TEST_F(ApplyCostModelTest, ParseInvalidTest) {
+  ApplyCostModel model;
+  EXPECT_FALSE(ApplyCostModel::Parse("", &model));
+  EXPECT_FALSE(ApplyCostModel::Parse("medium", &model));
+  EXPECT_FALSE(ApplyCostModel::Parse("1,2,3,4", &model));
+  EXPECT_FALSE(ApplyCostModel::Parse("1,2,3,-4,100", &model));
+  EXPECT_FALSE(ApplyCostModel::Parse("1,2,3,4,x", &model));
+  // The target cost can't be zero.
+  EXPECT_FALSE(ApplyCostModel::Parse("1,2,3,4,0", &model));
+}
+
+TEST_F(ApplyCostModelTest, OperationCostTest) {
+  const ApplyCostModel model = {1, 4, 20, 80, 100};
+  InstallOperation op;
+  // 2 MiB of 4 KiB blocks.
+  *op.add_dst_extents() = ExtentForRange(10, 256);
+  *op.add_dst_extents() = ExtentForRange(1000, 256);
+
+  op.set_type(InstallOperation::SOURCE_COPY);
+  EXPECT_DOUBLE_EQ(9, model.OperationCost(op, kBlockSize));
+  EXPECT_FALSE(ApplyCostModel::IsCpuBound(op));
+  op.set_type(InstallOperation::REPLACE_XZ);
+  EXPECT_DOUBLE_EQ(41, model.OperationCost(op, kBlockSize));
+  EXPECT_TRUE(ApplyCostModel::IsCpuBound(op));
+  op.set_type(InstallOperation::SOURCE_BSDIFF);
+  EXPECT_DOUBLE_EQ(161, model.OperationCost(op, kBlockSize));
+  EXPECT_TRUE(ApplyCostModel::IsCpuBound(op));
+}
+
+}  // namespace chromeos_update_engine
@@ -21,25 +21,34 @@
 namespace chromeos_update_engine {
 
 off_t BlobFileWriter::StoreBlob(const brillo::Blob& blob) {
-  base::AutoLock auto_lock(blob_mutex_);
-  if (!utils::PWriteAll(blob_fd_, blob.data(), blob.size(), *blob_file_size_))
+  off_t result;
+  {
+    base::AutoLock auto_lock(blob_mutex_);
+    result = *blob_file_size_;
+    *blob_file_size_ += blob.size();
+  }
+  // A failed write leaves a hole at |result|, the caller gives up on the
+  // whole blob file anyway.
+  if (!utils::PWriteAll(blob_fd_, blob.data(), blob.size(), result))
     return -1;
 
-  off_t result = *blob_file_size_;
-  *blob_file_size_ += blob.size();
-
-  stored_blobs_++;
-  if (total_blobs_ > 0 && (10 * (stored_blobs_ - 1) / total_blobs_) !=
-                              (10 * stored_blobs_ / total_blobs_)) {
-    LOG(INFO) << (100 * stored_blobs_ / total_blobs_) << "% complete "
-              << stored_blobs_ << "/" << total_blobs_
-              << " ops (output size: " << *blob_file_size_ << ")";
+  const size_t stored_blobs = ++stored_blobs_;
+  const size_t total_blobs = total_blobs_;
+  if (total_blobs > 0 && (10 * (stored_blobs - 1) / total_blobs) !=
+                             (10 * stored_blobs / total_blobs)) {
+    off_t blob_file_size;
+    {
+      base::AutoLock auto_lock(blob_mutex_);
+      blob_file_size = *blob_file_size_;
+    }
+    LOG(INFO) << (100 * stored_blobs / total_blobs) << "% complete "
+              << stored_blobs << "/" << total_blobs
+              << " ops (output size: " << blob_file_size << ")";
   }
   return result;
 }
 
 void BlobFileWriter::IncTotalBlobs(size_t increment) {
-  base::AutoLock auto_lock(blob_mutex_);
   total_blobs_ += increment;
 }
 
@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 
+#include <atomic>
+
 #include <android-base/macros.h>
 
 #include <base/synchronization/lock.h>
@@ -32,17 +34,19 @@ class BlobFileWriter {
       : blob_fd_(blob_fd), blob_file_size_(blob_file_size) {}
 
   // Store the passed |blob| in the blob file. Returns the offset at which it
-  // was stored, or -1 in case of failure.
+  // was stored, or -1 in case of failure. Only reserving the offset is
+  // serialized, blobs stored concurrently are written to the file in parallel.
   off_t StoreBlob(const brillo::Blob& blob);
 
   // Increase |total_blobs| by |increment|. Thread safe.
   void IncTotalBlobs(size_t increment);
 
  private:
-  size_t total_blobs_{0};
-  size_t stored_blobs_{0};
+  std::atomic<size_t> total_blobs_{0};
+  std::atomic<size_t> stored_blobs_{0};
 
-  // The file and its size are protected with the |blob_mutex_|.
+  // Blobs are written with pwrite() at their reserved offset, only the file
+  // size is protected with the |blob_mutex_|.
   int blob_fd_;
   off_t* blob_file_size_;
 
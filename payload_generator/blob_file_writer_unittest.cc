@@ -17,6 +17,8 @@
 #include "update_engine/payload_generator/blob_file_writer.h"
 
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -49,4 +51,48 @@ TEST(BlobFileWriterTest, SimpleTest) {
   EXPECT_EQ(blob, stored_blob);
 }
 
+TEST(BlobFileWriterTest, ConcurrentStoreBlob) {
+  ScopedTempFile blob_file("BlobFileWriterTest.XXXXXX", true);
+  off_t blob_file_size = 0;
+  BlobFileWriter blob_file_writer(blob_file.fd(), &blob_file_size);
+
+  constexpr size_t kNumThreads = 8;
+  constexpr size_t kBlobsPerThread = 100;
+  blob_file_writer.IncTotalBlobs(kNumThreads * kBlobsPerThread);
+  std::vector<std::vector<off_t>> offsets(kNumThreads);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([&blob_file_writer, &offsets, i]() {
+      for (size_t j = 0; j < kBlobsPerThread; j++) {
+        // Every thread stores blobs of its own size and content.
+        brillo::Blob blob(i + 1 + j, static_cast<uint8_t>(i));
+        offsets[i].push_back(blob_file_writer.StoreBlob(blob));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  off_t expected_size = 0;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    for (size_t j = 0; j < kBlobsPerThread; j++) {
+      const brillo::Blob blob(i + 1 + j, static_cast<uint8_t>(i));
+      expected_size += blob.size();
+      ASSERT_GE(offsets[i][j], 0);
+      brillo::Blob stored_blob(blob.size());
+      ssize_t bytes_read;
+      ASSERT_TRUE(utils::PReadAll(blob_file.fd(),
+                                  stored_blob.data(),
+                                  stored_blob.size(),
+                                  offsets[i][j],
+                                  &bytes_read));
+      ASSERT_EQ(static_cast<ssize_t>(blob.size()), bytes_read);
+      ASSERT_EQ(blob, stored_blob);
+    }
+  }
+  EXPECT_EQ(expected_size, blob_file_size);
+  EXPECT_EQ(expected_size, utils::FileSize(blob_file.path()));
+}
+
 }  // namespace chromeos_update_engine
@@ -17,29 +17,67 @@
 #include "update_engine/payload_generator/block_mapping.h"
 
 #include <fcntl.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <base/logging.h>
+
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/mapped_file.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 using std::string;
 using std::vector;
 
+namespace chromeos_update_engine {
+
 namespace {
 
+size_t HashValue(const uint8_t* data, size_t size) {
+  return std::hash<std::string_view>()(
+      std::string_view(reinterpret_cast<const char*>(data), size));
+}
+
 size_t HashValue(const brillo::Blob& blob) {
-  std::hash<string> hash_fn;
-  return hash_fn(string(blob.begin(), blob.end()));
+  return HashValue(blob.data(), blob.size());
 }
 
-}  // namespace
+// Maps the partitions by reading them one block at a time, for files which
+// can't be mapped into memory.
+bool MapPartitionBlocksFromDisk(const string& old_part,
+                                const string& new_part,
+                                size_t old_size,
+                                size_t new_size,
+                                size_t block_size,
+                                vector<BlockMapping::BlockId>* old_block_ids,
+                                vector<BlockMapping::BlockId>* new_block_ids) {
+  BlockMapping mapping(block_size);
+  if (mapping.AddBlock(brillo::Blob(block_size, '\0')) != 0)
+    return false;
+  int old_fd = HANDLE_EINTR(open(old_part.c_str(), O_RDONLY));
+  int new_fd = HANDLE_EINTR(open(new_part.c_str(), O_RDONLY));
+  ScopedFdCloser old_fd_closer(&old_fd);
+  ScopedFdCloser new_fd_closer(&new_fd);
 
-namespace chromeos_update_engine {
+  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
+      old_fd, 0, old_size / block_size, old_block_ids));
+  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
+      new_fd, 0, new_size / block_size, new_block_ids));
+  return true;
+}
+
+}  // namespace
 
 BlockMapping::BlockId BlockMapping::AddBlock(const brillo::Blob& block_data) {
   return AddBlock(-1, 0, block_data);
@@ -144,18 +182,106 @@ bool MapPartitionBlocks(const string& old_part,
                         size_t block_size,
                         vector<BlockMapping::BlockId>* old_block_ids,
                         vector<BlockMapping::BlockId>* new_block_ids) {
-  BlockMapping mapping(block_size);
-  if (mapping.AddBlock(brillo::Blob(block_size, '\0')) != 0)
-    return false;
-  int old_fd = HANDLE_EINTR(open(old_part.c_str(), O_RDONLY));
-  int new_fd = HANDLE_EINTR(open(new_part.c_str(), O_RDONLY));
-  ScopedFdCloser old_fd_closer(&old_fd);
-  ScopedFdCloser new_fd_closer(&new_fd);
+  MappedFile old_file;
+  MappedFile new_file;
+  if (!old_file.Map(old_part, old_size) || !new_file.Map(new_part, new_size)) {
+    LOG(WARNING) << "Reading the partitions one block at a time instead";
+    return MapPartitionBlocksFromDisk(old_part,
+                                      new_part,
+                                      old_size,
+                                      new_size,
+                                      block_size,
+                                      old_block_ids,
+                                      new_block_ids);
+  }
 
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      old_fd, 0, old_size / block_size, old_block_ids));
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      new_fd, 0, new_size / block_size, new_block_ids));
+  // Block 0 is the block with all zeros, followed by the blocks of the old
+  // and then the new partition, the order in which ids are assigned.
+  const size_t old_blocks = old_size / block_size;
+  const size_t new_blocks = new_size / block_size;
+  const size_t total_blocks = 1 + old_blocks + new_blocks;
+  const brillo::Blob zero_block(block_size, 0);
+  auto block_data = [&](size_t block) {
+    if (block == 0) {
+      return zero_block.data();
+    }
+    if (block <= old_blocks) {
+      return old_file.data() + (block - 1) * block_size;
+    }
+    return new_file.data() + (block - 1 - old_blocks) * block_size;
+  };
+
+  // When called from GenerateUpdatePayloadFile(), the blocks are hashed on
+  // the threads shared by all partitions.
+  std::unique_ptr<TaskScheduler> own_scheduler;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler == nullptr) {
+    own_scheduler =
+        std::make_unique<TaskScheduler>(diff_utils::GetMaxThreads());
+    scheduler = own_scheduler.get();
+  }
+  const size_t num_shards = scheduler->num_threads();
+
+  // Hash all blocks in parallel, a few ranges per thread.
+  vector<size_t> hashes(total_blocks);
+  {
+    TaskScheduler::TaskGroup group(scheduler, false);
+    const size_t range_blocks =
+        std::max<size_t>(1, total_blocks / (num_shards * 4) + 1);
+    for (size_t start = 0; start < total_blocks; start += range_blocks) {
+      const size_t end = std::min(total_blocks, start + range_blocks);
+      group.Submit(end - start, [&, start, end]() {
+        for (size_t block = start; block < end; block++) {
+          hashes[block] = HashValue(block_data(block), block_size);
+        }
+      });
+    }
+    group.Wait();
+  }
+
+  // Find the first block with the same data as each block. Every shard owns
+  // the blocks whose hash falls into it, so equal blocks always end up in the
+  // same shard and shards don't share any state.
+  vector<size_t> first_equal(total_blocks);
+  {
+    TaskScheduler::TaskGroup group(scheduler, false);
+    for (size_t shard = 0; shard < num_shards; shard++) {
+      group.Submit(1, [&, shard]() {
+        std::unordered_map<size_t, vector<size_t>> buckets;
+        for (size_t block = 0; block < total_blocks; block++) {
+          if (hashes[block] % num_shards != shard) {
+            continue;
+          }
+          vector<size_t>& bucket = buckets[hashes[block]];
+          auto it = std::find_if(
+              bucket.begin(), bucket.end(), [&](size_t other) {
+                return memcmp(block_data(other),
+                              block_data(block),
+                              block_size) == 0;
+              });
+          if (it == bucket.end()) {
+            bucket.push_back(block);
+            first_equal[block] = block;
+          } else {
+            first_equal[block] = *it;
+          }
+        }
+      });
+    }
+    group.Wait();
+  }
+
+  // Number the unique blocks in order, the zero block gets id 0.
+  vector<BlockMapping::BlockId> block_ids(total_blocks);
+  BlockMapping::BlockId next_block_id = 0;
+  for (size_t block = 0; block < total_blocks; block++) {
+    block_ids[block] = first_equal[block] == block
+                           ? next_block_id++
+                           : block_ids[first_equal[block]];
+  }
+  old_block_ids->assign(block_ids.begin() + 1,
+                        block_ids.begin() + 1 + old_blocks);
+  new_block_ids->assign(block_ids.begin() + 1 + old_blocks, block_ids.end());
   return true;
 }
 
@@ -112,4 +112,42 @@ TEST_F(BlockMappingTest, MapPartitionBlocks) {
   EXPECT_EQ((vector<BlockMapping::BlockId>{0, 11, 12, 13, 1, 2}), new_ids);
 }
 
+TEST_F(BlockMappingTest, MapPartitionBlocksDuplicatedBlocks) {
+  // Every other block of both partitions has the same data, the remaining
+  // ones are zeros.
+  string contents(8 * block_size_, '\0');
+  for (size_t i = 0; i < contents.size(); ++i) {
+    if ((i / block_size_) % 2) {
+      contents[i] = 'a' + (i % block_size_) % 7;
+    }
+  }
+  test_utils::WriteFileString(old_part_.path(), contents);
+  test_utils::WriteFileString(new_part_.path(), contents);
+
+  vector<BlockMapping::BlockId> old_ids, new_ids;
+  EXPECT_TRUE(MapPartitionBlocks(old_part_.path(),
+                                 new_part_.path(),
+                                 contents.size(),
+                                 contents.size(),
+                                 block_size_,
+                                 &old_ids,
+                                 &new_ids));
+  EXPECT_EQ((vector<BlockMapping::BlockId>{0, 1, 0, 1, 0, 1, 0, 1}), old_ids);
+  EXPECT_EQ(old_ids, new_ids);
+}
+
+TEST_F(BlockMappingTest, MapPartitionBlocksShortFile) {
+  test_utils::WriteFileString(old_part_.path(), string(block_size_, 'a'));
+  test_utils::WriteFileString(new_part_.path(), string(block_size_, 'b'));
+
+  vector<BlockMapping::BlockId> old_ids, new_ids;
+  EXPECT_FALSE(MapPartitionBlocks(old_part_.path(),
+                                  new_part_.path(),
+                                  2 * block_size_,
+                                  block_size_,
+                                  block_size_,
+                                  &old_ids,
+                                  &new_ids));
+}
+
 }  // namespace chromeos_update_engine
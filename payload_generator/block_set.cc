@@ -0,0 +1,352 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/block_set.h"
+
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr uint32_t kWordBits = 64;
+
+// Returns the bits of the |word|-th word of a bitmap in [|begin|, |end|).
+uint64_t RangeMask(uint32_t word, uint32_t begin, uint32_t end) {
+  const uint32_t base = word * kWordBits;
+  const uint32_t first = std::max(begin, base) - base;
+  const uint32_t last = std::min(end, base + kWordBits) - base;
+  uint64_t mask = ~uint64_t{0} << first;
+  if (last < kWordBits)
+    mask &= (uint64_t{1} << last) - 1;
+  return mask;
+}
+}  // namespace
+
+uint32_t BlockSet::Container::AddRange(uint32_t begin, uint32_t end) {
+  if (begin >= end)
+    return 0;
+  if (!is_bitmap() && blocks_ + (end - begin) > kMaxArrayBlocks)
+    ConvertToBitmap();
+  uint32_t added = 0;
+  if (is_bitmap()) {
+    for (uint32_t word = begin / kWordBits; word * kWordBits < end; word++) {
+      const uint64_t mask = RangeMask(word, begin, end);
+      added += __builtin_popcountll(mask & ~bitmap_[word]);
+      bitmap_[word] |= mask;
+    }
+  } else {
+    const auto first = std::lower_bound(array_.begin(), array_.end(), begin);
+    const auto last = std::lower_bound(first, array_.end(), end);
+    added = (end - begin) - (last - first);
+    const auto it = array_.insert(array_.erase(first, last), end - begin, 0);
+    std::iota(it, it + (end - begin), begin);
+  }
+  blocks_ += added;
+  Shrink();
+  return added;
+}
+
+uint32_t BlockSet::Container::RemoveRange(uint32_t begin, uint32_t end) {
+  if (begin >= end)
+    return 0;
+  uint32_t removed = 0;
+  if (is_bitmap()) {
+    for (uint32_t word = begin / kWordBits; word * kWordBits < end; word++) {
+      const uint64_t mask = RangeMask(word, begin, end);
+      removed += __builtin_popcountll(mask & bitmap_[word]);
+      bitmap_[word] &= ~mask;
+    }
+  } else {
+    const auto first = std::lower_bound(array_.begin(), array_.end(), begin);
+    const auto last = std::lower_bound(first, array_.end(), end);
+    removed = last - first;
+    array_.erase(first, last);
+  }
+  blocks_ -= removed;
+  Shrink();
+  return removed;
+}
+
+uint32_t BlockSet::Container::Add(const Container& other) {
+  uint32_t added = 0;
+  if (!is_bitmap() && !other.is_bitmap() &&
+      blocks_ + other.blocks_ <= kMaxArrayBlocks) {
+    vector<uint16_t> merged;
+    merged.reserve(blocks_ + other.blocks_);
+    std::set_union(array_.begin(),
+                   array_.end(),
+                   other.array_.begin(),
+                   other.array_.end(),
+                   std::back_inserter(merged));
+    added = merged.size() - blocks_;
+    array_.swap(merged);
+  } else {
+    ConvertToBitmap();
+    if (other.is_bitmap()) {
+      for (size_t word = 0; word < bitmap_.size(); word++) {
+        added += __builtin_popcountll(other.bitmap_[word] & ~bitmap_[word]);
+        bitmap_[word] |= other.bitmap_[word];
+      }
+    } else {
+      for (uint16_t block : other.array_) {
+        const uint64_t bit = uint64_t{1} << (block % kWordBits);
+        added += (bitmap_[block / kWordBits] & bit) ? 0 : 1;
+        bitmap_[block / kWordBits] |= bit;
+      }
+    }
+  }
+  blocks_ += added;
+  Shrink();
+  return added;
+}
+
+uint32_t BlockSet::Container::Remove(const Container& other) {
+  uint32_t removed = 0;
+  if (!is_bitmap()) {
+    const auto it = std::remove_if(
+        array_.begin(), array_.end(), [&other](uint16_t block) {
+          return other.Contains(block);
+        });
+    removed = array_.end() - it;
+    array_.erase(it, array_.end());
+  } else if (other.is_bitmap()) {
+    for (size_t word = 0; word < bitmap_.size(); word++) {
+      removed += __builtin_popcountll(bitmap_[word] & other.bitmap_[word]);
+      bitmap_[word] &= ~other.bitmap_[word];
+    }
+  } else {
+    for (uint16_t block : other.array_) {
+      const uint64_t bit = uint64_t{1} << (block % kWordBits);
+      removed += (bitmap_[block / kWordBits] & bit) ? 1 : 0;
+      bitmap_[block / kWordBits] &= ~bit;
+    }
+  }
+  blocks_ -= removed;
+  Shrink();
+  return removed;
+}
+
+bool BlockSet::Container::Contains(uint32_t block) const {
+  if (is_bitmap())
+    return (bitmap_[block / kWordBits] >> (block % kWordBits)) & 1;
+  return std::binary_search(array_.begin(), array_.end(), block);
+}
+
+uint32_t BlockSet::Container::FindNext(uint32_t block,
+                                       uint32_t end,
+                                       bool contained) const {
+  if (is_bitmap()) {
+    while (block < end) {
+      const uint32_t word = block / kWordBits;
+      uint64_t bits = contained ? bitmap_[word] : ~bitmap_[word];
+      bits &= ~uint64_t{0} << (block % kWordBits);
+      if (bits)
+        return std::min(end, word * kWordBits + __builtin_ctzll(bits));
+      block = (word + 1) * kWordBits;
+    }
+    return end;
+  }
+  auto it = std::lower_bound(array_.begin(), array_.end(), block);
+  if (contained)
+    return it != array_.end() && *it < end ? *it : end;
+  // The blocks following |block| in the list are all in the set.
+  for (; it != array_.end() && *it == block && block < end; ++it)
+    block++;
+  return std::min(block, end);
+}
+
+void BlockSet::Container::ConvertToBitmap() {
+  if (is_bitmap())
+    return;
+  bitmap_.assign(kContainerBlocks / kWordBits, 0);
+  for (uint16_t block : array_)
+    bitmap_[block / kWordBits] |= uint64_t{1} << (block % kWordBits);
+  array_.clear();
+  array_.shrink_to_fit();
+}
+
+void BlockSet::Container::Shrink() {
+  if (!is_bitmap() || blocks_ > kMaxArrayBlocks)
+    return;
+  array_.reserve(blocks_);
+  for (uint32_t word = 0; word < bitmap_.size(); word++) {
+    for (uint64_t bits = bitmap_[word]; bits; bits &= bits - 1)
+      array_.push_back(word * kWordBits + __builtin_ctzll(bits));
+  }
+  bitmap_.clear();
+  bitmap_.shrink_to_fit();
+}
+
+void BlockSet::AddBlock(uint64_t block) {
+  AddRange(block, block + 1);
+}
+
+void BlockSet::SubtractBlock(uint64_t block) {
+  SubtractRange(block, block + 1);
+}
+
+void BlockSet::AddExtent(const Extent& extent) {
+  if (extent.start_block() == kSparseHole)
+    return;
+  AddRange(extent.start_block(), extent.start_block() + extent.num_blocks());
+}
+
+void BlockSet::SubtractExtent(const Extent& extent) {
+  if (extent.start_block() == kSparseHole)
+    return;
+  SubtractRange(extent.start_block(),
+                extent.start_block() + extent.num_blocks());
+}
+
+void BlockSet::AddExtents(const vector<Extent>& extents) {
+  for (const Extent& extent : extents)
+    AddExtent(extent);
+}
+
+void BlockSet::SubtractExtents(const vector<Extent>& extents) {
+  for (const Extent& extent : extents)
+    SubtractExtent(extent);
+}
+
+void BlockSet::AddSet(const BlockSet& set) {
+  if (&set == this)
+    return;
+  for (const auto& [key, container] : set.containers_)
+    blocks_ += containers_[key].Add(container);
+}
+
+void BlockSet::SubtractSet(const BlockSet& set) {
+  if (&set == this) {
+    containers_.clear();
+    blocks_ = 0;
+    return;
+  }
+  for (const auto& [key, container] : set.containers_) {
+    const auto it = containers_.find(key);
+    if (it == containers_.end())
+      continue;
+    blocks_ -= it->second.Remove(container);
+    if (it->second.blocks() == 0)
+      containers_.erase(it);
+  }
+}
+
+bool BlockSet::ContainsBlock(uint64_t block) const {
+  const auto it = containers_.find(block >> kContainerBits);
+  return it != containers_.end() &&
+         it->second.Contains(block - (it->first << kContainerBits));
+}
+
+uint64_t BlockSet::FindNextBlock(uint64_t block,
+                                 uint64_t end,
+                                 bool contained) const {
+  while (block < end) {
+    const auto it = containers_.lower_bound(block >> kContainerBits);
+    if (it == containers_.end() || it->first != block >> kContainerBits) {
+      // No block in the set until the next container, if any.
+      if (!contained)
+        return block;
+      if (it == containers_.end())
+        return end;
+      block = it->first << kContainerBits;
+      continue;
+    }
+    const uint64_t base = it->first << kContainerBits;
+    const uint64_t container_end = std::min(end, base + kContainerBlocks);
+    const uint64_t found =
+        base + it->second.FindNext(
+                   block - base, container_end - base, contained);
+    if (found < container_end)
+      return found;
+    block = container_end;
+  }
+  return end;
+}
+
+vector<Extent> BlockSet::ToExtents() const {
+  vector<Extent> extents;
+  for (const auto& [key, container] : containers_) {
+    const uint64_t base = key << kContainerBits;
+    uint32_t begin = container.FindNext(0, kContainerBlocks, true);
+    while (begin < kContainerBlocks) {
+      const uint32_t end = container.FindNext(begin, kContainerBlocks, false);
+      // Runs may continue in the next container.
+      if (!extents.empty() && extents.back().start_block() +
+                                      extents.back().num_blocks() ==
+                                  base + begin) {
+        extents.back().set_num_blocks(extents.back().num_blocks() + end -
+                                      begin);
+      } else {
+        extents.push_back(ExtentForRange(base + begin, end - begin));
+      }
+      begin = container.FindNext(end, kContainerBlocks, true);
+    }
+  }
+  return extents;
+}
+
+void BlockSet::AddRange(uint64_t begin, uint64_t end) {
+  while (begin < end) {
+    const uint64_t key = begin >> kContainerBits;
+    const uint64_t base = key << kContainerBits;
+    const uint64_t range_end = std::min(end, base + kContainerBlocks);
+    blocks_ += containers_[key].AddRange(begin - base, range_end - base);
+    begin = range_end;
+  }
+}
+
+void BlockSet::SubtractRange(uint64_t begin, uint64_t end) {
+  auto it = containers_.lower_bound(begin >> kContainerBits);
+  while (it != containers_.end() && (it->first << kContainerBits) < end) {
+    const uint64_t base = it->first << kContainerBits;
+    blocks_ -= it->second.RemoveRange(
+        std::max(begin, base) - base,
+        std::min(end, base + kContainerBlocks) - base);
+    if (it->second.blocks() == 0)
+      it = containers_.erase(it);
+    else
+      ++it;
+  }
+}
+
+vector<Extent> FilterBlockSet(const vector<Extent>& extents,
+                              const BlockSet& set) {
+  vector<Extent> result;
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole) {
+      if (extent.num_blocks() > 0)
+        result.push_back(extent);
+      continue;
+    }
+    const uint64_t end = extent.start_block() + extent.num_blocks();
+    uint64_t begin = set.FindNextBlock(extent.start_block(), end, false);
+    while (begin < end) {
+      const uint64_t next = set.FindNextBlock(begin, end, true);
+      result.push_back(ExtentForRange(begin, next - begin));
+      begin = set.FindNextBlock(next, end, false);
+    }
+  }
+  return result;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,114 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_SET_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_SET_H_
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A BlockSet is a set of blocks stored as a compressed bitmap, for the sets
+// covering a large part of a partition in no particular layout, like the
+// blocks already visited while generating its operations. Unlike ExtentRanges,
+// its size and the cost of its operations don't grow with the fragmentation of
+// the set.
+// The blocks are split in containers of kContainerBlocks blocks, each holding
+// either the sorted list of its blocks when it has few of them, or a bitmap of
+// all of them. Like ExtentRanges, sparse hole extents are ignored.
+class BlockSet {
+ public:
+  BlockSet() = default;
+
+  void AddBlock(uint64_t block);
+  void SubtractBlock(uint64_t block);
+  void AddExtent(const Extent& extent);
+  void SubtractExtent(const Extent& extent);
+  void AddExtents(const std::vector<Extent>& extents);
+  void SubtractExtents(const std::vector<Extent>& extents);
+  void AddSet(const BlockSet& set);
+  void SubtractSet(const BlockSet& set);
+
+  bool ContainsBlock(uint64_t block) const;
+
+  // Returns the first block in [|block|, |end|) which is in the set if
+  // |contained| is true or isn't otherwise, or |end| if there is none.
+  uint64_t FindNextBlock(uint64_t block, uint64_t end, bool contained) const;
+
+  // Returns the blocks of the set as a sorted list of extents.
+  std::vector<Extent> ToExtents() const;
+
+  uint64_t blocks() const { return blocks_; }
+
+ private:
+  static constexpr uint32_t kContainerBits = 16;
+  static constexpr uint32_t kContainerBlocks = 1 << kContainerBits;
+  // Containers with more blocks than this use a bitmap, which takes as much
+  // memory as a list of this many blocks.
+  static constexpr uint32_t kMaxArrayBlocks = kContainerBlocks / 16;
+
+  // The blocks of the set in [key * kContainerBlocks, (key + 1) *
+  // kContainerBlocks), indexed relatively to the first one. A container is
+  // never empty.
+  class Container {
+   public:
+    // Add or remove the blocks in [|begin|, |end|) and return how many were
+    // added or removed.
+    uint32_t AddRange(uint32_t begin, uint32_t end);
+    uint32_t RemoveRange(uint32_t begin, uint32_t end);
+    // Add or remove the blocks of |other| and return how many were added or
+    // removed.
+    uint32_t Add(const Container& other);
+    uint32_t Remove(const Container& other);
+
+    bool Contains(uint32_t block) const;
+    // Same as BlockSet::FindNextBlock() within this container.
+    uint32_t FindNext(uint32_t block, uint32_t end, bool contained) const;
+
+    uint32_t blocks() const { return blocks_; }
+
+   private:
+    bool is_bitmap() const { return !bitmap_.empty(); }
+    void ConvertToBitmap();
+    // Switches back to a list once there are few enough blocks.
+    void Shrink();
+
+    std::vector<uint16_t> array_;
+    std::vector<uint64_t> bitmap_;
+    uint32_t blocks_{0};
+  };
+
+  // Adds or removes the blocks in [|begin|, |end|).
+  void AddRange(uint64_t begin, uint64_t end);
+  void SubtractRange(uint64_t begin, uint64_t end);
+
+  std::map<uint64_t, Container> containers_;
+  uint64_t blocks_{0};
+};
+
+// Filters out from |extents| all the blocks in |set|, preserving the order of
+// the remaining blocks. This is the same as FilterExtentRanges() for a
+// BlockSet.
+std::vector<Extent> FilterBlockSet(const std::vector<Extent>& extents,
+                                   const BlockSet& set);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_SET_H_
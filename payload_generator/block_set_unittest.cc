@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/block_set.h"
+
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+TEST(BlockSetTest, AddAndSubtractTest) {
+  BlockSet set;
+  set.AddExtent(ExtentForRange(10, 20));
+  set.AddBlock(30);
+  set.AddExtent(ExtentForRange(kSparseHole, 5));
+  EXPECT_EQ(21U, set.blocks());
+  EXPECT_EQ(vector<Extent>{ExtentForRange(10, 21)}, set.ToExtents());
+
+  set.SubtractExtent(ExtentForRange(15, 3));
+  set.SubtractBlock(30);
+  set.SubtractBlock(100);
+  EXPECT_EQ(17U, set.blocks());
+  EXPECT_EQ(vector<Extent>({ExtentForRange(10, 5), ExtentForRange(18, 12)}),
+            set.ToExtents());
+  EXPECT_TRUE(set.ContainsBlock(10));
+  EXPECT_FALSE(set.ContainsBlock(15));
+  EXPECT_FALSE(set.ContainsBlock(30));
+}
+
+TEST(BlockSetTest, LargeExtentsTest) {
+  // Extents spanning many containers switch them to bitmaps and back.
+  BlockSet set;
+  set.AddExtent(ExtentForRange(1000, 1000000));
+  EXPECT_EQ(1000000U, set.blocks());
+  set.SubtractExtent(ExtentForRange(2000, 998000));
+  EXPECT_EQ(vector<Extent>({ExtentForRange(1000, 1000),
+                            ExtentForRange(1000000, 1000)}),
+            set.ToExtents());
+  EXPECT_EQ(1000U, set.FindNextBlock(0, 5000, true));
+  EXPECT_EQ(2000U, set.FindNextBlock(1000, 5000, false));
+  EXPECT_EQ(1000000U, set.FindNextBlock(2000, 2000000, true));
+  EXPECT_EQ(5000U, set.FindNextBlock(2000, 5000, true));
+}
+
+TEST(BlockSetTest, SetAlgebraTest) {
+  BlockSet evens;
+  BlockSet others;
+  for (uint64_t block = 0; block < 200000; block += 2)
+    evens.AddBlock(block);
+  others.AddExtent(ExtentForRange(100, 50));
+  others.AddExtent(ExtentForRange(150000, 100000));
+
+  BlockSet set = evens;
+  set.AddSet(others);
+  EXPECT_EQ(100000U + 25 + 75000, set.blocks());
+  EXPECT_TRUE(set.ContainsBlock(101));
+  EXPECT_TRUE(set.ContainsBlock(249999));
+
+  set.SubtractSet(evens);
+  EXPECT_EQ(25U + 75000, set.blocks());
+  EXPECT_FALSE(set.ContainsBlock(100));
+  EXPECT_TRUE(set.ContainsBlock(101));
+  EXPECT_EQ(vector<Extent>({ExtentForRange(101, 1), ExtentForRange(103, 1)}),
+            FilterBlockSet({ExtentForRange(100, 4)}, evens));
+
+  set.SubtractSet(set);
+  EXPECT_EQ(0U, set.blocks());
+  EXPECT_TRUE(set.ToExtents().empty());
+}
+
+TEST(BlockSetTest, FilterBlockSetTest) {
+  BlockSet set;
+  set.AddExtent(ExtentForRange(10, 10));
+  set.AddExtent(ExtentForRange(70000, 10));
+  // The order of the extents is preserved and sparse holes are kept.
+  EXPECT_EQ(vector<Extent>({ExtentForRange(69990, 10),
+                            ExtentForRange(70010, 5),
+                            ExtentForRange(kSparseHole, 2),
+                            ExtentForRange(0, 10),
+                            ExtentForRange(20, 5)}),
+            FilterBlockSet({ExtentForRange(69990, 25),
+                            ExtentForRange(kSparseHole, 2),
+                            ExtentForRange(0, 25),
+                            ExtentForRange(12, 5)},
+                           set));
+}
+
+TEST(BlockSetTest, MatchesExtentRangesTest) {
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<uint64_t> start(0, 300000);
+  std::uniform_int_distribution<uint64_t> length(0, 10000);
+  BlockSet set;
+  ExtentRanges ranges;
+  for (int i = 0; i < 500; i++) {
+    const Extent extent = ExtentForRange(start(gen), length(gen) >> (i % 8));
+    if (i % 3 == 2) {
+      set.SubtractExtent(extent);
+      ranges.SubtractExtent(extent);
+    } else {
+      set.AddExtent(extent);
+      ranges.AddExtent(extent);
+    }
+    ASSERT_EQ(ranges.blocks(), set.blocks());
+  }
+  EXPECT_EQ(ranges.GetExtentsForBlockCount(ranges.blocks()), set.ToExtents());
+  const vector<Extent> extents = {ExtentForRange(0, 310000)};
+  EXPECT_EQ(FilterExtentRanges(extents, ranges),
+            FilterBlockSet(extents, set));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_generator/boot_img_filesystem.h"
 
+#include <algorithm>
 #include <array>
 
 #include <android-base/unique_fd.h>
@@ -139,22 +140,42 @@ FilesystemInterface::File BootImgFilesystem::GetFile(const string& name,
   file.name = name;
   file.extents = {ExtentForBytes(kBlockSize, offset, size)};
 
+  // Only gzip data is read in full, to locate its deflates. The kernel and
+  // ramdisk are often tens of MiB, so check their header first.
+  constexpr size_t kGZipHeaderSize = 10;
   brillo::Blob data;
-  if (utils::ReadFileChunk(filename_, offset, size, &data) &&
-      data.size() == size) {
-    constexpr size_t kGZipHeaderSize = 10;
-    // Check GZip header magic.
-    if (data.size() > kGZipHeaderSize && data[0] == 0x1F && data[1] == 0x8B) {
-      if (!puffin::LocateDeflatesInGzip(data, &file.deflates)) {
-        LOG(ERROR) << "Error occurred parsing gzip " << name << " at offset "
-                   << offset << " of " << filename_ << ", found "
-                   << file.deflates.size() << " deflates.";
-        return file;
-      }
-      for (auto& deflate : file.deflates) {
-        deflate.offset += offset * 8;
-      }
-    }
+  const uint64_t header_size = std::min<uint64_t>(size, kGZipHeaderSize);
+  if (!utils::ReadFileChunk(filename_, offset, header_size, &data) ||
+      data.size() != header_size) {
+    return file;
+  }
+  // The lz4 legacy frame used by kernels and ramdisks is made of independent
+  // blocks of up to 8 MiB of uncompressed data, which Lz4diff can't compress
+  // again byte for byte, so it is diffed as is.
+  constexpr std::array<uint8_t, 4> kLz4LegacyMagic = {0x02, 0x21, 0x4C, 0x18};
+  if (data.size() >= kLz4LegacyMagic.size() &&
+      std::equal(
+          kLz4LegacyMagic.begin(), kLz4LegacyMagic.end(), data.begin())) {
+    file.is_compressed = true;
+    return file;
+  }
+  // Check GZip header magic.
+  if (size <= kGZipHeaderSize || data[0] != 0x1F || data[1] != 0x8B) {
+    return file;
+  }
+  data.clear();
+  if (!utils::ReadFileChunk(filename_, offset, size, &data) ||
+      data.size() != size) {
+    return file;
+  }
+  if (!puffin::LocateDeflatesInGzip(data, &file.deflates)) {
+    LOG(ERROR) << "Error occurred parsing gzip " << name << " at offset "
+               << offset << " of " << filename_ << ", found "
+               << file.deflates.size() << " deflates.";
+    return file;
+  }
+  for (auto& deflate : file.deflates) {
+    deflate.offset += offset * 8;
   }
   return file;
 }
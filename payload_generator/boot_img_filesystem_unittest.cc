@@ -154,4 +154,26 @@ TEST_F(BootImgFilesystemTest, GZipRamdiskTest) {
   EXPECT_EQ(1u, files[1].deflates.size());
 }
 
+TEST_F(BootImgFilesystemTest, Lz4LegacyRamdiskTest) {
+  // The lz4 legacy magic, followed by the size of the first block.
+  brillo::Blob ramdisk = {0x02, 0x21, 0x4c, 0x18, 0x10, 0x00, 0x00, 0x00};
+  ramdisk.resize(24, 'r');
+  test_utils::WriteFileVector(boot_file_.path(),
+                              GetBootImg(brillo::Blob(1234, 'k'), ramdisk));
+  unique_ptr<BootImgFilesystem> fs =
+      BootImgFilesystem::CreateFromFile(boot_file_.path());
+  EXPECT_NE(nullptr, fs);
+
+  vector<FilesystemInterface::File> files;
+  EXPECT_TRUE(fs->GetFiles(&files));
+  ASSERT_EQ(2u, files.size());
+
+  EXPECT_EQ("<kernel>", files[0].name);
+  EXPECT_FALSE(files[0].is_compressed);
+
+  EXPECT_EQ("<ramdisk>", files[1].name);
+  EXPECT_TRUE(files[1].is_compressed);
+  EXPECT_TRUE(files[1].deflates.empty());
+}
+
 }  // namespace chromeos_update_engine
@@ -16,8 +16,15 @@
 
 #include "update_engine/payload_generator/cow_size_estimator.h"
 
+#include <fcntl.h>
+
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <random>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -26,6 +33,7 @@
 #include <libsnapshot/cow_format.h>
 
 #include "update_engine/payload_consumer/block_extent_writer.h"
+#include "update_engine/payload_consumer/cow_write_batcher.h"
 #include "update_engine/payload_consumer/snapshot_extent_writer.h"
 #include "update_engine/payload_consumer/xor_extent_writer.h"
 #include "update_engine/common/utils.h"
@@ -37,44 +45,66 @@
 namespace chromeos_update_engine {
 using android::snapshot::CreateCowEstimator;
 using android::snapshot::ICowWriter;
+
+namespace {
+using OperationIterator =
+    google::protobuf::RepeatedPtrField<InstallOperation>::const_iterator;
+
+// Standard errors between the extrapolated size and the bound of its
+// confidence interval, 99.7% of the time.
+constexpr double kConfidenceFactor = 3;
+
+struct Shard {
+  int begin;
+  int end;
+  uint64_t blocks;
+};
+}  // namespace
+
 // Compute XOR map, a map from dst extent to corresponding merge operation
-static ExtentMap<const CowMergeOperation*, ExtentLess> ComputeXorMap(
+static ExtentMap<const CowMergeOperation*> ComputeXorMap(
     const google::protobuf::RepeatedPtrField<CowMergeOperation>& merge_ops) {
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map;
+  std::vector<std::pair<Extent, const CowMergeOperation*>> entries;
   for (const auto& merge_op : merge_ops) {
     if (merge_op.type() == CowMergeOperation::COW_XOR) {
-      xor_map.AddExtent(merge_op.dst_extent(), &merge_op);
+      entries.emplace_back(merge_op.dst_extent(), &merge_op);
     }
   }
-  return xor_map;
+  return ExtentMap<const CowMergeOperation*>(std::move(entries));
 }
 
-bool CowDryRun(
-    FileDescriptorPtr source_fd,
-    FileDescriptorPtr target_fd,
-    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
-    const google::protobuf::RepeatedPtrField<CowMergeOperation>&
-        merge_operations,
-    const size_t block_size,
-    android::snapshot::ICowWriter* cow_writer,
-    const size_t new_partition_size,
-    const size_t old_partition_size,
-    const bool xor_enabled) {
-  CHECK_NE(target_fd, nullptr);
-  CHECK(target_fd->IsOpen());
-  VABCPartitionWriter::WriteMergeSequence(merge_operations, cow_writer);
-  ExtentRanges visited;
-  SnapshotExtentWriter extent_writer(cow_writer);
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map =
-      ComputeXorMap(merge_operations);
+ExtentRanges ComputeCopyBlocks(
+    const google::protobuf::RepeatedPtrField<CowMergeOperation>& merge_ops) {
   ExtentRanges copy_blocks;
-  for (const auto& cow_op : merge_operations) {
+  for (const auto& cow_op : merge_ops) {
     if (cow_op.type() != CowMergeOperation::COW_COPY) {
       continue;
     }
     copy_blocks.AddExtent(cow_op.dst_extent());
   }
-  for (const auto& op : operations) {
+  return copy_blocks;
+}
+
+// Converts the operations in [begin, end) to CowOps and applies them to
+// |cow_writer|, adding the blocks they write to |visited|.
+static bool DryRunOperations(
+    const FileDescriptorPtr& source_fd,
+    const FileDescriptorPtr& target_fd,
+    OperationIterator begin,
+    OperationIterator end,
+    const size_t block_size,
+    const ExtentMap<const CowMergeOperation*>& xor_map,
+    const ExtentRanges& copy_blocks,
+    ICowWriter* cow_writer,
+    const size_t old_partition_size,
+    const bool xor_enabled,
+    ExtentRanges* visited) {
+  // Coalesce the raw blocks of each operation like the client does.
+  CowWriteBatcher batcher(
+      cow_writer, block_size, CowWriteBatcher::kDefaultBatchSize);
+  SnapshotExtentWriter extent_writer(&batcher);
+  for (auto op_it = begin; op_it != end; ++op_it) {
+    const auto& op = *op_it;
     switch (op.type()) {
       case InstallOperation::SOURCE_BSDIFF:
       case InstallOperation::BROTLI_BSDIFF:
@@ -88,7 +118,7 @@ bool CowDryRun(
                   op, source_fd, cow_writer, xor_map, old_partition_size);
           TEST_AND_RETURN_FALSE(writer->Init(op.dst_extents(), block_size));
           for (const auto& ext : op.dst_extents()) {
-            visited.AddExtent(ext);
+            visited->AddExtent(ext);
             ssize_t bytes_read = 0;
             std::vector<unsigned char> new_data(ext.num_blocks() * block_size);
             if (!utils::PReadAll(target_fd,
@@ -113,10 +143,13 @@ bool CowDryRun(
       }
       case InstallOperation::REPLACE:
       case InstallOperation::REPLACE_BZ:
-      case InstallOperation::REPLACE_XZ: {
+      case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
+      // The client writes the data it copies from the other partition.
+      case InstallOperation::PARTITION_COPY: {
         TEST_AND_RETURN_FALSE(extent_writer.Init(op.dst_extents(), block_size));
         for (const auto& ext : op.dst_extents()) {
-          visited.AddExtent(ext);
+          visited->AddExtent(ext);
           std::vector<unsigned char> data(ext.num_blocks() * block_size);
           ssize_t bytes_read = 0;
           if (!utils::PReadAll(target_fd,
@@ -133,13 +166,14 @@ bool CowDryRun(
             return false;
           }
         }
+        TEST_AND_RETURN_FALSE(batcher.Flush());
         cow_writer->AddLabel(0);
         break;
       }
       case InstallOperation::ZERO:
       case InstallOperation::DISCARD: {
         for (const auto& ext : op.dst_extents()) {
-          visited.AddExtent(ext);
+          visited->AddExtent(ext);
           cow_writer->AddZeroBlocks(ext.start_block(), ext.num_blocks());
         }
         cow_writer->AddLabel(0);
@@ -147,10 +181,17 @@ bool CowDryRun(
       }
       case InstallOperation::SOURCE_COPY: {
         for (const auto& ext : op.dst_extents()) {
-          visited.AddExtent(ext);
+          visited->AddExtent(ext);
         }
+        // The COW size doesn't depend on whether copies are added by range.
         if (!VABCPartitionWriter::ProcessSourceCopyOperation(
-                op, block_size, copy_blocks, source_fd, cow_writer, true)) {
+                op,
+                block_size,
+                copy_blocks,
+                source_fd,
+                cow_writer,
+                /*sequence_op_supported=*/true,
+                /*ranged_copy_ops=*/false)) {
           LOG(ERROR) << "Failed to process source copy operation: " << op.type()
                      << "\nsource extents: " << op.src_extents()
                      << "\ndestination extents: " << op.dst_extents();
@@ -162,7 +203,14 @@ bool CowDryRun(
         LOG(ERROR) << "unknown op: " << op.type();
     }
   }
+  return true;
+}
 
+bool WriteUnvisitedBlocks(const FileDescriptorPtr& target_fd,
+                          const ExtentRanges& visited,
+                          const size_t block_size,
+                          const size_t new_partition_size,
+                          ICowWriter* cow_writer) {
   const size_t last_block = new_partition_size / block_size;
   const auto unvisited_extents =
       FilterExtentRanges({ExtentForRange(0, last_block)}, visited);
@@ -190,15 +238,67 @@ bool CowDryRun(
     CHECK_EQ(to_write, 0ULL);
     cow_writer->AddLabel(0);
   }
+  return true;
+}
+
+bool CowDryRun(
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    const google::protobuf::RepeatedPtrField<CowMergeOperation>&
+        merge_operations,
+    const size_t block_size,
+    android::snapshot::ICowWriter* cow_writer,
+    const size_t new_partition_size,
+    const size_t old_partition_size,
+    const bool xor_enabled) {
+  CHECK_NE(target_fd, nullptr);
+  CHECK(target_fd->IsOpen());
+  VABCPartitionWriter::WriteMergeSequence(merge_operations, cow_writer);
+  ExtentRanges visited;
+  TEST_AND_RETURN_FALSE(DryRunOperations(source_fd,
+                                         target_fd,
+                                         operations.begin(),
+                                         operations.end(),
+                                         block_size,
+                                         ComputeXorMap(merge_operations),
+                                         ComputeCopyBlocks(merge_operations),
+                                         cow_writer,
+                                         old_partition_size,
+                                         xor_enabled,
+                                         &visited));
+  TEST_AND_RETURN_FALSE(WriteUnvisitedBlocks(
+      target_fd, visited, block_size, new_partition_size, cow_writer));
 
   TEST_AND_RETURN_FALSE(cow_writer->Finalize());
 
   return true;
 }
 
+// Splits |operations| into shards of consecutive operations writing at least
+// |shard_blocks| blocks each, but the last one.
+static std::vector<Shard> SplitOperations(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    uint64_t shard_blocks) {
+  std::vector<Shard> shards;
+  Shard shard{0, 0, 0};
+  for (const auto& op : operations) {
+    shard.end++;
+    shard.blocks += utils::BlocksInExtents(op.dst_extents());
+    if (shard.blocks >= shard_blocks) {
+      shards.push_back(shard);
+      shard = {shard.end, shard.end, 0};
+    }
+  }
+  if (shard.begin != shard.end) {
+    shards.push_back(shard);
+  }
+  return shards;
+}
+
 android::snapshot::CowSizeInfo EstimateCowSizeInfo(
-    FileDescriptorPtr source_fd,
-    FileDescriptorPtr target_fd,
+    const std::string& source_path,
+    const std::string& target_path,
     const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
     const google::protobuf::RepeatedPtrField<CowMergeOperation>&
         merge_operations,
@@ -208,24 +308,254 @@ android::snapshot::CowSizeInfo EstimateCowSizeInfo(
     const size_t old_partition_size,
     const bool xor_enabled,
     uint32_t cow_version,
-    uint64_t compression_factor) {
+    uint64_t compression_factor,
+    size_t num_threads,
+    double error_bound,
+    const CowEstimateShards& sharding) {
   android::snapshot::CowOptions options{
       .block_size = static_cast<uint32_t>(block_size),
       .compression = std::move(compression),
       .max_blocks = (new_partition_size / block_size),
       .compression_factor = compression_factor};
-  auto cow_writer = CreateCowEstimator(cow_version, options);
-  CHECK_NE(cow_writer, nullptr) << "Could not create cow estimator";
-  CHECK(CowDryRun(source_fd,
-                  target_fd,
-                  operations,
-                  merge_operations,
-                  block_size,
-                  cow_writer.get(),
-                  new_partition_size,
-                  old_partition_size,
-                  xor_enabled));
-  return cow_writer->GetCowSizeInfo();
+  auto create_estimator = [cow_version, &options]() {
+    auto cow_writer = CreateCowEstimator(cow_version, options);
+    CHECK_NE(cow_writer, nullptr) << "Could not create cow estimator";
+    return cow_writer;
+  };
+  // Every shard reads through file descriptors of its own, reads move the
+  // file offset.
+  auto open_images = [&source_path, &target_path](
+                         FileDescriptorPtr* source_fd,
+                         FileDescriptorPtr* target_fd) {
+    *source_fd = std::make_shared<EintrSafeFileDescriptor>();
+    (*source_fd)->Open(source_path.c_str(), O_RDONLY);
+    *target_fd = std::make_shared<EintrSafeFileDescriptor>();
+    (*target_fd)->Open(target_path.c_str(), O_RDONLY);
+  };
+
+  uint64_t total_blocks = 0;
+  for (const auto& op : operations) {
+    total_blocks += utils::BlocksInExtents(op.dst_extents());
+  }
+  if (error_bound <= 0 && total_blocks <= sharding.shard_blocks) {
+    FileDescriptorPtr source_fd, target_fd;
+    open_images(&source_fd, &target_fd);
+    auto cow_writer = create_estimator();
+    CHECK(CowDryRun(source_fd,
+                    target_fd,
+                    operations,
+                    merge_operations,
+                    block_size,
+                    cow_writer.get(),
+                    new_partition_size,
+                    old_partition_size,
+                    xor_enabled));
+    return cow_writer->GetCowSizeInfo();
+  }
+  num_threads = std::max<size_t>(num_threads, 1);
+
+  const auto xor_map = ComputeXorMap(merge_operations);
+  const auto copy_blocks = ComputeCopyBlocks(merge_operations);
+
+  // The merge sequence and the blocks no operation writes are always
+  // estimated exactly, on an estimator of their own.
+  android::snapshot::CowSizeInfo info;
+  {
+    FileDescriptorPtr source_fd, target_fd;
+    open_images(&source_fd, &target_fd);
+    CHECK(target_fd->IsOpen());
+    ExtentRanges visited;
+    for (const auto& op : operations) {
+      visited.AddRepeatedExtents(op.dst_extents());
+    }
+    auto cow_writer = create_estimator();
+    VABCPartitionWriter::WriteMergeSequence(merge_operations, cow_writer.get());
+    CHECK(WriteUnvisitedBlocks(target_fd,
+                               visited,
+                               block_size,
+                               new_partition_size,
+                               cow_writer.get()));
+    CHECK(cow_writer->Finalize());
+    info = cow_writer->GetCowSizeInfo();
+  }
+  auto empty_writer = create_estimator();
+  CHECK(empty_writer->Finalize());
+  const auto empty_info = empty_writer->GetCowSizeInfo();
+
+  // The shards don't depend on the number of threads, so neither does the
+  // estimate.
+  std::vector<Shard> shards = SplitOperations(
+      operations,
+      error_bound > 0 ? sharding.sample_shard_blocks : sharding.shard_blocks);
+  if (error_bound > 0) {
+    // A fixed seed keeps the estimate of the same images reproducible.
+    std::mt19937 generator(0);
+    std::shuffle(shards.begin(), shards.end(), generator);
+  }
+
+  // Size of each replayed shard, without the fixed size of its estimator.
+  std::vector<android::snapshot::CowSizeInfo> shard_infos(shards.size());
+  auto run_shard = [&](const Shard& shard,
+                       android::snapshot::CowSizeInfo* shard_info) {
+    FileDescriptorPtr source_fd, target_fd;
+    open_images(&source_fd, &target_fd);
+    if (!target_fd->IsOpen()) {
+      return false;
+    }
+    auto cow_writer = create_estimator();
+    ExtentRanges visited;
+    TEST_AND_RETURN_FALSE(DryRunOperations(source_fd,
+                                           target_fd,
+                                           operations.begin() + shard.begin,
+                                           operations.begin() + shard.end,
+                                           block_size,
+                                           xor_map,
+                                           copy_blocks,
+                                           cow_writer.get(),
+                                           old_partition_size,
+                                           xor_enabled,
+                                           &visited));
+    TEST_AND_RETURN_FALSE(cow_writer->Finalize());
+    *shard_info = cow_writer->GetCowSizeInfo();
+    shard_info->cow_size -= empty_info.cow_size;
+    shard_info->op_count_max -= empty_info.op_count_max;
+    return true;
+  };
+  // Replays shards [begin, end) on |num_threads| threads.
+  auto run_shards = [&](size_t begin, size_t end) {
+    std::atomic<size_t> next{begin};
+    std::atomic<bool> failed{false};
+    auto worker = [&]() {
+      for (size_t i = next++; i < end && !failed; i = next++) {
+        if (!run_shard(shards[i], &shard_infos[i])) {
+          failed = true;
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(num_threads, end - begin); i++) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    CHECK(!failed) << "Failed to estimate COW size";
+  };
+
+  if (error_bound <= 0) {
+    run_shards(0, shards.size());
+    for (const auto& shard_info : shard_infos) {
+      info.cow_size += shard_info.cow_size;
+      info.op_count_max += shard_info.op_count_max;
+    }
+    return info;
+  }
+
+  // Ratio estimators of the COW size and op count of all shards from the
+  // sampled ones, extrapolating their size per written block. Returns the
+  // extrapolated value and its standard error.
+  size_t sampled = 0;
+  uint64_t sampled_blocks = 0;
+  uint64_t sampled_size = 0;
+  uint64_t sampled_ops = 0;
+  auto extrapolate = [&](uint64_t sampled_value, auto shard_value) {
+    const double per_block =
+        static_cast<double>(sampled_value) / sampled_blocks;
+    const double estimate = per_block * total_blocks;
+    if (sampled < 2) {
+      return std::make_pair(estimate, 0.0);
+    }
+    double variance = 0;
+    for (size_t i = 0; i < sampled; i++) {
+      const double residual =
+          shard_value(shard_infos[i]) - per_block * shards[i].blocks;
+      variance += residual * residual;
+    }
+    variance /= sampled - 1;
+    const double mean_blocks = static_cast<double>(sampled_blocks) / sampled;
+    const double sampling_fraction =
+        static_cast<double>(sampled) / shards.size();
+    return std::make_pair(
+        estimate,
+        total_blocks * std::sqrt((1 - sampling_fraction) * variance / sampled) /
+            mean_blocks);
+  };
+  auto shard_size = [](const android::snapshot::CowSizeInfo& shard_info) {
+    return static_cast<double>(shard_info.cow_size);
+  };
+  auto shard_ops = [](const android::snapshot::CowSizeInfo& shard_info) {
+    return static_cast<double>(shard_info.op_count_max);
+  };
+  while (sampled < shards.size()) {
+    const size_t end = std::min(shards.size(),
+                                sampled + sharding.sampled_shards_per_round);
+    run_shards(sampled, end);
+    for (size_t i = sampled; i < end; i++) {
+      sampled_blocks += shards[i].blocks;
+      sampled_size += shard_infos[i].cow_size;
+      sampled_ops += shard_infos[i].op_count_max;
+    }
+    sampled = end;
+    if (sampled_blocks == 0 || sampled < 2) {
+      continue;
+    }
+    const auto [estimated_size, standard_error] =
+        extrapolate(sampled_size, shard_size);
+    if (kConfidenceFactor * standard_error <=
+        error_bound * (info.cow_size + estimated_size)) {
+      break;
+    }
+  }
+  LOG(INFO) << "Estimated COW size from " << sampled << " of "
+            << shards.size() << " shards of operations";
+  if (sampled == shards.size() || sampled_blocks == 0) {
+    info.cow_size += sampled_size;
+    info.op_count_max += sampled_ops;
+    return info;
+  }
+
+  // The shards not sampled can't take more than if none of their blocks
+  // compressed, one raw block per block and a label per operation.
+  android::snapshot::CowOptions raw_options = options;
+  raw_options.compression = "none";
+  auto raw_writer = CreateCowEstimator(cow_version, raw_options);
+  auto raw_empty_writer = CreateCowEstimator(cow_version, raw_options);
+  CHECK(raw_writer != nullptr && raw_empty_writer != nullptr)
+      << "Could not create cow estimator";
+  const std::vector<uint8_t> raw_block(block_size);
+  for (size_t i = sampled; i < shards.size(); i++) {
+    for (int op = shards[i].begin; op < shards[i].end; op++) {
+      for (const auto& ext : operations[op].dst_extents()) {
+        for (uint64_t block = 0; block < ext.num_blocks(); block++) {
+          CHECK(raw_writer->AddRawBlocks(
+              ext.start_block() + block, raw_block.data(), block_size));
+        }
+      }
+      CHECK(raw_writer->AddLabel(0));
+    }
+  }
+  CHECK(raw_writer->Finalize());
+  CHECK(raw_empty_writer->Finalize());
+  const auto raw_info = raw_writer->GetCowSizeInfo();
+  const auto raw_empty_info = raw_empty_writer->GetCowSizeInfo();
+  const uint64_t max_size =
+      sampled_size + raw_info.cow_size - raw_empty_info.cow_size;
+  const uint64_t max_ops =
+      sampled_ops + raw_info.op_count_max - raw_empty_info.op_count_max;
+
+  const auto [estimated_size, size_error] =
+      extrapolate(sampled_size, shard_size);
+  const auto [estimated_ops, ops_error] = extrapolate(sampled_ops, shard_ops);
+  info.cow_size += std::min(
+      max_size,
+      static_cast<uint64_t>(
+          std::ceil(estimated_size + kConfidenceFactor * size_error)));
+  info.op_count_max += std::min(
+      max_ops,
+      static_cast<uint64_t>(
+          std::ceil(estimated_ops + kConfidenceFactor * ops_error)));
+  return info;
 }
 
 }  // namespace chromeos_update_engine
@@ -20,17 +20,42 @@
 #include <update_engine/update_metadata.pb.h>
 
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
-// Given file descriptor to the target image, and list of
+
+// How EstimateCowSizeInfo() splits the operations into shards, lowered by the
+// tests to shard small images.
+struct CowEstimateShards {
+  // Operations replayed on an estimator of their own when estimating in
+  // parallel. Partitions writing no more blocks are estimated on a single one.
+  uint64_t shard_blocks = 8192;
+  // Shards sampled when estimating within an error bound.
+  uint64_t sample_shard_blocks = 2048;
+  // Number of shards sampled before checking the error bound again.
+  size_t sampled_shards_per_round = 32;
+};
+
+// Given the paths of the source and target images, and list of
 // operations, estimate the size of COW image if the operations are applied on
 // Virtual AB Compression enabled device. This is intended to be used by update
 // generators to put an estimate cow size in OTA payload. When installing an OTA
 // update, libsnapshot will take this estimate as a hint to allocate spaces.
-// If |xor_enabled| is true, then |source_fd| must be non-null.
+// If |xor_enabled| is true, then |source_path| must be a valid image.
+//
+// The operations are split into shards of consecutive operations replayed on
+// |num_threads| threads, each shard on its own estimator. Sizes are additive
+// so the shards' sizes are summed up, minus the fixed size of an estimator
+// counted for every shard. The shards are the same for any |num_threads|, so
+// the estimate is too.
+// When |error_bound| is non-zero, only a random sample of the shards is
+// replayed, until the size extrapolated from them is within |error_bound|
+// of the exact size with 99.7% confidence, e.g. 0.02 for 2%. The upper end of
+// that interval is returned, as the COW reserved from the estimate must not
+// fall short, but never more than if no block of the other shards compressed.
 android::snapshot::CowSizeInfo EstimateCowSizeInfo(
-    FileDescriptorPtr source_fd,
-    FileDescriptorPtr target_fd,
+    const std::string& source_path,
+    const std::string& target_path,
     const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
     const google::protobuf::RepeatedPtrField<CowMergeOperation>&
         merge_operations,
@@ -40,7 +65,10 @@ android::snapshot::CowSizeInfo EstimateCowSizeInfo(
     const size_t old_partition_size,
     bool xor_enabled,
     uint32_t cow_version,
-    uint64_t compression_factor);
+    uint64_t compression_factor,
+    size_t num_threads = 1,
+    double error_bound = 0,
+    const CowEstimateShards& sharding = {});
 
 // Convert InstallOps to CowOps and apply the converted cow op to |cow_writer|
 bool CowDryRun(
@@ -55,4 +83,16 @@ bool CowDryRun(
     const size_t old_partition_size,
     bool xor_enabled);
 
+// Returns the target blocks written by the COW_COPY operations of |merge_ops|.
+ExtentRanges ComputeCopyBlocks(
+    const google::protobuf::RepeatedPtrField<CowMergeOperation>& merge_ops);
+
+// Writes the blocks of the target partition in |target_fd| not in |visited| as
+// raw blocks.
+bool WriteUnvisitedBlocks(const FileDescriptorPtr& target_fd,
+                          const ExtentRanges& visited,
+                          const size_t block_size,
+                          const size_t new_partition_size,
+                          android::snapshot::ICowWriter* cow_writer);
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,142 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/cow_size_estimator.h"
+
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <string>
+
+#include <android-base/stringprintf.h>
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 1024;
+// Blocks written by every operation.
+constexpr size_t kOpBlocks = 8;
+
+// Shards small enough for the images of the tests.
+constexpr CowEstimateShards kSmallShards{.shard_blocks = 64,
+                                         .sample_shard_blocks = 16,
+                                         .sampled_shards_per_round = 4};
+// Never shards, so that the operations are replayed on a single estimator.
+constexpr CowEstimateShards kNoShards{
+    .shard_blocks = std::numeric_limits<uint64_t>::max()};
+}  // namespace
+
+class CowSizeEstimatorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Runs of text, which compresses, between runs of random data, which
+    // doesn't, in varying proportions so that the shards differ.
+    std::mt19937 random(7);
+    brillo::Blob data;
+    while (data.size() < kNumBlocks * kBlockSize) {
+      const bool text = random() % 3 != 0;
+      const size_t run_end =
+          std::min(kNumBlocks * kBlockSize,
+                   data.size() + (1 + random() % 24) * kBlockSize);
+      while (data.size() < run_end) {
+        if (text) {
+          const std::string line =
+              android::base::StringPrintf("line %zu\n", data.size());
+          data.insert(data.end(), line.begin(), line.end());
+        } else {
+          data.push_back(random() & 0xFF);
+        }
+      }
+      data.resize(run_end);
+    }
+    ASSERT_TRUE(test_utils::WriteFileVector(target_.path(), data));
+    ASSERT_TRUE(test_utils::WriteFileVector(source_.path(), data));
+
+    for (size_t block = 0; block < kNumBlocks; block += kOpBlocks) {
+      InstallOperation* op = operations_.Add();
+      // Some zero operations, which take no data.
+      op->set_type(block % (8 * kOpBlocks) == 0 ? InstallOperation::ZERO
+                                                : InstallOperation::REPLACE);
+      *op->add_dst_extents() = ExtentForRange(block, kOpBlocks);
+    }
+  }
+
+  android::snapshot::CowSizeInfo Estimate(size_t num_threads,
+                                          double error_bound,
+                                          const CowEstimateShards& sharding) {
+    return EstimateCowSizeInfo(source_.path(),
+                               target_.path(),
+                               operations_,
+                               merge_operations_,
+                               kBlockSize,
+                               "lz4",
+                               kNumBlocks * kBlockSize,
+                               kNumBlocks * kBlockSize,
+                               false /* xor_enabled */,
+                               2 /* cow_version */,
+                               kBlockSize /* compression_factor */,
+                               num_threads,
+                               error_bound,
+                               sharding);
+  }
+
+  ScopedTempFile source_{"CowSizeEstimatorTest-source.XXXXXX"};
+  ScopedTempFile target_{"CowSizeEstimatorTest-target.XXXXXX"};
+  google::protobuf::RepeatedPtrField<InstallOperation> operations_;
+  google::protobuf::RepeatedPtrField<CowMergeOperation> merge_operations_;
+};
+
+TEST_F(CowSizeEstimatorTest, ShardedMatchesSerialTest) {
+  const auto serial = Estimate(1, 0, kNoShards);
+  ASSERT_GT(serial.cow_size, 0u);
+  const auto sharded = Estimate(1, 0, kSmallShards);
+  EXPECT_EQ(serial.cow_size, sharded.cow_size);
+  EXPECT_EQ(serial.op_count_max, sharded.op_count_max);
+}
+
+TEST_F(CowSizeEstimatorTest, IndependentOfThreadCountTest) {
+  const auto exact = Estimate(1, 0, kSmallShards);
+  const auto sampled = Estimate(1, 0.5, kSmallShards);
+  for (size_t num_threads : {2u, 3u, 8u}) {
+    const auto threaded_exact = Estimate(num_threads, 0, kSmallShards);
+    EXPECT_EQ(exact.cow_size, threaded_exact.cow_size) << num_threads;
+    EXPECT_EQ(exact.op_count_max, threaded_exact.op_count_max) << num_threads;
+    const auto threaded_sampled = Estimate(num_threads, 0.5, kSmallShards);
+    EXPECT_EQ(sampled.cow_size, threaded_sampled.cow_size) << num_threads;
+    EXPECT_EQ(sampled.op_count_max, threaded_sampled.op_count_max)
+        << num_threads;
+  }
+}
+
+// The sampled estimate is an upper bound of the exact size, which the COW
+// reserved from it must hold.
+TEST_F(CowSizeEstimatorTest, SampledBoundCoversExactSizeTest) {
+  const auto exact = Estimate(1, 0, kNoShards);
+  for (double error_bound : {0.5, 0.2, 0.05}) {
+    const auto sampled = Estimate(4, error_bound, kSmallShards);
+    EXPECT_GE(sampled.cow_size, exact.cow_size) << error_bound;
+    EXPECT_GE(sampled.op_count_max, exact.op_count_max) << error_bound;
+  }
+}
+
+}  // namespace chromeos_update_engine
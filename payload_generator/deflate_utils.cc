@@ -17,17 +17,25 @@
 #include "update_engine/payload_generator/deflate_utils.h"
 
 #include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 
 #include <base/files/file_util.h>
 #include <base/logging.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/mapped_file.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 using puffin::BitExtent;
@@ -48,6 +56,22 @@ constexpr std::ostream& operator<<(std::ostream& out,
 // The minimum size for a squashfs image to be processed.
 const uint64_t kMinimumSquashfsImageSize = 1 * 1024 * 1024;  // bytes
 
+// Computes the |data_hash| of |file| from the partition |image|. Files with
+// blocks past the end of the image are left without one.
+bool HashFileData(const MappedFile& image, FilesystemInterface::File* file) {
+  HashCalculator hasher;
+  for (const Extent& extent : file->extents) {
+    if (!image.Contains(extent, kBlockSize))
+      return true;
+    TEST_AND_RETURN_FALSE(
+        hasher.Update(image.data() + extent.start_block() * kBlockSize,
+                      extent.num_blocks() * kBlockSize));
+  }
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  file->data_hash = hasher.raw_hash();
+  return true;
+}
+
 // TODO(*): Optimize this so we don't have to read all extents into memory in
 // case it is large.
 bool CopyExtentsToFile(const string& in_path,
@@ -79,6 +103,73 @@ bool IsSquashfsImage(const string& part_path,
   return false;
 }
 
+// The deflates found in the data of zip and gzip files so far, relative to the
+// start of the data. Identical archives show up in the source and the target
+// images, and in the targets of several payloads, so each is only parsed once
+// per process.
+class DeflateLocationCache {
+ public:
+  // Stores in |deflates| the deflates of |data|, the contents of |filename|.
+  bool Locate(const std::string_view filename,
+              const brillo::Blob& data,
+              vector<BitExtent>* deflates) {
+    brillo::Blob key;
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(data, &key));
+    // The format the data is parsed as depends on the extension.
+    key.push_back(IsFileExtensions(filename, {".gz", ".gzip", ".tgz"}));
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(key);
+      if (it != entries_.end()) {
+        *deflates = it->second;
+        return true;
+      }
+    }
+    TEST_AND_RETURN_FALSE(DeflatePreprocessFileData(filename, data, deflates));
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.emplace(std::move(key), *deflates);
+    return true;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::map<brillo::Blob, vector<BitExtent>> entries_;
+};
+
+DeflateLocationCache* GetDeflateLocationCache() {
+  static auto* cache = new DeflateLocationCache();
+  return cache;
+}
+
+// Finds the deflates of |file|, a zip or gzip file stored in |part_path|, and
+// stores them in |file.deflates| relative to the start of the partition.
+bool LocateFileDeflates(const string& part_path,
+                        FilesystemInterface::File* file) {
+  brillo::Blob data;
+  TEST_AND_RETURN_FALSE(utils::ReadExtents(
+      part_path,
+      file->extents,
+      &data,
+      kBlockSize * utils::BlocksInExtents(file->extents),
+      kBlockSize));
+  // |data| read from disk always has size multiple of kBlockSize. So it
+  // might contain trailing garbage data and confuse the gzip/zip
+  // processors. Trim them.
+  if (file->file_stat.st_size > 0 &&
+      static_cast<size_t>(file->file_stat.st_size) < data.size()) {
+    data.resize(file->file_stat.st_size);
+  }
+  vector<BitExtent> deflates;
+  TEST_AND_RETURN_FALSE(
+      GetDeflateLocationCache()->Locate(file->name, data, &deflates));
+  // Shift the deflate's extent to the offset starting from the beginning
+  // of the current partition; and the delta processor will align the
+  // extents in a continuous buffer later.
+  TEST_AND_RETURN_FALSE(ShiftBitExtentsOverExtents(file->extents, &deflates));
+  file->deflates = std::move(deflates);
+  return true;
+}
+
 bool IsRegularFile(const FilesystemInterface::File& file) {
   // If inode is 0, then stat information is invalid for some psuedo files
   if (file.file_stat.st_ino != 0 &&
@@ -307,11 +398,16 @@ bool DeflatePreprocessFileData(const std::string_view filename,
 
 bool PreprocessPartitionFiles(const PartitionConfig& part,
                               vector<FilesystemInterface::File>* result_files,
-                              bool extract_deflates) {
+                              bool extract_deflates,
+                              GenerationReport* report) {
+  auto filesystem_phase =
+      std::make_unique<GenerationReport::ScopedPhase>(report, "filesystem");
   // Get the file system files.
   vector<FilesystemInterface::File> tmp_files;
   part.fs_interface->GetFiles(&tmp_files);
   result_files->reserve(tmp_files.size());
+  // Indices in |result_files| of the zip and gzip files to find deflates in.
+  vector<size_t> archives;
 
   for (auto& file : tmp_files) {
     auto is_regular_file = IsRegularFile(file);
@@ -354,38 +450,57 @@ bool PreprocessPartitionFiles(const PartitionConfig& part,
           file.name, {".apk", ".zip", ".jar", ".zvoice", ".apex", "capex"});
       bool is_gzip = IsFileExtensions(file.name, {".gz", ".gzip", ".tgz"});
       if (is_zip || is_gzip) {
-        brillo::Blob data;
-        TEST_AND_RETURN_FALSE(utils::ReadExtents(
-            part.path,
-            file.extents,
-            &data,
-            kBlockSize * utils::BlocksInExtents(file.extents),
-            kBlockSize));
-        // |data| read from disk always has size multiple of kBlockSize. So it
-        // might contain trailing garbage data and confuse the gzip/zip
-        // processors. Trim them.
-        if (file.file_stat.st_size > 0 &&
-            static_cast<size_t>(file.file_stat.st_size) < data.size()) {
-          data.resize(file.file_stat.st_size);
-        }
-        vector<puffin::BitExtent> deflates;
-        if (!DeflatePreprocessFileData(file.name, data, &deflates)) {
-          LOG(ERROR) << "Failed to preprocess deflate data in partition "
-                     << part.name;
-          return false;
-        }
-        // Shift the deflate's extent to the offset starting from the beginning
-        // of the current partition; and the delta processor will align the
-        // extents in a continuous buffer later.
-        TEST_AND_RETURN_FALSE(
-            ShiftBitExtentsOverExtents(file.extents, &deflates));
-        file.deflates = std::move(deflates);
+        archives.push_back(result_files->size());
       }
     }
 
     result_files->push_back(file);
   }
-  return true;
+  filesystem_phase.reset();
+
+  // Locating the deflates inflates the whole archive, and hashing the files
+  // reads all of them, so the files are processed in parallel. When called
+  // from GenerateUpdatePayloadFile(), on the threads shared by all partitions.
+  std::unique_ptr<TaskScheduler> own_scheduler;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler == nullptr) {
+    own_scheduler =
+        std::make_unique<TaskScheduler>(diff_utils::GetMaxThreads());
+    scheduler = own_scheduler.get();
+  }
+  const auto image = MappedFile::OpenShared(part.path);
+  TEST_AND_RETURN_FALSE(image);
+  std::atomic<bool> failed{false};
+  TaskScheduler::TaskGroup group(scheduler, false);
+  // The hashes let the generator copy files that didn't change without
+  // reading them again, see DeltaReadPartition().
+  for (auto& result_file : *result_files) {
+    auto* file = &result_file;
+    const uint64_t size = utils::BlocksInExtents(file->extents) * kBlockSize;
+    if (size == 0)
+      continue;
+    group.Submit(size, [&part, &image, file, &failed, report]() {
+      GenerationReport::ScopedPhase phase(report, "file_hashing");
+      if (!failed && !HashFileData(*image, file)) {
+        LOG(ERROR) << "Failed to hash the files of partition " << part.name;
+        failed = true;
+      }
+    });
+  }
+  for (size_t index : archives) {
+    auto* file = &(*result_files)[index];
+    const uint64_t size = utils::BlocksInExtents(file->extents) * kBlockSize;
+    group.Submit(size, size, [&part, file, &failed, report]() {
+      GenerationReport::ScopedPhase phase(report, "deflate_detection");
+      if (!failed && !LocateFileDeflates(part.path, file)) {
+        LOG(ERROR) << "Failed to preprocess deflate data in partition "
+                   << part.name;
+        failed = true;
+      }
+    });
+  }
+  group.Wait();
+  return !failed;
 }
 
 }  // namespace deflate_utils
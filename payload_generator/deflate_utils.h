@@ -23,6 +23,7 @@
 #include <puffin/puffdiff.h>
 
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 
 namespace chromeos_update_engine {
@@ -32,9 +33,12 @@ namespace deflate_utils {
 // includes:
 //  - splitting large Squashfs containers into its smaller files.
 //  - extracting deflates in zip and gzip files.
+//  - hashing the data of every file, see FilesystemInterface::File.
+// The time spent is added to |report|, if not null.
 bool PreprocessPartitionFiles(const PartitionConfig& part,
                               std::vector<FilesystemInterface::File>* result,
-                              bool extract_deflates);
+                              bool extract_deflates,
+                              GenerationReport* report = nullptr);
 
 // Spreads all extents in |over_extents| over |base_extents|. Here we assume the
 // |over_extents| are non-overlapping and sorted by their offset.
@@ -19,18 +19,22 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <memory>
 #include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
 
 using puffin::BitExtent;
 using puffin::ByteExtent;
+using std::string;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -186,5 +190,75 @@ TEST(DeflateUtilsTest, CompactBoundaryTest) {
   EXPECT_EQ(out_deflates, expected_out_deflates);
 }
 
+namespace {
+// A filesystem of regular files of |file_size| bytes, one per block.
+class RegularFilesFilesystem : public FilesystemInterface {
+ public:
+  RegularFilesFilesystem(const vector<string>& names, off_t file_size) {
+    for (size_t i = 0; i < names.size(); i++) {
+      File file;
+      file.name = names[i];
+      file.file_stat.st_ino = i + 1;
+      file.file_stat.st_mode = S_IFREG | 0644;
+      file.file_stat.st_size = file_size;
+      file.extents = {ExtentForRange(i, 1)};
+      files_.push_back(file);
+    }
+  }
+
+  size_t GetBlockSize() const override { return kBlockSize; }
+  size_t GetBlockCount() const override { return files_.size(); }
+  bool GetFiles(vector<File>* files) const override {
+    *files = files_;
+    return true;
+  }
+
+ private:
+  vector<File> files_;
+};
+}  // namespace
+
+TEST(DeflateUtilsTest, PreprocessPartitionFilesLocatesDeflates) {
+  // "hello" compressed with gzip -n.
+  const brillo::Blob gzip = {0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00,
+                             0x00, 0x00, 0x03, 0xcb, 0x48, 0xcd, 0xc9,
+                             0xc9, 0x07, 0x00, 0x86, 0xa6, 0x10, 0x36,
+                             0x05, 0x00, 0x00, 0x00};
+  brillo::Blob data(kBlockSize * 3);
+  std::copy(gzip.begin(), gzip.end(), data.begin());
+  std::copy(gzip.begin(), gzip.end(), data.begin() + 2 * kBlockSize);
+  ScopedTempFile part_file("DeflateUtilsTest_part.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), data));
+
+  PartitionConfig part("part");
+  part.path = part_file.path();
+  part.size = data.size();
+  part.fs_interface = std::make_unique<RegularFilesFilesystem>(
+      vector<string>{"/a.gz", "/b.txt", "/c.gz"}, gzip.size());
+
+  vector<FilesystemInterface::File> files;
+  ASSERT_TRUE(PreprocessPartitionFiles(part, &files, true));
+  ASSERT_EQ(3u, files.size());
+  // The deflate stream starts right after the 10 bytes gzip header.
+  ASSERT_EQ(1u, files[0].deflates.size());
+  ASSERT_EQ(10u * 8, files[0].deflates[0].offset);
+  ASSERT_TRUE(files[1].deflates.empty());
+  ASSERT_EQ(1u, files[2].deflates.size());
+  ASSERT_EQ((2 * kBlockSize + 10) * 8, files[2].deflates[0].offset);
+  ASSERT_EQ(files[0].deflates[0].length, files[2].deflates[0].length);
+
+  // The data of the files is hashed, whole blocks included.
+  brillo::Blob hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfBytes(data.data(), kBlockSize, &hash));
+  EXPECT_EQ(hash, files[0].data_hash);
+  EXPECT_EQ(hash, files[2].data_hash);
+  ASSERT_TRUE(HashCalculator::RawHashOfData(brillo::Blob(kBlockSize), &hash));
+  EXPECT_EQ(hash, files[1].data_hash);
+
+  vector<FilesystemInterface::File> files_without_deflates;
+  ASSERT_TRUE(PreprocessPartitionFiles(part, &files_without_deflates, false));
+  ASSERT_TRUE(files_without_deflates[0].deflates.empty());
+}
+
 }  // namespace deflate_utils
 }  // namespace chromeos_update_engine
@@ -16,7 +16,6 @@
 
 #include "update_engine/payload_generator/delta_diff_generator.h"
 
-#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -30,15 +29,17 @@
 #include <base/threading/simple_thread.h>
 
 #include "update_engine/common/utils.h"
-#include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_generator/ab_generator.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/blob_file_writer.h"
 #include "update_engine/payload_generator/cow_size_estimator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/full_update_generator.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/merge_sequence_generator.h"
 #include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/source_block_index.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
@@ -50,19 +51,24 @@ namespace chromeos_update_engine {
 // bytes
 const size_t kRootFSPartitionSize = static_cast<size_t>(2) * 1024 * 1024 * 1024;
 
-class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
-  bool IsDynamicPartition(const std::string& partition_name) {
-    for (const auto& group :
-         config_.target.dynamic_partition_metadata->groups()) {
-      const auto& names = group.partition_names();
-      if (std::find(names.begin(), names.end(), partition_name) !=
-          names.end()) {
-        return true;
-      }
-    }
+namespace {
+// Whether |partition_name| is a dynamic partition of the target of |config|.
+bool IsDynamicPartition(const PayloadGenerationConfig& config,
+                        const std::string& partition_name) {
+  if (!config.target.dynamic_partition_metadata) {
     return false;
   }
+  for (const auto& group : config.target.dynamic_partition_metadata->groups()) {
+    const auto& names = group.partition_names();
+    if (std::find(names.begin(), names.end(), partition_name) != names.end()) {
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace
 
+class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
  public:
   explicit PartitionProcessor(
       const PayloadGenerationConfig& config,
@@ -94,11 +100,15 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       LOG(FATAL) << "GenerateOperations(" << old_part_.name << ", "
                  << new_part_.name << ") failed";
     }
+    // The operations of a shard are incomplete.
+    if (config_.diff_shard_count > 0) {
+      return;
+    }
 
     bool snapshot_enabled =
         config_.target.dynamic_partition_metadata &&
         config_.target.dynamic_partition_metadata->snapshot_enabled();
-    if (!snapshot_enabled || !IsDynamicPartition(new_part_.name)) {
+    if (!snapshot_enabled || !IsDynamicPartition(config_, new_part_.name)) {
       return;
     }
     // Skip cow size estimation if VABC isn't enabled
@@ -106,31 +116,29 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       return;
     }
     if (!old_part_.path.empty()) {
+      GenerationReport::ScopedPhase phase(config_.report, "merge_sequence");
       auto generator = MergeSequenceGenerator::Create(*aops_, new_part_.name);
-      if (!generator || !generator->Generate(cow_merge_sequence_)) {
+      if (!generator || !generator->Generate(cow_merge_sequence_,
+                                             config_.merge_source_order)) {
         LOG(FATAL) << "Failed to generate merge sequence";
       }
     }
 
     LOG(INFO) << "Estimating COW size for partition: " << new_part_.name;
-    // Need the contents of source/target image bytes when doing
-    // dry run.
-    auto target_fd = std::make_unique<EintrSafeFileDescriptor>();
-    target_fd->Open(new_part_.path.c_str(), O_RDONLY);
-
     google::protobuf::RepeatedPtrField<InstallOperation> operations;
 
     for (const AnnotatedOperation& aop : *aops_) {
       *operations.Add() = aop.op;
     }
 
-    FileDescriptorPtr source_fd = std::make_shared<EintrSafeFileDescriptor>();
-    source_fd->Open(old_part_.path.c_str(), O_RDONLY);
-
+    // The dry run reads the source/target images itself, on as many threads
+    // as the scheduler running this partition has while its thread waits.
+    auto* scheduler = TaskScheduler::Current();
+    GenerationReport::ScopedPhase phase(config_.report, "cow_estimation");
     *cow_info_ = EstimateCowSizeInfo(
-        std::move(source_fd),
-        std::move(target_fd),
-        std::move(operations),
+        old_part_.path,
+        new_part_.path,
+        operations,
         {cow_merge_sequence_->begin(), cow_merge_sequence_->end()},
         config_.block_size,
         config_.target.dynamic_partition_metadata->vabc_compression_param(),
@@ -138,7 +146,9 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
         old_part_.size,
         config_.enable_vabc_xor,
         config_.target.dynamic_partition_metadata->cow_version(),
-        config_.target.dynamic_partition_metadata->compression_factor());
+        config_.target.dynamic_partition_metadata->compression_factor(),
+        scheduler ? scheduler->num_threads() : 1,
+        config_.cow_estimate_error_bound);
 
     // add a 1% overhead to our estimation
     cow_info_->cow_size = cow_info_->cow_size * 1.01;
@@ -163,26 +173,76 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
   DISALLOW_COPY_AND_ASSIGN(PartitionProcessor);
 };
 
-bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
-                               const string& output_path,
-                               const string& private_key_path,
-                               uint64_t* metadata_size) {
-  if (!config.version.Validate()) {
-    LOG(ERROR) << "Unsupported major.minor version: " << config.version.major
-               << "." << config.version.minor;
-    return false;
+namespace {
+
+// Logs the full operations on incompressible looking data since |before|, and
+// how much would have been saved by compressing them.
+void LogIncompressibleDataStats(
+    const diff_utils::IncompressibleDataStats& before) {
+  const auto after = diff_utils::GetIncompressibleDataStats();
+  const uint64_t chunks = after.chunks - before.chunks;
+  if (chunks == 0)
+    return;
+  const uint64_t measured = after.measured_chunks - before.measured_chunks;
+  const uint64_t savings = after.measured_savings - before.measured_savings;
+  LOG(INFO) << chunks << " full operations (" << after.bytes - before.bytes
+            << " bytes) looked incompressible, skipped "
+            << after.skipped_compressions - before.skipped_compressions
+            << " compressor runs on them. Compressing " << measured
+            << " of them saved " << savings << " bytes"
+            << (measured > 0 && measured < chunks
+                    ? ", about " + std::to_string(savings * chunks / measured) +
+                          " bytes for all of them."
+                    : ".");
+}
+
+// The partitions and the files they are split into share these threads,
+// |max_threads| caps all the work together.
+size_t GetThreadCount(const PayloadGenerationConfig& config) {
+  auto thread_count = diff_utils::GetMaxThreads();
+  if (thread_count > config.max_threads && config.max_threads > 0) {
+    thread_count = config.max_threads;
   }
+  return thread_count;
+}
 
+// Generates the payload from |source| to the target of |config| on the
+// threads of |scheduler|, see GenerateUpdatePayloadFile().
+bool GeneratePayload(const PayloadGenerationConfig& config,
+                     const ImageConfig& source,
+                     TaskScheduler* scheduler,
+                     const string& output_path,
+                     const string& private_key_path,
+                     uint64_t* metadata_size) {
   // Create empty payload file object.
   PayloadFile payload;
   TEST_AND_RETURN_FALSE(payload.Init(config));
 
+  // The source partitions are indexed once for all the partitions to find the
+  // data moved within them, and between the dynamic ones.
+  std::unique_ptr<SourceBlockIndex> source_block_index;
+  if (config.is_delta) {
+    GenerationReport::ScopedPhase phase(config.report, "block_index");
+    const bool partition_copy =
+        config.OperationEnabled(InstallOperation::PARTITION_COPY);
+    source_block_index = std::make_unique<SourceBlockIndex>(config.block_size);
+    for (const PartitionConfig& part : source.partitions) {
+      if (!part.path.empty()) {
+        TEST_AND_RETURN_FALSE(source_block_index->AddPartition(
+            part.name,
+            part.path,
+            partition_copy && IsDynamicPartition(config, part.name)));
+      }
+    }
+    TEST_AND_RETURN_FALSE(source_block_index->Build(scheduler));
+  }
+
   ScopedTempFile data_file("CrAU_temp_data.XXXXXX", true);
   {
     off_t data_file_size = 0;
     BlobFileWriter blob_file(data_file.fd(), &data_file_size);
     if (config.is_delta) {
-      TEST_EQ(config.source.partitions.size(), config.target.partitions.size());
+      TEST_EQ(source.partitions.size(), config.target.partitions.size());
     }
     PartitionConfig empty_part("");
     std::vector<std::vector<AnnotatedOperation>> all_aops;
@@ -195,21 +255,9 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
         config.target.partitions.size());
 
     std::vector<PartitionProcessor> partition_tasks{};
-    auto thread_count = std::min<size_t>(diff_utils::GetMaxThreads(),
-                                         config.target.partitions.size());
-    if (thread_count > config.max_threads && config.max_threads > 0) {
-      thread_count = config.max_threads;
-    }
-    if (thread_count < 1) {
-      thread_count = 1;
-    }
-    base::DelegateSimpleThreadPool thread_pool{"partition-thread-pool",
-                                               static_cast<int>(thread_count)};
-    LOG(INFO) << "Using " << thread_count << " threads to process "
-              << config.target.partitions.size() << " partitions";
     for (size_t i = 0; i < config.target.partitions.size(); i++) {
       const PartitionConfig& old_part =
-          config.is_delta ? config.source.partitions[i] : empty_part;
+          config.is_delta ? source.partitions[i] : empty_part;
       const PartitionConfig& new_part = config.target.partitions[i];
       LOG(INFO) << "Partition name: " << new_part.name;
       LOG(INFO) << "Partition size: " << new_part.size;
@@ -221,7 +269,7 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
         // Delta update.
         LOG(INFO) << "Using generator ABGenerator() for partition "
                   << new_part.name;
-        strategy.reset(new ABGenerator());
+        strategy.reset(new ABGenerator(source_block_index.get()));
       } else {
         LOG(INFO) << "Using generator FullUpdateGenerator() for partition "
                   << new_part.name;
@@ -238,15 +286,26 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                                    &all_cow_info[i],
                                                    std::move(strategy)));
     }
-    thread_pool.Start();
-    for (auto& processor : partition_tasks) {
-      thread_pool.AddWork(&processor);
+    {
+      TaskScheduler::TaskGroup partitions(scheduler, true);
+      for (size_t i = 0; i < partition_tasks.size(); i++) {
+        auto* processor = &partition_tasks[i];
+        partitions.Submit(config.target.partitions[i].size / config.block_size,
+                          [processor]() { processor->Run(); });
+      }
+      partitions.Wait();
+    }
+    if (config.diff_shard_count > 0) {
+      LOG(INFO) << "Diffed shard " << config.diff_shard_index << " of "
+                << config.diff_shard_count << ", not writing "
+                << output_path;
+      *metadata_size = 0;
+      return true;
     }
-    thread_pool.JoinAll();
 
     for (size_t i = 0; i < config.target.partitions.size(); i++) {
       const PartitionConfig& old_part =
-          config.is_delta ? config.source.partitions[i] : empty_part;
+          config.is_delta ? source.partitions[i] : empty_part;
       const PartitionConfig& new_part = config.target.partitions[i];
       TEST_AND_RETURN_FALSE(
           payload.AddPartition(old_part,
@@ -258,7 +317,7 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
   }
   data_file.CloseFd();
 
-  LOG(INFO) << "Writing payload file...";
+  LOG(INFO) << "Writing payload file " << output_path << "...";
   // Write payload file to disk.
   TEST_AND_RETURN_FALSE(payload.WritePayload(
       output_path, data_file.path(), private_key_path, metadata_size));
@@ -268,4 +327,120 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
   return true;
 }
 
+// Computes the info and the files of |part|, shared by all the payloads
+// generated to it.
+bool PrepareSharedTargetPartition(const PayloadGenerationConfig& config,
+                                  PartitionConfig* part) {
+  PartitionInfo info;
+  TEST_AND_RETURN_FALSE(diff_utils::InitializePartitionInfo(*part, &info));
+  if (config.segment_hash_size > 0) {
+    TEST_AND_RETURN_FALSE(diff_utils::AddPartitionSegmentHashes(
+        *part, config.segment_hash_size, &info));
+  }
+  part->info = std::move(info);
+  if (part->fs_interface) {
+    std::vector<FilesystemInterface::File> files;
+    TEST_AND_RETURN_FALSE(diff_utils::GetPartitionFiles(
+        config,
+        *part,
+        config.OperationEnabled(InstallOperation::PUFFDIFF),
+        &files));
+    part->files = std::move(files);
+  }
+  return true;
+}
+
+}  // namespace
+
+bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
+                               const string& output_path,
+                               const string& private_key_path,
+                               uint64_t* metadata_size) {
+  if (!config.version.Validate()) {
+    LOG(ERROR) << "Unsupported major.minor version: " << config.version.major
+               << "." << config.version.minor;
+    return false;
+  }
+
+  const auto incompressible_stats = diff_utils::GetIncompressibleDataStats();
+  TaskScheduler scheduler(GetThreadCount(config), config.memory_budget);
+  LOG(INFO) << "Using " << scheduler.num_threads() << " threads to process "
+            << config.target.partitions.size() << " partitions";
+  if (config.memory_budget > 0) {
+    LOG(INFO) << "Diffing files with a memory budget of "
+              << config.memory_budget << " bytes";
+  }
+  const bool success = GeneratePayload(config,
+                                       config.source,
+                                       &scheduler,
+                                       output_path,
+                                       private_key_path,
+                                       metadata_size);
+  LogIncompressibleDataStats(incompressible_stats);
+  return success;
+}
+
+bool GenerateUpdatePayloadFiles(PayloadGenerationConfig* config,
+                                const vector<ImageConfig>& sources,
+                                const vector<string>& output_paths,
+                                const string& private_key_path,
+                                vector<uint64_t>* metadata_sizes) {
+  if (!config->version.Validate()) {
+    LOG(ERROR) << "Unsupported major.minor version: " << config->version.major
+               << "." << config->version.minor;
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(config->is_delta);
+  TEST_AND_RETURN_FALSE(sources.size() == output_paths.size());
+
+  const auto incompressible_stats = diff_utils::GetIncompressibleDataStats();
+  TaskScheduler scheduler(GetThreadCount(*config), config->memory_budget);
+  LOG(INFO) << "Using " << scheduler.num_threads() << " threads to generate "
+            << sources.size() << " payloads of "
+            << config->target.partitions.size() << " partitions";
+
+  // The target partitions are hashed and their filesystems parsed once, the
+  // payloads only read what was found.
+  auto& target_partitions = config->target.partitions;
+  std::vector<char> prepared(target_partitions.size());
+  {
+    TaskScheduler::TaskGroup partitions(&scheduler, false);
+    for (size_t i = 0; i < target_partitions.size(); i++) {
+      partitions.Submit(target_partitions[i].size / config->block_size,
+                        [config, &target_partitions, &prepared, i]() {
+                          prepared[i] = PrepareSharedTargetPartition(
+                              *config, &target_partitions[i]);
+                        });
+    }
+    partitions.Wait();
+  }
+  TEST_AND_RETURN_FALSE(std::all_of(
+      prepared.begin(), prepared.end(), [](char ok) { return ok; }));
+
+  metadata_sizes->assign(sources.size(), 0);
+  std::vector<char> generated(sources.size());
+  {
+    TaskScheduler::TaskGroup payloads(&scheduler, true);
+    for (size_t i = 0; i < sources.size(); i++) {
+      payloads.Submit(0, [&, i]() {
+        generated[i] = GeneratePayload(*config,
+                                       sources[i],
+                                       &scheduler,
+                                       output_paths[i],
+                                       private_key_path,
+                                       &(*metadata_sizes)[i]);
+      });
+    }
+    payloads.Wait();
+  }
+  LogIncompressibleDataStats(incompressible_stats);
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (!generated[i]) {
+      LOG(ERROR) << "Failed to generate " << output_paths[i];
+      return false;
+    }
+  }
+  return true;
+}
+
 };  // namespace chromeos_update_engine
@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_DELTA_DIFF_GENERATOR_H_
 
 #include <string>
+#include <vector>
 
 #include "update_engine/payload_generator/payload_generation_config.h"
 
@@ -42,6 +43,19 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                const std::string& private_key_path,
                                uint64_t* metadata_size);
 
+// Same as GenerateUpdatePayloadFile(), for delta payloads from each of
+// |sources| to the target image of |config| written to the respective
+// |output_paths|, |config.source| is ignored. The target partitions are hashed
+// and their files found only once, this stores the results in |config|. The
+// payloads are then generated at the same time, sharing the threads of the
+// partitions and files of all of them. Also writes the size of the metadata
+// of each payload into |metadata_sizes|.
+bool GenerateUpdatePayloadFiles(PayloadGenerationConfig* config,
+                                const std::vector<ImageConfig>& sources,
+                                const std::vector<std::string>& output_paths,
+                                const std::string& private_key_path,
+                                std::vector<uint64_t>* metadata_sizes);
+
 };  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DELTA_DIFF_GENERATOR_H_
@@ -30,12 +30,17 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <functional>
 #include <limits>
 #include <list>
 #include <map>
 #include <memory>
 #include <numeric>
+#include <set>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -58,15 +63,26 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/lz4diff/lz4diff.h"
+#include "update_engine/lz4diff/lz4diff_compress.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/ab_generator.h"
 #include "update_engine/payload_generator/block_mapping.h"
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/file_index_cache.h"
+#include "update_engine/payload_generator/file_segments.h"
+#include "update_engine/payload_generator/mapped_file.h"
+#include "update_engine/payload_generator/memory_patch_writer.h"
+#include "update_engine/payload_generator/parallel_suffix_array.h"
+#include "update_engine/payload_generator/previous_payload.h"
+#include "update_engine/payload_generator/task_scheduler.h"
+#include "update_engine/payload_generator/xor_matcher.h"
 #include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd_compress.h"
 
 using std::list;
 using std::map;
@@ -83,6 +99,111 @@ namespace {
 // Chrome binary in ASan builders.
 const uint64_t kMaxBsdiffDestinationSize = 200 * 1024 * 1024;  // bytes
 
+// One in this many full operations skipping the compressors runs them anyway,
+// without using the result, to measure what skipping them costs.
+const uint64_t kIncompressibleMeasureInterval = 64;
+
+// The counters returned by GetIncompressibleDataStats().
+struct {
+  std::atomic<uint64_t> chunks{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> skipped_compressions{0};
+  std::atomic<uint64_t> measured_chunks{0};
+  std::atomic<uint64_t> measured_savings{0};
+} g_incompressible_stats;
+
+// A REPLACE_ZSTD operation is preferred over a smaller REPLACE_XZ or
+// REPLACE_BZ one unless it's more than 1/kZstdMaxOverhead larger, since it
+// decompresses several times faster on the device.
+const size_t kZstdMaxOverhead = 32;
+
+// Data at least this large is compressed by all the compressors at once when
+// running on the shared threads.
+const size_t kConcurrentCompressionMinSize = 1024 * 1024;  // bytes
+
+// Compresses |new_data| with the compressors allowed by |version| into
+// |out_blob|, setting |out_type| to the operation of the smallest result, or
+// of the zstd one if it's close enough. Returns whether any compressor
+// succeeded.
+bool CompressFullData(const brillo::Blob& new_data,
+                      const PayloadVersion& version,
+                      brillo::Blob* out_blob,
+                      InstallOperation::Type* out_type) {
+  // The compressors allowed by |version|, in the order their results are
+  // compared.
+  struct Compressor {
+    InstallOperation::Type type;
+    std::function<bool(brillo::Blob*)> compress;
+    brillo::Blob blob;
+    bool success{false};
+  };
+  vector<Compressor> compressors;
+  if (version.OperationAllowed(InstallOperation::REPLACE_XZ)) {
+    compressors.push_back(
+        {InstallOperation::REPLACE_XZ, [&](brillo::Blob* out) {
+           return XzCompressStreams(new_data, version.xz_stream_size, out);
+         }});
+  }
+  if (version.OperationAllowed(InstallOperation::REPLACE_BZ)) {
+    // TODO(deymo): Implement some heuristic to determine if it is worth trying
+    // to compress the blob with bzip2 if we already have a good REPLACE_XZ.
+    compressors.push_back(
+        {InstallOperation::REPLACE_BZ,
+         [&](brillo::Blob* out) { return BzipCompress(new_data, out); }});
+  }
+  if (version.OperationAllowed(InstallOperation::REPLACE_ZSTD)) {
+    compressors.push_back(
+        {InstallOperation::REPLACE_ZSTD,
+         [&](brillo::Blob* out) { return ZstdCompress(new_data, out); }});
+  }
+
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler != nullptr && compressors.size() > 1 &&
+      new_data.size() >= kConcurrentCompressionMinSize) {
+    TaskScheduler::TaskGroup group(scheduler, false);
+    for (Compressor& compressor : compressors) {
+      Compressor* task_compressor = &compressor;
+      group.Submit(new_data.size() / kBlockSize, [task_compressor]() {
+        task_compressor->success =
+            task_compressor->compress(&task_compressor->blob);
+      });
+    }
+    group.Wait();
+  } else {
+    for (Compressor& compressor : compressors) {
+      compressor.success = compressor.compress(&compressor.blob);
+    }
+  }
+
+  // Compare in the order the compressors used to run one after another.
+  bool out_blob_set = false;
+  for (Compressor& compressor : compressors) {
+    if (!compressor.success || compressor.blob.empty())
+      continue;
+    const bool better =
+        !out_blob_set ||
+        (compressor.type == InstallOperation::REPLACE_ZSTD
+             ? out_blob->size() + out_blob->size() / kZstdMaxOverhead >=
+                   compressor.blob.size()
+             : out_blob->size() > compressor.blob.size());
+    if (better) {
+      *out_type = compressor.type;
+      *out_blob = std::move(compressor.blob);
+      out_blob_set = true;
+    }
+  }
+  return out_blob_set;
+}
+
+// Records that the compressors turned |data_size| bytes of incompressible
+// looking data into |compressed_size| bytes.
+void MeasureIncompressibleData(size_t data_size, size_t compressed_size) {
+  g_incompressible_stats.measured_chunks++;
+  if (compressed_size < data_size) {
+    g_incompressible_stats.measured_savings += data_size - compressed_size;
+  }
+}
+
 // The maximum destination size allowed for puffdiff. In general, puffdiff
 // should work for arbitrary big files, but the payload application is quite
 // memory intensive, so we limit these operations to 150 MiB.
@@ -94,6 +215,15 @@ const uint64_t kMaxZucchiniDestinationSize = 150 * 1024 * 1024;  // bytes
 
 const int kBrotliCompressionQuality = 11;
 
+// The minimum old data size for building the bsdiff suffix array in parallel,
+// smaller ones are faster to index on their own.
+const uint64_t kMinParallelSuffixArraySize = 16 * 1024 * 1024;  // bytes
+
+// Rough peak memory use of diffing a file per byte of its larger version:
+// both versions, the bsdiff suffix array of the old one and the patches of
+// the candidates generated concurrently.
+const uint64_t kDiffMemoryPerInputByte = 9;
+
 // Storing a diff operation has more overhead over replace operation in the
 // manifest, we need to store an additional src_sha256_hash which is 32 bytes
 // and not compressible, and also src_extents which could use anywhere from a
@@ -122,6 +252,22 @@ bool IsDiffOperationBetter(const InstallOperation& op,
          old_blob_size;
 }
 
+// Whether zucchini is tried on file |name|.
+bool IsZucchiniCandidate(const string& name) {
+  // zip files are ignored for now. We expect puffin to perform better on those.
+  // Investigate whether puffin over zucchini yields better results on those.
+  return deflate_utils::IsFileExtensions(
+      name,
+      {".ko",
+       ".so",
+       ".art",
+       ".odex",
+       ".vdex",
+       "<kernel>",
+       "<modem-partition>",
+       /*, ".capex",".jar", ".apk", ".apex"*/});
+}
+
 // Returns the levenshtein distance between string |a| and |b|.
 // https://en.wikipedia.org/wiki/Levenshtein_distance
 int LevenshteinDistance(const string& a, const string& b) {
@@ -186,6 +332,62 @@ void AppendXorBlock(std::vector<CowMergeOperation>* ops,
   }
 }
 
+// The old and new extents of a part of a file diffed on its own.
+using ChunkExtents = std::pair<vector<Extent>, vector<Extent>>;
+
+// Splits the file stored in |new_extents| of |new_part| in segments of at most
+// |max_segment_blocks| blocks at content-defined boundaries, see
+// FindSegmentBoundaries(), and appends to |chunks| the extents of each segment
+// and of the matching part of the old file in |old_extents| of |old_part|.
+// Returns false if the file isn't split.
+bool SplitInSegments(const string& old_part,
+                     const string& new_part,
+                     const vector<Extent>& old_extents,
+                     const vector<Extent>& new_extents,
+                     uint64_t max_segment_blocks,
+                     vector<ChunkExtents>* chunks) {
+  const auto new_image = MappedFile::OpenShared(new_part);
+  if (!new_image) {
+    return false;
+  }
+  const uint64_t min_segment_blocks =
+      std::max<uint64_t>(max_segment_blocks / 4, 1);
+  const auto new_boundaries = FindSegmentBoundaries(*new_image,
+                                                    new_extents,
+                                                    kBlockSize,
+                                                    min_segment_blocks,
+                                                    max_segment_blocks);
+  if (new_boundaries.size() < 2) {
+    return false;
+  }
+  const auto old_image =
+      old_extents.empty() ? nullptr : MappedFile::OpenShared(old_part);
+  const auto old_boundaries =
+      old_image ? FindSegmentBoundaries(*old_image,
+                                        old_extents,
+                                        kBlockSize,
+                                        min_segment_blocks,
+                                        max_segment_blocks)
+                : vector<SegmentBoundary>{};
+  const uint64_t new_blocks = utils::BlocksInExtents(new_extents);
+  const auto old_ranges = MatchSegments(old_boundaries,
+                                        utils::BlocksInExtents(old_extents),
+                                        new_boundaries,
+                                        new_blocks);
+  for (size_t i = 0; i < new_boundaries.size(); i++) {
+    const uint64_t start = new_boundaries[i].block;
+    const uint64_t end = i + 1 < new_boundaries.size()
+                             ? new_boundaries[i + 1].block
+                             : new_blocks;
+    chunks->emplace_back(
+        ExtentsSublist(old_extents, old_ranges[i].first, old_ranges[i].second),
+        ExtentsSublist(new_extents, start, end - start));
+  }
+  LOG(INFO) << "Split file of " << new_blocks << " blocks in "
+            << chunks->size() << " segments";
+  return true;
+}
+
 }  // namespace
 
 namespace diff_utils {
@@ -205,6 +407,12 @@ BestDiffGenerator::GetUsableCompressorTypes() const {
   return config_.compressors;
 }
 
+bool BestDiffGenerator::BsdiffZstdAllowed() const {
+  // PopulateXorOps() reads the patches with the bsdiff library.
+  return config_.bsdiff_zstd && !config_.enable_vabc_xor &&
+         config_.version.minor >= kZstdMinorPayloadVersion;
+}
+
 bool BestDiffGenerator::GenerateBestDiffOperation(
     const std::vector<std::pair<InstallOperation_Type, size_t>>&
         diff_candidates,
@@ -217,12 +425,19 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       config_.OperationEnabled(InstallOperation::LZ4DIFF_PUFFDIFF)) {
     brillo::Blob patch;
     InstallOperation::Type op_type{};
-    if (Lz4Diff(old_data_,
-                new_data_,
+    GenerationReport::ScopedPhase phase(config_.report, "diff LZ4DIFF");
+    const base::TimeTicks start = base::TimeTicks::Now();
+    if (Lz4Diff(ToStringView(old_data_),
+                ToStringView(new_data_),
                 old_block_info_,
                 new_block_info_,
+                Lz4Context::ForCurrentThread(),
                 &patch,
                 &op_type)) {
+      if (config_.report) {
+        tried_candidates_.push_back(
+            {op_type, patch.size(), base::TimeTicks::Now() - start});
+      }
       aop->op.set_type(op_type);
       // LZ4DIFF is likely significantly better than BSDIFF/PUFFDIFF when
       // working with EROFS. So no need to even try other diffing algorithms.
@@ -231,10 +446,37 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
     }
   }
 
+  const DiffCache cache(config_.diff_cache_dir);
+  brillo::Blob cache_key;
+  if (!config_.diff_cache_dir.empty()) {
+    TEST_AND_RETURN_FALSE(ComputeDiffCacheKey(
+        diff_candidates, *aop, data_blob->size(), &cache_key));
+    InstallOperation::Type cached_type{};
+    brillo::Blob cached_patch;
+    if (cache.Lookup(cache_key, &cached_type, &cached_patch)) {
+      // An empty patch means no diff beat the original operation.
+      if (!cached_patch.empty()) {
+        UseDiff(cached_type, std::move(cached_patch), aop, data_blob);
+      }
+      return true;
+    }
+  }
+  const InstallOperation::Type original_type = aop->op.type();
+
   const uint64_t input_bytes = std::max(utils::BlocksInExtents(src_extents_),
                                         utils::BlocksInExtents(dst_extents_)) *
                                kBlockSize;
 
+  // The diffs to generate, in the order they are compared. An empty patch
+  // means the algorithm doesn't apply to this file.
+  struct Candidate {
+    InstallOperation::Type type;
+    brillo::Blob patch;
+    base::TimeDelta duration;
+    // Whether the time budget ran out before the diff started.
+    bool skipped = false;
+  };
+  vector<Candidate> candidates;
   for (auto [op_type, limit] : diff_candidates) {
     if (!config_.OperationEnabled(op_type)) {
       continue;
@@ -252,112 +494,240 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
         config_.OperationEnabled(InstallOperation::BROTLI_BSDIFF)) {
       op_type = InstallOperation::BROTLI_BSDIFF;
     }
+    // A single bsdiff run already compresses its streams with every usable
+    // compressor and keeps the smallest, so never diff twice with the same
+    // algorithm, e.g. when both SOURCE_BSDIFF and BROTLI_BSDIFF are listed.
+    if (std::any_of(candidates.begin(),
+                    candidates.end(),
+                    [op_type = op_type](const Candidate& candidate) {
+                      return candidate.type == op_type;
+                    })) {
+      continue;
+    }
+    candidates.push_back({op_type, {}});
+  }
 
-    switch (op_type) {
-      case InstallOperation::SOURCE_BSDIFF:
-      case InstallOperation::BROTLI_BSDIFF:
-        TEST_AND_RETURN_FALSE(
-            TryBsdiffAndUpdateOperation(op_type, aop, data_blob));
-        break;
-      case InstallOperation::PUFFDIFF:
-        TEST_AND_RETURN_FALSE(TryPuffdiffAndUpdateOperation(aop, data_blob));
-        break;
-      case InstallOperation::ZUCCHINI:
-        TEST_AND_RETURN_FALSE(TryZucchiniAndUpdateOperation(aop, data_blob));
-        break;
-      default:
-        NOTREACHED();
+  // Once a candidate failed the whole operation fails, so the candidates not
+  // started yet are skipped. So are those started after the time budget of
+  // the file ran out, the diff libraries can't be interrupted.
+  std::atomic<bool> failed{false};
+  const base::TimeTicks file_start = base::TimeTicks::Now();
+  const base::TimeDelta budget =
+      base::TimeDelta::FromSeconds(config_.diff_time_budget_seconds);
+  auto generate = [this, aop, &failed, file_start, budget](
+                      Candidate* candidate) {
+    const base::TimeTicks start = base::TimeTicks::Now();
+    if (!budget.is_zero() && start - file_start > budget) {
+      candidate->skipped = true;
+      return;
+    }
+    GenerationReport::ScopedPhase phase(
+        config_.report,
+        string("diff ") + InstallOperationTypeName(candidate->type));
+    if (!failed && !GenerateDiffPatch(
+                       candidate->type, aop->name, &candidate->patch)) {
+      failed = true;
+    }
+    candidate->duration = base::TimeTicks::Now() - start;
+  };
+  // When running on the shared threads, diff large files with all algorithms
+  // at once, all of them read the same |old_data_| and |new_data_|.
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler != nullptr && candidates.size() > 1) {
+    TaskScheduler::TaskGroup group(scheduler, false);
+    for (auto& candidate : candidates) {
+      Candidate* task_candidate = &candidate;
+      group.Submit(input_bytes / kBlockSize,
+                   [&generate, task_candidate]() { generate(task_candidate); });
+    }
+    group.Wait();
+  } else {
+    for (auto& candidate : candidates) {
+      generate(&candidate);
+    }
+  }
+  TEST_AND_RETURN_FALSE(!failed);
+
+  // Compare in candidate order, like trying them one after another would.
+  for (auto& candidate : candidates) {
+    if (candidate.skipped) {
+      LOG(INFO) << candidate.type << " skipped, diffing " << aop->name
+                << " exceeded the time budget";
+      budget_exceeded_ = true;
+      continue;
+    }
+    if (config_.report) {
+      tried_candidates_.push_back(
+          {candidate.type, candidate.patch.size(), candidate.duration});
+    }
+    if (!candidate.patch.empty() &&
+        IsDiffOperationBetter(aop->op,
+                              data_blob->size(),
+                              candidate.patch.size(),
+                              src_extents_.size())) {
+      UseDiff(candidate.type, std::move(candidate.patch), aop, data_blob);
     }
   }
 
+  // The result depends on the time spent, so it isn't cached.
+  if (!cache_key.empty() && !budget_exceeded_) {
+    const bool diffed = aop->op.type() != original_type;
+    // A failure to cache the result doesn't affect the payload.
+    if (!cache.Store(cache_key,
+                     aop->op.type(),
+                     diffed ? *data_blob : brillo::Blob())) {
+      LOG(WARNING) << "Unable to cache the diff of " << aop->name;
+    }
+  }
   return true;
 }
 
-bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
-    InstallOperation_Type operation_type,
-    AnnotatedOperation* aop,
-    brillo::Blob* data_blob) {
-  base::FilePath patch;
-  TEST_AND_RETURN_FALSE(base::CreateTemporaryFile(&patch));
-  ScopedPathUnlinker unlinker(patch.value());
+bool BestDiffGenerator::ComputeDiffCacheKey(
+    const std::vector<std::pair<InstallOperation_Type, size_t>>&
+        diff_candidates,
+    const AnnotatedOperation& aop,
+    size_t data_size,
+    brillo::Blob* key) const {
+  HashCalculator hasher;
+  // All fields have a fixed size or are preceded by their size, so different
+  // inputs can't produce the same byte stream.
+  auto add_number = [&hasher](uint64_t value) {
+    value = htole64(value);
+    return hasher.Update(&value, sizeof(value));
+  };
+  auto add_data = [&hasher, &add_number](const brillo::Blob& data) {
+    return add_number(data.size()) && hasher.Update(data.data(), data.size());
+  };
+  auto add_deflates = [&add_number](const vector<puffin::BitExtent>& deflates) {
+    TEST_AND_RETURN_FALSE(add_number(deflates.size()));
+    for (const auto& deflate : deflates) {
+      TEST_AND_RETURN_FALSE(add_number(deflate.offset));
+      TEST_AND_RETURN_FALSE(add_number(deflate.length));
+    }
+    return true;
+  };
+
+  TEST_AND_RETURN_FALSE(add_data(old_data_));
+  TEST_AND_RETURN_FALSE(add_data(new_data_));
+  TEST_AND_RETURN_FALSE(add_deflates(old_deflates_));
+  TEST_AND_RETURN_FALSE(add_deflates(new_deflates_));
+  TEST_AND_RETURN_FALSE(add_number(config_.version.minor));
+  const auto compressors = GetUsableCompressorTypes();
+  TEST_AND_RETURN_FALSE(add_number(compressors.size()));
+  for (const auto compressor : compressors) {
+    TEST_AND_RETURN_FALSE(add_number(static_cast<uint64_t>(compressor)));
+  }
+  TEST_AND_RETURN_FALSE(add_number(BsdiffZstdAllowed()));
+  TEST_AND_RETURN_FALSE(add_number(diff_candidates.size()));
+  for (const auto& [op_type, limit] : diff_candidates) {
+    TEST_AND_RETURN_FALSE(add_number(op_type));
+    TEST_AND_RETURN_FALSE(add_number(limit));
+    TEST_AND_RETURN_FALSE(add_number(config_.OperationEnabled(op_type)));
+  }
+  TEST_AND_RETURN_FALSE(
+      add_number(config_.OperationEnabled(InstallOperation::BROTLI_BSDIFF)));
+  TEST_AND_RETURN_FALSE(add_number(IsZucchiniCandidate(aop.name)));
+  // The sizes the diffs have to beat.
+  TEST_AND_RETURN_FALSE(add_number(aop.op.type()));
+  TEST_AND_RETURN_FALSE(add_number(data_size));
+  TEST_AND_RETURN_FALSE(add_number(src_extents_.size()));
+  TEST_AND_RETURN_FALSE(add_number(utils::BlocksInExtents(src_extents_)));
+  TEST_AND_RETURN_FALSE(add_number(utils::BlocksInExtents(dst_extents_)));
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *key = hasher.raw_hash();
+  return true;
+}
 
+void BestDiffGenerator::UseDiff(InstallOperation_Type type,
+                                brillo::Blob patch,
+                                AnnotatedOperation* aop,
+                                brillo::Blob* data_blob) const {
+  InstallOperation& operation = aop->op;
+  // VABC XOR won't work with compressed files just yet.
+  if ((type == InstallOperation::SOURCE_BSDIFF ||
+       type == InstallOperation::BROTLI_BSDIFF) &&
+      config_.enable_vabc_xor) {
+    StoreExtents(src_extents_, operation.mutable_src_extents());
+    diff_utils::PopulateXorOps(aop, patch);
+    diff_utils::RefineXorOps(aop, old_data_, new_data_);
+  }
+  operation.set_type(type);
+  *data_blob = std::move(patch);
+}
+
+bool BestDiffGenerator::GenerateDiffPatch(InstallOperation_Type type,
+                                          const string& name,
+                                          brillo::Blob* patch) const {
+  switch (type) {
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+      return GenerateBsdiffPatch(type, patch);
+    case InstallOperation::PUFFDIFF:
+      return GeneratePuffdiffPatch(patch);
+    case InstallOperation::ZUCCHINI:
+      return GenerateZucchiniPatch(name, patch);
+    default:
+      NOTREACHED();
+      return false;
+  }
+}
+
+bool BestDiffGenerator::GenerateBsdiffPatch(InstallOperation_Type type,
+                                            brillo::Blob* patch) const {
   std::unique_ptr<bsdiff::PatchWriterInterface> bsdiff_patch_writer;
-  if (operation_type == InstallOperation::BROTLI_BSDIFF) {
-    bsdiff_patch_writer = bsdiff::CreateBSDF2PatchWriter(
-        patch.value(), GetUsableCompressorTypes(), kBrotliCompressionQuality);
+  if (type == InstallOperation::BROTLI_BSDIFF) {
+    bsdiff_patch_writer =
+        std::make_unique<MemoryPatchWriter>(patch,
+                                            GetUsableCompressorTypes(),
+                                            kBrotliCompressionQuality,
+                                            BsdiffZstdAllowed());
   } else {
-    bsdiff_patch_writer = bsdiff::CreateBsdiffPatchWriter(patch.value());
+    bsdiff_patch_writer = std::make_unique<MemoryPatchWriter>(patch);
   }
 
-  brillo::Blob bsdiff_delta;
+  // bsdiff builds the suffix array of the old data on the calling thread,
+  // which takes most of the time of large files. Those often end up running
+  // alone, so build it in tasks the idle threads can pick up instead.
+  std::unique_ptr<bsdiff::SuffixArrayIndexInterface> index;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler != nullptr &&
+      old_data_.size() >= kMinParallelSuffixArraySize &&
+      scheduler->IdleThreads() > 0) {
+    index = CreateParallelSuffixArrayIndex(
+        old_data_.data(), old_data_.size(), scheduler);
+  }
+  bsdiff::SuffixArrayIndexInterface* sai = index.get();
   TEST_AND_RETURN_FALSE(0 == bsdiff::bsdiff(old_data_.data(),
                                             old_data_.size(),
                                             new_data_.data(),
                                             new_data_.size(),
                                             bsdiff_patch_writer.get(),
-                                            nullptr));
-
-  TEST_AND_RETURN_FALSE(utils::ReadFile(patch.value(), &bsdiff_delta));
-  TEST_AND_RETURN_FALSE(!bsdiff_delta.empty());
-
-  InstallOperation& operation = aop->op;
-  if (IsDiffOperationBetter(operation,
-                            data_blob->size(),
-                            bsdiff_delta.size(),
-                            src_extents_.size())) {
-    // VABC XOR won't work with compressed files just yet.
-    if (config_.enable_vabc_xor) {
-      StoreExtents(src_extents_, operation.mutable_src_extents());
-      diff_utils::PopulateXorOps(aop, bsdiff_delta);
-    }
-    operation.set_type(operation_type);
-    *data_blob = std::move(bsdiff_delta);
-  }
+                                            index ? &sai : nullptr));
+  TEST_AND_RETURN_FALSE(!patch->empty());
   return true;
 }
 
-bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
-                                                      brillo::Blob* data_blob) {
+bool BestDiffGenerator::GeneratePuffdiffPatch(brillo::Blob* patch) const {
   // Only Puffdiff if both files have at least one deflate left.
-  if (!old_deflates_.empty() && !new_deflates_.empty()) {
-    brillo::Blob puffdiff_delta;
-    ScopedTempFile temp_file("puffdiff-delta.XXXXXX");
-    // Perform PuffDiff operation.
-    TEST_AND_RETURN_FALSE(puffin::PuffDiff(old_data_,
-                                           new_data_,
-                                           old_deflates_,
-                                           new_deflates_,
-                                           GetUsableCompressorTypes(),
-                                           temp_file.path(),
-                                           &puffdiff_delta));
-    TEST_AND_RETURN_FALSE(!puffdiff_delta.empty());
-
-    InstallOperation& operation = aop->op;
-    if (IsDiffOperationBetter(operation,
-                              data_blob->size(),
-                              puffdiff_delta.size(),
-                              src_extents_.size())) {
-      operation.set_type(InstallOperation::PUFFDIFF);
-      *data_blob = std::move(puffdiff_delta);
-    }
+  if (old_deflates_.empty() || new_deflates_.empty()) {
+    return true;
   }
+  ScopedTempFile temp_file("puffdiff-delta.XXXXXX");
+  // Perform PuffDiff operation.
+  TEST_AND_RETURN_FALSE(puffin::PuffDiff(old_data_,
+                                         new_data_,
+                                         old_deflates_,
+                                         new_deflates_,
+                                         GetUsableCompressorTypes(),
+                                         temp_file.path(),
+                                         patch));
+  TEST_AND_RETURN_FALSE(!patch->empty());
   return true;
 }
 
-bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
-                                                      brillo::Blob* data_blob) {
-  // zip files are ignored for now. We expect puffin to perform better on those.
-  // Investigate whether puffin over zucchini yields better results on those.
-  if (!deflate_utils::IsFileExtensions(
-          aop->name,
-          {".ko",
-           ".so",
-           ".art",
-           ".odex",
-           ".vdex",
-           "<kernel>",
-           "<modem-partition>",
-           /*, ".capex",".jar", ".apk", ".apex"*/})) {
+bool BestDiffGenerator::GenerateZucchiniPatch(const string& name,
+                                              brillo::Blob* patch) const {
+  if (!IsZucchiniCandidate(name)) {
     return true;
   }
   zucchini::ConstBufferView src_bytes(old_data_.data(), old_data_.size());
@@ -373,19 +743,8 @@ bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
   // Compress the delta with brotli.
   // TODO(197361113) support compressing the delta with different algorithms,
   // similar to the usage in puffin.
-  brillo::Blob compressed_delta;
   TEST_AND_RETURN_FALSE(puffin::BrotliEncode(
-      zucchini_delta.data(), zucchini_delta.size(), &compressed_delta));
-
-  InstallOperation& operation = aop->op;
-  if (IsDiffOperationBetter(operation,
-                            data_blob->size(),
-                            compressed_delta.size(),
-                            src_extents_.size())) {
-    operation.set_type(InstallOperation::ZUCCHINI);
-    *data_blob = std::move(compressed_delta);
-  }
-
+      zucchini_delta.data(), zucchini_delta.size(), patch));
   return true;
 }
 
@@ -412,9 +771,11 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
         chunk_blocks_(chunk_blocks),
         blob_file_(blob_file) {}
 
-  bool operator>(const FileDeltaProcessor& other) const {
-    return new_extents_blocks_ > other.new_extents_blocks_;
-  }
+  size_t new_extents_blocks() const { return new_extents_blocks_; }
+
+  // Returns the number of bytes diffing the largest chunk of the file is
+  // expected to use at most.
+  uint64_t EstimateMemoryUsage() const;
 
   ~FileDeltaProcessor() override = default;
 
@@ -448,6 +809,17 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
   DISALLOW_COPY_AND_ASSIGN(FileDeltaProcessor);
 };
 
+uint64_t FileDeltaProcessor::EstimateMemoryUsage() const {
+  uint64_t old_blocks = utils::BlocksInExtents(old_extents_.extents);
+  uint64_t new_blocks = new_extents_blocks_;
+  if (chunk_blocks_ > 0) {
+    old_blocks = std::min<uint64_t>(old_blocks, chunk_blocks_);
+    new_blocks = std::min<uint64_t>(new_blocks, chunk_blocks_);
+  }
+  return std::max(old_blocks, new_blocks) * kBlockSize *
+         kDiffMemoryPerInputByte;
+}
+
 void FileDeltaProcessor::Run() {
   TEST_AND_RETURN(blob_file_ != nullptr);
   base::TimeTicks start = base::TimeTicks::Now();
@@ -466,8 +838,11 @@ void FileDeltaProcessor::Run() {
     return;
   }
 
-  if (!ABGenerator::FragmentOperations(
-          config_.version, &file_aops_, new_part_, blob_file_)) {
+  if (!ABGenerator::FragmentOperations(config_.version,
+                                       &file_aops_,
+                                       new_part_,
+                                       blob_file_,
+                                       config_.max_compression_effort)) {
     LOG(ERROR) << "Failed to fragment operations for " << name_;
     failed_ = true;
     return;
@@ -525,16 +900,124 @@ std::vector<Extent> RemoveDuplicateBlocks(const std::vector<Extent>& extents) {
   return ret;
 }
 
+namespace {
+
+// Whether |new_file| has the same data as |old_file| according to their
+// hashes, so it can be copied from it as is. That's only possible if
+// |new_file_extents|, its blocks not visited yet, are all of its blocks and
+// have no duplicates.
+bool IsUnchangedFile(const File& old_file,
+                     const File& new_file,
+                     const vector<Extent>& new_file_extents) {
+  if (new_file.data_hash.empty() || old_file.data_hash != new_file.data_hash)
+    return false;
+  const uint64_t num_blocks = utils::BlocksInExtents(new_file.extents);
+  return utils::BlocksInExtents(old_file.extents) == num_blocks &&
+         utils::BlocksInExtents(RemoveDuplicateBlocks(new_file_extents)) ==
+             num_blocks;
+}
+
+// Appends to |aops| SOURCE_COPY operations named |name| copying the blocks of
+// |old_extents| to |new_extents|, at most |chunk_blocks| blocks each or all
+// of them at once if -1.
+void AppendSourceCopy(vector<AnnotatedOperation>* aops,
+                      const string& name,
+                      const vector<Extent>& old_extents,
+                      const vector<Extent>& new_extents,
+                      ssize_t chunk_blocks) {
+  const uint64_t num_blocks = utils::BlocksInExtents(new_extents);
+  if (chunk_blocks == -1)
+    chunk_blocks = num_blocks;
+  for (uint64_t offset = 0; offset < num_blocks; offset += chunk_blocks) {
+    vector<Extent> src_extents =
+        ExtentsSublist(old_extents, offset, chunk_blocks);
+    vector<Extent> dst_extents =
+        ExtentsSublist(new_extents, offset, chunk_blocks);
+    NormalizeExtents(&src_extents);
+    NormalizeExtents(&dst_extents);
+    AnnotatedOperation aop;
+    aop.name = name;
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    StoreExtents(src_extents, aop.op.mutable_src_extents());
+    StoreExtents(dst_extents, aop.op.mutable_dst_extents());
+    aops->push_back(std::move(aop));
+  }
+}
+
+// Keeps in |processors| only the files diffed by the shard
+// |config.diff_shard_index|. The files are assigned from the largest to the
+// shard with the fewest blocks so far, in the same order on every generator
+// sharding the same images.
+void KeepShardFiles(const PayloadGenerationConfig& config,
+                    list<FileDeltaProcessor>* processors) {
+  vector<const FileDeltaProcessor*> by_size;
+  for (const FileDeltaProcessor& processor : *processors)
+    by_size.push_back(&processor);
+  std::stable_sort(
+      by_size.begin(),
+      by_size.end(),
+      [](const FileDeltaProcessor* a, const FileDeltaProcessor* b) {
+        return a->new_extents_blocks() > b->new_extents_blocks();
+      });
+  vector<uint64_t> shard_blocks(config.diff_shard_count);
+  std::set<const FileDeltaProcessor*> kept;
+  for (const FileDeltaProcessor* processor : by_size) {
+    const auto shard =
+        std::min_element(shard_blocks.begin(), shard_blocks.end());
+    *shard += processor->new_extents_blocks();
+    if (static_cast<uint32_t>(shard - shard_blocks.begin()) ==
+        config.diff_shard_index) {
+      kept.insert(processor);
+    }
+  }
+  processors->remove_if([&kept](const FileDeltaProcessor& processor) {
+    return kept.count(&processor) == 0;
+  });
+}
+
+}  // namespace
+
+bool GetPartitionFiles(const PayloadGenerationConfig& config,
+                       const PartitionConfig& part,
+                       bool extract_deflates,
+                       vector<FilesystemInterface::File>* files) {
+  if (part.files) {
+    *files = *part.files;
+    return true;
+  }
+  if (config.file_index_cache_dir.empty()) {
+    return deflate_utils::PreprocessPartitionFiles(
+        part, files, extract_deflates, config.report);
+  }
+  const FileIndexCache cache(config.file_index_cache_dir);
+  brillo::Blob key;
+  TEST_AND_RETURN_FALSE(
+      FileIndexCache::ComputeKey(part, extract_deflates, &key));
+  if (cache.Lookup(key, files)) {
+    LOG(INFO) << "Loaded " << files->size() << " files of partition "
+              << part.name << " from the file index cache.";
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
+      part, files, extract_deflates, config.report));
+  // The files were found anyway, failing to cache them only costs time.
+  if (!cache.Store(key, *files)) {
+    LOG(WARNING) << "Unable to cache the files of partition " << part.name;
+  }
+  return true;
+}
+
 bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                         const PartitionConfig& old_part,
                         const PartitionConfig& new_part,
                         ssize_t hard_chunk_blocks,
                         size_t soft_chunk_blocks,
                         const PayloadGenerationConfig& config,
-                        BlobFileWriter* blob_file) {
+                        BlobFileWriter* blob_file,
+                        const SourceBlockIndex* source_block_index) {
   const auto& version = config.version;
-  ExtentRanges old_visited_blocks;
-  ExtentRanges new_visited_blocks;
+  BlockSet old_visited_blocks;
+  BlockSet new_visited_blocks;
 
   // If verity is enabled, mark those blocks as visited to skip generating
   // operations for them.
@@ -553,10 +1036,23 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
 
   TEST_AND_RETURN_FALSE(new_part.fs_interface);
   vector<FilesystemInterface::File> new_files;
-  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-      new_part, &new_files, puffdiff_allowed));
+  TEST_AND_RETURN_FALSE(
+      GetPartitionFiles(config, new_part, puffdiff_allowed, &new_files));
+
+  // Only the blocks changed since the previous payload are generated again.
+  if (config.previous_payload) {
+    GenerationReport::ScopedPhase phase(config.report, "previous_payload");
+    TEST_AND_RETURN_FALSE(
+        config.previous_payload->ReuseOperations(old_part,
+                                                 new_part,
+                                                 new_files,
+                                                 config,
+                                                 blob_file,
+                                                 aops,
+                                                 &new_visited_blocks));
+  }
 
-  ExtentRanges old_zero_blocks;
+  BlockSet old_zero_blocks;
   // Prematurely removing moved blocks will render compression info useless.
   // Even if a single block inside a 100MB file is filtered out, the entire
   // 100MB file can't be decompressed. In this case we will fallback to BSDIFF,
@@ -569,6 +1065,7 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
       });
   if (!config.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) ||
       no_compressed_files) {
+    GenerationReport::ScopedPhase phase(config.report, "block_mapping");
     TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(aops,
                                                   old_part.path,
                                                   new_part.path,
@@ -579,19 +1076,37 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                                   blob_file,
                                                   &old_visited_blocks,
                                                   &new_visited_blocks,
-                                                  &old_zero_blocks));
+                                                  &old_zero_blocks,
+                                                  source_block_index));
   }
 
   map<string, FilesystemInterface::File> old_files_map;
   if (old_part.fs_interface) {
     vector<FilesystemInterface::File> old_files;
-    TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-        old_part, &old_files, puffdiff_allowed));
+    TEST_AND_RETURN_FALSE(
+        GetPartitionFiles(config, old_part, puffdiff_allowed, &old_files));
     for (const FilesystemInterface::File& file : old_files)
       old_files_map[file.name] = file;
   }
 
+  // The data of new files may come from another partition instead.
+  if (source_block_index &&
+      config.OperationEnabled(InstallOperation::PARTITION_COPY)) {
+    GenerationReport::ScopedPhase phase(config.report, "partition_copy");
+    TEST_AND_RETURN_FALSE(DeltaPartitionCopyBlocks(aops,
+                                                   new_part,
+                                                   new_files,
+                                                   old_files_map,
+                                                   *source_block_index,
+                                                   &new_visited_blocks));
+  }
+
   list<FileDeltaProcessor> file_delta_processors;
+  size_t unchanged_files = 0;
+  // Mapping the files to the blocks not visited yet.
+  auto block_mapping_phase =
+      std::make_unique<GenerationReport::ScopedPhase>(config.report,
+                                                      "block_mapping");
 
   // The processing is very straightforward here, we generate operations for
   // every file (and pseudo-file such as the metadata) in the new filesystem
@@ -606,7 +1121,7 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     // handled as normal files. We also ignore blocks that were already
     // processed by a previous file.
     vector<Extent> new_file_extents =
-        FilterExtentRanges(new_file.extents, new_visited_blocks);
+        FilterBlockSet(new_file.extents, new_visited_blocks);
     new_visited_blocks.AddExtents(new_file_extents);
 
     if (new_file_extents.empty())
@@ -616,6 +1131,17 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
         GetOldFile(old_files_map, new_file.name);
     old_visited_blocks.AddExtents(old_file.extents);
 
+    // Files whose data didn't change are copied without reading them.
+    if (IsUnchangedFile(old_file, new_file, new_file_extents)) {
+      AppendSourceCopy(aops,
+                       new_file.name,
+                       old_file.extents,
+                       new_file_extents,
+                       hard_chunk_blocks);
+      unchanged_files++;
+      continue;
+    }
+
     // TODO(b/177104308) Filtering |new_file_extents| might confuse puffdiff, as
     // we might filterout extents with deflate streams. PUFFDIFF is written with
     // that in mind, so it will try to adapt to the filtered extents.
@@ -646,12 +1172,12 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   // blocks in the old partition as available data.
   vector<Extent> new_unvisited = {
       ExtentForRange(0, new_part.size / kBlockSize)};
-  new_unvisited = FilterExtentRanges(new_unvisited, new_visited_blocks);
+  new_unvisited = FilterBlockSet(new_unvisited, new_visited_blocks);
   if (!new_unvisited.empty()) {
     vector<Extent> old_unvisited;
     if (old_part.fs_interface) {
       old_unvisited.push_back(ExtentForRange(0, old_part.size / kBlockSize));
-      old_unvisited = FilterExtentRanges(old_unvisited, old_visited_blocks);
+      old_unvisited = FilterBlockSet(old_unvisited, old_visited_blocks);
     }
 
     LOG(INFO) << "Scanning " << utils::BlocksInExtents(new_unvisited)
@@ -673,29 +1199,52 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                        soft_chunk_blocks,
                                        blob_file);
   }
+  block_mapping_phase.reset();
+  LOG(INFO) << "Copied " << unchanged_files << " unchanged files of partition "
+            << new_part.name << " without diffing them";
+  if (config.diff_shard_count > 0) {
+    const size_t num_files = file_delta_processors.size();
+    KeepShardFiles(config, &file_delta_processors);
+    LOG(INFO) << "Diffing " << file_delta_processors.size() << " of the "
+              << num_files << " files of partition " << new_part.name
+              << " in shard " << config.diff_shard_index << " of "
+              << config.diff_shard_count;
+  }
 
-  size_t max_threads = GetMaxThreads();
-
-  if (config.max_threads > 0 && config.max_threads < max_threads) {
-    max_threads = config.max_threads;
+  // When called from GenerateUpdatePayloadFile(), the files are processed on
+  // the threads shared by all partitions.
+  std::unique_ptr<TaskScheduler> own_scheduler;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler == nullptr) {
+    size_t max_threads = GetMaxThreads();
+    if (config.max_threads > 0 && config.max_threads < max_threads) {
+      max_threads = config.max_threads;
+    }
+    own_scheduler =
+        std::make_unique<TaskScheduler>(max_threads, config.memory_budget);
+    scheduler = own_scheduler.get();
   }
-  LOG(INFO) << "Using " << max_threads << " threads to process "
+  LOG(INFO) << "Using " << scheduler->num_threads() << " threads to process "
             << file_delta_processors.size() << " files on partition "
             << old_part.name;
 
-  // Sort the files in descending order based on number of new blocks to make
-  // sure we start the largest ones first.
-  if (file_delta_processors.size() > max_threads) {
-    file_delta_processors.sort(std::greater<FileDeltaProcessor>());
-  }
-
-  base::DelegateSimpleThreadPool thread_pool("incremental-update-generator",
-                                             max_threads);
-  thread_pool.Start();
-  for (auto& processor : file_delta_processors) {
-    thread_pool.AddWork(&processor);
+  // Map the images once for all files, the mappings are shared with the
+  // operations reading them, see ReadExtentsToDiff().
+  const auto old_image = MappedFile::OpenShared(old_part.path);
+  const auto new_image = MappedFile::OpenShared(new_part.path);
+
+  // The scheduler starts the largest files first, by number of new blocks.
+  // File tasks wait for the diffs BestDiffGenerator runs in parallel.
+  {
+    TaskScheduler::TaskGroup files(scheduler, true);
+    for (auto& processor : file_delta_processors) {
+      auto* file_processor = &processor;
+      files.Submit(processor.new_extents_blocks(),
+                   processor.EstimateMemoryUsage(),
+                   [file_processor]() { file_processor->Run(); });
+    }
+    files.Wait();
   }
-  thread_pool.JoinAll();
 
   for (auto& processor : file_delta_processors) {
     TEST_AND_RETURN_FALSE(processor.MergeOperation(aops));
@@ -712,18 +1261,29 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
                              ssize_t chunk_blocks,
                              const PayloadGenerationConfig& config,
                              BlobFileWriter* blob_file,
-                             ExtentRanges* old_visited_blocks,
-                             ExtentRanges* new_visited_blocks,
-                             ExtentRanges* old_zero_blocks) {
+                             BlockSet* old_visited_blocks,
+                             BlockSet* new_visited_blocks,
+                             BlockSet* old_zero_blocks,
+                             const SourceBlockIndex* source_block_index) {
   vector<BlockMapping::BlockId> old_block_ids;
   vector<BlockMapping::BlockId> new_block_ids;
-  TEST_AND_RETURN_FALSE(MapPartitionBlocks(old_part,
-                                           new_part,
-                                           old_num_blocks * kBlockSize,
-                                           new_num_blocks * kBlockSize,
-                                           kBlockSize,
-                                           &old_block_ids,
-                                           &new_block_ids));
+  if (source_block_index && source_block_index->HasPartitionAt(old_part)) {
+    TEST_AND_RETURN_FALSE(
+        source_block_index->MapPartitionBlocks(old_part,
+                                               new_part,
+                                               old_num_blocks * kBlockSize,
+                                               new_num_blocks * kBlockSize,
+                                               &old_block_ids,
+                                               &new_block_ids));
+  } else {
+    TEST_AND_RETURN_FALSE(MapPartitionBlocks(old_part,
+                                             new_part,
+                                             old_num_blocks * kBlockSize,
+                                             new_num_blocks * kBlockSize,
+                                             kBlockSize,
+                                             &old_block_ids,
+                                             &new_block_ids));
+  }
 
   // A mapping from the block_id to the list of block numbers with that block id
   // in the old partition. This is used to lookup where in the old partition
@@ -741,7 +1301,7 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
     if (old_block_ids[block] == 0)
       old_zero_blocks->AddBlock(block);
   }
-  old_visited_blocks->AddRanges(*old_zero_blocks);
+  old_visited_blocks->AddSet(*old_zero_blocks);
 
   // The collection of blocks in the new partition with just zeros. This is a
   // common case for free-space that's also problematic for bsdiff, so we want
@@ -853,6 +1413,198 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
   return true;
 }
 
+bool DeltaPartitionCopyBlocks(vector<AnnotatedOperation>* aops,
+                              const PartitionConfig& new_part,
+                              const vector<File>& new_files,
+                              const map<string, File>& old_files,
+                              const SourceBlockIndex& index,
+                              BlockSet* new_visited_blocks) {
+  if (!index.IsCopySource(new_part.name))
+    return true;
+  const auto new_image = MappedFile::OpenShared(new_part.path);
+  TEST_AND_RETURN_FALSE(new_image);
+  const uint64_t max_blocks = kMaxPartitionCopySize / kBlockSize;
+
+  const size_t num_ops = aops->size();
+  uint64_t copied_blocks = 0;
+  AnnotatedOperation aop;
+  vector<Extent> src_extents;
+  vector<Extent> dst_extents;
+  // Appends the operation of the blocks found so far, if any.
+  auto flush = [&]() -> bool {
+    if (dst_extents.empty())
+      return true;
+    // The source blocks are identical to the new ones, whose hash is the
+    // source hash.
+    brillo::Blob data, hash;
+    TEST_AND_RETURN_FALSE(
+        new_image->ReadExtents(dst_extents, kBlockSize, &data));
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(data, &hash));
+    aop.op.set_src_sha256_hash(hash.data(), hash.size());
+    StoreExtents(src_extents, aop.op.mutable_src_extents());
+    StoreExtents(dst_extents, aop.op.mutable_dst_extents());
+    copied_blocks += utils::BlocksInExtents(dst_extents);
+    aops->push_back(std::move(aop));
+    aop = {};
+    src_extents.clear();
+    dst_extents.clear();
+    return true;
+  };
+
+  for (const File& new_file : new_files) {
+    if (old_files.count(new_file.name) > 0)
+      continue;
+    for (const Extent& extent :
+         FilterBlockSet(new_file.extents, *new_visited_blocks)) {
+      if (!new_image->Contains(extent, kBlockSize))
+        continue;
+      for (uint64_t block = extent.start_block();
+           block < extent.start_block() + extent.num_blocks();
+           block++) {
+        // Files may list a block more than once.
+        if (new_visited_blocks->ContainsBlock(block))
+          continue;
+        string partition;
+        uint64_t src_block = 0;
+        if (!index.FindBlock(new_image->data() + block * kBlockSize,
+                             new_part.name,
+                             &partition,
+                             &src_block)) {
+          TEST_AND_RETURN_FALSE(flush());
+          continue;
+        }
+        if (!dst_extents.empty() &&
+            (aop.op.src_partition_name() != partition ||
+             utils::BlocksInExtents(dst_extents) >= max_blocks)) {
+          TEST_AND_RETURN_FALSE(flush());
+        }
+        if (dst_extents.empty()) {
+          aop.name = new_file.name;
+          aop.op.set_type(InstallOperation::PARTITION_COPY);
+          aop.op.set_src_partition_name(partition);
+        }
+        AppendBlockToExtents(&src_extents, src_block);
+        AppendBlockToExtents(&dst_extents, block);
+        new_visited_blocks->AddBlock(block);
+      }
+    }
+    TEST_AND_RETURN_FALSE(flush());
+  }
+  LOG(INFO) << "Produced " << (aops->size() - num_ops) << " operations for "
+            << copied_blocks << " blocks copied from other partitions";
+  return true;
+}
+
+bool SplitUnchangedCompressedBlocks(const string& old_part,
+                                    const string& new_part,
+                                    const File& old_file,
+                                    const File& new_file,
+                                    vector<AnnotatedOperation>* aops,
+                                    File* changed_file) {
+  const auto& old_blocks = old_file.compressed_file_info.blocks;
+  const auto& new_blocks = new_file.compressed_file_info.blocks;
+  if (old_blocks.empty() || new_blocks.empty()) {
+    return false;
+  }
+  const auto old_image = MappedFile::OpenShared(old_part);
+  const auto new_image = MappedFile::OpenShared(new_part);
+  brillo::Blob old_data;
+  brillo::Blob new_data;
+  if (!old_image || !new_image ||
+      !old_image->ReadExtents(old_file.extents, kBlockSize, &old_data) ||
+      !new_image->ReadExtents(new_file.extents, kBlockSize, &new_data)) {
+    return false;
+  }
+  // The size of a block in the file data, compressed or not.
+  const auto stored_size = [](const CompressedBlock& block) {
+    return block.IsCompressed() ? block.compressed_length
+                                : block.uncompressed_length;
+  };
+  const auto is_aligned = [](uint64_t offset, uint64_t size) {
+    return offset % kBlockSize == 0 && size % kBlockSize == 0;
+  };
+
+  // The offset in |old_data| of every old block on block boundaries, by its
+  // data.
+  std::unordered_map<std::string_view, uint64_t> old_offsets;
+  uint64_t offset = 0;
+  for (const auto& block : old_blocks) {
+    const uint64_t size = stored_size(block);
+    if (offset + size > old_data.size()) {
+      return false;
+    }
+    if (is_aligned(offset, size)) {
+      old_offsets.emplace(ToStringView(old_data.data() + offset, size), offset);
+    }
+    offset += size;
+  }
+
+  AnnotatedOperation aop;
+  aop.name = new_file.name;
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  vector<Extent> src_extents;
+  vector<Extent> dst_extents;
+  vector<Extent> changed_extents;
+  vector<CompressedBlock> changed_blocks;
+  // The first block of |new_file| not copied yet.
+  uint64_t changed_start = 0;
+  uint64_t uncompressed_offset = 0;
+  offset = 0;
+  for (const auto& block : new_blocks) {
+    const uint64_t size = stored_size(block);
+    if (offset + size > new_data.size()) {
+      return false;
+    }
+    const auto old_offset =
+        is_aligned(offset, size)
+            ? old_offsets.find(ToStringView(new_data.data() + offset, size))
+            : old_offsets.end();
+    if (old_offset == old_offsets.end()) {
+      auto& changed_block = changed_blocks.emplace_back(block);
+      changed_block.uncompressed_offset = uncompressed_offset;
+      uncompressed_offset += block.uncompressed_length;
+    } else {
+      const uint64_t start = offset / kBlockSize;
+      const uint64_t count = size / kBlockSize;
+      const auto src = ExtentsSublist(
+          old_file.extents, old_offset->second / kBlockSize, count);
+      const auto dst = ExtentsSublist(new_file.extents, start, count);
+      const auto changed = ExtentsSublist(
+          new_file.extents, changed_start, start - changed_start);
+      src_extents.insert(src_extents.end(), src.begin(), src.end());
+      dst_extents.insert(dst_extents.end(), dst.begin(), dst.end());
+      changed_extents.insert(
+          changed_extents.end(), changed.begin(), changed.end());
+      changed_start = start + count;
+    }
+    offset += size;
+  }
+  if (dst_extents.empty()) {
+    return false;
+  }
+  // The blocks after the last copied one, including any data following the
+  // compressed blocks.
+  const auto changed = ExtentsSublist(
+      new_file.extents,
+      changed_start,
+      utils::BlocksInExtents(new_file.extents) - changed_start);
+  changed_extents.insert(changed_extents.end(), changed.begin(), changed.end());
+
+  NormalizeExtents(&src_extents);
+  NormalizeExtents(&dst_extents);
+  NormalizeExtents(&changed_extents);
+  StoreExtents(src_extents, aop.op.mutable_src_extents());
+  StoreExtents(dst_extents, aop.op.mutable_dst_extents());
+  LOG(INFO) << "Copying " << utils::BlocksInExtents(dst_extents)
+            << " blocks of unchanged compressed data of " << new_file.name;
+  aops->push_back(std::move(aop));
+
+  *changed_file = new_file;
+  changed_file->extents = std::move(changed_extents);
+  changed_file->compressed_file_info.blocks = std::move(changed_blocks);
+  return true;
+}
+
 bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    const std::string& old_part,
                    const std::string& new_part,
@@ -861,69 +1613,206 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    ssize_t chunk_blocks,
                    const PayloadGenerationConfig& config,
                    BlobFileWriter* blob_file) {
-  const auto& old_extents = old_file.extents;
-  const auto& new_extents = new_file.extents;
-  const auto& name = new_file.name;
-
-  brillo::Blob data;
-
-  uint64_t total_blocks = utils::BlocksInExtents(new_extents);
   if (chunk_blocks == 0) {
     LOG(ERROR) << "Invalid number of chunk_blocks. Cannot be 0.";
     return false;
   }
 
-  if (chunk_blocks == -1)
-    chunk_blocks = total_blocks;
-
-  for (uint64_t block_offset = 0; block_offset < total_blocks;
-       block_offset += chunk_blocks) {
-    // Split the old/new file in the same chunks. Note that this could drop
-    // some information from the old file used for the new chunk. If the old
-    // file is smaller (or even empty when there's no old file) the chunk will
-    // also be empty.
-    vector<Extent> old_extents_chunk =
-        ExtentsSublist(old_extents, block_offset, chunk_blocks);
-    vector<Extent> new_extents_chunk =
-        ExtentsSublist(new_extents, block_offset, chunk_blocks);
+  // Only the compressed blocks that changed need LZ4DIFF, when the file is
+  // diffed as a whole.
+  File changed_file;
+  const File* diffed_file = &new_file;
+  if ((chunk_blocks == -1 || utils::BlocksInExtents(new_file.extents) <=
+                                 static_cast<uint64_t>(chunk_blocks)) &&
+      config.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) &&
+      config.OperationEnabled(InstallOperation::LZ4DIFF_PUFFDIFF) &&
+      SplitUnchangedCompressedBlocks(
+          old_part, new_part, old_file, new_file, aops, &changed_file)) {
+    if (changed_file.extents.empty()) {
+      return true;
+    }
+    diffed_file = &changed_file;
+  }
+
+  const auto& old_extents = old_file.extents;
+  const auto& new_extents = diffed_file->extents;
+  const auto& name = diffed_file->name;
+
+  uint64_t total_blocks = utils::BlocksInExtents(new_extents);
+
+  vector<ChunkExtents> chunks;
+  const uint64_t max_segment_blocks = config.max_file_segment_size / kBlockSize;
+  bool segmented = chunk_blocks == -1 && max_segment_blocks > 0 &&
+                   total_blocks > max_segment_blocks &&
+                   diffed_file->compressed_file_info.blocks.empty();
+  if (!segmented || !SplitInSegments(old_part,
+                                     new_part,
+                                     old_extents,
+                                     new_extents,
+                                     max_segment_blocks,
+                                     &chunks)) {
+    segmented = false;
+    if (chunk_blocks == -1)
+      chunk_blocks = total_blocks;
+
+    for (uint64_t block_offset = 0; block_offset < total_blocks;
+         block_offset += chunk_blocks) {
+      // Split the old/new file in the same chunks. Note that this could drop
+      // some information from the old file used for the new chunk. If the old
+      // file is smaller (or even empty when there's no old file) the chunk
+      // will also be empty.
+      chunks.emplace_back(
+          ExtentsSublist(old_extents, block_offset, chunk_blocks),
+          ExtentsSublist(new_extents, block_offset, chunk_blocks));
+    }
+  }
+
+  vector<AnnotatedOperation> chunk_aops(chunks.size());
+  vector<brillo::Blob> chunk_data(chunks.size());
+  std::atomic<bool> failed{false};
+  const auto diff_chunk = [&](size_t i) {
+    auto& [old_extents_chunk, new_extents_chunk] = chunks[i];
     NormalizeExtents(&old_extents_chunk);
     NormalizeExtents(&new_extents_chunk);
 
-    // Now, insert into the list of operations.
-    AnnotatedOperation aop;
-    aop.name = new_file.name;
-    TEST_AND_RETURN_FALSE(ReadExtentsToDiff(old_part,
-                                            new_part,
-                                            old_extents_chunk,
-                                            new_extents_chunk,
-                                            old_file,
-                                            new_file,
-                                            config,
-                                            &data,
-                                            &aop));
-
+    AnnotatedOperation& aop = chunk_aops[i];
+    aop.name = name;
+    if (!ReadExtentsToDiff(old_part,
+                           new_part,
+                           old_extents_chunk,
+                           new_extents_chunk,
+                           old_file,
+                           *diffed_file,
+                           config,
+                           &chunk_data[i],
+                           &aop)) {
+      failed = true;
+    }
+  };
+  const auto store_chunk = [&](size_t i) {
+    AnnotatedOperation& aop = chunk_aops[i];
     // Check if the operation writes nothing.
     if (aop.op.dst_extents_size() == 0) {
       LOG(ERROR) << "Empty non-MOVE operation";
       return false;
     }
 
-    if (static_cast<uint64_t>(chunk_blocks) < total_blocks) {
-      aop.name = android::base::StringPrintf(
-          "%s:%" PRIu64, name.c_str(), block_offset / chunk_blocks);
+    if (chunks.size() > 1) {
+      aop.name = android::base::StringPrintf("%s:%zu", name.c_str(), i);
     }
 
     // Write the data
-    TEST_AND_RETURN_FALSE(aop.SetOperationBlob(data, blob_file));
+    TEST_AND_RETURN_FALSE(aop.SetOperationBlob(chunk_data[i], blob_file));
+    chunk_data[i] = brillo::Blob();
     aops->emplace_back(aop);
+    return true;
+  };
+
+  // The segments of a file are diffed at once on the shared threads. Fixed
+  // size chunks are diffed one after another, as the memory estimate of the
+  // file only accounts for one of them.
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (segmented && scheduler != nullptr) {
+    TaskScheduler::TaskGroup group(scheduler, true);
+    for (size_t i = 0; i < chunks.size(); i++) {
+      group.Submit(utils::BlocksInExtents(chunks[i].second),
+                   [&diff_chunk, i]() { diff_chunk(i); });
+    }
+    group.Wait();
+    TEST_AND_RETURN_FALSE(!failed);
+    for (size_t i = 0; i < chunks.size(); i++) {
+      TEST_AND_RETURN_FALSE(store_chunk(i));
+    }
+    return true;
+  }
+  for (size_t i = 0; i < chunks.size(); i++) {
+    diff_chunk(i);
+    TEST_AND_RETURN_FALSE(!failed);
+    TEST_AND_RETURN_FALSE(store_chunk(i));
   }
   return true;
 }
 
+bool IsLikelyIncompressible(const uint8_t* data, size_t size) {
+  // Too little data to tell, and cheap to compress anyway.
+  constexpr size_t kMinSize = 16 * 1024;
+  // Larger data is sampled in this many evenly spaced windows.
+  constexpr size_t kSampleWindows = 16;
+  constexpr size_t kSampleWindowSize = 64 * 1024;
+  // Bits per byte below which entropy coding alone saves space.
+  constexpr double kMaxCompressibleEntropy = 7.95;
+  // Data where at least one in |kMinMatchRatio| positions repeats earlier
+  // data is considered compressible.
+  constexpr size_t kMinMatchRatio = 64;
+  constexpr size_t kMatchTableBits = 16;
+  if (size < kMinSize)
+    return false;
+
+  vector<std::pair<size_t, size_t>> windows;
+  if (size <= kSampleWindows * kSampleWindowSize) {
+    windows.emplace_back(0, size);
+  } else {
+    const size_t stride = (size - kSampleWindowSize) / (kSampleWindows - 1);
+    for (size_t i = 0; i < kSampleWindows; i++) {
+      windows.emplace_back(i * stride, kSampleWindowSize);
+    }
+  }
+
+  uint64_t counts[256] = {};
+  size_t sampled = 0;
+  for (const auto& [offset, length] : windows) {
+    for (size_t i = offset; i < offset + length; i++) {
+      counts[data[i]]++;
+    }
+    sampled += length;
+  }
+  double entropy = 0;
+  for (uint64_t count : counts) {
+    if (count > 0) {
+      const double p = static_cast<double>(count) / sampled;
+      entropy -= p * std::log2(p);
+    }
+  }
+  if (entropy < kMaxCompressibleEntropy)
+    return false;
+
+  // Uniformly distributed bytes may still repeat, like a random block written
+  // several times. Count the positions whose next four bytes are the same as
+  // at the last position with the same hash.
+  vector<uint32_t> last_seen(1 << kMatchTableBits);
+  size_t positions = 0;
+  size_t matches = 0;
+  for (const auto& [offset, length] : windows) {
+    for (size_t i = offset; i + sizeof(uint32_t) <= offset + length; i++) {
+      uint32_t value;
+      memcpy(&value, data + i, sizeof(value));
+      uint32_t& slot =
+          last_seen[(value * 2654435761u) >> (32 - kMatchTableBits)];
+      if (slot == value) {
+        matches++;
+      }
+      slot = value;
+      positions++;
+    }
+  }
+  return matches * kMinMatchRatio < positions;
+}
+
+IncompressibleDataStats GetIncompressibleDataStats() {
+  IncompressibleDataStats stats;
+  stats.chunks = g_incompressible_stats.chunks;
+  stats.bytes = g_incompressible_stats.bytes;
+  stats.skipped_compressions = g_incompressible_stats.skipped_compressions;
+  stats.measured_chunks = g_incompressible_stats.measured_chunks;
+  stats.measured_savings = g_incompressible_stats.measured_savings;
+  return stats;
+}
+
 bool GenerateBestFullOperation(const brillo::Blob& new_data,
                                const PayloadVersion& version,
                                brillo::Blob* out_blob,
-                               InstallOperation::Type* out_type) {
+                               InstallOperation::Type* out_type,
+                               bool max_compression_effort) {
   if (new_data.empty())
     return false;
 
@@ -938,28 +1827,34 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
   }
 
   bool out_blob_set = false;
-
-  // Try compressing |new_data| with xz first.
-  if (version.OperationAllowed(InstallOperation::REPLACE_XZ)) {
-    brillo::Blob new_data_xz;
-    if (XzCompress(new_data, &new_data_xz) && !new_data_xz.empty()) {
-      *out_type = InstallOperation::REPLACE_XZ;
-      *out_blob = std::move(new_data_xz);
-      out_blob_set = true;
-    }
+  // The compressors would most likely only spend time to produce a REPLACE in
+  // the end.
+  const bool incompressible = IsLikelyIncompressible(new_data);
+  if (!incompressible || max_compression_effort) {
+    out_blob_set = CompressFullData(new_data, version, out_blob, out_type);
   }
-
-  // Try compressing it with bzip2.
-  if (version.OperationAllowed(InstallOperation::REPLACE_BZ)) {
-    brillo::Blob new_data_bz;
-    // TODO(deymo): Implement some heuristic to determine if it is worth trying
-    // to compress the blob with bzip2 if we already have a good REPLACE_XZ.
-    if (BzipCompress(new_data, &new_data_bz) && !new_data_bz.empty() &&
-        (!out_blob_set || out_blob->size() > new_data_bz.size())) {
-      // A REPLACE_BZ is better or nothing else was set.
-      *out_type = InstallOperation::REPLACE_BZ;
-      *out_blob = std::move(new_data_bz);
-      out_blob_set = true;
+  if (incompressible) {
+    const uint64_t chunk = g_incompressible_stats.chunks++;
+    g_incompressible_stats.bytes += new_data.size();
+    if (max_compression_effort) {
+      MeasureIncompressibleData(
+          new_data.size(), out_blob_set ? out_blob->size() : new_data.size());
+    } else {
+      g_incompressible_stats.skipped_compressions +=
+          version.OperationAllowed(InstallOperation::REPLACE_XZ) +
+          version.OperationAllowed(InstallOperation::REPLACE_BZ) +
+          version.OperationAllowed(InstallOperation::REPLACE_ZSTD);
+      if (chunk % kIncompressibleMeasureInterval == 0) {
+        // The result isn't used, so the payload doesn't depend on which
+        // operations happen to be measured.
+        brillo::Blob blob;
+        InstallOperation::Type type;
+        MeasureIncompressibleData(
+            new_data.size(),
+            CompressFullData(new_data, version, &blob, &type)
+                ? blob.size()
+                : new_data.size());
+      }
     }
   }
 
@@ -1040,6 +1935,79 @@ bool PopulateXorOps(AnnotatedOperation* aop, const uint8_t* data, size_t size) {
   return true;
 }
 
+void RefineXorOps(AnnotatedOperation* aop,
+                  const brillo::Blob& old_data,
+                  const brillo::Blob& new_data) {
+  // The blocks of the partitions each block of the data is at.
+  vector<uint64_t> src_blocks;
+  vector<uint64_t> dst_blocks;
+  for (const Extent& extent : aop->op.src_extents()) {
+    for (uint64_t i = 0; i < extent.num_blocks(); i++) {
+      src_blocks.push_back(extent.start_block() + i);
+    }
+  }
+  for (const Extent& extent : aop->op.dst_extents()) {
+    for (uint64_t i = 0; i < extent.num_blocks(); i++) {
+      dst_blocks.push_back(extent.start_block() + i);
+    }
+  }
+  std::unordered_map<uint64_t, uint64_t> src_index;
+  std::unordered_map<uint64_t, uint64_t> dst_index;
+  for (size_t i = 0; i < src_blocks.size(); i++) {
+    src_index.emplace(src_blocks[i], i);
+  }
+  for (size_t i = 0; i < dst_blocks.size(); i++) {
+    dst_index.emplace(dst_blocks[i], i);
+  }
+
+  // The matches bsdiff found are candidates too.
+  vector<int64_t> hints(dst_blocks.size(), kNoXorMatch);
+  for (const CowMergeOperation& op : aop->xor_ops) {
+    for (uint64_t i = 0; i < op.dst_extent().num_blocks(); i++) {
+      const auto src = src_index.find(op.src_extent().start_block() + i);
+      const auto dst = dst_index.find(op.dst_extent().start_block() + i);
+      if (src != src_index.end() && dst != dst_index.end()) {
+        hints[dst->second] = src->second * kBlockSize + op.src_offset();
+      }
+    }
+  }
+  // The device XORs with the bytes of the partition, so an unaligned match
+  // must span two contiguous blocks of the partition.
+  const auto usable = [&src_blocks](uint64_t offset) {
+    const uint64_t block = offset / kBlockSize;
+    return offset % kBlockSize == 0 || (block + 1 < src_blocks.size() &&
+                                        src_blocks[block + 1] ==
+                                            src_blocks[block] + 1);
+  };
+  const vector<int64_t> matches =
+      FindXorMatches(old_data, new_data, kBlockSize, hints, usable);
+
+  auto& xor_ops = aop->xor_ops;
+  xor_ops.clear();
+  size_t total_xor_blocks = 0;
+  for (size_t i = 0; i < matches.size(); i++) {
+    if (matches[i] == kNoXorMatch) {
+      continue;
+    }
+    AppendXorBlock(&xor_ops,
+                   src_blocks[matches[i] / kBlockSize],
+                   dst_blocks[i],
+                   matches[i] % kBlockSize);
+    total_xor_blocks++;
+  }
+  // Like in PopulateXorOps(), the extra block read by unaligned operations is
+  // part of their source.
+  for (auto& op : xor_ops) {
+    if (op.src_offset() > 0) {
+      op.mutable_src_extent()->set_num_blocks(op.dst_extent().num_blocks() + 1);
+    }
+  }
+  if (total_xor_blocks > 0) {
+    LOG(INFO) << "Kept " << total_xor_blocks << " XOR blocks of "
+              << matches.size() << " improving the COW size.";
+  }
+}
+
 bool ReadExtentsToDiff(const string& old_part,
                        const string& new_part,
                        const vector<Extent>& src_extents,
@@ -1052,6 +2020,9 @@ bool ReadExtentsToDiff(const string& old_part,
   const auto& version = config.version;
   AnnotatedOperation& aop = *out_op;
   InstallOperation& operation = aop.op;
+  const base::TimeTicks start = base::TimeTicks::Now();
+  std::vector<GenerationReport::Candidate> candidates;
+  bool budget_exceeded = false;
 
   // We read blocks from old_extents and write blocks to new_extents.
   const uint64_t blocks_to_read = utils::BlocksInExtents(src_extents);
@@ -1060,13 +2031,33 @@ bool ReadExtentsToDiff(const string& old_part,
   // All operations have dst_extents.
   StoreExtents(dst_extents, operation.mutable_dst_extents());
 
+  // Use the mappings of the images shared by all threads when possible.
+  const auto old_image =
+      blocks_to_read > 0 ? MappedFile::OpenShared(old_part) : nullptr;
+  const auto new_image = MappedFile::OpenShared(new_part);
+  if (old_image && new_image &&
+      MappedExtentsEqual(
+          *old_image, src_extents, *new_image, dst_extents, kBlockSize)) {
+    // No change in data, no need to read or compress it.
+    operation.set_type(InstallOperation::SOURCE_COPY);
+    StoreExtents(src_extents, operation.mutable_src_extents());
+    out_data->clear();
+    *out_op = aop;
+    return true;
+  }
+
   // Read in bytes from new data.
   brillo::Blob new_data;
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
-                                           dst_extents,
-                                           &new_data,
-                                           kBlockSize * blocks_to_write,
-                                           kBlockSize));
+  if (new_image) {
+    TEST_AND_RETURN_FALSE(
+        new_image->ReadExtents(dst_extents, kBlockSize, &new_data));
+  } else {
+    TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
+                                             dst_extents,
+                                             &new_data,
+                                             kBlockSize * blocks_to_write,
+                                             kBlockSize));
+  }
   TEST_AND_RETURN_FALSE(!new_data.empty());
 
   // Data blob that will be written to delta file.
@@ -1075,18 +2066,33 @@ bool ReadExtentsToDiff(const string& old_part,
   // Try generating a full operation for the given new data, regardless of the
   // old_data.
   InstallOperation::Type op_type{};
-  TEST_AND_RETURN_FALSE(
-      GenerateBestFullOperation(new_data, version, &data_blob, &op_type));
+  const base::TimeTicks full_start = base::TimeTicks::Now();
+  {
+    GenerationReport::ScopedPhase phase(config.report, "full_operation");
+    TEST_AND_RETURN_FALSE(
+        GenerateBestFullOperation(new_data,
+                                  version,
+                                  &data_blob,
+                                  &op_type,
+                                  config.max_compression_effort));
+  }
   operation.set_type(op_type);
+  candidates.push_back(
+      {op_type, data_blob.size(), base::TimeTicks::Now() - full_start});
 
   if (blocks_to_read > 0) {
     brillo::Blob old_data;
     // Read old data.
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(old_part,
-                                             src_extents,
-                                             &old_data,
-                                             kBlockSize * blocks_to_read,
-                                             kBlockSize));
+    if (old_image) {
+      TEST_AND_RETURN_FALSE(
+          old_image->ReadExtents(src_extents, kBlockSize, &old_data));
+    } else {
+      TEST_AND_RETURN_FALSE(utils::ReadExtents(old_part,
+                                               src_extents,
+                                               &old_data,
+                                               kBlockSize * blocks_to_read,
+                                               kBlockSize));
+    }
     if (old_data == new_data) {
       // No change in data.
       operation.set_type(InstallOperation::SOURCE_COPY);
@@ -1107,6 +2113,9 @@ bool ReadExtentsToDiff(const string& old_part,
         LOG(INFO) << "Failed to generate diff for " << new_file.name;
         return false;
       }
+      const auto& tried = best_diff_generator.tried_candidates();
+      candidates.insert(candidates.end(), tried.begin(), tried.end());
+      budget_exceeded = best_diff_generator.budget_exceeded();
     }
   }
 
@@ -1132,6 +2141,18 @@ bool ReadExtentsToDiff(const string& old_part,
     operation.clear_src_extents();
   }
 
+  if (config.report) {
+    config.report->AddDiff(new_part,
+                           {new_file.name,
+                            operation.type(),
+                            data_blob.size(),
+                            blocks_to_read * kBlockSize,
+                            blocks_to_write * kBlockSize,
+                            base::TimeTicks::Now() - start,
+                            std::move(candidates),
+                            budget_exceeded});
+  }
+
   *out_data = std::move(data_blob);
   *out_op = aop;
   return true;
@@ -1140,7 +2161,8 @@ bool ReadExtentsToDiff(const string& old_part,
 bool IsAReplaceOperation(InstallOperation::Type op_type) {
   return (op_type == InstallOperation::REPLACE ||
           op_type == InstallOperation::REPLACE_BZ ||
-          op_type == InstallOperation::REPLACE_XZ);
+          op_type == InstallOperation::REPLACE_XZ ||
+          op_type == InstallOperation::REPLACE_ZSTD);
 }
 
 bool IsNoSourceOperation(InstallOperation::Type op_type) {
@@ -1161,6 +2183,33 @@ bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
   return true;
 }
 
+bool AddPartitionSegmentHashes(const PartitionConfig& part,
+                               uint64_t segment_size,
+                               PartitionInfo* info) {
+  TEST_AND_RETURN_FALSE(segment_size > 0);
+  info->set_segment_size(segment_size);
+  info->clear_segment_hashes();
+  brillo::Blob data;
+  brillo::Blob hash;
+  HashCalculator digest;
+  for (uint64_t offset = 0; offset < part.size; offset += segment_size) {
+    const uint64_t size = std::min(segment_size, part.size - offset);
+    data.clear();
+    TEST_AND_RETURN_FALSE(
+        utils::ReadFileChunk(part.path, offset, size, &data));
+    TEST_AND_RETURN_FALSE(data.size() == size);
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(data, &hash));
+    info->add_segment_hashes(hash.data(), hash.size());
+    TEST_AND_RETURN_FALSE(digest.Update(hash.data(), hash.size()));
+  }
+  TEST_AND_RETURN_FALSE(digest.Finalize());
+  info->set_segment_hashes_digest(digest.raw_hash().data(),
+                                  digest.raw_hash().size());
+  LOG(INFO) << part.path << ": " << info->segment_hashes_size()
+            << " segment hashes of " << segment_size << " bytes";
+  return true;
+}
+
 bool CompareAopsByDestination(AnnotatedOperation first_aop,
                               AnnotatedOperation second_aop) {
   // We want empty operations to be at the end of the payload.
@@ -27,9 +27,12 @@
 
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/block_set.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/payload_generator/source_block_index.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -37,6 +40,15 @@ namespace chromeos_update_engine {
 namespace diff_utils {
 using File = FilesystemInterface::File;
 
+// Stores in |files| the files of |part| as found by
+// deflate_utils::PreprocessPartitionFiles(). Uses |part.files| when set, or
+// the files found the last time |part| was processed when |config| has a file
+// index cache.
+bool GetPartitionFiles(const PayloadGenerationConfig& config,
+                       const PartitionConfig& part,
+                       bool extract_deflates,
+                       std::vector<FilesystemInterface::File>* files);
+
 // Create operations in |aops| to produce all the blocks in the |new_part|
 // partition using the filesystem opened in that PartitionConfig.
 // It uses the files reported by the filesystem in |old_part| and the data
@@ -46,14 +58,17 @@ using File = FilesystemInterface::File;
 // and soft chunk limits in number of blocks respectively. The soft chunk limit
 // is used to split MOVE and SOURCE_COPY operations and REPLACE_BZ of zeroed
 // blocks, while the hard limit is used to split a file when generating other
-// operations. A value of -1 in |hard_chunk_blocks| means whole files.
+// operations. A value of -1 in |hard_chunk_blocks| means whole files. When
+// set, the blocks of |old_part| are looked up in |source_block_index|, as are
+// the new files if PARTITION_COPY is enabled, see DeltaPartitionCopyBlocks().
 bool DeltaReadPartition(std::vector<AnnotatedOperation>* aops,
                         const PartitionConfig& old_part,
                         const PartitionConfig& new_part,
                         ssize_t hard_chunk_blocks,
                         size_t soft_chunk_blocks,
                         const PayloadGenerationConfig& version,
-                        BlobFileWriter* blob_file);
+                        BlobFileWriter* blob_file,
+                        const SourceBlockIndex* source_block_index = nullptr);
 
 // Create operations in |aops| for identical blocks that moved around in the old
 // and new partition and also handle zeroed blocks. The old and new partition
@@ -64,18 +79,35 @@ bool DeltaReadPartition(std::vector<AnnotatedOperation>* aops,
 // The collections |old_visited_blocks| and |new_visited_blocks| state what
 // blocks already have operations reading or writing them and only operations
 // for unvisited blocks are produced by this function updating both collections
-// with the used blocks.
-bool DeltaMovedAndZeroBlocks(std::vector<AnnotatedOperation>* aops,
-                             const std::string& old_part,
-                             const std::string& new_part,
-                             size_t old_num_blocks,
-                             size_t new_num_blocks,
-                             ssize_t chunk_blocks,
-                             const PayloadGenerationConfig& version,
-                             BlobFileWriter* blob_file,
-                             ExtentRanges* old_visited_blocks,
-                             ExtentRanges* new_visited_blocks,
-                             ExtentRanges* old_zero_blocks);
+// with the used blocks. When |old_part| was indexed in |source_block_index|,
+// its blocks are looked up there instead of being read again.
+bool DeltaMovedAndZeroBlocks(
+    std::vector<AnnotatedOperation>* aops,
+    const std::string& old_part,
+    const std::string& new_part,
+    size_t old_num_blocks,
+    size_t new_num_blocks,
+    ssize_t chunk_blocks,
+    const PayloadGenerationConfig& version,
+    BlobFileWriter* blob_file,
+    BlockSet* old_visited_blocks,
+    BlockSet* new_visited_blocks,
+    BlockSet* old_zero_blocks,
+    const SourceBlockIndex* source_block_index = nullptr);
+
+// Create PARTITION_COPY operations in |aops| for the blocks of the files in
+// |new_files| of |new_part| found in another copy source partition of
+// |index|, if |new_part| is one too.
+// Only the files without one of the same name in |old_files| are considered,
+// as the others are diffed with it. The operations copy at most
+// kMaxPartitionCopySize bytes, from a single partition each. The blocks used
+// are added to |new_visited_blocks|, and the unvisited ones only are copied.
+bool DeltaPartitionCopyBlocks(std::vector<AnnotatedOperation>* aops,
+                              const PartitionConfig& new_part,
+                              const std::vector<File>& new_files,
+                              const std::map<std::string, File>& old_files,
+                              const SourceBlockIndex& index,
+                              BlockSet* new_visited_blocks);
 
 // For a given file |name| append operations to |aops| to produce it in the
 // |new_part|. The file will be split in chunks of |chunk_blocks| blocks each
@@ -94,6 +126,19 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    const PayloadGenerationConfig& config,
                    BlobFileWriter* blob_file);
 
+// Finds the compressed blocks of |new_file| whose compressed data is identical
+// to a compressed block of |old_file|, which don't need to be decompressed,
+// diffed and recompressed. Only blocks stored on block boundaries are matched.
+// Appends a SOURCE_COPY of them to |aops| and stores in |changed_file| the rest
+// of |new_file|, with its remaining compressed blocks. Returns whether any
+// block was found.
+bool SplitUnchangedCompressedBlocks(const std::string& old_part,
+                                    const std::string& new_part,
+                                    const File& old_file,
+                                    const File& new_file,
+                                    std::vector<AnnotatedOperation>* aops,
+                                    File* changed_file);
+
 // Reads the blocks |old_extents| from |old_part| (if it exists) and the
 // |new_extents| from |new_part| and determines the smallest way to encode
 // this |new_extents| for the diff. It stores necessary data in |out_data| and
@@ -114,14 +159,41 @@ bool ReadExtentsToDiff(const std::string& old_part,
                        brillo::Blob* out_data,
                        AnnotatedOperation* out_op);
 
+// Returns whether the |size| bytes at |data| look like they wouldn't compress,
+// which is the case when they are close to uniformly distributed and barely
+// repeat themselves. This is much cheaper than trying a compressor on them.
+bool IsLikelyIncompressible(const uint8_t* data, size_t size);
+
+inline bool IsLikelyIncompressible(const brillo::Blob& data) {
+  return IsLikelyIncompressible(data.data(), data.size());
+}
+
 // Generates the best allowed full operation to produce |new_data|. The allowed
 // operations are based on |payload_version|. The operation blob will be stored
 // in |out_blob| and the resulting operation type in |out_type|. Returns whether
-// a valid full operation was generated.
+// a valid full operation was generated. The compressors are skipped on data
+// that IsLikelyIncompressible(), unless |max_compression_effort| is set.
 bool GenerateBestFullOperation(const brillo::Blob& new_data,
                                const PayloadVersion& version,
                                brillo::Blob* out_blob,
-                               InstallOperation::Type* out_type);
+                               InstallOperation::Type* out_type,
+                               bool max_compression_effort = false);
+
+// Counters of the full operations on data that looked incompressible, over
+// all calls to GenerateBestFullOperation() in this process.
+struct IncompressibleDataStats {
+  // Number of such operations and their size in bytes.
+  uint64_t chunks = 0;
+  uint64_t bytes = 0;
+  // Number of compressor runs skipped on them.
+  uint64_t skipped_compressions = 0;
+  // Number of them the compressors ran on anyway, all of them with max
+  // compression effort and a sample otherwise, and the bytes the compressors
+  // saved over a REPLACE on those.
+  uint64_t measured_chunks = 0;
+  uint64_t measured_savings = 0;
+};
+IncompressibleDataStats GetIncompressibleDataStats();
 
 // Returns whether |op_type| is one of the REPLACE full operations.
 bool IsAReplaceOperation(InstallOperation::Type op_type);
@@ -132,6 +204,11 @@ bool IsNoSourceOperation(InstallOperation::Type op_type);
 bool InitializePartitionInfo(const PartitionConfig& partition,
                              PartitionInfo* info);
 
+// Stores the hash of every |segment_size| bytes of |partition| in |info|.
+bool AddPartitionSegmentHashes(const PartitionConfig& partition,
+                               uint64_t segment_size,
+                               PartitionInfo* info);
+
 // Compare two AnnotatedOperations by the start block of the first Extent in
 // their destination extents.
 bool CompareAopsByDestination(AnnotatedOperation first_aop,
@@ -160,6 +237,14 @@ inline bool PopulateXorOps(AnnotatedOperation* aop,
   return PopulateXorOps(aop, patch_data.data(), patch_data.size());
 }
 
+// Replaces the XOR operations of |aop| found by PopulateXorOps() with the ones
+// of the blocks FindXorMatches() finds better stored XORed, the matches of
+// bsdiff being candidates too. |old_data| and |new_data| are the data of the
+// source and destination extents of |aop|.
+void RefineXorOps(AnnotatedOperation* aop,
+                  const brillo::Blob& old_data,
+                  const brillo::Blob& new_data);
+
 // A utility class that tries different algorithms and pick the patch with the
 // smallest size.
 
@@ -210,7 +295,8 @@ class BestDiffGenerator {
 
   // Tries different algorithms and compares their patch sizes with the
   // compressed full operation data in |data_blob|. If the size is smaller,
-  // updates the operation type in |aop| and bytes in |data_blob|.
+  // updates the operation type in |aop| and bytes in |data_blob|. When called
+  // from a TaskScheduler task, the algorithms run concurrently on its threads.
   bool GenerateBestDiffOperation(AnnotatedOperation* aop,
                                  brillo::Blob* data_blob);
 
@@ -220,15 +306,49 @@ class BestDiffGenerator {
       AnnotatedOperation* aop,
       brillo::Blob* data_blob);
 
+  // The algorithms tried by GenerateBestDiffOperation(), only recorded when
+  // the config has a report.
+  const std::vector<GenerationReport::Candidate>& tried_candidates() const {
+    return tried_candidates_;
+  }
+
+  // Whether GenerateBestDiffOperation() skipped diff algorithms because the
+  // time budget of the file, see PayloadGenerationConfig, ran out.
+  bool budget_exceeded() const { return budget_exceeded_; }
+
  private:
   std::vector<bsdiff::CompressorType> GetUsableCompressorTypes() const;
-  bool TryBsdiffAndUpdateOperation(InstallOperation_Type operation_type,
-                                   AnnotatedOperation* aop,
-                                   brillo::Blob* data_blob);
-  bool TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
-                                     brillo::Blob* data_blob);
-  bool TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
-                                     brillo::Blob* data_blob);
+  // Whether the streams of BROTLI_BSDIFF patches may be compressed with zstd.
+  bool BsdiffZstdAllowed() const;
+
+  // Stores the diff of |type| in |patch|, or nothing if |type| doesn't apply
+  // to file |name|. Only reads the members, so several diffs of the same
+  // file may be generated concurrently.
+  bool GenerateDiffPatch(InstallOperation_Type type,
+                         const std::string& name,
+                         brillo::Blob* patch) const;
+  bool GenerateBsdiffPatch(InstallOperation_Type type,
+                           brillo::Blob* patch) const;
+  bool GeneratePuffdiffPatch(brillo::Blob* patch) const;
+  bool GenerateZucchiniPatch(const std::string& name,
+                             brillo::Blob* patch) const;
+
+  // Computes the key of the diff cache entry for diffing with
+  // |diff_candidates|, starting from operation |aop| with |data_size| bytes
+  // of data: the SHA-256 of all inputs the result of the Try* functions
+  // depends on.
+  bool ComputeDiffCacheKey(
+      const std::vector<std::pair<InstallOperation_Type, size_t>>&
+          diff_candidates,
+      const AnnotatedOperation& aop,
+      size_t data_size,
+      brillo::Blob* key) const;
+
+  // Makes |aop| a |type| operation with data |patch|, stored in |data_blob|.
+  void UseDiff(InstallOperation_Type type,
+               brillo::Blob patch,
+               AnnotatedOperation* aop,
+               brillo::Blob* data_blob) const;
 
   const brillo::Blob& old_data_;
   const brillo::Blob& new_data_;
@@ -239,6 +359,8 @@ class BestDiffGenerator {
   const CompressedFile& old_block_info_;
   const CompressedFile& new_block_info_;
   const PayloadGenerationConfig& config_;
+  std::vector<GenerationReport::Candidate> tried_candidates_;
+  bool budget_exceeded_ = false;
 };
 
 }  // namespace diff_utils
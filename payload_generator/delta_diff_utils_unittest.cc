@@ -17,25 +17,34 @@
 #include "update_engine/payload_generator/delta_diff_utils.h"
 
 #include <algorithm>
+#include <map>
 #include <random>
+#include <set>
 #include <string>
 #include <vector>
 
+#include <base/files/file_enumerator.h>
 #include <base/files/scoped_file.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/format_macros.h>
 #include <android-base/stringprintf.h>
+#include <base/strings/string_number_conversions.h>
 #include <bsdiff/patch_writer.h>
 #include <gtest/gtest.h>
 #include <puffin/common.h>
 
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/fake_filesystem.h"
+#include "update_engine/payload_generator/source_block_index.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 using std::string;
 using std::vector;
@@ -126,11 +135,13 @@ class DeltaDiffUtilsTest : public ::testing::Test {
 
   // Helper function to call DeltaMovedAndZeroBlocks() using this class' data
   // members. This simply avoids repeating all the arguments that never change.
-  bool RunDeltaMovedAndZeroBlocks(ssize_t chunk_blocks,
-                                  uint32_t minor_version) {
+  bool RunDeltaMovedAndZeroBlocks(
+      ssize_t chunk_blocks,
+      uint32_t minor_version,
+      const SourceBlockIndex* source_block_index = nullptr) {
     BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
     PayloadVersion version(kBrilloMajorPayloadVersion, minor_version);
-    ExtentRanges old_zero_blocks;
+    BlockSet old_zero_blocks;
     return diff_utils::DeltaMovedAndZeroBlocks(&aops_,
                                                old_part_.path,
                                                new_part_.path,
@@ -141,7 +152,8 @@ class DeltaDiffUtilsTest : public ::testing::Test {
                                                &blob_file,
                                                &old_visited_blocks_,
                                                &new_visited_blocks_,
-                                               &old_zero_blocks);
+                                               &old_zero_blocks,
+                                               source_block_index);
   }
 
   // Old and new temporary partitions used in the tests. These are initialized
@@ -159,8 +171,8 @@ class DeltaDiffUtilsTest : public ::testing::Test {
 
   // Default input/output arguments used when calling DeltaMovedAndZeroBlocks().
   vector<AnnotatedOperation> aops_;
-  ExtentRanges old_visited_blocks_;
-  ExtentRanges new_visited_blocks_;
+  BlockSet old_visited_blocks_;
+  BlockSet new_visited_blocks_;
 };
 
 TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
@@ -177,10 +189,11 @@ TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
       {.version = PayloadVersion(kMaxSupportedMajorPayloadVersion,
                                  kVerityMinorPayloadVersion)},
       &blob_file));
+  ExtentRanges written_blocks;
   for (const auto& aop : aops_) {
-    new_visited_blocks_.AddRepeatedExtents(aop.op.dst_extents());
+    written_blocks.AddRepeatedExtents(aop.op.dst_extents());
   }
-  for (const auto& extent : new_visited_blocks_.extent_set()) {
+  for (const auto& extent : written_blocks.extent_set()) {
     ASSERT_FALSE(ExtentRanges::ExtentsOverlap(
         extent, new_part_.verity.hash_tree_extent));
     ASSERT_FALSE(
@@ -188,6 +201,184 @@ TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
   }
 }
 
+TEST_F(DeltaDiffUtilsTest, UnchangedFilesAreCopiedTest) {
+  // The blocks of both partitions differ, but the hashes of the files say
+  // they didn't change, so the files are copied without diffing them.
+  InitializePartitionWithUniqueBlocks(old_part_, block_size_, 42);
+  InitializePartitionWithUniqueBlocks(new_part_, block_size_, 5);
+  File old_file;
+  old_file.name = "/moved";
+  old_file.extents = {ExtentForRange(10, 3), ExtentForRange(2, 2)};
+  old_file.data_hash = {1, 2, 3};
+  File new_file = old_file;
+  new_file.extents = {ExtentForRange(20, 5)};
+  // A file with the same name and hash but of a different size is diffed.
+  File other_old_file = old_file;
+  other_old_file.name = "/other";
+  other_old_file.extents = {ExtentForRange(30, 2)};
+  File other_new_file = other_old_file;
+  other_new_file.extents = {ExtentForRange(40, 3)};
+  old_part_.files = vector<File>{old_file, other_old_file};
+  new_part_.files = vector<File>{new_file, other_new_file};
+
+  BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+  ASSERT_TRUE(diff_utils::DeltaReadPartition(
+      &aops_,
+      old_part_,
+      new_part_,
+      2,
+      -1,
+      {.version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                 kSourceMinorPayloadVersion)},
+      &blob_file));
+  vector<AnnotatedOperation> copies;
+  for (const AnnotatedOperation& aop : aops_) {
+    if (aop.name == "/moved") {
+      copies.push_back(aop);
+    } else if (aop.name == "/other") {
+      EXPECT_NE(InstallOperation::SOURCE_COPY, aop.op.type());
+    }
+  }
+  ASSERT_EQ(3U, copies.size());
+  vector<vector<Extent>> src_extents, dst_extents;
+  for (const AnnotatedOperation& aop : copies) {
+    EXPECT_EQ(InstallOperation::SOURCE_COPY, aop.op.type());
+    src_extents.emplace_back();
+    ExtentsToVector(aop.op.src_extents(), &src_extents.back());
+    dst_extents.emplace_back();
+    ExtentsToVector(aop.op.dst_extents(), &dst_extents.back());
+  }
+  EXPECT_EQ((vector<vector<Extent>>{{ExtentForRange(10, 2)},
+                                    {ExtentForRange(12, 1),
+                                     ExtentForRange(2, 1)},
+                                    {ExtentForRange(3, 1)}}),
+            src_extents);
+  EXPECT_EQ((vector<vector<Extent>>{{ExtentForRange(20, 2)},
+                                    {ExtentForRange(22, 2)},
+                                    {ExtentForRange(24, 1)}}),
+            dst_extents);
+}
+
+TEST_F(DeltaDiffUtilsTest, DiffShardsTest) {
+  InitializePartitionWithUniqueBlocks(old_part_, block_size_, 42);
+  InitializePartitionWithUniqueBlocks(new_part_, block_size_, 5);
+  vector<File> files(3);
+  files[0].name = "/a";
+  files[0].extents = {ExtentForRange(10, 10)};
+  files[1].name = "/b";
+  files[1].extents = {ExtentForRange(30, 5)};
+  files[2].name = "/c";
+  files[2].extents = {ExtentForRange(40, 3)};
+  old_part_.files = files;
+  new_part_.files = files;
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kSourceMinorPayloadVersion)};
+  config.diff_cache_dir = cache_dir.GetPath().value();
+  config.diff_shard_count = 2;
+
+  // The 110 blocks of no file are diffed in the first shard, the files in the
+  // second one.
+  const vector<std::set<string>> expected_names = {{"<non-file-data>"},
+                                                   {"/a", "/b", "/c"}};
+  for (uint32_t shard = 0; shard < config.diff_shard_count; shard++) {
+    config.diff_shard_index = shard;
+    BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+    vector<AnnotatedOperation> aops;
+    ASSERT_TRUE(diff_utils::DeltaReadPartition(
+        &aops, old_part_, new_part_, -1, -1, config, &blob_file));
+    std::set<string> names;
+    for (const AnnotatedOperation& aop : aops)
+      names.insert(aop.name.substr(0, aop.name.find(':')));
+    EXPECT_EQ(expected_names[shard], names);
+  }
+}
+
+TEST_F(DeltaDiffUtilsTest, IsLikelyIncompressibleTest) {
+  brillo::Blob random_data(256 * 1024);
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<uint16_t> dis(0, 255);
+  for (uint8_t& byte : random_data) {
+    byte = static_cast<uint8_t>(dis(gen));
+  }
+  EXPECT_TRUE(diff_utils::IsLikelyIncompressible(random_data));
+
+  // The same random block repeated compresses well anyway.
+  brillo::Blob repeated_data(random_data.size());
+  for (size_t i = 0; i < repeated_data.size(); i++) {
+    repeated_data[i] = random_data[i % kBlockSize];
+  }
+  EXPECT_FALSE(diff_utils::IsLikelyIncompressible(repeated_data));
+
+  brillo::Blob pattern_data(random_data.size());
+  test_utils::FillWithData(&pattern_data);
+  EXPECT_FALSE(diff_utils::IsLikelyIncompressible(pattern_data));
+
+  // Small blobs are always worth trying.
+  random_data.resize(kBlockSize);
+  EXPECT_FALSE(diff_utils::IsLikelyIncompressible(random_data));
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperationSkipsCompressors) {
+  brillo::Blob random_data(256 * 1024);
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<uint16_t> dis(0, 255);
+  for (uint8_t& byte : random_data) {
+    byte = static_cast<uint8_t>(dis(gen));
+  }
+  const PayloadVersion version(kBrilloMajorPayloadVersion,
+                               kSourceMinorPayloadVersion);
+
+  for (bool max_compression_effort : {false, true}) {
+    const auto before = diff_utils::GetIncompressibleDataStats();
+    brillo::Blob blob;
+    InstallOperation::Type type;
+    ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+        random_data, version, &blob, &type, max_compression_effort));
+    EXPECT_EQ(InstallOperation::REPLACE, type);
+    EXPECT_EQ(random_data, blob);
+
+    const auto after = diff_utils::GetIncompressibleDataStats();
+    EXPECT_EQ(1U, after.chunks - before.chunks);
+    EXPECT_EQ(random_data.size(), after.bytes - before.bytes);
+    if (max_compression_effort) {
+      EXPECT_EQ(before.skipped_compressions, after.skipped_compressions);
+      EXPECT_EQ(1U, after.measured_chunks - before.measured_chunks);
+    } else {
+      // Both xz and bzip2 are allowed.
+      EXPECT_EQ(2U, after.skipped_compressions - before.skipped_compressions);
+    }
+    EXPECT_EQ(before.measured_savings, after.measured_savings);
+  }
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperationZstdTest) {
+  brillo::Blob data(256 * 1024);
+  test_utils::FillWithData(&data);
+  brillo::Blob blob;
+  InstallOperation::Type type;
+
+  // Full payloads only use zstd when allowed explicitly.
+  PayloadVersion version(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion);
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data, version, &blob, &type, false));
+  EXPECT_NE(InstallOperation::REPLACE_ZSTD, type);
+
+  version.full_zstd_allowed = true;
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data, version, &blob, &type, false));
+  EXPECT_EQ(InstallOperation::REPLACE_ZSTD, type);
+  EXPECT_LT(blob.size(), data.size());
+
+  version = PayloadVersion(kBrilloMajorPayloadVersion,
+                           kZstdMinorPayloadVersion);
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data, version, &blob, &type, false));
+  EXPECT_EQ(InstallOperation::REPLACE_ZSTD, type);
+}
+
 TEST_F(DeltaDiffUtilsTest, ReplaceSmallTest) {
   // The old file is on a different block than the new one.
   vector<Extent> old_extents = {ExtentForRange(1, 1)};
@@ -435,6 +626,139 @@ TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_FullOperationBetter) {
   ASSERT_EQ(InstallOperation::REPLACE_XZ, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_ParallelMatchesSerial) {
+  brillo::Blob dst_data_blob(4 * kBlockSize);
+  test_utils::FillWithData(&dst_data_blob);
+  brillo::Blob src_data_blob = dst_data_blob;
+  src_data_blob[0]++;
+  src_data_blob[kBlockSize * 2]++;
+  vector<Extent> old_extents = {ExtentForRange(1, 4)};
+  vector<Extent> new_extents = {ExtentForRange(8, 4)};
+
+  const FilesystemInterface::File empty;
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kZucchiniMinorPayloadVersion)};
+  auto generate = [&](AnnotatedOperation* aop, brillo::Blob* data) {
+    aop->name = "data.so";
+    aop->op.set_type(InstallOperation::REPLACE);
+    *data = dst_data_blob;
+    diff_utils::BestDiffGenerator best_diff_generator(src_data_blob,
+                                                      dst_data_blob,
+                                                      old_extents,
+                                                      new_extents,
+                                                      empty,
+                                                      empty,
+                                                      config);
+    EXPECT_TRUE(best_diff_generator.GenerateBestDiffOperation(
+        {{InstallOperation::SOURCE_BSDIFF, 1024 * 1024},
+         {InstallOperation::ZUCCHINI, 1024 * 1024}},
+        aop,
+        data));
+  };
+
+  AnnotatedOperation serial_aop;
+  brillo::Blob serial_data;
+  generate(&serial_aop, &serial_data);
+
+  AnnotatedOperation parallel_aop;
+  brillo::Blob parallel_data;
+  {
+    TaskScheduler scheduler(2);
+    TaskScheduler::TaskGroup group(&scheduler, true);
+    group.Submit(1, [&]() { generate(&parallel_aop, &parallel_data); });
+    group.Wait();
+  }
+  ASSERT_NE(InstallOperation::REPLACE, serial_aop.op.type());
+  ASSERT_EQ(serial_aop.op.type(), parallel_aop.op.type());
+  ASSERT_EQ(serial_data, parallel_data);
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_DiffsOncePerAlgorithm) {
+  brillo::Blob dst_data_blob(kBlockSize);
+  test_utils::FillWithData(&dst_data_blob);
+  brillo::Blob src_data_blob = dst_data_blob;
+  src_data_blob[0]++;
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+
+  const FilesystemInterface::File empty;
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kZucchiniMinorPayloadVersion)};
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  brillo::Blob data = dst_data_blob;
+  diff_utils::BestDiffGenerator best_diff_generator(src_data_blob,
+                                                    dst_data_blob,
+                                                    old_extents,
+                                                    new_extents,
+                                                    empty,
+                                                    empty,
+                                                    config);
+  // SOURCE_BSDIFF is promoted to BROTLI_BSDIFF, the second entry must not run
+  // bsdiff again.
+  ASSERT_TRUE(best_diff_generator.GenerateBestDiffOperation(
+      {{InstallOperation::SOURCE_BSDIFF, 1024 * 1024},
+       {InstallOperation::BROTLI_BSDIFF, 1024 * 1024}},
+      &aop,
+      &data));
+  ASSERT_EQ(InstallOperation::BROTLI_BSDIFF, aop.op.type());
+  ASSERT_FALSE(data.empty());
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_UsesDiffCache) {
+  brillo::Blob dst_data_blob(kBlockSize);
+  test_utils::FillWithData(&dst_data_blob);
+  brillo::Blob src_data_blob = dst_data_blob;
+  src_data_blob[0]++;
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  const FilesystemInterface::File empty;
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kZucchiniMinorPayloadVersion)};
+  config.diff_cache_dir = cache_dir.GetPath().value();
+  auto generate = [&](brillo::Blob* data) {
+    AnnotatedOperation aop;
+    aop.name = "data.so";
+    aop.op.set_type(InstallOperation::REPLACE);
+    *data = dst_data_blob;
+    diff_utils::BestDiffGenerator best_diff_generator(src_data_blob,
+                                                      dst_data_blob,
+                                                      old_extents,
+                                                      new_extents,
+                                                      empty,
+                                                      empty,
+                                                      config);
+    EXPECT_TRUE(best_diff_generator.GenerateBestDiffOperation(
+        {{InstallOperation::ZUCCHINI, 1024 * 1024}}, &aop, data));
+    return aop.op.type();
+  };
+
+  brillo::Blob data;
+  ASSERT_EQ(InstallOperation::ZUCCHINI, generate(&data));
+
+  // Replace the only cache entry, the next run must use it instead of
+  // diffing again.
+  base::FileEnumerator entries(
+      cache_dir.GetPath(), false, base::FileEnumerator::FILES);
+  const base::FilePath entry = entries.Next();
+  ASSERT_FALSE(entry.empty());
+  ASSERT_TRUE(entries.Next().empty());
+  brillo::Blob key;
+  ASSERT_TRUE(base::HexStringToBytes(entry.BaseName().value(), &key));
+  const brillo::Blob fake_patch = {1, 2, 3};
+  ASSERT_TRUE(DiffCache(config.diff_cache_dir)
+                  .Store(key, InstallOperation::PUFFDIFF, fake_patch));
+
+  ASSERT_EQ(InstallOperation::PUFFDIFF, generate(&data));
+  ASSERT_EQ(fake_patch, data);
+}
+
 TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
   brillo::Blob data_blob(kBlockSize);
   vector<Extent> extents = {ExtentForRange(1, 1)};
@@ -514,8 +838,10 @@ TEST_F(DeltaDiffUtilsTest, IdenticalBlocksAreCopiedFromSource) {
   expected_ranges.AddExtent(ExtentForRange(0, 50));
   expected_ranges.SubtractExtents(different_blocks);
 
-  ASSERT_EQ(expected_ranges.extent_set(), old_visited_blocks_.extent_set());
-  ASSERT_EQ(expected_ranges.extent_set(), new_visited_blocks_.extent_set());
+  const vector<Extent> expected_extents =
+      expected_ranges.GetExtentsForBlockCount(expected_ranges.blocks());
+  ASSERT_EQ(expected_extents, old_visited_blocks_.ToExtents());
+  ASSERT_EQ(expected_extents, new_visited_blocks_.ToExtents());
   ASSERT_EQ(0, blob_size_);
 
   // We expect all the blocks that we didn't override with |different_blocks|
@@ -608,14 +934,10 @@ TEST_F(DeltaDiffUtilsTest, ZeroBlocksUseReplaceBz) {
                                          kSourceMinorPayloadVersion));
 
   // Zeroed blocks from |old_visited_blocks_| were copied over.
-  ASSERT_EQ(old_zeros,
-            old_visited_blocks_.GetExtentsForBlockCount(
-                old_visited_blocks_.blocks()));
+  ASSERT_EQ(old_zeros, old_visited_blocks_.ToExtents());
 
   // All the new zeroed blocks should be used with REPLACE_BZ.
-  ASSERT_EQ(new_zeros,
-            new_visited_blocks_.GetExtentsForBlockCount(
-                new_visited_blocks_.blocks()));
+  ASSERT_EQ(new_zeros, new_visited_blocks_.ToExtents());
 
   vector<Extent> expected_op_extents = {
       ExtentForRange(10, 1),
@@ -679,6 +1001,57 @@ TEST_F(DeltaDiffUtilsTest, ShuffledBlocksAreTracked) {
   ASSERT_EQ(0, blob_size_);
 }
 
+TEST_F(DeltaDiffUtilsTest, MovedBlocksFoundInSourceBlockIndex) {
+  // The old partition has the blocks of the new one in another order, twice,
+  // and zeros.
+  const vector<uint64_t> permutation = {3, 0, 4, 1, 2};
+  vector<Extent> perm_extents;
+  for (uint64_t x : permutation)
+    AppendBlockToExtents(&perm_extents, x);
+  for (uint64_t x : permutation)
+    AppendBlockToExtents(&perm_extents, x + 8);
+  old_part_.size = block_size_ * 16;
+  new_part_.size = block_size_ * 8;
+  InitializePartitionWithUniqueBlocks(new_part_, block_size_, 123);
+  brillo::Blob new_contents;
+  ASSERT_TRUE(utils::ReadFile(new_part_.path, &new_contents));
+  new_contents.resize(permutation.size() * block_size_);
+  brillo::Blob old_contents = new_contents;
+  old_contents.insert(
+      old_contents.end(), new_contents.begin(), new_contents.end());
+  ASSERT_TRUE(
+      WriteExtents(old_part_.path, perm_extents, block_size_, old_contents));
+  ASSERT_TRUE(WriteExtents(old_part_.path,
+                           {ExtentForRange(5, 3), ExtentForRange(13, 3)},
+                           block_size_,
+                           brillo::Blob(6 * block_size_)));
+
+  SourceBlockIndex index(block_size_);
+  ASSERT_TRUE(index.AddPartition(old_part_.name, old_part_.path, false));
+  ASSERT_TRUE(index.Build(nullptr));
+  ASSERT_TRUE(RunDeltaMovedAndZeroBlocks(-1,  // chunk_blocks
+                                         kSourceMinorPayloadVersion,
+                                         &index));
+
+  // The first copy of the moved blocks is read.
+  ASSERT_EQ(1U, aops_.size());
+  const AnnotatedOperation& aop = aops_[0];
+  ASSERT_EQ(InstallOperation::SOURCE_COPY, aop.op.type());
+  vector<Extent> aop_src_extents;
+  ExtentsToVector(aop.op.src_extents(), &aop_src_extents);
+  EXPECT_EQ((vector<Extent>{ExtentForRange(3, 1),
+                            ExtentForRange(0, 1),
+                            ExtentForRange(4, 1),
+                            ExtentForRange(1, 1),
+                            ExtentForRange(2, 1)}),
+            aop_src_extents);
+  ASSERT_EQ(1, aop.op.dst_extents_size());
+  EXPECT_EQ(ExtentForRange(0, permutation.size()), aop.op.dst_extents(0));
+  EXPECT_EQ(permutation.size(), new_visited_blocks_.blocks());
+  // The zeros of the old partition are visited too.
+  EXPECT_EQ(permutation.size() + 6, old_visited_blocks_.blocks());
+}
+
 TEST_F(DeltaDiffUtilsTest, IsExtFilesystemTest) {
   ASSERT_TRUE(diff_utils::IsExtFilesystem(
       test_utils::GetBuildArtifactsPath("gen/disk_ext2_1k.img")));
@@ -729,6 +1102,33 @@ TEST_F(DeltaDiffUtilsTest, GetOldFileTest) {
   ASSERT_EQ(diff_utils::GetOldFile(old_files_map, "a").name, "filename");
 }
 
+TEST_F(DeltaDiffUtilsTest, GetPartitionFilesTest) {
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  PayloadGenerationConfig config;
+  config.file_index_cache_dir = cache_dir.GetPath().value();
+  auto* fs = static_cast<FakeFilesystem*>(new_part_.fs_interface.get());
+  fs->AddFile("/a", {ExtentForRange(0, 1)});
+
+  vector<FilesystemInterface::File> files;
+  ASSERT_TRUE(diff_utils::GetPartitionFiles(config, new_part_, false, &files));
+  ASSERT_EQ(1u, files.size());
+  ASSERT_EQ("/a", files[0].name);
+
+  // The image didn't change, so the files are found in the cache.
+  fs->AddFile("/b", {ExtentForRange(1, 1)});
+  ASSERT_TRUE(diff_utils::GetPartitionFiles(config, new_part_, false, &files));
+  ASSERT_EQ(1u, files.size());
+  ASSERT_EQ("/a", files[0].name);
+
+  // Files shared between payloads are used as they are.
+  new_part_.files.emplace(1);
+  new_part_.files->back().name = "/shared";
+  ASSERT_TRUE(diff_utils::GetPartitionFiles(config, new_part_, false, &files));
+  ASSERT_EQ(1u, files.size());
+  ASSERT_EQ("/shared", files[0].name);
+}
+
 TEST_F(DeltaDiffUtilsTest, XorOpsSourceNotAligned) {
   ScopedTempFile patch_file;
   bsdiff::BsdiffPatchWriter writer{patch_file.path()};
@@ -864,4 +1264,141 @@ TEST_F(DeltaDiffUtilsTest, FindAndCompactDeflates) {
       extents, bit_extents, &out_deflates));
 }
 
+TEST_F(DeltaDiffUtilsTest, SplitUnchangedCompressedBlocksTest) {
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(old_part_, block_size_, 42));
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(new_part_, block_size_, 5));
+  // Four compressed blocks of two blocks each, followed by a block of
+  // uncompressed data. The first and third new blocks are the third and second
+  // old ones.
+  File old_file;
+  old_file.name = "file";
+  old_file.extents = {ExtentForRange(10, 9)};
+  for (size_t i = 0; i < 4; i++) {
+    old_file.compressed_file_info.blocks.emplace_back(
+        i * 3 * block_size_, 2 * block_size_, 3 * block_size_);
+  }
+  File new_file = old_file;
+  new_file.extents = {ExtentForRange(50, 9)};
+  brillo::Blob old_data;
+  ASSERT_TRUE(utils::ReadFile(old_part_.path, &old_data));
+  const auto old_block = [&](size_t i) {
+    return brillo::Blob(old_data.begin() + (10 + 2 * i) * block_size_,
+                        old_data.begin() + (12 + 2 * i) * block_size_);
+  };
+  ASSERT_TRUE(WriteExtents(
+      new_part_.path, {ExtentForRange(50, 2)}, block_size_, old_block(2)));
+  ASSERT_TRUE(WriteExtents(
+      new_part_.path, {ExtentForRange(54, 2)}, block_size_, old_block(1)));
+
+  File changed_file;
+  ASSERT_TRUE(diff_utils::SplitUnchangedCompressedBlocks(
+      old_part_.path,
+      new_part_.path,
+      old_file,
+      new_file,
+      &aops_,
+      &changed_file));
+  ASSERT_EQ(1U, aops_.size());
+  const InstallOperation& op = aops_[0].op;
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, op.type());
+  vector<Extent> extents;
+  ExtentsToVector(op.src_extents(), &extents);
+  EXPECT_EQ((vector<Extent>{ExtentForRange(14, 2), ExtentForRange(12, 2)}),
+            extents);
+  ExtentsToVector(op.dst_extents(), &extents);
+  EXPECT_EQ((vector<Extent>{ExtentForRange(50, 2), ExtentForRange(54, 2)}),
+            extents);
+
+  EXPECT_EQ((vector<Extent>{ExtentForRange(52, 2), ExtentForRange(56, 3)}),
+            changed_file.extents);
+  const auto& blocks = changed_file.compressed_file_info.blocks;
+  ASSERT_EQ(2U, blocks.size());
+  EXPECT_EQ(0U, blocks[0].uncompressed_offset);
+  EXPECT_EQ(3 * block_size_, blocks[1].uncompressed_offset);
+  EXPECT_EQ(2 * block_size_, blocks[1].compressed_length);
+
+  // Nothing is split off files without identical blocks.
+  aops_.clear();
+  new_file.extents = {ExtentForRange(70, 9)};
+  EXPECT_FALSE(diff_utils::SplitUnchangedCompressedBlocks(
+      old_part_.path,
+      new_part_.path,
+      old_file,
+      new_file,
+      &aops_,
+      &changed_file));
+  EXPECT_TRUE(aops_.empty());
+}
+
+TEST_F(DeltaDiffUtilsTest, DeltaPartitionCopyBlocksTest) {
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(old_part_, block_size_, 42));
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(new_part_, block_size_, 42));
+  PartitionConfig other_part{"other"};
+  ScopedTempFile other_part_file{"DeltaDiffUtilsTest-other_part-XXXXXX", true};
+  CreatePartition(
+      &other_part, &other_part_file, block_size_, block_size_ * 50);
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(other_part, block_size_, 7));
+  brillo::Blob other_data;
+  ASSERT_TRUE(utils::ReadFile(other_part.path, &other_data));
+  const auto other_blocks = [&](uint64_t start, uint64_t count) {
+    return brillo::Blob(other_data.begin() + start * block_size_,
+                        other_data.begin() + (start + count) * block_size_);
+  };
+  // A new file whose first 12 blocks moved from the other partition, the last
+  // ones are in the old version of this partition. A file of the same name in
+  // the old partition is diffed with it instead.
+  ASSERT_TRUE(WriteExtents(new_part_.path,
+                           {ExtentForRange(10, 10)},
+                           block_size_,
+                           other_blocks(30, 10)));
+  ASSERT_TRUE(WriteExtents(new_part_.path,
+                           {ExtentForRange(20, 2)},
+                           block_size_,
+                           other_blocks(5, 2)));
+  ASSERT_TRUE(WriteExtents(new_part_.path,
+                           {ExtentForRange(0, 5)},
+                           block_size_,
+                           other_blocks(0, 5)));
+  File moved_file;
+  moved_file.name = "moved";
+  moved_file.extents = {ExtentForRange(10, 15)};
+  File kept_file;
+  kept_file.name = "kept";
+  kept_file.extents = {ExtentForRange(0, 5)};
+  std::map<string, File> old_files = {{"kept", kept_file}};
+
+  SourceBlockIndex index(block_size_);
+  ASSERT_TRUE(index.AddPartition(other_part.name, other_part.path, true));
+  ASSERT_TRUE(index.AddPartition(old_part_.name, old_part_.path, true));
+  ASSERT_TRUE(index.Build(nullptr));
+  ASSERT_TRUE(diff_utils::DeltaPartitionCopyBlocks(&aops_,
+                                                   new_part_,
+                                                   {kept_file, moved_file},
+                                                   old_files,
+                                                   index,
+                                                   &new_visited_blocks_));
+
+  ASSERT_EQ(1U, aops_.size());
+  const InstallOperation& op = aops_[0].op;
+  EXPECT_EQ("moved", aops_[0].name);
+  EXPECT_EQ(InstallOperation::PARTITION_COPY, op.type());
+  EXPECT_EQ("other", op.src_partition_name());
+  vector<Extent> extents;
+  ExtentsToVector(op.src_extents(), &extents);
+  EXPECT_EQ((vector<Extent>{ExtentForRange(30, 10), ExtentForRange(5, 2)}),
+            extents);
+  ExtentsToVector(op.dst_extents(), &extents);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(10, 12)}, extents);
+  brillo::Blob source_data = other_blocks(30, 10);
+  brillo::Blob more_data = other_blocks(5, 2);
+  source_data.insert(source_data.end(), more_data.begin(), more_data.end());
+  brillo::Blob source_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(source_data, &source_hash));
+  EXPECT_EQ(source_hash,
+            brillo::Blob(op.src_sha256_hash().begin(),
+                         op.src_sha256_hash().end()));
+  EXPECT_EQ(vector<Extent>{ExtentForRange(10, 12)},
+            new_visited_blocks_.ToExtents());
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,123 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <endian.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Bump the version whenever the format of the entries or the way their keys
+// are computed changes.
+constexpr char kDiffCacheMagic[] = {'U', 'E', 'D', 'C'};
+constexpr uint32_t kDiffCacheVersion = 1;
+
+// Entry header, all integers are little endian. The header is followed by
+// the patch, |patch_hash| is its SHA-256.
+struct __attribute__((packed)) DiffCacheHeader {
+  char magic[sizeof(kDiffCacheMagic)];
+  uint32_t version;
+  uint32_t type;
+  uint8_t patch_hash[32];
+};
+}  // namespace
+
+std::string DiffCache::PathForKey(const brillo::Blob& key) const {
+  return base::FilePath(dir_).Append(HexEncode(key)).value();
+}
+
+bool DiffCache::Lookup(const brillo::Blob& key,
+                       InstallOperation::Type* type,
+                       brillo::Blob* patch) const {
+  const std::string path = PathForKey(key);
+  brillo::Blob entry;
+  if (!base::PathExists(base::FilePath(path)) ||
+      !utils::ReadFile(path, &entry)) {
+    return false;
+  }
+  DiffCacheHeader header;
+  if (entry.size() < sizeof(header)) {
+    LOG(WARNING) << "Ignoring truncated diff cache entry " << path;
+    return false;
+  }
+  memcpy(&header, entry.data(), sizeof(header));
+  if (memcmp(header.magic, kDiffCacheMagic, sizeof(kDiffCacheMagic)) != 0 ||
+      le32toh(header.version) != kDiffCacheVersion ||
+      !InstallOperation::Type_IsValid(le32toh(header.type))) {
+    LOG(WARNING) << "Ignoring invalid diff cache entry " << path;
+    return false;
+  }
+  brillo::Blob data(entry.begin() + sizeof(header), entry.end());
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(data, &hash));
+  if (hash.size() != sizeof(header.patch_hash) ||
+      memcmp(hash.data(), header.patch_hash, hash.size()) != 0) {
+    LOG(WARNING) << "Ignoring corrupted diff cache entry " << path;
+    return false;
+  }
+  *type = static_cast<InstallOperation::Type>(le32toh(header.type));
+  *patch = std::move(data);
+  return true;
+}
+
+bool DiffCache::Store(const brillo::Blob& key,
+                      InstallOperation::Type type,
+                      const brillo::Blob& patch) const {
+  DiffCacheHeader header;
+  memcpy(header.magic, kDiffCacheMagic, sizeof(kDiffCacheMagic));
+  header.version = htole32(kDiffCacheVersion);
+  header.type = htole32(static_cast<uint32_t>(type));
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(patch, &hash));
+  TEST_AND_RETURN_FALSE(hash.size() == sizeof(header.patch_hash));
+  std::copy(hash.begin(), hash.end(), header.patch_hash);
+
+  brillo::Blob entry(sizeof(header));
+  memcpy(entry.data(), &header, sizeof(header));
+  entry.insert(entry.end(), patch.begin(), patch.end());
+
+  base::FilePath temp_path;
+  TEST_AND_RETURN_FALSE(
+      base::CreateTemporaryFileInDir(base::FilePath(dir_), &temp_path));
+  if (!utils::WriteFile(
+          temp_path.value().c_str(), entry.data(), entry.size())) {
+    unlink(temp_path.value().c_str());
+    return false;
+  }
+  const std::string path = PathForKey(key);
+  if (rename(temp_path.value().c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Unable to move diff cache entry to " << path;
+    unlink(temp_path.value().c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,61 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+
+#include <string>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A content addressed store of diff results on disk, so a payload generated
+// again from the same images doesn't have to run the diff algorithms again.
+// Every entry lives in its own file named after the hex encoded |key|, the
+// SHA-256 of everything the result depends on. Entries are written to a
+// temporary file first and renamed into place, so several generators may
+// share a cache directory.
+class DiffCache {
+ public:
+  explicit DiffCache(const std::string& dir) : dir_(dir) {}
+
+  // Reads the entry for |key| into |type| and |patch|. Returns false if
+  // there is no such entry or it is corrupted.
+  bool Lookup(const brillo::Blob& key,
+              InstallOperation::Type* type,
+              brillo::Blob* patch) const;
+
+  // Stores |type| and |patch| as the entry for |key|, replacing any existing
+  // entry.
+  bool Store(const brillo::Blob& key,
+             InstallOperation::Type type,
+             const brillo::Blob& patch) const;
+
+ private:
+  std::string PathForKey(const brillo::Blob& key) const;
+
+  const std::string dir_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
@@ -0,0 +1,95 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <memory>
+#include <string>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class DiffCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    cache_ = std::make_unique<DiffCache>(temp_dir_.GetPath().value());
+    ASSERT_TRUE(HashCalculator::RawHashOfData({1, 2, 3}, &key_));
+    patch_.resize(1000);
+    test_utils::FillWithData(&patch_);
+  }
+
+  std::string EntryPath() const {
+    return temp_dir_.GetPath().Append(HexEncode(key_)).value();
+  }
+
+  base::ScopedTempDir temp_dir_;
+  std::unique_ptr<DiffCache> cache_;
+  brillo::Blob key_;
+  brillo::Blob patch_;
+};
+
+TEST_F(DiffCacheTest, StoreAndLookup) {
+  ASSERT_TRUE(cache_->Store(key_, InstallOperation::PUFFDIFF, patch_));
+
+  InstallOperation::Type type{};
+  brillo::Blob patch;
+  ASSERT_TRUE(cache_->Lookup(key_, &type, &patch));
+  ASSERT_EQ(InstallOperation::PUFFDIFF, type);
+  ASSERT_EQ(patch_, patch);
+}
+
+TEST_F(DiffCacheTest, StoreReplacesEntry) {
+  ASSERT_TRUE(cache_->Store(key_, InstallOperation::PUFFDIFF, patch_));
+  ASSERT_TRUE(cache_->Store(key_, InstallOperation::REPLACE_XZ, {}));
+
+  InstallOperation::Type type{};
+  brillo::Blob patch;
+  ASSERT_TRUE(cache_->Lookup(key_, &type, &patch));
+  ASSERT_EQ(InstallOperation::REPLACE_XZ, type);
+  ASSERT_TRUE(patch.empty());
+}
+
+TEST_F(DiffCacheTest, MissingEntry) {
+  InstallOperation::Type type{};
+  brillo::Blob patch;
+  ASSERT_FALSE(cache_->Lookup(key_, &type, &patch));
+}
+
+TEST_F(DiffCacheTest, CorruptedEntryIsIgnored) {
+  ASSERT_TRUE(cache_->Store(key_, InstallOperation::PUFFDIFF, patch_));
+  brillo::Blob entry;
+  ASSERT_TRUE(utils::ReadFile(EntryPath(), &entry));
+  entry.back()++;
+  ASSERT_TRUE(
+      utils::WriteFile(EntryPath().c_str(), entry.data(), entry.size()));
+
+  InstallOperation::Type type{};
+  brillo::Blob patch;
+  ASSERT_FALSE(cache_->Lookup(key_, &type, &patch));
+
+  // Truncated entries are ignored as well.
+  ASSERT_TRUE(utils::WriteFile(EntryPath().c_str(), entry.data(), 10));
+  ASSERT_FALSE(cache_->Lookup(key_, &type, &patch));
+}
+
+}  // namespace chromeos_update_engine
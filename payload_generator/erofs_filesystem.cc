@@ -20,9 +20,13 @@
 #include <fcntl.h>
 #include <time.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <mutex>
+#include <utility>
 
 #include <android-base/unique_fd.h>
 #include <erofs/dir.h>
@@ -35,9 +39,11 @@
 #include "lz4diff/lz4patch.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 namespace chromeos_update_engine {
 
@@ -217,49 +223,16 @@ bool ErofsFilesystem::GetFiles(struct erofs_sb_info* sbi,
                                const std::string& filename,
                                std::vector<File>* files,
                                const CompressionAlgorithm& algo) {
-  size_t unaligned_bytes = 0;
-  const auto block_size = 1UL << sbi->blkszbits;
+  // The directory tree is walked on this thread, the inodes of the regular
+  // files it lists are then read and mapped in parallel. The mappings of
+  // different inodes only share the read-only superblock.
+  std::vector<std::pair<std::string, erofs_nid_t>> entries;
   const auto err = erofs_iterate_root_dir(
       sbi, [&](struct erofs_iterate_dir_context* p_info) {
         const auto& info = *p_info;
-        if (info.ctx.de_ftype != EROFS_FT_REG_FILE) {
-          return 0;
-        }
-        struct erofs_inode inode {};
-        inode.nid = info.ctx.de_nid;
-        inode.sbi = sbi;
-        int err = erofs_read_inode_from_disk(&inode);
-        if (err) {
-          LOG(ERROR) << "Failed to read inode " << inode.nid;
-          return err;
-        }
-        const auto uncompressed_size = inode.i_size;
-        erofs_off_t compressed_size = 0;
-        if (uncompressed_size == 0) {
-          return 0;
+        if (info.ctx.de_ftype == EROFS_FT_REG_FILE) {
+          entries.emplace_back(info.path, info.ctx.de_nid);
         }
-        err = GetOccupiedSize(&inode, block_size, &compressed_size);
-        if (err) {
-          LOG(FATAL) << "Failed to get occupied size for " << filename;
-          return err;
-        }
-        // For EROFS_INODE_FLAT_INLINE , most blocks are stored on aligned
-        // addresses. Except the last block, which is stored right after the
-        // inode. These nodes will have a slight amount of data unaligned, which
-        // is fine.
-
-        File file;
-        file.name = info.path;
-        file.compressed_file_info.zero_padding_enabled =
-            erofs_sb_has_lz4_0padding(sbi);
-        file.is_compressed = compressed_size != uncompressed_size;
-
-        file.file_stat.st_size = uncompressed_size;
-        file.file_stat.st_ino = inode.nid;
-        FillExtentInfo(&file, filename, &inode, &unaligned_bytes);
-        file.compressed_file_info.algo = algo;
-
-        files->emplace_back(std::move(file));
         return 0;
       });
   if (err) {
@@ -267,8 +240,85 @@ bool ErofsFilesystem::GetFiles(struct erofs_sb_info* sbi,
     return false;
   }
 
-  for (auto& file : *files) {
-    NormalizeExtents(&file.extents);
+  const auto block_size = 1UL << sbi->blkszbits;
+  // Returns false if the inode couldn't be read, leaves |file| empty if the
+  // file is.
+  auto read_file = [&](size_t index, File* file, size_t* unaligned_bytes) {
+    struct erofs_inode inode {};
+    inode.nid = entries[index].second;
+    inode.sbi = sbi;
+    if (erofs_read_inode_from_disk(&inode)) {
+      LOG(ERROR) << "Failed to read inode " << inode.nid;
+      return false;
+    }
+    const auto uncompressed_size = inode.i_size;
+    erofs_off_t compressed_size = 0;
+    if (uncompressed_size == 0) {
+      return true;
+    }
+    if (GetOccupiedSize(&inode, block_size, &compressed_size)) {
+      LOG(FATAL) << "Failed to get occupied size for " << filename;
+      return false;
+    }
+    // For EROFS_INODE_FLAT_INLINE , most blocks are stored on aligned
+    // addresses. Except the last block, which is stored right after the
+    // inode. These nodes will have a slight amount of data unaligned, which
+    // is fine.
+
+    file->name = entries[index].first;
+    file->compressed_file_info.zero_padding_enabled =
+        erofs_sb_has_lz4_0padding(sbi);
+    file->is_compressed = compressed_size != uncompressed_size;
+
+    file->file_stat.st_size = uncompressed_size;
+    file->file_stat.st_ino = inode.nid;
+    FillExtentInfo(file, filename, &inode, unaligned_bytes);
+    file->compressed_file_info.algo = algo;
+    NormalizeExtents(&file->extents);
+    return true;
+  };
+
+  // When called from a TaskScheduler task, e.g. while generating a payload,
+  // the inodes are read on its threads.
+  std::unique_ptr<TaskScheduler> own_scheduler;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler == nullptr) {
+    own_scheduler =
+        std::make_unique<TaskScheduler>(diff_utils::GetMaxThreads());
+    scheduler = own_scheduler.get();
+  }
+  // Every task fills the files of a range of entries, so |files| keeps the
+  // order of the walk.
+  std::vector<File> entry_files(entries.size());
+  std::atomic<size_t> unaligned_bytes{0};
+  std::atomic<bool> failed{false};
+  {
+    TaskScheduler::TaskGroup group(scheduler, false);
+    const size_t range_entries = std::max<size_t>(
+        1, entries.size() / (scheduler->num_threads() * 4) + 1);
+    for (size_t start = 0; start < entries.size(); start += range_entries) {
+      const size_t end = std::min(entries.size(), start + range_entries);
+      group.Submit(end - start, [&, start, end]() {
+        size_t range_unaligned_bytes = 0;
+        for (size_t i = start; i < end && !failed; i++) {
+          if (!read_file(i, &entry_files[i], &range_unaligned_bytes)) {
+            failed = true;
+          }
+        }
+        unaligned_bytes += range_unaligned_bytes;
+      });
+    }
+    group.Wait();
+  }
+  if (failed) {
+    LOG(ERROR) << "EROFS files iteration failed";
+    return false;
+  }
+
+  for (auto& file : entry_files) {
+    if (!file.name.empty()) {
+      files->emplace_back(std::move(file));
+    }
   }
   LOG(INFO) << "EROFS image " << filename << " has " << unaligned_bytes
             << " unaligned bytes, which is "
@@ -52,6 +52,8 @@ class ErofsFilesystem final : public FilesystemInterface {
   //    space.
   //  <metadata>: With the rest of ext2 metadata blocks, such as superblocks
   //    and bitmap tables.
+  // The inodes of the files are read in parallel, on the current TaskScheduler
+  // if any, the files are returned in the order of the directory walk.
   static bool GetFiles(struct erofs_sb_info* sbi,
                        const std::string& filename,
                        std::vector<File>* files,
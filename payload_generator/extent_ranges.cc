@@ -130,9 +130,8 @@ void ExtentRanges::SubtractExtent(const Extent& extent) {
   ExtentSet::iterator end_del = extent_set_.end();
   uint64_t del_blocks = 0;
   ExtentSet new_extents;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e;
-       ++it) {
+  const auto range = GetCandidateRange(extent);
+  for (ExtentSet::iterator it = range.begin(), e = range.end(); it != e; ++it) {
     if (!ExtentsOverlap(*it, extent))
       continue;
 
@@ -156,23 +155,94 @@ void ExtentRanges::SubtractExtent(const Extent& extent) {
   blocks_ -= del_blocks;
 }
 
+bool ExtentRanges::ShouldMergeRanges(const ExtentRanges& ranges) const {
+  return ranges.extent_set_.size() * kMergeRangesFactor >= extent_set_.size();
+}
+
 void ExtentRanges::AddRanges(const ExtentRanges& ranges) {
-  // Remember to respect |merge_touching_extents_| setting
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-                                 e = ranges.extent_set_.end();
-       it != e;
-       ++it) {
-    AddExtent(*it);
+  if (!ShouldMergeRanges(ranges)) {
+    // Remember to respect |merge_touching_extents_| setting
+    for (const Extent& extent : ranges.extent_set_) {
+      AddExtent(extent);
+    }
+    return;
+  }
+  // Both sets are sorted, so walk them at once and join each extent with the
+  // following ones it should be merged with, like AddExtent() would.
+  ExtentSet result;
+  uint64_t blocks = 0;
+  auto it = extent_set_.begin();
+  auto other_it = ranges.extent_set_.begin();
+  auto next = [&]() -> const Extent& {
+    if (other_it == ranges.extent_set_.end() ||
+        (it != extent_set_.end() && ExtentLess()(*it, *other_it))) {
+      return *it++;
+    }
+    return *other_it++;
+  };
+  if (it == extent_set_.end() && other_it == ranges.extent_set_.end()) {
+    return;
   }
+  Extent current = next();
+  while (it != extent_set_.end() || other_it != ranges.extent_set_.end()) {
+    const Extent& extent = next();
+    const bool should_merge = merge_touching_extents_
+                                  ? ExtentsOverlapOrTouch(current, extent)
+                                  : ExtentsOverlap(current, extent);
+    if (should_merge) {
+      current = UnionOverlappingExtents(current, extent);
+    } else {
+      blocks += current.num_blocks();
+      result.insert(result.end(), current);
+      current = extent;
+    }
+  }
+  blocks += current.num_blocks();
+  result.insert(result.end(), current);
+  extent_set_ = std::move(result);
+  blocks_ = blocks;
 }
 
 void ExtentRanges::SubtractRanges(const ExtentRanges& ranges) {
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-                                 e = ranges.extent_set_.end();
-       it != e;
-       ++it) {
-    SubtractExtent(*it);
+  if (!ShouldMergeRanges(ranges)) {
+    for (const Extent& extent : ranges.extent_set_) {
+      SubtractExtent(extent);
+    }
+    return;
+  }
+  // Both sets are sorted and their extents don't overlap, so walk them at
+  // once keeping the parts of each extent no subtracted extent covers.
+  ExtentSet result;
+  uint64_t blocks = 0;
+  auto add = [&result, &blocks](uint64_t start, uint64_t end) {
+    result.insert(result.end(), ExtentForRange(start, end - start));
+    blocks += end - start;
+  };
+  auto other_it = ranges.extent_set_.begin();
+  const auto other_end = ranges.extent_set_.end();
+  for (const Extent& extent : extent_set_) {
+    uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    while (other_it != other_end &&
+           other_it->start_block() + other_it->num_blocks() <= start) {
+      ++other_it;
+    }
+    // A subtracted extent reaching past |end| may cut the next extent too, so
+    // don't move past it.
+    for (auto it = other_it; start < end && it != other_end &&
+                             it->start_block() < end;
+         ++it) {
+      if (it->start_block() > start) {
+        add(start, it->start_block());
+      }
+      start = std::max(start, it->start_block() + it->num_blocks());
+    }
+    if (start < end) {
+      add(start, end);
+    }
   }
+  extent_set_ = std::move(result);
+  blocks_ = blocks;
 }
 
 void ExtentRanges::AddExtents(const vector<Extent>& extents) {
@@ -99,6 +99,12 @@ class ExtentRanges {
       const Extent& extent) const;
 
  private:
+  // AddRanges() and SubtractRanges() walk both sets at once instead of adding
+  // or subtracting extents one by one when |ranges| has at least one extent
+  // for every |kMergeRangesFactor| extents of this set.
+  static constexpr size_t kMergeRangesFactor = 16;
+  bool ShouldMergeRanges(const ExtentRanges& ranges) const;
+
   ExtentSet extent_set_;
   uint64_t blocks_ = 0;
   bool merge_touching_extents_ = true;
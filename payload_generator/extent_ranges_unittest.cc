@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_generator/extent_ranges.h"
 
+#include <random>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -405,6 +406,54 @@ TEST(ExtentRangesTest, AddExtentNoMergeStressTest) {
   ASSERT_EQ(ranges.extent_set().size(), 200000UL) << ranges.extent_set();
 }
 
+TEST(ExtentRangesTest, SubtractExtentStressTest) {
+  ExtentRanges ranges(true);
+  for (size_t i = 0; i < 200000; i++) {
+    ranges.AddExtent(ExtentForRange(i * 2, 1));
+  }
+  for (size_t i = 0; i < 200000; i += 2) {
+    ranges.SubtractExtent(ExtentForRange(i * 2, 1));
+  }
+  ASSERT_EQ(ranges.extent_set().size(), 100000UL);
+  ASSERT_EQ(ranges.blocks(), 100000UL);
+}
+
+TEST(ExtentRangesTest, MergedRangesMatchExtentByExtent) {
+  // Sets of similar sizes are added and subtracted by walking both at once,
+  // which must give the same result as going through the extents one by one.
+  for (bool merge_touching_extents : {true, false}) {
+    for (unsigned int seed = 0; seed < 20; seed++) {
+      std::mt19937 gen(seed);
+      std::uniform_int_distribution<uint64_t> start(0, 500);
+      std::uniform_int_distribution<uint64_t> length(1, 8);
+      ExtentRanges ranges(merge_touching_extents);
+      ExtentRanges other(merge_touching_extents);
+      for (size_t i = 0; i < 50; i++) {
+        ranges.AddExtent(ExtentForRange(start(gen), length(gen)));
+        other.AddExtent(ExtentForRange(start(gen), length(gen)));
+      }
+
+      ExtentRanges expected = ranges;
+      for (const Extent& extent : other.extent_set()) {
+        expected.AddExtent(extent);
+      }
+      ExtentRanges merged = ranges;
+      merged.AddRanges(other);
+      EXPECT_EQ(expected.extent_set(), merged.extent_set());
+      EXPECT_EQ(expected.blocks(), merged.blocks());
+
+      expected = ranges;
+      for (const Extent& extent : other.extent_set()) {
+        expected.SubtractExtent(extent);
+      }
+      ExtentRanges subtracted = ranges;
+      subtracted.SubtractRanges(other);
+      EXPECT_EQ(expected.extent_set(), subtracted.extent_set());
+      EXPECT_EQ(expected.blocks(), subtracted.blocks());
+    }
+  }
+}
+
 TEST(ExtentRangesTest, AddExtentTouching) {
   ExtentRanges ranges(true);
   ranges.AddExtent(ExtentForRange(5, 5));
@@ -0,0 +1,328 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_index_cache.h"
+
+#include <endian.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Bump the version whenever the format of the entries, the way their keys are
+// computed or the files returned by PreprocessPartitionFiles() change.
+constexpr char kFileIndexMagic[] = {'U', 'E', 'F', 'I'};
+constexpr uint32_t kFileIndexVersion = 2;
+
+// Entry header, all integers are little endian. The header is followed by
+// |num_files| file records, |data_hash| is the SHA-256 of all of them.
+struct __attribute__((packed)) FileIndexHeader {
+  char magic[sizeof(kFileIndexMagic)];
+  uint32_t version;
+  uint64_t num_files;
+  uint8_t data_hash[32];
+};
+
+// Serializes file records as a sequence of little endian 64 bit integers and
+// length prefixed strings.
+class RecordWriter {
+ public:
+  explicit RecordWriter(brillo::Blob* out) : out_(out) {}
+
+  void Write(uint64_t value) {
+    value = htole64(value);
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out_->insert(out_->end(), bytes, bytes + sizeof(value));
+  }
+
+  void Write(const string& str) {
+    Write(str.size());
+    out_->insert(out_->end(), str.begin(), str.end());
+  }
+
+ private:
+  brillo::Blob* out_;
+};
+
+class RecordReader {
+ public:
+  RecordReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  bool Read(uint64_t* value) {
+    TEST_AND_RETURN_FALSE(size_ - pos_ >= sizeof(*value));
+    memcpy(value, data_ + pos_, sizeof(*value));
+    *value = le64toh(*value);
+    pos_ += sizeof(*value);
+    return true;
+  }
+
+  bool Read(string* str) {
+    uint64_t length{};
+    TEST_AND_RETURN_FALSE(Read(&length));
+    TEST_AND_RETURN_FALSE(size_ - pos_ >= length);
+    str->assign(reinterpret_cast<const char*>(data_ + pos_), length);
+    pos_ += length;
+    return true;
+  }
+
+  // Reads a count of items each made of |item_size| integers, fails early on
+  // counts larger than the remaining data.
+  bool ReadCount(size_t item_size, uint64_t* count) {
+    TEST_AND_RETURN_FALSE(Read(count));
+    TEST_AND_RETURN_FALSE(*count <= (size_ - pos_) / sizeof(uint64_t) /
+                                         std::max<size_t>(item_size, 1));
+    return true;
+  }
+
+  bool AtEnd() const { return pos_ == size_; }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t pos_{0};
+};
+
+void WriteFileRecord(const FilesystemInterface::File& file,
+                     RecordWriter* writer) {
+  writer->Write(file.name);
+  const struct stat& st = file.file_stat;
+  for (uint64_t value : {static_cast<uint64_t>(st.st_ino),
+                         static_cast<uint64_t>(st.st_mode),
+                         static_cast<uint64_t>(st.st_nlink),
+                         static_cast<uint64_t>(st.st_uid),
+                         static_cast<uint64_t>(st.st_gid),
+                         static_cast<uint64_t>(st.st_size),
+                         static_cast<uint64_t>(st.st_blksize),
+                         static_cast<uint64_t>(st.st_blocks),
+                         static_cast<uint64_t>(st.st_atime),
+                         static_cast<uint64_t>(st.st_mtime),
+                         static_cast<uint64_t>(st.st_ctime)}) {
+    writer->Write(value);
+  }
+  writer->Write(file.is_compressed);
+  writer->Write(file.extents.size());
+  for (const Extent& extent : file.extents) {
+    writer->Write(extent.start_block());
+    writer->Write(extent.num_blocks());
+  }
+  writer->Write(file.deflates.size());
+  for (const puffin::BitExtent& deflate : file.deflates) {
+    writer->Write(deflate.offset);
+    writer->Write(deflate.length);
+  }
+  const CompressedFile& info = file.compressed_file_info;
+  writer->Write(info.blocks.size());
+  for (const CompressedBlock& block : info.blocks) {
+    writer->Write(block.uncompressed_offset);
+    writer->Write(block.compressed_length);
+    writer->Write(block.uncompressed_length);
+  }
+  writer->Write(info.algo.type());
+  writer->Write(static_cast<uint32_t>(info.algo.level()));
+  writer->Write(info.zero_padding_enabled);
+  writer->Write(string(file.data_hash.begin(), file.data_hash.end()));
+}
+
+bool ReadFileRecord(RecordReader* reader, FilesystemInterface::File* file) {
+  TEST_AND_RETURN_FALSE(reader->Read(&file->name));
+  uint64_t values[11];
+  for (uint64_t& value : values) {
+    TEST_AND_RETURN_FALSE(reader->Read(&value));
+  }
+  struct stat& st = file->file_stat;
+  st.st_ino = values[0];
+  st.st_mode = values[1];
+  st.st_nlink = values[2];
+  st.st_uid = values[3];
+  st.st_gid = values[4];
+  st.st_size = values[5];
+  st.st_blksize = values[6];
+  st.st_blocks = values[7];
+  st.st_atime = values[8];
+  st.st_mtime = values[9];
+  st.st_ctime = values[10];
+
+  uint64_t value{};
+  TEST_AND_RETURN_FALSE(reader->Read(&value));
+  file->is_compressed = value != 0;
+
+  uint64_t count{};
+  TEST_AND_RETURN_FALSE(reader->ReadCount(2, &count));
+  file->extents.resize(count);
+  for (Extent& extent : file->extents) {
+    uint64_t start_block{}, num_blocks{};
+    TEST_AND_RETURN_FALSE(reader->Read(&start_block));
+    TEST_AND_RETURN_FALSE(reader->Read(&num_blocks));
+    extent.set_start_block(start_block);
+    extent.set_num_blocks(num_blocks);
+  }
+  TEST_AND_RETURN_FALSE(reader->ReadCount(2, &count));
+  file->deflates.resize(count);
+  for (puffin::BitExtent& deflate : file->deflates) {
+    TEST_AND_RETURN_FALSE(reader->Read(&deflate.offset));
+    TEST_AND_RETURN_FALSE(reader->Read(&deflate.length));
+  }
+  CompressedFile& info = file->compressed_file_info;
+  TEST_AND_RETURN_FALSE(reader->ReadCount(3, &count));
+  info.blocks.resize(count);
+  for (CompressedBlock& block : info.blocks) {
+    TEST_AND_RETURN_FALSE(reader->Read(&block.uncompressed_offset));
+    TEST_AND_RETURN_FALSE(reader->Read(&block.compressed_length));
+    TEST_AND_RETURN_FALSE(reader->Read(&block.uncompressed_length));
+  }
+  TEST_AND_RETURN_FALSE(reader->Read(&value));
+  TEST_AND_RETURN_FALSE(CompressionAlgorithm::Type_IsValid(value));
+  info.algo.set_type(static_cast<CompressionAlgorithm::Type>(value));
+  TEST_AND_RETURN_FALSE(reader->Read(&value));
+  info.algo.set_level(static_cast<int32_t>(value));
+  TEST_AND_RETURN_FALSE(reader->Read(&value));
+  info.zero_padding_enabled = value != 0;
+  string data_hash;
+  TEST_AND_RETURN_FALSE(reader->Read(&data_hash));
+  file->data_hash.assign(data_hash.begin(), data_hash.end());
+  return true;
+}
+}  // namespace
+
+bool FileIndexCache::ComputeKey(const PartitionConfig& part,
+                                bool extract_deflates,
+                                brillo::Blob* key) {
+  brillo::Blob key_data;
+  RecordWriter writer(&key_data);
+  writer.Write(string(kFileIndexMagic, sizeof(kFileIndexMagic)));
+  writer.Write(kFileIndexVersion);
+  writer.Write(part.name);
+  writer.Write(part.size);
+  writer.Write(extract_deflates);
+  writer.Write(part.erofs_compression_param.SerializeAsString());
+
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfFile(
+                            part.path, part.size, &hash) ==
+                        static_cast<off_t>(part.size));
+  writer.Write(string(hash.begin(), hash.end()));
+  // The mapfile is only used when the image has no known filesystem, but
+  // then the files come from it instead of the image.
+  string mapfile;
+  if (!part.mapfile_path.empty()) {
+    TEST_AND_RETURN_FALSE(utils::ReadFile(part.mapfile_path, &mapfile));
+  }
+  writer.Write(mapfile);
+  return HashCalculator::RawHashOfData(key_data, key);
+}
+
+string FileIndexCache::PathForKey(const brillo::Blob& key) const {
+  return base::FilePath(dir_).Append(HexEncode(key)).value();
+}
+
+bool FileIndexCache::Lookup(const brillo::Blob& key,
+                            vector<FilesystemInterface::File>* files) const {
+  const string path = PathForKey(key);
+  brillo::Blob entry;
+  if (!base::PathExists(base::FilePath(path)) ||
+      !utils::ReadFile(path, &entry)) {
+    return false;
+  }
+  FileIndexHeader header;
+  if (entry.size() < sizeof(header)) {
+    LOG(WARNING) << "Ignoring truncated file index cache entry " << path;
+    return false;
+  }
+  memcpy(&header, entry.data(), sizeof(header));
+  if (memcmp(header.magic, kFileIndexMagic, sizeof(kFileIndexMagic)) != 0 ||
+      le32toh(header.version) != kFileIndexVersion) {
+    LOG(WARNING) << "Ignoring invalid file index cache entry " << path;
+    return false;
+  }
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+      entry.data() + sizeof(header), entry.size() - sizeof(header), &hash));
+  if (hash.size() != sizeof(header.data_hash) ||
+      memcmp(hash.data(), header.data_hash, hash.size()) != 0) {
+    LOG(WARNING) << "Ignoring corrupted file index cache entry " << path;
+    return false;
+  }
+
+  RecordReader reader(entry.data() + sizeof(header),
+                      entry.size() - sizeof(header));
+  vector<FilesystemInterface::File> result(le64toh(header.num_files));
+  for (FilesystemInterface::File& file : result) {
+    if (!ReadFileRecord(&reader, &file)) {
+      LOG(WARNING) << "Ignoring malformed file index cache entry " << path;
+      return false;
+    }
+  }
+  if (!reader.AtEnd()) {
+    LOG(WARNING) << "Ignoring malformed file index cache entry " << path;
+    return false;
+  }
+  *files = std::move(result);
+  return true;
+}
+
+bool FileIndexCache::Store(
+    const brillo::Blob& key,
+    const vector<FilesystemInterface::File>& files) const {
+  brillo::Blob entry(sizeof(FileIndexHeader));
+  RecordWriter writer(&entry);
+  for (const FilesystemInterface::File& file : files) {
+    WriteFileRecord(file, &writer);
+  }
+
+  FileIndexHeader header;
+  memcpy(header.magic, kFileIndexMagic, sizeof(kFileIndexMagic));
+  header.version = htole32(kFileIndexVersion);
+  header.num_files = htole64(files.size());
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+      entry.data() + sizeof(header), entry.size() - sizeof(header), &hash));
+  TEST_AND_RETURN_FALSE(hash.size() == sizeof(header.data_hash));
+  std::copy(hash.begin(), hash.end(), header.data_hash);
+  memcpy(entry.data(), &header, sizeof(header));
+
+  base::FilePath temp_path;
+  TEST_AND_RETURN_FALSE(
+      base::CreateTemporaryFileInDir(base::FilePath(dir_), &temp_path));
+  if (!utils::WriteFile(
+          temp_path.value().c_str(), entry.data(), entry.size())) {
+    unlink(temp_path.value().c_str());
+    return false;
+  }
+  const string path = PathForKey(key);
+  if (rename(temp_path.value().c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Unable to move file index cache entry to " << path;
+    unlink(temp_path.value().c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
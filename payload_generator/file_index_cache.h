@@ -0,0 +1,66 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_INDEX_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_INDEX_CACHE_H_
+
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+
+namespace chromeos_update_engine {
+
+// A store on disk of the files found in partition images, with their extents,
+// deflates, compressed blocks and hashes, so the filesystem of an image diffed
+// against several source images is only parsed, scanned for deflates and
+// hashed once. Entries are laid out like those of DiffCache: one file per
+// image named after the hex encoded key, written to a temporary file first and
+// renamed into place.
+class FileIndexCache {
+ public:
+  explicit FileIndexCache(const std::string& dir) : dir_(dir) {}
+
+  // Computes in |key| the SHA-256 of the contents of |part| and of everything
+  // else deflate_utils::PreprocessPartitionFiles() depends on.
+  static bool ComputeKey(const PartitionConfig& part,
+                         bool extract_deflates,
+                         brillo::Blob* key);
+
+  // Reads the files of the entry for |key| into |files|. Returns false if
+  // there is no such entry or it is corrupted.
+  bool Lookup(const brillo::Blob& key,
+              std::vector<FilesystemInterface::File>* files) const;
+
+  // Stores |files| as the entry for |key|, replacing any existing entry.
+  bool Store(const brillo::Blob& key,
+             const std::vector<FilesystemInterface::File>& files) const;
+
+ private:
+  std::string PathForKey(const brillo::Blob& key) const;
+
+  const std::string dir_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileIndexCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_INDEX_CACHE_H_
@@ -0,0 +1,147 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_index_cache.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class FileIndexCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    cache_ = std::make_unique<FileIndexCache>(temp_dir_.GetPath().value());
+    ASSERT_TRUE(HashCalculator::RawHashOfData({1, 2, 3}, &key_));
+
+    FilesystemInterface::File metadata;
+    metadata.name = "<metadata>";
+    metadata.extents = {ExtentForRange(0, 2)};
+    files_.push_back(metadata);
+
+    FilesystemInterface::File apk;
+    apk.name = "/app/foo.apk";
+    apk.file_stat.st_ino = 12;
+    apk.file_stat.st_mode = S_IFREG | 0644;
+    apk.file_stat.st_size = 5000;
+    apk.extents = {ExtentForRange(10, 1), ExtentForRange(4, 1)};
+    apk.deflates = {{100, 2000}, {3000, 800}};
+    apk.compressed_file_info.blocks = {{0, 4096, 8192}, {8192, 100, 100}};
+    apk.compressed_file_info.algo.set_type(CompressionAlgorithm::LZ4HC);
+    apk.compressed_file_info.algo.set_level(-1);
+    apk.compressed_file_info.zero_padding_enabled = true;
+    ASSERT_TRUE(HashCalculator::RawHashOfData({4, 5, 6}, &apk.data_hash));
+    files_.push_back(apk);
+  }
+
+  std::string EntryPath() const {
+    return temp_dir_.GetPath().Append(HexEncode(key_)).value();
+  }
+
+  base::ScopedTempDir temp_dir_;
+  std::unique_ptr<FileIndexCache> cache_;
+  brillo::Blob key_;
+  vector<FilesystemInterface::File> files_;
+};
+
+TEST_F(FileIndexCacheTest, StoreAndLookup) {
+  ASSERT_TRUE(cache_->Store(key_, files_));
+
+  vector<FilesystemInterface::File> files;
+  ASSERT_TRUE(cache_->Lookup(key_, &files));
+  ASSERT_EQ(files_.size(), files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    ASSERT_EQ(files_[i].name, files[i].name);
+    ASSERT_EQ(files_[i].file_stat.st_ino, files[i].file_stat.st_ino);
+    ASSERT_EQ(files_[i].file_stat.st_mode, files[i].file_stat.st_mode);
+    ASSERT_EQ(files_[i].file_stat.st_size, files[i].file_stat.st_size);
+    ASSERT_EQ(files_[i].extents, files[i].extents);
+    ASSERT_EQ(files_[i].deflates, files[i].deflates);
+    const auto& expected_info = files_[i].compressed_file_info;
+    const auto& info = files[i].compressed_file_info;
+    ASSERT_EQ(expected_info.blocks.size(), info.blocks.size());
+    for (size_t j = 0; j < info.blocks.size(); j++) {
+      ASSERT_EQ(expected_info.blocks[j].uncompressed_offset,
+                info.blocks[j].uncompressed_offset);
+      ASSERT_EQ(expected_info.blocks[j].compressed_length,
+                info.blocks[j].compressed_length);
+      ASSERT_EQ(expected_info.blocks[j].uncompressed_length,
+                info.blocks[j].uncompressed_length);
+    }
+    ASSERT_EQ(expected_info.algo.type(), info.algo.type());
+    ASSERT_EQ(expected_info.algo.level(), info.algo.level());
+    ASSERT_EQ(expected_info.zero_padding_enabled, info.zero_padding_enabled);
+    ASSERT_EQ(files_[i].data_hash, files[i].data_hash);
+  }
+}
+
+TEST_F(FileIndexCacheTest, MissingEntry) {
+  vector<FilesystemInterface::File> files;
+  ASSERT_FALSE(cache_->Lookup(key_, &files));
+}
+
+TEST_F(FileIndexCacheTest, CorruptedEntryIsIgnored) {
+  ASSERT_TRUE(cache_->Store(key_, files_));
+  brillo::Blob entry;
+  ASSERT_TRUE(utils::ReadFile(EntryPath(), &entry));
+  entry.back()++;
+  ASSERT_TRUE(
+      utils::WriteFile(EntryPath().c_str(), entry.data(), entry.size()));
+
+  vector<FilesystemInterface::File> files;
+  ASSERT_FALSE(cache_->Lookup(key_, &files));
+
+  // Truncated entries are ignored as well.
+  ASSERT_TRUE(utils::WriteFile(EntryPath().c_str(), entry.data(), 10));
+  ASSERT_FALSE(cache_->Lookup(key_, &files));
+}
+
+TEST_F(FileIndexCacheTest, KeyDependsOnImageAndOptions) {
+  ScopedTempFile image("FileIndexCacheTest_image.XXXXXX");
+  brillo::Blob data(4096 * 4);
+  test_utils::FillWithData(&data);
+  ASSERT_TRUE(test_utils::WriteFileVector(image.path(), data));
+  PartitionConfig part("system");
+  part.path = image.path();
+  part.size = data.size();
+
+  brillo::Blob key, other_key;
+  ASSERT_TRUE(FileIndexCache::ComputeKey(part, true, &key));
+  ASSERT_TRUE(FileIndexCache::ComputeKey(part, true, &other_key));
+  ASSERT_EQ(key, other_key);
+
+  ASSERT_TRUE(FileIndexCache::ComputeKey(part, false, &other_key));
+  ASSERT_NE(key, other_key);
+
+  data[100]++;
+  ASSERT_TRUE(test_utils::WriteFileVector(image.path(), data));
+  ASSERT_TRUE(FileIndexCache::ComputeKey(part, true, &other_key));
+  ASSERT_NE(key, other_key);
+}
+
+}  // namespace chromeos_update_engine
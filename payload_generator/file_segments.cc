@@ -0,0 +1,152 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_segments.h"
+
+#include <algorithm>
+#include <array>
+#include <unordered_map>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The rolling hash is a gear hash: every byte shifts the hash left by one bit
+// and adds a random value of the byte, so the hash only depends on the last
+// |kWindowSize| bytes.
+constexpr uint64_t kWindowSize = 64;
+
+constexpr std::array<uint64_t, 256> MakeGearTable() {
+  // splitmix64, so the table is the same on every build.
+  std::array<uint64_t, 256> table{};
+  uint64_t state = 0;
+  for (auto& value : table) {
+    state += 0x9e3779b97f4a7c15ULL;
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    value = z ^ (z >> 31);
+  }
+  return table;
+}
+
+constexpr std::array<uint64_t, 256> kGearTable = MakeGearTable();
+}  // namespace
+
+vector<SegmentBoundary> FindSegmentBoundaries(const MappedFile& image,
+                                              const vector<Extent>& extents,
+                                              size_t block_size,
+                                              uint64_t min_blocks,
+                                              uint64_t max_blocks) {
+  CHECK_GT(min_blocks, 0U);
+  CHECK_LE(min_blocks, max_blocks);
+  CHECK_GE(block_size, kWindowSize);
+  vector<SegmentBoundary> boundaries = {{0, 0}};
+  const uint64_t min_bytes = min_blocks * block_size;
+  const uint64_t max_bytes = max_blocks * block_size;
+  // A segment ends after a byte where the top |bits| bits of the hash, which
+  // depend on all the bytes of the window, are 0. Past the minimum size, that
+  // is expected every 2^|bits| bytes, at most a quarter of the way to the
+  // maximum size, so few segments are cut at the maximum size.
+  uint64_t bits = 1;
+  while ((8ULL << bits) <= max_bytes - min_bytes && bits < 63) {
+    bits++;
+  }
+  const uint64_t mask = ~0ULL << (64 - bits);
+
+  uint64_t hash = 0;
+  uint64_t segment_start = 0;
+  // The offset in the file of the current extent.
+  uint64_t extent_offset = 0;
+  for (const Extent& extent : extents) {
+    if (!image.Contains(extent, block_size)) {
+      LOG(WARNING) << "Extent " << extent << " is out of bounds, not splitting";
+      return {{0, 0}};
+    }
+    const uint8_t* data = image.data() + extent.start_block() * block_size;
+    const uint64_t size = extent.num_blocks() * block_size;
+    for (uint64_t i = 0; i < size; i++) {
+      // The bytes before the window ending at the minimum size don't matter.
+      const uint64_t hash_start = segment_start + min_bytes - kWindowSize;
+      if (extent_offset + i < hash_start) {
+        i = std::min(size, hash_start - extent_offset) - 1;
+        continue;
+      }
+      hash = (hash << 1) + kGearTable[data[i]];
+      const uint64_t end = extent_offset + i + 1;
+      if (end - segment_start < min_bytes) {
+        continue;
+      }
+      const bool found = (hash & mask) == 0;
+      if (found || end - segment_start >= max_bytes) {
+        // The segment rounded down to whole blocks is still at least the
+        // minimum size, as it started on a block.
+        boundaries.push_back({end / block_size, found ? hash : 0});
+        segment_start = boundaries.back().block * block_size;
+        hash = 0;
+      }
+    }
+    extent_offset += size;
+  }
+  return boundaries;
+}
+
+vector<std::pair<uint64_t, uint64_t>> MatchSegments(
+    const vector<SegmentBoundary>& old_boundaries,
+    uint64_t old_blocks,
+    const vector<SegmentBoundary>& new_boundaries,
+    uint64_t new_blocks) {
+  std::unordered_map<uint64_t, uint64_t> old_blocks_by_hash;
+  for (const auto& boundary : old_boundaries) {
+    if (boundary.hash != 0) {
+      old_blocks_by_hash.emplace(boundary.hash, boundary.block);
+    }
+  }
+  // Returns the old block of the boundary with the same data as |boundary|,
+  // or |fallback|.
+  const auto find_old_block = [&](const SegmentBoundary& boundary,
+                                  uint64_t fallback) {
+    const auto it = old_blocks_by_hash.find(boundary.hash);
+    return boundary.hash != 0 && it != old_blocks_by_hash.end() ? it->second
+                                                                : fallback;
+  };
+
+  vector<std::pair<uint64_t, uint64_t>> old_ranges;
+  for (size_t i = 0; i < new_boundaries.size(); i++) {
+    const uint64_t start = new_boundaries[i].block;
+    const uint64_t end = i + 1 < new_boundaries.size()
+                             ? new_boundaries[i + 1].block
+                             : new_blocks;
+    const uint64_t old_start =
+        i == 0 ? 0 : find_old_block(new_boundaries[i], start);
+    uint64_t old_end = i + 1 < new_boundaries.size()
+                           ? find_old_block(new_boundaries[i + 1], 0)
+                           : old_blocks;
+    if (old_end <= old_start) {
+      old_end = old_start + (end - start);
+    }
+    old_ranges.emplace_back(old_start, old_end - old_start);
+  }
+  return old_ranges;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,64 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SEGMENTS_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SEGMENTS_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "update_engine/payload_generator/mapped_file.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// The start of a segment of a file split by FindSegmentBoundaries().
+struct SegmentBoundary {
+  // The first block of the segment, relative to the file.
+  uint64_t block;
+  // The rolling hash of the data right before |block| that ended the previous
+  // segment. 0 for the first segment and when the previous segment ended for
+  // reaching the maximum size.
+  uint64_t hash;
+};
+
+// Splits the data of |extents| in |image| in segments of |min_blocks| to
+// |max_blocks| blocks of |block_size| bytes, the last one may be shorter. The
+// segments end where a rolling hash of the data matches a pattern, so they
+// only depend on the data nearby: an insertion or removal only moves the
+// boundaries around it and the same data is split alike in another file.
+// The first boundary returned is at block 0.
+std::vector<SegmentBoundary> FindSegmentBoundaries(
+    const MappedFile& image,
+    const std::vector<Extent>& extents,
+    size_t block_size,
+    uint64_t min_blocks,
+    uint64_t max_blocks);
+
+// Returns for every segment of |new_boundaries| the range of blocks of the old
+// file, split in |old_boundaries|, with the same data at its ends, as the
+// first block and the number of blocks. Without such a range, the new segment
+// uses the old blocks at the same offset. |old_blocks| and |new_blocks| are the
+// sizes of the files.
+std::vector<std::pair<uint64_t, uint64_t>> MatchSegments(
+    const std::vector<SegmentBoundary>& old_boundaries,
+    uint64_t old_blocks,
+    const std::vector<SegmentBoundary>& new_boundaries,
+    uint64_t new_blocks);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SEGMENTS_H_
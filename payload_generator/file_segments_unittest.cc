@@ -0,0 +1,153 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_segments.h"
+
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class FileSegmentsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_data_.resize(kBlocks * kBlockSize);
+    std::mt19937 gen(1234);
+    std::uniform_int_distribution<uint16_t> dis(0, 255);
+    for (auto& byte : old_data_) {
+      byte = dis(gen);
+    }
+    // Blocks inserted in the middle.
+    new_data_ = old_data_;
+    brillo::Blob inserted(kInsertedBlocks * kBlockSize);
+    for (auto& byte : inserted) {
+      byte = dis(gen);
+    }
+    new_data_.insert(new_data_.begin() + kInsertedAt * kBlockSize,
+                     inserted.begin(),
+                     inserted.end());
+    ASSERT_TRUE(test_utils::WriteFileVector(old_file_.path(), old_data_));
+    ASSERT_TRUE(test_utils::WriteFileVector(new_file_.path(), new_data_));
+    ASSERT_TRUE(old_image_.Map(old_file_.path(), old_data_.size()));
+    ASSERT_TRUE(new_image_.Map(new_file_.path(), new_data_.size()));
+  }
+
+  vector<SegmentBoundary> Split(const MappedFile& image) {
+    return FindSegmentBoundaries(image,
+                                 {ExtentForRange(0, image.size() / kBlockSize)},
+                                 kBlockSize,
+                                 kMinBlocks,
+                                 kMaxBlocks);
+  }
+
+  static constexpr size_t kBlockSize = 1024;
+  static constexpr uint64_t kBlocks = 400;
+  static constexpr uint64_t kMinBlocks = 4;
+  static constexpr uint64_t kMaxBlocks = 16;
+  static constexpr uint64_t kInsertedAt = 150;
+  static constexpr uint64_t kInsertedBlocks = 5;
+
+  ScopedTempFile old_file_{"FileSegmentsTest-old.XXXXXX"};
+  ScopedTempFile new_file_{"FileSegmentsTest-new.XXXXXX"};
+  brillo::Blob old_data_;
+  brillo::Blob new_data_;
+  MappedFile old_image_;
+  MappedFile new_image_;
+};
+
+TEST_F(FileSegmentsTest, SegmentSizesTest) {
+  const auto boundaries = Split(old_image_);
+  ASSERT_GT(boundaries.size(), kBlocks / kMaxBlocks);
+  EXPECT_EQ(0U, boundaries[0].block);
+  EXPECT_EQ(0U, boundaries[0].hash);
+  for (size_t i = 1; i < boundaries.size(); i++) {
+    const uint64_t size = boundaries[i].block - boundaries[i - 1].block;
+    EXPECT_GE(size, kMinBlocks);
+    EXPECT_LE(size, kMaxBlocks);
+  }
+  EXPECT_LE(kBlocks - boundaries.back().block, kMaxBlocks);
+}
+
+TEST_F(FileSegmentsTest, SplitAcrossExtentsTest) {
+  // The same data stored in two extents is split alike.
+  ASSERT_TRUE(test_utils::WriteFileVector(new_file_.path(), old_data_));
+  MappedFile image;
+  ASSERT_TRUE(image.Map(new_file_.path(), old_data_.size()));
+  const auto boundaries =
+      FindSegmentBoundaries(image,
+                            {ExtentForRange(0, 101), ExtentForRange(101, 299)},
+                            kBlockSize,
+                            kMinBlocks,
+                            kMaxBlocks);
+  const auto expected = Split(old_image_);
+  ASSERT_EQ(expected.size(), boundaries.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].block, boundaries[i].block);
+    EXPECT_EQ(expected[i].hash, boundaries[i].hash);
+  }
+}
+
+TEST_F(FileSegmentsTest, MatchSegmentsAfterInsertionTest) {
+  const auto old_boundaries = Split(old_image_);
+  const auto new_boundaries = Split(new_image_);
+  const auto old_ranges = MatchSegments(old_boundaries,
+                                        kBlocks,
+                                        new_boundaries,
+                                        kBlocks + kInsertedBlocks);
+  ASSERT_EQ(new_boundaries.size(), old_ranges.size());
+  EXPECT_EQ(0U, old_ranges[0].first);
+
+  // The segments before the insertion use the same blocks of the old file.
+  // Once the boundaries after it get in sync with the old ones again, the
+  // segments use the old blocks with the same data.
+  size_t matched_after = 0;
+  for (size_t i = 0; i + 1 < new_boundaries.size(); i++) {
+    const uint64_t start = new_boundaries[i].block;
+    const uint64_t size = new_boundaries[i + 1].block - start;
+    if (start + size <= kInsertedAt) {
+      EXPECT_EQ(std::make_pair(start, size), old_ranges[i]);
+    } else if (start >= kInsertedAt + kInsertedBlocks &&
+               old_ranges[i].first != start) {
+      EXPECT_EQ(std::make_pair(start - kInsertedBlocks, size), old_ranges[i]);
+      matched_after++;
+    }
+  }
+  EXPECT_GT(matched_after, 0U);
+  EXPECT_EQ(kBlocks, old_ranges.back().first + old_ranges.back().second);
+}
+
+TEST_F(FileSegmentsTest, MatchSegmentsWithoutOldFileTest) {
+  const auto new_boundaries = Split(new_image_);
+  const auto old_ranges =
+      MatchSegments({}, 0, new_boundaries, kBlocks + kInsertedBlocks);
+  ASSERT_EQ(new_boundaries.size(), old_ranges.size());
+  for (size_t i = 0; i + 1 < new_boundaries.size(); i++) {
+    EXPECT_EQ(new_boundaries[i].block, old_ranges[i].first);
+    EXPECT_EQ(new_boundaries[i + 1].block - new_boundaries[i].block,
+              old_ranges[i].second);
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -31,6 +31,7 @@
 #include <string>
 #include <vector>
 
+#include <brillo/secure_blob.h>
 #include <puffin/utils.h>
 
 #include "update_engine/lz4diff/lz4diff_format.h"
@@ -74,6 +75,10 @@ class FilesystemInterface {
     std::vector<puffin::BitExtent> deflates;
 
     CompressedFile compressed_file_info;
+
+    // The SHA-256 of the data in |extents|, whole blocks included, or empty if
+    // unknown. Computed by deflate_utils::PreprocessPartitionFiles().
+    brillo::Blob data_hash;
   };
 
   virtual ~FilesystemInterface() = default;
@@ -20,17 +20,21 @@
 #include <inttypes.h>
 
 #include <algorithm>
-#include <deque>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <utility>
 
 #include <base/format_macros.h>
 #include <android-base/stringprintf.h>
-#include <base/synchronization/lock.h>
-#include <base/threading/simple_thread.h>
 #include <brillo/secure_blob.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/mapped_file.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 using std::vector;
 
@@ -39,74 +43,263 @@ namespace chromeos_update_engine {
 namespace {
 
 const size_t kDefaultFullChunkSize = 1024 * 1024;  // 1 MiB
+// Number of chunks per thread read but not stored yet.
+const size_t kChunksInFlightPerThread = 2;
 
-// This class encapsulates a full update chunk processing thread work. The
-// processor reads a chunk of data from the input file descriptor and compresses
-// it. The processor will destroy itself when the work is done.
-class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
+// With an apply cost model, the partition is sampled in regions of this size,
+// which is also the smallest chunk.
+const size_t kAdaptiveRegionSize = 256 * 1024;  // 256 KiB
+// Number of regions sampled by each task.
+const size_t kRegionsPerTask = 64;
+// The largest chunk with an apply cost model, which bounds the memory used
+// by the chunks in flight.
+const size_t kMaxAdaptiveChunkSize = 16 * 1024 * 1024;  // 16 MiB
+// Small partitions are split in at least this many chunks so they are
+// compressed on several threads.
+const size_t kMinAdaptiveChunks = 4;
+
+// Compresses the chunks of a partition, each one described by the
+// preset destination extent of its operation. The tasks processing the chunks
+// read them one at a time and in order, so the partition is read sequentially
+// instead of by all threads at random offsets. The blobs are stored in chunk
+// order too. At most |window| chunks are read but not stored yet, which bounds
+// the memory used by chunks waiting for a slower earlier one.
+class ChunkPipeline {
  public:
-  // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
-  ChunkProcessor(const PayloadVersion& version,
-                 int fd,
-                 off_t offset,
-                 size_t size,
-                 BlobFileWriter* blob_file,
-                 AnnotatedOperation* aop)
+  ChunkPipeline(const PayloadVersion& version,
+                bool max_compression_effort,
+                int fd,
+                size_t block_size,
+                size_t window,
+                BlobFileWriter* blob_file,
+                vector<AnnotatedOperation>* aops)
       : version_(version),
+        max_compression_effort_(max_compression_effort),
         fd_(fd),
-        offset_(offset),
-        size_(size),
+        block_size_(block_size),
+        window_(std::max<size_t>(window, 1)),
         blob_file_(blob_file),
-        aop_(aop) {}
-  // We use a default move constructor since all the data members are POD types.
-  ChunkProcessor(ChunkProcessor&&) = default;
-  ~ChunkProcessor() override = default;
-
-  // Overrides DelegateSimpleThread::Delegate.
-  // Run() handles the read from |fd| in a thread-safe way, and stores the
-  // new operation to generate the region starting at |offset| of size |size|
-  // in the output operation |aop|. The associated blob data is stored in
-  // |blob_fd| and |blob_file_size| is updated.
-  void Run() override;
+        aops_(aops) {}
+
+  // Reads, compresses and stores the next chunk. Must be called once per
+  // chunk, from any thread.
+  void ProcessNextChunk();
 
  private:
-  bool ProcessChunk();
+  struct Chunk {
+    InstallOperation::Type type;
+    brillo::Blob blob;
+  };
+
+  // Waits for room in the window and reads the next chunk into |data|. Sets
+  // |index| to the chunk read. Returns false on error or if a previous chunk
+  // failed.
+  bool ReadNextChunk(size_t* index, brillo::Blob* data);
+
+  // Queues |chunk| for the |index|-th operation and stores the blobs of the
+  // queued chunks whose predecessors are stored. Returns false on error.
+  bool StoreChunk(size_t index, Chunk chunk);
+
+  // Stops the pipeline, the remaining operations are left without a type.
+  void Fail();
 
   // Work parameters.
   const PayloadVersion& version_;
-  int fd_;
-  off_t offset_;
-  size_t size_;
+  const bool max_compression_effort_;
+  const int fd_;
+  const size_t block_size_;
+  const size_t window_;
   BlobFileWriter* blob_file_;
-  AnnotatedOperation* aop_;
+  vector<AnnotatedOperation>* aops_;
 
-  DISALLOW_COPY_AND_ASSIGN(ChunkProcessor);
+  // Held while reading a chunk so the chunks are read in order.
+  std::mutex read_mutex_;
+
+  std::mutex mutex_;
+  // Signalled when a chunk is stored or the pipeline failed.
+  std::condition_variable stored_cv_;
+  // Index of the next chunk to read.
+  size_t next_read_{0};
+  // Index of the next chunk to store.
+  size_t next_store_{0};
+  // Compressed chunks waiting for an earlier chunk to be stored.
+  std::map<size_t, Chunk> pending_;
+  // Whether a thread is storing the pending chunks.
+  bool storing_{false};
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkPipeline);
 };
 
-void ChunkProcessor::Run() {
-  if (!ProcessChunk()) {
-    LOG(ERROR) << "Error processing region at " << offset_ << " of size "
-               << size_;
+void ChunkPipeline::ProcessNextChunk() {
+  size_t index;
+  brillo::Blob data;
+  if (!ReadNextChunk(&index, &data)) {
+    Fail();
+    return;
+  }
+  Chunk chunk;
+  if (!diff_utils::GenerateBestFullOperation(data,
+                                             version_,
+                                             &chunk.blob,
+                                             &chunk.type,
+                                             max_compression_effort_)) {
+    LOG(ERROR) << "Error compressing chunk " << index;
+    Fail();
+    return;
+  }
+  // Release the chunk before waiting for the earlier ones to be stored.
+  data = brillo::Blob();
+  if (!StoreChunk(index, std::move(chunk))) {
+    Fail();
   }
 }
 
-bool ChunkProcessor::ProcessChunk() {
-  brillo::Blob buffer_in_(size_);
-  brillo::Blob op_blob;
+bool ChunkPipeline::ReadNextChunk(size_t* index, brillo::Blob* data) {
+  std::lock_guard<std::mutex> read_lock(read_mutex_);
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stored_cv_.wait(lock, [this] {
+      return failed_ || next_read_ < next_store_ + window_;
+    });
+    TEST_AND_RETURN_FALSE(!failed_);
+    TEST_AND_RETURN_FALSE(next_read_ < aops_->size());
+    *index = next_read_++;
+  }
+  const Extent& extent = (*aops_)[*index].op.dst_extents(0);
+  data->resize(extent.num_blocks() * block_size_);
   ssize_t bytes_read = -1;
-  TEST_AND_RETURN_FALSE(utils::PReadAll(
-      fd_, buffer_in_.data(), buffer_in_.size(), offset_, &bytes_read));
-  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size_));
-
-  InstallOperation::Type op_type;
-  TEST_AND_RETURN_FALSE(diff_utils::GenerateBestFullOperation(
-      buffer_in_, version_, &op_blob, &op_type));
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd_,
+                      data->data(),
+                      data->size(),
+                      static_cast<off_t>(extent.start_block()) * block_size_,
+                      &bytes_read));
+  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(data->size()));
+  return true;
+}
 
-  aop_->op.set_type(op_type);
-  TEST_AND_RETURN_FALSE(aop_->SetOperationBlob(op_blob, blob_file_));
+bool ChunkPipeline::StoreChunk(size_t index, Chunk chunk) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  pending_.emplace(index, std::move(chunk));
+  // Only one thread stores at a time, so the blobs are stored in order. It
+  // doesn't hold |mutex_| meanwhile, other chunks still get queued.
+  if (storing_) {
+    return true;
+  }
+  storing_ = true;
+  while (!failed_ && !pending_.empty() &&
+         pending_.begin()->first == next_store_) {
+    auto node = pending_.extract(pending_.begin());
+    lock.unlock();
+    AnnotatedOperation* aop = &(*aops_)[node.key()];
+    aop->op.set_type(node.mapped().type);
+    const bool stored = aop->SetOperationBlob(node.mapped().blob, blob_file_);
+    lock.lock();
+    if (!stored) {
+      aop->op.clear_type();
+      storing_ = false;
+      return false;
+    }
+    next_store_++;
+    stored_cv_.notify_all();
+  }
+  storing_ = false;
   return true;
 }
 
+void ChunkPipeline::Fail() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = true;
+    pending_.clear();
+  }
+  stored_cv_.notify_all();
+}
+
+// Splits the first |partition_blocks| blocks of |image| in chunks costing
+// about the target operation cost of |cost_model| to apply, and at most
+// |max_chunk_size| bytes. Regions which look incompressible are only copied by
+// the device, so they are split in larger chunks than the others, which it
+// decompresses. The regions are sampled on the threads of |scheduler|.
+vector<Extent> AdaptiveChunks(const MappedFile& image,
+                              size_t block_size,
+                              size_t partition_blocks,
+                              const ApplyCostModel& cost_model,
+                              size_t max_chunk_size,
+                              TaskScheduler* scheduler) {
+  const size_t region_blocks = kAdaptiveRegionSize / block_size;
+  const size_t num_regions = utils::DivRoundUp(partition_blocks, region_blocks);
+  vector<uint8_t> incompressible(num_regions);
+  {
+    TaskScheduler::TaskGroup regions(scheduler, false);
+    for (size_t first = 0; first < num_regions; first += kRegionsPerTask) {
+      const size_t last = std::min(first + kRegionsPerTask, num_regions);
+      regions.Submit((last - first) * region_blocks, [&, first, last]() {
+        for (size_t region = first; region < last; region++) {
+          const size_t start_block = region * region_blocks;
+          const size_t num_blocks =
+              std::min(region_blocks, partition_blocks - start_block);
+          incompressible[region] = diff_utils::IsLikelyIncompressible(
+              image.data() + start_block * block_size, num_blocks * block_size);
+        }
+      });
+    }
+    regions.Wait();
+  }
+
+  // The largest chunks of each kind within the target cost.
+  const size_t max_blocks =
+      std::min(max_chunk_size, kMaxAdaptiveChunkSize) / block_size;
+  const size_t min_blocks = std::min(region_blocks, max_blocks);
+  const size_t partition_max_blocks = std::max(
+      min_blocks, std::min(max_blocks, partition_blocks / kMinAdaptiveChunks));
+  const auto chunk_blocks = [&](double cost_per_mib) {
+    double blocks = max_blocks;
+    if (cost_per_mib > 0) {
+      const double budget =
+          cost_model.target_operation_cost - cost_model.operation_cost;
+      blocks = std::clamp(budget / cost_per_mib * 1024 * 1024 / block_size,
+                          0.0,
+                          static_cast<double>(max_blocks));
+    }
+    return std::min(std::max(static_cast<size_t>(blocks), min_blocks),
+                    partition_max_blocks);
+  };
+  const size_t copied_chunk_blocks = chunk_blocks(cost_model.copy_cost_per_mib);
+  const size_t decompressed_chunk_blocks =
+      chunk_blocks(cost_model.decompress_cost_per_mib);
+
+  // Runs of regions of the same kind are split in chunks of even size.
+  vector<Extent> chunks;
+  size_t incompressible_blocks = 0;
+  for (size_t region = 0; region < num_regions;) {
+    size_t end = region + 1;
+    while (end < num_regions && incompressible[end] == incompressible[region])
+      end++;
+    const size_t start_block = region * region_blocks;
+    const size_t run_blocks =
+        std::min(end * region_blocks, partition_blocks) - start_block;
+    if (incompressible[region])
+      incompressible_blocks += run_blocks;
+    const size_t num_chunks = utils::DivRoundUp(
+        run_blocks,
+        incompressible[region] ? copied_chunk_blocks
+                               : decompressed_chunk_blocks);
+    for (size_t i = 0; i < num_chunks; i++) {
+      const size_t first = run_blocks * i / num_chunks;
+      const size_t last = run_blocks * (i + 1) / num_chunks;
+      chunks.push_back(ExtentForRange(start_block + first, last - first));
+    }
+    region = end;
+  }
+  LOG(INFO) << "Split " << partition_blocks << " blocks in " << chunks.size()
+            << " chunks of up to " << decompressed_chunk_blocks
+            << " blocks, or " << copied_chunk_blocks << " blocks for the "
+            << incompressible_blocks << " likely incompressible blocks";
+  return chunks;
+}
+
 }  // namespace
 
 bool FullUpdateGenerator::GenerateOperations(
@@ -122,72 +315,106 @@ bool FullUpdateGenerator::GenerateOperations(
   // For performance reasons, we force a small default hard limit of 1 MiB. This
   // limit can be changed in the config, and we will use the smaller of the two
   // soft/hard limits.
-  size_t full_chunk_size;
-  if (config.hard_chunk_size >= 0) {
-    full_chunk_size = std::min(static_cast<size_t>(config.hard_chunk_size),
-                               config.soft_chunk_size);
-  } else {
-    full_chunk_size = std::min(kDefaultFullChunkSize, config.soft_chunk_size);
-    LOG(INFO) << "No chunk_size provided, using the default chunk_size for the "
-              << "full operations: " << full_chunk_size << " bytes.";
+  // When called from GenerateUpdatePayloadFile(), the chunks are compressed
+  // on the threads shared by all partitions.
+  std::unique_ptr<TaskScheduler> own_scheduler;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler == nullptr) {
+    own_scheduler =
+        std::make_unique<TaskScheduler>(diff_utils::GetMaxThreads());
+    scheduler = own_scheduler.get();
   }
-  TEST_AND_RETURN_FALSE(full_chunk_size > 0);
-  TEST_AND_RETURN_FALSE(full_chunk_size % config.block_size == 0);
-
-  size_t chunk_blocks = full_chunk_size / config.block_size;
-  size_t max_threads = diff_utils::GetMaxThreads();
-  LOG(INFO) << "Compressing partition " << new_part.name << " from "
-            << new_part.path << " splitting in chunks of " << chunk_blocks
-            << " blocks (" << config.block_size << " bytes each) using "
-            << max_threads << " threads";
 
   int in_fd = open(new_part.path.c_str(), O_RDONLY, 0);
   TEST_AND_RETURN_FALSE(in_fd >= 0);
   ScopedFdCloser in_fd_closer(&in_fd);
 
-  // We potentially have all the ChunkProcessors in memory but only
-  // |max_threads| will actually hold a block in memory while we process.
   size_t partition_blocks = new_part.size / config.block_size;
-  size_t num_chunks = utils::DivRoundUp(partition_blocks, chunk_blocks);
+  vector<Extent> chunk_extents;
+  if (config.apply_cost_model) {
+    // The chunks are sized for the device to apply them in about the target
+    // operation cost, up to the hard limit.
+    const size_t max_chunk_size = config.hard_chunk_size >= 0
+                                      ? config.hard_chunk_size
+                                      : kMaxAdaptiveChunkSize;
+    TEST_AND_RETURN_FALSE(max_chunk_size >= config.block_size);
+    TEST_AND_RETURN_FALSE(max_chunk_size % config.block_size == 0);
+    TEST_AND_RETURN_FALSE(kAdaptiveRegionSize % config.block_size == 0);
+    const auto image = MappedFile::OpenShared(new_part.path);
+    TEST_AND_RETURN_FALSE(image);
+    TEST_AND_RETURN_FALSE(image->size() >= new_part.size);
+    LOG(INFO) << "Compressing partition " << new_part.name << " from "
+              << new_part.path << " in chunks adapted to its data using "
+              << scheduler->num_threads() << " threads";
+    chunk_extents = AdaptiveChunks(*image,
+                                   config.block_size,
+                                   partition_blocks,
+                                   *config.apply_cost_model,
+                                   max_chunk_size,
+                                   scheduler);
+  } else {
+    // FullUpdateGenerator requires a positive chunk_size, otherwise there
+    // will be only one operation with the whole partition which should not be
+    // allowed. For performance reasons, we force a small default hard limit
+    // of 1 MiB. This limit can be changed in the config, and we will use the
+    // smaller of the two soft/hard limits.
+    size_t full_chunk_size;
+    if (config.hard_chunk_size >= 0) {
+      full_chunk_size = std::min(static_cast<size_t>(config.hard_chunk_size),
+                                 config.soft_chunk_size);
+    } else {
+      full_chunk_size = std::min(kDefaultFullChunkSize, config.soft_chunk_size);
+      LOG(INFO) << "No chunk_size provided, using the default chunk_size for "
+                << "the full operations: " << full_chunk_size << " bytes.";
+    }
+    TEST_AND_RETURN_FALSE(full_chunk_size > 0);
+    TEST_AND_RETURN_FALSE(full_chunk_size % config.block_size == 0);
+
+    size_t chunk_blocks = full_chunk_size / config.block_size;
+    LOG(INFO) << "Compressing partition " << new_part.name << " from "
+              << new_part.path << " splitting in chunks of " << chunk_blocks
+              << " blocks (" << config.block_size << " bytes each) using "
+              << scheduler->num_threads() << " threads";
+    for (size_t start_block = 0; start_block < partition_blocks;
+         start_block += chunk_blocks) {
+      // The last chunk could be smaller.
+      chunk_extents.push_back(ExtentForRange(
+          start_block, std::min(chunk_blocks, partition_blocks - start_block)));
+    }
+  }
+
+  size_t num_chunks = chunk_extents.size();
   aops->resize(num_chunks);
-  vector<ChunkProcessor> chunk_processors;
-  chunk_processors.reserve(num_chunks);
   blob_file->IncTotalBlobs(num_chunks);
 
   for (size_t i = 0; i < num_chunks; ++i) {
-    size_t start_block = i * chunk_blocks;
-    // The last chunk could be smaller.
-    size_t num_blocks =
-        std::min(chunk_blocks, partition_blocks - i * chunk_blocks);
-
     // Preset all the static information about the operations. The
-    // ChunkProcessor will set the rest.
+    // ChunkPipeline will set the rest.
     AnnotatedOperation* aop = aops->data() + i;
     aop->name = android::base::StringPrintf(
         "<%s-operation-%" PRIuS ">", new_part.name.c_str(), i);
-    Extent* dst_extent = aop->op.add_dst_extents();
-    dst_extent->set_start_block(start_block);
-    dst_extent->set_num_blocks(num_blocks);
-
-    chunk_processors.emplace_back(
-        config.version,
-        in_fd,
-        static_cast<off_t>(start_block) * config.block_size,
-        num_blocks * config.block_size,
-        blob_file,
-        aop);
+    *aop->op.add_dst_extents() = chunk_extents[i];
   }
 
-  // Thread pool used for worker threads.
-  base::DelegateSimpleThreadPool thread_pool("full-update-generator",
-                                             max_threads);
-  thread_pool.Start();
-  for (ChunkProcessor& processor : chunk_processors)
-    thread_pool.AddWork(&processor);
-  thread_pool.JoinAll();
+  // Allow every thread to have a chunk in flight and one read ahead.
+  ChunkPipeline pipeline(config.version,
+                         config.max_compression_effort,
+                         in_fd,
+                         config.block_size,
+                         kChunksInFlightPerThread * scheduler->num_threads(),
+                         blob_file,
+                         aops);
+  {
+    TaskScheduler::TaskGroup chunks(scheduler, false);
+    for (size_t i = 0; i < num_chunks; ++i) {
+      chunks.Submit(chunk_extents[i].num_blocks(),
+                    [&pipeline]() { pipeline.ProcessNextChunk(); });
+    }
+    chunks.Wait();
+  }
 
   // All the operations must have a type set at this point. Otherwise, a
-  // ChunkProcessor failed to complete.
+  // chunk failed to complete.
   for (const AnnotatedOperation& aop : *aops) {
     if (!aop.op.has_type())
       return false;
@@ -16,7 +16,9 @@
 
 #include "update_engine/payload_generator/full_update_generator.h"
 
+#include <algorithm>
 #include <memory>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -90,6 +92,71 @@ TEST_F(FullUpdateGeneratorTest, RunTest) {
   }
 }
 
+// Test that the blobs are stored in the order of the operations, however the
+// chunks are scheduled.
+TEST_F(FullUpdateGeneratorTest, BlobsStoredInOrder) {
+  config_.hard_chunk_size = 4 * config_.block_size;
+  brillo::Blob new_part(4 * 1024 * 1024);
+  FillWithData(&new_part);
+  new_part_conf.size = new_part.size();
+
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_writer_.get(),
+                                            &aops));
+  EXPECT_EQ(new_part.size() / config_.hard_chunk_size, aops.size());
+  uint64_t next_offset = 0;
+  for (const AnnotatedOperation& aop : aops) {
+    EXPECT_EQ(next_offset, aop.op.data_offset()) << aop.name;
+    next_offset += aop.op.data_length();
+  }
+  EXPECT_EQ(static_cast<off_t>(next_offset), out_blobs_length_);
+}
+
+// Test that with an apply cost model, incompressible data is split in larger
+// chunks than the data the device decompresses.
+TEST_F(FullUpdateGeneratorTest, AdaptiveChunksTest) {
+  // Decompressing 1 MiB and copying 25 MiB cost the target of 101 ms.
+  config_.apply_cost_model = ApplyCostModel{1, 4, 100, 400, 101};
+  config_.hard_chunk_size = -1;
+  brillo::Blob new_part(16 * 1024 * 1024);
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<uint16_t> dis(0, 255);
+  for (size_t i = 0; i < new_part.size() / 2; i++) {
+    new_part[i] = static_cast<uint8_t>(dis(gen));
+  }
+  brillo::Blob pattern(new_part.size() / 2);
+  FillWithData(&pattern);
+  std::copy(pattern.begin(), pattern.end(), new_part.begin() + pattern.size());
+  new_part_conf.size = new_part.size();
+
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_writer_.get(),
+                                            &aops));
+  // The random half is split in chunks of a quarter of the partition at most,
+  // the other one in chunks of 1 MiB.
+  ASSERT_EQ(10U, aops.size());
+  uint64_t next_block = 0;
+  for (size_t i = 0; i < aops.size(); i++) {
+    ASSERT_EQ(1, aops[i].op.dst_extents_size());
+    EXPECT_EQ(next_block, aops[i].op.dst_extents(0).start_block());
+    const uint64_t expected_size = i < 2 ? 4 * 1024 * 1024 : 1024 * 1024;
+    EXPECT_EQ(expected_size / config_.block_size,
+              aops[i].op.dst_extents(0).num_blocks())
+        << "i = " << i;
+    next_block += aops[i].op.dst_extents(0).num_blocks();
+  }
+  EXPECT_EQ(InstallOperation::REPLACE, aops[0].op.type());
+  EXPECT_NE(InstallOperation::REPLACE, aops[2].op.type());
+}
+
 // Test that if the chunk size is not a divisor of the image size, it handles
 // correctly the last chunk of the partition.
 TEST_F(FullUpdateGeneratorTest, ChunkSizeTooBig) {
@@ -14,9 +14,13 @@
 // limitations under the License.
 //
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <iterator>
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <android-base/strings.h>
@@ -36,15 +40,20 @@
 #include "update_engine/common/fake_boot_control.h"
 #include "update_engine/common/fake_hardware.h"
 #include "update_engine/common/file_fetcher.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/prefs.h"
 #include "update_engine/common/terminator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/payload_generator/payload_properties.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/previous_payload.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/payload_generator/xz.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -314,7 +323,10 @@ DEFINE_string(old_partitions,
               "Path to the old partitions. To pass multiple partitions, use "
               "a single argument with a colon between paths, e.g. "
               "/path/to/part:/path/to/part2::/path/to/last_part . Path can "
-              "be empty, but it has to match the order of partition_names.");
+              "be empty, but it has to match the order of partition_names. "
+              "To generate payloads from several source builds to the same "
+              "target at once, separate the partitions of each build with a "
+              "comma and pass as many --out_file paths.");
 DEFINE_string(new_partitions,
               "",
               "Path to the new partitions. To pass multiple partitions, use "
@@ -327,7 +339,8 @@ DEFINE_string(old_mapfiles,
               "in the old partition. The .map file is normally generated "
               "when creating the image in Android builds. Only recommended "
               "for unsupported filesystem. Pass multiple files separated by "
-              "a colon as with -old_partitions.");
+              "a colon and the files of several source builds separated by a "
+              "comma as with -old_partitions.");
 DEFINE_string(new_mapfiles,
               "",
               "Path to the .map files associated with the partition files "
@@ -342,10 +355,17 @@ DEFINE_string(in_file,
               "",
               "Path to input delta payload file used to hash/sign payloads "
               "and apply delta over old_image (for debugging)");
-DEFINE_string(out_file, "", "Path to output delta payload file");
+DEFINE_string(out_file,
+              "",
+              "Path to output delta payload file. With several source builds "
+              "in --old_partitions, the paths of their payloads separated by "
+              "a comma.");
 DEFINE_string(out_hash_file, "", "Path to output hash file");
 DEFINE_string(out_metadata_hash_file, "", "Path to output metadata hash file");
-DEFINE_string(out_metadata_size_file, "", "Path to output metadata size file");
+DEFINE_string(out_metadata_size_file,
+              "",
+              "Path to output metadata size file, several paths separated by "
+              "a comma as with --out_file.");
 DEFINE_string(private_key, "", "Path to private key in .pem format");
 DEFINE_string(public_key, "", "Path to public key in .pem format");
 DEFINE_int32(public_key_version,
@@ -433,13 +453,18 @@ DEFINE_bool(
 DEFINE_bool(enable_vabc_xor,
             false,
             "Whether to use Virtual AB Compression XOR feature");
+DEFINE_bool(merge_source_order,
+            false,
+            "Whether to order the Virtual AB Compression merge by source "
+            "blocks");
 DEFINE_string(apex_info_file,
               "",
               "Path to META/apex_info.pb found in target build");
 DEFINE_string(compressor_types,
-              "bz2:brotli",
+              "bz2:brotli:zstd",
               "Colon ':' separated list of compressors. Allowed valures are "
-              "bz2 and brotli.");
+              "bz2, brotli and zstd. Zstd is only used from minor version 11 "
+              "on, by BROTLI_BSDIFF operations.");
 DEFINE_bool(enable_lz4diff,
             false,
             "Whether to enable LZ4diff feature when processing EROFS images.");
@@ -464,6 +489,185 @@ DEFINE_int64(max_threads,
              "The maximum number of threads allowed for generating "
              "ota.");
 
+DEFINE_uint64(memory_budget,
+              0,
+              "When non-zero, the number of bytes of memory the files diffed "
+              "in parallel may use together. Small files are still diffed on "
+              "all threads while large files are diffed one after another, "
+              "instead of lowering --max_threads for all files.");
+
+DEFINE_uint64(segment_hash_size,
+              0,
+              "When non-zero, also store the hash of every segment of this "
+              "many bytes of the new partitions, lets the device verify only "
+              "the segments not written by SOURCE_COPY operations and verify "
+              "segments in parallel. Must be a multiple of the block size, "
+              "e.g. 67108864 for 64 MiB segments.");
+
+DEFINE_bool(payload_index,
+            false,
+            "Write an index of the operation blobs after them, for tools "
+            "which read parts of the payload without going through all of "
+            "its manifest. Requires minor version 12, full payloads with it "
+            "are only for devices whose update_engine supports that version.");
+
+DEFINE_uint64(payload_index_chunk_size,
+              0,
+              "When non-zero, also store in the --payload_index the hash of "
+              "every chunk of this many bytes of the data blobs, to verify "
+              "any part of them on its own, e.g. 1048576.");
+
+DEFINE_bool(split_manifest,
+            false,
+            "Store the operations of every partition apart from the manifest, "
+            "right before the data of the partition, so the device starts "
+            "applying a partition once its own operations are downloaded. "
+            "Requires minor version 13, full payloads with it are only for "
+            "devices whose update_engine supports that version.");
+
+DEFINE_bool(dedup_blobs,
+            false,
+            "Store identical data blobs once, shared by all the operations "
+            "using them, up to 16 MiB of shared blobs. Requires minor version "
+            "14, full payloads with it are only for devices whose "
+            "update_engine supports that version. Not compatible with "
+            "--split_manifest.");
+
+DEFINE_bool(partition_copy,
+            false,
+            "Copy the data of a dynamic partition found in another dynamic "
+            "source partition, like files moved between partitions, from there "
+            "instead of sending it. Requires minor version 15.");
+
+DEFINE_string(diff_cache_dir,
+              "",
+              "An existing directory to cache the diffs between files in. "
+              "Generating a payload again from the same images reuses the "
+              "cached diffs instead of running the diff algorithms again. The "
+              "directory may be shared between runs and concurrent "
+              "generators.");
+
+DEFINE_uint64(diff_shard_count,
+              0,
+              "When non-zero, only diff the files of the shard "
+              "--diff_shard_index of this many shards into --diff_cache_dir, "
+              "without writing the payload. Running every shard on its own "
+              "machine with a shared --diff_cache_dir, then generating the "
+              "payload without sharding, spreads the diffs across machines.");
+
+DEFINE_uint64(diff_shard_index,
+              0,
+              "The shard to diff with --diff_shard_count, from 0.");
+
+DEFINE_string(file_index_cache_dir,
+              "",
+              "An existing directory to cache the files found in the "
+              "partition images in, with their extents and deflates. Images "
+              "diffed again, for example a target image diffed against "
+              "several source images, are then not parsed and scanned for "
+              "deflates again. The directory may be shared between runs and "
+              "concurrent generators.");
+
+DEFINE_double(cow_estimate_error_bound,
+              0,
+              "When non-zero, estimate the COW size of the partitions from a "
+              "sample of their operations instead of replaying all of them, "
+              "within this relative error with 95% confidence, e.g. 0.02. "
+              "Meant for builds where the exact estimate isn't needed.");
+
+DEFINE_uint64(xz_stream_size,
+              0,
+              "When non-zero, split the data of REPLACE_XZ operations in xz "
+              "streams of this many uncompressed bytes, decoded in parallel on "
+              "the device. Only for devices whose update_engine can decode "
+              "several xz streams in an operation.");
+
+DEFINE_bool(full_zstd,
+            false,
+            "Allow REPLACE_ZSTD operations in a full payload. Delta payloads "
+            "use them from minor version 11 on. Only for devices whose "
+            "update_engine supports that minor version.");
+
+DEFINE_bool(max_compression_effort,
+            false,
+            "Try all the allowed compressors on every full operation, also on "
+            "data that looks incompressible, like compressed files. Slower, "
+            "the build log reports how much it saves.");
+
+DEFINE_uint64(diff_time_budget_seconds,
+              0,
+              "When non-zero, once diffing a file took this many seconds the "
+              "diff algorithms not started yet are skipped and the best diff "
+              "found so far is used, for predictable build times. The payload "
+              "then depends on the speed of the machine.");
+
+DEFINE_uint64(max_file_segment_size,
+              0,
+              "When non-zero, split files larger than this many bytes in "
+              "segments of at most this size, at boundaries depending on "
+              "their data, diffed in parallel as separate operations. Such "
+              "files may otherwise be too large to diff, or build and apply "
+              "as a single operation.");
+
+DEFINE_string(apply_cost_model,
+              "",
+              "When set, merge, split and order the operations for a device to "
+              "apply them fast: one of the device classes \"low\", \"mid\" "
+              "and \"high\", or the cost in milliseconds of an operation, of "
+              "a MiB copied, decompressed and patched, and the target cost of "
+              "an operation, separated by commas. Full operations are then "
+              "sized by their cost too, up to --chunk_size.");
+
+DEFINE_double(streaming_download_rate,
+              0,
+              "When set with --apply_cost_model, lay out the data of the "
+              "payload for a device downloading it at this rate in MiB/s "
+              "while applying it.");
+
+DEFINE_uint64(streaming_lookahead_size,
+              16 * 1024 * 1024,
+              "With --streaming_download_rate, how many bytes the device "
+              "downloads ahead of the operation it applies.");
+
+DEFINE_string(out_report_file,
+              "",
+              "Path to write a JSON report of the payload generation to: the "
+              "wall and CPU time of every phase, the operations of every "
+              "partition and, for every file diffed, the size and time of "
+              "every algorithm tried, and the peak memory used. Only "
+              "supported with a single source build.");
+
+DEFINE_string(previous_payload,
+              "",
+              "Path to a payload generated before from the same source build "
+              "to a previous target build. Its operations writing blocks that "
+              "didn't change since are reused instead of being generated "
+              "again. Requires --previous_target_partitions or "
+              "--changed_files, and the same minor version.");
+
+DEFINE_string(previous_target_partitions,
+              "",
+              "With --previous_payload, the partitions of the previous target "
+              "build separated by colons, in the order of --partition_names. "
+              "The blocks changed since are found by comparing them with the "
+              "new ones.");
+
+DEFINE_string(changed_files,
+              "",
+              "With --previous_payload, the files changed since the previous "
+              "target build as partition:/path separated by commas, e.g. "
+              "system:/system/bin/foo. All the blocks of the other files are "
+              "assumed unchanged, so the list must include every file "
+              "written, added or removed.");
+
+DEFINE_bool(verify_reproducible,
+            false,
+            "Generate the payload a second time on a different number of "
+            "threads and fail if the two payloads differ, their signatures "
+            "aside. Only supported with a single source build and without "
+            "--diff_time_budget_seconds, which makes the payload depend on "
+            "the time spent.");
+
 void RoundDownPartitions(const ImageConfig& config) {
   for (const auto& part : config.partitions) {
     if (part.path.empty()) {
@@ -479,6 +683,79 @@ void RoundDownPartitions(const ImageConfig& config) {
   }
 }
 
+// Opens the filesystems of all the partitions of the source and target of
+// |config| and of |extra_sources|, loading the verity config of the target
+// partitions as well if |load_verity|. Done in parallel, as it adds up with
+// many partitions.
+bool OpenPartitions(PayloadGenerationConfig* config,
+                    vector<ImageConfig>* extra_sources,
+                    bool load_verity) {
+  size_t num_threads = diff_utils::GetMaxThreads();
+  if (config->max_threads > 0)
+    num_threads = std::min<size_t>(num_threads, config->max_threads);
+  TaskScheduler scheduler(num_threads);
+  std::atomic<bool> success{true};
+  TaskScheduler::TaskGroup tasks(&scheduler, false);
+  auto open = [&tasks, &success](PartitionConfig* part, bool verity) {
+    tasks.Submit(part->size, [part, verity, &success]() {
+      if (!part->OpenFilesystem() || (verity && !part->LoadVerityConfig())) {
+        LOG(ERROR) << "Unable to load partition " << part->name << " from "
+                   << part->path;
+        success = false;
+      }
+    });
+  };
+  for (PartitionConfig& part : config->target.partitions)
+    open(&part, load_verity);
+  for (PartitionConfig& part : config->source.partitions)
+    open(&part, false);
+  for (ImageConfig& source : *extra_sources) {
+    for (PartitionConfig& part : source.partitions)
+      open(&part, false);
+  }
+  tasks.Wait();
+  return success;
+}
+
+// Generates the payload of |config| again on a different number of threads
+// and returns whether it's byte for byte the same as |payload_path|.
+bool VerifyReproducible(PayloadGenerationConfig* config,
+                        const string& payload_path,
+                        const string& private_key_path) {
+  const size_t num_threads =
+      std::min<size_t>(diff_utils::GetMaxThreads(), config->max_threads);
+  config->max_threads = num_threads > 1 ? num_threads / 2 : 2;
+  // Diffs cached by the first generation would hide differences, and the
+  // report is of the first generation.
+  config->diff_cache_dir.clear();
+  config->report = nullptr;
+  LOG(INFO) << "Generating the payload again on " << config->max_threads
+            << " threads instead of " << num_threads
+            << " to verify it is reproducible.";
+  ScopedTempFile other_payload("reproducible_payload.XXXXXX");
+  uint64_t metadata_size = 0;
+  TEST_AND_RETURN_FALSE(GenerateUpdatePayloadFile(
+      *config, other_payload.path(), private_key_path, &metadata_size));
+
+  // ECDSA signatures differ every time, only the signed contents are compared.
+  brillo::Blob hash, other_hash;
+  TEST_AND_RETURN_FALSE(
+      PayloadSigner::HashPayloadWithoutSignatures(payload_path, &hash));
+  TEST_AND_RETURN_FALSE(PayloadSigner::HashPayloadWithoutSignatures(
+      other_payload.path(), &other_hash));
+  if (hash != other_hash) {
+    LOG(ERROR) << "The payload isn't reproducible, its unsigned SHA-256 is "
+               << base::HexEncode(hash.data(), hash.size()) << " on "
+               << num_threads << " threads but "
+               << base::HexEncode(other_hash.data(), other_hash.size())
+               << " on " << config->max_threads << " threads.";
+    return false;
+  }
+  LOG(INFO) << "The payload is reproducible, its unsigned SHA-256 is "
+            << base::HexEncode(hash.data(), hash.size());
+  return true;
+}
+
 void RoundUpPartitions(const ImageConfig& config) {
   for (const auto& part : config.partitions) {
     if (part.path.empty()) {
@@ -583,13 +860,11 @@ int Main(int argc, char** argv) {
   // A payload generation was requested. Convert the flags to a
   // PayloadGenerationConfig.
   PayloadGenerationConfig payload_config;
-  vector<string> partition_names, old_partitions, new_partitions;
-  vector<string> old_mapfiles, new_mapfiles;
+  vector<string> partition_names, new_partitions;
+  vector<string> new_mapfiles;
+  // The source builds after the first one, see --old_partitions.
+  vector<ImageConfig> extra_sources;
 
-  if (!FLAGS_old_mapfiles.empty()) {
-    old_mapfiles = base::SplitString(
-        FLAGS_old_mapfiles, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
-  }
   if (!FLAGS_new_mapfiles.empty()) {
     new_mapfiles = base::SplitString(
         FLAGS_new_mapfiles, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
@@ -614,6 +889,7 @@ int Main(int argc, char** argv) {
   }
 
   payload_config.enable_vabc_xor = FLAGS_enable_vabc_xor;
+  payload_config.merge_source_order = FLAGS_merge_source_order;
   payload_config.enable_lz4diff = FLAGS_enable_lz4diff;
   payload_config.enable_zucchini = FLAGS_enable_zucchini;
   payload_config.enable_puffdiff = FLAGS_enable_puffdiff;
@@ -658,22 +934,45 @@ int Main(int argc, char** argv) {
   }
 
   if (payload_config.is_delta) {
+    vector<vector<string>> old_partition_sets;
     if (!FLAGS_old_partitions.empty()) {
-      old_partitions = base::SplitString(FLAGS_old_partitions,
-                                         ":",
-                                         base::TRIM_WHITESPACE,
-                                         base::SPLIT_WANT_ALL);
-      CHECK(old_partitions.size() == new_partitions.size());
+      for (const string& old_partitions :
+           base::SplitString(FLAGS_old_partitions,
+                             ",",
+                             base::TRIM_WHITESPACE,
+                             base::SPLIT_WANT_ALL)) {
+        old_partition_sets.push_back(base::SplitString(
+            old_partitions, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL));
+        CHECK(old_partition_sets.back().size() == new_partitions.size());
+      }
     } else {
-      old_partitions = {FLAGS_old_image, FLAGS_old_kernel};
+      old_partition_sets = {{FLAGS_old_image, FLAGS_old_kernel}};
       LOG(WARNING) << "--old_partitions is empty, using deprecated --old_image "
                    << "and --old_kernel flags.";
     }
-    for (size_t i = 0; i < partition_names.size(); i++) {
-      payload_config.source.partitions.emplace_back(partition_names[i]);
-      payload_config.source.partitions.back().path = old_partitions[i];
-      if (i < old_mapfiles.size())
-        payload_config.source.partitions.back().mapfile_path = old_mapfiles[i];
+    vector<string> old_mapfile_sets;
+    if (!FLAGS_old_mapfiles.empty()) {
+      old_mapfile_sets = base::SplitString(
+          FLAGS_old_mapfiles, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+      CHECK(old_mapfile_sets.size() <= old_partition_sets.size());
+    }
+    extra_sources.resize(old_partition_sets.size() - 1);
+    for (size_t j = 0; j < old_partition_sets.size(); j++) {
+      ImageConfig& source =
+          j == 0 ? payload_config.source : extra_sources[j - 1];
+      vector<string> old_mapfiles;
+      if (j < old_mapfile_sets.size() && !old_mapfile_sets[j].empty()) {
+        old_mapfiles = base::SplitString(old_mapfile_sets[j],
+                                         ":",
+                                         base::TRIM_WHITESPACE,
+                                         base::SPLIT_WANT_ALL);
+      }
+      for (size_t i = 0; i < partition_names.size(); i++) {
+        source.partitions.emplace_back(partition_names[i]);
+        source.partitions.back().path = old_partition_sets[j][i];
+        if (i < old_mapfiles.size())
+          source.partitions.back().mapfile_path = old_mapfiles[i];
+      }
     }
   }
 
@@ -682,6 +981,8 @@ int Main(int argc, char** argv) {
   }
 
   if (!FLAGS_in_file.empty()) {
+    LOG_IF(FATAL, !extra_sources.empty())
+        << "Only one source build can be passed with --in_file.";
     return ApplyPayload(FLAGS_in_file, payload_config) ? 0 : 1;
   }
 
@@ -700,6 +1001,10 @@ int Main(int argc, char** argv) {
   if (payload_config.is_delta) {
     RoundDownPartitions(payload_config.source);
     CHECK(payload_config.source.LoadImageSize());
+    for (ImageConfig& source : extra_sources) {
+      RoundDownPartitions(source);
+      CHECK(source.LoadImageSize());
+    }
   }
   RoundUpPartitions(payload_config.target);
   CHECK(payload_config.target.LoadImageSize());
@@ -721,14 +1026,6 @@ int Main(int argc, char** argv) {
 
   payload_config.rootfs_partition_size = FLAGS_rootfs_partition_size;
 
-  if (payload_config.is_delta) {
-    // Avoid opening the filesystem interface for full payloads.
-    for (PartitionConfig& part : payload_config.target.partitions)
-      CHECK(part.OpenFilesystem());
-    for (PartitionConfig& part : payload_config.source.partitions)
-      CHECK(part.OpenFilesystem());
-  }
-
   payload_config.version.major = FLAGS_major_version;
   LOG(INFO) << "Using provided major_version=" << FLAGS_major_version;
 
@@ -759,6 +1056,9 @@ int Main(int argc, char** argv) {
     return 1;
   }
 
+  payload_config.version.xz_stream_size = FLAGS_xz_stream_size;
+  payload_config.version.full_zstd_allowed = FLAGS_full_zstd;
+
   payload_config.max_timestamp = FLAGS_max_timestamp;
 
   payload_config.security_patch_level = FLAGS_security_patch_level;
@@ -766,18 +1066,104 @@ int Main(int argc, char** argv) {
   if (FLAGS_max_threads > 0) {
     payload_config.max_threads = FLAGS_max_threads;
   }
+  payload_config.memory_budget = FLAGS_memory_budget;
+
+  payload_config.segment_hash_size = FLAGS_segment_hash_size;
+  payload_config.payload_index = FLAGS_payload_index;
+  payload_config.payload_index_chunk_size = FLAGS_payload_index_chunk_size;
+  payload_config.split_partition_operations = FLAGS_split_manifest;
+  payload_config.dedup_blobs = FLAGS_dedup_blobs;
+  payload_config.partition_copy = FLAGS_partition_copy;
+  payload_config.diff_cache_dir = FLAGS_diff_cache_dir;
+  payload_config.diff_shard_count = FLAGS_diff_shard_count;
+  payload_config.diff_shard_index = FLAGS_diff_shard_index;
+  payload_config.file_index_cache_dir = FLAGS_file_index_cache_dir;
+  payload_config.cow_estimate_error_bound = FLAGS_cow_estimate_error_bound;
+  payload_config.max_compression_effort = FLAGS_max_compression_effort;
+  payload_config.diff_time_budget_seconds = FLAGS_diff_time_budget_seconds;
+  if (FLAGS_verify_reproducible) {
+    LOG_IF(FATAL, !extra_sources.empty())
+        << "Only one source build can be passed with --verify_reproducible.";
+    LOG_IF(FATAL, FLAGS_diff_time_budget_seconds > 0)
+        << "--diff_time_budget_seconds can't be reproducible.";
+  }
+  payload_config.max_file_segment_size = FLAGS_max_file_segment_size;
+  if (!FLAGS_apply_cost_model.empty()) {
+    ApplyCostModel cost_model;
+    LOG_IF(FATAL, !ApplyCostModel::Parse(FLAGS_apply_cost_model, &cost_model))
+        << "Invalid --apply_cost_model: " << FLAGS_apply_cost_model;
+    payload_config.apply_cost_model = cost_model;
+  }
+  payload_config.streaming_download_mib_per_second =
+      FLAGS_streaming_download_rate;
+  payload_config.streaming_lookahead_size = FLAGS_streaming_lookahead_size;
+  GenerationReport report;
+  if (!FLAGS_out_report_file.empty()) {
+    LOG_IF(FATAL, !extra_sources.empty())
+        << "Only one source build can be passed with --out_report_file.";
+    payload_config.report = &report;
+  }
+  PreviousPayload previous_payload;
+  if (!FLAGS_previous_payload.empty()) {
+    LOG_IF(FATAL, !extra_sources.empty())
+        << "Only one source build can be passed with --previous_payload.";
+    LOG_IF(FATAL,
+           FLAGS_previous_target_partitions.empty() ==
+               FLAGS_changed_files.empty())
+        << "Exactly one of --previous_target_partitions and --changed_files "
+           "must be passed with --previous_payload.";
+    CHECK(previous_payload.Load(FLAGS_previous_payload));
+    if (!FLAGS_previous_target_partitions.empty()) {
+      const vector<string> previous_targets =
+          base::SplitString(FLAGS_previous_target_partitions,
+                            ":",
+                            base::TRIM_WHITESPACE,
+                            base::SPLIT_WANT_ALL);
+      CHECK_EQ(partition_names.size(), previous_targets.size());
+      for (size_t i = 0; i < partition_names.size(); i++) {
+        if (!previous_targets[i].empty()) {
+          previous_payload.SetPreviousTarget(partition_names[i],
+                                             previous_targets[i]);
+        }
+      }
+    }
+    for (const string& changed_file :
+         base::SplitString(FLAGS_changed_files,
+                           ",",
+                           base::TRIM_WHITESPACE,
+                           base::SPLIT_WANT_NONEMPTY)) {
+      const size_t pos = changed_file.find(':');
+      LOG_IF(FATAL, pos == string::npos)
+          << "Invalid --changed_files entry: " << changed_file;
+      previous_payload.AddChangedFile(changed_file.substr(0, pos),
+                                      changed_file.substr(pos + 1));
+    }
+    payload_config.previous_payload = &previous_payload;
+  }
 
   if (!FLAGS_partition_timestamps.empty()) {
     CHECK(ParsePerPartitionTimestamps(FLAGS_partition_timestamps,
                                       &payload_config));
   }
 
-  if (payload_config.is_delta &&
+  // Avoid opening the filesystem interface for full payloads.
+  const bool load_verity =
+      payload_config.is_delta &&
       payload_config.version.minor >= kVerityMinorPayloadVersion &&
-      !FLAGS_disable_verity_computation) {
-    CHECK(payload_config.target.LoadVerityConfig());
+      !FLAGS_disable_verity_computation;
+  if (payload_config.is_delta) {
+    CHECK(OpenPartitions(&payload_config, &extra_sources, load_verity));
+  }
+  if (load_verity) {
     for (size_t i = 0; i < payload_config.target.partitions.size(); ++i) {
-      if (payload_config.source.partitions[i].fs_interface != nullptr) {
+      // The target is shared by all the payloads, so the verity config is
+      // dropped if any of them installs the partition in full.
+      if (payload_config.source.partitions[i].fs_interface != nullptr &&
+          std::all_of(extra_sources.begin(),
+                      extra_sources.end(),
+                      [i](const ImageConfig& source) {
+                        return source.partitions[i].fs_interface != nullptr;
+                      })) {
         continue;
       }
       if (!payload_config.target.partitions[i].verity.IsEmpty()) {
@@ -793,22 +1179,73 @@ int Main(int argc, char** argv) {
             << " update";
 
   // From this point, all the options have been parsed.
-  if (!payload_config.Validate()) {
+  if (!payload_config.Validate() ||
+      !std::all_of(extra_sources.begin(),
+                   extra_sources.end(),
+                   [&payload_config](const ImageConfig& source) {
+                     return payload_config.ValidateSource(source);
+                   })) {
     LOG(ERROR) << "Invalid options passed. See errors above.";
     return 1;
   }
 
+  if (!extra_sources.empty()) {
+    const vector<string> out_files = base::SplitString(
+        FLAGS_out_file, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    CHECK_EQ(out_files.size(), extra_sources.size() + 1)
+        << "Pass one --out_file for each source build.";
+    vector<string> out_metadata_size_files;
+    if (!FLAGS_out_metadata_size_file.empty()) {
+      out_metadata_size_files =
+          base::SplitString(FLAGS_out_metadata_size_file,
+                            ",",
+                            base::TRIM_WHITESPACE,
+                            base::SPLIT_WANT_ALL);
+      CHECK_EQ(out_metadata_size_files.size(), out_files.size());
+    }
+    vector<ImageConfig> sources;
+    sources.push_back(std::move(payload_config.source));
+    std::move(extra_sources.begin(),
+              extra_sources.end(),
+              std::back_inserter(sources));
+    vector<uint64_t> metadata_sizes;
+    if (!GenerateUpdatePayloadFiles(&payload_config,
+                                    sources,
+                                    out_files,
+                                    FLAGS_private_key,
+                                    &metadata_sizes)) {
+      return 1;
+    }
+    for (size_t i = 0; i < out_metadata_size_files.size(); i++) {
+      string metadata_size_string = std::to_string(metadata_sizes[i]);
+      CHECK(utils::WriteFile(out_metadata_size_files[i].c_str(),
+                             metadata_size_string.data(),
+                             metadata_size_string.size()));
+    }
+    return 0;
+  }
+
   uint64_t metadata_size{};
   if (!GenerateUpdatePayloadFile(
           payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size)) {
     return 1;
   }
+  if (FLAGS_verify_reproducible &&
+      !VerifyReproducible(&payload_config, FLAGS_out_file, FLAGS_private_key)) {
+    return 1;
+  }
   if (!FLAGS_out_metadata_size_file.empty()) {
     string metadata_size_string = std::to_string(metadata_size);
     CHECK(utils::WriteFile(FLAGS_out_metadata_size_file.c_str(),
                            metadata_size_string.data(),
                            metadata_size_string.size()));
   }
+  if (!FLAGS_out_report_file.empty()) {
+    const string report_json = report.ToJson();
+    CHECK(utils::WriteFile(FLAGS_out_report_file.c_str(),
+                           report_json.data(),
+                           report_json.size()));
+  }
   return 0;
 }
 
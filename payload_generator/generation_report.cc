@@ -0,0 +1,195 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_report.h"
+
+#include <sys/resource.h>
+
+#include <cinttypes>
+#include <utility>
+
+#include <android-base/stringprintf.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using android::base::StringAppendF;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+void AppendJsonString(const string& value, string* json) {
+  json->push_back('"');
+  for (const char c : value) {
+    if (c == '"' || c == '\\') {
+      json->push_back('\\');
+      json->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      StringAppendF(json, "\\u%04x", c);
+    } else {
+      json->push_back(c);
+    }
+  }
+  json->push_back('"');
+}
+
+void AppendJsonKey(const char* key, string* json) {
+  AppendJsonString(key, json);
+  json->push_back(':');
+}
+
+void AppendOperationType(InstallOperation::Type type, string* json) {
+  AppendJsonKey("type", json);
+  AppendJsonString(InstallOperationTypeName(type), json);
+}
+
+void AppendDiff(const GenerationReport::Diff& diff, string* json) {
+  json->push_back('{');
+  AppendJsonKey("name", json);
+  AppendJsonString(diff.name, json);
+  json->push_back(',');
+  AppendOperationType(diff.type, json);
+  StringAppendF(json,
+                ",\"data_size\":%" PRIu64 ",\"src_bytes\":%" PRIu64
+                ",\"dst_bytes\":%" PRIu64 ",\"seconds\":%.6f",
+                diff.data_size,
+                diff.src_bytes,
+                diff.dst_bytes,
+                diff.duration.InSecondsF());
+  json->append(",\"candidates\":[");
+  for (size_t i = 0; i < diff.candidates.size(); i++) {
+    const GenerationReport::Candidate& candidate = diff.candidates[i];
+    json->append(i > 0 ? ",{" : "{");
+    AppendOperationType(candidate.type, json);
+    StringAppendF(json,
+                  ",\"size\":%" PRIu64 ",\"seconds\":%.6f}",
+                  candidate.size,
+                  candidate.duration.InSecondsF());
+  }
+  StringAppendF(json,
+                "],\"budget_exceeded\":%s}",
+                diff.budget_exceeded ? "true" : "false");
+}
+}  // namespace
+
+GenerationReport::ScopedPhase::ScopedPhase(GenerationReport* report,
+                                           string name)
+    : report_(report), name_(std::move(name)) {
+  if (report_) {
+    start_ = base::TimeTicks::Now();
+    if (base::ThreadTicks::IsSupported()) {
+      cpu_start_ = base::ThreadTicks::Now();
+    }
+  }
+}
+
+GenerationReport::ScopedPhase::~ScopedPhase() {
+  if (report_) {
+    report_->AddPhase(name_,
+                      base::TimeTicks::Now() - start_,
+                      base::ThreadTicks::IsSupported()
+                          ? base::ThreadTicks::Now() - cpu_start_
+                          : base::TimeDelta());
+  }
+}
+
+void GenerationReport::AddPhase(const string& name,
+                                base::TimeDelta duration,
+                                base::TimeDelta cpu_duration) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PhaseSummary& phase = phases_[name];
+  phase.count++;
+  phase.duration += duration;
+  phase.cpu_duration += cpu_duration;
+}
+
+void GenerationReport::AddDiff(const string& image_path, Diff diff) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  diffs_[image_path].push_back(std::move(diff));
+}
+
+void GenerationReport::AddPartition(const string& name,
+                                    const string& image_path,
+                                    const vector<AnnotatedOperation>& aops) {
+  Partition partition{name, image_path, {}};
+  for (const AnnotatedOperation& aop : aops) {
+    OperationsSummary& summary = partition.operations[aop.op.type()];
+    summary.count++;
+    summary.data_size += aop.op.data_length();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  partitions_.push_back(std::move(partition));
+}
+
+string GenerationReport::ToJson() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  string json = "{";
+  struct rusage usage {};
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    // Linux reports the maximum resident set size in KiB.
+    StringAppendF(&json,
+                  "\"peak_rss_bytes\":%" PRIu64 ",",
+                  static_cast<uint64_t>(usage.ru_maxrss) * 1024);
+  }
+  json.append("\"phases\":[");
+  bool first_phase = true;
+  for (const auto& [name, phase] : phases_) {
+    json.append(first_phase ? "{" : ",{");
+    first_phase = false;
+    AppendJsonKey("name", &json);
+    AppendJsonString(name, &json);
+    StringAppendF(&json,
+                  ",\"count\":%" PRIu64
+                  ",\"seconds\":%.6f,\"cpu_seconds\":%.6f}",
+                  phase.count,
+                  phase.duration.InSecondsF(),
+                  phase.cpu_duration.InSecondsF());
+  }
+  json.append("],\"partitions\":[");
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    const Partition& partition = partitions_[i];
+    json.append(i > 0 ? ",{" : "{");
+    AppendJsonKey("name", &json);
+    AppendJsonString(partition.name, &json);
+    json.append(",\"operations\":[");
+    bool first = true;
+    for (const auto& [type, summary] : partition.operations) {
+      json.append(first ? "{" : ",{");
+      first = false;
+      AppendOperationType(type, &json);
+      StringAppendF(&json,
+                    ",\"count\":%" PRIu64 ",\"data_size\":%" PRIu64 "}",
+                    summary.count,
+                    summary.data_size);
+    }
+    json.append("],\"diffs\":[");
+    const auto it = diffs_.find(partition.image_path);
+    if (it != diffs_.end()) {
+      for (size_t j = 0; j < it->second.size(); j++) {
+        if (j > 0) {
+          json.push_back(',');
+        }
+        AppendDiff(it->second[j], &json);
+      }
+    }
+    json.append("]}");
+  }
+  json.append("]}");
+  return json;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,130 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_REPORT_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_REPORT_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Collects how a payload was generated: for every file diffed, the operation
+// it ended up with and the size and time of every algorithm tried, the
+// operations of every partition, like PayloadFile::ReportPayloadUsage() logs,
+// and the time spent in each phase of the generation. Diffs, partitions and
+// phases may be added from several threads.
+class GenerationReport {
+ public:
+  // Adds the wall and CPU time of the current thread from its construction to
+  // its destruction to phase |name| of |report|, if not null. The phases run
+  // on many threads at once, so their times add up to more than the wall time
+  // of the generation, and the work a phase hands to other threads is counted
+  // in the phases those threads run, if any.
+  class ScopedPhase {
+   public:
+    ScopedPhase(GenerationReport* report, std::string name);
+    ~ScopedPhase();
+
+   private:
+    GenerationReport* report_;
+    std::string name_;
+    base::TimeTicks start_;
+    base::ThreadTicks cpu_start_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedPhase);
+  };
+
+  // An algorithm tried on a file.
+  struct Candidate {
+    InstallOperation::Type type;
+    // The size of the result, 0 when the algorithm didn't apply.
+    uint64_t size;
+    base::TimeDelta duration;
+  };
+
+  // A file, or a chunk of a file, diffed by diff_utils::ReadExtentsToDiff().
+  struct Diff {
+    std::string name;
+    InstallOperation::Type type;
+    uint64_t data_size;
+    // The bytes read from the source and target images.
+    uint64_t src_bytes;
+    uint64_t dst_bytes;
+    base::TimeDelta duration;
+    std::vector<Candidate> candidates;
+    // Whether algorithms were skipped because the time budget ran out.
+    bool budget_exceeded;
+  };
+
+  GenerationReport() = default;
+
+  // Records |diff| of a file of the target image stored in |image_path|.
+  void AddDiff(const std::string& image_path, Diff diff);
+
+  // Records the final operations |aops| of partition |name|, whose target
+  // image is stored in |image_path|.
+  void AddPartition(const std::string& name,
+                    const std::string& image_path,
+                    const std::vector<AnnotatedOperation>& aops);
+
+  // Adds |duration| of wall time and |cpu_duration| of CPU time to phase
+  // |name|, see ScopedPhase.
+  void AddPhase(const std::string& name,
+                base::TimeDelta duration,
+                base::TimeDelta cpu_duration);
+
+  // Returns the report as a JSON object with the phases by name, the
+  // partitions in the order they were added and, in each of them, the diffs of
+  // its image. Also includes the peak resident memory of the process so far.
+  std::string ToJson() const;
+
+ private:
+  struct OperationsSummary {
+    uint64_t count{0};
+    uint64_t data_size{0};
+  };
+  struct PhaseSummary {
+    uint64_t count{0};
+    base::TimeDelta duration;
+    base::TimeDelta cpu_duration;
+  };
+  struct Partition {
+    std::string name;
+    std::string image_path;
+    std::map<InstallOperation::Type, OperationsSummary> operations;
+  };
+
+  mutable std::mutex mutex_;
+  std::vector<Partition> partitions_;
+  // The diffs of each target image path.
+  std::map<std::string, std::vector<Diff>> diffs_;
+  std::map<std::string, PhaseSummary> phases_;
+
+  DISALLOW_COPY_AND_ASSIGN(GenerationReport);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_REPORT_H_
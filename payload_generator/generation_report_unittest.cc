@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_report.h"
+
+#include <string>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+using std::string;
+using testing::EndsWith;
+using testing::HasSubstr;
+using testing::StartsWith;
+
+namespace chromeos_update_engine {
+
+namespace {
+AnnotatedOperation MakeOperation(InstallOperation::Type type,
+                                 uint64_t data_length) {
+  AnnotatedOperation aop;
+  aop.op.set_type(type);
+  aop.op.set_data_length(data_length);
+  return aop;
+}
+}  // namespace
+
+class GenerationReportTest : public ::testing::Test {
+ protected:
+  GenerationReport report_;
+};
+
+TEST_F(GenerationReportTest, EmptyReport) {
+  const string json = report_.ToJson();
+  EXPECT_THAT(json, StartsWith("{\"peak_rss_bytes\":"));
+  EXPECT_THAT(json, EndsWith(",\"phases\":[],\"partitions\":[]}"));
+}
+
+TEST_F(GenerationReportTest, Phases) {
+  report_.AddPhase("merge_sequence",
+                   base::TimeDelta::FromMilliseconds(20),
+                   base::TimeDelta::FromMilliseconds(10));
+  report_.AddPhase("filesystem",
+                   base::TimeDelta::FromMilliseconds(30),
+                   base::TimeDelta::FromMilliseconds(5));
+  report_.AddPhase("merge_sequence",
+                   base::TimeDelta::FromMilliseconds(40),
+                   base::TimeDelta::FromMilliseconds(20));
+  { GenerationReport::ScopedPhase phase(nullptr, "ignored"); }
+
+  EXPECT_THAT(report_.ToJson(),
+              HasSubstr("\"phases\":["
+                        "{\"name\":\"filesystem\",\"count\":1,"
+                        "\"seconds\":0.030000,\"cpu_seconds\":0.005000},"
+                        "{\"name\":\"merge_sequence\",\"count\":2,"
+                        "\"seconds\":0.060000,\"cpu_seconds\":0.030000}],"));
+
+  { GenerationReport::ScopedPhase phase(&report_, "cow_estimation"); }
+  EXPECT_THAT(report_.ToJson(),
+              HasSubstr("{\"name\":\"cow_estimation\",\"count\":1,"));
+}
+
+TEST_F(GenerationReportTest, PartitionsAndDiffs) {
+  report_.AddDiff("/tmp/system.img",
+                  {"/bin/\"sh\"",
+                   InstallOperation::BROTLI_BSDIFF,
+                   100,
+                   8192,
+                   4096,
+                   base::TimeDelta::FromMilliseconds(30),
+                   {{InstallOperation::REPLACE_XZ,
+                     2000,
+                     base::TimeDelta::FromMilliseconds(10)},
+                    {InstallOperation::BROTLI_BSDIFF,
+                     100,
+                     base::TimeDelta::FromMilliseconds(20)}},
+                   true});
+  report_.AddDiff("/tmp/vendor.img",
+                  {"/lib/foo.so",
+                   InstallOperation::REPLACE,
+                   4096,
+                   0,
+                   4096,
+                   base::TimeDelta(),
+                   {},
+                   false});
+  report_.AddPartition("system",
+                       "/tmp/system.img",
+                       {MakeOperation(InstallOperation::SOURCE_COPY, 0),
+                        MakeOperation(InstallOperation::BROTLI_BSDIFF, 100),
+                        MakeOperation(InstallOperation::BROTLI_BSDIFF, 50)});
+
+  // Diffs of images without a partition are omitted.
+  EXPECT_THAT(
+      report_.ToJson(),
+      EndsWith("\"partitions\":[{\"name\":\"system\",\"operations\":["
+               "{\"type\":\"SOURCE_COPY\",\"count\":1,\"data_size\":0},"
+               "{\"type\":\"BROTLI_BSDIFF\",\"count\":2,\"data_size\":150}"
+               "],\"diffs\":[{\"name\":\"/bin/\\\"sh\\\"\","
+               "\"type\":\"BROTLI_BSDIFF\",\"data_size\":100,"
+               "\"src_bytes\":8192,\"dst_bytes\":4096,\"seconds\":0.030000,"
+               "\"candidates\":["
+               "{\"type\":\"REPLACE_XZ\",\"size\":2000,\"seconds\":0.010000},"
+               "{\"type\":\"BROTLI_BSDIFF\",\"size\":100,"
+               "\"seconds\":0.020000}],\"budget_exceeded\":true}]}]}"));
+}
+
+}  // namespace chromeos_update_engine
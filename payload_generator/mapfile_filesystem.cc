@@ -17,24 +17,41 @@
 #include "update_engine/payload_generator/mapfile_filesystem.h"
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <iterator>
 #include <map>
+#include <utility>
 
-#include <android-base/parseint.h>
-#include <base/files/file_util.h>
 #include <base/logging.h>
 #include <base/memory/ptr_util.h>
-#include <base/strings/string_split.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/mapped_file.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
+using std::string_view;
 using std::vector;
 
 namespace {
 // The .map file is defined in terms of 4K blocks.
 size_t kMapfileBlockSize = 4096;
+
+// The .map file is parsed in chunks of about this many bytes.
+constexpr size_t kParseChunkSize = 1024 * 1024;
+
+// Parses the decimal block number |text| into |block|.
+bool ParseBlock(string_view text, uint64_t* block) {
+  if (text.empty())
+    return false;
+  const auto [end, error] =
+      std::from_chars(text.data(), text.data() + text.size(), *block);
+  return error == std::errc() && end == text.data() + text.size();
+}
 }  // namespace
 
 namespace chromeos_update_engine {
@@ -78,34 +95,89 @@ size_t MapfileFilesystem::GetBlockCount() const {
 bool MapfileFilesystem::GetFiles(vector<File>* files) const {
   files->clear();
 
-  string file_data;
-  if (!base::ReadFileToString(base::FilePath(mapfile_filename_), &file_data)) {
+  const off_t file_size = utils::FileSize(mapfile_filename_);
+  MappedFile mapfile;
+  if (file_size < 0 || !mapfile.Map(mapfile_filename_, file_size)) {
     LOG(ERROR) << "Unable to read .map file: " << mapfile_filename_;
     return false;
   }
+  const string_view file_data(reinterpret_cast<const char*>(mapfile.data()),
+                              mapfile.size());
+
+  // Split the file in chunks of whole lines, the last line of a chunk is the
+  // one ending after kParseChunkSize bytes.
+  vector<string_view> chunks;
+  for (size_t begin = 0; begin < file_data.size();) {
+    size_t end = file_data.find(
+        '\n', std::min(file_data.size(), begin + kParseChunkSize) - 1);
+    end = end == string_view::npos ? file_data.size() : end + 1;
+    chunks.push_back(file_data.substr(begin, end - begin));
+    begin = end;
+  }
+
+  // When called from a TaskScheduler task, e.g. while generating a payload,
+  // the chunks are parsed on its threads.
+  std::unique_ptr<TaskScheduler> own_scheduler;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler == nullptr && chunks.size() > 1) {
+    own_scheduler =
+        std::make_unique<TaskScheduler>(diff_utils::GetMaxThreads());
+    scheduler = own_scheduler.get();
+  }
+  vector<vector<File>> chunk_files(chunks.size());
+  std::atomic<bool> failed{false};
+  if (scheduler != nullptr) {
+    TaskScheduler::TaskGroup group(scheduler, false);
+    for (size_t i = 0; i < chunks.size(); i++) {
+      group.Submit(chunks[i].size(), [&, i]() {
+        if (!ParseLines(chunks[i], i + 1 == chunks.size(), &chunk_files[i])) {
+          failed = true;
+        }
+      });
+    }
+    group.Wait();
+  } else if (!chunks.empty()) {
+    failed = !ParseLines(chunks[0], true, &chunk_files[0]);
+  }
+  if (failed) {
+    return false;
+  }
+
+  for (auto& chunk : chunk_files) {
+    std::move(chunk.begin(), chunk.end(), std::back_inserter(*files));
+  }
+  return true;
+}
+
+bool MapfileFilesystem::ParseLines(string_view chunk,
+                                   bool last_chunk,
+                                   vector<File>* files) const {
+  // Iterate over all the lines in the chunk and generate one File entry per
+  // line. The file ends with an empty line when it ends with a newline.
+  while (!chunk.empty() || last_chunk) {
+    const size_t newline = chunk.find('\n');
+    const string_view line = chunk.substr(0, newline);
+    if (newline == string_view::npos) {
+      chunk = {};
+      last_chunk = false;
+    } else {
+      chunk.remove_prefix(newline + 1);
+    }
 
-  // Iterate over all the lines in the file and generate one File entry per
-  // line.
-  vector<base::StringPiece> lines = base::SplitStringPiece(
-      file_data, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
-  for (const base::StringPiece& line : lines) {
     File mapped_file;
 
     mapped_file.extents = {};
     size_t delim, last_delim = line.size();
     while ((delim = line.rfind(' ', last_delim - 1)) != string::npos) {
-      string blocks =
-          line.substr(delim + 1, last_delim - (delim + 1)).as_string();
+      const string_view blocks =
+          line.substr(delim + 1, last_delim - (delim + 1));
       size_t dash = blocks.find('-', 0);
       uint64_t block_start, block_end;
-      if (dash == string::npos &&
-          android::base::ParseUint<uint64_t>(blocks, &block_start)) {
+      if (dash == string::npos && ParseBlock(blocks, &block_start)) {
         mapped_file.extents.push_back(ExtentForRange(block_start, 1));
       } else if (dash != string::npos &&
-                 android::base::ParseUint<uint64_t>(blocks.substr(0, dash),
-                                                    &block_start) &&
-                 android::base::ParseUint<uint64_t>(blocks.substr(dash + 1),
-                                                    &block_end)) {
+                 ParseBlock(blocks.substr(0, dash), &block_start) &&
+                 ParseBlock(blocks.substr(dash + 1), &block_end)) {
         if (block_end < block_start) {
           LOG(ERROR) << "End block " << block_end
                      << " is smaller than start block " << block_start
@@ -135,11 +207,10 @@ bool MapfileFilesystem::GetFiles(vector<File>* files) const {
 
     if (last_delim == string::npos)
       continue;
-    mapped_file.name = line.substr(0, last_delim).as_string();
+    mapped_file.name = string(line.substr(0, last_delim));
 
-    files->push_back(mapped_file);
+    files->push_back(std::move(mapped_file));
   }
-
   return true;
 }
 
@@ -28,6 +28,7 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace chromeos_update_engine {
@@ -43,12 +44,19 @@ class MapfileFilesystem : public FilesystemInterface {
   size_t GetBlockCount() const override;
 
   // All the generated FilesystemInterface::File are reported as regular files.
-  // Files may overlap with other files in the same block.
+  // Files may overlap with other files in the same block. The .map file is
+  // mapped and its chunks of lines parsed in parallel.
   bool GetFiles(std::vector<File>* files) const override;
 
  private:
   MapfileFilesystem(const std::string& mapfile_filename, off_t num_blocks);
 
+  // Appends the files of the lines of |chunk| to |files|. The lines end with a
+  // newline, except the last one of the |last_chunk| which may be empty.
+  bool ParseLines(std::string_view chunk,
+                  bool last_chunk,
+                  std::vector<File>* files) const;
+
   // The file where the map filesystem is stored.
   std::string mapfile_filename_;
 
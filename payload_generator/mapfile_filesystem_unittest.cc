@@ -106,6 +106,36 @@ TEST_F(MapfileFilesystemTest, SeveralFileFormatTest) {
   EXPECT_EQ(map_files["/1234"].extents, (vector<Extent>{ExtentForRange(7, 1)}));
 }
 
+TEST_F(MapfileFilesystemTest, LargeMapfileTest) {
+  // Large enough to be parsed in several chunks, which keep the file order.
+  constexpr uint64_t kNumFiles = 100000;
+  string text;
+  for (uint64_t i = 0; i < kNumFiles; i++) {
+    text += android::base::StringPrintf(
+        "/dir/file%" PRIu64 " %" PRIu64 "-%" PRIu64 "\n", i, i * 2, i * 2 + 1);
+  }
+  test_utils::WriteFileString(temp_mapfile_.path(), text);
+  EXPECT_EQ(0,
+            HANDLE_EINTR(truncate(temp_file_.path().c_str(),
+                                  4096 * 2 * kNumFiles)));
+
+  unique_ptr<MapfileFilesystem> fs = MapfileFilesystem::CreateFromFile(
+      temp_file_.path(), temp_mapfile_.path());
+  ASSERT_NE(nullptr, fs.get());
+
+  vector<FilesystemInterface::File> files;
+  EXPECT_TRUE(fs->GetFiles(&files));
+  // The newline at the end of the file is followed by an empty line.
+  ASSERT_EQ(kNumFiles + 1, files.size());
+  for (uint64_t i = 0; i < kNumFiles; i++) {
+    EXPECT_EQ(android::base::StringPrintf("/dir/file%" PRIu64, i),
+              files[i].name);
+    EXPECT_EQ((vector<Extent>{ExtentForRange(i * 2, 2)}), files[i].extents);
+  }
+  EXPECT_TRUE(files.back().name.empty());
+  EXPECT_TRUE(files.back().extents.empty());
+}
+
 TEST_F(MapfileFilesystemTest, BlockNumberTooBigTest) {
   test_utils::WriteFileString(temp_mapfile_.path(), "/some/file 1-4\n");
   EXPECT_EQ(0, HANDLE_EINTR(truncate(temp_file_.path().c_str(), 4096 * 3)));
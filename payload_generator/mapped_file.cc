@@ -0,0 +1,150 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_file.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+}
+
+std::shared_ptr<const MappedFile> MappedFile::OpenShared(
+    const std::string& path) {
+  static std::mutex mutex;
+  static std::map<std::string, std::weak_ptr<const MappedFile>> mappings;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& mapping = mappings[path];
+  std::shared_ptr<const MappedFile> file = mapping.lock();
+  if (file) {
+    return file;
+  }
+  const off_t size = utils::FileSize(path);
+  if (size < 0) {
+    return nullptr;
+  }
+  auto new_file = std::make_shared<MappedFile>();
+  if (!new_file->Map(path, size)) {
+    return nullptr;
+  }
+  mapping = new_file;
+  return new_file;
+}
+
+bool MappedFile::Map(const std::string& path, size_t size) {
+  TEST_AND_RETURN_FALSE(data_ == nullptr);
+  if (size == 0) {
+    return true;
+  }
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  // Accessing pages past the end of the file raises SIGBUS.
+  const off_t file_size = utils::FileSize(fd);
+  if (file_size < 0 || static_cast<uint64_t>(file_size) < size) {
+    LOG(ERROR) << path << " is smaller than " << size << " bytes";
+    return false;
+  }
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    PLOG(WARNING) << "Unable to map " << path;
+    return false;
+  }
+  data_ = static_cast<const uint8_t*>(mapping);
+  size_ = size;
+  return true;
+}
+
+bool MappedFile::Contains(const Extent& extent, size_t block_size) const {
+  const uint64_t blocks = size_ / block_size;
+  return extent.start_block() <= blocks &&
+         extent.num_blocks() <= blocks - extent.start_block();
+}
+
+bool MappedFile::ReadExtents(const std::vector<Extent>& extents,
+                             size_t block_size,
+                             brillo::Blob* out_data) const {
+  out_data->clear();
+  for (const Extent& extent : extents) {
+    TEST_AND_RETURN_FALSE(Contains(extent, block_size));
+    const uint8_t* start = data_ + extent.start_block() * block_size;
+    out_data->insert(
+        out_data->end(), start, start + extent.num_blocks() * block_size);
+  }
+  return true;
+}
+
+bool MappedExtentsEqual(const MappedFile& file,
+                        const std::vector<Extent>& extents,
+                        const MappedFile& other_file,
+                        const std::vector<Extent>& other_extents,
+                        size_t block_size) {
+  if (utils::BlocksInExtents(extents) !=
+      utils::BlocksInExtents(other_extents)) {
+    return false;
+  }
+  // Walk both lists at once, comparing the longest run of blocks both of the
+  // current extents still have.
+  size_t index = 0;
+  size_t other_index = 0;
+  uint64_t offset = 0;
+  uint64_t other_offset = 0;
+  while (index < extents.size() && other_index < other_extents.size()) {
+    const Extent& extent = extents[index];
+    const Extent& other_extent = other_extents[other_index];
+    if (!file.Contains(extent, block_size) ||
+        !other_file.Contains(other_extent, block_size)) {
+      return false;
+    }
+    const uint64_t blocks = std::min(extent.num_blocks() - offset,
+                                     other_extent.num_blocks() - other_offset);
+    if (blocks > 0 &&
+        memcmp(file.data() + (extent.start_block() + offset) * block_size,
+               other_file.data() +
+                   (other_extent.start_block() + other_offset) * block_size,
+               blocks * block_size) != 0) {
+      return false;
+    }
+    offset += blocks;
+    other_offset += blocks;
+    if (offset == extent.num_blocks()) {
+      index++;
+      offset = 0;
+    }
+    if (other_offset == other_extent.num_blocks()) {
+      other_index++;
+      other_offset = 0;
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_FILE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A read-only mapping of a partition image, so its blocks are accessed
+// without reading them into buffers first.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  ~MappedFile();
+
+  // Returns the mapping of the whole file |path|, shared with everyone else
+  // still holding a mapping of |path| so all threads diffing the same image
+  // use the same pages. Returns nullptr if the file can't be mapped.
+  static std::shared_ptr<const MappedFile> OpenShared(const std::string& path);
+
+  // Maps the first |size| bytes of |path|, which must be at least that large.
+  // An empty file or |size| of 0 maps nothing.
+  bool Map(const std::string& path, size_t size);
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // Copies the data of |extents| in order to |out_data|, reusing its
+  // storage. Fails if any extent is out of bounds.
+  bool ReadExtents(const std::vector<Extent>& extents,
+                   size_t block_size,
+                   brillo::Blob* out_data) const;
+
+  // Whether |extent| of blocks of |block_size| bytes lies within the mapping.
+  bool Contains(const Extent& extent, size_t block_size) const;
+
+ private:
+  const uint8_t* data_{nullptr};
+  size_t size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MappedFile);
+};
+
+// Whether the data of |extents| in |file| equals the data of |other_extents|
+// in |other_file|. Compares the mapped data without copying it.
+bool MappedExtentsEqual(const MappedFile& file,
+                        const std::vector<Extent>& extents,
+                        const MappedFile& other_file,
+                        const std::vector<Extent>& other_extents,
+                        size_t block_size);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_FILE_H_
@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_file.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class MappedFileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    contents_.resize(8 * block_size_);
+    for (size_t i = 0; i < contents_.size(); i++) {
+      contents_[i] = 'a' + i / block_size_;
+    }
+    ASSERT_TRUE(test_utils::WriteFileString(file_.path(), contents_));
+  }
+
+  ScopedTempFile file_{"MappedFileTest.XXXXXX"};
+  size_t block_size_{1024};
+  string contents_;
+};
+
+TEST_F(MappedFileTest, ReadExtents) {
+  MappedFile file;
+  ASSERT_TRUE(file.Map(file_.path(), contents_.size()));
+  brillo::Blob data;
+  ASSERT_TRUE(file.ReadExtents(
+      {ExtentForRange(5, 2), ExtentForRange(1, 1)}, block_size_, &data));
+  ASSERT_EQ(contents_.substr(5 * block_size_, 2 * block_size_) +
+                contents_.substr(block_size_, block_size_),
+            string(data.begin(), data.end()));
+  ASSERT_FALSE(file.ReadExtents({ExtentForRange(7, 2)}, block_size_, &data));
+}
+
+TEST_F(MappedFileTest, MapFailsPastEndOfFile) {
+  MappedFile file;
+  ASSERT_FALSE(file.Map(file_.path(), contents_.size() + 1));
+}
+
+TEST_F(MappedFileTest, OpenSharedReusesMapping) {
+  auto first = MappedFile::OpenShared(file_.path());
+  ASSERT_TRUE(first);
+  ASSERT_EQ(contents_.size(), first->size());
+  ASSERT_EQ(first, MappedFile::OpenShared(file_.path()));
+}
+
+TEST_F(MappedFileTest, ExtentsEqual) {
+  MappedFile file;
+  ASSERT_TRUE(file.Map(file_.path(), contents_.size()));
+  // The same blocks split differently.
+  ASSERT_TRUE(MappedExtentsEqual(file,
+                                 {ExtentForRange(1, 3)},
+                                 file,
+                                 {ExtentForRange(1, 1), ExtentForRange(2, 2)},
+                                 block_size_));
+  ASSERT_FALSE(MappedExtentsEqual(
+      file, {ExtentForRange(1, 2)}, file, {ExtentForRange(2, 2)}, block_size_));
+  ASSERT_FALSE(MappedExtentsEqual(
+      file, {ExtentForRange(1, 2)}, file, {ExtentForRange(1, 1)}, block_size_));
+  // Out of bounds extents never match.
+  ASSERT_FALSE(MappedExtentsEqual(
+      file, {ExtentForRange(7, 2)}, file, {ExtentForRange(7, 2)}, block_size_));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,227 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/memory_patch_writer.h"
+
+#include <brotli/encode.h>
+#include <bzlib.h>
+
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/zstd_bspatch.h"
+#include "update_engine/payload_generator/zstd_compress.h"
+
+using bsdiff::CompressorType;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr char kLegacyMagic[] = "BSDIFF40";
+constexpr char kBsdf2Magic[] = "BSDF2";
+// The magic and the sizes of the control and diff streams and new file.
+constexpr size_t kHeaderSize = 32;
+// Zstd compressed streams are used unless they make the patch more than
+// 1/kZstdMaxOverhead larger.
+constexpr size_t kZstdMaxOverhead = 50;
+
+// Stores |value| in |buffer| in the sign-magnitude little endian format of
+// bsdiff patches.
+void EncodeInt64(int64_t value, uint8_t* buffer) {
+  uint64_t magnitude = value < 0 ? (1ULL << 63) - value : value;
+  for (size_t i = 0; i < 8; i++) {
+    buffer[i] = magnitude & 0xff;
+    magnitude >>= 8;
+  }
+}
+
+void AppendInt64(int64_t value, brillo::Blob* blob) {
+  uint8_t buffer[8];
+  EncodeInt64(value, buffer);
+  blob->insert(blob->end(), buffer, buffer + sizeof(buffer));
+}
+
+// Unlike BzipCompress(), also produces a bzip2 stream for empty data, which
+// bspatch expects for every stream.
+bool Bzip2Compress(const brillo::Blob& data, brillo::Blob* output) {
+  // The bound documented by libbzip2.
+  const size_t bound = data.size() + data.size() / 100 + 600;
+  TEST_AND_RETURN_FALSE(bound <= std::numeric_limits<unsigned int>::max());
+  output->resize(bound);
+  unsigned int output_size = bound;
+  const int rc = BZ2_bzBuffToBuffCompress(
+      reinterpret_cast<char*>(output->data()),
+      &output_size,
+      reinterpret_cast<char*>(const_cast<uint8_t*>(data.data())),
+      data.size(),
+      9,   // Best compression
+      0,   // Silent verbosity
+      0);  // Default work factor
+  TEST_AND_RETURN_FALSE(rc == BZ_OK);
+  output->resize(output_size);
+  return true;
+}
+
+bool BrotliCompress(const brillo::Blob& data,
+                    int quality,
+                    brillo::Blob* output) {
+  size_t output_size = BrotliEncoderMaxCompressedSize(data.size());
+  TEST_AND_RETURN_FALSE(output_size > 0);
+  output->resize(output_size);
+  TEST_AND_RETURN_FALSE(BrotliEncoderCompress(quality,
+                                              BROTLI_MAX_WINDOW_BITS,
+                                              BROTLI_MODE_GENERIC,
+                                              data.size(),
+                                              data.data(),
+                                              &output_size,
+                                              output->data()));
+  output->resize(output_size);
+  return true;
+}
+}  // namespace
+
+MemoryPatchWriter::MemoryPatchWriter(brillo::Blob* patch)
+    : patch_(patch),
+      legacy_(true),
+      types_({CompressorType::kBZ2}),
+      brotli_quality_(0),
+      allow_zstd_(false) {}
+
+MemoryPatchWriter::MemoryPatchWriter(brillo::Blob* patch,
+                                     const vector<CompressorType>& types,
+                                     int brotli_quality,
+                                     bool allow_zstd)
+    : patch_(patch),
+      legacy_(false),
+      types_(types),
+      brotli_quality_(brotli_quality),
+      allow_zstd_(allow_zstd) {}
+
+bool MemoryPatchWriter::Init(size_t new_size) {
+  TEST_AND_RETURN_FALSE(patch_ != nullptr);
+  TEST_AND_RETURN_FALSE(!types_.empty());
+  new_size_ = new_size;
+  written_size_ = 0;
+  ctrl_stream_.clear();
+  diff_stream_.clear();
+  extra_stream_.clear();
+  return true;
+}
+
+bool MemoryPatchWriter::WriteDiffStream(const uint8_t* data, size_t size) {
+  diff_stream_.insert(diff_stream_.end(), data, data + size);
+  return true;
+}
+
+bool MemoryPatchWriter::WriteExtraStream(const uint8_t* data, size_t size) {
+  extra_stream_.insert(extra_stream_.end(), data, data + size);
+  return true;
+}
+
+bool MemoryPatchWriter::AddControlEntry(const bsdiff::ControlEntry& entry) {
+  AppendInt64(entry.diff_size, &ctrl_stream_);
+  AppendInt64(entry.extra_size, &ctrl_stream_);
+  AppendInt64(entry.offset_increment, &ctrl_stream_);
+  written_size_ += entry.diff_size + entry.extra_size;
+  return true;
+}
+
+bool MemoryPatchWriter::CompressStream(const brillo::Blob& stream,
+                                       CompressorType* type,
+                                       brillo::Blob* output) const {
+  output->clear();
+  for (const CompressorType candidate : types_) {
+    brillo::Blob compressed;
+    switch (candidate) {
+      case CompressorType::kBZ2:
+        TEST_AND_RETURN_FALSE(Bzip2Compress(stream, &compressed));
+        break;
+      case CompressorType::kBrotli:
+        TEST_AND_RETURN_FALSE(
+            BrotliCompress(stream, brotli_quality_, &compressed));
+        break;
+      default:
+        LOG(ERROR) << "Unsupported bsdiff compressor "
+                   << static_cast<int>(candidate);
+        return false;
+    }
+    if (output->empty() || compressed.size() < output->size()) {
+      *type = candidate;
+      *output = std::move(compressed);
+    }
+  }
+  return true;
+}
+
+bool MemoryPatchWriter::Close() {
+  if (written_size_ != new_size_) {
+    LOG(ERROR) << "The control entries produce " << written_size_
+               << " bytes, expected " << new_size_;
+    return false;
+  }
+
+  CompressorType types[3];
+  brillo::Blob streams[3];
+  TEST_AND_RETURN_FALSE(CompressStream(ctrl_stream_, &types[0], &streams[0]));
+  TEST_AND_RETURN_FALSE(CompressStream(diff_stream_, &types[1], &streams[1]));
+  TEST_AND_RETURN_FALSE(CompressStream(extra_stream_, &types[2], &streams[2]));
+  uint8_t type_bytes[3];
+  for (size_t i = 0; i < 3; i++) {
+    type_bytes[i] = static_cast<uint8_t>(types[i]);
+  }
+
+  if (allow_zstd_) {
+    // ZstdBspatch() only applies patches with all their streams in zstd.
+    brillo::Blob zstd_streams[3];
+    TEST_AND_RETURN_FALSE(ZstdCompress(ctrl_stream_, &zstd_streams[0]));
+    TEST_AND_RETURN_FALSE(ZstdCompress(diff_stream_, &zstd_streams[1]));
+    TEST_AND_RETURN_FALSE(ZstdCompress(extra_stream_, &zstd_streams[2]));
+    size_t size = 0;
+    size_t zstd_size = 0;
+    for (size_t i = 0; i < 3; i++) {
+      size += streams[i].size();
+      zstd_size += zstd_streams[i].size();
+    }
+    if (zstd_size <= size + size / kZstdMaxOverhead) {
+      for (size_t i = 0; i < 3; i++) {
+        streams[i] = std::move(zstd_streams[i]);
+        type_bytes[i] = kBsdiffZstdCompressorType;
+      }
+    }
+  }
+
+  patch_->assign(kHeaderSize, 0);
+  if (legacy_) {
+    std::memcpy(patch_->data(), kLegacyMagic, 8);
+  } else {
+    std::memcpy(patch_->data(), kBsdf2Magic, 5);
+    std::memcpy(patch_->data() + 5, type_bytes, sizeof(type_bytes));
+  }
+  EncodeInt64(streams[0].size(), patch_->data() + 8);
+  EncodeInt64(streams[1].size(), patch_->data() + 16);
+  EncodeInt64(new_size_, patch_->data() + 24);
+  for (const brillo::Blob& stream : streams) {
+    patch_->insert(patch_->end(), stream.begin(), stream.end());
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
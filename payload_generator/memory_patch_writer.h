@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_MEMORY_PATCH_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_MEMORY_PATCH_WRITER_H_
+
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <bsdiff/constants.h>
+#include <bsdiff/control_entry.h>
+#include <bsdiff/patch_writer_interface.h>
+
+namespace chromeos_update_engine {
+
+// A bsdiff patch writer storing the patch in a Blob instead of the file
+// bsdiff::BsdiffPatchWriter writes to, in the same BSDIFF40 or BSDF2 format.
+// The streams are kept uncompressed until Close() compresses them.
+class MemoryPatchWriter : public bsdiff::PatchWriterInterface {
+ public:
+  // Writes a BSDIFF40 patch, with bzip2 compressed streams, to |patch|.
+  explicit MemoryPatchWriter(brillo::Blob* patch);
+
+  // Writes a BSDF2 patch to |patch|, each stream compressed with the one of
+  // |types| giving the smallest result. Brotli uses |brotli_quality|. With
+  // |allow_zstd|, all the streams are compressed with zstd instead unless that
+  // makes the patch noticeably larger, since it's much faster to apply.
+  MemoryPatchWriter(brillo::Blob* patch,
+                    const std::vector<bsdiff::CompressorType>& types,
+                    int brotli_quality,
+                    bool allow_zstd = false);
+
+  // bsdiff::PatchWriterInterface overrides.
+  bool Init(size_t new_size) override;
+  bool WriteDiffStream(const uint8_t* data, size_t size) override;
+  bool WriteExtraStream(const uint8_t* data, size_t size) override;
+  bool AddControlEntry(const bsdiff::ControlEntry& entry) override;
+  bool Close() override;
+
+ private:
+  // Compresses |stream| with the smallest of |types_| into |output|.
+  bool CompressStream(const brillo::Blob& stream,
+                      bsdiff::CompressorType* type,
+                      brillo::Blob* output) const;
+
+  brillo::Blob* patch_;
+  const bool legacy_;
+  const std::vector<bsdiff::CompressorType> types_;
+  const int brotli_quality_;
+  const bool allow_zstd_;
+
+  size_t new_size_{0};
+  // The bytes of the new file the control entries added so far produce.
+  uint64_t written_size_{0};
+  brillo::Blob ctrl_stream_;
+  brillo::Blob diff_stream_;
+  brillo::Blob extra_stream_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryPatchWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_MEMORY_PATCH_WRITER_H_
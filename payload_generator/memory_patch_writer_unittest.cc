@@ -0,0 +1,113 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/memory_patch_writer.h"
+
+#include <string>
+#include <vector>
+
+#include <bsdiff/bsdiff.h>
+#include <bsdiff/bspatch.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+
+using bsdiff::CompressorType;
+
+namespace chromeos_update_engine {
+
+class MemoryPatchWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_data_.resize(20000);
+    test_utils::FillWithData(&old_data_);
+    new_data_ = old_data_;
+    new_data_.erase(new_data_.begin() + 100, new_data_.begin() + 300);
+    for (size_t i = 5000; i < 6000; i += 7) {
+      new_data_[i]++;
+    }
+    new_data_.insert(new_data_.end(), 3000, 'x');
+  }
+
+  void Diff(MemoryPatchWriter* writer) {
+    ASSERT_EQ(0,
+              bsdiff::bsdiff(old_data_.data(),
+                             old_data_.size(),
+                             new_data_.data(),
+                             new_data_.size(),
+                             writer,
+                             nullptr));
+  }
+
+  brillo::Blob Patch(const brillo::Blob& patch) {
+    brillo::Blob output;
+    EXPECT_EQ(0,
+              bsdiff::bspatch(old_data_.data(),
+                              old_data_.size(),
+                              patch.data(),
+                              patch.size(),
+                              [&output](const uint8_t* data, size_t size) {
+                                output.insert(output.end(), data, data + size);
+                                return size;
+                              }));
+    return output;
+  }
+
+  brillo::Blob old_data_;
+  brillo::Blob new_data_;
+};
+
+TEST_F(MemoryPatchWriterTest, LegacyPatch) {
+  brillo::Blob patch;
+  MemoryPatchWriter writer(&patch);
+  Diff(&writer);
+  ASSERT_EQ("BSDIFF40", std::string(patch.begin(), patch.begin() + 8));
+  EXPECT_EQ(new_data_, Patch(patch));
+}
+
+TEST_F(MemoryPatchWriterTest, Bsdf2Patch) {
+  for (const auto& types :
+       {std::vector<CompressorType>{CompressorType::kBrotli},
+        std::vector<CompressorType>{CompressorType::kBZ2,
+                                    CompressorType::kBrotli}}) {
+    brillo::Blob patch;
+    MemoryPatchWriter writer(&patch, types, 9);
+    Diff(&writer);
+    ASSERT_EQ("BSDF2", std::string(patch.begin(), patch.begin() + 5));
+    EXPECT_EQ(new_data_, Patch(patch));
+  }
+}
+
+TEST_F(MemoryPatchWriterTest, IdenticalData) {
+  // The extra stream is empty.
+  new_data_ = old_data_;
+  brillo::Blob patch;
+  MemoryPatchWriter writer(&patch, {CompressorType::kBZ2}, 9);
+  Diff(&writer);
+  EXPECT_EQ(new_data_, Patch(patch));
+}
+
+TEST_F(MemoryPatchWriterTest, MismatchingSizeFails) {
+  brillo::Blob patch;
+  MemoryPatchWriter writer(&patch);
+  ASSERT_TRUE(writer.Init(10));
+  const uint8_t data[4] = {1, 2, 3, 4};
+  ASSERT_TRUE(writer.WriteDiffStream(data, sizeof(data)));
+  ASSERT_TRUE(writer.AddControlEntry({4, 0, 0}));
+  EXPECT_FALSE(writer.Close());
+}
+
+}  // namespace chromeos_update_engine
@@ -18,6 +18,10 @@
 
 #include <algorithm>
 #include <limits>
+#include <set>
+#include <utility>
+
+#include <android-base/macros.h>
 
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
@@ -196,114 +200,106 @@ std::unique_ptr<MergeSequenceGenerator> MergeSequenceGenerator::Create(
       new MergeSequenceGenerator(sequence, partition_name));
 }
 
-template <typename T>
-CowMergeOperation MaxOutDegree(
-    const T& nodes,
-    const std::map<CowMergeOperation, std::set<CowMergeOperation>>&
-        merge_after) {
-  // Rationale for this algorithm:
-  // We only need to remove nodes from the graph if the graph contains a cycle.
-  // Any graph of N nodes has cycle iff number of edges >= N.
-  // So, to restore the graph back to an acyclic state, we need to keep removing
-  // edges until we have <N edges left. To minimize the number of nodes removed,
-  // we always remove the node with maximum out degree.
-  CowMergeOperation best;
-  size_t max_out_degree = 0;
-  const auto has_xor =
-      std::any_of(nodes.begin(),
-                  nodes.end(),
-                  [&merge_after](const CowMergeOperation& node) {
-                    if (node.type() != CowMergeOperation::COW_XOR) {
-                      return false;
-                    }
-                    auto it = merge_after.find(node);
-                    if (it == merge_after.end()) {
-                      return false;
-                    }
-                    return it->second.size() > 0;
-                  });
-  for (const auto& op : nodes) {
-    if (has_xor && op.type() != CowMergeOperation::COW_XOR) {
-      continue;
-    }
-    const auto out_degree = merge_after.at(op).size();
-    if (out_degree > max_out_degree) {
-      best = op;
-      max_out_degree = out_degree;
-    } else if (out_degree == max_out_degree) {
-      if (op.src_extent().num_blocks() < best.src_extent().num_blocks()) {
-        best = op;
-      }
+namespace {
+// Picks the node to remove from a potentially cyclic graph to break its
+// cycles. Nodes are indices into the sorted operations, and |merge_after|
+// is an outgoing edge list: |merge_after[a]| holds all nodes which `a` has
+// an outgoing edge to.
+// The only requirement is to return a node which is still in the graph. As
+// long as this is satisfied, merge sequence generation will work. Caller
+// will keep removing nodes returned by Pick() until the graph has no cycles.
+// However, the choice of which node to remove can greatly impact COW sizes.
+// Nodes removed from the graph will be converted to a COW_REPLACE operation,
+// taking more disk space. So we should try to pick a node which minimizes
+// number of nodes we have to remove. (Modulo the weight of each node, which
+// is how many blocks a CowMergeOperation touches)
+//
+// Rationale for this algorithm:
+// We only need to remove nodes from the graph if the graph contains a cycle.
+// Any graph of N nodes has cycle iff number of edges >= N.
+// So, to restore the graph back to an acyclic state, we need to keep removing
+// edges until we have <N edges left. To minimize the number of nodes removed,
+// we always remove the node with maximum out degree, preferring XOR nodes.
+// Out degrees don't change while nodes are removed, so the nodes are kept
+// ordered by preference instead of scanning the whole graph on every pick.
+class ConvertToRawPicker {
+ public:
+  ConvertToRawPicker(const std::vector<CowMergeOperation>& operations,
+                     const std::vector<std::vector<size_t>>& merge_after)
+      : operations_(operations),
+        merge_after_(merge_after),
+        nodes_(Preferred{this}),
+        xor_nodes_(Preferred{this}) {}
+
+  // Makes |node| a candidate of Pick().
+  void Add(size_t node) {
+    nodes_.insert(node);
+    if (IsXorWithOutEdges(node)) {
+      xor_nodes_.insert(node);
     }
   }
-  CHECK_NE(max_out_degree, 0UL);
-  return best;
-}
 
-template <typename T>
-struct MapKeyIterator {
-  MapKeyIterator<T>& operator++() {
-    ++it;
-    return *this;
-  }
-  MapKeyIterator<T>& operator--() {
-    --it;
-    return *this;
+  void Remove(size_t node) {
+    nodes_.erase(node);
+    xor_nodes_.erase(node);
   }
-  bool operator==(const MapKeyIterator<T>& rhs) const { return it == rhs.it; }
-  bool operator!=(const MapKeyIterator<T>& rhs) const { return it != rhs.it; }
-  auto&& operator->() const { return it->first; }
-  auto&& operator*() const { return it->first; }
-  T it;
-};
 
-template <typename T, typename U>
-struct MapKeyRange {
-  auto begin() const {
-    return MapKeyIterator<typename std::map<T, U>::const_iterator>{map.begin()};
+  size_t Pick() const {
+    if (!xor_nodes_.empty()) {
+      return *xor_nodes_.begin();
+    }
+    CHECK(!nodes_.empty());
+    const size_t best = *nodes_.begin();
+    CHECK_NE(merge_after_[best].size(), 0UL);
+    return best;
   }
-  auto end() const {
-    return MapKeyIterator<typename std::map<T, U>::const_iterator>{map.end()};
+
+ private:
+  // Orders nodes by decreasing out degree, then by increasing number of src
+  // blocks, then by dst blocks.
+  struct Preferred {
+    bool operator()(size_t a, size_t b) const {
+      const auto a_degree = picker->merge_after_[a].size();
+      const auto b_degree = picker->merge_after_[b].size();
+      if (a_degree != b_degree) {
+        return a_degree > b_degree;
+      }
+      const auto a_blocks = picker->operations_[a].src_extent().num_blocks();
+      const auto b_blocks = picker->operations_[b].src_extent().num_blocks();
+      if (a_blocks != b_blocks) {
+        return a_blocks < b_blocks;
+      }
+      return a < b;
+    }
+    const ConvertToRawPicker* picker;
+  };
+
+  bool IsXorWithOutEdges(size_t node) const {
+    return operations_[node].type() == CowMergeOperation::COW_XOR &&
+           !merge_after_[node].empty();
   }
-  std::map<T, U> map;
-};
 
-CowMergeOperation MaxOutDegree(
-    const std::map<CowMergeOperation, int>& incoming_edges,
-    const std::map<CowMergeOperation, std::set<CowMergeOperation>>&
-        merge_after) {
-  return MaxOutDegree(MapKeyRange<CowMergeOperation, int>{incoming_edges},
-                      merge_after);
-}
+  const std::vector<CowMergeOperation>& operations_;
+  const std::vector<std::vector<size_t>>& merge_after_;
+  std::set<size_t, Preferred> nodes_;
+  // The XOR nodes of |nodes_| with outgoing edges, they are picked first.
+  std::set<size_t, Preferred> xor_nodes_;
 
-// Given a potentially cyclic graph, return a node to remove to break cycles
-// |incoming_edges| stores nodes' in degree, and |merge_after| is an outgoing
-// edge list. For example, |merge_after[a]| returns all nodes which `a` has an
-// out going edge to.
-// The only requirement of this function is to return a node which is in
-// |incoming_edges| . As long as this is satisfied, merge sequence generation
-// will work. Caller will keep removing nodes returned by this function until
-// the graph has no cycles. However, the choice of which node to remove can
-// greatly impact COW sizes. Nodes removed from the graph will be converted to a
-// COW_REPLACE operation, taking more disk space. So this function should try to
-// pick a node which minimizes number of nodes we have to remove. (Modulo the
-// weight of each node, which is how many blocks a CowMergeOperation touches)
-CowMergeOperation PickConvertToRaw(
-    const std::map<CowMergeOperation, int>& incoming_edges,
-    const std::map<CowMergeOperation, std::set<CowMergeOperation>>&
-        merge_after) {
-  return MaxOutDegree(incoming_edges, merge_after);
-}
+  DISALLOW_COPY_AND_ASSIGN(ConvertToRawPicker);
+};
+}  // namespace
 
-std::map<CowMergeOperation, std::set<CowMergeOperation>>
-MergeSequenceGenerator::FindDependency(
+std::vector<std::vector<size_t>> MergeSequenceGenerator::FindDependency(
     const std::vector<CowMergeOperation>& operations) {
   LOG(INFO) << "Finding dependencies";
 
-  // Since the OTA operation may reuse some source blocks, use the binary
-  // search on sorted dst extents to find overlaps.
-  std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
-  for (const auto& op : operations) {
+  // The dst extents never overlap, so once sorted by start block their end
+  // blocks are sorted too. Since the OTA operation may reuse some source
+  // blocks, use the binary search on sorted dst extents to find all the
+  // operations writing the src extent of each operation.
+  std::vector<std::vector<size_t>> merge_after(operations.size());
+  for (size_t i = 0; i < operations.size(); i++) {
+    const auto& op = operations[i];
     // lower bound (inclusive): dst extent's end block >= src extent's start
     // block.
     const auto lower_it = std::lower_bound(
@@ -326,27 +322,22 @@ MergeSequenceGenerator::FindDependency(
           return src_end_block < it.dst_extent().start_block();
         });
 
-    // TODO(xunchang) skip inserting the empty set to merge_after.
-    if (lower_it == upper_it) {
-      merge_after.insert({op, {}});
-    } else {
-      std::set<CowMergeOperation> operations(lower_it, upper_it);
-      auto it = operations.find(op);
-      if (it != operations.end()) {
+    merge_after[i].reserve(upper_it - lower_it);
+    for (auto it = lower_it; it != upper_it; ++it) {
+      const size_t blocked = it - operations.begin();
+      if (blocked == i) {
         LOG(INFO) << "Self overlapping " << op;
-        operations.erase(it);
+        continue;
       }
-      auto ret = merge_after.emplace(op, std::move(operations));
-      // Check the insertion indeed happens.
-      CHECK(ret.second) << op;
+      merge_after[i].push_back(blocked);
     }
   }
 
   return merge_after;
 }
 
-bool MergeSequenceGenerator::Generate(
-    std::vector<CowMergeOperation>* sequence) const {
+bool MergeSequenceGenerator::Generate(std::vector<CowMergeOperation>* sequence,
+                                      bool source_order) const {
   sequence->clear();
 
   LOG(INFO) << "Generating sequence";
@@ -354,74 +345,136 @@ bool MergeSequenceGenerator::Generate(
   // Use the non-DFS version of the topology sort. So we can control the
   // operations to discard to break cycles; thus yielding a deterministic
   // sequence.
-  std::map<CowMergeOperation, int> incoming_edges;
-  for (const auto& it : merge_after_) {
-    for (const auto& blocked : it.second) {
-      // Value is default initialized to 0.
+  std::vector<size_t> incoming_edges(operations_.size());
+  for (const auto& blocked_operations : merge_after_) {
+    for (const size_t blocked : blocked_operations) {
       incoming_edges[blocked] += 1;
     }
   }
 
-  // Technically, we can use std::unordered_set or just a std::vector. but
-  // std::set gives the benefit where operations are sorted by dst blocks. This
-  // will ensure that operations that do not have dependency constraints appear
-  // in increasing block order. Such order would help snapuserd batch merges and
-  // improve boot time, but isn't strictly needed for correctness.
-  std::set<CowMergeOperation> free_operations;
-  for (const auto& op : operations_) {
-    if (incoming_edges.find(op) == incoming_edges.end()) {
-      free_operations.insert(op);
+  // Nodes are indices into |operations_|, which are sorted by dst blocks.
+  // Keeping the free operations sorted ensures that operations that do not
+  // have dependency constraints appear in increasing block order. Such order
+  // would help snapuserd batch merges and improve boot time, but isn't
+  // strictly needed for correctness.
+  std::vector<size_t> free_operations;
+  // Whether an operation that had incoming edges is still in the graph.
+  std::vector<bool> pending(operations_.size());
+  size_t num_pending = 0;
+  ConvertToRawPicker picker(operations_, merge_after_);
+  for (size_t i = 0; i < operations_.size(); i++) {
+    if (incoming_edges[i] == 0) {
+      free_operations.push_back(i);
+    } else {
+      pending[i] = true;
+      num_pending++;
+      picker.Add(i);
     }
   }
 
-  std::vector<CowMergeOperation> merge_sequence;
-  std::set<CowMergeOperation> convert_to_raw;
-  while (!incoming_edges.empty()) {
+  std::vector<size_t> merge_sequence;
+  std::vector<size_t> convert_to_raw;
+  if (source_order) {
+    // Merge the free operations in increasing source block order from where
+    // the last merged operation read, starting over from the first block at
+    // the end, like an elevator sweeping the source.
+    std::set<std::pair<uint64_t, size_t>> ready;
+    for (const size_t op : free_operations) {
+      ready.emplace(operations_[op].src_extent().start_block(), op);
+    }
+    free_operations.clear();
+    uint64_t position = 0;
+    while (!ready.empty() || num_pending > 0) {
+      size_t op;
+      if (ready.empty()) {
+        op = picker.Pick();
+        CHECK(pending[op]);
+        convert_to_raw.push_back(op);
+        LOG(INFO) << "Converting operation to raw " << operations_[op];
+      } else {
+        auto it = ready.lower_bound({position, 0});
+        if (it == ready.end()) {
+          it = ready.begin();
+        }
+        op = it->second;
+        ready.erase(it);
+        merge_sequence.push_back(op);
+        const Extent& src_extent = operations_[op].src_extent();
+        position = src_extent.start_block() + src_extent.num_blocks();
+      }
+      if (pending[op]) {
+        pending[op] = false;
+        num_pending--;
+        picker.Remove(op);
+      }
+      for (const size_t blocked : merge_after_[op]) {
+        if (!pending[blocked]) {
+          continue;
+        }
+        auto blocking_transfer_count = &incoming_edges[blocked];
+        if (*blocking_transfer_count == 0) {
+          LOG(ERROR) << "Unexpected count in merge after map "
+                     << *blocking_transfer_count;
+          return false;
+        }
+        *blocking_transfer_count -= 1;
+        if (*blocking_transfer_count == 0) {
+          ready.emplace(operations_[blocked].src_extent().start_block(),
+                        blocked);
+        }
+      }
+    }
+  }
+  while (num_pending > 0) {
     if (!free_operations.empty()) {
       merge_sequence.insert(
           merge_sequence.end(), free_operations.begin(), free_operations.end());
     } else {
-      auto to_convert = PickConvertToRaw(incoming_edges, merge_after_);
+      const size_t to_convert = picker.Pick();
       // The operation we pick must be one of the nodes not already in merge
       // sequence.
-      CHECK(incoming_edges.find(to_convert) != incoming_edges.end());
+      CHECK(pending[to_convert]);
 
-      free_operations.insert(to_convert);
-      convert_to_raw.insert(to_convert);
-      LOG(INFO) << "Converting operation to raw " << to_convert;
+      free_operations.push_back(to_convert);
+      convert_to_raw.push_back(to_convert);
+      LOG(INFO) << "Converting operation to raw " << operations_[to_convert];
     }
 
-    std::set<CowMergeOperation> next_free_operations;
-    for (const auto& op : free_operations) {
-      incoming_edges.erase(op);
+    std::vector<size_t> next_free_operations;
+    for (const size_t op : free_operations) {
+      if (pending[op]) {
+        pending[op] = false;
+        num_pending--;
+        picker.Remove(op);
+      }
 
       // Now that this particular operation is merged, other operations
       // blocked by this one may be free. Decrement the count of blocking
       // operations, and set up the free operations for the next iteration.
-      for (const auto& blocked : merge_after_.at(op)) {
-        auto it = incoming_edges.find(blocked);
-        if (it == incoming_edges.end()) {
+      for (const size_t blocked : merge_after_[op]) {
+        if (!pending[blocked]) {
           continue;
         }
 
-        auto blocking_transfer_count = &it->second;
-        if (*blocking_transfer_count <= 0) {
+        auto blocking_transfer_count = &incoming_edges[blocked];
+        if (*blocking_transfer_count == 0) {
           LOG(ERROR) << "Unexpected count in merge after map "
-                     << blocking_transfer_count;
+                     << *blocking_transfer_count;
           return false;
         }
         // This operation is no longer blocked by anyone. Add it to the merge
         // sequence in the next iteration.
         *blocking_transfer_count -= 1;
         if (*blocking_transfer_count == 0) {
-          next_free_operations.insert(blocked);
+          next_free_operations.push_back(blocked);
         }
       }
     }
 
-    LOG(INFO) << "Remaining transfers " << incoming_edges.size()
-              << ", free transfers " << free_operations.size()
-              << ", merge_sequence size " << merge_sequence.size();
+    LOG(INFO) << "Remaining transfers " << num_pending << ", free transfers "
+              << free_operations.size() << ", merge_sequence size "
+              << merge_sequence.size();
+    std::sort(next_free_operations.begin(), next_free_operations.end());
     free_operations = std::move(next_free_operations);
   }
 
@@ -433,24 +486,27 @@ bool MergeSequenceGenerator::Generate(
   CHECK_EQ(operations_.size(), merge_sequence.size() + convert_to_raw.size());
 
   size_t blocks_in_sequence = 0;
-  for (const CowMergeOperation& transfer : merge_sequence) {
-    blocks_in_sequence += transfer.dst_extent().num_blocks();
+  std::vector<CowMergeOperation> result;
+  result.reserve(merge_sequence.size());
+  for (const size_t op : merge_sequence) {
+    blocks_in_sequence += operations_[op].dst_extent().num_blocks();
+    result.push_back(operations_[op]);
   }
 
   size_t blocks_in_raw = 0;
-  for (const CowMergeOperation& transfer : convert_to_raw) {
-    blocks_in_raw += transfer.dst_extent().num_blocks();
+  for (const size_t op : convert_to_raw) {
+    blocks_in_raw += operations_[op].dst_extent().num_blocks();
   }
 
   LOG(INFO) << "Blocks in merge sequence " << blocks_in_sequence
             << ", blocks in raw " << blocks_in_raw << ", partition "
             << partition_name_;
-  if (!ValidateSequence(merge_sequence)) {
+  if (!ValidateSequence(result)) {
     LOG(ERROR) << "Invalid Sequence";
     return false;
   }
 
-  *sequence = std::move(merge_sequence);
+  *sequence = std::move(result);
   return true;
 }
 
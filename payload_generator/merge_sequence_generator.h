@@ -17,9 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_MERGE_SEQUENCE_GENERATOR_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_MERGE_SEQUENCE_GENERATOR_H_
 
-#include <map>
 #include <memory>
-#include <set>
 #include <utility>
 #include <vector>
 
@@ -67,27 +65,33 @@ class MergeSequenceGenerator {
   static bool ValidateSequence(const std::vector<CowMergeOperation>& sequence);
 
   // Generates a merge sequence from |operations_|, puts the result in
-  // |sequence|. Returns false on failure.
-  bool Generate(std::vector<CowMergeOperation>* sequence) const;
+  // |sequence|. Returns false on failure. The operations free to merge are
+  // ordered by destination blocks, or by source blocks when |source_order| is
+  // set so the device reads the source partition mostly sequentially.
+  bool Generate(std::vector<CowMergeOperation>* sequence,
+                bool source_order = false) const;
 
   const std::vector<CowMergeOperation>& GetOperations() const {
     return operations_;
   }
-  const std::map<CowMergeOperation, std::set<CowMergeOperation>>&
-  GetDependencyMap() const {
+  // Returns, for every operation of GetOperations(), the indices of the
+  // operations that should merge after it.
+  const std::vector<std::vector<size_t>>& GetDependencies() const {
     return merge_after_;
   }
 
  private:
   friend class MergeSequenceGeneratorTest;
 
-  // For a given merge operation, finds all the operations that should merge
-  // after myself. Put the result in |merge_after|. |operations| must be sorted
-  static std::map<CowMergeOperation, std::set<CowMergeOperation>>
-  FindDependency(const std::vector<CowMergeOperation>& operations);
+  // For each merge operation, finds the indices of all the operations that
+  // should merge after it, i.e. the ones writing blocks it reads.
+  // |operations| must be sorted.
+  static std::vector<std::vector<size_t>> FindDependency(
+      const std::vector<CowMergeOperation>& operations);
   // The list of CowMergeOperations to sort.
   const std::vector<CowMergeOperation> operations_;
-  const std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after_;
+  // The dependency graph of |operations_|, indexed like |operations_|.
+  const std::vector<std::vector<size_t>> merge_after_;
   const std::string_view partition_name_;
 };
 
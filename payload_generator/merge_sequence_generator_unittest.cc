@@ -15,6 +15,8 @@
 //
 
 #include <algorithm>
+#include <map>
+#include <set>
 #include <vector>
 
 #include <android-base/file.h>
@@ -46,7 +48,15 @@ class MergeSequenceGeneratorTest : public ::testing::Test {
       std::vector<CowMergeOperation> transfers,
       std::map<CowMergeOperation, std::set<CowMergeOperation>>* result) {
     std::sort(transfers.begin(), transfers.end());
-    *result = MergeSequenceGenerator::FindDependency(transfers);
+    const auto merge_after = MergeSequenceGenerator::FindDependency(transfers);
+    ASSERT_EQ(transfers.size(), merge_after.size());
+    result->clear();
+    for (size_t i = 0; i < transfers.size(); i++) {
+      auto& blocked = (*result)[transfers[i]];
+      for (const size_t index : merge_after[i]) {
+        blocked.insert(transfers[index]);
+      }
+    }
   }
 
   void GenerateSequence(std::vector<CowMergeOperation> transfers) {
@@ -206,6 +216,64 @@ TEST_F(MergeSequenceGeneratorTest, GenerateSequenceMultipleCycles) {
   GenerateSequence(transfers);
 }
 
+TEST_F(MergeSequenceGeneratorTest, GenerateSequenceManyCycles) {
+  // Every pair of operations swaps two blocks, so one operation of each pair
+  // has to be converted to raw.
+  constexpr size_t kNumPairs = 50000;
+  std::vector<CowMergeOperation> transfers;
+  for (size_t i = 0; i < kNumPairs; i++) {
+    transfers.push_back(CreateCowMergeOperation(ExtentForRange(i * 2 + 1, 1),
+                                                ExtentForRange(i * 2, 1)));
+    transfers.push_back(CreateCowMergeOperation(ExtentForRange(i * 2, 1),
+                                                ExtentForRange(i * 2 + 1, 1)));
+  }
+  MergeSequenceGenerator generator(std::move(transfers), "");
+  std::vector<CowMergeOperation> sequence;
+  ASSERT_TRUE(generator.Generate(&sequence));
+  ASSERT_EQ(kNumPairs, sequence.size());
+  // Ties are broken by dst blocks, so the first operation of each pair is
+  // converted.
+  for (size_t i = 0; i < kNumPairs; i++) {
+    ASSERT_EQ(i * 2 + 1, sequence[i].dst_extent().start_block());
+  }
+}
+
+TEST_F(MergeSequenceGeneratorTest, GenerateSequencePrefersXorForRaw) {
+  std::vector<CowMergeOperation> transfers = {
+      CreateCowMergeOperation(ExtentForRange(10, 10), ExtentForRange(20, 10)),
+      CreateCowMergeOperation(ExtentForRange(20, 10),
+                              ExtentForRange(10, 10),
+                              CowMergeOperation::COW_XOR),
+  };
+  MergeSequenceGenerator generator(std::move(transfers), "");
+  std::vector<CowMergeOperation> sequence;
+  ASSERT_TRUE(generator.Generate(&sequence));
+  ASSERT_EQ(1UL, sequence.size());
+  ASSERT_EQ(CowMergeOperation::COW_COPY, sequence[0].type());
+}
+
+TEST_F(MergeSequenceGeneratorTest, GenerateSequenceInSourceOrder) {
+  // The second operation reads the blocks the first one writes, so it merges
+  // first.
+  std::vector<CowMergeOperation> transfers = {
+      CreateCowMergeOperation(ExtentForRange(300, 10), ExtentForRange(0, 10)),
+      CreateCowMergeOperation(ExtentForRange(0, 10), ExtentForRange(100, 10)),
+      CreateCowMergeOperation(ExtentForRange(500, 10), ExtentForRange(400, 10)),
+  };
+  MergeSequenceGenerator generator(transfers, "");
+  std::vector<CowMergeOperation> sequence;
+  ASSERT_TRUE(generator.Generate(&sequence));
+  ASSERT_EQ((std::vector<CowMergeOperation>{
+                transfers[1], transfers[2], transfers[0]}),
+            sequence);
+
+  ASSERT_TRUE(generator.Generate(&sequence, true));
+  ASSERT_EQ((std::vector<CowMergeOperation>{
+                transfers[1], transfers[0], transfers[2]}),
+            sequence);
+  ASSERT_TRUE(MergeSequenceGenerator::ValidateSequence(sequence));
+}
+
 void ValidateSplitSequence(const Extent& src_extent, const Extent& dst_extent) {
   std::vector<CowMergeOperation> sequence;
   SplitSelfOverlapping(src_extent, dst_extent, &sequence);
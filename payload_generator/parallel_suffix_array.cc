@@ -0,0 +1,318 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/parallel_suffix_array.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <limits>
+#include <utility>
+
+#include <base/logging.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Suffixes bucketed together by a task.
+constexpr size_t kBucketChunkSize = 4 * 1024 * 1024;
+// Suffixes sorted together by a task of a prefix doubling round.
+constexpr size_t kSortChunkSize = 256 * 1024;
+// The first byte of a suffix, then the second one or the end of the text.
+constexpr size_t kNumBuckets = 256 * 257;
+
+// Suffixes in [begin, end) of the suffix array sharing their first bytes.
+struct Group {
+  uint32_t begin;
+  uint32_t end;
+};
+
+// The suffixes in [begin, end) of the groups [first_group, last_group),
+// handled by a task of a prefix doubling round. Either whole groups or a
+// part of a single one.
+struct Slice {
+  size_t first_group;
+  size_t last_group;
+  uint32_t begin;
+  uint32_t end;
+};
+
+uint32_t BucketOf(const uint8_t* text, size_t n, size_t i) {
+  return text[i] * 257 + (i + 1 < n ? text[i + 1] + 1 : 0);
+}
+
+// Runs |task| for every index below |num_tasks|, on |scheduler| if not null.
+// The tasks are weighted by the size of the text, so that threads freed up
+// pick them before starting other files.
+void RunTasks(TaskScheduler* scheduler,
+              uint64_t weight,
+              size_t num_tasks,
+              const std::function<void(size_t)>& task) {
+  if (scheduler == nullptr || num_tasks < 2) {
+    for (size_t i = 0; i < num_tasks; i++) {
+      task(i);
+    }
+    return;
+  }
+  TaskScheduler::TaskGroup group(scheduler, false);
+  for (size_t i = 0; i < num_tasks; i++) {
+    group.Submit(weight, [&task, i]() { task(i); });
+  }
+  group.Wait();
+}
+
+// Stores the suffix array of |text| in the |n| entries of |sa|.
+void BuildSuffixArrayInto(const uint8_t* text,
+                          size_t n,
+                          TaskScheduler* scheduler,
+                          uint32_t* sa) {
+  // The rank of a suffix is the position of the first suffix of its group in
+  // |sa|, so the groups sort like their ranks.
+  vector<uint32_t> rank(n);
+  vector<Group> groups;
+
+  // Bucket the suffixes by their first two bytes, each chunk of the text
+  // storing its suffixes of every bucket after those of the previous chunks.
+  const size_t num_chunks = (n + kBucketChunkSize - 1) / kBucketChunkSize;
+  vector<vector<uint32_t>> offsets(num_chunks, vector<uint32_t>(kNumBuckets));
+  RunTasks(scheduler, n, num_chunks, [&](size_t chunk) {
+    const size_t end = std::min(n, (chunk + 1) * kBucketChunkSize);
+    for (size_t i = chunk * kBucketChunkSize; i < end; i++) {
+      offsets[chunk][BucketOf(text, n, i)]++;
+    }
+  });
+  vector<uint32_t> bucket_begin(kNumBuckets);
+  uint32_t offset = 0;
+  for (size_t bucket = 0; bucket < kNumBuckets; bucket++) {
+    bucket_begin[bucket] = offset;
+    for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+      const uint32_t count = offsets[chunk][bucket];
+      offsets[chunk][bucket] = offset;
+      offset += count;
+    }
+    if (offset - bucket_begin[bucket] > 1) {
+      groups.push_back({bucket_begin[bucket], offset});
+    }
+  }
+  RunTasks(scheduler, n, num_chunks, [&](size_t chunk) {
+    const size_t end = std::min(n, (chunk + 1) * kBucketChunkSize);
+    for (size_t i = chunk * kBucketChunkSize; i < end; i++) {
+      const uint32_t bucket = BucketOf(text, n, i);
+      sa[offsets[chunk][bucket]++] = i;
+      rank[i] = bucket_begin[bucket];
+    }
+  });
+  offsets.clear();
+
+  // Whether a suffix starts a new group in the round, only set within the
+  // groups sorted by the round.
+  vector<uint8_t> group_starts(n);
+  for (size_t h = 2; !groups.empty(); h *= 2) {
+    // Suffixes ending within |h| bytes sort before the others of their group,
+    // there is at most one such suffix per group.
+    auto key = [&rank, n, h](uint32_t i) -> uint32_t {
+      return i + h < n ? rank[i + h] + 1 : 0;
+    };
+    auto less = [&key](uint32_t a, uint32_t b) { return key(a) < key(b); };
+
+    // Small groups are sorted together, large ones are split and their
+    // sorted slices merged afterwards.
+    vector<Slice> slices;
+    bool extend_slice = false;
+    for (size_t g = 0; g < groups.size(); g++) {
+      const Group group = groups[g];
+      if (group.end - group.begin > kSortChunkSize) {
+        for (size_t begin = group.begin; begin < group.end;
+             begin += kSortChunkSize) {
+          slices.push_back(
+              {g,
+               g + 1,
+               static_cast<uint32_t>(begin),
+               static_cast<uint32_t>(
+                   std::min<size_t>(group.end, begin + kSortChunkSize))});
+        }
+        extend_slice = false;
+      } else if (extend_slice) {
+        slices.back().last_group = g + 1;
+        slices.back().end = group.end;
+      } else {
+        slices.push_back({g, g + 1, group.begin, group.end});
+        extend_slice = true;
+      }
+      if (slices.back().end - slices.back().begin >= kSortChunkSize) {
+        extend_slice = false;
+      }
+    }
+    // Calls |run| for the suffixes of every group in |slice|.
+    auto for_each_group = [&groups](const Slice& slice, auto run) {
+      for (size_t g = slice.first_group; g < slice.last_group; g++) {
+        run(groups[g],
+            std::max(groups[g].begin, slice.begin),
+            std::min(groups[g].end, slice.end));
+      }
+    };
+
+    // The ranks are only read until all groups are sorted and split, and only
+    // written afterwards, so that the tasks don't depend on each other.
+    RunTasks(scheduler, n, slices.size(), [&](size_t i) {
+      for_each_group(slices[i], [&](const Group&, uint32_t lo, uint32_t hi) {
+        std::sort(sa + lo, sa + hi, less);
+      });
+    });
+    for (size_t width = kSortChunkSize;; width *= 2) {
+      vector<std::array<uint32_t, 3>> merges;
+      for (const Group& group : groups) {
+        for (size_t begin = group.begin; begin + width < group.end;
+             begin += 2 * width) {
+          merges.push_back(
+              {static_cast<uint32_t>(begin),
+               static_cast<uint32_t>(begin + width),
+               static_cast<uint32_t>(
+                   std::min<size_t>(group.end, begin + 2 * width))});
+        }
+      }
+      if (merges.empty()) {
+        break;
+      }
+      RunTasks(scheduler, n, merges.size(), [&](size_t i) {
+        std::inplace_merge(
+            sa + merges[i][0], sa + merges[i][1], sa + merges[i][2], less);
+      });
+    }
+    RunTasks(scheduler, n, slices.size(), [&](size_t i) {
+      for_each_group(
+          slices[i], [&](const Group& group, uint32_t lo, uint32_t hi) {
+            uint32_t previous_key = lo > group.begin ? key(sa[lo - 1]) : 0;
+            for (uint32_t j = lo; j < hi; j++) {
+              const uint32_t j_key = key(sa[j]);
+              group_starts[j] = j == group.begin || j_key != previous_key;
+              previous_key = j_key;
+            }
+          });
+    });
+    RunTasks(scheduler, n, slices.size(), [&](size_t i) {
+      for_each_group(slices[i], [&](const Group&, uint32_t lo, uint32_t hi) {
+        uint32_t begin = lo;
+        while (!group_starts[begin]) {
+          begin--;
+        }
+        for (uint32_t j = lo; j < hi; j++) {
+          if (group_starts[j]) {
+            begin = j;
+          }
+          rank[sa[j]] = begin;
+        }
+      });
+    });
+
+    vector<Group> new_groups;
+    for (const Group& group : groups) {
+      uint32_t begin = group.begin;
+      for (uint32_t j = group.begin + 1; j <= group.end; j++) {
+        if (j < group.end && !group_starts[j]) {
+          continue;
+        }
+        if (j - begin > 1) {
+          new_groups.push_back({begin, j});
+        }
+        begin = j;
+      }
+    }
+    groups = std::move(new_groups);
+  }
+}
+
+class ParallelSuffixArrayIndex : public bsdiff::SuffixArrayIndexInterface {
+ public:
+  ParallelSuffixArrayIndex(const uint8_t* text,
+                           size_t n,
+                           TaskScheduler* scheduler)
+      : text_(text), n_(n), sa_(n + 1) {
+    // The empty suffix comes first, like in bsdiff's own index.
+    sa_[0] = n;
+    BuildSuffixArrayInto(text, n, scheduler, sa_.data() + 1);
+  }
+
+  // Same binary search as bsdiff, keeping the longest of the two suffixes
+  // around |target| and the last one on ties.
+  void SearchPrefix(const uint8_t* target,
+                    size_t length,
+                    size_t* out_length,
+                    uint64_t* out_pos) const override {
+    size_t first = 0;
+    size_t last = n_;
+    while (last - first >= 2) {
+      const size_t middle = first + (last - first) / 2;
+      const uint32_t pos = sa_[middle];
+      if (memcmp(text_ + pos, target, std::min(n_ - pos, length)) < 0) {
+        first = middle;
+      } else {
+        last = middle;
+      }
+    }
+    const size_t first_length = MatchLength(sa_[first], target, length);
+    const size_t last_length = MatchLength(sa_[last], target, length);
+    if (first_length > last_length) {
+      *out_pos = sa_[first];
+      *out_length = first_length;
+    } else {
+      *out_pos = sa_[last];
+      *out_length = last_length;
+    }
+  }
+
+ private:
+  size_t MatchLength(uint32_t pos, const uint8_t* target, size_t length) const {
+    const size_t max_length = std::min(n_ - pos, length);
+    size_t i = 0;
+    while (i < max_length && text_[pos + i] == target[i]) {
+      i++;
+    }
+    return i;
+  }
+
+  const uint8_t* text_;
+  const size_t n_;
+  vector<uint32_t> sa_;
+};
+}  // namespace
+
+vector<uint32_t> BuildSuffixArray(const uint8_t* text,
+                                  size_t n,
+                                  TaskScheduler* scheduler) {
+  CHECK_LT(n, std::numeric_limits<uint32_t>::max());
+  vector<uint32_t> sa(n);
+  BuildSuffixArrayInto(text, n, scheduler, sa.data());
+  return sa;
+}
+
+std::unique_ptr<bsdiff::SuffixArrayIndexInterface>
+CreateParallelSuffixArrayIndex(const uint8_t* text,
+                               size_t n,
+                               TaskScheduler* scheduler) {
+  if (n >= std::numeric_limits<uint32_t>::max()) {
+    LOG(WARNING) << "Too large to build a parallel suffix array: " << n
+                 << " bytes";
+    return nullptr;
+  }
+  return std::make_unique<ParallelSuffixArrayIndex>(text, n, scheduler);
+}
+
+}  // namespace chromeos_update_engine
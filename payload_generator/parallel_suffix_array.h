@@ -0,0 +1,54 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PARALLEL_SUFFIX_ARRAY_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PARALLEL_SUFFIX_ARRAY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <bsdiff/suffix_array_index.h>
+
+#include "update_engine/payload_generator/task_scheduler.h"
+
+namespace chromeos_update_engine {
+
+// Returns the suffix array of the |n| bytes of |text|, i.e. the start of its
+// suffixes in lexicographic order, a suffix being smaller than the longer ones
+// it is a prefix of. The suffixes are bucketed by their first two bytes, then
+// sorted by prefix doubling: each round sorts the suffixes sharing their first
+// |h| bytes by the rank of their suffix |h| bytes further. The buckets and
+// groups of each round are split in tasks on |scheduler| when not null, so
+// that idle threads help with the large inputs.
+// |n| must be less than 2^32 - 1.
+std::vector<uint32_t> BuildSuffixArray(const uint8_t* text,
+                                       size_t n,
+                                       TaskScheduler* scheduler);
+
+// Returns a bsdiff index of the |n| bytes of |text|, which must outlive it,
+// whose suffix array is built with BuildSuffixArray(). It finds the same
+// matches as the index bsdiff builds on its own, so the patches don't depend
+// on which one is used. Returns nullptr if |text| is too large.
+std::unique_ptr<bsdiff::SuffixArrayIndexInterface>
+CreateParallelSuffixArrayIndex(const uint8_t* text,
+                               size_t n,
+                               TaskScheduler* scheduler);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PARALLEL_SUFFIX_ARRAY_H_
@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/parallel_suffix_array.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <bsdiff/bsdiff.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_generator/memory_patch_writer.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+vector<uint32_t> NaiveSuffixArray(const brillo::Blob& text) {
+  vector<uint32_t> sa(text.size());
+  std::iota(sa.begin(), sa.end(), 0);
+  std::sort(sa.begin(), sa.end(), [&text](uint32_t a, uint32_t b) {
+    return std::lexicographical_compare(text.begin() + a,
+                                        text.end(),
+                                        text.begin() + b,
+                                        text.end());
+  });
+  return sa;
+}
+
+// Data with long repeated runs, which take many prefix doubling rounds.
+brillo::Blob RepetitiveData(size_t size) {
+  brillo::Blob data(size);
+  test_utils::FillWithData(&data);
+  std::fill(data.begin() + size / 4, data.begin() + size / 2, 0);
+  for (size_t i = size / 2; i < size; i++) {
+    data[i] = "abcab"[i % 5];
+  }
+  return data;
+}
+}  // namespace
+
+TEST(ParallelSuffixArrayTest, EmptyAndShortTextTest) {
+  EXPECT_TRUE(BuildSuffixArray(nullptr, 0, nullptr).empty());
+  const brillo::Blob text = {'b', 'a', 'n', 'a', 'n', 'a'};
+  EXPECT_EQ(vector<uint32_t>({5, 3, 1, 0, 4, 2}),
+            BuildSuffixArray(text.data(), text.size(), nullptr));
+}
+
+TEST(ParallelSuffixArrayTest, MatchesNaiveSuffixArrayTest) {
+  brillo::Blob random(5000);
+  test_utils::FillWithData(&random);
+  for (const auto& text : {random, RepetitiveData(5000)}) {
+    EXPECT_EQ(NaiveSuffixArray(text),
+              BuildSuffixArray(text.data(), text.size(), nullptr));
+  }
+}
+
+TEST(ParallelSuffixArrayTest, SchedulerMatchesSequentialTest) {
+  // Large enough to split the buckets and the groups in several tasks.
+  const brillo::Blob text = RepetitiveData(5 * 1024 * 1024);
+  TaskScheduler scheduler(4);
+  vector<uint32_t> sa;
+  TaskScheduler::TaskGroup group(&scheduler, false);
+  group.Submit(1, [&sa, &text, &scheduler]() {
+    sa = BuildSuffixArray(text.data(), text.size(), &scheduler);
+  });
+  group.Wait();
+  EXPECT_EQ(BuildSuffixArray(text.data(), text.size(), nullptr), sa);
+}
+
+TEST(ParallelSuffixArrayTest, SamePatchAsBsdiffIndexTest) {
+  const brillo::Blob old_data = RepetitiveData(100000);
+  brillo::Blob new_data = old_data;
+  new_data.erase(new_data.begin() + 1000, new_data.begin() + 3000);
+  for (size_t i = 60000; i < 70000; i += 13) {
+    new_data[i]++;
+  }
+  new_data.insert(new_data.end(), old_data.begin(), old_data.begin() + 5000);
+
+  brillo::Blob expected;
+  MemoryPatchWriter expected_writer(&expected);
+  ASSERT_EQ(0,
+            bsdiff::bsdiff(old_data.data(),
+                           old_data.size(),
+                           new_data.data(),
+                           new_data.size(),
+                           &expected_writer,
+                           nullptr));
+
+  auto index =
+      CreateParallelSuffixArrayIndex(old_data.data(), old_data.size(), nullptr);
+  ASSERT_NE(nullptr, index);
+  bsdiff::SuffixArrayIndexInterface* sai = index.get();
+  brillo::Blob patch;
+  MemoryPatchWriter writer(&patch);
+  ASSERT_EQ(0,
+            bsdiff::bsdiff(old_data.data(),
+                           old_data.size(),
+                           new_data.data(),
+                           new_data.size(),
+                           &writer,
+                           &sai));
+  // The index stays owned by the caller.
+  EXPECT_EQ(index.get(), sai);
+  EXPECT_EQ(expected, patch);
+}
+
+}  // namespace chromeos_update_engine
@@ -18,7 +18,9 @@
 
 #include <endian.h>
 
+#include <algorithm>
 #include <map>
+#include <optional>
 #include <utility>
 
 #include <android-base/stringprintf.h>
@@ -26,9 +28,11 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/payload_signer.h"
 
 using std::string;
@@ -57,6 +61,45 @@ bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
   return true;
 }
 
+// Forwards the writes to another FileWriter and hashes the first |hash_size|
+// bytes written, so the payload can be signed without reading it back.
+class HashingFileWriter : public FileWriter {
+ public:
+  HashingFileWriter(FileWriter* writer, uint64_t hash_size)
+      : writer_(writer), hash_size_(hash_size) {}
+
+  bool Write(const void* bytes, size_t count) override {
+    TEST_AND_RETURN_FALSE(writer_->Write(bytes, count));
+    const size_t hash_count = std::min<uint64_t>(count, hash_size_ - hashed_);
+    if (hash_count > 0) {
+      TEST_AND_RETURN_FALSE(calculator_.Update(bytes, hash_count));
+      hashed_ += hash_count;
+    }
+    return true;
+  }
+
+  int Close() override { return writer_->Close(); }
+
+  // Returns in |out_hash| the hash of the bytes written so far, which must be
+  // all of the hashed bytes unless |partial| is set.
+  bool GetHash(bool partial, brillo::Blob* out_hash) const {
+    TEST_AND_RETURN_FALSE(partial || hashed_ == hash_size_);
+    HashCalculator calculator;
+    TEST_AND_RETURN_FALSE(calculator.SetContext(calculator_.GetContext()));
+    TEST_AND_RETURN_FALSE(calculator.Finalize());
+    *out_hash = calculator.raw_hash();
+    return true;
+  }
+
+ private:
+  FileWriter* writer_;
+  const uint64_t hash_size_;
+  uint64_t hashed_{0};
+  HashCalculator calculator_;
+
+  DISALLOW_COPY_AND_ASSIGN(HashingFileWriter);
+};
+
 }  // namespace
 
 bool PayloadFile::Init(const PayloadGenerationConfig& config) {
@@ -64,6 +107,12 @@ bool PayloadFile::Init(const PayloadGenerationConfig& config) {
   major_version_ = config.version.major;
   manifest_.set_minor_version(config.version.minor);
   manifest_.set_block_size(config.block_size);
+  segment_hash_size_ = config.segment_hash_size;
+  report_ = config.report;
+  payload_index_ = config.payload_index;
+  payload_index_chunk_size_ = config.payload_index_chunk_size;
+  split_operations_ = config.split_partition_operations;
+  dedup_blobs_ = config.dedup_blobs;
   manifest_.set_max_timestamp(config.max_timestamp);
   if (!config.security_patch_level.empty()) {
     manifest_.set_security_patch_level(config.security_patch_level);
@@ -110,8 +159,19 @@ bool PayloadFile::AddPartition(const PartitionConfig& old_conf,
   if (!old_conf.path.empty())
     TEST_AND_RETURN_FALSE(
         diff_utils::InitializePartitionInfo(old_conf, &part.old_info));
-  TEST_AND_RETURN_FALSE(
-      diff_utils::InitializePartitionInfo(new_conf, &part.new_info));
+  if (new_conf.info) {
+    part.new_info = *new_conf.info;
+  } else {
+    TEST_AND_RETURN_FALSE(
+        diff_utils::InitializePartitionInfo(new_conf, &part.new_info));
+    if (segment_hash_size_ > 0) {
+      TEST_AND_RETURN_FALSE(diff_utils::AddPartitionSegmentHashes(
+          new_conf, segment_hash_size_, &part.new_info));
+    }
+  }
+  if (report_) {
+    report_->AddPartition(new_conf.name, new_conf.path, part.aops);
+  }
   part_vec_.push_back(std::move(part));
   return true;
 }
@@ -120,10 +180,16 @@ bool PayloadFile::WritePayload(const string& payload_file,
                                const string& data_blobs_path,
                                const string& private_key_path,
                                uint64_t* metadata_size_out) {
-  // Reorder the data blobs with the manifest_.
-  ScopedTempFile ordered_blobs_file("CrAU_temp_data.ordered.XXXXXX");
-  TEST_AND_RETURN_FALSE(
-      ReorderDataBlobs(data_blobs_path, ordered_blobs_file.path()));
+  // Assign the final offsets of the data blobs, which are copied straight
+  // from |data_blobs_path| to the payload in the order of the manifest_.
+  int blobs_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(blobs_fd >= 0);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+  vector<BlobRange> blob_ranges;
+  {
+    GenerationReport::ScopedPhase phase(report_, "blob_reorder");
+    TEST_AND_RETURN_FALSE(AssignDataOffsets(blobs_fd, &blob_ranges));
+  }
 
   // Check that install op blobs are in order.
   uint64_t next_blob_offset = 0;
@@ -131,6 +197,11 @@ bool PayloadFile::WritePayload(const string& payload_file,
     for (const auto& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
+      // Deduplicated blobs are shared with a previous operation.
+      if (dedup_blobs_ &&
+          aop.op.data_offset() + aop.op.data_length() <= next_blob_offset) {
+        continue;
+      }
       if (aop.op.data_offset() != next_blob_offset) {
         LOG(FATAL) << "bad blob offset! " << aop.op.data_offset()
                    << " != " << next_blob_offset;
@@ -139,6 +210,13 @@ bool PayloadFile::WritePayload(const string& payload_file,
     }
   }
 
+  if (split_operations_) {
+    TEST_AND_RETURN_FALSE(SplitPartitionOperations(&blob_ranges));
+    for (const auto& part : part_vec_) {
+      next_blob_offset += part.operations_blob.size();
+    }
+  }
+
   // Copy the operations and partition info from the part_vec_ to the manifest.
   manifest_.clear_partitions();
   for (const auto& part : part_vec_) {
@@ -160,6 +238,8 @@ bool PayloadFile::WritePayload(const string& payload_file,
       if (!part.postinstall.filesystem_type.empty())
         partition->set_filesystem_type(part.postinstall.filesystem_type);
       partition->set_postinstall_optional(part.postinstall.optional);
+      if (part.postinstall.parallel)
+        partition->set_postinstall_parallel(true);
     }
     if (!part.verity.IsEmpty()) {
       if (part.verity.hash_tree_extent.num_blocks() != 0) {
@@ -177,8 +257,18 @@ bool PayloadFile::WritePayload(const string& payload_file,
         partition->set_fec_roots(part.verity.fec_roots);
       }
     }
-    for (const AnnotatedOperation& aop : part.aops) {
-      *partition->add_operations() = aop.op;
+    if (!part.operations_blob.empty()) {
+      brillo::Blob hash;
+      TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+          part.operations_blob.data(), part.operations_blob.size(), &hash));
+      partition->set_operations_blob_offset(part.operations_blob_offset);
+      partition->set_operations_blob_size(part.operations_blob.size());
+      partition->set_operations_blob_sha256_hash(hash.data(), hash.size());
+      partition->set_num_operations(part.aops.size());
+    } else {
+      for (const AnnotatedOperation& aop : part.aops) {
+        *partition->add_operations() = aop.op;
+      }
     }
     for (const auto& merge_op : part.cow_merge_sequence) {
       *partition->add_merge_operations() = merge_op;
@@ -190,6 +280,26 @@ bool PayloadFile::WritePayload(const string& payload_file,
       *(partition->mutable_new_partition_info()) = part.new_info;
   }
 
+  // The index is right after the blobs of the operations. Its hash in the
+  // manifest lets consumers trust it once the metadata signature is verified.
+  if (payload_index_) {
+    PayloadIndex index;
+    {
+      GenerationReport::ScopedPhase phase(report_, "payload_index");
+      TEST_AND_RETURN_FALSE(BuildPayloadIndex(blobs_fd, blob_ranges, &index));
+    }
+    string serialized_index;
+    TEST_AND_RETURN_FALSE(index.SerializeToString(&serialized_index));
+    brillo::Blob index_hash;
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+        serialized_index.data(), serialized_index.size(), &index_hash));
+    manifest_.set_index_offset(next_blob_offset);
+    manifest_.set_index_size(serialized_index.size());
+    manifest_.set_index_sha256_hash(index_hash.data(), index_hash.size());
+    next_blob_offset += serialized_index.size();
+    blob_ranges.push_back({0, 0, std::move(serialized_index)});
+  }
+
   // Signatures appear at the end of the blobs. Note the offset in the
   // |manifest_|.
   uint64_t signature_blob_length = 0;
@@ -199,12 +309,22 @@ bool PayloadFile::WritePayload(const string& payload_file,
     PayloadSigner::AddSignatureToManifest(
         next_blob_offset, signature_blob_length, &manifest_);
   }
-  WritePayload(payload_file,
-               ordered_blobs_file.path(),
-               private_key_path,
-               major_version_,
-               manifest_,
-               metadata_size_out);
+  const auto copy_blobs = [blobs_fd, &blob_ranges](FileWriter* writer) {
+    return ReadBlobRanges(
+        blobs_fd, blob_ranges, [writer](const void* data, size_t count) {
+          return writer->Write(data, count);
+        });
+  };
+  {
+    // Hashing and signing the payload happen while it is written.
+    GenerationReport::ScopedPhase phase(report_, "write_and_sign");
+    TEST_AND_RETURN_FALSE(WritePayload(payload_file,
+                                       private_key_path,
+                                       major_version_,
+                                       manifest_,
+                                       copy_blobs,
+                                       metadata_size_out));
+  }
 
   ReportPayloadUsage(*metadata_size_out);
   return true;
@@ -216,23 +336,64 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
                                uint64_t major_version_,
                                const DeltaArchiveManifest& manifest,
                                uint64_t* metadata_size_out) {
+  const auto append_blobs = [&ordered_blobs_file](FileWriter* writer) {
+    int blobs_fd = open(ordered_blobs_file.c_str(), O_RDONLY, 0);
+    ScopedFdCloser blobs_fd_closer(&blobs_fd);
+    TEST_AND_RETURN_FALSE(blobs_fd >= 0);
+    vector<char> buf(1024 * 1024);
+    for (;;) {
+      ssize_t rc = read(blobs_fd, buf.data(), buf.size());
+      if (0 == rc) {
+        // EOF
+        break;
+      }
+      TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
+      TEST_AND_RETURN_FALSE_ERRNO(writer->Write(buf.data(), rc));
+    }
+    return true;
+  };
+  return WritePayload(payload_file,
+                      private_key_path,
+                      major_version_,
+                      manifest,
+                      append_blobs,
+                      metadata_size_out);
+}
+
+bool PayloadFile::WritePayload(const std::string& payload_file,
+                               const std::string& private_key_path,
+                               uint64_t major_version,
+                               const DeltaArchiveManifest& manifest,
+                               const BlobsWriter& write_blobs,
+                               uint64_t* metadata_size_out) {
   std::string serialized_manifest;
 
-  TEST_AND_RETURN_FALSE(manifest.SerializeToString(&serialized_manifest));
+  // The extents are only packed in the written manifest.
+  DeltaArchiveManifest packed_manifest = manifest;
+  PackManifestExtents(&packed_manifest);
+  TEST_AND_RETURN_FALSE(
+      packed_manifest.SerializeToString(&serialized_manifest));
   uint64_t metadata_size =
       sizeof(kDeltaMagic) + 2 * sizeof(uint64_t) + serialized_manifest.size();
   LOG(INFO) << "Writing final delta file header...";
-  DirectFileWriter writer;
-  TEST_AND_RETURN_FALSE_ERRNO(writer.Open(payload_file.c_str(),
-                                          O_WRONLY | O_CREAT | O_TRUNC,
-                                          0644) == 0);
-  ScopedFileWriterCloser writer_closer(&writer);
+  DirectFileWriter file_writer;
+  TEST_AND_RETURN_FALSE_ERRNO(file_writer.Open(payload_file.c_str(),
+                                               O_WRONLY | O_CREAT | O_TRUNC,
+                                               0644) == 0);
+  ScopedFileWriterCloser writer_closer(&file_writer);
+  // The payload signature covers the metadata and the data blobs up to the
+  // signature blob, which are hashed as they are written.
+  HashingFileWriter writer(
+      &file_writer,
+      private_key_path.empty()
+          ? 0
+          : metadata_size + sizeof(uint32_t) + manifest.signatures_offset());
 
   // Write header
   TEST_AND_RETURN_FALSE_ERRNO(writer.Write(kDeltaMagic, sizeof(kDeltaMagic)));
 
   // Write major version number
-  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer, major_version_));
+  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer, major_version));
 
   // Write protobuf length
   TEST_AND_RETURN_FALSE(
@@ -257,46 +418,31 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
   TEST_AND_RETURN_FALSE_ERRNO(
       writer.Write(serialized_manifest.data(), serialized_manifest.size()));
 
-  // Write metadata signature blob.
+  // Write metadata signature blob. It is not part of the signed payload, so it
+  // bypasses the hashing |writer|.
   if (!private_key_path.empty()) {
     brillo::Blob metadata_hash;
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfFile(
-        payload_file, metadata_size, &metadata_hash));
+    TEST_AND_RETURN_FALSE(writer.GetHash(true, &metadata_hash));
     string metadata_signature;
     TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
         metadata_hash, {private_key_path}, &metadata_signature));
-    TEST_AND_RETURN_FALSE_ERRNO(
-        writer.Write(metadata_signature.data(), metadata_signature.size()));
+    TEST_AND_RETURN_FALSE_ERRNO(file_writer.Write(metadata_signature.data(),
+                                                  metadata_signature.size()));
   }
 
   // Append the data blobs.
   LOG(INFO) << "Writing final delta file data blobs...";
-  int blobs_fd = open(ordered_blobs_file.c_str(), O_RDONLY, 0);
-  ScopedFdCloser blobs_fd_closer(&blobs_fd);
-  TEST_AND_RETURN_FALSE(blobs_fd >= 0);
-  for (;;) {
-    vector<char> buf(1024 * 1024);
-    ssize_t rc = read(blobs_fd, buf.data(), buf.size());
-    if (0 == rc) {
-      // EOF
-      break;
-    }
-    TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
-    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), rc));
-  }
+  TEST_AND_RETURN_FALSE(write_blobs(&writer));
   // Write payload signature blob.
   if (!private_key_path.empty()) {
     LOG(INFO) << "Signing the update...";
+    brillo::Blob payload_hash;
+    TEST_AND_RETURN_FALSE(writer.GetHash(false, &payload_hash));
     string signature;
-    TEST_AND_RETURN_FALSE(PayloadSigner::SignPayload(
-        payload_file,
-        {private_key_path},
-        metadata_size,
-        signature_blob_length,
-        metadata_size + signature_blob_length + manifest.signatures_offset(),
-        &signature));
+    TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
+        payload_hash, {private_key_path}, &signature));
     TEST_AND_RETURN_FALSE_ERRNO(
-        writer.Write(signature.data(), signature.size()));
+        file_writer.Write(signature.data(), signature.size()));
   }
   if (metadata_size_out) {
     *metadata_size_out = metadata_size;
@@ -304,38 +450,237 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
   return true;
 }
 
-bool PayloadFile::ReorderDataBlobs(const string& data_blobs_path,
-                                   const string& new_data_blobs_path) {
-  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
-  ScopedFdCloser in_fd_closer(&in_fd);
-
-  DirectFileWriter writer;
-  int rc = writer.Open(
-      new_data_blobs_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0644);
-  if (rc != 0) {
-    PLOG(ERROR) << "Error creating " << new_data_blobs_path;
-    return false;
-  }
-  ScopedFileWriterCloser writer_closer(&writer);
+bool PayloadFile::AssignDataOffsets(int data_blobs_fd,
+                                    vector<BlobRange>* blob_ranges) {
+  blob_ranges->clear();
   uint64_t out_file_size = 0;
 
+  // The first blob with a given hash and length, and whether it's shared.
+  struct DedupBlob {
+    uint64_t offset;
+    uint64_t length;
+    bool reused;
+  };
+  std::map<string, DedupBlob> dedup_blobs;
+  uint64_t reused_size = 0;
+  uint64_t dedup_size = 0;
+  size_t num_dedup_ops = 0;
+
   for (auto& part : part_vec_) {
     for (AnnotatedOperation& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
       CHECK(aop.op.has_data_length());
-      brillo::Blob buf(aop.op.data_length());
-      ssize_t rc = pread(in_fd, buf.data(), buf.size(), aop.op.data_offset());
-      TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
+      const uint64_t offset = aop.op.data_offset();
+      const uint64_t length = aop.op.data_length();
+      // Blobs stored through SetOperationBlob() are hashed already, only the
+      // ones referencing part of another blob need to be read back.
+      if (!aop.op.has_data_sha256_hash()) {
+        brillo::Blob buf(length);
+        ssize_t rc = pread(data_blobs_fd, buf.data(), buf.size(), offset);
+        TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
+        // Add the hash of the data blobs for this operation
+        TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
+      }
 
-      // Add the hash of the data blobs for this operation
-      TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
+      if (dedup_blobs_ && length > 0) {
+        auto it = dedup_blobs.find(aop.op.data_sha256_hash());
+        if (it == dedup_blobs.end()) {
+          dedup_blobs.emplace(aop.op.data_sha256_hash(),
+                              DedupBlob{out_file_size, length, false});
+        } else if (it->second.length == length &&
+                   (it->second.reused ||
+                    reused_size + length <= kMaxReusedBlobsSize)) {
+          // The client keeps every shared blob until its last use.
+          if (!it->second.reused) {
+            it->second.reused = true;
+            reused_size += length;
+          }
+          aop.op.set_data_offset(it->second.offset);
+          dedup_size += length;
+          num_dedup_ops++;
+          continue;
+        }
+      }
 
       aop.op.set_data_offset(out_file_size);
-      TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), buf.size()));
-      out_file_size += buf.size();
+      out_file_size += length;
+      if (!blob_ranges->empty() &&
+          blob_ranges->back().offset + blob_ranges->back().length == offset) {
+        blob_ranges->back().length += length;
+      } else {
+        blob_ranges->push_back({offset, length, {}});
+      }
+    }
+  }
+  if (num_dedup_ops > 0) {
+    LOG(INFO) << "Deduplicated the blobs of " << num_dedup_ops
+              << " operations, saving " << dedup_size << " bytes; "
+              << reused_size << " bytes of blobs are shared.";
+  }
+  return true;
+}
+
+bool PayloadFile::SplitPartitionOperations(vector<BlobRange>* blob_ranges) {
+  // Where the blobs of every partition start before the operations are
+  // inserted.
+  vector<uint64_t> starts;
+  uint64_t offset = 0;
+  for (const auto& part : part_vec_) {
+    starts.push_back(offset);
+    for (const auto& aop : part.aops) {
+      if (aop.op.has_data_offset()) {
+        offset += aop.op.data_length();
+      }
+    }
+  }
+
+  // The data offsets of the operations move by the size of the operations
+  // before them, whose size depends on these offsets. Larger offsets never
+  // encode shorter, so the sizes only grow until they settle.
+  vector<uint64_t> shifts(part_vec_.size());
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    uint64_t shift = 0;
+    for (size_t i = 0; i < part_vec_.size(); i++) {
+      Partition& part = part_vec_[i];
+      if (part.aops.empty()) {
+        shifts[i] = shift;
+        continue;
+      }
+      shift += part.operations_blob.size();
+      shifts[i] = shift;
+      PartitionOperations operations;
+      for (const AnnotatedOperation& aop : part.aops) {
+        InstallOperation* op = operations.add_operations();
+        *op = aop.op;
+        if (op->has_data_offset()) {
+          op->set_data_offset(op->data_offset() + shift);
+        }
+      }
+      PackOperationsExtents(manifest_.minor_version(),
+                            operations.mutable_operations());
+      string blob;
+      TEST_AND_RETURN_FALSE(operations.SerializeToString(&blob));
+      changed |= blob.size() != part.operations_blob.size();
+      part.operations_blob = std::move(blob);
+    }
+  }
+  for (size_t i = 0; i < part_vec_.size(); i++) {
+    Partition& part = part_vec_[i];
+    part.operations_blob_offset =
+        starts[i] + shifts[i] - part.operations_blob.size();
+    for (AnnotatedOperation& aop : part.aops) {
+      if (aop.op.has_data_offset()) {
+        aop.op.set_data_offset(aop.op.data_offset() + shifts[i]);
+      }
+    }
+  }
+
+  // Insert the operations before the blobs of their partition, splitting
+  // the ranges spanning several partitions.
+  vector<BlobRange> ranges;
+  size_t next_part = 0;
+  uint64_t pos = 0;
+  const auto insert_operations = [this, &ranges, &next_part, &starts, &pos]() {
+    for (; next_part < part_vec_.size() && starts[next_part] == pos;
+         next_part++) {
+      const string& blob = part_vec_[next_part].operations_blob;
+      if (!blob.empty()) {
+        ranges.push_back({0, 0, blob});
+      }
+    }
+  };
+  for (BlobRange range : *blob_ranges) {
+    while (range.length > 0) {
+      insert_operations();
+      uint64_t count = range.length;
+      if (next_part < part_vec_.size()) {
+        count = std::min(count, starts[next_part] - pos);
+      }
+      ranges.push_back({range.offset, count, {}});
+      range.offset += count;
+      range.length -= count;
+      pos += count;
+    }
+  }
+  insert_operations();
+  *blob_ranges = std::move(ranges);
+  return true;
+}
+
+bool PayloadFile::ReadBlobRanges(
+    int data_blobs_fd,
+    const vector<BlobRange>& blob_ranges,
+    const std::function<bool(const void*, size_t)>& consume) {
+  vector<char> buf(1024 * 1024);
+  for (const BlobRange& range : blob_ranges) {
+    if (!range.data.empty()) {
+      TEST_AND_RETURN_FALSE(consume(range.data.data(), range.data.size()));
+      continue;
+    }
+    for (uint64_t done = 0; done < range.length;) {
+      const size_t count = std::min<uint64_t>(buf.size(), range.length - done);
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          data_blobs_fd, buf.data(), count, range.offset + done, &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(count));
+      TEST_AND_RETURN_FALSE(consume(buf.data(), count));
+      done += count;
+    }
+  }
+  return true;
+}
+
+bool PayloadFile::BuildPayloadIndex(int data_blobs_fd,
+                                    const vector<BlobRange>& blob_ranges,
+                                    PayloadIndex* index) const {
+  index->Clear();
+  for (const Partition& part : part_vec_) {
+    PayloadIndex::PartitionRange* range = index->add_partitions();
+    range->set_partition_name(part.name);
+    range->set_first_operation(index->data_offsets_size());
+    range->set_num_operations(part.aops.size());
+    for (const AnnotatedOperation& aop : part.aops) {
+      index->add_data_offsets(aop.op.data_offset());
+      index->add_data_lengths(aop.op.data_length());
+    }
+  }
+  if (payload_index_chunk_size_ == 0)
+    return true;
+
+  // The chunks span the blob ranges, which are read in pieces.
+  index->set_chunk_size(payload_index_chunk_size_);
+  std::optional<HashCalculator> calculator;
+  uint64_t chunk_done = 0;
+  const auto hash_data = [this, &calculator, &chunk_done, index](
+                             const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+      if (chunk_done == 0) {
+        calculator.emplace();
+      }
+      const size_t count =
+          std::min<uint64_t>(size, payload_index_chunk_size_ - chunk_done);
+      TEST_AND_RETURN_FALSE(calculator->Update(bytes, count));
+      bytes += count;
+      size -= count;
+      chunk_done += count;
+      if (chunk_done == payload_index_chunk_size_) {
+        TEST_AND_RETURN_FALSE(calculator->Finalize());
+        const brillo::Blob& hash = calculator->raw_hash();
+        index->add_chunk_hashes(hash.data(), hash.size());
+        chunk_done = 0;
+      }
     }
+    return true;
+  };
+  TEST_AND_RETURN_FALSE(ReadBlobRanges(data_blobs_fd, blob_ranges, hash_data));
+  if (chunk_done > 0) {
+    TEST_AND_RETURN_FALSE(calculator->Finalize());
+    const brillo::Blob& hash = calculator->raw_hash();
+    index->add_chunk_hashes(hash.data(), hash.size());
   }
   return true;
 }
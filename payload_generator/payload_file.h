@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_FILE_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_FILE_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -25,6 +26,7 @@
 
 #include <libsnapshot/cow_writer.h>
 
+#include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
@@ -42,7 +44,8 @@ class PayloadFile {
 
   // Add a partition to the payload manifest. Including partition name, list of
   // operations and partition info. The operations in |aops|
-  // reference a blob stored in the file provided to WritePayload().
+  // reference a blob stored in the file provided to WritePayload(). The info of
+  // |new_conf| is only computed if |new_conf.info| isn't set.
   bool AddPartition(const PartitionConfig& old_conf,
                     const PartitionConfig& new_conf,
                     std::vector<AnnotatedOperation> aops,
@@ -66,7 +69,32 @@ class PayloadFile {
                            uint64_t* out_metadata_size);
 
  private:
-  FRIEND_TEST(PayloadFileTest, ReorderBlobsTest);
+  FRIEND_TEST(PayloadFileTest, AssignDataOffsetsTest);
+  FRIEND_TEST(PayloadFileTest, AssignDataOffsetsDedupTest);
+  FRIEND_TEST(PayloadFileTest, WritePayloadCopiesAndSignsBlobs);
+  FRIEND_TEST(PayloadFileTest, WritePayloadWithIndexTest);
+  FRIEND_TEST(PayloadFileTest, WritePayloadWithSplitOperationsTest);
+
+  // A contiguous range of bytes in the data blobs file, or |data| to write
+  // instead if it isn't empty.
+  struct BlobRange {
+    uint64_t offset;
+    uint64_t length;
+    std::string data;
+  };
+
+  // Callback which appends the data blobs to the payload being written.
+  using BlobsWriter = std::function<bool(FileWriter*)>;
+
+  // Writes the header, |manifest| and signatures of the payload to
+  // |payload_file| and calls |write_blobs| to append the data blobs in the
+  // order of the operations in |manifest|.
+  static bool WritePayload(const std::string& payload_file,
+                           const std::string& private_key_path,
+                           uint64_t major_version,
+                           const DeltaArchiveManifest& manifest,
+                           const BlobsWriter& write_blobs,
+                           uint64_t* out_metadata_size);
 
   // Computes a SHA256 hash of the given buf and sets the hash value in the
   // operation so that update_engine could verify. This hash should be set
@@ -77,14 +105,36 @@ class PayloadFile {
   static bool AddOperationHash(InstallOperation* op, const brillo::Blob& buf);
 
   // Install operations in the manifest may reference data blobs, which
-  // are in data_blobs_path. This function creates a new data blobs file
-  // with the data blobs in the same order as the referencing install
-  // operations in the manifest. E.g. if manifest[0] has a data blob
-  // "X" at offset 1, manifest[1] has a data blob "Y" at offset 0,
-  // and data_blobs_path's file contains "YX", new_data_blobs_path
-  // will set to be a file that contains "XY".
-  bool ReorderDataBlobs(const std::string& data_blobs_path,
-                        const std::string& new_data_blobs_path);
+  // are in the file |data_blobs_fd|, in any order. This function sets the
+  // data_offset of the operations to the offset of their blob in the payload,
+  // where the blobs appear in the same order as the referencing install
+  // operations, and stores in |blob_ranges| the ranges of |data_blobs_fd| to
+  // copy to the payload in that order. E.g. if manifest[0] has a data blob
+  // "X" at offset 1 and manifest[1] has a data blob "Y" at offset 0, the
+  // ranges are {1, 1}, {0, 1} and the data_offsets become 0 and 1. Only blobs
+  // without a data_sha256_hash are read to add it. With dedup_blobs_, the
+  // operations whose blob has the same hash as a previous one point at it.
+  bool AssignDataOffsets(int data_blobs_fd,
+                         std::vector<BlobRange>* blob_ranges);
+
+  // Moves the operations of every partition out of the manifest, to right
+  // before the blobs of the partition in |blob_ranges|, and shifts the data
+  // offsets of the operations accordingly.
+  bool SplitPartitionOperations(std::vector<BlobRange>* blob_ranges);
+
+  // Calls |consume| on the data of the |blob_ranges| of |data_blobs_fd| in
+  // order, in pieces of at most 1 MiB.
+  static bool ReadBlobRanges(
+      int data_blobs_fd,
+      const std::vector<BlobRange>& blob_ranges,
+      const std::function<bool(const void*, size_t)>& consume);
+
+  // Builds in |index| the PayloadIndex of the operations of part_vec_, which
+  // have their final data offsets. With payload_index_chunk_size_, also hashes
+  // the chunks of the |blob_ranges| of |data_blobs_fd|, in that order.
+  bool BuildPayloadIndex(int data_blobs_fd,
+                         const std::vector<BlobRange>& blob_ranges,
+                         PayloadIndex* index) const;
 
   // Print in stderr the Payload usage report.
   void ReportPayloadUsage(uint64_t metadata_size) const;
@@ -92,6 +142,24 @@ class PayloadFile {
   // The major_version of the requested payload.
   uint64_t major_version_;
 
+  // Size of the segments hashed in new_partition_info, 0 if disabled.
+  uint64_t segment_hash_size_{0};
+
+  // Where the operations of every partition are recorded, if set.
+  GenerationReport* report_{nullptr};
+
+  // Whether to write a PayloadIndex and the size of the chunks it hashes, 0
+  // if none.
+  bool payload_index_{false};
+  uint64_t payload_index_chunk_size_{0};
+
+  // Whether to store the operations of the partitions apart from the
+  // manifest, before their data blobs.
+  bool split_operations_{false};
+
+  // Whether operations with identical blobs share the first of them.
+  bool dedup_blobs_{false};
+
   DeltaArchiveManifest manifest_;
 
   // Struct has necessary information to write PartitionUpdate in protobuf.
@@ -111,6 +179,11 @@ class PayloadFile {
     // Per partition timestamp.
     std::string version;
     android::snapshot::CowSizeInfo cow_info;
+
+    // The serialized PartitionOperations of |aops| and its offset in the
+    // blobs, if they are stored apart from the manifest.
+    std::string operations_blob;
+    uint64_t operations_blob_offset{0};
   };
 
   std::vector<Partition> part_vec_;
@@ -16,13 +16,21 @@
 
 #include "update_engine/payload_generator/payload_file.h"
 
+#include <fcntl.h>
+
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
+#include "update_engine/common/testing_constants.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_generator/payload_signer.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 
 using std::string;
@@ -35,8 +43,8 @@ class PayloadFileTest : public ::testing::Test {
   PayloadFile payload_;
 };
 
-TEST_F(PayloadFileTest, ReorderBlobsTest) {
-  ScopedTempFile orig_blobs("ReorderBlobsTest.orig.XXXXXX");
+TEST_F(PayloadFileTest, AssignDataOffsetsTest) {
+  ScopedTempFile orig_blobs("AssignDataOffsetsTest.orig.XXXXXX");
 
   // The operations have three blob and one gap (the whitespace):
   // Rootfs operation 1: [8, 3] bcd
@@ -45,8 +53,6 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   string orig_data = "kernel abcd";
   EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), orig_data));
 
-  ScopedTempFile new_blobs("ReorderBlobsTest.new.XXXXXX");
-
   payload_.part_vec_.resize(2);
 
   vector<AnnotatedOperation> aops;
@@ -64,14 +70,27 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   aop.op.set_data_length(6);
   payload_.part_vec_[1].aops = {aop};
 
-  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), new_blobs.path()));
+  int fd = open(orig_blobs.path().c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  ScopedFdCloser fd_closer(&fd);
+  vector<PayloadFile::BlobRange> blob_ranges;
+  EXPECT_TRUE(payload_.AssignDataOffsets(fd, &blob_ranges));
 
   const vector<AnnotatedOperation>& part0_aops = payload_.part_vec_[0].aops;
   const vector<AnnotatedOperation>& part1_aops = payload_.part_vec_[1].aops;
-  string new_data;
-  EXPECT_TRUE(utils::ReadFile(new_blobs.path(), &new_data));
   // Kernel blobs should appear at the end.
-  EXPECT_EQ("bcdakernel", new_data);
+  ASSERT_EQ(3U, blob_ranges.size());
+  EXPECT_EQ(8U, blob_ranges[0].offset);
+  EXPECT_EQ(3U, blob_ranges[0].length);
+  EXPECT_EQ(7U, blob_ranges[1].offset);
+  EXPECT_EQ(1U, blob_ranges[1].length);
+  EXPECT_EQ(0U, blob_ranges[2].offset);
+  EXPECT_EQ(6U, blob_ranges[2].length);
+
+  brillo::Blob hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(brillo::Blob{'a'}, &hash));
+  EXPECT_EQ(string(hash.begin(), hash.end()),
+            part0_aops[1].op.data_sha256_hash());
 
   EXPECT_EQ(2U, part0_aops.size());
   EXPECT_EQ(0U, part0_aops[0].op.data_offset());
@@ -84,4 +103,242 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   EXPECT_EQ(6U, part1_aops[0].op.data_length());
 }
 
+TEST_F(PayloadFileTest, AssignDataOffsetsDedupTest) {
+  ScopedTempFile orig_blobs("AssignDataOffsetsDedupTest.orig.XXXXXX");
+
+  // Rootfs operations: [0, 3] abc, [3, 2] de, [5, 3] abc
+  // Kernel operations: [8, 2] de, [10, 2] ab
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "abcdeabcdeab"));
+
+  payload_.dedup_blobs_ = true;
+  payload_.part_vec_.resize(2);
+  AnnotatedOperation aop;
+  for (const auto& [offset, length] :
+       vector<std::pair<uint64_t, uint64_t>>{{0, 3}, {3, 2}, {5, 3}}) {
+    aop.op.set_data_offset(offset);
+    aop.op.set_data_length(length);
+    payload_.part_vec_[0].aops.push_back(aop);
+  }
+  for (const auto& [offset, length] :
+       vector<std::pair<uint64_t, uint64_t>>{{8, 2}, {10, 2}}) {
+    aop.op.set_data_offset(offset);
+    aop.op.set_data_length(length);
+    payload_.part_vec_[1].aops.push_back(aop);
+  }
+
+  int fd = open(orig_blobs.path().c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  ScopedFdCloser fd_closer(&fd);
+  vector<PayloadFile::BlobRange> blob_ranges;
+  EXPECT_TRUE(payload_.AssignDataOffsets(fd, &blob_ranges));
+
+  // Only "abc", "de" and "ab" are stored.
+  ASSERT_EQ(2U, blob_ranges.size());
+  EXPECT_EQ(0U, blob_ranges[0].offset);
+  EXPECT_EQ(5U, blob_ranges[0].length);
+  EXPECT_EQ(10U, blob_ranges[1].offset);
+  EXPECT_EQ(2U, blob_ranges[1].length);
+
+  vector<uint64_t> offsets;
+  for (const auto& part : payload_.part_vec_) {
+    for (const AnnotatedOperation& part_aop : part.aops) {
+      offsets.push_back(part_aop.op.data_offset());
+    }
+  }
+  EXPECT_EQ((vector<uint64_t>{0, 3, 0, 3, 5}), offsets);
+}
+
+TEST_F(PayloadFileTest, WritePayloadCopiesAndSignsBlobs) {
+  ScopedTempFile orig_blobs("WritePayloadTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "kernel abcd"));
+
+  payload_.major_version_ = kBrilloMajorPayloadVersion;
+  payload_.part_vec_.resize(2);
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  // Blobs with a precomputed hash aren't read back.
+  aop.op.set_data_offset(8);
+  aop.op.set_data_length(3);
+  aop.op.set_data_sha256_hash("bcd hash");
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.clear_data_sha256_hash();
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(6);
+  payload_.part_vec_[1].aops.push_back(aop);
+  aop.op.set_data_offset(6);
+  aop.op.set_data_length(2);
+  payload_.part_vec_[1].aops.push_back(aop);
+
+  ScopedTempFile payload_file("WritePayloadTest.payload.XXXXXX");
+  const string private_key = GetBuildArtifactsPath(kUnittestPrivateKeyPath);
+  uint64_t metadata_size = 0;
+  ASSERT_TRUE(payload_.WritePayload(
+      payload_file.path(), orig_blobs.path(), private_key, &metadata_size));
+
+  // The signatures computed while writing match the written payload.
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+
+  uint64_t signature_size = 0;
+  ASSERT_TRUE(
+      PayloadSigner::SignatureBlobLength({private_key}, &signature_size));
+  string payload;
+  ASSERT_TRUE(utils::ReadFile(payload_file.path(), &payload));
+  ASSERT_EQ(metadata_size + 11 + 2 * signature_size, payload.size());
+  EXPECT_EQ("bcdkernel a", payload.substr(metadata_size + signature_size, 11));
+  EXPECT_EQ("bcd hash", payload_.part_vec_[0].aops[0].op.data_sha256_hash());
+}
+
+TEST_F(PayloadFileTest, WritePayloadWithIndexTest) {
+  ScopedTempFile orig_blobs("WritePayloadWithIndexTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "kernel abcd"));
+
+  payload_.major_version_ = kBrilloMajorPayloadVersion;
+  payload_.payload_index_ = true;
+  payload_.payload_index_chunk_size_ = 4;
+  payload_.part_vec_.resize(2);
+  payload_.part_vec_[0].name = "rootfs";
+  payload_.part_vec_[1].name = "kernel";
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(8);
+  aop.op.set_data_length(3);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_type(InstallOperation::ZERO);
+  aop.op.clear_data_offset();
+  aop.op.clear_data_length();
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(6);
+  payload_.part_vec_[1].aops.push_back(aop);
+
+  ScopedTempFile payload_file("WritePayloadWithIndexTest.payload.XXXXXX");
+  const string private_key = GetBuildArtifactsPath(kUnittestPrivateKeyPath);
+  uint64_t metadata_size = 0;
+  ASSERT_TRUE(payload_.WritePayload(
+      payload_file.path(), orig_blobs.path(), private_key, &metadata_size));
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+
+  PayloadMetadata payload_metadata;
+  DeltaArchiveManifest manifest;
+  ASSERT_TRUE(payload_metadata.ParsePayloadFile(
+      payload_file.path(), &manifest, nullptr));
+  EXPECT_EQ(9U, manifest.index_offset());
+  EXPECT_EQ(manifest.index_offset() + manifest.index_size(),
+            manifest.signatures_offset());
+  PayloadIndex index;
+  ASSERT_TRUE(
+      payload_metadata.ReadPayloadIndex(payload_file.path(), manifest, &index));
+
+  ASSERT_EQ(2, index.partitions_size());
+  EXPECT_EQ("kernel", index.partitions(1).partition_name());
+  EXPECT_EQ(2U, index.partitions(1).first_operation());
+  EXPECT_EQ(1U, index.partitions(1).num_operations());
+  EXPECT_EQ((vector<uint64_t>{0, 0, 3}),
+            vector<uint64_t>(index.data_offsets().begin(),
+                             index.data_offsets().end()));
+  EXPECT_EQ((vector<uint64_t>{3, 0, 6}),
+            vector<uint64_t>(index.data_lengths().begin(),
+                             index.data_lengths().end()));
+
+  // The data blobs are "bcdkernel", hashed in chunks "bcdk", "erne" and "l".
+  ASSERT_EQ(3, index.chunk_hashes_size());
+  const brillo::Blob data = {'b', 'c', 'd', 'k', 'e', 'r', 'n', 'e', 'l'};
+  EXPECT_TRUE(PayloadMetadata::VerifyPayloadIndexChunk(
+      index, 1, data.data() + 4, 4));
+  EXPECT_TRUE(PayloadMetadata::VerifyPayloadIndexChunk(
+      index, 2, data.data() + 8, 1));
+  EXPECT_FALSE(PayloadMetadata::VerifyPayloadIndexChunk(
+      index, 0, data.data() + 4, 4));
+  EXPECT_FALSE(
+      PayloadMetadata::VerifyPayloadIndexChunk(index, 0, data.data(), 3));
+
+  // An index not matching the manifest's hash is rejected.
+  brillo::Blob index_data;
+  ASSERT_TRUE(
+      utils::ReadFileChunk(payload_file.path(),
+                           payload_metadata.GetPayloadIndexOffset(manifest),
+                           manifest.index_size(),
+                           &index_data));
+  EXPECT_TRUE(
+      PayloadMetadata::ParsePayloadIndex(manifest, index_data, &index));
+  index_data.back() ^= 1;
+  EXPECT_FALSE(
+      PayloadMetadata::ParsePayloadIndex(manifest, index_data, &index));
+}
+
+TEST_F(PayloadFileTest, WritePayloadWithSplitOperationsTest) {
+  ScopedTempFile orig_blobs("WritePayloadWithSplitOperationsTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "kernel abcd"));
+
+  payload_.major_version_ = kBrilloMajorPayloadVersion;
+  payload_.manifest_.set_minor_version(kSplitManifestMinorPayloadVersion);
+  payload_.split_operations_ = true;
+  payload_.part_vec_.resize(3);
+  payload_.part_vec_[0].name = "rootfs";
+  payload_.part_vec_[1].name = "system";
+  payload_.part_vec_[2].name = "kernel";
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  *aop.op.add_dst_extents() = ExtentForRange(0, 1);
+  aop.op.set_data_offset(8);
+  aop.op.set_data_length(3);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(6);
+  payload_.part_vec_[2].aops.push_back(aop);
+
+  ScopedTempFile payload_file(
+      "WritePayloadWithSplitOperationsTest.payload.XXXXXX");
+  const string private_key = GetBuildArtifactsPath(kUnittestPrivateKeyPath);
+  uint64_t metadata_size = 0;
+  ASSERT_TRUE(payload_.WritePayload(
+      payload_file.path(), orig_blobs.path(), private_key, &metadata_size));
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+
+  brillo::Blob payload_data;
+  ASSERT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+  PayloadMetadata payload_metadata;
+  ASSERT_EQ(MetadataParseResult::kSuccess,
+            payload_metadata.ParsePayloadHeader(payload_data));
+  DeltaArchiveManifest manifest;
+  ASSERT_TRUE(payload_metadata.GetManifest(payload_data, &manifest));
+  ASSERT_EQ(3, manifest.partitions_size());
+  for (const PartitionUpdate& partition : manifest.partitions()) {
+    EXPECT_EQ(0, partition.operations_size());
+  }
+  EXPECT_FALSE(manifest.partitions(1).has_operations_blob_offset());
+  EXPECT_EQ(1U, manifest.partitions(2).num_operations());
+
+  ASSERT_TRUE(payload_metadata.LoadPartitionOperations(
+      payload_data.data(), payload_data.size(), &manifest));
+  const uint64_t data_offset =
+      metadata_size + payload_metadata.GetMetadataSignatureSize();
+  for (int i : {0, 2}) {
+    const PartitionUpdate& partition = manifest.partitions(i);
+    ASSERT_EQ(1, partition.operations_size());
+    const InstallOperation& op = partition.operations(0);
+    EXPECT_EQ(1, op.dst_extents_size());
+    // The operations come right before the data of their partition.
+    EXPECT_EQ(partition.operations_blob_offset() +
+                  partition.operations_blob_size(),
+              op.data_offset());
+    EXPECT_EQ(i == 0 ? "bcd" : "kernel",
+              string(payload_data.begin() + data_offset + op.data_offset(),
+                     payload_data.begin() + data_offset + op.data_offset() +
+                         op.data_length()));
+  }
+  EXPECT_EQ(0U, manifest.partitions(0).operations_blob_offset());
+
+  // Operations not matching the manifest's hash are rejected.
+  const uint64_t kernel_operations_offset =
+      data_offset + manifest.partitions(2).operations_blob_offset();
+  payload_data[kernel_operations_offset] ^= 1;
+  EXPECT_FALSE(payload_metadata.LoadPartitionOperations(
+      payload_data.data(), payload_data.size(), &manifest));
+}
+
 }  // namespace chromeos_update_engine
@@ -21,6 +21,7 @@
 #include <utility>
 
 #include <android-base/parseint.h>
+#include <base/files/file_util.h>
 #include <base/logging.h>
 #include <brillo/strings/string_utils.h>
 #include <libsnapshot/cow_format.h>
@@ -34,6 +35,7 @@
 #include "update_engine/payload_generator/erofs_filesystem.h"
 #include "update_engine/payload_generator/ext2_filesystem.h"
 #include "update_engine/payload_generator/mapfile_filesystem.h"
+#include "update_engine/payload_generator/previous_payload.h"
 #include "update_engine/payload_generator/raw_filesystem.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
 #include "update_engine/update_metadata.pb.h"
@@ -43,7 +45,8 @@ using std::string;
 namespace chromeos_update_engine {
 
 bool PostInstallConfig::IsEmpty() const {
-  return !run && path.empty() && filesystem_type.empty() && !optional;
+  return !run && path.empty() && filesystem_type.empty() && !optional &&
+         !parallel;
 }
 
 bool VerityConfig::IsEmpty() const {
@@ -147,6 +150,8 @@ bool ImageConfig::LoadPostInstallConfig(const brillo::KeyValueStore& store) {
                     &part.postinstall.filesystem_type);
     store.GetBoolean("POSTINSTALL_OPTIONAL_" + part.name,
                      &part.postinstall.optional);
+    store.GetBoolean("POSTINSTALL_PARALLEL_" + part.name,
+                     &part.postinstall.parallel);
   }
   if (!found_postinstall) {
     LOG(ERROR) << "No valid postinstall config found.";
@@ -291,7 +296,13 @@ bool PayloadVersion::Validate() const {
                         minor == kVerityMinorPayloadVersion ||
                         minor == kPartialUpdateMinorPayloadVersion ||
                         minor == kZucchiniMinorPayloadVersion ||
-                        minor == kLZ4DIFFMinorPayloadVersion);
+                        minor == kLZ4DIFFMinorPayloadVersion ||
+                        minor == kPackedExtentsMinorPayloadVersion ||
+                        minor == kZstdMinorPayloadVersion ||
+                        minor == kPayloadIndexMinorPayloadVersion ||
+                        minor == kSplitManifestMinorPayloadVersion ||
+                        minor == kDedupBlobsMinorPayloadVersion ||
+                        minor == kPartitionCopyMinorPayloadVersion);
   return true;
 }
 
@@ -329,6 +340,15 @@ bool PayloadVersion::OperationAllowed(InstallOperation::Type operation) const {
     case InstallOperation::LZ4DIFF_PUFFDIFF:
       return minor >= kLZ4DIFFMinorPayloadVersion;
 
+    case InstallOperation::REPLACE_ZSTD:
+      // Full payloads always have the full payload minor version, so they
+      // can't tell whether the client supports it.
+      return minor >= kZstdMinorPayloadVersion ||
+             (minor == kFullPayloadMinorVersion && full_zstd_allowed);
+
+    case InstallOperation::PARTITION_COPY:
+      return minor >= kPartitionCopyMinorPayloadVersion;
+
     case InstallOperation::MOVE:
     case InstallOperation::BSDIFF:
       NOTREACHED();
@@ -340,21 +360,26 @@ bool PayloadVersion::IsDeltaOrPartial() const {
   return minor != kFullPayloadMinorVersion;
 }
 
+bool PayloadGenerationConfig::ValidateSource(
+    const ImageConfig& source_image) const {
+  for (const PartitionConfig& part : source_image.partitions) {
+    if (!part.path.empty()) {
+      TEST_AND_RETURN_FALSE(part.ValidateExists());
+      TEST_AND_RETURN_FALSE(part.size % block_size == 0);
+    }
+    // Source partition should not have postinstall or verity config.
+    TEST_AND_RETURN_FALSE(part.postinstall.IsEmpty());
+    TEST_AND_RETURN_FALSE(part.verity.IsEmpty());
+  }
+  return true;
+}
+
 bool PayloadGenerationConfig::Validate() const {
   TEST_AND_RETURN_FALSE(version.Validate());
   TEST_AND_RETURN_FALSE(version.IsDeltaOrPartial() ==
                         (is_delta || is_partial_update));
   if (is_delta) {
-    for (const PartitionConfig& part : source.partitions) {
-      if (!part.path.empty()) {
-        TEST_AND_RETURN_FALSE(part.ValidateExists());
-        TEST_AND_RETURN_FALSE(part.size % block_size == 0);
-      }
-      // Source partition should not have postinstall or verity config.
-      TEST_AND_RETURN_FALSE(part.postinstall.IsEmpty());
-      TEST_AND_RETURN_FALSE(part.verity.IsEmpty());
-    }
-
+    TEST_AND_RETURN_FALSE(ValidateSource(source));
   } else {
     // All the "source" image fields must be empty for full payloads.
     TEST_AND_RETURN_FALSE(source.ValidateIsEmpty());
@@ -377,6 +402,46 @@ bool PayloadGenerationConfig::Validate() const {
   TEST_AND_RETURN_FALSE(soft_chunk_size % block_size == 0);
 
   TEST_AND_RETURN_FALSE(rootfs_partition_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(segment_hash_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(
+      !payload_index || version.minor == kFullPayloadMinorVersion ||
+      version.minor >= kPayloadIndexMinorPayloadVersion);
+  TEST_AND_RETURN_FALSE(payload_index || payload_index_chunk_size == 0);
+  TEST_AND_RETURN_FALSE(
+      !split_partition_operations ||
+      version.minor == kFullPayloadMinorVersion ||
+      version.minor >= kSplitManifestMinorPayloadVersion);
+  TEST_AND_RETURN_FALSE(!dedup_blobs ||
+                        version.minor == kFullPayloadMinorVersion ||
+                        version.minor >= kDedupBlobsMinorPayloadVersion);
+  // The client only knows which blobs to keep when it has all the operations
+  // up front.
+  TEST_AND_RETURN_FALSE(!dedup_blobs || !split_partition_operations);
+  // Only dynamic partitions copy from each other.
+  TEST_AND_RETURN_FALSE(
+      !partition_copy ||
+      (is_delta && target.dynamic_partition_metadata &&
+       version.minor >= kPartitionCopyMinorPayloadVersion));
+  // The operations reused must be allowed in this payload.
+  TEST_AND_RETURN_FALSE(
+      !previous_payload ||
+      (is_delta && previous_payload->minor_version() == version.minor));
+  TEST_AND_RETURN_FALSE(diff_cache_dir.empty() ||
+                        base::DirectoryExists(base::FilePath(diff_cache_dir)));
+  // The shards are only generated for their diffs.
+  TEST_AND_RETURN_FALSE(diff_shard_count == 0 ||
+                        (is_delta && !diff_cache_dir.empty() &&
+                         diff_shard_index < diff_shard_count));
+  TEST_AND_RETURN_FALSE(
+      file_index_cache_dir.empty() ||
+      base::DirectoryExists(base::FilePath(file_index_cache_dir)));
+  TEST_AND_RETURN_FALSE(cow_estimate_error_bound >= 0 &&
+                        cow_estimate_error_bound < 1);
+  // Operations can only be reordered in A/B payloads.
+  TEST_AND_RETURN_FALSE(streaming_download_mib_per_second >= 0);
+  TEST_AND_RETURN_FALSE(streaming_download_mib_per_second == 0 ||
+                        (apply_cost_model &&
+                         version.minor >= kSourceMinorPayloadVersion));
 
   return true;
 }
@@ -384,20 +449,25 @@ bool PayloadGenerationConfig::Validate() const {
 void PayloadGenerationConfig::ParseCompressorTypes(
     const std::string& compressor_types) {
   auto types = brillo::string_utils::Split(compressor_types, ":");
-  CHECK_LE(types.size(), 2UL)
-      << "Only two compressor types are allowed: bz2 and brotli";
-  CHECK_GT(types.size(), 0UL) << "Please pass in at least 1 valid compressor. "
-                                 "Allowed values are bz2 and brotli.";
+  CHECK_LE(types.size(), 3UL)
+      << "Only three compressor types are allowed: bz2, brotli and zstd";
   compressors.clear();
+  bsdiff_zstd = false;
   for (const auto& type : types) {
     if (type == "bz2") {
       compressors.emplace_back(bsdiff::CompressorType::kBZ2);
     } else if (type == "brotli") {
       compressors.emplace_back(bsdiff::CompressorType::kBrotli);
+    } else if (type == "zstd") {
+      bsdiff_zstd = true;
     } else {
       LOG(FATAL) << "Unknown compressor type: " << type;
     }
   }
+  // Zstd is only used by BROTLI_BSDIFF patches, PUFFDIFF ones need another.
+  CHECK_GT(compressors.size(), 0UL)
+      << "Please pass in at least 1 valid compressor besides zstd. Allowed "
+         "values are bz2 and brotli.";
 }
 
 bool PayloadGenerationConfig::OperationEnabled(
@@ -413,6 +483,8 @@ bool PayloadGenerationConfig::OperationEnabled(
       return enable_lz4diff;
     case InstallOperation::PUFFDIFF:
       return enable_puffdiff;
+    case InstallOperation::PARTITION_COPY:
+      return partition_copy;
     default:
       return true;
   }
@@ -20,6 +20,7 @@
 #include <cstddef>
 
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -27,11 +28,15 @@
 #include <brillo/secure_blob.h>
 
 #include "bsdiff/constants.h"
+#include "update_engine/payload_generator/apply_cost_model.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
+class GenerationReport;
+class PreviousPayload;
+
 struct PostInstallConfig {
   // Whether the postinstall config is empty.
   bool IsEmpty() const;
@@ -50,6 +55,10 @@ struct PostInstallConfig {
 
   // Whether this postinstall script should be ignored if it fails.
   bool optional = false;
+
+  // Whether this postinstall script can run alongside the ones of other
+  // partitions.
+  bool parallel = false;
 };
 
 // Data will be written to the payload and used for hash tree and FEC generation
@@ -101,6 +110,10 @@ struct PartitionConfig {
   // |fs_interface|. Returns whether opening the filesystem worked.
   bool OpenFilesystem();
 
+  // Load the verity config of this partition by parsing its image, which
+  // requires |fs_interface|.
+  bool LoadVerityConfig();
+
   // The path to the partition file. This can be a regular file or a block
   // device such as a loop device.
   std::string path;
@@ -138,6 +151,12 @@ struct PartitionConfig {
   // Examples: lz4    lz4hc,9
   // The default is usually lz4hc,9 for mkfs.erofs
   CompressionAlgorithm erofs_compression_param = GetDefaultCompressionParam();
+
+  // The PartitionInfo of this partition and its files as returned by
+  // diff_utils::GetPartitionFiles(), when computed once for all the payloads
+  // generated to this partition, see GenerateUpdatePayloadFiles().
+  std::optional<PartitionInfo> info;
+  std::optional<std::vector<FilesystemInterface::File>> files;
 };
 
 // The ImageConfig struct describes a pair of binaries kernel and rootfs and the
@@ -190,6 +209,17 @@ struct PayloadVersion {
 
   // The minor version of the payload.
   uint32_t minor;
+
+  // When non-zero, the data of REPLACE_XZ operations is split in xz streams of
+  // this many uncompressed bytes, which the client decodes in parallel.
+  // Clients without the parallel decoder fail on such operations, so it's
+  // only set for the ones known to have it.
+  uint64_t xz_stream_size{0};
+
+  // Whether a full payload may use REPLACE_ZSTD operations, which delta
+  // payloads use from kZstdMinorPayloadVersion on. Clients older than that
+  // version fail on them, so it's only set for the ones known to support it.
+  bool full_zstd_allowed{false};
 };
 
 // The PayloadGenerationConfig struct encapsulates all the configuration to
@@ -200,6 +230,10 @@ struct PayloadGenerationConfig {
   // Returns whether the PayloadGenerationConfig is valid.
   bool Validate() const;
 
+  // Returns whether |source_image| is a valid source image for a delta
+  // payload, as |source| is checked by Validate().
+  bool ValidateSource(const ImageConfig& source_image) const;
+
   void ParseCompressorTypes(const std::string& compressor_types);
 
   // Image information about the new image that's the target of this payload.
@@ -255,6 +289,10 @@ struct PayloadGenerationConfig {
   // Whether to enable VABC xor op
   bool enable_vabc_xor = false;
 
+  // Whether the merge sequences favour reading the source partitions in order
+  // over writing the targets in order.
+  bool merge_source_order = false;
+
   // Whether to enable LZ4diff ops
   bool enable_lz4diff = false;
 
@@ -270,8 +308,105 @@ struct PayloadGenerationConfig {
   // count by number of CPU cores
   uint32_t max_threads = 256;
 
+  // When non-zero, the files diffed at the same time use about this many
+  // bytes of memory together at most. Files estimated to need more than that
+  // are diffed on their own.
+  uint64_t memory_budget = 0;
+
+  // When non-zero, the hash of every |segment_hash_size| bytes of the new
+  // partitions is stored in their new_partition_info as well, a multiple of
+  // |block_size|.
+  uint64_t segment_hash_size = 0;
+
+  // Whether to write a PayloadIndex after the data blobs, for consumers which
+  // read parts of the payload directly. Only allowed in minor version
+  // kPayloadIndexMinorPayloadVersion or newer, or full payloads for clients
+  // supporting it.
+  bool payload_index = false;
+
+  // When non-zero, the PayloadIndex also has the hash of every chunk of this
+  // many bytes of the data blobs.
+  uint64_t payload_index_chunk_size = 0;
+
+  // Whether to store the operations of every partition apart from the
+  // manifest, right before its data blobs, so the device starts applying a
+  // partition once its own operations are downloaded. Only allowed in minor
+  // version kSplitManifestMinorPayloadVersion or newer, or full payloads for
+  // clients supporting it.
+  bool split_partition_operations = false;
+
+  // Whether operations with identical data blobs share a single copy of it,
+  // up to kMaxReusedBlobsSize of shared blobs. Only allowed in minor version
+  // kDedupBlobsMinorPayloadVersion or newer, or full payloads for clients
+  // supporting it.
+  bool dedup_blobs = false;
+
+  // Whether the blocks of a dynamic partition with data found in another
+  // dynamic source partition, like files moved between partitions, are copied
+  // from there with PARTITION_COPY operations. Only allowed in delta payloads
+  // of minor version kPartitionCopyMinorPayloadVersion or newer.
+  bool partition_copy = false;
+
+  // When not empty, an existing directory where the results of diffing files
+  // are cached, see DiffCache.
+  std::string diff_cache_dir;
+
+  // When |diff_shard_count| is non-zero, only the files of the shard
+  // |diff_shard_index| of every partition are diffed, to fill |diff_cache_dir|,
+  // and no payload is written. Generators on several machines sharing
+  // |diff_cache_dir| each diff a shard of the same payload, which is then
+  // generated without sharding from the cached diffs.
+  uint32_t diff_shard_count = 0;
+  uint32_t diff_shard_index = 0;
+
+  // When not empty, an existing directory where the files found in the
+  // partition images are cached, see FileIndexCache.
+  std::string file_index_cache_dir;
+
+  // When non-zero, the COW size of a partition is extrapolated from a sample
+  // of its operations, within this relative error, see EstimateCowSizeInfo().
+  double cow_estimate_error_bound = 0;
+
+  // Whether to try all the allowed compressors on every full operation, even
+  // on data that looks incompressible, see GenerateBestFullOperation().
+  bool max_compression_effort = false;
+
+  // When non-zero, once diffing a file took this many seconds the diff
+  // algorithms not started yet are skipped and the best diff found so far is
+  // used. The payload then depends on the speed of the machine.
+  uint64_t diff_time_budget_seconds = 0;
+
+  // When non-zero, files larger than this many bytes are split in segments of
+  // at most this size at boundaries depending on their data, each diffed on
+  // its own and at once with the others, see FindSegmentBoundaries().
+  uint64_t max_file_segment_size = 0;
+
+  // When set, A/B operations are merged, split and ordered for the device to
+  // apply them fast according to this model, see ABGenerator. Full operations
+  // are sized by it too, larger for incompressible data, see
+  // FullUpdateGenerator.
+  std::optional<ApplyCostModel> apply_cost_model;
+
+  // When non-zero with an |apply_cost_model|, A/B operations and so their data
+  // blobs are laid out for a device downloading the payload at this rate while
+  // applying it, |streaming_lookahead_size| bytes ahead at most, see
+  // ABGenerator::OrderOperationsForStreaming().
+  double streaming_download_mib_per_second = 0;
+  uint64_t streaming_lookahead_size = 0;
+
+  // When set, how the payload is generated is recorded in this report, see
+  // GenerationReport. Not owned.
+  GenerationReport* report = nullptr;
+
+  // When set, the operations of this payload from the same source are reused
+  // for the blocks that didn't change since, see PreviousPayload. Not owned.
+  const PreviousPayload* previous_payload = nullptr;
+
   std::vector<bsdiff::CompressorType> compressors{
       bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli};
+  // Whether BROTLI_BSDIFF patches may use zstd, which the bsdiff library
+  // doesn't support, when the minor version allows it.
+  bool bsdiff_zstd = true;
 
   [[nodiscard]] bool OperationEnabled(InstallOperation::Type op) const noexcept;
 };
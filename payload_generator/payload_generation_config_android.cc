@@ -129,99 +129,102 @@ bool VerifyVerityConfig(const PartitionConfig& part) {
 }
 }  // namespace
 
-bool ImageConfig::LoadVerityConfig() {
-  for (PartitionConfig& part : partitions) {
-    // Parse AVB devices.
-    if (part.size > sizeof(AvbFooter)) {
-      uint64_t footer_offset = part.size - sizeof(AvbFooter);
-      brillo::Blob buffer;
+bool PartitionConfig::LoadVerityConfig() {
+  // Parse AVB devices.
+  if (size > sizeof(AvbFooter)) {
+    uint64_t footer_offset = size - sizeof(AvbFooter);
+    brillo::Blob buffer;
+    TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+        path, footer_offset, sizeof(AvbFooter), &buffer));
+    if (memcmp(buffer.data(), AVB_FOOTER_MAGIC, AVB_FOOTER_MAGIC_LEN) == 0) {
+      LOG(INFO) << "Parsing verity config from AVB footer for " << name;
+      AvbFooter footer;
+      TEST_AND_RETURN_FALSE(avb_footer_validate_and_byteswap(
+          reinterpret_cast<const AvbFooter*>(buffer.data()), &footer));
+      buffer.clear();
+
+      TEST_AND_RETURN_FALSE(
+          footer.vbmeta_offset + sizeof(AvbVBMetaImageHeader) <= size);
       TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
-          part.path, footer_offset, sizeof(AvbFooter), &buffer));
-      if (memcmp(buffer.data(), AVB_FOOTER_MAGIC, AVB_FOOTER_MAGIC_LEN) == 0) {
-        LOG(INFO) << "Parsing verity config from AVB footer for " << part.name;
-        AvbFooter footer;
-        TEST_AND_RETURN_FALSE(avb_footer_validate_and_byteswap(
-            reinterpret_cast<const AvbFooter*>(buffer.data()), &footer));
-        buffer.clear();
+          path, footer.vbmeta_offset, footer.vbmeta_size, &buffer));
+      TEST_AND_RETURN_FALSE(avb_descriptor_foreach(
+          buffer.data(), buffer.size(), AvbDescriptorCallback, this));
+    }
+  }
 
+  // Parse VB1.0 devices with FEC metadata, devices with hash tree without
+  // FEC will be skipped for now.
+  if (verity.IsEmpty() && size > FEC_BLOCKSIZE) {
+    brillo::Blob fec_metadata;
+    TEST_AND_RETURN_FALSE(utils::ReadFileChunk(path,
+                                               size - FEC_BLOCKSIZE,
+                                               sizeof(fec_header),
+                                               &fec_metadata));
+    const fec_header* header =
+        reinterpret_cast<const fec_header*>(fec_metadata.data());
+    if (header->magic == FEC_MAGIC) {
+      LOG(INFO) << "Parsing verity config from Verified Boot 1.0 metadata for "
+                << name;
+      const size_t block_size = fs_interface->GetBlockSize();
+      // FEC_VERITY_DISABLE skips verifying verity hash tree, because we will
+      // verify it ourselves later.
+      fec::io fh(path, O_RDONLY, FEC_VERITY_DISABLE);
+      TEST_AND_RETURN_FALSE(fh);
+      fec_verity_metadata verity_data;
+      if (fh.get_verity_metadata(verity_data)) {
+        auto verity_table = base::SplitString(verity_data.table,
+                                              " ",
+                                              base::KEEP_WHITESPACE,
+                                              base::SPLIT_WANT_ALL);
+        TEST_AND_RETURN_FALSE(verity_table.size() == 10);
+        size_t data_block_size = 0;
+        TEST_AND_RETURN_FALSE(
+            base::StringToSizeT(verity_table[3], &data_block_size));
+        TEST_AND_RETURN_FALSE(block_size == data_block_size);
+        size_t hash_block_size = 0;
         TEST_AND_RETURN_FALSE(
-            footer.vbmeta_offset + sizeof(AvbVBMetaImageHeader) <= part.size);
-        TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
-            part.path, footer.vbmeta_offset, footer.vbmeta_size, &buffer));
-        TEST_AND_RETURN_FALSE(avb_descriptor_foreach(
-            buffer.data(), buffer.size(), AvbDescriptorCallback, &part));
+            base::StringToSizeT(verity_table[4], &hash_block_size));
+        TEST_AND_RETURN_FALSE(block_size == hash_block_size);
+        uint64_t num_data_blocks = 0;
+        TEST_AND_RETURN_FALSE(android::base::ParseUint<uint64_t>(
+            verity_table[5], &num_data_blocks));
+        verity.hash_tree_data_extent = ExtentForRange(0, num_data_blocks);
+        uint64_t hash_start_block = 0;
+        TEST_AND_RETURN_FALSE(android::base::ParseUint<uint64_t>(
+            verity_table[6], &hash_start_block));
+        verity.hash_tree_algorithm = verity_table[7];
+        TEST_AND_RETURN_FALSE(base::HexStringToBytes(
+            verity_table[9], &verity.hash_tree_salt));
+        auto hash_function =
+            HashTreeBuilder::HashFunction(verity.hash_tree_algorithm);
+        TEST_AND_RETURN_FALSE(hash_function != nullptr);
+        HashTreeBuilder hash_tree_builder(block_size, hash_function);
+        uint64_t tree_size =
+            hash_tree_builder.CalculateSize(num_data_blocks * block_size);
+        verity.hash_tree_extent =
+            ExtentForRange(hash_start_block, tree_size / block_size);
       }
-    }
-
-    // Parse VB1.0 devices with FEC metadata, devices with hash tree without
-    // FEC will be skipped for now.
-    if (part.verity.IsEmpty() && part.size > FEC_BLOCKSIZE) {
-      brillo::Blob fec_metadata;
-      TEST_AND_RETURN_FALSE(utils::ReadFileChunk(part.path,
-                                                 part.size - FEC_BLOCKSIZE,
-                                                 sizeof(fec_header),
-                                                 &fec_metadata));
-      const fec_header* header =
-          reinterpret_cast<const fec_header*>(fec_metadata.data());
-      if (header->magic == FEC_MAGIC) {
-        LOG(INFO)
-            << "Parsing verity config from Verified Boot 1.0 metadata for "
-            << part.name;
-        const size_t block_size = part.fs_interface->GetBlockSize();
-        // FEC_VERITY_DISABLE skips verifying verity hash tree, because we will
-        // verify it ourselves later.
-        fec::io fh(part.path, O_RDONLY, FEC_VERITY_DISABLE);
-        TEST_AND_RETURN_FALSE(fh);
-        fec_verity_metadata verity_data;
-        if (fh.get_verity_metadata(verity_data)) {
-          auto verity_table = base::SplitString(verity_data.table,
-                                                " ",
-                                                base::KEEP_WHITESPACE,
-                                                base::SPLIT_WANT_ALL);
-          TEST_AND_RETURN_FALSE(verity_table.size() == 10);
-          size_t data_block_size = 0;
-          TEST_AND_RETURN_FALSE(
-              base::StringToSizeT(verity_table[3], &data_block_size));
-          TEST_AND_RETURN_FALSE(block_size == data_block_size);
-          size_t hash_block_size = 0;
-          TEST_AND_RETURN_FALSE(
-              base::StringToSizeT(verity_table[4], &hash_block_size));
-          TEST_AND_RETURN_FALSE(block_size == hash_block_size);
-          uint64_t num_data_blocks = 0;
-          TEST_AND_RETURN_FALSE(android::base::ParseUint<uint64_t>(
-              verity_table[5], &num_data_blocks));
-          part.verity.hash_tree_data_extent =
-              ExtentForRange(0, num_data_blocks);
-          uint64_t hash_start_block = 0;
-          TEST_AND_RETURN_FALSE(android::base::ParseUint<uint64_t>(
-              verity_table[6], &hash_start_block));
-          part.verity.hash_tree_algorithm = verity_table[7];
-          TEST_AND_RETURN_FALSE(base::HexStringToBytes(
-              verity_table[9], &part.verity.hash_tree_salt));
-          auto hash_function =
-              HashTreeBuilder::HashFunction(part.verity.hash_tree_algorithm);
-          TEST_AND_RETURN_FALSE(hash_function != nullptr);
-          HashTreeBuilder hash_tree_builder(block_size, hash_function);
-          uint64_t tree_size =
-              hash_tree_builder.CalculateSize(num_data_blocks * block_size);
-          part.verity.hash_tree_extent =
-              ExtentForRange(hash_start_block, tree_size / block_size);
-        }
-        fec_ecc_metadata ecc_data;
-        if (!part.disable_fec_computation && fh.get_ecc_metadata(ecc_data) &&
-            ecc_data.valid) {
-          TEST_AND_RETURN_FALSE(block_size == FEC_BLOCKSIZE);
-          part.verity.fec_data_extent = ExtentForRange(0, ecc_data.blocks);
-          part.verity.fec_extent =
-              ExtentForBytes(block_size, ecc_data.start, header->fec_size);
-          part.verity.fec_roots = ecc_data.roots;
-        }
+      fec_ecc_metadata ecc_data;
+      if (!disable_fec_computation && fh.get_ecc_metadata(ecc_data) &&
+          ecc_data.valid) {
+        TEST_AND_RETURN_FALSE(block_size == FEC_BLOCKSIZE);
+        verity.fec_data_extent = ExtentForRange(0, ecc_data.blocks);
+        verity.fec_extent =
+            ExtentForBytes(block_size, ecc_data.start, header->fec_size);
+        verity.fec_roots = ecc_data.roots;
       }
     }
+  }
 
-    if (!part.verity.IsEmpty()) {
-      TEST_AND_RETURN_FALSE(VerifyVerityConfig(part));
-    }
+  if (!verity.IsEmpty()) {
+    TEST_AND_RETURN_FALSE(VerifyVerityConfig(*this));
+  }
+  return true;
+}
+
+bool ImageConfig::LoadVerityConfig() {
+  for (PartitionConfig& part : partitions) {
+    TEST_AND_RETURN_FALSE(part.LoadVerityConfig());
   }
   return true;
 }
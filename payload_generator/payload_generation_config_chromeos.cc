@@ -18,6 +18,10 @@
 
 namespace chromeos_update_engine {
 
+bool PartitionConfig::LoadVerityConfig() {
+  return true;
+}
+
 bool ImageConfig::LoadVerityConfig() {
   return true;
 }
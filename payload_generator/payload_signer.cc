@@ -32,6 +32,7 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 #include "update_engine/update_metadata.pb.h"
@@ -129,7 +130,9 @@ bool AddSignatureBlobToPayload(const string& payload_path,
       payload_signature.size(),
       &manifest);
 
-  // Updates the payload to include the new manifest.
+  // Updates the payload to include the new manifest. GetManifest() unpacked
+  // its extents.
+  PackManifestExtents(&manifest);
   string serialized_manifest;
   TEST_AND_RETURN_FALSE(manifest.AppendToString(&serialized_manifest));
   LOG(INFO) << "Updated protobuf size: " << serialized_manifest.size();
@@ -272,6 +275,32 @@ bool PayloadSigner::VerifySignedPayload(const string& payload_path,
   return true;
 }
 
+bool PayloadSigner::HashPayloadWithoutSignatures(const string& payload_path,
+                                                 brillo::Blob* out_hash) {
+  brillo::Blob payload;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &payload));
+  PayloadMetadata payload_metadata;
+  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadHeader(payload));
+  DeltaArchiveManifest manifest;
+  TEST_AND_RETURN_FALSE(payload_metadata.GetManifest(payload, &manifest));
+  const uint64_t metadata_size = payload_metadata.GetMetadataSize();
+  const uint32_t metadata_signature_size =
+      payload_metadata.GetMetadataSignatureSize();
+  uint64_t signatures_offset = payload.size();
+  if (manifest.has_signatures_offset()) {
+    signatures_offset =
+        metadata_size + metadata_signature_size + manifest.signatures_offset();
+    TEST_AND_RETURN_FALSE(payload.size() ==
+                          signatures_offset + manifest.signatures_size());
+  }
+  return CalculateHashFromPayload(payload,
+                                  metadata_size,
+                                  metadata_signature_size,
+                                  signatures_offset,
+                                  out_hash,
+                                  nullptr);
+}
+
 bool PayloadSigner::SignHash(const brillo::Blob& hash,
                              const string& private_key_path,
                              brillo::Blob* out_signature) {
@@ -39,6 +39,13 @@ class PayloadSigner {
   static bool VerifySignedPayload(const std::string& payload_path,
                                   const std::string& public_key_path);
 
+  // Calculates in |out_hash| the raw SHA256 hash of the payload in
+  // |payload_path| without its metadata and payload signatures, which is the
+  // hash the payload signature signs. The same for a payload signed or not,
+  // and whatever the signature, including randomized ECDSA ones.
+  static bool HashPayloadWithoutSignatures(const std::string& payload_path,
+                                           brillo::Blob* out_hash);
+
   // Adds specified signature offset/length to given |manifest|.
   static void AddSignatureToManifest(uint64_t signature_blob_offset,
                                      uint64_t signature_blob_length,
@@ -157,6 +157,48 @@ TEST_F(PayloadSignerTest, VerifySignatureTest) {
   EXPECT_FALSE(payload_verifier->VerifySignature(signature, hash_data_));
 }
 
+// ECDSA signatures differ every time, the hash without them doesn't.
+TEST_F(PayloadSignerTest, HashPayloadWithoutSignaturesTest) {
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  PayloadFile payload;
+  EXPECT_TRUE(payload.Init(config));
+  uint64_t metadata_size;
+  ScopedTempFile payload_file("payload.XXXXXX");
+  ScopedTempFile other_payload_file("payload.XXXXXX");
+  for (const auto* path : {&payload_file, &other_payload_file}) {
+    ASSERT_TRUE(
+        payload.WritePayload(path->path(),
+                             "/dev/null",
+                             GetBuildArtifactsPath(kUnittestPrivateKeyECPath),
+                             &metadata_size));
+  }
+  brillo::Blob data, other_data;
+  ASSERT_TRUE(utils::ReadFile(payload_file.path(), &data));
+  ASSERT_TRUE(utils::ReadFile(other_payload_file.path(), &other_data));
+  EXPECT_NE(data, other_data);
+
+  brillo::Blob hash, other_hash;
+  ASSERT_TRUE(
+      PayloadSigner::HashPayloadWithoutSignatures(payload_file.path(), &hash));
+  ASSERT_TRUE(PayloadSigner::HashPayloadWithoutSignatures(
+      other_payload_file.path(), &other_hash));
+  EXPECT_EQ(hash, other_hash);
+
+  // A different payload hashes differently.
+  config.version.minor = kSourceMinorPayloadVersion;
+  PayloadFile changed_payload;
+  EXPECT_TRUE(changed_payload.Init(config));
+  ASSERT_TRUE(changed_payload.WritePayload(
+      other_payload_file.path(),
+      "/dev/null",
+      GetBuildArtifactsPath(kUnittestPrivateKeyECPath),
+      &metadata_size));
+  ASSERT_TRUE(PayloadSigner::HashPayloadWithoutSignatures(
+      other_payload_file.path(), &other_hash));
+  EXPECT_NE(hash, other_hash);
+}
+
 TEST_F(PayloadSignerTest, VerifySignedPayloadTest) {
   ScopedTempFile payload_file("payload.XXXXXX");
   PayloadGenerationConfig config;
@@ -0,0 +1,227 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/previous_payload.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Whether the first info.size() bytes of |path| have the hash in |info|.
+bool MatchesPartitionInfo(const string& path, const PartitionInfo& info) {
+  brillo::Blob hash;
+  if (HashCalculator::RawHashOfFile(path, info.size(), &hash) !=
+      static_cast<off_t>(info.size())) {
+    return false;
+  }
+  return info.hash() == string(hash.begin(), hash.end());
+}
+}  // namespace
+
+bool PreviousPayload::Load(const string& path) {
+  payload_ = MappedFile::OpenShared(path);
+  if (!payload_) {
+    LOG(ERROR) << "Unable to map the previous payload " << path;
+    return false;
+  }
+  PayloadMetadata metadata;
+  TEST_AND_RETURN_FALSE(metadata.ParsePayloadHeader(
+                            payload_->data(), payload_->size(), nullptr) ==
+                        MetadataParseResult::kSuccess);
+  TEST_AND_RETURN_FALSE(
+      metadata.GetManifest(payload_->data(), payload_->size(), &manifest_));
+  TEST_AND_RETURN_FALSE(metadata.LoadPartitionOperations(
+      payload_->data(), payload_->size(), &manifest_));
+  data_offset_ =
+      metadata.GetMetadataSize() + metadata.GetMetadataSignatureSize();
+  TEST_AND_RETURN_FALSE(data_offset_ <= payload_->size());
+  LOG(INFO) << "Loaded the previous payload " << path << " of "
+            << manifest_.partitions_size() << " partitions";
+  return true;
+}
+
+void PreviousPayload::SetPreviousTarget(const string& partition,
+                                        const string& path) {
+  previous_targets_[partition] = path;
+}
+
+void PreviousPayload::AddChangedFile(const string& partition,
+                                     const string& name) {
+  changed_files_[partition].insert(name);
+}
+
+bool PreviousPayload::ReuseOperations(
+    const PartitionConfig& old_part,
+    const PartitionConfig& new_part,
+    const vector<FilesystemInterface::File>& new_files,
+    const PayloadGenerationConfig& config,
+    BlobFileWriter* blob_file,
+    vector<AnnotatedOperation>* aops,
+    BlockSet* new_visited_blocks) const {
+  const auto it = std::find_if(manifest_.partitions().begin(),
+                               manifest_.partitions().end(),
+                               [&new_part](const PartitionUpdate& part) {
+                                 return part.partition_name() == new_part.name;
+                               });
+  if (it == manifest_.partitions().end()) {
+    LOG(INFO) << "Partition " << new_part.name
+              << " isn't in the previous payload";
+    return true;
+  }
+  const PartitionUpdate& previous_part = *it;
+  const PartitionInfo& old_info = previous_part.old_partition_info();
+  if (old_info.size() != old_part.size ||
+      !MatchesPartitionInfo(old_part.path, old_info)) {
+    LOG(WARNING) << "The previous payload doesn't update from this source of "
+                 << new_part.name << ", not reusing its operations";
+    return true;
+  }
+  if (previous_part.new_partition_info().size() != new_part.size) {
+    LOG(WARNING) << "Partition " << new_part.name
+                 << " changed size since the previous payload, not reusing "
+                    "its operations";
+    return true;
+  }
+
+  // The files listed as changed are only used without previous targets.
+  if (!previous_targets_.empty() &&
+      previous_targets_.count(new_part.name) == 0) {
+    LOG(INFO) << "No previous target for partition " << new_part.name
+              << ", not reusing the operations of the previous payload";
+    return true;
+  }
+
+  ExtentRanges changed_blocks;
+  changed_blocks.AddExtents(new_visited_blocks->ToExtents());
+  TEST_AND_RETURN_FALSE(
+      GetChangedBlocks(new_part, previous_part, new_files, &changed_blocks));
+
+  size_t reused_ops = 0;
+  brillo::Blob blob;
+  for (const InstallOperation& op : previous_part.operations()) {
+    // Only the source of this partition was checked.
+    if (op.type() == InstallOperation::PARTITION_COPY ||
+        !config.OperationEnabled(op.type())) {
+      continue;
+    }
+    if (std::any_of(op.dst_extents().begin(),
+                    op.dst_extents().end(),
+                    [&changed_blocks](const Extent& extent) {
+                      return changed_blocks.OverlapsWithExtent(extent);
+                    })) {
+      continue;
+    }
+    AnnotatedOperation aop;
+    aop.name = "<previous-payload>";
+    aop.op = op;
+    if (op.has_data_length() && op.data_length() > 0) {
+      const uint64_t offset = data_offset_ + op.data_offset();
+      TEST_AND_RETURN_FALSE(offset <= payload_->size() &&
+                            op.data_length() <= payload_->size() - offset);
+      blob.assign(payload_->data() + offset,
+                  payload_->data() + offset + op.data_length());
+      const off_t data_offset = blob_file->StoreBlob(blob);
+      TEST_AND_RETURN_FALSE(data_offset != -1);
+      aop.op.set_data_offset(data_offset);
+    }
+    for (const Extent& extent : op.dst_extents())
+      new_visited_blocks->AddExtent(extent);
+    aops->push_back(std::move(aop));
+    reused_ops++;
+  }
+  LOG(INFO) << "Reused " << reused_ops << " of "
+            << previous_part.operations_size()
+            << " operations of the previous payload for partition "
+            << new_part.name << ", " << changed_blocks.blocks()
+            << " blocks changed";
+  return true;
+}
+
+bool PreviousPayload::GetChangedBlocks(
+    const PartitionConfig& new_part,
+    const PartitionUpdate& previous_part,
+    const vector<FilesystemInterface::File>& new_files,
+    ExtentRanges* changed_blocks) const {
+  const uint64_t num_blocks = new_part.size / kBlockSize;
+  const auto target_it = previous_targets_.find(new_part.name);
+  if (target_it != previous_targets_.end()) {
+    if (!MatchesPartitionInfo(target_it->second,
+                              previous_part.new_partition_info())) {
+      LOG(ERROR) << "The previous payload doesn't update to "
+                 << target_it->second << " for partition " << new_part.name;
+      return false;
+    }
+    const auto previous_image = MappedFile::OpenShared(target_it->second);
+    const auto new_image = MappedFile::OpenShared(new_part.path);
+    TEST_AND_RETURN_FALSE(previous_image && new_image);
+    TEST_AND_RETURN_FALSE(previous_image->size() >= new_part.size &&
+                          new_image->size() >= new_part.size);
+    vector<Extent> extents;
+    for (uint64_t block = 0; block < num_blocks; block++) {
+      if (memcmp(previous_image->data() + block * kBlockSize,
+                 new_image->data() + block * kBlockSize,
+                 kBlockSize) != 0) {
+        AppendBlockToExtents(&extents, block);
+      }
+    }
+    changed_blocks->AddExtents(extents);
+    return true;
+  }
+
+  // Without the previous target, only the blocks of the files not listed are
+  // known not to have changed. Pseudo-files like the metadata aren't trusted.
+  const auto files_it = changed_files_.find(new_part.name);
+  const std::set<string> no_files;
+  const std::set<string>& changed_files =
+      files_it != changed_files_.end() ? files_it->second : no_files;
+  ExtentRanges unchanged_blocks;
+  ExtentRanges changed_file_blocks;
+  size_t found_files = 0;
+  for (const FilesystemInterface::File& file : new_files) {
+    if (changed_files.count(file.name) > 0) {
+      changed_file_blocks.AddExtents(file.extents);
+      found_files++;
+    } else if (!file.name.empty() && file.name[0] == '/') {
+      unchanged_blocks.AddExtents(file.extents);
+    }
+  }
+  if (found_files < changed_files.size()) {
+    LOG(WARNING) << "Only " << found_files << " of the " << changed_files.size()
+                 << " changed files were found in partition "
+                 << new_part.name;
+  }
+  // Blocks shared with a changed file changed too.
+  unchanged_blocks.SubtractRanges(changed_file_blocks);
+  changed_blocks->AddExtents(FilterExtentRanges(
+      {ExtentForRange(0, num_blocks)}, unchanged_blocks));
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PREVIOUS_PAYLOAD_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PREVIOUS_PAYLOAD_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/block_set.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/mapped_file.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A payload generated before from the same source images to a previous
+// version of the target images, whose operations are reused when a new
+// payload is generated after only a few files of the target changed. Only the
+// operations writing changed blocks are generated again.
+//
+// The changed blocks of a partition are found by comparing the new target
+// image with the previous one, when it's set with SetPreviousTarget().
+// When no previous target is set for any partition, they are the blocks of the
+// files listed with AddChangedFile() and all the blocks not in a file, so the
+// list must be complete.
+class PreviousPayload {
+ public:
+  PreviousPayload() = default;
+
+  // Maps the payload at |path| and parses its manifest and operations.
+  bool Load(const std::string& path);
+
+  uint32_t minor_version() const { return manifest_.minor_version(); }
+
+  // Sets the previous target image of |partition|, the one the payload
+  // updates to.
+  void SetPreviousTarget(const std::string& partition,
+                         const std::string& path);
+  // Adds the file |name| of |partition| to the files changed since the
+  // previous target.
+  void AddChangedFile(const std::string& partition, const std::string& name);
+
+  // Appends to |aops| the operations of the previous payload for |new_part|
+  // which write none of its changed blocks, with a copy of their data stored
+  // in |blob_file|, and adds the blocks they write to |new_visited_blocks|.
+  // |new_files| are the files of |new_part|. Nothing is reused if |old_part|
+  // isn't the source of the previous payload or |new_part| changed size.
+  // Blocks already in |new_visited_blocks| are considered changed.
+  bool ReuseOperations(const PartitionConfig& old_part,
+                       const PartitionConfig& new_part,
+                       const std::vector<FilesystemInterface::File>& new_files,
+                       const PayloadGenerationConfig& config,
+                       BlobFileWriter* blob_file,
+                       std::vector<AnnotatedOperation>* aops,
+                       BlockSet* new_visited_blocks) const;
+
+ private:
+  // Adds to |changed_blocks| the blocks of |new_part| which may differ from
+  // the previous target described by |previous_part|.
+  bool GetChangedBlocks(const PartitionConfig& new_part,
+                        const PartitionUpdate& previous_part,
+                        const std::vector<FilesystemInterface::File>& new_files,
+                        ExtentRanges* changed_blocks) const;
+
+  std::shared_ptr<const MappedFile> payload_;
+  // The offset of the data blobs in |payload_|.
+  uint64_t data_offset_{0};
+  DeltaArchiveManifest manifest_;
+  // The previous target image of each partition.
+  std::map<std::string, std::string> previous_targets_;
+  // The changed files of each partition without a previous target.
+  std::map<std::string, std::set<std::string>> changed_files_;
+
+  DISALLOW_COPY_AND_ASSIGN(PreviousPayload);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PREVIOUS_PAYLOAD_H_
@@ -0,0 +1,206 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/previous_payload.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/payload_file.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PreviousPayloadTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // The previous target replaces block 0, copies block 1 and replaces
+    // block 2 of the source.
+    old_data_ = string(kBlockSize, 'a') + string(kBlockSize, 'b') +
+                string(kBlockSize, 'c');
+    previous_data_ = string(kBlockSize, 'x') + string(kBlockSize, 'b') +
+                     string(kBlockSize, 'y');
+    ASSERT_TRUE(test_utils::WriteFileString(old_file_.path(), old_data_));
+    ASSERT_TRUE(
+        test_utils::WriteFileString(previous_file_.path(), previous_data_));
+
+    config_.version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                     kPartitionCopyMinorPayloadVersion);
+    config_.is_delta = true;
+    old_part_.path = old_file_.path();
+    old_part_.size = old_data_.size();
+    new_part_.path = new_file_.path();
+    new_part_.size = old_data_.size();
+
+    DeltaArchiveManifest manifest;
+    manifest.set_block_size(kBlockSize);
+    manifest.set_minor_version(kPartitionCopyMinorPayloadVersion);
+    PartitionUpdate* partition = manifest.add_partitions();
+    partition->set_partition_name("system");
+    SetPartitionInfo(old_data_, partition->mutable_old_partition_info());
+    SetPartitionInfo(previous_data_, partition->mutable_new_partition_info());
+    InstallOperation* op = partition->add_operations();
+    op->set_type(InstallOperation::REPLACE);
+    op->set_data_offset(0);
+    op->set_data_length(kBlockSize);
+    *op->add_dst_extents() = ExtentForRange(0, 1);
+    op = partition->add_operations();
+    op->set_type(InstallOperation::SOURCE_COPY);
+    *op->add_src_extents() = ExtentForRange(1, 1);
+    *op->add_dst_extents() = ExtentForRange(1, 1);
+    op = partition->add_operations();
+    op->set_type(InstallOperation::REPLACE);
+    op->set_data_offset(kBlockSize);
+    op->set_data_length(kBlockSize);
+    *op->add_dst_extents() = ExtentForRange(2, 1);
+
+    ScopedTempFile blobs("PreviousPayloadTest-blobs.XXXXXX");
+    ASSERT_TRUE(test_utils::WriteFileString(
+        blobs.path(), previous_data_.substr(0, kBlockSize) +
+                          previous_data_.substr(2 * kBlockSize)));
+    uint64_t metadata_size = 0;
+    ASSERT_TRUE(PayloadFile::WritePayload(payload_file_.path(),
+                                          blobs.path(),
+                                          "",
+                                          kBrilloMajorPayloadVersion,
+                                          manifest,
+                                          &metadata_size));
+  }
+
+  static void SetPartitionInfo(const string& data, PartitionInfo* info) {
+    brillo::Blob hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(
+        brillo::Blob(data.begin(), data.end()), &hash));
+    info->set_size(data.size());
+    info->set_hash(hash.data(), hash.size());
+  }
+
+  // Reuses the operations of |previous_payload| for the new partition with
+  // |new_data| and |new_files|.
+  bool Reuse(const PreviousPayload& previous_payload,
+             const string& new_data,
+             const vector<FilesystemInterface::File>& new_files,
+             vector<AnnotatedOperation>* aops,
+             BlockSet* new_visited_blocks) {
+    EXPECT_TRUE(test_utils::WriteFileString(new_file_.path(), new_data));
+    BlobFileWriter blob_file(blobs_file_.fd(), &blobs_size_);
+    return previous_payload.ReuseOperations(old_part_,
+                                            new_part_,
+                                            new_files,
+                                            config_,
+                                            &blob_file,
+                                            aops,
+                                            new_visited_blocks);
+  }
+
+  ScopedTempFile old_file_{"PreviousPayloadTest-old.XXXXXX"};
+  ScopedTempFile previous_file_{"PreviousPayloadTest-previous.XXXXXX"};
+  ScopedTempFile new_file_{"PreviousPayloadTest-new.XXXXXX"};
+  ScopedTempFile payload_file_{"PreviousPayloadTest-payload.XXXXXX"};
+  ScopedTempFile blobs_file_{"PreviousPayloadTest-out.XXXXXX", true};
+  off_t blobs_size_{0};
+  string old_data_;
+  string previous_data_;
+  PayloadGenerationConfig config_;
+  PartitionConfig old_part_{"system"};
+  PartitionConfig new_part_{"system"};
+};
+
+TEST_F(PreviousPayloadTest, PreviousTargetTest) {
+  PreviousPayload previous_payload;
+  ASSERT_TRUE(previous_payload.Load(payload_file_.path()));
+  EXPECT_EQ(kPartitionCopyMinorPayloadVersion,
+            previous_payload.minor_version());
+  previous_payload.SetPreviousTarget("system", previous_file_.path());
+
+  // Only the last block changed, the operations of the others are reused.
+  const string new_data = previous_data_.substr(0, 2 * kBlockSize) +
+                          string(kBlockSize, 'z');
+  vector<AnnotatedOperation> aops;
+  BlockSet new_visited_blocks;
+  ASSERT_TRUE(
+      Reuse(previous_payload, new_data, {}, &aops, &new_visited_blocks));
+  ASSERT_EQ(2U, aops.size());
+  EXPECT_EQ(InstallOperation::REPLACE, aops[0].op.type());
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, aops[1].op.type());
+  EXPECT_EQ(2U, new_visited_blocks.blocks());
+  EXPECT_FALSE(new_visited_blocks.ContainsBlock(2));
+
+  // The data of the operation was copied to the new blobs.
+  string blobs;
+  ASSERT_TRUE(utils::ReadFile(blobs_file_.path(), &blobs));
+  EXPECT_EQ(previous_data_.substr(0, kBlockSize),
+            blobs.substr(aops[0].op.data_offset(), aops[0].op.data_length()));
+}
+
+TEST_F(PreviousPayloadTest, ChangedFilesTest) {
+  PreviousPayload previous_payload;
+  ASSERT_TRUE(previous_payload.Load(payload_file_.path()));
+  previous_payload.AddChangedFile("system", "/foo");
+
+  // The blocks of /foo and of no file are generated again.
+  vector<FilesystemInterface::File> new_files(3);
+  new_files[0].name = "/foo";
+  new_files[0].extents = {ExtentForRange(0, 1)};
+  new_files[1].name = "/bar";
+  new_files[1].extents = {ExtentForRange(1, 1)};
+  new_files[2].name = "<inode-blocks>";
+  new_files[2].extents = {ExtentForRange(2, 1)};
+  vector<AnnotatedOperation> aops;
+  BlockSet new_visited_blocks;
+  ASSERT_TRUE(Reuse(
+      previous_payload, previous_data_, new_files, &aops, &new_visited_blocks));
+  ASSERT_EQ(1U, aops.size());
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, aops[0].op.type());
+  EXPECT_EQ(1U, new_visited_blocks.blocks());
+}
+
+TEST_F(PreviousPayloadTest, OtherSourceTest) {
+  // Nothing is reused from a payload for another source.
+  ASSERT_TRUE(test_utils::WriteFileString(old_file_.path(), previous_data_));
+  PreviousPayload previous_payload;
+  ASSERT_TRUE(previous_payload.Load(payload_file_.path()));
+  previous_payload.SetPreviousTarget("system", previous_file_.path());
+  vector<AnnotatedOperation> aops;
+  BlockSet new_visited_blocks;
+  ASSERT_TRUE(
+      Reuse(previous_payload, previous_data_, {}, &aops, &new_visited_blocks));
+  EXPECT_TRUE(aops.empty());
+
+  // Nor from a payload to another previous target.
+  ASSERT_TRUE(test_utils::WriteFileString(old_file_.path(), old_data_));
+  ASSERT_TRUE(test_utils::WriteFileString(previous_file_.path(), old_data_));
+  EXPECT_FALSE(
+      Reuse(previous_payload, previous_data_, {}, &aops, &new_visited_blocks));
+}
+
+TEST_F(PreviousPayloadTest, InvalidPayloadTest) {
+  ASSERT_TRUE(test_utils::WriteFileString(payload_file_.path(), "CrAU junk"));
+  PreviousPayload previous_payload;
+  EXPECT_FALSE(previous_payload.Load(payload_file_.path()));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,269 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/source_block_index.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Number of blocks hashed by each task while building the index.
+constexpr uint64_t kBlocksPerTask = 16384;
+
+// The fingerprint of the blocks with only zeros while building the index.
+// HashBlock() never returns it.
+constexpr uint64_t kZeroFingerprint = 0;
+
+// Whether the |size| bytes at |data| are all zeros.
+bool IsZeroBlock(const uint8_t* data, size_t size) {
+  return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+}  // namespace
+
+bool SourceBlockIndex::AddPartition(const string& name,
+                                    const string& path,
+                                    bool copy_source) {
+  auto image = MappedFile::OpenShared(path);
+  if (!image) {
+    LOG(ERROR) << "Unable to map source partition " << name << " at " << path;
+    return false;
+  }
+  // The block numbers are stored in 32 bits.
+  TEST_AND_RETURN_FALSE(image->size() / block_size_ <= UINT32_MAX);
+  partitions_.push_back({name, path, copy_source, std::move(image), {}});
+  return true;
+}
+
+bool SourceBlockIndex::Build(TaskScheduler* scheduler) {
+  // The fingerprints of all the blocks, hashed in parallel.
+  vector<vector<uint64_t>> fingerprints(partitions_.size());
+  {
+    std::unique_ptr<TaskScheduler::TaskGroup> tasks;
+    if (scheduler)
+      tasks = std::make_unique<TaskScheduler::TaskGroup>(scheduler, false);
+    for (size_t i = 0; i < partitions_.size(); i++) {
+      const uint64_t num_blocks = partitions_[i].image->size() / block_size_;
+      fingerprints[i].resize(num_blocks);
+      for (uint64_t first = 0; first < num_blocks; first += kBlocksPerTask) {
+        const uint64_t last = std::min(first + kBlocksPerTask, num_blocks);
+        auto task = [this, &fingerprints, i, first, last]() {
+          const uint8_t* data = partitions_[i].image->data();
+          for (uint64_t block = first; block < last; block++) {
+            const uint8_t* block_data = data + block * block_size_;
+            fingerprints[i][block] = IsZeroBlock(block_data, block_size_)
+                                         ? kZeroFingerprint
+                                         : HashBlock(block_data);
+          }
+        };
+        if (tasks) {
+          tasks->Submit(last - first, std::move(task));
+        } else {
+          task();
+        }
+      }
+    }
+    if (tasks)
+      tasks->Wait();
+  }
+
+  uint64_t num_blocks = 0;
+  for (const vector<uint64_t>& partition_fingerprints : fingerprints) {
+    num_blocks += std::count_if(partition_fingerprints.begin(),
+                                partition_fingerprints.end(),
+                                [](uint64_t fingerprint) {
+                                  return fingerprint != kZeroFingerprint;
+                                });
+  }
+  size_t table_size = 1;
+  while (table_size < 2 * num_blocks)
+    table_size *= 2;
+  table_.assign(table_size, {0, kNoPartition, 0});
+
+  // Inserted in order, so the first block of a partition with some data is
+  // the one indexed.
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    vector<Extent> zero_extents;
+    for (uint64_t block = 0; block < fingerprints[i].size(); block++) {
+      if (fingerprints[i][block] == kZeroFingerprint) {
+        AppendBlockToExtents(&zero_extents, block);
+      } else {
+        Insert({fingerprints[i][block],
+                static_cast<uint32_t>(i),
+                static_cast<uint32_t>(block)});
+      }
+    }
+    partitions_[i].zero_blocks = ExtentRanges();
+    partitions_[i].zero_blocks.AddExtents(zero_extents);
+  }
+  LOG(INFO) << "Indexed " << num_blocks << " source blocks of "
+            << partitions_.size() << " partitions in " << table_size
+            << " slots";
+  return true;
+}
+
+bool SourceBlockIndex::HasPartition(const string& name) const {
+  return std::any_of(
+      partitions_.begin(), partitions_.end(), [&name](const Partition& part) {
+        return part.name == name;
+      });
+}
+
+bool SourceBlockIndex::IsCopySource(const string& name) const {
+  return std::any_of(
+      partitions_.begin(), partitions_.end(), [&name](const Partition& part) {
+        return part.copy_source && part.name == name;
+      });
+}
+
+bool SourceBlockIndex::HasPartitionAt(const string& path) const {
+  return std::any_of(
+      partitions_.begin(), partitions_.end(), [&path](const Partition& part) {
+        return part.path == path;
+      });
+}
+
+bool SourceBlockIndex::FindBlock(const uint8_t* data,
+                                 const string& exclude_partition,
+                                 string* partition,
+                                 uint64_t* block) const {
+  if (table_.empty())
+    return false;
+  const uint64_t fingerprint = HashBlock(data);
+  const size_t mask = table_.size() - 1;
+  // Blocks with the same fingerprint are compared, so collisions can't match.
+  for (size_t i = fingerprint & mask; table_[i].partition != kNoPartition;
+       i = (i + 1) & mask) {
+    const Slot& slot = table_[i];
+    const Partition& part = partitions_[slot.partition];
+    if (slot.fingerprint != fingerprint || !part.copy_source ||
+        part.name == exclude_partition ||
+        memcmp(BlockData(slot), data, block_size_) != 0) {
+      continue;
+    }
+    *partition = part.name;
+    *block = slot.block;
+    return true;
+  }
+  return false;
+}
+
+bool SourceBlockIndex::MapPartitionBlocks(
+    const string& old_part,
+    const string& new_part,
+    size_t old_size,
+    size_t new_size,
+    vector<BlockMapping::BlockId>* old_block_ids,
+    vector<BlockMapping::BlockId>* new_block_ids) const {
+  auto it = std::find_if(
+      partitions_.begin(), partitions_.end(), [&old_part](const Partition& p) {
+        return p.path == old_part;
+      });
+  TEST_AND_RETURN_FALSE(it != partitions_.end());
+  const Partition& old_partition = *it;
+  TEST_AND_RETURN_FALSE(old_partition.image->size() >= old_size);
+  const auto new_image = MappedFile::OpenShared(new_part);
+  TEST_AND_RETURN_FALSE(new_image);
+  TEST_AND_RETURN_FALSE(new_image->size() >= new_size);
+
+  // Old blocks are their own id, plus one as 0 is the id of zeros.
+  const uint64_t old_num_blocks = old_size / block_size_;
+  old_block_ids->resize(old_num_blocks);
+  for (uint64_t block = 0; block < old_num_blocks; block++) {
+    (*old_block_ids)[block] =
+        old_partition.zero_blocks.ContainsBlock(block) ? 0 : block + 1;
+  }
+  // New blocks not in the old partition get ids after those.
+  const uint32_t partition = it - partitions_.begin();
+  const uint64_t new_num_blocks = new_size / block_size_;
+  new_block_ids->resize(new_num_blocks);
+  for (uint64_t block = 0; block < new_num_blocks; block++) {
+    const uint8_t* data = new_image->data() + block * block_size_;
+    uint64_t old_block = 0;
+    if (IsZeroBlock(data, block_size_)) {
+      (*new_block_ids)[block] = 0;
+    } else if (FindPartitionBlock(
+                   data, HashBlock(data), partition, &old_block) &&
+               old_block < old_num_blocks) {
+      (*new_block_ids)[block] = old_block + 1;
+    } else {
+      (*new_block_ids)[block] = old_num_blocks + 1 + block;
+    }
+  }
+  return true;
+}
+
+uint64_t SourceBlockIndex::HashBlock(const uint8_t* data) const {
+  const uint64_t hash = std::hash<std::string_view>{}(
+      std::string_view(reinterpret_cast<const char*>(data), block_size_));
+  return hash == kZeroFingerprint ? 1 : hash;
+}
+
+const uint8_t* SourceBlockIndex::BlockData(const Slot& slot) const {
+  return partitions_[slot.partition].image->data() +
+         static_cast<uint64_t>(slot.block) * block_size_;
+}
+
+void SourceBlockIndex::Insert(const Slot& slot) {
+  const size_t mask = table_.size() - 1;
+  for (size_t i = slot.fingerprint & mask;; i = (i + 1) & mask) {
+    Slot& entry = table_[i];
+    if (entry.partition == kNoPartition) {
+      entry = slot;
+      return;
+    }
+    if (entry.fingerprint == slot.fingerprint &&
+        entry.partition == slot.partition &&
+        memcmp(BlockData(entry), BlockData(slot), block_size_) == 0) {
+      return;
+    }
+  }
+}
+
+bool SourceBlockIndex::FindPartitionBlock(const uint8_t* data,
+                                          uint64_t fingerprint,
+                                          uint32_t partition,
+                                          uint64_t* block) const {
+  if (table_.empty())
+    return false;
+  const size_t mask = table_.size() - 1;
+  for (size_t i = fingerprint & mask; table_[i].partition != kNoPartition;
+       i = (i + 1) & mask) {
+    const Slot& slot = table_[i];
+    if (slot.fingerprint == fingerprint && slot.partition == partition &&
+        memcmp(BlockData(slot), data, block_size_) == 0) {
+      *block = slot.block;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace chromeos_update_engine
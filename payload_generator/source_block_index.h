@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_SOURCE_BLOCK_INDEX_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_SOURCE_BLOCK_INDEX_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/payload_generator/block_mapping.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/mapped_file.h"
+#include "update_engine/payload_generator/task_scheduler.h"
+
+namespace chromeos_update_engine {
+
+// An index of the blocks of all the source partitions of a payload by their
+// data. It finds where the blocks of a target partition were in the old
+// version of the partition, like the blocks moved within it, or in the other
+// partitions, like the blocks of files moved between partitions. The images
+// stay mapped while the index exists.
+//
+// The blocks are indexed once for all partitions, in an open addressing hash
+// table of their 64-bit fingerprints. Blocks of a partition with the same data
+// are indexed once, and blocks with only zeros not at all.
+class SourceBlockIndex {
+ public:
+  explicit SourceBlockIndex(size_t block_size) : block_size_(block_size) {}
+
+  // Adds the partition |name| stored at |path| to be indexed by Build(). With
+  // |copy_source|, its blocks are found by FindBlock(). Returns whether the
+  // image could be mapped.
+  bool AddPartition(const std::string& name,
+                    const std::string& path,
+                    bool copy_source);
+
+  // Indexes the blocks of the partitions added, reading them on the threads
+  // of |scheduler|, or on this one if null.
+  bool Build(TaskScheduler* scheduler);
+
+  // Whether the partition |name| was indexed.
+  bool HasPartition(const std::string& name) const;
+  // Whether the partition |name| was indexed as a copy source.
+  bool IsCopySource(const std::string& name) const;
+  // Whether the partition stored at |path| was indexed.
+  bool HasPartitionAt(const std::string& path) const;
+
+  // Finds a block with the |block_size| bytes at |data| in a copy source
+  // partition other than |exclude_partition|. Stores in |partition| the name
+  // of that partition and in |block| its block number. Returns whether one was
+  // found.
+  bool FindBlock(const uint8_t* data,
+                 const std::string& exclude_partition,
+                 std::string* partition,
+                 uint64_t* block) const;
+
+  // Same as the MapPartitionBlocks() function for the indexed partition at
+  // |old_part|, without reading it again. Only the blocks of |new_part| get
+  // the id of an old block with the same data, the first one, while the ids
+  // of old blocks with the same data differ.
+  bool MapPartitionBlocks(
+      const std::string& old_part,
+      const std::string& new_part,
+      size_t old_size,
+      size_t new_size,
+      std::vector<BlockMapping::BlockId>* old_block_ids,
+      std::vector<BlockMapping::BlockId>* new_block_ids) const;
+
+ private:
+  struct Partition {
+    std::string name;
+    std::string path;
+    bool copy_source;
+    std::shared_ptr<const MappedFile> image;
+    // The blocks with only zeros, which aren't in the table.
+    ExtentRanges zero_blocks;
+  };
+
+  // An entry of the table, empty if |partition| is kNoPartition.
+  struct Slot {
+    uint64_t fingerprint;
+    uint32_t partition;
+    uint32_t block;
+  };
+  static constexpr uint32_t kNoPartition = UINT32_MAX;
+
+  uint64_t HashBlock(const uint8_t* data) const;
+  const uint8_t* BlockData(const Slot& slot) const;
+  // Adds |slot| to |table_| unless the same data is there for its partition.
+  void Insert(const Slot& slot);
+  // Finds the block of |partition| with the data at |data|, whose fingerprint
+  // is |fingerprint|.
+  bool FindPartitionBlock(const uint8_t* data,
+                          uint64_t fingerprint,
+                          uint32_t partition,
+                          uint64_t* block) const;
+
+  size_t block_size_;
+  std::vector<Partition> partitions_;
+  // The blocks of all |partitions_| by fingerprint, probed linearly from the
+  // slot of its lowest bits. The size is a power of two at least twice the
+  // number of blocks.
+  std::vector<Slot> table_;
+
+  DISALLOW_COPY_AND_ASSIGN(SourceBlockIndex);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_SOURCE_BLOCK_INDEX_H_
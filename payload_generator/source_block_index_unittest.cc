@@ -0,0 +1,179 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/source_block_index.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class SourceBlockIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Blocks of letters, the last block of each partition is zeros.
+    system_.assign(4 * block_size_, '\0');
+    vendor_.assign(4 * block_size_, '\0');
+    for (size_t i = 0; i < 3 * block_size_; i++) {
+      system_[i] = 'a' + i / block_size_;
+      vendor_[i] = 'x' - i / block_size_;
+    }
+    ASSERT_TRUE(test_utils::WriteFileString(system_file_.path(), system_));
+    ASSERT_TRUE(test_utils::WriteFileString(vendor_file_.path(), vendor_));
+  }
+
+  // The block |block| of |data|.
+  const uint8_t* Block(const string& data, size_t block) const {
+    return reinterpret_cast<const uint8_t*>(data.data()) + block * block_size_;
+  }
+
+  ScopedTempFile system_file_{"SourceBlockIndexTest-system.XXXXXX"};
+  ScopedTempFile vendor_file_{"SourceBlockIndexTest-vendor.XXXXXX"};
+  size_t block_size_{1024};
+  string system_;
+  string vendor_;
+};
+
+TEST_F(SourceBlockIndexTest, FindBlockTest) {
+  SourceBlockIndex index(block_size_);
+  ASSERT_TRUE(index.AddPartition("system", system_file_.path(), true));
+  ASSERT_TRUE(index.AddPartition("vendor", vendor_file_.path(), true));
+  ASSERT_TRUE(index.Build(nullptr));
+  EXPECT_TRUE(index.HasPartition("system"));
+  EXPECT_TRUE(index.HasPartition("vendor"));
+  EXPECT_FALSE(index.HasPartition("product"));
+
+  string partition;
+  uint64_t block = 0;
+  ASSERT_TRUE(
+      index.FindBlock(Block(system_, 2), "product", &partition, &block));
+  EXPECT_EQ("system", partition);
+  EXPECT_EQ(2U, block);
+  ASSERT_TRUE(index.FindBlock(Block(vendor_, 1), "system", &partition, &block));
+  EXPECT_EQ("vendor", partition);
+  EXPECT_EQ(1U, block);
+
+  // The partition looking for its blocks is excluded.
+  EXPECT_FALSE(
+      index.FindBlock(Block(system_, 0), "system", &partition, &block));
+
+  // Neither zeros nor other data are found.
+  EXPECT_FALSE(
+      index.FindBlock(Block(system_, 3), "product", &partition, &block));
+  string other(block_size_, 'a');
+  other.back() = 'b';
+  EXPECT_FALSE(index.FindBlock(Block(other, 0), "product", &partition, &block));
+}
+
+TEST_F(SourceBlockIndexTest, DuplicateBlocksTest) {
+  // A block of system is also in vendor, it's found in either partition.
+  vendor_.replace(0, block_size_, system_, 0, block_size_);
+  ASSERT_TRUE(test_utils::WriteFileString(vendor_file_.path(), vendor_));
+  SourceBlockIndex index(block_size_);
+  ASSERT_TRUE(index.AddPartition("system", system_file_.path(), true));
+  ASSERT_TRUE(index.AddPartition("vendor", vendor_file_.path(), true));
+  ASSERT_TRUE(index.Build(nullptr));
+
+  string partition;
+  uint64_t block = 0;
+  ASSERT_TRUE(index.FindBlock(Block(system_, 0), "system", &partition, &block));
+  EXPECT_EQ("vendor", partition);
+  EXPECT_EQ(0U, block);
+  ASSERT_TRUE(index.FindBlock(Block(system_, 0), "vendor", &partition, &block));
+  EXPECT_EQ("system", partition);
+  EXPECT_EQ(0U, block);
+}
+
+TEST_F(SourceBlockIndexTest, CopySourceTest) {
+  // Only the blocks of copy sources are found in other partitions.
+  SourceBlockIndex index(block_size_);
+  ASSERT_TRUE(index.AddPartition("system", system_file_.path(), false));
+  ASSERT_TRUE(index.AddPartition("vendor", vendor_file_.path(), true));
+  ASSERT_TRUE(index.Build(nullptr));
+  EXPECT_TRUE(index.HasPartition("system"));
+  EXPECT_FALSE(index.IsCopySource("system"));
+  EXPECT_TRUE(index.IsCopySource("vendor"));
+  EXPECT_TRUE(index.HasPartitionAt(system_file_.path()));
+
+  string partition;
+  uint64_t block = 0;
+  EXPECT_FALSE(
+      index.FindBlock(Block(system_, 0), "vendor", &partition, &block));
+  EXPECT_TRUE(index.FindBlock(Block(vendor_, 0), "system", &partition, &block));
+}
+
+TEST_F(SourceBlockIndexTest, MapPartitionBlocksTest) {
+  // The system blocks are duplicated and moved in the new version, which has
+  // a new block and zeros.
+  system_.replace(block_size_, block_size_, system_, 0, block_size_);
+  ASSERT_TRUE(test_utils::WriteFileString(system_file_.path(), system_));
+  string new_system = system_.substr(2 * block_size_, block_size_) +
+                      system_.substr(0, block_size_) +
+                      string(block_size_, 'n') + string(block_size_, '\0');
+  ScopedTempFile new_file("SourceBlockIndexTest-new.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileString(new_file.path(), new_system));
+
+  SourceBlockIndex index(block_size_);
+  ASSERT_TRUE(index.AddPartition("system", system_file_.path(), false));
+  ASSERT_TRUE(index.AddPartition("vendor", vendor_file_.path(), false));
+  ASSERT_TRUE(index.Build(nullptr));
+  vector<BlockMapping::BlockId> old_ids;
+  vector<BlockMapping::BlockId> new_ids;
+  ASSERT_TRUE(index.MapPartitionBlocks(system_file_.path(),
+                                       new_file.path(),
+                                       system_.size(),
+                                       new_system.size(),
+                                       &old_ids,
+                                       &new_ids));
+  EXPECT_EQ((vector<BlockMapping::BlockId>{1, 2, 3, 0}), old_ids);
+  ASSERT_EQ(4U, new_ids.size());
+  EXPECT_EQ(3, new_ids[0]);
+  EXPECT_EQ(1, new_ids[1]);
+  EXPECT_EQ(0, new_ids[3]);
+  EXPECT_EQ(old_ids.end(),
+            std::find(old_ids.begin(), old_ids.end(), new_ids[2]));
+
+  // Partitions not indexed, or shorter than |old_size|, can't be mapped.
+  EXPECT_FALSE(index.MapPartitionBlocks(new_file.path(),
+                                        new_file.path(),
+                                        new_system.size(),
+                                        new_system.size(),
+                                        &old_ids,
+                                        &new_ids));
+  EXPECT_FALSE(index.MapPartitionBlocks(system_file_.path(),
+                                        new_file.path(),
+                                        2 * system_.size(),
+                                        new_system.size(),
+                                        &old_ids,
+                                        &new_ids));
+}
+
+TEST_F(SourceBlockIndexTest, MissingPartitionTest) {
+  SourceBlockIndex index(block_size_);
+  EXPECT_FALSE(index.AddPartition("system", "/path/to/nowhere", true));
+  EXPECT_FALSE(index.HasPartition("system"));
+}
+
+}  // namespace chromeos_update_engine
@@ -91,20 +91,9 @@ bool GetFileMapContent(const string& sqfs_path, string* map) {
 
 }  // namespace
 
-bool SquashfsFilesystem::Init(const string& map,
-                              const string& sqfs_path,
-                              size_t size,
-                              const SquashfsHeader& header,
-                              bool extract_deflates) {
-  size_ = size;
-
-  bool is_zlib = header.compression_type == kSquashfsZlibCompression;
-  if (!is_zlib) {
-    LOG(WARNING) << "Filesystem is not Gzipped. Not filling deflates!";
-  }
-  vector<puffin::ByteExtent> zlib_blks;
-
-  // Reading files map. For the format of the file map look at the comments for
+bool SquashfsFilesystem::ParseFileMap(const string& map,
+                                      vector<SquashfsFileMapEntry>* entries) {
+  // For the format of the file map look at the comments for
   // |CreateFromFileMap()|.
   auto lines = base::SplitStringPiece(map,
                                       "\n",
@@ -118,13 +107,37 @@ bool SquashfsFilesystem::Init(const string& map,
                                base::SplitResult::SPLIT_WANT_NONEMPTY);
     // Only filename is invalid.
     TEST_AND_RETURN_FALSE(splits.size() > 1);
-    uint64_t start;
-    TEST_AND_RETURN_FALSE(base::StringToUint64(splits[1], &start));
+    SquashfsFileMapEntry entry;
+    entry.name = splits[0].as_string();
+    TEST_AND_RETURN_FALSE(base::StringToUint64(splits[1], &entry.start));
+    for (size_t i = 2; i < splits.size(); ++i) {
+      unsigned blk_size;
+      TEST_AND_RETURN_FALSE(base::StringToUint(splits[i], &blk_size));
+      entry.block_sizes.push_back(blk_size);
+    }
+    entries->push_back(std::move(entry));
+  }
+  return true;
+}
+
+bool SquashfsFilesystem::Init(const vector<SquashfsFileMapEntry>& entries,
+                              const string& sqfs_path,
+                              size_t size,
+                              const SquashfsHeader& header,
+                              bool extract_deflates) {
+  size_ = size;
+
+  bool is_zlib = header.compression_type == kSquashfsZlibCompression;
+  if (!is_zlib) {
+    LOG(WARNING) << "Filesystem is not Gzipped. Not filling deflates!";
+  }
+  vector<puffin::ByteExtent> zlib_blks;
+
+  for (const auto& entry : entries) {
+    uint64_t start = entry.start;
     uint64_t cur_offset = start;
     bool is_compressed = false;
-    for (size_t i = 2; i < splits.size(); ++i) {
-      uint64_t blk_size;
-      TEST_AND_RETURN_FALSE(base::StringToUint64(splits[i], &blk_size));
+    for (uint64_t blk_size : entry.block_sizes) {
       // TODO(ahassani): For puffin push it into a proper list if uncompressed.
       auto new_blk_size = blk_size & ~kSquashfsCompressedBit;
       TEST_AND_RETURN_FALSE(new_blk_size <= header.block_size);
@@ -141,7 +154,7 @@ bool SquashfsFilesystem::Init(const string& map,
     // If size is zero do not add the file.
     if (cur_offset - start > 0) {
       File file;
-      file.name = splits[0].as_string();
+      file.name = entry.name;
       file.extents = {ExtentForBytes(kBlockSize, start, cur_offset - start)};
       file.is_compressed = is_compressed;
       files_.emplace_back(file);
@@ -277,16 +290,24 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFile(
     return nullptr;
   }
 
-  // Read the map file.
-  string filemap;
-  if (!GetFileMapContent(sqfs_path, &filemap)) {
-    LOG(ERROR) << "Failed to produce squashfs map file: " << sqfs_path;
-    return nullptr;
+  // Read the file map from the image tables, or with unsquashfs for the
+  // images the reader doesn't support.
+  vector<SquashfsFileMapEntry> entries;
+  if (!ReadSquashfsFileMap(sqfs_path, &entries)) {
+    LOG(INFO) << "Falling back to unsquashfs to read the file map of "
+              << sqfs_path;
+    entries.clear();
+    string filemap;
+    if (!GetFileMapContent(sqfs_path, &filemap) ||
+        !ParseFileMap(filemap, &entries)) {
+      LOG(ERROR) << "Failed to produce squashfs map file: " << sqfs_path;
+      return nullptr;
+    }
   }
 
   unique_ptr<SquashfsFilesystem> sqfs(new SquashfsFilesystem());
   if (!sqfs->Init(
-          filemap, sqfs_path, sqfs_file->GetSize(), header, extract_deflates)) {
+          entries, sqfs_path, sqfs_file->GetSize(), header, extract_deflates)) {
     LOG(ERROR) << "Failed to initialized the Squashfs file system";
     return nullptr;
   }
@@ -301,8 +322,14 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFileMap(
     return nullptr;
   }
 
+  vector<SquashfsFileMapEntry> entries;
+  if (!ParseFileMap(filemap, &entries)) {
+    LOG(ERROR) << "Failed to parse the squashfs file map";
+    return nullptr;
+  }
+
   unique_ptr<SquashfsFilesystem> sqfs(new SquashfsFilesystem());
-  if (!sqfs->Init(filemap, "", size, header, false)) {
+  if (!sqfs->Init(entries, "", size, header, false)) {
     LOG(ERROR) << "Failed to initialize the Squashfs file system using filemap";
     return nullptr;
   }
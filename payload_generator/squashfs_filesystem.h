@@ -31,6 +31,7 @@
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/squashfs_reader.h"
 
 namespace chromeos_update_engine {
 
@@ -95,8 +96,12 @@ class SquashfsFilesystem : public FilesystemInterface {
  private:
   SquashfsFilesystem() = default;
 
+  // Parses the text file map described in CreateFromFileMap().
+  static bool ParseFileMap(const std::string& map,
+                           std::vector<SquashfsFileMapEntry>* entries);
+
   // Initialize and populates the files in the file system.
-  bool Init(const std::string& map,
+  bool Init(const std::vector<SquashfsFileMapEntry>& entries,
             const std::string& sqfs_path,
             size_t size,
             const SquashfsHeader& header,
@@ -0,0 +1,598 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// This reader follows the squashfs 4.0 on-disk format as described in
+// fs/squashfs/squashfs_fs.h of the kernel tree, little-endian only.
+
+#include "update_engine/payload_generator/squashfs_reader.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+#include <lz4.h>
+#include <lzma.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/task_scheduler.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kSquashfsMagic = 0x73717368;
+constexpr size_t kSuperBlockSize = 96;
+// The offset in the super block of a table that isn't in the image.
+constexpr uint64_t kInvalidTable = ~0ULL;
+
+// Metadata blocks are preceded by a 16 bit header with their stored size and
+// this bit set if they're stored uncompressed.
+constexpr uint16_t kMetadataUncompressedBit = 1 << 15;
+constexpr size_t kMetadataBlockSize = 8192;
+// Metadata blocks decompressed by every task.
+constexpr size_t kMetadataBlocksPerTask = 128;
+
+constexpr size_t kInodeHeaderSize = 16;
+constexpr size_t kDirectoryHeaderSize = 12;
+constexpr size_t kDirectoryEntryHeaderSize = 8;
+// The fragment index of a file whose tail isn't packed in a fragment.
+constexpr uint32_t kNoFragment = ~0U;
+// Guards against loops in corrupted directory trees.
+constexpr size_t kMaxDirectoryDepth = 256;
+
+enum Compression : uint16_t {
+  kZlibCompression = 1,
+  kXzCompression = 4,
+  kLz4Compression = 5,
+  kZstdCompression = 6,
+};
+
+enum InodeType : uint16_t {
+  kDirectoryInode = 1,
+  kRegularInode = 2,
+  kLongDirectoryInode = 8,
+  kLongRegularInode = 9,
+};
+
+template <typename T>
+T ReadLE(const uint8_t* data) {
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+struct SuperBlock {
+  uint32_t block_size;
+  uint32_t fragment_count;
+  uint16_t compression_type;
+  uint64_t root_inode;
+  uint64_t bytes_used;
+  uint64_t id_table_start;
+  uint64_t xattr_id_table_start;
+  uint64_t inode_table_start;
+  uint64_t directory_table_start;
+  uint64_t fragment_table_start;
+  uint64_t export_table_start;
+};
+
+bool ParseSuperBlock(const brillo::Blob& blob, SuperBlock* super_block) {
+  TEST_AND_RETURN_FALSE(blob.size() >= kSuperBlockSize);
+  TEST_AND_RETURN_FALSE(ReadLE<uint32_t>(blob.data()) == kSquashfsMagic);
+  TEST_AND_RETURN_FALSE(ReadLE<uint16_t>(blob.data() + 28) == 4);
+  super_block->block_size = ReadLE<uint32_t>(blob.data() + 12);
+  super_block->fragment_count = ReadLE<uint32_t>(blob.data() + 16);
+  super_block->compression_type = ReadLE<uint16_t>(blob.data() + 20);
+  super_block->root_inode = ReadLE<uint64_t>(blob.data() + 32);
+  super_block->bytes_used = ReadLE<uint64_t>(blob.data() + 40);
+  super_block->id_table_start = ReadLE<uint64_t>(blob.data() + 48);
+  super_block->xattr_id_table_start = ReadLE<uint64_t>(blob.data() + 56);
+  super_block->inode_table_start = ReadLE<uint64_t>(blob.data() + 64);
+  super_block->directory_table_start = ReadLE<uint64_t>(blob.data() + 72);
+  super_block->fragment_table_start = ReadLE<uint64_t>(blob.data() + 80);
+  super_block->export_table_start = ReadLE<uint64_t>(blob.data() + 88);
+  TEST_AND_RETURN_FALSE(super_block->block_size > 0);
+  return true;
+}
+
+bool IsSupportedCompression(uint16_t compression_type) {
+  return compression_type == kZlibCompression ||
+         compression_type == kXzCompression ||
+         compression_type == kLz4Compression ||
+         compression_type == kZstdCompression;
+}
+
+// Decompresses the |in_size| bytes of |in| into |out|, which has room for
+// |*out_size| bytes, and sets |*out_size| to the decompressed size.
+bool Decompress(uint16_t compression_type,
+                const uint8_t* in,
+                size_t in_size,
+                uint8_t* out,
+                size_t* out_size) {
+  switch (compression_type) {
+    case kZlibCompression: {
+      uLongf size = *out_size;
+      TEST_AND_RETURN_FALSE(uncompress(out, &size, in, in_size) == Z_OK);
+      *out_size = size;
+      return true;
+    }
+    case kXzCompression: {
+      uint64_t memlimit = UINT64_MAX;
+      size_t in_pos = 0, out_pos = 0;
+      TEST_AND_RETURN_FALSE(lzma_stream_buffer_decode(&memlimit,
+                                                      0,
+                                                      nullptr,
+                                                      in,
+                                                      &in_pos,
+                                                      in_size,
+                                                      out,
+                                                      &out_pos,
+                                                      *out_size) == LZMA_OK);
+      *out_size = out_pos;
+      return true;
+    }
+    case kLz4Compression: {
+      int size = LZ4_decompress_safe(reinterpret_cast<const char*>(in),
+                                     reinterpret_cast<char*>(out),
+                                     in_size,
+                                     *out_size);
+      TEST_AND_RETURN_FALSE(size >= 0);
+      *out_size = size;
+      return true;
+    }
+    case kZstdCompression: {
+      size_t size = ZSTD_decompress(out, *out_size, in, in_size);
+      TEST_AND_RETURN_FALSE(!ZSTD_isError(size));
+      *out_size = size;
+      return true;
+    }
+  }
+  return false;
+}
+
+// A metadata table of the image, decompressed as a whole. All metadata blocks
+// but the last decompress to 8 KiB, so structures crossing the boundary
+// between two blocks are contiguous in the decompressed table.
+class MetadataTable {
+ public:
+  MetadataTable() = default;
+
+  // Decompresses the metadata blocks of the table stored in the |size| bytes
+  // of |data| on |scheduler|.
+  bool Init(const uint8_t* data,
+            size_t size,
+            uint16_t compression_type,
+            TaskScheduler* scheduler) {
+    for (size_t offset = 0; offset < size;) {
+      TEST_AND_RETURN_FALSE(size - offset >= sizeof(uint16_t));
+      const size_t length = ReadLE<uint16_t>(data + offset) &
+                            ~kMetadataUncompressedBit;
+      TEST_AND_RETURN_FALSE(length > 0 && length <= kMetadataBlockSize);
+      TEST_AND_RETURN_FALSE(size - offset - sizeof(uint16_t) >= length);
+      block_offsets_.push_back(offset);
+      offset += sizeof(uint16_t) + length;
+    }
+    const size_t num_blocks = block_offsets_.size();
+    data_.resize(num_blocks * kMetadataBlockSize);
+    vector<size_t> sizes(num_blocks, kMetadataBlockSize);
+
+    std::atomic<bool> failed{false};
+    TaskScheduler::TaskGroup group(scheduler, false);
+    for (size_t first = 0; first < num_blocks;
+         first += kMetadataBlocksPerTask) {
+      const size_t last =
+          std::min(num_blocks, first + kMetadataBlocksPerTask);
+      group.Submit(last - first, [&, first, last]() {
+        for (size_t i = first; i < last && !failed; i++) {
+          const uint8_t* block = data + block_offsets_[i];
+          const uint16_t header = ReadLE<uint16_t>(block);
+          const size_t length = header & ~kMetadataUncompressedBit;
+          uint8_t* out = data_.data() + i * kMetadataBlockSize;
+          if (header & kMetadataUncompressedBit) {
+            memcpy(out, block + sizeof(header), length);
+            sizes[i] = length;
+          } else if (!Decompress(compression_type,
+                                 block + sizeof(header),
+                                 length,
+                                 out,
+                                 &sizes[i])) {
+            LOG(ERROR) << "Failed to decompress the metadata block at "
+                       << block_offsets_[i];
+            failed = true;
+          }
+        }
+      });
+    }
+    group.Wait();
+    TEST_AND_RETURN_FALSE(!failed);
+
+    for (size_t i = 0; i + 1 < num_blocks; i++) {
+      TEST_AND_RETURN_FALSE(sizes[i] == kMetadataBlockSize);
+    }
+    if (num_blocks > 0) {
+      data_.resize((num_blocks - 1) * kMetadataBlockSize + sizes.back());
+    }
+    return true;
+  }
+
+  // Returns the |size| bytes at |offset| in the decompressed metadata block
+  // stored |block| bytes after the start of the table, or nullptr if they
+  // aren't all in the table.
+  const uint8_t* Get(uint64_t block, size_t offset, size_t size) const {
+    auto it =
+        std::lower_bound(block_offsets_.begin(), block_offsets_.end(), block);
+    if (it == block_offsets_.end() || *it != block) {
+      return nullptr;
+    }
+    const size_t pos = (it - block_offsets_.begin()) * kMetadataBlockSize;
+    if (offset > data_.size() - pos || data_.size() - pos - offset < size) {
+      return nullptr;
+    }
+    return data_.data() + pos + offset;
+  }
+
+ private:
+  // The offset of every metadata block from the start of the table.
+  vector<uint64_t> block_offsets_;
+  brillo::Blob data_;
+
+  DISALLOW_COPY_AND_ASSIGN(MetadataTable);
+};
+
+struct Image {
+  uint32_t block_size;
+  MetadataTable inodes;
+  MetadataTable directories;
+};
+
+// The parts of the directory and regular file inodes the file map needs.
+struct Inode {
+  uint16_t type;
+
+  // The listing of a directory in the directory table, not counting "." and
+  // "..", which aren't stored.
+  uint64_t listing_block;
+  size_t listing_offset;
+  size_t listing_size;
+
+  // The data blocks of a regular file. |block_sizes| points into the inode
+  // table.
+  uint64_t start;
+  const uint8_t* block_sizes;
+  size_t block_count;
+
+  bool IsDirectory() const {
+    return type == kDirectoryInode || type == kLongDirectoryInode;
+  }
+  bool IsRegular() const {
+    return type == kRegularInode || type == kLongRegularInode;
+  }
+};
+
+// Reads the inode stored at |offset| in the decompressed metadata block |block|
+// of the inode table. Inodes of other types only get their |type| set.
+bool ReadInode(const Image& image,
+               uint64_t block,
+               size_t offset,
+               Inode* inode) {
+  const uint8_t* data = image.inodes.Get(block, offset, kInodeHeaderSize);
+  TEST_AND_RETURN_FALSE(data);
+  inode->type = ReadLE<uint16_t>(data);
+
+  uint64_t file_size;
+  uint32_t fragment;
+  size_t inode_size;
+  switch (inode->type) {
+    case kDirectoryInode: {
+      data = image.inodes.Get(block, offset, 32);
+      TEST_AND_RETURN_FALSE(data);
+      inode->listing_block = ReadLE<uint32_t>(data + 16);
+      file_size = ReadLE<uint16_t>(data + 24);
+      inode->listing_offset = ReadLE<uint16_t>(data + 26);
+      inode->listing_size = file_size > 3 ? file_size - 3 : 0;
+      return true;
+    }
+    case kLongDirectoryInode: {
+      data = image.inodes.Get(block, offset, 40);
+      TEST_AND_RETURN_FALSE(data);
+      file_size = ReadLE<uint32_t>(data + 20);
+      inode->listing_block = ReadLE<uint32_t>(data + 24);
+      inode->listing_offset = ReadLE<uint16_t>(data + 34);
+      inode->listing_size = file_size > 3 ? file_size - 3 : 0;
+      return true;
+    }
+    case kRegularInode: {
+      inode_size = 32;
+      data = image.inodes.Get(block, offset, inode_size);
+      TEST_AND_RETURN_FALSE(data);
+      inode->start = ReadLE<uint32_t>(data + 16);
+      fragment = ReadLE<uint32_t>(data + 20);
+      file_size = ReadLE<uint32_t>(data + 28);
+      break;
+    }
+    case kLongRegularInode: {
+      inode_size = 56;
+      data = image.inodes.Get(block, offset, inode_size);
+      TEST_AND_RETURN_FALSE(data);
+      inode->start = ReadLE<uint64_t>(data + 16);
+      file_size = ReadLE<uint64_t>(data + 24);
+      fragment = ReadLE<uint32_t>(data + 44);
+      break;
+    }
+    default:
+      return true;
+  }
+
+  // The tail of the file has no block of its own if it's in a fragment.
+  inode->block_count = file_size / image.block_size;
+  if (fragment == kNoFragment && file_size % image.block_size != 0) {
+    inode->block_count++;
+  }
+  TEST_AND_RETURN_FALSE(inode->block_count <= SIZE_MAX / sizeof(uint32_t));
+  inode->block_sizes = image.inodes.Get(
+      block, offset + inode_size, inode->block_count * sizeof(uint32_t));
+  TEST_AND_RETURN_FALSE(inode->block_sizes);
+  return true;
+}
+
+// Lists the directory |dir| whose path in the image is |path|, empty for the
+// root. Adds its regular files to |files| and its subdirectories to |subdirs|.
+bool ListDirectory(const Image& image,
+                   const Inode& dir,
+                   const string& path,
+                   vector<SquashfsFileMapEntry>* files,
+                   vector<std::pair<string, Inode>>* subdirs) {
+  const size_t size = dir.listing_size;
+  if (size == 0) {
+    return true;
+  }
+  const uint8_t* data =
+      image.directories.Get(dir.listing_block, dir.listing_offset, size);
+  TEST_AND_RETURN_FALSE(data);
+
+  // The listing is a sequence of headers, each followed by the entries whose
+  // inodes are in the same metadata block.
+  for (size_t pos = 0; pos < size;) {
+    TEST_AND_RETURN_FALSE(size - pos >= kDirectoryHeaderSize);
+    const uint64_t count = ReadLE<uint32_t>(data + pos) + 1ULL;
+    const uint64_t inode_block = ReadLE<uint32_t>(data + pos + 4);
+    pos += kDirectoryHeaderSize;
+    for (uint64_t i = 0; i < count; i++) {
+      TEST_AND_RETURN_FALSE(size - pos >= kDirectoryEntryHeaderSize);
+      const size_t inode_offset = ReadLE<uint16_t>(data + pos);
+      const uint16_t type = ReadLE<uint16_t>(data + pos + 4);
+      const size_t name_size = ReadLE<uint16_t>(data + pos + 6) + 1;
+      pos += kDirectoryEntryHeaderSize;
+      TEST_AND_RETURN_FALSE(size - pos >= name_size);
+      string name(reinterpret_cast<const char*>(data + pos), name_size);
+      pos += name_size;
+      TEST_AND_RETURN_FALSE(name != "." && name != "..");
+      TEST_AND_RETURN_FALSE(name.find_first_of(string("/\0", 2)) ==
+                            string::npos);
+
+      // Directory entries only use the basic inode types.
+      if (type != kDirectoryInode && type != kRegularInode) {
+        continue;
+      }
+      Inode inode;
+      TEST_AND_RETURN_FALSE(
+          ReadInode(image, inode_block, inode_offset, &inode));
+      string entry_path = path.empty() ? name : path + "/" + name;
+      if (type == kDirectoryInode) {
+        TEST_AND_RETURN_FALSE(inode.IsDirectory());
+        subdirs->emplace_back(std::move(entry_path), inode);
+        continue;
+      }
+      TEST_AND_RETURN_FALSE(inode.IsRegular());
+      SquashfsFileMapEntry file;
+      file.name = std::move(entry_path);
+      file.start = inode.start;
+      file.block_sizes.resize(inode.block_count);
+      if (inode.block_count > 0) {
+        memcpy(file.block_sizes.data(),
+               inode.block_sizes,
+               inode.block_count * sizeof(uint32_t));
+      }
+      files->push_back(std::move(file));
+    }
+  }
+  return true;
+}
+
+// Walks the directory tree of an image with one task per directory.
+class TreeWalker {
+ public:
+  TreeWalker(const Image& image, TaskScheduler* scheduler)
+      : image_(image), group_(scheduler, false) {}
+
+  bool Walk(const Inode& root, vector<SquashfsFileMapEntry>* files) {
+    WalkDirectory(root, "", 0);
+    group_.Wait();
+    TEST_AND_RETURN_FALSE(!failed_);
+    *files = std::move(files_);
+    return true;
+  }
+
+ private:
+  void WalkDirectory(const Inode& dir, const string& path, size_t depth) {
+    if (failed_) {
+      return;
+    }
+    if (depth > kMaxDirectoryDepth) {
+      LOG(ERROR) << "Directory /" << path << " is nested too deep.";
+      failed_ = true;
+      return;
+    }
+    vector<SquashfsFileMapEntry> files;
+    vector<std::pair<string, Inode>> subdirs;
+    if (!ListDirectory(image_, dir, path, &files, &subdirs)) {
+      LOG(ERROR) << "Failed to list directory /" << path;
+      failed_ = true;
+      return;
+    }
+    for (auto& subdir : subdirs) {
+      const Inode inode = subdir.second;
+      group_.Submit(inode.listing_size,
+                    [this, inode, path = std::move(subdir.first), depth]() {
+                      WalkDirectory(inode, path, depth + 1);
+                    });
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::move(files.begin(), files.end(), std::back_inserter(files_));
+  }
+
+  const Image& image_;
+  TaskScheduler::TaskGroup group_;
+  std::atomic<bool> failed_{false};
+
+  std::mutex mutex_;
+  vector<SquashfsFileMapEntry> files_;
+
+  DISALLOW_COPY_AND_ASSIGN(TreeWalker);
+};
+
+// Finds the end of the directory table, where the next table starts. The order
+// of the tables after it differs between mksquashfs versions, so the end is
+// the closest start of any of them. Tables with an index start with the
+// metadata blocks the index points to, the index itself is at the offset in the
+// super block.
+bool FindDirectoryTableEnd(const string& sqfs_path,
+                           const SuperBlock& super_block,
+                           uint64_t* end) {
+  *end = super_block.bytes_used;
+  auto add_table = [&super_block, end](uint64_t start) {
+    if (start > super_block.directory_table_start && start < *end) {
+      *end = start;
+    }
+  };
+  auto add_indexed_table = [&sqfs_path, &super_block, &add_table](
+                               uint64_t index) {
+    if (index == kInvalidTable) {
+      return true;
+    }
+    TEST_AND_RETURN_FALSE(index <= super_block.bytes_used - sizeof(uint64_t));
+    add_table(index);
+    brillo::Blob first_entry;
+    TEST_AND_RETURN_FALSE(
+        utils::ReadFileChunk(sqfs_path, index, sizeof(uint64_t), &first_entry));
+    TEST_AND_RETURN_FALSE(first_entry.size() == sizeof(uint64_t));
+    add_table(ReadLE<uint64_t>(first_entry.data()));
+    return true;
+  };
+
+  TEST_AND_RETURN_FALSE(add_indexed_table(super_block.id_table_start));
+  if (super_block.fragment_count > 0) {
+    TEST_AND_RETURN_FALSE(add_indexed_table(super_block.fragment_table_start));
+  } else {
+    add_table(super_block.fragment_table_start);
+  }
+  TEST_AND_RETURN_FALSE(add_indexed_table(super_block.export_table_start));
+  // The xattr id table starts with the offset of the xattr table instead.
+  TEST_AND_RETURN_FALSE(add_indexed_table(super_block.xattr_id_table_start));
+  TEST_AND_RETURN_FALSE(*end > super_block.directory_table_start);
+  return true;
+}
+
+}  // namespace
+
+bool ReadSquashfsFileMap(const string& sqfs_path,
+                         vector<SquashfsFileMapEntry>* entries) {
+  brillo::Blob blob;
+  SuperBlock super_block;
+  TEST_AND_RETURN_FALSE(
+      utils::ReadFileChunk(sqfs_path, 0, kSuperBlockSize, &blob));
+  TEST_AND_RETURN_FALSE(ParseSuperBlock(blob, &super_block));
+  if (!IsSupportedCompression(super_block.compression_type)) {
+    LOG(INFO) << "Squashfs compression type " << super_block.compression_type
+              << " of " << sqfs_path << " isn't supported.";
+    return false;
+  }
+  const off_t image_size = utils::FileSize(sqfs_path);
+  TEST_AND_RETURN_FALSE(super_block.bytes_used >= kSuperBlockSize &&
+                        image_size >= 0 &&
+                        super_block.bytes_used <=
+                            static_cast<uint64_t>(image_size));
+  TEST_AND_RETURN_FALSE(super_block.inode_table_start <
+                        super_block.directory_table_start);
+
+  // The inode and directory tables follow each other, read both at once.
+  uint64_t tables_end;
+  TEST_AND_RETURN_FALSE(
+      FindDirectoryTableEnd(sqfs_path, super_block, &tables_end));
+  const uint64_t tables_size = tables_end - super_block.inode_table_start;
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+      sqfs_path, super_block.inode_table_start, tables_size, &blob));
+  TEST_AND_RETURN_FALSE(blob.size() == tables_size);
+  const size_t inode_table_size =
+      super_block.directory_table_start - super_block.inode_table_start;
+
+  // Use the threads shared by all partitions when called from
+  // GenerateUpdatePayloadFile().
+  std::unique_ptr<TaskScheduler> own_scheduler;
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler == nullptr) {
+    own_scheduler =
+        std::make_unique<TaskScheduler>(diff_utils::GetMaxThreads());
+    scheduler = own_scheduler.get();
+  }
+
+  Image image;
+  image.block_size = super_block.block_size;
+  TEST_AND_RETURN_FALSE(image.inodes.Init(blob.data(),
+                                          inode_table_size,
+                                          super_block.compression_type,
+                                          scheduler));
+  TEST_AND_RETURN_FALSE(
+      image.directories.Init(blob.data() + inode_table_size,
+                             blob.size() - inode_table_size,
+                             super_block.compression_type,
+                             scheduler));
+  // The tables are decompressed, the compressed copy isn't needed anymore.
+  brillo::Blob().swap(blob);
+
+  // Inode references are the offset of the metadata block in the inode table
+  // shifted by 16 bits, plus the offset in the decompressed block.
+  Inode root;
+  TEST_AND_RETURN_FALSE(ReadInode(image,
+                                  super_block.root_inode >> 16,
+                                  super_block.root_inode & 0xffff,
+                                  &root));
+  TEST_AND_RETURN_FALSE(root.IsDirectory());
+
+  TreeWalker walker(image, scheduler);
+  TEST_AND_RETURN_FALSE(walker.Walk(root, entries));
+  // Directories are walked in parallel, sort to keep the result stable.
+  std::sort(entries->begin(),
+            entries->end(),
+            [](const SquashfsFileMapEntry& a, const SquashfsFileMapEntry& b) {
+              return a.name < b.name;
+            });
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,50 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_SQUASHFS_READER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_SQUASHFS_READER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace chromeos_update_engine {
+
+// A regular file of a squashfs image and where its data blocks are, the same
+// information a line of the `unsquashfs -m` file map has.
+struct SquashfsFileMapEntry {
+  // The path of the file inside the image, without a leading slash.
+  std::string name;
+  // The byte offset of the first data block of the file in the image.
+  uint64_t start{0};
+  // The size of every data block of the file in the image. The tail of the
+  // file packed in a fragment isn't included. Bit 24 is set if the block is
+  // stored uncompressed.
+  std::vector<uint32_t> block_sizes;
+};
+
+// Lists the regular files of the squashfs image at |sqfs_path| by walking its
+// inode and directory tables in-process, without running unsquashfs. The
+// metadata is decompressed and the directory tree walked on the threads of
+// the current TaskScheduler, or on threads of its own when not called from a
+// task. Supports the zlib, xz, lz4 and zstd compressors and returns false for
+// the others or if the image is corrupted.
+bool ReadSquashfsFileMap(const std::string& sqfs_path,
+                         std::vector<SquashfsFileMapEntry>* entries);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_SQUASHFS_READER_H_
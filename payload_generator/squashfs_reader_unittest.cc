@@ -0,0 +1,207 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/squashfs_reader.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kTestSqfsBlockSize = 4096;
+constexpr uint32_t kUncompressedBlock = 1 << 24;
+constexpr uint64_t kNoTable = ~0ULL;
+
+class ImageWriter {
+ public:
+  template <typename T>
+  void Put(T value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    image_.insert(image_.end(), bytes, bytes + sizeof(value));
+  }
+  void Put(const string& str) {
+    image_.insert(image_.end(), str.begin(), str.end());
+  }
+  template <typename T>
+  void PutAt(size_t offset, T value) {
+    memcpy(image_.data() + offset, &value, sizeof(value));
+  }
+  void Skip(size_t size) { image_.resize(image_.size() + size); }
+
+  // Starts an uncompressed metadata block of |size| bytes.
+  void StartMetadataBlock(uint16_t size) { Put<uint16_t>(size | (1 << 15)); }
+
+  void PutInodeHeader(uint16_t type) {
+    Put<uint16_t>(type);
+    Skip(14);
+  }
+
+  size_t size() const { return image_.size(); }
+  const brillo::Blob& image() const { return image_; }
+
+ private:
+  brillo::Blob image_;
+};
+
+// Creates an image with the files "file1", whose two blocks are in the image,
+// and "dir/file2", whose tail is in a fragment and uses a long inode.
+brillo::Blob CreateTestImage() {
+  ImageWriter writer;
+  writer.Skip(96);
+  // The data of the files, the reader doesn't look at it.
+  writer.Skip(100 + 4096 + 4096);
+
+  const size_t inode_table_start = writer.size();
+  writer.StartMetadataBlock(164);
+  // file1 at offset 0.
+  writer.PutInodeHeader(2);
+  writer.Put<uint32_t>(96);   // start
+  writer.Put<uint32_t>(~0U);  // fragment
+  writer.Put<uint32_t>(0);    // offset in the fragment
+  writer.Put<uint32_t>(2 * kTestSqfsBlockSize);
+  writer.Put<uint32_t>(100);
+  writer.Put<uint32_t>(kTestSqfsBlockSize | kUncompressedBlock);
+  // dir/file2 at offset 40.
+  writer.PutInodeHeader(9);
+  writer.Put<uint64_t>(96 + 100 + 4096);  // start
+  writer.Put<uint64_t>(kTestSqfsBlockSize + 10);
+  writer.Put<uint64_t>(0);    // sparse
+  writer.Put<uint32_t>(1);    // nlink
+  writer.Put<uint32_t>(0);    // fragment
+  writer.Put<uint32_t>(0);    // offset in the fragment
+  writer.Put<uint32_t>(~0U);  // xattr
+  writer.Put<uint32_t>(kTestSqfsBlockSize | kUncompressedBlock);
+  // dir at offset 100, its listing is at offset 0 and 25 bytes long.
+  writer.PutInodeHeader(1);
+  writer.Put<uint32_t>(0);  // listing block
+  writer.Put<uint32_t>(2);  // nlink
+  writer.Put<uint16_t>(25 + 3);
+  writer.Put<uint16_t>(0);  // listing offset
+  writer.Put<uint32_t>(0);  // parent
+  // The root at offset 132, its listing is at offset 25 and 36 bytes long.
+  writer.PutInodeHeader(1);
+  writer.Put<uint32_t>(0);
+  writer.Put<uint32_t>(3);
+  writer.Put<uint16_t>(36 + 3);
+  writer.Put<uint16_t>(25);
+  writer.Put<uint32_t>(0);
+
+  const size_t directory_table_start = writer.size();
+  writer.StartMetadataBlock(61);
+  // The listing of dir.
+  writer.Put<uint32_t>(0);  // count - 1
+  writer.Put<uint32_t>(0);  // inode block
+  writer.Put<uint32_t>(1);  // inode number
+  writer.Put<uint16_t>(40);
+  writer.Put<int16_t>(0);
+  writer.Put<uint16_t>(2);
+  writer.Put<uint16_t>(4);
+  writer.Put(string("file2"));
+  // The listing of the root.
+  writer.Put<uint32_t>(1);
+  writer.Put<uint32_t>(0);
+  writer.Put<uint32_t>(1);
+  writer.Put<uint16_t>(100);
+  writer.Put<int16_t>(0);
+  writer.Put<uint16_t>(1);
+  writer.Put<uint16_t>(2);
+  writer.Put(string("dir"));
+  writer.Put<uint16_t>(0);
+  writer.Put<int16_t>(0);
+  writer.Put<uint16_t>(2);
+  writer.Put<uint16_t>(4);
+  writer.Put(string("file1"));
+
+  const size_t id_table = writer.size();
+  writer.StartMetadataBlock(4);
+  writer.Put<uint32_t>(0);
+  const size_t id_table_start = writer.size();
+  writer.Put<uint64_t>(id_table);
+
+  writer.PutAt<uint32_t>(0, 0x73717368);
+  writer.PutAt<uint32_t>(12, kTestSqfsBlockSize);
+  writer.PutAt<uint16_t>(20, 1);  // zlib
+  writer.PutAt<uint16_t>(28, 4);
+  writer.PutAt<uint64_t>(32, 132);  // root inode
+  writer.PutAt<uint64_t>(40, writer.size());
+  writer.PutAt<uint64_t>(48, id_table_start);
+  writer.PutAt<uint64_t>(56, kNoTable);
+  writer.PutAt<uint64_t>(64, inode_table_start);
+  writer.PutAt<uint64_t>(72, directory_table_start);
+  writer.PutAt<uint64_t>(80, kNoTable);
+  writer.PutAt<uint64_t>(88, kNoTable);
+  return writer.image();
+}
+
+}  // namespace
+
+class SquashfsReaderTest : public ::testing::Test {
+ protected:
+  bool ReadFileMap(const brillo::Blob& image,
+                   vector<SquashfsFileMapEntry>* entries) {
+    EXPECT_TRUE(utils::WriteFile(image_file_.path().c_str(),
+                                 image.data(),
+                                 image.size()));
+    return ReadSquashfsFileMap(image_file_.path(), entries);
+  }
+
+  ScopedTempFile image_file_{"squashfs_reader_unittest.XXXXXX"};
+};
+
+TEST_F(SquashfsReaderTest, ReadFileMapTest) {
+  vector<SquashfsFileMapEntry> entries;
+  ASSERT_TRUE(ReadFileMap(CreateTestImage(), &entries));
+  ASSERT_EQ(2u, entries.size());
+  EXPECT_EQ("dir/file2", entries[0].name);
+  EXPECT_EQ(96u + 100 + 4096, entries[0].start);
+  EXPECT_EQ(vector<uint32_t>({kTestSqfsBlockSize | kUncompressedBlock}),
+            entries[0].block_sizes);
+  EXPECT_EQ("file1", entries[1].name);
+  EXPECT_EQ(96u, entries[1].start);
+  EXPECT_EQ(vector<uint32_t>({100, kTestSqfsBlockSize | kUncompressedBlock}),
+            entries[1].block_sizes);
+}
+
+TEST_F(SquashfsReaderTest, TruncatedListingTest) {
+  brillo::Blob image = CreateTestImage();
+  // Make the root listing longer than the directory table.
+  const size_t root_inode = 96 + 100 + 4096 + 4096 + 2 + 132;
+  image[root_inode + 24] = 100;
+  vector<SquashfsFileMapEntry> entries;
+  EXPECT_FALSE(ReadFileMap(image, &entries));
+}
+
+TEST_F(SquashfsReaderTest, UnsupportedCompressionTest) {
+  brillo::Blob image = CreateTestImage();
+  image[20] = 3;  // lzo
+  vector<SquashfsFileMapEntry> entries;
+  EXPECT_FALSE(ReadFileMap(image, &entries));
+}
+
+}  // namespace chromeos_update_engine
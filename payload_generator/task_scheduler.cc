@@ -0,0 +1,137 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/task_scheduler.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+thread_local TaskScheduler* current_scheduler = nullptr;
+}  // namespace
+
+TaskScheduler::TaskGroup::TaskGroup(TaskScheduler* scheduler, bool tasks_wait)
+    : scheduler_(scheduler), tasks_wait_(tasks_wait) {
+  CHECK(scheduler_);
+}
+
+TaskScheduler::TaskGroup::~TaskGroup() {
+  Wait();
+}
+
+void TaskScheduler::TaskGroup::Submit(uint64_t weight,
+                                      uint64_t memory,
+                                      std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(scheduler_->mutex_);
+    pending_++;
+    scheduler_->queue_.emplace(TaskKey{weight, scheduler_->next_sequence_++},
+                               Task{this, memory, std::move(task)});
+  }
+  // Threads waiting for a group may be able to run it too.
+  scheduler_->cv_.notify_all();
+}
+
+void TaskScheduler::TaskGroup::Wait() {
+  std::unique_lock<std::mutex> lock(scheduler_->mutex_);
+  const bool helps = Current() == scheduler_;
+  while (pending_ > 0) {
+    if (!helps) {
+      scheduler_->cv_.wait(lock);
+    } else if (!scheduler_->RunNextTask(&lock, this)) {
+      scheduler_->idle_threads_++;
+      scheduler_->cv_.wait(lock);
+      scheduler_->idle_threads_--;
+    }
+  }
+}
+
+TaskScheduler::TaskScheduler(size_t num_threads, uint64_t memory_budget)
+    : memory_budget_(memory_budget) {
+  num_threads = std::max<size_t>(num_threads, 1);
+  workers_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; i++) {
+    workers_.emplace_back(&TaskScheduler::WorkerLoop, this);
+  }
+}
+
+TaskScheduler::~TaskScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CHECK(queue_.empty());
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+TaskScheduler* TaskScheduler::Current() {
+  return current_scheduler;
+}
+
+size_t TaskScheduler::IdleThreads() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return idle_threads_;
+}
+
+void TaskScheduler::WorkerLoop() {
+  current_scheduler = this;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    if (!RunNextTask(&lock, nullptr)) {
+      idle_threads_++;
+      cv_.wait(lock);
+      idle_threads_--;
+    }
+  }
+}
+
+bool TaskScheduler::RunNextTask(std::unique_lock<std::mutex>* lock,
+                                const TaskGroup* waiting_for) {
+  auto it = std::find_if(
+      queue_.begin(), queue_.end(), [this, waiting_for](const auto& entry) {
+        const Task& task = entry.second;
+        if (waiting_for != nullptr && task.group != waiting_for &&
+            task.group->tasks_wait_) {
+          return false;
+        }
+        return memory_budget_ == 0 || task.memory == 0 ||
+               memory_in_use_ == 0 ||
+               memory_in_use_ + task.memory <= memory_budget_;
+      });
+  if (it == queue_.end()) {
+    return false;
+  }
+  Task task = std::move(it->second);
+  queue_.erase(it);
+  memory_in_use_ += task.memory;
+  lock->unlock();
+  task.run();
+  // Release whatever the task holds before taking the lock again.
+  task.run = nullptr;
+  lock->lock();
+  memory_in_use_ -= task.memory;
+  task.group->pending_--;
+  cv_.notify_all();
+  return true;
+}
+
+}  // namespace chromeos_update_engine
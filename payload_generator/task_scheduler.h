@@ -0,0 +1,141 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_TASK_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_TASK_SCHEDULER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// Runs the tasks of all partitions of a payload on a fixed number of threads.
+// Queued tasks are run heaviest first across all groups, so the largest files
+// of every partition start early instead of each partition balancing its own
+// files. A task running on the scheduler may submit tasks and wait for them,
+// meanwhile its thread runs queued tasks instead of sitting idle, so there are
+// never more than |num_threads| tasks running.
+//
+// Tasks may declare the memory they need at most. With a memory budget, a
+// queued task only starts if it fits next to the running ones, lighter tasks
+// behind it start meanwhile. A task is always started when no memory is in
+// use, so tasks larger than the budget still run, just on their own.
+class TaskScheduler {
+ public:
+  // Tasks submitted and waited for together.
+  class TaskGroup {
+   public:
+    // With |tasks_wait|, tasks of this group wait for other groups. Threads
+    // waiting for a group never pick up such tasks, so waits don't nest.
+    TaskGroup(TaskScheduler* scheduler, bool tasks_wait);
+    // Waits for the tasks still pending.
+    ~TaskGroup();
+
+    // Queues |task| with a priority of |weight|, heavier tasks run first.
+    void Submit(uint64_t weight, std::function<void()> task) {
+      Submit(weight, 0, std::move(task));
+    }
+    // Same, for a task that uses up to |memory| bytes while running. Tasks
+    // waiting for other groups keep their memory meanwhile, so tasks of groups
+    // whose tasks don't wait shouldn't use any.
+    void Submit(uint64_t weight, uint64_t memory, std::function<void()> task);
+
+    // Returns once all tasks submitted so far are done. Called on a thread of
+    // the scheduler, runs queued tasks of this group, or of groups whose tasks
+    // don't wait, in the meantime.
+    void Wait();
+
+   private:
+    friend class TaskScheduler;
+
+    TaskScheduler* scheduler_;
+    const bool tasks_wait_;
+    // Tasks queued or running, guarded by the scheduler's mutex.
+    size_t pending_{0};
+
+    DISALLOW_COPY_AND_ASSIGN(TaskGroup);
+  };
+
+  // Runs tasks on |num_threads| threads. When |memory_budget| is non-zero,
+  // running tasks use at most that many bytes together, see Submit().
+  explicit TaskScheduler(size_t num_threads, uint64_t memory_budget = 0);
+  // Must only be destroyed once all groups are done.
+  ~TaskScheduler();
+
+  size_t num_threads() const { return workers_.size(); }
+  uint64_t memory_budget() const { return memory_budget_; }
+
+  // Returns how many threads of the scheduler have nothing to run at the
+  // moment, which would pick up tasks of groups whose tasks don't wait right
+  // away.
+  size_t IdleThreads();
+
+  // Returns the scheduler the calling thread belongs to, or nullptr when not
+  // called from a task.
+  static TaskScheduler* Current();
+
+ private:
+  // Orders queued tasks by decreasing weight, then by submission order.
+  struct TaskKey {
+    uint64_t weight;
+    uint64_t sequence;
+    bool operator<(const TaskKey& other) const {
+      return weight != other.weight ? weight > other.weight
+                                    : sequence < other.sequence;
+    }
+  };
+  struct Task {
+    TaskGroup* group;
+    uint64_t memory;
+    std::function<void()> run;
+  };
+
+  void WorkerLoop();
+
+  // Runs the first queued task |waiting_for| may run, any task if null, that
+  // fits the memory budget. Returns false if there is none. Must be called
+  // with |lock| held, which is released while the task runs.
+  bool RunNextTask(std::unique_lock<std::mutex>* lock,
+                   const TaskGroup* waiting_for);
+
+  std::mutex mutex_;
+  // Signalled when a task is queued or done, or |stopping_| is set.
+  std::condition_variable cv_;
+  std::map<TaskKey, Task> queue_;
+  uint64_t next_sequence_{0};
+  const uint64_t memory_budget_;
+  // Sum of |memory| of the running tasks.
+  uint64_t memory_in_use_{0};
+  // Threads waiting for a task to be queued or done.
+  size_t idle_threads_{0};
+  bool stopping_{false};
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_TASK_SCHEDULER_H_
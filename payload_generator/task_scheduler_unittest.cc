@@ -0,0 +1,152 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/task_scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(TaskSchedulerTest, RunsAllTasks) {
+  TaskScheduler scheduler(4);
+  std::atomic<int> count{0};
+  TaskScheduler::TaskGroup group(&scheduler, false);
+  for (int i = 0; i < 100; i++) {
+    group.Submit(i, [&count]() { count++; });
+  }
+  group.Wait();
+  ASSERT_EQ(100, count);
+}
+
+TEST(TaskSchedulerTest, RunsHeaviestFirst) {
+  TaskScheduler scheduler(1);
+  std::mutex mutex;
+  std::vector<int> order;
+  TaskScheduler::TaskGroup group(&scheduler, false);
+  std::atomic<bool> release{false};
+  // Keeps the only thread busy until all tasks are queued.
+  group.Submit(0, [&release]() {
+    while (!release) {
+      std::this_thread::yield();
+    }
+  });
+  for (int weight : {1, 5, 3, 5}) {
+    group.Submit(weight, [&mutex, &order, weight]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(weight);
+    });
+  }
+  release = true;
+  group.Wait();
+  ASSERT_EQ(std::vector<int>({5, 5, 3, 1}), order);
+}
+
+TEST(TaskSchedulerTest, NestedGroupsDontExceedThreads) {
+  // Every outer task waits for inner tasks, with fewer threads than outer
+  // tasks that only completes if waiting threads run the inner tasks.
+  TaskScheduler scheduler(2);
+  std::atomic<int> running{0};
+  std::atomic<int> max_running{0};
+  std::atomic<int> inner_done{0};
+  auto track = [&running, &max_running]() {
+    const int now = ++running;
+    int max = max_running;
+    while (now > max && !max_running.compare_exchange_weak(max, now)) {
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    running--;
+  };
+  TaskScheduler::TaskGroup outer(&scheduler, true);
+  for (int i = 0; i < 4; i++) {
+    outer.Submit(10, [&scheduler, &inner_done, track]() {
+      ASSERT_EQ(&scheduler, TaskScheduler::Current());
+      TaskScheduler::TaskGroup inner(&scheduler, false);
+      for (int j = 0; j < 8; j++) {
+        inner.Submit(j, [&inner_done, track]() {
+          track();
+          inner_done++;
+        });
+      }
+      inner.Wait();
+    });
+  }
+  outer.Wait();
+  ASSERT_EQ(32, inner_done);
+  ASSERT_LE(max_running, 2);
+  ASSERT_EQ(nullptr, TaskScheduler::Current());
+}
+
+TEST(TaskSchedulerTest, MemoryBudgetLimitsRunningTasks) {
+  TaskScheduler scheduler(4, 100);
+  std::mutex mutex;
+  uint64_t in_use = 0;
+  uint64_t max_in_use = 0;
+  std::atomic<int> done{0};
+  auto track = [&](uint64_t memory) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      in_use += memory;
+      max_in_use = std::max(max_in_use, in_use);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      in_use -= memory;
+    }
+    done++;
+  };
+  TaskScheduler::TaskGroup group(&scheduler, false);
+  // The large tasks can't run together, small ones fill the remaining budget.
+  for (uint64_t memory : {60, 60, 60, 10, 10, 10, 10, 10}) {
+    group.Submit(memory, memory, [&track, memory]() { track(memory); });
+  }
+  group.Wait();
+  ASSERT_EQ(8, done);
+  ASSERT_LE(max_in_use, 100u);
+}
+
+TEST(TaskSchedulerTest, TaskLargerThanBudgetRuns) {
+  TaskScheduler scheduler(2, 100);
+  bool ran = false;
+  TaskScheduler::TaskGroup group(&scheduler, false);
+  group.Submit(1, 1000, [&ran]() { ran = true; });
+  group.Wait();
+  ASSERT_TRUE(ran);
+}
+
+TEST(TaskSchedulerTest, CountsIdleThreads) {
+  TaskScheduler scheduler(3);
+  size_t idle = 0;
+  TaskScheduler::TaskGroup group(&scheduler, false);
+  group.Submit(1, [&scheduler, &idle]() {
+    // The other threads go idle once they find no task to run.
+    for (int i = 0; i < 1000 && idle != 2; i++) {
+      idle = scheduler.IdleThreads();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  group.Wait();
+  ASSERT_EQ(2u, idle);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,178 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/xor_matcher.h"
+
+#include <lz4.h>
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include <base/logging.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The chunks of the old data are indexed every |kIndexStride| bytes, so
+// looking up the chunks at |kIndexStride| consecutive offsets of a block finds
+// any old data sharing a chunk there whatever its alignment.
+constexpr size_t kChunkSize = 16;
+constexpr size_t kIndexStride = 64;
+// The number of places of a block probed for chunks, spread over the block so
+// some of them likely fall in data it shares with the old one.
+constexpr size_t kProbes = 4;
+// The most candidates compared with each block.
+constexpr size_t kMaxCandidates = 16;
+// Blocks with fewer bytes in common with their best candidate aren't worth
+// compressing XORed, as a fraction of the block size.
+constexpr size_t kMinEqualFraction = 8;
+
+uint64_t HashChunk(const uint8_t* data) {
+  uint64_t hash = 0;
+  for (size_t i = 0; i < kChunkSize; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15;
+  }
+  return hash;
+}
+
+// Chunks of a single byte, like zeros, are everywhere and match anything.
+bool IsUniformChunk(const uint8_t* data) {
+  return memcmp(data, data + 1, kChunkSize - 1) == 0;
+}
+
+size_t CompressedSize(const uint8_t* data, size_t size, vector<char>* buffer) {
+  buffer->resize(LZ4_compressBound(size));
+  const int compressed =
+      LZ4_compress_default(reinterpret_cast<const char*>(data),
+                           buffer->data(),
+                           size,
+                           buffer->size());
+  return compressed > 0 ? compressed : size;
+}
+}  // namespace
+
+size_t CountEqualBytes(const uint8_t* a, const uint8_t* b, size_t size) {
+  constexpr uint64_t kLowBits = 0x7F7F7F7F7F7F7F7F;
+  size_t equal = 0;
+  size_t i = 0;
+  // Eight bytes at a time: the high bit of each byte of |zero| is set when the
+  // byte of |diff| is zero.
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t a_word, b_word;
+    memcpy(&a_word, a + i, sizeof(a_word));
+    memcpy(&b_word, b + i, sizeof(b_word));
+    const uint64_t diff = a_word ^ b_word;
+    const uint64_t zero = ~(((diff & kLowBits) + kLowBits) | diff | kLowBits);
+    equal += __builtin_popcountll(zero);
+  }
+  for (; i < size; i++) {
+    equal += a[i] == b[i];
+  }
+  return equal;
+}
+
+vector<int64_t> FindXorMatches(const brillo::Blob& old_data,
+                               const brillo::Blob& new_data,
+                               size_t block_size,
+                               const vector<int64_t>& hints,
+                               const std::function<bool(uint64_t)>& usable) {
+  CHECK_GE(block_size, kProbes * (kIndexStride + kChunkSize));
+  const size_t num_blocks = new_data.size() / block_size;
+  vector<int64_t> matches(num_blocks, kNoXorMatch);
+  if (old_data.size() < block_size) {
+    return matches;
+  }
+
+  std::unordered_map<uint64_t, uint64_t> index;
+  index.reserve(old_data.size() / kIndexStride);
+  for (size_t offset = 0; offset + kChunkSize <= old_data.size();
+       offset += kIndexStride) {
+    if (!IsUniformChunk(old_data.data() + offset)) {
+      index.emplace(HashChunk(old_data.data() + offset), offset);
+    }
+  }
+
+  const uint64_t max_offset = old_data.size() - block_size;
+  vector<uint64_t> candidates;
+  vector<uint8_t> xored(block_size);
+  vector<char> buffer;
+  int64_t previous_match = kNoXorMatch;
+  for (size_t i = 0; i < num_blocks; i++) {
+    const uint8_t* block = new_data.data() + i * block_size;
+    candidates.clear();
+    const auto add_candidate = [&](int64_t offset) {
+      if (offset >= 0 && static_cast<uint64_t>(offset) <= max_offset &&
+          candidates.size() < kMaxCandidates &&
+          std::find(candidates.begin(), candidates.end(), offset) ==
+              candidates.end() &&
+          usable(offset)) {
+        candidates.push_back(offset);
+      }
+    };
+    if (i < hints.size()) {
+      add_candidate(hints[i]);
+    }
+    if (previous_match != kNoXorMatch) {
+      add_candidate(previous_match + block_size);
+    }
+    for (size_t start = 0; start < block_size; start += block_size / kProbes) {
+      for (size_t pos = start;
+           pos < start + kIndexStride && pos + kChunkSize <= block_size;
+           pos++) {
+        if (IsUniformChunk(block + pos)) {
+          continue;
+        }
+        const auto it = index.find(HashChunk(block + pos));
+        if (it != index.end() && it->second >= pos) {
+          add_candidate(it->second - pos);
+        }
+      }
+    }
+
+    size_t best_equal = 0;
+    int64_t best_offset = kNoXorMatch;
+    for (uint64_t offset : candidates) {
+      const size_t equal =
+          CountEqualBytes(block, old_data.data() + offset, block_size);
+      if (equal > best_equal) {
+        best_equal = equal;
+        best_offset = offset;
+      }
+    }
+    previous_match = kNoXorMatch;
+    if (best_offset == kNoXorMatch ||
+        best_equal < block_size / kMinEqualFraction) {
+      continue;
+    }
+    const uint8_t* old_block = old_data.data() + best_offset;
+    for (size_t j = 0; j < block_size; j++) {
+      xored[j] = block[j] ^ old_block[j];
+    }
+    if (CompressedSize(xored.data(), block_size, &buffer) <
+        CompressedSize(block, block_size, &buffer)) {
+      matches[i] = best_offset;
+      previous_match = best_offset;
+    }
+  }
+  return matches;
+}
+
+}  // namespace chromeos_update_engine
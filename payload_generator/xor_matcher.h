@@ -0,0 +1,52 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_XOR_MATCHER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_XOR_MATCHER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// The match of a block which is better stored as is than XORed.
+constexpr int64_t kNoXorMatch = -1;
+
+// Returns the number of equal bytes at the same offsets of |a| and |b|.
+size_t CountEqualBytes(const uint8_t* a, const uint8_t* b, size_t size);
+
+// Returns for each block of |block_size| bytes of |new_data| the offset of the
+// bytes of |old_data| it compresses the best XORed with, or kNoXorMatch when
+// the block compresses better on its own. The candidates of a block are
+// |hints| for that block, the bytes following the match of the previous block
+// and the offsets of |old_data| sharing short chunks with the block, found
+// through a hash index of |old_data|. The candidate with the most bytes in
+// common with the block is then compressed XORed with it to check it beats the
+// block itself. Offsets |usable| returns false for are never returned.
+std::vector<int64_t> FindXorMatches(
+    const brillo::Blob& old_data,
+    const brillo::Blob& new_data,
+    size_t block_size,
+    const std::vector<int64_t>& hints,
+    const std::function<bool(uint64_t)>& usable);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_XOR_MATCHER_H_
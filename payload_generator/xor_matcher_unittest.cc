@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/xor_matcher.h"
+
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/delta_diff_generator.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class XorMatcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_data_.resize(kBlocks * kBlockSize);
+    for (auto& byte : old_data_) {
+      byte = dis_(gen_);
+    }
+  }
+
+  // Returns |num_blocks| blocks of |old_data_| from |offset|, with one byte of
+  // every |every| bytes changed.
+  brillo::Blob ChangedData(size_t offset, size_t num_blocks, size_t every) {
+    brillo::Blob data(old_data_.begin() + offset,
+                      old_data_.begin() + offset + num_blocks * kBlockSize);
+    for (size_t i = 0; i < data.size(); i += every) {
+      data[i] ^= 1;
+    }
+    return data;
+  }
+
+  static constexpr size_t kBlocks = 8;
+  std::mt19937 gen_{1234};
+  std::uniform_int_distribution<uint16_t> dis_{0, 255};
+  brillo::Blob old_data_;
+  const std::function<bool(uint64_t)> all_usable_ = [](uint64_t) {
+    return true;
+  };
+};
+
+TEST_F(XorMatcherTest, CountEqualBytesTest) {
+  vector<uint8_t> a(21, 7);
+  vector<uint8_t> b = a;
+  EXPECT_EQ(21U, CountEqualBytes(a.data(), b.data(), a.size()));
+  // Differences in the words and in the remaining bytes.
+  b[0] = 0;
+  b[9] = 0x80;
+  b[15] = 8;
+  b[20] = 1;
+  EXPECT_EQ(17U, CountEqualBytes(a.data(), b.data(), a.size()));
+}
+
+TEST_F(XorMatcherTest, FindsUnalignedMatchesTest) {
+  const brillo::Blob new_data = ChangedData(100, 4, 50);
+  EXPECT_EQ((vector<int64_t>{100, 100 + kBlockSize, 100 + 2 * kBlockSize,
+                             100 + 3 * kBlockSize}),
+            FindXorMatches(old_data_, new_data, kBlockSize, {}, all_usable_));
+}
+
+TEST_F(XorMatcherTest, UsesHintsTest) {
+  // With a change every 8 bytes no chunk is shared, only the hint matches.
+  const brillo::Blob new_data = ChangedData(3 * kBlockSize + 10, 1, 8);
+  EXPECT_EQ((vector<int64_t>{kNoXorMatch}),
+            FindXorMatches(old_data_, new_data, kBlockSize, {}, all_usable_));
+  EXPECT_EQ((vector<int64_t>{3 * kBlockSize + 10}),
+            FindXorMatches(old_data_,
+                           new_data,
+                           kBlockSize,
+                           {3 * kBlockSize + 10},
+                           all_usable_));
+}
+
+TEST_F(XorMatcherTest, SkipsUnusableAndUnrelatedBlocksTest) {
+  brillo::Blob new_data(2 * kBlockSize);
+  for (auto& byte : new_data) {
+    byte = dis_(gen_);
+  }
+  EXPECT_EQ((vector<int64_t>{kNoXorMatch, kNoXorMatch}),
+            FindXorMatches(old_data_, new_data, kBlockSize, {}, all_usable_));
+
+  new_data = ChangedData(100, 1, 50);
+  EXPECT_EQ((vector<int64_t>{kNoXorMatch}),
+            FindXorMatches(old_data_,
+                           new_data,
+                           kBlockSize,
+                           {},
+                           [](uint64_t offset) { return offset != 100; }));
+}
+
+}  // namespace chromeos_update_engine
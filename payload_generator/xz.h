@@ -29,6 +29,15 @@ void XzCompressInit();
 // will be the equivalent of running xz -9 --check=none
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out);
 
+// Same as XzCompress(), but every |stream_size| bytes of |in| are compressed
+// into an xz stream of their own, concatenated in |out|. The index of each
+// stream tells where it starts, so XzExtentWriter decodes them in parallel.
+// A |stream_size| of 0 produces a single stream. When called from a
+// TaskScheduler task, the streams are compressed concurrently on its threads.
+bool XzCompressStreams(const brillo::Blob& in,
+                       size_t stream_size,
+                       brillo::Blob* out);
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_XZ_H_
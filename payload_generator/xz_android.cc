@@ -17,12 +17,16 @@
 #include "update_engine/payload_generator/xz.h"
 
 #include <algorithm>
+#include <atomic>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <7zCrc.h>
 #include <Xz.h>
 #include <XzEnc.h>
 
+#include "update_engine/payload_generator/task_scheduler.h"
+
 namespace {
 
 bool xz_initialized = false;
@@ -114,4 +118,41 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   return res == SZ_OK;
 }
 
+bool XzCompressStreams(const brillo::Blob& in,
+                       size_t stream_size,
+                       brillo::Blob* out) {
+  if (stream_size == 0 || in.size() <= stream_size)
+    return XzCompress(in, out);
+  out->clear();
+  const size_t num_streams = (in.size() + stream_size - 1) / stream_size;
+  std::vector<brillo::Blob> streams(num_streams);
+  std::atomic<bool> failed{false};
+  auto compress_stream = [&](size_t index) {
+    const size_t offset = index * stream_size;
+    const size_t size = std::min(stream_size, in.size() - offset);
+    const brillo::Blob chunk(in.begin() + offset, in.begin() + offset + size);
+    if (!failed && !XzCompress(chunk, &streams[index]))
+      failed = true;
+  };
+  // The streams don't depend on each other, so they are compressed at once on
+  // the shared threads.
+  TaskScheduler* scheduler = TaskScheduler::Current();
+  if (scheduler != nullptr) {
+    TaskScheduler::TaskGroup group(scheduler, false);
+    for (size_t i = 0; i < num_streams; i++) {
+      group.Submit(stream_size,
+                   [&compress_stream, i]() { compress_stream(i); });
+    }
+    group.Wait();
+  } else {
+    for (size_t i = 0; i < num_streams && !failed; i++)
+      compress_stream(i);
+  }
+  if (failed)
+    return false;
+  for (const brillo::Blob& stream : streams)
+    out->insert(out->end(), stream.begin(), stream.end());
+  return true;
+}
+
 }  // namespace chromeos_update_engine
@@ -29,6 +29,7 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
 #include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/payload_generator/xz.h"
 
 using chromeos_update_engine::test_utils::kRandomString;
@@ -175,4 +176,29 @@ TYPED_TEST(ZipTest, CompressELFTest) {
   EXPECT_EQ(0, memcmp(in.data(), decompressed.data(), in.size()));
 }
 
+TEST(XzStreamsTest, CompressStreamsTest) {
+  brillo::Blob in(std::begin(kRandomString), std::end(kRandomString));
+  in.insert(in.end(), 3000, 'x');
+  brillo::Blob out;
+  EXPECT_TRUE(XzCompressStreams(in, 1024, &out));
+  brillo::Blob single_stream;
+  EXPECT_TRUE(XzCompress(in, &single_stream));
+  EXPECT_NE(single_stream, out);
+  brillo::Blob decompressed;
+  EXPECT_TRUE(DecompressWithWriter<XzExtentWriter>(out, &decompressed));
+  EXPECT_EQ(in, decompressed);
+
+  // Compressed concurrently, the streams are the same.
+  brillo::Blob concurrent_out;
+  {
+    TaskScheduler scheduler(4);
+    TaskScheduler::TaskGroup group(&scheduler, true);
+    group.Submit(1, [&]() {
+      EXPECT_TRUE(XzCompressStreams(in, 1024, &concurrent_out));
+    });
+    group.Wait();
+  }
+  EXPECT_EQ(out, concurrent_out);
+}
+
 }  // namespace chromeos_update_engine
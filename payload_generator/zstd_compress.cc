@@ -0,0 +1,42 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/zstd_compress.h"
+
+#include <zstd.h>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+// Uses a window of at most 8 MiB, the largest the client accepts.
+constexpr int kZstdCompressionLevel = 19;
+}  // namespace
+
+bool ZstdCompress(const brillo::Blob& in, brillo::Blob* out) {
+  out->resize(ZSTD_compressBound(in.size()));
+  const size_t size = ZSTD_compress(
+      out->data(), out->size(), in.data(), in.size(), kZstdCompressionLevel);
+  if (ZSTD_isError(size)) {
+    LOG(ERROR) << "ZSTD_compress failed: " << ZSTD_getErrorName(size);
+    return false;
+  }
+  out->resize(size);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
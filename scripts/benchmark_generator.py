@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2024 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""Benchmarks delta_generator on a fixed corpus of image pairs.
+
+The corpus is a JSON file listing the payloads to generate, each with the
+delta_generator arguments selecting its images, relative to the directory of
+the corpus:
+
+  {"cases": [{"name": "system-delta",
+              "args": ["--partition_names=system",
+                       "--old_partitions=old/system.img",
+                       "--new_partitions=new/system.img"]}]}
+
+Every case is generated --repeat times with each of the --max_threads values,
+one process per run so that the peak memory of each run is its own. The
+report lists, for every run, the wall and CPU time, the peak memory, the
+payload size and the time of every phase from delta_generator's
+--out_report_file, and the median of the runs of every case and thread count.
+"""
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def ReadMemInfo():
+  """Returns the total memory of the host in bytes, or None."""
+  try:
+    with open('/proc/meminfo') as fp:
+      for line in fp:
+        if line.startswith('MemTotal:'):
+          return int(line.split()[1]) * 1024
+  except OSError:
+    pass
+  return None
+
+
+def RunCase(delta_generator, case, corpus_dir, max_threads, work_dir):
+  """Generates the payload of |case| once and returns what it cost."""
+  payload = os.path.join(work_dir, 'payload.bin')
+  report_file = os.path.join(work_dir, 'report.json')
+  cmd = [delta_generator] + case['args'] + [
+      '--out_file=' + payload,
+      '--out_report_file=' + report_file,
+      '--max_threads=%d' % max_threads,
+  ]
+  start = time.monotonic()
+  with open(os.path.join(work_dir, 'delta_generator.log'), 'w') as log:
+    process = subprocess.Popen(cmd, cwd=corpus_dir, stdout=log,
+                               stderr=subprocess.STDOUT)
+    _, status, usage = os.wait4(process.pid, 0)
+  wall_seconds = time.monotonic() - start
+  if os.waitstatus_to_exitcode(status) != 0:
+    raise RuntimeError('%s failed, see %s' % (' '.join(cmd), log.name))
+
+  with open(report_file) as fp:
+    report = json.load(fp)
+  return {
+      'case': case['name'],
+      'max_threads': max_threads,
+      'wall_seconds': wall_seconds,
+      'user_seconds': usage.ru_utime,
+      'system_seconds': usage.ru_stime,
+      # Linux reports the maximum resident set size in KiB.
+      'peak_rss_bytes': usage.ru_maxrss * 1024,
+      'payload_size': os.path.getsize(payload),
+      'phases': {phase['name']: {'seconds': phase['seconds'],
+                                 'cpu_seconds': phase['cpu_seconds']}
+                 for phase in report.get('phases', [])},
+  }
+
+
+def Summarize(runs):
+  """Returns the median of every measure of |runs| by case and threads."""
+  groups = {}
+  for run in runs:
+    groups.setdefault((run['case'], run['max_threads']), []).append(run)
+  summary = []
+  for (case, max_threads), group in groups.items():
+    entry = {'case': case, 'max_threads': max_threads, 'runs': len(group)}
+    for key in ('wall_seconds', 'user_seconds', 'system_seconds',
+                'peak_rss_bytes', 'payload_size'):
+      entry[key] = statistics.median(run[key] for run in group)
+    phases = {}
+    for run in group:
+      for name, phase in run['phases'].items():
+        phases.setdefault(name, []).append(phase)
+    entry['phases'] = {
+        name: {key: statistics.median(phase[key] for phase in values)
+               for key in ('seconds', 'cpu_seconds')}
+        for name, values in sorted(phases.items())}
+    summary.append(entry)
+  return summary
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+  parser.add_argument('corpus', help='JSON file listing the payloads')
+  parser.add_argument('--delta_generator', default='delta_generator',
+                      help='path to the delta_generator binary')
+  parser.add_argument('--max_threads', default='0',
+                      help='comma separated --max_threads values to run, 0 '
+                      'for as many threads as CPUs')
+  parser.add_argument('--repeat', type=int, default=3,
+                      help='number of runs of every case and thread count')
+  parser.add_argument('--cases', default=None,
+                      help='comma separated names of the cases to run, all '
+                      'of them if not set')
+  parser.add_argument('--output', default=None,
+                      help='where to write the JSON report, stdout if not set')
+  args = parser.parse_args()
+
+  with open(args.corpus) as fp:
+    cases = json.load(fp)['cases']
+  if args.cases:
+    names = args.cases.split(',')
+    cases = [case for case in cases if case['name'] in names]
+  corpus_dir = os.path.dirname(os.path.abspath(args.corpus))
+  thread_counts = [int(value) for value in args.max_threads.split(',')]
+
+  runs = []
+  with tempfile.TemporaryDirectory() as work_dir:
+    for case in cases:
+      for max_threads in thread_counts:
+        for i in range(args.repeat):
+          print('Generating %s with --max_threads=%d (%d/%d)' %
+                (case['name'], max_threads, i + 1, args.repeat),
+                file=sys.stderr)
+          runs.append(RunCase(args.delta_generator, case, corpus_dir,
+                              max_threads, work_dir))
+
+  report = {
+      'host': {'cpus': os.cpu_count(), 'memory_bytes': ReadMemInfo()},
+      'summary': Summarize(runs),
+      'runs': runs,
+  }
+  output = json.dumps(report, indent=2)
+  if args.output:
+    with open(args.output, 'w') as fp:
+      fp.write(output)
+  else:
+    print(output)
+
+
+if __name__ == '__main__':
+  main()